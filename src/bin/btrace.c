@@ -0,0 +1,209 @@
+/*
+ * btrace -- decodes binary event traces.
+ *
+ * Copyright (c) 2026 Raphael Manfredi <Raphael_Manfredi@pobox.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/btrace.h"
+#include "lib/file.h"
+#include "lib/log.h"
+#include "lib/misc.h"
+#include "lib/progname.h"
+#include "lib/stringify.h"
+
+#include "lib/override.h"
+
+/**
+ * Known event definitions, indexed by event ID.
+ */
+static struct {
+	char name[BTRACE_NAMELEN + 1];
+	uint kinds;
+	bool defined;
+} events[BTRACE_EV_MAX + 1];
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-h] [-e event] tracefile\n"
+		"  -e : only show the named event\n"
+		"  -h : prints this help message\n"
+		, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Record event definition.
+ */
+static void
+define_event(const struct btrace_record *r)
+{
+	uint16 id = r->arg[0] & 0xffff;
+
+	events[id].kinds = (r->arg[0] >> 16) & 0xffff;
+	events[id].defined = TRUE;
+	memcpy(events[id].name, &r->arg[1], BTRACE_NAMELEN);
+	events[id].name[BTRACE_NAMELEN] = '\0';
+}
+
+/**
+ * Print an address argument, as packed by btrace_addr().
+ */
+static void
+print_addr(uint64 v)
+{
+	uint16 port = v & 0xffff;
+
+	if (v & ((uint64) 1 << 63)) {
+		printf("ipv6#%08x:%u", (uint) ((v >> 16) & 0xffffffffU), port);
+	} else {
+		uint32 ip = (v >> 16) & 0xffffffffU;
+
+		printf("%u.%u.%u.%u:%u",
+			ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff, port);
+	}
+}
+
+/**
+ * Print a trace record.
+ */
+static void
+print_record(const struct btrace_record *r)
+{
+	uint kinds = events[r->event].kinds;
+	uint i;
+
+	printf("%s.%06u %u.%u ",
+		uint64_to_string(r->stamp / 1000000), (uint) (r->stamp % 1000000),
+		r->stid, r->seq);
+
+	if (events[r->event].defined) {
+		printf("%s", events[r->event].name);
+	} else {
+		kinds = BTRACE_KINDS(BTRACE_A_HEX, BTRACE_A_HEX,
+			BTRACE_A_HEX, BTRACE_A_HEX);
+		printf("#%u", r->event);
+	}
+
+	for (i = 0; i < BTRACE_ARGS; i++) {
+		uint64 v = r->arg[i];
+
+		switch (btrace_kind(kinds, i)) {
+		case BTRACE_A_NONE:
+			continue;
+		case BTRACE_A_UINT:
+			printf(" %s", uint64_to_string(v));
+			break;
+		case BTRACE_A_INT:
+			printf(" %s", int64_to_string((int64) v));
+			break;
+		case BTRACE_A_ADDR:
+			putchar(' ');
+			print_addr(v);
+			break;
+		case BTRACE_A_HEX:
+		default:
+			printf(" 0x%08x%08x", (uint) (v >> 32), (uint) (v & 0xffffffffU));
+			break;
+		}
+	}
+
+	putchar('\n');
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	FILE *f;
+	struct btrace_header hd;
+	struct btrace_record r;
+	const char *only = NULL;
+	/* getopt() variables: */
+	extern int optind;
+	extern char *optarg;
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, "he:")) != EOF) {
+		switch (c) {
+		case 'e':			/* filter on event name */
+			only = optarg;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 1)
+		usage();
+
+	argv += optind;
+
+	f = file_fopen(argv[0], "rb");
+	if (NULL == f)
+		exit(EXIT_FAILURE);
+
+	if (1 != fread(&hd, sizeof hd, 1, f))
+		s_fatal_exit(EXIT_FAILURE, "cannot read trace header: %m");
+
+	if (0 != memcmp(hd.magic, BTRACE_MAGIC, sizeof hd.magic))
+		s_fatal_exit(EXIT_FAILURE, "%s is not a trace file", argv[0]);
+
+	if (hd.endian != BTRACE_ENDIAN)
+		s_fatal_exit(EXIT_FAILURE, "trace was made on a different endianness");
+
+	if (hd.recsize != sizeof r)
+		s_fatal_exit(EXIT_FAILURE, "unsupported record size %u", hd.recsize);
+
+	while (1 == fread(&r, sizeof r, 1, f)) {
+		if (BTRACE_EV_DEFINE == r.event) {
+			define_event(&r);
+			continue;
+		}
+
+		if (only != NULL && 0 != strcmp(only, events[r.event].name))
+			continue;
+
+		print_record(&r);
+	}
+
+	if (ferror(f))
+		s_fatal_exit(EXIT_FAILURE, "read() error: %m");
+
+	fclose(f);
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,897 @@
+/*
+ * loadgen -- synthetic Gnutella and DHT load generator.
+ *
+ * Copyright (c) 2026 Raphael Manfredi <Raphael_Manfredi@pobox.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The load generator connects a set of simulated leaves to an ultrapeer
+ * under test and sends a configurable mix of Gnutella pings and queries
+ * at a target rate, along with UDP pings and DHT PING / FIND_NODE requests.
+ *
+ * Each request carries a MUID encoding a sequence number, so that replies
+ * (pongs, query hits, DHT responses) can be matched to measure the latency
+ * and throughput of the node under test.  Statistics are reported every
+ * second and summarized at the end of the run.
+ *
+ * The node under test must accept connections from private addresses and,
+ * unless -L is used to spread leaves over 127.0.0.x source addresses,
+ * several connections from the same address.
+ */
+
+#include "common.h"
+
+#include "if/core/gnutella.h"
+#include "if/dht/kademlia.h"
+
+#include "lib/compat_poll.h"
+#include "lib/fd.h"
+#include "lib/host_addr.h"
+#include "lib/log.h"
+#include "lib/misc.h"
+#include "lib/parse.h"
+#include "lib/progname.h"
+#include "lib/random.h"
+#include "lib/str.h"
+#include "lib/stringify.h"
+#include "lib/tm.h"
+#include "lib/xmalloc.h"
+
+#include "lib/override.h"
+
+#define LG_LEAVES		10		/* Default amount of simulated leaves */
+#define LG_RATE			100		/* Default messages per second */
+#define LG_DURATION		30		/* Default run duration, in seconds */
+#define LG_TTL			1		/* Default TTL for queries */
+#define LG_WINDOW		65536	/* Outstanding requests we can match */
+#define LG_BUFSIZE		65536	/* Per-connection buffer size */
+#define LG_TIMEOUT		10000	/* Handshake timeout, in ms */
+#define LG_VENDOR		0x4c4f4144		/* 'LOAD' */
+
+enum lg_kind {
+	LG_PING = 0,		/* Gnutella ping over TCP */
+	LG_QUERY,			/* Gnutella query over TCP */
+	LG_UDP_PING,		/* Gnutella ping over UDP */
+	LG_DHT_PING,		/* DHT PING request */
+	LG_DHT_FIND,		/* DHT FIND_NODE request */
+
+	LG_KIND_COUNT
+};
+
+static const char *lg_kind_name[LG_KIND_COUNT] = {
+	"ping", "query", "udp-ping", "dht-ping", "dht-find",
+};
+
+/**
+ * Per-kind statistics.
+ */
+static struct lg_stats {
+	uint64 sent;			/* Requests sent */
+	uint64 replies;			/* Replies received */
+	uint64 answered;		/* Requests that got at least one reply */
+	uint64 dropped;			/* Requests not sent, buffers full */
+	double lat_sum;			/* Sum of first-reply latencies (ms) */
+	double lat_max;			/* Maximum first-reply latency (ms) */
+} lg_stats[LG_KIND_COUNT];
+
+/**
+ * Outstanding requests, indexed by sequence number modulo LG_WINDOW.
+ */
+static struct lg_request {
+	uint32 seq;				/* Sequence number of the request */
+	uint8 kind;				/* Request kind */
+	uint8 answered;			/* Whether we got a reply already */
+	tm_t sent;				/* Time at which the request was sent */
+} lg_requests[LG_WINDOW];
+
+/**
+ * A simulated leaf connection.
+ */
+struct lg_conn {
+	int fd;					/* Connected socket, -1 when closed */
+	size_t inlen;			/* Amount of data in input buffer */
+	size_t outlen;			/* Amount of data in output buffer */
+	char in[LG_BUFSIZE];	/* Input buffer */
+	char out[LG_BUFSIZE];	/* Output buffer */
+};
+
+static struct lg_conn *lg_conns;
+static uint lg_leaves = LG_LEAVES;
+static uint32 lg_seq;
+static uint64 lg_rx_msgs, lg_rx_bytes;
+static int lg_udp = -1;
+static socket_addr_t lg_target;
+static socklen_t lg_target_len;
+
+static const char *lg_words[] = {
+	"music", "video", "linux", "free", "live", "remix", "album", "mp3",
+	"ogg", "flac", "movie", "concert", "guitar", "piano", "jazz", "rock",
+	"classic", "demo", "lecture", "book", "podcast", "radio", "kernel",
+	"gnutella", "sample", "trailer", "documentary", "orchestra", "symphony",
+};
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hL] [-c leaves] [-d secs] [-m mix] [-r rate] [-t ttl]\n"
+		"       host:port\n"
+		"  -c : amount of simulated leaves (default %u)\n"
+		"  -d : duration of the run, in seconds (default %u)\n"
+		"  -h : prints this help message\n"
+		"  -m : mix of ping,query,udp-ping,dht-ping,dht-find weights\n"
+		"       (default \"10,80,10,0,0\")\n"
+		"  -r : target amount of messages per second (default %u)\n"
+		"  -t : TTL of queries (default %u)\n"
+		"  -L : spread leaves over 127.0.0.x source addresses\n"
+		, getprogname(), LG_LEAVES, LG_DURATION, LG_RATE, LG_TTL);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Allocate a new request of the given kind and generate its MUID.
+ *
+ * The MUID starts with the sequence number (little-endian) and the kind,
+ * the remaining bytes are random.
+ */
+static void
+lg_request_new(enum lg_kind kind, guid_t *muid)
+{
+	uint32 seq = lg_seq++;
+	struct lg_request *r = &lg_requests[seq % LG_WINDOW];
+
+	random_bytes(muid->v, sizeof muid->v);
+	poke_le32(&muid->v[0], seq);
+	muid->v[4] = kind;
+	muid->v[8] = 0xff;			/* Modern servent marker */
+	muid->v[15] = 0x00;
+
+	r->seq = seq;
+	r->kind = kind;
+	r->answered = FALSE;
+	tm_now_exact(&r->sent);
+	lg_stats[kind].sent++;
+}
+
+/**
+ * Account for a reply carrying the given MUID.
+ */
+static void
+lg_reply(const char *muid, enum lg_kind kind)
+{
+	uint32 seq = peek_le32(muid);
+	struct lg_request *r = &lg_requests[seq % LG_WINDOW];
+	struct lg_stats *s = &lg_stats[kind];
+	tm_t now;
+	double ms;
+
+	if (r->seq != seq || r->kind != kind || UNSIGNED(muid[4]) != kind)
+		return;			/* Not one of our requests, or too old */
+
+	s->replies++;
+
+	if (r->answered)
+		return;			/* Only the first reply counts for latency */
+
+	tm_now_exact(&now);
+	ms = tm_elapsed_f(&now, &r->sent) * 1000.0;
+	r->answered = TRUE;
+	s->answered++;
+	s->lat_sum += ms;
+	s->lat_max = MAX(s->lat_max, ms);
+}
+
+/**
+ * Build a Gnutella header at the start of the buffer.
+ */
+static void
+lg_header(void *buf, const guid_t *muid, uint8 function, uint8 ttl,
+	uint32 size)
+{
+	gnutella_header_t *h = buf;
+
+	gnutella_header_set_muid(h, muid);
+	gnutella_header_set_function(h, function);
+	gnutella_header_set_ttl(h, ttl);
+	gnutella_header_set_hops(h, 0);
+	gnutella_header_set_size(h, size);
+}
+
+/**
+ * Build a Gnutella ping.
+ *
+ * @return the length of the message.
+ */
+static size_t
+lg_build_ping(char *buf, guid_t *muid, uint8 ttl)
+{
+	lg_header(buf, muid, GTA_MSG_INIT, ttl, 0);
+	return GTA_HEADER_SIZE;
+}
+
+/**
+ * Build a Gnutella query with a couple of random words.
+ *
+ * @return the length of the message.
+ */
+static size_t
+lg_build_query(char *buf, size_t len, guid_t *muid, uint8 ttl)
+{
+	char *p = &buf[GTA_HEADER_SIZE];
+	size_t n;
+
+	g_assert(len > GTA_HEADER_SIZE + 3);
+
+	poke_be16(p, GTA_FLAGS_MARK);	/* No OOB, no XML, no firewall */
+	n = str_bprintf(p + 2, len - GTA_HEADER_SIZE - 2, "%s %s",
+		lg_words[random_value(N_ITEMS(lg_words) - 1)],
+		lg_words[random_value(N_ITEMS(lg_words) - 1)]);
+	n += 2 + 1;						/* Flags and trailing NUL */
+
+	lg_header(buf, muid, GTA_MSG_SEARCH, ttl, n);
+	return GTA_HEADER_SIZE + n;
+}
+
+/**
+ * Build a Gnutella pong in reply to a ping from the node under test, so
+ * that our leaves are not considered dead.
+ *
+ * @return the length of the message.
+ */
+static size_t
+lg_build_pong(char *buf, const char *muid)
+{
+	char *p = &buf[GTA_HEADER_SIZE];
+
+	memset(p, 0, 14);					/* Port, IP, files, kbytes */
+	lg_header(buf, cast_to_guid_ptr_const(muid), GTA_MSG_INIT_RESPONSE, 1, 14);
+	return GTA_HEADER_SIZE + 14;
+}
+
+/**
+ * Build a DHT request with an optional random target KUID.
+ *
+ * @return the length of the message.
+ */
+static size_t
+lg_build_dht(char *buf, guid_t *muid, uint8 op, bool target)
+{
+	kademlia_header_t *h = (kademlia_header_t *) buf;
+	uchar kuid[KDA_KUID_SIZE];
+	size_t size = 0;
+
+	random_bytes(kuid, sizeof kuid);
+
+	memset(buf, 0, KDA_HEADER_SIZE);
+	kademlia_header_set_muid(h, muid);
+	kademlia_header_set_dht(h, KDA_VERSION_MAJOR, KDA_VERSION_MINOR);
+	kademlia_header_set_function(h, op);
+	kademlia_header_set_contact_kuid(h, kuid);
+	kademlia_header_set_contact_vendor(h, LG_VENDOR);
+	kademlia_header_set_contact_version(h,
+		KDA_VERSION_MAJOR, KDA_VERSION_MINOR);
+	kademlia_header_set_contact_addr_port(h, 0x7f000001, 0);
+	kademlia_header_set_contact_instance(h, 1);
+	kademlia_header_set_contact_flags(h, KDA_MSG_F_FIREWALLED);
+	kademlia_header_set_extended_length(h, 0);
+
+	if (target) {
+		random_bytes(&buf[KDA_HEADER_SIZE], KDA_KUID_SIZE);
+		size = KDA_KUID_SIZE;
+	}
+
+	kademlia_header_set_size(h, size);
+	return KDA_HEADER_SIZE + size;
+}
+
+/**
+ * Queue message for sending on the connection.
+ *
+ * @return TRUE if queued, FALSE if the output buffer is full.
+ */
+static bool
+lg_queue(struct lg_conn *c, const char *msg, size_t len)
+{
+	if (c->outlen + len > sizeof c->out)
+		return FALSE;
+
+	memcpy(&c->out[c->outlen], msg, len);
+	c->outlen += len;
+	return TRUE;
+}
+
+/**
+ * Send a request of the given kind.
+ */
+static void
+lg_send(enum lg_kind kind, uint8 ttl)
+{
+	static uint next;
+	char buf[512];
+	guid_t muid;
+	size_t len;
+	struct lg_conn *c = NULL;
+
+	if (LG_PING == kind || LG_QUERY == kind) {
+		uint i;
+
+		/*
+		 * Pick the next connected leaf, round-robin.
+		 */
+
+		for (i = 0; i < lg_leaves; i++) {
+			c = &lg_conns[next++ % lg_leaves];
+			if (-1 != c->fd)
+				break;
+			c = NULL;
+		}
+
+		if (NULL == c) {
+			lg_stats[kind].dropped++;
+			return;
+		}
+	}
+
+	lg_request_new(kind, &muid);
+
+	switch (kind) {
+	case LG_PING:
+		len = lg_build_ping(buf, &muid, 1);
+		break;
+	case LG_QUERY:
+		len = lg_build_query(buf, sizeof buf, &muid, ttl);
+		break;
+	case LG_UDP_PING:
+		len = lg_build_ping(buf, &muid, 1);
+		break;
+	case LG_DHT_PING:
+		len = lg_build_dht(buf, &muid, KDA_MSG_PING_REQUEST, FALSE);
+		break;
+	case LG_DHT_FIND:
+		len = lg_build_dht(buf, &muid, KDA_MSG_FIND_NODE_REQUEST, TRUE);
+		break;
+	default:
+		g_assert_not_reached();
+	}
+
+	if (c != NULL) {
+		if (!lg_queue(c, buf, len)) {
+			lg_stats[kind].sent--;
+			lg_stats[kind].dropped++;
+		}
+	} else {
+		if (-1 == sendto(lg_udp, buf, len, 0,
+			socket_addr_get_const_sockaddr(&lg_target), lg_target_len)
+		) {
+			lg_stats[kind].sent--;
+			lg_stats[kind].dropped++;
+		}
+	}
+}
+
+/**
+ * Handle a complete Gnutella message received on a connection.
+ */
+static void
+lg_handle(struct lg_conn *c, const char *msg, size_t len)
+{
+	const char *muid = msg;
+
+	lg_rx_msgs++;
+	lg_rx_bytes += len;
+
+	switch (gnutella_header_get_function(msg)) {
+	case GTA_MSG_INIT:
+		{
+			char pong[GTA_HEADER_SIZE + 14];
+			size_t n = lg_build_pong(pong, muid);
+			(void) lg_queue(c, pong, n);
+		}
+		break;
+	case GTA_MSG_INIT_RESPONSE:
+		lg_reply(muid, LG_PING);
+		break;
+	case GTA_MSG_SEARCH_RESULTS:
+		lg_reply(muid, LG_QUERY);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Close connection.
+ */
+static void
+lg_close(struct lg_conn *c, const char *reason)
+{
+	s_warning("leaf #%u closed: %s", (uint) (c - lg_conns), reason);
+	close(c->fd);
+	c->fd = -1;
+}
+
+/**
+ * Read and process incoming data on a connection.
+ */
+static void
+lg_read(struct lg_conn *c)
+{
+	ssize_t r;
+	size_t off = 0;
+
+	r = read(c->fd, &c->in[c->inlen], sizeof c->in - c->inlen);
+
+	if (0 == r) {
+		lg_close(c, "EOF");
+		return;
+	} else if (-1 == r) {
+		if (!is_temporary_error(errno))
+			lg_close(c, english_strerror(errno));
+		return;
+	}
+
+	c->inlen += r;
+
+	while (c->inlen - off >= GTA_HEADER_SIZE) {
+		const char *msg = &c->in[off];
+		size_t size = gnutella_header_get_size(msg) & GTA_SIZE_MASK;
+
+		if (GTA_HEADER_SIZE + size > sizeof c->in) {
+			lg_close(c, "message too large");
+			return;
+		}
+
+		if (c->inlen - off < GTA_HEADER_SIZE + size)
+			break;
+
+		lg_handle(c, msg, GTA_HEADER_SIZE + size);
+		off += GTA_HEADER_SIZE + size;
+	}
+
+	if (off != 0) {
+		memmove(c->in, &c->in[off], c->inlen - off);
+		c->inlen -= off;
+	}
+}
+
+/**
+ * Flush pending output on a connection.
+ */
+static void
+lg_write(struct lg_conn *c)
+{
+	ssize_t r;
+
+	r = write(c->fd, c->out, c->outlen);
+
+	if (-1 == r) {
+		if (!is_temporary_error(errno))
+			lg_close(c, english_strerror(errno));
+		return;
+	}
+
+	memmove(c->out, &c->out[r], c->outlen - r);
+	c->outlen -= r;
+}
+
+/**
+ * Read and process an incoming UDP datagram.
+ */
+static void
+lg_read_udp(void)
+{
+	char buf[LG_BUFSIZE];
+	ssize_t r;
+
+	r = recv(lg_udp, buf, sizeof buf, 0);
+
+	if (r < GTA_HEADER_SIZE)
+		return;
+
+	lg_rx_msgs++;
+	lg_rx_bytes += r;
+
+	switch (gnutella_header_get_function(buf)) {
+	case GTA_MSG_INIT_RESPONSE:
+		lg_reply(buf, LG_UDP_PING);
+		break;
+	case GTA_MSG_DHT:
+		if (r < KDA_HEADER_SIZE)
+			break;
+		switch (kademlia_header_get_function(buf)) {
+		case KDA_MSG_PING_RESPONSE:
+			lg_reply(buf, LG_DHT_PING);
+			break;
+		case KDA_MSG_FIND_NODE_RESPONSE:
+			lg_reply(buf, LG_DHT_FIND);
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Read handshake reply, up to the final empty line.
+ *
+ * @return TRUE if the node accepted the connection.
+ */
+static bool
+lg_handshake_reply(int fd, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len - 1) {
+		struct pollfd pfd;
+		ssize_t r;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		if (compat_poll(&pfd, 1, LG_TIMEOUT) <= 0)
+			return FALSE;
+
+		r = read(fd, &buf[n], 1);	/* Do not read past the headers */
+		if (r <= 0)
+			return FALSE;
+
+		n += r;
+		buf[n] = '\0';
+
+		if (n >= 4 && 0 == strcmp(&buf[n - 4], "\r\n\r\n"))
+			return is_strprefix(buf, "GNUTELLA/0.6 200") != NULL;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Connect a simulated leaf to the node under test.
+ *
+ * @return TRUE if the leaf is connected.
+ */
+static bool
+lg_connect(struct lg_conn *c, uint n, bool spread)
+{
+	static const char hello[] =
+		"GNUTELLA CONNECT/0.6\r\n"
+		"User-Agent: loadgen/1.0\r\n"
+		"X-Ultrapeer: False\r\n"
+		"Pong-Caching: 0.1\r\n"
+		"GGEP: 0.5\r\n"
+		"\r\n";
+	static const char ok[] = "GNUTELLA/0.6 200 OK\r\n\r\n";
+	char buf[4096];
+	int fd;
+
+	c->fd = -1;
+
+	fd = socket(socket_addr_get_family(&lg_target), SOCK_STREAM, 0);
+	if (-1 == fd) {
+		s_warning("leaf #%u: cannot create socket: %m", n);
+		return FALSE;
+	}
+
+	if (spread) {
+		socket_addr_t local;
+		socklen_t len;
+
+		len = socket_addr_set(&local, host_addr_get_ipv4(0x7f000002 + n), 0);
+		if (-1 == bind(fd, socket_addr_get_const_sockaddr(&local), len))
+			s_warning("leaf #%u: cannot bind: %m", n);
+	}
+
+	if (
+		-1 == connect(fd,
+			socket_addr_get_const_sockaddr(&lg_target), lg_target_len)
+	) {
+		s_warning("leaf #%u: cannot connect: %m", n);
+		goto failed;
+	}
+
+	if (-1 == write(fd, hello, CONST_STRLEN(hello)))
+		goto failed;
+
+	if (!lg_handshake_reply(fd, buf, sizeof buf)) {
+		s_warning("leaf #%u: handshake refused", n);
+		goto failed;
+	}
+
+	if (-1 == write(fd, ok, CONST_STRLEN(ok)))
+		goto failed;
+
+	fd_set_nonblocking(fd);
+	c->fd = fd;
+	c->inlen = c->outlen = 0;
+	return TRUE;
+
+failed:
+	close(fd);
+	return FALSE;
+}
+
+/**
+ * Parse the message mix, as comma-separated weights.
+ */
+static void
+lg_parse_mix(const char *s, uint *mix)
+{
+	uint i;
+	const char *p = s;
+
+	for (i = 0; i < LG_KIND_COUNT; i++) {
+		const char *end;
+		int error;
+
+		mix[i] = parse_uint32(p, &end, 10, &error);
+		if (error)
+			usage();
+		if (',' != *end)
+			break;
+		p = end + 1;
+	}
+
+	while (++i < LG_KIND_COUNT)
+		mix[i] = 0;
+}
+
+/**
+ * Pick a request kind according to the mix weights.
+ */
+static enum lg_kind
+lg_pick(const uint *mix, uint total)
+{
+	uint v = random_value(total - 1);
+	uint i;
+
+	for (i = 0; i < LG_KIND_COUNT; i++) {
+		if (v < mix[i])
+			return i;
+		v -= mix[i];
+	}
+
+	g_assert_not_reached();
+}
+
+/**
+ * Report statistics.
+ */
+static void
+lg_report(double elapsed, bool final)
+{
+	uint i;
+
+	printf("%s%.1fs: rx %s msgs (%s bytes)\n",
+		final ? "TOTAL " : "", elapsed,
+		uint64_to_string(lg_rx_msgs), uint64_to_string2(lg_rx_bytes));
+
+	for (i = 0; i < LG_KIND_COUNT; i++) {
+		const struct lg_stats *s = &lg_stats[i];
+
+		if (0 == s->sent && 0 == s->dropped)
+			continue;
+
+		printf("  %-8s sent=%s (%.1f/s) dropped=%s replies=%s "
+			"answered=%.1f%% latency avg=%.2fms max=%.2fms\n",
+			lg_kind_name[i], uint64_to_string(s->sent),
+			s->sent / MAX(elapsed, 0.001), uint64_to_string2(s->dropped),
+			uint64_to_string3(s->replies),
+			s->answered * 100.0 / MAX(s->sent, 1),
+			s->lat_sum / MAX(s->answered, 1), s->lat_max);
+	}
+
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	uint rate = LG_RATE, duration = LG_DURATION, ttl = LG_TTL;
+	uint mix[LG_KIND_COUNT] = { 10, 80, 10, 0, 0 };
+	uint i, total, connected = 0, nfds;
+	bool spread = FALSE;
+	host_addr_t addr;
+	uint16 port;
+	struct pollfd *pfd;
+	tm_t start, last;
+	uint64 due = 0;
+	/* getopt() variables: */
+	extern int optind;
+	extern char *optarg;
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, "c:d:hLm:r:t:")) != EOF) {
+		switch (c) {
+		case 'c':			/* amount of leaves */
+			lg_leaves = atoi(optarg);
+			break;
+		case 'd':			/* duration */
+			duration = atoi(optarg);
+			break;
+		case 'L':			/* spread leaves over loopback addresses */
+			spread = TRUE;
+			break;
+		case 'm':			/* message mix */
+			lg_parse_mix(optarg, mix);
+			break;
+		case 'r':			/* target rate */
+			rate = atoi(optarg);
+			break;
+		case 't':			/* query TTL */
+			ttl = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 1)
+		usage();
+
+	argv += optind;
+
+	if (!string_to_host_addr_port(argv[0], NULL, &addr, &port) || 0 == port)
+		s_fatal_exit(EXIT_FAILURE, "invalid address \"%s\"", argv[0]);
+
+	for (i = 0, total = 0; i < LG_KIND_COUNT; i++)
+		total += mix[i];
+
+	if (0 == total || 0 == rate || ttl > 255 || lg_leaves > 250)
+		usage();
+
+	lg_target_len = socket_addr_set(&lg_target, addr, port);
+
+	lg_udp = socket(socket_addr_get_family(&lg_target), SOCK_DGRAM, 0);
+	if (-1 == lg_udp)
+		s_fatal_exit(EXIT_FAILURE, "cannot create UDP socket: %m");
+	fd_set_nonblocking(lg_udp);
+
+	/*
+	 * Connect the leaves.
+	 */
+
+	XMALLOC0_ARRAY(lg_conns, lg_leaves);
+
+	for (i = 0; i < lg_leaves; i++) {
+		if (lg_connect(&lg_conns[i], i, spread))
+			connected++;
+	}
+
+	printf("%u/%u leaves connected to %s\n",
+		connected, lg_leaves, host_addr_port_to_string(addr, port));
+
+	if (0 == connected && 0 == mix[LG_UDP_PING] + mix[LG_DHT_PING] +
+		mix[LG_DHT_FIND])
+	{
+		s_fatal_exit(EXIT_FAILURE, "no leaf connected, nothing to do");
+	}
+
+	XMALLOC_ARRAY(pfd, lg_leaves + 1);
+
+	/*
+	 * Main loop: send the requests due since the start of the run, then
+	 * wait for I/Os for at most a millisecond.
+	 */
+
+	tm_now_exact(&start);
+	last = start;
+
+	for (;;) {
+		tm_t now;
+		double elapsed;
+		uint64 target;
+
+		tm_now_exact(&now);
+		elapsed = tm_elapsed_f(&now, &start);
+
+		if (elapsed >= duration)
+			break;
+
+		target = (uint64) (elapsed * rate);
+		while (due < target) {
+			lg_send(lg_pick(mix, total), ttl);
+			due++;
+		}
+
+		if (tm_elapsed_ms(&now, &last) >= 1000) {
+			lg_report(elapsed, FALSE);
+			last = now;
+		}
+
+		for (i = 0, nfds = 0; i < lg_leaves; i++) {
+			struct lg_conn *lc = &lg_conns[i];
+
+			if (-1 == lc->fd)
+				continue;
+
+			pfd[nfds].fd = lc->fd;
+			pfd[nfds].events = POLLIN | (lc->outlen != 0 ? POLLOUT : 0);
+			pfd[nfds].revents = 0;
+			nfds++;
+		}
+
+		pfd[nfds].fd = lg_udp;
+		pfd[nfds].events = POLLIN;
+		pfd[nfds].revents = 0;
+		nfds++;
+
+		if (compat_poll(pfd, nfds, 1) <= 0)
+			continue;
+
+		for (i = 0; i < nfds; i++) {
+			struct lg_conn *lc = NULL;
+			uint j;
+
+			if (0 == pfd[i].revents)
+				continue;
+
+			if (pfd[i].fd == lg_udp) {
+				lg_read_udp();
+				continue;
+			}
+
+			for (j = 0; j < lg_leaves; j++) {
+				if (lg_conns[j].fd == pfd[i].fd) {
+					lc = &lg_conns[j];
+					break;
+				}
+			}
+
+			g_assert(lc != NULL);
+
+			if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+				lg_read(lc);
+			if (-1 != lc->fd && (pfd[i].revents & POLLOUT))
+				lg_write(lc);
+		}
+	}
+
+	tm_now_exact(&last);
+	lg_report(tm_elapsed_f(&last, &start), TRUE);
+
+	for (i = 0; i < lg_leaves; i++) {
+		if (-1 != lg_conns[i].fd)
+			close(lg_conns[i].fd);
+	}
+
+	close(lg_udp);
+	XFREE_NULL(pfd);
+	XFREE_NULL(lg_conns);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -63,9 +63,11 @@
 #include "lib/fd.h"
 #include "lib/fifo.h"
 #include "lib/file.h"		/* For file_register_fd_reclaimer() */
+#include "lib/halloc.h"
 #include "lib/hevset.h"
 #include "lib/misc.h"
 #include "lib/parse.h"
+#include "lib/pow2.h"
 #include "lib/spinlock.h"
 #include "lib/stringify.h"	/* For plural() */
 #include "lib/tm.h"
@@ -84,6 +86,14 @@
  *
  * We use linear decay to gradually decrease the amount of requests made
  * over time.
+ *
+ * To avoid creating a record for each IP address we see only once or
+ * twice, which would let the table grow without bounds when we are flooded
+ * by many addresses, the requests are first accounted for in a count-min
+ * sketch: an array of decaying counters indexed by two independent hashes
+ * of the address.  Counters can only over-estimate the amount of requests
+ * made by an address, and an exact record is created only when the
+ * estimate crosses half the request limit.
  */
 
 #define BAN_DELAY		300		/**< Initial ban delay: 5 minutes */
@@ -98,6 +108,9 @@
 #define MAX_OOB_PERIOD		60		/**< ...per minute */
 #define MAX_OOB_BAN			600		/**< 10 minutes */
 
+#define BAN_SKETCH_ROWS		2		/**< Amount of hash functions */
+#define BAN_SKETCH_WIDTH	2048	/**< Counters per row (power of 2) */
+
 #define ban_reason(p)	((p)->ban_msg ? (p)->ban_msg : "N/A")
 
 #define FORCE_ASSIGN(t,s,f,v) G_STMT_START {	\
@@ -106,6 +119,14 @@
 
 enum ban_magic { BAN_MAGIC = 0x01d2f60d };
 
+/**
+ * A decaying counter in the count-min sketch.
+ */
+struct ban_counter {
+	float counter;				/**< Counts requests, decayed linearily */
+	time_t last;				/**< Time of last update */
+};
+
 /**
  * A banning object.
  */
@@ -119,6 +140,7 @@ struct ban {
 	unsigned remind;			/**< Reminding period, every so many attempts */
 	const float decay_coeff;	/**< Decay coefficient, per second */
 	hevset_t *info;				/**< Info by IP address */
+	struct ban_counter *sketch;	/**< Count-min sketch of requests */
 };
 
 static inline void
@@ -208,6 +230,7 @@ ban_make(const ban_category_t cat,
 	b->remind = remind;
 	b->info = hevset_create_any(offsetof(struct addr_info, addr),
 		host_addr_hash_func, host_addr_hash_func2, host_addr_eq_func);
+	HALLOC0_ARRAY(b->sketch, BAN_SKETCH_ROWS * BAN_SKETCH_WIDTH);
 
 	/*
 	 * Assignments to read-only fields at creation time.
@@ -291,6 +314,7 @@ ban_free(struct ban *b)
 
 	hevset_foreach(b->info, free_info, NULL);
 	hevset_free_null(&b->info);
+	HFREE_NULL(b->sketch);
 	b->magic = 0;
 	WFREE(b);
 }
@@ -374,6 +398,43 @@ ipf_unban(cqueue_t *cq, void *obj)
 	ipf->cq_ev = cq_insert(ban_cq, delay, ipf_destroy, ipf);
 }
 
+/**
+ * Account for a new request from an address in the count-min sketch.
+ *
+ * @return the estimated amount of requests made by the address, including
+ * the new one, after decaying.
+ */
+static float
+ban_sketch_record(struct ban *b, const host_addr_t addr, time_t now)
+{
+	uint h[BAN_SKETCH_ROWS];
+	float estimate = 0.0;
+	size_t i;
+
+	STATIC_ASSERT(IS_POWER_OF_2(BAN_SKETCH_WIDTH));
+	STATIC_ASSERT(2 == BAN_SKETCH_ROWS);
+
+	h[0] = host_addr_hash_func(&addr);
+	h[1] = host_addr_hash_func2(&addr);
+
+	for (i = 0; i < BAN_SKETCH_ROWS; i++) {
+		struct ban_counter *c =
+			&b->sketch[i * BAN_SKETCH_WIDTH + (h[i] & (BAN_SKETCH_WIDTH - 1))];
+
+		c->counter -= delta_time(now, c->last) * b->decay_coeff;
+		if (c->counter < 0.0)
+			c->counter = 0.0;
+
+		c->counter += 1.0;
+		c->last = now;
+
+		if (0 == i || c->counter < estimate)
+			estimate = c->counter;
+	}
+
+	return estimate;
+}
+
 /**
  * Check whether we can allow connection / event from `ip' to proceed.
  *
@@ -410,13 +471,20 @@ ban_allow(const ban_category_t cat, const host_addr_t addr)
 	ipf = hevset_lookup(b->info, &addr);
 
 	/*
-	 * First time we see this IP?  It's OK then.
+	 * Not tracking this IP exactly?  It's OK then, unless the sketch says
+	 * it is getting close to the request limit, in which case we start
+	 * to track it precisely.
 	 */
 
 	if (NULL == ipf) {
+		float estimate = ban_sketch_record(b, addr, now);
+
+		if (estimate <= (float) b->requests / 2.0)
+			return BAN_OK;
+
 		ipf = ipf_make(addr, now, b);
+		ipf->counter = estimate - 1.0;		/* New request accounted below */
 		hevset_insert(b->info, ipf);
-		return BAN_OK;
 	}
 
 	addr_info_check(ipf);
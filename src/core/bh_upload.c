@@ -60,6 +60,7 @@
 #include "lib/product.h"
 #include "lib/pslist.h"
 #include "lib/stringify.h"
+#include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/url.h"
 #include "lib/walloc.h"
@@ -80,6 +81,9 @@
 
 #define BH_BUFSIZ			16384	/**< Buffer size for TX deflation */
 
+#define BH_CACHE_MAX		(16 * 1024 * 1024)	/**< Max cached hits size */
+#define BH_CACHE_LIFETIME	(15 * 60)			/**< Max cache age (secs) */
+
 enum bh_state {
 	BH_STATE_HEADER = 0,	/* Sending header */
 	BH_STATE_LIBRARY_INFO,	/* Info on library */
@@ -96,6 +100,25 @@ enum bh_type {
 	BH_TYPE_QHIT			/* Send back Gnutella query hits */
 };
 
+/**
+ * Cached query hits for the whole library.
+ *
+ * Query hits for the library are the same for all the hosts browsing us,
+ * so we keep the generated data around until the library is rescanned,
+ * or until they get too old (the hits also carry our address and our
+ * push-proxies, which can change).
+ */
+struct bh_cache {
+	int refcnt;				/**< Amount of references */
+	char *data;				/**< The generated query hits */
+	size_t size;			/**< Size of data */
+	time_t created;			/**< Creation time */
+	time_t rescan;			/**< Value of "library_rescan_finished" */
+	uint files;				/**< Amount of files scanned in the library */
+};
+
+static struct bh_cache *bh_cache[2];	/**< Indexed by bh_cache_index() */
+
 struct browse_host_upload {
 	struct special_upload special;	/**< vtable, MUST be first field */
 	enum bh_type type;		/**< Type of data to send back */
@@ -109,6 +132,11 @@ struct browse_host_upload {
 	uint file_index;		/**< Current file index (iterator) */
 	enum bh_state state;	/**< Current state of the state machine */
 	pslist_t *hits;			/**< Pending query hits to send back */
+	struct bh_cache *cache;	/**< Cached query hits we're sending */
+	char *rec;				/**< Query hits generated so far, for the cache */
+	size_t rec_len;			/**< Length of recorded data */
+	size_t rec_size;		/**< Allocated size of the recording buffer */
+	bool recording;			/**< Whether we're recording generated hits */
 	special_upload_closed_t cb;	/**< Callback to invoke when TX fully flushed */
 	void *cb_arg;			/**< Callback argument */
 };
@@ -367,6 +395,156 @@ browse_host_read_html(struct special_upload *ctx,
 	return p - cast_to_char_ptr(dest);
 }
 
+/**
+ * @return the index of the cache slot for the query hits of the session.
+ */
+static inline uint
+bh_cache_index(const struct browse_host_upload *bh)
+{
+	return (bh->flags & BH_F_G2) ? 1 : 0;
+}
+
+/**
+ * Remove a reference on cached query hits, freeing them when nobody
+ * uses them any more.
+ */
+static void
+bh_cache_unref(struct bh_cache *bc)
+{
+	g_assert(bc->refcnt > 0);
+
+	if (0 == --bc->refcnt) {
+		HFREE_NULL(bc->data);
+		WFREE(bc);
+	}
+}
+
+/**
+ * @return cached query hits to use for the session, NULL if none.
+ */
+static struct bh_cache *
+bh_cache_get(const struct browse_host_upload *bh)
+{
+	struct bh_cache **bcp = &bh_cache[bh_cache_index(bh)];
+	struct bh_cache *bc = *bcp;
+
+	if (NULL == bc)
+		return NULL;
+
+	if (
+		delta_time(tm_time(), bc->created) > BH_CACHE_LIFETIME ||
+		bc->rescan != GNET_PROPERTY(library_rescan_finished) ||
+		bc->files != shared_files_scanned()
+	) {
+		*bcp = NULL;
+		bh_cache_unref(bc);
+		return NULL;
+	}
+
+	bc->refcnt++;
+	return bc;
+}
+
+/**
+ * Record the query hits we generated for the whole library in the cache.
+ */
+static void
+bh_cache_record(struct browse_host_upload *bh)
+{
+	struct bh_cache **bcp = &bh_cache[bh_cache_index(bh)];
+	struct bh_cache *bc;
+
+	if (GNET_PROPERTY(library_rebuilding) || 0 == bh->rec_len)
+		return;
+
+	WALLOC0(bc);
+	bc->refcnt = 1;
+	bc->size = bh->rec_len;
+	bc->data = hrealloc(bh->rec, bh->rec_len);	/* Trim buffer */
+	bh->rec = NULL;
+	bh->recording = FALSE;
+	bc->created = tm_time();
+	bc->rescan = GNET_PROPERTY(library_rescan_finished);
+	bc->files = shared_files_scanned();
+
+	if (*bcp != NULL)
+		bh_cache_unref(*bcp);
+	*bcp = bc;
+}
+
+/**
+ * Stop recording the query hits we generate.
+ */
+static void
+bh_cache_stop(struct browse_host_upload *bh)
+{
+	HFREE_NULL(bh->rec);
+	bh->rec_len = bh->rec_size = 0;
+	bh->recording = FALSE;
+}
+
+/**
+ * Append generated query hit data to the recording buffer.
+ */
+static void
+bh_cache_append(struct browse_host_upload *bh, const void *data, size_t len)
+{
+	g_assert(bh->recording);
+
+	if (bh->rec_len + len > BH_CACHE_MAX) {
+		bh_cache_stop(bh);
+		return;
+	}
+
+	if (bh->rec_len + len > bh->rec_size) {
+		bh->rec_size = MAX(BH_BUFSIZ, 2 * bh->rec_size);
+		bh->rec_size = MAX(bh->rec_size, bh->rec_len + len);
+		bh->rec = hrealloc(bh->rec, bh->rec_size);
+	}
+
+	memcpy(&bh->rec[bh->rec_len], data, len);
+	bh->rec_len += len;
+}
+
+/**
+ * Discard all the cached query hits.
+ */
+void
+browse_host_close_cache(void)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(bh_cache); i++) {
+		if (bh_cache[i] != NULL) {
+			bh_cache_unref(bh_cache[i]);
+			bh_cache[i] = NULL;
+		}
+	}
+}
+
+/**
+ * Reads the cached query hits.
+ *
+ * @return the amount of bytes copied to ``dest'', 0 at the end.
+ */
+static ssize_t
+browse_host_read_cache(struct special_upload *ctx,
+	void *const dest, size_t size)
+{
+	struct browse_host_upload *bh = cast_to_browse_host_upload(ctx);
+	size_t remain = size;
+
+	g_assert(bh->cache != NULL);
+
+	if (NULL == bh->b_data) {
+		bh->b_data = bh->cache->data;
+		bh->b_size = bh->cache->size;
+		bh->b_offset = 0;
+	}
+
+	return browse_host_read_data(bh, dest, &remain);
+}
+
 /**
  * Enqueue query hit built by creating a message.
  * Callback for qhit_build_results().
@@ -433,14 +611,20 @@ browse_host_read_qhits(struct special_upload *ctx,
 				sf = shared_file_sorted(bh->file_index);
 			} while (NULL == sf && bh->file_index <= shared_files_scanned());
 
+			if (SHARE_REBUILDING == sf)
+				bh_cache_stop(bh);		/* Incomplete library */
+
 			if (SHARE_REBUILDING == sf || NULL == sf)
 				break;
 
 			files = pslist_prepend(files, sf);
 		}
 
-		if (NULL == files)		/* Did not find any more file to include */
+		if (NULL == files) {	/* Did not find any more file to include */
+			if (bh->recording)
+				bh_cache_record(bh);
 			return 0;			/* We're done */
+		}
 
 		/*
 		 * Now build the query hits containing the files we selected.
@@ -484,6 +668,14 @@ browse_host_read_qhits(struct special_upload *ctx,
 		}
 	}
 
+	/*
+	 * Record the generated data so that the next hosts browsing us
+	 * get the query hits from the cache.
+	 */
+
+	if (bh->recording)
+		bh_cache_append(bh, dest, size - remain);
+
 	return size - remain;
 }
 
@@ -558,6 +750,10 @@ browse_host_close(struct special_upload *ctx, bool fully_served)
 		pmsg_free(mb);
 	}
 	pslist_free_null(&bh->hits);
+	HFREE_NULL(bh->rec);
+
+	if (bh->cache != NULL)
+		bh_cache_unref(bh->cache);
 
 	if (bh->w_buf) {
 		wfree(bh->w_buf, bh->w_buf_size);
@@ -613,7 +809,7 @@ browse_host_open(
 	g_assert(flags & (BH_F_HTML|BH_F_QHITS));
 	g_assert((flags & (BH_F_HTML|BH_F_QHITS)) != (BH_F_HTML|BH_F_QHITS));
 
-	WALLOC(bh);
+	WALLOC0(bh);
 	bh->special.magic = SPECIAL_UPLOAD_BROWSE_MAGIC;
 	bh->special.read  = (flags & BH_F_HTML)
 						? browse_host_read_html
@@ -627,6 +823,19 @@ browse_host_open(
 	bh->file_index = 0;
 	bh->flags = flags;
 
+	/*
+	 * Query hits are served from the cache when we have them already,
+	 * otherwise we record them as we generate them.
+	 */
+
+	if (flags & BH_F_QHITS) {
+		bh->cache = bh_cache_get(bh);
+		if (bh->cache != NULL)
+			bh->special.read = browse_host_read_cache;
+		else
+			bh->recording = TRUE;
+	}
+
 	/*
 	 * Instantiate the TX stack.
 	 */
@@ -652,6 +861,8 @@ browse_host_open(
 		args.cb = deflate_cb;
 		args.nagle = FALSE;
 		args.reduced = FALSE;
+		args.low_memory = FALSE;
+		args.dictionary = FALSE;
 		args.gzip = 0 != (flags & BH_F_GZIP);
 		args.buffer_flush = INT_MAX;		/* Flush only at the end */
 		args.buffer_size = BH_BUFSIZ;
@@ -71,6 +71,7 @@ struct special_upload *browse_host_open(
 	const struct tx_link_cb *link_cb,
 	struct wrap_io *wio,
 	int flags);
+void browse_host_close_cache(void);
 
 #endif /* _core_bh_upload_h_ */
 
@@ -42,6 +42,7 @@
 #include "if/gnet_property_priv.h"
 
 #include "lib/compat_sendfile.h"
+#include "lib/cq.h"
 #include "lib/entropy.h"
 #include "lib/halloc.h"
 #include "lib/hstrfn.h"
@@ -70,6 +71,7 @@ enum {
 	BS_F_NO_STEALING	= (1 << 8),		/**< Prevent b/w stealing from us */
 	BS_F_STOLEN_IGN		= (1 << 9),		/**< Ignore stolen bandwidth */
 	BS_F_UNIFORM_BW		= (1 << 10),	/**< Uniform b/w allocation */
+	BS_F_PACED			= (1 << 11),	/**< Waiting for pacing refill */
 
 	BS_F_RW				= (BS_F_READ|BS_F_WRITE)
 };
@@ -113,6 +115,12 @@ enum bsched_magic {
  * of the period, any amount of bandwidth that has been unused will be
  * given as "stolen" bandwidth to some of the schedulers stealing from us.
  * Priority is given to schedulers that used up all their bandwidth.
+ *
+ * Within a period, the bandwidth is paced: it is made available gradually
+ * as time passes, like tokens filling a bucket, instead of being given all
+ * at once when the period begins.  Otherwise the sources would consume the
+ * whole period allowance in a burst and then stay idle until the next
+ * period, yielding a sawtooth traffic pattern on fast links.
  */
 
 struct bsched {
@@ -120,6 +128,7 @@ struct bsched {
 	tm_t last_period;			/**< Last time we ran our period */
 	plist_t *sources;			/**< List of bio_source_t */
 	pslist_t *stealers;			/**< List of bsched_t stealing bw */
+	cevent_t *pacing_ev;		/**< Pacing refill event */
 	char *name;					/**< Name, for tracing purposes */
 	int count;					/**< Amount of sources */
 	uint type;					/**< Scheduling type */
@@ -172,6 +181,8 @@ static int64 bws_in_ema = 0;
 
 #define BW_UDP_OVERSIZE	1024 /**< Allow that many bytes over available b/w */
 
+#define BW_PACING_SLICES	10	/**< Pacing granularity within a period */
+
 static inline void
 bsched_check(const bsched_t * const bs)
 {
@@ -260,6 +271,7 @@ bsched_free(bsched_t *bs)
 
 	plist_free_null(&bs->sources);
 	pslist_free_null(&bs->stealers);
+	cq_cancel(&bs->pacing_ev);
 	HFREE_NULL(bs->name);
 	bs->magic = 0;
 	WFREE(bs);
@@ -970,6 +982,97 @@ bsched_clear_active(bsched_t *bs)
 	}
 }
 
+/**
+ * Callout queue callback invoked when the pacing bucket was refilled.
+ *
+ * Re-enable the sources we had to disable, and trigger the passive ones
+ * that already requested bandwidth during the period.
+ */
+static void
+bsched_pacing_refill(cqueue_t *cq, void *obj)
+{
+	bsched_t *bs = obj;
+	plist_t *iter;
+	pslist_t *trigger = NULL;
+
+	bsched_check(bs);
+
+	cq_zero(cq, &bs->pacing_ev);
+	bs->flags &= ~BS_F_PACED;
+
+	if (bs->flags & BS_F_NOBW)
+		return;				/* Exhausted the whole period allowance */
+
+	PLIST_FOREACH(bs->sources, iter) {
+		bio_source_t *bio = iter->data;
+
+		bio_check(bio);
+
+		if (bio->io_tag == 0 && bio->io_callback) {
+			if (!(bio->flags & BIO_F_PASSIVE))
+				bio_enable(bio);
+			else if (bio->flags & BIO_F_USED)
+				trigger = pslist_prepend(trigger, bio);
+		}
+	}
+
+	while (trigger != NULL) {
+		bio_source_t *bio = trigger->data;
+
+		trigger = pslist_remove(trigger, bio);
+		bio_trigger(bio);
+	}
+}
+
+/**
+ * Compute the amount of bandwidth made available so far by pacing within
+ * the current period, stolen bandwidth included.
+ *
+ * We allow one pacing slice in advance to absorb bursts: the whole period
+ * allowance is therefore available slightly before the period ends.
+ */
+static int64
+bsched_pacing_allowance(const bsched_t *bs)
+{
+	tm_t now;
+	long elapsed;
+	int64 total = bs->bw_max + bs->bw_stolen;
+
+	tm_now(&now);
+	elapsed = tm_elapsed_ms(&now, &bs->last_period);
+	elapsed += bs->period / BW_PACING_SLICES;
+
+	if (elapsed >= bs->period || elapsed <= 0)
+		return total;		/* Late, or time jumped backwards */
+
+	return (int64) (total * ((double) elapsed / bs->period));
+}
+
+/**
+ * Disable all sources until the next pacing slice refills the bucket.
+ */
+static void
+bsched_pacing_wait(bsched_t *bs)
+{
+	plist_t *iter;
+
+	bsched_check(bs);
+	g_assert(!(bs->flags & BS_F_PACED));
+
+	PLIST_FOREACH(bs->sources, iter) {
+		bio_source_t *bio = iter->data;
+
+		bio_check(bio);
+
+		if (bio->io_tag)
+			bio_disable(bio);
+	}
+
+	bs->flags |= BS_F_PACED;
+	bs->pacing_ev = cq_main_insert(MAX(1, bs->period / BW_PACING_SLICES),
+		bsched_pacing_refill, bs);
+}
+
 /**
  * Called whenever a new scheduling timeslice begins.
  *
@@ -1103,6 +1206,8 @@ bsched_begin_timeslice(bsched_t *bs)
 	}
 
 	bs->flags &= ~(BS_F_NOBW|BS_F_FROZEN_SLOT|BS_F_CHANGED_BW|BS_F_CLEARED);
+	bs->flags &= ~BS_F_PACED;
+	cq_cancel(&bs->pacing_ev);
 
 	/*
 	 * On the first round of source dispatching, don't use the stolen b/w.
@@ -1362,8 +1467,8 @@ bw_available(bio_source_t *bio, int len)
 	if (!(bs->flags & BS_F_ENABLED))		/* Scheduler disabled */
 		return len;							/* Use amount requested */
 
-	if (bs->flags & BS_F_NOBW)				/* No more bandwidth */
-		return 0;							/* Grant nothing */
+	if (bs->flags & (BS_F_NOBW | BS_F_PACED))	/* No more bandwidth */
+		return 0;								/* Grant nothing */
 
 	/*
 	 * Source is already disabled if there is a callback and no tag on a
@@ -1513,6 +1618,25 @@ bw_available(bio_source_t *bio, int len)
 		available = 0;
 	}
 
+	/*
+	 * Do not grant more than what pacing made available so far, waiting
+	 * for the next refill when we consumed it all.
+	 */
+
+	if (available > 0 && GNET_PROPERTY(bw_pacing)) {
+		int64 paced = bsched_pacing_allowance(bs) - bs->bw_actual;
+
+		if (paced <= 0) {
+			if (GNET_PROPERTY(bsched_debug) > 7)
+				g_debug("BSCHED %s: \"%s\" waiting for pacing refill",
+					G_STRFUNC, bs->name);
+			bsched_pacing_wait(bs);
+			return 0;
+		}
+
+		available = MIN(available, paced);
+	}
+
 	/*
 	 * Enforce 0 bytes if source was used with uniform scheduling.
 	 * Active sources are disabled, but we could face a passive one.
@@ -1970,6 +2094,78 @@ bio_sendto(bio_source_t *bio, const gnet_host_t *to,
 	return r;
 }
 
+/**
+ * Send several datagrams at once to their own destinations, as bandwidth
+ * permits.
+ *
+ * Datagrams are sent in order and each of them is handled as bio_sendto()
+ * would, meaning we stop at the first datagram for which there is not
+ * enough bandwidth left.
+ *
+ * @return the amount of datagrams sent, or -1 with errno set if the first
+ * datagram could not be sent (EAGAIN when we have no bandwidth).
+ */
+ssize_t
+bio_sendmmsg(bio_source_t *bio, const wrap_dgram_t *dg, int cnt)
+{
+	size_t available, total = 0;
+	int i, n;
+	ssize_t r;
+
+	bio_check(bio);
+	g_assert(bio->flags & BIO_F_WRITE);
+	g_assert(cnt > 0);
+
+	for (i = 0; i < cnt; i++)
+		total += dg[i].len;
+
+	available = bw_available(bio, total);
+
+	/*
+	 * Count how many datagrams we can send with the available bandwidth,
+	 * allowing the same BW_UDP_OVERSIZE extra amount as bio_sendto() for
+	 * the last one.
+	 */
+
+	for (n = 0, total = 0; n < cnt; n++) {
+		if (
+			total >= available ||
+			available - total + BW_UDP_OVERSIZE < dg[n].len
+		)
+			break;
+		total += dg[n].len;
+	}
+
+	if (0 == n) {
+		errno = VAL_EAGAIN;
+		return -1;
+	}
+
+	if (GNET_PROPERTY(bsched_debug) > 7)
+		g_debug("BSCHED %s(wio=%d, cnt=%d) n=%d, len=%zu, available=%zu",
+			G_STRFUNC, bio->wio->fd(bio->wio), cnt, n, total, available);
+
+	g_assert(bio->wio != NULL);
+	g_assert(bio->wio->sendmmsg != NULL);
+	r = (*bio->wio->sendmmsg)(bio->wio, dg, n);
+
+	if ((ssize_t) -1 == r && 0 == errno) {
+		g_warning("wio->sendmmsg(fd=%d, cnt=%d) returned -1 with errno = 0, "
+			"assuming EAGAIN", bio->wio->fd(bio->wio), n);
+		errno = VAL_EAGAIN;
+	}
+
+	if (r > 0) {
+		for (i = 0, total = 0; i < r; i++)
+			total += dg[i].len + BW_UDP_MSG;
+
+		bsched_bw_update(bsched_get(bio->bws), total, total);
+		bio_bw_update(bio, total);
+	}
+
+	return r;
+}
+
 /**
  * Write at most `len' bytes to source's fd, as bandwidth permits.
  *
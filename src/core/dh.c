@@ -451,12 +451,15 @@ forward:
 }
 
 /**
- * Route query hits from one node to the other.
+ * Check whether query hits can be routed from one node to the other, and
+ * account for them as queued if they can.
+ *
+ * @return the information to attach to the message to route, NULL if the
+ * message is dropped.
  */
-void
-dh_route(gnutella_node_t *src, gnutella_node_t *dest, int count)
+static struct dh_pmsg_info *
+dh_route_accept(gnutella_node_t *src, gnutella_node_t *dest, int count)
 {
-	pmsg_t *mb;
 	struct dh_pmsg_info *pmi;
 	const struct guid *muid;
 	dqhit_t *dh;
@@ -512,6 +515,44 @@ dh_route(gnutella_node_t *src, gnutella_node_t *dest, int count)
 
 	g_assert(dh->hits_queued >= UNSIGNED(count));
 
+	return pmi;
+
+drop_shutdown:
+	gnet_stats_count_dropped(src, MSG_DROP_SHUTDOWN);
+	return NULL;
+
+drop_flow_control:
+	gnet_stats_count_dropped(src, MSG_DROP_FLOW_CONTROL);
+	gnet_stats_count_flowc(&src->header, TRUE);
+	return NULL;
+
+drop_throttle:
+	gnet_stats_count_dropped(src, MSG_DROP_THROTTLE);
+	return NULL;
+
+drop_transient:
+	gnet_stats_count_dropped(src, MSG_DROP_TRANSIENT);
+	return NULL;
+}
+
+/**
+ * Route query hits from one node to the other.
+ */
+void
+dh_route(gnutella_node_t *src, gnutella_node_t *dest, int count)
+{
+	pmsg_t *mb;
+	struct dh_pmsg_info *pmi;
+	const struct guid *muid;
+	mqueue_t *mq;
+
+	pmi = dh_route_accept(src, dest, count);
+	if (NULL == pmi)
+		return;
+
+	muid = gnutella_header_get_muid(&src->header);
+	mq = dest->outq;
+
 	/*
 	 * Magic: we create an extended version of a pmsg_t that contains a
 	 * free routine, which will be invoked when the message queue frees
@@ -548,7 +589,7 @@ dh_route(gnutella_node_t *src, gnutella_node_t *dest, int count)
 
 		if (!NODE_CAN_SR_UDP(dest) && NODE_CAN_INFLATE(dest)) {
 			mb = gmsg_split_to_deflated_pmsg(&src->header, src->data,
-					src->size + GTA_HEADER_SIZE);
+					src->size + GTA_HEADER_SIZE, dest->addr);
 
 			if (gnutella_header_get_ttl(pmsg_phys_base(mb)) & GTA_UDP_DEFLATED)
 				gnet_stats_inc_general(GNR_UDP_TX_COMPRESSED);
@@ -575,25 +616,30 @@ dh_route(gnutella_node_t *src, gnutella_node_t *dest, int count)
 				node_infostr(dest));
 		}
 	}
+}
 
-	return;
-
-drop_shutdown:
-	gnet_stats_count_dropped(src, MSG_DROP_SHUTDOWN);
-	return;
+/**
+ * Build the message routing query hits from one node to a TCP node, without
+ * enqueuing it, so that the caller can defer its transmission.
+ *
+ * The hits are accounted for as queued, and the returned message must be
+ * either enqueued to the destination or freed.
+ *
+ * @return the message to enqueue, NULL if the hits are dropped.
+ */
+pmsg_t *
+dh_route_pmsg(gnutella_node_t *src, gnutella_node_t *dest, int count)
+{
+	struct dh_pmsg_info *pmi;
 
-drop_flow_control:
-	gnet_stats_count_dropped(src, MSG_DROP_FLOW_CONTROL);
-	gnet_stats_count_flowc(&src->header, TRUE);
-	return;
+	g_assert(!NODE_IS_UDP(dest));
 
-drop_throttle:
-	gnet_stats_count_dropped(src, MSG_DROP_THROTTLE);
-	return;
+	pmi = dh_route_accept(src, dest, count);
+	if (NULL == pmi)
+		return NULL;
 
-drop_transient:
-	gnet_stats_count_dropped(src, MSG_DROP_TRANSIENT);
-	return;
+	return gmsg_split_to_pmsg_extend(&src->header, src->data,
+		src->size + GTA_HEADER_SIZE, dh_pmsg_free, pmi);
 }
 
 /**
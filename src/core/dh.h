@@ -42,6 +42,7 @@
 
 struct gnutella_node;
 struct guid;
+struct pmsg;
 
 void dh_init(void);
 void dh_close(void);
@@ -50,6 +51,8 @@ void dh_got_results(const struct guid *muid, int count);
 void dh_timer(time_t now);
 void dh_route(
 	struct gnutella_node *src, struct gnutella_node *dest, int count);
+struct pmsg *dh_route_pmsg(
+	struct gnutella_node *src, struct gnutella_node *dest, int count);
 bool dh_would_route(const struct guid *m, struct gnutella_node *d, int cnt);
 
 #endif	/* _core_dh_h_ */
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Download source quality tracking.
+ *
+ * For each server from which we download, we keep the measured upload
+ * speed and HTTP latency (both as computed by the download layer), along
+ * with a short history of served chunks and errors.  This information is
+ * persisted so that we can rank servers we already dealt with in the past
+ * as soon as they reappear as sources, instead of having to learn again
+ * that they are slow or unreliable.
+ *
+ * The knowledge is summarized as a score in [0, DLQUAL_SCORE_MAX], servers
+ * we know nothing about being given DLQUAL_NEUTRAL.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "dlqual.h"
+
+#include "hosts.h"
+#include "settings.h"
+
+#include "lib/cq.h"
+#include "lib/dbmw.h"
+#include "lib/dbstore.h"
+#include "lib/gnet_host.h"
+#include "lib/stringify.h"
+#include "lib/tm.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+/**
+ * DBM wrapper to associate a server address with its download quality.
+ */
+static dbmw_t *db_dlqual;
+static char db_dlqual_base[] = "dl_quality";
+static char db_dlqual_what[] = "Download server quality";
+
+#define DLQUAL_DB_CACHE_SIZE	512		/**< Amount of keys to keep in cache */
+#define DLQUAL_DATA_VERSION		0		/**< Serialization version number */
+#define DLQUAL_PRUNE_PERIOD		(3600 * 1000)	/**< 1 hour, in ms */
+#define DLQUAL_SYNC_PERIOD		(60 * 1000)		/**< 1 minute, in ms */
+#define DLQUAL_LIFETIME			(30 * 86400)	/**< 30 days */
+#define DLQUAL_HISTORY			64		/**< Outcomes before halving counts */
+#define DLQUAL_SPEED_REF		16384	/**< Speed yielding half the score */
+#define DLQUAL_LATENCY_REF		2000	/**< Latency halving the score (ms) */
+
+/**
+ * Download quality of a server, as stored to disk.
+ * The structure is serialized first, not written as-is.
+ *
+ * The structure is keyed by the address and port of the server.
+ */
+struct dlqual {
+	time_t first_seen;		/**< When we first recorded that server */
+	time_t last_seen;		/**< Last time we recorded an outcome */
+	uint32 speed;			/**< Average (EMA) upload speed, in bytes/sec */
+	uint32 latency;			/**< HTTP latency, in ms (EMA) */
+	uint32 successes;		/**< Amount of completed requests (decayed) */
+	uint32 errors;			/**< Amount of failed attempts (decayed) */
+};
+
+static cperiodic_t *dlqual_prune_ev;	/**< Expired entries pruning */
+static cperiodic_t *dlqual_sync_ev;		/**< DB sync */
+
+/**
+ * Serialization routine for dlqual.
+ */
+static void
+serialize_dlqual(pmsg_t *mb, const void *data)
+{
+	const struct dlqual *dq = data;
+
+	pmsg_write_u8(mb, DLQUAL_DATA_VERSION);
+	pmsg_write_time(mb, dq->first_seen);
+	pmsg_write_time(mb, dq->last_seen);
+	pmsg_write_be32(mb, dq->speed);
+	pmsg_write_be32(mb, dq->latency);
+	pmsg_write_be32(mb, dq->successes);
+	pmsg_write_be32(mb, dq->errors);
+}
+
+/**
+ * Deserialization routine for dlqual.
+ */
+static void
+deserialize_dlqual(bstr_t *bs, void *valptr, size_t len)
+{
+	struct dlqual *dq = valptr;
+	uint8 version;
+
+	g_assert(sizeof *dq == len);
+
+	bstr_read_u8(bs, &version);
+	bstr_read_time(bs, &dq->first_seen);
+	bstr_read_time(bs, &dq->last_seen);
+	bstr_read_be32(bs, &dq->speed);
+	bstr_read_be32(bs, &dq->latency);
+	bstr_read_be32(bs, &dq->successes);
+	bstr_read_be32(bs, &dq->errors);
+}
+
+/**
+ * Compute the score of a server.
+ *
+ * The score is the product of three factors:
+ *
+ * - the speed factor, which is 1/2 at DLQUAL_SPEED_REF and tends to 1 as
+ *   the speed increases (a server whose speed is unknown gets 1/2);
+ * - the reliability factor, which is the Laplace estimator of the success
+ *   rate, i.e. 1/2 when we know nothing;
+ * - the latency factor, which is 1/2 at DLQUAL_LATENCY_REF.
+ *
+ * @return score in [0, DLQUAL_SCORE_MAX].
+ */
+static uint
+dlqual_score(const struct dlqual *dq)
+{
+	uint64 score;
+
+	if (0 == dq->speed) {
+		score = DLQUAL_SCORE_MAX / 2;
+	} else {
+		score = (uint64) DLQUAL_SCORE_MAX * dq->speed /
+			((uint64) dq->speed + DLQUAL_SPEED_REF);
+	}
+
+	score = 2 * score * (dq->successes + 1) /
+		((uint64) dq->successes + dq->errors + 2);
+
+	score = score * DLQUAL_LATENCY_REF /
+		((uint64) dq->latency + DLQUAL_LATENCY_REF);
+
+	return MIN(score, DLQUAL_SCORE_MAX);
+}
+
+/**
+ * Get quality data from database, returning NULL if not found.
+ */
+static struct dlqual *
+get_dlqual(const gnet_host_t *host)
+{
+	struct dlqual *dq;
+
+	dq = dbmw_read(db_dlqual, host, NULL);
+
+	if (NULL == dq) {
+		if (dbmw_has_ioerr(db_dlqual)) {
+			s_warning_once_per(LOG_PERIOD_MINUTE,
+				"DBMW \"%s\" I/O error", dbmw_name(db_dlqual));
+		}
+	}
+
+	return dq;
+}
+
+/**
+ * Get quality data for a server, creating a new entry if needed.
+ *
+ * @return quality data, NULL if the server is not one we can track.
+ */
+static struct dlqual *
+dlqual_get(gnet_host_t *host, const host_addr_t addr, uint16 port)
+{
+	struct dlqual *dq;
+	static struct dlqual new_dq;
+
+	if (NULL == db_dlqual || !host_is_valid(addr, port))
+		return NULL;
+
+	gnet_host_set(host, addr, port);
+	dq = get_dlqual(host);
+
+	if (NULL == dq) {
+		dq = &new_dq;
+		ZERO(dq);
+		dq->first_seen = tm_time();
+	}
+
+	return dq;
+}
+
+/**
+ * Record outcome and update the database.
+ *
+ * @return the new score of the server.
+ */
+static uint
+dlqual_put(const gnet_host_t *host, struct dlqual *dq, bool success)
+{
+	if (success)
+		dq->successes++;
+	else
+		dq->errors++;
+
+	/*
+	 * Only keep a limited history so that a server which was unreliable a
+	 * long time ago can redeem itself, and conversely.
+	 */
+
+	if (dq->successes + dq->errors > DLQUAL_HISTORY) {
+		dq->successes /= 2;
+		dq->errors /= 2;
+	}
+
+	dq->last_seen = tm_time();
+	dbmw_write(db_dlqual, host, PTRLEN(dq));
+
+	return dlqual_score(dq);
+}
+
+/**
+ * Lookup what we know about a server.
+ *
+ * @param addr		the address of the server
+ * @param port		the port of the server
+ * @param speed		where persisted speed is written, if not NULL (0 if none)
+ * @param latency	where persisted latency is written, if not NULL (0 if none)
+ *
+ * @return score of the server, DLQUAL_NEUTRAL if unknown.
+ */
+uint
+dlqual_lookup(const host_addr_t addr, uint16 port, uint *speed, uint *latency)
+{
+	gnet_host_t host;
+	struct dlqual *dq;
+	uint score = DLQUAL_NEUTRAL;
+
+	if (speed != NULL)
+		*speed = 0;
+	if (latency != NULL)
+		*latency = 0;
+
+	if (NULL == db_dlqual || !host_is_valid(addr, port))
+		return DLQUAL_NEUTRAL;
+
+	gnet_host_set(&host, addr, port);
+	dq = get_dlqual(&host);
+
+	if (dq != NULL) {
+		if (speed != NULL)
+			*speed = dq->speed;
+		if (latency != NULL)
+			*latency = dq->latency;
+		score = dlqual_score(dq);
+	}
+
+	return score;
+}
+
+/**
+ * Record that a server successfully served a request.
+ *
+ * @param addr		the address of the server
+ * @param port		the port of the server
+ * @param speed		the average speed of the server, in bytes/sec
+ * @param latency	the average HTTP latency of the server, in ms
+ *
+ * @return the new score of the server.
+ */
+uint
+dlqual_success(const host_addr_t addr, uint16 port, uint speed, uint latency)
+{
+	gnet_host_t host;
+	struct dlqual *dq;
+
+	dq = dlqual_get(&host, addr, port);
+	if (NULL == dq)
+		return DLQUAL_NEUTRAL;
+
+	if (speed != 0)
+		dq->speed = speed;
+	dq->latency = latency;
+
+	return dlqual_put(&host, dq, TRUE);
+}
+
+/**
+ * Record that we failed to get data from a server.
+ *
+ * @return the new score of the server.
+ */
+uint
+dlqual_error(const host_addr_t addr, uint16 port)
+{
+	gnet_host_t host;
+	struct dlqual *dq;
+
+	dq = dlqual_get(&host, addr, port);
+	if (NULL == dq)
+		return DLQUAL_NEUTRAL;
+
+	return dlqual_put(&host, dq, FALSE);
+}
+
+/**
+ * DBMW foreach iterator to remove old entries.
+ * @return TRUE if entry must be deleted.
+ */
+static bool
+dlqual_prune(void *key, void *value, size_t u_len, void *u_data)
+{
+	const gnet_host_t *h = key;
+	const struct dlqual *dq = value;
+	time_delta_t d;
+	bool expired;
+
+	(void) u_len;
+	(void) u_data;
+
+	d = delta_time(tm_time(), dq->last_seen);
+	expired = d > DLQUAL_LIFETIME;
+
+	if (GNET_PROPERTY(download_debug) > 5) {
+		g_debug("DLQUAL cached %s score=%u speed=%u latency=%u ok=%u err=%u "
+			"last_seen=%s%s",
+			gnet_host_to_string(h), dlqual_score(dq), dq->speed, dq->latency,
+			dq->successes, dq->errors, compact_time(d),
+			expired ? " [EXPIRED]" : "");
+	}
+
+	return expired;
+}
+
+/**
+ * Prune the database, removing expired servers.
+ */
+static void
+dlqual_prune_old(void)
+{
+	if (GNET_PROPERTY(download_debug)) {
+		g_debug("DLQUAL pruning expired servers (%zu)",
+			dbmw_count(db_dlqual));
+	}
+
+	dbmw_foreach_remove(db_dlqual, dlqual_prune, NULL);
+
+	if (GNET_PROPERTY(download_debug)) {
+		g_debug("DLQUAL pruned expired servers (%zu remaining)",
+			dbmw_count(db_dlqual));
+	}
+}
+
+/**
+ * Callout queue periodic event to expire old entries.
+ */
+static bool
+dlqual_periodic_prune(void *unused_obj)
+{
+	(void) unused_obj;
+
+	dlqual_prune_old();
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Callout queue periodic event to synchronize the disk image.
+ */
+static bool
+dlqual_periodic_sync(void *unused_obj)
+{
+	(void) unused_obj;
+
+	dbstore_sync_flush(db_dlqual);
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Initialize the download quality database.
+ */
+void G_COLD
+dlqual_init(void)
+{
+	dbstore_kv_t kv =
+		{ sizeof(gnet_host_t), gnet_host_length, sizeof(struct dlqual), 0 };
+	dbstore_packing_t packing =
+		{ serialize_dlqual, deserialize_dlqual, NULL };
+
+	g_assert(NULL == db_dlqual);
+
+	db_dlqual = dbstore_open(db_dlqual_what, settings_gnet_db_dir(),
+		db_dlqual_base, kv, packing, DLQUAL_DB_CACHE_SIZE,
+		gnet_host_hash, gnet_host_equal, FALSE);
+
+	dbstore_set_bloom(db_dlqual, settings_gnet_db_dir(), db_dlqual_base);
+
+	dlqual_prune_old();
+
+	dlqual_prune_ev = cq_periodic_main_add(
+		DLQUAL_PRUNE_PERIOD, dlqual_periodic_prune, NULL);
+	dlqual_sync_ev = cq_periodic_main_add(
+		DLQUAL_SYNC_PERIOD, dlqual_periodic_sync, NULL);
+}
+
+/**
+ * Close the download quality database.
+ */
+void
+dlqual_close(void)
+{
+	dbstore_close(db_dlqual, settings_gnet_db_dir(), db_dlqual_base);
+	db_dlqual = NULL;
+	cq_periodic_remove(&dlqual_prune_ev);
+	cq_periodic_remove(&dlqual_sync_ev);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
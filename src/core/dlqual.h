@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Download source quality tracking.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _core_dlqual_h_
+#define _core_dlqual_h_
+
+#include "common.h"
+#include "lib/host_addr.h"
+
+#define DLQUAL_SCORE_MAX	1000	/**< Best possible score */
+#define DLQUAL_NEUTRAL		250		/**< Score of unknown servers */
+#define DLQUAL_POOR			100		/**< Servers scheduled last below that */
+
+/*
+ * Public interface.
+ */
+
+void dlqual_init(void);
+void dlqual_close(void);
+
+uint dlqual_lookup(const host_addr_t addr, uint16 port,
+	uint *speed, uint *latency);
+uint dlqual_success(const host_addr_t addr, uint16 port,
+	uint speed, uint latency);
+uint dlqual_error(const host_addr_t addr, uint16 port);
+
+/**
+ * @return whether score denotes a server we should only use as last resort.
+ */
+static inline bool
+dlqual_is_poor(uint score)
+{
+	return score < DLQUAL_POOR;
+}
+
+#endif /* _core_dlqual_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -99,6 +99,7 @@ struct dmesh {				/**< A download mesh bucket */
 	htable_t *by_host;		/**< Entries indexed by host (IP:port) */
 	htable_t *by_guid;		/**< Entries indexed by GUID (firewalled entries) */
 	time_t last_update;		/**< Timestamp of last insert/expire in the mesh */
+	time_t last_expire;		/**< Timestamp of last expiration sweep */
 	const sha1_t *sha1;		/**< The SHA1 of this mesh */
 };
 
@@ -122,6 +123,7 @@ struct dmesh_entry {
 #define DMESH_CALLOUT	5000		/**< Callout heartbeat every 5 seconds */
 #define DMESH_BAN_VETO	300			/**< 5 minutes, to keep banned entry */
 #define EXPIRE_DELAY	600			/**< 10 minutes after last update */
+#define EXPIRE_PERIOD	60			/**< At most one sweep per minute */
 
 #define FW_MAX_PROXIES	4			/**< At most 4 push-proxies */
 
@@ -587,6 +589,7 @@ dm_alloc(const struct sha1 *sha1)
 
 	WALLOC(dm);
 	dm->last_update = 0;
+	dm->last_expire = tm_time();
 	dm->entries = list_new();
 	dm->sha1 = atom_sha1_get(sha1);
 	dm->by_host = htable_create_any(packed_host_hash_func,
@@ -741,6 +744,10 @@ dm_lifetime(const struct dmesh *dm)
 
 /**
  * Expire entries deemed too old in a given mesh bucket `dm'.
+ *
+ * Since this is called each time an entry is added, the sweep is done at
+ * most every EXPIRE_PERIOD seconds: lifetimes are expressed in hours, and
+ * readers of the mesh skip entries that became stale in the meantime.
  */
 static void
 dm_expire(struct dmesh *dm)
@@ -751,6 +758,10 @@ dm_expire(struct dmesh *dm)
 	long agemax;
 	list_iter_t *iter;
 
+	if (delta_time(now, dm->last_expire) < EXPIRE_PERIOD)
+		return;
+
+	dm->last_expire = now;
 	agemax = dm_lifetime(dm);
 
 	iter = list_iter_before_head(dm->entries);
@@ -781,6 +792,9 @@ dm_expire(struct dmesh *dm)
 
 	list_iter_free(&iter);
 
+	if (NULL == expired)
+		return;
+
 	PSLIST_FOREACH(expired, sl) {
 		struct dmesh_entry *dme = sl->data;
 
@@ -789,7 +803,7 @@ dm_expire(struct dmesh *dm)
 
 	pslist_free(expired);
 
-	dm->last_update = tm_time();
+	dm->last_update = now;
 }
 
 /**
@@ -868,12 +882,12 @@ dmesh_count(const struct sha1 *sha1)
 	dm = hikset_lookup(mesh, sha1);
 
 	/*
-	 * If we have an entry and the last update was done more than
+	 * If we have an entry and the last expiration was done more than
 	 * EXPIRE_DELAY seconds ago, attempt to expire old entries, and
 	 * dispose of the record if none remain.
 	 */
 
-	if (NULL != dm && delta_time(tm_time(), dm->last_update) > EXPIRE_DELAY) {
+	if (NULL != dm && delta_time(tm_time(), dm->last_expire) > EXPIRE_DELAY) {
 		dm_expire(dm);
 
 		if (list_length(dm->entries) == 0) {
@@ -1800,6 +1814,8 @@ dmesh_fill_alternate(const struct sha1 *sha1, gnet_host_t *hvec, int hcnt)
 
 	/*
 	 * First pass: identify good entries that can be requested by hash only.
+	 * Checks requiring a cache lookup are deferred to the second pass, so
+	 * that only the entries we are about to return pay for them.
 	 */
 
 	i = 0;
@@ -1829,12 +1845,6 @@ dmesh_fill_alternate(const struct sha1 *sha1, gnet_host_t *hvec, int hcnt)
 		if (!host_addr_is_ipv4(dme->e.url.addr))
 			continue;
 
-		if (g2_cache_lookup(dme->e.url.addr, dme->e.url.port))
-			continue;			/* Don't pollute with G2-only entries */
-
-		if (local_addr_cache_lookup(dme->e.url.addr, dme->e.url.port))
-			continue;			/* Don't pollute with our recent addresses */
-
 		g_assert(i < MAX_ENTRIES);
 		selected[i++] = dme;
 	}
@@ -1851,16 +1861,23 @@ dmesh_fill_alternate(const struct sha1 *sha1, gnet_host_t *hvec, int hcnt)
 	 * Second pass: choose at most `hcnt' entries at random.
 	 *
 	 * We do this by randomly shuffling the whole array and then selecting
-	 * the first `hcnt' entries.
+	 * the first `hcnt' entries that pass the remaining checks.
 	 */
 
 	SHUFFLE_ARRAY_N(selected, nselected);
 
-	for (i = j = 0; i < nselected && j < hcnt; i++, j++) {
+	for (i = j = 0; i < nselected && j < hcnt; i++) {
 		struct dmesh_entry *dme;
 
 		dme = selected[i];
-		gnet_host_set(&hvec[j], dme->e.url.addr, dme->e.url.port);
+
+		if (g2_cache_lookup(dme->e.url.addr, dme->e.url.port))
+			continue;			/* Don't pollute with G2-only entries */
+
+		if (local_addr_cache_lookup(dme->e.url.addr, dme->e.url.port))
+			continue;			/* Don't pollute with our recent addresses */
+
+		gnet_host_set(&hvec[j++], dme->e.url.addr, dme->e.url.port);
 	}
 
 	return j;		/* Amount we filled in vector */
@@ -1977,6 +1994,8 @@ dmesh_alternate_location(const struct sha1 *sha1,
 	list_iter_t *iter;
 	bool complete_file;
 	bool can_share_partials;
+	time_t now = tm_time();
+	long agemax;
 
 	g_assert(sha1);
 	g_assert(buf);
@@ -2099,7 +2118,6 @@ dmesh_alternate_location(const struct sha1 *sha1,
 		static const char tls_hex[] = "tls=8";	/* Only us at index zero */
 		size_t url_len;
 		struct dmesh_entry ourselves;
-		time_t now = tm_time();
 
 		ourselves.inserted = now;
 		ourselves.stamp = now;
@@ -2147,9 +2165,11 @@ dmesh_alternate_location(const struct sha1 *sha1,
 
 	/*
 	 * Go through the list, selecting new entries that can fit.
-	 * We'll do two passes.  The first pass identifies the candidates.
+	 * We'll do two passes.  The first pass identifies the candidates,
+	 * using only the checks that do not require any lookup.
 	 * The second pass randomly selects items until we fill the room
-	 * allocated.
+	 * allocated, performing the costlier checks only on the entries
+	 * we are about to emit.
 	 */
 
 	ZERO(&selected);
@@ -2161,6 +2181,7 @@ dmesh_alternate_location(const struct sha1 *sha1,
 	i = 0;
 	iter = list_iter_before_head(dm->entries);
 	complete_file = sha1_of_finished_file(sha1);
+	agemax = complete_file ? MAX_LIBLIFETIME : MAX_LIFETIME;
 
 	while (list_iter_has_next(iter)) {
 		struct dmesh_entry *dme = list_iter_next(iter);
@@ -2185,21 +2206,15 @@ dmesh_alternate_location(const struct sha1 *sha1,
 		if (delta_time(dme->inserted, last_sent) <= 0)
 			continue;
 
-		if (host_addr_equiv(dme->e.url.addr, addr))
-			continue;
+		if (delta_time(now, dme->stamp) > agemax)
+			continue;			/* Stale, not swept yet by dm_expire() */
 
-		if (!hcache_addr_within_net(dme->e.url.addr, net))
+		if (host_addr_equiv(dme->e.url.addr, addr))
 			continue;
 
 		if (dme->e.url.idx != URN_INDEX)
 			continue;
 
-		if (g2_cache_lookup(dme->e.url.addr, dme->e.url.port))
-			continue;			/* Don't pollute with G2-only entries */
-
-		if (local_addr_cache_lookup(dme->e.url.addr, dme->e.url.port))
-			continue;			/* Don't pollute with our recent addresses */
-
 		g_assert(i < MAX_ENTRIES);
 
 		selected[i++] = dme;
@@ -2225,13 +2240,24 @@ dmesh_alternate_location(const struct sha1 *sha1,
 
 		g_assert(delta_time(dme->inserted, last_sent) > 0);
 
+		if (!hcache_addr_within_net(dme->e.url.addr, net))
+			continue;
+
+		if (g2_cache_lookup(dme->e.url.addr, dme->e.url.port))
+			continue;			/* Don't pollute with G2-only entries */
+
+		if (local_addr_cache_lookup(dme->e.url.addr, dme->e.url.port))
+			continue;			/* Don't pollute with our recent addresses */
+
 		url_len = dmesh_entry_compact(dme, ARYLEN(url));
 
 		/* Buffer was large enough */
 		g_assert((size_t) -1 != url_len && url_len < sizeof url);
 
-		if (header_fmt_append_value(fmt, url))
-			added = TRUE;
+		if (!header_fmt_append_value(fmt, url))
+			break;				/* Header is full */
+
+		added = TRUE;
 	}
 
 	if (NULL == guid)
@@ -2320,6 +2346,9 @@ dmesh_alternate_location(const struct sha1 *sha1,
 		if (delta_time(dme->inserted, last_sent) <= 0)
 			continue;
 
+		if (delta_time(now, dme->stamp) > agemax)
+			continue;
+
 		if (guid_eq(dme->e.fwh.guid, guid))
 			continue;
 
@@ -43,6 +43,7 @@
 #include "bsched.h"
 #include "clock.h"
 #include "ctl.h"
+#include "dlqual.h"
 #include "dmesh.h"
 #include "features.h"
 #include "gdht.h"
@@ -70,6 +71,8 @@
 #include "sockets.h"
 #include "thex_download.h"
 #include "token.h"
+#include "tracing.h"
+#include "tth_cache.h"
 #include "udp.h"
 #include "uploads.h"
 #include "verify_sha1.h"
@@ -97,6 +100,7 @@
 #include "lib/dbus_util.h"
 #include "lib/dualhash.h"
 #include "lib/endian.h"
+#include "lib/erbtree.h"
 #include "lib/entropy.h"
 #include "lib/file.h"
 #include "lib/file_object.h"
@@ -115,7 +119,6 @@
 #include "lib/magnet.h"
 #include "lib/palloc.h"
 #include "lib/parse.h"
-#include "lib/plist.h"
 #include "lib/pslist.h"
 #include "lib/random.h"
 #include "lib/sequence.h"
@@ -158,6 +161,11 @@
 #define DOWNLOAD_FS_SPACE		16384	/**< Min filesystem free space */
 #define DOWNLOAD_PUSH_FREQ		30		/**< Each 30 secs, we allow sending... */
 #define DOWNLOAD_PUSH_MAX		4		/**< ...4 PUSHes max to a server */
+#define DOWNLOAD_DONTNEED_MIN	(64 * 1024 * 1024)	/**< Large files only */
+#define DOWNLOAD_DONTNEED_WIN	(4 * 1024 * 1024)	/**< Cache drop window */
+#define DOWNLOAD_PREEMPT_GRACE	60		/**< Secs before judging source speed */
+#define DOWNLOAD_PREEMPT_FACTOR	4		/**< Faster source must be 4x faster */
+#define DOWNLOAD_PREEMPT_DELAY	300		/**< Retry delay for preempted source */
 
 #define IO_AVG_RATE		5		/**< Compute global recv rate every 5 secs */
 
@@ -188,6 +196,9 @@ static void download_incomplete_header(struct download *d);
 static bool has_blank_guid(const struct download *d);
 static void download_verify_sha1(struct download *d);
 static void download_verify_tigertree(struct download *d);
+static void download_verify_tigertree_done(struct download *d,
+	const struct tth *tth, uint elapsed,
+	const struct tth *leaves, size_t num_leaves);
 static bool download_get_server_name(struct download *d, header_t *header);
 static bool use_push_proxy(struct download *d);
 static void download_unavailable(struct download *d,
@@ -415,20 +426,16 @@ server_host_info(const struct dl_server *server)
  * This `dl_key' is inserted in the `dl_by_host' hash table were we find a
  * `dl_server' structure describing all the downloads for the given host.
  *
- * All `dl_server' structures are also inserted in the `dl_by_time' struct,
- * where hosts are sorted based on their retry time.
+ * All `dl_server' structures having waiting downloads are also inserted in
+ * the `dl_by_time' tree, where hosts are sorted based on their retry time.
+ * Servers with nothing waiting are not scheduled, so that picking the next
+ * download to start only needs to look at the head of that tree.
  */
 
 static hikset_t *dl_by_host;
 
-#define DHASH_SIZE	(1UL << 10)	/**< Hash list size, must be a power of 2 */
-#define DHASH_MASK 	(DHASH_SIZE - 1)
-#define DL_HASH(x)	((x) & DHASH_MASK)
-
-static struct {
-	plist_t *servers[DHASH_SIZE];	/**< Lists of servers, by retry time */
-	int change[DHASH_SIZE];			/**< Counts changes to the list */
-} dl_by_time;
+static erbtree_t dl_by_time;		/**< Waiting servers, by retry time */
+static uint dl_by_time_change;		/**< Counts changes to the tree */
 
 /**
  * To handle download meshes, where we only know the IP/port of the host and
@@ -1140,8 +1147,10 @@ static int
 dl_server_retry_cmp(const void *p, const void *q)
 {
 	const struct dl_server *a = p, *b = q;
+	int c;
 
-	return CMP(a->retry_after, b->retry_after);
+	c = CMP(a->retry_after, b->retry_after);
+	return 0 != c ? c : ptr_cmp(a, b);
 }
 
 /**
@@ -1310,6 +1319,8 @@ download_init(void)
 {
 	dl_by_host = hikset_create_any(
 		offsetof(struct dl_server, key), dl_key_hash, dl_key_eq);
+	erbtree_init(&dl_by_time, dl_server_retry_cmp,
+		offsetof(struct dl_server, by_time));
 	dl_by_addr = htable_create_any(dl_addr_hash, NULL, dl_addr_eq);
 	dl_by_guid = htable_create(HASH_KEY_FIXED, GUID_RAW_SIZE);
 	dl_by_id = hikset_create(
@@ -1756,32 +1767,36 @@ buffers_strip_trailing(struct download *d, size_t amount)
 /* ----------------------------------------- */
 
 /**
- * Insert server by retry time into the `dl_by_time' structure.
+ * Insert server by retry time into the `dl_by_time' tree, provided it has
+ * waiting downloads and is not already scheduled.
  */
 static void
 dl_by_time_insert(struct dl_server *server)
 {
-	uint idx = DL_HASH(server->retry_after);
-
 	g_assert(dl_server_valid(server));
 
-	dl_by_time.change[idx]++;
-	dl_by_time.servers[idx] = plist_insert_sorted(dl_by_time.servers[idx],
-		server, dl_server_retry_cmp);
+	if (server->scheduled || 0 == server_list_length(server, DL_LIST_WAITING))
+		return;
+
+	dl_by_time_change++;
+	erbtree_insert(&dl_by_time, &server->by_time);
+	server->scheduled = TRUE;
 }
 
 /**
- * Remove server from the `dl_by_time' structure.
+ * Remove server from the `dl_by_time' tree, if it was scheduled.
  */
 static void
 dl_by_time_remove(struct dl_server *server)
 {
-	uint idx = DL_HASH(server->retry_after);
-
 	g_assert(dl_server_valid(server));
 
-	dl_by_time.change[idx]++;
-	dl_by_time.servers[idx] = plist_remove(dl_by_time.servers[idx], server);
+	if (!server->scheduled)
+		return;
+
+	dl_by_time_change++;
+	erbtree_remove(&dl_by_time, &server->by_time);
+	server->scheduled = FALSE;
 }
 
 /**
@@ -1849,9 +1864,10 @@ allocate_server(const struct guid *guid, const host_addr_t addr, uint16 port)
 	server->retry_after = tm_time();
 	server->country = gip_country(addr);
 	server->sha1_counts = htable_create(HASH_KEY_FIXED, SHA1_RAW_SIZE);
+	server->quality = dlqual_lookup(addr, port,
+		&server->speed_avg, &server->latency);
 
 	hikset_insert_key(dl_by_host, &server->key);
-	dl_by_time_insert(server);
 
 	/*
 	 * If host is reacheable directly, its GUID does not matter much to
@@ -2528,6 +2544,7 @@ change_server_addr(struct dl_server *server,
 	key->addr = new_addr;
 	key->port = new_port;
 	server->country = gip_country(new_addr);
+	server->quality = dlqual_lookup(new_addr, new_port, NULL, NULL);
 
 	g_assert(dl_server_valid(server));
 
@@ -3258,6 +3275,8 @@ server_list_insert_download_sorted(struct dl_server *server, enum dl_list idx,
 
 	server_sha1_count_inc(server, d);
 	list_insert_sorted(server_list_by_index(server, idx), d, dl_retry_cmp);
+	if (DL_LIST_WAITING == idx)
+		dl_by_time_insert(server);
 }
 
 static void
@@ -3269,6 +3288,8 @@ server_list_append_download(struct dl_server *server, enum dl_list idx,
 
 	server_sha1_count_inc(server, d);
 	list_append(server_list_by_index(server, idx), d);
+	if (DL_LIST_WAITING == idx)
+		dl_by_time_insert(server);
 }
 
 static void
@@ -3280,6 +3301,8 @@ server_list_prepend_download(struct dl_server *server, enum dl_list idx,
 
 	server_sha1_count_inc(server, d);
 	list_prepend(server_list_by_index(server, idx), d);
+	if (DL_LIST_WAITING == idx)
+		dl_by_time_insert(server);
 }
 
 static struct download *
@@ -3305,6 +3328,8 @@ server_list_remove_download(struct dl_server *server, enum dl_list idx,
 	list_remove(server->list[idx], d);
 	if (0 == server_list_length(server, idx)) {
 		list_free(&server->list[idx]);
+		if (DL_LIST_WAITING == idx)
+			dl_by_time_remove(server);
 	}
 }
 
@@ -4062,9 +4087,12 @@ download_server_retry_after(struct dl_server *server, time_t now, int hold)
 		after = MAX(after, time_advance(now, hold));
 
 	if (server->retry_after != after) {
+		bool scheduled = server->scheduled;
+
 		dl_by_time_remove(server);
 		server->retry_after = after;
-		dl_by_time_insert(server);
+		if (scheduled)
+			dl_by_time_insert(server);
 	}
 }
 
@@ -4416,6 +4444,19 @@ download_socket_connected(gnutella_socket_t *s, void *owner)
 	download_connected(d);
 }
 
+/**
+ * Record that we failed to get anything from the server of the download.
+ */
+static void
+download_server_failed(const struct download *d)
+{
+	struct dl_server *server = d->server;
+
+	g_assert(dl_server_valid(server));
+
+	server->quality = dlqual_error(server->key->addr, server->key->port);
+}
+
 /**
  * Callback invoked when connection failed.
  */
@@ -4430,6 +4471,8 @@ download_socket_connect_failed(gnutella_socket_t *s, void *owner,
 
 	(void) errmsg;
 
+	download_server_failed(d);
+
 	/*
 	 * Socket will be closed by download_fallback_to_push().
 	 *
@@ -4594,6 +4637,11 @@ download_stop_v(struct download *d, download_status_t new_status,
 	g_assert(!DOWNLOAD_IS_STOPPED(d));
 	g_assert(d->status != new_status);
 
+	BTRACE(TRACE_DL_STOP, btrace_addr(download_addr(d), download_port(d)),
+		pointer_to_ulong(d), d->pos, new_status);
+
+	d->preempted = FALSE;
+
 	if (DOWNLOAD_IS_ACTIVE(d)) {
 		g_assert(d->file_info->recvcount > 0);
 		g_assert(d->file_info->recvcount <= d->file_info->refcount);
@@ -4674,6 +4722,8 @@ download_stop_v(struct download *d, download_status_t new_status,
 			else
 				server->speed_avg += (avg >> 1) - (server->speed_avg >> 1);
 		}
+		server->quality = dlqual_success(server->key->addr, server->key->port,
+			server->speed_avg, server->latency);
 		d->data_timeouts = 0;	/* Got a full chunk all right */
 
 		/*
@@ -6568,180 +6618,194 @@ static void
 download_pickup_queued(void)
 {
 	time_t now = tm_time();
-	uint i;
+	rbnode_t *rn;
+	uint last_change;
+	bool use_poor = FALSE;
+	bool skipped_poor;
 
 	/*
-	 * To select downloads, we iterate over the sorted `dl_by_time' list and
-	 * look for something we could schedule.
+	 * To select downloads, we iterate over the sorted `dl_by_time' tree and
+	 * look for something we could schedule.  Only servers with waiting
+	 * downloads are present in the tree, and we stop as soon as we reach
+	 * one whose retry time is in the future.
 	 *
 	 * Note that we jump from one host to the other, even if we have multiple
 	 * things to schedule on the same host: It's better to spread load among
 	 * all hosts first.
+	 *
+	 * Servers with a poor quality score (slow, unreliable or lagging) are
+	 * skipped during the first pass, and only considered if there are still
+	 * free slots once all the other servers were given a chance.
 	 */
 
-	for (i = 0; i < DHASH_SIZE; i++) {
-		plist_t *l;
-		int last_change;
+retry:
+	skipped_poor = FALSE;
 
-		if (download_queue_is_frozen())
-			break;
-
-		if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
-			break;
+	if (download_queue_is_frozen())
+		return;
 
-		if (!bws_can_connect(SOCK_TYPE_DOWNLOAD))
-			break;
+	if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
+		return;
 
-	retry:
-		l = dl_by_time.servers[i];
-		last_change = dl_by_time.change[i];
+	if (!bws_can_connect(SOCK_TYPE_DOWNLOAD))
+		return;
 
-		for (/* NOTHING */; NULL != l; l = plist_next(l)) {
-			struct dl_server *server = l->data;
-			list_iter_t *iter;
-			struct download *d;
-			uint n;
-			bool only_special = FALSE;
+	last_change = dl_by_time_change;
 
-			g_assert(dl_server_valid(server));
+	for (rn = erbtree_first(&dl_by_time); rn != NULL; rn = erbtree_next(rn)) {
+		struct dl_server *server = erbtree_data(&dl_by_time, rn);
+		list_iter_t *iter;
+		struct download *d;
+		uint n;
+		bool only_special = FALSE;
 
-			if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
-				break;
+		g_assert(dl_server_valid(server));
 
-			/*
-			 * List is sorted, so as soon as we go beyond the current time,
-			 * we can stop.
-			 */
+		if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
+			break;
 
-			if (delta_time(now, server->retry_after) < 0)
-				break;
+		/*
+		 * Tree is sorted, so as soon as we go beyond the current time,
+		 * we can stop.
+		 */
 
-			if (server_list_length(server, DL_LIST_WAITING) == 0)
-				continue;
+		if (delta_time(now, server->retry_after) < 0)
+			break;
 
-			if (
-				count_running_on_server(server)
-					>= GNET_PROPERTY(max_host_downloads)
-			) {
-				download_list_send_head_ping(server->list[DL_LIST_WAITING]);
+		g_assert(server_list_length(server, DL_LIST_WAITING) != 0);
 
-				/*
-				 * Normally, special downloads are served by remote servents
-				 * regardless of the amount of upload slots or per host
-				 * restrictions (since these downloads are small, usually).
-				 *
-				 * Hence, allow such special downloads to be scheduled even
-				 * if we reached the configured local maximum.
-				 */
+		if (!use_poor && dlqual_is_poor(server->quality)) {
+			skipped_poor = TRUE;
+			continue;
+		}
 
-				only_special = TRUE;
-			}
+		if (
+			count_running_on_server(server)
+				>= GNET_PROPERTY(max_host_downloads)
+		) {
+			download_list_send_head_ping(server->list[DL_LIST_WAITING]);
 
 			/*
-			 * Avoid hammering servers.  In case we have multiple files queued
-			 * on that server, we must not issue all the requests in a short
-			 * period of time as this can be frowned upon.
+			 * Normally, special downloads are served by remote servents
+			 * regardless of the amount of upload slots or per host
+			 * restrictions (since these downloads are small, usually).
+			 *
+			 * Hence, allow such special downloads to be scheduled even
+			 * if we reached the configured local maximum.
 			 */
 
-			if (delta_time(now, server->last_connect) < DOWNLOAD_CONNECT_DELAY)
-				continue;
+			only_special = TRUE;
+		}
 
-			/*
-			 * OK, select a download within the waiting list, but do not
-			 * remove it yet.  This will be done by download_start().
-			 */
+		/*
+		 * Avoid hammering servers.  In case we have multiple files queued
+		 * on that server, we must not issue all the requests in a short
+		 * period of time as this can be frowned upon.
+		 */
 
-			g_assert(server->list[DL_LIST_WAITING]);	/* Since count != 0 */
+		if (delta_time(now, server->last_connect) < DOWNLOAD_CONNECT_DELAY)
+			continue;
 
-			n = 0;
-			d = NULL;
-			iter = list_iter_before_head(server->list[DL_LIST_WAITING]);
-			while (list_iter_has_next(iter)) {
-				struct download *cur;
+		/*
+		 * OK, select a download within the waiting list, but do not
+		 * remove it yet.  This will be done by download_start().
+		 */
 
-				cur = list_iter_next(iter);
-				download_check(cur);
+		g_assert(server->list[DL_LIST_WAITING]);	/* Since count != 0 */
 
-				if (cur->flags & (DL_F_SUSPENDED | DL_F_PAUSED))
-					continue;
+		n = 0;
+		d = NULL;
+		iter = list_iter_before_head(server->list[DL_LIST_WAITING]);
+		while (list_iter_has_next(iter)) {
+			struct download *cur;
 
-				if (only_special && !download_is_special(cur))
-					continue;
+			cur = list_iter_next(iter);
+			download_check(cur);
 
-				if (download_has_enough_active_sources(cur)) {
-					download_send_head_ping(cur);
-					continue;
-				}
+			if (cur->flags & (DL_F_SUSPENDED | DL_F_PAUSED))
+				continue;
 
-				if (
-					delta_time(now, cur->last_update) <=
-						(time_delta_t) cur->timeout_delay
-				) {
-					download_send_head_ping(cur);
-					continue;
-				}
+			if (only_special && !download_is_special(cur))
+				continue;
 
-				/* Note that we skip over paused and suspended downloads */
-				if (delta_time(now, cur->retry_after) < 0)
-					break;	/* List is sorted */
+			if (download_has_enough_active_sources(cur)) {
+				download_send_head_ping(cur);
+				continue;
+			}
 
-				if (d) {
-					if ((NULL != d->thex) == (NULL != cur->thex)) {
-						/*
-						 * Pick the download with the most progress. Otherwise
-						 * we easily end up with dozens of partials from the
-						 * the server.
-						 */
+			if (
+				delta_time(now, cur->last_update) <=
+					(time_delta_t) cur->timeout_delay
+			) {
+				download_send_head_ping(cur);
+				continue;
+			}
 
-						if (
-							download_total_progress(d)
-								>= download_total_progress(cur)
-						) {
-							download_send_head_ping(cur);
-							continue;
-						}
-					}
+			/* Note that we skip over paused and suspended downloads */
+			if (delta_time(now, cur->retry_after) < 0)
+				break;	/* List is sorted */
+
+			if (d) {
+				if ((NULL != d->thex) == (NULL != cur->thex)) {
+					/*
+					 * Pick the download with the most progress. Otherwise
+					 * we easily end up with dozens of partials from the
+					 * the server.
+					 */
 
-					/* Give priority to THEX downloads */
-					if (d->thex && NULL == cur->thex) {
+					if (
+						download_total_progress(d)
+							>= download_total_progress(cur)
+					) {
 						download_send_head_ping(cur);
 						continue;
 					}
 				}
 
-				if (d)
-					download_send_head_ping(d);
-
-				d = cur;
-
-				/*
-				 * If there are a lot of downloads queued at a single server we
-				 * might spend a lot of time scanning the queue of a download
-				 * to pick. Thus limit the amount of items we're going to take
-				 * into account.
-				 */
-
-				if (n++ > 100)
-					break;
+				/* Give priority to THEX downloads */
+				if (d->thex && NULL == cur->thex) {
+					download_send_head_ping(cur);
+					continue;
+				}
 			}
-			list_iter_free(&iter);
 
-			if (d) {
-				download_start(d, FALSE);
-			}
+			if (d)
+				download_send_head_ping(d);
 
+			d = cur;
 
 			/*
-			 * It's possible that download_start() ended-up changing the
-			 * dl_by_time list we're iterating over.  That's why all changes
-			 * to that list update the dl_by_time_change variable, which we
-			 * snapshot upon entry into the loop.
-			 *		--RAM, 24/08/2002.
+			 * If there are a lot of downloads queued at a single server we
+			 * might spend a lot of time scanning the queue of a download
+			 * to pick. Thus limit the amount of items we're going to take
+			 * into account.
 			 */
 
-			if (last_change != dl_by_time.change[i])
-				goto retry;
+			if (n++ > 100)
+				break;
+		}
+		list_iter_free(&iter);
+
+		if (d) {
+			download_start(d, FALSE);
 		}
+
+
+		/*
+		 * It's possible that download_start() ended-up changing the
+		 * dl_by_time tree we're iterating over.  That's why all changes
+		 * to that tree update the dl_by_time_change variable, which we
+		 * snapshot upon entry into the loop.
+		 *		--RAM, 24/08/2002.
+		 */
+
+		if (last_change != dl_by_time_change)
+			goto retry;
+	}
+
+	if (skipped_poor && !use_poor) {
+		use_poor = TRUE;
+		goto retry;
 	}
 }
 
@@ -9250,6 +9314,8 @@ download_flush(struct download *d, bool *trimmed, bool may_stop)
 
 		iov = buffers_to_iovec(d, &n);
 		ret = file_object_pwritev(d->out_file, iov, n, d->pos);
+		if (ret > 0)
+			file_info_sha1_written(d->file_info, d->pos, iov, n, ret);
 		HFREE_NULL(iov);
 
 		b->mode = DL_BUF_READING;
@@ -9327,10 +9393,44 @@ download_flush(struct download *d, bool *trimmed, bool may_stop)
 	g_assert(d->pos - old_pos == old_held);
 
 	buffers_discard(d);			/* Since we wrote everything... */
+	download_drop_cache(d, old_pos);
 
 	return TRUE;
 }
 
+/**
+ * Let the kernel drop the cached pages of data we flushed for a large file.
+ *
+ * Data of a large file being downloaded is not going to be read back before
+ * the file is complete, so there is no point in letting it evict more useful
+ * pages from the cache.  We advise by whole windows, lagging one window
+ * behind the write position to let the kernel write back the dirty pages
+ * before we ask it to drop them.
+ *
+ * @param d			the download
+ * @param old_pos	the write position before the flush
+ */
+static void
+download_drop_cache(const struct download *d, filesize_t old_pos)
+{
+	const fileinfo_t *fi = d->file_info;
+	filesize_t from, to;
+
+	if (!fi->file_size_known || fi->size < DOWNLOAD_DONTNEED_MIN)
+		return;
+
+	from = old_pos / DOWNLOAD_DONTNEED_WIN;
+	to = d->pos / DOWNLOAD_DONTNEED_WIN;
+
+	if (to == from || 1 == to)
+		return;			/* No new whole window lagging behind */
+
+	from = (0 == from ? 0 : from - 1) * DOWNLOAD_DONTNEED_WIN;
+	to = (to - 1) * DOWNLOAD_DONTNEED_WIN;
+
+	file_object_fadvise_dontneed(d->out_file, from, to - from);
+}
+
 /**
  * Issue download_flush() if needed, discarding silently anything we cannot
  * commit to disk.
@@ -9404,6 +9504,23 @@ download_continue(struct download *d, bool trimmed)
 
 	cd->served_reqs++;		/* We got one more served request */
 
+	/*
+	 * If this source was found to be too slow whilst a faster one is
+	 * waiting, let it go now that its chunk is complete.
+	 */
+
+	if (cd->preempted) {
+		if (GNET_PROPERTY(download_debug))
+			g_debug("preempting slow source for \"%s\" (%.2f%%) at %s",
+				download_basename(cd), 100.0 * download_total_progress(cd),
+				download_host_info(cd));
+
+		gnet_stats_inc_general(GNR_DL_PREEMPTED_SOURCES);
+		download_queue_delay(cd, DOWNLOAD_PREEMPT_DELAY,
+			_("Preempted by faster source"));
+		goto cleanup;
+	}
+
 	/*
 	 * If we had to trim the data requested, it means the server did not
 	 * understand our Range: request properly, and it's going to send us
@@ -12891,6 +13008,22 @@ rx_stack_setup:
 				error);
 			return;
 		}
+
+		/*
+		 * Reserve the space for the whole file now, since chunks will be
+		 * written in random order and would otherwise fragment the file.
+		 */
+
+		if (GNET_PROPERTY(download_preallocate) && fi->file_size_known) {
+			if (
+				0 != file_object_preallocate(d->out_file, 0, fi->size) &&
+				GNET_PROPERTY(download_debug) &&
+				errno != ENOTSUP
+			) {
+				g_warning("%s(): cannot preallocate %s bytes for \"%s\": %m",
+					G_STRFUNC, uint64_to_string(fi->size), fi->pathname);
+			}
+		}
 	}
 
 file_opened:
@@ -12952,6 +13085,9 @@ download_read(struct download *d, pmsg_t *mb)
 
 	fi = d->file_info;
 
+	BTRACE(TRACE_DL_DATA, btrace_addr(download_addr(d), download_port(d)),
+		pointer_to_ulong(d), d->pos, pmsg_size(mb));
+
 	if (buffers_full(d)) {
 		download_queue_delay(d, GNET_PROPERTY(download_retry_stopped_delay),
 			_("Stopped (Read buffer full)"));
@@ -13124,6 +13260,10 @@ download_request_sent(struct download *d)
 	d->last_update = tm_time();
 	tm_now(&d->header_sent);
 
+	BTRACE(TRACE_DL_REQUEST,
+		btrace_addr(download_addr(d), download_port(d)),
+		pointer_to_ulong(d), d->chunk.start, d->chunk.end);
+
 	if (download_pipelining(d)) {
 		g_assert(DOWNLOAD_IS_ACTIVE(d));
 		dl_pipeline_check(d->pipeline);
@@ -15431,12 +15571,17 @@ download_verifying_done(struct download *d)
 
 /**
  * Called when download verification is finished and digest is known.
+ *
+ * When the TTH was computed along with the SHA1, ``tth'' is non-NULL and
+ * ``leaves'' holds the ``num_leaves'' leaves of the computed tree.
  */
 static void
 download_verify_sha1_done(struct download *d,
-	const struct sha1 *sha1, uint elapsed)
+	const struct sha1 *sha1, uint elapsed,
+	const struct tth *tth, const struct tth *leaves, size_t num_leaves)
 {
 	fileinfo_t *fi;
+	bool need_tth;
 
 	download_check(d);
 	g_assert(d->status == GTA_DL_VERIFYING);
@@ -15454,15 +15599,38 @@ download_verify_sha1_done(struct download *d,
 	fi->cha1 = atom_sha1_get(sha1);
 	fi->vrfy_elapsed = elapsed;
 	fi->vrfy_hashed = fi->size;
+	file_info_sha1_forget(fi);
 	file_info_store_binary(fi, TRUE);		/* Resync with computed SHA1 */
 	file_info_changed(fi);
 
+	ignore_add_sha1(file_info_readable_filename(fi), fi->cha1);
+
+	/*
+	 * Record a matching TTH computed along with the SHA1, so that it does
+	 * not need to be computed again once the completed file is shared.
+	 */
+
+	if (tth != NULL && fi->tth != NULL && tth_eq(tth, fi->tth))
+		tth_cache_insert(tth, leaves, num_leaves);
+
+	need_tth = fi->tth != NULL &&
+		(!has_good_sha1(d) || GNET_PROPERTY(tigertree_debug) > 1);
+
+	if (need_tth && tth != NULL) {
+		/*
+		 * No need to read the whole file again to check its TTH.
+		 */
+
+		fi->tth_check = TRUE;
+		gnet_stats_inc_general(GNR_TTH_VERIFICATIONS);
+		download_verify_tigertree_done(d, tth, elapsed, leaves, num_leaves);
+		return;
+	}
+
 	download_set_status(d, GTA_DL_VERIFIED);
 	fi->flags &= ~FI_F_VERIFYING;
 
-	ignore_add_sha1(file_info_readable_filename(fi), fi->cha1);
-
-	if (fi->tth && (!has_good_sha1(d) || GNET_PROPERTY(tigertree_debug) > 1)) {
+	if (need_tth) {
 		download_verify_tigertree(d);
 	} else {
 		download_verifying_done(d);
@@ -15510,6 +15678,7 @@ download_verify_status_unknown(struct download *d, const char *what)
 static void
 download_verify_sha1_error(struct download *d)
 {
+	file_info_sha1_forget(d->file_info);
 	download_verify_status_unknown(d, "SHA1");
 }
 
@@ -15526,14 +15695,21 @@ download_verify_sha1_callback(const struct verify *ctx,
 	case VERIFY_START:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, TRUE);
 		download_verify_sha1_start(d);
+		if (d->file_info->sha1_ctx != NULL)
+			verify_sha1_resume(ctx, d->file_info->sha1_ctx);
+		else if (d->file_info->tth != NULL)
+			verify_sha1_want_tth(ctx);	/* Compute TTH in the same pass */
 		return TRUE;
 	case VERIFY_PROGRESS:
-		download_verify_sha1_progress(d, verify_hashed(ctx));
+		download_verify_sha1_progress(d,
+			d->file_info->sha1_hashed + verify_hashed(ctx));
 		return TRUE;
 	case VERIFY_DONE:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
 		download_verify_sha1_done(d,
-			verify_sha1_digest(ctx), verify_elapsed(ctx));
+			verify_sha1_digest(ctx), verify_elapsed(ctx),
+			verify_sha1_tth_digest(ctx), verify_sha1_tth_leaves(ctx),
+			verify_sha1_tth_leave_count(ctx));
 		return TRUE;
 	case VERIFY_ERROR:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
@@ -15598,8 +15774,23 @@ download_verify_sha1(struct download *d)
 	queue_suspend_downloads_with_file(fi, TRUE);
 	d->flags &= ~DL_F_CLONED;		/* Has to be persisted until SHA-1 is OK */
 
-	inserted = verify_sha1_enqueue(TRUE, download_pathname(d),
-					download_filesize(d), download_verify_sha1_callback, d);
+	/*
+	 * If the leading part of the file was hashed as it was written, only
+	 * the remaining tail needs to be read back.
+	 */
+
+	if (fi->sha1_ctx != NULL) {
+		if (GNET_PROPERTY(verify_debug) > 1) {
+			g_debug("%s: %s already hashed for %s", G_STRFUNC,
+				filesize_to_string(fi->sha1_hashed), download_pathname(d));
+		}
+		inserted = verify_sha1_enqueue_tail(TRUE, download_pathname(d),
+						fi->sha1_hashed, download_filesize(d),
+						download_verify_sha1_callback, d);
+	} else {
+		inserted = verify_sha1_enqueue(TRUE, download_pathname(d),
+						download_filesize(d), download_verify_sha1_callback, d);
+	}
 
 	g_assert(inserted); /* There cannot be duplicates */
 
@@ -16994,6 +17185,86 @@ download_clear_stopped(bool complete,
 }
 
 
+/**
+ * Look for the slowest active source of a file, and flag it for preemption
+ * if a much faster source is waiting for a slot.
+ *
+ * This is only done when the file already has as many active sources as
+ * we allow, since otherwise the faster source will be started anyway.
+ * The flagged source is let go when its current chunk is completed, so as
+ * to not waste what it already sent us.
+ */
+static void
+download_preempt_slowest(const fileinfo_t *fi, time_t now)
+{
+	pslist_t *sl;
+	struct download *slowest = NULL;
+	uint slowest_bps = MAX_INT_VAL(uint);
+	uint best_bps = 0;
+
+	if (!fi->use_swarming || FILE_INFO_COMPLETE(fi))
+		return;
+
+	if (
+		UNSIGNED(fi->recvcount) <
+			GNET_PROPERTY(max_simultaneous_downloads_per_file)
+	)
+		return;
+
+	PSLIST_FOREACH(fi->sources, sl) {
+		struct download *d = sl->data;
+
+		download_check(d);
+
+		if (DOWNLOAD_IS_ACTIVE(d)) {
+			uint bps;
+
+			if (d->preempted)
+				return;			/* Only one at a time */
+
+			if (NULL == d->bio || download_is_special(d))
+				continue;
+
+			if (delta_time(now, d->start_date) < DOWNLOAD_PREEMPT_GRACE)
+				continue;
+
+			bps = bio_avg_bps(d->bio);
+			if (bps < slowest_bps) {
+				slowest = d;
+				slowest_bps = bps;
+			}
+		} else if (GTA_DL_QUEUED == d->status) {
+			const struct dl_server *server = d->server;
+
+			if (d->flags & (DL_F_SUSPENDED | DL_F_PAUSED))
+				continue;
+
+			if (
+				delta_time(now, d->retry_after) < 0 ||
+				delta_time(now, server->retry_after) < 0
+			)
+				continue;
+
+			if (dlqual_is_poor(server->quality))
+				continue;
+
+			best_bps = MAX(best_bps, server->speed_avg);
+		}
+	}
+
+	if (NULL == slowest || best_bps / DOWNLOAD_PREEMPT_FACTOR <= slowest_bps)
+		return;
+
+	slowest->preempted = TRUE;
+
+	if (GNET_PROPERTY(download_debug)) {
+		g_debug("%s(): will preempt \"%s\" at %s (%u B/s), "
+			"a source at %u B/s is waiting",
+			G_STRFUNC, download_basename(slowest),
+			download_host_info(slowest), slowest_bps, best_bps);
+	}
+}
+
 /**
  * Download heartbeat timer.
  */
@@ -17032,6 +17303,7 @@ download_timer(time_t now)
 					fi->recv_amount = 0;
 					fi->recv_last_time = now;
 					file_info_changed(fi);
+					download_preempt_slowest(fi, now);
 
 					entropy_harvest_single(VARLEN(rate));
 				}
@@ -17148,6 +17420,9 @@ download_timer(time_t now)
 				if (DOWNLOAD_IS_ACTIVE(d))
 					d->data_timeouts++;
 
+				if (d->status != GTA_DL_ACTIVE_QUEUED)
+					download_server_failed(d);
+
 				/*
 				 * When the 'timeout' has expired, first check whether the
 				 * download was activly queued. If so, tell parq to retry the
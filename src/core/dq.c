@@ -84,6 +84,7 @@
 #define DQ_LINGER_TIMEOUT	180000 /**< 3 minutes, in ms */
 #define DQ_STATUS_TIMEOUT	40000  /**< 40 s, in ms, to reply to query status */
 #define DQ_MAX_PENDING		3	   /**< Max pending queries we allow */
+#define DQ_MAX_PARALLEL		2	   /**< Max UPs queried at each round */
 #define DQ_MAX_STAT_TIMEOUT	2	   /**< Max # of stat timeouts we allow */
 #define DQ_STAT_THRESHOLD	3	   /**< Request status every 3 UP probed */
 #define DQ_MIN_FOR_GUIDANCE	20	   /**< Request guidance if 20+ new results */
@@ -157,6 +158,7 @@ typedef struct dquery {
 	uint32 up_sent;			/**< # of UPs to which we really sent our query */
 	uint32 last_status;		/**< How many UP queried last time we got status */
 	uint32 pending;			/**< Pending query messages not ACK'ed yet by mq */
+	uint32 pending_horizon;	/**< Horizon of the pending query messages */
 	uint32 max_results;		/**< Max results we're targetting for */
 	uint32 fin_results;		/**< # of results terminating leaf-guided query */
 	uint32 oob_results;		/**< Amount of unclaimed OOB results reported */
@@ -346,6 +348,30 @@ dq_kept_results(dquery_t *dq)
 		dq->results;
 }
 
+/**
+ * @return the average amount of results per host reached, as observed
+ * so far for the query.
+ */
+static double
+dq_results_per_up(const dquery_t *dq)
+{
+	return (double) dq->results / (double) MAX(dq->horizon, 1);
+}
+
+/**
+ * Predict the amount of results we are going to get once all the pending
+ * query messages are sent, based on the yield observed so far.
+ */
+static uint32
+dq_predicted_results(const dquery_t *dq)
+{
+	double expected = dq_results_per_up(dq) * (double) dq->pending_horizon;
+
+	expected = MIN(expected, (double) dq->max_results);
+
+	return dq_kept_results(dq) + (uint32) expected;
+}
+
 /**
  * Select the proper TTL for the next query we're going to send to the
  * specified node, assuming hosts are equally split among the remaining
@@ -369,7 +395,7 @@ dq_select_ttl(dquery_t *dq, gnutella_node_t *node, int connections)
 
 	g_assert(needed > 0);		/* Or query would have been stopped */
 
-	results_per_up = dq->results / MAX(dq->horizon, 1);
+	results_per_up = dq_results_per_up(dq);
 	hosts_to_reach = (double) needed / MAX(results_per_up, (double) 0.000001);
 	hosts_to_reach_via_node = hosts_to_reach / (double) connections;
 
@@ -493,6 +519,13 @@ dq_pmsg_free(pmsg_t *mb, void *arg)
 	dq->pending--;
 	hset_remove(dq->enqueued, pmi->node_id);
 
+	{
+		uint32 h = dq_get_horizon(pmi->degree, pmi->ttl);
+
+		g_assert(dq->pending_horizon >= h);
+		dq->pending_horizon -= h;
+	}
+
 	if (!pmsg_was_sent(mb)) {
 		const struct nid *key;
 		bool found;
@@ -594,15 +627,18 @@ dq_pmsg_by_ttl(dquery_t *dq, int ttl)
 	/*
 	 * Copy does not exist for this TTL.
 	 *
-	 * First, create the data buffer, and copy the data from the
+	 * First, create the data buffer, and copy the header from the
 	 * template to this new buffer.  We assume the original message
-	 * is made of one data buffer only (no data block chaining yet).
+	 * is made of one data buffer only.
 	 */
 
 	t = dq->mb;					/* Our "template" */
 	len = pmsg_size(t);
-	db = pdata_new(len);
-	memcpy(pdata_start(db), pmsg_phys_base(t), len);
+	db = pdata_new(GTA_HEADER_SIZE);
+	memcpy(pdata_start(db), pmsg_phys_base(t), GTA_HEADER_SIZE);
+
+	g_assert(!pmsg_is_chained(t));
+	g_assert(len >= GTA_HEADER_SIZE);
 
 	/*
 	 * Patch the TTL in the new data buffer.
@@ -614,9 +650,21 @@ dq_pmsg_by_ttl(dquery_t *dq, int ttl)
 
 	/*
 	 * Now create a message for this data buffer and save it for later perusal.
+	 *
+	 * The payload is not copied: it is chained to the header, referencing
+	 * the data buffer of the template, so that all the messages we create
+	 * share the same payload.
 	 */
 
-	mb = pmsg_alloc(pmsg_prio(t), db, 0, len);
+	mb = pmsg_alloc(pmsg_prio(t), db, 0, GTA_HEADER_SIZE);
+
+	if (len > GTA_HEADER_SIZE) {
+		pmsg_t *payload = pmsg_clone_plain(t);
+
+		pmsg_discard(payload, GTA_HEADER_SIZE);
+		pmsg_chain_append(mb, payload);
+	}
+
 	dq->by_ttl[ttl - 1] = mb;
 	gmsg_install_presend(mb);
 
@@ -636,17 +684,24 @@ static int
 dq_fill_probe_up(dquery_t *dq, gnutella_node_t **nv, int ncount)
 {
 	const pslist_t *sl;
-	int i = 0;
+	gnutella_node_t **cv;
+	size_t i = 0, cnt, found;
 
 	dquery_check(dq);
 
-	PSLIST_FOREACH(node_all_ultranodes(), sl) {
-		gnutella_node_t *n;
+	/*
+	 * Gather all the candidates first, so that we can check whether they
+	 * can route the query in one batch.
+	 */
 
-		if (i >= ncount)
-			break;
+	cnt = pslist_length(node_all_ultranodes());
+	if (0 == cnt)
+		return 0;
 
-		n = sl->data;
+	WALLOC_ARRAY(cv, cnt);
+
+	PSLIST_FOREACH(node_all_ultranodes(), sl) {
+		gnutella_node_t *n = sl->data;
 
 		/*
 		 * Dont bother sending anything to transient nodes, we're going
@@ -686,15 +741,23 @@ dq_fill_probe_up(dquery_t *dq, gnutella_node_t **nv, int ncount)
 		if (NODE_IN_TX_FLOW_CONTROL(n) || n->hops_flow == 0)
 			continue;
 
-		if (!qrp_node_can_route(n, dq->qhv))
-			continue;
+		g_assert(i < cnt);
+		cv[i++] = n;
+	}
 
-		g_assert(NODE_IS_WRITABLE(n));	/* Checked by qrp_node_can_route() */
+	found = qrp_node_route_filter(dq->qhv, cv, i);
+	if (found > UNSIGNED(ncount))
+		found = ncount;
 
-		nv[i++] = n;		/* Node or one of its leaves could answer */
+	/* Node or one of its leaves could answer */
+	for (i = 0; i < found; i++) {
+		g_assert(NODE_IS_WRITABLE(cv[i]));	/* Checked by QRP filter */
+		nv[i] = cv[i];
 	}
 
-	return i;
+	WFREE_ARRAY(cv, cnt);
+
+	return found;
 }
 
 static void
@@ -1373,6 +1436,7 @@ dq_send_query(dquery_t *dq, gnutella_node_t *n, int ttl, bool probe)
 			nid_to_string2(NODE_ID(n)), (int) NODE_MQUEUE_PENDING(n));
 
 	dq->pending++;
+	dq->pending_horizon += dq_get_horizon(pmi->degree, pmi->ttl);
 
 	/*
 	 * If query is not local, the messages we send are as if we had
@@ -1399,7 +1463,7 @@ dq_send_next(dquery_t *dq)
 	int found;
 	int timeout;
 	int i;
-	bool sent = FALSE;
+	int sent = 0;
 	uint32 results;
 
 	dquery_check(dq);
@@ -1487,6 +1551,22 @@ dq_send_next(dquery_t *dq)
 		return;
 	}
 
+	/*
+	 * Likewise, if the yield observed so far predicts that the pending
+	 * messages will bring all the results we want, wait for them instead
+	 * of widening the search needlessly.
+	 */
+
+	if (dq->pending != 0 && dq_predicted_results(dq) >= dq->max_results) {
+		if (GNET_PROPERTY(dq_debug) > 19)
+			g_debug("DQ[%s] waiting for %u ms (pending=%u, predicted=%u)",
+				nid_to_string(&dq->qid), dq->result_timeout, dq->pending,
+				dq_predicted_results(dq));
+		dq->results_ev = cq_main_insert(
+			dq->result_timeout, dq_results_expired, dq);
+		return;
+	}
+
 	WALLOC_ARRAY(nv, ncount);
 	found = dq_fill_next_up(dq, nv, ncount);
 
@@ -1513,6 +1593,10 @@ dq_send_next(dquery_t *dq)
 	 *
 	 * If the selected TTL is 1 and the node is QRP-capable and says
 	 * it won't match, pick the next...
+	 *
+	 * When the yield observed so far predicts that this query will not
+	 * bring enough results, query up to DQ_MAX_PARALLEL nodes at once
+	 * rather than waiting a full timeout period between each of them.
 	 */
 
 	for (i = 0; i < found; i++) {
@@ -1565,11 +1649,16 @@ dq_send_next(dquery_t *dq)
 		}
 
 		dq_send_query(dq, node, ttl, FALSE);
-		sent = TRUE;
-		break;
+		sent++;
+
+		if (
+			sent >= DQ_MAX_PARALLEL || dq->pending >= DQ_MAX_PENDING ||
+			dq_predicted_results(dq) >= dq->max_results
+		)
+			break;
 	}
 
-	if (!sent)
+	if (0 == sent)
 		goto terminate;
 
 	/*
@@ -1919,7 +2008,7 @@ dq_launch_net(
 		} else {
 			if (GNET_PROPERTY(dq_debug)) {
 				g_warning("DQ %s #%s: "
-					"cannot OOB-proxy query \"%s\" (%s): MUID collision",
+					"cannot OOB-proxy query \"%s\" (%s): refused",
 					node_infostr(n), nid_to_string(NODE_ID(n)),
 					n->data + 2,
 					(flags_valid && (flags & QUERY_F_LEAF_GUIDED)) ?
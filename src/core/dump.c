@@ -83,6 +83,25 @@
  * # to cleanly stop dumps, use this instead of hitting ^C
  * echo set dump_transmitted_gnutella_packets FALSE | gtk-gnutella --shell
  *
+ * Dumping through named pipes is meant for light use: it is synchronous
+ * and stops as soon as the reader cannot keep up.  To capture live traffic
+ * at production rates, the "dump_capture" property enables the capture
+ * mode instead, which writes both RX and TX traffic to packets.pcapng:
+ *
+ * - Packets are copied into an in-memory ring, reserving space with atomic
+ *   operations only, so capturing never takes a lock nor issues a system
+ *   call on the traffic path.  When the ring is full, packets are dropped
+ *   and counted, rather than delaying the traffic.
+ *
+ * - A background thread flushes the ring to the file, by large writes.
+ *
+ * - The "dump_capture_sampling" property can be used to capture only one
+ *   packet out of N in each direction, and the address filters above apply.
+ *
+ * The file uses the pcapng format, with one interface for RX and one for TX
+ * traffic, both of the LINKTYPE_USER0 type.  Each packet holds the same data
+ * as the named pipe dumps: barracuda header(s) followed by the message.
+ *
  * @author Raphael Manfredi
  * @date 2009, 2012
  * @author Christian Biere
@@ -94,13 +113,19 @@
 #include "nodes.h"
 #include "settings.h"
 
+#include "lib/atomic.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/halloc.h"
+#include "lib/iovec.h"
 #include "lib/ipset.h"
 #include "lib/path.h"
 #include "lib/pmsg.h"
 #include "lib/slist.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/thread.h"
+#include "lib/tm.h"
+#include "lib/vmm.h"
 
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
@@ -109,6 +134,34 @@
 
 #define DUMP_BUFFER_MAX	(256 * 1024UL)	/* Max amount we keep in memory */
 
+#define DUMP_RING_SIZE	(4 * 1024 * 1024U)	/* Capture ring, a power of 2 */
+#define DUMP_RING_MASK	(DUMP_RING_SIZE - 1)
+#define DUMP_FLUSH_MS	50				/* Flushing period of the ring */
+#define DUMP_CHUNKS		8				/* Max data chunks per packet */
+#define DUMP_CAPTURE	"packets.pcapng"
+
+/**
+ * Packet capture interfaces.
+ */
+enum dump_iface {
+	DUMP_IF_RX = 0,
+	DUMP_IF_TX,
+
+	DUMP_IF_COUNT
+};
+
+/**
+ * Pcapng block types, plus our own padding block, never written out.
+ */
+#define PCAPNG_SHB		0x0a0d0d0aU		/* Section Header Block */
+#define PCAPNG_IDB		0x00000001U		/* Interface Description Block */
+#define PCAPNG_EPB		0x00000006U		/* Enhanced Packet Block */
+#define DUMP_RING_PAD	0x80000000U		/* Skip to the start of the ring */
+
+#define PCAPNG_MAGIC	0x1a2b3c4dU		/* Byte-order magic */
+#define PCAPNG_EPB_HDR	28				/* EPB length before packet data */
+#define PCAPNG_USER0	147				/* LINKTYPE_USER0 */
+
 /**
  * Barracuda header flags.
  */
@@ -174,6 +227,29 @@ static ipset_t dump_rx_addrs = IPSET_INIT;
 static ipset_t dump_tx_from_addrs = IPSET_INIT;
 static ipset_t dump_tx_to_addrs = IPSET_INIT;
 
+/**
+ * Packet capture ring.
+ *
+ * The ring is made of pcapng blocks, the first word of which is only
+ * written once the block is complete, to commit it.  Offsets are
+ * free-running and wrap around naturally since the ring size is a
+ * power of 2.  Blocks are never split: when a block does not fit before
+ * the end of the ring, a padding block skips to the start of the ring.
+ */
+static struct dump_ring {
+	char *base;					/**< The ring, NULL when not capturing */
+	uint head;					/**< Reservation offset */
+	uint tail;					/**< Flushing offset */
+	uint writers;				/**< Threads writing into the ring */
+	uint seen[DUMP_IF_COUNT];	/**< Packets seen, for sampling */
+	uint captured;				/**< Packets captured */
+	uint dropped;				/**< Packets dropped, ring being full */
+	int fd;						/**< Capture file */
+	uint tid;					/**< Flushing thread */
+	bool enabled;				/**< Whether packets are captured */
+	bool running;				/**< Whether flushing thread must run */
+} dump_ring = { NULL, 0, 0, 0, { 0, 0 }, 0, 0, -1, 0, FALSE, FALSE };
+
 /**
  * Fill dump header with node address information.
  */
@@ -335,6 +411,48 @@ dump_packet_from(struct dump *dump, const gnutella_node_t *node)
 	dump_flush(dump);
 }
 
+/**
+ * Fill the dump headers of relayed or locally-emitted packet.
+ * If ``from'' is NULL, packet was emitted locally.
+ *
+ * @return FALSE if the packet must not be dumped.
+ */
+static bool
+dump_tx_headers(const gnutella_node_t *from, const gnutella_node_t *to,
+	const pmsg_t *mb, struct dump_header *dh_to, struct dump_header *dh_from)
+{
+	/*
+	 * This is only for Gnutella packets, leave DHT messages out.
+	 */
+
+	if (GTA_MSG_DHT == gnutella_header_get_function(pmsg_phys_base(mb)))
+		return FALSE;
+
+	if (!ipset_contains_addr(&dump_tx_to_addrs, to->addr, TRUE))
+		return FALSE;
+
+	if (NULL == from) {
+		gnutella_node_t local;
+		local.peermode = NODE_IS_UDP(to) ? NODE_P_UDP : NODE_P_NORMAL;
+		local.addr = listen_addr();
+		local.port = GNET_PROPERTY(listen_port);
+		if (!ipset_contains_addr(&dump_tx_from_addrs, local.addr, TRUE))
+			return FALSE;
+		dump_header_set(dh_from, &local);
+	} else {
+		if (!ipset_contains_addr(&dump_tx_from_addrs, from->addr, TRUE))
+			return FALSE;
+		dump_header_set(dh_from, from);
+	}
+
+	dump_header_set(dh_to, to);
+	dh_to->data[0] |= DH_F_TO;
+	if (pmsg_prio(mb) != PMSG_P_DATA)
+		dh_to->data[0] |= DH_F_CTRL;
+
+	return TRUE;
+}
+
 /**
  * Dump relayed or locally-emitted packet.
  * If ``from'' is NULL, packet was emitted locally.
@@ -354,39 +472,416 @@ dump_packet_from_to(struct dump *dump,
 	if (!dump_initialize(dump))
 		return;
 
+	if (!dump_tx_headers(from, to, mb, &dh_to, &dh_from))
+		return;
+
+	dump_append(dump, ARYLEN(dh_to.data));
+	dump_append(dump, ARYLEN(dh_from.data));
+	for (/* empty */; mb != NULL; mb = pmsg_cont(mb))
+		dump_append(dump, pmsg_start(mb), pmsg_block_size(mb));
+	dump_flush(dump);
+}
+
+#define DUMP_ROUND4(x)	(((x) + 3) & ~((size_t) 3))
+
+/**
+ * Store 16-bit value in native order into the buffer.
+ *
+ * @return offset after the written value.
+ */
+static inline size_t
+dump_put16(char *buf, size_t off, uint16 v)
+{
+	memcpy(buf + off, &v, sizeof v);
+	return off + sizeof v;
+}
+
+/**
+ * Store 32-bit value in native order into the buffer.
+ *
+ * @return offset after the written value.
+ */
+static inline size_t
+dump_put32(char *buf, size_t off, uint32 v)
+{
+	memcpy(buf + off, &v, sizeof v);
+	return off + sizeof v;
+}
+
+/**
+ * Write data to the capture file.
+ *
+ * @return TRUE if OK, FALSE on error with errno set.
+ */
+static bool
+dump_capture_write(const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len != 0) {
+		ssize_t r = write(dump_ring.fd, p, len);
+
+		if ((ssize_t) -1 == r) {
+			if (EINTR == errno)
+				continue;
+			return FALSE;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Write the pcapng section header and the interface descriptions.
+ *
+ * @return TRUE if OK, FALSE on error with errno set.
+ */
+static bool
+dump_capture_header(void)
+{
+	static const char * const names[DUMP_IF_COUNT] = {
+		"gnutella-rx", "gnutella-tx"
+	};
+	char buf[128];
+	size_t i, off = 0;
+
+	off = dump_put32(buf, off, PCAPNG_SHB);
+	off = dump_put32(buf, off, 28);
+	off = dump_put32(buf, off, PCAPNG_MAGIC);
+	off = dump_put16(buf, off, 1);				/* Major version */
+	off = dump_put16(buf, off, 0);				/* Minor version */
+	off = dump_put32(buf, off, (uint32) -1);	/* Unknown section length */
+	off = dump_put32(buf, off, (uint32) -1);
+	off = dump_put32(buf, off, 28);
+
+	for (i = 0; i < N_ITEMS(names); i++) {
+		size_t len = vstrlen(names[i]);
+		size_t total = 28 + DUMP_ROUND4(len);
+
+		off = dump_put32(buf, off, PCAPNG_IDB);
+		off = dump_put32(buf, off, total);
+		off = dump_put16(buf, off, PCAPNG_USER0);
+		off = dump_put16(buf, off, 0);			/* Reserved */
+		off = dump_put32(buf, off, 0);			/* No snapshot length */
+		off = dump_put16(buf, off, 2);			/* if_name option */
+		off = dump_put16(buf, off, len);
+		memset(buf + off, 0, DUMP_ROUND4(len));
+		memcpy(buf + off, names[i], len);
+		off += DUMP_ROUND4(len);
+		off = dump_put32(buf, off, 0);			/* End of options */
+		off = dump_put32(buf, off, total);
+	}
+
+	g_assert(off <= sizeof buf);
+
+	return dump_capture_write(buf, off);
+}
+
+/**
+ * Capture packet into the ring.
+ *
+ * This can be called from any thread, and never blocks: when the ring is
+ * full, the packet is dropped.
+ *
+ * @param ifc		the capture interface
+ * @param iov		the data chunks making up the captured packet
+ * @param iovcnt	amount of chunks
+ * @param size		original packet size (can exceed what is captured)
+ */
+static void
+dump_capture(enum dump_iface ifc, const iovec_t *iov, size_t iovcnt,
+	size_t size)
+{
+	struct dump_ring *r = &dump_ring;
+	uint32 sampling = GNET_PROPERTY(dump_capture_sampling);
+	size_t caplen, blen, off, i;
+	uint h, need;
+	uint64 ts;
+	tm_t now;
+	char *p;
+
+	atomic_uint_inc(&r->writers);		/* Prevents the ring from going */
+
+	if G_UNLIKELY(!atomic_bool_get(&r->enabled))
+		goto done;
+
+	if (sampling > 1 && 0 != atomic_uint_inc(&r->seen[ifc]) % sampling)
+		goto done;
+
+	caplen = iov_calculate_size(iov, iovcnt);
+	blen = PCAPNG_EPB_HDR + DUMP_ROUND4(caplen) + 4;
+
 	/*
-	 * This is only for Gnutella packets, leave DHT messages out.
+	 * Reserve room in the ring, adding a padding block when the packet
+	 * does not fit before the end of the ring.
 	 */
 
-	if (GTA_MSG_DHT == gnutella_header_get_function(pmsg_phys_base(mb)))
-		return;
+	for (;;) {
+		uint t = atomic_uint_get(&r->tail);
 
-	if (!ipset_contains_addr(&dump_tx_to_addrs, to->addr, TRUE))
+		h = atomic_uint_get(&r->head);
+		off = h & DUMP_RING_MASK;
+		need = blen;
+
+		if (off + blen > DUMP_RING_SIZE)
+			need += DUMP_RING_SIZE - off;
+
+		if G_UNLIKELY(h - t + need > DUMP_RING_SIZE) {
+			atomic_uint_inc(&r->dropped);
+			goto done;
+		}
+
+		if (atomic_uint_xchg_if_eq(&r->head, h, h + need))
+			break;
+	}
+
+	if G_UNLIKELY(need != blen) {
+		atomic_uint_set(ptr_add_offset(r->base, off), DUMP_RING_PAD);
+		off = 0;
+	}
+
+	/*
+	 * Fill the Enhanced Packet Block, committing it by writing its type.
+	 */
+
+	tm_now_exact(&now);
+	ts = (uint64) now.tv_sec * 1000000 + now.tv_usec;
+
+	p = ptr_add_offset(r->base, off);
+	off = dump_put32(p, sizeof(uint32), blen);
+	off = dump_put32(p, off, ifc);
+	off = dump_put32(p, off, ts >> 32);
+	off = dump_put32(p, off, ts & 0xffffffffU);
+	off = dump_put32(p, off, caplen);
+	off = dump_put32(p, off, size);
+
+	for (i = 0; i < iovcnt; i++) {
+		size_t len = iovec_len(&iov[i]);
+
+		memcpy(p + off, iovec_base(&iov[i]), len);
+		off += len;
+	}
+
+	while (0 != (off & 3))
+		p[off++] = '\0';
+
+	off = dump_put32(p, off, blen);
+
+	g_assert(off == blen);
+
+	atomic_mb();
+	atomic_uint_set((uint *) p, PCAPNG_EPB);
+	atomic_uint_inc(&r->captured);
+
+done:
+	atomic_uint_dec(&r->writers);
+}
+
+/**
+ * Flush committed blocks from the ring to the capture file.
+ *
+ * The flushed area is cleared before being handed back, so that stale
+ * data cannot be mistaken for committed blocks.
+ *
+ * @return TRUE if OK, FALSE on write error.
+ */
+static bool
+dump_capture_flush(void)
+{
+	struct dump_ring *r = &dump_ring;
+
+	for (;;) {
+		uint t = atomic_uint_get(&r->tail);
+		size_t off = t & DUMP_RING_MASK, len = 0;
+		uint type, *w;
+
+		do {
+			w = ptr_add_offset(r->base, off + len);
+			type = atomic_uint_get(w);
+			if (type != PCAPNG_EPB)
+				break;
+			len += w[1];		/* Block total length */
+		} while (off + len < DUMP_RING_SIZE);
+
+		if (len != 0) {
+			if (!dump_capture_write(ptr_add_offset(r->base, off), len))
+				return FALSE;
+			memset(ptr_add_offset(r->base, off), 0, len);
+		} else if (DUMP_RING_PAD == type) {
+			*w = 0;
+			len = DUMP_RING_SIZE - off;
+		} else {
+			return TRUE;		/* Nothing more committed */
+		}
+
+		atomic_mb();
+		atomic_uint_set(&r->tail, t + len);
+	}
+}
+
+/**
+ * Capture flushing thread.
+ */
+static void *
+dump_capture_thread(void *unused_arg)
+{
+	(void) unused_arg;
+
+	thread_set_name("dump");
+
+	while (atomic_bool_get(&dump_ring.running)) {
+		if (!dump_capture_flush())
+			goto error;
+		thread_sleep_ms(DUMP_FLUSH_MS);
+	}
+
+	if (dump_capture_flush())
+		return NULL;
+
+	/* FALL THROUGH */
+
+error:
+	s_warning("error writing to %s: %m -- stopping capture", DUMP_CAPTURE);
+	atomic_bool_set(&dump_ring.enabled, FALSE);
+	return NULL;
+}
+
+/**
+ * Start capturing packets.
+ */
+static void
+dump_capture_start(void)
+{
+	struct dump_ring *r = &dump_ring;
+	char *pathname;
+	int id;
+
+	if (r->base != NULL)
 		return;
 
-	if (NULL == from) {
-		gnutella_node_t local;
-		local.peermode = NODE_IS_UDP(to) ? NODE_P_UDP : NODE_P_NORMAL;
-		local.addr = listen_addr();
-		local.port = GNET_PROPERTY(listen_port);
-		if (!ipset_contains_addr(&dump_tx_from_addrs, local.addr, TRUE))
-			return;
-		dump_header_set(&dh_from, &local);
-	} else {
-		if (!ipset_contains_addr(&dump_tx_from_addrs, from->addr, TRUE))
-			return;
-		dump_header_set(&dh_from, from);
+	pathname = make_pathname(settings_config_dir(), DUMP_CAPTURE);
+	r->fd = file_create(pathname, O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	HFREE_NULL(pathname);
+
+	if (r->fd < 0) {
+		g_warning("can't create %s -- disabling capture", DUMP_CAPTURE);
+		goto failed;
 	}
 
-	dump_header_set(&dh_to, to);
-	dh_to.data[0] |= DH_F_TO;
-	if (pmsg_prio(mb) != PMSG_P_DATA)
-		dh_to.data[0] |= DH_F_CTRL;
+	if (!dump_capture_header()) {
+		g_warning("error writing to %s: %m -- disabling capture",
+			DUMP_CAPTURE);
+		goto failed;
+	}
 
-	dump_append(dump, ARYLEN(dh_to.data));
-	dump_append(dump, ARYLEN(dh_from.data));
-	dump_append(dump, pmsg_start(mb), pmsg_size(mb));
-	dump_flush(dump);
+	r->base = vmm_alloc0(DUMP_RING_SIZE);
+	r->head = r->tail = 0;
+	r->captured = r->dropped = 0;
+	ZERO(&r->seen);
+	r->running = TRUE;
+
+	id = thread_create(dump_capture_thread, NULL,
+			THREAD_F_NO_CANCEL | THREAD_F_WARN, THREAD_STACK_MIN);
+
+	if (-1 == id) {
+		r->running = FALSE;
+		vmm_free(r->base, DUMP_RING_SIZE);
+		r->base = NULL;
+		goto failed;
+	}
+
+	r->tid = id;
+	atomic_bool_set(&r->enabled, TRUE);
+	return;
+
+failed:
+	fd_close(&r->fd);
+	gnet_prop_set_boolean_val(PROP_DUMP_CAPTURE, FALSE);
+}
+
+/**
+ * Stop capturing packets, flushing the ring to the capture file.
+ */
+static void
+dump_capture_stop(void)
+{
+	struct dump_ring *r = &dump_ring;
+
+	if (NULL == r->base)
+		return;
+
+	atomic_bool_set(&r->enabled, FALSE);
+
+	while (0 != atomic_uint_get(&r->writers))
+		thread_yield();
+
+	atomic_bool_set(&r->running, FALSE);
+	thread_join(r->tid, NULL);
+
+	g_info("captured %u packet%s into %s, %u dropped",
+		r->captured, plural(r->captured), DUMP_CAPTURE, r->dropped);
+
+	vmm_free(r->base, DUMP_RING_SIZE);
+	r->base = NULL;
+	fd_close(&r->fd);
+}
+
+/**
+ * Capture packet received from node.
+ */
+static void
+dump_capture_rx(const gnutella_node_t *node)
+{
+	struct dump_header dh;
+	iovec_t iov[3];
+
+	if (!ipset_contains_addr(&dump_rx_addrs, node->addr, TRUE))
+		return;
+
+	dump_header_set(&dh, node);
+	iovec_set(&iov[0], dh.data, sizeof dh.data);
+	iovec_set(&iov[1], node->header, sizeof node->header);
+	iovec_set(&iov[2], node->data, node->size);
+
+	dump_capture(DUMP_IF_RX, iov, N_ITEMS(iov),
+		sizeof dh.data + sizeof node->header + node->size);
+}
+
+/**
+ * Capture relayed or locally-emitted packet.
+ * If ``from'' is NULL, packet was emitted locally.
+ */
+static void
+dump_capture_tx(const gnutella_node_t *from, const gnutella_node_t *to,
+	const pmsg_t *mb)
+{
+	struct dump_header dh_to;
+	struct dump_header dh_from;
+	iovec_t iov[DUMP_CHUNKS];
+	size_t n = 0, size;
+
+	if (!dump_tx_headers(from, to, mb, &dh_to, &dh_from))
+		return;
+
+	iovec_set(&iov[n++], dh_to.data, sizeof dh_to.data);
+	iovec_set(&iov[n++], dh_from.data, sizeof dh_from.data);
+	size = sizeof dh_to.data + sizeof dh_from.data;
+
+	/*
+	 * Packets made of too many blocks are truncated, which pcapng supports.
+	 */
+
+	for (/* empty */; mb != NULL; mb = pmsg_cont(mb)) {
+		size_t len = pmsg_block_size(mb);
+
+		if (n < N_ITEMS(iov))
+			iovec_set(&iov[n++], pmsg_start(mb), len);
+		size += len;
+	}
+
+	dump_capture(DUMP_IF_TX, iov, n, size);
 }
 
 /**
@@ -400,6 +895,9 @@ dump_rx_packet(const gnutella_node_t *node)
 	} else if (dump_rx.initialized) {
 		dump_disable(&dump_rx);
 	}
+
+	if G_UNLIKELY(atomic_bool_get(&dump_ring.enabled))
+		dump_capture_rx(node);
 }
 
 /**
@@ -420,6 +918,9 @@ dump_tx_tcp_packet(
 	} else if (dump_tx.initialized) {
 		dump_disable(&dump_tx);
 	}
+
+	if G_UNLIKELY(atomic_bool_get(&dump_ring.enabled))
+		dump_capture_tx(from, to, mb);
 }
 
 /**
@@ -428,7 +929,10 @@ dump_tx_tcp_packet(
 void
 dump_tx_udp_packet(const gnet_host_t *to, const pmsg_t *mb)
 {
-	if (GNET_PROPERTY(dump_transmitted_gnutella_packets)) {
+	bool dump = GNET_PROPERTY(dump_transmitted_gnutella_packets);
+	bool capture = atomic_bool_get(&dump_ring.enabled);
+
+	if (dump || capture) {
 		gnutella_node_t udp;
 
 		g_assert(to != NULL);
@@ -436,17 +940,21 @@ dump_tx_udp_packet(const gnet_host_t *to, const pmsg_t *mb)
 
 		/*
 		 * Fill only the fields which will be perused by
-		 * dump_packet_from_to().
+		 * dump_packet_from_to() and dump_capture_tx().
 		 */
 
 		udp.peermode = NODE_P_UDP;
 		udp.addr = gnet_host_get_addr(to);
 		udp.port = gnet_host_get_port(to);
 
-		dump_packet_from_to(&dump_tx, NULL, &udp, mb);
-	} else if (dump_tx.initialized) {
-		dump_disable(&dump_tx);
+		if (dump)
+			dump_packet_from_to(&dump_tx, NULL, &udp, mb);
+		if (capture)
+			dump_capture_tx(NULL, &udp, mb);
 	}
+
+	if (!dump && dump_tx.initialized)
+		dump_disable(&dump_tx);
 }
 
 /**
@@ -474,6 +982,18 @@ void dump_tx_set_to_addrs(const char *s)
 	ipset_set_addrs(&dump_tx_to_addrs, s);
 }
 
+/**
+ * Start or stop packet capturing.
+ */
+void
+dump_capture_enable(bool on)
+{
+	if (on)
+		dump_capture_start();
+	else
+		dump_capture_stop();
+}
+
 /**
  * Initialize traffic dumping.
  */
@@ -494,6 +1014,8 @@ dump_close(void)
 	if (dump_tx.initialized)
 		dump_disable(&dump_tx);
 
+	dump_capture_stop();
+
 	ipset_clear(&dump_rx_addrs);
 	ipset_clear(&dump_tx_from_addrs);
 	ipset_clear(&dump_tx_to_addrs);
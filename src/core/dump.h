@@ -49,6 +49,7 @@ void dump_tx_udp_packet(const gnet_host_t *to, const pmsg_t *mb);
 void dump_rx_set_addrs(const char *s);
 void dump_tx_set_from_addrs(const char *s);
 void dump_tx_set_to_addrs(const char *s);
+void dump_capture_enable(bool on);
 
 void dump_init(void);
 void dump_close(void);
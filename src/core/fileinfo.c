@@ -69,7 +69,10 @@
 #include "lib/ascii.h"
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/bstr.h"
+#include "lib/compat_pio.h"
 #include "lib/concat.h"
+#include "lib/crc.h"
 #include "lib/crash.h"
 #include "lib/cstr.h"
 #include "lib/eclist.h"
@@ -90,10 +93,12 @@
 #include "lib/mempcpy.h"
 #include "lib/parse.h"
 #include "lib/path.h"
+#include "lib/pmsg.h"
 #include "lib/pow2.h"
 #include "lib/pslist.h"
 #include "lib/random.h"
 #include "lib/rbtree.h"
+#include "lib/sha1.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/tigertree.h"
@@ -102,6 +107,7 @@
 #include "lib/unsigned.h"
 #include "lib/url.h"
 #include "lib/utf8.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 #include "lib/xmalloc.h"
 
@@ -120,6 +126,7 @@
 #define FI_DHT_QUEUED_DELAY	150			/**< Penalty per queued source */
 #define FI_DHT_RECV_DELAY	600			/**< Penalty per active source */
 #define FI_DHT_RECV_THRESH	5			/**< No query if that many active */
+#define FI_BDP_ROUNDTRIPS	16			/**< Request covers that many RTTs */
 
 /*
  * Aligning requested blocks is just a convenience, to make it easier later
@@ -147,6 +154,7 @@ struct dl_file_chunk {
 	filesize_t to;					/**< Range offset end (byte EXCLUDED) */
 	const download_t *download;		/**< Download which "reserved" range */
 	slink_t lk;						/**< Embedded one-way link */
+	rbnode_t node;					/**< Embedded node in chunk tree */
 };
 
 static inline void
@@ -675,6 +683,136 @@ dl_file_chunk_free(struct dl_file_chunk **fc_ptr)
 	}
 }
 
+/**
+ * Compares two chunks so that two chunks are equal when they overlap.
+ *
+ * This is the ordering of the chunk tree, since chunks in the list never
+ * overlap, and it allows looking up the chunk holding a given offset.
+ */
+static int
+fi_chunk_overlap_cmp(const void *a, const void *b)
+{
+	const struct dl_file_chunk *ca = a, *cb = b;
+
+	if (ca->to <= cb->from)			/* `to' is NOT part of the chunk range */
+		return -1;
+
+	if (cb->to <= ca->from)
+		return +1;
+
+	return 0;		/* Overlapping chunks are equal */
+}
+
+/**
+ * Append chunk at the tail of the chunk list of the fileinfo.
+ *
+ * When loading an inconsistent chunk list, the chunk may overlap with
+ * previous ones, in which case it is not indexed.  Such a list will be
+ * caught by file_info_check_chunklist() and freed anyway.
+ */
+static void
+fi_chunk_append(fileinfo_t *fi, struct dl_file_chunk *fc)
+{
+	dl_file_chunk_check(fc);
+
+	fi_chunk_append(fi, fc);
+	erbtree_insert(&fi->chunktree, &fc->node);
+}
+
+/**
+ * Insert new chunk `nfc' after chunk `fc' in the chunk list of the fileinfo.
+ *
+ * The range of `fc' must have been shrunk beforehand so that the two chunks
+ * do not overlap.
+ */
+static void
+fi_chunk_insert_after(fileinfo_t *fi,
+	struct dl_file_chunk *fc, struct dl_file_chunk *nfc)
+{
+	void *old;
+
+	dl_file_chunk_check(fc);
+	dl_file_chunk_check(nfc);
+	g_assert(fc->to <= nfc->from);
+
+	fi_chunk_insert_after(fi, fc, nfc);
+	old = erbtree_insert(&fi->chunktree, &nfc->node);
+
+	g_assert(NULL == old);
+}
+
+/**
+ * Remove the chunk following `fc' in the chunk list of the fileinfo.
+ *
+ * @return the removed chunk, which must be freed by the caller.
+ */
+static struct dl_file_chunk *
+fi_chunk_remove_after(fileinfo_t *fi, struct dl_file_chunk *fc)
+{
+	struct dl_file_chunk *next;
+
+	next = fi_chunk_remove_after(fi, fc);
+	dl_file_chunk_check(next);
+	erbtree_remove(&fi->chunktree, &next->node);
+
+	return next;
+}
+
+/**
+ * Locate the chunk holding the given file offset.
+ *
+ * @return the chunk, NULL if offset lies beyond the last chunk.
+ */
+static struct dl_file_chunk *
+fi_chunk_lookup(const fileinfo_t *fi, filesize_t pos)
+{
+	struct dl_file_chunk key;
+
+	key.from = pos;
+	key.to = pos + 1;
+
+	return erbtree_lookup(&fi->chunktree, &key);
+}
+
+/**
+ * @return the chunk preceding `fc' in the chunk list, NULL if none.
+ */
+static struct dl_file_chunk *
+fi_chunk_prev(const fileinfo_t *fi, const struct dl_file_chunk *fc)
+{
+	rbnode_t *rn = erbtree_prev(&fc->node);
+
+	return NULL == rn ? NULL : erbtree_data(&fi->chunktree, rn);
+}
+
+/**
+ * Find the first empty chunk overlapping with the [from, to[ range.
+ *
+ * @return the empty chunk, NULL if the whole range is busy or done.
+ */
+static struct dl_file_chunk *
+fi_chunk_find_empty(const fileinfo_t *fi, filesize_t from, filesize_t to)
+{
+	const slink_t *sl;
+	struct dl_file_chunk *fc;
+
+	fc = fi_chunk_lookup(fi, from);
+
+	for (sl = NULL == fc ? NULL : &fc->lk; sl != NULL; sl = eslist_next(sl)) {
+		fc = eslist_data(&fi->chunklist, sl);
+
+		dl_file_chunk_check(fc);
+
+		if (fc->from >= to)
+			break;
+
+		if (DL_CHUNK_EMPTY == fc->status)
+			return fc;
+	}
+
+	return NULL;
+}
+
 static struct dl_avail_chunk *
 dl_avail_chunk_alloc(void)
 {
@@ -1133,6 +1271,7 @@ file_info_chunklist_free(fileinfo_t *fi)
 {
 	file_info_check(fi);
 
+	erbtree_clear(&fi->chunktree);
 	eslist_wfree(&fi->chunklist, sizeof(struct dl_file_chunk));
 }
 
@@ -1165,6 +1304,7 @@ fi_downloading_free(fileinfo_t *fi)
 
 	http_rangeset_free_null(&fi->seen_on_network);
 	fi_tigertree_free(fi);
+	file_info_sha1_forget(fi);
 }
 
 /**
@@ -1306,7 +1446,7 @@ fi_extend_chunklist(fileinfo_t *fi, filesize_t size)
 	fc->from = fi->size;
 	fc->to = size;
 	fc->status = DL_CHUNK_EMPTY;
-	eslist_append(&fi->chunklist, fc);
+	fi_chunk_append(fi, fc);
 
 	/*
 	 * Don't remove/re-insert `fi' from hash tables: when this routine is
@@ -1910,6 +2050,8 @@ file_info_allocate(void)
 	WALLOC0(fi);
 	fi->magic = FI_MAGIC;
 	eslist_init(&fi->chunklist, offsetof(struct dl_file_chunk, lk));
+	erbtree_init(&fi->chunktree, fi_chunk_overlap_cmp,
+		offsetof(struct dl_file_chunk, node));
 	eslist_init(&fi->available, offsetof(struct dl_avail_chunk, lk));
 
 	return fi;
@@ -2171,7 +2313,7 @@ G_STMT_START {				\
 				if (DL_CHUNK_BUSY == fc->status)
 					fc->status = DL_CHUNK_EMPTY;
 
-				eslist_append(&fi->chunklist, fc);
+				fi_chunk_append(fi, fc);
 			}
 			break;
 		default:
@@ -2256,64 +2398,145 @@ eof:
 #undef BAILOUT
 }
 
+/*
+ * Binary fileinfo database.
+ *
+ * The fileinfo records are kept in an append-only binary file, so that
+ * only the records that changed since the last store need to be written.
+ * The file starts with a header, followed by records:
+ *
+ *   0    payload length (4 bytes)
+ *   4    CRC32 of the record, excluding these first 8 bytes (4 bytes)
+ *   8    record type (1 byte), FI_DB_PUT or FI_DB_DEL, then 3 bytes of 0
+ *   12   fileinfo GUID (16 bytes)
+ *   28   payload, the serialized fileinfo for FI_DB_PUT, nothing otherwise
+ *
+ * Integers are stored in big-endian order.  The last record for a GUID
+ * wins.  The file is rewritten when it holds more than twice the amount
+ * of live data.
+ *
+ * Fileinfo records remember the length and CRC of their last persisted
+ * record, so that we can quickly determine whether they changed.
+ */
+
+#define FI_DB_FILE			"fileinfo.bin"
+#define FI_DB_MAGIC			"GTKGFIDB"
+#define FI_DB_VERSION		1
+#define FI_DB_HDRLEN		16			/* magic, version, record header len */
+#define FI_DB_RECLEN		28			/* Record header length */
+#define FI_DB_COMPACT_MIN	(256 * 1024)	/* Minimum size for compaction */
+
+#define FI_DB_PUT			1			/* Record stores fileinfo */
+#define FI_DB_DEL			2			/* Record deletes fileinfo */
+
+#define FI_DB_DATA_VERSION	1			/* Serialization version number */
+
+#define FI_DB_F_PAUSED		(1U << 0)	/* FI_F_PAUSED */
+#define FI_DB_F_SEEDING		(1U << 1)	/* File being seeded */
+#define FI_DB_F_SIZE_UNK	(1U << 2)	/* !file_size_known */
+#define FI_DB_F_NO_SWARM	(1U << 3)	/* !use_swarming */
+#define FI_DB_F_SHA1		(1U << 4)	/* SHA1 follows */
+#define FI_DB_F_TTH			(1U << 5)	/* TTH follows */
+#define FI_DB_F_CHA1		(1U << 6)	/* CHA1 follows */
+
+static const mode_t FI_DB_FILE_MODE = S_IRUSR | S_IWUSR; /* 0600 */
+
+static int fi_db_fd = -1;			/**< Database file, opened lazily */
+static fileoffset_t fi_db_end;		/**< Append offset, 0 if no header yet */
+static fileoffset_t fi_db_live;		/**< Bytes held by live records */
+
 /**
- * Stores a file info record to the config_dir/fileinfo file, and
- * appends it to the output file in question if needed.
+ * Fill the database file header in the supplied buffer.
  */
 static void
-file_info_store_one(FILE *f, fileinfo_t *fi)
+file_info_db_header_fill(char buf[FI_DB_HDRLEN])
 {
-	slink_t *cl;
-	pslist_t *sl;
-	char *path;
-
-	file_info_check(fi);
-
-	/*
-	 * We now persist seeded files in order to be able to resume seeding
-	 * after a crash and a restart, thereby ensuring continuity of the
-	 * user session.
-	 * 		--RAM, 2017-10-21
-	 */
+	memcpy(buf, FI_DB_MAGIC, 8);
+	poke_be32(&buf[8], FI_DB_VERSION);
+	poke_be32(&buf[12], FI_DB_RECLEN);
+}
 
-	if (FI_F_SEEDING == ((FI_F_SEEDING | FI_F_NOSHARE) & fi->flags))
-		goto persist;		/* Skip trailer writes, of course */
+/**
+ * Fill record header, computing the record checksum.
+ */
+static void
+file_info_db_record_fill(char hdr[FI_DB_RECLEN], uint8 type,
+	const struct guid *guid, const void *payload, size_t len)
+{
+	uint32 crc;
 
-	if (fi->flags & (FI_F_TRANSIENT | FI_F_SEEDING | FI_F_STRIPPED))
-		return;
+	poke_be32(&hdr[0], len);
+	hdr[8] = type;
+	hdr[9] = hdr[10] = hdr[11] = 0;
+	memcpy(&hdr[12], guid, GUID_RAW_SIZE);
 
-	if (fi->use_swarming && fi->dirty) {
-		file_info_store_binary(fi, FALSE);
-	}
+	crc = crc32_update(0, &hdr[8], FI_DB_RECLEN - 8);
+	crc = crc32_update(crc, payload, len);
+	poke_be32(&hdr[4], crc);
+}
 
-persist:
+/**
+ * Serialize the fileinfo record.
+ *
+ * @return new message holding the serialized fileinfo.
+ */
+static pmsg_t *
+file_info_db_serialize(const fileinfo_t *fi)
+{
+	const pslist_t *sl;
+	const slink_t *cl;
+	pmsg_t *mb;
+	uint32 flags = 0;
+	size_t len;
 
 	/*
-	 * Keep entries for incomplete or not even started downloads so that the
-	 * download is started/resumed as soon as a search gains a source.
+	 * Compute an upper bound of the serialized size: strings are written
+	 * as a length (at most 10 bytes) followed by their bytes.
 	 */
 
-	if (0 == fi->refcount && fi->done == fi->size) {
-		filestat_t st;
+	len = 64 + 10 + vstrlen(fi->pathname) +
+		SHA1_RAW_SIZE + TTH_RAW_SIZE + SHA1_RAW_SIZE +
+		eslist_count(&fi->chunklist) * (2 * 8 + 1);
 
-		if (-1 == stat(fi->pathname, &st)) {
-			return; 	/* Skip: not referenced, and file no longer exists */
-		}
+	PSLIST_FOREACH(fi->alias, sl) {
+		len += 10 + vstrlen(sl->data);
 	}
 
-	path = filepath_directory(fi->pathname);
-	fprintf(f,
-		"# refcount %u\n"
-		"NAME %s\n"
-		"PATH %s\n"
-		"GUID %s\n"
-		"GENR %u\n",
-		fi->refcount,
-		filepath_basename(fi->pathname),
-		path,
-		guid_hex_str(fi->guid),
-		fi->generation);
-	HFREE_NULL(path);
+	if (FI_F_PAUSED & fi->flags)
+		flags |= FI_DB_F_PAUSED;
+	if (FI_F_SEEDING == ((FI_F_SEEDING | FI_F_NOSHARE) & fi->flags))
+		flags |= FI_DB_F_SEEDING;
+	if (!fi->file_size_known)
+		flags |= FI_DB_F_SIZE_UNK;
+	if (!fi->use_swarming)
+		flags |= FI_DB_F_NO_SWARM;
+	if (fi->sha1 != NULL)
+		flags |= FI_DB_F_SHA1;
+	if (fi->tth != NULL)
+		flags |= FI_DB_F_TTH;
+	if (fi->cha1 != NULL)
+		flags |= FI_DB_F_CHA1;
+
+	mb = pmsg_new(PMSG_P_DATA, NULL, len);
+
+	pmsg_write_u8(mb, FI_DB_DATA_VERSION);
+	pmsg_write_be32(mb, fi->generation);
+	pmsg_write_be32(mb, flags);
+	pmsg_write_be64(mb, fi->size);
+	pmsg_write_be64(mb, fi->done);
+	pmsg_write_be64(mb, fi->stamp);
+	pmsg_write_be64(mb, fi->created);
+	pmsg_write_be64(mb, fi->ntime);
+	pmsg_write_string(mb, fi->pathname, (size_t) -1);
+
+	if (fi->sha1 != NULL)
+		pmsg_write(mb, fi->sha1, SHA1_RAW_SIZE);
+	if (fi->tth != NULL)
+		pmsg_write(mb, fi->tth, TTH_RAW_SIZE);
+	if (fi->cha1 != NULL)
+		pmsg_write(mb, fi->cha1, SHA1_RAW_SIZE);
+
+	pmsg_write_be32(mb, pslist_length(fi->alias));
 
 	PSLIST_FOREACH(fi->alias, sl) {
 		const char *alias = sl->data;
@@ -2323,453 +2546,859 @@ persist:
 			g_warning("skipping fileinfo alias which looks like a urn: "
 				"\"%s\" (filename=\"%s\")",
 				alias, filepath_basename(fi->pathname));
-		} else
-			fprintf(f, "ALIA %s\n", alias);
+			alias = "";		/* Keep the announced count valid */
+		}
+		pmsg_write_string(mb, alias, (size_t) -1);
 	}
 
-	if (fi->sha1)
-		fprintf(f, "SHA1 %s\n", sha1_base32(fi->sha1));
-	if (fi->tth)
-		fprintf(f, "TTH %s\n", tth_base32(fi->tth));
-	if (fi->cha1)
-		fprintf(f, "CHA1 %s\n", sha1_base32(fi->cha1));
-
-	fprintf(f, "SIZE %s\n", filesize_to_string(fi->size));
-	fprintf(f, "DONE %s\n", filesize_to_string(fi->done));
-	fprintf(f, "TIME %s\n", time_t_to_string(fi->stamp));
-	fprintf(f, "CTIM %s\n", time_t_to_string(fi->created));
-	fprintf(f, "NTIM %s\n", time_t_to_string(fi->ntime));
-
-	/*
-	 * The following boolean tags are emitted conditionally because they
-	 * have defaults: we only emit them when the value is not the default.
-	 *
-	 * For instance, "PAUS" is emitted only when TRUE, so when missing, the
-	 * assumption will be that the file downloading was not paused, i.e. that
-	 * the value of that tag was FALSE.
-	 *
-	 * Note that although here we only emit "PAUS 1", we can correctly process
-	 * input with "PAUS 0": although we no longer emit these, we accept them.
-	 *
-	 * 		--RAM, 2017-10-21
-	 */
-
-	if (FI_F_PAUSED & fi->flags)
-		fputs("PAUS 1\n", f);
-
-	if (FI_F_SEEDING == ((FI_F_SEEDING | FI_F_NOSHARE) & fi->flags))
-		fputs("SEED 1\n", f);
-
-	if (!fi->file_size_known)
-		fputs("FSKN 0\n", f);
-
-	if (!fi->use_swarming)
-		fputs("SWRM 0\n", f);
-
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
+	pmsg_write_be32(mb, eslist_count(&fi->chunklist));
+
 	ESLIST_FOREACH(&fi->chunklist, cl) {
 		const struct dl_file_chunk *fc = eslist_data(&fi->chunklist, cl);
 
 		dl_file_chunk_check(fc);
-		fprintf(f, "CHNK %s %s %u\n",
-			filesize_to_string(fc->from), filesize_to_string2(fc->to),
-			(uint) fc->status);
+		pmsg_write_be64(mb, fc->from);
+		pmsg_write_be64(mb, fc->to);
+		pmsg_write_u8(mb, fc->status);
 	}
-	fprintf(f, "\n");
+
+	return mb;
 }
 
 /**
- * Callback for hash table iterator. Used by file_info_store().
+ * Deserialize a fileinfo record.
+ *
+ * Aliases are prepended to the alias list in their storage order, as
+ * file_info_retrieve_finish() expects.
+ *
+ * @return new fileinfo, NULL if the record is damaged.
  */
-static void
-file_info_store_list(void *value, void *user_data)
+static fileinfo_t *
+file_info_db_deserialize(const struct guid *guid, const void *data, size_t len)
 {
-	fileinfo_t *fi = value;
+	fileinfo_t *fi;
+	bstr_t *bs;
+	uint8 version;
+	uint32 flags, i, n;
+	uint64 size, done, stamp, created, ntime;
+	char *s = NULL;
 
-	file_info_check(fi);
-	file_info_store_one(user_data, fi);
-}
+	fi = file_info_allocate();
+	fi->guid = atom_guid_get(guid);
 
-/**
- * Stores the list of output files and their metainfo to the
- * configdir/fileinfo database.
- */
-void
-file_info_store(void)
-{
-	FILE *f;
-	file_path_t fp;
+	bs = bstr_open(data, len, BSTR_F_ERROR);
 
-	file_path_set(&fp, settings_config_dir(), file_info_file);
-	f = file_config_open_write(file_info_what, &fp);
+	bstr_read_u8(bs, &version);
+	bstr_read_be32(bs, &fi->generation);
+	bstr_read_be32(bs, &flags);
+	bstr_read_be64(bs, &size);
+	bstr_read_be64(bs, &done);
+	bstr_read_be64(bs, &stamp);
+	bstr_read_be64(bs, &created);
+	bstr_read_be64(bs, &ntime);
 
-	if (!f)
-		return;
+	if (bstr_has_error(bs) || version > FI_DB_DATA_VERSION)
+		goto damaged;
 
-	file_config_preamble(f, "Fileinfo database");
-
-	fputs(
-		"#\n"
-		"# Format is:\n"
-		"#	NAME <file name>\n"
-		"#	PATH <path>\n"
-		"#	GUID <file ID>\n"
-		"#	GENR <generation number>\n"
-		"#	ALIA <alias file name>\n"
-		"#	SIZE <size>\n"
-		"#	SHA1 <server sha1>\n"
-		"#	TTH  <server tth>\n"
-		"#	CHA1 <computed sha1> [when done only]\n"
-		"#	DONE <bytes done>\n"
-		"#	TIME <last update stamp>\n"
-		"#	CTIM <entry creation time>\n"
-		"#	NTIM <time when new source was seen>\n"
-		"#	PAUS <boolean; paused> [when TRUE only]\n"
-		"#	SEED <boolean; file seeded> [when TRUE only]\n"
-		"#	FSKN <boolean; file_size_known> [when FALSE only]\n"
-		"#	SWRM <boolean; use_swarming> [when FALSE only]\n"
-		"#	CHNK <start> <end+1> <0=hole, 1=busy, 2=done>\n"
-		"#	<blank line>\n"
-		"#\n\n",
-		f
-	);
-
-	hikset_foreach(fi_by_outname, file_info_store_list, f);
-
-	file_config_close(f, &fp);
-	fileinfo_dirty = FALSE;
-}
+	if (size >= ((uint64) 1UL << 63) || done > size)
+		goto damaged;
 
-/**
- * Store global file information cache if dirty.
- */
-void
-file_info_store_if_dirty(void)
-{
-	if (fileinfo_dirty)
-		file_info_store();
-}
+	fi->size = size;
+	fi->done = done;
+	fi->stamp = stamp;
+	fi->modified = stamp;		/* Until we know better */
+	fi->created = created;
+	fi->ntime = ntime;
+	fi->file_size_known = 0 == (flags & FI_DB_F_SIZE_UNK);
+	fi->use_swarming = 0 == (flags & FI_DB_F_NO_SWARM);
+
+	if (flags & FI_DB_F_PAUSED)
+		fi->flags |= FI_F_PAUSED;
+	if (flags & FI_DB_F_SEEDING)
+		fi->flags |= FI_F_SEEDING | FI_F_STRIPPED;
 
-/*
- * Notify interested parties that file info is being removed and free
- * its handle.  Used mainly during final cleanup.
- */
-static void
-fi_dispose(fileinfo_t *fi)
-{
-	file_info_check(fi);
+	if (!bstr_read_string(bs, NULL, &s) || !is_absolute_path(s))
+		goto damaged;
 
-	file_info_drop_handle(fi, "Shutting down");
+	fi->pathname = atom_str_get(s);
+	HFREE_NULL(s);
+
+	if (flags & FI_DB_F_SHA1) {
+		struct sha1 sha1;
+		if (!bstr_read(bs, VARLEN(sha1)))
+			goto damaged;
+		fi->sha1 = atom_sha1_get(&sha1);
+	}
+
+	if (flags & FI_DB_F_TTH) {
+		struct tth tth;
+		if (!bstr_read(bs, VARLEN(tth)))
+			goto damaged;
+		fi->tth = atom_tth_get(&tth);
+	}
+
+	if (flags & FI_DB_F_CHA1) {
+		struct sha1 cha1;
+		if (!bstr_read(bs, VARLEN(cha1)))
+			goto damaged;
+		fi->cha1 = atom_sha1_get(&cha1);
+	}
+
+	if (!bstr_read_be32(bs, &n))
+		goto damaged;
+
+	for (i = 0; i < n; i++) {
+		if (!bstr_read_string(bs, NULL, &s))
+			goto damaged;
+		if ('\0' != *s)
+			fi->alias = pslist_prepend_const(fi->alias, atom_str_get(s));
+		HFREE_NULL(s);
+	}
+
+	if (!bstr_read_be32(bs, &n))
+		goto damaged;
 
 	/*
-	 * Note that normally all fileinfo structures should have been collected
-	 * during the freeing of downloads, so if we come here with a non-zero
-	 * refcount, something is wrong with our memory management.
-	 *
-	 * (refcount of zero is possible if we have a fileinfo entry but no
-	 * download attached to that fileinfo)
+	 * An inconsistent chunk list is not fatal: file_info_retrieve_finish()
+	 * will attempt to recover it from the file trailer.
 	 */
 
-	if (fi->refcount)
-		g_warning("%s(): refcount = %u for \"%s\"",
-			G_STRFUNC, fi->refcount, fi->pathname);
+	for (i = 0; i < n; i++) {
+		struct dl_file_chunk *fc, *prev;
+		uint64 from, to;
+		uint8 status;
 
-	fi->hashed = FALSE;
+		bstr_read_be64(bs, &from);
+		bstr_read_be64(bs, &to);
+		if (!bstr_read_u8(bs, &status))
+			goto damaged;
+
+		prev = eslist_tail(&fi->chunklist);
+
+		if (
+			to <= from || to > fi->size || status > 2U ||
+			from != (prev ? prev->to : 0)
+		) {
+			g_warning("%s(): chunklist is inconsistent for \"%s\"",
+				G_STRFUNC, fi->pathname);
+			break;
+		}
+
+		fc = dl_file_chunk_alloc();
+		fc->from = from;
+		fc->to = to;
+		fc->status = DL_CHUNK_BUSY == status ? DL_CHUNK_EMPTY : status;
+		fi_chunk_append(fi, fc);
+	}
+
+	bstr_free(&bs);
+	return fi;
+
+damaged:
+	g_warning("%s(): damaged fileinfo record for GUID %s: %s",
+		G_STRFUNC, guid_hex_str(guid),
+		bstr_has_error(bs) ? bstr_error(bs) : "invalid value");
+	HFREE_NULL(s);
+	bstr_free(&bs);
 	fi_free(fi);
+	return NULL;
 }
 
 /**
- * Callback for hash table iterator. Used by file_info_close().
+ * Close the database file.
  */
 static void
-file_info_free_sha1_kv(void *val, void *unused_x)
+file_info_db_close(void)
 {
-	const fileinfo_t *fi = val;
-
-	(void) unused_x;
-	file_info_check(fi);
-
-	/* fi structure in value not freed, shared with other hash tables */
+	fd_close(&fi_db_fd);
 }
 
 /**
- * Callback for hash table iterator. Used by file_info_close().
+ * Open the database file for appending, if not already done.
+ *
+ * Trailing garbage seen at load time is discarded and the header is
+ * written when the file is new.
+ *
+ * @return TRUE if OK.
  */
-static void
-file_info_free_namesize_kv(const void *key, void *val, void *unused_x)
+static bool
+file_info_db_open(void)
 {
-	namesize_t *ns = deconstify_pointer(key);
-	pslist_t *list = val;
+	char *path;
 
-	(void) unused_x;
-	namesize_free(ns);
-	pslist_free(list);
+	if (is_valid_fd(fi_db_fd))
+		return TRUE;
 
-	/* fi structure in value not freed, shared with other hash tables */
+	path = make_pathname(settings_config_dir(), FI_DB_FILE);
+	fi_db_fd = file_open(path, O_CREAT | O_RDWR, FI_DB_FILE_MODE);
+
+	if (!is_valid_fd(fi_db_fd))
+		goto failed;
+
+	if (0 == fi_db_end) {
+		char hdr[FI_DB_HDRLEN];
+
+		file_info_db_header_fill(hdr);
+		if (FI_DB_HDRLEN != compat_pwrite(fi_db_fd, ARYLEN(hdr), 0))
+			goto failed;
+		fi_db_end = FI_DB_HDRLEN;
+	}
+
+	if (-1 == ftruncate(fi_db_fd, fi_db_end))
+		goto failed;
+
+	HFREE_NULL(path);
+	return TRUE;
+
+failed:
+	g_warning("%s(): cannot open \"%s\": %m", G_STRFUNC, path);
+	fd_close(&fi_db_fd);
+	HFREE_NULL(path);
+	return FALSE;
 }
 
 /**
- * Callback for hash table iterator. Used by file_info_close().
+ * Append a record to the database file.
+ *
+ * @return TRUE if OK.
  */
-static void
-file_info_free_guid_kv(void *val, void *unused_x)
+static bool
+file_info_db_append(const char hdr[FI_DB_RECLEN],
+	const void *payload, size_t len)
 {
-	fileinfo_t *fi = val;
+	iovec_t iov[2];
+	ssize_t w;
 
-	(void) unused_x;
-	file_info_check(fi);
+	if (!file_info_db_open())
+		return FALSE;
 
-	/*
-	 * fi structure in value not freed, shared with other hash tables
-	 * However, transient file info are only in this hash, so free them!
-	 */
+	iovec_set(&iov[0], hdr, FI_DB_RECLEN);
+	iovec_set(&iov[1], payload, len);
 
-	if (fi->flags & FI_F_TRANSIENT)
-		fi_dispose(fi);
+	w = compat_pwritev(fi_db_fd, iov, N_ITEMS(iov), fi_db_end);
+
+	if G_UNLIKELY(UNSIGNED(w) != FI_DB_RECLEN + len) {
+		if (-1 == w)
+			g_warning("%s(): write error: %m", G_STRFUNC);
+		else
+			g_warning("%s(): partial write (%zd bytes)", G_STRFUNC, w);
+		if (-1 == ftruncate(fi_db_fd, fi_db_end))
+			g_warning("%s(): cannot truncate: %m", G_STRFUNC);
+		return FALSE;
+	}
+
+	fi_db_end += FI_DB_RECLEN + len;
+	return TRUE;
 }
 
 /**
- * Callback for hash table iterator. Used by file_info_close().
+ * Delete the database record of the given GUID.
  */
 static void
-file_info_free_outname_kv(void *val, void *unused_x)
+file_info_db_delete_guid(const struct guid *guid)
 {
-	fileinfo_t *fi = val;
-
-	(void) unused_x;
-	file_info_check(fi);
-
-	/*
-	 * This table is the last one to be freed, and it is also guaranteed to
-	 * contain ALL fileinfo, and only ONCE, by definition.  Thus freeing
-	 * happens here.
-	 */
+	char hdr[FI_DB_RECLEN];
 
-	fi_dispose(fi);
+	file_info_db_record_fill(hdr, FI_DB_DEL, guid, NULL, 0);
+	(void) file_info_db_append(hdr, NULL, 0);
 }
 
 /**
- * Signals that some information in the fileinfo has changed, warranting
- * a display update in the GUI.
+ * Delete the database record of the fileinfo, if persisted.
  */
-void
-file_info_changed(fileinfo_t *fi)
+static void
+file_info_db_delete(fileinfo_t *fi)
 {
 	file_info_check(fi);
-	g_return_if_fail(fi->hashed);
 
-	fi_event_trigger(fi, EV_FI_STATUS_CHANGED);
+	if (0 == fi->db_len)
+		return;
+
+	file_info_db_delete_guid(fi->guid);
+	fi_db_live -= FI_DB_RECLEN + fi->db_len;
+	fi->db_len = fi->db_crc = 0;
 }
 
+/**
+ * Persist the fileinfo into the database, unless its last persisted record
+ * is identical.
+ */
 static void
-src_event_trigger(struct download *d, gnet_src_ev_t id)
+file_info_db_put(fileinfo_t *fi)
 {
-	fileinfo_t *fi;
-
-	download_check(d);
-	g_assert(d->src_handle_valid);
+	char hdr[FI_DB_RECLEN];
+	pmsg_t *mb;
+	size_t len;
+	uint32 crc;
 
-	fi = d->file_info;
 	file_info_check(fi);
 
-	g_assert(UNSIGNED(id) < EV_SRC_EVENTS);
-	event_trigger(src_events[id], T_NORMAL(src_listener_t, (d->src_handle)));
-}
-
-void
-fi_src_status_changed(struct download *d)
-{
-	src_event_trigger(d, EV_SRC_STATUS_CHANGED);
-}
+	mb = file_info_db_serialize(fi);
+	len = pmsg_written_size(mb);
+	file_info_db_record_fill(hdr, FI_DB_PUT, fi->guid, pmsg_start(mb), len);
+	crc = peek_be32(&hdr[4]);
 
-void
-fi_src_info_changed(struct download *d)
-{
-	src_event_trigger(d, EV_SRC_INFO_CHANGED);
-}
+	if (fi->db_len == len && fi->db_crc == crc)
+		goto done;			/* Unchanged */
 
-void
-fi_src_ranges_changed(struct download *d)
-{
-	src_event_trigger(d, EV_SRC_RANGES_CHANGED);
-}
+	if (file_info_db_append(hdr, pmsg_start(mb), len)) {
+		if (fi->db_len != 0)
+			fi_db_live -= FI_DB_RECLEN + fi->db_len;
+		fi_db_live += FI_DB_RECLEN + len;
+		fi->db_len = len;
+		fi->db_crc = crc;
+	}
 
-/**
- * Pre-close some file_info information.
- * This should be separate from file_info_close so that we can avoid circular
- * dependencies with other close routines, in this case with download_close.
- */
-void
-file_info_close_pre(void)
-{
-	src_remove_listener(fi_update_seen_on_network, EV_SRC_RANGES_CHANGED);
-	can_publish_partial_sha1 = FALSE;
+done:
+	pmsg_free(mb);
 }
 
 /**
- * Close and free all file_info structs in the list.
+ * @return whether the fileinfo must be kept in the database.
  */
-void G_COLD
-file_info_close(void)
+static bool
+file_info_db_is_persistent(const fileinfo_t *fi)
 {
-	unsigned i;
-
 	/*
-	 * Freeing callbacks expect that the freeing of the `fi_by_outname'
-	 * table will free the referenced `fi' (since that table MUST contain
-	 * all the known `fi' structs by definition).
+	 * We now persist seeded files in order to be able to resume seeding
+	 * after a crash and a restart, thereby ensuring continuity of the
+	 * user session.
+	 * 		--RAM, 2017-10-21
 	 */
 
-	hikset_foreach(fi_by_sha1, file_info_free_sha1_kv, NULL);
-	htable_foreach(fi_by_namesize, file_info_free_namesize_kv, NULL);
-	hikset_foreach(fi_by_guid, file_info_free_guid_kv, NULL);
-	hikset_foreach(fi_by_outname, file_info_free_outname_kv, NULL);
+	if (FI_F_SEEDING == ((FI_F_SEEDING | FI_F_NOSHARE) & fi->flags))
+		goto check;
 
-	g_assert(0 == idtable_count(src_handle_map));
-	idtable_destroy(src_handle_map);
+	if (fi->flags & (FI_F_TRANSIENT | FI_F_SEEDING | FI_F_STRIPPED))
+		return FALSE;
 
-	for (i = 0; i < N_ITEMS(src_events); i++) {
-		event_destroy(src_events[i]);
-	}
+check:
 
 	/*
-	 * The hash tables may still not be completely empty, but the referenced
-	 * file_info structs are all freed.
-	 *      --Richard, 9/3/2003
+	 * Keep entries for incomplete or not even started downloads so that the
+	 * download is started/resumed as soon as a search gains a source.
 	 */
 
-	g_assert(0 == idtable_count(fi_handle_map));
-	idtable_destroy(fi_handle_map);
+	if (0 == fi->refcount && fi->done == fi->size) {
+		filestat_t st;
 
-	for (i = 0; i < N_ITEMS(fi_events); i++) {
-		event_destroy(fi_events[i]);
+		if (-1 == stat(fi->pathname, &st)) {
+			return FALSE; 	/* Not referenced, and file no longer exists */
+		}
 	}
-	hikset_free_null(&fi_by_sha1);
-	htable_free_null(&fi_by_namesize);
-	hikset_free_null(&fi_by_guid);
-	hikset_free_null(&fi_by_outname);
 
-	HFREE_NULL(tbuf.arena);
+	return TRUE;
 }
 
 /**
- * Inserts a file_info struct into the hash tables.
+ * @return whether the database file is worth compacting.
+ */
+static bool
+file_info_db_needs_compaction(void)
+{
+	return fi_db_end > FI_DB_COMPACT_MIN &&
+		fi_db_end > 2 * (FI_DB_HDRLEN + fi_db_live);
+}
+
+struct file_info_db_compact_context {
+	FILE *f;
+	fileoffset_t live;
+	bool error;
+};
+
+/**
+ * Write one fileinfo record to the new database file.
  */
 static void
-file_info_hash_insert(fileinfo_t *fi)
+file_info_db_compact_write(void *value, void *data)
 {
-	const fileinfo_t *xfi;
+	const fileinfo_t *fi = value;
+	struct file_info_db_compact_context *ctx = data;
+	char hdr[FI_DB_RECLEN];
+	pmsg_t *mb;
+	size_t len;
 
 	file_info_check(fi);
-	g_assert(!fi->hashed);
-	g_assert(fi->guid);
-	g_assert(NULL == fi->sf);
 
-	if (GNET_PROPERTY(fileinfo_debug) > 4)
-		g_debug("FILEINFO insert 0x%p \"%s\" "
-			"(%s/%s bytes done) sha1=%s",
-			cast_to_constpointer(fi), fi->pathname,
-			filesize_to_string(fi->done), filesize_to_string2(fi->size),
-			fi->sha1 ? sha1_base32(fi->sha1) : "none");
+	if (ctx->error || !file_info_db_is_persistent(fi))
+		return;
 
-	/*
-	 * Transient fileinfo is only recorded in the GUID hash table.
-	 */
+	mb = file_info_db_serialize(fi);
+	len = pmsg_written_size(mb);
+	file_info_db_record_fill(hdr, FI_DB_PUT, fi->guid, pmsg_start(mb), len);
 
-	if (fi->flags & FI_F_TRANSIENT)
-		goto transient;
+	if (
+		1 != fwrite(ARYLEN(hdr), 1, ctx->f) ||
+		1 != fwrite(pmsg_start(mb), len, 1, ctx->f)
+	)
+		ctx->error = TRUE;
 
-	/*
-	 * If an entry already exists in the `fi_by_outname' table, then it
-	 * is for THIS fileinfo.  Otherwise, there's a structural assertion
-	 * that has been broken somewhere!
-	 *		--RAM, 01/09/2002
-	 */
+	pmsg_free(mb);
+}
 
-	xfi = hikset_lookup(fi_by_outname, fi->pathname);
-	if (xfi) {
-		file_info_check(xfi);
-		g_assert(xfi == fi);
-	} else {
-		hikset_insert_key(fi_by_outname, &fi->pathname);
+/**
+ * Record what was persisted for the fileinfo in the new database file.
+ */
+static void
+file_info_db_compact_commit(void *value, void *data)
+{
+	fileinfo_t *fi = value;
+	struct file_info_db_compact_context *ctx = data;
+	char hdr[FI_DB_RECLEN];
+	pmsg_t *mb;
+	size_t len;
+
+	if (!file_info_db_is_persistent(fi)) {
+		fi->db_len = fi->db_crc = 0;
+		return;
 	}
 
-	/*
-	 * Likewise, there can be only ONE entry per given SHA1, but the SHA1
-	 * may not be already present at this time, so the entry is optional.
-	 * If it exists, it must be unique though.
-	 *		--RAM, 01/09/2002
-	 */
+	mb = file_info_db_serialize(fi);
+	len = pmsg_written_size(mb);
+	file_info_db_record_fill(hdr, FI_DB_PUT, fi->guid, pmsg_start(mb), len);
+	pmsg_free(mb);
 
-	if (fi->sha1) {
-		xfi = hikset_lookup(fi_by_sha1, fi->sha1);
+	fi->db_len = len;
+	fi->db_crc = peek_be32(&hdr[4]);
+	ctx->live += FI_DB_RECLEN + len;
+}
 
-		if (NULL != xfi && xfi != fi)		/* See comment above */
-			g_error("xfi = %p, fi = %p", (void *) xfi, (void *) fi);
+/**
+ * Rewrite the whole database file from the known fileinfo records.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+file_info_db_compact(void)
+{
+	struct file_info_db_compact_context ctx;
+	char hdr[FI_DB_HDRLEN];
+	file_path_t fp;
 
-		if (NULL == xfi)
-			hikset_insert_key(fi_by_sha1, &fi->sha1);
+	file_path_set(&fp, settings_config_dir(), FI_DB_FILE);
+	ctx.f = file_config_open_write(file_info_what, &fp);
 
-		/*
-		 * To be able to return hits on partial files for which we have SHA1,
-		 * create a shared file entry and record it as searchable.
-		 */
+	if (NULL == ctx.f)
+		return FALSE;
 
-		shared_file_from_fileinfo(fi);
-		if (fi->sf != NULL)
-			share_add_partial(fi->sf);
-	}
+	file_info_db_header_fill(hdr);
+	ctx.error = 1 != fwrite(ARYLEN(hdr), 1, ctx.f);
+	hikset_foreach(fi_by_outname, file_info_db_compact_write, &ctx);
 
-	if (fi->file_size_known) {
-		file_info_hash_insert_name_size(fi);
+	if (ctx.error) {
+		g_warning("%s(): cannot write %s: %m", G_STRFUNC, file_info_what);
+		fclose(ctx.f);
+		return FALSE;
 	}
 
-transient:
 	/*
-	 * Obviously, GUID entries must be unique as well.
+	 * Our appending descriptor must not outlive the former file.
 	 */
 
-	xfi = hikset_lookup(fi_by_guid, fi->guid);
-
-	if (NULL != xfi && xfi != fi)		/* See comment above */
-		g_error("xfi = %p, fi = %p", (void *) xfi, (void *) fi);
-
-	if (NULL == xfi)
-		hikset_insert_key(fi_by_guid, &fi->guid);
+	file_info_db_close();
 
-	/*
-	 * Notify interested parties, update counters.
-	 */
+	if (!file_config_close(ctx.f, &fp))
+		return FALSE;
 
-	fi->hashed = TRUE;
-    fi->fi_handle = file_info_request_handle(fi);
+	ctx.live = 0;
+	hikset_foreach(fi_by_outname, file_info_db_compact_commit, &ctx);
+	fi_db_live = ctx.live;
+	fi_db_end = FI_DB_HDRLEN + ctx.live;
 
-	gnet_prop_incr_guint32(PROP_FI_ALL_COUNT);
+	if (GNET_PROPERTY(fileinfo_debug)) {
+		g_debug("%s(): rewrote %s, %s bytes", G_STRFUNC,
+			file_info_what, fileoffset_t_to_string(fi_db_end));
+	}
 
-    fi_event_trigger(fi, EV_FI_ADDED);
+	return TRUE;
 }
 
 /**
- * Remove fileinfo data from all the hash tables.
+ * Persists a file info record to the config_dir/fileinfo.bin database,
+ * and flushes the trailer of the output file in question if needed.
  */
 static void
-file_info_hash_remove(fileinfo_t *fi)
+file_info_store_one(fileinfo_t *fi)
 {
-	const fileinfo_t *xfi;
-
 	file_info_check(fi);
-	g_assert(fi->hashed);
-	g_assert(fi->guid);
 
-	if (GNET_PROPERTY(fileinfo_debug) > 4) {
-		g_debug("FILEINFO remove %p \"%s\" (%s/%s bytes done) sha1=%s",
-			(void *) fi, fi->pathname,
-			filesize_to_string(fi->done), filesize_to_string2(fi->size),
-			fi->sha1 ? sha1_base32(fi->sha1) : "none");
+	if (
+		fi->use_swarming && fi->dirty &&
+		!(fi->flags & (FI_F_TRANSIENT | FI_F_SEEDING | FI_F_STRIPPED))
+	) {
+		file_info_store_binary(fi, FALSE);
 	}
 
-	file_info_drop_handle(fi, "Discarding file info");
+	if (file_info_db_is_persistent(fi))
+		file_info_db_put(fi);
+	else
+		file_info_db_delete(fi);
+}
+
+/**
+ * Callback for hash table iterator. Used by file_info_store().
+ */
+static void
+file_info_store_list(void *value, void *unused_data)
+{
+	fileinfo_t *fi = value;
+
+	(void) unused_data;
+	file_info_check(fi);
+	file_info_store_one(fi);
+}
+
+/**
+ * Stores the list of output files and their metainfo to the
+ * configdir/fileinfo.bin database.
+ *
+ * Only the records that changed since they were last persisted are
+ * appended to the database, which is rewritten when it holds too many
+ * superseded records.
+ */
+void
+file_info_store(void)
+{
+	hikset_foreach(fi_by_outname, file_info_store_list, NULL);
+
+	if (file_info_db_needs_compaction())
+		file_info_db_compact();
+
+	fileinfo_dirty = FALSE;
+}
+
+/**
+ * Store global file information cache if dirty.
+ */
+void
+file_info_store_if_dirty(void)
+{
+	if (fileinfo_dirty)
+		file_info_store();
+}
+
+/*
+ * Notify interested parties that file info is being removed and free
+ * its handle.  Used mainly during final cleanup.
+ */
+static void
+fi_dispose(fileinfo_t *fi)
+{
+	file_info_check(fi);
+
+	file_info_drop_handle(fi, "Shutting down");
+
+	/*
+	 * Note that normally all fileinfo structures should have been collected
+	 * during the freeing of downloads, so if we come here with a non-zero
+	 * refcount, something is wrong with our memory management.
+	 *
+	 * (refcount of zero is possible if we have a fileinfo entry but no
+	 * download attached to that fileinfo)
+	 */
+
+	if (fi->refcount)
+		g_warning("%s(): refcount = %u for \"%s\"",
+			G_STRFUNC, fi->refcount, fi->pathname);
+
+	fi->hashed = FALSE;
+	fi_free(fi);
+}
+
+/**
+ * Callback for hash table iterator. Used by file_info_close().
+ */
+static void
+file_info_free_sha1_kv(void *val, void *unused_x)
+{
+	const fileinfo_t *fi = val;
+
+	(void) unused_x;
+	file_info_check(fi);
+
+	/* fi structure in value not freed, shared with other hash tables */
+}
+
+/**
+ * Callback for hash table iterator. Used by file_info_close().
+ */
+static void
+file_info_free_namesize_kv(const void *key, void *val, void *unused_x)
+{
+	namesize_t *ns = deconstify_pointer(key);
+	pslist_t *list = val;
+
+	(void) unused_x;
+	namesize_free(ns);
+	pslist_free(list);
+
+	/* fi structure in value not freed, shared with other hash tables */
+}
+
+/**
+ * Callback for hash table iterator. Used by file_info_close().
+ */
+static void
+file_info_free_guid_kv(void *val, void *unused_x)
+{
+	fileinfo_t *fi = val;
+
+	(void) unused_x;
+	file_info_check(fi);
+
+	/*
+	 * fi structure in value not freed, shared with other hash tables
+	 * However, transient file info are only in this hash, so free them!
+	 */
+
+	if (fi->flags & FI_F_TRANSIENT)
+		fi_dispose(fi);
+}
+
+/**
+ * Callback for hash table iterator. Used by file_info_close().
+ */
+static void
+file_info_free_outname_kv(void *val, void *unused_x)
+{
+	fileinfo_t *fi = val;
+
+	(void) unused_x;
+	file_info_check(fi);
+
+	/*
+	 * This table is the last one to be freed, and it is also guaranteed to
+	 * contain ALL fileinfo, and only ONCE, by definition.  Thus freeing
+	 * happens here.
+	 */
+
+	fi_dispose(fi);
+}
+
+/**
+ * Signals that some information in the fileinfo has changed, warranting
+ * a display update in the GUI.
+ */
+void
+file_info_changed(fileinfo_t *fi)
+{
+	file_info_check(fi);
+	g_return_if_fail(fi->hashed);
+
+	fi_event_trigger(fi, EV_FI_STATUS_CHANGED);
+}
+
+static void
+src_event_trigger(struct download *d, gnet_src_ev_t id)
+{
+	fileinfo_t *fi;
+
+	download_check(d);
+	g_assert(d->src_handle_valid);
+
+	fi = d->file_info;
+	file_info_check(fi);
+
+	g_assert(UNSIGNED(id) < EV_SRC_EVENTS);
+	event_trigger(src_events[id], T_NORMAL(src_listener_t, (d->src_handle)));
+}
+
+void
+fi_src_status_changed(struct download *d)
+{
+	src_event_trigger(d, EV_SRC_STATUS_CHANGED);
+}
+
+void
+fi_src_info_changed(struct download *d)
+{
+	src_event_trigger(d, EV_SRC_INFO_CHANGED);
+}
+
+void
+fi_src_ranges_changed(struct download *d)
+{
+	src_event_trigger(d, EV_SRC_RANGES_CHANGED);
+}
+
+/**
+ * Pre-close some file_info information.
+ * This should be separate from file_info_close so that we can avoid circular
+ * dependencies with other close routines, in this case with download_close.
+ */
+void
+file_info_close_pre(void)
+{
+	src_remove_listener(fi_update_seen_on_network, EV_SRC_RANGES_CHANGED);
+	can_publish_partial_sha1 = FALSE;
+}
+
+/**
+ * Close and free all file_info structs in the list.
+ */
+void G_COLD
+file_info_close(void)
+{
+	unsigned i;
+
+	/*
+	 * Freeing callbacks expect that the freeing of the `fi_by_outname'
+	 * table will free the referenced `fi' (since that table MUST contain
+	 * all the known `fi' structs by definition).
+	 */
+
+	hikset_foreach(fi_by_sha1, file_info_free_sha1_kv, NULL);
+	htable_foreach(fi_by_namesize, file_info_free_namesize_kv, NULL);
+	hikset_foreach(fi_by_guid, file_info_free_guid_kv, NULL);
+	hikset_foreach(fi_by_outname, file_info_free_outname_kv, NULL);
+
+	g_assert(0 == idtable_count(src_handle_map));
+	idtable_destroy(src_handle_map);
+
+	for (i = 0; i < N_ITEMS(src_events); i++) {
+		event_destroy(src_events[i]);
+	}
+
+	/*
+	 * The hash tables may still not be completely empty, but the referenced
+	 * file_info structs are all freed.
+	 *      --Richard, 9/3/2003
+	 */
+
+	g_assert(0 == idtable_count(fi_handle_map));
+	idtable_destroy(fi_handle_map);
+
+	for (i = 0; i < N_ITEMS(fi_events); i++) {
+		event_destroy(fi_events[i]);
+	}
+	hikset_free_null(&fi_by_sha1);
+	htable_free_null(&fi_by_namesize);
+	hikset_free_null(&fi_by_guid);
+	hikset_free_null(&fi_by_outname);
+	file_info_db_close();
+
+	HFREE_NULL(tbuf.arena);
+}
+
+/**
+ * Inserts a file_info struct into the hash tables.
+ */
+static void
+file_info_hash_insert(fileinfo_t *fi)
+{
+	const fileinfo_t *xfi;
+
+	file_info_check(fi);
+	g_assert(!fi->hashed);
+	g_assert(fi->guid);
+	g_assert(NULL == fi->sf);
+
+	if (GNET_PROPERTY(fileinfo_debug) > 4)
+		g_debug("FILEINFO insert 0x%p \"%s\" "
+			"(%s/%s bytes done) sha1=%s",
+			cast_to_constpointer(fi), fi->pathname,
+			filesize_to_string(fi->done), filesize_to_string2(fi->size),
+			fi->sha1 ? sha1_base32(fi->sha1) : "none");
+
+	/*
+	 * Transient fileinfo is only recorded in the GUID hash table.
+	 */
+
+	if (fi->flags & FI_F_TRANSIENT)
+		goto transient;
+
+	/*
+	 * If an entry already exists in the `fi_by_outname' table, then it
+	 * is for THIS fileinfo.  Otherwise, there's a structural assertion
+	 * that has been broken somewhere!
+	 *		--RAM, 01/09/2002
+	 */
+
+	xfi = hikset_lookup(fi_by_outname, fi->pathname);
+	if (xfi) {
+		file_info_check(xfi);
+		g_assert(xfi == fi);
+	} else {
+		hikset_insert_key(fi_by_outname, &fi->pathname);
+	}
+
+	/*
+	 * Likewise, there can be only ONE entry per given SHA1, but the SHA1
+	 * may not be already present at this time, so the entry is optional.
+	 * If it exists, it must be unique though.
+	 *		--RAM, 01/09/2002
+	 */
+
+	if (fi->sha1) {
+		xfi = hikset_lookup(fi_by_sha1, fi->sha1);
+
+		if (NULL != xfi && xfi != fi)		/* See comment above */
+			g_error("xfi = %p, fi = %p", (void *) xfi, (void *) fi);
+
+		if (NULL == xfi)
+			hikset_insert_key(fi_by_sha1, &fi->sha1);
+
+		/*
+		 * To be able to return hits on partial files for which we have SHA1,
+		 * create a shared file entry and record it as searchable.
+		 */
+
+		shared_file_from_fileinfo(fi);
+		if (fi->sf != NULL)
+			share_add_partial(fi->sf);
+	}
+
+	if (fi->file_size_known) {
+		file_info_hash_insert_name_size(fi);
+	}
+
+transient:
+	/*
+	 * Obviously, GUID entries must be unique as well.
+	 */
+
+	xfi = hikset_lookup(fi_by_guid, fi->guid);
+
+	if (NULL != xfi && xfi != fi)		/* See comment above */
+		g_error("xfi = %p, fi = %p", (void *) xfi, (void *) fi);
+
+	if (NULL == xfi)
+		hikset_insert_key(fi_by_guid, &fi->guid);
+
+	/*
+	 * Notify interested parties, update counters.
+	 */
+
+	fi->hashed = TRUE;
+    fi->fi_handle = file_info_request_handle(fi);
+
+	gnet_prop_incr_guint32(PROP_FI_ALL_COUNT);
+
+    fi_event_trigger(fi, EV_FI_ADDED);
+}
+
+/**
+ * Remove fileinfo data from all the hash tables.
+ */
+static void
+file_info_hash_remove(fileinfo_t *fi)
+{
+	const fileinfo_t *xfi;
+
+	file_info_check(fi);
+	g_assert(fi->hashed);
+	g_assert(fi->guid);
+
+	if (GNET_PROPERTY(fileinfo_debug) > 4) {
+		g_debug("FILEINFO remove %p \"%s\" (%s/%s bytes done) sha1=%s",
+			(void *) fi, fi->pathname,
+			filesize_to_string(fi->done), filesize_to_string2(fi->size),
+			fi->sha1 ? sha1_base32(fi->sha1) : "none");
+	}
+
+	file_info_drop_handle(fi, "Discarding file info");
 	entropy_harvest_single(PTRLEN(fi->guid));
 
 	g_assert(GNET_PROPERTY(fi_all_count) > 0);
@@ -2926,6 +3555,7 @@ file_info_reparent_all(fileinfo_t *from, fileinfo_t *to)
 	g_assert(0 == from->refcount);
 	g_assert(0 == from->lifecount);
 
+	file_info_db_delete(from);
 	file_info_hash_remove(from);
 	fi_free(from);
 }
@@ -3138,451 +3768,626 @@ fi_reset_chunks(fileinfo_t *fi)
 		fc->from = 0;
 		fc->to = fi->size;
 		fc->status = DL_CHUNK_EMPTY;
-		eslist_append(&fi->chunklist, fc);
+		fi_chunk_append(fi, fc);
 	}
 
-	fi->generation = 0;		/* Restarting from scratch... */
-	fi->done = 0;
-	atom_sha1_free_null(&fi->cha1);
-}
+	fi->generation = 0;		/* Restarting from scratch... */
+	fi->done = 0;
+	atom_sha1_free_null(&fi->cha1);
+}
+
+/**
+ * Copy CHUNK info from binary trailer `trailer' into `fi'.
+ */
+static void
+fi_copy_chunks(fileinfo_t *fi, fileinfo_t *trailer)
+{
+	const struct dl_file_chunk *fc;
+
+	file_info_check(fi);
+	file_info_check(trailer);
+	g_assert(0 == eslist_count(&fi->chunklist));
+	g_assert(file_info_check_chunklist(trailer, TRUE));
+
+	fi->generation = trailer->generation;
+	if (trailer->cha1)
+		fi->cha1 = atom_sha1_get(trailer->cha1);
+
+	ESLIST_FOREACH_DATA(&trailer->chunklist, fc) {
+		dl_file_chunk_check(fc);
+		g_assert(fc->from <= fc->to);
+
+		fi_chunk_append(fi, WCOPY(fc));
+	}
+
+	file_info_merge_adjacent(fi); /* Recalculates also fi->done */
+}
+
+/**
+ * Finish the processing of a fileinfo record read from the fileinfo
+ * database: validate it against the trailer of the output file, then
+ * record it.
+ *
+ * The fileinfo can be replaced by the one read from the trailer, when
+ * it is more recent, hence the record is given by reference.
+ *
+ * @param fi_ptr		the fileinfo to process, pathname already set
+ * @param old_filename	if non-NULL, unsanitized file name to rename
+ *
+ * @return TRUE if the fileinfo was recorded, FALSE if it must be discarded.
+ */
+static bool G_COLD
+file_info_retrieve_finish(fileinfo_t **fi_ptr, const char *old_filename)
+{
+	fileinfo_t *fi = *fi_ptr, *dfi;
+	bool upgraded;
+	bool reload_chunks = FALSE;
+
+	/*
+	 * There can't be duplicates!
+	 */
+
+	dfi = hikset_lookup(fi_by_outname, fi->pathname);
+	if (NULL != dfi) {
+		g_warning("discarding DUPLICATE fileinfo entry for \"%s\"",
+			filepath_basename(fi->pathname));
+		return FALSE;
+	}
+
+	if (0 == fi->size) {
+		fi->file_size_known = FALSE;
+	}
+
+	/*
+	 * If we deserialized an older version, bring it up to date.
+	 */
+
+	upgraded = fi_upgrade_older_version(fi);
+
+	/*
+	 * If we are processing a file being seeded, skip all the
+	 * CHNK, DONE and trailer consistency checks.
+	 *
+	 * If we are not recovering from a crash, seeded entries are
+	 * discarded.
+	 */
+
+	if (FI_F_SEEDING & fi->flags) {
+		if (crash_was_restarted()) {
+			filestat_t sb;
+
+			if (NULL == fi->sha1) {
+				g_warning("%s(): missing SHA1 for seeded file %s",
+					G_STRFUNC, fi->pathname);
+				return FALSE;		/* Fileinfo DB was corrupted, drop seed */
+			}
+
+			if (!file_exists(fi->pathname)) {
+				g_warning("%s(): missing previously seeded file %s",
+					G_STRFUNC, fi->pathname);
+				return FALSE;		/* User probably removed the file */
+			}
+
+			if (-1 == stat(fi->pathname, &sb)) {
+				g_warning("%s(): cannot stat seeded file %s: %m",
+					G_STRFUNC, fi->pathname);
+				return FALSE;
+			}
+
+			/*
+			 * FIXME:
+			 * Would need to check that the file is still accurate if
+			 * the timestamp was changed since last modification.
+			 * For now just warn.
+			 * 		--RAM, 2017-10-23
+			 */
+
+			if (sb.st_mtime != fi->modified) {
+				bool accepted = huge_cached_is_uptodate(
+						fi->pathname, sb.st_size, sb.st_mtime);
 
-/**
- * Copy CHUNK info from binary trailer `trailer' into `fi'.
- */
-static void
-fi_copy_chunks(fileinfo_t *fi, fileinfo_t *trailer)
-{
-	const struct dl_file_chunk *fc;
+				g_warning("%s(): modified seeded file %s: "
+					"last modified=%lu, file mtime=%lu; %s",
+					G_STRFUNC, fi->pathname,
+					(ulong) fi->modified, (ulong) sb.st_mtime,
+					accepted ? "resetting!" : "discarding!");
 
-	file_info_check(fi);
-	file_info_check(trailer);
-	g_assert(0 == eslist_count(&fi->chunklist));
-	g_assert(file_info_check_chunklist(trailer, TRUE));
+				if (!accepted)
+					return FALSE;
 
-	fi->generation = trailer->generation;
-	if (trailer->cha1)
-		fi->cha1 = atom_sha1_get(trailer->cha1);
+				/* This stamp is necessary to be able to upload! */
+				fi->modified = sb.st_mtime;
+				fi->stamp = fi->modified;	/* Persist new value */
+			}
 
-	ESLIST_FOREACH_DATA(&trailer->chunklist, fc) {
-		dl_file_chunk_check(fc);
-		g_assert(fc->from <= fc->to);
+			if (fi->tth != NULL)
+				file_info_recomputed_tth_internal(fi, fi->tth, FALSE);
 
-		eslist_append(&fi->chunklist, WCOPY(fc));
-	}
+			/* Seeding of file will be resumed */
+			goto ready;
+		}
 
-	file_info_merge_adjacent(fi); /* Recalculates also fi->done */
-}
+		if (GNET_PROPERTY(share_debug)) {
+			g_info("SHARE discarding seeded file %s", fi->pathname);
+		}
 
-/**
- * Loads the fileinfo database from disk, and saves a copy in fileinfo.orig.
- */
-void G_COLD
-file_info_retrieve(void)
-{
-	FILE *f;
-	char line[1024];
-	fileinfo_t *fi = NULL;
-	bool empty = TRUE;
-	bool last_was_truncated = FALSE;
-	file_path_t fp;
-	const char *old_filename = NULL;	/* In case we must rename the file */
-	const char *path = NULL;
-	const char *filename = NULL;
+		/* Drop the seeded file now */
+		return FALSE;
+	}
 
 	/*
-	 * We have a complex interaction here: each time a new entry within the
-	 * download mesh is added, file_info_try_to_swarm_with() will be
-	 * called.	Moreover, the download mesh is initialized before us.
+	 * Allow reconstruction of missing information: if no CHNK
+	 * entry was found for the file, fake one, all empty, and reset
+	 * DONE and GENR to 0.
 	 *
-	 * However, we cannot enqueue a download before the download module is
-	 * initialized. And we know it is initialized now because download_init()
-	 * calls us!
+	 * If for instance the partition where temporary files are held
+	 * is lost, a single "grep -v ^CHNK fileinfo > fileinfo.new"
+	 * will be enough to restart without losing the collected
+	 * files.
 	 *
-	 *		--RAM, 20/08/2002
+	 *		--RAM, 31/12/2003
 	 */
 
-	can_swarm = TRUE;			/* Allows file_info_try_to_swarm_with() */
+	if (0 == eslist_count(&fi->chunklist)) {
+		if (fi->file_size_known)
+			g_warning("no CHNK info for \"%s\"", fi->pathname);
+		fi_reset_chunks(fi);
+		reload_chunks = TRUE;	/* Will try to grab from trailer */
+	} else if (!file_info_check_chunklist(fi, FALSE)) {
+		if (fi->file_size_known)
+			g_warning("invalid set of CHNK info for \"%s\"",
+				fi->pathname);
+		fi_reset_chunks(fi);
+		reload_chunks = TRUE;	/* Will try to grab from trailer */
+	}
 
-	file_path_set(&fp, settings_config_dir(), file_info_file);
-	f = file_config_open_read(file_info_what, &fp, 1);
-	if (!f)
-		return;
+	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	while (fgets(ARYLEN(line), f)) {
-		int error;
-		bool truncated = FALSE, damaged;
-		const char *ep;
-		char *value;
-		uint64 v;
+	/*
+	 * If DONE does not match the actual size described by the CHNK
+	 * set, them perhaps the fileinfo database was corrupted?
+	 */
+
+	{
+		filesize_t done = fi->done;
+
+		file_info_merge_adjacent(fi); /* Recalculates also fi->done */
 
 		/*
-		 * The following semi-complex logic attempts to determine whether
-		 * we filled the whole line buffer without reaching the end of the
-		 * physical line.
-		 *
-		 * When truncation occurs, we skip every following "line" we'd get
-		 * up to the point where we no longer need to truncate, at which time
-		 * we'll be re-synchronized on the real end of the line.
+		 * If DONE was missing, fi->done will still be 0.
+		 * In that case, we don't really care since we'll have
+		 * recomputed fi->done in the call above.
 		 */
 
-		truncated = !file_line_chomp_tail(ARYLEN(line), NULL);
-
-		if (last_was_truncated) {
-			last_was_truncated = truncated;
-			g_warning("ignoring fileinfo line after truncation: '%s'", line);
-			continue;
-		} else if (truncated) {
-			last_was_truncated = TRUE;
-			g_warning("ignoring too long fileinfo line: '%s'", line);
-			continue;
+		if (done != 0 && fi->done != done) {
+			g_warning("inconsistent DONE info for \"%s\": "
+				"read %s, computed %s",
+				fi->pathname, filesize_to_string(done),
+				filesize_to_string2(fi->done));
+			reload_chunks = TRUE;	/* Will try to grab from trailer */
 		}
+	}
 
-		if (file_line_is_comment(line))
-			continue;
+	/*
+	 * If `old_filename' is not NULL, then we need to rename
+	 * the file bearing that name into the new (sanitized)
+	 * name, making sure there is no filename conflict.
+	 */
+
+	if (NULL != old_filename) {
+		const char *new_pathname;
+		char *old_path;
+		bool renamed = TRUE;
+
+		old_path = filepath_directory(fi->pathname);
+		new_pathname = file_info_new_outname(old_path,
+							filepath_basename(fi->pathname));
+		HFREE_NULL(old_path);
+		if (NULL == new_pathname)
+			return FALSE;
 
 		/*
-		 * Reaching an empty line means the end of the fileinfo description.
+		 * If fi->done == 0, the file might not exist on disk.
 		 */
 
-		if ('\0' == *line && fi) {
-			fileinfo_t *dfi;
-			bool upgraded;
-			bool reload_chunks = FALSE;
+		if (-1 == rename(fi->pathname, new_pathname) && 0 != fi->done)
+			renamed = FALSE;
 
-			if (filename && path) {
-				char *pathname = make_pathname(path, filename);
-				fi->pathname = atom_str_get(pathname);
-				HFREE_NULL(pathname);
-			} else {
-				/* There's an incomplete fileinfo record */
-				goto reset;
-			}
-			atom_str_free_null(&filename);
-			atom_str_free_null(&path);
+		if (renamed) {
+			g_warning("renamed \"%s\" into sanitized \"%s\"",
+				fi->pathname, new_pathname);
+			atom_str_change(&fi->pathname, new_pathname);
+		} else {
+			g_warning("cannot rename \"%s\" into \"%s\": %m",
+				fi->pathname, new_pathname);
+		}
+		atom_str_free_null(&new_pathname);
+	}
 
-			/*
-			 * There can't be duplicates!
-			 */
+	/*
+	 * Check file trailer information.	The main file is only written
+	 * infrequently and the file's trailer can have more up-to-date
+	 * information.
+	 */
 
-			dfi = hikset_lookup(fi_by_outname, fi->pathname);
-			if (NULL != dfi) {
-				g_warning("discarding DUPLICATE fileinfo entry for \"%s\"",
-					filepath_basename(fi->pathname));
-				goto reset;
-			}
+	dfi = file_info_retrieve_binary(fi->pathname);
+
+	/*
+	 * If we resetted the CHNK list above, grab those from the
+	 * trailer: that cannot be worse than having to download
+	 * everything again...  If there was no valid trailer, all the
+	 * data are lost and the whole file will need to be grabbed again.
+	 */
+
+	if (dfi != NULL && reload_chunks) {
+		fi_copy_chunks(fi, dfi);
+		if (0 != eslist_count(&fi->chunklist)) {
+			g_message("recovered %s downloaded bytes "
+				"from trailer of \"%s\"",
+				filesize_to_string(fi->done), fi->pathname);
+		}
+	} else if (reload_chunks)
+		g_warning("lost all CHNK info for \"%s\" -- downloading again",
+			fi->pathname);
+
+	g_assert(file_info_check_chunklist(fi, TRUE));
+
+	/*
+	 * Special treatment for the GUID: if not present, it will be
+	 * added during retrieval, but it will be different for the
+	 * one in the fileinfo DB and the one on disk.  Set `upgraded'
+	 * to signal that, so that we resync the metainfo below.
+	 */
 
-			if (0 == fi->size) {
-				fi->file_size_known = FALSE;
+	if (dfi && dfi->guid != fi->guid)		/* They're atoms... */
+		upgraded = TRUE;
+
+	/*
+	 * NOTE: The tigertree data is only stored in the trailer, not
+	 * in the common "fileinfo" file. Therefore, it MUST be fetched
+	 * from "dfi".
+	 */
+
+	if (dfi && dfi->tigertree.leaves && NULL == fi->tigertree.leaves) {
+		file_info_got_tigertree(fi,
+			dfi->tigertree.leaves, dfi->tigertree.num_leaves, FALSE);
+	}
+
+	if (dfi) {
+		fi->modified = dfi->modified;
+	}
+
+	if (NULL == dfi) {
+		if (is_regular(fi->pathname)) {
+			g_warning("got metainfo in fileinfo cache, "
+				"but none in \"%s\"", fi->pathname);
+			upgraded = FALSE;			/* No need to flush twice */
+			file_info_store_binary(fi, TRUE);	/* Create metainfo */
+		} else {
+			file_info_merge_adjacent(fi);		/* Compute fi->done */
+			if (fi->done > 0) {
+				g_warning("discarding cached metainfo for \"%s\": "
+					"file had %s bytes downloaded "
+					"but is now gone!", fi->pathname,
+					filesize_to_string(fi->done));
+				return FALSE;
 			}
+		}
+	} else if (dfi->generation > fi->generation) {
+		g_warning("found more recent metainfo in \"%s\"", fi->pathname);
+		fi_free(fi);
+		*fi_ptr = fi = dfi;
+	} else if (dfi->generation < fi->generation) {
+		g_warning("found OUTDATED metainfo in \"%s\"", fi->pathname);
+		fi_free(dfi);
+		dfi = NULL;
+		upgraded = FALSE;				/* No need to flush twice */
+		file_info_store_binary(fi, TRUE);/* Resync metainfo */
+	} else {
+		g_assert(dfi->generation == fi->generation);
+		fi_free(dfi);
+		dfi = NULL;
+	}
 
-			/*
-			 * If we deserialized an older version, bring it up to date.
-			 */
+	/*
+	 * Check whether entry is not another's duplicate.
+	 */
 
-			upgraded = fi_upgrade_older_version(fi);
+	dfi = file_info_lookup_dup(fi);
 
-			/*
-			 * If we are processing a file being seeded, skip all the
-			 * CHNK, DONE and trailer consistency checks.
-			 *
-			 * If we are not recovering from a crash, seeded entries are
-			 * discarded.
-			 */
+	if (NULL != dfi) {
+		g_warning("found DUPLICATE entry for \"%s\" "
+			"(%s bytes) with \"%s\" (%s bytes)",
+			fi->pathname, filesize_to_string(fi->size),
+			dfi->pathname, filesize_to_string2(dfi->size));
+		return FALSE;
+	}
 
-			if (FI_F_SEEDING & fi->flags) {
-				if (crash_was_restarted()) {
-					filestat_t sb;
+	/*
+	 * If we had to upgrade the fileinfo, make sure we resync
+	 * the metadata on disk as well.
+	 */
 
-					if (NULL == fi->sha1) {
-						g_warning("%s(): missing SHA1 for seeded file %s",
-							G_STRFUNC, fi->pathname);
-						goto reset;		/* Fileinfo DB was corrupted, drop seed */
-					}
+	if (upgraded) {
+		g_warning("flushing upgraded metainfo in \"%s\"", fi->pathname);
+		file_info_store_binary(fi, TRUE);		/* Resync metainfo */
+	}
 
-					if (!file_exists(fi->pathname)) {
-						g_warning("%s(): missing previously seeded file %s",
-							G_STRFUNC, fi->pathname);
-						goto reset;		/* User probably removed the file */
-					}
+	file_info_merge_adjacent(fi);
 
-					if (-1 == stat(fi->pathname, &sb)) {
-						g_warning("%s(): cannot stat seeded file %s: %m",
-							G_STRFUNC, fi->pathname);
-						goto reset;
-					}
+ready:
 
-					/*
-					 * FIXME:
-					 * Would need to check that the file is still accurate if
-					 * the timestamp was changed since last modification.
-					 * For now just warn.
-					 * 		--RAM, 2017-10-23
-					 */
+	file_info_hash_insert(fi);
 
-					if (sb.st_mtime != fi->modified) {
-						bool accepted = huge_cached_is_uptodate(
-								fi->pathname, sb.st_size, sb.st_mtime);
+	if (can_publish_partial_sha1 && fi->sha1 != NULL) {
+		publisher_add(fi->sha1);
+	}
 
-						g_warning("%s(): modified seeded file %s: "
-							"last modified=%lu, file mtime=%lu; %s",
-							G_STRFUNC, fi->pathname,
-							(ulong) fi->modified, (ulong) sb.st_mtime,
-							accepted ? "resetting!" : "discarding!");
+	/*
+	 * We could not add the aliases immediately because the file
+	 * is formatted with ALIA coming before SIZE.  To let fi_alias()
+	 * detect conflicting entries, we need to have a valid fi->size.
+	 * And since the `fi' is hashed, we can detect duplicates in
+	 * the `aliases' list itself as an added bonus.
+	 */
 
-						if (!accepted)
-							goto reset;
+	if (fi->alias) {
+		pslist_t *aliases, *sl;
 
-						/* This stamp is necessary to be able to upload! */
-						fi->modified = sb.st_mtime;
-						fi->stamp = fi->modified;	/* Persist new value */
-					}
+		/* For efficiency each alias has been prepended to
+		 * the list. To preserve the order between sessions,
+		 * the original list order is restored here. */
+		aliases = pslist_reverse(fi->alias);
+		fi->alias = NULL;
+		PSLIST_FOREACH(aliases, sl) {
+			const char *s = sl->data;
+			fi_alias(fi, s, TRUE);
+			atom_str_free_null(&s);
+		}
+		pslist_free_null(&aliases);
+	}
 
-					if (fi->tth != NULL)
-						file_info_recomputed_tth_internal(fi, fi->tth, FALSE);
+	return TRUE;
+}
 
-					/* Seeding of file will be resumed */
-					goto ready;
-				}
+/**
+ * Load the binary fileinfo database.
+ *
+ * @return TRUE if the database existed, FALSE if we must fallback to
+ * the legacy text database.
+ */
+static bool G_COLD
+file_info_db_retrieve(void)
+{
+	char *path, *base;
+	int fd;
+	filestat_t sb;
+	htable_t *last;
+	fileoffset_t offset, end;
+	size_t loaded = 0, discarded = 0;
 
-				if (GNET_PROPERTY(share_debug)) {
-					g_info("SHARE discarding seeded file %s", fi->pathname);
-				}
+	path = make_pathname(settings_config_dir(), FI_DB_FILE);
+	fd = file_open_missing(path, O_RDONLY);
 
-				/* Drop the seeded file now */
-				goto reset;
-			}
+	if (!is_valid_fd(fd)) {
+		HFREE_NULL(path);
+		return FALSE;
+	}
 
-			/*
-			 * Allow reconstruction of missing information: if no CHNK
-			 * entry was found for the file, fake one, all empty, and reset
-			 * DONE and GENR to 0.
-			 *
-			 * If for instance the partition where temporary files are held
-			 * is lost, a single "grep -v ^CHNK fileinfo > fileinfo.new"
-			 * will be enough to restart without losing the collected
-			 * files.
-			 *
-			 *		--RAM, 31/12/2003
-			 */
+	if (-1 == fstat(fd, &sb)) {
+		g_warning("%s(): cannot stat \"%s\": %m", G_STRFUNC, path);
+		goto corrupted;
+	}
 
-			if (0 == eslist_count(&fi->chunklist)) {
-				if (fi->file_size_known)
-					g_warning("no CHNK info for \"%s\"", fi->pathname);
-				fi_reset_chunks(fi);
-				reload_chunks = TRUE;	/* Will try to grab from trailer */
-			} else if (!file_info_check_chunklist(fi, FALSE)) {
-				if (fi->file_size_known)
-					g_warning("invalid set of CHNK info for \"%s\"",
-						fi->pathname);
-				fi_reset_chunks(fi);
-				reload_chunks = TRUE;	/* Will try to grab from trailer */
-			}
+	if (sb.st_size < FI_DB_HDRLEN || sb.st_size > MAX_INT_VAL(ssize_t))
+		goto corrupted;
 
-			g_assert(file_info_check_chunklist(fi, TRUE));
+	base = vmm_mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-			/*
-			 * If DONE does not match the actual size described by the CHNK
-			 * set, them perhaps the fileinfo database was corrupted?
-			 */
+	if (MAP_FAILED == base) {
+		g_warning("%s(): cannot map \"%s\": %m", G_STRFUNC, path);
+		goto corrupted;
+	}
 
-			{
-				filesize_t done = fi->done;
+	if (
+		0 != memcmp(base, FI_DB_MAGIC, 8) ||
+		FI_DB_VERSION != peek_be32(&base[8]) ||
+		FI_DB_RECLEN != peek_be32(&base[12])
+	) {
+		vmm_munmap(base, sb.st_size);
+		goto corrupted;
+	}
 
-				file_info_merge_adjacent(fi); /* Recalculates also fi->done */
+	vmm_madvise_sequential(base, sb.st_size);
 
-				/*
-				 * If DONE was missing, fi->done will still be 0.
-				 * In that case, we don't really care since we'll have
-				 * recomputed fi->done in the call above.
-				 */
+	/*
+	 * First pass: locate the last record for each GUID, and the end of
+	 * the valid records.
+	 */
 
-				if (done != 0 && fi->done != done) {
-					g_warning("inconsistent DONE info for \"%s\": "
-						"read %s, computed %s",
-						fi->pathname, filesize_to_string(done),
-						filesize_to_string2(fi->done));
-					reload_chunks = TRUE;	/* Will try to grab from trailer */
-				}
-			}
+	last = htable_create(HASH_KEY_FIXED, GUID_RAW_SIZE);
 
-			/*
-			 * If `old_filename' is not NULL, then we need to rename
-			 * the file bearing that name into the new (sanitized)
-			 * name, making sure there is no filename conflict.
-			 */
+	for (offset = FI_DB_HDRLEN; offset + FI_DB_RECLEN <= sb.st_size; /**/) {
+		const char *rec = &base[offset];
+		size_t len = peek_be32(&rec[0]);
+		const struct guid *guid = (const void *) &rec[12];
 
-			if (NULL != old_filename) {
-				const char *new_pathname;
-				char *old_path;
-				bool renamed = TRUE;
+		if (offset + FI_DB_RECLEN + (fileoffset_t) len > sb.st_size)
+			break;
 
-				old_path = filepath_directory(fi->pathname);
-				new_pathname = file_info_new_outname(old_path,
-									filepath_basename(fi->pathname));
-				HFREE_NULL(old_path);
-				if (NULL == new_pathname)
-					goto reset;
+		if (
+			peek_be32(&rec[4]) != crc32_update(
+				crc32_update(0, &rec[8], FI_DB_RECLEN - 8),
+				&rec[FI_DB_RECLEN], len)
+		)
+			break;
 
-				/*
-				 * If fi->done == 0, the file might not exist on disk.
-				 */
+		htable_remove(last, guid);
+		if (FI_DB_PUT == rec[8])
+			htable_insert_const(last, guid, rec);
 
-				if (-1 == rename(fi->pathname, new_pathname) && 0 != fi->done)
-					renamed = FALSE;
+		offset += FI_DB_RECLEN + len;
+	}
 
-				if (renamed) {
-					g_warning("renamed \"%s\" into sanitized \"%s\"",
-						fi->pathname, new_pathname);
-					atom_str_change(&fi->pathname, new_pathname);
-				} else {
-					g_warning("cannot rename \"%s\" into \"%s\": %m",
-						fi->pathname, new_pathname);
-				}
-				atom_str_free_null(&new_pathname);
-			}
+	if (offset != sb.st_size) {
+		g_warning("%s(): discarding last %s bytes of \"%s\"", G_STRFUNC,
+			fileoffset_t_to_string(sb.st_size - offset), path);
+	}
 
-			/*
-			 * Check file trailer information.	The main file is only written
-			 * infrequently and the file's trailer can have more up-to-date
-			 * information.
-			 */
+	fi_db_end = end = offset;
 
-			dfi = file_info_retrieve_binary(fi->pathname);
+	/*
+	 * Second pass: load the live records, in their file order.
+	 *
+	 * Records we cannot accept are deleted, since the fileinfo would
+	 * otherwise be dropped when rewriting the database.
+	 */
 
-			/*
-			 * If we resetted the CHNK list above, grab those from the
-			 * trailer: that cannot be worse than having to download
-			 * everything again...  If there was no valid trailer, all the
-			 * data are lost and the whole file will need to be grabbed again.
-			 */
+	for (offset = FI_DB_HDRLEN; offset < end; /**/) {
+		const char *rec = &base[offset];
+		size_t len = peek_be32(&rec[0]);
+		const struct guid *guid = (const void *) &rec[12];
+		fileinfo_t *fi;
 
-			if (dfi != NULL && reload_chunks) {
-				fi_copy_chunks(fi, dfi);
-				if (0 != eslist_count(&fi->chunklist)) {
-					g_message("recovered %s downloaded bytes "
-						"from trailer of \"%s\"",
-						filesize_to_string(fi->done), fi->pathname);
-				}
-			} else if (reload_chunks)
-				g_warning("lost all CHNK info for \"%s\" -- downloading again",
-					fi->pathname);
+		offset += FI_DB_RECLEN + len;
 
-			g_assert(file_info_check_chunklist(fi, TRUE));
+		if (htable_lookup(last, guid) != rec)
+			continue;
 
-			/*
-			 * Special treatment for the GUID: if not present, it will be
-			 * added during retrieval, but it will be different for the
-			 * one in the fileinfo DB and the one on disk.  Set `upgraded'
-			 * to signal that, so that we resync the metainfo below.
-			 */
+		fi = file_info_db_deserialize(guid, &rec[FI_DB_RECLEN], len);
 
-			if (dfi && dfi->guid != fi->guid)		/* They're atoms... */
-				upgraded = TRUE;
+		if (NULL == fi) {
+			discarded++;
+			file_info_db_delete_guid(guid);
+			continue;
+		}
 
-			/*
-			 * NOTE: The tigertree data is only stored in the trailer, not
-			 * in the common "fileinfo" file. Therefore, it MUST be fetched
-			 * from "dfi".
-			 */
+		if (!file_info_retrieve_finish(&fi, NULL)) {
+			fi_free(fi);
+			discarded++;
+			file_info_db_delete_guid(guid);
+			continue;
+		}
 
-			if (dfi && dfi->tigertree.leaves && NULL == fi->tigertree.leaves) {
-				file_info_got_tigertree(fi,
-					dfi->tigertree.leaves, dfi->tigertree.num_leaves, FALSE);
-			}
+		loaded++;
 
-			if (dfi) {
-				fi->modified = dfi->modified;
-			}
+		/*
+		 * The fileinfo can have been replaced by the one from the trailer,
+		 * bearing another GUID: delete the record we loaded then, and
+		 * the new record will be persisted by the next store.
+		 */
 
-			if (NULL == dfi) {
-				if (is_regular(fi->pathname)) {
-					g_warning("got metainfo in fileinfo cache, "
-						"but none in \"%s\"", fi->pathname);
-					upgraded = FALSE;			/* No need to flush twice */
-					file_info_store_binary(fi, TRUE);	/* Create metainfo */
-				} else {
-					file_info_merge_adjacent(fi);		/* Compute fi->done */
-					if (fi->done > 0) {
-						g_warning("discarding cached metainfo for \"%s\": "
-							"file had %s bytes downloaded "
-							"but is now gone!", fi->pathname,
-							filesize_to_string(fi->done));
-						goto reset;
-					}
-				}
-			} else if (dfi->generation > fi->generation) {
-				g_warning("found more recent metainfo in \"%s\"", fi->pathname);
-				fi_free(fi);
-				fi = dfi;
-			} else if (dfi->generation < fi->generation) {
-				g_warning("found OUTDATED metainfo in \"%s\"", fi->pathname);
-				fi_free(dfi);
-				dfi = NULL;
-				upgraded = FALSE;				/* No need to flush twice */
-				file_info_store_binary(fi, TRUE);/* Resync metainfo */
-			} else {
-				g_assert(dfi->generation == fi->generation);
-				fi_free(dfi);
-				dfi = NULL;
-			}
+		if (!guid_eq(fi->guid, guid)) {
+			file_info_db_delete_guid(guid);
+			fileinfo_dirty = TRUE;
+		} else {
+			fi->db_len = len;
+			fi->db_crc = peek_be32(&rec[4]);
+			fi_db_live += FI_DB_RECLEN + len;
+		}
+	}
+
+	htable_free_null(&last);
+	vmm_munmap(base, sb.st_size);
+	fd_close(&fd);
+
+	if (GNET_PROPERTY(fileinfo_debug) || discarded != 0) {
+		g_info("loaded %zu fileinfo record%s from %s, discarded %zu",
+			loaded, plural(loaded), path, discarded);
+	}
 
-			/*
-			 * Check whether entry is not another's duplicate.
-			 */
+	HFREE_NULL(path);
+	return TRUE;
 
-			dfi = file_info_lookup_dup(fi);
+corrupted:
+	{
+		char *bad = h_strconcat(path, ".corrupted", NULL_PTR);
 
-			if (NULL != dfi) {
-				g_warning("found DUPLICATE entry for \"%s\" "
-					"(%s bytes) with \"%s\" (%s bytes)",
-					fi->pathname, filesize_to_string(fi->size),
-					dfi->pathname, filesize_to_string2(dfi->size));
-				goto reset;
-			}
+		g_warning("%s(): invalid \"%s\", renamed as \"%s\"",
+			G_STRFUNC, path, bad);
+		if (-1 == rename(path, bad))
+			g_warning("%s(): cannot rename \"%s\": %m", G_STRFUNC, path);
+		HFREE_NULL(bad);
+	}
+	fd_close(&fd);
+	HFREE_NULL(path);
+	return TRUE;
+}
 
-			/*
-			 * If we had to upgrade the fileinfo, make sure we resync
-			 * the metadata on disk as well.
-			 */
+/**
+ * Loads the legacy text fileinfo database from disk, and saves a copy in
+ * fileinfo.orig.
+ *
+ * @return TRUE if the text database was present.
+ */
+static bool G_COLD
+file_info_retrieve_text(void)
+{
+	FILE *f;
+	char line[1024];
+	fileinfo_t *fi = NULL;
+	bool empty = TRUE;
+	bool last_was_truncated = FALSE;
+	file_path_t fp;
+	const char *old_filename = NULL;	/* In case we must rename the file */
+	const char *path = NULL;
+	const char *filename = NULL;
 
-			if (upgraded) {
-				g_warning("flushing upgraded metainfo in \"%s\"", fi->pathname);
-				file_info_store_binary(fi, TRUE);		/* Resync metainfo */
-			}
+	file_path_set(&fp, settings_config_dir(), file_info_file);
+	f = file_config_open_read(file_info_what, &fp, 1);
+	if (!f)
+		return FALSE;
 
-			file_info_merge_adjacent(fi);
+	while (fgets(ARYLEN(line), f)) {
+		int error;
+		bool truncated = FALSE, damaged;
+		const char *ep;
+		char *value;
+		uint64 v;
 
-		ready:
+		/*
+		 * The following semi-complex logic attempts to determine whether
+		 * we filled the whole line buffer without reaching the end of the
+		 * physical line.
+		 *
+		 * When truncation occurs, we skip every following "line" we'd get
+		 * up to the point where we no longer need to truncate, at which time
+		 * we'll be re-synchronized on the real end of the line.
+		 */
 
-			file_info_hash_insert(fi);
+		truncated = !file_line_chomp_tail(ARYLEN(line), NULL);
 
-			if (can_publish_partial_sha1 && fi->sha1 != NULL) {
-				publisher_add(fi->sha1);
-			}
+		if (last_was_truncated) {
+			last_was_truncated = truncated;
+			g_warning("ignoring fileinfo line after truncation: '%s'", line);
+			continue;
+		} else if (truncated) {
+			last_was_truncated = TRUE;
+			g_warning("ignoring too long fileinfo line: '%s'", line);
+			continue;
+		}
 
-			/*
-			 * We could not add the aliases immediately because the file
-			 * is formatted with ALIA coming before SIZE.  To let fi_alias()
-			 * detect conflicting entries, we need to have a valid fi->size.
-			 * And since the `fi' is hashed, we can detect duplicates in
-			 * the `aliases' list itself as an added bonus.
-			 */
+		if (file_line_is_comment(line))
+			continue;
 
-			if (fi->alias) {
-				pslist_t *aliases, *sl;
-
-				/* For efficiency each alias has been prepended to
-				 * the list. To preserve the order between sessions,
-				 * the original list order is restored here. */
-				aliases = pslist_reverse(fi->alias);
-				fi->alias = NULL;
-				PSLIST_FOREACH(aliases, sl) {
-					const char *s = sl->data;
-					fi_alias(fi, s, TRUE);
-					atom_str_free_null(&s);
-				}
-				pslist_free_null(&aliases);
+		/*
+		 * Reaching an empty line means the end of the fileinfo description.
+		 */
+
+		if ('\0' == *line && fi) {
+			if (filename && path) {
+				char *pathname = make_pathname(path, filename);
+				fi->pathname = atom_str_get(pathname);
+				HFREE_NULL(pathname);
+			} else {
+				/* There's an incomplete fileinfo record */
+				goto reset;
 			}
+			atom_str_free_null(&filename);
+			atom_str_free_null(&path);
+
+			if (!file_info_retrieve_finish(&fi, old_filename))
+				goto reset;
 
 			empty = FALSE;
 			fi = NULL;
@@ -3801,7 +4606,7 @@ file_info_retrieve(void)
 							filesize_to_string(fi->size));
 						damaged = TRUE;
 					} else {
-						eslist_append(&fi->chunklist, fc);
+						fi_chunk_append(fi, fc);
 					}
 				}
 			}
@@ -3833,6 +4638,48 @@ file_info_retrieve(void)
 	atom_str_free_null(&path);
 
 	fclose(f);
+
+	return TRUE;
+}
+
+/**
+ * Loads the fileinfo database from disk.
+ *
+ * The legacy text database is converted to the binary database if found.
+ */
+void G_COLD
+file_info_retrieve(void)
+{
+	/*
+	 * We have a complex interaction here: each time a new entry within the
+	 * download mesh is added, file_info_try_to_swarm_with() will be
+	 * called.	Moreover, the download mesh is initialized before us.
+	 *
+	 * However, we cannot enqueue a download before the download module is
+	 * initialized. And we know it is initialized now because download_init()
+	 * calls us!
+	 *
+	 *		--RAM, 20/08/2002
+	 */
+
+	can_swarm = TRUE;			/* Allows file_info_try_to_swarm_with() */
+
+	if (file_info_db_retrieve())
+		return;
+
+	if (file_info_retrieve_text()) {
+		char *path;
+
+		if (!file_info_db_compact())
+			return;		/* Keep the text database as a fallback */
+
+		path = make_pathname(settings_config_dir(), file_info_file);
+		if (-1 == unlink(path))
+			g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, path);
+		else
+			g_info("converted \"%s\" to %s", path, FI_DB_FILE);
+		HFREE_NULL(path);
+	}
 }
 
 static bool
@@ -3946,7 +4793,7 @@ file_info_create(const char *file, const char *path, filesize_t size,
 		fi->size = fc->to = st.st_size;
 		fc->status = DL_CHUNK_DONE;
 		fi->modified = st.st_mtime;
-		eslist_append(&fi->chunklist, fc);
+		fi_chunk_append(fi, fc);
 		fi->dirty = TRUE;
 	}
 
@@ -4417,7 +5264,7 @@ file_info_merge_adjacent(fileinfo_t *fi)
 			void *removed;
 
 			fc1->to = fc2->to;
-			removed = eslist_remove_after(&fi->chunklist, fc1);
+			removed = fi_chunk_remove_after(fi, fc1);
 			g_assert(removed == fc2);
 			dl_file_chunk_free(&fc2);
 			fc2 = fc1;					/* new current chunk */
@@ -4488,7 +5335,7 @@ file_info_size_known(struct download *d, filesize_t size)
 			fc->to = fi->done;			/* Byte at that offset is excluded */
 			fc->status = DL_CHUNK_DONE;
 
-			eslist_append(&fi->chunklist, fc);
+			fi_chunk_append(fi, fc);
 		} else {
 			fc->to = fi->done;
 
@@ -4499,7 +5346,7 @@ file_info_size_known(struct download *d, filesize_t size)
 			while (NULL != eslist_next(&fc->lk)) {
 				struct dl_file_chunk *fcn;
 
-				fcn = eslist_remove_after(&fi->chunklist, fc);
+				fcn = fi_chunk_remove_after(fi, fc);
 				dl_file_chunk_free(&fcn);
 			}
 		}
@@ -4518,7 +5365,7 @@ file_info_size_known(struct download *d, filesize_t size)
 		fc->to = size;				/* Byte at that offset is excluded */
 		fc->status = DL_CHUNK_BUSY;
 		fc->download = d;
-		eslist_append(&fi->chunklist, fc);
+		fi_chunk_append(fi, fc);
 	}
 
 	fi->file_size_known = TRUE;
@@ -4624,8 +5471,16 @@ again:
 	 *		--RAM, 04/11/2002
 	 */
 
+	/*
+	 * Start with the chunk holding `from', all the previous ones lying
+	 * before the range to update.
+	 */
+
+	fc = fi_chunk_lookup(fi, from);
+	prevfc = NULL == fc ? NULL : fi_chunk_prev(fi, fc);
+
 	for (
-		n = 0, prevfc = NULL, sl = eslist_first(&fi->chunklist);
+		n = 0, sl = NULL == fc ? NULL : &fc->lk;
 		sl != NULL;
 		n++, prevfc = fc, sl = eslist_next(sl)
 	) {
@@ -4693,7 +5548,7 @@ again:
 				fc->to = to;
 				fc->status = status;
 				fc->download = newval;
-				eslist_insert_after(&fi->chunklist, fc, nfc);
+				fi_chunk_insert_after(fi, fc, nfc);
 				g_assert(file_info_check_chunklist(fi, TRUE));
 			}
 
@@ -4718,7 +5573,8 @@ again:
 				nfc->to = fc->to;
 				nfc->status = fc->status;
 				nfc->download = fc->download;
-				eslist_insert_after(&fi->chunklist, fc, nfc);
+				fc->to = to;
+				fi_chunk_insert_after(fi, fc, nfc);
 
 				if (DL_CHUNK_BUSY == nfc->status) {
 					/*
@@ -4737,9 +5593,9 @@ again:
 			nfc->to = to;
 			nfc->status = status;
 			nfc->download = newval;
-			eslist_insert_after(&fi->chunklist, fc, nfc);
 
 			fc->to = from;
+			fi_chunk_insert_after(fi, fc, nfc);
 
 			found = TRUE;
 			g_assert(file_info_check_chunklist(fi, TRUE));
@@ -4760,10 +5616,10 @@ again:
 			nfc->to = fc->to;
 			nfc->status = status;
 			nfc->download = newval;
-			eslist_insert_after(&fi->chunklist, fc, nfc);
 
 			tmp = fc->to;
 			fc->to = from;
+			fi_chunk_insert_after(fi, fc, nfc);
 			from = tmp;
 			g_assert(file_info_check_chunklist(fi, TRUE));
 			goto again;
@@ -4915,10 +5771,12 @@ file_info_chunk_status(fileinfo_t *fi, filesize_t from, filesize_t to)
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+	fc = fi_chunk_lookup(fi, from);
+
+	if (fc != NULL) {
 		dl_file_chunk_check(fc);
 
-		if (from >= fc->from && to <= fc->to)
+		if (to <= fc->to)
 			return fc->status;
 	}
 
@@ -4947,43 +5805,38 @@ file_info_new_chunk_owner(const struct download *d,
 {
 	fileinfo_t *fi;
 	const struct download *old = NULL;
-	const slink_t *sl;
+	const slink_t *sl = NULL;
+	struct dl_file_chunk *fc;
 
 	download_check(d);
 	fi = d->file_info;
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH(&fi->chunklist, sl) {
-		struct dl_file_chunk *fc = eslist_data(&fi->chunklist, sl);
-
-		dl_file_chunk_check(fc);
+	/*
+	 * We're looking for the first busy chunk intersecting with [from, to],
+	 * which happens when one of the segment bounds lies within the chunk.
+	 */
 
-		/*
-		 * We're looking for the first busy chunk intersecting with [from, to],
-		 * which happens when one of the segment bounds lies within the chunk.
-		 */
+	fc = fi_chunk_lookup(fi, from);
 
-		if (DL_CHUNK_BUSY != fc->status)
-			continue;
+	if (NULL == fc || DL_CHUNK_BUSY != fc->status)
+		fc = fi_chunk_lookup(fi, to);
 
-		if (
-			(from >= fc->from && from < fc->to) ||
-			(to >= fc->from && to < fc->to)
-		) {
-			g_assert(fc->download != NULL);
-			download_check(fc->download);
-			g_assert(fc->download != d);
+	if (fc != NULL && DL_CHUNK_BUSY == fc->status) {
+		dl_file_chunk_check(fc);
+		g_assert(fc->download != NULL);
+		download_check(fc->download);
+		g_assert(fc->download != d);
 
-			old = fc->download;
-			fc->download = d;
-			break;
-		}
+		old = fc->download;
+		fc->download = d;
+		sl = &fc->lk;
 	}
 
 	if (old != NULL) {
 		for (sl = eslist_next(sl); sl != NULL; sl = eslist_next(sl)) {
-			struct dl_file_chunk *fc = eslist_data(&fi->chunklist, sl);
+			fc = eslist_data(&fi->chunklist, sl);
 
 			dl_file_chunk_check(fc);
 
@@ -5007,10 +5860,11 @@ file_info_pos_status(fileinfo_t *fi, filesize_t pos)
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+	fc = fi_chunk_lookup(fi, pos);
+
+	if (fc != NULL) {
 		dl_file_chunk_check(fc);
-		if (pos >= fc->from && pos < fc->to)
-			return fc->status;
+		return fc->status;
 	}
 
 	if (pos > fi->size) {
@@ -5022,6 +5876,54 @@ file_info_pos_status(fileinfo_t *fi, filesize_t pos)
 	return DL_CHUNK_DONE;
 }
 
+/**
+ * Make sure the data we think we have is still there.
+ *
+ * Data in completed chunks lying beyond the end of the file is lost, which
+ * means the file was truncated or replaced.  Holes within completed chunks
+ * are only reported when debugging, since some filesystems turn written
+ * runs of zeros into holes.
+ *
+ * @return TRUE if data from completed chunks is known to be lost.
+ */
+static bool
+fi_check_holes(const fileinfo_t *fi, const filestat_t *sb)
+{
+	const struct dl_file_chunk *fc;
+	file_object_t *fo = NULL;
+	bool lost = FALSE;
+
+	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+		dl_file_chunk_check(fc);
+
+		if (DL_CHUNK_DONE != fc->status)
+			continue;
+
+		if (fc->to > (filesize_t) sb->st_size) {
+			lost = TRUE;
+			break;
+		}
+
+		if (0 == GNET_PROPERTY(fileinfo_debug))
+			continue;
+
+		if (NULL == fo) {
+			fo = file_object_open(fi->pathname, O_RDONLY);
+			if (NULL == fo)
+				break;
+		}
+
+		if (file_object_has_hole(fo, fc->from, fc->to - fc->from)) {
+			g_debug("%s(): file %s has a hole within [%s, %s[",
+				G_STRFUNC, fi->pathname, filesize_to_string(fc->from),
+				filesize_to_string2(fc->to));
+		}
+	}
+
+	file_object_release(&fo);
+	return lost;
+}
+
 /**
  * This routine is called each time we start a new download, before
  * making the request to the remote server. If we detect that the
@@ -5045,11 +5947,19 @@ fi_check_file(fileinfo_t *fi)
 	 * be excluded from this check.
 	 */
 
-	if (
-		!(fi->flags & FI_F_TRANSIENT) &&
-		stat(fi->pathname, &buf) && ENOENT == errno
-	) {
-		g_warning("file %s removed, resetting swarming", fi->pathname);
+	if (fi->flags & FI_F_TRANSIENT)
+		return;
+
+	if (stat(fi->pathname, &buf)) {
+		if (ENOENT == errno) {
+			g_warning("file %s removed, resetting swarming", fi->pathname);
+			file_info_reset(fi);
+		}
+		return;
+	}
+
+	if (fi_check_holes(fi, &buf)) {
+		g_warning("file %s truncated, resetting swarming", fi->pathname);
 		file_info_reset(fi);
 	}
 }
@@ -5085,23 +5995,6 @@ fi_busy_count(fileinfo_t *fi, const struct download *d)
 	return count;
 }
 
-/**
- * Compares two offered ranges so that two ranges are equal when they overlap.
- */
-static int
-fi_chunk_overlap_cmp(const void *a, const void *b)
-{
-	const struct dl_file_chunk *ca = a, *cb = b;
-
-	if (ca->to <= cb->from)			/* `to' is NOT part of the chunk range */
-		return -1;
-
-	if (cb->to <= ca->from)
-		return +1;
-
-	return 0;		/* Overlapping chunks are equal */
-}
-
 /**
  * Select a chunk randomly among the rarest chunks offered on the network.
  *
@@ -5121,7 +6014,6 @@ fi_chunk_overlap_cmp(const void *a, const void *b)
 static const struct dl_file_chunk *
 fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 {
-	rbtree_t *missing;
 	http_rangeset_t *offered;
 	const struct dl_file_chunk *fc;
 	const struct dl_file_chunk *first, *candidate = NULL;
@@ -5159,24 +6051,12 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 	}
 
 	/*
-	 * The `missing' red-black tree contains the file chunks that are still
-	 * empty and need to be downloaded.
-	 *
 	 * The `offered' set contains the HTTP ranges offered by the source,
 	 * if any given.  If NULL, it means the source covers the whole file.
 	 */
 
-	missing = rbtree_create(fi_chunk_overlap_cmp);
 	offered = NULL == d ? NULL : d->ranges;
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-		dl_file_chunk_check(fc);
-
-		if (DL_CHUNK_EMPTY == fc->status) {
-			rbtree_insert(missing, fc);
-		}
-	}
-
 	/*
 	 * Find the first missing chunk that is also offered, starting with the
 	 * rarest available chunk: the fi->available list is sorted by increasing
@@ -5185,7 +6065,6 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 
 	ESLIST_FOREACH_DATA(&fi->available, fa) {
 		struct dl_file_chunk *dfc;
-		struct dl_file_chunk crange;
 
 		dl_avail_chunk_check(fa);
 
@@ -5203,10 +6082,7 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 		)
 			continue;		/* Range not offered */
 
-		crange.from = fa->from;
-		crange.to = fa->to;
-
-		dfc = rbtree_lookup(missing, &crange);
+		dfc = fi_chunk_find_empty(fi, fa->from, fa->to);
 
 		if (dfc != NULL) {
 			/* Rare range overlaps with missing range */
@@ -5318,7 +6194,7 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 			nfc->status = dfc->status;
 			dfc->to = start;
 
-			eslist_insert_after(&fi->chunklist, dfc, nfc);
+			fi_chunk_insert_after(fi, dfc, nfc);
 			candidate = nfc;
 
 			if (
@@ -5340,8 +6216,6 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 	if (NULL == candidate)
 		candidate = first;
 
-	rbtree_free_null(&missing);
-
 done:
 	if (GNET_PROPERTY(fileinfo_debug) || GNET_PROPERTY(download_debug)) {
 		g_debug("%s(): returning [%s, %s] (%u) for \"%s\"",
@@ -5504,6 +6378,20 @@ fi_pick_chunk(fileinfo_t *fi)
 			aligned = offset & ~file_info_align_mask;
 			offset = MAX(aligned, fc->from);
 
+			/*
+			 * When space was not reserved upfront, writing right after
+			 * data we already have extends the extents the filesystem
+			 * already allocated instead of creating a new island in the
+			 * middle of the gap.
+			 */
+
+			if (!GNET_PROPERTY(download_preallocate)) {
+				const struct dl_file_chunk *prev = fi_chunk_prev(fi, fc);
+
+				if (prev != NULL && DL_CHUNK_DONE == prev->status)
+					offset = fc->from;
+			}
+
 			candidate = fc;
 			goto selected;
 		}
@@ -5546,7 +6434,7 @@ selected:
 		nfc->status = DL_CHUNK_EMPTY;
 		fc->to = nfc->from;
 
-		eslist_insert_after(&fi->chunklist, fc, nfc);
+		fi_chunk_insert_after(fi, fc, nfc);
 		candidate = nfc;
 	}
 
@@ -5559,13 +6447,14 @@ selected:
  * Compute chunksize to be used for the current request.
  */
 static filesize_t
-fi_chunksize(fileinfo_t *fi)
+fi_chunksize(fileinfo_t *fi, const struct download *d)
 {
-	filesize_t chunksize;
+	filesize_t chunksize, bdp;
 	int src_count;
 	uint32 max;
 
 	file_info_check(fi);
+	download_check(d);
 
 	/*
 	 * Chunk size is estimated based on the amount of potential concurrent
@@ -5605,6 +6494,21 @@ fi_chunksize(fileinfo_t *fi)
 
 	chunksize = MIN(chunksize, max);
 
+	/*
+	 * Only one request can be pipelined on a connection, so each request
+	 * must be large enough compared to the bandwidth-delay product of the
+	 * source, or a fast server far away would spend a good fraction of
+	 * its time idle waiting for our next request.
+	 *
+	 * We therefore make sure the request covers FI_BDP_ROUNDTRIPS times
+	 * the amount of data the source can send us during one round-trip,
+	 * still within the configured maximum chunk size.
+	 */
+
+	bdp = (filesize_t) download_speed_avg(d) * d->server->latency / 1000;
+	bdp = MIN(bdp * FI_BDP_ROUNDTRIPS, GNET_PROPERTY(dl_maxchunksize));
+	chunksize = MAX(chunksize, bdp);
+
 	return chunksize;
 }
 
@@ -5797,6 +6701,7 @@ fi_find_aggressive_candidate(
 	int starving;
 	filesize_t minchunk;
 	bool can_be_aggressive = FALSE;
+	bool endgame;
 	double missing_coverage;
 
 	/*
@@ -5814,7 +6719,18 @@ fi_find_aggressive_candidate(
 	minchunk = MIN(minchunk, GNET_PROPERTY(dl_minchunksize));
 	minchunk = MAX(minchunk, FI_MIN_CHUNK_SPLIT);
 
-	fc = fi_find_largest(fi, d);
+	/*
+	 * When what remains to be downloaded would fit in one minimum-sized
+	 * chunk per active source, we're in the endgame: completion is now
+	 * bounded by the slowest server, not by the largest pending chunk.
+	 * Skip the largest chunk then, and directly duplicate the tail of
+	 * the chunk held by the slowest source with this (faster) one.
+	 */
+
+	endgame = fi->size - fi->done <=
+		(filesize_t) fi->lifecount * GNET_PROPERTY(dl_minchunksize);
+
+	fc = endgame ? NULL : fi_find_largest(fi, d);
 
 	if (fc != NULL && fc->to - fc->from < minchunk)
 		fc = NULL;
@@ -5877,11 +6793,11 @@ fi_find_aggressive_candidate(
 			&& download_speed_avg(d) > download_speed_avg(fc->download);
 
 		if (can_be_aggressive && GNET_PROPERTY(download_debug) > 1)
-			g_debug("will instead be aggressive for \"%s\" given d/l speed "
+			g_debug("will %s be aggressive for \"%s\" given d/l speed "
 				"of %s%u B/s for slowest chunk owner (%s) and %u B/s for "
 				"stealer, and a coverage of missing chunks of %.2f%% and "
 				"%.2f%% respectively",
-				fi->pathname,
+				endgame ? "(endgame)" : "instead", fi->pathname,
 				download_is_stalled(fc->download) ? "stalling " : "",
 				download_speed_avg(fc->download),
 				download_host_info(fc->download),
@@ -5919,6 +6835,63 @@ fi_find_aggressive_candidate(
 	return TRUE;
 }
 
+/**
+ * Discard the SHA1 computed incrementally over the written file prefix.
+ */
+void
+file_info_sha1_forget(fileinfo_t *fi)
+{
+	file_info_check(fi);
+
+	WFREE_TYPE_NULL(fi->sha1_ctx);
+	fi->sha1_hashed = 0;
+}
+
+/**
+ * Record data that was just written to the file at the given offset.
+ *
+ * As long as data is written contiguously from the start of the file, its
+ * SHA1 is computed incrementally, so that upon completion only the tail
+ * of the file needs to be read back and hashed for verification.
+ *
+ * Writing again within the already hashed prefix invalidates the SHA1
+ * state, since the data it covered was rewritten (for instance after a
+ * corrupted range was cleared and downloaded again).
+ *
+ * @param fi		the fileinfo
+ * @param offset	offset in the file where data was written
+ * @param iov		the I/O vector that was written
+ * @param iovcnt	amount of entries in iov
+ * @param size		amount of bytes actually written, from the start of iov
+ */
+void
+file_info_sha1_written(fileinfo_t *fi, filesize_t offset,
+	const iovec_t *iov, int iovcnt, size_t size)
+{
+	int i;
+
+	file_info_check(fi);
+
+	if (offset < fi->sha1_hashed)
+		file_info_sha1_forget(fi);
+
+	if (offset != fi->sha1_hashed)
+		return;				/* Not contiguous with the hashed prefix */
+
+	if (NULL == fi->sha1_ctx) {
+		WALLOC(fi->sha1_ctx);
+		SHA1_reset(fi->sha1_ctx);
+	}
+
+	for (i = 0; i < iovcnt && size != 0; i++) {
+		size_t len = MIN(size, iovec_len(&iov[i]));
+
+		SHA1_input(fi->sha1_ctx, iovec_base(&iov[i]), len);
+		size -= len;
+		fi->sha1_hashed += len;
+	}
+}
+
 /**
  * Mark [from, to] as now being a chunk reserved by given download.
  * If ``chunk'' is non-NULL, then the [from, to] belongs to that chunk
@@ -6049,7 +7022,7 @@ file_info_find_hole(const struct download *d, filesize_t *from, filesize_t *to)
 	 *		--RAM, 2005-10-27
 	 */
 
-	chunksize = fi_chunksize(fi);
+	chunksize = fi_chunksize(fi, d);
 
 	if (
 		GNET_PROPERTY(pfsp_server) && d->served_reqs == 0 &&
@@ -6199,7 +7172,7 @@ file_info_find_available_hole(
 	 */
 
 	if (eslist_count(&fi->available) > 1) {
-		chunksize = fi_chunksize(fi);
+		chunksize = fi_chunksize(fi, d);
 		chunk = fi_pick_rarest_chunk(fi, d, chunksize);
 	} else {
 		chunk = GNET_PROPERTY(pfsp_server) ?
@@ -6293,7 +7266,7 @@ file_info_find_available_hole(
 
 found:
 	if (0 == chunksize)
-		chunksize = fi_chunksize(fi);
+		chunksize = fi_chunksize(fi, d);
 
 	if ((*to - *from) > chunksize)
 		*to = *from + chunksize;
@@ -6898,6 +7871,7 @@ file_info_remove_source(fileinfo_t *fi, struct download *d)
 		gnet_prop_decr_guint32(PROP_FI_WITH_SOURCE_COUNT);
 
 		if (fi->flags & FI_F_DISCARD) {
+			file_info_db_delete(fi);
 			file_info_hash_remove(fi);
 			fi_free(fi);
 		}
@@ -7004,6 +7978,7 @@ file_info_remove(fileinfo_t *fi)
 	file_info_check(fi);
 	g_assert(fi->refcount == 0);
 
+	file_info_db_delete(fi);
 	file_info_hash_remove(fi);
 	fi_free(fi);
 }
@@ -7262,6 +8237,7 @@ file_info_purge(fileinfo_t *fi)
 			search_dissociate_sha1(fi->sha1);
 
 		file_info_unlink(fi);
+		file_info_db_delete(fi);
 		file_info_hash_remove(fi);
 		fi_free(fi);
 	}
@@ -7522,18 +8498,14 @@ file_info_restrict_range(fileinfo_t *fi, filesize_t start, filesize_t *end)
 	}
 
 	/*
-	 * Look for a suitable chunk, relying on the fact that completed chunks
-	 * have been coalesced together.
+	 * Look for the chunk within which `start' falls, relying on the fact
+	 * that completed chunks have been coalesced together.
 	 */
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-		dl_file_chunk_check(fc);
-
-		if (DL_CHUNK_DONE != fc->status)
-			continue;
+	fc = fi_chunk_lookup(fi, start);
 
-		if (start < fc->from || start >= fc->to)
-			continue;		/* `start' is not in the range */
+	if (fc != NULL && DL_CHUNK_DONE == fc->status) {
+		dl_file_chunk_check(fc);
 
 		/*
 		 * We found an available chunk within which `start' falls.
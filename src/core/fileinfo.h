@@ -87,6 +87,9 @@ void file_info_update(const struct download *d, filesize_t from, filesize_t to,
 	enum dl_chunk_status status);
 void file_info_new_chunk_owner(const struct download *d,
 	filesize_t from, filesize_t to);
+void file_info_sha1_written(fileinfo_t *fi, filesize_t offset,
+	const iovec_t *iov, int iovcnt, size_t size);
+void file_info_sha1_forget(fileinfo_t *fi);
 enum dl_chunk_status file_info_pos_status(fileinfo_t *fi,
 	filesize_t pos /*, filesize_t *start, filesize_t *end */);
 void file_info_close(void);
@@ -68,6 +68,7 @@
 #include "lib/sha1.h"
 #include "lib/stacktrace.h"
 #include "lib/stringify.h"
+#include "lib/thread.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -89,6 +90,42 @@ static once_flag_t build_alive_pi_done;
 static pmsg_t *build_po;			/* Single pong */
 static once_flag_t build_po_done;
 
+/**
+ * Payloads of the /LNI message that are patched in the template.
+ */
+enum g2_lni_slot {
+	G2_LNI_SLOT_LS = 0,		/**< Library statistics */
+	G2_LNI_SLOT_UP,			/**< Uptime */
+	G2_LNI_SLOT_GU,			/**< Node GUID */
+	G2_LNI_SLOT_NA,			/**< Node address */
+
+	G2_LNI_SLOT_COUNT
+};
+
+static const char *g2_lni_slot_path[] = {
+	"/LNI/LS",				/* G2_LNI_SLOT_LS */
+	"/LNI/UP",				/* G2_LNI_SLOT_UP */
+	"/LNI/GU",				/* G2_LNI_SLOT_GU */
+	"/LNI/NA",				/* G2_LNI_SLOT_NA */
+};
+
+/**
+ * A pre-serialized message, along with the location of the payloads that
+ * change between messages and are patched in place.
+ *
+ * The template is only valid as long as the layout of the message does not
+ * change, i.e. the same children are present and the patched payloads keep
+ * the same length, which is summarized by the "shape" value.
+ */
+struct g2_build_template {
+	pmsg_t *mb;							/**< Serialized message, or NULL */
+	uint shape;							/**< Layout signature */
+	size_t off[G2_LNI_SLOT_COUNT];		/**< Offset of patched payloads */
+	size_t len[G2_LNI_SLOT_COUNT];		/**< Length of patched payloads */
+};
+
+static struct g2_build_template build_lni;		/* /LNI template */
+
 enum g2_qh2_pmi_magic { G2_QH2_PMI_MAGIC = 0x79ec9986 };
 
 /**
@@ -324,6 +361,31 @@ g2_build_add_vendor(g2_tree_t *t)
 	g2_tree_add_child(t, c);
 }
 
+/**
+ * Fill payload with an IP:port.
+ *
+ * @param payload	the buffer to fill, must be at least 18 bytes
+ * @param addr		the IP address
+ * @param port		the port address
+ *
+ * @return the length of the payload.
+ */
+static size_t
+g2_build_host_payload(char *payload, host_addr_t addr, uint16 port)
+{
+	struct packed_host_addr packed;
+	uint alen;
+	void *p;
+
+	packed = host_addr_pack(addr);
+	alen = packed_host_addr_size(packed) - 1;	/* skip network byte */
+
+	p = mempcpy(payload, &packed.addr, alen);
+	p = poke_le16(p, port);
+
+	return ptr_diff(p, payload);
+}
+
 /**
  * Add child to the node, carrying an IP:port.
  *
@@ -337,19 +399,13 @@ g2_build_add_vendor(g2_tree_t *t)
 static g2_tree_t *
 g2_build_add_host(g2_tree_t *t, const char *name, host_addr_t addr, uint16 port)
 {
-	struct packed_host_addr packed;
-	uint alen;
 	char payload[18];		/* Large enough for IPv6 as well, one day? */
-	void *p;
+	size_t len;
 	g2_tree_t *c;
 
-	packed = host_addr_pack(addr);
-	alen = packed_host_addr_size(packed) - 1;	/* skip network byte */
+	len = g2_build_host_payload(payload, addr, port);
 
-	p = mempcpy(payload, &packed.addr, alen);
-	p = poke_le16(p, port);
-
-	c = g2_tree_alloc_copy(name, payload, ptr_diff(p, payload));
+	c = g2_tree_alloc_copy(name, payload, len);
 	g2_tree_add_child(t, c);
 
 	return c;
@@ -380,15 +436,16 @@ g2_build_add_node_address(g2_tree_t *t)
 }
 
 /**
- * Add the servent update as a "UP" child to the root.
+ * Fill payload with the servent uptime.
+ *
+ * @param payload	the buffer to fill, must be at least 8 bytes
+ *
+ * @return the length of the payload.
  */
-static void
-g2_build_add_uptime(g2_tree_t *t)
+static int
+g2_build_uptime_payload(char *payload)
 {
 	time_delta_t uptime;
-	char payload[8];
-	int n;
-	g2_tree_t *c;
 
 	/*
 	 * The uptime will typically be small, hence it is encoded as a variable
@@ -397,7 +454,20 @@ g2_build_add_uptime(g2_tree_t *t)
 	 */
 
 	uptime = delta_time(tm_time(), GNET_PROPERTY(start_stamp));
-	n = vlint_encode(uptime, payload);
+	return vlint_encode(uptime, payload);
+}
+
+/**
+ * Add the servent update as a "UP" child to the root.
+ */
+static void
+g2_build_add_uptime(g2_tree_t *t)
+{
+	char payload[8];
+	int n;
+	g2_tree_t *c;
+
+	n = g2_build_uptime_payload(payload);
 
 	c = g2_tree_alloc_copy("UP", payload, n);	/* No trailing 0s */
 	g2_tree_add_child(t, c);
@@ -498,35 +568,48 @@ g2_build_add_gtkgv(g2_tree_t *t)
 }
 
 /**
- * Build a Local Node Info message.
+ * Fill payload with the library statistics.
  *
- * @return a /LNI message.
+ * @param payload	the buffer to fill, must be at least 8 bytes
+ *
+ * @return the length of the payload.
  */
-pmsg_t *
-g2_build_lni(void)
+static size_t
+g2_build_library_payload(char *payload)
 {
-	g2_tree_t *t;
-	pmsg_t *mb;
+	uint32 files, kbytes;
+	void *p = payload;
 
-	t = g2_tree_alloc_empty(G2_NAME(LNI));
+	files  = MIN(shared_files_scanned(), ~((uint32) 0U));
+	kbytes = MIN(shared_kbytes_scanned(), ~((uint32) 0U));
 
-	/* LS -- library statistics */
+	p = poke_le32(p, files);
+	p = poke_le32(p, kbytes);
 
-	{
-		uint32 files, kbytes;
-		char payload[8];
-		void *p = payload;
-		g2_tree_t *c;
+	return ptr_diff(p, payload);
+}
+
+/**
+ * Create the template of the Local Node Info message and record where the
+ * payloads we patch are located in the serialized message.
+ *
+ * @param shape		the layout signature of the message
+ */
+static void
+g2_build_lni_template(uint shape)
+{
+	g2_tree_t *t, *c;
+	const g2_tree_t *r;
+	char payload[8];
+	const void *base;
+	uint i;
 
-		files  = MIN(shared_files_scanned(), ~((uint32) 0U));
-		kbytes = MIN(shared_kbytes_scanned(), ~((uint32) 0U));
+	t = g2_tree_alloc_empty(G2_NAME(LNI));
 
-		p = poke_le32(p, files);
-		p = poke_le32(p, kbytes);
+	/* LS -- library statistics */
 
-		c = g2_tree_alloc_copy("LS", ARYLEN(payload));
-		g2_tree_add_child(t, c);
-	}
+	c = g2_tree_alloc_copy("LS", payload, g2_build_library_payload(payload));
+	g2_tree_add_child(t, c);
 
 	g2_build_add_firewalled(t);		/* FW -- whether servent is firewalled */
 	g2_build_add_uptime(t);			/* UP -- servent uptime */
@@ -535,10 +618,83 @@ g2_build_lni(void)
 	g2_build_add_node_address(t);	/* NA -- the IP:port of this node */
 	g2_build_add_tls(t);			/* TLS -- whether TLS is supported */
 
-	mb = g2_build_pmsg(t);
+	pmsg_free_null(&build_lni.mb);
+	build_lni.mb = g2_build_pmsg(t);
+	build_lni.shape = shape;
 	g2_tree_free_null(&t);
 
-	return mb;
+	/*
+	 * Payloads of the deserialized tree point into the message, giving us
+	 * the location of the slots to patch.
+	 */
+
+	base = pmsg_phys_base(build_lni.mb);
+	r = g2_frame_deserialize(base, pmsg_size(build_lni.mb), NULL, FALSE);
+
+	g_assert(r != NULL);
+
+	for (i = 0; i < N_ITEMS(g2_lni_slot_path); i++) {
+		const void *p = g2_tree_payload(r, g2_lni_slot_path[i],
+			&build_lni.len[i]);
+
+		g_assert(p != NULL);
+		build_lni.off[i] = ptr_diff(p, base);
+	}
+
+	g2_tree_free_null_const(&r);
+}
+
+/**
+ * Patch payload in the /LNI template.
+ */
+static void
+g2_build_lni_patch(enum g2_lni_slot slot, const void *payload, size_t len)
+{
+	g_assert(UNSIGNED(slot) < N_ITEMS(build_lni.off));
+	g_assert(len == build_lni.len[slot]);
+
+	memcpy(ptr_add_offset(pmsg_phys_base(build_lni.mb), build_lni.off[slot]),
+		payload, len);
+}
+
+/**
+ * Build a Local Node Info message.
+ *
+ * The message is built from a pre-serialized template, in which we patch
+ * the payloads that can change between two messages.  The template is only
+ * regenerated when the layout of the message changes.
+ *
+ * @return a /LNI message.
+ */
+pmsg_t *
+g2_build_lni(void)
+{
+	char ls[8], up[8], na[18];
+	size_t ls_len, up_len, na_len;
+	uint shape;
+
+	g_assert(thread_is_main());		/* Template is not protected */
+
+	ls_len = g2_build_library_payload(ls);
+	up_len = g2_build_uptime_payload(up);
+	na_len = g2_build_host_payload(na,
+		listen_addr_primary(), socket_listen_port());
+
+	shape = (GNET_PROPERTY(is_firewalled) ||
+			GNET_PROPERTY(is_udp_firewalled)) |
+		(tls_enabled() << 1) | (up_len << 2) | (na_len << 6);
+
+	if (NULL == build_lni.mb || shape != build_lni.shape)
+		g2_build_lni_template(shape);
+
+	g2_build_lni_patch(G2_LNI_SLOT_LS, ls, ls_len);
+	g2_build_lni_patch(G2_LNI_SLOT_UP, up, up_len);
+	g2_build_lni_patch(G2_LNI_SLOT_GU,
+		GNET_PROPERTY(servent_guid), GUID_RAW_SIZE);
+	g2_build_lni_patch(G2_LNI_SLOT_NA, na, na_len);
+
+	return pmsg_new(PMSG_P_DATA,
+		pmsg_phys_base(build_lni.mb), pmsg_size(build_lni.mb));
 }
 
 /**
@@ -1294,6 +1450,7 @@ g2_build_close(void)
 	/* Don't take locks, we're shutdowning from a single thread */
 	pmsg_free_null(&build_alive_pi);
 	pmsg_free_null(&build_po);
+	pmsg_free_null(&build_lni.mb);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -182,6 +182,7 @@
 struct frame_dctx {
 	const void *p;				/* Reading pointer */
 	const void *end;			/* End of reading buffer */
+	g2_tree_arena_t *arena;		/* Node arena, NULL if none */
 	unsigned copy:1;			/* Whether to copy payload data */
 };
 
@@ -327,7 +328,8 @@ g2_frame_recursive_deserialize(struct frame_dctx *dctx)
 	 * OK, create the node.  We don't know whether there will be a payload yet.
 	 */
 
-	node = g2_tree_alloc_empty(name);
+	node = NULL == dctx->arena ?
+		g2_tree_alloc_empty(name) : g2_tree_arena_alloc(dctx->arena, name);
 
 	/*
 	 * If it is a compound packet, deserialize its children.
@@ -339,6 +341,7 @@ g2_frame_recursive_deserialize(struct frame_dctx *dctx)
 
 		childctx.p = dctx->p;
 		childctx.end = const_ptr_add_offset(dctx->p, length);
+		childctx.arena = dctx->arena;
 		childctx.copy = dctx->copy;
 
 		while (ptr_cmp(childctx.p, childctx.end) < 0) {
@@ -393,7 +396,8 @@ g2_frame_recursive_deserialize(struct frame_dctx *dctx)
 	return node;
 
 failure:
-	g2_tree_free_null(&node);
+	if (NULL == dctx->arena)
+		g2_tree_free_null(&node);	/* Else freed with the arena */
 	return NULL;
 }
 
@@ -423,6 +427,7 @@ g2_frame_whole_length(const void *buf, size_t len)
 
 	dctx.p = buf;
 	dctx.end = const_ptr_add_offset(buf, len);
+	dctx.arena = NULL;
 	dctx.copy = FALSE;
 
 	/*
@@ -476,6 +481,7 @@ g2_frame_name(const void *buf, size_t len, size_t *nlen)
 
 	dctx.p = buf;
 	dctx.end = const_ptr_add_offset(buf, len);
+	dctx.arena = NULL;
 	dctx.copy = FALSE;
 
 	/*
@@ -510,7 +516,8 @@ g2_frame_name(const void *buf, size_t len, size_t *nlen)
 /**
  * Deserialize the first G2 packet held in the supplied buffer.
  *
- * Payload data is NOT copied but points directly into the input buffer.
+ * When payload data is NOT copied, it points directly into the input buffer
+ * and the nodes are allocated from an arena, released at once with the tree.
  *
  * @param buf			start of buffer where packet lies
  * @param len			amount of data held in the buffer
@@ -531,10 +538,18 @@ g2_frame_deserialize(const void *buf, size_t len, size_t *packet_len, bool copy)
 
 	dctx.p = buf;
 	dctx.end = const_ptr_add_offset(buf, len);
+	dctx.arena = copy ? NULL : g2_tree_arena_make();
 	dctx.copy = booleanize(copy);
 
 	t = g2_frame_recursive_deserialize(&dctx);
 
+	if (dctx.arena != NULL) {
+		if (NULL == t)
+			g2_tree_arena_free_null(&dctx.arena);
+		else
+			g2_tree_arena_attach(dctx.arena, t);
+	}
+
 	if (packet_len != NULL)
 		*packet_len = ptr_diff(dctx.p, buf);
 
@@ -53,7 +53,9 @@
 #include "core/hosts.h"
 #include "core/mq_tcp.h"
 #include "core/mq_udp.h"
+#include "core/matching.h"		/* For st_fill_qhv() */
 #include "core/nodes.h"
+#include "core/qrp.h"
 #include "core/routing.h"
 #include "core/search.h"
 #include "core/settings.h"		/* For is_my_address_and_port() */
@@ -70,6 +72,7 @@
 #include "lib/hstrfn.h"
 #include "lib/misc.h"			/* For dump_hex() */
 #include "lib/pmsg.h"
+#include "lib/pslist.h"
 #include "lib/str.h"
 #include "lib/stringify.h"		/* For plural() */
 #include "lib/tokenizer.h"
@@ -165,6 +168,7 @@ static const tokenizer_t g2_q2_md[] = {
 };
 
 static aging_table_t *g2_udp_pings;
+static query_hashvec_t *g2_query_hashvec;
 
 /**
  * Send a message to target node.
@@ -806,6 +810,118 @@ g2_node_intuit_media_type(const char *md)
 	return 0;
 }
 
+/**
+ * Handle reception of a /QHT
+ *
+ * Query hash tables are only sent by G2 leaves to their hub.  Their payload
+ * is laid out exactly like the Gnutella QRP messages, so we process them
+ * with the same code, faking a minimal Gnutella header as we do for /Q2.
+ * The table is then held by the node like the QRT of a Gnutella leaf.
+ */
+static void
+g2_node_handle_qht(gnutella_node_t *n, const g2_tree_t *t)
+{
+	const char *payload;
+	size_t paylen;
+	char *data;
+	uint16 size;
+	bool done;
+
+	if (!NODE_IS_LEAF(n)) {
+		g2_node_drop(G_STRFUNC, n, t, "not coming from a leaf");
+		return;
+	}
+
+	payload = g2_tree_node_payload(t, &paylen);
+
+	if (NULL == payload || 0 == paylen) {
+		g2_node_drop(G_STRFUNC, n, t, "no payload");
+		return;
+	}
+
+	if (NULL == n->qrt_receive) {
+		n->qrt_receive = qrt_receive_create(n, n->recv_query_table);
+		if (NULL == n->qrt_receive)
+			return;
+	}
+
+	/*
+	 * The payload lies within the message data, so it is shorter.
+	 */
+
+	data = n->data;
+	size = n->size;
+	n->data = deconstify_char(payload);
+	n->size = paylen;
+	gnutella_header_set_function(&n->header, GTA_MSG_QRP);
+
+	if (!qrt_receive_next(n->qrt_receive, &done))
+		goto restore;			/* Node BYE-ed */
+
+	if (done) {
+		qrt_receive_free(n->qrt_receive);
+		n->qrt_receive = NULL;
+	}
+
+restore:
+	n->data = data;
+	n->size = size;
+}
+
+/**
+ * Forward /Q2 to the G2 leaves whose query hash table shows they could
+ * answer it.
+ *
+ * The candidate leaves are checked against their tables in one batch, then
+ * the query is forwarded as-is: the same message is shared by all the
+ * leaves selected.
+ *
+ * @param n		the node from which the query comes
+ * @param qhv	the query hash vector
+ */
+static void
+g2_node_route_q2(const gnutella_node_t *n, const query_hashvec_t *qhv)
+{
+	const pslist_t *sl;
+	gnutella_node_t **nv;
+	size_t i, cnt = 0, max;
+
+	max = pslist_length(node_all_g2_nodes());
+
+	if (max <= 1)
+		return;			/* Only the node which sent us the query */
+
+	WALLOC_ARRAY(nv, max);
+
+	PSLIST_FOREACH(node_all_g2_nodes(), sl) {
+		gnutella_node_t *dn = sl->data;
+
+		if (dn == n || !NODE_IS_LEAF(dn) || NULL == dn->recv_query_table)
+			continue;
+
+		node_inc_qrp_query(dn);
+		nv[cnt++] = dn;
+	}
+
+	cnt = qrp_node_route_filter(qhv, nv, cnt);
+
+	if (cnt != 0) {
+		pmsg_t *mb = pmsg_new(PMSG_P_DATA, n->data, n->size);
+
+		for (i = 0; i < cnt; i++)
+			g2_node_send(nv[i], pmsg_clone(mb));
+
+		pmsg_free(mb);
+
+		if (GNET_PROPERTY(g2_debug) > 1) {
+			g_debug("%s(): forwarded /Q2 from %s to %zu lea%s",
+				G_STRFUNC, node_infostr(n), cnt, plural_f(cnt));
+		}
+	}
+
+	WFREE_ARRAY(nv, max);
+}
+
 /**
  * Handle reception of a /Q2
  */
@@ -820,6 +936,7 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 	uint32 iflags = 0;
 	search_request_info_t sri;
 	bool has_interest = FALSE;
+	query_hashvec_t *qhv = NULL;
 
 	node_inc_rx_query(n);
 
@@ -1006,6 +1123,33 @@ g2_node_handle_q2(gnutella_node_t *n, const g2_tree_t *t)
 
 	search_request(n, &sri, NULL);
 
+	/*
+	 * Forward the query to the leaves that can answer it.  Leaves send their
+	 * hits directly to the querying host, so we only forward queries that
+	 * bear a /Q2/UDP return address.
+	 */
+
+	if (sri.oob) {
+		int i;
+
+		qhv = g2_query_hashvec;
+		qhvec_reset(qhv);
+
+		for (i = 0; i < sri.exv_sha1cnt; i++) {
+			char urn[SHA1_URN_LENGTH + 1];
+
+			str_bprintf(ARYLEN(urn),
+				"urn:sha1:%s", sha1_base32(&sri.exv_sha1[i].sha1));
+			qhvec_add(qhv, urn, QUERY_H_URN);
+		}
+
+		if (dn != NULL)
+			st_fill_qhv(sri.extended_query, qhv);
+
+		if (qhvec_count(qhv) != 0)
+			g2_node_route_q2(n, qhv);
+	}
+
 done:
 
 	HFREE_NULL(dn);
@@ -1071,6 +1215,9 @@ g2_node_handle(gnutella_node_t *n)
 	case G2_MSG_Q2:
 		g2_node_handle_q2(n, t);
 		break;
+	case G2_MSG_QHT:
+		g2_node_handle_qht(n, t);
+		break;
 	case G2_MSG_QA:
 	case G2_MSG_QKA:
 		g2_node_handle_rpc_answer(n, t, type);
@@ -1100,6 +1247,8 @@ g2_node_init(void)
 	g2_udp_pings = aging_make(G2_UDP_PING_FREQ,
 		host_addr_hash_func, host_addr_eq_func, wfree_host_addr);
 
+	g2_query_hashvec = qhvec_alloc(QRP_HVEC_MAX);
+
 	TOKENIZE_CHECK_SORTED(g2_q2_children);
 	TOKENIZE_CHECK_SORTED(g2_lni_children);
 	TOKENIZE_CHECK_SORTED(g2_q2_i);
@@ -1113,6 +1262,8 @@ void G_COLD
 g2_node_close(void)
 {
 	aging_destroy(&g2_udp_pings);
+	qhvec_free(g2_query_hashvec);
+	g2_query_hashvec = NULL;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -114,19 +114,64 @@
 #include "lib/override.h"		/* Must be the last header included */
 
 enum g2_tree_magic { G2_TREE_MAGIC = 0x67f8b9e7 };
+enum g2_tree_arena_magic { G2_TREE_ARENA_MAGIC = 0x2d6c1f4b };
+
+#define G2_TREE_NAME_MAX	8		/**< Maximum length of a packet name */
+#define G2_TREE_ARENA_CHUNK	8		/**< Nodes per arena chunk */
 
 /**
  * A G2 packet (tree structure).
  */
 struct g2_tree {
 	enum g2_tree_magic magic;		/**< Magic number */
-	const char *name;				/**< Node name (atom) */
+	const char *name;				/**< Node name (atom unless in arena) */
 	void *payload;					/**< Payload buffer, NULL if none */
 	size_t paylen;					/**< Payload length */
+	struct g2_tree_arena *arena;	/**< Arena holding node, NULL if none */
 	node_t node;					/**< Embedded tree node */
 	unsigned copied:1;				/**< Whether payload was copied */
 };
 
+/**
+ * A node allocated from an arena, with its name stored inline.
+ */
+struct g2_tree_anode {
+	struct g2_tree tree;
+	char name[G2_TREE_NAME_MAX + 1];
+};
+
+struct g2_tree_arena_chunk {
+	struct g2_tree_arena_chunk *next;
+	struct g2_tree_anode nodes[G2_TREE_ARENA_CHUNK];
+};
+
+/**
+ * A node arena.
+ *
+ * Deserialized trees are short-lived and their nodes are never freed
+ * individually, so we carve them out of chunks that are all released at
+ * once, along with the root.  The first chunk is embedded, which is enough
+ * for most messages.
+ *
+ * When the tree is modified with nodes or payloads that do not belong to
+ * the arena, it becomes "mixed" and must be traversed to be freed.
+ */
+struct g2_tree_arena {
+	enum g2_tree_arena_magic magic;
+	const g2_tree_t *root;				/**< Root owning the arena */
+	struct g2_tree_arena_chunk *chunk;	/**< Current chunk */
+	uint used;							/**< Nodes used in current chunk */
+	unsigned mixed:1;					/**< Holds foreign nodes or payloads */
+	struct g2_tree_arena_chunk first;	/**< First chunk */
+};
+
+static inline void
+g2_tree_arena_check(const struct g2_tree_arena * const a)
+{
+	g_assert(a != NULL);
+	g_assert(G2_TREE_ARENA_MAGIC == a->magic);
+}
+
 static inline void
 g2_tree_check(const struct g2_tree * const t)
 {
@@ -438,6 +483,8 @@ g2_tree_alloc_empty(const char *name)
 
 /**
  * Release memory used by node.
+ *
+ * Nodes belonging to an arena are only released with the arena.
  */
 static void
 g2_tree_free_node(void *data)
@@ -449,12 +496,124 @@ g2_tree_free_node(void *data)
 	if (n->payload != NULL && n->copied)
 		hfree(n->payload);
 
-	atom_str_free_null(&n->name);
 	n->payload = NULL;
+
+	if (n->arena != NULL)
+		return;
+
+	atom_str_free_null(&n->name);
 	n->magic = 0;
 	WFREE(n);
 }
 
+/**
+ * Create a new node arena.
+ */
+g2_tree_arena_t *
+g2_tree_arena_make(void)
+{
+	g2_tree_arena_t *a;
+
+	WALLOC(a);
+	a->magic = G2_TREE_ARENA_MAGIC;
+	a->root = NULL;
+	a->chunk = &a->first;
+	a->first.next = NULL;
+	a->used = 0;
+	a->mixed = FALSE;
+
+	return a;
+}
+
+/**
+ * Free arena and all the nodes it holds, nullifying its pointer.
+ *
+ * The nodes must not be referenced any more.
+ */
+void
+g2_tree_arena_free_null(g2_tree_arena_t **a_ptr)
+{
+	g2_tree_arena_t *a = *a_ptr;
+
+	if (a != NULL) {
+		struct g2_tree_arena_chunk *c, *next;
+
+		g2_tree_arena_check(a);
+
+		for (c = a->chunk; c != &a->first; c = next) {
+			next = c->next;
+			WFREE(c);
+		}
+
+		a->magic = 0;
+		WFREE(a);
+		*a_ptr = NULL;
+	}
+}
+
+/**
+ * Create a node without any payload, allocated from the arena.
+ *
+ * @param a			the arena
+ * @param name		name of the node, at most 8 characters
+ *
+ * @return a new node with no payload.
+ */
+g2_tree_t *
+g2_tree_arena_alloc(g2_tree_arena_t *a, const char *name)
+{
+	struct g2_tree_anode *an;
+	size_t len;
+
+	g2_tree_arena_check(a);
+
+	len = vstrlen(name);
+	g_assert(len <= G2_TREE_NAME_MAX);
+
+	if G_UNLIKELY(G2_TREE_ARENA_CHUNK == a->used) {
+		struct g2_tree_arena_chunk *c;
+
+		WALLOC(c);
+		c->next = a->chunk;
+		a->chunk = c;
+		a->used = 0;
+	}
+
+	an = &a->chunk->nodes[a->used++];
+	ZERO(&an->tree);
+	an->tree.magic = G2_TREE_MAGIC;
+	an->tree.arena = a;
+	memcpy(an->name, name, len + 1);
+	an->tree.name = an->name;
+
+	return &an->tree;
+}
+
+/**
+ * Make the tree root the owner of the arena from which its nodes were
+ * allocated: the arena will be released when the tree is freed.
+ */
+void
+g2_tree_arena_attach(g2_tree_arena_t *a, const g2_tree_t *root)
+{
+	g2_tree_arena_check(a);
+	g2_tree_check(root);
+	g_assert(a == root->arena);
+	g_assert(NULL == a->root);
+
+	a->root = root;
+}
+
+/**
+ * Flag the arena of the node as mixed, if any.
+ */
+static inline void
+g2_tree_arena_mixed(const g2_tree_t *node)
+{
+	if (node->arena != NULL)
+		node->arena->mixed = TRUE;
+}
+
 /**
  * Create a node with associated payload.
  *
@@ -525,6 +684,9 @@ g2_tree_set_payload(g2_tree_t *root, const void *payload,
 		deconstify_gpointer(payload);
 	root->paylen = paylen;
 	root->copied = booleanize(copy);
+
+	if (copy)
+		g2_tree_arena_mixed(root);
 }
 
 /**
@@ -579,6 +741,7 @@ g2_tree_append_payload(g2_tree_t *root, const void *payload, size_t paylen)
 	root->paylen = newlen;
 
 	g_assert(root->copied);
+	g2_tree_arena_mixed(root);
 
 	return newlen;
 }
@@ -594,6 +757,9 @@ g2_tree_add_child(g2_tree_t *parent, g2_tree_t *child)
 	g2_tree_check(parent);
 	g2_tree_check(child);
 
+	if (child->arena != parent->arena)
+		g2_tree_arena_mixed(parent);
+
 	etree_init_root(&t, parent, FALSE, offsetof(g2_tree_t, node));
 	etree_prepend_child(&t, parent, child);
 }
@@ -619,12 +785,26 @@ g2_tree_reverse_children(g2_tree_t *root)
 static void
 g2_tree_free(g2_tree_t *root)
 {
+	g2_tree_arena_t *a = root->arena;
 	etree_t t;
 
 	g2_tree_check(root);
 
+	/*
+	 * When the root owns an arena that only holds its own nodes, we can
+	 * release the whole tree at once, without traversing it.
+	 */
+
+	if (a != NULL && a->root == root && !a->mixed) {
+		g2_tree_arena_free_null(&a);
+		return;
+	}
+
 	etree_init_root(&t, root, FALSE, offsetof(g2_tree_t, node));
 	etree_sub_free(&t, root, g2_tree_free_node);
+
+	if (a != NULL && a->root == root)
+		g2_tree_arena_free_null(&a);
 }
 
 /**
@@ -750,11 +930,30 @@ g2_tree_test(void)
 	g_assert(node != NULL);
 	g_assert(node != c2);
 	g_assert(0 == strcmp("c2", g2_tree_name(node)));
+	g2_tree_free_null(&retrieved);
+
+	/*
+	 * Arena-backed deserialization, payloads pointing to the buffer.
+	 */
+
+	retrieved = g2_frame_deserialize(buffer, length, &rlen, FALSE);
+	g_assert(retrieved != NULL);
+	g_assert(length == rlen);
+
+	g_debug("%s(): arena-deserialized tree:", G_STRFUNC);
+	ok = g2_tfmt_tree_dump(retrieved, stderr, G2FMT_O_PAYLOAD | G2FMT_O_PAYLEN);
+	g_assert(ok);
+
+	node = g2_tree_lookup(retrieved, "/root/rchild/c1");
+	g_assert(node != NULL);
+	g_assert(0 == strcmp("c1", g2_tree_name(node)));
+	g_assert(g2_tree_node_payload(node, &rlen) != NULL);
+	g_assert(LARGE_PAYLOAD == rlen);
 
-	HFREE_NULL(buffer);
 	HFREE_NULL(large);
 	g2_tree_free_null(&root);
 	g2_tree_free_null(&retrieved);
+	HFREE_NULL(buffer);
 
 	g_debug("%s() done.", G_STRFUNC);
 }
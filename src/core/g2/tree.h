@@ -37,6 +37,9 @@
 struct g2_tree;
 typedef struct g2_tree g2_tree_t;
 
+struct g2_tree_arena;
+typedef struct g2_tree_arena g2_tree_arena_t;
+
 /*
  * Public interface.
  */
@@ -63,6 +66,11 @@ void g2_tree_add_child(g2_tree_t *parent, g2_tree_t *child);
 void g2_tree_reverse_children(g2_tree_t *node);
 void g2_tree_free_null(g2_tree_t **root_ptr);
 
+g2_tree_arena_t *g2_tree_arena_make(void);
+void g2_tree_arena_free_null(g2_tree_arena_t **a_ptr);
+g2_tree_t *g2_tree_arena_alloc(g2_tree_arena_t *a, const char *name);
+void g2_tree_arena_attach(g2_tree_arena_t *a, const g2_tree_t *root);
+
 void g2_tree_enter_leave(g2_tree_t *root,
 	match_fn_t enter, data_fn_t leave, void *data);
 
@@ -51,17 +51,35 @@
 #include "lib/atoms.h"
 #include "lib/base32.h"
 #include "lib/bstr.h"
+#include "lib/cq.h"
+#include "lib/dbmw.h"
+#include "lib/dbstore.h"
 #include "lib/endian.h"
 #include "lib/hikset.h"
+#include "lib/pmsg.h"
 #include "lib/sha1.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
 #define MAX_PROXIES		32		/**< Max push-proxies we collect from a PROX */
 
+#define GDHT_CACHE_PROXIES	16		/**< Max push-proxies we cache per GUID */
+#define GDHT_CACHE_SIZE		512		/**< Amount of keys to keep in cache */
+#define GDHT_CACHE_VERSION	0		/**< Serialization version number */
+#define GDHT_CACHE_REPLAYS	2		/**< Max replays before a new lookup */
+#define GDHT_CACHE_LIFETIME	(DHT_VALUE_PROX_EXPIRE / 2)	/**< Found entries */
+#define GDHT_CACHE_NEG_LIFETIME	(10 * 60)	/**< 10 minutes, for failures */
+#define GDHT_CACHE_REPLAY_DELAY	1		/**< ms, delay before replaying */
+#define GDHT_PRUNE_PERIOD	(15 * 60 * 1000)	/**< 15 minutes, in ms */
+#define GDHT_SYNC_PERIOD	(60 * 1000)			/**< 1 minute, in ms */
+
+#define GDHT_CACHE_F_SERVER	(1U << 0)	/**< Servent address changed */
+#define GDHT_CACHE_F_DHT	(1U << 1)	/**< Servent publishes PROX in DHT */
+
 /**
  * Hash table holding all the pending lookups by KUID.
  */
@@ -95,6 +113,33 @@ typedef enum {
 	GUID_LOOKUP_MAGIC = 0x465531c7U
 } glk_magic_t;
 
+/**
+ * Results of a PROX / NOPE lookup, as cached to disk.
+ * The structure is serialized first, not written as-is.
+ *
+ * The structure is keyed by the servent's GUID.  An entry without any
+ * push-proxy records a failed lookup.
+ */
+struct guid_cache {
+	time_t expire;			/**< Expiration time of the entry */
+	host_addr_t addr;		/**< Servent's address, from PROX */
+	uint16 port;			/**< Servent's port, from PROX */
+	uint8 flags;			/**< GDHT_CACHE_F_* flags */
+	uint8 replays;			/**< Amount of times we replayed the entry */
+	uint8 count;			/**< Amount of push-proxies */
+	gnet_host_t proxies[GDHT_CACHE_PROXIES];	/**< Push-proxies */
+};
+
+/**
+ * DBM wrapper to associate a servent's GUID with its push-proxies.
+ */
+static dbmw_t *db_guid_cache;
+static char db_guid_cache_base[] = "dht_guid_cache";
+static char db_guid_cache_what[] = "DHT push-proxies of servents";
+
+static cperiodic_t *gdht_prune_ev;		/**< Expired entries pruning */
+static cperiodic_t *gdht_sync_ev;		/**< DB sync */
+
 /**
  * Context for PROX / NOPE lookups.
  */
@@ -105,6 +150,8 @@ struct guid_lookup {
 	host_addr_t addr;		/**< Servent's address */
 	uint16 port;			/**< Servent's port */
 	unsigned nope:1;		/**< Was looking for a NOPE instead of a PROX */
+	struct guid_cache *gc;	/**< Results collected for caching */
+	cevent_t *replay_ev;	/**< Replay of cached results, if pending */
 };
 
 static inline void
@@ -191,11 +238,205 @@ gdht_free_guid_lookup(struct guid_lookup *glk, bool do_remove)
 		hikset_remove(guid_lookups, glk->id);
 	}
 
+	cq_cancel(&glk->replay_ev);
+	WFREE_NULL(glk->gc, sizeof *glk->gc);
 	kuid_atom_free(glk->id);
 	atom_guid_free(glk->guid);
 	WFREE(glk);
 }
 
+/**
+ * Serialization routine for guid_cache.
+ */
+static void
+serialize_guid_cache(pmsg_t *mb, const void *data)
+{
+	const struct guid_cache *gc = data;
+	uint i;
+
+	pmsg_write_u8(mb, GDHT_CACHE_VERSION);
+	pmsg_write_time(mb, gc->expire);
+	pmsg_write_ipv4_or_ipv6_addr(mb, gc->addr);
+	pmsg_write_be16(mb, gc->port);
+	pmsg_write_u8(mb, gc->flags);
+	pmsg_write_u8(mb, gc->replays);
+	pmsg_write_u8(mb, gc->count);
+
+	for (i = 0; i < gc->count; i++) {
+		pmsg_write_ipv4_or_ipv6_addr(mb, gnet_host_get_addr(&gc->proxies[i]));
+		pmsg_write_be16(mb, gnet_host_get_port(&gc->proxies[i]));
+	}
+}
+
+/**
+ * Deserialization routine for guid_cache.
+ */
+static void
+deserialize_guid_cache(bstr_t *bs, void *valptr, size_t len)
+{
+	struct guid_cache *gc = valptr;
+	uint8 version;
+	uint i;
+
+	g_assert(sizeof *gc == len);
+
+	bstr_read_u8(bs, &version);
+	bstr_read_time(bs, &gc->expire);
+	bstr_read_packed_ipv4_or_ipv6_addr(bs, &gc->addr);
+	bstr_read_be16(bs, &gc->port);
+	bstr_read_u8(bs, &gc->flags);
+	bstr_read_u8(bs, &gc->replays);
+	bstr_read_u8(bs, &gc->count);
+
+	gc->count = MIN(gc->count, GDHT_CACHE_PROXIES);
+
+	for (i = 0; i < gc->count; i++) {
+		host_addr_t addr;
+		uint16 port;
+
+		bstr_read_packed_ipv4_or_ipv6_addr(bs, &addr);
+		bstr_read_be16(bs, &port);
+		gnet_host_set(&gc->proxies[i], addr, port);
+	}
+}
+
+/**
+ * Record push-proxy in the results collected by a GUID lookup.
+ */
+static void
+gdht_cache_add_proxy(struct guid_lookup *glk,
+	const host_addr_t addr, uint16 port)
+{
+	struct guid_cache *gc = glk->gc;
+	gnet_host_t host;
+	uint i;
+
+	if (NULL == gc || gc->count >= GDHT_CACHE_PROXIES)
+		return;
+
+	gnet_host_set(&host, addr, port);
+
+	for (i = 0; i < gc->count; i++) {
+		if (gnet_host_equal(&gc->proxies[i], &host))
+			return;
+	}
+
+	gc->proxies[gc->count++] = host;
+}
+
+/**
+ * Store the results of a GUID lookup in the cache.
+ *
+ * An empty result set is stored as well, to avoid looking again for a
+ * servent which cannot be found in the DHT for a while.
+ */
+static void
+gdht_cache_store(struct guid_lookup *glk)
+{
+	struct guid_cache *gc = glk->gc;
+
+	if (NULL == gc || NULL == db_guid_cache)
+		return;
+
+	/*
+	 * We cannot know when the values were published, so assume they are
+	 * halfway through their lifetime: the servent republishes them before
+	 * they expire anyway.
+	 */
+
+	gc->expire = time_advance(tm_time(), 0 == gc->count ?
+		GDHT_CACHE_NEG_LIFETIME : GDHT_CACHE_LIFETIME);
+
+	dbmw_write(db_guid_cache, glk->guid, PTRLEN(gc));
+}
+
+/**
+ * Callout queue callback to replay the cached results of a GUID lookup.
+ */
+static void
+gdht_cache_replay(cqueue_t *cq, void *obj)
+{
+	struct guid_lookup *glk = obj;
+	struct guid_cache *gc = glk->gc;
+
+	guid_lookup_check(glk);
+
+	cq_zero(cq, &glk->replay_ev);
+
+	if (gc->flags & GDHT_CACHE_F_SERVER)
+		download_found_server(glk->guid, gc->addr, gc->port);
+
+	if (gc->flags & GDHT_CACHE_F_DHT)
+		download_server_publishes_in_dht(glk->guid);
+
+	if (gc->count != 0)
+		download_add_push_proxies(glk->guid, gc->proxies, gc->count);
+
+	gdht_free_guid_lookup(glk, TRUE);
+}
+
+/**
+ * Check whether we have cached results for a GUID lookup, in which case
+ * they will be replayed shortly instead of querying the DHT again.
+ *
+ * @return TRUE if the lookup was answered from the cache.
+ */
+static bool
+gdht_cache_lookup(struct guid_lookup *glk)
+{
+	struct guid_cache *gc;
+
+	if (NULL == db_guid_cache)
+		return FALSE;
+
+	gc = dbmw_read(db_guid_cache, glk->guid, NULL);
+
+	if (NULL == gc) {
+		if (dbmw_has_ioerr(db_guid_cache)) {
+			s_warning_once_per(LOG_PERIOD_MINUTE,
+				"DBMW \"%s\" I/O error", dbmw_name(db_guid_cache));
+		}
+		return FALSE;
+	}
+
+	if (delta_time(gc->expire, tm_time()) <= 0) {
+		dbmw_delete(db_guid_cache, glk->guid);
+		return FALSE;
+	}
+
+	/*
+	 * Cached push-proxies may have been tried already by the time the
+	 * download layer asks again, in which case we need fresh ones.
+	 */
+
+	if (gc->count != 0) {
+		if (gc->replays >= GDHT_CACHE_REPLAYS)
+			return FALSE;
+		gc->replays++;
+		dbmw_write(db_guid_cache, glk->guid, PTRLEN(gc));
+	}
+
+	if (GNET_PROPERTY(dht_lookup_debug)) {
+		g_debug("DHT cached PROX for GUID %s: %u push-prox%s, expires in %s",
+			guid_to_string(glk->guid), gc->count, plural_y(gc->count),
+			compact_time(delta_time(gc->expire, tm_time())));
+	}
+
+	gnet_stats_inc_general(0 == gc->count ?
+		GNR_DHT_GUID_CACHE_NEGATIVE_HITS : GNR_DHT_GUID_CACHE_HITS);
+
+	/*
+	 * Replay asynchronously: the download layer does not expect to get
+	 * results whilst it is requesting the lookup.
+	 */
+
+	glk->gc = WCOPY(gc);
+	glk->replay_ev = cq_main_insert(GDHT_CACHE_REPLAY_DELAY,
+		gdht_cache_replay, glk);
+
+	return TRUE;
+}
+
 /*
  * Get human-readable DHT value type and version.
  * @return pointer to static data
@@ -645,6 +886,16 @@ gdht_guid_not_found(const kuid_t *kuid, lookup_error_t error, void *arg)
 		g_debug("DHT PROX lookup for GUID %s failed: %s",
 			guid_to_string(glk->guid), lookup_strerror(error));
 
+	/*
+	 * Only remember servents which are not in the DHT, not lookups that
+	 * failed because of our own DHT connectivity.
+	 */
+
+	if (LOOKUP_E_NOT_FOUND == error && glk->gc != NULL) {
+		glk->gc->count = 0;
+		gdht_cache_store(glk);
+	}
+
 	gdht_free_guid_lookup(glk, TRUE);
 }
 
@@ -812,8 +1063,14 @@ gdht_handle_prox(const lookup_val_rc_t *rc, struct guid_lookup *glk)
 	 * since we last heard about it.
 	 */
 
-	if (!host_addr_equiv(glk->addr, rc->addr) || port != glk->port)
+	if (!host_addr_equiv(glk->addr, rc->addr) || port != glk->port) {
 		download_found_server(glk->guid, rc->addr, port);
+		if (glk->gc != NULL) {
+			glk->gc->flags |= GDHT_CACHE_F_SERVER;
+			glk->gc->addr = rc->addr;
+			glk->gc->port = port;
+		}
+	}
 
 	/*
 	 * Create new push-proxies.
@@ -829,6 +1086,14 @@ gdht_handle_prox(const lookup_val_rc_t *rc, struct guid_lookup *glk)
 	download_server_publishes_in_dht(glk->guid);
 	download_add_push_proxies(glk->guid, proxies, proxy_count);
 
+	if (glk->gc != NULL) {
+		glk->gc->flags |= GDHT_CACHE_F_DHT;
+		for (i = 0; i < proxy_count; i++) {
+			gdht_cache_add_proxy(glk, gnet_host_get_addr(&proxies[i]),
+				gnet_host_get_port(&proxies[i]));
+		}
+	}
+
 	/* FALL THROUGH */
 
 cleanup:
@@ -922,6 +1187,7 @@ gdht_handle_nope(const lookup_val_rc_t *rc, struct guid_lookup *glk)
 			host_addr_port_to_string2(glk->addr, glk->port));
 
 	download_add_push_proxy(glk->guid, rc->addr, port);
+	gdht_cache_add_proxy(glk, rc->addr, port);
 
 	/* FALL THROUGH */
 
@@ -1005,6 +1271,9 @@ gdht_guid_found(const kuid_t *kuid, const lookup_val_rs_t *rs, void *arg)
 		GNR_DHT_SUCCESSFUL_NODE_PUSH_ENTRY_LOOKUPS :
 		GNR_DHT_SUCCESSFUL_PUSH_PROXY_LOOKUPS);
 
+	if (glk->gc != NULL && glk->gc->count != 0)
+		gdht_cache_store(glk);
+
 	gdht_free_guid_lookup(glk, TRUE);
 }
 
@@ -1020,7 +1289,7 @@ gdht_find_guid(const guid_t *guid, const host_addr_t addr, uint16 port)
 	g_assert(!guid_is_blank(guid));
 	g_assert(host_addr_initialized(addr));
 
-	WALLOC(glk);
+	WALLOC0(glk);
 	glk->magic = GUID_LOOKUP_MAGIC;
 	glk->id = gdht_kuid_from_guid(guid);
 	glk->guid = atom_guid_get(guid);
@@ -1043,12 +1312,22 @@ gdht_find_guid(const guid_t *guid, const host_addr_t addr, uint16 port)
 		return;
 	}
 
+	hikset_insert_key(guid_lookups, &glk->id);
+
+	/*
+	 * The same servents are looked for repeatedly, as long as we have
+	 * downloads from them: use what we already know when possible.
+	 */
+
+	if (gdht_cache_lookup(glk))
+		return;
+
 	if (GNET_PROPERTY(dht_lookup_debug))
 		g_debug("DHT will be searching PROX for %s (GUID %s) for %s",
 			kuid_to_hex_string(glk->id),
 			guid_to_string(guid), host_addr_port_to_string(addr, port));
 
-	hikset_insert_key(guid_lookups, &glk->id);
+	WALLOC0(glk->gc);
 
 	/*
 	 * We're looking for ANY value here, but we really expect PROX or NOPE
@@ -1069,16 +1348,78 @@ gdht_find_guid(const guid_t *guid, const host_addr_t addr, uint16 port)
 		gdht_guid_found, gdht_guid_not_found, glk);
 }
 
+/**
+ * DBMW foreach iterator to remove expired cache entries.
+ * @return TRUE if entry must be deleted.
+ */
+static bool
+gdht_cache_prune(void *unused_key, void *value, size_t u_len, void *u_data)
+{
+	const struct guid_cache *gc = value;
+
+	(void) unused_key;
+	(void) u_len;
+	(void) u_data;
+
+	return delta_time(gc->expire, tm_time()) <= 0;
+}
+
+/**
+ * Callout queue periodic event to expire old cache entries.
+ */
+static bool
+gdht_periodic_prune(void *unused_obj)
+{
+	(void) unused_obj;
+
+	dbmw_foreach_remove(db_guid_cache, gdht_cache_prune, NULL);
+
+	if (GNET_PROPERTY(dht_lookup_debug)) {
+		g_debug("DHT cached PROX for %zu GUID%s",
+			dbmw_count(db_guid_cache), plural(dbmw_count(db_guid_cache)));
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Callout queue periodic event to synchronize the disk image.
+ */
+static bool
+gdht_periodic_sync(void *unused_obj)
+{
+	(void) unused_obj;
+
+	dbstore_sync_flush(db_guid_cache);
+	return TRUE;		/* Keep calling */
+}
+
 /**
  * Initialize the Gnutella DHT layer.
  */
 void
 gdht_init(void)
 {
+	dbstore_kv_t kv =
+		{ GUID_RAW_SIZE, NULL, sizeof(struct guid_cache), 0 };
+	dbstore_packing_t packing =
+		{ serialize_guid_cache, deserialize_guid_cache, NULL };
+
 	sha1_lookups = hikset_create(
 		offsetof(struct sha1_lookup, id), HASH_KEY_FIXED, KUID_RAW_SIZE);
 	guid_lookups = hikset_create(
 		offsetof(struct guid_lookup, id), HASH_KEY_FIXED, KUID_RAW_SIZE);
+
+	db_guid_cache = dbstore_open(db_guid_cache_what, settings_gnet_db_dir(),
+		db_guid_cache_base, kv, packing, GDHT_CACHE_SIZE,
+		guid_hash, guid_eq, FALSE);
+
+	dbmw_foreach_remove(db_guid_cache, gdht_cache_prune, NULL);
+
+	gdht_prune_ev = cq_periodic_main_add(
+		GDHT_PRUNE_PERIOD, gdht_periodic_prune, NULL);
+	gdht_sync_ev = cq_periodic_main_add(
+		GDHT_SYNC_PERIOD, gdht_periodic_sync, NULL);
 }
 
 /**
@@ -1118,6 +1459,11 @@ gdht_close(void)
 
 	hikset_foreach(guid_lookups, free_guid_lookups_kv, NULL);
 	hikset_free_null(&guid_lookups);
+
+	cq_periodic_remove(&gdht_prune_ev);
+	cq_periodic_remove(&gdht_sync_ev);
+	dbstore_close(db_guid_cache, settings_gnet_db_dir(), db_guid_cache_base);
+	db_guid_cache = NULL;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -35,6 +35,7 @@
 
 #include "geo_ip.h"
 #include "settings.h"
+#include "startup.h"
 
 #include "lib/ascii.h"
 #include "lib/file.h"
@@ -60,17 +61,21 @@
 
 struct gip_source {
 	const char *file;		/**< Source file */
+	const char *compiled;	/**< Compiled database, in the gnet DB dir */
 	const char *what;		/**< English description of file */
 	time_t mtime;			/**< Modification time of loaded file */
+	struct iprange_db *db;	/**< The database of country CIDR ranges */
 };
 
+/*
+ * Each source has its own database so that both files can be loaded
+ * concurrently at startup time.
+ */
 static struct gip_source gip_source[] = {
-	{ "geo-ip.txt",		"Geographic IPv4 mappings", 0 },
-	{ "geo-ipv6.txt",	"Geographic IPv6 mappings", 0 },
+	{ "geo-ip.txt",	  "geo-ip.db",	 "Geographic IPv4 mappings", 0, NULL },
+	{ "geo-ipv6.txt", "geo-ipv6.db", "Geographic IPv6 mappings", 0, NULL },
 };
 
-static struct iprange_db *geo_db;	/**< The database of bogus CIDR ranges */
-
 /**
  * Context used during ip_range_split() calls.
  */
@@ -99,7 +104,7 @@ gip_add_cidr(uint32 ip, uint bits, void *udata)
 			ip_to_string(ip), bits, ctx->line);
 
 	cc = ctx->country;
-	error = iprange_add_cidr(geo_db, ip, bits, cc);
+	error = iprange_add_cidr(gip_source[GIP_IPV4].db, ip, bits, cc);
 
 	switch (error) {
 	case IPR_ERR_OK:
@@ -287,7 +292,8 @@ no_bits:
 		return;
 	}
 
-	error = iprange_add_cidr6(geo_db, ip, bits, (code + 1) << 1);
+	error = iprange_add_cidr6(gip_source[GIP_IPV6].db,
+				ip, bits, (code + 1) << 1);
 
 	if (IPR_ERR_OK != error) {
 		g_warning("%s, line %d: cannot insert %s/%u: %s",
@@ -299,6 +305,9 @@ no_bits:
 /**
  * Load geographic IP data from the supplied FILE.
  *
+ * The parsed data are saved in a compiled form, which is simply mapped
+ * in memory on the next loadings, until the FILE changes.
+ *
  * @return The amount of entries loaded.
  */
 static uint G_COLD
@@ -307,28 +316,38 @@ gip_load(FILE *f, unsigned idx)
 	char line[1024];
 	int linenum = 0;
 	filestat_t buf;
+	struct iprange_db *db;
+	char *compiled;
+	uint64 stamp = 0;
 
 	g_assert(f != NULL);
 	g_assert(uint_is_non_negative(idx));
 	g_assert(idx < N_ITEMS(gip_source));
 
-	switch (idx) {
-	case GIP_IPV4:
-		iprange_reset_ipv4(geo_db);
-		break;
-	case GIP_IPV6:
-		iprange_reset_ipv6(geo_db);
-		break;
-	default:
-		g_assert_not_reached();
-	}
+	compiled = make_pathname(settings_gnet_db_dir(), gip_source[idx].compiled);
 
 	if (-1 == fstat(fileno(f), &buf)) {
 		g_warning("cannot stat %s: %m", gip_source[idx].file);
 	} else {
 		gip_source[idx].mtime = buf.st_mtime;
+		stamp = iprange_file_stamp(&buf);
+		db = iprange_load(compiled, stamp);
+
+		if (db != NULL) {
+			iprange_free(&gip_source[idx].db);
+			gip_source[idx].db = db;
+			goto loaded;
+		}
 	}
 
+	/*
+	 * A mapped database is read-only, hence we always parse the file into
+	 * a new database instead of resetting the current one.
+	 */
+
+	iprange_free(&gip_source[idx].db);
+	gip_source[idx].db = db = iprange_new();
+
 	while (fgets(ARYLEN(line), f)) {
 		linenum++;
 
@@ -353,21 +372,27 @@ gip_load(FILE *f, unsigned idx)
 
 	}
 
-	iprange_sync(geo_db);
+	iprange_sync(db);
+
+	if (stamp != 0)
+		iprange_save(db, compiled, stamp);
+
+loaded:
+	HFREE_NULL(compiled);
 
 	if (GNET_PROPERTY(reload_debug)) {
 		if (GIP_IPV4 == idx) {
 			g_debug("loaded %u geographical IPv4 ranges (%u hosts)",
-				iprange_get_item_count4(geo_db),
-				iprange_get_host_count4(geo_db));
+				iprange_get_item_count4(db),
+				iprange_get_host_count4(db));
 		} else {
 			g_debug("loaded %u geographical IPv6 ranges",
-				iprange_get_item_count6(geo_db));
+				iprange_get_item_count6(db));
 		}
 	}
 
 	return GIP_IPV4 == idx ?
-		iprange_get_item_count4(geo_db) : iprange_get_item_count6(geo_db);
+		iprange_get_item_count4(db) : iprange_get_item_count6(db);
 }
 
 /**
@@ -407,15 +432,18 @@ gip_changed(const char *filename, void *idx_ptr)
  *
  * The selected file will then be monitored and a reloading will occur
  * shortly after a modification.
+ *
+ * This is run by a separate thread at startup time, see startup_spawn().
  */
 static void
-gip_retrieve(unsigned n)
+gip_retrieve(void *p)
 {
 	FILE *f;
 	int idx;
 	char *filename;
 	file_path_t fp[4];
 	unsigned length;
+	unsigned n = pointer_to_uint(p);
 
 	length = settings_file_path_load(fp, gip_source[n].file, SFP_DFLT);
 
@@ -441,10 +469,11 @@ gip_retrieve(unsigned n)
 void
 gip_init(void)
 {
-	geo_db = iprange_new();
+	gip_source[GIP_IPV4].db = iprange_new();
+	gip_source[GIP_IPV6].db = iprange_new();
 
-	gip_retrieve(GIP_IPV4);
-	gip_retrieve(GIP_IPV6);
+	startup_spawn("geo-ip.txt", gip_retrieve, uint_to_pointer(GIP_IPV4));
+	startup_spawn("geo-ipv6.txt", gip_retrieve, uint_to_pointer(GIP_IPV6));
 }
 
 /**
@@ -453,7 +482,8 @@ gip_init(void)
 void
 gip_close(void)
 {
-	iprange_free(&geo_db);
+	iprange_free(&gip_source[GIP_IPV4].db);
+	iprange_free(&gip_source[GIP_IPV6].db);
 }
 
 /**
@@ -468,10 +498,12 @@ gip_country(const host_addr_t ha)
 {
 	uint16 code;
 
-	if G_UNLIKELY(NULL == geo_db)
+	if G_UNLIKELY(NULL == gip_source[GIP_IPV4].db)
 		return ISO3166_INVALID;
 
-	code = iprange_get_addr(geo_db, ha);
+	code = iprange_get_addr(gip_source[GIP_IPV4].db, ha);
+	if (0 == code)
+		code = iprange_get_addr(gip_source[GIP_IPV6].db, ha);
 
 	return 0 == code ? ISO3166_INVALID : (code >> 1) - 1;
 }
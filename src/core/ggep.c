@@ -710,6 +710,64 @@ ggep_stream_close(ggep_stream_t *gs)
 	return len;
 }
 
+/**
+ * Fast path for ggep_stream_packv(), used when neither COBS nor deflate
+ * is requested and the payload fits in a single-byte length.
+ *
+ * This is the common case for our fixed-size extensions (DU, IP, GUE,
+ * PUSH...) and the whole extension can be written at once: there is no
+ * payload to move around once its length is known.
+ *
+ * @return TRUE if written successfully.  On error, the stream is left
+ * untouched.
+ */
+static bool
+ggep_stream_pack_plain(ggep_stream_t *gs,
+	const char *id, const iovec_t *iov, int iovcnt, size_t plen)
+{
+	size_t idlen, needed;
+	char *p;
+	int i;
+
+	g_assert(ggep_stream_is_valid(gs));
+	g_assert(gs->outbuf != NULL);		/* Stream not closed */
+	g_assert(!gs->begun);
+	g_assert(plen <= 63);
+
+	idlen = vstrlen(id);
+
+	g_assert(idlen > 0);
+	g_assert(idlen < 16);
+
+	needed = (gs->magic_sent ? 0 : 1) + 1 + idlen + 1 + plen;
+
+	if (needed > ggep_stream_avail(gs)) {
+		ggep_errno = GGEP_E_SPACE;
+		return FALSE;
+	}
+
+	p = gs->o;
+
+	if (!gs->magic_sent) {
+		*p++ = GGEP_MAGIC;
+		gs->magic_sent = TRUE;
+	}
+
+	gs->last_fp = p;
+	*p++ = idlen & GGEP_F_IDLEN;
+	p = mempcpy(p, id, idlen);
+	*p++ = GGEP_L_LAST | (plen & GGEP_L_VALUE);
+
+	for (i = 0; i < iovcnt; i++)
+		p = mempcpy(p, iovec_base(&iov[i]), iovec_len(&iov[i]));
+
+	gs->o = p;
+
+	g_assert(ggep_stream_is_valid(gs));
+
+	return TRUE;
+}
+
 /**
  * The vectorized version of ggep_stream_pack().
  *
@@ -721,6 +779,17 @@ ggep_stream_packv(ggep_stream_t *gs,
 {
 	g_assert(iovcnt >= 0);
 
+	if (0 == (wflags & (GGEP_W_COBS | GGEP_W_DEFLATE))) {
+		size_t plen = iov_calculate_size(iov, iovcnt);
+
+		if (plen <= 63) {
+			if (0 == plen && (wflags & GGEP_W_STRIP))
+				return TRUE;	/* Nothing emitted, as ggep_stream_end() */
+
+			return ggep_stream_pack_plain(gs, id, iov, iovcnt, plen);
+		}
+	}
+
 	if (!ggep_stream_begin(gs, id, wflags))
 		return FALSE;
 
@@ -45,7 +45,9 @@
 #include "search.h"
 #include "settings.h"
 #include "sq.h"
+#include "tx_deflate.h"
 #include "vmsg.h"
+#include "zdict.h"
 
 #include "g2/msg.h"
 
@@ -53,7 +55,9 @@
 #include "if/dht/kmsg.h"
 #include "if/dht/kademlia.h"
 
+#include "lib/aging.h"
 #include "lib/endian.h"
+#include "lib/halloc.h"
 #include "lib/omalloc.h"
 #include "lib/once.h"
 #include "lib/pmsg.h"
@@ -66,11 +70,23 @@
 
 #include "lib/override.h"		/* Must be the last header included */
 
+#define GMSG_SHARED_MIN	4	/**< Min compressed targets to share deflation */
+#define GMSG_ZDICT_LINGER	3600	/**< 1 hour, UDP dictionary support */
+
 static const char *msg_name[256];
 static uint8 msg_weight[256];	/**< For gmsg_cmp() */
+static uint8 msg_checks[256];	/**< For gmsg_checks() */
+static uint8 msg_regular[256];	/**< Regular payload size, for gmsg_checks() */
 static uint8 kmsg_weight[256];	/**< For gmsg_cmp() */
 
 static zlib_deflater_t *gmsg_deflater;
+static zlib_deflater_t *gmsg_zdict_deflater;	/**< Using preset dictionary */
+
+/**
+ * Addresses of hosts known to inflate UDP payloads deflated with our
+ * preset dictionary.
+ */
+static aging_table_t *gmsg_zdict_hosts;
 
 /**
  * Ensure that the gnutella message header has the correct size,
@@ -162,6 +178,25 @@ gmsg_split_dump(FILE *out, const void *head, const void *data,
 		data, size - GTA_HEADER_SIZE);
 }
 
+/**
+ * Same as gmsg_dump(), but the message is held in a message block, which
+ * can be chained.
+ */
+static void
+gmsg_mb_dump(FILE *out, const pmsg_t *mb)
+{
+	if (pmsg_is_chained(mb)) {
+		size_t size = pmsg_size(mb);
+		char *data = halloc(size);
+
+		pmsg_chain_copy(mb, data, size);
+		gmsg_dump(out, data, size);
+		hfree(data);
+	} else {
+		gmsg_dump(out, pmsg_start(mb), pmsg_size(mb));
+	}
+}
+
 /**
  * Initialization of the Gnutella message structures.
  */
@@ -172,29 +207,43 @@ gmsg_init(void)
 
 #define VMSG_W	10		/* Special weight to flag vendor messages */
 
+#define CHK_K	GMSG_CHK_KNOWN
+#define CHK_L	(GMSG_CHK_KNOWN | GMSG_CHK_LOCAL)
+#define CHK_LT	(GMSG_CHK_KNOWN | GMSG_CHK_LOCAL_TCP)
+#define CHK_R	(GMSG_CHK_KNOWN | GMSG_CHK_REGULAR)
+
 	for (i = 0; i < 256; i++) {
 		const char *s = "unknown";
-		uint w = 0;
+		uint w = 0, c = 0, r = 0;
 
 		switch ((enum gta_msg) i) {
 		case GTA_MSG_DHT:            w = 0;      s = "DHT"; break;
-		case GTA_MSG_HSEP_DATA:      w = 0;      s = "HSEP"; break;
-		case GTA_MSG_INIT:           w = 1;      s = "Ping"; break;
-		case GTA_MSG_SEARCH:         w = 2;      s = "Query"; break;
-		case GTA_MSG_INIT_RESPONSE:  w = 3;      s = "Pong"; break;
-		case GTA_MSG_SEARCH_RESULTS: w = 4;      s = "Q-Hit"; break;
-		case GTA_MSG_PUSH_REQUEST:   w = 5;      s = "Push"; break;
-		case GTA_MSG_VENDOR:         w = VMSG_W; s = "Vndor"; break;
-		case GTA_MSG_STANDARD:       w = VMSG_W; s = "Vstd"; break;
-		case GTA_MSG_RUDP:   		 w = 6;      s = "RUDP"; break;
-		case GTA_MSG_QRP:            w = 8;      s = "QRP"; break;
-		case GTA_MSG_BYE:      		 w = 9;      s = "BYE"; break;
+		case GTA_MSG_HSEP_DATA:      w = 0;      s = "HSEP"; c = CHK_L; break;
+		case GTA_MSG_INIT:           w = 1;      s = "Ping"; c = CHK_R; break;
+		case GTA_MSG_SEARCH:         w = 2;      s = "Query"; c = CHK_K; break;
+		case GTA_MSG_INIT_RESPONSE:  w = 3;      s = "Pong"; c = CHK_R;
+			r = sizeof(gnutella_init_response_t); break;
+		case GTA_MSG_SEARCH_RESULTS: w = 4;      s = "Q-Hit"; c = CHK_K; break;
+		case GTA_MSG_PUSH_REQUEST:   w = 5;      s = "Push"; c = CHK_R;
+			r = sizeof(gnutella_push_request_t); break;
+		case GTA_MSG_VENDOR:         w = VMSG_W; s = "Vndor"; c = CHK_LT; break;
+		case GTA_MSG_STANDARD:       w = VMSG_W; s = "Vstd"; c = CHK_LT; break;
+		case GTA_MSG_RUDP:   		 w = 6;      s = "RUDP"; c = CHK_K; break;
+		case GTA_MSG_QRP:            w = 8;      s = "QRP"; c = CHK_L; break;
+		case GTA_MSG_BYE:      		 w = 9;      s = "BYE"; c = CHK_L; break;
 		case GTA_MSG_G2_SEARCH: /* Not a real message */ break;
 		}
 		msg_name[i] = s;
 		msg_weight[i] = w;
+		msg_checks[i] = c;
+		msg_regular[i] = r;
 	}
 
+#undef CHK_K
+#undef CHK_L
+#undef CHK_LT
+#undef CHK_R
+
 	/*
 	 * We need to be able to compare Gnutella and Kademlia messages since
 	 * they can both be found in the same UDP queue.
@@ -227,6 +276,9 @@ gmsg_init(void)
 	}
 
 	gmsg_deflater = zlib_deflater_make(NULL, 0, Z_BEST_COMPRESSION);
+	gmsg_zdict_deflater = zlib_deflater_make(NULL, 0, Z_BEST_COMPRESSION);
+	gmsg_zdict_hosts = aging_make(GMSG_ZDICT_LINGER,
+		host_addr_hash_func, host_addr_eq_func, wfree_host_addr);
 }
 
 /**
@@ -236,6 +288,9 @@ void G_COLD
 gmsg_close(void)
 {
 	zlib_deflater_free(gmsg_deflater, TRUE);
+	zlib_deflater_free(gmsg_zdict_deflater, TRUE);
+	aging_destroy(&gmsg_zdict_hosts);
+	tx_deflate_share_close();
 }
 
 /**
@@ -250,6 +305,27 @@ gmsg_name(uint function)
 	return msg_name[function];
 }
 
+/**
+ * Get the header checks to perform on incoming messages of a given type.
+ *
+ * This lets the RX path validate the header of all the message types
+ * through a single table lookup instead of per-type logic.
+ *
+ * @param function		the message function
+ * @param regular		where the regular payload size is written, for
+ *						messages flagged with GMSG_CHK_REGULAR
+ *
+ * @return the GMSG_CHK_* flags for the message type, 0 if unknown.
+ */
+uint
+gmsg_checks(uint function, size_t *regular)
+{
+	g_assert(function < N_ITEMS(msg_checks));
+
+	*regular = msg_regular[function];
+	return msg_checks[function];
+}
+
 /**
  * Construct regular PDU descriptor from message.
  *
@@ -277,17 +353,20 @@ gmsg_to_pmsg(const void *msg, uint32 size)
  * @param head		pointer to the Gnutella header
  * @param data		pointer to the Gnutella payload
  * @param size		the total size of the message, header + payload
+ * @param to		the address of the host to which message will be sent
  *
  * @return new message, with possibly deflated payload content.
  * The caller can tell because deflated payloads are signaled with the
  * TTL having the GTA_UDP_DEFLATED bit set.
  */
 pmsg_t *
-gmsg_split_to_deflated_pmsg(const void *head, const void *data, uint32 size)
+gmsg_split_to_deflated_pmsg(const void *head, const void *data, uint32 size,
+	host_addr_t to)
 {
 	uint32 plen = size - GTA_HEADER_SIZE;		/* Raw payload length */
 	void *buf;									/* Compression made there */
 	uint32 deflated_length;						/* Length of deflated data */
+	zlib_deflater_t *zd = gmsg_deflater;
 	pmsg_t *mb;
 
 	/*
@@ -303,9 +382,29 @@ gmsg_split_to_deflated_pmsg(const void *head, const void *data, uint32 size)
 	 * Compress payload into internally allocated buffer (in gmsg_deflater).
 	 */
 
-	zlib_deflater_reset(gmsg_deflater, data, plen);
+	/*
+	 * Small datagrams compress poorly without any history, so we use our
+	 * preset dictionary for hosts we know can inflate with it.
+	 */
 
-	if (-1 == zlib_deflate_all(gmsg_deflater)) {
+	if (
+		GNET_PROPERTY(deflate_dictionary) &&
+		NULL != aging_lookup(gmsg_zdict_hosts, &to)
+	) {
+		const void *dict;
+		size_t len;
+
+		dict = zdict_get(&len);
+		zlib_deflater_reset(gmsg_zdict_deflater, data, plen);
+
+		if (zlib_deflater_set_dictionary(gmsg_zdict_deflater, dict, len))
+			zd = gmsg_zdict_deflater;
+	}
+
+	if (gmsg_deflater == zd)
+		zlib_deflater_reset(zd, data, plen);
+
+	if (-1 == zlib_deflate_all(zd)) {
 		g_carp("%s(): deflate error", G_STRFUNC);
 		goto send_raw;
 	}
@@ -314,8 +413,8 @@ gmsg_split_to_deflated_pmsg(const void *head, const void *data, uint32 size)
 	 * Check whether compressed data is smaller than the original payload.
 	 */
 
-	deflated_length = zlib_deflater_outlen(gmsg_deflater);
-	buf = zlib_deflater_out(gmsg_deflater);
+	deflated_length = zlib_deflater_outlen(zd);
+	buf = zlib_deflater_out(zd);
 
 	g_assert(zlib_is_valid_header(buf, deflated_length));
 
@@ -337,8 +436,9 @@ gmsg_split_to_deflated_pmsg(const void *head, const void *data, uint32 size)
 	mb = gmsg_split_to_pmsg(head, buf, deflated_length + GTA_HEADER_SIZE);
 
 	if (GNET_PROPERTY(udp_debug))
-		g_debug("UDP deflated %s into %d bytes",
-			gmsg_infostr_full_split(head, data, size), deflated_length);
+		g_debug("UDP deflated %s into %d bytes%s",
+			gmsg_infostr_full_split(head, data, size), deflated_length,
+			zd == gmsg_zdict_deflater ? " with dictionary" : "");
 
 	{
 		void *header;
@@ -369,17 +469,33 @@ send_raw:
  *
  * @param msg		pointer to the Gnutella message (payload follows header)
  * @param size		the total size of the message, header + payload
+ * @param to		the address of the host to which message will be sent
  *
  * @return new message, with possibly deflated payload content.
  * The caller can tell because deflated payloads are signaled with the
  * TTL having the GTA_UDP_DEFLATED bit set.
  */
 pmsg_t *
-gmsg_to_deflated_pmsg(const void *msg, uint32 size)
+gmsg_to_deflated_pmsg(const void *msg, uint32 size, host_addr_t to)
 {
 	const char *data = const_ptr_add_offset(msg, GTA_HEADER_SIZE);
 
-	return gmsg_split_to_deflated_pmsg(msg, data, size);
+	return gmsg_split_to_deflated_pmsg(msg, data, size, to);
+}
+
+/**
+ * Record that host can inflate UDP payloads deflated with our preset
+ * dictionary, either because it sent us such payloads or because it
+ * advertised support for the dictionary on a TCP connection.
+ */
+void
+gmsg_zdict_learn(host_addr_t addr)
+{
+	if (NULL == gmsg_zdict_hosts)
+		return;		/* Shutting down */
+
+	if (!aging_lookup_revitalise(gmsg_zdict_hosts, &addr))
+		aging_record(gmsg_zdict_hosts, WCOPY(&addr));
 }
 
 /**
@@ -482,7 +598,7 @@ gmsg_mb_sendto_all(const pslist_t *sl, pmsg_t *mb)
 	gmsg_header_check(pmsg_phys_base(mb), pmsg_written_size(mb));
 
 	if (GNET_PROPERTY(gmsg_debug) > 5 && gmsg_hops(pmsg_phys_base(mb)) == 0)
-		gmsg_dump(stdout, pmsg_phys_base(mb), pmsg_written_size(mb));
+		gmsg_mb_dump(stdout, mb);
 
 	for (/* empty */; sl; sl = pslist_next(sl)) {
 		gnutella_node_t *dn = sl->data;
@@ -510,10 +626,11 @@ gmsg_mb_routeto_one(const gnutella_node_t *from,
 		return;
 
 	if (GNET_PROPERTY(gmsg_debug) > 5 && gmsg_hops(pmsg_phys_base(mb)) == 0)
-		gmsg_dump(stdout, pmsg_phys_base(mb), pmsg_written_size(mb));
+		gmsg_mb_dump(stdout, mb);
 
 	if (NODE_IS_UDP(to)) {
 		gnet_host_t host;
+		g_assert(!pmsg_is_chained(mb));		/* Datagrams are contiguous */
 		gnet_host_set(&host, to->addr, to->port);
 		mq_udp_putq(to->outq, mb, &host);
 	} else {
@@ -572,7 +689,7 @@ gmsg_sendto_one(gnutella_node_t *n, const void *msg, uint32 size)
 			pmsg_mark_reliable(mb);
 		} else {
 			mb = NODE_CAN_INFLATE(n) ?
-				gmsg_to_deflated_pmsg(msg, size) :
+				gmsg_to_deflated_pmsg(msg, size, n->addr) :
 				gmsg_to_pmsg(msg, size);
 		}
 
@@ -667,6 +784,35 @@ gmsg_split_routeto_one(gnutella_node_t *from, gnutella_node_t *to,
 	gmsg_split_send_from_to(from, to, head, data, size);
 }
 
+/**
+ * Deflate broadcasted message once for all the compressed connections in
+ * the list, when the CPU is overloaded, so that the TX deflating layers of
+ * these connections need not compress the same bytes again.
+ */
+static void
+gmsg_share_deflated(const pslist_t *sl, const pmsg_t *mb)
+{
+	const pslist_t *l;
+	uint n = 0;
+
+	if (
+		!GNET_PROPERTY(overloaded_cpu) ||
+		!GNET_PROPERTY(deflate_shared_broadcast)
+	)
+		return;
+
+	PSLIST_FOREACH(sl, l) {
+		const gnutella_node_t *dn = l->data;
+
+		if (NODE_IS_ESTABLISHED(dn) && NODE_TX_COMPRESSED(dn)) {
+			if (++n >= GMSG_SHARED_MIN) {
+				tx_deflate_share(pmsg_start(mb), pmsg_size(mb));
+				return;
+			}
+		}
+	}
+}
+
 /**
  * Broadcast message to all nodes in the list.
  */
@@ -680,6 +826,8 @@ gmsg_sendto_all(const pslist_t *sl, const void *msg, uint32 size)
 	if (GNET_PROPERTY(gmsg_debug) > 5 && gmsg_hops(msg) == 0)
 		gmsg_dump(stdout, msg, size);
 
+	gmsg_share_deflated(sl, mb);
+
 	for (/* empty */; sl; sl = pslist_next(sl)) {
 		gnutella_node_t *dn = sl->data;
 		if (!NODE_IS_ESTABLISHED(dn))
@@ -748,6 +896,7 @@ gmsg_split_routeto_all_but_one(const gnutella_node_t *from,
 		skip_up_with_qrp = TRUE;
 
 	gmsg_header_check(head, size);
+	gmsg_share_deflated(sl, mb);
 
 	/* relayed broadcasted message, cannot be sent with hops=0 */
 
@@ -779,6 +928,7 @@ gmsg_split_routeto_all(
 	pmsg_t *mb = gmsg_split_to_pmsg(head, data, size);
 
 	gmsg_header_check(head, size);
+	gmsg_share_deflated(sl, mb);
 
 	/* relayed broadcasted message, cannot be sent with hops=0 */
 
@@ -41,6 +41,7 @@
 #include "if/core/search.h"
 
 #include "lib/endian.h"
+#include "lib/host_addr.h"
 #include "lib/pmsg.h"
 
 struct gnutella_node;
@@ -91,6 +92,15 @@ typedef enum {
 	GMSG_VALID_NO_PROCESS		/* Marked for flags we do not know */
 } gmsg_valid_t;
 
+/*
+ * Header checks to perform on incoming messages, per message function.
+ */
+
+#define GMSG_CHK_KNOWN		(1U << 0)	/**< Message function is known */
+#define GMSG_CHK_LOCAL		(1U << 1)	/**< Never routed: hops=0, TTL<=1 */
+#define GMSG_CHK_LOCAL_TCP	(1U << 2)	/**< Same, when received via TCP */
+#define GMSG_CHK_REGULAR	(1U << 3)	/**< Fixed size, unless GGEP follows */
+
 /*
  * Public interface
  */
@@ -98,12 +108,14 @@ typedef enum {
 void gmsg_init(void);
 void gmsg_close(void);
 const char *gmsg_name(uint function);
+uint gmsg_checks(uint function, size_t *regular);
 gmsg_valid_t gmsg_size_valid(const void *msg, uint16 *size);
 
 pmsg_t *gmsg_to_pmsg(const void *msg, uint32 size);
-pmsg_t *gmsg_to_deflated_pmsg(const void *msg, uint32 size);
+pmsg_t *gmsg_to_deflated_pmsg(const void *msg, uint32 size, host_addr_t to);
 pmsg_t *gmsg_split_to_deflated_pmsg(const void *head,
-			const void *data, uint32 size);
+			const void *data, uint32 size, host_addr_t to);
+void gmsg_zdict_learn(host_addr_t addr);
 pmsg_t *gmsg_to_ctrl_pmsg(const void *msg, uint32 size);
 pmsg_t * gmsg_to_ctrl_pmsg_extend(const void *msg, uint32 size,
 			pmsg_free_t free_cb, void *arg);
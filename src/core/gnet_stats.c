@@ -60,6 +60,21 @@ static gnet_stats_t gnet_stats;
 static gnet_stats_t gnet_tcp_stats;
 static gnet_stats_t gnet_udp_stats;
 
+/**
+ * Handling statistics for Gnutella messages, per message type.
+ *
+ * These are only updated and read from the main thread, where messages
+ * are processed.
+ */
+static struct gnet_hstats {
+	uint64 count;				/**< Messages handled */
+	uint64 bytes;				/**< Payload bytes handled */
+	uint64 total_ns;			/**< Total handling time, in nanoseconds */
+	uint64 max_ns;				/**< Maximum handling time */
+} gnet_hstats[MSG_TYPE_COUNT];
+
+static time_t gnet_hstats_since;	/**< When statistics were last reset */
+
 /*
  * Thread-safe locks.
  *
@@ -75,6 +90,78 @@ static spinlock_t gnet_stats_slk = SPINLOCK_INIT;
 #define GNET_STATS_LOCK		spinlock_hidden(&gnet_stats_slk)
 #define GNET_STATS_UNLOCK	spinunlock_hidden(&gnet_stats_slk)
 
+/**
+ * Per-thread shards of the general statistics.
+ *
+ * General counters are updated from many threads, so each thread adjusts
+ * its own shard without locking, and shards are only summed when the
+ * statistics are read.  The values in gnet_stats.general are the base to
+ * which shards are added: they are only changed under the lock, to set a
+ * counter or to keep a maximum.
+ */
+static struct gnet_stats_shard {
+	int64 general[GNR_TYPE_COUNT];
+} gnet_stats_shard[THREAD_MAX];
+
+/**
+ * @return the shard of the current thread, NULL if none can be used.
+ */
+static inline struct gnet_stats_shard *
+gnet_stats_shard_get(void)
+{
+	uint stid = thread_small_id();
+
+	return G_LIKELY(stid < N_ITEMS(gnet_stats_shard)) ?
+		&gnet_stats_shard[stid] : NULL;
+}
+
+/**
+ * Compute the sum of all the shards for a general counter.
+ */
+static int64
+gnet_stats_shard_sum(size_t i)
+{
+	int64 sum = 0;
+	size_t t;
+
+	for (t = 0; t < N_ITEMS(gnet_stats_shard); t++)
+		sum += gnet_stats_shard[t].general[i];
+
+	return sum;
+}
+
+/**
+ * Fill the general counters with the base values plus all the shards.
+ *
+ * @attention
+ * Must be called with the lock held.
+ */
+static void
+gnet_stats_general_collect(uint64 *general)
+{
+	size_t i;
+
+	for (i = 0; i < GNR_TYPE_COUNT; i++)
+		general[i] = gnet_stats.general[i] + gnet_stats_shard_sum(i);
+}
+
+/**
+ * Adjust general counter by given signed delta.
+ */
+static inline void
+gnet_stats_general_add(size_t i, int64 delta)
+{
+	struct gnet_stats_shard *gs = gnet_stats_shard_get();
+
+	if G_LIKELY(gs != NULL) {
+		gs->general[i] += delta;
+	} else {
+		GNET_STATS_LOCK;
+		gnet_stats.general[i] += delta;
+		GNET_STATS_UNLOCK;
+	}
+}
+
 /***
  *** Public functions
  ***/
@@ -175,6 +262,8 @@ gnet_stats_init(void)
 
     ZERO(&gnet_stats);
     ZERO(&gnet_udp_stats);
+
+	gnet_hstats_since = tm_time();
 }
 
 /**
@@ -221,10 +310,16 @@ gnet_stats_udp_digest(sha1_t *digest)
 void
 gnet_stats_general_digest(sha1_t *digest)
 {
+	uint64 general[GNR_TYPE_COUNT];
 	uint32 n = entropy_nonce();
 
 	gnet_stats_inc_general(GNR_STATS_DIGEST);
-	SHA1_COMPUTE_NONCE(gnet_stats.general, &n, digest);
+
+	GNET_STATS_LOCK;
+	gnet_stats_general_collect(general);
+	GNET_STATS_UNLOCK;
+
+	SHA1_COMPUTE_NONCE(general, &n, digest);
 }
 
 /**
@@ -622,7 +717,7 @@ gnet_stats_count_expired(const gnutella_node_t *n)
         (reason == MSG_DROP_ROUTE_LOST) ||				\
         (reason == MSG_DROP_NO_ROUTE)					\
     )													\
-        gnet_stats.general[GNR_ROUTING_ERRORS]++;		\
+        gnet_stats_general_add(GNR_ROUTING_ERRORS, 1);	\
 														\
     gnet_stats.drop_reason[reason][MSG_TOTAL]++;		\
     gnet_stats.drop_reason[reason][t]++;				\
@@ -731,9 +826,7 @@ gnet_stats_count_general(gnr_stats_t type, int delta)
 
 	g_assert(i < GNR_TYPE_COUNT);
 
-	GNET_STATS_LOCK;
-    gnet_stats.general[i] += delta;
-	GNET_STATS_UNLOCK;
+	gnet_stats_general_add(i, delta);
 }
 
 /**
@@ -746,9 +839,7 @@ gnet_stats_inc_general(gnr_stats_t type)
 
 	g_assert(i < GNR_TYPE_COUNT);
 
-	GNET_STATS_LOCK;
-    gnet_stats.general[i]++;
-	GNET_STATS_UNLOCK;
+	gnet_stats_general_add(i, 1);
 }
 
 /**
@@ -761,9 +852,7 @@ gnet_stats_dec_general(gnr_stats_t type)
 
 	g_assert(i < GNR_TYPE_COUNT);
 
-	GNET_STATS_LOCK;
-    gnet_stats.general[i]--;
-	GNET_STATS_UNLOCK;
+	gnet_stats_general_add(i, -1);
 }
 
 /**
@@ -777,8 +866,12 @@ gnet_stats_max_general(gnr_stats_t type, uint64 value)
 	g_assert(i < GNR_TYPE_COUNT);
 
 	GNET_STATS_LOCK;
-	if (value > gnet_stats.general[i])
-		gnet_stats.general[i] = value;
+	{
+		int64 sum = gnet_stats_shard_sum(i);
+
+		if (value > gnet_stats.general[i] + sum)
+			gnet_stats.general[i] = value - sum;
+	}
 	GNET_STATS_UNLOCK;
 }
 
@@ -793,7 +886,7 @@ gnet_stats_set_general(gnr_stats_t type, uint64 value)
 	g_assert(i < GNR_TYPE_COUNT);
 
 	GNET_STATS_LOCK;
-    gnet_stats.general[i] = value;
+	gnet_stats.general[i] = value - gnet_stats_shard_sum(i);
 	GNET_STATS_UNLOCK;
 }
 
@@ -809,7 +902,7 @@ gnet_stats_get_general(gnr_stats_t type)
 	g_assert(i < GNR_TYPE_COUNT);
 
 	GNET_STATS_LOCK;
-	value = gnet_stats.general[i];
+	value = gnet_stats.general[i] + gnet_stats_shard_sum(i);
 	GNET_STATS_UNLOCK;
 
 	return value;
@@ -930,6 +1023,40 @@ gnet_stats_g2_count_flowc(const gnutella_node_t *n,
 	gnet_stats_flowc_internal(t, f, ttl, hops, len);
 }
 
+/**
+ * Record processing of a Gnutella message.
+ *
+ * @param function		the Gnutella message function
+ * @param len			the payload length
+ * @param start			when processing of the message began
+ */
+void
+gnet_stats_count_handled(uint8 function, size_t len, const tm_nano_t *start)
+{
+	struct gnet_hstats *hs;
+	tm_nano_t end, elapsed;
+	uint64 ns;
+	uint t = stats_lut[function];
+
+	g_assert(thread_is_main());
+
+	tm_precise_time(&end);
+	tm_precise_elapsed(&elapsed, &end, start);
+	ns = (uint64) elapsed.tv_sec * 1000000000UL + elapsed.tv_nsec;
+
+	hs = &gnet_hstats[t];
+	hs->count++;
+	hs->bytes += len;
+	hs->total_ns += ns;
+	hs->max_ns = MAX(hs->max_ns, ns);
+
+	hs = &gnet_hstats[MSG_TOTAL];
+	hs->count++;
+	hs->bytes += len;
+	hs->total_ns += ns;
+	hs->max_ns = MAX(hs->max_ns, ns);
+}
+
 /***
  *** Public functions (gnet.h)
  ***/
@@ -941,6 +1068,7 @@ gnet_stats_get(gnet_stats_t *s)
 
 	GNET_STATS_LOCK;
     *s = gnet_stats;
+	gnet_stats_general_collect(s->general);
 	GNET_STATS_UNLOCK;
 }
 
@@ -962,4 +1090,56 @@ gnet_stats_udp_get(gnet_stats_t *s)
     *s = gnet_udp_stats;
 }
 
+/**
+ * Reset message handling statistics.
+ */
+void
+gnet_stats_handled_reset(void)
+{
+	g_assert(thread_is_main());
+
+	ZERO(&gnet_hstats);
+	gnet_hstats_since = tm_time();
+}
+
+/**
+ * Get message handling statistics.
+ *
+ * This must be called from the main thread, where messages are handled.
+ *
+ * @param vec		vector to fill, one entry per message type seen
+ * @param cnt		amount of entries in the vector
+ * @param since		if non-NULL, written with time of last statistics reset
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+gnet_stats_handled_get(gnet_msg_stats_t *vec, size_t cnt, time_t *since)
+{
+	size_t i, n = 0;
+
+	g_assert(vec != NULL || 0 == cnt);
+	g_assert(thread_is_main());
+
+	for (i = 0; i < N_ITEMS(gnet_hstats) && n < cnt; i++) {
+		const struct gnet_hstats *hs = &gnet_hstats[i];
+		gnet_msg_stats_t *ms;
+
+		if (0 == hs->count)
+			continue;
+
+		ms = &vec[n++];
+		ms->type = i;
+		ms->count = hs->count;
+		ms->bytes = hs->bytes;
+		ms->total_ns = hs->total_ns;
+		ms->max_ns = hs->max_ns;
+	}
+
+	if (since != NULL)
+		*since = gnet_hstats_since;
+
+	return n;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
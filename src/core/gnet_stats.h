@@ -30,6 +30,8 @@
 #include "if/core/net_stats.h"
 #include "if/dht/kademlia.h"
 
+#include "lib/tm.h"
+
 void gnet_stats_init(void);
 
 void gnet_stats_count_received_header(gnutella_node_t *n);
@@ -52,6 +54,8 @@ void gnet_stats_max_general(gnr_stats_t type, uint64 value);
 void gnet_stats_set_general(gnr_stats_t type, uint64 value);
 uint64 gnet_stats_get_general(gnr_stats_t type);
 void gnet_stats_count_flowc(const void *, bool head_only);
+void gnet_stats_count_handled(uint8 function, size_t len,
+	const tm_nano_t *start);
 
 void gnet_stats_g2_count_flowc(const gnutella_node_t *n,
 	const void *base, size_t len);
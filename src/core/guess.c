@@ -165,6 +165,8 @@
 #define GUESS_FIND_DELAY		5000	/**< in ms, UDP queue flush grace */
 #define GUESS_ALPHA				5		/**< Level of query concurrency */
 #define GUESS_ALPHA_MAX			50		/**< Max level of query concurrency */
+#define GUESS_WINDOW_MIN		2		/**< Min per-query RPC window */
+#define GUESS_QK_WARMING		5		/**< Query keys pre-fetched per period */
 #define GUESS_WAIT_DELAY		30000	/**< in ms, time waiting for hosts */
 #define GUESS_WARMING_COUNT		100		/**< Loose concurrency after that */
 #define GUESS_MAX_TIMEOUTS		5		/**< Max # of consecutive timeouts */
@@ -213,6 +215,7 @@ struct guess {
 	uint32 recv_results;		/**< Amount of results received */
 	unsigned hops;				/**< Amount of iteration hops */
 	int rpc_pending;			/**< Amount of RPC pending */
+	int window;					/**< RPC window, adjusted on timeouts */
 	unsigned bw_out_query;		/**< Spent outgoing querying bandwidth */
 	unsigned bw_out_qk;			/**< Estimated outgoing query key bandwidth */
 };
@@ -462,6 +465,9 @@ guess_event_fire(const guess_t *gq, bool created)
 {
 	struct guess_query query;
 
+	if (LISTENER_NONE(guess_event))
+		return;
+
 	query.max_ultra	= gq->max_ultrapeers;
 	query.mode		= gq->mode;
 
@@ -485,6 +491,9 @@ guess_stats_fire(const guess_t *gq)
 {
 	struct guess_stats stats;
 
+	if (LISTENER_NONE(guess_stats))
+		return;
+
 	stats.pool			= hash_list_length(gq->pool);	/* Excluding deferred */
 	stats.queried_ultra	= gq->queried_ultra;
 	stats.queried_g2	= gq->queried_g2;
@@ -3455,6 +3464,35 @@ guess_check_link_cache(void)
 	}
 }
 
+/**
+ * Pre-fetch query keys for some of the hosts in the 0.2 cache, which are
+ * the ones we are going to pick first when loading the pool of a new query.
+ *
+ * This saves the extra round-trip needed to get a query key from a host
+ * when we are about to send it the query.
+ */
+static void
+guess_warm_qk_cache(void)
+{
+	size_t i, n;
+
+	n = MIN(GUESS_QK_WARMING, guess_cache_count());
+
+	for (i = 0; i < n; i++) {
+		const gnet_host_t *h = guess_cache_select();
+
+		if (guess_has_valid_qk(h) || !guess_can_recontact(h))
+			continue;
+
+		if (GNET_PROPERTY(guess_client_debug) > 4) {
+			g_debug("GUESS pre-fetching query key for %s",
+				gnet_host_to_string(h));
+		}
+
+		guess_request_qk(h, FALSE, FALSE);
+	}
+}
+
 /**
  * Callout queue periodic event to monitor the link cache.
  */
@@ -3464,6 +3502,7 @@ guess_periodic_check(void *unused_obj)
 	(void) unused_obj;
 
 	guess_check_link_cache();
+	guess_warm_qk_cache();
 	return TRUE;				/* Keep calling */
 }
 
@@ -4667,6 +4706,15 @@ guess_handle_ack(guess_t *gq,
 	return hops >= gq->hops;		/* Iterate only if reply from current hop */
 }
 
+/**
+ * @return the amount of concurrent RPCs the query can issue.
+ */
+static int
+guess_window(const guess_t *gq)
+{
+	return MIN(gq->window, guess_alpha);
+}
+
 /**
  * GUESS RPC callback function.
  *
@@ -4690,16 +4738,28 @@ guess_rpc_callback(struct guess_rpc *grp, const gnutella_node_t *n, guess_t *gq)
 			grp->pmi->rpc_done = TRUE;
 		} else {
 			guess_timeout_from(grp->host);
+
+			/*
+			 * The message was lost, or the host is gone: shrink the window
+			 * so that we do not flood the network with queries that are
+			 * likely to be lost as well.
+			 */
+
+			gq->window -= gq->window / 4;
+			gq->window = MAX(gq->window, GUESS_WINDOW_MIN);
 		}
 
 		iterate = FALSE;
 	} else {
 		g_assert(NULL == grp->pmi);		/* Message sent if we get a reply */
 
+		if (gq->window < GUESS_ALPHA_MAX)
+			gq->window++;
+
 		iterate = guess_handle_ack(gq, n, grp->host, grp->hops, grp->t);
 	}
 
-	if (iterate || gq->rpc_pending < guess_alpha)
+	if (iterate || gq->rpc_pending < guess_window(gq))
 		guess_iterate(gq);
 }
 
@@ -5085,7 +5145,7 @@ guess_bandwidth_available(void *data, void *unused)
 static void
 guess_iterate(guess_t *gq)
 {
-	int alpha = guess_alpha;
+	int alpha;
 	int i = 0;
 	unsigned unsent = 0;
 	size_t attempts = 0, poolsize;
@@ -5093,6 +5153,8 @@ guess_iterate(guess_t *gq)
 
 	guess_check(gq);
 
+	alpha = guess_window(gq);
+
 	/*
 	 * Check for termination criteria.
 	 */
@@ -5386,6 +5448,7 @@ guess_create(gnet_search_t sh, const guid_t *muid, const char *query,
 	gq->muid = atom_guid_get(muid);
 	gq->mtype = mtype;
 	gq->mode = GUESS_QUERY_BOUNDED;
+	gq->window = GUESS_ALPHA;
 	gq->queried =
 		hset_create_any(gnet_host_hash, gnet_host_hash2, gnet_host_equal);
 	gq->deferred =
@@ -5865,7 +5928,7 @@ guess_init(void)
 		}
 	}
 
-	db_qkdata = dbstore_open(db_qkdata_what, settings_gnet_db_dir(),
+	db_qkdata = dbstore_open_lsm(db_qkdata_what, settings_gnet_db_dir(),
 		db_qkdata_base, kv, packing, GUESS_QK_DB_CACHE_SIZE,
 		gnet_host_hash, gnet_host_equal, FALSE);
 
@@ -852,6 +852,8 @@ guid_init(void)
 		db_guid_base, kv, packing, 1,
 		guid_hash, guid_eq, FALSE);
 
+	dbstore_set_bloom(db_guid, settings_gnet_db_dir(), db_guid_base);
+
 	guid_prune_old();
 
 	guid_prune_ev = cq_periodic_main_add(
@@ -66,7 +66,6 @@
 #include "lib/file.h"
 #include "lib/getdate.h"
 #include "lib/hashlist.h"
-#include "lib/hset.h"
 #include "lib/htable.h"
 #include "lib/path.h"
 #include "lib/random.h"
@@ -1497,8 +1496,6 @@ hcache_fill_caught_array(host_net_t net, host_type_t type,
 	int i;
 	hostcache_t *hc = NULL;
 	hostcache_t *hc2 = NULL;
-	hset_t *seen_host =
-		hset_create_any(gnet_host_hash, gnet_host_hash2, gnet_host_equal);
 	hash_list_iter_t *iter;
 
     switch (type) {
@@ -1579,6 +1576,10 @@ hcache_fill_caught_array(host_net_t net, host_type_t type,
 
 	/*
 	 * We first try to fill IPv6 addresses, or IPv4 if they only want that.
+	 *
+	 * A host belongs to at most one cache of its class, and both caches
+	 * we iterate over are of the same class, so there cannot be any
+	 * duplicate: no need to track the hosts we already filled.
 	 */
 
 	iter = hash_list_iterator(hc->hostlist);
@@ -1589,17 +1590,12 @@ hcache_fill_caught_array(host_net_t net, host_type_t type,
 		if (NULL == h)
 			break;
 
-		if (hset_contains(seen_host, h))
-			continue;
-
 		/*
 		 * Cannot do a struct copy, the host atom may be shorter than
 		 * the structure when holding an IPv4 address.
 		 */
 
 		gnet_host_copy(&hosts[i], h);
-
-		hset_insert(seen_host, &hosts[i]);
 	}
 	hash_list_iter_release(&iter);
 
@@ -1619,23 +1615,16 @@ hcache_fill_caught_array(host_net_t net, host_type_t type,
 		if (NULL == h)
 			break;
 
-		if (hset_contains(seen_host, h))
-			continue;
-
 		/*
 		 * Cannot do a struct copy, the host atom may be shorter than
 		 * the structure when holding an IPv4 address.
 		 */
 
 		gnet_host_copy(&hosts[i], h);
-
-		hset_insert(seen_host, &hosts[i]);
 	}
 	hash_list_iter_release(&iter);
 
 done:
-	hset_free_null(&seen_host);	/* Keys point into vector */
-
 	return i;				/* Amount of hosts we filled */
 }
 
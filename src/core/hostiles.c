@@ -42,6 +42,7 @@
 #include "settings.h"
 #include "nodes.h"
 #include "gnet_stats.h"
+#include "startup.h"
 
 #include "dht/stable.h"
 
@@ -84,6 +85,14 @@ static const char * const hostiles_what[NUM_HOSTILES] = {
 	"hostile IP addresses (private)"
 };
 
+/**
+ * Compiled databases, in the gnet DB directory.
+ */
+static const char * const hostiles_compiled[NUM_HOSTILES] = {
+	"hostiles-global.db",
+	"hostiles.db"
+};
+
 static struct iprange_db *hostile_db[NUM_HOSTILES];	/**< The hostile database */
 
 /**
@@ -278,6 +287,9 @@ hostiles_close_one(hostiles_t which)
 /**
  * Load hostile data from the supplied FILE.
  *
+ * The parsed data are saved in a compiled form, which is simply mapped
+ * in memory on the next loadings, until the FILE changes.
+ *
  * @returns the amount of entries loaded.
  */
 static int
@@ -288,10 +300,25 @@ hostiles_load(FILE *f, hostiles_t which)
 	int linenum = 0;
 	int bits;
 	iprange_err_t error;
+	filestat_t buf;
+	char *compiled;
+	uint64 stamp = 0;
 
 	g_assert(UNSIGNED(which) < NUM_HOSTILES);
 	g_assert(NULL == hostile_db[which]);
 
+	compiled = make_pathname(settings_gnet_db_dir(), hostiles_compiled[which]);
+
+	if (-1 == fstat(fileno(f), &buf)) {
+		g_warning("cannot stat %s: %m", hostiles_what[which]);
+	} else {
+		stamp = iprange_file_stamp(&buf);
+		hostile_db[which] = iprange_load(compiled, stamp);
+
+		if (hostile_db[which] != NULL)
+			goto loaded;
+	}
+
 	hostile_db[which] = iprange_new();
 
 	while (fgets(ARYLEN(line), f)) {
@@ -335,6 +362,12 @@ hostiles_load(FILE *f, hostiles_t which)
 
 	iprange_sync(hostile_db[which]);
 
+	if (stamp != 0)
+		iprange_save(hostile_db[which], compiled, stamp);
+
+loaded:
+	HFREE_NULL(compiled);
+
 	if (GNET_PROPERTY(reload_debug)) {
 		g_debug("loaded %u addresses/netmasks from %s (%u hosts)",
 			iprange_get_item_count(hostile_db[which]), hostiles_what[which],
@@ -454,6 +487,15 @@ hostiles_retrieve(hostiles_t which)
 	}
 }
 
+/**
+ * Startup loading of hostile addresses, run by a separate thread.
+ */
+static void G_COLD
+hostiles_retrieve_task(void *p)
+{
+	hostiles_retrieve(pointer_to_uint(p));
+}
+
 /**
  * If the property was set to FALSE at startup time, hostile_db[HOSTILE_GLOBAL]
  * is still NULL and we need to load the global hostiles.txt now. Otherwise,
@@ -1160,6 +1202,8 @@ hostiles_init(void)
 		db_spam_base, kv, packing, SPAM_DB_CACHE_SIZE,
 		gnet_host_hash, gnet_host_equal, FALSE);
 
+	dbstore_set_bloom(db_spam, settings_gnet_db_dir(), db_spam_base);
+
 	hostiles_spam_prune_old();
 
 	hostiles_spam_prune_ev = cq_periodic_main_add(
@@ -1172,9 +1216,15 @@ hostiles_init(void)
 
 	cq_periodic_main_add(
 		HOSTILES_DYNAMIC_PERIOD_MS, hostiles_dynamic_timer, NULL);
-	hostiles_retrieve(HOSTILE_PRIVATE);
+
+	startup_spawn("hostiles.txt", hostiles_retrieve_task,
+		uint_to_pointer(HOSTILE_PRIVATE));
+	if (GNET_PROPERTY(use_global_hostiles_txt)) {
+		startup_spawn("global hostiles.txt", hostiles_retrieve_task,
+			uint_to_pointer(HOSTILE_GLOBAL));
+	}
     gnet_prop_add_prop_changed_listener(PROP_USE_GLOBAL_HOSTILES_TXT,
-		use_global_hostiles_txt_changed, TRUE);
+		use_global_hostiles_txt_changed, FALSE);
 }
 
 /**
@@ -130,6 +130,9 @@ static hsep_triple hsep_own = {1, 0, 0};
 static event_t *hsep_global_table_changed_event;
 static time_t hsep_last_global_table_change = 0;
 
+static void hsep_send(gnutella_node_t *n, time_t now,
+	const hsep_triple *other);
+
 /**
  * Fires a change event for the global HSEP table.
  */
@@ -464,7 +467,8 @@ void
 hsep_timer(time_t now)
 {
 	const pslist_t *sl;
-	bool scanning_shared;
+	bool scanning_shared, have_other = FALSE;
+	hsep_triple other;
 	static time_t last_sent = 0;
 
 	/* update number of shared files and KiB */
@@ -493,8 +497,14 @@ hsep_timer(time_t now)
 		diff = n->hsep->random_skew + delta_time(now, n->hsep->last_sent);
 
 		/* the -900 is used to react to changes in system time */
-		if (diff >= HSEP_MSG_INTERVAL || diff < -900)
-			hsep_send_msg(n, now);
+		if (diff >= HSEP_MSG_INTERVAL || diff < -900) {
+			/* computed once, it does not depend on the node */
+			if (!have_other) {
+				hsep_get_non_hsep_triple(&other);
+				have_other = TRUE;
+			}
+			hsep_send(n, now, &other);
+		}
 	}
 
 	/*
@@ -716,16 +726,44 @@ hsep_process_msg(gnutella_node_t *n, time_t now)
 }
 
 /**
- * Sends a HSEP message to the given node, but only if data to send
- * has changed. Should be called about every 30-60 seconds per node.
- * Will automatically be called by hsep_timer() and
- * hsep_connection_init(). Node must be HSEP-capable.
+ * Checks whether the table to send differs enough from the previously sent
+ * one to be worth a new message.  Both tables hold little-endian values.
+ *
+ * @return TRUE if at least one value changed by more than HSEP_MSG_CHANGE
+ * percents.
  */
+static bool
+hsep_table_changed_enough(const hsep_triple *old, const hsep_triple *new,
+	unsigned int triples)
+{
+	unsigned int i, j;
 
-void
-hsep_send_msg(gnutella_node_t *n, time_t now)
+	for (i = 0; i < triples; i++) {
+		for (j = 0; j < N_ITEMS(old[0]); j++) {
+			uint64 o = peek_le64(&old[i][j]);
+			uint64 v = peek_le64(&new[i][j]);
+			uint64 delta = o > v ? o - v : v - o;
+
+			if (delta != 0 && delta >= o / (100 / HSEP_MSG_CHANGE))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Sends a HSEP message to the given node, but only if data to send
+ * has changed significantly since the last message was sent.
+ *
+ * @param n		the node to which we want to send
+ * @param now	current time
+ * @param other	the triple for non-HSEP nodes, NULL to compute it
+ */
+static void
+hsep_send(gnutella_node_t *n, time_t now, const hsep_triple *other)
 {
-	hsep_triple tmp[N_ITEMS(n->hsep->sent_table)], other;
+	hsep_triple tmp[N_ITEMS(n->hsep->sent_table)], none;
 	unsigned int i, j, msglen, msgsize, triples, opttriples;
 	gnutella_msg_hsep_t *msg;
 	hsep_ctx_t *hsep;
@@ -734,7 +772,6 @@ hsep_send_msg(gnutella_node_t *n, time_t now)
 	g_assert(n->hsep);
 
 	hsep = n->hsep;
-	ZERO(&other);
 
 	/*
 	 * If we are a leaf, we just need to send one triple,
@@ -746,21 +783,10 @@ hsep_send_msg(gnutella_node_t *n, time_t now)
 
 	triples = settings_is_leaf() ? 1 : N_ITEMS(tmp);
 
-	/*
-	 * Allocate and initialize message to send.
-	 */
-
-	msgsize = GTA_HEADER_SIZE + triples * (sizeof *msg - GTA_HEADER_SIZE);
-	msg = walloc(msgsize);
-
-	{
-		gnutella_header_t *header;
-
-		header = gnutella_msg_hsep_header(msg);
-		message_set_muid(header, GTA_MSG_HSEP_DATA);
-		gnutella_header_set_function(header, GTA_MSG_HSEP_DATA);
-		gnutella_header_set_ttl(header, 1);
-		gnutella_header_set_hops(header, 0);
+	if (triples > 1 && NULL == other) {
+		/* determine what we know about non-HSEP nodes in 1 hop distance */
+		hsep_get_non_hsep_triple(&none);
+		other = &none;
 	}
 
 	/*
@@ -768,16 +794,11 @@ hsep_send_msg(gnutella_node_t *n, time_t now)
 	 * little endian byte order.
 	 */
 
-	if (triples > 1) {
-		/* determine what we know about non-HSEP nodes in 1 hop distance */
-		hsep_get_non_hsep_triple(&other);
-	}
-
 	for (i = 0; i < triples; i++) {
-		for (j = 0; j < N_ITEMS(other); j++) {
+		for (j = 0; j < N_ITEMS(hsep_own); j++) {
 			uint64 val;
 
-			val = hsep_own[j] + (0 == i ? 0 : other[j]) +
+			val = hsep_own[j] + (0 == i ? 0 : (*other)[j]) +
 				hsep_global_table[i][j] - hsep->table[i][j];
 			poke_le64(&tmp[i][j], val);
 		}
@@ -785,11 +806,37 @@ hsep_send_msg(gnutella_node_t *n, time_t now)
 
 	STATIC_ASSERT(sizeof hsep->sent_table == sizeof tmp);
 	/* check if the table differs from the previously sent table */
+	if (0 == memcmp(tmp, hsep->sent_table, triples * sizeof tmp[0]))
+		goto charge_timer;
+
+	/*
+	 * Small variations are only propagated after some time, to avoid
+	 * sending messages to all our peers each time a remote node comes
+	 * and goes in the horizon.
+	 */
+
 	if (
-		0 == memcmp(tmp, hsep->sent_table, sizeof tmp)
-	) {
-		WFREE_NULL(msg, msgsize);
+		hsep->msgs_sent != 0 &&
+		delta_time(now, hsep->last_changed) < HSEP_MSG_MAX_INTERVAL &&
+		!hsep_table_changed_enough(hsep->sent_table, tmp, triples)
+	)
 		goto charge_timer;
+
+	/*
+	 * Allocate and initialize message to send.
+	 */
+
+	msgsize = GTA_HEADER_SIZE + triples * (sizeof *msg - GTA_HEADER_SIZE);
+	msg = walloc(msgsize);
+
+	{
+		gnutella_header_t *header;
+
+		header = gnutella_msg_hsep_header(msg);
+		message_set_muid(header, GTA_MSG_HSEP_DATA);
+		gnutella_header_set_function(header, GTA_MSG_HSEP_DATA);
+		gnutella_header_set_ttl(header, 1);
+		gnutella_header_set_hops(header, 0);
 	}
 
 	memcpy(cast_to_char_ptr(msg) + GTA_HEADER_SIZE,
@@ -797,6 +844,7 @@ hsep_send_msg(gnutella_node_t *n, time_t now)
 
 	/* store the table for later comparison */
 	memcpy(hsep->sent_table, tmp, triples * sizeof tmp[0]);
+	hsep->last_changed = now;
 
 	/*
 	 * Note that on big endian architectures the message data is now in
@@ -858,6 +906,19 @@ charge_timer:
 	hsep->random_skew = random_value(2 * HSEP_MSG_SKEW) - HSEP_MSG_SKEW;
 }
 
+/**
+ * Sends a HSEP message to the given node, but only if data to send
+ * has changed. Should be called about every 30-60 seconds per node.
+ * Will automatically be called by hsep_timer() and
+ * hsep_connection_init(). Node must be HSEP-capable.
+ */
+
+void
+hsep_send_msg(gnutella_node_t *n, time_t now)
+{
+	hsep_send(n, now, NULL);
+}
+
 /**
  * This should be called whenever the number of shared files or kibibytes
  * change. The values are checked for changes, nothing is done if nothing
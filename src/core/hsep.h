@@ -55,6 +55,14 @@
  */
 #define HSEP_MSG_SKEW 10
 
+/**
+ * Minimal change, in percents of any value previously sent to a node, that
+ * triggers the sending of a new HSEP message.  Smaller changes are only
+ * propagated every HSEP_MSG_MAX_INTERVAL seconds.
+ */
+#define HSEP_MSG_CHANGE 2
+#define HSEP_MSG_MAX_INTERVAL (10 * HSEP_MSG_INTERVAL)
+
 /*
  * Public interface.
  */
@@ -52,6 +52,7 @@
 #include "lib/ascii.h"
 #include "lib/atoms.h"
 #include "lib/concat.h"
+#include "lib/cq.h"
 #include "lib/cstr.h"
 #include "lib/getline.h"
 #include "lib/gnet_host.h"
@@ -66,6 +67,7 @@
 #include "lib/pslist.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/strtok.h"
 #include "lib/timestamp.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
@@ -1117,6 +1119,8 @@ struct http_async {
 	struct http_async *parent;		/**< Parent request, for redirections */
 	pslist_t *delayed;				/**< Delayed data (list of pmsg_t) */
 	pslist_t *children;				/**< Child requests */
+	cevent_t *defer_ev;				/**< Deferred processing event */
+	filesize_t body_left;			/**< Reply body bytes still expected */
 	unsigned header_sent:1;			/**< Whether HTTP request header was sent */
 
 	/*
@@ -1148,6 +1152,9 @@ struct http_async {
 
 #define HA_F_FREED		0x00000001	/**< Structure has been logically freed */
 #define HA_F_SUBREQ		0x00000002	/**< Children request now has control */
+#define HA_F_KEEPALIVE	0x00000004	/**< Server keeps connection open */
+#define HA_F_LENGTH		0x00000008	/**< Reply body length is known */
+#define HA_F_REUSABLE	0x00000010	/**< Whole reply read, can reuse socket */
 
 /**
  * In order to allow detection of logically freed structures when we return
@@ -1207,6 +1214,230 @@ static struct socket_ops http_async_socket_ops = {
 	http_async_socket_destroy,		/* destroy */
 };
 
+/**
+ * Callout queue callback to send the request on a reused connection.
+ */
+static void
+http_async_reuse(cqueue_t *cq, void *obj)
+{
+	http_async_t *ha = obj;
+
+	http_async_check(ha);
+
+	cq_zero(cq, &ha->defer_ev);
+	http_async_connected(ha);
+}
+
+/***
+ *** Pool of idle persistent connections.
+ ***/
+
+#define HTTP_POOL_PER_HOST	2		/**< Max idle connections per server */
+#define HTTP_POOL_MAX		16		/**< Max idle connections overall */
+#define HTTP_POOL_IDLE		4		/**< Seconds before closing idle ones */
+
+/**
+ * An idle connection, kept around after a complete reply was read on a
+ * persistent connection so that the next request to the same server can
+ * skip the TCP handshake.
+ *
+ * The idle timeout is kept short because we do not want to race against
+ * the server closing the connection on its side whilst we send a request.
+ */
+struct http_pooled {
+	struct gnutella_socket *socket;	/**< The idle connection */
+	const char *host;				/**< Server hostname (atom), or NULL */
+	host_addr_t addr;				/**< Server address */
+	uint16 port;					/**< Server port */
+	time_t stamp;					/**< When connection became idle */
+};
+
+static pslist_t *http_pool;			/**< Idle connections (http_pooled) */
+
+/**
+ * Remove idle connection from the pool and free the entry, returning the
+ * socket, now owned by the caller.
+ */
+static struct gnutella_socket *
+http_pool_remove(struct http_pooled *hp)
+{
+	struct gnutella_socket *s = hp->socket;
+
+	http_pool = pslist_remove(http_pool, hp);
+	atom_str_free_null(&hp->host);
+	WFREE(hp);
+
+	socket_evt_clear(s);
+	socket_detach_ops(s);
+
+	return s;
+}
+
+/**
+ * Close idle connection and remove it from the pool.
+ */
+static void
+http_pool_close(struct http_pooled *hp)
+{
+	struct gnutella_socket *s = http_pool_remove(hp);
+
+	if (GNET_PROPERTY(http_debug) > 2) {
+		g_debug("HTTP closing idle connection to %s",
+			host_addr_port_to_string(s->addr, s->port));
+	}
+
+	socket_free_null(&s);
+}
+
+/**
+ * Callback invoked when an idle socket is destroyed.
+ */
+static void
+http_pool_socket_destroy(gnutella_socket_t *s, void *owner, const char *reason)
+{
+	struct http_pooled *hp = owner;
+
+	g_assert(s == hp->socket);
+
+	(void) reason;
+	(void) http_pool_remove(hp);
+}
+
+/**
+ * Socket-layer callbacks for idle connections.
+ */
+static struct socket_ops http_pool_socket_ops = {
+	NULL,							/* connect_failed */
+	NULL,							/* connected */
+	http_pool_socket_destroy,		/* destroy */
+};
+
+/**
+ * Input callback for idle connections.
+ *
+ * The server has nothing to say on an idle connection: this is either
+ * the connection being closed on its side, or garbage.  Either way, the
+ * connection is no longer usable.
+ */
+static void
+http_pool_readable(void *data, int unused_source, inputevt_cond_t unused_cond)
+{
+	(void) unused_source;
+	(void) unused_cond;
+
+	http_pool_close(data);
+}
+
+/**
+ * Attempt to keep the connection of a fully processed request opened,
+ * for reuse by a subsequent request to the same server.
+ *
+ * @return TRUE if the socket was put in the pool.
+ */
+static bool
+http_pool_put(http_async_t *ha)
+{
+	struct gnutella_socket *s = ha->socket;
+	struct http_pooled *hp;
+	pslist_t *sl;
+	size_t count = 0, same = 0;
+
+	if (NULL == s || 0 == (ha->flags & HA_F_REUSABLE))
+		return FALSE;
+
+	if (s->flags & (SOCK_F_EOF | SOCK_F_CONNRESET | SOCK_F_SHUTDOWN))
+		return FALSE;
+
+	PSLIST_FOREACH(http_pool, sl) {
+		hp = sl->data;
+		count++;
+		if (hp->port == s->port && host_addr_equiv(hp->addr, s->addr))
+			same++;
+	}
+
+	if (count >= HTTP_POOL_MAX || same >= HTTP_POOL_PER_HOST)
+		return FALSE;
+
+	WALLOC0(hp);
+	hp->socket = s;
+	hp->host = NULL == ha->host ? NULL : atom_str_get(ha->host);
+	hp->addr = s->addr;
+	hp->port = s->port;
+	hp->stamp = tm_time();
+
+	/*
+	 * Reset the socket to the state it had right after connection, so that
+	 * it can be handed over to the next request.
+	 */
+
+	socket_evt_clear(s);
+	getline_free_null(&s->getline);
+	s->pos = 0;
+
+	socket_attach_ops(s, SOCK_TYPE_HTTP, &http_pool_socket_ops, hp);
+	socket_evt_set(s, INPUT_EVENT_RX, http_pool_readable, hp);
+
+	http_pool = pslist_prepend(http_pool, hp);
+	ha->socket = NULL;
+
+	if (GNET_PROPERTY(http_debug) > 2) {
+		g_debug("HTTP keeping idle connection to %s",
+			host_addr_port_to_string(s->addr, s->port));
+	}
+
+	return TRUE;
+}
+
+/**
+ * Grab an idle connection to the server.
+ *
+ * @param host		the server hostname, NULL if given as an address
+ * @param addr		the server address, if no hostname
+ * @param port		the server port
+ *
+ * @return idle socket, removed from the pool, NULL if none.
+ */
+static struct gnutella_socket *
+http_pool_get(const char *host, const host_addr_t addr, uint16 port)
+{
+	pslist_t *sl;
+
+	PSLIST_FOREACH(http_pool, sl) {
+		struct http_pooled *hp = sl->data;
+
+		if (hp->port != port)
+			continue;
+
+		if (NULL == host) {
+			if (NULL == hp->host && host_addr_equiv(hp->addr, addr))
+				return http_pool_remove(hp);
+		} else {
+			if (hp->host != NULL && 0 == ascii_strcasecmp(hp->host, host))
+				return http_pool_remove(hp);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Close idle connections that have been unused for too long.
+ */
+static void
+http_pool_expire(time_t now)
+{
+	pslist_t *sl, *next;
+
+	for (sl = http_pool; sl != NULL; sl = next) {
+		struct http_pooled *hp = sl->data;
+
+		next = pslist_next(sl);
+
+		if (delta_time(now, hp->stamp) > HTTP_POOL_IDLE)
+			http_pool_close(hp);
+	}
+}
+
 /**
  * Get URL and request information, given opaque handle.
  * This can be used by client code to log request parameters.
@@ -1413,7 +1644,9 @@ http_async_free_recursive(http_async_t *ha)
 	}
 	if (ha->rx)
 		rx_disable(ha->rx);			/* No further reads */
-	socket_free_null(&ha->socket);
+	cq_cancel(&ha->defer_ev);
+	if (!http_pool_put(ha))
+		socket_free_null(&ha->socket);
 	if (ha->user_free) {
 		(*ha->user_free)(ha->user_opaque);
 		ha->user_free = NULL;
@@ -1679,7 +1912,6 @@ http_async_build_get_request(const http_async_t *ha,
 		"Host: %s\r\n"
 		"User-Agent: %s\r\n"
 		"Accept-Encoding: deflate\r\n"
-		"Connection: close\r\n"
 		"\r\n",
 		verb, path,
 		http_async_remote_host_port(ha),
@@ -1843,6 +2075,7 @@ http_async_create(
 	struct gnutella_socket *s;
 	http_async_t *ha;
 	const char *path, *host = NULL;
+	bool reused;
 
 	g_assert(url);
 	g_assert(error_ind);
@@ -1876,15 +2109,25 @@ http_async_create(
 
 		if (string_to_host_addr(host, NULL, &ip)) {
 			host = NULL;
-			s = socket_connect(ip, uport, SOCK_TYPE_HTTP, SOCK_F_FORCE);
+			s = http_pool_get(NULL, ip, uport);
+			reused = s != NULL;
+			if (!reused)
+				s = socket_connect(ip, uport, SOCK_TYPE_HTTP, SOCK_F_FORCE);
 		} else {
-			s = socket_connect_by_name(host, uport,
-					SOCK_TYPE_HTTP, SOCK_F_FORCE);
+			s = http_pool_get(host, zero_host_addr, uport);
+			reused = s != NULL;
+			if (!reused) {
+				s = socket_connect_by_name(host, uport,
+						SOCK_TYPE_HTTP, SOCK_F_FORCE);
+			}
 		}
 	} else {
 		host = NULL;
 		path = url;
-		s = socket_connect(addr, port, SOCK_TYPE_HTTP, SOCK_F_FORCE);
+		s = http_pool_get(NULL, addr, port);
+		reused = s != NULL;
+		if (!reused)
+			s = socket_connect(addr, port, SOCK_TYPE_HTTP, SOCK_F_FORCE);
 	}
 
 	if (s == NULL) {
@@ -1921,6 +2164,20 @@ http_async_create(
 
 	socket_attach_ops(s, SOCK_TYPE_HTTP, &http_async_socket_ops, ha);
 
+	/*
+	 * When reusing an idle connection, we are already connected but we
+	 * must let the caller customize the request before sending it.
+	 */
+
+	if (reused) {
+		ha->defer_ev = cq_main_insert(1, http_async_reuse, ha);
+
+		if (GNET_PROPERTY(http_debug) > 2) {
+			g_debug("HTTP reusing idle connection to %s for \"%s\"",
+				host_addr_port_to_string(s->addr, s->port), url);
+		}
+	}
+
 	if (post_data != NULL) {
 		ha->data = post_data->data;
 		ha->datalen = post_data->datalen;
@@ -2343,15 +2600,78 @@ http_async_rx_done(void *o)
 	http_data_ind(ha->rx, NULL);	/* Signals EOF */
 }
 
+/**
+ * Callout queue callback invoked when the whole reply body was received
+ * on a persistent connection.
+ */
+static void
+http_async_body_done(cqueue_t *cq, void *obj)
+{
+	http_async_t *ha = obj;
+
+	http_async_check(ha);
+
+	cq_zero(cq, &ha->defer_ev);
+	if (ha->flags & HA_F_KEEPALIVE)
+		ha->flags |= HA_F_REUSABLE;
+	http_async_rx_done(ha);
+}
+
+/**
+ * Signal that the whole reply body was received, when its length is known.
+ *
+ * Since we are called from the RX stack before data are delivered to the
+ * user, the end of the reply is processed asynchronously.
+ */
+static void
+http_async_body_complete(http_async_t *ha)
+{
+	if (NULL == ha->defer_ev)
+		ha->defer_ev = cq_main_insert(1, http_async_body_done, ha);
+}
+
+static void
+http_async_rx_given(void *o, ssize_t amount)
+{
+	http_async_t *ha = o;
+
+	http_async_check(ha);
+
+	if (0 == (ha->flags & HA_F_LENGTH))
+		return;
+
+	if (UNSIGNED(amount) > ha->body_left) {
+		ha->flags &= ~HA_F_KEEPALIVE;	/* Got more than announced */
+		ha->body_left = 0;
+	} else {
+		ha->body_left -= amount;
+	}
+
+	if (0 == ha->body_left)
+		http_async_body_complete(ha);
+}
+
+static void
+http_async_rx_chunk_end(void *o)
+{
+	http_async_t *ha = o;
+
+	http_async_check(ha);
+
+	if (ha->flags & HA_F_KEEPALIVE)
+		ha->flags |= HA_F_REUSABLE;
+	http_async_rx_done(ha);
+}
+
 static const struct rx_link_cb http_async_rx_link_cb = {
-	NULL,					/* add_rx_given */
+	http_async_rx_given,	/* add_rx_given */
 	http_async_rx_error,	/* read_error */
 	http_async_rx_done,		/* got_eof */
 };
 
 static const struct rx_chunk_cb http_async_rx_chunk_cb = {
 	http_async_rx_error,	/* chunk_error */
-	http_async_rx_done,		/* chunk_end */
+	http_async_rx_chunk_end,	/* chunk_end */
 };
 
 static const struct rx_inflate_cb http_async_rx_inflate_cb = {
@@ -2545,6 +2865,18 @@ http_got_header(http_async_t *ha, header_t *header)
 	g_assert(s->gdk_tag == 0);
 	g_assert(ha->rx == NULL);
 
+	/*
+	 * See whether the server will keep the connection opened after its
+	 * reply, in which case we need to know where the reply ends to be able
+	 * to reuse the connection for a subsequent request.
+	 */
+
+	if (http_major > 1 || (1 == http_major && http_minor >= 1)) {
+		buf = header_get(header, "Connection");
+		if (NULL == buf || !strtok_case_has(buf, ",", "close"))
+			ha->flags |= HA_F_KEEPALIVE;
+	}
+
 	/*
 	 * Lowest RX layer: the link level, doing network I/O.
 	 */
@@ -2576,6 +2908,32 @@ http_got_header(http_async_t *ha, header_t *header)
 
 		if (GNET_PROPERTY(http_debug) > 1)
 			http_async_logdbg(ha, "installing chunked layer");
+	} else if (ha->flags & HA_F_KEEPALIVE) {
+		/*
+		 * Without chunking, the reply body length must be known for the
+		 * connection to be reusable.  Otherwise the server will close the
+		 * connection at the end of the reply.
+		 */
+
+		buf = header_get(header, "Content-Length");
+
+		if (
+			HTTP_HEAD == ha->type || 204 == ack_code || 304 == ack_code ||
+			(ack_code >= 100 && ack_code < 200)
+		) {
+			ha->body_left = 0;
+			ha->flags |= HA_F_LENGTH;
+		} else if (buf != NULL) {
+			int error;
+
+			ha->body_left = parse_uint64(buf, NULL, 10, &error);
+			if (error)
+				ha->flags &= ~HA_F_KEEPALIVE;
+			else
+				ha->flags |= HA_F_LENGTH;
+		} else {
+			ha->flags &= ~HA_F_KEEPALIVE;
+		}
 	}
 
 	/*
@@ -2628,6 +2986,9 @@ http_got_header(http_async_t *ha, header_t *header)
 
 		rx_recv(rx_bottom(ha->rx), mb);
 	}
+
+	if ((ha->flags & HA_F_LENGTH) && 0 == ha->body_left)
+		http_async_body_complete(ha);
 }
 
 /**
@@ -3499,6 +3860,8 @@ retry:
 
 	if (sl_ha_freed)
 		http_async_free_pending();
+
+	http_pool_expire(now);
 }
 
 /**
@@ -3509,6 +3872,9 @@ http_close(void)
 {
 	while (sl_outgoing)
 		http_async_error(sl_outgoing->data, HTTP_ASYNC_CANCELLED);
+
+	while (http_pool != NULL)
+		http_pool_close(http_pool->data);
 }
 
 /***
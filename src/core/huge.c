@@ -48,13 +48,18 @@
 #include "settings.h"
 #include "share.h"
 #include "spam.h"
+#include "tth_cache.h"
 #include "verify_sha1.h"
 #include "verify_tth.h"
 #include "version.h"
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/compat_pio.h"
 #include "lib/cq.h"
+#include "lib/crc.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/gnet_host.h"
 #include "lib/halloc.h"
@@ -67,6 +72,7 @@
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/urn.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property.h"
@@ -74,11 +80,11 @@
 
 #include "lib/override.h"		/* Must be the last header included */
 
-#define HUGE_SHA1_CACHE_FREQ	60	/* seconds, for SHA1 cache dumps */
+#define HUGE_SHA1_CACHE_FREQ	60	/* seconds, for SHA1 cache compactions */
 
 /**
  * There's an in-core cache (the hash table ``sha1_cache''), and a
- * persistent copy (normally in ~/.gtk-gnutella/sha1_cache). The
+ * persistent copy (normally in ~/.gtk-gnutella/sha1_cache.bin). The
  * in-core cache is filled with the persistent one at launch. When the
  * "shared_file" (the records describing the shared files, see
  * share.h) are created, a call is made to sha1_set_digest to fill the
@@ -89,10 +95,9 @@
  * modification time. If they're identical to the ones in the cache,
  * the digest is considered to be accurate, and is used. If the file
  * size or last modification time don't match, the digest is computed
- * again and stored in the in-core cache, but it isn't stored in the
- * persistent one. Instead, the cache is marked as dirty, and will be
- * entirely overwritten by dump_cache, called when everything has been
- * computed.
+ * again and stored in the in-core cache, the former persistent record
+ * is killed and a new one is appended.  The persistent cache is only
+ * rewritten when it holds more dead records than live ones.
  */
 
 struct sha1_cache_entry {
@@ -101,17 +106,14 @@ struct sha1_cache_entry {
 	const struct tth *tth;		/**< TTH (binary; atom)				*/
     filesize_t  size;			/**< File size                      */
     time_t mtime;				/**< Last modification time         */
+    fileoffset_t offset;		/**< Persistent record offset, 0 if none */
     bool shared;				/**< There's a known entry for this
                                      file in the share library      */
 };
 
 static hikset_t *sha1_cache;
 
-/**
- * cache_dirty = TRUE means that in-core cache is different from the disk one.
- */
-static bool cache_dirty;
-static time_t cache_dumped;
+static time_t cache_dumped;		/**< Last compaction attempt */
 
 static cpattern_t *has_http_urls;
 
@@ -142,14 +144,16 @@ static void update_volatile_cache(
 
 /**
  * Add a new entry to the in-memory cache.
+ *
+ * @return the new entry.
  */
-static void
+static struct sha1_cache_entry *
 add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 	const struct sha1 *sha1, const struct tth *tth, bool known_to_be_shared)
 {
 	struct sha1_cache_entry *item;
 
-	WALLOC(item);
+	WALLOC0(item);
 	item->file_name = atom_str_get(filename);
 	item->size = size;
 	item->mtime = mtime;
@@ -157,128 +161,352 @@ add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 	item->tth = tth ? atom_tth_get(tth) : NULL;
 	item->shared = known_to_be_shared;
 	hikset_insert_key(sha1_cache, &item->file_name);
+
+	return item;
 }
 
 /* Disk cache */
 
-static const char sha1_persistent_cache_file_header[] =
-"#\n"
-"# gtk-gnutella SHA1 cache file.\n"
-"# This file is automatically generated.\n"
-"# Format is: URN<TAB>file_size<TAB>file_mtime<TAB>file_name\n"
-"# Comment lines start with a sharp (#)\n"
-"#\n"
-"\n";
+/*
+ * The persistent cache is a binary file made of a header followed by
+ * records.  Each record is a fixed-size part holding everything but the
+ * path, followed by the NUL-terminated path itself.  Integers are stored
+ * in big-endian order.
+ *
+ * File header:
+ *
+ *   0    magic (8 bytes), SHA1_CACHE_MAGIC
+ *   8    version (4 bytes)
+ *   12   length of the fixed part of records (4 bytes)
+ *
+ * Records:
+ *
+ *   0    flags (1 byte), SHA1_CACHE_F_*
+ *   1    reserved, 0
+ *   2    path length, including trailing NUL (2 bytes)
+ *   4    CRC32 of the record, excluding the first 8 bytes (4 bytes)
+ *   8    file size (8 bytes)
+ *   16   file mtime (8 bytes)
+ *   24   SHA-1 (20 bytes)
+ *   44   TTH (24 bytes), zeroed if not known
+ *   68   path
+ *
+ * Records are only ever appended.  When an entry is updated or removed,
+ * its record is killed by clearing the SHA1_CACHE_F_LIVE flag in place,
+ * which is not covered by the CRC.  The file is rewritten once dead
+ * records outnumber live ones.
+ */
+
+#define SHA1_CACHE_FILE		"sha1_cache.bin"
+#define SHA1_CACHE_LEGACY	"sha1_cache"	/* Former text format */
+#define SHA1_CACHE_MAGIC	"GTKGSHA1"
+#define SHA1_CACHE_VERSION	1
+#define SHA1_CACHE_HDRLEN	16				/* File header length */
+#define SHA1_CACHE_RECLEN	68				/* Fixed part of records */
+#define SHA1_CACHE_DEAD_MIN	1024			/* Dead records before compaction */
 
+#define SHA1_CACHE_F_LIVE	(1U << 0)		/* Record is valid */
+#define SHA1_CACHE_F_TTH	(1U << 1)		/* TTH is known */
+
+static const mode_t SHA1_CACHE_FILE_MODE = S_IRUSR | S_IWUSR; /* 0600 */
+
+static int cache_fd = -1;			/**< Persistent cache, opened lazily */
+static fileoffset_t cache_end;		/**< Append offset, 0 if no header yet */
+static size_t cache_dead;			/**< Amount of dead records in file */
+
+/**
+ * @return the length of the persisted record for the entry.
+ */
+static inline size_t
+sha1_cache_record_len(const struct sha1_cache_entry *e)
+{
+	return SHA1_CACHE_RECLEN + vstrlen(e->file_name) + 1;
+}
+
+/**
+ * Serialize entry into the supplied buffer, which must be large enough
+ * to hold sha1_cache_record_len() bytes.
+ *
+ * @return the length of the serialized record.
+ */
+static size_t
+sha1_cache_record_fill(char *buf, const struct sha1_cache_entry *e)
+{
+	size_t len = vstrlen(e->file_name) + 1;
+	size_t n = SHA1_CACHE_RECLEN + len;
+
+	g_assert(len <= MAX_INT_VAL(uint16));
+
+	buf[0] = SHA1_CACHE_F_LIVE | (e->tth != NULL ? SHA1_CACHE_F_TTH : 0);
+	buf[1] = 0;
+	poke_be16(&buf[2], len);
+	poke_be64(&buf[8], e->size);
+	poke_be64(&buf[16], e->mtime);
+	memcpy(&buf[24], e->sha1, SHA1_RAW_SIZE);
+	if (e->tth != NULL)
+		memcpy(&buf[44], e->tth, TTH_RAW_SIZE);
+	else
+		memset(&buf[44], 0, TTH_RAW_SIZE);
+	memcpy(&buf[SHA1_CACHE_RECLEN], e->file_name, len);
+	poke_be32(&buf[4], crc32_update(0, &buf[8], n - 8));
+
+	return n;
+}
+
+/**
+ * Fill the persistent cache file header in the supplied buffer.
+ */
 static void
-cache_entry_print(FILE *f, const char *filename,
-	const struct sha1 *sha1, const struct tth *tth,
-	filesize_t size, time_t mtime)
+sha1_cache_header_fill(char buf[SHA1_CACHE_HDRLEN])
 {
-	char size_buf[UINT64_DEC_BUFLEN], mtime_buf[UINT64_DEC_BUFLEN];
+	memcpy(buf, SHA1_CACHE_MAGIC, 8);
+	poke_be32(&buf[8], SHA1_CACHE_VERSION);
+	poke_be32(&buf[12], SHA1_CACHE_RECLEN);
+}
 
-	g_return_if_fail(f);
-	g_return_if_fail(filename);
-	g_return_if_fail(sha1);
-	g_return_if_fail(size > 0);
+/**
+ * Open the persistent cache for appending, if not already done.
+ *
+ * Trailing garbage seen at load time is discarded and the header is
+ * written when the file is new.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+sha1_cache_open(void)
+{
+	char *path;
+
+	if (is_valid_fd(cache_fd))
+		return TRUE;
 
-	uint64_to_string_buf(size, ARYLEN(size_buf));
-	uint64_to_string_buf(mtime, ARYLEN(mtime_buf));
+	path = make_pathname(settings_config_dir(), SHA1_CACHE_FILE);
+	cache_fd = file_open(path, O_CREAT | O_RDWR, SHA1_CACHE_FILE_MODE);
 
-	fprintf(f, "%s\t%s\t%s\t%s\n", bitprint_to_urn_string(sha1, tth),
-		size_buf, mtime_buf, filename);
+	if (!is_valid_fd(cache_fd))
+		goto failed;
+
+	if (0 == cache_end) {
+		char hdr[SHA1_CACHE_HDRLEN];
+
+		sha1_cache_header_fill(hdr);
+		if (SHA1_CACHE_HDRLEN != compat_pwrite(cache_fd, ARYLEN(hdr), 0))
+			goto failed;
+		cache_end = sizeof hdr;
+	}
+
+	if (-1 == ftruncate(cache_fd, cache_end))
+		goto failed;
+
+	HFREE_NULL(path);
+	return TRUE;
+
+failed:
+	g_warning("%s(): cannot open \"%s\": %m", G_STRFUNC, path);
+	fd_close(&cache_fd);
+	HFREE_NULL(path);
+	return FALSE;
 }
 
 /**
- * Add an entry to the persistent cache.
+ * Close the persistent cache.
  */
 static void
-add_persistent_cache_entry(const char *filename, filesize_t size,
-	time_t mtime, const struct sha1 *sha1, const struct tth *tth)
+sha1_cache_close(void)
 {
-	char *pathname;
-	FILE *f;
+	fd_close(&cache_fd);
+}
 
-	pathname = make_pathname(settings_config_dir(), "sha1_cache");
-	f = file_fopen(pathname, "a");
-	if (f) {
-		filestat_t sb;
+/**
+ * Append entry to the persistent cache.
+ */
+static void
+add_persistent_cache_entry(struct sha1_cache_entry *e)
+{
+	size_t n;
+	ssize_t w;
+	char *buf;
 
-		/*
-		 * If we're adding the very first entry (file empty), then emit header.
-		 */
+	g_assert(0 == e->offset);
 
-		if (fstat(fileno(f), &sb)) {
-			g_warning("%s(): could not stat \"%s\": %m", G_STRFUNC, pathname);
-		} else {
-			if (0 == sb.st_size) {
-				fputs(sha1_persistent_cache_file_header, f);
-			}
-			cache_entry_print(f, filename, sha1, tth, size, mtime);
-		}
-		fclose(f);
-	} else {
-		g_warning("%s(): could not open \"%s\": %m", G_STRFUNC, pathname);
+	if (sha1_cache_record_len(e) - SHA1_CACHE_RECLEN > MAX_INT_VAL(uint16)) {
+		g_warning("%s(): path too long to be cached: \"%s\"",
+			G_STRFUNC, e->file_name);
+		return;
+	}
+
+	if (!sha1_cache_open())
+		return;
+
+	buf = halloc(sha1_cache_record_len(e));
+	n = sha1_cache_record_fill(buf, e);
+	w = compat_pwrite(cache_fd, buf, n, cache_end);
+	hfree(buf);
+
+	if G_UNLIKELY(UNSIGNED(w) != n) {
+		if (-1 == w)
+			g_warning("%s(): write error: %m", G_STRFUNC);
+		else
+			g_warning("%s(): partial write (%zd/%zu bytes)", G_STRFUNC, w, n);
+		if (-1 == ftruncate(cache_fd, cache_end))
+			g_warning("%s(): cannot truncate: %m", G_STRFUNC);
+		return;
+	}
+
+	e->offset = cache_end;
+	cache_end += n;
+}
+
+/**
+ * Kill the persisted record of the entry, if any.
+ */
+static void
+kill_persistent_cache_entry(struct sha1_cache_entry *e)
+{
+	if (0 == e->offset)
+		return;
+
+	/*
+	 * Even if we cannot clear the flag, the record is accounted as dead:
+	 * upon reload, the entry will be superseded by a later record or be
+	 * pruned again.
+	 */
+
+	if (sha1_cache_open()) {
+		char flags = 0;
+
+		if (1 != compat_pwrite(cache_fd, &flags, 1, e->offset))
+			g_warning("%s(): cannot kill record: %m", G_STRFUNC);
 	}
-	HFREE_NULL(pathname);
+
+	e->offset = 0;
+	cache_dead++;
 }
 
-struct dump_cache_context {
+/**
+ * @return whether the persistent cache has enough dead records to be
+ * worth compacting.
+ */
+static bool
+sha1_cache_needs_compaction(void)
+{
+	return cache_dead > SHA1_CACHE_DEAD_MIN &&
+		cache_dead > hikset_count(sha1_cache);
+}
+
+struct sha1_cache_compact_context {
 	FILE *f;
-	bool forced;
+	fileoffset_t offset;
+	bool error;
 };
 
 /**
- * Dump one (in-memory) cache into the persistent cache. This is a callback
- * called by dump_cache to dump the whole in-memory cache onto disk.
+ * Write one (in-memory) cache entry to the new persistent cache.
  */
 static void
-dump_cache_one_entry(void *value, void *udata)
+sha1_cache_write_entry(void *value, void *udata)
 {
 	struct sha1_cache_entry *e = value;
-	struct dump_cache_context *ctx = udata;
+	struct sha1_cache_compact_context *ctx = udata;
+	size_t n;
+	char *buf;
 
-	if (ctx->forced || e->shared) {
-		cache_entry_print(ctx->f,
-			e->file_name, e->sha1, e->tth, e->size, e->mtime);
-	}
+	if (ctx->error)
+		return;
+
+	if (sha1_cache_record_len(e) - SHA1_CACHE_RECLEN > MAX_INT_VAL(uint16))
+		return;
+
+	buf = halloc(sha1_cache_record_len(e));
+	n = sha1_cache_record_fill(buf, e);
+	if (1 != fwrite(buf, n, 1, ctx->f))
+		ctx->error = TRUE;
+	hfree(buf);
 }
 
 /**
- * Dump the whole in-memory cache onto disk.
+ * Record the offset of the entry in the compacted persistent cache.
+ *
+ * Entries are traversed in the same order as by sha1_cache_write_entry()
+ * since the cache was not modified in-between.
  */
 static void
-dump_cache(bool force)
+sha1_cache_rebase_entry(void *value, void *udata)
 {
-	FILE *f;
-	file_path_t fp;
+	struct sha1_cache_entry *e = value;
+	struct sha1_cache_compact_context *ctx = udata;
 
-	if (!force && !cache_dirty)
+	if (sha1_cache_record_len(e) - SHA1_CACHE_RECLEN > MAX_INT_VAL(uint16)) {
+		e->offset = 0;
 		return;
+	}
 
-	file_path_set(&fp, settings_config_dir(), "sha1_cache");
-	f = file_config_open_write("SHA-1 cache", &fp);
-	if (f) {
-		struct dump_cache_context ctx;
-
-		fputs(sha1_persistent_cache_file_header, f);
-		ctx.f = f;
-		ctx.forced = force;
-		hikset_foreach(sha1_cache, dump_cache_one_entry, &ctx);
-		if (file_config_close(f, &fp)) {
-			cache_dirty = FALSE;
+	e->offset = ctx->offset;
+	ctx->offset += sha1_cache_record_len(e);
+}
+
+/**
+ * Rewrite the whole persistent cache from the in-memory one, dropping
+ * all the dead records.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+sha1_cache_compact(void)
+{
+	struct sha1_cache_compact_context ctx;
+	file_path_t fp;
+	char hdr[SHA1_CACHE_HDRLEN];
+	bool ok = FALSE;
+
+	file_path_set(&fp, settings_config_dir(), SHA1_CACHE_FILE);
+	ctx.f = file_config_open_write("SHA-1 cache", &fp);
+
+	if (NULL == ctx.f)
+		goto done;
+
+	sha1_cache_header_fill(hdr);
+	ctx.error = 1 != fwrite(ARYLEN(hdr), 1, ctx.f);
+	hikset_foreach(sha1_cache, sha1_cache_write_entry, &ctx);
+
+	if (ctx.error) {
+		g_warning("%s(): write error: %m", G_STRFUNC);
+		fclose(ctx.f);
+		goto done;
+	}
+
+	/*
+	 * Our appending descriptor must not outlive the former file.
+	 */
+
+	sha1_cache_close();
+
+	if (file_config_close(ctx.f, &fp)) {
+		ctx.offset = SHA1_CACHE_HDRLEN;
+		hikset_foreach(sha1_cache, sha1_cache_rebase_entry, &ctx);
+		cache_end = ctx.offset;
+		cache_dead = 0;
+		ok = TRUE;
+
+		if (GNET_PROPERTY(share_debug)) {
+			size_t n = hikset_count(sha1_cache);
+			g_debug("%s(): rewrote SHA1 cache with %zu entr%s",
+				G_STRFUNC, n, plural_y(n));
 		}
 	}
 
+done:
 	/*
 	 * Update the timestamp even on failure to avoid that we retry this
 	 * too frequently.
 	 */
+
 	cache_dumped = tm_time();
+	return ok;
 }
 
 /**
- * This function is used to read the disk cache into memory.
+ * This function is used to read the legacy text cache into memory.
  *
  * It must be passed one line from the cache (ending with '\n'). It
  * performs all the syntactic processing to extract the fields from
@@ -385,18 +613,17 @@ failure:
 }
 
 /**
- * Read the whole persistent cache into memory.
+ * Read the legacy text cache into memory, converting it to the binary
+ * format.  The text file is removed once converted.
  */
 static void G_COLD
-sha1_read_cache(void)
+sha1_read_legacy_cache(void)
 {
 	FILE *f;
 	file_path_t fp[1];
 	bool truncated = FALSE;
 
-	g_return_if_fail(settings_config_dir());
-
-	file_path_set(fp, settings_config_dir(), "sha1_cache");
+	file_path_set(fp, settings_config_dir(), SHA1_CACHE_LEGACY);
 	f = file_config_open_read("SHA-1 cache", fp, N_ITEMS(fp));
 	if (f) {
 		for (;;) {
@@ -414,10 +641,175 @@ sha1_read_cache(void)
 			}
 		}
 		fclose(f);
-		dump_cache(TRUE);
+
+		if (sha1_cache_compact()) {
+			char *path = make_pathname(fp->dir, fp->name);
+
+			g_info("converted SHA1 cache to \"%s\"", SHA1_CACHE_FILE);
+			if (-1 == unlink(path))
+				g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, path);
+			HFREE_NULL(path);
+		}
 	}
 }
 
+/**
+ * Load one record from the mapped persistent cache.
+ *
+ * Files are not checked here: the cache is consulted with the size and
+ * modification time of the files we share, and entries for files that
+ * are no longer shared get pruned after the first library scan.  This is
+ * what makes loading fast for large libraries.
+ *
+ * @param rec		the start of the record
+ * @param avail		amount of bytes available from the record start
+ * @param offset	the offset of the record in the file
+ *
+ * @return the length of the record, 0 if it is truncated or corrupted.
+ */
+static size_t G_COLD
+sha1_cache_load_record(const char *rec, size_t avail, fileoffset_t offset)
+{
+	struct sha1_cache_entry *e;
+	const char *path;
+	uint8 flags;
+	size_t len, n;
+	filesize_t size;
+	time_t mtime;
+	const struct tth *tth;
+
+	if (avail < SHA1_CACHE_RECLEN)
+		return 0;
+
+	flags = rec[0];
+	len = peek_be16(&rec[2]);
+	n = SHA1_CACHE_RECLEN + len;
+	path = &rec[SHA1_CACHE_RECLEN];
+
+	if (0 == len || n > avail || path[len - 1] != '\0')
+		return 0;
+
+	if (peek_be32(&rec[4]) != crc32_update(0, &rec[8], n - 8))
+		return 0;
+
+	if (0 == (flags & SHA1_CACHE_F_LIVE)) {
+		cache_dead++;
+		return n;
+	}
+
+	size = peek_be64(&rec[8]);
+	mtime = peek_be64(&rec[16]);
+	tth = (flags & SHA1_CACHE_F_TTH) ? (const void *) &rec[44] : NULL;
+
+	/*
+	 * A live record for a known path means we could not kill the previous
+	 * record when the entry was updated: the last record wins.
+	 */
+
+	e = hikset_lookup(sha1_cache, path);
+	if (e != NULL) {
+		update_volatile_cache(e, size, mtime,
+			(const struct sha1 *) &rec[24], tth);
+		e->shared = FALSE;
+		cache_dead++;
+	} else {
+		e = add_volatile_cache_entry(path, size, mtime,
+			(const struct sha1 *) &rec[24], tth, FALSE);
+	}
+	e->offset = offset;
+
+	return n;
+}
+
+/**
+ * Read the whole persistent cache into memory.
+ */
+static void G_COLD
+sha1_read_cache(void)
+{
+	char *path;
+	int fd;
+	filestat_t sb;
+	char *base;
+	fileoffset_t offset;
+
+	g_return_if_fail(settings_config_dir());
+
+	path = make_pathname(settings_config_dir(), SHA1_CACHE_FILE);
+	fd = file_open_missing(path, O_RDONLY);
+
+	if (!is_valid_fd(fd)) {
+		sha1_read_legacy_cache();
+		goto done;
+	}
+
+	if (-1 == fstat(fd, &sb)) {
+		g_warning("%s(): cannot stat \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+
+	if (sb.st_size < SHA1_CACHE_HDRLEN || sb.st_size > MAX_INT_VAL(ssize_t)) {
+		g_warning("%s(): ignoring \"%s\": bad size", G_STRFUNC, path);
+		goto done;
+	}
+
+	base = vmm_mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (MAP_FAILED == base) {
+		g_warning("%s(): cannot map \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+
+	if (
+		0 != memcmp(base, SHA1_CACHE_MAGIC, 8) ||
+		SHA1_CACHE_VERSION != peek_be32(&base[8]) ||
+		SHA1_CACHE_RECLEN != peek_be32(&base[12])
+	) {
+		g_warning("%s(): ignoring \"%s\": bad header", G_STRFUNC, path);
+		vmm_munmap(base, sb.st_size);
+		goto done;
+	}
+
+	vmm_madvise_sequential(base, sb.st_size);
+
+	for (offset = SHA1_CACHE_HDRLEN; offset < sb.st_size; /* empty */) {
+		size_t n = sha1_cache_load_record(&base[offset],
+			sb.st_size - offset, offset);
+
+		if (0 == n)
+			break;
+		offset += n;
+	}
+
+	vmm_munmap(base, sb.st_size);
+
+	/*
+	 * Any trailing garbage, usually a record partially written when we
+	 * crashed, is discarded when we first append to the file.
+	 */
+
+	if (offset != sb.st_size) {
+		g_warning("%s(): discarding last %zu byte%s of \"%s\"",
+			G_STRFUNC, (size_t) (sb.st_size - offset),
+			plural(sb.st_size - offset), path);
+	}
+
+	cache_end = offset;
+
+	if (GNET_PROPERTY(share_debug)) {
+		size_t n = hikset_count(sha1_cache);
+		g_debug("%s(): loaded %zu SHA1 cache entr%s, %zu dead record%s",
+			G_STRFUNC, n, plural_y(n), cache_dead, plural(cache_dead));
+	}
+
+	if (sha1_cache_needs_compaction())
+		sha1_cache_compact();
+
+done:
+	fd_close(&fd);
+	HFREE_NULL(path);
+}
+
 static bool
 huge_spam_check(shared_file_t *sf, const struct sha1 *sha1)
 {
@@ -439,7 +831,7 @@ huge_spam_check(shared_file_t *sf, const struct sha1 *sha1)
 static cevent_t *cache_dump_ev;
 
 /**
- * Callout queue callback invoked when we should flush the SHA1 cache.
+ * Callout queue callback invoked when we should compact the SHA1 cache.
  */
 static void
 cache_dump_due(cqueue_t *cq, void *unused_obj)
@@ -447,18 +839,22 @@ cache_dump_due(cqueue_t *cq, void *unused_obj)
 	(void) unused_obj;
 
 	cq_zero(cq, &cache_dump_ev);	/* Indicates callback fired */
-	dump_cache(FALSE);
+
+	if (sha1_cache_needs_compaction())
+		sha1_cache_compact();
 }
 
 /**
- * Dump the cache at most about once per HUGE_SHA1_CACHE_FREQ secs..
+ * Compact the cache, when needed, at most about once per
+ * HUGE_SHA1_CACHE_FREQ secs.
  */
 static void
 cache_dump_schedule(void)
 {
 	time_delta_t t;
 
-	cache_dirty = TRUE;
+	if (!sha1_cache_needs_compaction())
+		return;
 
 	if G_UNLIKELY(0 == cache_dumped) {
 		t = 0;
@@ -470,7 +866,7 @@ cache_dump_schedule(void)
 			t = HUGE_SHA1_CACHE_FREQ - t;
 	}
 	if (0 == t) {
-		dump_cache(FALSE);
+		sha1_cache_compact();
 	} else if (NULL == cache_dump_ev) {
 		cache_dump_ev = cq_main_insert(t * 1000, cache_dump_due, NULL);
 	}
@@ -537,15 +933,15 @@ huge_update_hashes(shared_file_t *sf,
 	if (cached) {
 		update_volatile_cache(cached, shared_file_size(sf),
 			shared_file_modification_time(sf), sha1, tth);
+		kill_persistent_cache_entry(cached);
+		add_persistent_cache_entry(cached);
 
-		cache_dump_schedule(); 	/* Dump cache once per minute */
+		cache_dump_schedule(); 	/* Compact at most once per minute */
 	} else {
-		add_volatile_cache_entry(shared_file_path(sf),
+		cached = add_volatile_cache_entry(shared_file_path(sf),
 			shared_file_size(sf), shared_file_modification_time(sf),
 			sha1, tth, TRUE);
-		add_persistent_cache_entry(shared_file_path(sf),
-			shared_file_size(sf), shared_file_modification_time(sf),
-			sha1, tth);
+		add_persistent_cache_entry(cached);
 	}
 	return TRUE;
 }
@@ -624,13 +1020,30 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 	case VERIFY_START:
 		if (!huge_need_sha1(sf))
 			return FALSE;
+		if (!shared_file_tth_is_available(sf))
+			verify_sha1_want_tth(ctx);	/* Compute TTH in the same pass */
 		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, TRUE);
 		return TRUE;
 	case VERIFY_PROGRESS:
 		return shared_file_indexed(sf);
 	case VERIFY_DONE:
-		huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
-		request_tigertree(sf, TRUE);
+		{
+			const struct tth *tth = verify_sha1_tth_digest(ctx);
+
+			/*
+			 * As in request_tigertree_callback(), persist the TTH in the
+			 * cache before updating the hashes.
+			 */
+
+			if (tth != NULL) {
+				tth_cache_insert(tth, verify_sha1_tth_leaves(ctx),
+					verify_sha1_tth_leave_count(ctx));
+				huge_update_hashes(sf, verify_sha1_digest(ctx), tth);
+			} else {
+				huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
+				request_tigertree(sf, TRUE);
+			}
+		}
 		/* FALL THROUGH */
 	case VERIFY_ERROR:
 	case VERIFY_SHUTDOWN:
@@ -729,7 +1142,6 @@ request_sha1(shared_file_t *sf)
 	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
 
 	if (cached && cached_entry_up_to_date(cached, sf)) {
-		cache_dirty = TRUE;
 		cached->shared = TRUE;
 		shared_file_set_sha1(sf, cached->sha1);
 		shared_file_set_tth(sf, cached->tth);
@@ -1019,6 +1431,7 @@ cache_entry_is_shared(void *v, void *unused_udata)
 	if (NULL == sf) {
 		/* Entry no longer shared */
 
+		kill_persistent_cache_entry(e);
 		atom_str_free_null(&e->file_name);
 		atom_sha1_free_null(&e->sha1);
 		atom_tth_free_null(&e->tth);
@@ -1098,7 +1511,11 @@ cache_free_entry(void *v, void *unused_udata)
 void
 huge_close(void)
 {
-	dump_cache(FALSE);
+	cq_cancel(&cache_dump_ev);
+
+	if (sha1_cache_needs_compaction())
+		sha1_cache_compact();
+	sha1_cache_close();
 
 	hikset_foreach(sha1_cache, cache_free_entry, NULL);
 	hikset_free_null(&sha1_cache);
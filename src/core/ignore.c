@@ -43,6 +43,7 @@
 #include "lib/ascii.h"
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/bloom.h"
 #include "lib/file.h"
 #include "lib/halloc.h"
 #include "lib/hset.h"
@@ -60,6 +61,7 @@
  * filename/filesizes we likewise wish to ignore.
  */
 static htable_t *by_sha1;		/**< SHA1s to ignore */
+static bloom_t *sha1_bloom;		/**< Filter in front of by_sha1 */
 static hset_t *by_namesize;		/**< By filename + filesize */
 
 /*
@@ -134,6 +136,55 @@ open_append(const char *file)
 	return f;
 }
 
+/**
+ * Table iterator callback.
+ *
+ * Add a key from the by_sha1 table to the SHA1 filter.
+ */
+static void
+sha1_bloom_add_kv(const void *key, void *unused_value, void *unused_udata)
+{
+	(void) unused_value;
+	(void) unused_udata;
+
+	bloom_add(sha1_bloom, key, SHA1_RAW_SIZE);
+}
+
+/**
+ * Record `sha1' as being ignored, for `file'.
+ *
+ * The SHA1 is added to the filter in front of the table, which is rebuilt
+ * with a larger capacity when it becomes full.
+ */
+static void
+ignore_sha1_insert(const struct sha1 *sha1, const char *file)
+{
+	htable_insert_const(by_sha1, atom_sha1_get(sha1), atom_str_get(file));
+
+	if G_UNLIKELY(bloom_is_full(sha1_bloom)) {
+		bloom_free_null(&sha1_bloom);
+		sha1_bloom = bloom_make(2 * htable_count(by_sha1));
+		htable_foreach(by_sha1, sha1_bloom_add_kv, NULL);
+	} else {
+		bloom_add(sha1_bloom, sha1, SHA1_RAW_SIZE);
+	}
+}
+
+/**
+ * Check whether `sha1' is ignored.
+ *
+ * Most of the SHA1 we check are not, so we only probe the table when the
+ * filter cannot rule the SHA1 out.
+ */
+static bool
+ignore_sha1_contains(const struct sha1 *sha1)
+{
+	if G_LIKELY(!bloom_maybe(sha1_bloom, sha1, SHA1_RAW_SIZE))
+		return FALSE;
+
+	return htable_contains(by_sha1, sha1);
+}
+
 /**
  * Initialize the ignore tables.
  */
@@ -141,6 +192,7 @@ void G_COLD
 ignore_init(void)
 {
 	by_sha1 = htable_create(HASH_KEY_FIXED, SHA1_RAW_SIZE);
+	sha1_bloom = bloom_make(0);
 	by_namesize = hset_create_any(namesize_hash, NULL, namesize_eq);
 
 	ignore_sha1_load(ignore_sha1, &ignore_sha1_mtime);
@@ -189,7 +241,7 @@ sha1_parse(FILE *f, const char *file)
 			continue;
 		}
 
-		if (htable_contains(by_sha1, &sha1))
+		if (ignore_sha1_contains(&sha1))
 			continue;
 
 		/*
@@ -203,7 +255,7 @@ sha1_parse(FILE *f, const char *file)
 		}
 
 		p = &ign_tmp[SHA1_BASE32_SIZE + 2];
-		htable_insert_const(by_sha1, atom_sha1_get(&sha1), atom_str_get(p));
+		ignore_sha1_insert(&sha1, p);
 	}
 }
 
@@ -329,7 +381,7 @@ ignore_is_requested(const char *filename, filesize_t size,
 	if (sha1) {
 		shared_file_t *sf;
 		bool ignore;
-		if (htable_contains(by_sha1, sha1))
+		if (ignore_sha1_contains(sha1))
 			return IGNORE_SHA1;
 		if (spam_sha1_check(sha1))
 			return IGNORE_SPAM;
@@ -359,8 +411,8 @@ ignore_add_sha1(const char *file, const struct sha1 *sha1)
 {
 	g_assert(sha1);
 
-	if (!htable_contains(by_sha1, sha1))
-		htable_insert_const(by_sha1, atom_sha1_get(sha1), atom_str_get(file));
+	if (!ignore_sha1_contains(sha1))
+		ignore_sha1_insert(sha1, file);
 
 	/*
 	 * Write to file even if duplicate SHA1, in order to help us
@@ -470,6 +522,7 @@ ignore_close(void)
 {
 	htable_foreach(by_sha1, free_sha1_kv, NULL);
 	htable_free_null(&by_sha1);
+	bloom_free_null(&sha1_bloom);
 
 	hset_foreach(by_namesize, free_namesize_kv, NULL);
 	hset_free_null(&by_namesize);
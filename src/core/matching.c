@@ -36,12 +36,22 @@
 #include "lib/ascii.h"
 #include "lib/atomic.h"
 #include "lib/atoms.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
+#include "lib/file.h"
 #include "lib/halloc.h"
 #include "lib/hset.h"
-#include "lib/pattern.h"
+#include "lib/htable.h"
+#include "lib/misc.h"
+#include "lib/path.h"
+#include "lib/mpattern.h"
 #include "lib/pslist.h"
+#include "lib/semaphore.h"
 #include "lib/stringify.h"	/* For hex_escape() */
+#include "lib/thread.h"
+#include "lib/tm.h"
 #include "lib/utf8.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 #include "lib/wordvec.h"
 
@@ -88,21 +98,34 @@ typedef uint64 st_mask_t;
 
 #define ST_MIN_BIN_SIZE		4
 
+#define ST_CACHE_MAX		256		/**< Max amount of cached query results */
+#define ST_CACHE_TTL		30		/**< Lifetime of cached results (secs) */
+
 struct st_entry {
 	const char *string;				/* atom */
 	shared_file_t *sf;
 	st_mask_t mask;
+	filesize_t size;				/* File size, valid if "sized" */
+	uint media_type;				/* Media type mask of the file */
+	unsigned sized:1;				/* Whether file size cannot change */
 };
 
+/*
+ * The masks of the entries are also kept in a separate array, in the same
+ * order as the entries, so that scanning a bin can reject most entries by
+ * only reading that array, without touching the entries themselves.
+ */
 struct st_bin {
 	uint nslots, nvals;
 	struct st_entry **vals;
+	st_mask_t *masks;				/* Masks of the entries in "vals" */
 };
 
 struct st_set {
 	uint nentries, nchars, nbins;
 	struct st_bin **bins;
 	struct st_bin all_entries;
+	htable_t *words;				/* Word prefix -> st_posting, optional */
 	uchar index_map[MAX_INT_VAL(uchar)];
 	uchar fold_map[MAX_INT_VAL(uchar)];
 };
@@ -114,6 +137,26 @@ struct search_table {
 	int refcnt;
 	struct st_set plain;		/* Plain table, original names */
 	struct st_set alias;		/* Normalized names */
+	htable_t *cache;			/* Recent results, by canonic query string */
+};
+
+/*
+ * Results of a recent search.
+ *
+ * The same popular queries keep coming from many peers within seconds,
+ * so we remember the matching entries for a while.  The entries referenced
+ * here are also held by the search table, which owns the cache, and which
+ * is never modified once it is used for searching.
+ */
+struct st_cached {
+	const char *search;			/* Canonic search string (atom) */
+	time_t stamp;				/* When matching was done */
+	filesize_t minsize;			/* Size limits, if restricted */
+	filesize_t maxsize;
+	uint32 media_types;			/* Media types filtering */
+	uint nres;					/* Amount of matches */
+	pslist_t *result;			/* Matching shared_file_t entries */
+	unsigned size_restrictions:1;
 };
 
 static inline void
@@ -145,6 +188,7 @@ bin_initialize(struct st_bin *bin, int size)
 	bin->nslots = size;
 
 	HALLOC_ARRAY(bin->vals, bin->nslots);
+	HALLOC_ARRAY(bin->masks, bin->nslots);
 	for (i = 0; i < bin->nslots; i++)
 		bin->vals[i] = NULL;
 }
@@ -171,6 +215,7 @@ static void
 bin_destroy(struct st_bin *bin)
 {
 	HFREE_NULL(bin->vals);
+	HFREE_NULL(bin->masks);
 	bin->nslots = 0;
 	bin->nvals = 0;
 }
@@ -184,7 +229,9 @@ bin_insert_item(struct st_bin *bin, struct st_entry *entry)
 	if (bin->nvals == bin->nslots) {
 		bin->nslots *= 2;
 		HREALLOC_ARRAY(bin->vals, bin->nslots);
+		HREALLOC_ARRAY(bin->masks, bin->nslots);
 	}
+	bin->masks[bin->nvals] = entry->mask;
 	bin->vals[bin->nvals++] = entry;
 }
 
@@ -195,6 +242,7 @@ static void
 bin_compact(struct st_bin *bin)
 {
 	HREALLOC_ARRAY(bin->vals, bin->nvals);
+	HREALLOC_ARRAY(bin->masks, bin->nvals);
 	bin->nslots = bin->nvals;
 }
 
@@ -262,6 +310,8 @@ st_set_initialize(struct st_set *set)
 	set->nbins = set->nchars * set->nchars;
 	set->bins = NULL;
 	set->all_entries.vals = 0;
+	set->all_entries.masks = NULL;
+	set->words = NULL;
 
 	if (GNET_PROPERTY(matching_debug)) {
 		static bool done;
@@ -303,6 +353,9 @@ st_set_recreate(struct st_set *set)
 		set->bins[i] = NULL;
 
     bin_initialize(&set->all_entries, ST_MIN_BIN_SIZE);
+
+	if (GNET_PROPERTY(search_word_index))
+		set->words = htable_create(HASH_KEY_STRING, 0);
 }
 
 /**
@@ -317,6 +370,260 @@ st_recreate(search_table_t *table)
 	st_set_recreate(&table->alias);
 }
 
+/*
+ * Word index.
+ *
+ * Bins only tell us which names contain a pair of characters, and for
+ * common pairs that can be a large fraction of the library.  Since query
+ * words must match at the beginning of words in the names, we can also
+ * index the leading bytes of the words: each name is listed under the
+ * first 2 to ST_WORD_PREFIX bytes of all its words.  A query word is then
+ * looked up by its own leading bytes, and only the names listed for all
+ * the query words can match.
+ *
+ * Names are listed by increasing index in the set.  Each index is stored as
+ * the difference with the previous one, 7 bits per byte, the high bit being
+ * set when more bytes follow, which takes a single byte most of the time.
+ */
+
+#define ST_WORD_PREFIX	4		/**< Longest word prefix indexed */
+#define ST_WORD_LISTS	8		/**< Max amount of lists intersected */
+
+struct st_posting {
+	char key[ST_WORD_PREFIX + 1];	/**< Word prefix */
+	uint count;						/**< Amount of names listed */
+	uint last;						/**< Last index listed, plus one */
+	uint len, size;					/**< Used and allocated data bytes */
+	uchar *data;					/**< Encoded index differences */
+};
+
+/**
+ * htable_foreach() callback to free word index lists.
+ */
+static void
+st_posting_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	struct st_posting *p = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	HFREE_NULL(p->data);
+	WFREE(p);
+}
+
+/**
+ * htable_foreach() callback to make word index lists take as little memory
+ * as needed.
+ */
+static void
+st_posting_compact_kv(const void *unused_key, void *value, void *unused_data)
+{
+	struct st_posting *p = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	HREALLOC_ARRAY(p->data, p->len);
+	p->size = p->len;
+}
+
+/**
+ * Decode next index from the list.
+ *
+ * @param p		the list
+ * @param pos	offset in the list data, updated
+ * @param prev	previous index decoded plus one, 0 initially
+ *
+ * @return the decoded index plus one.
+ */
+static inline uint
+st_posting_next(const struct st_posting *p, uint *pos, uint prev)
+{
+	uint v = 0, shift = 0;
+	uchar c;
+
+	do {
+		g_assert(*pos < p->len);
+		c = p->data[(*pos)++];
+		v |= (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return prev + v;
+}
+
+/**
+ * List name under the word prefix.
+ *
+ * @param words		the word index
+ * @param key		the word prefix
+ * @param idx		index of the name in the set
+ */
+static void
+st_word_add(htable_t *words, const char *key, uint idx)
+{
+	struct st_posting *p;
+	uint delta;
+
+	p = htable_lookup(words, key);
+
+	if (NULL == p) {
+		WALLOC0(p);
+		clamp_strcpy(p->key, sizeof p->key, key);
+		htable_insert(words, p->key, p);
+	}
+
+	if (p->last == idx + 1)
+		return;			/* Name has several words starting the same way */
+
+	g_assert(p->last < idx + 1);	/* Names are indexed in order */
+
+	delta = idx + 1 - p->last;
+	p->last = idx + 1;
+	p->count++;
+
+	if (p->size - p->len < 5) {
+		p->size = MAX(8, p->size * 2);
+		HREALLOC_ARRAY(p->data, p->size);
+	}
+
+	while (delta >= 0x80) {
+		p->data[p->len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	p->data[p->len++] = delta;
+}
+
+/**
+ * Index the leading bytes of all the words of the entry.
+ *
+ * Words start where mpattern_match() considers there is a word boundary.
+ * Prefixes containing spaces are not indexed, since query words have none.
+ *
+ * @param set		the set to which entry belongs
+ * @param entry		the entry to index
+ * @param idx		index of the entry in the set
+ */
+static void
+st_word_index(struct st_set *set, const struct st_entry *entry, uint idx)
+{
+	const uchar *s = (const uchar *) entry->string;
+	size_t i, len = vstrlen(entry->string);
+
+	for (i = 0; i + 1 < len; i++) {
+		char key[ST_WORD_PREFIX + 1];
+		size_t k;
+
+		if (0 != i && is_ascii_ident(s[i - 1]) == is_ascii_ident(s[i]))
+			continue;		/* Not at the beginning of a word */
+
+		for (k = 0; k < ST_WORD_PREFIX && i + k < len; k++) {
+			if (is_ascii_space(s[i + k]))
+				break;
+
+			key[k] = s[i + k];
+
+			if (k != 0) {
+				key[k + 1] = '\0';
+				st_word_add(set->words, key, idx);
+			}
+		}
+	}
+}
+
+/**
+ * Look up the names listed for all the query words in the word index.
+ *
+ * Words shorter than 2 bytes are not indexed and are therefore ignored,
+ * so the names returned still need to be matched against the query.
+ *
+ * @param set		the set being searched
+ * @param wovec		the query words
+ * @param wocnt		amount of query words
+ * @param max		only use the index if its shortest list is shorter
+ * @param ids		where the allocated array of name indices is returned
+ *
+ * @return the amount of names found, -1 if the index cannot be used.
+ */
+static int
+st_word_lookup(const struct st_set *set,
+	const word_vec_t *wovec, uint wocnt, uint max, uint **ids)
+{
+	const struct st_posting *lists[ST_WORD_LISTS];
+	const struct st_posting *shortest = NULL;
+	uint i, j, n = 0, pos = 0, found, *v;
+
+	*ids = NULL;
+
+	for (i = 0; i < wocnt && n < N_ITEMS(lists); i++) {
+		char key[ST_WORD_PREFIX + 1];
+		const struct st_posting *p;
+
+		if (wovec[i].len < 2)
+			continue;
+
+		clamp_strncpy(key, sizeof key, wovec[i].word, wovec[i].len);
+		p = htable_lookup(set->words, key);
+
+		if (NULL == p)
+			return 0;		/* No name has a word starting that way */
+
+		lists[n++] = p;
+
+		if (NULL == shortest || p->count < shortest->count)
+			shortest = p;
+	}
+
+	if (NULL == shortest || shortest->count >= max)
+		return -1;
+
+	/*
+	 * Decode the shortest list, then only keep the names also present in
+	 * each of the other lists, walking them in parallel since all the lists
+	 * are sorted.
+	 */
+
+	HALLOC_ARRAY(v, shortest->count);
+
+	for (i = 0, j = 0; i < shortest->count; i++)
+		v[i] = j = st_posting_next(shortest, &pos, j);
+
+	found = shortest->count;
+
+	for (i = 0; i < n && found != 0; i++) {
+		const struct st_posting *p = lists[i];
+		uint cur = 0, k, kept = 0;
+
+		if (p == shortest)
+			continue;
+
+		pos = 0;
+
+		for (k = 0; k < found; k++) {
+			while (cur < v[k] && pos < p->len)
+				cur = st_posting_next(p, &pos, cur);
+
+			if (cur < v[k])
+				break;		/* List exhausted */
+
+			if (cur == v[k])
+				v[kept++] = v[k];
+		}
+
+		found = kept;
+	}
+
+	for (i = 0; i < found; i++)
+		v[i]--;				/* Lists hold indices plus one */
+
+	if (0 == found)
+		HFREE_NULL(v);
+
+	*ids = v;
+	return found;
+}
+
 /**
  * Destroy a set.
  */
@@ -344,6 +651,124 @@ st_set_destroy(struct st_set *set)
 		}
 		bin_destroy(&set->all_entries);
 	}
+
+	if (set->words != NULL) {
+		htable_foreach(set->words, st_posting_free_kv, NULL);
+		htable_free_null(&set->words);
+	}
+}
+
+/**
+ * Free cached search results.
+ */
+static void
+st_cached_free(struct st_cached *c)
+{
+	atom_str_free_null(&c->search);
+	pslist_free_null(&c->result);
+	WFREE(c);
+}
+
+/**
+ * htable_foreach_remove() callback to dispose of cached search results.
+ */
+static bool
+st_cached_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	(void) unused_key;
+	(void) unused_data;
+
+	st_cached_free(value);
+	return TRUE;
+}
+
+/**
+ * Dispose of all the cached search results held by the table.
+ */
+static void
+st_cache_free(search_table_t *table)
+{
+	if (NULL == table->cache)
+		return;
+
+	htable_foreach_remove(table->cache, st_cached_free_kv, NULL);
+	htable_free_null(&table->cache);
+}
+
+/**
+ * Look for recent results of the same search, with the same limits.
+ *
+ * @return cached results if found, NULL otherwise.
+ */
+static const struct st_cached *
+st_cache_lookup(search_table_t *table, const char *search,
+	const search_request_info_t *sri)
+{
+	struct st_cached *c;
+
+	if (NULL == table->cache)
+		return NULL;
+
+	c = htable_lookup(table->cache, search);
+
+	if (NULL == c)
+		return NULL;
+
+	if (delta_time(tm_time(), c->stamp) > ST_CACHE_TTL) {
+		htable_remove(table->cache, c->search);
+		st_cached_free(c);
+		return NULL;
+	}
+
+	if (
+		c->media_types != sri->media_types ||
+		c->size_restrictions != sri->size_restrictions ||
+		(sri->size_restrictions &&
+			(c->minsize != sri->minsize || c->maxsize != sri->maxsize))
+	)
+		return NULL;
+
+	return c;
+}
+
+/**
+ * Remember the results of a search.
+ *
+ * @param table		the search table
+ * @param search	the canonic search string
+ * @param sri		search meta-information used to apply limits
+ * @param result	the list of matching entries, copied
+ * @param nres		the amount of matches
+ */
+static void
+st_cache_store(search_table_t *table, const char *search,
+	const search_request_info_t *sri, pslist_t *result, uint nres)
+{
+	struct st_cached *c;
+
+	if (NULL == table->cache)
+		table->cache = htable_create(HASH_KEY_STRING, 0);
+
+	c = htable_lookup(table->cache, search);
+
+	if (c != NULL) {
+		htable_remove(table->cache, c->search);
+		st_cached_free(c);
+	} else if (htable_count(table->cache) >= ST_CACHE_MAX) {
+		htable_foreach_remove(table->cache, st_cached_free_kv, NULL);
+	}
+
+	WALLOC0(c);
+	c->search = atom_str_get(search);
+	c->stamp = tm_time();
+	c->media_types = sri->media_types;
+	c->size_restrictions = sri->size_restrictions;
+	c->minsize = sri->minsize;
+	c->maxsize = sri->maxsize;
+	c->nres = nres;
+	c->result = pslist_copy(result);
+
+	htable_insert(table->cache, c->search, c);
 }
 
 /**
@@ -361,6 +786,7 @@ st_destroy(search_table_t *table)
 
 	g_assert(0 == table->refcnt);
 
+	st_cache_free(table);
 	st_set_destroy(&table->plain);
 	st_set_destroy(&table->alias);
 
@@ -467,6 +893,22 @@ mask_hash(const char *s) {
 	return mask;
 }
 
+/**
+ * Attach shared file to the entry, recording the file attributes used to
+ * apply query limits.
+ *
+ * The size of partial files can change whilst they are in the table, so
+ * it is only recorded for complete files.
+ */
+static void
+st_entry_set_file(struct st_entry *entry, const shared_file_t *sf)
+{
+	entry->sf = shared_file_ref(sf);
+	entry->media_type = shared_file_media_mask(sf);
+	entry->sized = !shared_file_is_partial(sf);
+	entry->size = entry->sized ? shared_file_size(sf) : 0;
+}
+
 /**
  * Get key of two-char pair.
  */
@@ -509,8 +951,8 @@ st_insert_item(search_table_t *table,
 
 	WALLOC(entry);
 	entry->string = atom_str_get(s);
-	entry->sf = shared_file_ref(sf);
 	entry->mask = mask_hash(entry->string);
+	st_entry_set_file(entry, sf);
 
 	len = vstrlen(entry->string);
 	for (i = 0; i < len - 1; i++) {
@@ -528,6 +970,10 @@ st_insert_item(search_table_t *table,
 
 		bin_insert_item(set->bins[key], entry);
 	}
+
+	if (set->words != NULL)
+		st_word_index(set, entry, set->all_entries.nvals);
+
 	bin_insert_item(&set->all_entries, entry);
 	set->nentries++;
 
@@ -552,6 +998,9 @@ st_set_compact(struct st_set *set)
 		if (set->bins[i])
 			bin_compact(set->bins[i]);
 	}
+
+	if (set->words != NULL)
+		htable_foreach(set->words, st_posting_compact_kv, NULL);
 }
 
 /**
@@ -566,95 +1015,502 @@ st_compact(search_table_t *table)
 	st_set_compact(&table->alias);
 }
 
-/**
- * Apply pattern matching on text, matching at the *beginning* of words.
- * Patterns are lazily compiled as needed, using pattern_compile_fast().
+/*
+ * Search table snapshots.
+ *
+ * Building the search table requires inserting each library entry in all the
+ * bins matching the consecutive character pairs of its name, which is costly
+ * for large libraries.  Since the library rarely changes between two runs,
+ * we save the final table to disk and reload it at the next startup when the
+ * set of shared files is unchanged.
+ *
+ * Entries cannot refer to shared files across runs, so they are recorded by
+ * their index in the vector of shared files given to st_store(), along with
+ * the size and modification time of each file.  The snapshot is only used
+ * when the same files, in the same order, bear the same sizes, modification
+ * times and names.  Anything else invalidates the snapshot and the table is
+ * then rebuilt as usual.
+ *
+ * All values are stored in little-endian order.  The layout is:
+ *
+ *   header: magic, version, file count, amount of indexing chars, index map
+ *   files:  for each file, its size and modification time (64-bit)
+ *   sets:   for the plain and then the alias set, the entry count and the
+ *           amount of used bins, then for each entry its file index, mask
+ *           (64-bit) and name (32-bit length + bytes), then for each used bin
+ *           its key, its value count and the indices of its entries.
  */
-static bool
-entry_match(const char *text, size_t tlen,
-	cpattern_t **pw, word_vec_t *wovec, size_t wn)
-{
-	size_t i;
 
-	for (i = 0; i < wn; i++) {
-		size_t j, offset = 0, amount = wovec[i].amount;
+#define ST_SNAPSHOT_MAGIC	0x54535447		/* "GTST" once serialized */
+#define ST_SNAPSHOT_VERSION	1
 
-		if (pw[i] == NULL)
-			pw[i] = pattern_compile_fast(wovec[i].word, wovec[i].len, FALSE);
+struct st_writer {
+	FILE *f;
+	bool error;
+};
 
-		for (j = 0; j < amount; j++) {
-			const char *pos;
+static void
+st_put_data(struct st_writer *w, const void *data, size_t len)
+{
+	if (len != 0 && 1 != fwrite(data, len, 1, w->f))
+		w->error = TRUE;
+}
 
-			pos = pattern_search(pw[i], text, tlen, offset, qs_begin);
-			if (pos)
-				offset = (pos - text) + pattern_len(pw[i]);
-			else
-				break;
-		}
-		if (j != amount)	/* Word does not occur as many times as we want */
-			return FALSE;
-	}
+static void
+st_put32(struct st_writer *w, uint32 v)
+{
+	char buf[4];
 
-	return TRUE;
+	poke_le32(buf, v);
+	st_put_data(w, buf, sizeof buf);
+}
+
+static void
+st_put64(struct st_writer *w, uint64 v)
+{
+	char buf[8];
+
+	poke_le64(buf, v);
+	st_put_data(w, buf, sizeof buf);
 }
 
 /**
- * Fill non-NULL query hash vector for query routing.
+ * Serialize set.
  *
- * This needs to be called when st_search() is not called when processing
- * a query, otherwise the qhery hash vector won't be properly initialized
- * and the query would be improperly dropped by qrt_build_query_target(),
- * hence never routed.
+ * @param w		the writer
+ * @param set	the set to serialize
+ * @param fidx	maps a shared file to its index in the file vector, plus 1
  */
-void
-st_fill_qhv(const char *search_term, query_hashvec_t *qhv)
+static void
+st_set_store(struct st_writer *w, const struct st_set *set, htable_t *fidx)
 {
-	char *search;
-	word_vec_t *wovec;
-	uint wocnt;
-	uint i;
+	htable_t *eidx;
+	uint i, used = 0;
 
-	if (NULL == qhv)
-		return;
+	for (i = 0; i < set->nbins; i++) {
+		if (set->bins[i] != NULL)
+			used++;
+	}
 
-	search = UNICODE_CANONIZE(search_term);
-	wocnt = word_vec_make(search, &wovec);
+	st_put32(w, set->all_entries.nvals);
+	st_put32(w, used);
 
-	for (i = 0; i < wocnt; i++) {
-		if (wovec[i].len >= QRP_MIN_WORD_LENGTH)
-			qhvec_add(qhv, wovec[i].word, QUERY_H_WORD);
+	eidx = htable_create(HASH_KEY_SELF, 0);
+
+	for (i = 0; i < set->all_entries.nvals && !w->error; i++) {
+		const struct st_entry *e = set->all_entries.vals[i];
+		int idx = pointer_to_int(htable_lookup(fidx, e->sf));
+		size_t len = vstrlen(e->string);
+
+		if G_UNLIKELY(0 == idx) {
+			w->error = TRUE;		/* Entry not in the file vector */
+			break;
+		}
+
+		htable_insert(eidx, e, int_to_pointer(i + 1));
+
+		st_put32(w, idx - 1);
+		st_put64(w, e->mask);
+		st_put32(w, len);
+		st_put_data(w, e->string, len);
 	}
 
-	if (search != search_term)
-		HFREE_NULL(search);
+	for (i = 0; i < set->nbins && !w->error; i++) {
+		const struct st_bin *bin = set->bins[i];
+		uint j;
 
-	if (wocnt > 0)
-		word_vec_free(wovec, wocnt);
+		if (NULL == bin)
+			continue;
+
+		st_put32(w, i);
+		st_put32(w, bin->nvals);
+
+		for (j = 0; j < bin->nvals; j++)
+			st_put32(w, pointer_to_int(htable_lookup(eidx, bin->vals[j])) - 1);
+	}
+
+	htable_free_null(&eidx);
 }
 
 /**
- * Compute search bin "name" (2 consecutive indexing letters) given
- * the matching start string whose first 2 characters were used to select
- * the bin.
+ * Save a snapshot of the search table to disk.
  *
- * @param str	start of 2 chars that make up the bin name
+ * All the shared files referenced by the table must be listed in the
+ * supplied vector, which must be given again, in the same order, to
+ * st_retrieve() to reload the table.
  *
- * @return the bin name, as a pointer to a static buffer
+ * @param table		the search table
+ * @param dir		the directory where the snapshot is saved
+ * @param name		the name of the snapshot file
+ * @param files		vector of shared files
+ * @param count		amount of shared files in the vector
+ *
+ * @return TRUE if the snapshot was saved.
  */
-static const char *
-st_bin_name(const char *str)
+bool
+st_store(const search_table_t *table, const char *dir, const char *name,
+	const struct shared_file * const *files, size_t count)
 {
-	static char buf[3];
+	struct st_writer w;
+	file_path_t fp;
+	htable_t *fidx;
+	size_t i;
 
-	g_assert(str != NULL);
-	g_assert(str[0] != '\0' && str[1] != '\0');
+	search_table_check(table);
+	g_assert(files != NULL || 0 == count);
+	g_return_val_if_fail(count < MAX_INT_VAL(int), FALSE);
 
-	buf[0] = is_ascii_print(str[0]) ? str[0] : ' ';
-	buf[1] = is_ascii_print(str[1]) ? str[1] : ' ';
-	buf[2] = '\0';
+	file_path_set(&fp, dir, name);
+	w.f = file_config_open_write("search table", &fp);
+	w.error = FALSE;
 
-	return buf;
-}
+	if (NULL == w.f)
+		return FALSE;
+
+	st_put32(&w, ST_SNAPSHOT_MAGIC);
+	st_put32(&w, ST_SNAPSHOT_VERSION);
+	st_put32(&w, count);
+	st_put32(&w, table->plain.nchars);
+	st_put_data(&w, table->plain.index_map, sizeof table->plain.index_map);
+
+	fidx = htable_create(HASH_KEY_SELF, 0);
+
+	for (i = 0; i < count; i++) {
+		const shared_file_t *sf = files[i];
+
+		htable_insert(fidx, sf, int_to_pointer(i + 1));
+		st_put64(&w, shared_file_size(sf));
+		st_put64(&w, shared_file_modification_time(sf));
+	}
+
+	st_set_store(&w, &table->plain, fidx);
+	st_set_store(&w, &table->alias, fidx);
+
+	htable_free_null(&fidx);
+
+	if (w.error) {
+		s_warning("%s(): cannot save search table in \"%s\": %m",
+			G_STRFUNC, fp.name);
+		fclose(w.f);
+		return FALSE;
+	}
+
+	return file_config_close(w.f, &fp);
+}
+
+struct st_reader {
+	const char *p, *end;
+	bool error;
+};
+
+static const void *
+st_get_data(struct st_reader *r, size_t len)
+{
+	const char *p = r->p;
+
+	if (r->error || UNSIGNED(r->end - r->p) < len) {
+		r->error = TRUE;
+		return NULL;
+	}
+
+	r->p += len;
+	return p;
+}
+
+static uint32
+st_get32(struct st_reader *r)
+{
+	const void *p = st_get_data(r, 4);
+
+	return NULL == p ? 0 : peek_le32(p);
+}
+
+static uint64
+st_get64(struct st_reader *r)
+{
+	const void *p = st_get_data(r, 8);
+
+	return NULL == p ? 0 : peek_le64(p);
+}
+
+/**
+ * Reload set from the snapshot.
+ *
+ * @return TRUE if the set was entirely reloaded and is consistent with
+ * the supplied files.
+ */
+static bool
+st_set_retrieve(struct st_reader *r, struct st_set *set, enum match_set which,
+	const struct shared_file * const *files, size_t count)
+{
+	uint32 n, used, i;
+
+	n = st_get32(r);
+	used = st_get32(r);
+
+	if (r->error || used > set->nbins)
+		return FALSE;
+
+	for (i = 0; i < n; i++) {
+		uint32 idx = st_get32(r);
+		st_mask_t mask = st_get64(r);
+		uint32 len = st_get32(r);
+		const char *s = st_get_data(r, len);
+		const char *name;
+		struct st_entry *entry;
+
+		if (r->error || idx >= count)
+			return FALSE;
+
+		name = ST_SET_PLAIN == which ?
+			shared_file_name_canonic(files[idx]) :
+			shared_file_name_normalized(files[idx]);
+
+		if (vstrlen(name) != len || 0 != memcmp(name, s, len))
+			return FALSE;		/* File was renamed */
+
+		WALLOC(entry);
+		entry->string = atom_str_get(name);
+		entry->mask = mask;
+		st_entry_set_file(entry, files[idx]);
+
+		if (set->words != NULL)
+			st_word_index(set, entry, set->all_entries.nvals);
+
+		bin_insert_item(&set->all_entries, entry);
+		set->nentries++;
+	}
+
+	for (i = 0; i < used; i++) {
+		uint32 key = st_get32(r);
+		uint32 nvals = st_get32(r);
+		struct st_bin *bin;
+		uint32 j;
+
+		if (r->error || key >= set->nbins || set->bins[key] != NULL)
+			return FALSE;
+
+		if (0 == nvals || nvals > n)
+			return FALSE;
+
+		WALLOC(bin);
+		bin_initialize(bin, nvals);
+		set->bins[key] = bin;
+
+		for (j = 0; j < nvals; j++) {
+			uint32 e = st_get32(r);
+
+			if (r->error || e >= n)
+				return FALSE;
+
+			bin_insert_item(bin, set->all_entries.vals[e]);
+		}
+	}
+
+	st_set_compact(set);
+
+	return TRUE;
+}
+
+/**
+ * Reload search table from the snapshot.
+ *
+ * @return TRUE if the table was entirely reloaded.
+ */
+static bool
+st_load(search_table_t *table, struct st_reader *r,
+	const struct shared_file * const *files, size_t count)
+{
+	const void *index_map;
+	size_t i;
+
+	if (
+		st_get32(r) != ST_SNAPSHOT_MAGIC ||
+		st_get32(r) != ST_SNAPSHOT_VERSION ||
+		st_get32(r) != count ||
+		st_get32(r) != table->plain.nchars
+	)
+		return FALSE;
+
+	index_map = st_get_data(r, sizeof table->plain.index_map);
+
+	if (
+		NULL == index_map ||
+		0 != memcmp(index_map, ARYLEN(table->plain.index_map))
+	)
+		return FALSE;
+
+	for (i = 0; i < count; i++) {
+		const shared_file_t *sf = files[i];
+		filesize_t size = st_get64(r);
+		time_t mtime = st_get64(r);
+
+		if (r->error)
+			return FALSE;
+
+		if (
+			size != shared_file_size(sf) ||
+			mtime != shared_file_modification_time(sf)
+		)
+			return FALSE;		/* File was changed */
+	}
+
+	if (!st_set_retrieve(r, &table->plain, ST_SET_PLAIN, files, count))
+		return FALSE;
+
+	if (!st_set_retrieve(r, &table->alias, ST_SET_ALIAS, files, count))
+		return FALSE;
+
+	return r->p == r->end;
+}
+
+/**
+ * Reload search table from the snapshot saved by st_store(), provided it
+ * still describes the supplied shared files.
+ *
+ * @param dir		the directory where the snapshot was saved
+ * @param name		the name of the snapshot file
+ * @param files		vector of shared files, in the order given to st_store()
+ * @param count		amount of shared files in the vector
+ *
+ * @return the reloaded search table, NULL if there is no snapshot or if it
+ * went stale, in which case the table must be rebuilt.
+ */
+search_table_t *
+st_retrieve(const char *dir, const char *name,
+	const struct shared_file * const *files, size_t count)
+{
+	search_table_t *table = NULL;
+	struct st_reader r;
+	filestat_t sb;
+	char *path;
+	void *p = NULL;
+	size_t size = 0;
+	int fd;
+
+	g_assert(files != NULL || 0 == count);
+
+	path = make_pathname(dir, name);
+	fd = file_open_missing(path, O_RDONLY);
+
+	if (-1 == fd)
+		goto done;
+
+	if (-1 == fstat(fd, &sb) || !S_ISREG(sb.st_mode)) {
+		s_warning("%s(): cannot use \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+
+	if (sb.st_size <= 0 || UNSIGNED(sb.st_size) >= MAX_INT_VAL(size_t))
+		goto done;
+
+	size = sb.st_size;
+
+#ifdef HAS_MMAP
+	p = vmm_mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == p) {
+		s_warning("%s(): cannot map \"%s\": %m", G_STRFUNC, path);
+		p = NULL;
+		goto done;
+	}
+	vmm_madvise_sequential(p, size);
+#else
+	p = halloc(size);
+	if (size != UNSIGNED(read(fd, p, size))) {
+		s_warning("%s(): cannot read \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+#endif	/* HAS_MMAP */
+
+	r.p = p;
+	r.end = r.p + size;
+	r.error = FALSE;
+
+	table = st_create();
+
+	if (!st_load(table, &r, files, count)) {
+		if (GNET_PROPERTY(matching_debug)) {
+			g_debug("MATCH discarding stale search table snapshot \"%s\"",
+				path);
+		}
+		st_free(&table);
+	} else if (GNET_PROPERTY(matching_debug)) {
+		g_debug("MATCH reloaded search table for %zu file%s from \"%s\"",
+			count, plural(count), path);
+	}
+
+	/* FALL THROUGH */
+
+done:
+#ifdef HAS_MMAP
+	if (p != NULL)
+		vmm_munmap(p, size);
+#else
+	HFREE_NULL(p);
+#endif
+	fd_close(&fd);
+	HFREE_NULL(path);
+
+	return table;
+}
+
+/**
+ * Fill non-NULL query hash vector for query routing.
+ *
+ * This needs to be called when st_search() is not called when processing
+ * a query, otherwise the qhery hash vector won't be properly initialized
+ * and the query would be improperly dropped by qrt_build_query_target(),
+ * hence never routed.
+ */
+void
+st_fill_qhv(const char *search_term, query_hashvec_t *qhv)
+{
+	char *search;
+	word_vec_t *wovec;
+	uint wocnt;
+	uint i;
+
+	if (NULL == qhv)
+		return;
+
+	search = UNICODE_CANONIZE(search_term);
+	wocnt = word_vec_make(search, &wovec);
+
+	for (i = 0; i < wocnt; i++) {
+		if (wovec[i].len >= QRP_MIN_WORD_LENGTH)
+			qhvec_add(qhv, wovec[i].word, QUERY_H_WORD);
+	}
+
+	if (search != search_term)
+		HFREE_NULL(search);
+
+	if (wocnt > 0)
+		word_vec_free(wovec, wocnt);
+}
+
+/**
+ * Compute search bin "name" (2 consecutive indexing letters) given
+ * the matching start string whose first 2 characters were used to select
+ * the bin.
+ *
+ * @param str	start of 2 chars that make up the bin name
+ *
+ * @return the bin name, as a pointer to a static buffer
+ */
+static const char *
+st_bin_name(const char *str)
+{
+	static char buf[3];
+
+	g_assert(str != NULL);
+	g_assert(str[0] != '\0' && str[1] != '\0');
+
+	buf[0] = is_ascii_print(str[0]) ? str[0] : ' ';
+	buf[1] = is_ascii_print(str[1]) ? str[1] : ' ';
+	buf[2] = '\0';
+
+	return buf;
+}
 
 enum search_mode {
 	SEARCH_NORMAL,		/* Original query string */
@@ -663,6 +1519,343 @@ enum search_mode {
 
 typedef size_t (*st_filename_len_fn_t)(const shared_file_t *sf);
 
+/**
+ * Query matching parameters, for scanning the entries of a search bin.
+ */
+struct st_scan {
+	const struct st_entry * const *vals;	/**< Entries from the bin */
+	const st_mask_t *masks;					/**< Masks of these entries */
+	uint vcnt;								/**< Amount of entries */
+	const char *search;						/**< Query string (canonized) */
+	const search_request_info_t *sri;		/**< For applying query limits */
+	const hset_t *already_matched;			/**< Files to skip, if non-NULL */
+	const mpattern_t *words;				/**< Matches all query words */
+	st_mask_t search_mask;					/**< Mask of the query */
+	size_t minlen;							/**< Minimum filename length */
+	st_filename_len_fn_t flen;				/**< Computes filename length */
+};
+
+/**
+ * A partition of the bin entries, scanned by a single thread.
+ */
+struct st_part {
+	const struct st_scan *scan;		/**< Common matching parameters */
+	uint start, end;				/**< Entries scanned are [start, end[ */
+	pslist_t *result;				/**< Matching files */
+	uint nres;						/**< Amount of matching files */
+	int scanned;					/**< Amount of entries matched */
+};
+
+#define ST_SCAN_BLOCK	8		/**< Masks compared in one pass */
+
+/**
+ * Match entry whose mask shows it can match the query.
+ *
+ * The file attributes recorded in the entry let us apply the query limits
+ * before touching the shared file.
+ */
+static inline void
+st_scan_entry(struct st_part *p, const struct st_entry *e)
+{
+	const struct st_scan *sc = p->scan;
+	const search_request_info_t *sri = sc->sri;
+	const shared_file_t *sf;
+	size_t filename_len;
+
+	if (0 != sri->media_types && 0 == (e->media_type & sri->media_types))
+		return;		/* Not of the requested type */
+
+	if (
+		sri->size_restrictions && e->sized &&
+		(e->size < sri->minsize || e->size > sri->maxsize)
+	)
+		return;		/* Not within size limits */
+
+	sf = e->sf;
+
+	if (
+		sc->already_matched != NULL &&
+		hset_contains(sc->already_matched, sf)
+	)
+		return;
+
+	if (!shared_file_is_shareable(sf))
+		return;		/* Cannot be shared */
+
+	filename_len = (*sc->flen)(sf);
+
+	if (filename_len < sc->minlen)
+		return;		/* Can't match */
+
+	if (
+		sri->size_restrictions && !e->sized &&
+		!search_apply_limits(sf, sri)
+	)
+		return;		/* Does not pass limits the queryier has set */
+
+	p->scanned++;
+
+	if (mpattern_match(sc->words, e->string, filename_len)) {
+		if (GNET_PROPERTY(matching_debug) > 3) {
+			g_debug("MATCH \"%s\" matches %s",
+				sc->search, shared_file_name_nfc(sf));
+		}
+
+		/*
+		 * As we only return a limited amount of results, we insert all the
+		 * matching entries in a list, which will then be randomly shuffled.
+		 * Only its leading items will be extracted.
+		 *
+		 * That strategy allows us to possibly return all the matching entries
+		 * when they repeat the search over time.
+		 */
+
+		p->result = pslist_prepend_const(p->result, sf);
+		p->nres++;
+	}
+}
+
+/**
+ * Match entries from a partition of the bin.
+ *
+ * All the query words are looked for in a single pass over each file name,
+ * at the beginning of words.
+ *
+ * The masks of the entries are compared with the query mask a block at a
+ * time, without any branching, which the compiler can turn into vector
+ * instructions.  Only the entries whose mask shows they can match are then
+ * looked at.
+ */
+static void G_HOT
+st_scan_part(struct st_part *p)
+{
+	const struct st_scan *sc = p->scan;
+	const st_mask_t qmask = sc->search_mask;
+	uint i = p->start;
+
+	for (/* empty */; i + ST_SCAN_BLOCK <= p->end; i += ST_SCAN_BLOCK) {
+		const st_mask_t *m = &sc->masks[i];
+		uint j, candidates = 0;
+
+		for (j = 0; j < ST_SCAN_BLOCK; j++)
+			candidates |= (uint) (qmask == (m[j] & qmask)) << j;
+
+		for (j = 0; candidates != 0; j++, candidates >>= 1) {
+			if (candidates & 1)
+				st_scan_entry(p, sc->vals[i + j]);
+		}
+	}
+
+	for (/* empty */; i < p->end; i++) {
+		if (qmask == (sc->masks[i] & qmask))
+			st_scan_entry(p, sc->vals[i]);
+	}
+}
+
+/*
+ * Parallel matching.
+ *
+ * Matching a query requires scanning all the entries of the smallest search
+ * bin, and on large libraries this can be the most expensive part of query
+ * processing.  When the "search_matching_threads" property is non-zero, large
+ * bins are split in as many partitions as there are threads involved, and
+ * worker threads help the main thread scan them, each partition collecting
+ * its matches in its own list.  The automaton matching the query words is
+ * shared by all the threads since it is read-only.  These lists are then merged once all the
+ * partitions have been scanned.
+ *
+ * Workers are created on demand and stay blocked on a semaphore until the
+ * main thread hands them a new set of partitions to scan.  Partitions are
+ * picked up atomically, so the main thread takes its share of the work
+ * whilst waiting for the workers.
+ */
+
+#define ST_THREAD_MAX			16		/**< Maximum amount of worker threads */
+#define ST_THREAD_MIN_ENTRIES	4096	/**< Smaller bins are not split */
+
+static struct st_pool {
+	semaphore_t *start;				/**< Released to wake up workers */
+	semaphore_t *done;				/**< Released by workers when done */
+	struct st_part *parts;			/**< Partitions being scanned */
+	uint nparts;					/**< Amount of partitions */
+	uint next;						/**< Next partition to scan (atomic) */
+	uint threads;					/**< Amount of worker threads */
+	bool exiting;					/**< Whether workers must exit */
+} st_pool;
+
+/**
+ * Scan partitions until there are none left.
+ */
+static void
+st_pool_run(void)
+{
+	for (;;) {
+		uint i = atomic_uint_inc(&st_pool.next);
+
+		if (i >= st_pool.nparts)
+			break;
+
+		st_scan_part(&st_pool.parts[i]);
+	}
+}
+
+/**
+ * Worker thread main loop.
+ */
+static void *
+st_pool_worker(void *unused_arg)
+{
+	(void) unused_arg;
+
+	thread_set_name("matching");
+
+	for (;;) {
+		semaphore_acquire(st_pool.start, 1, NULL);
+
+		if (atomic_bool_get(&st_pool.exiting))
+			break;
+
+		st_pool_run();
+		semaphore_release(st_pool.done, 1);
+	}
+
+	semaphore_release(st_pool.done, 1);
+	return NULL;
+}
+
+/**
+ * Make sure the amount of worker threads configured is running.
+ *
+ * @return the amount of worker threads available.
+ */
+static uint
+st_pool_workers(void)
+{
+	uint wanted = MIN(GNET_PROPERTY(search_matching_threads), ST_THREAD_MAX);
+
+	if G_LIKELY(st_pool.threads >= wanted)
+		return wanted;
+
+	if (NULL == st_pool.start) {
+		st_pool.start = semaphore_create(0);
+		st_pool.done = semaphore_create(0);
+	}
+
+	while (st_pool.threads < wanted) {
+		int r = thread_create(st_pool_worker, NULL,
+			THREAD_F_DETACH | THREAD_F_NO_CANCEL | THREAD_F_WARN,
+			THREAD_STACK_MIN);
+
+		if (-1 == r)
+			break;
+
+		st_pool.threads++;
+	}
+
+	if (GNET_PROPERTY(matching_debug)) {
+		g_debug("MATCH using %u worker thread%s for query matching",
+			st_pool.threads, plural(st_pool.threads));
+	}
+
+	return st_pool.threads;
+}
+
+/**
+ * Scan all the entries of the bin, splitting the work across worker threads
+ * for large enough bins.
+ *
+ * @param sc		the matching parameters
+ * @param result	list where matching files are prepended
+ * @param scanned	where the amount of entries matched is returned
+ *
+ * @return the amount of matching files added to the list.
+ */
+static uint
+st_scan(const struct st_scan *sc, pslist_t **result, int *scanned)
+{
+	struct st_part parts[ST_THREAD_MAX + 1];
+	uint i, n, workers = 0, nres = 0;
+
+	/*
+	 * Waiting for the workers must be done without holding any lock, and
+	 * only the main thread can drive them.
+	 */
+
+	if (
+		sc->vcnt >= ST_THREAD_MIN_ENTRIES &&
+		0 != GNET_PROPERTY(search_matching_threads) &&
+		thread_is_main() && 0 == thread_lock_count()
+	)
+		workers = st_pool_workers();
+
+	n = workers + 1;
+	ZERO(&parts);
+
+	for (i = 0; i < n; i++) {
+		struct st_part *p = &parts[i];
+
+		p->scan = sc;
+		p->start = (uint64) sc->vcnt * i / n;
+		p->end = (uint64) sc->vcnt * (i + 1) / n;
+	}
+
+	parts[0].result = *result;
+
+	if (0 == workers) {
+		st_scan_part(&parts[0]);
+	} else {
+		st_pool.parts = parts;
+		st_pool.nparts = n;
+		st_pool.next = 0;
+		atomic_mb();
+
+		semaphore_release(st_pool.start, workers);
+		st_pool_run();
+		semaphore_acquire(st_pool.done, workers, NULL);
+
+		st_pool.parts = NULL;
+		st_pool.nparts = 0;
+	}
+
+	/*
+	 * Merge the results.
+	 */
+
+	*result = parts[0].result;
+
+	for (i = 0; i < n; i++) {
+		const struct st_part *p = &parts[i];
+
+		if (i != 0 && p->result != NULL)
+			*result = pslist_concat(p->result, *result);
+
+		nres += p->nres;
+		*scanned += p->scanned;
+	}
+
+	return nres;
+}
+
+/**
+ * Stop the worker threads used for query matching.
+ */
+void
+st_close(void)
+{
+	if (0 == st_pool.threads)
+		return;
+
+	g_assert(thread_is_main());
+
+	atomic_bool_set(&st_pool.exiting, TRUE);
+	semaphore_release(st_pool.start, st_pool.threads);
+	semaphore_acquire(st_pool.done, st_pool.threads, NULL);
+
+	semaphore_destroy(&st_pool.start);
+	semaphore_destroy(&st_pool.done);
+	st_pool.threads = 0;
+}
+
 /**
  * Perform search.
  *
@@ -693,15 +1886,15 @@ st_run_search(
 	uint best_bin_size = UINT_MAX;
 	word_vec_t *wovec;
 	uint wocnt;
-	cpattern_t **pattern;
-	struct st_entry **vals;
-	uint vcnt;
+	struct st_scan sc;
+	mpattern_t *words;
 	int scanned = 0;		/* measure search mask efficiency */
-	pslist_t *local;
 	st_mask_t search_mask;
 	size_t minlen;
 	hset_t *already_matched = NULL;	/* entries that are already in the list */
 	st_filename_len_fn_t flen;
+	struct st_entry **wvals = NULL;	/* entries from the word index */
+	st_mask_t *wmasks = NULL;		/* masks of these entries */
 
 	g_assert(implies(SEARCH_ALIAS == mode, NULL == qhv));
 
@@ -804,7 +1997,16 @@ st_run_search(
 
 	g_assert(best_bin_size > 0);	/* Allocated bin, it must hold something */
 
-	WALLOC0_ARRAY(pattern, wocnt);
+	/*
+	 * Compile the automaton looking for all the query words at once.
+	 */
+
+	words = mpattern_compile(wovec, wocnt, qs_begin);
+
+	if G_UNLIKELY(NULL == words) {
+		word_vec_free(wovec, wocnt);
+		goto finish;				/* Query too long */
+	}
 
 	/*
 	 * Prepare matching optimization, an idea from Mike Green.
@@ -840,91 +2042,63 @@ st_run_search(
 		shared_file_name_canonic_len : shared_file_name_normalized_len;
 
 	/*
-	 * Search through the smallest bin
+	 * Search through the smallest bin, unless the word index gives us
+	 * fewer entries to look at.
 	 */
 
-	vcnt = best_bin->nvals;
-	vals = best_bin->vals;
-
-	nres = 0;
-	local = *result;
-	for (i = 0; i < vcnt; i++) {
-		const struct st_entry *e = vals[i];
-		const shared_file_t *sf;
-		size_t filename_len;
-
-		/*
-		 * As we only return a limited amount of results, we insert all the
-		 * matching entries in a list, which will then be randomly shuffled.
-		 * Only its leading items will be extracted.
-		 *
-		 * That strategy allows us to possibly return all the matching entries
-		 * when they repeat the search over time.
-		 */
-
-		if ((e->mask & search_mask) != search_mask)
-			continue;		/* Can't match */
-
-		sf = e->sf;
-
-		if (already_matched != NULL && hset_contains(already_matched, sf))
-			continue;
+	sc.vals = (const struct st_entry * const *) best_bin->vals;
+	sc.masks = best_bin->masks;
+	sc.vcnt = best_bin->nvals;
 
-		if (!shared_file_is_shareable(sf))
-			continue;		/* Cannot be shared */
+	if (set->words != NULL) {
+		uint *ids;
+		int n = st_word_lookup(set, wovec, wocnt, best_bin_size, &ids);
 
-		filename_len = (*flen)(sf);
-
-		if (filename_len < minlen)
-			continue;		/* Can't match */
-
-		if (!search_apply_limits(sf, sri))
-			continue;		/* Does not pass limits the queryier has set */
+		if (n >= 0) {
+			if (GNET_PROPERTY(matching_debug) > 1) {
+				g_debug("MATCH %s(): word index yields %d entr%s",
+					G_STRFUNC, n, plural_y(n));
+			}
 
-		scanned++;
+			if (n != 0) {
+				HALLOC_ARRAY(wvals, n);
+				HALLOC_ARRAY(wmasks, n);
 
-		if (entry_match(e->string, filename_len, pattern, wovec, wocnt)) {
-			if (GNET_PROPERTY(matching_debug) > 3) {
-				g_debug("MATCH \"%s\" matches %s",
-					search, shared_file_name_nfc(sf));
+				for (i = 0; i < (uint) n; i++) {
+					wvals[i] = set->all_entries.vals[ids[i]];
+					wmasks[i] = set->all_entries.masks[ids[i]];
+				}
+				HFREE_NULL(ids);
 			}
 
-			local = pslist_prepend_const(local, sf);
-			nres++;
+			sc.vals = (const struct st_entry * const *) wvals;
+			sc.masks = wmasks;
+			sc.vcnt = n;
 		}
 	}
+	sc.search = search;
+	sc.sri = sri;
+	sc.already_matched = already_matched;
+	sc.words = words;
+	sc.search_mask = search_mask;
+	sc.minlen = minlen;
+	sc.flen = flen;
 
-	*result = local;
+	nres = st_scan(&sc, result, &scanned);
 
 	if (GNET_PROPERTY(matching_debug) > 2) {
-		uint compiled = 0;
-
-		for (i = 0; i < wocnt; i++) {
-			if (NULL == pattern[i])
-				break;
-			compiled++;
-		}
-
 		g_debug("MATCH %s(): "
-			"scanned %d/%d bin entr%s, "
-			"compiled %u/%u pattern%s, got %d match%s",
-			G_STRFUNC, scanned, best_bin_size, plural_y(scanned),
-			compiled, wocnt, plural(compiled), nres, plural_es(nres));
+			"scanned %d/%u %s entr%s for %u word%s (%zu states), "
+			"got %d match%s",
+			G_STRFUNC, scanned, sc.vcnt, NULL == wvals ? "bin" : "index",
+			plural_y(scanned),
+			wocnt, plural(wocnt), mpattern_states(words),
+			nres, plural_es(nres));
 	}
 
-	/*
-	 * Matching patterns are lazily compiled by entry_match(), as they are
-	 * needed, but in order.  Therefore we can stop as soon as we hit a NULL
-	 * entry in the array.
-	 */
-
-	for (i = 0; i < wocnt; i++) {
-		if (NULL == pattern[i])
-			break;
-		pattern_free(pattern[i]);
-	}
-
-	WFREE_ARRAY(pattern, wocnt);
+	HFREE_NULL(wvals);
+	HFREE_NULL(wmasks);
+	mpattern_free_null(&words);
 	word_vec_free(wovec, wocnt);
 
 	/* FALL THROUGH */
@@ -962,6 +2136,7 @@ st_search(
 	uint i;
 	pslist_t *result = NULL;
 	char *search, *alias;
+	const struct st_cached *cached;
 
 	/*
 	 * We use a canonic search string, which simplifies matching.
@@ -985,6 +2160,29 @@ st_search(
 	}
 
 
+	/*
+	 * If the same query was recently run with the same limits, reuse
+	 * its results.  We still need to compute the query hash vector, which
+	 * is otherwise a side effect of matching.
+	 */
+
+	cached = st_cache_lookup(table, search, sri);
+
+	if (cached != NULL) {
+		pslist_t *sl;
+
+		PSLIST_FOREACH(cached->result, sl) {
+			const shared_file_t *sf = sl->data;
+
+			if (shared_file_is_shareable(sf))
+				result = pslist_prepend_const(result, sf);
+		}
+
+		nres = cached->nres;
+		st_fill_qhv(search, qhv);
+		goto pick;
+	}
+
 	/*
 	 * Run the original query, unmangled.
 	 */
@@ -1015,6 +2213,9 @@ st_search(
 			gnet_stats_count_general(GNR_LOCAL_ALIASED_HITS, ares);
 	}
 
+	st_cache_store(table, search, sri, result, nres);
+
+pick:
 	/*
 	 * Randomly shuffle the results and pick the first max_res items.
 	 */
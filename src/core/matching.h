@@ -83,6 +83,11 @@ int st_count(const search_table_t *st, enum match_set which);
 bool st_insert_item(search_table_t *, enum match_set which, const char *key,
 	const struct shared_file *sf);
 
+bool st_store(const search_table_t *table, const char *dir, const char *name,
+	const struct shared_file * const *files, size_t count);
+search_table_t *st_retrieve(const char *dir, const char *name,
+	const struct shared_file * const *files, size_t count);
+
 /**
  * Callback for st_search().
  *
@@ -106,6 +111,7 @@ int st_search(
 	struct query_hashvec *qhv);
 
 void st_fill_qhv(const char *search_term, struct query_hashvec *qhv);
+void st_close(void);
 
 #endif	/* _core_matching_h_ */
 
@@ -30,6 +30,10 @@
  * As of 2013-11-10, this background task runs in a dedicated thread since
  * it is purely I/O driven.
  *
+ * Several moving threads are now created, each running its own daemon, so
+ * that a large move does not delay the others: new work is dispatched to
+ * the least loaded thread.
+ *
  * @author Raphael Manfredi
  * @date 2002-2003, 2013
  */
@@ -64,10 +68,20 @@
 
 #define COPY_BLOCK_FRAGMENT	4096		/**< Power of two of copy unit credit */
 #define COPY_BUF_SIZE		65536		/**< Size of the reading buffer */
+#define MOVE_WORKERS		2			/**< Amount of moving threads */
+
+/**
+ * A moving thread, with its own background scheduler and daemon.
+ */
+struct move_worker {
+	struct bgtask *daemon;	/**< The moving daemon */
+	uint thread_id;			/**< Thread running the daemon */
+	uint pending;			/**< Amount of queued or ongoing moves */
+	bool work_available;	/**< Whether daemon has work to do */
+};
 
-static struct bgtask *move_daemon;
-static uint move_thread_id = THREAD_INVALID_ID;
-static bool move_work_available;
+static struct move_worker move_worker[MOVE_WORKERS];
+static int move_active;		/**< Amount of daemons at work (main thread) */
 
 enum moved_magic_t { MOVED_MAGIC = 0x0ac0b103 };
 
@@ -76,6 +90,7 @@ enum moved_magic_t { MOVED_MAGIC = 0x0ac0b103 };
  */
 struct moved {
 	enum moved_magic_t magic;	/**< Magic number */
+	struct move_worker *mw;	/**< Worker running this daemon */
 	download_t *d;			/**< Download for which we're moving file */
 	char *buffer;			/**< Large buffer, where data is read */
 	char *target;			/**< Target file name, in case an error occurs */
@@ -93,6 +108,7 @@ struct moved {
  * Work queue entry.
  */
 struct work {
+	struct move_worker *mw;	/**< Worker to which the move was dispatched */
 	download_t *d;			/**< Download to move */
 	const char *dest;		/**< Target directory (atom) */
 	const char *ext;		/**< Trailing extension (atom) */
@@ -102,11 +118,13 @@ struct work {
  * Allocate work queue entry.
  */
 static struct work *
-move_we_alloc(download_t *d, const char *dest, const char *ext)
+move_we_alloc(struct move_worker *mw,
+	download_t *d, const char *dest, const char *ext)
 {
 	struct work *we;
 
 	WALLOC(we);
+	we->mw = mw;
 	we->d = d;
 	we->dest = atom_str_get(dest);
 	we->ext = atom_str_get(ext);
@@ -122,6 +140,7 @@ move_we_free(void *data)
 {
 	struct work *we = data;
 
+	atomic_uint_dec(&we->mw->pending);
 	atom_str_free_null(&we->dest);
 	atom_str_free_null(&we->ext);
 	WFREE(we);
@@ -177,10 +196,34 @@ move_notify(void *v)
 
 	g_assert(thread_is_main());
 
-	gnet_prop_set_boolean_val(PROP_FILE_MOVING, on);
+	/*
+	 * The property reflects whether any of the daemons is at work.
+	 */
+
+	move_active += on ? +1 : -1;
+	g_assert(move_active >= 0);
+
+	gnet_prop_set_boolean_val(PROP_FILE_MOVING, 0 != move_active);
 	return NULL;
 }
 
+/**
+ * @return the worker whose moving thread we're running in.
+ */
+static struct move_worker *
+move_worker_self(void)
+{
+	uint id = thread_small_id();
+	uint i;
+
+	for (i = 0; i < N_ITEMS(move_worker); i++) {
+		if (id == move_worker[i].thread_id)
+			return &move_worker[i];
+	}
+
+	g_assert_not_reached();
+}
+
 /**
  * Called in the context of the moving thread when the daemon task status
  * changes.
@@ -188,19 +231,23 @@ move_notify(void *v)
 static void
 move_notification_change(void *v)
 {
-	atomic_bool_set(&move_work_available, pointer_to_bool(v));
+	struct move_worker *mw = move_worker_self();
+
+	atomic_bool_set(&mw->work_available, pointer_to_bool(v));
 }
 
 /**
  * Daemon's notification of start/stop.
  */
 static void
-move_d_notify(struct bgtask *unused_h, bool on)
+move_d_notify(struct bgtask *h, bool on)
 {
-	(void) unused_h;
+	struct moved *md = bg_task_context(h);
+
+	g_assert(md->magic == MOVED_MAGIC);
 
 	teq_safe_rpc(THREAD_MAIN_ID, move_notify, bool_to_pointer(on));
-	teq_post(move_thread_id, move_notification_change, bool_to_pointer(on));
+	teq_post(md->mw->thread_id, move_notification_change, bool_to_pointer(on));
 }
 
 /**
@@ -575,10 +622,24 @@ again:		/* Avoids indenting all this code */
 void
 move_queue(download_t *d, const char *dest, const char *ext)
 {
+	struct move_worker *mw = &move_worker[0];
 	struct work *we;
+	uint i;
 
-	we = move_we_alloc(d, dest, ext);
-	bg_daemon_enqueue(move_daemon, we);
+	/*
+	 * Dispatch to the worker with the least amount of pending moves.
+	 */
+
+	for (i = 1; i < N_ITEMS(move_worker); i++) {
+		struct move_worker *w = &move_worker[i];
+
+		if (atomic_uint_get(&w->pending) < atomic_uint_get(&mw->pending))
+			mw = w;
+	}
+
+	atomic_uint_inc(&mw->pending);
+	we = move_we_alloc(mw, d, dest, ext);
+	bg_daemon_enqueue(mw->daemon, we);
 }
 
 /**
@@ -587,29 +648,32 @@ move_queue(download_t *d, const char *dest, const char *ext)
 static void
 move_thread_terminate(int sig)
 {
+	struct move_worker *mw = move_worker_self();
+
 	g_assert(TSIG_TERM == sig);
 
 	if (GNET_PROPERTY(move_debug))
 		g_debug("terminating moving thread");
 
-	move_thread_id = THREAD_INVALID_ID;
+	mw->thread_id = THREAD_INVALID_ID;
 }
 
 /**
  * Is there pending work for the library thread, or is thread terminated?
  */
 static bool
-move_thread_has_work(void *unused_arg)
+move_thread_has_work(void *arg)
 {
-	(void) unused_arg;
+	struct move_worker *mw = arg;
 
-	return atomic_bool_get(&move_work_available) ||
-		THREAD_INVALID_ID == move_thread_id;
+	return atomic_bool_get(&mw->work_available) ||
+		THREAD_INVALID_ID == mw->thread_id;
 }
 
 struct move_thread_args {
 	barrier_t *b;
 	bgsched_t *bs;
+	struct move_worker *mw;
 };
 
 /**
@@ -619,14 +683,16 @@ static void *
 move_thread_main(void *arg)
 {
 	struct move_thread_args *v = arg;
+	struct move_worker *mw;
 	bgsched_t *bs;
 	barrier_t *b;
 
 	thread_set_name("moving");
 	teq_create();				/* Queue to receive TEQ events */
-	thread_signal(TSIG_TERM, move_thread_terminate);
 	bs = v->bs;					/* Copy since ``arg'' is on creator's stack */
 	b = v->b;
+	mw = v->mw;
+	thread_signal(TSIG_TERM, move_thread_terminate);
 
 	barrier_wait(b);			/* Thread has initialized */
 	barrier_free_null(&b);
@@ -638,13 +704,13 @@ move_thread_main(void *arg)
 	 * Process work until we're told to exit.
 	 */
 
-	while (move_thread_id != THREAD_INVALID_ID) {
+	while (mw->thread_id != THREAD_INVALID_ID) {
 		if (GNET_PROPERTY(move_debug))
 			g_debug("moving thread sleeping");
 
-		teq_wait(move_thread_has_work, NULL);
+		teq_wait(move_thread_has_work, mw);
 
-		if (THREAD_INVALID_ID == move_thread_id)
+		if (THREAD_INVALID_ID == mw->thread_id)
 			break;			/* Terminated by signal */
 
 		if (GNET_PROPERTY(move_debug))
@@ -661,10 +727,10 @@ move_thread_main(void *arg)
 }
 
 /**
- * Initializes the background moving/copying task.
+ * Initializes a background moving/copying worker.
  */
-void G_COLD
-move_init(void)
+static void G_COLD
+move_worker_init(struct move_worker *mw)
 {
 	struct moved *md;
 	bgstep_cb_t step = move_d_step_copy;
@@ -674,6 +740,7 @@ move_init(void)
 
 	WALLOC0(md);
 	md->magic = MOVED_MAGIC;
+	md->mw = mw;
 	md->rd = NULL;
 	md->wd = -1;
 	md->target = NULL;
@@ -695,15 +762,16 @@ move_init(void)
 	b = barrier_new(2);
 	args.b = barrier_refcnt_inc(b);
 	args.bs = bg_sched_create("moving", 1000000 /* 1 s */);
+	args.mw = mw;
 
 	r = thread_create(move_thread_main, &args,
 			THREAD_F_DETACH | THREAD_F_NO_CANCEL |
 				THREAD_F_NO_POOL | THREAD_F_PANIC,
 			THREAD_STACK_MIN);
 
-	move_thread_id = r;
+	mw->thread_id = r;
 
-	move_daemon = bg_daemon_create(args.bs, "file moving",
+	mw->daemon = bg_daemon_create(args.bs, "file moving",
 		&step, 1,
 		md, move_d_free,
 		move_d_start, move_d_end, move_we_free,
@@ -713,14 +781,32 @@ move_init(void)
 	barrier_free_null(&b);
 }
 
+/**
+ * Initializes the background moving/copying tasks.
+ */
+void G_COLD
+move_init(void)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(move_worker); i++)
+		move_worker_init(&move_worker[i]);
+}
+
 /**
  * Called at shutdown time.
  */
 void
 move_close(void)
 {
-	bg_task_cancel(move_daemon);
-	thread_kill(move_thread_id, TSIG_TERM);
+	uint i;
+
+	for (i = 0; i < N_ITEMS(move_worker); i++) {
+		struct move_worker *mw = &move_worker[i];
+
+		bg_task_cancel(mw->daemon);
+		thread_kill(mw->thread_id, TSIG_TERM);
+	}
 }
 
 /* vi: set ts=4 sw=4 cindent: */
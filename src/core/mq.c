@@ -33,6 +33,8 @@
 
 #include "common.h"
 
+#include <math.h>
+
 #define MQ_INTERNAL
 #include "mq.h"
 
@@ -46,8 +48,10 @@
 #include "lib/htable.h"
 #include "lib/plist.h"
 #include "lib/pmsg.h"
+#include "lib/pow2.h"
 #include "lib/str.h"
 #include "lib/stringify.h"		/* For plural() */
+#include "lib/tm.h"
 #include "lib/unsigned.h"		/* For size_saturate_add() */
 #include "lib/walloc.h"
 #include "lib/xsort_data.h"
@@ -201,7 +205,7 @@ mq_info(const mqueue_t *q)
 		bool udp = NODE_USES_UDP(q->node);
 
 		str_bprintf(ARYLEN(buf),
-			"queue %p [%s %s node %s%s%s%s%s] (%d item%s, %d byte%s)",
+			"queue %p [%s %s node %s%s%s%s%s%s] (%d item%s, %d byte%s)",
 			(void *) q, udp ? "UDP" : "TCP",
 			NODE_IS_ULTRA(q->node) ? "ultra" :
 			udp ? "remote" : "leaf", node_addr(q->node),
@@ -209,6 +213,7 @@ mq_info(const mqueue_t *q)
 			(q->flags & MQ_DISCARD) ? " DISCARD" : "",
 			(q->flags & MQ_SWIFT) ? " SWIFT" : "",
 			(q->flags & MQ_WARNZONE) ? " WARNZONE" : "",
+			(q->flags & MQ_CODEL) ? " CODEL" : "",
 			q->count, plural(q->count),
 			q->size, plural(q->size)
 		);
@@ -375,6 +380,7 @@ mq_free(mqueue_t *q)
 		qlink_free(q);
 
 	cq_cancel(&q->swift_ev);
+	cq_cancel(&q->coalesce_ev);
 	plist_free_null(&q->qhead);
 	pmsg_slist_free(&q->qwait);
 
@@ -647,6 +653,208 @@ mq_update_flowc(mqueue_t *q)
 	}
 }
 
+/*
+ * Queueing delay management.
+ *
+ * This follows the CoDel algorithm from Nichols and Jacobson: when the time
+ * spent in the queue by the messages we send stays above the target delay
+ * for a whole interval, we enter the dropping state.  We then drop droppable
+ * messages about to be sent, at a rate increasing with the square root of
+ * the amount of messages dropped, until the delay falls below the target.
+ *
+ * Contrary to the watermarks, which only look at the amount of bytes held,
+ * this reacts to how long messages have waited: a query that sat several
+ * seconds in the queue is no longer worth sending, whereas the messages we
+ * cannot drop are sent regardless of their delay.
+ */
+
+#define MQ_CODEL_MINBYTES	1500	/**< No drops if less than that queued */
+
+#define MQ_DELAY_BUCKETS	18		/**< Power-of-2 buckets of delays in ms */
+#define MQ_DELAY_PERIOD		1024	/**< Samples between stats updates */
+
+static uint32 mq_delay_hist[MQ_DELAY_BUCKETS];
+static uint mq_delay_samples;
+
+/**
+ * @return current time in milliseconds, wrapping around.
+ */
+static inline uint32
+mq_now_ms(void)
+{
+	tm_t now;
+
+	tm_now(&now);
+	return (uint32) tm2ms(&now);
+}
+
+/**
+ * @return time elapsed in ms since the message was enqueued.
+ */
+static inline uint32
+mq_delay(const pmsg_t *mb, uint32 now)
+{
+	int32 delay = now - pmsg_stamp(mb);
+
+	return delay < 0 ? 0 : delay;	/* Clock could have been adjusted */
+}
+
+/**
+ * @return the largest delay accounted for in the histogram bucket.
+ */
+static inline uint32
+mq_delay_bucket_max(uint i)
+{
+	return 0 == i ? 0 : (1U << i) - 1;
+}
+
+/**
+ * Update the delay percentiles from the histogram, then age it so that
+ * the percentiles reflect recent traffic.
+ */
+static void
+mq_delay_percentiles(void)
+{
+	static const struct {
+		gnr_stats_t stat;
+		uint permille;
+	} pct[] = {
+		{ GNR_MQ_SOJOURN_MEDIAN,	500 },
+		{ GNR_MQ_SOJOURN_P90,		900 },
+		{ GNR_MQ_SOJOURN_P99,		990 },
+	};
+	uint64 total = 0, sum = 0;
+	uint i, j;
+
+	for (i = 0; i < N_ITEMS(mq_delay_hist); i++)
+		total += mq_delay_hist[i];
+
+	for (i = 0, j = 0; i < N_ITEMS(mq_delay_hist); i++) {
+		sum += mq_delay_hist[i];
+		while (j < N_ITEMS(pct) && sum * 1000 >= total * pct[j].permille) {
+			gnet_stats_set_general(pct[j].stat, mq_delay_bucket_max(i));
+			j++;
+		}
+		mq_delay_hist[i] /= 2;
+	}
+}
+
+/**
+ * Record that message is about to leave the queue, having been sent.
+ */
+static void
+mq_dequeued(mqueue_t *q, const pmsg_t *mb)
+{
+	uint32 delay = mq_delay(mb, mq_now_ms());
+	uint i;
+
+	mq_check_consistency(q);
+
+	i = 0 == delay ? 0 : 1 + highest_bit_set(delay);
+	mq_delay_hist[MIN(i, N_ITEMS(mq_delay_hist) - 1)]++;
+	gnet_stats_max_general(GNR_MQ_SOJOURN_MAX, delay);
+
+	if G_UNLIKELY(++mq_delay_samples >= MQ_DELAY_PERIOD) {
+		mq_delay_samples = 0;
+		mq_delay_percentiles();
+	}
+}
+
+/**
+ * @return time of the CoDel drop following the one made at time `t'.
+ */
+static inline uint32
+mq_codel_next(const mqueue_t *q, uint32 t)
+{
+	return t + (uint32) (GNET_PROPERTY(mq_codel_interval) /
+		sqrt(MAX(q->codel_count, 1)));
+}
+
+/**
+ * Called for each message about to be sent, to determine whether it waited
+ * for too long in the queue and must be dropped instead.
+ *
+ * @return TRUE if message must be dropped.
+ */
+static bool
+mq_codel_drop(mqueue_t *q, const pmsg_t *mb)
+{
+	uint32 now, interval;
+	bool ok_to_drop, droppable;
+
+	mq_check_consistency(q);
+
+	if (!GNET_PROPERTY(mq_codel)) {
+		q->flags &= ~MQ_CODEL;
+		return FALSE;
+	}
+
+	now = mq_now_ms();
+	interval = GNET_PROPERTY(mq_codel_interval);
+
+	if (
+		mq_delay(mb, now) < GNET_PROPERTY(mq_codel_target) ||
+		q->size <= MQ_CODEL_MINBYTES
+	) {
+		q->codel_first_above = 0;
+		ok_to_drop = FALSE;
+	} else if (0 == q->codel_first_above) {
+		q->codel_first_above = now + interval;
+		ok_to_drop = FALSE;
+	} else {
+		ok_to_drop = (int32) (now - q->codel_first_above) >= 0;
+	}
+
+	/*
+	 * A partially written message, or one we may not drop, is sent whatever
+	 * its delay: it does not consume the scheduled drop, which will apply
+	 * to the next droppable message.
+	 */
+
+	droppable = pmsg_is_unread(mb) && PMSG_P_DATA == pmsg_prio(mb) &&
+		gmsg_can_drop(pmsg_phys_base(mb), pmsg_size(mb));
+
+	if (q->flags & MQ_CODEL) {
+		if (!ok_to_drop) {
+			q->flags &= ~MQ_CODEL;		/* Delay back under the target */
+			return FALSE;
+		}
+		if (!droppable || (int32) (now - q->codel_drop_next) < 0)
+			return FALSE;
+		q->codel_count++;
+		q->codel_drop_next = mq_codel_next(q, q->codel_drop_next);
+	} else {
+		uint delta;
+
+		if (!ok_to_drop || !droppable)
+			return FALSE;
+
+		/*
+		 * If we were dropping not long ago, resume at about the same drop
+		 * rate since the queue was not controlled for long enough.
+		 */
+
+		delta = q->codel_count - q->codel_lastcount;
+		if (delta > 1 && now - q->codel_drop_next < 16 * interval)
+			q->codel_count = delta;
+		else
+			q->codel_count = 1;
+
+		q->flags |= MQ_CODEL;
+		q->codel_lastcount = q->codel_count;
+		q->codel_drop_next = mq_codel_next(q, now);
+	}
+
+	if (MQ_DEBUG_LVL(q) > 4 && q->uops->msg_log != NULL) {
+		q->uops->msg_log(mb, "to %s node %s, CODEL after %u ms (drop #%u)",
+			NODE_USES_UDP(q->node) ? "UDP" : "TCP", node_addr(q->node),
+			mq_delay(mb, now), q->codel_count);
+	}
+
+	gnet_stats_inc_general(GNR_MQ_CODEL_DROPS);
+	return TRUE;
+}
+
 /**
  * Remove all unsent messages from the queue.
  */
@@ -1447,6 +1655,7 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 	}
 
 	mq_add_linkable(q, new);
+	pmsg_set_stamp(mb, mq_now_ms());
 
 	q->size += msize;
 	q->count++;
@@ -1497,6 +1706,8 @@ static const struct mq_cops mq_cops = {
 	qlink_remove,			/**< qlink_remove */
 	mq_rmlink_prev,			/**< rmlink_prev */
 	mq_update_flowc,		/**< update_flowc */
+	mq_codel_drop,			/**< codel_drop */
+	mq_dequeued,			/**< dequeued */
 };
 
 /**
@@ -122,6 +122,8 @@ struct mq_cops {
 	void (*qlink_remove)(mqueue_t *q, plist_t *l);
 	plist_t *(*rmlink_prev)(mqueue_t *q, plist_t *l, int size);
 	void (*update_flowc)(mqueue_t *q);
+	bool (*codel_drop)(mqueue_t *q, const pmsg_t *mb);
+	void (*dequeued)(mqueue_t *q, const pmsg_t *mb);
 };
 
 enum mq_magic {
@@ -145,6 +147,10 @@ enum mq_magic {
  *
  * The `header' is used to hold the function/hops/TTL of a reference message
  * to be used as a comparison point when speeding up dropping in flow-control.
+ *
+ * The `codel_xxx' fields hold the state of the CoDel algorithm, which drops
+ * droppable messages based on the time they spent in the queue: times are
+ * expressed in milliseconds and wrap around.
  */
 struct mqueue {
 	enum mq_magic magic;	/**< Magic number */
@@ -156,6 +162,7 @@ struct mqueue {
 	plist_t *qhead, *qtail, **qlink;
 	slist_t *qwait;			/**< Waiting queue during putq recursions */
 	cevent_t *swift_ev;		/**< Callout queue event in "swift" mode */
+	cevent_t *coalesce_ev;	/**< Deferred flush of coalesced UDP messages */
 	const uint32 *debug;	/**< Debug config variable for this queue */
 	int swift_elapsed;		/**< Scheduled elapsed time, in ms */
 	int qlink_count;		/**< Amount of entries in `qlink' */
@@ -169,6 +176,10 @@ struct mqueue {
 	int flowc_written;		/**< Amount written during flow control */
 	int last_size;			/**< Queue size at last "swift" event callback */
     int putq_entered;		/**< For recursion checks in mq_putq() */
+	uint32 codel_first_above;	/**< When delay will have been too long */
+	uint32 codel_drop_next;		/**< Time of next CoDel drop */
+	uint codel_count;			/**< Drops since entering CoDel state */
+	uint codel_lastcount;		/**< Drop count when leaving CoDel state */
 };
 
 static inline void
@@ -183,6 +194,7 @@ mq_check_consistency(const struct mqueue * const q)
  */
 
 enum {
+	MQ_CODEL	= (1 << 5),	/**< CoDel dropping state, delay too long */
 	MQ_CLEAR	= (1 << 4),	/**< Running mq_clear() */
 	MQ_WARNZONE	= (1 << 3),	/**< Between hiwat and lowat */
 	MQ_SWIFT	= (1 << 2),	/**< Swift mode, dropping more traffic */
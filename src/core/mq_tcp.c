@@ -54,6 +54,7 @@
 
 #define MQ_MAXIOV		256		/**< Our limit on the I/O vectors we build */
 #define MQ_MINIOV		2		/**< Minimum amount of I/O vectors in service */
+#define MQ_CHAINIOV		8		/**< I/O vectors for direct chain writes */
 #define MQ_MINSEND		256		/**< Minimum size we try to send */
 
 static void mq_tcp_service(void *data);
@@ -107,6 +108,7 @@ mq_tcp_service(void *data)
 	static iovec_t iov[MQ_MAXIOV];
 	int iovsize;
 	int iovcnt;
+	int msgcnt;
 	int sent;
 	ssize_t r;
 	plist_t *l;
@@ -120,6 +122,7 @@ again:
 	g_assert(q->count);		/* Queue is serviced, we must have something */
 
 	iovcnt = 0;
+	msgcnt = 0;
 	sent = 0;
 	dropped = 0;
 
@@ -129,34 +132,49 @@ again:
 	 * Optimize our time: don't spend time building too much if we're
 	 * not likely to send anything.  We limit to 1.5 times the amount we
 	 * last wrote last time we were called, with a minimum of 2 entries.
+	 *
+	 * Chained messages use one I/O vector entry per message block, so that
+	 * their data can be submitted without being copied.
 	 */
 
-	iovsize = MIN(MQ_MAXIOV, q->count);
+	iovsize = MQ_MAXIOV;
 	maxsize = q->last_written + (q->last_written >> 1);		/* 1.5 times */
 	maxsize = MAX(MQ_MINSEND, maxsize);
 
 	for (l = q->qtail; l && iovsize > 0; /* empty */) {
-		iovec_t *ie;
 		pmsg_t *mb = (pmsg_t *) l->data;
 
 		/*
 		 * Don't build too much.
 		 */
 
-		if (iovcnt > MQ_MINIOV && maxsize < 0)
+		if (msgcnt > MQ_MINIOV && maxsize < 0)
 			break;
 
 		/*
 		 * Honour hops-flow, and ensure there is a route for possible replies.
+		 * Messages that waited for too long in the queue are dropped.
 		 */
 
-		if (pmsg_can_send(mb, q)) {
+		if (pmsg_can_send(mb, q) && !q->cops->codel_drop(q, mb)) {
+			int n;
+
+			if G_UNLIKELY(pmsg_is_chained(mb)) {
+				if (pmsg_chain_blocks(mb) > iovsize && msgcnt != 0)
+					break;		/* Will send it next time */
+				n = pmsg_chain_to_iovec(mb, &iov[iovcnt], iovsize);
+			} else {
+				iovec_set(&iov[iovcnt], deconstify_pointer(mb->m_rptr),
+					pmsg_size(mb));
+				n = 1;
+			}
+
 			/* send the message */
 			l = plist_prev(l);
-			iovsize--;
-			ie = &iov[iovcnt++];
-			iovec_set(ie, deconstify_pointer(mb->m_rptr), pmsg_size(mb));
-			maxsize -= iovec_len(ie);
+			iovsize -= n;
+			iovcnt += n;
+			msgcnt++;
+			maxsize -= pmsg_size(mb);
 			if (pmsg_prio(mb))
 				has_prioritary = TRUE;
 		} else {
@@ -218,27 +236,26 @@ again:
 	 * lower layer.
 	 */
 
-	iovsize = iovcnt;
-	iovcnt = 0;
 	saturated = FALSE;
 
-	for (l = q->qtail; l && r > 0 && iovsize > 0; iovsize--) {
-		iovec_t *ie = &iov[iovcnt++];
+	for (l = q->qtail; l && r > 0 && msgcnt > 0; msgcnt--) {
 		pmsg_t *mb = (pmsg_t *) l->data;
+		int size = pmsg_size(mb);
 
-		if ((uint) r >= iovec_len(ie)) {		/* Completely written */
+		if (r >= size) {						/* Completely written */
 			sent++;
 			pmsg_mark_sent(mb);
 			if (q->uops->msg_sent != NULL)
 				q->uops->msg_sent(q->node, mb);
-			r -= iovec_len(ie);
+			q->cops->dequeued(q, mb);
+			r -= size;
 			if (q->qlink)
 				q->cops->qlink_remove(q, l);
-			l = q->cops->rmlink_prev(q, l, iovec_len(ie));
+			l = q->cops->rmlink_prev(q, l, size);
 		} else {
-			g_assert(r > 0 && r < pmsg_size(mb));
+			g_assert(r > 0 && r < size);
 			g_assert(r < q->size);
-			mb->m_rptr += r;
+			pmsg_discard(mb, r);
 			q->size -= r;
 			g_assert(l == q->qtail);	/* Partially written, is at tail */
 			saturated = TRUE;
@@ -247,7 +264,7 @@ again:
 	}
 
 	mq_check(q, 0);
-	g_assert(r == 0 || iovsize > 0);
+	g_assert(r == 0 || msgcnt > 0);
 	g_assert(q->size >= 0 && q->count >= 0);
 
 	if (sent)
@@ -372,7 +389,14 @@ again:
 			if (prioritary)
 				node_flushq(q->node);
 
-			written = tx_write(q->tx_drv, mbs, size);
+			if G_UNLIKELY(pmsg_is_chained(mb)) {
+				iovec_t iov[MQ_CHAINIOV];
+				int n = pmsg_chain_to_iovec(mb, iov, N_ITEMS(iov));
+
+				written = tx_writev(q->tx_drv, iov, n);
+			} else {
+				written = tx_write(q->tx_drv, mbs, size);
+			}
 
 			/*
 			 * If that assertion fails, then it means there is an error
@@ -415,7 +439,7 @@ again:
 			goto cleanup;
 		}
 
-		mb->m_rptr += written;		/* Partially written */
+		pmsg_discard(mb, written);	/* Partially written */
 		size -= written;
 
 		/* FALL THROUGH */
@@ -45,6 +45,8 @@
 #include "mq_udp.h"
 #include "dump.h"
 
+#include "lib/aging.h"
+#include "lib/cq.h"
 #include "lib/pmsg.h"
 #include "lib/walloc.h"
 
@@ -53,9 +55,21 @@
 
 #include "lib/override.h"		/* Must be the last header included */
 
+#define MQ_UDP_COALESCE_SIZE	476		/**< One semi-reliable UDP fragment */
+#define MQ_UDP_COALESCE_MAX		16		/**< Max messages coalesced together */
+#define MQ_UDP_COALESCE_SCAN	64		/**< Max queued messages to inspect */
+#define MQ_UDP_COALESCE_DELAY	1		/**< ms, wait for more messages */
+#define MQ_UDP_COALESCE_LINGER	3600	/**< 1 hour, coalescing support */
+
 static void mq_udp_service(void *data);
 static const struct mq_ops mq_udp_ops;
 
+/**
+ * Addresses of hosts known to accept several Gnutella messages coalesced
+ * into one semi-reliable UDP message.
+ */
+static aging_table_t *mq_udp_coalesce_hosts;
+
 /**
  * The "meta data" attached to each message block enqueued yields routing
  * information, perused by the queue to route messages.
@@ -144,6 +158,223 @@ mq_udp_attach_metadata(pmsg_t *mb, const gnet_host_t *to)
 	return result;
 }
 
+/**
+ * Record that host can split semi-reliable UDP messages made of several
+ * Gnutella messages.
+ */
+void
+mq_udp_coalesce_learn(host_addr_t addr)
+{
+	if (NULL == mq_udp_coalesce_hosts)
+		return;		/* Shutting down */
+
+	if (!aging_lookup_revitalise(mq_udp_coalesce_hosts, &addr))
+		aging_record(mq_udp_coalesce_hosts, WCOPY(&addr));
+}
+
+/**
+ * Can messages sent through the queue to the given destination be coalesced?
+ *
+ * Only the Gnutella semi-reliable UDP layer is used for coalescing: plain
+ * UDP receivers expect exactly one message per datagram and could not tell
+ * a coalesced datagram from semi-reliable UDP traffic anyway.
+ */
+static bool
+mq_udp_coalescing(const mqueue_t *q, const gnet_host_t *to)
+{
+	host_addr_t addr;
+
+	if (!NODE_CAN_SR_UDP(q->node) || NODE_TALKS_G2(q->node))
+		return FALSE;
+
+	if (NULL == mq_udp_coalesce_hosts)
+		return FALSE;	/* Shutting down */
+
+	addr = gnet_host_get_addr(to);
+	return NULL != aging_lookup(mq_udp_coalesce_hosts, &addr);
+}
+
+/**
+ * Can message be coalesced with others?
+ */
+static bool
+mq_udp_coalescable(const pmsg_t *mb)
+{
+	/*
+	 * Messages with a transmit hook need to be seen as such by the lower
+	 * layers, so they are sent on their own.
+	 */
+
+	return pmsg_size(mb) < MQ_UDP_COALESCE_SIZE &&
+		!pmsg_is_chained(mb) && !(mb->m_flags & PMSG_PF_HOOK);
+}
+
+/**
+ * Original messages coalesced into a single message.
+ */
+struct mq_udp_batch {
+	pmsg_t *mb[MQ_UDP_COALESCE_MAX];	/**< Referenced original messages */
+	uint count;							/**< Amount of messages */
+};
+
+/**
+ * Free routine for coalesced messages, propagating the transmission status
+ * to the original messages.
+ */
+static void
+mq_udp_batch_free(pmsg_t *mb, void *arg)
+{
+	struct mq_udp_batch *mub = arg;
+	uint i;
+
+	for (i = 0; i < mub->count; i++) {
+		if (pmsg_was_sent(mb))
+			pmsg_mark_sent(mub->mb[i]);
+		pmsg_free(mub->mb[i]);
+	}
+
+	WFREE(mub);
+}
+
+/**
+ * Coalesce the message held at `l' with the messages queued behind it that
+ * go to the same destination, as long as they fit in one fragment of the
+ * semi-reliable UDP layer.
+ *
+ * The original messages are left in the queue, and referenced by the new
+ * message: they are removed by mq_udp_coalesced() once the new message
+ * was accepted by the TX layer.
+ *
+ * @param q			the message queue
+ * @param l			the queue link of the leading message
+ * @param links		where queue links of coalesced messages are returned
+ * @param count		where the amount of coalesced messages is returned
+ *
+ * @return the coalesced message, NULL if there is nothing to coalesce.
+ */
+static pmsg_t *
+mq_udp_coalesce(mqueue_t *q, plist_t *l, plist_t **links, uint *count)
+{
+	pmsg_t *mb = l->data, *cmb;
+	struct mq_udp_info *mi = pmsg_get_metadata(mb);
+	struct mq_udp_batch *mub;
+	size_t total;
+	plist_t *p;
+	uint i, n = 0, scanned = 0;
+
+	if (!mq_udp_coalescable(mb) || !mq_udp_coalescing(q, &mi->to))
+		return NULL;
+
+	total = pmsg_size(mb);
+	links[n++] = l;
+
+	for (
+		p = plist_prev(l);
+		p != NULL && n < MQ_UDP_COALESCE_MAX && scanned < MQ_UDP_COALESCE_SCAN;
+		p = plist_prev(p), scanned++
+	) {
+		pmsg_t *m = p->data;
+		struct mq_udp_info *pi = pmsg_get_metadata(m);
+		size_t size = pmsg_size(m);
+
+		if (total + size > MQ_UDP_COALESCE_SIZE)
+			continue;
+
+		if (!gnet_host_equal(&pi->to, &mi->to) || !mq_udp_coalescable(m))
+			continue;
+
+		/* Will be dropped when its turn comes */
+		if (!pmsg_can_send(m, q))
+			continue;
+
+		links[n++] = p;
+		total += size;
+	}
+
+	if (n < 2)
+		return NULL;
+
+	WALLOC(mub);
+	mub->count = n;
+	cmb = pmsg_new_extend(pmsg_prio(mb), NULL, total, mq_udp_batch_free, mub);
+
+	for (i = 0; i < n; i++) {
+		pmsg_t *m = links[i]->data;
+
+		mub->mb[i] = pmsg_ref(m);
+		pmsg_write(cmb, pmsg_start(m), pmsg_size(m));
+
+		if (pmsg_is_reliable(m))
+			pmsg_mark_reliable(cmb);
+	}
+
+	g_assert((size_t) pmsg_size(cmb) == total);
+
+	*count = n;
+	return cmb;
+}
+
+/**
+ * Remove the messages coalesced behind the leading one from the queue, once
+ * the coalesced message has been accepted by the TX layer.
+ */
+static void
+mq_udp_coalesced(mqueue_t *q, plist_t **links, uint count)
+{
+	uint i;
+
+	for (i = 1; i < count; i++) {
+		plist_t *l = links[i];
+		pmsg_t *mb = l->data;
+
+		q->cops->dequeued(q, mb);
+
+		if (q->qlink)
+			q->cops->qlink_remove(q, l);
+
+		(void) q->cops->rmlink_prev(q, l, pmsg_size(mb));
+	}
+
+	gnet_stats_count_general(GNR_UDP_SR_TX_COALESCED, count);
+}
+
+/**
+ * Callout queue callback to flush messages held for coalescing.
+ */
+static void
+mq_udp_coalesce_flush(cqueue_t *cq, void *data)
+{
+	mqueue_t *q = data;
+
+	mq_check(q, 0);
+
+	cq_zero(cq, &q->coalesce_ev);
+
+	if (q->count != 0)
+		mq_udp_service(q);
+}
+
+/**
+ * Should message be queued instead of being sent immediately, to give it
+ * a chance to be coalesced with the next messages sent to the same host?
+ *
+ * When the message is held, a flush is scheduled shortly, after the
+ * current burst of messages has been generated.
+ */
+static bool
+mq_udp_coalesce_hold(mqueue_t *q, const pmsg_t *mb, const gnet_host_t *to)
+{
+	if (!mq_udp_coalescable(mb) || !mq_udp_coalescing(q, to))
+		return FALSE;
+
+	if (NULL == q->coalesce_ev) {
+		q->coalesce_ev = cq_main_insert(MQ_UDP_COALESCE_DELAY,
+			mq_udp_coalesce_flush, q);
+	}
+
+	return TRUE;
+}
+
 /**
  * Create new message queue capable of holding `maxsize' bytes, and
  * owned by the supplied node.
@@ -206,12 +437,30 @@ mq_udp_service(void *data)
 		int mb_size = pmsg_size(mb);
 		struct mq_udp_info *mi = pmsg_get_metadata(mb);
 
-		if (!pmsg_can_send(mb, q)) {
+		plist_t *links[MQ_UDP_COALESCE_MAX];
+		pmsg_t *cmb;
+		uint count = 0;
+
+		if (!pmsg_can_send(mb, q) || q->cops->codel_drop(q, mb)) {
 			dropped++;
 			goto skip;
 		}
 
-		r = tx_sendto(q->tx_drv, mb, &mi->to);
+		cmb = mq_udp_coalesce(q, l, links, &count);
+
+		if (cmb != NULL) {
+			int cmb_size = pmsg_size(cmb);
+
+			r = tx_sendto(q->tx_drv, cmb, &mi->to);
+			pmsg_free(cmb);
+
+			if (r > 0) {
+				g_assert(r == cmb_size);
+				mq_udp_coalesced(q, links, count);
+			}
+		} else {
+			r = tx_sendto(q->tx_drv, mb, &mi->to);
+		}
 
 		if (r < 0)		/* Error, drop packet and continue */
 			goto skip;
@@ -219,9 +468,10 @@ mq_udp_service(void *data)
 		if (r == 0)		/* No more bandwidth */
 			break;
 
-		g_assert(r == mb_size);
+		g_assert(cmb != NULL || r == mb_size);
 
 		node_add_tx_given(q->node, r);
+		q->cops->dequeued(q, mb);
 
 		if (q->flags & MQ_FLOWC)
 			q->flowc_written += r;
@@ -343,10 +593,11 @@ again:
 		q->uops->msg_queued(q->node, mb);
 
 	/*
-	 * If queue is empty, attempt a write immediatly.
+	 * If queue is empty, attempt a write immediatly, unless we hold the
+	 * message to coalesce it with the next ones.
 	 */
 
-	if (q->qhead == NULL) {
+	if (q->qhead == NULL && !mq_udp_coalesce_hold(q, mb, to)) {
 		ssize_t written;
 
 		if (pmsg_can_send(mb, q)) {
@@ -503,4 +754,23 @@ static const struct mq_ops mq_udp_ops = {
 	mq_udp_flushed,		/* flushed */
 };
 
+/**
+ * Initialize UDP message queues.
+ */
+void G_COLD
+mq_udp_init(void)
+{
+	mq_udp_coalesce_hosts = aging_make(MQ_UDP_COALESCE_LINGER,
+		host_addr_hash_func, host_addr_eq_func, wfree_host_addr);
+}
+
+/**
+ * Release resources used by UDP message queues.
+ */
+void G_COLD
+mq_udp_close(void)
+{
+	aging_destroy(&mq_udp_coalesce_hosts);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -37,6 +37,7 @@
 #include "common.h"
 #include "mq.h"
 #include "lib/gnet_host.h"
+#include "lib/host_addr.h"
 #include "lib/pmsg.h"
 
 /*
@@ -51,6 +52,10 @@ mqueue_t *mq_udp_make(int maxsize,
 
 void mq_udp_putq(mqueue_t *q, pmsg_t *mb, const gnet_host_t *to);
 void mq_udp_node_putq(mqueue_t *q, pmsg_t *mb, const struct gnutella_node *n);
+void mq_udp_coalesce_learn(host_addr_t addr);
+
+void mq_udp_init(void);
+void mq_udp_close(void);
 
 #endif	/* _core_mq_udp_h_ */
 
@@ -95,6 +95,7 @@
 #include "version.h"
 #include "vmsg.h"
 #include "whitelist.h"
+#include "zdict.h"
 
 #include "g2/frame.h"
 #include "g2/msg.h"
@@ -166,6 +167,7 @@
 #define NODE_USELESS_GRACE		300	  /**< No kick if condition too recent */
 #define NODE_UP_USELESS_GRACE	600	  /**< No kick if condition too recent */
 #define NODE_QRT_MOVE_FREQ		300   /**< Time between QRT move attempts */
+#define NODE_HOUSEKEEPING		5     /**< Period of per-node cache lookups */
 
 #define SHUTDOWN_GRACE_DELAY	120	  /**< Grace time for shutdowning nodes */
 #define BYE_GRACE_DELAY			30	  /**< Bye sent, give time to propagate */
@@ -1396,6 +1398,7 @@ node_timer(time_t now)
 
 	for (sl = sl_nodes; NULL != sl; /* empty */ ) {
 		gnutella_node_t *n = sl->data;
+		bool housekeeping;
 
 		/*
 		 * NB:	As the list `sl_nodes' might be modified, the next
@@ -1403,7 +1406,19 @@ node_timer(time_t now)
 		 */
 
 		sl = pslist_next(sl);
-		node_tls_refresh(n);
+
+		/*
+		 * Checks requiring a lookup in the TLS or hostile caches are only
+		 * done every NODE_HOUSEKEEPING seconds for a given node.  Nodes are
+		 * spread over the period by their ID, so that each tick only does
+		 * the lookups for a fraction of the connected nodes.
+		 */
+
+		housekeeping =
+			0 == (nid_value(NODE_ID(n)) + (uint64) now) % NODE_HOUSEKEEPING;
+
+		if (housekeeping)
+			node_tls_refresh(n);
 
 		/*
 		 * Check that we get the expected vendor message description
@@ -1530,7 +1545,7 @@ node_timer(time_t now)
 				continue;
 			}
 
-			if (hostiles_is_bad(n->addr)) {
+			if (housekeeping && hostiles_is_bad(n->addr)) {
 				hostiles_flags_t flags = hostiles_check(n->addr);
 				g_message("removing %s, as dynamically found hostile peer (%s)",
 					node_infostr(n), hostiles_flags_to_string(flags));
@@ -1824,6 +1839,21 @@ node_init(void)
 
 	header_features_add(FEATURES_CONNECTIONS, "sflag", 0, 1);
 
+	/*
+	 * Signal we can inflate streams using our preset dictionary.
+	 */
+
+	header_features_add_guarded(FEATURES_CONNECTIONS, "zdict",
+		ZDICT_VERSION_MAJOR, ZDICT_VERSION_MINOR,
+		GNET_PROPERTY_PTR(deflate_dictionary));
+
+	/*
+	 * Signal we can split semi-reliable UDP messages made of several
+	 * coalesced Gnutella messages.
+	 */
+
+	header_features_add(FEATURES_CONNECTIONS, "mudp", 0, 1);
+
 	/*
 	 * IPv6-Ready:
 	 * - advertise "IP/6.4" if we don't run IPv4.
@@ -2213,6 +2243,20 @@ node_decrement_counters(const gnutella_node_t *n)
 	}
 }
 
+/**
+ * Make the message data point back to our own data buffer, if it was
+ * pointing within the RX buffer.
+ */
+static inline void
+node_data_own(gnutella_node_t *n)
+{
+	if (n->data_in_place) {
+		n->data = n->rx_data;
+		n->rx_data = NULL;
+		n->data_in_place = FALSE;
+	}
+}
+
 /**
  * The vectorized (message-wise) version of node_remove().
  */
@@ -2319,6 +2363,7 @@ node_remove_v(gnutella_node_t *n, const char *reason, va_list ap)
 	/* n->io_opaque will be freed by node_real_remove() */
 	/* n->vendor will be freed by node_real_remove() */
 
+	node_data_own(n);
 	if (n->allocated) {
 		HFREE_NULL(n->data);
 		n->allocated = 0;
@@ -3393,9 +3438,25 @@ node_inflate_payload(gnutella_node_t *n)
 
 	/*
 	 * Start of payload looks OK, attempt inflation.
+	 *
+	 * The payload may have been deflated with our preset dictionary, in
+	 * which case we know the host can also inflate such payloads.
 	 */
 
-	ret = zlib_inflate_into(n->data, n->size, payload_inflate_buffer, &outlen);
+	if (zlib_header_has_dictionary(n->data, n->size)) {
+		const void *dict;
+		size_t len;
+
+		dict = zdict_get(&len);
+		ret = zlib_inflate_into_dict(n->data, n->size,
+				payload_inflate_buffer, &outlen, dict, len);
+		if (Z_OK == ret)
+			gmsg_zdict_learn(n->addr);
+	} else {
+		ret = zlib_inflate_into(n->data, n->size,
+				payload_inflate_buffer, &outlen);
+	}
+
 	if (ret != Z_OK) {
 		if (GNET_PROPERTY(udp_debug))
 			g_warning("UDP cannot inflate %s from %s: %s",
@@ -4019,17 +4080,28 @@ node_msg_ut_accounting(void *o, const pmsg_t *mb, const gnet_host_t *to)
 {
 	gnutella_node_t *n = o;
 	char *mb_start = pmsg_phys_base(mb);
-	uint8 function = gmsg_function(mb_start);
 	int mb_size = pmsg_written_size(mb);
 
 	node_check(n);
 	g_assert(!NODE_TALKS_G2(n));
 
-	node_sent_accounting(n, function, mb_start, mb_size);
+	/*
+	 * The message can be made of several coalesced Gnutella messages.
+	 */
 
-	if (GNET_PROPERTY(log_sr_udp_tx)) {
-		g_info("UDP-SR sent %s to %s",
-			gmsg_infostr_full(mb_start, mb_size), gnet_host_to_string(to));
+	while (mb_size >= GTA_HEADER_SIZE) {
+		uint8 function = gmsg_function(mb_start);
+		int size = MIN(mb_size, GTA_HEADER_SIZE + gmsg_size(mb_start));
+
+		node_sent_accounting(n, function, mb_start, size);
+
+		if (GNET_PROPERTY(log_sr_udp_tx)) {
+			g_info("UDP-SR sent %s to %s",
+				gmsg_infostr_full(mb_start, size), gnet_host_to_string(to));
+		}
+
+		mb_start += size;
+		mb_size -= size;
 	}
 }
 
@@ -4909,6 +4981,9 @@ node_net_stack_create(gnutella_node_t *n)
 		args.nagle = TRUE;
 		args.gzip = FALSE;
 		args.reduced = settings_is_ultra() && NODE_IS_LEAF(n);
+		args.low_memory = GNET_PROPERTY(deflate_low_memory);
+		args.dictionary = GNET_PROPERTY(deflate_dictionary) &&
+			(n->attrs2 & NODE_A2_ZDICT);
 		args.buffer_size = NODE_TX_BUFSIZ;
 		args.buffer_flush = NODE_TX_FLUSH;
 
@@ -7042,6 +7117,33 @@ check_protocol:
 			n->attrs |= NODE_A_CAN_SFLAG;
 	}
 
+	/*
+	 * Check whether remote node can inflate data compressed with our
+	 * preset dictionary.
+	 */
+	{
+		uint major, minor;
+
+		if (
+			header_get_feature("zdict", head, &major, &minor) &&
+			ZDICT_VERSION_MAJOR == major
+		) {
+			n->attrs2 |= NODE_A2_ZDICT;
+			gmsg_zdict_learn(n->addr);	/* Can also use it for UDP */
+		}
+	}
+
+	/*
+	 * Check whether remote node can split coalesced semi-reliable UDP
+	 * messages, so that we can coalesce what we send to it.
+	 */
+	{
+		uint major, minor;
+
+		if (header_get_feature("mudp", head, &major, &minor))
+			mq_udp_coalesce_learn(n->addr);
+	}
+
 	/*
 	 * If we're a leaf node, only accept connections to "modern" ultra nodes.
 	 * A modern ultra node supports high outdegree and dynamic querying.
@@ -8474,6 +8576,27 @@ node_dht_get_addr_port(const host_addr_t addr, uint16 port)
 	return NULL;
 }
 
+/**
+ * Get "fake" node for DHT reception of a datagram we got earlier.
+ *
+ * This is used when processing of the datagram was deferred, to setup
+ * the pseudo node as node_udp_process() would have done.
+ *
+ * @return setup node, NULL if we cannot get a valid node
+ */
+gnutella_node_t *
+node_dht_setup(const host_addr_t addr, uint16 port, void *data, size_t len)
+{
+	gnutella_node_t *n;
+
+	n = node_dht_get_addr_port(addr, port);
+
+	if G_LIKELY(n != NULL)
+		node_pseudo_setup(n, data, len);
+
+	return n;
+}
+
 /**
  * Get "fake" node for UDP routing.
  */
@@ -9040,7 +9163,7 @@ node_patch_push_fw2fw(gnutella_node_t *n)
  * since we may invalidate that node during the processing.
  */
 static void
-node_parse(gnutella_node_t *n)
+node_parse_message(gnutella_node_t *n)
 {
 	bool drop = FALSE;
 	bool has_ggep = FALSE;
@@ -9049,6 +9172,9 @@ node_parse(gnutella_node_t *n)
 	query_hashvec_t *qhv = NULL;
 	int results = 0;						/* # of results in query hits */
 	search_request_info_t *sri = NULL;
+	size_t fixed_size;
+	uint8 function;
+	uint checks;
 
 	g_return_if_fail(n != NULL);
 	g_assert(NODE_IS_CONNECTED(n));
@@ -9101,66 +9227,21 @@ node_parse(gnutella_node_t *n)
 		return;
 	}
 
-	/* First some simple checks */
-
-	switch (gnutella_header_get_function(&n->header)) {
-	case GTA_MSG_INIT:
-        if (n->size)
-			regular_size = 0;		/* Will check further below */
-		break;
-	case GTA_MSG_INIT_RESPONSE:
-        if (n->size != sizeof(gnutella_init_response_t))
-			regular_size = sizeof(gnutella_init_response_t);
-		break;
-	case GTA_MSG_BYE:
-		if (
-			gnutella_header_get_hops(&n->header) != 0 ||
-			gnutella_header_get_ttl(&n->header) > 1
-		) {
-			n->n_bad++;
-			drop = TRUE;
-			if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
-				gmsg_log_bad(n, "expected hops=0 and TTL<=1");
-            gnet_stats_count_dropped(n, MSG_DROP_IMPROPER_HOPS_TTL);
-		}
-		break;
-	case GTA_MSG_PUSH_REQUEST:
-        if (n->size != sizeof(gnutella_push_request_t))
-			regular_size = sizeof(gnutella_push_request_t);
-		break;
-	case GTA_MSG_SEARCH:
-		if (n->size <= 3) {	/* At least speed(2) + NUL(1) */
-			drop = TRUE;
-            gnet_stats_count_dropped(n, MSG_DROP_TOO_SMALL);
-        }
-		else if (n->size > GNET_PROPERTY(search_queries_forward_size)) {
-			drop = TRUE;
-            gnet_stats_count_dropped(n, MSG_DROP_TOO_LARGE);
-        }
+	/*
+	 * First some simple checks, common to several message types, driven by
+	 * the per-type rules computed by gmsg_init().
+	 */
 
-		/*
-		 * TODO
-		 * Just like we refuse to process queries that are "too short",
-		 * and would therefore match too many things, we should probably
-		 * refuse to forward those on the network.	Less careful servents
-		 * would reply, and then we'll have more messages to process.
-		 *				-- RAM, 09/09/2001
-		 */
-		break;
-	case GTA_MSG_SEARCH_RESULTS:
-        if (n->size > GNET_PROPERTY(search_answers_forward_size)) {
-            drop = TRUE;
-            gnet_stats_count_dropped(n, MSG_DROP_TOO_LARGE);
-        }
-		if (n->size < GUID_RAW_SIZE) {
-			n->n_bad++;
-            drop = TRUE;
-            gnet_stats_count_dropped(n, MSG_DROP_TOO_SMALL);
-		}
-		break;
+	function = gnutella_header_get_function(&n->header);
+	checks = gmsg_checks(function, &fixed_size);
 
-	case GTA_MSG_VENDOR:
-	case GTA_MSG_STANDARD:
+	if G_UNLIKELY(!(checks & GMSG_CHK_KNOWN)) {
+		drop = TRUE;			/* Unknown message type - we drop it */
+		n->n_bad++;
+		if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
+			gmsg_log_bad(n, "unknown message type");
+		gnet_stats_count_dropped(n, MSG_DROP_UNKNOWN_TYPE);
+	} else if (
 		/*
 		 * Vendor messages are never routed, so they should be sent with
 		 * hops=0 and TTL=1.  When they come from UDP however, they can
@@ -9168,77 +9249,101 @@ node_parse(gnutella_node_t *n)
 		 * hops/ttl are not setup correctly.
 		 *		--RAM, 2006-08-29
 		 */
-		if (!NODE_IS_UDP(n)) {
+		(
+			(checks & GMSG_CHK_LOCAL) ||
+			((checks & GMSG_CHK_LOCAL_TCP) && !NODE_IS_UDP(n))
+		) && (
+			gnutella_header_get_hops(&n->header) != 0 ||
+			gnutella_header_get_ttl(&n->header) > 1
+		)
+	) {
+		n->n_bad++;
+		drop = TRUE;
+		if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
+			gmsg_log_bad(n, "expected hops=0 and TTL<=1");
+		gnet_stats_count_dropped(n, MSG_DROP_IMPROPER_HOPS_TTL);
+	} else if ((checks & GMSG_CHK_REGULAR) && n->size != fixed_size) {
+		regular_size = fixed_size;		/* Will check further below */
+	} else {
+		/*
+		 * Then the checks specific to each message type.
+		 */
+
+		switch (function) {
+		case GTA_MSG_SEARCH:
+			if (n->size <= 3) {	/* At least speed(2) + NUL(1) */
+				drop = TRUE;
+				gnet_stats_count_dropped(n, MSG_DROP_TOO_SMALL);
+			}
+			else if (n->size > GNET_PROPERTY(search_queries_forward_size)) {
+				drop = TRUE;
+				gnet_stats_count_dropped(n, MSG_DROP_TOO_LARGE);
+			}
+
+			/*
+			 * TODO
+			 * Just like we refuse to process queries that are "too short",
+			 * and would therefore match too many things, we should probably
+			 * refuse to forward those on the network.	Less careful servents
+			 * would reply, and then we'll have more messages to process.
+			 *				-- RAM, 09/09/2001
+			 */
+			break;
+		case GTA_MSG_SEARCH_RESULTS:
+			if (n->size > GNET_PROPERTY(search_answers_forward_size)) {
+				drop = TRUE;
+				gnet_stats_count_dropped(n, MSG_DROP_TOO_LARGE);
+			}
+			if (n->size < GUID_RAW_SIZE) {
+				n->n_bad++;
+				drop = TRUE;
+				gnet_stats_count_dropped(n, MSG_DROP_TOO_SMALL);
+			}
+			break;
+
+		case GTA_MSG_VENDOR:
+		case GTA_MSG_STANDARD:
+			/* In case no Vendor-Message was seen in handshake */
+			if (!NODE_IS_UDP(n))
+				n->attrs |= NODE_A_CAN_VENDOR;
+			break;
+
+		case GTA_MSG_QRP:			/* Leaf -> Ultrapeer, never routed */
 			if (
-				gnutella_header_get_hops(&n->header) != 0 ||
-				gnutella_header_get_ttl(&n->header) > 1
+				settings_is_leaf() ||
+				!(
+					n->peermode == NODE_P_LEAF ||
+					(
+						n->peermode == NODE_P_ULTRA &&
+						(n->attrs & NODE_A_UP_QRP)
+					)
+				)
 			) {
+				drop = TRUE;
 				n->n_bad++;
+				if (
+					GNET_PROPERTY(node_debug) ||
+					GNET_PROPERTY(log_bad_gnutella)
+				)
+					gmsg_log_bad(n, "unexpected QRP message");
+				gnet_stats_count_dropped(n, MSG_DROP_UNEXPECTED);
+			}
+			break;
+		case GTA_MSG_HSEP_DATA:     /* never routed */
+			if (!(n->attrs & NODE_A_CAN_HSEP)) {
 				drop = TRUE;
+				n->n_bad++;
 				if (
 					GNET_PROPERTY(node_debug) ||
 					GNET_PROPERTY(log_bad_gnutella)
 				)
-					gmsg_log_bad(n, "expected hops=0 and TTL<=1");
-				gnet_stats_count_dropped(n, MSG_DROP_IMPROPER_HOPS_TTL);
-			} else {
-				/* In case no Vendor-Message was seen in handshake */
-				n->attrs |= NODE_A_CAN_VENDOR;
+					gmsg_log_bad(n, "unexpected HSEP message");
+				gnet_stats_count_dropped(n, MSG_DROP_UNEXPECTED);
 			}
+			break;
+		default:
+			break;
 		}
-		break;
-
-	case GTA_MSG_QRP:			/* Leaf -> Ultrapeer, never routed */
-		if (
-			gnutella_header_get_hops(&n->header) != 0 ||
-			gnutella_header_get_ttl(&n->header) > 1
-		) {
-			n->n_bad++;
-			drop = TRUE;
-			if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
-				gmsg_log_bad(n, "expected hops=0 and TTL<=1");
-            gnet_stats_count_dropped(n, MSG_DROP_IMPROPER_HOPS_TTL);
-		} else if (
-			settings_is_leaf() ||
-			!(
-				n->peermode == NODE_P_LEAF ||
-				(n->peermode == NODE_P_ULTRA && (n->attrs & NODE_A_UP_QRP))
-			)
-		) {
-			drop = TRUE;
-			n->n_bad++;
-			if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
-				gmsg_log_bad(n, "unexpected QRP message");
-			gnet_stats_count_dropped(n, MSG_DROP_UNEXPECTED);
-		}
-		break;
-	case GTA_MSG_HSEP_DATA:     /* never routed */
-		if (
-			gnutella_header_get_hops(&n->header) != 0 ||
-			gnutella_header_get_ttl(&n->header) > 1
-		) {
-			n->n_bad++;
-			drop = TRUE;
-			if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
-				gmsg_log_bad(n, "expected hops=0 and TTL<=1");
-			gnet_stats_count_dropped(n, MSG_DROP_IMPROPER_HOPS_TTL);
-		} else if (!(n->attrs & NODE_A_CAN_HSEP)) {
-			drop = TRUE;
-			n->n_bad++;
-			if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
-				gmsg_log_bad(n, "unexpected HSEP message");
-			gnet_stats_count_dropped(n, MSG_DROP_UNEXPECTED);
-		}
-		break;
-	case GTA_MSG_RUDP:
-		break;
-	default:					/* Unknown message type - we drop it */
-		drop = TRUE;
-		n->n_bad++;
-		if (GNET_PROPERTY(node_debug) || GNET_PROPERTY(log_bad_gnutella))
-			gmsg_log_bad(n, "unknown message type");
-        gnet_stats_count_dropped(n, MSG_DROP_UNKNOWN_TYPE);
-		break;
 	}
 
 	/*
@@ -9613,6 +9718,26 @@ clean_dest:
 		pslist_free(dest.ur.u_nodes);
 }
 
+/**
+ * Process message, recording how much time we spent handling it, per
+ * message type.
+ *
+ * @attention
+ * NB: callers of this routine must not use the node structure upon return,
+ * since we may invalidate that node during the processing.
+ */
+static void
+node_parse(gnutella_node_t *n)
+{
+	uint8 function = gnutella_header_get_function(&n->header);
+	size_t len = n->size;
+	tm_nano_t start;
+
+	tm_precise_time(&start);
+	node_parse_message(n);
+	gnet_stats_count_handled(function, len, &start);
+}
+
 static void
 node_drain_hello(void *data, int source, inputevt_cond_t cond)
 {
@@ -9846,13 +9971,85 @@ node_udp_process(gnutella_node_t *n, const struct gnutella_socket *s,
 
 	if (NODE_IS_DHT(n)) {
 		node_add_rx_given(n, n->size + GTA_HEADER_SIZE);
-		kmsg_received(data, len, s->addr, s->port, n);
+		kmsg_received_async(data, len, s->addr, s->port, n);
 		return;
 	}
 
 	node_handle(n);
 }
 
+/**
+ * Check whether data received through the semi-reliable UDP layer is made
+ * of several Gnutella messages coalesced by the sending host.
+ *
+ * @param data		the received data
+ * @param len		length of data
+ *
+ * @return TRUE if data is exactly filled by at least two Gnutella messages.
+ */
+static bool
+node_udp_sr_is_coalesced(const void *data, size_t len)
+{
+	const char *p = data;
+	size_t count = 0;
+
+	while (len != 0) {
+		uint16 size;
+
+		if (len < GTA_HEADER_SIZE)
+			return FALSE;
+
+		switch (gmsg_size_valid(p, &size)) {
+		case GMSG_VALID:
+		case GMSG_VALID_MARKED:
+			break;
+		case GMSG_VALID_NO_PROCESS:
+		case GMSG_INVALID:
+			return FALSE;
+		}
+
+		if (GTA_HEADER_SIZE + (size_t) size > len)
+			return FALSE;
+
+		p += GTA_HEADER_SIZE + size;
+		len -= GTA_HEADER_SIZE + size;
+		count++;
+	}
+
+	return count > 1;
+}
+
+/**
+ * Handle Gnutella message received through the semi-reliable UDP layer,
+ * whose header and payload have been loaded into the pseudo node.
+ *
+ * @param n			the pseudo node
+ * @param from		the sending host
+ * @param length	total length of message (header + payload)
+ */
+static void
+node_udp_sr_handle(gnutella_node_t *n, const gnet_host_t *from, size_t length)
+{
+	/*
+	 * The message was received through the semi-reliable UDP layer, hence
+	 * we never went through udp_is_valid_gnet(), which is only called on
+	 * plain Gnutella messages received from UDP.  Therefore, no accounting
+	 * of the message was done yet, and we don't know whether what we got
+	 * is even a valid Gnutella message!
+	 */
+
+	if (!udp_is_valid_gnet_split(n, NULL, FALSE, n->header, n->data, length))
+		return;
+
+	if (GNET_PROPERTY(log_sr_udp_rx)) {
+		g_info("UDP-SR got %s from %s",
+			gmsg_infostr_full_split(n->header, n->data, n->size),
+			gnet_host_to_string(from));
+	}
+
+	node_handle(n);
+}
+
 /**
  * Data indication callback for the semi-reliable UDP layer.
  *
@@ -9863,10 +10060,12 @@ node_udp_sr_data_ind(rxdrv_t *unused_rx, pmsg_t *mb, const gnet_host_t *from)
 {
 	gnutella_node_t *n;
 	size_t length;
+	bool coalesced;
 
 	(void) unused_rx;
 
 	length = pmsg_size(mb);
+	coalesced = node_udp_sr_is_coalesced(pmsg_start(mb), length);
 	n = node_pseudo_get_from_mb(mb, from);
 
 	/*
@@ -9879,24 +10078,35 @@ node_udp_sr_data_ind(rxdrv_t *unused_rx, pmsg_t *mb, const gnet_host_t *from)
 		goto done;
 	}
 
+	if (!coalesced) {
+		node_udp_sr_handle(n, from, length);
+		goto done;
+	}
+
 	/*
-	 * The message was received through the semi-reliable UDP layer, hence
-	 * we never went through udp_is_valid_gnet(), which is only called on
-	 * plain Gnutella messages received from UDP.  Therefore, no accounting
-	 * of the message was done yet, and we don't know whether what we got
-	 * is even a valid Gnutella message!
+	 * The sending host coalesced several messages: handle each of them in
+	 * turn, and remember that we can coalesce what we send back to it.
+	 *
+	 * The payload size is saved before handling the message since its
+	 * processing can change n->size, when the payload is inflated.
 	 */
 
-	if (!udp_is_valid_gnet_split(n, NULL, FALSE, n->header, n->data, length))
-		goto done;
+	mq_udp_coalesce_learn(gnet_host_get_addr(from));
 
-	if (GNET_PROPERTY(log_sr_udp_rx)) {
-		g_info("UDP-SR got %s from %s",
-			gmsg_infostr_full_split(n->header, n->data, n->size),
-			gnet_host_to_string(from));
-	}
+	for (;;) {
+		size_t size = n->size;
 
-	node_handle(n);
+		gnet_stats_inc_general(GNR_UDP_SR_RX_COALESCED);
+		node_udp_sr_handle(n, from, GTA_HEADER_SIZE + size);
+
+		pmsg_discard(mb, size);
+		if (0 == pmsg_size(mb))
+			break;
+
+		n = node_pseudo_get_from_mb(mb, from);
+		if G_UNLIKELY(NULL == n)
+			break;
+	}
 
 	/* FALL THROUGH */
 
@@ -10547,6 +10757,19 @@ node_grow_data(gnutella_node_t *n, size_t len)
 		n->data = &n->socket->buf[0];
 		/* There should be enough room in the buffer! */
 		g_assert(len <= n->socket->buf_size);
+	} else if (n->data_in_place) {
+		/* TCP connection, message being parsed within the RX buffer */
+		const char *data = n->data;
+
+		node_data_own(n);
+
+		if (n->allocated < len) {
+			HFREE_NULL(n->data);
+			n->data = halloc(len);
+			n->allocated = len;
+		}
+
+		memcpy(n->data, data, MIN(len, n->size));
 	} else {
 		/* This is a node where we go through node_read() -- TCP connection */
 		g_assert(0 != n->allocated);
@@ -10558,6 +10781,20 @@ node_grow_data(gnutella_node_t *n, size_t len)
 	}
 }
 
+/**
+ * Make the message data point within the RX buffer, where the whole
+ * payload lies, to parse it without copying it first.
+ */
+static inline void
+node_data_in_place(gnutella_node_t *n, const char *data)
+{
+	g_assert(!n->data_in_place);
+
+	n->rx_data = n->data;
+	n->data = deconstify_pointer(data);
+	n->data_in_place = TRUE;
+}
+
 /**
  * Read data from the message buffer we just received.
  *
@@ -10715,9 +10952,20 @@ node_read(gnutella_node_t *n, pmsg_t *mb)
 		/* FALL THROUGH */
 	}
 
-	/* Reading of the message data */
+	/*
+	 * Reading of the message data.
+	 *
+	 * When the RX buffer holds the whole payload, which is the common case,
+	 * the message is parsed where it lies: the node's data buffer is only
+	 * used to gather payloads spanning several RX buffers.
+	 */
 
-	r = pmsg_read(mb, n->data + n->pos, n->size - n->pos);
+	if (0 == n->pos && UNSIGNED(pmsg_size(mb)) >= n->size) {
+		node_data_in_place(n, pmsg_start(mb));
+		r = pmsg_discard(mb, n->size);
+	} else {
+		r = pmsg_read(mb, n->data + n->pos, n->size - n->pos);
+	}
 
 	n->pos += r;
 	node_add_rx_read(n, r);
@@ -10730,6 +10978,7 @@ node_read(gnutella_node_t *n, pmsg_t *mb)
 	gnet_stats_count_received_payload(n, n->data);
 
 	node_parse(n);
+	node_data_own(n);
 
 	return TRUE;		/* There may be more data */
 
@@ -11383,9 +11632,39 @@ node_remove_uncompressed_ultra(bool *is_gtkg)
 	return TRUE;
 }
 
+/**
+ * Among a list of nodes, pick the one with the largest round-trip time.
+ *
+ * @return the slowest node, NULL if the RTT is unknown for all of them.
+ */
+static gnutella_node_t *
+node_slowest(const pslist_t *nodes)
+{
+	const pslist_t *sl;
+	gnutella_node_t *slowest = NULL;
+	uint32 rtt = 0;
+
+	PSLIST_FOREACH(nodes, sl) {
+		gnutella_node_t *n = sl->data;
+		const struct socket_tcp_info *ti;
+
+		if (NULL == n->socket)
+			continue;
+
+		ti = socket_tcp_info(n->socket);
+		if (ti != NULL && ti->rtt > rtt) {
+			rtt = ti->rtt;
+			slowest = n;
+		}
+	}
+
+	return slowest;
+}
+
 /**
  * Removes the node with the worst stats, considering the number of
- * weird, bad and duplicate packets.
+ * weird, bad and duplicate packets.  Among equally bad nodes, the one with
+ * the largest round-trip time is removed.
  *
  * If `non_local' is TRUE, we're removing this node because it is not
  * a local node, and we're having a connection from the local LAN.
@@ -11427,7 +11706,9 @@ node_remove_worst(bool non_local)
     }
     if (m) {
 		m = pslist_reverse(m);
-        n = pslist_nth_data(m, random_value(num - 1));
+		n = node_slowest(m);
+		if (NULL == n)
+			n = pslist_nth_data(m, random_value(num - 1));
         pslist_free(m);
 		if (non_local)
 			node_bye_if_writable(n, 202, "Local Node Preferred");
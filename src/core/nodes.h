@@ -145,6 +145,7 @@ typedef struct gnutella_node {
 	uint32 msg_flags;			/**< Message flags we set during analysis */
 
 	char *data;					/**< data of the current message */
+	char *rx_data;				/**< Our data buffer, whilst data is in RX */
 	uint32 pos;					/**< write position in data */
 
 	gnet_node_state_t status;	/**< See possible values below */
@@ -175,6 +176,7 @@ typedef struct gnutella_node {
 
 	uint32 allocated;			/**< Size of allocated buffer data, 0 for none */
 	bool have_header;			/**< TRUE if we have got a full message header */
+	bool data_in_place;			/**< TRUE if data points into the RX buffer */
 
 	time_t last_update;			/**< Last update of the node */
 	time_t last_tx;				/**< Last time we transmitted to the node */
@@ -367,6 +369,7 @@ enum {
  * Second attributes.
  */
 enum {
+	NODE_A2_ZDICT		= 1 << 11,	/**< Node knows compression dictionary */
 	NODE_A2_G2_HUB		= 1 << 10,	/**< Node is a G2 hub */
 	NODE_A2_SWITCH_TLS	= 1 << 9,	/**< Node will switch to TLS */
 	NODE_A2_UPGRADE_TLS	= 1 << 8,	/**< Node wants to upgrade to TLS */
@@ -718,6 +721,8 @@ void node_udp_process(gnutella_node_t *n, const struct gnutella_socket *s,
 gnutella_node_t *node_udp_get_addr_port(const host_addr_t addr, uint16 port);
 gnutella_node_t *node_udp_sr_get_addr_port(const host_addr_t addr, uint16 port);
 gnutella_node_t *node_dht_get_addr_port(const host_addr_t addr, uint16 port);
+gnutella_node_t *node_dht_setup(const host_addr_t addr, uint16 port,
+	void *data, size_t len);
 gnutella_node_t * node_udp_route_get_addr_port(
 	const host_addr_t addr, uint16 port, bool can_deflate, bool sr_udp);
 
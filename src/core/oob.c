@@ -70,6 +70,8 @@
 #define OOB_DELIVER_BASE_MS	2500			/**< 1 msg queued every 2.5 secs */
 #define OOB_DELIVER_RAND_MS	5000			/**< ... + up to 5 random secs */
 
+#define OOB_DELIVER_BURST	4096			/**< Max bytes queued per service */
+
 #define OOB_MAX_QUEUED		50				/**< Max # of messages per host */
 #define OOB_MAX_RETRY		3				/**< Retry # if LIME/12v2 dropped */
 
@@ -143,7 +145,8 @@ struct gservent {
  *
  * On reception of LIME/11v2, prepare all hits, put them in the FIFO
  * for this servent, then free the list.
- * Every OOB_DELIVER_MS, enqueue a hit to the UDP MQ for sending.
+ * Every OOB_DELIVER_MS, enqueue hits to the UDP MQ for sending, up to
+ * OOB_DELIVER_BURST bytes at a time.
  */
 
 static void results_destroy(cqueue_t *cq, void *obj);
@@ -447,8 +450,13 @@ servent_call_service(cqueue_t *cq, void *obj)
 }
 
 /**
- * Service servent's FIFO: send next packet, and re-arm servicing callback
+ * Service servent's FIFO: send next packets, and re-arm servicing callback
  * if there are more data to send.
+ *
+ * Hits from all the queries of the servent are held in the same FIFO, so
+ * we coalesce the delivery of consecutive small messages into a single
+ * burst of at most OOB_DELIVER_BURST bytes, instead of paying the whole
+ * delivery delay for each of them.  At least one message is sent.
  */
 static void
 servent_service(struct gservent *s, cqueue_t *cq)
@@ -456,33 +464,39 @@ servent_service(struct gservent *s, cqueue_t *cq)
 	pmsg_t *mb;
 	mqueue_t *q;
 	enum net_type nt;
+	size_t queued = 0;
 
-	mb = fifo_remove(s->fifo);
-	if (mb == NULL)
+	if (0 == fifo_count(s->fifo))
 		goto remove;
 
 	nt = host_addr_net(gnet_host_get_addr(s->host));
 	q = s->reliable ? node_udp_sr_get_outq(nt) : node_udp_get_outq(nt);
 	if (q == NULL)
-		goto udp_disabled;
+		goto remove;
 
-	if (GNET_PROPERTY(udp_debug) > 19)
-		g_debug("UDP queuing OOB %s to %s for #%s",
-			gmsg_infostr_full(pmsg_phys_base(mb), pmsg_written_size(mb)),
-			gnet_host_to_string(s->host),
-			guid_hex_str(cast_to_guid_ptr_const(pmsg_phys_base(mb))));
+	while (NULL != (mb = fifo_remove(s->fifo))) {
+		if (GNET_PROPERTY(udp_debug) > 19)
+			g_debug("UDP queuing OOB %s to %s for #%s",
+				gmsg_infostr_full(pmsg_phys_base(mb), pmsg_written_size(mb)),
+				gnet_host_to_string(s->host),
+				guid_hex_str(cast_to_guid_ptr_const(pmsg_phys_base(mb))));
 
-	/*
-	 * Count enqueued deflated payloads, only when server was marked as
-	 * supporting compression anyway...
-	 */
+		/*
+		 * Count enqueued deflated payloads, only when server was marked as
+		 * supporting compression anyway...
+		 */
 
-	if (s->can_deflate) {
-		if (gnutella_header_get_ttl(pmsg_phys_base(mb)) & GTA_UDP_DEFLATED)
-			gnet_stats_inc_general(GNR_UDP_TX_COMPRESSED);
-	}
+		if (s->can_deflate) {
+			if (gnutella_header_get_ttl(pmsg_phys_base(mb)) & GTA_UDP_DEFLATED)
+				gnet_stats_inc_general(GNR_UDP_TX_COMPRESSED);
+		}
 
-	mq_udp_putq(q, mb, s->host);
+		queued += pmsg_written_size(mb);
+		mq_udp_putq(q, mb, s->host);
+
+		if (queued >= OOB_DELIVER_BURST)
+			break;
+	}
 
 	if (0 == fifo_count(s->fifo))
 		goto remove;
@@ -491,10 +505,6 @@ servent_service(struct gservent *s, cqueue_t *cq)
 
 	return;
 
-udp_disabled:
-	pmsg_free(mb);
-	/* FALL THROUGH */
-
 remove:
 	servent_free_remove(s);
 }
@@ -562,7 +572,8 @@ oob_record_hit(void *data, size_t len, void *udata)
 	 */
 
 	mb = (s->can_deflate && !s->reliable) ?
-		gmsg_to_deflated_pmsg(data, len) : gmsg_to_pmsg(data, len);
+		gmsg_to_deflated_pmsg(data, len, gnet_host_get_addr(s->host)) :
+		gmsg_to_pmsg(data, len);
 
 	if (s->reliable)
 		pmsg_mark_reliable(mb);
@@ -39,6 +39,7 @@
 #include "gnet_stats.h"
 #include "hostiles.h"
 #include "ipv6-ready.h"
+#include "mq_tcp.h"
 #include "nodes.h"
 #include "routing.h"
 #include "settings.h"
@@ -52,8 +53,12 @@
 #include "lib/cq.h"
 #include "lib/endian.h"
 #include "lib/hikset.h"
+#include "lib/htable.h"
 #include "lib/nid.h"
+#include "lib/pmsg.h"
+#include "lib/pslist.h"
 #include "lib/stringify.h"	/* For plural() */
+#include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"	/* Must be the last header included */
@@ -63,7 +68,16 @@
  * in case we OOB-proxy a query from a leaf because it does not send us
  * meaningful result indications.
  */
-#define PROXY_EXPIRE_MS		(11*60*1000)	/**< 11 minutes at most */
+#define PROXY_EXPIRE		(11*60)			/**< 11 minutes at most */
+#define PROXY_EXPIRE_PERIOD	(30*1000)		/**< ms, records expiration */
+#define PROXY_MAX_RECORDS	8192			/**< Max proxied queries */
+
+/*
+ * Hits routed back to a leaf are held for a short while, so that the ones
+ * coming in a burst reach the TX stack of the leaf together.
+ */
+#define PROXY_BATCH_DELAY	100				/**< ms, max latency added */
+#define PROXY_BATCH_SIZE	(16*1024)		/**< Flush hits above that size */
 
 typedef enum oob_proxy_rec_magic {
 	OOB_PROXY_REC_MAGIC = 0x63c9bc13U
@@ -78,7 +92,7 @@ struct oob_proxy_rec {
 	const struct guid *leaf_muid;/**< Original MUID, set by leaf (atom) */
 	const struct guid *proxied_muid;/**< Proxied MUID (atom) */
 	struct nid *node_id;		/**< The ID of the node leaf */
-	cevent_t *expire_ev;		/**< Expire event, to clear this record */
+	time_t expire;				/**< Expiration time of this record */
 };
 
 static void
@@ -88,11 +102,44 @@ oob_proxy_rec_check(const struct oob_proxy_rec * const opr)
 	g_assert(OOB_PROXY_REC_MAGIC == opr->magic);
 }
 
+typedef enum oob_proxy_batch_magic {
+	OOB_PROXY_BATCH_MAGIC = 0x2e4f1d97U
+} oob_proxy_batch_magic_t;
+
+/**
+ * Query hits held before being routed back to a leaf.
+ */
+struct oob_proxy_batch {
+	oob_proxy_batch_magic_t magic;
+	struct nid *node_id;		/**< The ID of the node leaf */
+	pslist_t *hits;				/**< Held messages, in reverse order */
+	size_t size;				/**< Total size of held messages */
+	uint count;					/**< Amount of held messages */
+	cevent_t *flush_ev;			/**< Flush event, to send held messages */
+};
+
+static void
+oob_proxy_batch_check(const struct oob_proxy_batch * const opb)
+{
+	g_assert(opb);
+	g_assert(OOB_PROXY_BATCH_MAGIC == opb->magic);
+}
+
 /**
  * Table recording the proxied OOB query MUID.
  */
 static hikset_t *proxied_queries;	/* New MUID => oob_proxy_rec */
 
+/**
+ * Table recording the hits held for each leaf.
+ */
+static htable_t *proxied_batches;	/* Node ID => oob_proxy_batch */
+
+/**
+ * Periodic event expiring the proxied queries.
+ */
+static cperiodic_t *proxied_expire_ev;
+
 /*
  * High-level description of what's happening here.
  *
@@ -127,6 +174,7 @@ oob_proxy_rec_make(const struct guid *leaf_muid,
 	opr->leaf_muid = atom_guid_get(leaf_muid);
 	opr->proxied_muid = atom_guid_get(proxied_muid);
 	opr->node_id = nid_ref(node_id);
+	opr->expire = time_advance(tm_time(), PROXY_EXPIRE);
 
 	return opr;
 }
@@ -138,7 +186,6 @@ static void
 oob_proxy_rec_free(struct oob_proxy_rec *opr)
 {
 	oob_proxy_rec_check(opr);
-	cq_cancel(&opr->expire_ev);
 	atom_guid_free_null(&opr->leaf_muid);
 	atom_guid_free_null(&opr->proxied_muid);
 	nid_unref(opr->node_id);
@@ -147,34 +194,160 @@ oob_proxy_rec_free(struct oob_proxy_rec *opr)
 }
 
 /**
- * Dispose of the OOB proxy record, removing entry from the `proxied_queries'
- * table.
+ * Delay the expiration of the OOB proxy record, since the proxied query
+ * is still alive.
  */
-static void
-oob_proxy_rec_free_remove(struct oob_proxy_rec *opr)
+static inline void
+oob_proxy_rec_refresh(struct oob_proxy_rec *opr)
 {
-	oob_proxy_rec_check(opr);
-	hikset_remove(proxied_queries, opr->proxied_muid);
-	oob_proxy_rec_free(opr);
+	opr->expire = time_advance(tm_time(), PROXY_EXPIRE);
 }
 
 /**
- * Callout queue callback to free OOB proxy record.
+ * Hash set iterator callback to remove expired OOB proxy records.
+ *
+ * @return TRUE if the record expired and was freed.
  */
-static void
-oob_proxy_rec_destroy(cqueue_t *cq, void *obj)
+static bool
+oob_proxy_rec_expired(void *value, void *data)
 {
-	struct oob_proxy_rec *opr = obj;
+	struct oob_proxy_rec *opr = value;
+	const time_t *now = data;
 
 	oob_proxy_rec_check(opr);
 
+	if (delta_time(*now, opr->expire) < 0)
+		return FALSE;
+
 	if (GNET_PROPERTY(query_debug) > 1 || GNET_PROPERTY(oob_proxy_debug) > 1)
 		g_debug("OOB proxied query leaf-MUID=%s proxied-MUID=%s expired",
 			guid_hex_str(opr->leaf_muid),
 			data_hex_str(opr->proxied_muid->v, GUID_RAW_SIZE));
 
-	cq_zero(cq, &opr->expire_ev);		/* The timer which just triggered */
-	oob_proxy_rec_free_remove(opr);
+	oob_proxy_rec_free(opr);
+	return TRUE;
+}
+
+/**
+ * Callout queue periodic event to expire all the stale OOB proxy records
+ * at once, instead of having one timer per record.
+ */
+static bool
+oob_proxy_expire(void *unused_obj)
+{
+	time_t now = tm_time();
+	size_t n;
+
+	(void) unused_obj;
+
+	n = hikset_foreach_remove(proxied_queries, oob_proxy_rec_expired, &now);
+
+	if (n != 0 && GNET_PROPERTY(oob_proxy_debug)) {
+		g_debug("OOB expired %zu proxied quer%s, %zu remaining",
+			n, plural_y(n), hikset_count(proxied_queries));
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Free batch of held hits, dropping the messages it still holds.
+ */
+static void
+oob_proxy_batch_free(struct oob_proxy_batch *opb)
+{
+	oob_proxy_batch_check(opb);
+
+	cq_cancel(&opb->flush_ev);
+	pslist_free_full_null(&opb->hits, (free_fn_t) pmsg_free);
+	nid_unref(opb->node_id);
+	opb->magic = 0;
+	WFREE(opb);
+}
+
+/**
+ * Send all the hits held for a leaf in one burst, then dispose of the batch.
+ *
+ * Messages that cannot be sent because the leaf is gone are freed, and
+ * the DH layer sees them as unsent.
+ */
+static void
+oob_proxy_batch_flush(struct oob_proxy_batch *opb)
+{
+	gnutella_node_t *leaf;
+	pslist_t *sl;
+
+	oob_proxy_batch_check(opb);
+
+	htable_remove(proxied_batches, opb->node_id);
+
+	leaf = node_active_by_id(opb->node_id);
+	if (leaf != NULL && !NODE_IS_WRITABLE(leaf))
+		leaf = NULL;
+
+	if (GNET_PROPERTY(query_debug) > 5 || GNET_PROPERTY(oob_proxy_debug) > 2) {
+		g_debug("QUERY OOB-proxied %s %u hit message%s (%zu bytes) to #%s %s",
+			NULL == leaf ? "dropping" : "flushing",
+			opb->count, plural(opb->count), opb->size,
+			nid_to_string(opb->node_id),
+			NULL == leaf ? "(gone)" : node_infostr(leaf));
+	}
+
+	if (leaf != NULL) {
+		opb->hits = pslist_reverse(opb->hits);
+
+		PSLIST_FOREACH(opb->hits, sl) {
+			mq_tcp_putq(leaf->outq, sl->data, NULL);
+		}
+
+		pslist_free_null(&opb->hits);
+	}
+
+	oob_proxy_batch_free(opb);
+}
+
+/**
+ * Callout queue callback to flush the hits held for a leaf.
+ */
+static void
+oob_proxy_batch_flush_timeout(cqueue_t *cq, void *obj)
+{
+	struct oob_proxy_batch *opb = obj;
+
+	oob_proxy_batch_check(opb);
+
+	cq_zero(cq, &opb->flush_ev);		/* The timer which just triggered */
+	oob_proxy_batch_flush(opb);
+}
+
+/**
+ * Hold query hit message for the leaf, until the latency window expires
+ * or enough data is held.
+ */
+static void
+oob_proxy_batch_add(const gnutella_node_t *leaf, pmsg_t *mb)
+{
+	struct oob_proxy_batch *opb;
+
+	opb = htable_lookup(proxied_batches, NODE_ID(leaf));
+
+	if (NULL == opb) {
+		WALLOC0(opb);
+		opb->magic = OOB_PROXY_BATCH_MAGIC;
+		opb->node_id = nid_ref(NODE_ID(leaf));
+		opb->flush_ev = cq_main_insert(PROXY_BATCH_DELAY,
+			oob_proxy_batch_flush_timeout, opb);
+		htable_insert(proxied_batches, opb->node_id, opb);
+	}
+
+	oob_proxy_batch_check(opb);
+
+	opb->hits = pslist_prepend(opb->hits, mb);
+	opb->size += pmsg_size(mb);
+	opb->count++;
+
+	if (opb->size >= PROXY_BATCH_SIZE)
+		oob_proxy_batch_flush(opb);
 }
 
 /**
@@ -260,17 +433,29 @@ oob_proxy_create(gnutella_node_t *n)
 		 * Since it is coming from the same leaf, just increase the timeout.
 		 */
 
-		cq_resched(opr->expire_ev, PROXY_EXPIRE_MS);
+		oob_proxy_rec_refresh(opr);
 	} else {
 		/*
-		 * Record the mapping, and make sure it expires in PROXY_EXPIRE_MS.
+		 * Bound the amount of proxied queries we track: past the limit,
+		 * the query will be sent without the OOB flag.
+		 */
+
+		if (hikset_count(proxied_queries) >= PROXY_MAX_RECORDS) {
+			if (GNET_PROPERTY(query_debug) || GNET_PROPERTY(oob_proxy_debug)) {
+				g_warning("QUERY OOB-proxying of query #%s from %s "
+					"failed: already proxying %zu queries",
+					guid_to_string(muid), node_infostr(n),
+					hikset_count(proxied_queries));
+			}
+			return FALSE;
+		}
+
+		/*
+		 * Record the mapping, and make sure it expires in PROXY_EXPIRE secs.
 		 */
 
 		opr = oob_proxy_rec_make(muid, &proxied_muid, NODE_ID(n));
 		hikset_insert_key(proxied_queries, &opr->proxied_muid);
-
-		opr->expire_ev = cq_main_insert(PROXY_EXPIRE_MS,
-			oob_proxy_rec_destroy, opr);
 	}
 
 	/*
@@ -411,8 +596,7 @@ oob_proxy_pending_results(
 	 * OOB query is still alive, delay its expiration time.
 	 */
 
-	g_assert(opr->expire_ev != NULL);
-	cq_resched(opr->expire_ev, PROXY_EXPIRE_MS);
+	oob_proxy_rec_refresh(opr);
 
 	/*
 	 * Claim the results (all of it).
@@ -459,6 +643,7 @@ oob_proxy_got_results(gnutella_node_t *n, uint results)
 {
 	struct oob_proxy_rec *opr;
 	gnutella_node_t *leaf;
+	pmsg_t *mb;
 
 	g_assert(gnutella_header_get_function(&n->header) == GTA_MSG_SEARCH_RESULTS);
 	g_assert(results > 0 && results <= INT_MAX);
@@ -469,11 +654,10 @@ oob_proxy_got_results(gnutella_node_t *n, uint results)
 
 	oob_proxy_rec_check(opr);
 	/*
-	 * Delay the expiration timer: we still get results for the proxied query.
+	 * Delay the expiration time: we still get results for the proxied query.
 	 */
 
-	g_assert(opr->expire_ev != NULL);
-	cq_resched(opr->expire_ev, PROXY_EXPIRE_MS);
+	oob_proxy_rec_refresh(opr);
 
 	/*
 	 * Fetch the leaf node.
@@ -527,13 +711,18 @@ oob_proxy_got_results(gnutella_node_t *n, uint results)
 		gnutella_header_set_ttl(&n->header, 1);
 
 	/*
-	 * Route message to leaf node.
+	 * Route message to leaf node, holding it with the other hits we are
+	 * about to send to that leaf.
 	 */
 
 	/* Went through route_message() already */
 	g_assert(gnutella_header_get_hops(&n->header) > 0);
 
-	dh_route(n, leaf, results);
+	mb = dh_route_pmsg(n, leaf, results);
+	if (NULL == mb)
+		return TRUE;		/* Dropped by the DH layer */
+
+	oob_proxy_batch_add(leaf, mb);
 
 	if (GNET_PROPERTY(query_debug) > 5 || GNET_PROPERTY(oob_proxy_debug) > 2)
 		g_debug("QUERY OOB-proxied #%s routed %d hit%s to %s from %s %s",
@@ -570,6 +759,9 @@ oob_proxy_init(void)
 	proxied_queries = hikset_create(
 		offsetof(struct oob_proxy_rec, proxied_muid),
 		HASH_KEY_FIXED, GUID_RAW_SIZE);
+	proxied_batches = htable_create_any(nid_hash, nid_hash2, nid_equal);
+	proxied_expire_ev = cq_periodic_main_add(PROXY_EXPIRE_PERIOD,
+		oob_proxy_expire, NULL);
 }
 
 /**
@@ -585,14 +777,29 @@ free_oob_proxy_kv(void *value, void *uu_udata)
 	oob_proxy_rec_free(opr);
 }
 
+/**
+ * Cleanup servent -- hash table iterator callback
+ */
+static void
+free_oob_proxy_batch_kv(const void *key, void *value, void *unused_udata)
+{
+	(void) key;
+	(void) unused_udata;
+
+	oob_proxy_batch_free(value);
+}
+
 /**
  * Cleanup at shutdown time.
  */
 void
 oob_proxy_close(void)
 {
+	cq_periodic_remove(&proxied_expire_ev);
 	hikset_foreach(proxied_queries, free_oob_proxy_kv, NULL);
 	hikset_free_null(&proxied_queries);
+	htable_foreach(proxied_batches, free_oob_proxy_batch_kv, NULL);
+	htable_free_null(&proxied_batches);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -177,7 +177,7 @@ enum parq_ul_queue_magic {
  */
 struct parq_ul_queue {
 	enum parq_ul_queue_magic magic;
-	plist_t *by_position;		/**< Queued items sorted on position. Newest is
+	hash_list_t *by_position;	/**< Queued items sorted on position. Newest is
 								 added to the end. */
 	hash_list_t *by_rel_pos;	/**< Queued items sorted by relative position */
 	hash_list_t *by_date_dead;	/**< Dead items sorted on last update */
@@ -189,7 +189,7 @@ struct parq_ul_queue {
 	int active_queued_cnt;	/**< Number of actively queued entries */
 	int alive;				/**< Amount of alive entries */
 	int frozen;				/**< Subset of alive entries that are frozen */
-	unsigned recompute:1;	/**< Flagged as requiring update of internal data */
+	unsigned recompute:1;	/**< Positions and ETAs need to be recomputed */
 	unsigned active:1;		/**< Set to false when the number of upload slots
 								 was decreased but the queue still contained
 								 queued items. This queue shall be removed when
@@ -1442,14 +1442,18 @@ parq_upload_update_eta(struct parq_ul_queue *which_ul_queue)
 		 * Locate the first active upload in this queue.
 		 */
 
-		PLIST_FOREACH(which_ul_queue->by_position, l) {
-			struct parq_ul_queued *puq = l->data;
+		iter = hash_list_iterator(which_ul_queue->by_position);
+
+		while (hash_list_iter_has_next(iter)) {
+			struct parq_ul_queued *puq = hash_list_iter_next(iter);
 
 			if (puq->has_slot) {		/* Recompute ETA */
 				eta += parq_estimated_slot_time(puq);
 				break;
 			}
 		}
+
+		hash_list_iter_release(&iter);
 	}
 
 	if (eta == 0 && GNET_PROPERTY(ul_running) > GNET_PROPERTY(max_uploads)) {
@@ -1507,41 +1511,6 @@ parq_upload_update_eta(struct parq_ul_queue *which_ul_queue)
 	hash_list_iter_release(&iter);
 }
 
-/**
- * Decreases the position of all queued items after the given queued item.
- */
-static void
-parq_upload_decrease_all_after(struct parq_ul_queued *puq)
-{
-	plist_t *l;
-	int pos_cnt = 0;	/* Used for assertion */
-
-	g_assert(puq != NULL);
-	g_assert(puq->queue != NULL);
-	g_assert(puq->queue->by_position != NULL);
-	g_assert(puq->queue->by_position_length > 0);
-
-	l = plist_find(puq->queue->by_position, puq);
-	pos_cnt = ((struct parq_ul_queued *) l->data)->position;
-
-	l = plist_next(l);	/* Decrease _after_ current parq */
-
-	/*
-	 * Cycle through list and decrease all positions by one. Position should
-	 * never reach 0 which would mean the queued item is currently uploading
-	 */
-	for (;	l; l = plist_next(l)) {
-		struct parq_ul_queued *p = l->data;
-
-		g_assert(p != NULL);
-		g_assert(p->position > 1);
-		g_assert(p->position - 1 == UNSIGNED(pos_cnt));
-
-		p->position--;
-		pos_cnt++;
-	}
-}
-
 /**
  * Function used to keep the relative position list sorted by absolute
  * queue positions, which refer to the order of arrival in the queue.
@@ -1590,12 +1559,14 @@ parq_upload_recompute_positions(struct parq_ul_queue *q)
 {
 	uint pos = 0;
 	uint prev_pos = 0;
-	plist_t *l;
+	hash_list_iter_t *iter;
 
 	parq_ul_queue_check(q);
 
-	PLIST_FOREACH(q->by_position, l) {
-		struct parq_ul_queued *puq = l->data;
+	iter = hash_list_iterator(q->by_position);
+
+	while (hash_list_iter_has_next(iter)) {
+		struct parq_ul_queued *puq = hash_list_iter_next(iter);
 
 		parq_ul_queued_check(puq);
 		g_assert(puq->queue == q);
@@ -1606,6 +1577,8 @@ parq_upload_recompute_positions(struct parq_ul_queue *q)
 		puq->position = ++pos;
 	}
 
+	hash_list_iter_release(&iter);
+
 	g_assert(pos <= UNSIGNED(q->by_position_length));
 }
 
@@ -1649,6 +1622,31 @@ parq_upload_recompute_relative_positions(struct parq_ul_queue *q)
 	g_assert(hash_list_length(q->by_rel_pos) == rel);
 }
 
+/**
+ * Bring positions and ETAs of the queue up to date if they were flagged
+ * as needing a recomputation.
+ *
+ * Removing an entry from the queue merely leaves a hole in the numbering,
+ * which keeps entries correctly ordered.  Since renumbering requires a
+ * full traversal of the queue, it is deferred until positions are needed
+ * again, so that a burst of removals costs a single pass.
+ *
+ * @param q		the queue to synchronize
+ */
+static void
+parq_upload_queue_sync(struct parq_ul_queue *q)
+{
+	parq_ul_queue_check(q);
+
+	if (!q->recompute)
+		return;
+
+	parq_upload_recompute_positions(q);
+	parq_upload_recompute_relative_positions(q);
+	parq_upload_update_eta(q);
+	q->recompute = FALSE;
+}
+
 /**
  * Set frozen flag on upload entry.
  */
@@ -1692,7 +1690,7 @@ parq_upload_free(struct parq_ul_queued *puq)
 	g_assert(puq->addr_and_name != NULL);
 	g_assert(puq->queue != NULL);
 	g_assert(puq->queue->by_position_length > 0);
-	g_assert(puq->queue->by_position != NULL);
+	g_assert(hash_list_contains(puq->queue->by_position, puq));
 	g_assert(puq->by_addr != NULL);
 	g_assert(puq->by_addr->total > 0);
 	g_assert(puq->by_addr->uploading <= puq->by_addr->total);
@@ -1700,8 +1698,6 @@ parq_upload_free(struct parq_ul_queued *puq)
 	if (puq->u != NULL)
 		puq->u->parq_ul = NULL;
 
-	parq_upload_decrease_all_after(puq);
-
 	if (puq->flags & PARQ_UL_QUEUE)
 		hash_list_remove(ul_parq_queue, puq);
 
@@ -1733,7 +1729,7 @@ parq_upload_free(struct parq_ul_queued *puq)
 	}
 
 	/* Remove the current queued item from all lists */
-	puq->queue->by_position = plist_remove(puq->queue->by_position, puq);
+	hash_list_remove(puq->queue->by_position, puq);
 
 	parq_upload_remove_relative(puq);
 
@@ -1745,22 +1741,13 @@ parq_upload_free(struct parq_ul_queued *puq)
 
 	/*
 	 * Queued upload is now removed from all lists. So queue size can be
-	 * safely decreased and new ETAs can be calculated.
+	 * safely decreased.  New positions and ETAs will be calculated when
+	 * they are next needed, so that removing many entries at once does
+	 * not traverse the whole queue each time.
 	 */
 	g_assert(puq->queue->by_position_length > 0);
 	puq->queue->by_position_length--;
-
-	/*
-	 * Don't update ETA on shutdown, we don't need this information, so speed
-	 * up the shutdown process. Also it is better not doing so as on shutdown
-	 * not all entries are removed the 'correct' way, we just want to free
-	 * the memory
-	 */
-	if (!parq_shutdown) {
-		parq_upload_recompute_positions(puq->queue);
-		parq_upload_recompute_relative_positions(puq->queue);
-		parq_upload_update_eta(puq->queue);
-	}
+	puq->queue->recompute = TRUE;
 
 	/* Free the memory used by the current queued item */
 	HFREE_NULL(puq->addr_and_name);
@@ -1823,6 +1810,7 @@ parq_upload_new_queue(void)
 	queue->magic = PARQ_UL_QUEUE_MAGIC;
 	queue->active = TRUE;
 	queue->slot_stats = statx_make();
+	queue->by_position = hash_list_new(NULL, NULL);
 	queue->by_rel_pos = hash_list_new(NULL, NULL);
 	queue->by_date_dead = hash_list_new(NULL, NULL);
 
@@ -1933,6 +1921,8 @@ parq_upload_create(struct upload *u)
 	q = parq_upload_which_queue(u);
 	g_assert(q != NULL);
 
+	parq_upload_queue_sync(q);
+
 	/* Locate the last alive queued item so we can calculate the ETA */
 	prev_puq = hash_list_tail(q->by_rel_pos);
 
@@ -2004,7 +1994,7 @@ parq_upload_create(struct upload *u)
 	htable_insert(ul_all_parq_by_id, &puq->id, puq);
 
 	q->by_position_length++;
-	q->by_position = plist_append(q->by_position, puq);
+	hash_list_append(q->by_position, puq);
 
 	hash_list_append(puq->queue->by_rel_pos, puq);
 
@@ -2046,7 +2036,7 @@ parq_upload_create(struct upload *u)
 	g_assert(puq->queue != NULL);
 	g_assert(puq->queue->by_position != NULL);
 	g_assert(puq->queue->by_rel_pos != NULL);
-	g_assert(puq->queue->by_position->data != NULL);
+	g_assert(hash_list_tail(puq->queue->by_position) == puq);
 	g_assert(puq->relative_position > 0);
 	g_assert(puq->relative_position <=
 		UNSIGNED(puq->queue->by_position_length));
@@ -2097,6 +2087,7 @@ parq_upload_free_queue(struct parq_ul_queue *queue)
 	ul_parqs_cnt--;
 
 	/* Free memory */
+	hash_list_free(&queue->by_position);
 	hash_list_free(&queue->by_rel_pos);
 	hash_list_free(&queue->by_date_dead);
 	statx_free(queue->slot_stats);
@@ -2757,11 +2748,7 @@ parq_upload_timer(time_t now)
 	PLIST_FOREACH(ul_parqs, queues) {
 		struct parq_ul_queue *q = queues->data;
 
-		if (q->recompute) {
-			parq_upload_recompute_relative_positions(q);
-			parq_upload_update_eta(q);
-			q->recompute = FALSE;
-		}
+		parq_upload_queue_sync(q);
 	}
 
 	pslist_free_null(&to_remove);
@@ -3036,10 +3023,7 @@ parq_upload_freeze_all(struct parq_ul_queued *puq)
 	PLIST_FOREACH(ul_parqs, l) {
 		struct parq_ul_queue *q = l->data;
 
-		if (q->recompute) {
-			parq_upload_recompute_relative_positions(q);
-			q->recompute = FALSE;
-		}
+		parq_upload_queue_sync(q);
 	}
 }
 
@@ -3127,10 +3111,7 @@ parq_upload_unfreeze_all(struct parq_ul_queued *puq)
 	PLIST_FOREACH(ul_parqs, l) {
 		struct parq_ul_queue *q = l->data;
 
-		if (q->recompute) {
-			parq_upload_recompute_relative_positions(q);
-			q->recompute = FALSE;
-		}
+		parq_upload_queue_sync(q);
 	}
 }
 
@@ -3715,6 +3696,7 @@ parq_upload_request(struct upload *u)
 	upload_check(u);
 
 	puq = handle_to_queued(u->parq_ul);
+	parq_upload_queue_sync(puq->queue);
 	org_retry = puq->retry;
 	now = tm_time();
 
@@ -4765,6 +4747,28 @@ parq_upload_lookup_queue_no(const struct upload *u)
 	}
 }
 
+/**
+ * @return the amount of alive PARQ entries waiting for an upload slot.
+ */
+uint
+parq_upload_waiting(void)
+{
+	plist_t *l;
+	uint n = 0;
+
+	PLIST_FOREACH(ul_parqs, l) {
+		const struct parq_ul_queue *q = l->data;
+		int waiting;
+
+		parq_ul_queue_check(q);
+
+		waiting = q->alive - q->frozen - q->active_uploads;
+		n += MAX(0, waiting);
+	}
+
+	return n;
+}
+
 /**
  * @return TRUE if the upload was allowed quickly by PARQ.
  */
@@ -4980,7 +4984,7 @@ parq_upload_save_queue(void)
 	) {
 		struct parq_ul_queue *queue = queues->data;
 
-		PLIST_FOREACH_CALL_DATA(queue->by_position, parq_store, f);
+		hash_list_foreach(queue->by_position, parq_store, f);
 	}
 
 	file_config_close(f, &fp);
@@ -5523,18 +5527,19 @@ parq_close_pre(void)
 	 */
 	for (queues = ul_parqs; queues != NULL; queues = queues->next) {
 		struct parq_ul_queue *queue = queues->data;
+		hash_list_iter_t *iter;
 
-		PLIST_FOREACH(queue->by_position, dl) {
-			struct parq_ul_queued *puq = dl->data;
+		iter = hash_list_iterator(queue->by_position);
 
-			if (puq == NULL)
-				break;
+		while (hash_list_iter_has_next(iter)) {
+			struct parq_ul_queued *puq = hash_list_iter_next(iter);
 
 			puq->by_addr->uploading = 0;
 
 			to_remove = pslist_prepend(to_remove, puq);
 		}
 
+		hash_list_iter_release(&iter);
 		to_removeq = pslist_prepend(to_removeq, queue);
 	}
 
@@ -98,6 +98,7 @@ bool parq_upload_lookup_quick(const struct upload *);
 bool parq_upload_lookup_frozen(const struct upload *);
 
 bool parq_upload_queued(struct upload *);
+uint parq_upload_waiting(void);
 bool parq_upload_remove(struct upload *, bool, bool);
 void parq_upload_collect_stats(const struct upload *);
 void parq_upload_upload_got_freed(struct upload *);
@@ -87,6 +87,7 @@
 #define PCACHE_UHC_MAX_IP	30			/**< Max amount of IP:port returned */
 #define PCACHE_DHT_MAX_IP	10			/**< Max amount of IP:port returned */
 #define PCACHE_TRANSIENT	60			/**< Once every minute */
+#define PCACHE_HOSTS_PERIOD	2			/**< Secs we reuse host selections */
 
 /**
  * Basic pong information.
@@ -116,6 +117,28 @@ enum ping_flag {
 
 static pong_meta_t local_meta;
 
+/**
+ * Kinds of host selections we include in pongs.
+ */
+enum pcache_hosts_kind {
+	PCACHE_HOSTS_ULTRA = 0,		/**< Ultra nodes, for UHC pongs */
+	PCACHE_HOSTS_GUESS,			/**< GUESS hosts, for GUESS pongs */
+	PCACHE_HOSTS_DHT,			/**< DHT nodes, for "DHTIPP" */
+
+	PCACHE_HOSTS_KINDS
+};
+
+/**
+ * Host selections made recently, which we reuse for all the pongs we build
+ * during PCACHE_HOSTS_PERIOD seconds: under ping load, selecting the hosts
+ * is the most expensive part of building a pong.
+ */
+static struct pcache_hosts {
+	time_t stamp;						/**< When selection was made */
+	int count;							/**< Amount of hosts selected */
+	gnet_host_t host[PCACHE_UHC_MAX_IP];
+} pcache_hosts[PCACHE_HOSTS_KINDS][HOST_NET_MAX];
+
 /**
  * Compute the proper net type when requesting cached hosts, depending on the
  * ping flags (what the remote party said it wanted).
@@ -396,6 +419,51 @@ pcache_can_answer_ping(void)
 		inet_can_answer_ping();
 }
 
+/**
+ * Fill `hvec' with up to `hcnt' hosts of the specified kind, reusing the
+ * selection we made for the previous pong if it is still recent enough.
+ *
+ * @return amount of hosts filled.
+ */
+static int
+pcache_fill_hosts(enum pcache_hosts_kind kind, host_net_t net,
+	gnet_host_t *hvec, int hcnt)
+{
+	struct pcache_hosts *ph;
+	time_t now = tm_time();
+	int n;
+
+	STATIC_ASSERT(PCACHE_DHT_MAX_IP <= PCACHE_UHC_MAX_IP);
+	g_assert(UNSIGNED(kind) < PCACHE_HOSTS_KINDS);
+	g_assert(UNSIGNED(net) < HOST_NET_MAX);
+	g_assert(hcnt >= 0);
+
+	ph = &pcache_hosts[kind][net];
+
+	if (0 == ph->stamp || delta_time(now, ph->stamp) >= PCACHE_HOSTS_PERIOD) {
+		switch (kind) {
+		case PCACHE_HOSTS_ULTRA:
+			ph->count = node_fill_ultra(net, ph->host, PCACHE_UHC_MAX_IP);
+			break;
+		case PCACHE_HOSTS_GUESS:
+			ph->count = guess_fill_caught_array(net, TRUE,
+				ph->host, PCACHE_UHC_MAX_IP);
+			break;
+		case PCACHE_HOSTS_DHT:
+			ph->count = dht_fill_random(ph->host, PCACHE_DHT_MAX_IP);
+			break;
+		case PCACHE_HOSTS_KINDS:
+			g_assert_not_reached();
+		}
+		ph->stamp = now;
+	}
+
+	n = MIN(hcnt, ph->count);
+	memcpy(hvec, ph->host, n * sizeof hvec[0]);
+
+	return n;
+}
+
 /**
  * Build pong message.
  *
@@ -561,10 +629,11 @@ build_pong_msg(host_addr_t sender_addr, uint16 sender_port,
 		 */
 
 		if (GNET_PROPERTY(enable_guess) && (flags & (PING_F_QK | PING_F_GUE))) {
-			hcount = guess_fill_caught_array(net, TRUE,
+			hcount = pcache_fill_hosts(PCACHE_HOSTS_GUESS, net,
 				host, PCACHE_UHC_MAX_IP);
 		} else {
-			hcount = node_fill_ultra(net, host, PCACHE_UHC_MAX_IP);
+			hcount = pcache_fill_hosts(PCACHE_HOSTS_ULTRA, net,
+				host, PCACHE_UHC_MAX_IP);
 
 			/*
 			 * If we are missing node connections, be sure to include
@@ -607,7 +676,8 @@ build_pong_msg(host_addr_t sender_addr, uint16 sender_port,
 		gnet_host_t host[PCACHE_DHT_MAX_IP];
 		int hcount;
 
-		hcount = dht_fill_random(host, N_ITEMS(host));
+		hcount = pcache_fill_hosts(PCACHE_HOSTS_DHT, HOST_NET_BOTH,
+			host, N_ITEMS(host));
 
 		if (hcount > 0) {
 			ggept_dhtipp_pack(&gs, host, hcount,
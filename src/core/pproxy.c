@@ -89,6 +89,8 @@
 
 #include "lib/override.h"		/* Must be the last header included */
 
+#define PPROXY_MAX_REQUESTS	64	/**< Max requests served per connection */
+
 /***
  *** Server-side of push-proxy
  ***/
@@ -101,6 +103,9 @@ static void pproxy_error_remove(struct pproxy *pp, int code,
 	const char *msg, ...) G_PRINTF(3, 4);
 
 static struct socket_ops pproxy_socket_ops;
+static const struct io_error pproxy_io_error;
+
+static void call_pproxy_request(void *obj, header_t *header);
 
 /**
  * Get rid of all the resources attached to the push-proxy struct.
@@ -268,6 +273,63 @@ pproxy_error_remove(struct pproxy *pp, int code, const char *msg, ...)
 	va_end(args);
 }
 
+/**
+ * Called when a push-proxy request was successfully handled.
+ *
+ * If the connection is persistent, wait for the next request on the same
+ * socket, otherwise remove the push-proxy entry, logging the reason.
+ */
+static void G_PRINTF(2, 3)
+pproxy_request_done(struct pproxy *pp, const char *reason, ...)
+{
+	struct gnutella_socket *s = pp->socket;
+	va_list args;
+
+	pproxy_check(pp);
+	g_assert(pp->error_sent != 0);
+
+	if (!pp->keep_alive || ++pp->requests >= PPROXY_MAX_REQUESTS) {
+		va_start(args, reason);
+		pproxy_remove_v(pp, reason, args);
+		va_end(args);
+		return;
+	}
+
+	if (GNET_PROPERTY(push_proxy_debug) > 1) {
+		char buf[256];
+
+		va_start(args, reason);
+		str_vbprintf(ARYLEN(buf), reason, args);
+		va_end(args);
+
+		g_debug("push-proxy: served request #%u from %s (%s): %s",
+			pp->requests, host_addr_to_string(s->addr),
+			pproxy_vendor_str(pp), buf);
+	}
+
+	/*
+	 * Reset the per-request state and read the next request.
+	 */
+
+	atom_guid_free_null(&pp->guid);
+	io_free(pp->io_opaque);
+	g_assert(NULL == pp->io_opaque);
+	getline_free_null(&s->getline);
+
+	pp->error_sent = 0;
+	pp->addr_v4 = zero_host_addr;
+	pp->addr_v6 = zero_host_addr;
+	pp->port = 0;
+	pp->file_idx = 0;
+	pp->flags = 0;
+	pp->keep_alive = FALSE;
+	pp->last_update = tm_time();
+
+	io_get_header(pp, &pp->io_opaque, BSCHED_BWS_IN, s,
+		IO_HEAD_ONLY | IO_SAVE_FIRST, call_pproxy_request, NULL,
+		&pproxy_io_error);
+}
+
 /**
  * Push proxy timer.
  */
@@ -732,6 +794,7 @@ pproxy_request(struct pproxy *pp, header_t *header)
 	char *user_agent;
 	pslist_t *nodes;
 	bool supports_tls = FALSE;
+	uint http_major = 0, http_minor = 0;
 
 	if (GNET_PROPERTY(push_proxy_trace) & SOCK_TRACE_IN) {
 		g_debug("----Push-proxy request from %s:\n%s",
@@ -746,7 +809,25 @@ pproxy_request(struct pproxy *pp, header_t *header)
 	token = header_get(header, "X-Token");
 	user_agent = header_get(header, "User-Agent");
 
-	pp->user_agent = validate_vendor(user_agent, token, s->addr);
+	if (NULL == pp->user_agent)
+		pp->user_agent = validate_vendor(user_agent, token, s->addr);
+
+	/*
+	 * Do we have to keep the connection after this request?
+	 *
+	 * Firewalled servents downloading through us can then send several
+	 * push requests without paying for a new TCP connection each time.
+	 */
+
+	(void) http_extract_version(request, getline_length(s->getline),
+		&http_major, &http_minor);
+
+	buf = header_get(header, "Connection");
+
+	if (http_major > 1 || (1 == http_major && http_minor >= 1))
+		pp->keep_alive = NULL == buf || 0 != ascii_strcasecmp(buf, "close");
+	else
+		pp->keep_alive = buf != NULL && 0 == ascii_strcasecmp(buf, "keep-alive");
 
 	/*
 	 * Determine the servent ID.
@@ -851,11 +932,12 @@ pproxy_request(struct pproxy *pp, header_t *header)
 			gmsg_sendto_one(n, packet.data, packet.size);
 			gnet_stats_inc_general(GNR_PUSH_PROXY_TCP_RELAYED);
 
-			http_send_status(HTTP_PUSH_PROXY, pp->socket, 202, FALSE, NULL, 0,
+			http_send_status(HTTP_PUSH_PROXY, pp->socket, 202,
+					pp->keep_alive, NULL, 0,
 					HTTP_ATOMIC_SEND, "Push-proxy: message sent to node");
 
 			pp->error_sent = 202;
-			pproxy_remove(pp, "Push sent directly to node GUID %s",
+			pproxy_request_done(pp, "Push sent directly to node GUID %s",
 					guid_hex_str(pp->guid));
 		}
 
@@ -891,13 +973,15 @@ pproxy_request(struct pproxy *pp, header_t *header)
 
 			cnt = pslist_length(nodes);
 
-			http_send_status(HTTP_PUSH_PROXY, pp->socket, 203, FALSE, NULL, 0,
+			http_send_status(HTTP_PUSH_PROXY, pp->socket, 203,
+					pp->keep_alive, NULL, 0,
 					HTTP_ATOMIC_SEND,
 					"Push-proxy: message sent through Gnutella "
 					"(via %zd node%s)", cnt, plural(cnt));
 
 			pp->error_sent = 203;
-			pproxy_remove(pp, "Push sent via Gnutella (%zd node%s) for GUID %s",
+			pproxy_request_done(pp,
+					"Push sent via Gnutella (%zd node%s) for GUID %s",
 					cnt, plural(cnt), guid_hex_str(pp->guid));
 		}
 
@@ -914,13 +998,15 @@ pproxy_request(struct pproxy *pp, header_t *header)
 		upload_send_giv(pp->addr_v4, pp->port, 0, 1, 0,
 			"<from push-proxy>", pp->flags);
 
-		http_send_status(HTTP_PUSH_PROXY, pp->socket, 202, FALSE, NULL, 0,
+		http_send_status(HTTP_PUSH_PROXY, pp->socket, 202,
+			pp->keep_alive, NULL, 0,
 			HTTP_ATOMIC_SEND,
 			"Push-proxy: you found the target GUID %s",
 			guid_hex_str(pp->guid));
 
 		pp->error_sent = 202;
-		pproxy_remove(pp, "Push was for our GUID %s", guid_hex_str(pp->guid));
+		pproxy_request_done(pp, "Push was for our GUID %s",
+			guid_hex_str(pp->guid));
 
 		return;
 	}
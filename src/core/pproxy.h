@@ -66,6 +66,8 @@ struct pproxy {
 	uint32 file_idx;		/**< File index to request (0 if none supplied) */
 	uint32 flags;
 	void *io_opaque;		/**< Opaque I/O callback information */
+	uint requests;			/**< Requests served on this connection */
+	uint8 keep_alive;		/**< Whether connection persists after request */
 };
 
 static inline void
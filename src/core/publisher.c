@@ -65,8 +65,11 @@
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
 #include "lib/file.h"
+#include "lib/hashing.h"
+#include "lib/hashlist.h"
 #include "lib/hikset.h"
 #include "lib/misc.h"
+#include "lib/random.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
@@ -83,6 +86,9 @@
 #define PUBLISH_TRANSIENT	7200	/**< less than 2 hours => transient node */
 #define PUBLISH_DMESH_MAX	5		/**< File popularity by dmesh entry count */
 #define PUBLISH_PARTIAL_MAX	1		/**< Partial file popularity (dmesh) */
+#define PUBLISH_MIN_BURST	4		/**< Min amount of publishes per heartbeat */
+#define PUBLISH_RATE_MARGIN	2		/**< Spare publishing capacity factor */
+#define PUBLISH_JITTER		8		/**< Republish up to 1/8 of delay earlier */
 
 #define PUBLISH_DB_CACHE_SIZE	128		/**< Amount of data to keep cached */
 #define PUBLISH_SYNC_PERIOD		60000	/**< Flush DB every minute */
@@ -122,6 +128,7 @@ struct publisher_entry {
 	time_t last_enqueued;		/**< When file was last enqueued */
 	time_t last_publish;		/**< When file was last published */
 	time_t last_delayed;		/**< When republish event was set */
+	hash_list_t *queue;			/**< Rate-limiting queue, if waiting */
 	uint8 backgrounded;			/**< Whether PDHT is continuing publishing */
 };
 
@@ -134,6 +141,20 @@ publisher_check(const struct publisher_entry *pe)
 
 static hikset_t *publisher_sha1;	/** Known entries by SHA1 */
 
+/**
+ * Entries ready to be published but waiting for publishing credits.
+ *
+ * Rare entries (no alternate location known in the download mesh) are
+ * served before the others since they benefit most from being in the DHT.
+ */
+static hash_list_t *publisher_rare;
+static hash_list_t *publisher_common;
+
+/**
+ * Amount of publishes we can still launch during this heartbeat.
+ */
+static unsigned publisher_credits;
+
 /**
  * Private callout queue used to trigger republish events.
  */
@@ -231,6 +252,9 @@ publisher_entry_free(struct publisher_entry *pe, bool do_remove)
 	if (pe->backgrounded)
 		pdht_cancel_file(pe->sha1, FALSE);
 
+	if (pe->queue != NULL)
+		hash_list_remove(pe->queue, pe);
+
 	atom_sha1_free_null(&pe->sha1);
 	cq_cancel(&pe->publish_ev);
 	WFREE(pe);
@@ -410,6 +434,14 @@ publisher_done(void *arg, pdht_error_t code, const pdht_info_t *info)
 
 		delay = publisher_delay(info, DHT_VALUE_ALOC_EXPIRE);
 		accepted = publisher_is_acceptable(info);
+
+		/*
+		 * Randomly republish a little earlier so that entries published
+		 * at the same time (after a restart or a library rescan) drift
+		 * apart instead of all coming back together at each round.
+		 */
+
+		delay -= random_value(delay / PUBLISH_JITTER);
 		break;
 	case PDHT_E_POPULAR:
 		/*
@@ -558,6 +590,7 @@ publisher_handle(struct publisher_entry *pe)
 
 	publisher_check(pe);
 	g_assert(NULL == pe->publish_ev);
+	g_assert(NULL == pe->queue);
 
 	sf = shared_file_by_sha1(pe->sha1);
 
@@ -726,6 +759,26 @@ publisher_handle(struct publisher_entry *pe)
 		pe->backgrounded = FALSE;
 	}
 
+	/*
+	 * If we ran out of publishing credits for this heartbeat, queue the
+	 * entry: it will be handled again by publisher_heartbeat().
+	 */
+
+	if (0 == publisher_credits) {
+		pe->queue = 0 == alt_locs ? publisher_rare : publisher_common;
+		hash_list_append(pe->queue, pe);
+
+		if (GNET_PROPERTY(publisher_debug) > 3) {
+			g_debug("PUBLISHER SHA-1 %s queued (%s), %zu rare + %zu common",
+				sha1_to_string(pe->sha1), 0 == alt_locs ? "rare" : "common",
+				hash_list_count(publisher_rare),
+				hash_list_count(publisher_common));
+		}
+		goto done;
+	}
+
+	publisher_credits--;
+
 	/*
 	 * OK, we can publish this alternate location.
 	 */
@@ -747,6 +800,55 @@ done:
 	shared_file_unref(&sf);
 }
 
+/**
+ * Periodic heartbeat, replenishing publishing credits and handling queued
+ * entries, rare ones first.
+ *
+ * The amount of credits is computed so that all the known entries can be
+ * published evenly over the lifetime of the ALOC values, with some margin
+ * for retries.  This prevents bursts of publishing after a restart or a
+ * library rescan from saturating the DHT outgoing queue.
+ *
+ * @return TRUE to keep the periodic event.
+ */
+static bool
+publisher_heartbeat(void *unused_obj)
+{
+	size_t count = hikset_count(publisher_sha1);
+	uint64 rate;
+
+	(void) unused_obj;
+
+	rate = PUBLISH_RATE_MARGIN * (uint64) count * PUBLISHER_CALLOUT /
+		((DHT_VALUE_ALOC_EXPIRE - PUBLISH_SAFETY) * 1000);
+	publisher_credits = MAX(rate + 1, PUBLISH_MIN_BURST);
+
+	if (GNET_PROPERTY(publisher_debug) > 4) {
+		g_debug("PUBLISHER %u credit%s for %zu entr%s, "
+			"%zu rare + %zu common queued",
+			publisher_credits, plural(publisher_credits),
+			count, plural_y(count),
+			hash_list_count(publisher_rare),
+			hash_list_count(publisher_common));
+	}
+
+	while (publisher_credits != 0) {
+		struct publisher_entry *pe;
+
+		pe = hash_list_shift(publisher_rare);
+		if (NULL == pe)
+			pe = hash_list_shift(publisher_common);
+		if (NULL == pe)
+			break;
+
+		publisher_check(pe);
+		pe->queue = NULL;
+		publisher_handle(pe);		/* Will consume a credit if published */
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
 /**
  * Record a SHA1 for publishing.
  */
@@ -960,7 +1062,12 @@ publisher_init(void)
 		db_pubdata_base, kv, packing, PUBLISH_DB_CACHE_SIZE,
 		sha1_hash, sha1_eq, GNET_PROPERTY(dht_storage_in_memory));
 
+	publisher_rare = hash_list_new(pointer_hash, NULL);
+	publisher_common = hash_list_new(pointer_hash, NULL);
+	publisher_credits = PUBLISH_MIN_BURST;
+
 	cq_periodic_add(publish_cq, PUBLISH_SYNC_PERIOD, publisher_sync, NULL);
+	cq_periodic_add(publish_cq, PUBLISHER_CALLOUT, publisher_heartbeat, NULL);
 
 	for (i = 0; i < N_ITEMS(inverse_decimation); i++) {
 		double n = i + 1.0;
@@ -1038,6 +1145,8 @@ publisher_close(void)
 
 	hikset_foreach(publisher_sha1, free_entry, NULL);
 	hikset_free_null(&publisher_sha1);
+	hash_list_free(&publisher_rare);
+	hash_list_free(&publisher_common);
 
 	dbstore_close(db_pubdata, settings_dht_db_dir(), db_pubdata_base);
 	db_pubdata = NULL;
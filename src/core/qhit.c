@@ -720,6 +720,18 @@ add_file(const shared_file_t *sf)
 		found_insert(sha1);		/* SHA1 are atoms, address is unique */
 
 		needed += 9 + SHA1_BASE32_SIZE;
+
+		/*
+		 * Do not bother looking up alt-locs if the entry would not fit
+		 * even without them.
+		 */
+
+		if (
+			found_size() + needed + QHIT_MIN_TRAILER_LEN
+				> GNET_PROPERTY(search_answers_forward_size)
+		)
+			return FALSE;
+
 		hcnt = dmesh_fill_alternate(sha1, hvec, N_ITEMS(hvec));
 		needed += hcnt * 18 + 6;	/* Conservative, assumes IPv6 only */
 	}
@@ -79,6 +79,7 @@
 #include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/utf8.h"
+#include "lib/vsort.h"
 #include "lib/walloc.h"
 #include "lib/wordvec.h"
 #include "lib/zlib_util.h"
@@ -97,6 +98,7 @@
 #define MAX_TABLE_SIZE		(1 << MAX_TABLE_BITS)
 #define MAX_UP_TABLE_SIZE	131072 /**< Max size for inter-UP QRP: 128 Kslots */
 #define EMPTY_TABLE_SIZE	8
+#define QRT_TARGET_INLINE	64		/**< Candidates kept on the stack */
 
 #define qrp_debugging(lvl)	G_UNLIKELY(GNET_PROPERTY(qrp_debug) > (lvl))
 
@@ -255,6 +257,8 @@ void test_hash(void);
 static bool qrp_can_route_default(
 	const query_hashvec_t *qhv, const struct routing_table *rt);
 static void qrt_patch_fire_ready(struct routing_patch *rp);
+static void qrt_diff_cache_clear(void);
+static void qrt_diff_done(struct qrt_update *qup, bgstatus_t status);
 
 /**
  * Generate a description of the patch into a static string.
@@ -1056,6 +1060,14 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 	task = bg_task_create_stopped(NULL, "QRP patch compression",
 		&step, 1, ctx, qrt_compress_free, qrt_patch_compress_done, bt);
 
+	/*
+	 * Compression only touches the private context, hence it can safely
+	 * run in a worker thread instead of the main thread.
+	 */
+
+	if (task != NULL)
+		bg_task_set_threaded(task);
+
 	return task;		/* Can be NULL if bg task layer was shutdown already */
 }
 
@@ -1421,13 +1433,29 @@ merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
 	 *
 	 * Furthermore, we avoid repeated RT_SLOT_READ() calls by accessing the
 	 * compacted table one byte at a time and then looping on each of its bits.
+	 *
+	 * Leaf tables are sparse, so we skip empty bytes altogether, and even
+	 * runs of 8 empty bytes (64 slots) with a single 64-bit read.
 	 */
 
 #define RT_FOR_EACH_BIT_SET(ON_CHANGE)				\
-for (b = 0, i = 0; b < bytes; b++) {				\
-	uint8 entry = rt->arena[b];						\
+for (b = 0, i = 0; b < bytes; /* empty */) {		\
+	uint8 entry;									\
 	unsigned mask = 0x80;							\
 													\
+	if (											\
+		0 == (b & 0x7) && b + 8 <= bytes &&			\
+		0 == peek_le64(&rt->arena[b])				\
+	) {												\
+		b += 8;										\
+		i += 64;									\
+		continue;									\
+	}												\
+	entry = rt->arena[b++];							\
+	if (0 == entry) {								\
+		i += 8;										\
+		continue;									\
+	}												\
 	do {											\
 		/* "0 OR x = x", hence skip unset bits */	\
 		if (entry & mask) {							\
@@ -1888,6 +1916,7 @@ struct qrp_context {
 	struct routing_table **rtp;	/**< Points to routing table variable to fill */
 	struct routing_patch **rpp;	/**< Points to routing patch variable to fill */
 	pslist_t *sl_substrings;	/**< List of all substrings */
+	uint32 *hashes;				/**< Sorted QRP hash codes of substrings */
 	htable_t *words;			/**< Words making up the files */
 	bgtask_t *compress_bt;		/**< Task launched to compress patch */
 	int substrings;				/**< Amount of substrings */
@@ -1906,6 +1935,15 @@ struct qrp_context {
 static struct bgtask *qrp_comp;	/**< Background computation handle */
 static struct bgtask *qrp_merge;/**< Background merging handle */
 
+/*
+ * The sorted hash codes of the substrings from which the current local
+ * table was built.  The table is entirely determined by them, so when a
+ * library rescan yields the same hash codes, there is no need to rebuild
+ * the table and recompute the patches.
+ */
+static uint32 *qrp_last_hashes;	/**< Hash codes of the local table */
+static int qrp_last_count;		/**< Amount of hash codes */
+
 /**
  * Free the "seen words" hash table we're filling up in qrp_add_file()
  * and perusing in qrp_finalize_computation(), then nullify pointer.
@@ -1944,6 +1982,7 @@ qrp_context_free(void *p)
 	}
 	pslist_free_null(&ctx->sl_substrings);
 
+	HFREE_NULL(ctx->hashes);
 	HFREE_NULL(ctx->table);
 
 	if (ctx->rt)
@@ -2000,15 +2039,40 @@ qrp_cancel_computation(void)
 	QRP_TASK_UNLOCK;
 }
 
+/**
+ * vsort() callback for sorting QRP hash codes.
+ */
+static int
+qrp_hashcode_cmp(const void *a, const void *b)
+{
+	uint32 h1 = *(const uint32 *) a;
+	uint32 h2 = *(const uint32 *) b;
+
+	return CMP(h1, h2);
+}
+
+/**
+ * Remember the hash codes from which the local table was computed.
+ */
+static void
+qrp_record_hashes(struct qrp_context *ctx)
+{
+	HFREE_NULL(qrp_last_hashes);
+	qrp_last_hashes = ctx->hashes;
+	qrp_last_count = ctx->substrings;
+	ctx->hashes = NULL;		/* Now owned by qrp_last_hashes */
+}
+
 /**
  * Compute all the substrings we need to insert.
  */
 static bgret_t
-qrp_step_substring(struct bgtask *unused_h, void *u, int unused_ticks)
+qrp_step_substring(struct bgtask *h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
+	const pslist_t *sl;
+	int i = 0;
 
-	(void) unused_h;
 	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
 	g_assert(ctx->words != NULL);
@@ -2019,6 +2083,43 @@ qrp_step_substring(struct bgtask *unused_h, void *u, int unused_ticks)
 	if (qrp_debugging(1))
 		g_debug("QRP unique subwords: %d", ctx->substrings);
 
+	/*
+	 * The slot of a word in a table of 2^b slots is given by the leading
+	 * b bits of its 32-bit hash code, so we compute these hash codes once
+	 * for all the table sizes we may attempt.
+	 *
+	 * Sorting them makes the filling of the tables sequential and allows
+	 * us to detect that the table would be unchanged.
+	 */
+
+	HALLOC_ARRAY(ctx->hashes, MAX(1, ctx->substrings));
+
+	PSLIST_FOREACH(ctx->sl_substrings, sl) {
+		g_assert(i < ctx->substrings);
+		ctx->hashes[i++] = qrp_hashcode(sl->data);
+		if (qrp_debugging(7))
+			g_debug("QRP subword: \"%s\"", (const char *) sl->data);
+	}
+
+	g_assert(i == ctx->substrings);
+
+	vsort(ctx->hashes, ctx->substrings, sizeof ctx->hashes[0],
+		qrp_hashcode_cmp);
+
+	if (
+		routing_table != NULL && !routing_table->cancelled &&
+		local_table != NULL && qrp_last_hashes != NULL &&
+		qrp_last_count == ctx->substrings &&
+		0 == memcmp(qrp_last_hashes, ctx->hashes,
+			ctx->substrings * sizeof ctx->hashes[0])
+	) {
+		if (qrp_debugging(1)) {
+			g_debug("QRP no change in subwords, keeping generation #%d",
+				local_table->generation);
+		}
+		bg_task_exit(h, 0);		/* Abort processing */
+	}
+
 	return BGR_NEXT;		/* All done for this step */
 }
 
@@ -2063,15 +2164,16 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 	char *table = NULL;
 	int slots;
 	int bits;
-	const pslist_t *sl;
 	int upper_thresh;
 	int hashed = 0;
 	int filled = 0;
 	int conflict_ratio;
 	bool full = FALSE;
+	int i;
 
 	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
+	g_assert(ctx->hashes != NULL);
 
 	/*
 	 * Build QR table: we try to achieve a minimum sparse ratio (empty
@@ -2087,17 +2189,14 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 	table = halloc(slots);
 	memset(table, LOCAL_INFINITY, slots);
 
-	PSLIST_FOREACH(ctx->sl_substrings, sl) {
-		const char *word = sl->data;
-		uint idx = qrp_hash(word, bits);
+	for (i = 0; i < ctx->substrings; i++) {
+		uint idx = ctx->hashes[i] >> (32 - bits);
 
 		hashed++;
 
 		if (table[idx] == LOCAL_INFINITY) {
 			table[idx] = 1;
 			filled++;
-			if (qrp_debugging(7))
-				g_debug("QRP added subword: \"%s\"", word);
 		}
 
 		/*
@@ -2211,6 +2310,7 @@ qrp_step_create_table(struct bgtask *unused_h, void *u, int unused_ticks)
 	ctx->rt = qrt_create("Local table", ctx->table, ctx->slots, LOCAL_INFINITY);
 	qrt_ref(ctx->rt);		/* Created with refcnt=0 */
 	ctx->table = NULL;		/* Don't free table when freeing context */
+	qrp_record_hashes(ctx);
 
 	QRP_TASK_LOCK;
 
@@ -2227,6 +2327,7 @@ qrp_step_create_table(struct bgtask *unused_h, void *u, int unused_ticks)
 	 */
 
 	qrt_patches_clear();
+	qrt_diff_cache_clear();
 
 	elapsed = delta_time(tm_time(), (time_t) GNET_PROPERTY(qrp_timestamp));
 	elapsed = MAX(0, elapsed);
@@ -3219,6 +3320,7 @@ struct qrt_update {
 	int last_sent;				 /**< Amount sent during last batch */
 	void *compress;				 /**< Compressing task (NULL = done) */
 	void *listener;				 /**< Listener for default patch being ready */
+	struct qrt_diff *diff;		 /**< Shared patch we compress or wait for */
 	time_t last;				 /**< Time at which we sent the last batch */
 	unsigned ready:1;			 /**< Ready for sending? */
 	unsigned reset_needed:1;	 /**< Is the initial RESET needed? */
@@ -3263,6 +3365,9 @@ qrt_compressed(struct bgtask *unused_h, void *unused_u,
 	qup->compress = NULL;
 	qup->ready = TRUE;
 
+	if (qup->diff != NULL)
+		qrt_diff_done(qup, status);
+
 	if (qrp_debugging(2)) {
 		g_debug("%s(): QRP patch %p compression done for %s, status=%s",
 			G_STRFUNC, qup->patch, node_infostr(qup->node),
@@ -3430,6 +3535,211 @@ qrt_patch_available(void *arg, struct routing_patch *rp)
 	return TRUE;
 }
 
+/*
+ * Cache of compressed incremental patches.
+ *
+ * When our routing table changes, all the connections to which we had
+ * propagated the same previous table need the very same patch.  Instead
+ * of compressing that patch once per connection, the first update needing
+ * it compresses it and the others wait for the result, which is then kept
+ * until the next routing table is installed.
+ *
+ * Patches are identified by the generation numbers of the two tables and
+ * by the kind of patch (4-bit, 1-bit or byte-reversed 1-bit for G2).
+ */
+
+enum qrt_diff_kind {
+	QRT_DIFF_4 = 0,
+	QRT_DIFF_1,
+	QRT_DIFF_1_REV
+};
+
+#define QRT_DIFF_CACHE		8		/**< Amount of cached patches */
+
+struct qrt_diff {
+	struct routing_patch *patch;	/**< Compressed patch, NULL if pending */
+	struct qrt_update *owner;		/**< Update compressing the patch */
+	pslist_t *waiters;				/**< Updates waiting for the patch */
+	int old_generation;				/**< Generation of the old table */
+	int new_generation;				/**< Generation of the new table */
+	enum qrt_diff_kind kind;		/**< Kind of patch */
+	bool used;						/**< Whether entry is used */
+};
+
+static struct qrt_diff qrt_diff_cache[QRT_DIFF_CACHE];
+static uint qrt_diff_next;			/**< Next entry to recycle */
+
+/**
+ * Compress the patch computed for the connection.
+ */
+static void
+qrt_update_compress(struct qrt_update *qup)
+{
+	g_assert(qup->magic == QRT_UPDATE_MAGIC);
+	g_assert(qup->patch != NULL);
+
+	if (qrp_debugging(1)) {
+		g_debug("QRP compressing %s %p for %s",
+			qrp_patch_to_string(qup->patch), qup->patch,
+			node_infostr(qup->node));
+	}
+
+	qup->compress =
+		qrt_patch_compress(qup->patch, NULL, qrt_compressed, qup, NULL);
+	if (qup->compress != NULL)
+		bg_task_run(qup->compress);
+}
+
+/**
+ * Release a cache entry.
+ *
+ * Updates still waiting for the patch compress their own copy instead.
+ */
+static void
+qrt_diff_release(struct qrt_diff *d)
+{
+	pslist_t *waiters = d->waiters;
+	pslist_t *sl;
+
+	if (d->patch != NULL)
+		qrt_patch_unref(d->patch);
+	if (d->owner != NULL)
+		d->owner->diff = NULL;
+
+	ZERO(d);
+
+	PSLIST_FOREACH(waiters, sl) {
+		struct qrt_update *qup = sl->data;
+
+		g_assert(qup->magic == QRT_UPDATE_MAGIC);
+
+		qup->diff = NULL;
+		qrt_update_compress(qup);
+	}
+
+	pslist_free(waiters);
+}
+
+/**
+ * Clear the cache of compressed incremental patches.
+ */
+static void
+qrt_diff_cache_clear(void)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(qrt_diff_cache); i++) {
+		if (qrt_diff_cache[i].used)
+			qrt_diff_release(&qrt_diff_cache[i]);
+	}
+}
+
+/**
+ * Lookup cached patch between two table generations.
+ *
+ * @return the cache entry if found, NULL otherwise.
+ */
+static struct qrt_diff *
+qrt_diff_lookup(int old_generation, int new_generation, enum qrt_diff_kind kind)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(qrt_diff_cache); i++) {
+		struct qrt_diff *d = &qrt_diff_cache[i];
+
+		if (
+			d->used && d->kind == kind &&
+			d->old_generation == old_generation &&
+			d->new_generation == new_generation
+		)
+			return d;
+	}
+
+	return NULL;
+}
+
+/**
+ * Record that the update is going to compress the patch between the two
+ * table generations, so that other updates can wait for it.
+ */
+static void
+qrt_diff_insert(struct qrt_update *qup,
+	int old_generation, int new_generation, enum qrt_diff_kind kind)
+{
+	struct qrt_diff *d;
+
+	d = &qrt_diff_cache[qrt_diff_next];
+	qrt_diff_next = (qrt_diff_next + 1) % N_ITEMS(qrt_diff_cache);
+
+	if (d->used)
+		qrt_diff_release(d);
+
+	d->used = TRUE;
+	d->owner = qup;
+	d->old_generation = old_generation;
+	d->new_generation = new_generation;
+	d->kind = kind;
+
+	qup->diff = d;
+}
+
+/**
+ * Detach a waiting update from the cache entry.
+ */
+static void
+qrt_diff_detach(struct qrt_update *qup)
+{
+	struct qrt_diff *d = qup->diff;
+
+	g_assert(d != NULL);
+	g_assert(d->owner != qup);
+
+	d->waiters = pslist_remove(d->waiters, qup);
+	qup->diff = NULL;
+}
+
+/**
+ * Called when the compression of a shared patch is done.
+ *
+ * On success, the compressed patch is kept in the cache and handed to all
+ * the waiting updates.  Otherwise the entry is released and the waiting
+ * updates compress their own patch.
+ */
+static void
+qrt_diff_done(struct qrt_update *qup, bgstatus_t status)
+{
+	struct qrt_diff *d = qup->diff;
+	pslist_t *waiters, *sl;
+
+	g_assert(d != NULL);
+	g_assert(d->owner == qup);
+
+	d->owner = NULL;
+	qup->diff = NULL;
+
+	if (status != BGS_OK || NULL == qup->patch) {
+		qrt_diff_release(d);
+		return;
+	}
+
+	d->patch = qrt_patch_ref(qup->patch);
+	waiters = d->waiters;
+	d->waiters = NULL;
+
+	PSLIST_FOREACH(waiters, sl) {
+		struct qrt_update *w = sl->data;
+
+		g_assert(w->magic == QRT_UPDATE_MAGIC);
+
+		w->diff = NULL;
+		qrt_patch_unref(w->patch);
+		w->patch = qrt_patch_ref(d->patch);
+		qrt_compressed(NULL, NULL, BGS_OK, w);
+	}
+
+	pslist_free(waiters);
+}
+
 /**
  * Create structure keeping track of the table update.
  * Call qrt_update_send_next() to send the next patching message.
@@ -3532,6 +3842,8 @@ qrt_update_create(gnutella_node_t *n, struct routing_table *query_table)
 				qrt_patch_computed_add_listener(qrt_patch_available, qup);
 		}
 	} else {
+		enum qrt_diff_kind kind;
+
 		/*
 		 * The compression call may take a while, in the background.
 		 * When compression is done, `qup->compress' will be set to NULL.
@@ -3539,23 +3851,50 @@ qrt_update_create(gnutella_node_t *n, struct routing_table *query_table)
 		 */
 
 		if (NODE_TALKS_G2(n)) {
+			kind = QRT_DIFF_1_REV;
 			qup->patch = qrt_diff_1(old_table, routing_table, TRUE);
 		} else if (NODE_CAN_QRP1(n)) {
+			kind = QRT_DIFF_1;
 			qup->patch = qrt_diff_1(old_table, routing_table, FALSE);
 		} else {
+			kind = QRT_DIFF_4;
 			qup->patch = qrt_diff_4(old_table, routing_table);
 		}
 
 		if (qup->patch != NULL) {
-			if (qrp_debugging(1)) {
-				g_debug("QRP compressing %s %p for %s",
-					qrp_patch_to_string(qup->patch), qup->patch,
-					node_infostr(n));
+			struct qrt_diff *d;
+
+			/*
+			 * Other connections may have needed the same patch already,
+			 * in which case we reuse its compressed form, or wait for it
+			 * if it is still being compressed.  We keep our uncompressed
+			 * patch in case that compression does not complete.
+			 */
+
+			d = qrt_diff_lookup(
+				old_table->generation, routing_table->generation, kind);
+
+			if (d != NULL && d->patch != NULL) {
+				if (qrp_debugging(1)) {
+					g_debug("QRP reusing compressed %s %p for %s",
+						qrp_patch_to_string(d->patch), d->patch,
+						node_infostr(n));
+				}
+				qrt_patch_unref(qup->patch);
+				qup->patch = qrt_patch_ref(d->patch);
+				qrt_compressed(NULL, NULL, BGS_OK, qup);
+			} else if (d != NULL) {
+				if (qrp_debugging(1)) {
+					g_debug("QRP waiting for %s being compressed for %s",
+						qrp_patch_to_string(qup->patch), node_infostr(n));
+				}
+				d->waiters = pslist_prepend(d->waiters, qup);
+				qup->diff = d;
+			} else {
+				qrt_diff_insert(qup,
+					old_table->generation, routing_table->generation, kind);
+				qrt_update_compress(qup);
 			}
-			qup->compress =
-				qrt_patch_compress(qup->patch, NULL, qrt_compressed, qup, NULL);
-			if (qup->compress != NULL)
-				bg_task_run(qup->compress);
 		} else {
 			if (qrp_debugging(1)) {
 				g_debug("QRP no patch necessary for %s", node_infostr(n));
@@ -3583,6 +3922,13 @@ qrt_update_free(struct qrt_update *qup)
 
 	g_assert(qup->compress == NULL);	/* Reset by qrt_compressed() */
 
+	if (qup->diff != NULL) {
+		if (qup->diff->owner == qup)
+			qrt_diff_release(qup->diff);	/* Compression never started */
+		else
+			qrt_diff_detach(qup);
+	}
+
 	if (qup->listener)
 		qrt_patch_computed_remove_listener(qup->listener);
 
@@ -5104,6 +5450,7 @@ qrp_close(void)
 		qrt_unref(routing_table);
 
 	qrt_patches_clear();
+	qrt_diff_cache_clear();
 
 	if (local_table)
 		qrt_unref(local_table);
@@ -5111,6 +5458,7 @@ qrp_close(void)
 	if (merged_table)
 		qrt_unref(merged_table);
 
+	HFREE_NULL(qrp_last_hashes);
 	HFREE_NULL(buffer.arena);
 }
 
@@ -5379,6 +5727,18 @@ qrp_can_route_default(const query_hashvec_t *qhv, const struct routing_table *rt
 	return word < 3 ? hit == word : 3 * hit / word >= 2;
 }
 
+/**
+ * Check whether a query identified by its hash vector matches the
+ * routing table.
+ */
+bool
+qrt_can_route(const struct routing_table *rt, const query_hashvec_t *qhv)
+{
+	return qhv->has_urn ?
+	   rt->can_route_urn(qhv, rt) :
+	   rt->can_route(qhv, rt);
+}
+
 /**
  * Check whether we can route a query identified by its hash vector
  * to a node.
@@ -5399,9 +5759,145 @@ qrp_node_can_route(const gnutella_node_t *n, const query_hashvec_t *qhv)
 	if G_UNLIKELY(rt == NULL)
 		return NODE_IS_LEAF(n) ? FALSE : TRUE;
 
-	return qhv->has_urn ?
-	   rt->can_route_urn(qhv, rt) :
-	   rt->can_route(qhv, rt);
+	return qrt_can_route(rt, qhv);
+}
+
+/**
+ * Amount of routing tables we look ahead when batching QRP lookups.
+ *
+ * Each lookup is a random read in a (possibly large) arena, likely to miss
+ * in the CPU cache.  By prefetching the slots of the tables coming next
+ * while we test the current one, the memory accesses for several tables
+ * proceed in parallel instead of being serialized.
+ */
+#define QRT_BATCH_AHEAD		4
+
+/**
+ * Prefetch the routing table slots that will be read when checking whether
+ * the query hash vector can be routed through the table.
+ */
+static inline void
+qrt_prefetch_slots(const query_hashvec_t *qhv, const struct routing_table *rt)
+{
+	const struct query_hash *qh = qhv->vec;
+	const uint8 *arena = rt->arena;
+	uint i, shift;
+
+	if (rt->is_empty || NULL == arena)
+		return;
+
+	shift = 32 - rt->bits;
+
+	for (i = 0; i < qhv->count; i++) {
+		uint32 idx = qh[i].hashcode >> shift;
+		G_PREFETCH_R(&arena[idx >> 3]);
+	}
+}
+
+/**
+ * Check whether a query can be routed through each of the supplied tables,
+ * filling the ``can'' vector with the outcome for each table.
+ *
+ * This is functionally identical to calling the can_route() or
+ * can_route_urn() routine on each table, but the memory accesses on the
+ * arenas are pipelined.
+ *
+ * @param qhv		the query hash vector
+ * @param rtv		vector of routing tables to check
+ * @param cnt		amount of entries in the vector
+ * @param can		where results are written (same size as ``rtv'')
+ */
+static void G_HOT
+qrt_can_route_batch(const query_hashvec_t *qhv,
+	const struct routing_table * const *rtv, size_t cnt, bool *can)
+{
+	size_t i;
+	bool has_urn = qhv->has_urn;
+
+	for (i = 0; i < cnt && i < QRT_BATCH_AHEAD; i++)
+		qrt_prefetch_slots(qhv, rtv[i]);
+
+	for (i = 0; i < cnt; i++) {
+		const struct routing_table *rt = rtv[i];
+
+		if (i + QRT_BATCH_AHEAD < cnt)
+			qrt_prefetch_slots(qhv, rtv[i + QRT_BATCH_AHEAD]);
+
+		can[i] = has_urn ? rt->can_route_urn(qhv, rt) : rt->can_route(qhv, rt);
+	}
+}
+
+/**
+ * Filter the supplied node vector, keeping only the nodes to which
+ * we can route a query identified by its hash vector.
+ *
+ * This is the batched equivalent of calling qrp_node_can_route() on each
+ * node, in sequence, the relative order of the kept nodes being preserved.
+ *
+ * @param qhv		the query hash vector
+ * @param nv		the node vector to filter (updated in place)
+ * @param cnt		amount of nodes in the vector
+ *
+ * @return the amount of nodes kept at the head of the vector.
+ */
+size_t
+qrp_node_route_filter(const query_hashvec_t *qhv,
+	gnutella_node_t **nv, size_t cnt)
+{
+	const struct routing_table **rtv;
+	size_t *rti;
+	bool *can;
+	size_t i, j, n = 0;
+
+	g_assert(qhv != NULL);
+	g_assert(nv != NULL || 0 == cnt);
+
+	if (0 == cnt)
+		return 0;
+
+	WALLOC_ARRAY(rtv, cnt);
+	WALLOC_ARRAY(rti, cnt);
+	WALLOC_ARRAY(can, cnt);
+
+	/*
+	 * Nodes without a routing table need not consult it: collect the
+	 * tables that need to be looked at and update the verdict for the
+	 * others immediately, like qrp_node_can_route() would.
+	 */
+
+	for (i = 0; i < cnt; i++) {
+		const gnutella_node_t *dn = nv[i];
+
+		if (!NODE_IS_WRITABLE(dn)) {
+			can[i] = FALSE;
+		} else if (NULL == dn->recv_query_table) {
+			can[i] = !NODE_IS_LEAF(dn);
+		} else {
+			rti[n] = i;
+			rtv[n++] = dn->recv_query_table;
+		}
+	}
+
+	if (n != 0) {
+		bool *rcan;
+
+		WALLOC_ARRAY(rcan, n);
+		qrt_can_route_batch(qhv, rtv, n, rcan);
+		for (i = 0; i < n; i++)
+			can[rti[i]] = rcan[i];
+		WFREE_ARRAY(rcan, n);
+	}
+
+	for (i = j = 0; i < cnt; i++) {
+		if (can[i])
+			nv[j++] = nv[i];
+	}
+
+	WFREE_ARRAY(rtv, cnt);
+	WFREE_ARRAY(rti, cnt);
+	WFREE_ARRAY(can, cnt);
+
+	return j;
 }
 
 /**
@@ -5431,6 +5927,15 @@ qrt_build_query_target(
 {
 	pslist_t *nodes = NULL;		/* Targets for the query */
 	const pslist_t *sl;
+	gnutella_node_t **cv;		/* Candidate nodes */
+	const struct routing_table **rtv;
+	bool *can;
+	bool *lookup;
+	gnutella_node_t *cv_buf[QRT_TARGET_INLINE];
+	const struct routing_table *rtv_buf[QRT_TARGET_INLINE];
+	bool can_buf[QRT_TARGET_INLINE];
+	bool lookup_buf[QRT_TARGET_INLINE];
+	size_t i, cnt, n = 0, c = 0;
 	bool sha1_query;
 	bool whats_new;
 
@@ -5457,6 +5962,37 @@ qrt_build_query_target(
 
 	sha1_query = qhvec_has_urn(qhvec);
 
+	cnt = pslist_length(node_all_gnet_nodes());
+	if G_UNLIKELY(0 == cnt)
+		return NULL;
+
+	/*
+	 * The candidate vector holds the nodes that passed the initial checks,
+	 * in the order of the node list, and ``lookup'' tells whether the
+	 * node needs a QRP lookup before we can send it the query.  The tables
+	 * to look up are gathered in ``rtv''.
+	 *
+	 * Lookups are then performed in one batch, to pipeline the memory
+	 * accesses in the routing tables, which are likely to miss the cache
+	 * when we have many leaves.
+	 *
+	 * This routine is called for every query we route, so the vectors are
+	 * kept on the stack when the amount of connections permits, which is
+	 * the common case, and only allocated for larger node counts.
+	 */
+
+	if G_LIKELY(cnt <= QRT_TARGET_INLINE) {
+		cv = cv_buf;
+		lookup = lookup_buf;
+		rtv = rtv_buf;
+		can = can_buf;
+	} else {
+		WALLOC_ARRAY(cv, cnt);
+		WALLOC_ARRAY(lookup, cnt);
+		WALLOC_ARRAY(rtv, cnt);
+		WALLOC_ARRAY(can, cnt);
+	}
+
 	/*
 	 * We need to special case processing of queries with TTL=1 so that they
 	 * get set to ultra peers that support last-hop QRP only if they can
@@ -5467,7 +6003,6 @@ qrt_build_query_target(
 	PSLIST_FOREACH(node_all_gnet_nodes(), sl) {
 		gnutella_node_t *dn = sl->data;
 		struct routing_table *rt = dn->recv_query_table;
-		bool is_leaf;
 
 		/*
 		 * Avoid G_UNLIKELY() hints in the loop.  Either they are wrong hints
@@ -5490,9 +6025,7 @@ qrt_build_query_target(
 		 * a last-hop QRP capable ultra node).
 		 */
 
-		is_leaf = NODE_IS_LEAF(dn);
-
-		if (is_leaf) {
+		if (NODE_IS_LEAF(dn)) {
 			/* Leaf node */
 			if (!leaves) {
 				continue;				/* Routing duplicate query, skip! */
@@ -5532,13 +6065,32 @@ qrt_build_query_target(
 
 		node_inc_qrp_query(dn);			/* We have a QRT, mark we try routing */
 
-		if (!(qhvec->has_urn ?
-			  rt->can_route_urn(qhvec, rt) :
-			  rt->can_route(qhvec, rt)))
+		rtv[n++] = rt;
+		lookup[c] = TRUE;
+		cv[c++] = dn;
+		continue;
+
+	can_send:
+		lookup[c] = FALSE;		/* No QRP lookup required */
+		cv[c++] = dn;
+	}
+
+	g_assert(c <= cnt);
+
+	qrt_can_route_batch(qhvec, rtv, n, can);
+
+	for (i = n = 0; i < c; i++) {
+		gnutella_node_t *dn = cv[i];
+		const struct routing_table *rt = dn->recv_query_table;
+
+		if (!lookup[i])
+			goto send;
+
+		if (!can[n++])
 			continue;
 
-		if (!is_leaf)
-			goto can_send;			/* Avoid indentation of remaining code */
+		if (!NODE_IS_LEAF(dn))
+			goto send;			/* Avoid indentation of remaining code */
 
 		/*
 		 * If table for the leaf node is so full that we can't let all the
@@ -5583,7 +6135,7 @@ qrt_build_query_target(
 		 * OK, can send the query to that node.
 		 */
 
-	can_send:
+	send:
 
 		/*
 		 * Severely limit traffic to transient nodes since we're going
@@ -5606,6 +6158,13 @@ qrt_build_query_target(
 			node_inc_qrp_match(dn);
 	}
 
+	if G_UNLIKELY(cv != cv_buf) {
+		WFREE_ARRAY(cv, cnt);
+		WFREE_ARRAY(lookup, cnt);
+		WFREE_ARRAY(rtv, cnt);
+		WFREE_ARRAY(can, cnt);
+	}
+
 	return nodes;
 }
 
@@ -98,6 +98,8 @@ struct routing_table *qrt_ref(struct routing_table *);
 void qrt_unref(struct routing_table *);
 void qrt_get_info(const struct routing_table *, qrt_info_t *qi);
 void qrt_arena_relocate(struct routing_table *rt);
+bool qrt_can_route(const struct routing_table *rt,
+	const struct query_hashvec *qhv);
 
 struct query_hashvec *qhvec_alloc(uint size);
 void qhvec_free(struct query_hashvec *qhvec);
@@ -119,6 +121,8 @@ void qrt_route_query(struct gnutella_node *n,
 	query_hashvec_t *qhvec, bool leaves);
 bool qrp_node_can_route(const struct gnutella_node *n,
 			const query_hashvec_t *qhv);
+size_t qrp_node_route_filter(const query_hashvec_t *qhv,
+	struct gnutella_node **nv, size_t cnt);
 
 #endif	/* _core_qrp_h_ */
 
@@ -44,6 +44,7 @@
 #include "oob_proxy.h"
 #include "search.h"			/* For search_passive. */
 #include "settings.h"
+#include "tracing.h"
 
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
@@ -57,6 +58,7 @@
 #include "lib/hset.h"
 #include "lib/htable.h"
 #include "lib/pslist.h"
+#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
@@ -97,12 +99,26 @@ routing_udp_node_check(const struct routing_udp_node * const un)
 
 #define ROUTE_UDP_LIFETIME	180		/**< Keep UDP routes for 3 minutes */
 
+/**
+ * A route recorded for a message.
+ */
+struct route_entry {
+	struct route_data *rd;		/**< Where the message came from */
+	uint8 ttl;					/**< For broadcasted messages: TTL on route */
+};
+
+#define MESSAGE_ROUTES		2	/**< Routes held within the entry itself */
+
 /**
  * An entry in the routing table.
  *
- * Each entry is stored in the "message_array[]", to keep track of the
- * order used to create the routes, and in a hash table for quick lookup,
- * hashing being made based on the muid and the function.
+ * Each entry is stored in the "message_array[]" of its shard, to keep track
+ * of the order used to create the routes, and is indexed by an open-addressed
+ * hash table for quick lookup, hashing being made based on the muid and the
+ * function.
+ *
+ * The first routes are kept within the entry, which covers most messages,
+ * the following ones being stored in a separately allocated array.
  *
  * Query hit routes and push routes are precious, therefore they are
  * moved to the tail of the "message_array[]" when they get used to increase
@@ -110,12 +126,14 @@ routing_udp_node_check(const struct routing_udp_node * const un)
  */
 struct message {
 	struct guid muid;			/**< Message UID */
-	struct message **slot;		/**< Place where we're referenced from */
-	pslist_t *routes;            /**< route_data from where the message came */
-	pslist_t *ttls;			/**< For broadcasted messages: TTL by route */
+	struct route_entry route[MESSAGE_ROUTES];	/**< First routes */
+	struct route_entry *more;	/**< Routes beyond the first ones */
+	uint16 nroutes;				/**< Amount of routes */
 	uint8 function;				/**< Type of the message */
 	uint8 ttl;					/**< Max TTL we saw for this message */
-	uint8 chunk_idx;			/**< Index of chunk holding the slot */
+	uint8 chunk_idx;			/**< Index of chunk holding the entry */
+	uint8 shard;				/**< Index of shard holding the entry */
+	uint8 used;					/**< Whether entry is in use */
 };
 
 /**
@@ -154,35 +172,58 @@ static const char *debug_msg[256];
 /*
  * Routing table data structures.
  *
- * This is known as the "message_array[]".  It used to be a fixed-sized
- * array, but it is no more.  Instead, we use an array of chunks that
- * are dynamically allocated as needed.  The aim is to not cycle
+ * The table is split into shards, each message being held in the shard
+ * selected by the upper bits of the hash of its key.  Each shard has its
+ * own lock, so that routing lookups can be performed by several threads.
+ *
+ * Within a shard, messages are held in the "message_array[]".  It used to be
+ * a fixed-sized array, but it is no more.  Instead, we use an array of chunks
+ * that are dynamically allocated as needed.  The aim is to not cycle
  * back to the beginning of the table, loosing all the routing information
  * before at least TABLE_MIN_CYCLE seconds have elapsed or we have
  * allocated more than the amount of chunks we can tolerate.
  *
- * Each chunk contains pointers to dynamically allocated message entries,
- * each pointer being called a "slot" whilst the message structure is called
- * the "entry".
+ * Each chunk directly contains the message entries, each place being called
+ * a "slot".  The index of the shard is an open-addressed hash table with
+ * linear probing, which records the position of the message in the shard
+ * along with the hash of its key, so that probing seldom needs to access
+ * the entries themselves.
+ *
+ * Only the main thread updates the routing table, taking the shard lock
+ * around modifications, hence it can read the table without locking.
+ * Other threads must hold the shard lock whilst looking up messages.
  */
 
-#define CHUNK_BITS			14 	  /**< log2 of # messages stored  in a chunk */
-#define MAX_CHUNKS			64	  /**< Max # of chunks */
+#define CHUNK_BITS			11 	  /**< log2 of # messages stored  in a chunk */
+#define MAX_CHUNKS			64	  /**< Max # of chunks per shard */
 #define TABLE_MIN_CYCLE		3600  /**< 1 hour at least */
+#define SHARD_BITS			3	  /**< log2 of # of shards */
 
 #define CHUNK_MESSAGES		(1 << CHUNK_BITS)
 #define CHUNK_INDEX(x)		(((x) & ~(CHUNK_MESSAGES - 1)) >> CHUNK_BITS)
 #define ENTRY_INDEX(x)		((x) & (CHUNK_MESSAGES - 1))
+#define SHARD_COUNT			(1 << SHARD_BITS)
+#define INDEX_MIN_SIZE		(2 * CHUNK_MESSAGES)
 
-static struct {
-	struct message **chunks[MAX_CHUNKS];
+/**
+ * A slot in the index of a shard.
+ */
+struct routing_slot {
+	uint32 hash;				/**< Hash of the message key */
+	uint32 idx;					/**< Index of message in shard + 1, 0 if free */
+};
+
+static struct routing_shard {
+	spinlock_t lock;			 /**< Lock for updates of the shard */
+	struct message *chunks[MAX_CHUNKS];
+	struct routing_slot *index;	 /**< Index of messages (key = muid) */
+	size_t index_size;			 /**< Amount of index slots, a power of 2 */
 	int next_idx;				 /**< Next slot to use in "message_array[]" */
 	int capacity;				 /**< Capacity in terms of messages */
 	int count;					 /**< Amount really stored */
 	unsigned nchunks;			 /**< Amount of allocated chunks */
-	hset_t *messages_hashed;	 /**< All messages (key = struct message) */
 	time_t last_rotation;		 /**< Last time we restarted from idx=0 */
-} routing;
+} routing[SHARD_COUNT];
 
 /**
  * "banned" GUIDs for push routing.
@@ -827,135 +868,224 @@ init_routing_data(gnutella_node_t *node)
 }
 
 /**
- * Make sure slot belongs to specified chunk index.
+ * Hash the key of a message.
  */
-static void
-slot_check(struct message * const * const slot, unsigned chunk_idx)
+static inline uint32
+message_hash(const struct guid *muid, uint8 function)
+{
+	return integer_hash_fast(function) ^ universal_hash(muid, GUID_RAW_SIZE);
+}
+
+/**
+ * @return the shard holding messages whose key hashes to the given value.
+ */
+static inline struct routing_shard *
+routing_shard(uint32 hash)
 {
-	const void *chunk_base;
-	const void *chunk_end;
+	return &routing[hash >> (32 - SHARD_BITS)];
+}
 
-	g_assert(uint_is_non_negative(chunk_idx));
-	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk_idx < routing.nchunks);
+/**
+ * @return the message entry at the specified index of the shard.
+ */
+static inline struct message *
+shard_message(const struct routing_shard *rs, uint idx)
+{
+	return &rs->chunks[CHUNK_INDEX(idx)][ENTRY_INDEX(idx)];
+}
 
-	chunk_base = routing.chunks[chunk_idx];
-	chunk_end = const_ptr_add_offset(chunk_base, CHUNK_MESSAGES * sizeof *slot);
+/**
+ * @return the index of the message entry within its shard.
+ */
+static inline uint
+message_index(const struct routing_shard *rs, const struct message *m)
+{
+	return (m->chunk_idx << CHUNK_BITS) + (m - rs->chunks[m->chunk_idx]);
+}
 
-	g_assert(ptr_cmp(slot, chunk_base) >= 0);
-	g_assert(ptr_cmp(slot, chunk_end) < 0);
+/**
+ * @return the i-th route of the message.
+ */
+static inline struct route_entry *
+message_route(const struct message *m, uint i)
+{
+	return deconstify_pointer(
+		i < MESSAGE_ROUTES ? &m->route[i] : &m->more[i - MESSAGE_ROUTES]);
 }
 
 /**
  * Asserts that a message entry is consistent and belongs to the correct chunk.
  */
 static void
-message_check(const struct message * const m, unsigned chunk_idx)
+message_check(const struct routing_shard *rs, const struct message * const m)
 {
+	const struct message *chunk_base;
+
 	g_assert(m != NULL);
-	slot_check(m->slot, chunk_idx);
-	g_assert(chunk_idx == m->chunk_idx);
+	g_assert(m->used);
+	g_assert(m->shard == rs - routing);
+	g_assert(m->chunk_idx < rs->nchunks);
+
+	chunk_base = rs->chunks[m->chunk_idx];
+
+	g_assert(ptr_cmp(m, chunk_base) >= 0);
+	g_assert(ptr_cmp(m, &chunk_base[CHUNK_MESSAGES]) < 0);
 }
 
 /**
- * Asserts that a message entry is consistent and belongs to the correct chunk.
+ * Look for a message in the shard index.
  *
- * The "chunk" parameter points to the old chunk address and is used to
- * properly validate the m->slot value (before our caller can update it
- * to reflect the new chunk location).
+ * @return the message entry if found, NULL otherwise.
+ */
+static struct message *
+shard_lookup(const struct routing_shard *rs, uint32 hash,
+	const struct guid *muid, uint8 function)
+{
+	size_t mask = rs->index_size - 1, i;
+
+	if G_UNLIKELY(NULL == rs->index)
+		return NULL;
+
+	for (i = hash & mask; rs->index[i].idx != 0; i = (i + 1) & mask) {
+		if (rs->index[i].hash == hash) {
+			struct message *m = shard_message(rs, rs->index[i].idx - 1);
+
+			if (m->function == function && guid_eq(&m->muid, muid))
+				return m;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Record message at the specified index of the shard in the index.
  */
 static void
-message_check_chunk(const struct message * const m, unsigned chunk_idx,
-	struct message * const *chunk)
+shard_index_insert(struct routing_shard *rs, uint32 hash, uint idx)
 {
-	const void *chunk_end;
+	size_t mask = rs->index_size - 1, i;
 
-	g_assert(m != NULL);
-	g_assert(chunk_idx == m->chunk_idx);
+	for (i = hash & mask; rs->index[i].idx != 0; i = (i + 1) & mask)
+		/* empty */;
+
+	rs->index[i].hash = hash;
+	rs->index[i].idx = idx + 1;
+}
+
+/**
+ * Remove message at the specified index of the shard from the index.
+ */
+static void
+shard_index_remove(struct routing_shard *rs, uint32 hash, uint idx)
+{
+	size_t mask = rs->index_size - 1, i, j;
+
+	for (i = hash & mask; rs->index[i].idx != idx + 1; i = (i + 1) & mask)
+		g_assert(rs->index[i].idx != 0);
 
 	/*
-	 * Expand a variant of slot_check() since routing.chunks[chunk_idx]
-	 * has been re-allocated and the old chunk address is given.
+	 * Move back the following entries of the cluster that can take the
+	 * freed slot, so that lookups never need tombstones.
 	 */
 
-	g_assert(uint_is_non_negative(chunk_idx));
-	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk_idx < routing.nchunks);
+	for (j = (i + 1) & mask; rs->index[j].idx != 0; j = (j + 1) & mask) {
+		size_t home = rs->index[j].hash & mask;
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			rs->index[i] = rs->index[j];
+			i = j;
+		}
+	}
+
+	rs->index[i].idx = 0;
+}
+
+/**
+ * Rebuild the index of the shard, resizing it to fit the capacity.
+ */
+static void
+shard_index_rebuild(struct routing_shard *rs)
+{
+	size_t size = INDEX_MIN_SIZE;
+	uint i, j;
+
+	while (size < 2 * UNSIGNED(rs->capacity))
+		size *= 2;
 
-	chunk_end = const_ptr_add_offset(chunk, CHUNK_MESSAGES * sizeof m);
+	if (size != rs->index_size) {
+		HFREE_NULL(rs->index);
+		HALLOC0_ARRAY(rs->index, size);
+		rs->index_size = size;
+	} else {
+		memset(rs->index, 0, size * sizeof rs->index[0]);
+	}
 
-	g_assert(ptr_cmp(m->slot, chunk) >= 0);
-	g_assert(ptr_cmp(m->slot, chunk_end) < 0);
+	for (i = 0; i < rs->nchunks; i++) {
+		for (j = 0; j < CHUNK_MESSAGES; j++) {
+			const struct message *m = &rs->chunks[i][j];
+
+			if (m->used) {
+				shard_index_insert(rs, message_hash(&m->muid, m->function),
+					(i << CHUNK_BITS) + j);
+			}
+		}
+	}
 }
 
 /**
- * Clean already allocated entry.
+ * Clean already allocated entry, removing it from the table.
  */
 static void
-clean_entry(struct message *entry)
+clean_entry(struct routing_shard *rs, struct message *entry)
 {
-	g_assert(entry != NULL);
+	message_check(rs, entry);
 
-	hset_remove(routing.messages_hashed, entry);
+	shard_index_remove(rs, message_hash(&entry->muid, entry->function),
+		message_index(rs, entry));
 
-	if (entry->routes != NULL)
-		free_route_list(entry);
+	free_route_list(entry);
 
-	g_assert(entry->ttls == NULL);		/* Cleaned by free_route_list() */
-	g_assert(entry->routes == NULL);	/* Idem */
+	g_assert(0 == entry->nroutes);		/* Cleaned by free_route_list() */
+	g_assert(NULL == entry->more);		/* Idem */
 
+	entry->used = FALSE;
 	entry->ttl = 0;
+	rs->count--;
+	gnet_stats_dec_general(GNR_ROUTING_TABLE_COUNT);
 }
 
 /**
  * Prepare entry, cleaning any old value we can find at the referenced slot.
- * We try to avoid re-allocating something if we can.
  *
  * @return message entry to use
  */
 static struct message *
-prepare_entry(struct message **entryp, unsigned chunk_idx)
+prepare_entry(struct routing_shard *rs,
+	struct message *entry, unsigned chunk_idx)
 {
-	struct message *entry = *entryp;
-
 	STATIC_ASSERT(MAX_CHUNKS <= MAX_INT_VAL(uint8));
+	STATIC_ASSERT(SHARD_COUNT <= MAX_INT_VAL(uint8));
 
 	g_assert(uint_is_non_negative(chunk_idx));
 	g_assert(chunk_idx < MAX_CHUNKS);
-	slot_check(entryp, chunk_idx);
-
-	if (entry == NULL) {
-		WALLOC0(entry);
-		*entryp = entry;
-		entry->slot = entryp;
-		entry->chunk_idx = chunk_idx;	/* 8-bit value, must fit */
-		routing.count++;
-		gnet_stats_inc_general(GNR_ROUTING_TABLE_COUNT);
-		goto done;
-	}
 
 	/*
-	 * We cycled over the table, remove the message at the slot we're
-	 * going to supersede.  We don't need to allocate anything, we'll
-	 * reuse the old structure, which will be rehashed after being updated.
+	 * If we cycled over the table, remove the message at the slot we're
+	 * going to supersede.
 	 */
 
-	clean_entry(entry);
+	if (entry->used)
+		clean_entry(rs, entry);
 
-	/*
-	 * Attempt to move the object around if it can help compacting.
-	 */
+	ZERO(entry);
+	entry->chunk_idx = chunk_idx;		/* 8-bit value, must fit */
+	entry->shard = rs - routing;
+	entry->used = TRUE;
+	rs->count++;
+	gnet_stats_inc_general(GNR_ROUTING_TABLE_COUNT);
 
-	{
-		struct message *nentry = WMOVE(entry);
-
-		if (nentry != entry)
-			entry = *entryp = nentry;
-	}
-
-done:
-	g_assert(entryp == entry->slot);
-	message_check(entry, chunk_idx);
+	message_check(rs, entry);
 
 	return entry;
 }
@@ -963,42 +1093,27 @@ done:
 /**
  * Attempt to reallocate an already allocated chunk to see if the VMM layer
  * can relocate a fragment.
+ *
+ * Since the index refers to messages by position, nothing needs to be
+ * updated when the chunk moves.
  */
-static struct message **
-routing_chunk_move(struct message **chunk, unsigned chunk_idx)
+static void
+routing_chunk_move(struct routing_shard *rs, unsigned chunk_idx)
 {
-	struct message **nchunk;
-	struct message **p;
-	unsigned i;
+	struct message *chunk = rs->chunks[chunk_idx];
 
 	g_assert(chunk != NULL);
 	g_assert(uint_is_non_negative(chunk_idx));
 	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk == routing.chunks[chunk_idx]);
 
-	nchunk = hrealloc(chunk, CHUNK_MESSAGES * sizeof(struct message *));
-	if (nchunk == chunk)
-		return chunk;
+	rs->chunks[chunk_idx] =
+		hrealloc(chunk, CHUNK_MESSAGES * sizeof(struct message));
 
-	/*
-	 * VMM layer chose to relocate the chunk, update all the entries.
-	 */
-
-	if (GNET_PROPERTY(routing_debug)) {
-		g_debug("RT moving chunk #%u from %p to %p",
-			chunk_idx, (void *) chunk, (void *) nchunk);
-	}
-
-	for (p = &nchunk[0], i = 0; i < CHUNK_MESSAGES; i++, p++) {
-		struct message *m = *p;
-
-		if (m != NULL) {
-			message_check_chunk(m, chunk_idx, chunk);
-			m->slot = p;
-		}
+	if (GNET_PROPERTY(routing_debug) && chunk != rs->chunks[chunk_idx]) {
+		g_debug("RT moving chunk #%u of shard #%u from %p to %p",
+			chunk_idx, (uint) (rs - routing),
+			(void *) chunk, (void *) rs->chunks[chunk_idx]);
 	}
-
-	return routing.chunks[chunk_idx] = nchunk;
 }
 
 /**
@@ -1008,12 +1123,12 @@ routing_chunk_move(struct message **chunk, unsigned chunk_idx)
  * VM space for more volatile data and possibly defragmenting.
  */
 static void
-routing_chunk_move_attempt(void)
+routing_chunk_move_attempt(struct routing_shard *rs)
 {
 	size_t i;
 
-	for (i = 0; i < routing.nchunks; i++) {
-		routing.chunks[i] = routing_chunk_move(routing.chunks[i], i);
+	for (i = 0; i < rs->nchunks; i++) {
+		routing_chunk_move(rs, i);
 	}
 }
 
@@ -1022,67 +1137,87 @@ routing_chunk_move_attempt(void)
  * next available slot.
  */
 static void
-advance_slot(void)
+advance_slot(struct routing_shard *rs)
 {
 	/*
 	 * It's OK to go beyond the last allocated chunk (a new chunk will
 	 * be allocated next time) unless we already reached the last chunk.
 	 */
 
-	routing.next_idx++;
+	rs->next_idx++;
 
-	if (CHUNK_INDEX(routing.next_idx) >= MAX_CHUNKS)
-		routing.next_idx = 0;		/* Will force cycling over next time */
+	if (CHUNK_INDEX(rs->next_idx) >= MAX_CHUNKS)
+		rs->next_idx = 0;		/* Will force cycling over next time */
 }
 
 /**
- * Clear routing table, starting with specified chunk index.
+ * Update the routing table statistics, summing the figures of all shards.
+ */
+static void
+routing_update_stats(void)
+{
+	uint64 chunks = 0, capacity = 0, count = 0;
+	uint i;
+
+	for (i = 0; i < SHARD_COUNT; i++) {
+		chunks += routing[i].nchunks;
+		capacity += routing[i].capacity;
+		count += routing[i].count;
+	}
+
+	gnet_stats_set_general(GNR_ROUTING_TABLE_CHUNKS, chunks);
+	gnet_stats_set_general(GNR_ROUTING_TABLE_CAPACITY, capacity);
+	gnet_stats_set_general(GNR_ROUTING_TABLE_COUNT, count);
+}
+
+/**
+ * Clear routing table shard, starting with specified chunk index.
  *
+ * @param rs	the routing table shard
  * @param idx	the index of the first chunk to clear
  */
 static void
-routing_clear(unsigned idx)
+routing_clear(struct routing_shard *rs, unsigned idx)
 {
 	size_t i;
 
-	for (i = idx; i < routing.nchunks; i++) {
-		struct message **rchunk = routing.chunks[i];
+	for (i = idx; i < rs->nchunks; i++) {
+		struct message *rchunk = rs->chunks[i];
 		size_t j;
 
 		if (GNET_PROPERTY(routing_debug)) {
-			g_debug("RT freeing chunk #%zu at %p, now holds %d / %d",
-				i, (void *) rchunk, routing.count, routing.capacity);
+			g_debug("RT freeing chunk #%zu of shard #%u at %p, "
+				"now holds %d / %d", i, (uint) (rs - routing),
+				(void *) rchunk, rs->count, rs->capacity);
 		}
 
 		for (j = 0; j < CHUNK_MESSAGES; j++) {
-			struct message *m = rchunk[j];
-
-			if (m != NULL) {
-				message_check(m, i);
-				g_assert(m->slot == &rchunk[j]);
-				clean_entry(m);
-				WFREE(m);
-				routing.count--;
+			struct message *m = &rchunk[j];
+
+			if (m->used) {
+				message_check(rs, m);
+				free_route_list(m);
+				rs->count--;
 			}
 		}
 
-		routing.capacity -= CHUNK_MESSAGES;
-		HFREE_NULL(routing.chunks[i]);
+		rs->capacity -= CHUNK_MESSAGES;
+		HFREE_NULL(rs->chunks[i]);
 	}
 
-	routing.nchunks = idx;
-	gnet_stats_set_general(GNR_ROUTING_TABLE_CHUNKS, routing.nchunks);
-	gnet_stats_set_general(GNR_ROUTING_TABLE_CAPACITY, routing.capacity);
-	gnet_stats_set_general(GNR_ROUTING_TABLE_COUNT, routing.count);
+	rs->nchunks = idx;
+	routing_update_stats();
+
+	g_assert(uint_is_non_negative(rs->nchunks));
 
-	g_assert(uint_is_non_negative(routing.nchunks));
+	shard_index_rebuild(rs);
 
 	/*
 	 * After freeing chunks, we may be able to move around some of the
 	 * remaining ones.
 	 */
 
-	routing_chunk_move_attempt();
+	routing_chunk_move_attempt(rs);
 }
 
 /**
@@ -1091,19 +1226,26 @@ routing_clear(unsigned idx)
 void
 routing_clear_all(void)
 {
-	if (GNET_PROPERTY(routing_debug)) {
-		g_debug("RT clearing whole table (holds %d / %d)",
-			routing.capacity, routing.count);
-	}
+	uint i;
 
-	routing_clear(0);
-	routing.next_idx = 0;
-	routing.last_rotation = tm_time();
-	hset_clear(routing.messages_hashed);	/* Paranoid */
+	for (i = 0; i < SHARD_COUNT; i++) {
+		struct routing_shard *rs = &routing[i];
+
+		if (GNET_PROPERTY(routing_debug)) {
+			g_debug("RT clearing shard #%u (holds %d / %d)",
+				i, rs->count, rs->capacity);
+		}
+
+		spinlock(&rs->lock);
+		routing_clear(rs, 0);
+		rs->next_idx = 0;
+		rs->last_rotation = tm_time();
+		spinunlock(&rs->lock);
+	}
 }
 
 /**
- * Fetch next routing table slot, a pointer to a routing entry.
+ * Fetch next routing table slot in the shard, a pointer to a routing entry.
  *
  * When `advance' is FALSE, the slot is allocated as usual but there is
  * no increment of the slot index for next time.  This allows trial allocation
@@ -1113,27 +1255,28 @@ routing_clear_all(void)
  * When `advance' is TRUE, the slot is allocated and the slot index is
  * incremented immediately.
  *
+ * @param rs			the routing table shard
  * @param advance		whether to advance the slot index
  * @param cidx			if non-NULL, filled with the chunk index where slot is
  *
  * @return the address of the allocated slot.
  */
-static struct message **
-get_next_slot(bool advance, unsigned *cidx)
+static struct message *
+get_next_slot(struct routing_shard *rs, bool advance, unsigned *cidx)
 {
 	unsigned idx;
 	unsigned chunk_idx;
-	struct message **chunk;
-	struct message **slot = NULL;
+	struct message *chunk;
+	struct message *slot = NULL;
 	time_t now = tm_time();
-	time_delta_t elapsed = delta_time(now, routing.last_rotation);
+	time_delta_t elapsed = delta_time(now, rs->last_rotation);
 
-	idx = routing.next_idx;
+	idx = rs->next_idx;
 	chunk_idx = CHUNK_INDEX(idx);
 
 	g_assert(UNSIGNED(chunk_idx) < MAX_CHUNKS);
 
-	chunk = routing.chunks[chunk_idx];
+	chunk = rs->chunks[chunk_idx];
 
 	/*
 	 * If we get back here with a next index of zero and the chunk is
@@ -1143,10 +1286,11 @@ get_next_slot(bool advance, unsigned *cidx)
 
 	if G_UNLIKELY(0 == idx && NULL != chunk) {
 		if (GNET_PROPERTY(routing_debug)) {
-			g_debug("RT cycled naturally over table, elapsed=%u, holds %d / %d",
-				(unsigned) elapsed, routing.count, routing.capacity);
+			g_debug("RT cycled naturally over shard #%u, elapsed=%u, "
+				"holds %d / %d", (uint) (rs - routing),
+				(unsigned) elapsed, rs->count, rs->capacity);
 		}
-		routing.last_rotation = now;	/* Just cycled over */
+		rs->last_rotation = now;	/* Just cycled over */
 		elapsed = 0;
 	}
 
@@ -1164,14 +1308,14 @@ get_next_slot(bool advance, unsigned *cidx)
 		 */
 
 		if G_UNLIKELY(chunk != NULL && 0 == ENTRY_INDEX(idx)) {
-			routing_clear(chunk_idx);
+			routing_clear(rs, chunk_idx);
 			chunk = NULL;
 		}
 	}
 
 	if (chunk == NULL) {
 
-		g_assert(idx >= UNSIGNED(routing.capacity));
+		g_assert(idx >= UNSIGNED(rs->capacity));
 
 		/*
 		 * Chunk does not exist yet, determine whether we should create
@@ -1180,40 +1324,48 @@ get_next_slot(bool advance, unsigned *cidx)
 
 		if (idx > 0 && elapsed > TABLE_MIN_CYCLE) {
 			if (GNET_PROPERTY(routing_debug)) {
-				g_debug("RT cycling over table, elapsed=%u, holds %d / %d",
-					(unsigned) elapsed, routing.count, routing.capacity);
+				g_debug("RT cycling over shard #%u, elapsed=%u, "
+					"holds %d / %d", (uint) (rs - routing),
+					(unsigned) elapsed, rs->count, rs->capacity);
 			}
 
 			chunk_idx = 0;
-			idx = routing.next_idx = 0;
-			routing.last_rotation = now;
-			slot = routing.chunks[0];
+			idx = rs->next_idx = 0;
+			rs->last_rotation = now;
+			slot = rs->chunks[0];
 		} else {
 			/*
 			 * Allocate new chunk, expanding the capacity of the table.
 			 */
 
 			g_assert(idx == 0 || chunk_idx > 0);
-			g_assert(chunk_idx == routing.nchunks);
+			g_assert(chunk_idx == rs->nchunks);
 
-			routing_chunk_move_attempt();		/* Compact before allocating */
+			routing_chunk_move_attempt(rs);		/* Compact before allocating */
 
-			routing.nchunks++;
-			routing.capacity += CHUNK_MESSAGES;
-			routing.chunks[chunk_idx] =
-				halloc0(CHUNK_MESSAGES * sizeof(struct message *));
+			rs->nchunks++;
+			rs->capacity += CHUNK_MESSAGES;
+			rs->chunks[chunk_idx] =
+				halloc0(CHUNK_MESSAGES * sizeof(struct message));
 
 			gnet_stats_inc_general(GNR_ROUTING_TABLE_CHUNKS);
 			gnet_stats_count_general(GNR_ROUTING_TABLE_CAPACITY,
 				CHUNK_MESSAGES);
 
 			if (GNET_PROPERTY(routing_debug)) {
-				g_debug("RT created new chunk #%d at %p, now holds %d / %d",
-					chunk_idx, (void *) routing.chunks[chunk_idx],
-					routing.count, routing.capacity);
+				g_debug("RT created new chunk #%d of shard #%u at %p, "
+					"now holds %d / %d", chunk_idx, (uint) (rs - routing),
+					(void *) rs->chunks[chunk_idx], rs->count, rs->capacity);
 			}
 
-			slot = routing.chunks[chunk_idx];	/* First slot in new chunk */
+			/*
+			 * Keep the index at most half full.
+			 */
+
+			if (2 * UNSIGNED(rs->capacity) > rs->index_size)
+				shard_index_rebuild(rs);
+
+			slot = rs->chunks[chunk_idx];	/* First slot in new chunk */
 		}
 	} else {
 		unsigned entry_idx = ENTRY_INDEX(idx);
@@ -1224,8 +1376,8 @@ get_next_slot(bool advance, unsigned *cidx)
 		 */
 
 		if (0 == entry_idx) {
-			routing_chunk_move_attempt();
-			chunk = routing.chunks[chunk_idx];	/* In case it moved */
+			routing_chunk_move_attempt(rs);
+			chunk = rs->chunks[chunk_idx];	/* In case it moved */
 		}
 
 		/*
@@ -1234,44 +1386,47 @@ get_next_slot(bool advance, unsigned *cidx)
 		 * because we have already allocated the maximum amount of chunks.
 		 */
 
-		if (0 == idx && MAX_CHUNKS == routing.nchunks) {
+		if (0 == idx && MAX_CHUNKS == rs->nchunks) {
 			if (GNET_PROPERTY(routing_debug)) {
-				g_warning("RT cycling over FORCED, elapsed=%u, holds %d / %d",
-					(unsigned) elapsed, routing.count, routing.capacity);
+				g_warning("RT cycling over shard #%u FORCED, elapsed=%u, "
+					"holds %d / %d", (uint) (rs - routing),
+					(unsigned) elapsed, rs->count, rs->capacity);
 			}
-			routing.last_rotation = now;
+			rs->last_rotation = now;
 		}
 
 		slot = &chunk[entry_idx];
 	}
 
 	g_assert(slot != NULL);
-	g_assert(idx == UNSIGNED(routing.next_idx));
-	g_assert(idx < UNSIGNED(routing.capacity));
-	g_assert(routing.nchunks <= MAX_CHUNKS);
+	g_assert(idx == UNSIGNED(rs->next_idx));
+	g_assert(idx < UNSIGNED(rs->capacity));
+	g_assert(rs->nchunks <= MAX_CHUNKS);
 
 	if (advance)
-		advance_slot();
+		advance_slot(rs);
 
 	if (cidx != NULL)
 		*cidx = chunk_idx;
 
-	slot_check(slot, chunk_idx);
-
 	return slot;
 }
 
 /**
- * Fetch next routing table entry to be able to store routing information.
+ * Fetch next routing table entry in the shard to be able to store routing
+ * information.
+ *
+ * This can move the chunks of the shard around, invalidating the pointers
+ * to its other entries.
  */
 static struct message *
-get_next_entry(void)
+get_next_entry(struct routing_shard *rs)
 {
-	struct message **slot;
+	struct message *slot;
 	unsigned chunk_idx;
 
-	slot = get_next_slot(TRUE, &chunk_idx);
-	return prepare_entry(slot, chunk_idx);
+	slot = get_next_slot(rs, TRUE, &chunk_idx);
+	return prepare_entry(rs, slot, chunk_idx);
 }
 
 /**
@@ -1281,12 +1436,15 @@ get_next_entry(void)
  *
  * @return the new location of the revitalized entry
  */
-static void
+static struct message *
 revitalize_entry(struct message *entry, bool force)
 {
-	struct message **relocated;
-	struct message *prev;
+	struct routing_shard *rs = &routing[entry->shard];
+	struct message copy, *relocated;
 	unsigned chunk_idx;
+	uint32 hash;
+
+	message_check(rs, entry);
 
 	/*
 	 * Leaves don't route anything, so we usually don't revitalize their
@@ -1295,58 +1453,56 @@ revitalize_entry(struct message *entry, bool force)
 	 */
 
 	if (!force && settings_is_leaf())
-		return;
+		return entry;
 
 	/*
-	 * Relocate at the end of the table, preventing early expiration.
+	 * If the next slot is in the same chunk, there's no need to revitalize
+	 * since entries in the same chunk will roughly have the same lifetime.
 	 */
 
-	relocated = get_next_slot(FALSE, &chunk_idx);
+	if (CHUNK_INDEX(rs->next_idx) == entry->chunk_idx)
+		return entry;
 
 	/*
-	 * If slot is allocated in the same chunk, there's no need to revitalize
-	 * since entries in the same chunk will roughly have the same lifetime.
+	 * Relocate at the end of the table, preventing early expiration.
+	 *
+	 * The entry is saved and its slot freed before allocating the new one,
+	 * since that can move or free the chunk where the entry lies.
 	 */
 
-	if (chunk_idx == entry->chunk_idx)			/* Same chunk being used */
-		return;
+	hash = message_hash(&entry->muid, entry->function);
 
-	/*
-	 * Clean and reclaim new slot content, if present.
-	 */
+	spinlock(&rs->lock);
 
-	advance_slot();							/* Keeping the slot */
-	prev = *relocated;
+	copy = *entry;
+	shard_index_remove(rs, hash, message_index(rs, entry));
+	entry->used = FALSE;			/* Old slot "freed", routes now in copy */
+	entry->more = NULL;
+	entry->nroutes = 0;
+	rs->count--;
+	gnet_stats_dec_general(GNR_ROUTING_TABLE_COUNT);
 
-	if (prev != NULL) {
-		message_check(prev, chunk_idx);
-		g_assert(prev->slot == relocated);
-		clean_entry(prev);
-		WFREE(prev);
-		routing.count--;
-		gnet_stats_dec_general(GNR_ROUTING_TABLE_COUNT);
-	}
+	relocated = get_next_entry(rs);
+	chunk_idx = relocated->chunk_idx;
+	*relocated = copy;
+	relocated->chunk_idx = chunk_idx;	/* Entry moved to new chunk */
+	shard_index_insert(rs, hash, message_index(rs, relocated));
 
-	/*
-	 * Move `entry' to this new slot.
-	 */
+	spinunlock(&rs->lock);
 
-	*relocated = entry;
-	*(entry->slot) = NULL;					/* Old slot "freed" */
-	entry->slot = relocated;				/* Entry now at new slot */
-	entry->chunk_idx = chunk_idx;			/* Entry moved to new chunk */
+	message_check(rs, relocated);
 
-	message_check(entry, chunk_idx);
+	return relocated;
 }
 
 /**
  * Did node send the message?
  */
 static bool
-route_node_sent_message(gnutella_node_t *n, struct message *m)
+route_node_sent_message(gnutella_node_t *n, const struct message *m)
 {
 	struct route_data *route;
-	pslist_t *sl;
+	uint i;
 
 	if (n == fake_node)
 		route = &fake_route;
@@ -1361,8 +1517,8 @@ route_node_sent_message(gnutella_node_t *n, struct message *m)
 	if (route == NULL)
 		return FALSE;
 
-	PSLIST_FOREACH(m->routes, sl) {
-		if (route == sl->data)
+	for (i = 0; i < m->nroutes; i++) {
+		if (route == message_route(m, i)->rd)
 			return TRUE;
 	}
 
@@ -1380,8 +1536,7 @@ route_node_sent_message(gnutella_node_t *n, struct message *m)
 static bool
 route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 {
-	pslist_t *l;
-	int i;
+	uint i;
 	struct route_data *route;
 
 	g_assert(n != fake_node);
@@ -1397,7 +1552,6 @@ route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 	if (GTA_MSG_G2_SEARCH == m->function)
 		return FALSE;		/* As a G2 leaf, we do not care, it's a dup */
 
-	g_assert(m->ttls != NULL);
 	g_assert(
 		m->function == GTA_MSG_PUSH_REQUEST || m->function == GTA_MSG_SEARCH);
 
@@ -1405,17 +1559,14 @@ route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 
 	g_assert(route != NULL);
 
-	for (l = m->routes, i = 0; l; l = pslist_next(l), i++) {
-		if (route == l->data) {
-			pslist_t *t = pslist_nth(m->ttls, i);
-			uint8 old_ttl;
+	for (i = 0; i < m->nroutes; i++) {
+		struct route_entry *re = message_route(m, i);
 
-			g_assert(t != NULL);
-			old_ttl = GPOINTER_TO_INT(t->data);
-			if (old_ttl >= ttl)
+		if (route == re->rd) {
+			if (re->ttl >= ttl)
 				return FALSE;
 
-			t->data = GUINT_TO_POINTER((uint) ttl);
+			re->ttl = ttl;		/* Single byte, no need to lock */
 			return TRUE;
 		}
 	}
@@ -1424,40 +1575,6 @@ route_node_ttl_higher(gnutella_node_t *n, struct message *m, uint8 ttl)
 	return FALSE;
 }
 
-/**
- * compares two message structures
- */
-static int
-message_compare_func(const void *p, const void *q)
-{
-	const struct message *a = p, *b = q;
-
-	return a->function == b->function && guid_eq(&a->muid, &b->muid);
-}
-
-/**
- * Hashes message structures for storage in a hash table.
- */
-static uint
-message_hash_func(const void *key)
-{
-	const struct message *msg = key;
-
-	return integer_hash_fast(msg->function) ^
-		universal_hash(&msg->muid, GUID_RAW_SIZE);
-}
-
-/**
- * Alternate hashing of message structures for storage in a hash table.
- */
-static uint
-message_hash_func2(const void *key)
-{
-	const struct message *msg = key;
-
-	return integer_hash2(msg->function) ^ guid_hash(&msg->muid);
-}
-
 /**
  * Reset this node's GUID.
  */
@@ -1557,9 +1674,10 @@ routing_init(void)
 	 * need to be deallocated
 	 */
 
-	routing.messages_hashed = hset_create_any(message_hash_func,
-		message_hash_func2, message_compare_func);
-	routing.last_rotation = tm_time();
+	for (i = 0; i < SHARD_COUNT; i++) {
+		spinlock_init(&routing[i].lock);
+		routing[i].last_rotation = tm_time();
+	}
 
 	/*
 	 * Push proxification and starving GUIDs.
@@ -1634,22 +1752,73 @@ remove_one_message_reference(struct route_data *rd)
 static void
 free_route_list(struct message *m)
 {
-	pslist_t *sl;
+	uint i;
 
 	g_assert(m);
 
-	PSLIST_FOREACH(m->routes, sl) {
-		remove_one_message_reference(sl->data);
+	for (i = 0; i < m->nroutes; i++) {
+		remove_one_message_reference(message_route(m, i)->rd);
 	}
 
-	pslist_free_null(&m->routes);
+	if (m->nroutes > MESSAGE_ROUTES)
+		WFREE_ARRAY_NULL(m->more, m->nroutes - MESSAGE_ROUTES);
 
-	/*
-	 * If the message was a broadcasted one, we kept track of the TTL of
-	 * each message along the route.  This needs to be freed as well.
-	 */
+	m->nroutes = 0;
+}
+
+/**
+ * Append route to the message.
+ *
+ * The shard lock must be held by the caller.
+ *
+ * @param m		the message
+ * @param rd	the route from where the message came
+ * @param ttl	the TTL of the message on that route
+ */
+static void
+message_route_add(struct message *m, struct route_data *rd, uint8 ttl)
+{
+	struct route_entry *re;
+
+	g_assert(m->nroutes < MAX_INT_VAL(uint16));
+
+	if (m->nroutes >= MESSAGE_ROUTES) {
+		uint n = m->nroutes - MESSAGE_ROUTES;
+		WREALLOC_ARRAY(m->more, n, n + 1);
+	}
+
+	re = message_route(m, m->nroutes++);
+	re->rd = rd;
+	re->ttl = ttl;
+	rd->saved_messages++;
+}
+
+/**
+ * Remove the i-th route of the message, keeping the others in order.
+ *
+ * The shard lock must be held by the caller.
+ */
+static void
+message_route_remove(struct message *m, uint i)
+{
+	uint j;
+
+	g_assert(i < m->nroutes);
 
-	pslist_free_null(&m->ttls);	/* Data are ints, nothing to free */
+	remove_one_message_reference(message_route(m, i)->rd);
+
+	for (j = i + 1; j < m->nroutes; j++) {
+		*message_route(m, j - 1) = *message_route(m, j);
+	}
+
+	if (--m->nroutes >= MESSAGE_ROUTES) {
+		uint n = m->nroutes - MESSAGE_ROUTES;
+
+		if (0 == n)
+			WFREE_ARRAY_NULL(m->more, 1);
+		else
+			WREALLOC_ARRAY(m->more, n + 1, n);
+	}
 }
 
 /**
@@ -1697,9 +1866,11 @@ void
 message_add(const struct guid *muid, uint8 function,
 	gnutella_node_t *node)
 {
+	struct routing_shard *rs;
 	struct route_data *route;
 	struct message *entry;
 	struct message *m;
+	uint32 hash;
 	bool found;
 
 	found = find_message(muid, function, &m);
@@ -1742,11 +1913,16 @@ message_add(const struct guid *muid, uint8 function,
 			route = init_routing_data(node);
 	}
 
+	hash = message_hash(muid, function);
+	rs = routing_shard(hash);
+
+	spinlock(&rs->lock);
+
 	if (found)			/* Dup message forwarded due to higher TTL */
 		entry = m;		/* Reuse existing entry */
 	else {
-		entry = get_next_entry();
-		g_assert(entry->routes == NULL);
+		entry = get_next_entry(rs);
+		g_assert(0 == entry->nroutes);
 
 		/* fill in that storage space */
 		entry->muid = *muid;
@@ -1763,44 +1939,33 @@ message_add(const struct guid *muid, uint8 function,
 	 */
 
 	if (!found || !route_node_sent_message(node, m)) {
-		uint ttl;
-
-		route->saved_messages++;
-		entry->routes = pslist_append(entry->routes, route);
-
 		/*
-		 * If message is typically broadcasted, also record the TTL of
-		 * that route, since a node is allowed to resend us a message
+		 * Also record the TTL of that route, since for typically
+		 * broadcasted messages, a node is allowed to resend us a message
 		 * if it comes with a higher TTL than previously seen.
 		 *		--RAM, 2005-10-02
 		 */
 
-		ttl = node == fake_node
+		message_route_add(entry, route, node == fake_node
 				? GNET_PROPERTY(my_ttl)
-				: gnutella_header_get_ttl(&node->header);
-
-		switch (function) {
-		case GTA_MSG_PUSH_REQUEST:
-		case GTA_MSG_SEARCH:
-			entry->ttls = pslist_append(entry->ttls, GUINT_TO_POINTER(ttl));
-			break;
-		}
+				: gnutella_header_get_ttl(&node->header));
 	}
 
-	if (found)
-		return;
+	if (!found) {
+		/*
+		 * New message entry.
+		 */
 
-	/*
-	 * New message entry.
-	 */
+		if (node != fake_node)
+			entry->ttl = gnutella_header_get_ttl(&node->header);
+		else
+			entry->ttl = GNET_PROPERTY(my_ttl);
 
-	if (node != fake_node)
-		entry->ttl = gnutella_header_get_ttl(&node->header);
-	else
-		entry->ttl = GNET_PROPERTY(my_ttl);
+		/* insert the new message into the index */
+		shard_index_insert(rs, hash, message_index(rs, entry));
+	}
 
-	/* insert the new message into the hash table */
-	hset_insert(routing.messages_hashed, entry);
+	spinunlock(&rs->lock);
 }
 
 /**
@@ -1810,31 +1975,24 @@ message_add(const struct guid *muid, uint8 function,
 static void
 purge_dangling_references(struct message *m)
 {
-	pslist_t *sl;
-	pslist_t *t;
+	struct routing_shard *rs = &routing[m->shard];
+	bool locked = FALSE;
+	uint i;
 
-	for (sl = m->routes, t = m->ttls; sl; /* empty */) {
-		struct route_data *rd = sl->data;
-
-		if (rd->node == NULL) {
-			pslist_t *next = pslist_next(sl);
-			m->routes = pslist_remove_link(m->routes, sl);
-			remove_one_message_reference(rd);
-			pslist_free_1(sl);
-			sl = next;
-
-			if (t) {
-				next = pslist_next(t);
-				m->ttls = pslist_remove_link(m->ttls, t);
-				pslist_free_1(t);
-				t = next;
+	for (i = 0; i < m->nroutes; /* empty */) {
+		if (NULL == message_route(m, i)->rd->node) {
+			if (!locked) {
+				spinlock(&rs->lock);
+				locked = TRUE;
 			}
+			message_route_remove(m, i);
 		} else {
-			sl = pslist_next(sl);
-			if (t)
-				t = pslist_next(t);
+			i++;
 		}
 	}
+
+	if (locked)
+		spinunlock(&rs->lock);
 }
 
 /**
@@ -1849,9 +2007,8 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
 {
 	bool found;
 	struct message *m;
-	pslist_t *sl;
-	pslist_t *t;
 	struct route_data *route;
+	uint i;
 
 	g_assert(muid != NULL);
 	node_check(node);
@@ -1863,18 +2020,13 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
 	route = get_routing_data(node);
 	g_return_unless(route != NULL);
 
-	for (
-		sl = m->routes, t = m->ttls;
-		sl != NULL;
-		sl = pslist_next(sl), t = pslist_next(t)
-	) {
-		struct route_data *rd = sl->data;
+	for (i = 0; i < m->nroutes; i++) {
+		if (route == message_route(m, i)->rd) {
+			struct routing_shard *rs = &routing[m->shard];
 
-		if (route == rd) {
-			m->routes = pslist_remove_link(m->routes, sl);
-			if (t != NULL)
-				m->ttls = pslist_remove_link(m->ttls, t);
-			remove_one_message_reference(rd);
+			spinlock(&rs->lock);
+			message_route_remove(m, i);
+			spinunlock(&rs->lock);
 			break;
 		}
 	}
@@ -1884,22 +2036,22 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
  * Look for a particular message in the routing tables.
  *
  * If none of the nodes that sent us the message are still present, then
- * m->routes will be NULL.
+ * m->nroutes will be 0.
+ *
+ * This must only be called from the main thread, since it can update
+ * the message entry.
  *
  * @return TRUE if the message is found.
  */
 static bool
 find_message(const struct guid *muid, uint8 function, struct message **m)
 {
-	struct message dummy;
-	const void *orig_key;
-
-	dummy.muid = *muid;
-	dummy.function = function;
+	uint32 hash = message_hash(muid, function);
+	struct message *msg;
 
-	if (hset_contains_extended(routing.messages_hashed, &dummy, &orig_key)) {
-		struct message *msg = deconstify_pointer(orig_key);
+	msg = shard_lookup(routing_shard(hash), hash, muid, function);
 
+	if (msg != NULL) {
 		/* wipe out dead references to old nodes */
 		purge_dangling_references(msg);
 
@@ -2008,8 +2160,8 @@ route_max_forward_ttl(const gnutella_node_t *sender)
  * with proper routing information.
  *
  * `routes' is normally NULL unless we're forwarding a PUSH request.  In that
- * case, it must be sent to the whole list of routes we have, and `target' will
- * be NULL.
+ * case, it is the routing table entry of the target GUID and the message must
+ * be sent to the whole list of routes we have, and `target' will be NULL.
  *
  * @attention
  * NB: we're just *recording* routing information for the message into `dest',
@@ -2021,7 +2173,8 @@ static bool
 forward_message(
 	struct route_log *route_log,
 	gnutella_node_t **node,
-	gnutella_node_t *target, struct route_dest *dest, pslist_t *routes)
+	gnutella_node_t *target, struct route_dest *dest,
+	const struct message *routes)
 {
 	gnutella_node_t *sender = *node;
 
@@ -2081,15 +2234,15 @@ forward_message(
 		 */
 
 		if (routes != NULL) {
-			pslist_t *l;
 			pslist_t *nodes = NULL;
 			int count = 0;
+			uint i;
 
 			g_assert(gnutella_header_get_function(&sender->header)
 					== GTA_MSG_PUSH_REQUEST);
 
-			PSLIST_FOREACH(routes, l) {
-				struct route_data *rd = l->data;
+			for (i = 0; i < routes->nroutes; i++) {
+				struct route_data *rd = message_route(routes, i)->rd;
 				if (rd->node == sender)
 					continue;
 
@@ -2233,7 +2386,7 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 	 * each route.
 	 */
 
-	if (m->routes && route_node_sent_message(sender, m)) {
+	if (m->nroutes != 0 && route_node_sent_message(sender, m)) {
 		bool higher_ttl;
 
 		/*
@@ -2299,7 +2452,7 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 				gmsg_log_bad(sender, "dup message from same node");
 		}
 	} else {
-		if (m->routes == NULL) {
+		if (0 == m->nroutes) {
 			routing_log_extra(route_log, "all routes lost");
 
 			if (GNET_PROPERTY(log_dup_gnutella_other_node)) {
@@ -2309,13 +2462,13 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 			}
 		} else {
 			if (GNET_PROPERTY(log_gnutella_routing)) {
-				unsigned count = pslist_length(m->routes);
+				unsigned count = m->nroutes;
 				routing_log_extra(route_log, "%u remaining route%s",
 					count, plural(count));
 			}
 
 			if (GNET_PROPERTY(log_dup_gnutella_other_node)) {
-				unsigned count = pslist_length(m->routes);
+				unsigned count = m->nroutes;
 				gmsg_log_duplicate(sender,
 					"from %s: %sother node, %u route%s (dups=%u)",
 					node_infostr(sender), oob ? "OOB, " : "",
@@ -2481,7 +2634,7 @@ route_push(struct route_log *route_log,
 
 		forward_message(route_log, node, neighbour, dest, NULL);
 
-	} else if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->routes) {
+	} else if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->nroutes) {
 		gnet_stats_inc_general(GNR_PUSH_RELAYED_VIA_TABLE_ROUTE);
 
 		/*
@@ -2489,11 +2642,11 @@ route_push(struct route_log *route_log,
 		 * at least TABLE_MIN_CYCLE secs more after seeing this PUSH.
 		 */
 
-		revitalize_entry(m, FALSE);
-		forward_message(route_log, node, NULL, dest, m->routes);
+		m = revitalize_entry(m, FALSE);
+		forward_message(route_log, node, NULL, dest, m);
 
 	} else {
-		if (m && m->routes == NULL) {
+		if (m && 0 == m->nroutes) {
 			routing_log_extra(route_log, "route to target GUID %s gone",
 				guid_hex_str(guid));
 			gnet_stats_count_dropped(sender, MSG_DROP_ROUTE_LOST);
@@ -2666,7 +2819,8 @@ route_query_hit(struct route_log *route_log,
 				message_add(origin_guid, QUERY_HIT_ROUTE_SAVE, sender);
 				route_starving_check(origin_guid);
 			}
-		} else if (m->routes == NULL || !route_node_sent_message(sender, m)) {
+		} else if (0 == m->nroutes || !route_node_sent_message(sender, m)) {
+			struct routing_shard *rs = &routing[m->shard];
 			struct route_data *route;
 
 			/*
@@ -2686,10 +2840,9 @@ route_query_hit(struct route_log *route_log,
 			 * no recording of the TTLs at which we see it.
 			 */
 
-			g_assert(m->ttls == NULL);
-
-			m->routes = pslist_append(m->routes, route);
-			route->saved_messages++;
+			spinlock(&rs->lock);
+			message_route_add(m, route, 0);
+			spinunlock(&rs->lock);
 
 			/*
 			 * We just made use of this routing data: make it persist
@@ -2734,14 +2887,14 @@ route_query_hit(struct route_log *route_log,
 	 * the "message_array[]" to augment its lifetime.
 	 */
 
-	revitalize_entry(m, FALSE);
+	m = revitalize_entry(m, FALSE);
 
 	/*
-	 * If `m->routes' is NULL, we have seen the request, but unfortunately
+	 * If `m->nroutes' is 0, we have seen the request, but unfortunately
 	 * none of the nodes that sent us the request are connected any more.
 	 */
 
-	if (m->routes == NULL)
+	if (0 == m->nroutes)
 		goto route_lost;
 
 	if (route_node_sent_message(fake_node, m)) {
@@ -2778,12 +2931,12 @@ route_query_hit(struct route_log *route_log,
 	 * XXX route for relaying. --RAM, 2004-08-29
 	 */
 	{
-		pslist_t *sl;
+		uint i;
 		bool skipped_transient = FALSE;
 
 		found = NULL;
-		PSLIST_FOREACH(m->routes, sl) {
-			struct route_data *route = sl->data;
+		for (i = 0; i < m->nroutes; i++) {
+			struct route_data *route = message_route(m, i)->rd;
 
 			g_assert(route);
 			g_assert(route->node);
@@ -2806,7 +2959,7 @@ route_query_hit(struct route_log *route_log,
 				 * will be logged as a message targeted to a transient node.
 				 */
 
-				if (NULL != pslist_next(sl)) {
+				if (i + 1 < m->nroutes) {
 					gnutella_node_t *rn;
 
 					rn = route_node_get_gnutella(route->node);
@@ -3050,6 +3203,13 @@ route_message(gnutella_node_t **node, struct route_dest *dest)
 	}
 
 done:
+	BTRACE(TRACE_ROUTE, btrace_addr(sender->addr, sender->port),
+		function |
+			(gnutella_header_get_hops(&sender->header) << 8) |
+			(gnutella_header_get_ttl(&sender->header) << 16) |
+			(handle_it ? 1U << 24 : 0) | (duplicate ? 1U << 25 : 0),
+		tracing_guid(muid), dest->type);
+
 	routing_log_set_route(&route_log, dest, handle_it);
 	routing_log_flush(&route_log);
 
@@ -3070,17 +3230,36 @@ done:
  * Check whether we have a route for the reply that would be generated
  * for this request.
  *
+ * This routine can be called from any thread.
+ *
  * @returns boolean indicating whether we have such a route.
  */
 bool
 route_exists_for_reply(const struct guid *muid, uint8 function)
 {
-	struct message *m;
+	uint32 hash = message_hash(muid, function & ~0x01);
+	struct routing_shard *rs = routing_shard(hash);
+	const struct message *m;
+	bool exists = FALSE;
 
-	if (!find_message(muid, function & ~0x01, &m) || m->routes == NULL)
-		return FALSE;
+	spinlock(&rs->lock);
 
-	return TRUE;
+	m = shard_lookup(rs, hash, muid, function & ~0x01);
+
+	if (m != NULL) {
+		uint i;
+
+		for (i = 0; i < m->nroutes; i++) {
+			if (message_route(m, i)->rd->node != NULL) {
+				exists = TRUE;
+				break;
+			}
+		}
+	}
+
+	spinunlock(&rs->lock);
+
+	return exists;
 }
 
 /**
@@ -3115,13 +3294,13 @@ route_towards_guid(const struct guid *guid)
 	if (node)
 		return pslist_prepend(NULL, node);
 
-	if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->routes) {
-		pslist_t *iter, *nodes = NULL;
+	if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->nroutes) {
+		pslist_t *nodes = NULL;
+		uint i;
 
-		revitalize_entry(m, TRUE);
-		PSLIST_FOREACH(m->routes, iter) {
-			struct route_data *rd = iter->data;
-			nodes = pslist_prepend(nodes, rd->node);
+		m = revitalize_entry(m, TRUE);
+		for (i = 0; i < m->nroutes; i++) {
+			nodes = pslist_prepend(nodes, message_route(m, i)->rd->node);
 		}
 		return nodes;
 	}
@@ -3192,24 +3371,22 @@ routing_close(void)
 {
 	uint cnt;
 
-	g_assert(routing.messages_hashed != NULL);
-
-	hset_free_null(&routing.messages_hashed);
+	for (cnt = 0; cnt < SHARD_COUNT; cnt++) {
+		struct routing_shard *rs = &routing[cnt];
+		uint i, j;
 
-	for (cnt = 0; cnt < MAX_CHUNKS; cnt++) {
-		struct message **chunk = routing.chunks[cnt];
-		if (chunk != NULL) {
-			int i;
-			for (i = 0; i < CHUNK_MESSAGES; i++) {
-				struct message *m = chunk[i];
-				if (m != NULL) {
-					message_check(m, cnt);
+		for (i = 0; i < rs->nchunks; i++) {
+			for (j = 0; j < CHUNK_MESSAGES; j++) {
+				struct message *m = &rs->chunks[i][j];
+				if (m->used) {
+					message_check(rs, m);
 					free_route_list(m);
-					WFREE(m);
 				}
 			}
-			HFREE_NULL(chunk);
+			HFREE_NULL(rs->chunks[i]);
 		}
+		HFREE_NULL(rs->index);
+		spinlock_destroy(&rs->lock);
 	}
 
 	hset_foreach(ht_banned_push, free_banned_push, NULL);
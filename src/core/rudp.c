@@ -55,7 +55,19 @@
 /* The currently support protocol version. */
 static const uint16 RUDP_PROTO_VERSION = 0;
 
-static const uint16 RUDP_WINDOW = 20;
+#define RUDP_BUFFERS	64		/* Packets buffered in each direction */
+
+static const uint16 RUDP_WINDOW = RUDP_BUFFERS;
+
+/*
+ * Congestion control of the output window, all times being in ms.
+ */
+#define RUDP_CWND_INIT	4		/* Initial congestion window, in packets */
+#define RUDP_CWND_MIN	2		/* Minimal slow-start threshold */
+#define RUDP_RTO_INIT	1000	/* Retransmission timeout until RTT known */
+#define RUDP_RTO_MIN	200		/* Minimum retransmission timeout */
+#define RUDP_RTO_MAX	60000	/* Maximum retransmission timeout */
+#define RUDP_DUPACKS	3		/* Out-of-order ACKs triggering retransmit */
 
 /* Standardized RUDP packet opcodes */
 enum rudp_op {
@@ -139,7 +151,7 @@ enum rudp_list {
 static hash_list_t *rudp_list[RUDP_NUM_LISTS];
 
 struct rudp_window {
-	pmsg_t *buffers[32];
+	pmsg_t *buffers[RUDP_BUFFERS];
   	uint64 seq_no;		/* The current sequence number */
   	uint rd;			/* Read position; wrapping index into `buffers' */
   	uint wr;			/* Write position; wrapping index into `buffers' */
@@ -148,6 +160,21 @@ struct rudp_window {
 	tm_t last_event;	/* Timestamp of the last I/O event */
 };
 
+/*
+ * Transmission state of the output window, for pipelining.
+ */
+struct rudp_tx {
+	tm_t sent[RUDP_BUFFERS];	/* Last transmission time of each buffer */
+	uint8 txcnt[RUDP_BUFFERS];	/* Transmission count of each buffer */
+	uint srtt;			/* Smoothed round-trip time, 0 if unknown */
+	uint rttvar;		/* Round-trip time variation */
+	uint rto;			/* Current retransmission timeout */
+	uint cwnd;			/* Congestion window, in packets */
+	uint ssthresh;		/* Slow-start threshold */
+	uint acked;			/* ACKs counted towards window growth */
+	uint dupacks;		/* ACKs received whilst first buffer is missing */
+};
+
 struct rudp_con {
 	inputevt_handler_t event_handler;
 	inputevt_cond_t event_cond;
@@ -158,6 +185,7 @@ struct rudp_con {
 	uint8 conn_id;
 	struct rudp_window in;
 	struct rudp_window out;
+	struct rudp_tx tx;
 	enum rudp_status status;
 };
 
@@ -321,6 +349,9 @@ rudp_alloc(const host_addr_t addr, uint16 port, uint8 conn_id)
 		con->conn_id = conn_id;
 		con->in.space = RUDP_WINDOW;
 		con->out.space = RUDP_WINDOW;
+		con->tx.rto = RUDP_RTO_INIT;
+		con->tx.cwnd = RUDP_CWND_INIT;
+		con->tx.ssthresh = RUDP_WINDOW;
 		hset_insert(connections, con);
 		return con;
 	}
@@ -392,6 +423,87 @@ rudp_send_packet(struct rudp_con *con, const void *data, size_t size)
 	}
 }
 
+/**
+ * Send (or resend) the output buffer at index `i'.
+ */
+static void
+rudp_send_buffer(struct rudp_con *con, uint i)
+{
+	pmsg_t *mb;
+
+	g_assert(i < N_ITEMS(con->out.buffers));
+
+	mb = con->out.buffers[i];
+	g_return_if_fail(mb);
+
+	rudp_send_packet(con, pmsg_start(mb), pmsg_size(mb));
+	tm_now(&con->tx.sent[i]);
+	if (con->tx.txcnt[i] < MAX_INT_VAL(uint8))
+		con->tx.txcnt[i]++;
+}
+
+/**
+ * Send all the buffered packets that were never sent, as long as they fit
+ * within both the congestion window and the window advertised by the peer.
+ */
+static void
+rudp_flush(struct rudp_con *con)
+{
+	uint k, window;
+
+	window = MIN(con->tx.cwnd, con->out.space);
+	window = MIN(window, N_ITEMS(con->out.buffers));
+
+	for (k = 0; k < window; k++) {
+		uint i = (con->out.rd + k) % N_ITEMS(con->out.buffers);
+
+		if (con->out.buffers[i] != NULL && 0 == con->tx.txcnt[i])
+			rudp_send_buffer(con, i);
+	}
+}
+
+/**
+ * Update the round-trip time estimates with a new sample, as in TCP.
+ */
+static void
+rudp_rtt_sample(struct rudp_con *con, uint rtt)
+{
+	struct rudp_tx *tx = &con->tx;
+
+	if (0 == tx->srtt) {
+		tx->srtt = MAX(rtt, 1);
+		tx->rttvar = rtt / 2;
+	} else {
+		uint diff = tx->srtt > rtt ? tx->srtt - rtt : rtt - tx->srtt;
+
+		tx->rttvar = (3 * tx->rttvar + diff) / 4;
+		tx->srtt = MAX((7 * tx->srtt + rtt) / 8, 1);
+	}
+
+	tx->rto = tx->srtt + 4 * tx->rttvar;
+	tx->rto = CLAMP(tx->rto, RUDP_RTO_MIN, RUDP_RTO_MAX);
+}
+
+/**
+ * Shrink the congestion window after a loss.
+ *
+ * @param timeout	whether loss was detected by a retransmission timeout
+ */
+static void
+rudp_congestion(struct rudp_con *con, bool timeout)
+{
+	struct rudp_tx *tx = &con->tx;
+
+	tx->ssthresh = MAX(tx->cwnd / 2, RUDP_CWND_MIN);
+	tx->cwnd = timeout ? 1 : tx->ssthresh;
+	tx->acked = 0;
+
+	RUDP_DEBUG(("RUDP: %s to %s, cwnd=%u, ssthresh=%u, rto=%u",
+		timeout ? "timeout" : "fast retransmit",
+		host_addr_port_to_string(con->addr, con->port),
+		tx->cwnd, tx->ssthresh, tx->rto));
+}
+
 static inline bool
 rudp_may_send_syn(const struct rudp_con *con)
 {
@@ -446,13 +558,8 @@ rudp_send_syn(struct rudp_con *con)
 	 /* FALL THROUGH */
 	case RUDP_ST_SYN_SENT:
 		{
-			 pmsg_t *mb;
-
 			 g_return_if_fail(0 == con->out.rd);
-			 mb = con->out.buffers[con->out.rd];
-			 g_return_if_fail(mb);
-
-			 rudp_send_packet(con, pmsg_start(mb), pmsg_size(mb));
+			 rudp_send_buffer(con, con->out.rd);
 		}
 		break;
 	case RUDP_ST_ESTABLISHED:
@@ -670,11 +777,17 @@ rudp_handle_ack(struct rudp_con *con, const void *data)
 
 	{
 		bool pending;
-		uint i;
+		uint i, acked = 0, rd = con->out.rd;
+		tm_t now;
+
+		tm_now(&now);
 
 		/*
 		 * Remove all ACKed messages from the outbuf buffers. The
 		 * ACK qualifies for `seq_no' and all up to `start - 1'.
+		 *
+		 * Only buffers sent once give a valid round-trip time sample,
+		 * since we cannot know which transmission is being acknowledged.
 		 */
 		for (i = 0; i < N_ITEMS(con->out.buffers); i++) {
 			pmsg_t *mb;
@@ -687,12 +800,47 @@ rudp_handle_ack(struct rudp_con *con, const void *data)
 				header = cast_to_constpointer(pmsg_start(mb));
 				s = peek_be16(header->seq_no);
 				if (s == seq_no || s < start) {
+					if (1 == con->tx.txcnt[i]) {
+						rudp_rtt_sample(con,
+							MAX(0, tm_elapsed_ms(&now, &con->tx.sent[i])));
+					}
 					pmsg_free(mb);
 					con->out.buffers[i] = NULL;
+					con->tx.txcnt[i] = 0;
+					acked++;
 				}
 			}
 		}
 
+		/*
+		 * When later packets are acknowledged whilst the first one is still
+		 * missing, it was probably lost: resend it without waiting for the
+		 * retransmission timeout.
+		 */
+
+		if (acked != 0 && con->out.buffers[rd] != NULL) {
+			if (RUDP_DUPACKS == ++con->tx.dupacks) {
+				rudp_congestion(con, FALSE);
+				rudp_send_buffer(con, rd);
+			}
+		} else if (acked != 0) {
+			con->tx.dupacks = 0;
+		}
+
+		/*
+		 * Grow the congestion window: by one packet per ACK in slow start,
+		 * then by one packet per window's worth of ACKs.
+		 */
+
+		while (acked-- != 0 && con->tx.cwnd < N_ITEMS(con->out.buffers)) {
+			if (con->tx.cwnd < con->tx.ssthresh) {
+				con->tx.cwnd++;
+			} else if (++con->tx.acked >= con->tx.cwnd) {
+				con->tx.acked = 0;
+				con->tx.cwnd++;
+			}
+		}
+
 		pending = FALSE;
 		for (i = 0; i < N_ITEMS(con->out.buffers); i++) {
 			if (con->out.buffers[con->out.rd]) {
@@ -715,6 +863,9 @@ rudp_handle_ack(struct rudp_con *con, const void *data)
 		con->out.start = MAX(start, con->out.start);
 	}
 	con->out.space = MIN(space, N_ITEMS(con->out.buffers));
+
+	if (RUDP_ST_ESTABLISHED == con->status)
+		rudp_flush(con);	/* ACKs clock out the next packets */
 }
 
 static void
@@ -830,6 +981,7 @@ rudp_send_data(struct rudp_con *con, const void *data, size_t size)
 	pmsg_write(mb, p, data_len);
 
 	con->out.buffers[con->out.wr] = mb;
+	con->tx.txcnt[con->out.wr] = 0;
 	con->out.wr++;
 	con->out.wr %= N_ITEMS(con->out.buffers);
 
@@ -971,6 +1123,7 @@ rudp_write(struct rudp_con *con, const void *data, size_t size)
 
 	if (p != data) {
 		rudp_list_add(RUDP_LIST_PENDING, con, TRUE);
+		rudp_flush(con);
 		return p - (const char *) data;
 	} else {
 		errno = EAGAIN;
@@ -1132,13 +1285,26 @@ rudp_foreach_pending(void *data, void *unused_udata)
 
 	mb = con->out.buffers[con->out.rd];
 	if (mb) {
+		uint rd = con->out.rd;
 		tm_t now;
 
 		tm_now(&now);
 
-		if (tm_elapsed_ms(&now, &con->out.last_event) > 1000) {
-			rudp_send_packet(con, pmsg_start(mb), pmsg_size(mb));
+		/*
+		 * Resend the first unacknowledged packet on timeout, backing off
+		 * exponentially, then send whatever the window now allows.
+		 */
+
+		if (
+			con->tx.txcnt[rd] != 0 &&
+			tm_elapsed_ms(&now, &con->tx.sent[rd]) > (time_delta_t) con->tx.rto
+		) {
+			con->tx.rto = MIN(con->tx.rto * 2, RUDP_RTO_MAX);
+			con->tx.dupacks = 0;
+			rudp_congestion(con, TRUE);
+			rudp_send_buffer(con, rd);
 		}
+		rudp_flush(con);
 	}
 }
 
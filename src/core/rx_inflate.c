@@ -39,6 +39,7 @@
 #include "rx.h"
 #include "rx_inflate.h"
 #include "rxbuf.h"
+#include "zdict.h"
 
 #include "lib/base16.h"			/* For error messages */
 #include "lib/pmsg.h"
@@ -97,6 +98,22 @@ inflate_data(rxdrv_t *rx, pmsg_t *mb)
 
 	ret = inflate(inz, Z_SYNC_FLUSH);
 
+	/*
+	 * A stream made with our preset dictionary requests it right after
+	 * its header, before any data is produced.
+	 */
+
+	if (Z_NEED_DICT == ret && zdict_id() == inz->adler) {
+		const void *dict;
+		size_t len;
+
+		dict = zdict_get(&len);
+		ret = inflateSetDictionary(inz, dict, len);
+
+		if (Z_OK == ret && inz->avail_in != 0)
+			ret = inflate(inz, Z_SYNC_FLUSH);
+	}
+
 	if (ret != Z_OK && ret != Z_STREAM_END) {
 		str_t *s;
 
@@ -54,6 +54,7 @@ struct attr {
 	bio_source_t *bio;			/**< Bandwidth-limited I/O source */
 	bsched_bws_t bws;			/**< Scheduler to attach I/O source to */
 	const struct rx_link_cb *cb;/**< Layer-specific callbacks */
+	size_t guess;				/**< Guessed amount readable, 0 if unknown */
 	unsigned delivering:1;		/**< Currently delivery payloads */
 };
 
@@ -70,7 +71,7 @@ is_readable(void *data, int unused_source, inputevt_cond_t cond)
 	pmsg_t *mb;
 	ssize_t r;
 	uint i, iov_cnt;
-	size_t avail;
+	size_t avail, size = 0, maxsize = 0;
 
 	(void) unused_source;
 	g_assert(attr->bio);			/* Input enabled */
@@ -92,9 +93,17 @@ is_readable(void *data, int unused_source, inputevt_cond_t cond)
 		 * that the kernel can hold for the connection.
 		 */
 
-		avail = bio_get_bufsize(attr->bio, SOCK_BUF_RX);
-		if (0 == avail)
-			avail = 32 * 1024;	/* Guess if nothing was configured */
+		maxsize = bio_get_bufsize(attr->bio, SOCK_BUF_RX);
+		if (0 == maxsize)
+			maxsize = 32 * 1024;	/* Guess if nothing was configured */
+
+		/*
+		 * Adjust the guess to what the connection actually delivers, so
+		 * that mostly idle connections do not grab (and then release)
+		 * a full socket buffer worth of RX buffers at each read.
+		 */
+
+		avail = 0 == attr->guess ? maxsize : MIN(attr->guess, maxsize);
 	}
 
 	/*
@@ -108,6 +117,7 @@ is_readable(void *data, int unused_source, inputevt_cond_t cond)
 		db[i] = rxbuf_new();
 		len = pdata_len(db[i]);
 		iovec_set(&iov[i], pdata_start(db[i]), len);
+		size += len;
 		i++;
 
 		if (len >= avail)
@@ -132,6 +142,18 @@ is_readable(void *data, int unused_source, inputevt_cond_t cond)
 
 		g_assert(!attr->delivering);	/* No recursion: would mess up order */
 
+		/*
+		 * When we had to guess, grow the guess if we filled all the buffers
+		 * and shrink it when we used less than a quarter of them.
+		 */
+
+		if (maxsize != 0) {
+			if (UNSIGNED(r) == size)
+				attr->guess = MIN(size * 2, maxsize);
+			else if (UNSIGNED(r) < size / 4)
+				attr->guess = size / 2;
+		}
+
 		attr->delivering = TRUE;
 
 		if (attr->cb->add_rx_given != NULL)
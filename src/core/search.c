@@ -598,12 +598,55 @@ search_got_results_listener_remove(search_got_results_listener_t l)
 	LISTENER_REMOVE(search_got_results, l);
 }
 
+/**
+ * Compute the content fingerprint of a record.
+ *
+ * Records bearing a SHA1 are identified by it, the others by their name and
+ * size.  The fingerprint is never 0, which flags records not fingerprinted
+ * yet.  It is computed once and reused by the GUI to spot duplicates.
+ */
+static uint64
+search_record_fingerprint(const gnet_record_t *rc)
+{
+	uint64 fp;
+
+	if (rc->sha1 != NULL) {
+		fp = peek_le64(rc->sha1->data);		/* Already a good hash */
+	} else {
+		size_t len = vstrlen(rc->filename);
+
+		fp = (uint64) binary_hash(rc->filename, len) << 32 |
+			binary_hash2(rc->filename, len);
+		fp ^= rc->size * UINT64_CONST(0x9e3779b97f4a7c15);
+	}
+
+	return 0 == fp ? 1 : fp;
+}
+
+/**
+ * Compute the fingerprint of all the records from the set, when missing.
+ */
+static void
+search_results_fingerprint(gnet_results_set_t *rs)
+{
+	pslist_t *sl;
+
+	PSLIST_FOREACH(rs->records, sl) {
+		gnet_record_t *rc = sl->data;
+
+		if (0 == rc->fingerprint)
+			rc->fingerprint = search_record_fingerprint(rc);
+	}
+}
+
 static void
 search_fire_got_results(pslist_t *sch_matched,
-	const guid_t *muid, const gnet_results_set_t *rs)
+	const guid_t *muid, gnet_results_set_t *rs)
 {
     g_assert(rs != NULL);
 
+	search_results_fingerprint(rs);	/* For duplicate detection by the GUI */
+
 	LISTENER_EMIT(search_got_results, (sch_matched, muid, rs));
 }
 
@@ -1225,13 +1268,75 @@ search_results_set_spam(gnet_results_set_t *rs, unsigned flag)
 	rs->spam |= flag;
 }
 
+#define SEARCH_DUPES_SLOTS	256		/**< Dupes index slots kept on the stack */
+
+/**
+ * Slot in the dupes index, an open-addressed table of 64-bit keys.
+ */
+struct search_dupe_slot {
+	uint64 key;					/**< Hashed key, 0 for an empty slot */
+	const gnet_record_t *rc;	/**< Record which supplied the key */
+};
+
+/**
+ * Record key in the dupes index, unless already present.
+ *
+ * Keys are compared first, and matches confirmed by comparing the file
+ * index or the SHA1 of the records.
+ *
+ * @return TRUE if the key was already present, i.e. the record is a dup.
+ */
+static bool
+search_dupes_insert(struct search_dupe_slot *tab, size_t mask,
+	uint64 key, const gnet_record_t *rc, bool by_sha1)
+{
+	size_t i;
+
+	if G_UNLIKELY(0 == key)
+		key = 1;
+
+	for (i = key & mask; tab[i].key != 0; i = (i + 1) & mask) {
+		if (tab[i].key == key) {
+			const gnet_record_t *orc = tab[i].rc;
+
+			if (by_sha1 ? orc->sha1 == rc->sha1 :	/* atoms */
+				orc->file_index == rc->file_index
+			)
+				return TRUE;
+		}
+	}
+
+	tab[i].key = key;
+	tab[i].rc = rc;
+
+	return FALSE;
+}
+
 static void
 search_results_identify_dupes(const gnutella_node_t *n, gnet_results_set_t *rs,
 	hostiles_flags_t *hostile)
 {
-	htable_t *ht = htable_create(HASH_KEY_SELF, 0);
+	struct search_dupe_slot buf[SEARCH_DUPES_SLOTS], *tab;
 	pslist_t *sl;
 	unsigned dups = 0;
+	size_t slots;
+
+	/*
+	 * The index is sized to stay at most half full, and kept on the stack
+	 * for all the usual result sets.
+	 */
+
+	slots = next_pow2(MAX(rs->num_recs, 1) * 2);
+
+	if G_LIKELY(slots <= N_ITEMS(buf)) {
+		slots = N_ITEMS(buf);
+		ZERO(&buf);
+		tab = buf;
+	} else {
+		HALLOC0_ARRAY(tab, slots);
+	}
+
+	search_results_fingerprint(rs);
 
 	/*
 	 * Since we fake the file indices for G2 hits, skip the file index tests!
@@ -1242,49 +1347,44 @@ search_results_identify_dupes(const gnutella_node_t *n, gnet_results_set_t *rs,
 
 	/* Look for identical file index */
 	PSLIST_FOREACH(rs->records, sl) {
-		gnet_record_t *rc;
-		const void *key;
+		gnet_record_t *rc = sl->data;
+		uint64 key = (uint64) rc->file_index << 32 |
+			integer_hash(rc->file_index);
 
-		rc = sl->data;
-		key = ulong_to_pointer(rc->file_index);
-		if (htable_contains(ht, key)) {
+		if (search_dupes_insert(tab, slots - 1, key, rc, FALSE)) {
 			search_results_set_spam(rs, SPAM_F_DUP);
 			*hostile |= HSTL_DUP_INDEX;
 			rc->flags |= SR_SPAM;
 			dups++;
 			search_log_spam(n, rs, "duplicate file index %u", rc->file_index);
-		} else {
-			htable_insert(ht, key, rc);
 		}
 	}
 
+	memset(tab, 0, slots * sizeof tab[0]);
+
 sha1_check:
 
 	/* Look for identical SHA-1 */
 	PSLIST_FOREACH(rs->records, sl) {
-		gnet_record_t *rc;
-		const void *key;
+		gnet_record_t *rc = sl->data;
 
-		rc = sl->data;
-		key = rc->sha1;
-		if (NULL == key)
+		if (NULL == rc->sha1)
 			continue;
 
-		if (htable_contains(ht, key)) {
+		if (search_dupes_insert(tab, slots - 1, rc->fingerprint, rc, TRUE)) {
 			search_results_set_spam(rs, SPAM_F_DUP);
 			*hostile |= HSTL_DUP_SHA1;
 			rc->flags |= SR_SPAM;
 			dups++;
 			search_log_spam(n, rs, "duplicate SHA1 %s", sha1_base32(rc->sha1));
-		} else {
-			htable_insert(ht, key, rc);
 		}
 	}
 
 	if (rs->spam & SPAM_F_DUP)
 		gnet_stats_inc_general(GNR_SPAM_DUP_HITS);
 
-	htable_free_null(&ht);
+	if (tab != buf)
+		HFREE_NULL(tab);
 
 	if (dups != 0) {
 		search_log_spam(n, rs, "--> %u duplicate%s over %u item%s",
@@ -3409,13 +3509,19 @@ bad_packet:
  *
  * @param n			the node from which we got the QHD
  * @param browse	whether this QHD comes from a browse-host request
+ * @param display	whether hits can be dispatched to searches for display
  * @param hostile	where hostile indications are consolidated
  *
+ * When `display' is FALSE, the hit is only parsed for validation and spam
+ * detection and we do not bother extracting the information that is only
+ * of interest to the user (textual tags and file paths).
+ *
  * @return a structure describing the whole result set, or NULL if we
  * were unable to parse it properly.
  */
 static gnet_results_set_t * G_HOT
-get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
+get_results_set(gnutella_node_t *n, bool browse, bool display,
+	hostiles_flags_t *hostile)
 {
 	gnet_results_set_t *rs;
 	const char *endptr, *s, *tag;
@@ -3448,7 +3554,7 @@ get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
 		return NULL;
 	}
 
-	info = str_new(80);
+	info = NULL;			/* Created on demand, when displaying hits */
 
 	rs = search_new_r_set();
 	rs->stamp = tm_time();
@@ -3620,7 +3726,8 @@ get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
 			 * Look for a valid SHA1 or a tag string we can display.
 			 */
 
-			str_setlen(info, 0);
+			if (info != NULL)
+				str_setlen(info, 0);
 
 			for (i = 0; i < exvcnt; i++) {
 				extvec_t *e = &exv[i];
@@ -3815,7 +3922,7 @@ get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
 					break;
 				case EXT_T_GGEP_PATH:		/* Path */
 					paylen = ext_paylen(e);
-					if (!rc->path && paylen > 0) {
+					if (display && !rc->path && paylen > 0) {
 						char buf[1024];
 
 						clamp_strncpy(ARYLEN(buf), ext_payload(e), paylen);
@@ -3874,7 +3981,9 @@ get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
 					break;
 				case EXT_T_UNKNOWN:
 					has_unknown = TRUE;
-					if (ext_paylen(e) && ext_has_ascii_word(e)) {
+					if (display && ext_paylen(e) && ext_has_ascii_word(e)) {
+						if (NULL == info)
+							info = str_new(80);
 						if (str_len(info))
 							STR_CAT(info, "; ");
 						str_cat_len(info, ext_payload(e), ext_paylen(e));
@@ -3921,7 +4030,7 @@ get_results_set(gnutella_node_t *n, bool browse, hostiles_flags_t *hostile)
 			if (exvcnt)
 				ext_reset(exv, MAX_EXTVEC);
 
-			if (str_len(info) > 0)
+			if (info != NULL && str_len(info) > 0)
 				rc->tag = atom_str_get(str_2c(info));
 
 			if (hvec != NULL) {
@@ -5592,12 +5701,25 @@ search_check_alt_locs(gnet_results_set_t *rs, gnet_record_t *rc, fileinfo_t *fi)
 	}
 }
 
+/**
+ * Flag records in the results set for display purposes.
+ *
+ * The flags are only looked at by the listeners of search results and when
+ * logging query hit records, so this is skipped when nobody is going to use
+ * them, as is the case when running without a GUI.
+ */
 static void
 search_results_set_flag_records(gnet_results_set_t *rs)
 {
 	const pslist_t *sl;
 	bool need_push = FALSE;
 
+	if (
+		LISTENER_NONE(search_got_results) &&
+		!GNET_PROPERTY(log_query_hit_records)
+	)
+		return;
+
 	if (rs->guid != NULL && !guid_is_blank(rs->guid)) {
 		if ((rs->status & ST_FIREWALL) || !host_is_valid(rs->addr, rs->port)) {
 			need_push = TRUE;
@@ -5737,7 +5859,7 @@ search_browse_results(gnutella_node_t *n, gnet_search_t sh, const g2_tree_t *t)
 	hostiles_flags_t flags;
 
 	if (NULL == t)
-		rs = get_results_set(n, TRUE, &flags);
+		rs = get_results_set(n, TRUE, TRUE, &flags);
 	else
 		rs = get_g2_results_set(n, t, TRUE, &flags);
 
@@ -5864,7 +5986,7 @@ search_results_process(gnutella_node_t *n, const g2_tree_t *t, int *results)
 	 */
 
 	if (NULL == t)
-		rs = get_results_set(n, FALSE, &flags);
+		rs = get_results_set(n, FALSE, selected_searches != NULL, &flags);
 	else
 		rs = get_g2_results_set(n, t, FALSE, &flags);
 
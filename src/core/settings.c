@@ -1971,6 +1971,16 @@ rx_debug_addrs_changed(property_t prop)
 	return FALSE;
 }
 
+static bool
+dump_capture_changed(property_t prop)
+{
+	bool enabled;
+
+	gnet_prop_get_boolean_val(prop, &enabled);
+	dump_capture_enable(enabled);
+	return FALSE;
+}
+
 static bool
 dump_rx_addrs_changed(property_t prop)
 {
@@ -3510,6 +3520,11 @@ static prop_map_t property_map[] = {
 		tx_debug_addrs_changed,
 		TRUE,
 	},
+	{
+		PROP_DUMP_CAPTURE,
+		dump_capture_changed,
+		TRUE,
+	},
 	{
 		PROP_DUMP_RX_ADDRS,
 		dump_rx_addrs_changed,
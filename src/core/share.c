@@ -72,13 +72,16 @@
 #include "lib/bg.h"
 #include "lib/cq.h"
 #include "lib/crash.h"
+#include "lib/dirwatch.h"
 #include "lib/endian.h"
+#include "lib/epoch.h"
 #include "lib/file.h"
 #include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hikset.h"
 #include "lib/hset.h"
+#include "lib/hstrfn.h"
 #include "lib/htable.h"
 #include "lib/listener.h"
 #include "lib/mime_type.h"
@@ -174,11 +177,19 @@ static const struct special_file specials[] = {
 static htable_t *special_names;
 
 static hset_t *extensions;	/* Shared filename extensions */
+static uint extensions_gen;	/* Bumped when extensions are changed */
 static pslist_t *shared_dirs;
 static cevent_t *share_qrp_rebuild_ev;
 
 static hset_t *partial_files;	/* Contains partial files, thread-safe */
 
+/*
+ * Snapshot of the library search table, saved in the configuration directory
+ * along with the SHA-1 cache so that an unchanged library can be reloaded at
+ * startup without rebuilding the search bins.
+ */
+static const char search_table_file[] = "search_table";
+
 /*
  * These variables are recreated by each library scanning.
  *
@@ -758,14 +769,15 @@ shared_files_match(const char *query,
 	bool g2_query = booleanize(flags & SHARE_FM_G2);
 
 	/*
-	 * Take snapshots of the global search and partial tables, in case
-	 * they are reset by a background rescan.
+	 * The global search and partial tables can be replaced by a background
+	 * rescan, but the old ones are only freed once we leave the read-side
+	 * section, so we do not need to take any lock nor reference.
 	 */
 
-	SHARED_LIBFILE_LOCK;
-	gt = st_refcnt_inc(shared_libfile.search_table);
-	pt = partials ? st_refcnt_inc(shared_libfile.partial_table) : NULL;
-	SHARED_LIBFILE_UNLOCK;
+	epoch_enter();
+	gt = atomic_ptr_get((void * const *) &shared_libfile.search_table);
+	pt = partials ?
+		atomic_ptr_get((void * const *) &shared_libfile.partial_table) : NULL;
 
 	/*
 	 * First search from the library.
@@ -792,8 +804,7 @@ shared_files_match(const char *query,
 			g2_query ? GNR_LOCAL_G2_PARTIAL_HITS : GNR_LOCAL_PARTIAL_HITS, n);
 	}
 
-	st_free(&gt);
-	st_free(&pt);
+	epoch_leave();
 }
 
 /**
@@ -1012,6 +1023,7 @@ parse_extensions(const char *str)
 
 	free_extensions();
 	extensions = hset_create_any(ascii_strcase_hash, NULL, ascii_strcase_eq);
+	extensions_gen++;
 
 	for (i = 0; exts[i]; i++) {
 		char c;
@@ -1496,6 +1508,223 @@ share_tthset_free(hset_t *set)
 	hset_free_null(&set);
 }
 
+/**
+ * Directory scanning cache.
+ *
+ * For each directory scanned, we remember the entries we found there along
+ * with the attributes returned by stat().  As long as the directory watcher
+ * reports the directory as unchanged since it was last scanned, the next
+ * rescan replays these entries instead of reading the directory and calling
+ * stat() on each of its files, which saves most of the I/O for large
+ * libraries where only a few directories change between rescans.
+ *
+ * The entries replayed go through share_scan_add_file() again, so all
+ * the filtering done there (spam, partial files, etc...) is re-evaluated.
+ *
+ * Directories holding symbolic links are never cached since changes made
+ * to the target of the link would go unnoticed.
+ *
+ * This cache is only accessed from the thread doing the library scans.
+ */
+struct share_dir_file {
+	const char *pathname;		/* Full pathname (atom) */
+	filesize_t size;			/* File size */
+	time_t mtime;				/* Last modification time */
+	time_t ctime;				/* Last status change time */
+};
+
+struct share_dir {
+	const char *path;			/* Directory path (atom) */
+	pslist_t *files;			/* List of struct share_dir_file */
+	pslist_t *subdirs;			/* List of sub-directory paths (atoms) */
+	uint generation;			/* Last scan generation using this entry */
+};
+
+static htable_t *share_dir_cache;	/* path -> struct share_dir */
+static dirwatch_t *share_dirwatch;	/* Monitors the cached directories */
+static uint share_dir_generation;	/* Current scan generation */
+static uint share_dir_config;		/* Scan configuration signature */
+
+static void
+share_dir_file_free(void *data)
+{
+	struct share_dir_file *df = data;
+
+	atom_str_free_null(&df->pathname);
+	WFREE(df);
+}
+
+static void
+share_dir_subdir_free(void *data)
+{
+	atom_str_free(data);
+}
+
+static void
+share_dir_free(struct share_dir *sd)
+{
+	pslist_free_full_null(&sd->files, share_dir_file_free);
+	pslist_free_full_null(&sd->subdirs, share_dir_subdir_free);
+	atom_str_free_null(&sd->path);
+	WFREE(sd);
+}
+
+static struct share_dir *
+share_dir_alloc(const char *path)
+{
+	struct share_dir *sd;
+
+	WALLOC0(sd);
+	sd->path = atom_str_get(path);
+	sd->generation = share_dir_generation;
+
+	return sd;
+}
+
+static void
+share_dir_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	(void) unused_key;
+	(void) unused_data;
+
+	share_dir_free(value);
+}
+
+/**
+ * Discard all cached directories.
+ */
+static void
+share_dir_cache_clear(void)
+{
+	if (share_dir_cache != NULL) {
+		htable_foreach(share_dir_cache, share_dir_free_kv, NULL);
+		htable_clear(share_dir_cache);
+	}
+	dirwatch_free_null(&share_dirwatch);
+}
+
+/**
+ * Free the directory cache.
+ */
+static void
+share_dir_cache_free(void)
+{
+	share_dir_cache_clear();
+	htable_free_null(&share_dir_cache);
+}
+
+/**
+ * Prepare the directory cache for a new scan.
+ *
+ * The cache is flushed when the scanning configuration changed since the
+ * previous scan since its entries were filtered using the old settings.
+ */
+static void
+share_dir_cache_prepare(void)
+{
+	uint config;
+
+	config = extensions_gen +
+		(GNET_PROPERTY(scan_ignore_symlink_dirs) ? 1U << 30 : 0) +
+		(GNET_PROPERTY(scan_ignore_symlink_regfiles) ? 1U << 31 : 0);
+
+	if (config != share_dir_config) {
+		share_dir_cache_clear();
+		share_dir_config = config;
+	}
+
+	if (NULL == share_dir_cache)
+		share_dir_cache = htable_create(HASH_KEY_STRING, 0);
+
+	if (NULL == share_dirwatch)
+		share_dirwatch = dirwatch_make("library");
+
+	share_dir_generation++;
+}
+
+static bool
+share_dir_is_stale(const void *unused_key, void *value, void *unused_data)
+{
+	struct share_dir *sd = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	if (sd->generation == share_dir_generation)
+		return FALSE;
+
+	dirwatch_remove(share_dirwatch, sd->path);
+	share_dir_free(sd);
+	return TRUE;
+}
+
+/**
+ * Remove directories that were not part of the last completed scan.
+ */
+static void
+share_dir_cache_prune(void)
+{
+	size_t n;
+
+	if (NULL == share_dir_cache)
+		return;
+
+	n = htable_foreach_remove(share_dir_cache, share_dir_is_stale, NULL);
+
+	if (GNET_PROPERTY(share_debug) > 1) {
+		g_debug("SHARE directory cache holds %zu entr%s (%zu pruned), "
+			"%zu watched",
+			htable_count(share_dir_cache), plural_y(htable_count(share_dir_cache)),
+			n, dirwatch_count(share_dirwatch));
+	}
+}
+
+/**
+ * Fetch cached directory if we know it has not changed since the last scan.
+ *
+ * @return the cached directory, NULL if directory needs to be scanned.
+ */
+static struct share_dir *
+share_dir_cached(const char *path)
+{
+	struct share_dir *sd;
+
+	if (NULL == share_dir_cache)
+		return NULL;
+
+	sd = htable_lookup(share_dir_cache, path);
+	if (NULL == sd)
+		return NULL;
+
+	if (!dirwatch_is_clean(share_dirwatch, path))
+		return NULL;
+
+	sd->generation = share_dir_generation;
+	return sd;
+}
+
+/**
+ * Install the freshly scanned directory in the cache.
+ */
+static void
+share_dir_install(struct share_dir *sd)
+{
+	struct share_dir *old;
+
+	g_assert(share_dir_cache != NULL);
+
+	sd->files = pslist_reverse(sd->files);
+	sd->subdirs = pslist_reverse(sd->subdirs);
+
+	old = htable_lookup(share_dir_cache, sd->path);
+	if (old != NULL) {
+		htable_remove(share_dir_cache, old->path);
+		share_dir_free(old);
+	}
+
+	htable_insert(share_dir_cache, sd->path, sd);
+}
+
 enum recursive_scan_magic { RECURSIVE_SCAN_MAGIC = 0x16926d87U };
 
 struct recursive_scan {
@@ -1519,12 +1748,18 @@ struct recursive_scan {
 	shared_file_t **ftable;		/* cloned file_table, contains ref-counted sf */
 	search_table_t *search_tb;	/* the new search table */
 	search_table_t *partial_tb;	/* the new partial table */
+	const shared_file_t **st_files;	/* files in search table insertion order */
+	size_t st_files_count;		/* amount of entries in st_files[] */
+	bool search_tb_loaded;		/* whether search table came from snapshot */
 	size_t partial_files_count;	/* amount of partials in hset when we started */
 	uint64 files_scanned;		/* amount of files shared in the library */
 	uint64 bytes_scanned;		/* size of the library */
 	int idx;					/* iterating index */
 	int ticks;					/* ticks used */
 	size_t ftable_capacity;		/* Amount of entries in ftable[] */
+	struct share_dir *dir;		/* directory being recorded, if any */
+	struct share_dir *replay;	/* cached directory being replayed */
+	pslist_t *replay_next;		/* next cached file to replay */
 };
 
 static inline void
@@ -1538,6 +1773,18 @@ recursive_scan_check(const struct recursive_scan * const ctx)
 	g_assert(ctx->partial_files != NULL);
 }
 
+/**
+ * Stop recording the current directory, which cannot be cached.
+ */
+static void
+recursive_scan_dir_uncachable(struct recursive_scan *ctx)
+{
+	if (ctx->dir != NULL) {
+		share_dir_free(ctx->dir);
+		ctx->dir = NULL;
+	}
+}
+
 static struct recursive_scan *
 recursive_scan_new(const pslist_t *base_dirs, time_t now)
 {
@@ -1574,6 +1821,9 @@ recursive_scan_closedir(struct recursive_scan *ctx)
 		closedir(ctx->directory);
 		ctx->directory = NULL;
 	}
+	recursive_scan_dir_uncachable(ctx);
+	ctx->replay = NULL;
+	ctx->replay_next = NULL;
 }
 
 static void recursive_sf_unref(void *o)
@@ -1629,6 +1879,7 @@ recursive_scan_context_free(void *data)
 	htable_free_null(&ctx->basenames);
 	st_free(&ctx->search_tb);
 	st_free(&ctx->partial_tb);
+	HFREE_NULL(ctx->st_files);
 	atom_str_free_null(&ctx->base_dir);
 	qrp_dispose_words(&ctx->words);
 
@@ -1652,6 +1903,31 @@ recursive_scan_context_free(void *data)
 	WFREE(ctx);
 }
 
+/**
+ * Free search table once it can no longer be used by shared_files_match().
+ */
+static void
+share_search_table_free(void *data)
+{
+	search_table_t *st = data;
+
+	st_free(&st);
+}
+
+/**
+ * Retire search table after it was replaced, nullifying its pointer.
+ */
+static void
+share_search_table_retire(search_table_t **st_ptr)
+{
+	search_table_t *st = *st_ptr;
+
+	if (st != NULL) {
+		*st_ptr = NULL;
+		epoch_defer(share_search_table_free, st);
+	}
+}
+
 /**
  * Free up memory used by the shared library.
  */
@@ -1721,10 +1997,14 @@ shared_file_sort_by_name(const void *f1, const void *f2)
 static void
 recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 {
+	struct share_dir *sd;
+
 	recursive_scan_check(ctx);
 	g_assert(NULL == ctx->directory);
 	g_assert(NULL == ctx->relative_path);
 	g_assert(NULL == ctx->current_dir);
+	g_assert(NULL == ctx->dir);
+	g_assert(NULL == ctx->replay);
 
 	g_return_if_fail('\0' != dir[0]);
 	g_return_if_fail(is_absolute_path(ctx->base_dir));
@@ -1733,13 +2013,42 @@ recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 	if (directory_is_unshareable(dir))
 		return;
 
-	/**
-	 * FIXME: On Windows FindFirstFile/FindNextFile/FindClose
-	 *		  must be used to get the Unicode filenames.
-	 */
-	if (!(ctx->directory = opendir(dir))) {
-		g_warning("can't open directory %s: %m", dir);
-		return;
+	sd = share_dir_cached(dir);
+
+	if (sd != NULL) {
+		const pslist_t *sl;
+
+		/*
+		 * Directory unchanged since last scan, replay its entries.
+		 */
+
+		ctx->replay = sd;
+		ctx->replay_next = sd->files;
+
+		PSLIST_FOREACH(sd->subdirs, sl) {
+			slist_prepend(ctx->sub_dirs, h_strdup(sl->data));
+		}
+
+		if (GNET_PROPERTY(share_debug) > 5)
+			g_debug("SHARE directory \"%s\" unchanged", dir);
+	} else {
+		/*
+		 * The watch must be armed before we read the directory, so that
+		 * changes made whilst we are scanning it are not missed.
+		 */
+
+		if (dirwatch_add(share_dirwatch, dir))
+			ctx->dir = share_dir_alloc(dir);
+
+		/**
+		 * FIXME: On Windows FindFirstFile/FindNextFile/FindClose
+		 *		  must be used to get the Unicode filenames.
+		 */
+		if (!(ctx->directory = opendir(dir))) {
+			g_warning("can't open directory %s: %m", dir);
+			recursive_scan_dir_uncachable(ctx);
+			return;
+		}
 	}
 
 	/* Get relative path if required */
@@ -1820,11 +2129,13 @@ recursive_scan_readdir(struct recursive_scan *ctx)
 		if (S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode)) {
 			if (stat(fullpath, &sb)) {
 				g_warning("stat() failed %s: %m", fullpath);
+				recursive_scan_dir_uncachable(ctx);
 				goto finish;
 			}
 		} else if (!S_ISLNK(sb.st_mode)) {
 			if (lstat(fullpath, &sb)) {
 				g_warning("lstat() failed %s: %m", fullpath);
+				recursive_scan_dir_uncachable(ctx);
 				goto finish;
 			}
 
@@ -1847,6 +2158,9 @@ recursive_scan_readdir(struct recursive_scan *ctx)
 
 		/* Get info on the symlinked file */
 		if (S_ISLNK(sb.st_mode)) {
+			/* Changes behind symbolic links are not monitored */
+			recursive_scan_dir_uncachable(ctx);
+
 			if (stat(fullpath, &sb)) {
 				g_warning("broken symlink %s: %m", fullpath);
 				goto finish;
@@ -1878,6 +2192,10 @@ recursive_scan_readdir(struct recursive_scan *ctx)
 
 		if (S_ISDIR(sb.st_mode)) {
 			/* If a directory, add to list for later processing */
+			if (ctx->dir != NULL) {
+				ctx->dir->subdirs = pslist_prepend(ctx->dir->subdirs,
+					deconstify_char(atom_str_get(fullpath)));
+			}
 			slist_prepend(ctx->sub_dirs, fullpath);
 			fullpath = NULL;
 		} else if (S_ISREG(sb.st_mode)) {
@@ -1886,12 +2204,27 @@ recursive_scan_readdir(struct recursive_scan *ctx)
 			if (GNET_PROPERTY(share_debug) > 10)
 				g_debug("SHARE adding file \"%s\"", filename);
 
+			if (ctx->dir != NULL) {
+				struct share_dir_file *df;
+
+				WALLOC(df);
+				df->pathname = atom_str_get(fullpath);
+				df->size = sb.st_size;
+				df->mtime = sb.st_mtime;
+				df->ctime = sb.st_ctime;
+				ctx->dir->files = pslist_prepend(ctx->dir->files, df);
+			}
+
 			sf = share_scan_add_file(ctx->relative_path, fullpath, &sb);
 			if (sf) {
 				slist_append(ctx->shared_files, shared_file_ref(sf));
 			}
 		}
 	} else {
+		if (ctx->dir != NULL) {
+			share_dir_install(ctx->dir);
+			ctx->dir = NULL;
+		}
 		recursive_scan_closedir(ctx);
 	}
 
@@ -1899,6 +2232,39 @@ finish:
 	HFREE_NULL(fullpath);
 }
 
+/**
+ * Replay next entry of the cached directory being scanned.
+ */
+static void
+recursive_scan_replay(struct recursive_scan *ctx)
+{
+	const struct share_dir_file *df;
+	shared_file_t *sf;
+	filestat_t sb;
+
+	recursive_scan_check(ctx);
+	g_assert(ctx->replay != NULL);
+
+	if (NULL == ctx->replay_next) {
+		recursive_scan_closedir(ctx);
+		return;
+	}
+
+	df = ctx->replay_next->data;
+	ctx->replay_next = pslist_next(ctx->replay_next);
+
+	ZERO(&sb);
+	sb.st_mode = S_IFREG;
+	sb.st_size = df->size;
+	sb.st_mtime = df->mtime;
+	sb.st_ctime = df->ctime;
+
+	sf = share_scan_add_file(ctx->relative_path, df->pathname, &sb);
+	if (sf) {
+		slist_append(ctx->shared_files, shared_file_ref(sf));
+	}
+}
+
 /**
  * Callback invoked by the background task layer when a task is terminated.
  */
@@ -2002,6 +2368,7 @@ recursive_scan_step_setup(struct bgtask *bt, void *data, int uticks)
 	bg_task_signal(bt, BG_SIG_TERM, recursive_scan_sighandler);
 
 	atomic_bool_set(&share_rebuilding, TRUE);
+	share_dir_cache_prepare();
 
 	/*
 	 * If we're not running in the main thread, we need to funnel this
@@ -2026,7 +2393,10 @@ recursive_scan_next_dir(struct recursive_scan *ctx)
 
 	bg_task_cancel_test(ctx->task);
 
-	if (ctx->directory) {
+	if (ctx->replay != NULL) {
+		recursive_scan_replay(ctx);
+		return FALSE;
+	} else if (ctx->directory) {
 		recursive_scan_readdir(ctx);
 		return FALSE;
 	} else if (slist_length(ctx->sub_dirs) > 0) {
@@ -2079,7 +2449,37 @@ recursive_scan_step_compute_done(struct bgtask *bt, void *data, int ticks)
 
 	ctx->files_scanned = slist_length(ctx->shared_files);
 	ctx->bytes_scanned = 0;
-	ctx->search_tb = st_create();
+
+	/*
+	 * Record the files in the order they will be inserted in the search
+	 * table, so that we can reload the table saved by the previous scan
+	 * if none of the files changed since then.
+	 */
+
+	ctx->st_files_count = slist_length(ctx->shared_files);
+	HALLOC_ARRAY(ctx->st_files, ctx->st_files_count);
+
+	{
+		slist_iter_t *iter = slist_iter_on_head(ctx->shared_files);
+		size_t i = 0;
+
+		while (slist_iter_has_item(iter)) {
+			g_assert(i < ctx->st_files_count);
+			ctx->st_files[i++] = slist_iter_current(iter);
+			slist_iter_next(iter);
+		}
+		slist_iter_free(&iter);
+	}
+
+	ctx->search_tb = st_retrieve(settings_config_dir(), search_table_file,
+		ctx->st_files, ctx->st_files_count);
+
+	if (ctx->search_tb != NULL)
+		ctx->search_tb_loaded = TRUE;
+	else
+		ctx->search_tb = st_create();
+
+	share_dir_cache_prune();
 
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
@@ -2109,16 +2509,27 @@ recursive_scan_step_build_search_table(struct bgtask *bt, void *data, int ticks)
 		g_assert(1 == sf->refcnt);
 		ctx->bytes_scanned += sf->file_size;
 
-		st_insert_item(ctx->search_tb, ST_SET_PLAIN, sf->name_canonic, sf);
-		if (sf->name_normal != NULL)
-			st_insert_item(ctx->search_tb, ST_SET_ALIAS, sf->name_normal, sf);
+		if (!ctx->search_tb_loaded) {
+			st_insert_item(ctx->search_tb, ST_SET_PLAIN, sf->name_canonic, sf);
+			if (sf->name_normal != NULL)
+				st_insert_item(ctx->search_tb, ST_SET_ALIAS, sf->name_normal, sf);
+		}
 
 		ctx->shared = pslist_prepend_const(ctx->shared, sf);
 		upload_stats_enforce_local_filename(sf);
 	}
 
-	/* Compact the search table */
-	st_compact(ctx->search_tb);
+	/*
+	 * Compact the search table and save it for the next scan, unless it was
+	 * reloaded from the saved snapshot, in which case it is already compact.
+	 */
+
+	if (!ctx->search_tb_loaded) {
+		st_compact(ctx->search_tb);
+		st_store(ctx->search_tb, settings_config_dir(), search_table_file,
+			ctx->st_files, ctx->st_files_count);
+	}
+	HFREE_NULL(ctx->st_files);
 	ctx->ticks += 5;
 
 	bg_task_ticks_used(bt, ctx->ticks);
@@ -2337,6 +2748,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	struct recursive_scan *ctx = data;
 	size_t i;
 	pslist_t *files;
+	search_table_t *old_st;
 
 	recursive_scan_check(ctx);
 	g_assert(ctx->search_tb != NULL);
@@ -2384,6 +2796,14 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 
 	files = shared_libfile.shared_files;
 	shared_libfile.shared_files = NULL;
+
+	/*
+	 * Nor the search table, which can still be used by concurrent searches
+	 * and will be retired once the new one is installed.
+	 */
+
+	old_st = shared_libfile.search_table;
+	shared_libfile.search_table = NULL;
 	share_free();
 
 	/*
@@ -2420,6 +2840,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 
 	SHARED_LIBFILE_UNLOCK;
 
+	share_search_table_retire(&old_st);
 	shared_file_slist_free_null(&files);
 
 	/*
@@ -2673,6 +3094,7 @@ static bgret_t
 recursive_scan_step_install_partials(struct bgtask *bt, void *data, int ticks)
 {
 	struct recursive_scan *ctx = data;
+	search_table_t *old_st;
 
 	recursive_scan_check(ctx);
 	g_assert(ctx->partial_tb != NULL);
@@ -2693,12 +3115,14 @@ recursive_scan_step_install_partials(struct bgtask *bt, void *data, int ticks)
 
 	SHARED_LIBFILE_LOCK;
 
-	st_free(&shared_libfile.partial_table);
+	old_st = shared_libfile.partial_table;
 	shared_libfile.partial_table = ctx->partial_tb;
 	ctx->partial_tb = NULL;
 
 	SHARED_LIBFILE_UNLOCK;
 
+	share_search_table_retire(&old_st);
+
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
 }
@@ -3179,6 +3603,7 @@ share_thread_main(void *arg)
 	}
 
 	bg_sched_destroy_null(&v->sched);
+	share_dir_cache_free();
 
 	g_debug("library thread exiting");
 	return NULL;
@@ -3262,6 +3687,8 @@ share_close(void)
 {
 	if (THREAD_MAIN_ID != share_thread_id)
 		thread_kill(share_thread_id, TSIG_TERM);
+	else
+		share_dir_cache_free();
 
 	/*
 	 * This call must happen after node_close() to ensure the UDP TX scheduler
@@ -3279,7 +3706,9 @@ share_close(void)
 	oob_proxy_close();
 	oob_close();			/* References hits, so needs ``sha1_to_share'' */
 	qhit_close();
+	st_close();
 	st_free(&shared_libfile.partial_table);
+	(void) epoch_reclaim();		/* Free retired search tables, if possible */
 	htable_free_null(&share_media_types);
 	hset_free_null(&partial_files);
 	hikset_free_null(&sha1_to_share);
@@ -4053,6 +4482,17 @@ shared_file_has_media_type(const shared_file_t *sf, unsigned mask)
 	return 0 != (sf->media_type & mask);
 }
 
+/**
+ * @return media type mask of the shared file, 0 if unknown.
+ */
+unsigned
+shared_file_media_mask(const shared_file_t *sf)
+{
+	shared_file_check(sf);
+
+	return sf->media_type;
+}
+
 /**
  * Convenience routine: compute media type mask for a file name, corresponding
  * to the bits in the media type filter that must be set to return this type
@@ -150,6 +150,7 @@ bool shared_file_tth_is_available(const shared_file_t *sf);
 void shared_file_from_fileinfo(fileinfo_t *fi);
 bool shared_file_has_media_type(const shared_file_t *sf, unsigned m)
 	G_PURE;
+unsigned shared_file_media_mask(const shared_file_t *sf) G_PURE;
 
 struct pslist;
 
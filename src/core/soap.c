@@ -660,14 +660,27 @@ soap_build_request(const http_async_t *ha,
 		sr->regular = TRUE;
 	}
 
+	/*
+	 * Unless persistent connections are allowed, ask the server to close
+	 * the connection after its reply.
+	 */
+
 	if (sr->options & SOAP_RPC_O_ALL_CAPS) {
-		fixed_header =
+		fixed_header = (sr->options & SOAP_RPC_O_KEEP_ALIVE) ?
+			"ACCEPT-ENCODING: deflate\r\n"
+			"CACHE-CONTROL: no-cache\r\n"
+			"PRAGMA: no-cache\r\n"
+			:
 			"ACCEPT-ENCODING: deflate\r\n"
 			"CONNECTION: close\r\n"
 			"CACHE-CONTROL: no-cache\r\n"
 			"PRAGMA: no-cache\r\n";
 	} else {
-		fixed_header =
+		fixed_header = (sr->options & SOAP_RPC_O_KEEP_ALIVE) ?
+			"Accept-Encoding: deflate\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Pragma: no-cache\r\n"
+			:
 			"Accept-Encoding: deflate\r\n"
 			"Connection: close\r\n"
 			"Cache-Control: no-cache\r\n"
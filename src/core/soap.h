@@ -87,6 +87,7 @@ typedef void (*soap_error_cb_t)(const soap_rpc_t *sr,
 #define SOAP_RPC_O_MAN_RETRY	(1 << 1)	/**< Allow mandatory HTTP retry */
 #define SOAP_RPC_O_LOCAL_ADDR	(1 << 2)	/**< Grab local IP address */
 #define SOAP_RPC_O_ALL_CAPS		(1 << 3)	/**< Emit all-caps header names */
+#define SOAP_RPC_O_KEEP_ALIVE	(1 << 4)	/**< Allow persistent connection */
 
 /*
  * Public interface.
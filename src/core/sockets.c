@@ -34,6 +34,8 @@
  * @date 2001-2003, 2012-2013
  */
 
+#define _GNU_SOURCE		/* Needed on linux for recvmmsg() and sendmmsg() */
+
 #include "common.h"
 
 #ifdef I_NETDB
@@ -42,6 +44,9 @@
 #ifdef I_PWD
 #include <pwd.h>
 #endif
+#if defined(HAS_SENDMMSG) && defined(LINUX_SYSTEM)
+#include <netinet/udp.h>	/* For UDP_SEGMENT */
+#endif
 
 #include "sockets.h"
 
@@ -86,6 +91,7 @@
 #include "lib/header.h"
 #include "lib/misc.h"			/* For english_strerror() */
 #include "lib/once.h"
+#include "lib/pmsg.h"
 #include "lib/pslist.h"
 #include "lib/random.h"
 #include "lib/str.h"
@@ -114,7 +120,21 @@
 #define MAX_UDP_LOOP_MS		37		/**< Amount of CPU time we can spend */
 #define UDP_QUEUED_GUESS	65536	/**< Guess amount of pending RX input */
 #define UDP_QUEUE_DELAY_MS	250		/**< RX queue processing delay */
+#define UDP_RX_BATCH		16		/**< Max datagrams read per system call */
+#define UDP_TX_BATCH		16		/**< Max datagrams sent per system call */
+#define UDP_GSO_SEGMENTS	64		/**< Max segments per super-datagram */
+#define UDP_GSO_SEGSIZE		1232	/**< Max segment, IPv6 minimum MTU */
+#define UDP_GSO_MAXLEN		65000	/**< Max length of a super-datagram */
 #define TLS_BAN_FREQ		300		/**< Avoid TLS for 5 minutes */
+#define SOCKET_ACCEPT_BATCH	64		/**< Max accept() per I/O event */
+#define SOCKET_FD_RESERVE	32		/**< Spare fds for files and connect() */
+#define SOCKET_TCP_INFO_PERIOD	5	/**< secs, min delay between samplings */
+
+#ifdef SOMAXCONN
+#define SOCKET_TCP_BACKLOG	SOMAXCONN	/**< TCP listen() backlog */
+#else
+#define SOCKET_TCP_BACKLOG	128
+#endif
 
 enum {
 	SOCK_ADNS_PENDING	= 1 << 0,	/**< Don't free() the socket too early */
@@ -1540,6 +1560,67 @@ socket_udp_qfree(void *item, void *unused_data)
 	socket_udpq_free(item);
 }
 
+#ifdef HAS_RECVMMSG
+/**
+ * Ring of datagrams read from the kernel with a single recvmmsg() call.
+ *
+ * Each datagram is read into its own message block, large enough to hold
+ * the largest datagram we can read in the socket's buffer.  The datagrams
+ * are then handed out one at a time, in the order they were received, and
+ * the ring is only refilled once all of them have been consumed.
+ */
+struct udp_rx_ring {
+	struct mmsghdr hdr[UDP_RX_BATCH];	/**< Message headers */
+	iovec_t iov[UDP_RX_BATCH];			/**< Single I/O vector per datagram */
+	socket_addr_t from[UDP_RX_BATCH];	/**< Sender of each datagram */
+	pmsg_t *mb[UDP_RX_BATCH];			/**< Buffers holding the datagrams */
+#if defined(CMSG_LEN) && defined(CMSG_SPACE)
+	union {
+		struct cmsghdr hdr;
+		size_t align;
+		char bytes[CMSG_SPACE(512)];
+	} cmsg[UDP_RX_BATCH];				/**< Ancillary data */
+#endif	/* CMSG_LEN && CMSG_SPACE */
+	uint count;							/**< Datagrams held in the ring */
+	uint next;							/**< Next datagram to hand out */
+	bool disabled;						/**< Kernel lacks recvmmsg() */
+};
+
+/**
+ * Free the reception ring of the UDP context, if any.
+ */
+static void
+socket_udp_ring_free(struct udpctx *uctx)
+{
+	struct udp_rx_ring *ring = uctx->ring;
+	uint i;
+
+	if (NULL == ring)
+		return;
+
+	for (i = 0; i < N_ITEMS(ring->mb); i++)
+		pmsg_free_null(&ring->mb[i]);
+
+	WFREE(ring);
+	uctx->ring = NULL;
+}
+
+/**
+ * @return whether datagrams remain to be handed out from the reception ring.
+ */
+static inline bool
+socket_udp_ring_pending(const gnutella_socket_t *s)
+{
+	const struct udp_rx_ring *ring = s->resource.udp->ring;
+
+	return ring != NULL && ring->next < ring->count;
+}
+
+#else	/* !HAS_RECVMMSG */
+#define socket_udp_ring_free(u)		((void) (u))
+#define socket_udp_ring_pending(s)	((void) (s), FALSE)
+#endif	/* HAS_RECVMMSG */
+
 /**
  * Dispose of socket, closing connection, removing input callback, and
  * reclaiming attached getline buffer.
@@ -1560,6 +1641,7 @@ socket_free(struct gnutella_socket *s)
 		struct udpctx *uctx = s->resource.udp;
 		if (uctx != NULL) {
 			WFREE_NULL(uctx->socket_addr, sizeof(socket_addr_t));
+			socket_udp_ring_free(uctx);
 			eslist_foreach(&uctx->queue, socket_udp_qfree, NULL);
 			cq_cancel(&uctx->queue_ev);
 			WFREE(s->resource.udp);
@@ -2482,37 +2564,18 @@ socket_local_port(const struct gnutella_socket *s)
 }
 
 /**
- * Someone is connecting to us.
+ * Accept one incoming connection on listening socket.
+ *
+ * @return TRUE if a connection was pending, FALSE if none could be accepted.
  */
-static void
-socket_accept(void *data, int unused_source, inputevt_cond_t cond)
+static bool
+socket_accept_one(struct gnutella_socket *s)
 {
 	socket_addr_t addr;
 	socklen_t addr_len;
-	struct gnutella_socket *s = data;
 	struct gnutella_socket *t = NULL;
 	int fd;
 
-	(void) unused_source;
-	socket_check(s);
-	g_assert(s->flags & (SOCK_F_TCP | SOCK_F_LOCAL));
-
-	if G_UNLIKELY(cond & INPUT_EVENT_EXCEPTION) {
-		g_warning("%s(): input exception on TCP listening socket #%d!",
-			G_STRFUNC, s->file_desc);
-		return;		/* Ignore it, what else can we do? */
-	}
-
-	switch (s->type) {
-	case SOCK_TYPE_CONTROL:
-		break;
-	default:
-		g_warning("%s(): unknown listening socket type %d !",
-			G_STRFUNC, s->type);
-		socket_destroy(s, NULL);
-		return;
-	}
-
 	addr_len = socket_addr_init(&addr, s->net);
 	fd = compat_accept(s->file_desc,
 			socket_addr_get_sockaddr(&addr), &addr_len);
@@ -2543,11 +2606,33 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 					socket_evt_clear(s);
 				}
 			}
-			return;
+			return FALSE;
 		}
 
 		g_warning("had to close a banned fd to accept new connection");
 	}
+
+	/*
+	 * Descriptors are allocated lowest-first, hence the value of the one we
+	 * just got tells us how many are in use.  When we get close to the
+	 * limit, try to make room by reclaiming a banned descriptor, and if we
+	 * cannot, refuse the connection before spending any work on it: the
+	 * remaining descriptors are kept for files and outgoing connections,
+	 * instead of being reclaimed later on after wasting a handshake.
+	 */
+
+	if G_UNLIKELY(
+		UNSIGNED(fd) + SOCKET_FD_RESERVE >= GNET_PROPERTY(sys_nofile) &&
+		(NULL == reclaim_fd || !(*reclaim_fd)())
+	) {
+		if (GNET_PROPERTY(socket_debug)) {
+			g_debug("%s(): running short of fds, refusing connection (fd=%d)",
+				G_STRFUNC, fd);
+		}
+		fd_close(&fd);
+		return TRUE;
+	}
+
 	fd = fd_get_non_stdio(fd);
 
 	if (s->flags & SOCK_F_TCP)
@@ -2582,14 +2667,14 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 		if (socket_addr_getpeername(&addr, t->file_desc)) {
 			g_warning("getpeername() failed: %m");
 			socket_free_null(&t);
-			return;
+			return TRUE;
 		}
 		t->addr = socket_addr_get_addr(&addr);
 		t->port = socket_addr_get_port(&addr);
 		if (!is_host_addr(t->addr)) {
 			g_warning("incoming TCP connection from unidentifiable source");
 			socket_free_null(&t);
-			return;
+			return TRUE;
 		}
 		g_warning("had to use getpeername() after accept(): peer=%s",
 			host_addr_port_to_string(t->addr, t->port));
@@ -2605,7 +2690,7 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 				gip_country_cc(t->addr));
 		}
 		socket_free_null(&t);
-		return;
+		return TRUE;
 	}
 
 	t->tls.enabled = s->tls.enabled; /* Inherit from listening socket */
@@ -2659,6 +2744,51 @@ socket_accept(void *data, int unused_source, inputevt_cond_t cond)
 	inet_got_incoming(t->addr);	/* Signal we got an incoming connection */
 	if (!GNET_PROPERTY(force_local_ip))
 		guess_local_addr(t);
+
+	return TRUE;
+}
+
+/**
+ * Someone is connecting to us.
+ */
+static void
+socket_accept(void *data, int unused_source, inputevt_cond_t cond)
+{
+	struct gnutella_socket *s = data;
+	uint i;
+
+	(void) unused_source;
+	socket_check(s);
+	g_assert(s->flags & (SOCK_F_TCP | SOCK_F_LOCAL));
+
+	if G_UNLIKELY(cond & INPUT_EVENT_EXCEPTION) {
+		g_warning("%s(): input exception on TCP listening socket #%d!",
+			G_STRFUNC, s->file_desc);
+		return;		/* Ignore it, what else can we do? */
+	}
+
+	switch (s->type) {
+	case SOCK_TYPE_CONTROL:
+		break;
+	default:
+		g_warning("%s(): unknown listening socket type %d !",
+			G_STRFUNC, s->type);
+		socket_destroy(s, NULL);
+		return;
+	}
+
+	/*
+	 * During connection storms, for instance when we restart and all the
+	 * hosts that knew about us try to reconnect, many connections are
+	 * queued in the listen backlog.  Accepting them one per I/O event
+	 * would leave most of them waiting (and possibly timing out) whilst
+	 * we process other events, so we drain the backlog in batches.
+	 */
+
+	for (i = 0; i < SOCKET_ACCEPT_BATCH; i++) {
+		if (!socket_accept_one(s))
+			break;
+	}
 }
 
 #if defined(CMSG_FIRSTHDR) && defined(CMSG_NXTHDR)
@@ -2739,9 +2869,10 @@ socket_udp_extract_dst_addr(const struct msghdr *msg, host_addr_t *dst_addr)
  * Note: for the Gnutella datagram socket this is udp_received().
  */
 static inline void
-socket_udp_process(gnutella_socket_t *s, bool truncated)
+socket_udp_process(gnutella_socket_t *s,
+	const void *data, size_t len, bool truncated)
 {
-	(*s->resource.udp->data_ind)(s, s->buf, s->pos, truncated);
+	(*s->resource.udp->data_ind)(s, data, len, truncated);
 }
 
 /**
@@ -2808,27 +2939,268 @@ socket_udp_is_old(const gnutella_socket_t *s)
 }
 
 /**
- * Someone is sending us a datagram.  Read it into the socket's buffer.
+ * Record origin of the datagram we just read.
+ *
+ * @param s				the socket which received the datagram
+ * @param from_addr		the address of the sender
+ * @param msg			the message header filled by the kernel, if any
+ * @param r				the size of the datagram
+ * @param truncated		whether datagram was truncated
+ *
+ * @return -1 with errno set if the datagram must be ignored, its size
+ * otherwise.
+ */
+static ssize_t
+socket_udp_received(struct gnutella_socket *s, const socket_addr_t *from_addr,
+	const struct msghdr *msg, ssize_t r, bool truncated)
+{
+	bool has_dst_addr = FALSE;
+	host_addr_t dst_addr;
+
+	/*
+	 * We're too low level to account for the proper bandwidth here as we
+	 * want to distinguish between UDP Gnutella traffic and DHT traffic.
+	 *
+	 * This will be done in udp_receieved() which we're about to call.
+	 */
+
+	s->pos = r;
+
+	/*
+	 * Record remote address.
+	 */
+
+	s->addr = socket_addr_get_addr(from_addr);
+	s->port = socket_addr_get_port(from_addr);
+
+	if (!is_host_addr(s->addr)) {
+		gnet_stats_inc_general(GNR_UDP_BOGUS_SOURCE_IP);
+		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
+		errno = EINVAL;
+		return (ssize_t) -1;
+	}
+
+	/*
+	 * Traffic from hosts sending gibberish data or information we previously
+	 * determined as being invalid / suspicious is dropped right away, before
+	 * it can be queued for read-ahead or reach upper layers that would have
+	 * to parse it first, only to discard it.
+	 *
+	 * We let statically-banned hosts through though so that we may parse
+	 * their message and log dropping in upper layers, for statistics per
+	 * message type.  We only drop known gibberish at this level.
+	 */
+
+	if G_UNLIKELY(hostiles_check(s->addr) & HSTL_GIBBERISH) {
+		if (GNET_PROPERTY(udp_debug)) {
+			g_warning("UDP %sdatagram (%zd byte%s) received from "
+				"shunned IP %s -- dropped",
+				truncated ? "truncated " : "", r, plural(r),
+				host_addr_to_string(s->addr));
+		}
+		gnet_stats_inc_general(GNR_UDP_SHUNNED_SOURCE_IP);
+		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
+		errno = EPERM;
+		return (ssize_t) -1;
+	}
+
+	if (msg != NULL && !GNET_PROPERTY(force_local_ip))
+		has_dst_addr = socket_udp_extract_dst_addr(msg, &dst_addr);
+
+	if (has_dst_addr) {
+		static host_addr_t last_addr;
+
+		settings_addr_changed(dst_addr, s->addr);
+
+		/*
+		 * Show the destination address only when it differs from
+		 * the last seen or if the debug level is higher than 1.
+		 */
+
+		if (
+			GNET_PROPERTY(socket_debug) > 1 ||
+			!host_addr_equiv(last_addr, dst_addr)
+		) {
+			last_addr = dst_addr;
+			if (GNET_PROPERTY(socket_debug)) {
+				g_debug("%s(): dst_addr=%s",
+					G_STRFUNC, host_addr_to_string(dst_addr));
+			}
+		}
+	}
+
+	if (truncated)
+		gnet_stats_inc_general(GNR_UDP_RX_TRUNCATED);
+
+	return r;
+}
+
+#ifdef HAS_RECVMMSG
+/**
+ * Refill the reception ring with as many datagrams as the kernel can give.
+ *
+ * @return -1 on error, the amount of datagrams read otherwise.
+ */
+static int
+socket_udp_ring_fill(struct gnutella_socket *s, struct udp_rx_ring *ring)
+{
+	uint i;
+	int r;
+
+	for (i = 0; i < N_ITEMS(ring->hdr); i++) {
+		struct msghdr *msg = &ring->hdr[i].msg_hdr;
+		socket_addr_t *from = &ring->from[i];
+		socklen_t from_len;
+
+		from_len = socket_addr_init(from, s->net);
+		g_assert(from_len > 0);
+
+		iovec_set(&ring->iov[i],
+			pmsg_phys_base(ring->mb[i]), pmsg_phys_len(ring->mb[i]));
+
+		ZERO(msg);
+		msg->msg_name = socket_addr_get_sockaddr(from);
+		msg->msg_namelen = from_len;
+		msg->msg_iov = &ring->iov[i];
+		msg->msg_iovlen = 1;
+
+#if defined(CMSG_LEN) && defined(CMSG_SPACE)
+		ZERO(&ring->cmsg[i].hdr);
+		msg->msg_control = ring->cmsg[i].bytes;
+		msg->msg_controllen = sizeof ring->cmsg[i].bytes;
+#endif	/* CMSG_LEN && CMSG_SPACE */
+	}
+
+	ring->next = ring->count = 0;
+	r = recvmmsg(s->file_desc, ring->hdr, N_ITEMS(ring->hdr), 0, NULL);
+
+	if (r > 0)
+		ring->count = r;
+
+	return r;
+}
+
+/**
+ * Get next datagram from the reception ring, refilling it as needed.
  *
  * @param s				the socket which receives a datagram
  * @param truncation	written with whether datagram was truncated
+ * @param data			written with the start of the datagram
  *
  * @return -1 on error, the size of the datagram otherwise.
  */
 static ssize_t
-socket_udp_accept(struct gnutella_socket *s, bool *truncation)
+socket_udp_ring_accept(struct gnutella_socket *s,
+	bool *truncation, const void **data)
+{
+	struct udp_rx_ring *ring = s->resource.udp->ring;
+
+	for (;;) {
+		const struct msghdr *msg;
+		bool truncated = FALSE;
+		ssize_t r;
+		uint i;
+
+		if (ring->next == ring->count) {
+			if (-1 == socket_udp_ring_fill(s, ring))
+				return (ssize_t) -1;
+			if G_UNLIKELY(0 == ring->count) {
+				errno = VAL_EAGAIN;
+				return (ssize_t) -1;
+			}
+		}
+
+		i = ring->next++;
+		msg = &ring->hdr[i].msg_hdr;
+		r = ring->hdr[i].msg_len;
+
+		g_assert(UNSIGNED(r) <= pmsg_phys_len(ring->mb[i]));
+
+#if defined(HAS_MSGHDR_MSG_FLAGS)
+		truncated = 0 != (MSG_TRUNC & msg->msg_flags);
+#endif
+
+		/*
+		 * A datagram from a bogus source is simply skipped: we cannot
+		 * report the error to the caller whilst there are still datagrams
+		 * held in the ring, or they would be stranded there until the
+		 * next datagram arrives.
+		 */
+
+		if (-1 == socket_udp_received(s, &ring->from[i], msg, r, truncated))
+			continue;
+
+		*truncation = truncated;
+		*data = pmsg_phys_base(ring->mb[i]);
+		return r;
+	}
+}
+
+/**
+ * Check whether we can use the reception ring to read from the socket,
+ * allocating it on first usage.
+ */
+static bool
+socket_udp_ring_usable(struct gnutella_socket *s)
+{
+	struct udpctx *uctx = s->resource.udp;
+	struct udp_rx_ring *ring = uctx->ring;
+	uint i;
+
+	if G_LIKELY(ring != NULL)
+		return !ring->disabled;
+
+	/*
+	 * Sockets processing one datagram per event cannot read ahead.
+	 */
+
+	if (s->flags & SOCK_F_SINGLE)
+		return FALSE;
+
+	WALLOC0(ring);
+	for (i = 0; i < N_ITEMS(ring->mb); i++)
+		ring->mb[i] = pmsg_new(PMSG_P_DATA, NULL, s->buf_size);
+
+	uctx->ring = ring;
+	return TRUE;
+}
+#endif	/* HAS_RECVMMSG */
+
+/**
+ * Someone is sending us a datagram.  Read it into the socket's buffer, or
+ * get it from the reception ring when we can read several datagrams at once.
+ *
+ * @param s				the socket which receives a datagram
+ * @param truncation	written with whether datagram was truncated
+ * @param data			written with the start of the datagram
+ *
+ * @return -1 on error, the size of the datagram otherwise.
+ */
+static ssize_t
+socket_udp_accept(struct gnutella_socket *s,
+	bool *truncation, const void **data)
 {
 	socket_addr_t *from_addr;
 	struct sockaddr *from;
 	socklen_t from_len;
 	ssize_t r;
-	bool truncated = FALSE, has_dst_addr = FALSE;
-	host_addr_t dst_addr;
+	bool truncated = FALSE;
 
 	socket_check(s);
 	g_assert(s->flags & SOCK_F_UDP);
 	g_assert(s->type == SOCK_TYPE_UDP);
 
+#ifdef HAS_RECVMMSG
+	if (socket_udp_ring_usable(s)) {
+		r = socket_udp_ring_accept(s, truncation, data);
+
+		if G_LIKELY((ssize_t) -1 != r || ENOSYS != errno)
+			return r;
+
+		s->resource.udp->ring->disabled = TRUE;		/* Old kernel */
+	}
+#endif	/* HAS_RECVMMSG */
+
 	/*
 	 * Receive the datagram in the socket's buffer.
 	 */
@@ -2888,13 +3260,15 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
 		truncated = 0 != (MSG_TRUNC & msg.msg_flags);
 #endif
 
-		if ((ssize_t) -1 != r && !GNET_PROPERTY(force_local_ip)) {
-			has_dst_addr = socket_udp_extract_dst_addr(&msg, &dst_addr);
-		}
+		if ((ssize_t) -1 != r)
+			r = socket_udp_received(s, from_addr, &msg, r, truncated);
 	}
 #else	/* !HAS_RECVMSG */
 	r = recvfrom(s->file_desc, s->buf, s->buf_size, 0,
 			cast_to_pointer(from), &from_len);
+
+	if ((ssize_t) -1 != r)
+		r = socket_udp_received(s, from_addr, NULL, r, truncated);
 #endif	/* HAS_RECVMSG */
 
 	if ((ssize_t) -1 == r)
@@ -2902,55 +3276,8 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
 
 	g_assert((size_t) r <= s->buf_size);
 
-	/*
-	 * We're too low level to account for the proper bandwidth here as we
-	 * want to distinguish between UDP Gnutella traffic and DHT traffic.
-	 *
-	 * This will be done in udp_receieved() which we're about to call.
-	 */
-
-	s->pos = r;
-
-	/*
-	 * Record remote address.
-	 */
-
-	s->addr = socket_addr_get_addr(from_addr);
-	s->port = socket_addr_get_port(from_addr);
-
-	if (!is_host_addr(s->addr)) {
-		gnet_stats_inc_general(GNR_UDP_BOGUS_SOURCE_IP);
-		bws_udp_count_read(r, FALSE);	/* Assume not from DHT */
-		errno = EINVAL;
-		return (ssize_t) -1;
-	}
-
-	if (has_dst_addr) {
-		static host_addr_t last_addr;
-
-		settings_addr_changed(dst_addr, s->addr);
-
-		/*
-		 * Show the destination address only when it differs from
-		 * the last seen or if the debug level is higher than 1.
-		 */
-
-		if (
-			GNET_PROPERTY(socket_debug) > 1 ||
-			!host_addr_equiv(last_addr, dst_addr)
-		) {
-			last_addr = dst_addr;
-			if (GNET_PROPERTY(socket_debug)) {
-				g_debug("%s(): dst_addr=%s",
-					G_STRFUNC, host_addr_to_string(dst_addr));
-			}
-		}
-	}
-
-	if (truncated)
-		gnet_stats_inc_general(GNR_UDP_RX_TRUNCATED);
-
 	*truncation = truncated;
+	*data = s->buf;
 	return r;
 }
 
@@ -2958,7 +3285,8 @@ socket_udp_accept(struct gnutella_socket *s, bool *truncation)
  * Enqueue UDP datagram for deferred processing.
  */
 static void
-socket_udp_queue(gnutella_socket_t *s, bool truncated)
+socket_udp_queue(gnutella_socket_t *s,
+	const void *data, size_t len, bool truncated)
 {
 	struct udpctx *uctx;
 	struct udpq *uq;
@@ -2968,8 +3296,8 @@ socket_udp_queue(gnutella_socket_t *s, bool truncated)
 	uctx = s->resource.udp;
 
 	WALLOC0(uq);
-	uq->buf = wcopy(s->buf, s->pos);
-	uq->len = s->pos;
+	uq->buf = wcopy(data, len);
+	uq->len = len;
 	uq->queued = tm_time();
 	uq->truncated = booleanize(truncated);
 	uq->addr = s->addr;
@@ -3108,7 +3436,8 @@ socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 
 	/*
 	 * It might be useful to call socket_udp_accept() several times
-	 * as there are often several packets queued.
+	 * as there are often several packets queued.  When possible, they
+	 * are read from the kernel in batches, see socket_udp_ring_accept().
 	 *
 	 * When the RX queue is full, the kernel will start dropping new
 	 * incoming UDP datagrams, and we want to avoid that because this may
@@ -3132,12 +3461,16 @@ socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 	rd = qd = qn = 0;
 
 	for(;;) {
+		const void *dgram;
 		ssize_t r;
 
 		i++;
-		r = socket_udp_accept(s, &truncated);		/* Read datagram */
+		r = socket_udp_accept(s, &truncated, &dgram);	/* Read datagram */
 
 		if ((ssize_t) -1 == r) {
+			/* Datagram from a shunned host, dropped on reception */
+			if (EPERM == errno)
+				goto next;
 			/* ECONNRESET is meaningless with UDP but happens on Windows */
 			if (!is_temporary_error(errno) && errno != ECONNRESET) {
 				g_warning("%s(): ignoring datagram reception error: %m",
@@ -3162,18 +3495,20 @@ socket_udp_event(void *data, int unused_source, inputevt_cond_t cond)
 		 */
 
 		if (enqueue) {
-			socket_udp_queue(s, truncated);				/* Enqueue it */
+			socket_udp_queue(s, dgram, r, truncated);	/* Enqueue it */
 			qd += r;
 			qn++;
 		} else {
-			socket_udp_process(s, truncated);			/* Process it */
+			socket_udp_process(s, dgram, r, truncated);	/* Process it */
 		}
 
 		avail = size_saturate_sub(avail, r);
 
 		/* kevent() reports 32 more bytes than there are, maybe
-		 * it refers to header or control msg data. */
-		if (avail <= 32)
+		 * it refers to header or control msg data.
+		 * We cannot stop whilst datagrams remain in the reception ring
+		 * though, since the kernel would not signal them again. */
+		if (avail <= 32 && !socket_udp_ring_pending(s))
 			break;
 
 	next:
@@ -3338,6 +3673,59 @@ socket_set_quickack(struct gnutella_socket *s, int on)
 #endif	/* TCP_QUICKACK*/
 }
 
+/**
+ * Get TCP statistics for the connection.
+ *
+ * The statistics are sampled from the kernel on demand, at most once every
+ * SOCKET_TCP_INFO_PERIOD seconds, so callers can use this routine freely.
+ *
+ * @return the statistics, NULL if not a connected TCP socket or if they
+ * are not available on this platform.
+ */
+const struct socket_tcp_info *
+socket_tcp_info(struct gnutella_socket *s)
+{
+	socket_check(s);
+
+	if (
+		!(SOCK_F_TCP & s->flags) || !(SOCK_F_ESTABLISHED & s->flags) ||
+		!is_valid_fd(s->file_desc)
+	)
+		return NULL;
+
+#if defined(TCP_INFO) && defined(LINUX_SYSTEM)
+	{
+		time_t now = tm_time();
+
+		if (
+			0 == s->tcpi.stamp ||
+			delta_time(now, s->tcpi.stamp) >= SOCKET_TCP_INFO_PERIOD
+		) {
+			struct tcp_info ti;
+			socklen_t len = sizeof ti;
+
+			if (getsockopt(s->file_desc, sol_tcp(), TCP_INFO, &ti, &len)) {
+				if (GNET_PROPERTY(socket_debug)) {
+					g_debug("%s(): cannot get TCP_INFO (fd=%d): %m",
+						G_STRFUNC, s->file_desc);
+				}
+				return 0 == s->tcpi.stamp ? NULL : &s->tcpi;
+			}
+
+			s->tcpi.stamp = now;
+			s->tcpi.rtt = ti.tcpi_rtt;
+			s->tcpi.rttvar = ti.tcpi_rttvar;
+			s->tcpi.retrans = ti.tcpi_total_retrans;
+			s->tcpi.cwnd = ti.tcpi_snd_cwnd;
+		}
+
+		return &s->tcpi;
+	}
+#else	/* !(TCP_INFO && LINUX_SYSTEM) */
+	return NULL;
+#endif	/* TCP_INFO && LINUX_SYSTEM */
+}
+
 /***
  *** Sockets creation
  ***/
@@ -4240,7 +4628,7 @@ socket_tcp_listen(host_addr_t bind_addr, uint16 port)
 
 	/* listen() the socket */
 
-	if (listen(fd, 5) == -1) {
+	if (listen(fd, SOCKET_TCP_BACKLOG) == -1) {
 		g_warning("%s(): unable to listen() on the socket: %m", G_STRFUNC);
 		socket_destroy(s, "Unable to listen on socket");
 		return NULL;
@@ -4685,6 +5073,30 @@ socket_plain_readv(struct wrap_io *wio, iovec_t *iov, int iovcnt)
 	return s_readv(s->file_desc, iov, iovcnt);
 }
 
+/**
+ * Fill socket address for the destination of a datagram, converting it to
+ * the network type of the socket.
+ *
+ * @return the length of the address, 0 if it cannot be converted.
+ */
+static socklen_t
+socket_udp_dest(const struct gnutella_socket *s,
+	const gnet_host_t *to, socket_addr_t *addr)
+{
+	host_addr_t ha;
+
+	if (!host_addr_convert(gnet_host_get_addr(to), &ha, s->net)) {
+		if (GNET_PROPERTY(udp_debug)) {
+			g_carp("%s(): cannot convert %s to %s",
+				G_STRFUNC, host_addr_to_string(gnet_host_get_addr(to)),
+				net_type_to_string(s->net));
+		}
+		return 0;
+	}
+
+	return socket_addr_set(addr, ha, gnet_host_get_port(to));
+}
+
 static ssize_t
 socket_plain_sendto(
 	struct wrap_io *wio, const gnet_host_t *to, const void *buf, size_t size)
@@ -4692,23 +5104,17 @@ socket_plain_sendto(
 	struct gnutella_socket *s = wio->ctx;
 	socklen_t len;
 	socket_addr_t addr;
-	host_addr_t ha;
 	ssize_t ret;
 
 	socket_check(s);
 	g_assert(!socket_uses_tls(s));
 
-	if (!host_addr_convert(gnet_host_get_addr(to), &ha, s->net)) {
-		if (GNET_PROPERTY(udp_debug)) {
-			g_carp("%s(): cannot convert %s to %s",
-				G_STRFUNC, host_addr_to_string(gnet_host_get_addr(to)),
-				net_type_to_string(s->net));
-		}
+	len = socket_udp_dest(s, to, &addr);
+	if (0 == len) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	len = socket_addr_set(&addr, ha, gnet_host_get_port(to));
 	ret = sendto(s->file_desc, buf, size, 0,
 			socket_addr_get_const_sockaddr(&addr), len);
 
@@ -4720,6 +5126,193 @@ socket_plain_sendto(
 	return ret;
 }
 
+/**
+ * Send several datagrams, one system call at a time.
+ *
+ * @return the amount of datagrams sent, -1 with errno set if the first
+ * datagram could not be sent.
+ */
+static ssize_t
+socket_plain_sendmmsg_loop(struct wrap_io *wio,
+	const wrap_dgram_t *dg, int cnt)
+{
+	int i;
+
+	g_assert(cnt > 0);
+
+	for (i = 0; i < cnt; i++) {
+		if (-1 == socket_plain_sendto(wio, dg[i].to, dg[i].data, dg[i].len))
+			return 0 == i ? -1 : i;
+	}
+
+	return cnt;
+}
+
+#ifdef HAS_SENDMMSG
+#if defined(UDP_SEGMENT) && defined(SOL_UDP) && defined(CMSG_SPACE)
+#define USE_UDP_GSO
+#endif
+
+/**
+ * Can datagram be appended to the segments already gathered for a UDP
+ * segmentation offload, i.e. be sent as part of the same super-datagram?
+ *
+ * All the segments must go to the same destination and have the same size,
+ * only the last one being allowed to be shorter.
+ *
+ * @param s		the UDP socket
+ * @param dg	the first datagram in the segment group
+ * @param n		amount of segments in the group
+ * @param next	the datagram we would like to append
+ */
+static inline bool
+socket_udp_gso_can_append(const struct gnutella_socket *s,
+	const wrap_dgram_t *dg, uint n, const wrap_dgram_t *next)
+{
+#ifdef USE_UDP_GSO
+	return !s->resource.udp->no_gso &&
+		n < UDP_GSO_SEGMENTS &&
+		dg[0].len <= UDP_GSO_SEGSIZE &&
+		dg[n - 1].len == dg[0].len &&
+		next->len <= dg[0].len &&
+		(n + 1) * dg[0].len <= UDP_GSO_MAXLEN &&
+		gnet_host_equal(dg[0].to, next->to);
+#else
+	(void) s;
+	(void) dg;
+	(void) n;
+	(void) next;
+	return FALSE;
+#endif	/* USE_UDP_GSO */
+}
+
+/**
+ * Send several datagrams with one system call.
+ *
+ * Consecutive datagrams to the same destination are sent as one single
+ * super-datagram that the kernel (or the network card) segments when UDP
+ * segmentation offload is available.
+ *
+ * @return the amount of datagrams sent, -1 with errno set if the first
+ * datagram could not be sent.
+ */
+static ssize_t
+socket_plain_sendmmsg(struct wrap_io *wio,
+	const wrap_dgram_t *dg, int cnt)
+{
+	struct gnutella_socket *s = wio->ctx;
+	struct mmsghdr hdr[UDP_TX_BATCH];
+	socket_addr_t addr[UDP_TX_BATCH];
+	iovec_t iov[UDP_TX_BATCH];
+	uint8 segments[UDP_TX_BATCH];
+#ifdef USE_UDP_GSO
+	union {
+		struct cmsghdr hdr;
+		char bytes[CMSG_SPACE(sizeof(uint16))];
+	} cmsg[UDP_TX_BATCH];
+#endif
+	uint i, m, n, first = 0;
+	int r;
+
+	socket_check(s);
+	g_assert(!socket_uses_tls(s));
+	g_assert(s->flags & SOCK_F_UDP);
+	g_assert(cnt > 0);
+
+retry:
+	n = MIN(UNSIGNED(cnt), N_ITEMS(hdr));
+
+	for (i = m = 0; i < n; i++) {
+		iovec_set(&iov[i], deconstify_pointer(dg[i].data), dg[i].len);
+
+		if (m != 0 && socket_udp_gso_can_append(s, &dg[first], segments[m - 1],
+			&dg[i])
+		) {
+			hdr[m - 1].msg_hdr.msg_iovlen++;
+			segments[m - 1]++;
+			continue;
+		}
+
+		ZERO(&hdr[m]);
+		hdr[m].msg_hdr.msg_namelen = socket_udp_dest(s, dg[i].to, &addr[m]);
+
+		if G_UNLIKELY(0 == hdr[m].msg_hdr.msg_namelen) {
+			if (0 != m)
+				break;				/* Will fail on next call */
+			errno = EINVAL;
+			return -1;
+		}
+
+		hdr[m].msg_hdr.msg_name = socket_addr_get_sockaddr(&addr[m]);
+		hdr[m].msg_hdr.msg_iov = &iov[i];
+		hdr[m].msg_hdr.msg_iovlen = 1;
+		segments[m] = 1;
+		first = i;
+		m++;
+	}
+
+#ifdef USE_UDP_GSO
+	for (i = 0; i < m; i++) {
+		struct msghdr *msg = &hdr[i].msg_hdr;
+		struct cmsghdr *cm;
+		uint16 segsize;
+
+		if G_LIKELY(1 == segments[i])
+			continue;
+
+		ZERO(&cmsg[i]);
+		msg->msg_control = cmsg[i].bytes;
+		msg->msg_controllen = sizeof cmsg[i].bytes;
+		cm = CMSG_FIRSTHDR(msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof segsize);
+		segsize = msg->msg_iov[0].iov_len;
+		memcpy(CMSG_DATA(cm), &segsize, sizeof segsize);
+	}
+#endif	/* USE_UDP_GSO */
+
+	r = sendmmsg(s->file_desc, hdr, m, 0);
+
+	if (-1 == r) {
+		int e = errno;
+
+		if (ENOSYS == e) {
+			s->wio.sendmmsg = socket_plain_sendmmsg_loop;	/* Old kernel */
+			return socket_plain_sendmmsg_loop(wio, dg, cnt);
+		}
+
+		/*
+		 * The kernel refuses segmentation offload when the device cannot
+		 * compute checksums or when the path involves IPsec, for instance.
+		 * Stop using it on this socket and retry.
+		 */
+
+		if (
+			segments[0] > 1 &&
+			(EIO == e || EINVAL == e || ENOPROTOOPT == e || EOPNOTSUPP == e)
+		) {
+			if (GNET_PROPERTY(udp_debug)) {
+				g_debug("%s(): disabling UDP GSO on port %u: %m",
+					G_STRFUNC, s->local_port);
+			}
+			s->resource.udp->no_gso = TRUE;
+			goto retry;
+		}
+
+		if (GNET_PROPERTY(udp_debug))
+			g_warning("sendmmsg() failed: %m");
+		errno = e;
+		return -1;
+	}
+
+	for (i = n = 0; i < UNSIGNED(r); i++)
+		n += segments[i];
+
+	return n;
+}
+#endif	/* HAS_SENDMMSG */
+
 static ssize_t
 socket_no_sendto(struct wrap_io *unused_wio, const gnet_host_t *unused_to,
 	const void *unused_buf, size_t unused_size)
@@ -4732,6 +5325,17 @@ socket_no_sendto(struct wrap_io *unused_wio, const gnet_host_t *unused_to,
 	return -1;
 }
 
+static ssize_t
+socket_no_sendmmsg(struct wrap_io *unused_wio,
+	const wrap_dgram_t *unused_dg, int unused_cnt)
+{
+	(void) unused_wio;
+	(void) unused_dg;
+	(void) unused_cnt;
+	g_error("no sendmmsg() routine allowed");
+	return -1;
+}
+
 static ssize_t
 socket_no_write(struct wrap_io *unused_wio,
 		const void *unused_buf, size_t unused_size)
@@ -4800,12 +5404,18 @@ socket_wio_link(struct gnutella_socket *s)
 		s->wio.writev = socket_no_writev;
 		s->wio.readv = socket_plain_readv;
 		s->wio.sendto = socket_plain_sendto;
+#ifdef HAS_SENDMMSG
+		s->wio.sendmmsg = socket_plain_sendmmsg;
+#else
+		s->wio.sendmmsg = socket_plain_sendmmsg_loop;
+#endif
 	} else if (SOCK_CONN_LISTENING == s->direction) {
 		s->wio.write = socket_no_write;
 		s->wio.read = socket_no_read;
 		s->wio.writev = socket_no_writev;
 		s->wio.readv = socket_no_readv;
 		s->wio.sendto = socket_no_sendto;
+		s->wio.sendmmsg = socket_no_sendmmsg;
 	} else if (socket_uses_tls(s)) {
 		tls_wio_link(s);
 	} else {
@@ -4815,6 +5425,7 @@ socket_wio_link(struct gnutella_socket *s)
 		s->wio.writev = socket_plain_writev;
 		s->wio.readv = socket_plain_readv;
 		s->wio.sendto = socket_no_sendto;
+		s->wio.sendmmsg = socket_no_sendmmsg;
 	}
 }
 
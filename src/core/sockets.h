@@ -83,6 +83,17 @@ typedef enum {
 	SOCKET_MAGIC = 0x1fb7ddeb
 } socket_magic_t;
 
+/**
+ * TCP connection statistics, as sampled from the kernel.
+ */
+struct socket_tcp_info {
+	time_t stamp;			/**< When last sampled, 0 if never */
+	uint32 rtt;				/**< Smoothed round-trip time, in usecs */
+	uint32 rttvar;			/**< Round-trip time variance, in usecs */
+	uint32 retrans;			/**< Total amount of retransmitted segments */
+	uint32 cwnd;			/**< Sending congestion window, in segments */
+};
+
 
 typedef struct gnutella_socket {
 	socket_magic_t magic;	/**< magic for consistency checks */
@@ -121,6 +132,8 @@ typedef struct gnutella_socket {
 
 	unsigned so_rcvbuf;	/**< Configured RX buffer size, 0 if unknown */
 	unsigned so_sndbuf;	/**< Configured TX buffer size, 0 if unknown */
+
+	struct socket_tcp_info tcpi;	/**< Sampled TCP statistics */
 } gnutella_socket_t;
 
 /**
@@ -175,6 +188,8 @@ struct udpctx {
 	struct cevent *queue_ev;			/**< Queue processing event */
 	eslist_t queue;						/**< Queued items (read-ahead) */
 	size_t queued;						/**< Amount of bytes queued */
+	struct udp_rx_ring *ring;			/**< Batched reception ring */
+	bool no_gso;						/**< UDP GSO refused by kernel */
 };
 
 static inline void
@@ -286,6 +301,7 @@ void socket_tos_throughput(const struct gnutella_socket *s);
 void socket_tos_lowdelay(const struct gnutella_socket *s);
 void socket_tos_normal(const struct gnutella_socket *s);
 void socket_set_quickack(struct gnutella_socket *s, int val);
+const struct socket_tcp_info *socket_tcp_info(struct gnutella_socket *s);
 bool socket_bad_hostname(struct gnutella_socket *s);
 void socket_disable_token(struct gnutella_socket *s);
 bool socket_omit_token(struct gnutella_socket *s);
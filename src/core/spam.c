@@ -42,6 +42,7 @@
 #include "spam.h"
 #include "settings.h"
 #include "nodes.h"
+#include "startup.h"
 
 #include "lib/atoms.h"
 #include "lib/bit_array.h"
@@ -114,7 +115,7 @@ static const char spam_what[] = "Spam database";
 /****** END IDEAS ONLY ******/
 
 struct spam_lut {
-	pslist_t *sl_names;	/* List of struct namesize_item */
+	pslist_t *sl_names;	/* List of struct namesize_item, by min_size */
 };
 
 static struct spam_lut spam_lut;
@@ -184,6 +185,28 @@ spam_add_name_and_size(const char *name,
 	}
 }
 
+/**
+ * pslist_sort() callback to sort items by increasing minimum size.
+ */
+static int
+spam_namesize_cmp(const void *a, const void *b)
+{
+	const struct namesize_item *ia = a, *ib = b;
+
+	return CMP(ia->min_size, ib->min_size);
+}
+
+/**
+ * Sort the name and size items by increasing minimum size, which lets
+ * spam_check_filename_size() stop as soon as it reaches items which cannot
+ * match the size, without evaluating their regular expression.
+ */
+static void
+spam_names_sync(void)
+{
+	spam_lut.sl_names = pslist_sort(spam_lut.sl_names, spam_namesize_cmp);
+}
+
 struct spam_item {
 	struct sha1 sha1;
 	char		*name;
@@ -399,6 +422,7 @@ spam_load(FILE *f)
 	}
 
 	spam_sha1_sync();
+	spam_names_sync();
 
 	return item_count;
 }
@@ -468,6 +492,21 @@ spam_retrieve(void)
 	}
 }
 
+/**
+ * Loads the spam databases, run by a separate thread at startup time.
+ *
+ * The SHA-1 database must be loaded first since spam.txt can also list
+ * SHA-1 items.
+ */
+static void G_COLD
+spam_retrieve_all(void *unused_arg)
+{
+	(void) unused_arg;
+
+	spam_sha1_init();
+	spam_retrieve();
+}
+
 /**
  * Called on startup. Loads the spam.txt into memory.
  */
@@ -476,8 +515,7 @@ spam_init(void)
 {
 	TOKENIZE_CHECK_SORTED(spam_tags);
 
-	spam_sha1_init();
-	spam_retrieve();
+	startup_spawn("spam.txt", spam_retrieve_all, NULL);
 }
 
 /**
@@ -516,8 +554,11 @@ spam_check_filename_size(const char *filename, filesize_t size)
 		const struct namesize_item *item = sl->data;
 
 		g_assert(item);
+
+		if (size < item->min_size)
+			break;				/* Items sorted by increasing min_size */
+
 		if (
-			size >= item->min_size &&
 			size <= item->max_size &&
 			0 == regexec(&item->pattern, filename, 0, NULL, 0)
 		) {
@@ -49,6 +49,7 @@
 #include "lib/file.h"
 #include "lib/halloc.h"
 #include "lib/path.h"
+#include "lib/sha1set.h"
 #include "lib/sorted_array.h"
 #include "lib/str.h"
 #include "lib/watcher.h"
@@ -74,8 +75,14 @@ enum spam_state {
 	SPAM_LOADED
 };
 
+/*
+ * When the lookup table is kept in memory, SHA-1 are collected in a sorted
+ * array whilst loading, which is then compiled into a static set on sync.
+ * Adding more SHA-1 after that expands the set back into the array.
+ */
 struct sha1_lut {
 	struct sorted_array *tab;
+	sha1set_t *set;
 	enum spam_state state;
 	union {
 		dbmw_t *dw;
@@ -127,12 +134,38 @@ spam_lut_create(void)
 	}
 }
 
+/**
+ * Set iterator callback, adding back the SHA-1 to the sorted array.
+ */
+static void
+spam_sha1_expand_add(const struct sha1 *sha1, void *data)
+{
+	sorted_array_add(data, sha1);
+}
+
+/**
+ * Expand the static set back into a sorted array, so that we can add more
+ * items to it.
+ */
+static void
+spam_sha1_expand(void)
+{
+	g_assert(NULL == sha1_lut.tab);
+
+	sha1_lut.tab = sorted_array_new(sizeof(struct sha1), sha1_cmp_func);
+	sha1set_foreach(sha1_lut.set, spam_sha1_expand_add, sha1_lut.tab);
+	sha1set_free_null(&sha1_lut.set);
+}
+
 void
 spam_sha1_add(const struct sha1 *sha1)
 {
 	g_assert(sha1_lut.state != SPAM_UNINITIALIZED);
 	g_return_if_fail(sha1);
 
+	if (sha1_lut.set != NULL)
+		spam_sha1_expand();
+
 	if (sha1_lut.tab)
 		sorted_array_add(sha1_lut.tab, sha1);
 	else {
@@ -157,7 +190,25 @@ void
 spam_sha1_sync(void)
 {
 	if (sha1_lut.tab) {
+		size_t count;
+
 		sorted_array_sync(sha1_lut.tab, sha1_collision);
+
+		/*
+		 * Compile the sorted array into a static set, which is more compact
+		 * and has a Bloom filter in front: the vast majority of the SHA-1
+		 * we check are not spam.
+		 */
+
+		count = sorted_array_count(sha1_lut.tab);
+		sha1_lut.set = sha1set_make(
+			0 == count ? NULL : sorted_array_item(sha1_lut.tab, 0), count);
+		sorted_array_free(&sha1_lut.tab);
+
+		if (GNET_PROPERTY(spam_debug)) {
+			g_debug("%s(): %zu SHA-1 in %zu bytes",
+				G_STRFUNC, count, sha1set_memory(sha1_lut.set));
+		}
 	} else if (SPAM_LOADING == sha1_lut.state) {
 		dbmap_t *dm = sha1_lut.d.dm;
 
@@ -336,6 +387,7 @@ void
 spam_sha1_close(void)
 {
 	sorted_array_free(&sha1_lut.tab);
+	sha1set_free_null(&sha1_lut.set);
 	if (sha1_lut.d.dw) {
 		dbmw_destroy(sha1_lut.d.dw, TRUE);
 		sha1_lut.d.dw = NULL;
@@ -354,6 +406,9 @@ bool
 spam_sha1_check(const struct sha1 *sha1)
 {
 	g_return_val_if_fail(sha1, FALSE);
+	if (sha1_lut.set)
+		return sha1set_contains(sha1_lut.set, sha1);
+
 	if (sha1_lut.tab)
 		return NULL != sorted_array_lookup(sha1_lut.tab, sha1);
 
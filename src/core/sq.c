@@ -88,6 +88,12 @@ struct smsg_info {
 	gnet_search_t shandle;	/**< Handle to search that originated query */
 };
 
+/**
+ * Maximum amount of queries we can send in a row to a node whose message
+ * queue is empty, before having to wait for "search_queue_spacing" seconds.
+ */
+#define SQ_BATCH_MAX	4
+
 static squeue_t *global_sq = NULL;
 
 static void sq_cap(squeue_t *sq);
@@ -366,7 +372,12 @@ sq_global_putq(gnet_search_t sh, pmsg_t *mb, query_hashvec_t *qhv)
 
 /**
  * Decides if the queue can send a message. Currently use simple fixed
- * time base heuristics. May add bursty control later...
+ * time base heuristics.
+ *
+ * When the node has nothing pending in its message queue, it has idle
+ * capacity, so we release up to SQ_BATCH_MAX queries at once instead of
+ * a single one: queries re-issued in bursts then do not wait for the queue
+ * to slowly drain when the connection could carry them right away.
  */
 void
 sq_process(squeue_t *sq, time_t now)
@@ -375,10 +386,13 @@ sq_process(squeue_t *sq, time_t now)
 	plist_t *item;
 	smsg_t *sb;
 	gnutella_node_t *n;
-	bool sent;
+	bool sent, idle;
+	uint batch = 0;
 
 	g_assert(sq->node == NULL || sq->node->outq != NULL);
 
+	idle = sq->node != NULL && 0 == mq_size(sq->node->outq);
+
 retry:
 	/*
 	 * We don't need to do anything if either:
@@ -395,7 +409,7 @@ retry:
 	if (sq->count == 0)
 		return;
 
-    if (delta_time(now, sq->last_sent) < spacing)
+    if (0 == batch && delta_time(now, sq->last_sent) < spacing)
 		return;
 
 	n = sq->node;					/* Will be NULL for the global SQ */
@@ -507,6 +521,15 @@ retry:
 
 	if (!sent)
 		goto retry;
+
+	/*
+	 * Keep sending whilst the node had idle capacity when we started.
+	 * The queries we just sent may still be sitting in the message queue,
+	 * so we cannot check its size again here.
+	 */
+
+	if (idle && ++batch < SQ_BATCH_MAX)
+		goto retry;
 }
 
 /**
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Parallel loading of independent data at startup time.
+ *
+ * Many subsystems load sizeable text files when they are initialized, and
+ * these loadings are independent from each other: they only depend on the
+ * initialization of the subsystem requesting them.  Rather than parsing
+ * these files one after the other, subsystems can hand out their loading
+ * routine to startup_spawn(), which runs it in a separate thread whilst
+ * the main thread continues with the initialization sequence.
+ *
+ * The main thread then calls startup_wait() before any code can access the
+ * loaded data, which is the only synchronization point: loading routines
+ * must therefore only touch data private to their subsystem, and use
+ * thread-safe services otherwise.
+ *
+ * Once startup_wait() was called, loading routines are run synchronously,
+ * which lets subsystems use startup_spawn() unconditionally.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "startup.h"
+
+#include "lib/stringify.h"
+#include "lib/thread.h"
+#include "lib/tm.h"
+
+#include "if/gnet_property_priv.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define STARTUP_TASKS_MAX	16	/**< Max amount of concurrent loadings */
+
+/**
+ * A loading task.
+ */
+static struct startup_task {
+	const char *name;			/**< Task name, for logging */
+	startup_fn_t fn;			/**< Loading routine */
+	void *arg;					/**< Argument for loading routine */
+	int id;						/**< Thread ID, -1 if run synchronously */
+	tm_t start;					/**< Start time */
+	tm_t end;					/**< End time, set by the thread */
+} startup_tasks[STARTUP_TASKS_MAX];
+
+static uint startup_count;		/**< Amount of tasks launched */
+static bool startup_done;		/**< Whether startup_wait() was called */
+
+/**
+ * Thread running a loading task.
+ */
+static void *
+startup_thread(void *arg)
+{
+	struct startup_task *t = arg;
+
+	(*t->fn)(t->arg);
+	tm_now_exact(&t->end);
+
+	return NULL;
+}
+
+/**
+ * Run the loading routine in a new thread, if we are still starting up.
+ *
+ * @param name		the task name, for logging (static string)
+ * @param fn		the loading routine
+ * @param arg		the argument for the loading routine
+ */
+void
+startup_spawn(const char *name, startup_fn_t fn, void *arg)
+{
+	struct startup_task *t;
+
+	g_assert(name != NULL);
+	g_assert(fn != NULL);
+	g_assert(thread_is_main());
+
+	if (startup_done || startup_count >= N_ITEMS(startup_tasks)) {
+		(*fn)(arg);
+		return;
+	}
+
+	t = &startup_tasks[startup_count++];
+	t->name = name;
+	t->fn = fn;
+	t->arg = arg;
+	tm_now_exact(&t->start);
+
+	t->id = thread_create(startup_thread, t,
+		THREAD_F_NO_CANCEL | THREAD_F_NO_POOL | THREAD_F_WARN, 0);
+
+	if (-1 == t->id) {
+		(*fn)(arg);
+		tm_now_exact(&t->end);
+	}
+}
+
+/**
+ * Wait for all the loading tasks to complete.
+ *
+ * Must be called by the main thread before accessing any data loaded by
+ * the routines given to startup_spawn().
+ */
+void
+startup_wait(void)
+{
+	uint i;
+	tm_t start;
+
+	g_assert(thread_is_main());
+	g_assert(!startup_done);
+
+	tm_now_exact(&start);
+
+	for (i = 0; i < startup_count; i++) {
+		struct startup_task *t = &startup_tasks[i];
+
+		if (t->id != -1 && -1 == thread_join(t->id, NULL)) {
+			g_warning("%s(): cannot join with \"%s\" loading thread: %m",
+				G_STRFUNC, t->name);
+			continue;
+		}
+
+		if (GNET_PROPERTY(reload_debug)) {
+			g_debug("%s(): loading %s took %u ms", G_STRFUNC,
+				t->name, (uint) tm_elapsed_ms(&t->end, &t->start));
+		}
+	}
+
+	if (GNET_PROPERTY(reload_debug)) {
+		tm_t end;
+
+		tm_now_exact(&end);
+		g_debug("%s(): waited %u ms for %u task%s", G_STRFUNC,
+			(uint) tm_elapsed_ms(&end, &start), PLURAL(startup_count));
+	}
+
+	startup_done = TRUE;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
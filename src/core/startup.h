@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Parallel loading of independent data at startup time.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _core_startup_h_
+#define _core_startup_h_
+
+#include "common.h"
+
+typedef void (*startup_fn_t)(void *arg);
+
+/*
+ * Public interface.
+ */
+
+void startup_spawn(const char *name, startup_fn_t fn, void *arg);
+void startup_wait(void);
+
+#endif /* _core_startup_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -47,7 +47,7 @@
 #include "thex_download.h"
 
 #include "xml/vxml.h"
-#include "xml/xnode.h"
+#include "xml/xattr.h"
 
 #include "if/gnet_property_priv.h"
 
@@ -174,37 +174,69 @@ thex_download_data_ind(rxdrv_t *rx, pmsg_t *mb)
 	return !error && DOWNLOAD_IS_RUNNING(d);
 }
 
-/* XML helper functions */
-static xnode_t *
-find_element_by_name(xnode_t *p, const char *name)
-{
-   xnode_t *xn;
+/*
+ * THEX XML record parsing.
+ *
+ * The record is small and has a fixed shape, so we parse it with the
+ * callback interface of the XML parser: we only look at the attributes
+ * of the few elements we care about, without building the XML tree.
+ */
 
-    for (xn = xnode_first_child(p); xn != NULL; xn = xnode_next_sibling(xn)) {
-        if (xnode_is_element(xn) && 0 == strcmp(xnode_element_name(xn), name))
-			return xn;
-    }
-    return NULL;
-}
+enum thex_xmltok {
+	THEX_XMLTOK_HASHTREE = 1,		/* hashtree */
+	THEX_XMLTOK_FILE,				/* file */
+	THEX_XMLTOK_DIGEST,				/* digest */
+	THEX_XMLTOK_SERIALIZEDTREE		/* serializedtree */
+};
 
-static bool
-verify_element(xnode_t *node, const char *prop, const char *expect)
+static struct vxml_token thex_xml_tokens[] = {
+	{ "hashtree",		THEX_XMLTOK_HASHTREE },
+	{ "file",			THEX_XMLTOK_FILE },
+	{ "digest",			THEX_XMLTOK_DIGEST },
+	{ "serializedtree",	THEX_XMLTOK_SERIALIZEDTREE },
+};
+
+#define THEX_XML_SEEN(id)	(1U << (id))
+
+/**
+ * XML parsing context.
+ */
+struct thex_xml_ctx {
+	struct thex_download *ctx;	/**< The THEX download */
+	char *hashtree_id;			/**< URI of the serialized tree */
+	unsigned seen;				/**< Elements seen, by THEX_XML_SEEN() */
+};
+
+static const char *
+thex_xml_prop(const xattr_table_t *attrs, const char *element, const char *prop)
 {
 	const char *value;
 
-	value = xnode_prop_get(node, prop);
-  	if (NULL == value) {
+	value = NULL == attrs ? NULL : xattr_table_lookup(attrs, NULL, prop);
+	if (NULL == value) {
 		if (GNET_PROPERTY(tigertree_debug)) {
 			g_debug("TTH couldn't find property \"%s\" of node \"%s\"",
-				prop, xnode_element_name(node));
+				prop, element);
 		}
-		return FALSE;
 	}
+	return value;
+}
+
+static bool
+verify_element(const xattr_table_t *attrs, const char *element,
+	const char *prop, const char *expect)
+{
+	const char *value;
+
+	value = thex_xml_prop(attrs, element, prop);
+	if (NULL == value)
+		return FALSE;
+
 	if (0 != strcmp(value, expect)) {
 		if (GNET_PROPERTY(tigertree_debug)) {
 			g_debug("TTH property %s/%s doesn't match expected value \"%s\", "
 				"got \"%s\"",
-				xnode_element_name(node), prop, expect, value);
+				element, prop, expect, value);
 		}
 		return FALSE;
 	}
@@ -212,15 +244,124 @@ verify_element(xnode_t *node, const char *prop, const char *expect)
 	return TRUE;
 }
 
+static bool
+thex_xml_serializedtree(struct thex_xml_ctx *xc, const xattr_table_t *attrs)
+{
+	static const char element[] = "serializedtree";
+	struct thex_download *ctx = xc->ctx;
+	const char *value;
+	int error;
+
+	if (!verify_element(attrs, element, "type", THEX_TREE_TYPE))
+		return FALSE;
+
+	value = thex_xml_prop(attrs, element, "uri");
+	if (NULL == value)
+		return FALSE;
+
+	xc->hashtree_id = h_strdup(value);
+
+	value = thex_xml_prop(attrs, element, "depth");
+	if (NULL == value)
+		return FALSE;
+
+	ctx->depth = parse_uint16(value, NULL, 10, &error);
+	error |= ctx->depth > tt_full_depth(ctx->filesize);
+	if (error) {
+		ctx->depth = 0;
+		g_warning("TTH bad value for \"depth\" of node \"%s\": \"%s\"",
+			element, value);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Start of tokenized element (XML parser callback).
+ */
+static void
+thex_xml_start(vxml_parser_t *vp,
+	unsigned id, const xattr_table_t *attrs, void *data)
+{
+	struct thex_xml_ctx *xc = data;
+	bool ok = TRUE;
+
+	if (THEX_XMLTOK_HASHTREE == id) {
+		if (1 == vxml_parser_depth(vp))
+			xc->seen |= THEX_XML_SEEN(id);
+		return;
+	}
+
+	/*
+	 * Only the first occurrence of each element, right below the root
+	 * hashtree element, is considered.
+	 */
+
+	if (
+		2 != vxml_parser_depth(vp) ||
+		0 == (xc->seen & THEX_XML_SEEN(THEX_XMLTOK_HASHTREE)) ||
+		0 != (xc->seen & THEX_XML_SEEN(id))
+	)
+		return;
+
+	xc->seen |= THEX_XML_SEEN(id);
+
+	switch (id) {
+	case THEX_XMLTOK_FILE:
+		ok = verify_element(attrs, "file", "size",
+				filesize_to_string(xc->ctx->filesize)) &&
+			verify_element(attrs, "file", "segmentsize", THEX_SEGMENT_SIZE);
+		break;
+	case THEX_XMLTOK_DIGEST:
+		ok = verify_element(attrs, "digest", "algorithm", THEX_HASH_ALGO) &&
+			verify_element(attrs, "digest", "outputsize", THEX_HASH_SIZE);
+		break;
+	case THEX_XMLTOK_SERIALIZEDTREE:
+		ok = thex_xml_serializedtree(xc, attrs);
+		break;
+	default:
+		break;
+	}
+
+	if (!ok)
+		vxml_parser_error(vp, "invalid hashtree/%s element",
+			vxml_parser_current_element(vp));
+}
+
+/**
+ * Callbacks used to parse the THEX XML record.
+ */
+static struct vxml_ops thex_xml_ops = {
+	NULL,						/* plain_start */
+	NULL,						/* plain_text */
+	NULL,						/* plain_end */
+	thex_xml_start,				/* tokenized_start */
+	NULL,						/* tokenized_text */
+	NULL,						/* tokenized_end */
+};
+
 static char *
 thex_download_handle_xml(struct thex_download *ctx,
 	const char *data, size_t size)
 {
-	xnode_t *hashtree = NULL, *node;
-	char *hashtree_id = NULL;
+	static const struct {
+		enum thex_xmltok id;
+		const char *what;
+	} needed[] = {
+		{ THEX_XMLTOK_HASHTREE,			"root hashtree" },
+		{ THEX_XMLTOK_FILE,				"hashtree/file" },
+		{ THEX_XMLTOK_DIGEST,			"hashtree/digest" },
+		{ THEX_XMLTOK_SERIALIZEDTREE,	"hashtree/serializedtree" },
+	};
+	struct thex_xml_ctx xc;
 	bool success = FALSE;
 	vxml_parser_t *vp;
 	vxml_error_t e;
+	uint i;
+
+	ZERO(&xc);
+	xc.ctx = ctx;
 
 	if (size <= 0) {
 		if (GNET_PROPERTY(tigertree_debug)) {
@@ -235,100 +376,37 @@ thex_download_handle_xml(struct thex_download *ctx,
 
 	vp = vxml_parser_make("THEX record", VXML_O_STRIP_BLANKS);
 	vxml_parser_add_data(vp, data, size);
-	e = vxml_parse_tree(vp, &hashtree);
-	vxml_parser_free(vp);
+	e = vxml_parse_callbacks_tokens(vp, &thex_xml_ops,
+			thex_xml_tokens, N_ITEMS(thex_xml_tokens), &xc);
 
 	if (VXML_E_OK != e) {
 		if (GNET_PROPERTY(tigertree_debug)) {
-			g_warning("TTH cannot parse XML record: %s", vxml_strerror(e));
+			g_warning("TTH cannot parse XML record: %s",
+				vxml_parser_strerror(vp, e));
 			dump_hex(stderr, "XML record", data, size);
 		}
+		vxml_parser_free(vp);
 		goto finish;
 	}
 
-	if (0 != strcmp("hashtree", xnode_element_name(hashtree))) {
-		if (GNET_PROPERTY(tigertree_debug)) {
-			g_debug("TTH couldn't find root hashtree element");
-		}
-		goto finish;
-	}
-
-	node = find_element_by_name(hashtree, "file");
-	if (node) {
-		if (!verify_element(node, "size", filesize_to_string(ctx->filesize)))
-			goto finish;
-		if (!verify_element(node, "segmentsize", THEX_SEGMENT_SIZE))
-			goto finish;
-	} else {
-		if (GNET_PROPERTY(tigertree_debug)) {
-			g_debug("TTH couldn't find hashtree/file element");
-		}
-		goto finish;
-	}
-
-	node = find_element_by_name(hashtree, "digest");
-	if (node) {
-		if (!verify_element(node, "algorithm", THEX_HASH_ALGO))
-			goto finish;
-		if (!verify_element(node, "outputsize", THEX_HASH_SIZE))
-			goto finish;
-	} else {
-		if (GNET_PROPERTY(tigertree_debug)) {
-			g_debug("TTH couldn't find hashtree/digest element");
-		}
-    	goto finish;
-	}
-
-	node = find_element_by_name(hashtree, "serializedtree");
-	if (node) {
-		const char *value;
-		int error;
-
-		if (!verify_element(node, "type", THEX_TREE_TYPE))
-    		goto finish;
-
-		value = xnode_prop_get(node, "uri");
-		if (NULL == value) {
-			if (GNET_PROPERTY(tigertree_debug)) {
-				g_debug("TTH couldn't find property \"uri\" of node \"%s\"",
-					xnode_element_name(node));
-			}
-			goto finish;
-		}
-		hashtree_id = h_strdup(value);
+	vxml_parser_free(vp);
 
-		value = xnode_prop_get(node, "depth");
-		if (NULL == value) {
+	for (i = 0; i < N_ITEMS(needed); i++) {
+		if (0 == (xc.seen & THEX_XML_SEEN(needed[i].id))) {
 			if (GNET_PROPERTY(tigertree_debug)) {
-				g_debug("TTH couldn't find property \"depth\" of node \"%s\"",
-					xnode_element_name(node));
+				g_debug("TTH couldn't find %s element", needed[i].what);
 			}
 			goto finish;
 		}
-
-		ctx->depth = parse_uint16(value, NULL, 10, &error);
-		error |= ctx->depth > tt_full_depth(ctx->filesize);
-		if (error) {
-			ctx->depth = 0;
-			g_warning("TTH bad value for \"depth\" of node \"%s\": \"%s\"",
-				xnode_element_name(node), value);
-		}
-		if (error)
-			goto finish;
-	} else {
-		if (GNET_PROPERTY(tigertree_debug))
-			g_debug("TTH couldn't find hashtree/serializedtree element");
-		goto finish;
 	}
 
 	success = TRUE;
 
 finish:
 	if (!success)
-		HFREE_NULL(hashtree_id);
-	xnode_tree_free_null(&hashtree);
+		HFREE_NULL(xc.hashtree_id);
 
-	return hashtree_id;
+	return xc.hashtree_id;
 }
 
 static bool
@@ -53,6 +53,8 @@
 #include "lib/atoms.h"
 #include "lib/concat.h"
 #include "lib/gnet_host.h"
+#include "lib/halloc.h"
+#include "lib/hashlist.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/tigertree.h"
@@ -61,17 +63,33 @@
 #include "lib/override.h"	/* Must be the last header included */
 
 #define THEX_BUFSIZ			16384	/**< Buffer size for TX deflation */
+#define THEX_CACHE_MAX		64		/**< Max amount of cached replies */
 
 enum thex_state {
 	THEX_STATE_INITIAL,
-	THEX_STATE_XML,
-	THEX_STATE_XML_SENT,
-	THEX_STATE_TREE,
-	THEX_STATE_TREE_SENT,
+	THEX_STATE_DATA,
+	THEX_STATE_SENT,
 
 	NUM_THEX_STATES
 };
 
+/**
+ * A cached THEX reply: the DIME-encoded XML and tree records.
+ *
+ * Files are often requested by many hosts at the same time, and each of
+ * them will ask for the THEX data, so we keep the last replies around
+ * instead of rebuilding them from the TTH cache for each request.
+ */
+struct thex_reply {
+	struct tth tth;				/**< MUST be first, the hashing key */
+	filesize_t filesize;		/**< Size of the file */
+	char *data;					/**< The DIME-encoded reply */
+	size_t size;				/**< Size of the reply */
+	int refcnt;					/**< Amount of references */
+};
+
+static hash_list_t *thex_replies;	/**< Cached replies, in LRU order */
+
 struct thex_upload {
 	struct special_upload special;	/**< vtable, MUST be first field */
 
@@ -82,8 +100,7 @@ struct thex_upload {
 	const struct tth *tth;
 	filesize_t filesize;
 
-	char *data;
-	size_t size;
+	struct thex_reply *reply;
 	size_t offset;
 
 	enum thex_state state;
@@ -146,13 +163,6 @@ thex_upload_prepare_xml(char **data_ptr, const struct tth *tth,
 	return size;
 }
 
-static bool
-thex_upload_get_xml(struct thex_upload *ctx)
-{
-	ctx->size = thex_upload_prepare_xml(&ctx->data, ctx->tth, ctx->filesize);
-	return ctx->size > 0 && NULL != ctx->data;
-}
-
 static size_t
 thex_upload_prepare_tree(char **data_ptr, const struct tth *tth,
 	const struct tth *nodes, size_t n_nodes)
@@ -170,27 +180,117 @@ thex_upload_prepare_tree(char **data_ptr, const struct tth *tth,
 	return size;
 }
 
-static bool
-thex_upload_get_tree(struct thex_upload *ctx)
+/**
+ * Remove a reference on a cached reply, freeing it when no longer used.
+ */
+static void
+thex_reply_unref(struct thex_reply *r)
 {
-	const struct tth *nodes;
-	size_t n_nodes;
+	g_assert(r->refcnt > 0);
 
-	nodes = NULL;
-	n_nodes = tth_cache_get_tree(ctx->tth, ctx->filesize, &nodes);
-	g_return_val_if_fail(n_nodes > 0, FALSE);
-	g_return_val_if_fail(nodes, FALSE);
+	if (0 == --r->refcnt) {
+		HFREE_NULL(r->data);
+		WFREE(r);
+	}
+}
+
+/**
+ * Build the reply for the file, made of the DIME-encoded XML record
+ * followed by the DIME-encoded serialized tree.
+ *
+ * @return the new reply, NULL on error.
+ */
+static struct thex_reply *
+thex_reply_build(const struct tth *tth, filesize_t filesize)
+{
+	struct thex_reply *r;
+	const struct tth *nodes = NULL;
+	char *xml = NULL, *tree = NULL;
+	size_t n_nodes, xml_size, tree_size;
+
+	n_nodes = tth_cache_get_tree(tth, filesize, &nodes);
+	g_return_val_if_fail(n_nodes > 0, NULL);
+	g_return_val_if_fail(nodes, NULL);
+
+	xml_size = thex_upload_prepare_xml(&xml, tth, filesize);
+	tree_size = thex_upload_prepare_tree(&tree, tth, nodes, n_nodes);
+
+	if (0 == xml_size || NULL == xml || 0 == tree_size || NULL == tree) {
+		G_FREE_NULL(xml);
+		G_FREE_NULL(tree);
+		return NULL;
+	}
+
+	WALLOC0(r);
+	r->tth = *tth;
+	r->filesize = filesize;
+	r->size = xml_size + tree_size;
+	r->data = halloc(r->size);
+	memcpy(r->data, xml, xml_size);
+	memcpy(&r->data[xml_size], tree, tree_size);
+	r->refcnt = 1;
 
-	ctx->size = thex_upload_prepare_tree(&ctx->data, ctx->tth, nodes, n_nodes);
-	return ctx->size > 0 && NULL != ctx->data;
+	G_FREE_NULL(xml);
+	G_FREE_NULL(tree);
+
+	return r;
 }
 
-static void
-thex_upload_free_data(struct thex_upload *ctx)
+/**
+ * Get the reply for the file, from the cache or by building it.
+ *
+ * @return a new reference on the reply, NULL on error.
+ */
+static struct thex_reply *
+thex_reply_get(const struct tth *tth, filesize_t filesize)
 {
-	G_FREE_NULL(ctx->data);
-	ctx->offset = 0;
-	ctx->size = 0;
+	struct thex_reply *r;
+
+	if G_UNLIKELY(NULL == thex_replies)
+		thex_replies = hash_list_new(tth_hash, tth_eq);
+
+	r = hash_list_lookup(thex_replies, tth);
+
+	if (r != NULL) {
+		if (r->filesize == filesize) {
+			hash_list_moveto_head(thex_replies, r);
+			r->refcnt++;
+			return r;
+		}
+		hash_list_remove(thex_replies, r);
+		thex_reply_unref(r);
+	}
+
+	r = thex_reply_build(tth, filesize);
+	if (NULL == r)
+		return NULL;
+
+	hash_list_prepend(thex_replies, r);
+
+	while (hash_list_length(thex_replies) > THEX_CACHE_MAX) {
+		struct thex_reply *old = hash_list_remove_tail(thex_replies);
+		thex_reply_unref(old);
+	}
+
+	r->refcnt++;
+	return r;
+}
+
+/**
+ * Discard all the cached replies.
+ */
+void
+thex_upload_close_cache(void)
+{
+	struct thex_reply *r;
+
+	if (NULL == thex_replies)
+		return;
+
+	while (NULL != (r = hash_list_remove_head(thex_replies)))
+		thex_reply_unref(r);
+
+	hash_list_free(&thex_replies);
 }
 
 size_t
@@ -243,8 +343,7 @@ thex_upload_read(struct special_upload *special,
 
 	g_assert(ctx);
 	g_assert(0 == size || NULL != dest);
-	g_assert(0 == ctx->size || NULL != ctx->data);
-	g_assert(ctx->offset <= ctx->size);
+	g_assert(NULL == ctx->reply || ctx->offset <= ctx->reply->size);
 	g_assert(UNSIGNED(ctx->state) < NUM_THEX_STATES);
 
 	size = MIN(size, MAX_INT_VAL(ssize_t));
@@ -253,42 +352,34 @@ thex_upload_read(struct special_upload *special,
 
 		switch (ctx->state) {
 		case THEX_STATE_INITIAL:
-			g_assert(NULL == ctx->data);
-			if (!thex_upload_get_xml(ctx))
-				goto error;
-			ctx->state++;
-			break;
-
-		case THEX_STATE_XML_SENT:
-			g_assert(NULL == ctx->data);
-			if (!thex_upload_get_tree(ctx))
+			g_assert(NULL == ctx->reply);
+			ctx->reply = thex_reply_get(ctx->tth, ctx->filesize);
+			if (NULL == ctx->reply)
 				goto error;
 			ctx->state++;
 			break;
 
-		case THEX_STATE_XML:
-		case THEX_STATE_TREE:
+		case THEX_STATE_DATA:
 			{
+				const struct thex_reply *r = ctx->reply;
 				size_t n;
 
-				g_assert(ctx->data);
-				g_assert(ctx->size > ctx->offset);
-				n = ctx->size - ctx->offset;
+				g_assert(r != NULL);
+				g_assert(r->size > ctx->offset);
+				n = r->size - ctx->offset;
 				n = MIN(n, size);
 
-				memcpy(p, &ctx->data[ctx->offset], n);
+				memcpy(p, &r->data[ctx->offset], n);
 				ctx->offset += n;
 				p += n;
 				size -= n;
 
-				if (ctx->offset == ctx->size) {
-					thex_upload_free_data(ctx);
+				if (ctx->offset == r->size)
 					ctx->state++;
-				}
 			}
 			break;
 
-		case THEX_STATE_TREE_SENT:
+		case THEX_STATE_SENT:
 			size = 0;
 			break;
 		case NUM_THEX_STATES:
@@ -377,7 +468,8 @@ thex_upload_close(struct special_upload *special, bool fully_served)
 	}
 
 	tx_free(ctx->tx);
-	thex_upload_free_data(ctx);
+	if (ctx->reply != NULL)
+		thex_reply_unref(ctx->reply);
 	atom_tth_free_null(&ctx->tth);
 	ctx->special.magic = 0;
 	WFREE(ctx);
@@ -417,8 +509,7 @@ thex_upload_open(
 
 	ctx->tth = atom_tth_get(shared_file_tth(sf));
 	ctx->filesize = shared_file_size(sf);
-	ctx->data = NULL;
-	ctx->size = 0;
+	ctx->reply = NULL;
 	ctx->offset = 0;
 	ctx->state = THEX_STATE_INITIAL;
 
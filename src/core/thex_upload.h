@@ -63,6 +63,7 @@ struct special_upload *thex_upload_open(
 	const struct tx_link_cb *link_cb,
 	struct wrap_io *wio,
 	int flags);
+void thex_upload_close_cache(void);
 
 #endif /* _core_thex_upload_h_ */
 
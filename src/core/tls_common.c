@@ -60,6 +60,13 @@
 #define USE_TLS_PUSHV
 #endif
 
+/* gnutls_record_get_state() appeared in 3.4 */
+#if HAS_TLS(3, 4) && defined(HAS_KTLS)
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#define USE_KTLS
+#endif
+
 #include "tls_common.h"
 
 #include "features.h"
@@ -68,12 +75,15 @@
 #include "if/gnet_property_priv.h"
 #include "if/core/settings.h"
 
+#include "lib/aging.h"
 #include "lib/aje.h"
 #include "lib/array.h"
+#include "lib/atoms.h"
 #include "lib/concat.h"
 #include "lib/endian.h"
 #include "lib/fd.h"
 #include "lib/file.h"
+#include "lib/gnet_host.h"
 #include "lib/glog.h"
 #include "lib/halloc.h"
 #include "lib/header.h"
@@ -97,6 +107,7 @@ static const char tls_certfile[] = "cert.pem";
 
 #define TLS_DH_BITS			768
 #define TLS_FILE_MAXSIZE	(64 * 1024)
+#define TLS_RESUME_DELAY	3600		/**< Keep session data for 1 hour */
 
 struct tls_context {
 	gnutls_session_t session;
@@ -105,6 +116,8 @@ struct tls_context {
 		gnutls_anon_client_credentials_t client;
 	} cred;
 	const struct gnutella_socket *s;
+	bool ktls;				/**< Outgoing records encrypted by the kernel */
+	bool ktls_tried;		/**< Whether kernel offloading was attempted */
 };
 
 static gnutls_certificate_credentials_t cert_cred;
@@ -117,6 +130,22 @@ static bool cert_cred_loaded;
  */
 static htable_t *tls_sessions;
 
+/**
+ * Session data of the servers we connected to, for session resumption.
+ *
+ * We keep connecting again and again to the same hosts, and resuming the
+ * session avoids a full handshake with its asymmetric cryptography.
+ */
+static aging_table_t *tls_resume;
+
+#if HAS_TLS(2, 12)
+/**
+ * Key used to encrypt the session tickets we hand out as a server, so that
+ * clients can resume their session without us keeping any state.
+ */
+static gnutls_datum_t tls_ticket_key;
+#endif
+
 /**
  * Fill ``len'' random byte starting at ``data''.
  *
@@ -141,13 +170,14 @@ gnutls_rnd(gnutls_rnd_level_t level, void *data, size_t len)
 	 *
 	 * The GNUTLS_RND_NONCE is for non-predictable random numbers, which
 	 * must resist statistical analysis.  If broken, parts of the TLS
-	 * session are compromised.
+	 * session are compromised.  Nonces are requested for every record
+	 * sent, so we use the thread-private AJE pool, which needs no locking.
 	 */
 
 	if (GNUTLS_RND_KEY == level)
 		random_key_bytes(data, len);
 	else if (GNUTLS_RND_NONCE == level)
-		random_bytes_with(aje_rand, data, len);
+		random_bytes_with(aje_thread_rand, data, len);
 	else
 		random_strong_bytes(data, len);
 
@@ -566,6 +596,31 @@ tls_set_errno(struct gnutella_socket *s, int errnum)
 	gnutls_transport_set_errno(tls_socket_get_session(s), errnum);
 }
 
+#ifdef USE_KTLS
+/**
+ * Called when GnuTLS wants to send a record after the kernel took over the
+ * encryption of outgoing data on the socket.
+ *
+ * This happens when the remote peer requests a TLS 1.3 key update, since
+ * GnuTLS would then switch to new keys the kernel does not know about.
+ * The record cannot be sent without corrupting the stream, so we have to
+ * fail the connection.
+ */
+static ssize_t
+tls_kernel_push_refused(struct gnutella_socket *s)
+{
+	if (GNET_PROPERTY(tls_debug)) {
+		g_warning("%s(): GnuTLS record to send after kernel offloading, "
+			"dropping host=%s", G_STRFUNC,
+			host_addr_port_to_string(s->addr, s->port));
+	}
+	socket_connection_reset(s);
+	tls_set_errno(s, EIO);
+	errno = EIO;
+	return -1;
+}
+#endif	/* USE_KTLS */
+
 #ifdef USE_TLS_PUSHV
 static inline ssize_t
 tls_pushv(gnutls_transport_ptr_t ptr, const giovec_t *iov, int iovcnt)
@@ -578,6 +633,11 @@ tls_pushv(gnutls_transport_ptr_t ptr, const giovec_t *iov, int iovcnt)
 	socket_check(s);
 	g_assert(is_valid_fd(s->file_desc));
 
+#ifdef USE_KTLS
+	if G_UNLIKELY(s->tls.ctx->ktls)
+		return tls_kernel_push_refused(s);
+#endif
+
 	/*
 	 * On Windows, we need to convert the giovec_t structure into our
 	 * emulated iovec_t, which are actually WSABUF structures, so that
@@ -621,6 +681,11 @@ tls_push(gnutls_transport_ptr_t ptr, const void *buf, size_t size)
 	socket_check(s);
 	g_assert(is_valid_fd(s->file_desc));
 
+#ifdef USE_KTLS
+	if G_UNLIKELY(s->tls.ctx->ktls)
+		return tls_kernel_push_refused(s);
+#endif
+
 	ret = s_write(s->file_desc, buf, size);
 	saved_errno = errno;
 	tls_signal_pending(s);
@@ -854,6 +919,13 @@ tls_handshake(struct gnutella_socket *s)
 			tls_print_session_info(s->addr, s->port, session,
 				SOCK_CONN_INCOMING == s->direction);
 		}
+		if (
+			GNET_PROPERTY(tls_debug) > 1 &&
+			gnutls_session_is_resumed(session)
+		) {
+			g_debug("%s(): TLS session resumed with %s",
+				G_STRFUNC, host_addr_port_to_string(s->addr, s->port));
+		}
 		tls_signal_pending(s);
 		return TLS_HANDSHAKE_FINISHED;
 	case GNUTLS_E_AGAIN:
@@ -889,6 +961,72 @@ tls_handshake(struct gnutella_socket *s)
 	return TLS_HANDSHAKE_ERROR;
 }
 
+/**
+ * Free session data held in the resumption cache.
+ */
+static void
+tls_resume_free(void *key, void *value)
+{
+	gnutls_datum_t *d = value;
+
+	atom_host_free(key);
+	gnutls_free(d->data);
+	WFREE(d);
+}
+
+/**
+ * Prepare client session for resumption, if we have session data for
+ * the server we are connecting to.
+ */
+static void
+tls_resume_set(gnutls_session_t session, const struct gnutella_socket *s)
+{
+	gnet_host_t to;
+	const gnutls_datum_t *d;
+
+	gnet_host_set(&to, s->addr, s->port);
+	d = aging_lookup(tls_resume, &to);
+
+	if (d != NULL) {
+		int e = gnutls_session_set_data(session, d->data, d->size);
+
+		if (e != 0 && GNET_PROPERTY(tls_debug)) {
+			g_debug("%s(): cannot resume session with %s: %s",
+				G_STRFUNC, host_addr_port_to_string(s->addr, s->port),
+				gnutls_strerror(e));
+		}
+	}
+}
+
+/**
+ * Save the session data of an established client session, so that the next
+ * connection to the same server can resume the session.
+ *
+ * This is done when the session is freed and not right after the handshake
+ * because with TLS 1.3, session tickets are only sent afterwards.
+ */
+static void
+tls_resume_save(gnutls_session_t session, const struct gnutella_socket *s)
+{
+	gnet_host_t to;
+	gnutls_datum_t *d;
+
+	WALLOC0(d);
+
+	if (0 != gnutls_session_get_data2(session, d) || 0 == d->size) {
+		gnutls_free(d->data);
+		WFREE(d);
+		return;
+	}
+
+	gnet_host_set(&to, s->addr, s->port);
+
+	if (aging_lookup(tls_resume, &to) != NULL)
+		aging_remove(tls_resume, &to);
+
+	aging_insert(tls_resume, atom_host_get(&to), d);
+}
+
 /**
  * Initiates a new TLS session.
  *
@@ -999,6 +1137,11 @@ tls_init(struct gnutella_socket *s)
 		 * if we already laoded the certificate.
 		 */
 
+#if HAS_TLS(2, 12)
+		if (tls_ticket_key.data != NULL)
+			gnutls_session_ticket_enable_server(ctx->session, &tls_ticket_key);
+#endif
+
 		if (cert_cred_loaded)
 			goto done;
 
@@ -1018,6 +1161,8 @@ tls_init(struct gnutella_socket *s)
 		if (TRY(gnutls_credentials_set)(ctx->session,
 				GNUTLS_CRD_ANON, ctx->cred.client))
 			goto failure;
+
+		tls_resume_set(ctx->session, s);
 	}
 
 	/* FALL THROUGH */
@@ -1043,6 +1188,8 @@ tls_free(struct gnutella_socket *s)
 	ctx = s->tls.ctx;
 	if (ctx) {
 		if (ctx->session) {
+			if (!server && SOCK_TLS_ESTABLISHED == s->tls.stage)
+				tls_resume_save(ctx->session, s);
 			htable_remove(tls_sessions, ctx->session);
 			gnutls_deinit(ctx->session);
 		}
@@ -1098,6 +1245,14 @@ tls_global_init(void)
 	(void) tls_dh_params();
 	gnutls_certificate_allocate_credentials(&cert_cred);
 
+#if HAS_TLS(2, 12)
+	if ((e = gnutls_session_ticket_key_generate(&tls_ticket_key))) {
+		g_warning("%s(): gnutls_session_ticket_key_generate() failed: %s",
+			G_STRFUNC, gnutls_strerror(e));
+		ZERO(&tls_ticket_key);
+	}
+#endif
+
 	key_file = make_pathname(settings_config_dir(), tls_keyfile);
 	cert_file = make_pathname(settings_config_dir(), tls_certfile);
 
@@ -1143,6 +1298,8 @@ tls_global_init(void)
 	header_features_add(FEATURES_UPLOADS, f.name, f.major, f.minor);
 
 	tls_sessions = htable_create(HASH_KEY_SELF, 0);
+	tls_resume = aging_make(TLS_RESUME_DELAY,
+		gnet_host_hash, gnet_host_equal, tls_resume_free);
 }
 
 void
@@ -1153,6 +1310,14 @@ tls_global_close(void)
 		cert_cred = NULL;
 	}
 	htable_free_null(&tls_sessions);
+	aging_destroy(&tls_resume);
+#if HAS_TLS(2, 12)
+	if (tls_ticket_key.data != NULL) {
+		memset(tls_ticket_key.data, 0, tls_ticket_key.size);
+		gnutls_free(tls_ticket_key.data);
+		ZERO(&tls_ticket_key);
+	}
+#endif
 	gnutls_global_deinit();
 }
 
@@ -1395,6 +1560,262 @@ tls_no_sendto(struct wrap_io *unused_wio, const gnet_host_t *unused_to,
 	return -1;
 }
 
+static ssize_t
+tls_no_sendmmsg(struct wrap_io *unused_wio,
+	const wrap_dgram_t *unused_dg, int unused_cnt)
+{
+	(void) unused_wio;
+	(void) unused_dg;
+	(void) unused_cnt;
+	g_error("no sendmmsg() routine allowed");
+	return -1;
+}
+
+#ifdef USE_KTLS
+static ssize_t
+tls_kernel_io_check(struct gnutella_socket *s, const char *op,
+	size_t size, ssize_t ret)
+{
+	int saved_errno = errno;
+
+	if ((ssize_t) -1 == ret) {
+		if (ECONNRESET == saved_errno || EPIPE == saved_errno)
+			socket_connection_reset(s);
+	}
+	tls_transport_debug(op, s, size, ret);
+	tls_signal_pending(s);
+	errno = saved_errno;
+	return ret;
+}
+
+/**
+ * Write data to a socket whose outgoing records are encrypted by the kernel.
+ */
+static ssize_t
+tls_kernel_write(struct wrap_io *wio, const void *buf, size_t size)
+{
+	struct gnutella_socket *s = wio->ctx;
+
+	socket_check(s);
+	g_assert(socket_uses_tls(s));
+	g_assert(NULL != buf);
+	g_assert(size_is_positive(size));
+
+	return tls_kernel_io_check(s, G_STRFUNC, size,
+		s_write(s->file_desc, buf, size));
+}
+
+/**
+ * Write I/O vector to a socket whose outgoing records are encrypted by
+ * the kernel.
+ */
+static ssize_t
+tls_kernel_writev(struct wrap_io *wio, const iovec_t *iov, int iovcnt)
+{
+	struct gnutella_socket *s = wio->ctx;
+
+	socket_check(s);
+	g_assert(socket_uses_tls(s));
+	g_assert(iovcnt > 0);
+
+	return tls_kernel_io_check(s, G_STRFUNC, iov_calculate_size(iov, iovcnt),
+		s_writev(s->file_desc, iov, iovcnt));
+}
+
+/**
+ * Send the "close_notify" alert through the kernel, since GnuTLS can no
+ * longer send records on the socket.
+ */
+static void
+tls_kernel_bye(struct gnutella_socket *s)
+{
+	static const uint8 alert[2] = { 1, 0 };		/* Warning, close_notify */
+	char control[CMSG_SPACE(sizeof(uint8))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	ZERO(&msg);
+	ZERO(&control);
+	iov.iov_base = deconstify_pointer(alert);
+	iov.iov_len = sizeof alert;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint8));
+	*(uint8 *) CMSG_DATA(cmsg) = 21;			/* Record type: alert */
+
+	if (-1 == sendmsg(s->file_desc, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) {
+		if (GNET_PROPERTY(tls_debug) > 1) {
+			g_debug("%s(): cannot send close_notify to host=%s: %m",
+				G_STRFUNC, host_addr_port_to_string(s->addr, s->port));
+		}
+	}
+}
+
+/**
+ * Fill the kernel crypto information ``c'' for cipher ``type'' from the
+ * GnuTLS write state.
+ *
+ * With TLS 1.2, the implicit part of the nonce (the salt) is given by GnuTLS
+ * as the IV, and the explicit part starts with the record sequence number.
+ * With TLS 1.3, the salt and the IV are the two parts of the IV given by
+ * GnuTLS.  ChaCha20 has no salt and uses the whole IV in both cases.
+ */
+#define TLS_KERNEL_FILL(c, type) G_STMT_START {						\
+	size_t saltlen = sizeof (c).salt;									\
+	if (key.size != sizeof (c).key || iv.size < saltlen)				\
+		goto unsupported;												\
+	(c).info.version = version;											\
+	(c).info.cipher_type = (type);										\
+	memcpy((c).key, key.data, sizeof (c).key);							\
+	memcpy((c).salt, iv.data, saltlen);									\
+	memcpy((c).rec_seq, seq, sizeof (c).rec_seq);						\
+	if (TLS_1_2_VERSION == version && saltlen != 0) {					\
+		memcpy((c).iv, seq, sizeof (c).iv);								\
+	} else {															\
+		if (iv.size != saltlen + sizeof (c).iv)							\
+			goto unsupported;											\
+		memcpy((c).iv, ptr_add_offset(iv.data, saltlen), sizeof (c).iv);\
+	}																	\
+	len = sizeof (c);													\
+} G_STMT_END
+#endif	/* USE_KTLS */
+
+/**
+ * Hand the TLS session keys of the socket to the kernel, so that data
+ * written to the socket descriptor are encrypted by the kernel.
+ *
+ * This lets sendfile() be used on TLS connections, the kernel building the
+ * TLS records itself.  Only the sending side is offloaded: incoming records
+ * are still decrypted by GnuTLS.
+ *
+ * Offloading is attempted only once per socket, after the handshake.
+ *
+ * @return TRUE if outgoing data are now encrypted by the kernel.
+ */
+bool
+tls_kernel_offload(struct gnutella_socket *s)
+{
+#ifdef USE_KTLS
+	static bool unavailable;
+	tls_context_t ctx;
+	gnutls_session_t session;
+	gnutls_datum_t mac, iv, key;
+	uint8 seq[8];
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+#ifdef TLS_CIPHER_AES_GCM_256
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+	} ci;
+	socklen_t len = 0;
+	uint16 version;
+
+	socket_check(s);
+	g_assert(socket_uses_tls(s));
+
+	ctx = s->tls.ctx;
+
+	if (ctx->ktls || ctx->ktls_tried)
+		return ctx->ktls;
+
+	if (unavailable || !GNET_PROPERTY(tls_kernel_offload))
+		return FALSE;
+
+	if (s->tls.snarf != 0)
+		return FALSE;		/* GnuTLS still has a record to send */
+
+	ctx->ktls_tried = TRUE;
+	session = ctx->session;
+	ZERO(&ci);
+
+	switch (gnutls_protocol_get_version(session)) {
+	case GNUTLS_TLS1_2:
+		version = TLS_1_2_VERSION;
+		break;
+#if HAS_TLS(3, 6) && defined(TLS_1_3_VERSION)
+	case GNUTLS_TLS1_3:
+		version = TLS_1_3_VERSION;
+		break;
+#endif
+	default:
+		goto unsupported;
+	}
+
+	if (0 != gnutls_record_get_state(session, FALSE, &mac, &iv, &key, seq))
+		goto unsupported;
+
+	switch (gnutls_cipher_get(session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		TLS_KERNEL_FILL(ci.gcm128, TLS_CIPHER_AES_GCM_128);
+		break;
+#ifdef TLS_CIPHER_AES_GCM_256
+	case GNUTLS_CIPHER_AES_256_GCM:
+		TLS_KERNEL_FILL(ci.gcm256, TLS_CIPHER_AES_GCM_256);
+		break;
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		TLS_KERNEL_FILL(ci.chacha, TLS_CIPHER_CHACHA20_POLY1305);
+		break;
+#endif
+	default:
+		goto unsupported;
+	}
+
+	if (-1 == setsockopt(s->file_desc, SOL_TCP, TCP_ULP, "tls", sizeof "tls")) {
+		if (ENOENT == errno)
+			unavailable = TRUE;		/* No TLS support in the kernel */
+		goto failed;
+	}
+
+	/*
+	 * Should this fail, the socket is left with the TLS upper layer but
+	 * with no keys, which makes it behave as a plain TCP socket: GnuTLS
+	 * can go on sending its own records.
+	 */
+
+	if (-1 == setsockopt(s->file_desc, SOL_TLS, TLS_TX, &ci, len))
+		goto failed;
+
+	ZERO(&ci);
+	ctx->ktls = TRUE;
+	s->wio.write = tls_kernel_write;
+	s->wio.writev = tls_kernel_writev;
+
+	if (GNET_PROPERTY(tls_debug) > 1) {
+		g_debug("%s(): kernel now encrypts %s records to host=%s (fd=%d)",
+			G_STRFUNC, gnutls_cipher_get_name(gnutls_cipher_get(session)),
+			host_addr_port_to_string(s->addr, s->port), s->file_desc);
+	}
+
+	return TRUE;
+
+failed:
+	if (GNET_PROPERTY(tls_debug)) {
+		g_debug("%s(): cannot offload TLS to kernel for host=%s: %m",
+			G_STRFUNC, host_addr_port_to_string(s->addr, s->port));
+	}
+	/* FALL THROUGH */
+
+unsupported:
+	ZERO(&ci);
+	return FALSE;
+#else	/* !USE_KTLS */
+	socket_check(s);
+	return FALSE;
+#endif	/* USE_KTLS */
+}
+
 void
 tls_wio_link(struct gnutella_socket *s)
 {
@@ -1405,6 +1826,7 @@ tls_wio_link(struct gnutella_socket *s)
 	s->wio.writev = tls_writev;
 	s->wio.readv = tls_readv;
 	s->wio.sendto = tls_no_sendto;
+	s->wio.sendmmsg = tls_no_sendmmsg;
 	s->wio.flush = tls_flush;
 }
 
@@ -1424,6 +1846,13 @@ tls_bye(struct gnutella_socket *s)
 		g_warning("%s(): tls_flush(fd=%d) failed", G_STRFUNC, s->file_desc);
 	}
 
+#ifdef USE_KTLS
+	if (s->tls.ctx->ktls) {
+		tls_kernel_bye(s);
+		return;
+	}
+#endif
+
 	ret = gnutls_bye(s->tls.ctx->session,
 			SOCK_CONN_INCOMING != s->direction
 				? GNUTLS_SHUT_WR : GNUTLS_SHUT_RDWR);
@@ -1603,6 +2032,14 @@ tls_wio_link(struct gnutella_socket *s)
 	g_assert_not_reached();
 }
 
+bool
+tls_kernel_offload(struct gnutella_socket *s)
+{
+	socket_check(s);
+	g_assert_not_reached();
+	return FALSE;
+}
+
 void
 tls_global_init(void)
 {
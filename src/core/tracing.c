@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Binary tracing of high-rate core events.
+ *
+ * This defines the core events that can be traced through the binary
+ * tracing layer, and opens the trace file when requested.  Traces are
+ * decoded offline by the "btrace" program.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "tracing.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+/**
+ * Definition of the traced events.
+ */
+static const struct {
+	enum tracing_event event;
+	const char *name;
+	uint kinds;
+} tracing_events[] = {
+	{ TRACE_ROUTE, "route",
+		/* origin, function|hops|ttl|flags, MUID, route */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_HEX,
+			BTRACE_A_HEX, BTRACE_A_UINT) },
+	{ TRACE_DHT_RPC_SEND, "dht-rpc-send",
+		/* node, operation, MUID, timeout (ms) */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_UINT,
+			BTRACE_A_HEX, BTRACE_A_UINT) },
+	{ TRACE_DHT_RPC_REPLY, "dht-rpc-reply",
+		/* node, operation, MUID, RTT (ms) */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_UINT,
+			BTRACE_A_HEX, BTRACE_A_UINT) },
+	{ TRACE_DHT_RPC_TIMEOUT, "dht-rpc-timeout",
+		/* node, operation, MUID */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_UINT,
+			BTRACE_A_HEX, BTRACE_A_NONE) },
+	{ TRACE_DL_REQUEST, "dl-request",
+		/* source, download, chunk start, chunk end */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_HEX,
+			BTRACE_A_UINT, BTRACE_A_UINT) },
+	{ TRACE_DL_DATA, "dl-data",
+		/* source, download, position, amount */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_HEX,
+			BTRACE_A_UINT, BTRACE_A_UINT) },
+	{ TRACE_DL_STOP, "dl-stop",
+		/* source, download, position, status */
+		BTRACE_KINDS(BTRACE_A_ADDR, BTRACE_A_HEX,
+			BTRACE_A_UINT, BTRACE_A_UINT) },
+};
+
+/**
+ * Initialize event tracing.
+ *
+ * @param path		trace file to create, NULL if not tracing.
+ */
+void G_COLD
+tracing_init(const char *path)
+{
+	uint i;
+
+	STATIC_ASSERT(TRACE_MAX - 1 == N_ITEMS(tracing_events));
+
+	for (i = 0; i < N_ITEMS(tracing_events); i++) {
+		g_assert(UNSIGNED(i + 1) == tracing_events[i].event);
+
+		btrace_define(tracing_events[i].event,
+			tracing_events[i].name, tracing_events[i].kinds);
+	}
+
+	if (path != NULL && !btrace_open(path))
+		g_warning("cannot open trace file \"%s\": %m", path);
+}
+
+/**
+ * Stop event tracing.
+ */
+void G_COLD
+tracing_close(void)
+{
+	btrace_close();
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Binary tracing of high-rate core events.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _core_tracing_h_
+#define _core_tracing_h_
+
+#include "common.h"
+
+#include "lib/btrace.h"
+
+/**
+ * Traced events.
+ *
+ * IDs are recorded in the trace files along with the event names, so they
+ * need not be stable across versions.
+ */
+enum tracing_event {
+	TRACE_ROUTE = 1,			/**< Gnutella message routed */
+	TRACE_DHT_RPC_SEND,			/**< DHT RPC issued */
+	TRACE_DHT_RPC_REPLY,		/**< DHT RPC reply received */
+	TRACE_DHT_RPC_TIMEOUT,		/**< DHT RPC timed out */
+	TRACE_DL_REQUEST,			/**< Download request sent */
+	TRACE_DL_DATA,				/**< Download data received */
+	TRACE_DL_STOP,				/**< Download stopped */
+
+	TRACE_MAX
+};
+
+/**
+ * Trace argument for a GUID: its leading 8 bytes.
+ */
+static inline uint64
+tracing_guid(const void *guid)
+{
+	uint64 v;
+
+	memcpy(&v, guid, sizeof v);
+	return v;
+}
+
+/*
+ * Public interface.
+ */
+
+void tracing_init(const char *path);
+void tracing_close(void);
+
+#endif /* _core_tracing_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -28,12 +28,25 @@
  *
  * Caching of tigertree data.
  *
- * The tigertree data for each shared file is stored in a file in the directory
- * GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For example, if the root
- * hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data is
- * stored in
- * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
- * This avoids storing too many files per directory.
+ * The tigertree data of shared files are packed into a few large segment
+ * files, under the directory GTK_GNUTELLA_DIR/tth_store/.  Entries are
+ * sharded among TTH_SHARD_COUNT segments according to the leading bits of
+ * their root hash, each segment being an append-only sequence of records:
+ *
+ *   0    root hash (24 bytes)
+ *   24   amount of leaves (4 bytes, big-endian)
+ *   28   flags (4 bytes, big-endian), TTH_REC_F_*
+ *   32   the leaves, in raw binary form
+ *
+ * Replaced or removed entries are killed in place by clearing their
+ * TTH_REC_F_LIVE flag, and segments are compacted by the cleanup thread
+ * when they hold more dead data than live one.
+ *
+ * Each segment has its index, keyed by root hash, kept in core and saved
+ * in a companion index file at shutdown and after compactions.  At startup,
+ * we only need to load the index and scan the records appended to the
+ * segment since the index was written.  Leaves are read through a shared
+ * memory mapping of the segment.
  *
  * Only the leaves at TTH_MAX_DEPTH or above are stored. The root hash and the
  * nodes at each level between above these leaves can be calculated from the
@@ -41,10 +54,17 @@
  *
  * If the depth is 1 (root only), nothing is stored.
  *
+ * Former releases stored each tree in its own file, in the directory
+ * GTK_GNUTELLA_DIR/tth_cache/ (for instance the tree whose root hash is
+ * 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ was stored in the file
+ * tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ).  These entries are
+ * imported on demand, and the whole legacy tree is converted and removed
+ * by the first cleanup.
+ *
  * @author Christian Biere
  * @date 2007
  * @author Raphael Manfredi
- * @date 2015
+ * @date 2015, 2026
  */
 
 #include "common.h"
@@ -56,20 +76,24 @@
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/compat_pio.h"
+#include "lib/endian.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/ftw.h"
 #include "lib/halloc.h"
+#include "lib/hikset.h"
 #include "lib/hset.h"
 #include "lib/hstrfn.h"
+#include "lib/mutex.h"
 #include "lib/path.h"
 #include "lib/pslist.h"
-#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/tigertree.h"
 #include "lib/timestamp.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property_priv.h"
@@ -83,20 +107,73 @@
 #define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP) /* 0640 */
 #endif
 
+#define TTH_SHARD_BITS		4
+#define TTH_SHARD_COUNT		(1 << TTH_SHARD_BITS)	/* Segment files */
+
+#define TTH_SEG_MAGIC		"GTKGTTHS"
+#define TTH_IDX_MAGIC		"GTKGTTHI"
+#define TTH_SEG_VERSION		1
+#define TTH_SEG_HDRLEN		24	/* magic, version, shard, generation */
+#define TTH_IDX_HDRLEN		32	/* Same as segment + covered length */
+#define TTH_REC_HDRLEN		32	/* root, leaves, flags */
+#define TTH_IDX_RECLEN		36	/* root, offset, leaves */
+
+#define TTH_REC_F_LIVE		(1U << 0)	/* Record is valid */
+
+#define TTH_COMPACT_MIN		(4 * 1024 * 1024)	/* Dead bytes for compaction */
+
+/**
+ * An index entry.
+ */
+struct tth_slot {
+	const struct tth *root;		/**< Root hash (atom), the key */
+	fileoffset_t offset;		/**< Record offset in segment */
+	uint32 leaves;				/**< Amount of leaves */
+	bool fresh;					/**< Stored during this session */
+};
+
+/**
+ * A shard of the cache.
+ */
+struct tth_shard {
+	hikset_t *index;			/**< Index of struct tth_slot, by root */
+	int fd;						/**< Segment file, -1 if not opened */
+	uint64 generation;			/**< Bumped by each compaction */
+	fileoffset_t size;			/**< Append offset, 0 if no header yet */
+	fileoffset_t dead;			/**< Bytes held by dead records */
+	char *map;					/**< Read-only mapping of the segment */
+	size_t mapped;				/**< Length of the mapping */
+	bool dirty;					/**< Index differs from the saved one */
+};
+
+static struct tth_shard tth_shard[TTH_SHARD_COUNT];
+static bool tth_cache_inited;
+static bool tth_cache_legacy;	/**< Whether legacy tree is still present */
+
 /**
- * This lock is used to protect the creation / removal of directories
- * under the TTH cache.
+ * This lock protects the shards, which can be used by the cleanup thread.
  */
-static spinlock_t tth_path_lk = SPINLOCK_INIT;
+static mutex_t tth_cache_mtx = MUTEX_INIT;
 
-#define TTH_PATH_LOCK		spinlock(&tth_path_lk)
-#define TTH_PATH_UNLOCK		spinunlock(&tth_path_lk)
+#define TTH_CACHE_LOCK		mutex_lock(&tth_cache_mtx)
+#define TTH_CACHE_UNLOCK	mutex_unlock(&tth_cache_mtx)
 
 static const char *
 tth_cache_directory(void)
 {
 	static char *directory;
 
+	if (!directory) {
+		directory = make_pathname(settings_config_dir(), "tth_store");
+	}
+	return NOT_LEAKING(directory);
+}
+
+static const char *
+tth_cache_legacy_directory(void)
+{
+	static char *directory;
+
 	if (!directory) {
 		directory = make_pathname(settings_config_dir(), "tth_cache");
 	}
@@ -104,7 +181,7 @@ tth_cache_directory(void)
 }
 
 static char *
-tth_cache_pathname(const struct tth *tth)
+tth_cache_legacy_pathname(const struct tth *tth)
 {
 	const char *hash;
 
@@ -112,81 +189,383 @@ tth_cache_pathname(const struct tth *tth)
 
 	hash = tth_base32(tth);
 	return h_strdup_printf("%s%c%2.2s%c%s",
-			tth_cache_directory(), G_DIR_SEPARATOR,
+			tth_cache_legacy_directory(), G_DIR_SEPARATOR,
 			&hash[0], G_DIR_SEPARATOR, &hash[2]);
 }
 
-static int
-tth_cache_file_create(const struct tth *tth)
+/**
+ * @return the shard holding the given root hash.
+ */
+static inline struct tth_shard *
+tth_cache_shard(const struct tth *tth)
 {
-	char *pathname;
-	int accmode;
-	int fd;
+	return &tth_shard[(uchar) tth->data[0] >> (8 - TTH_SHARD_BITS)];
+}
+
+/**
+ * @return the index of the shard, used to name its files.
+ */
+static inline uint
+tth_shard_number(const struct tth_shard *s)
+{
+	return s - &tth_shard[0];
+}
+
+/**
+ * @return the length of a record holding the given amount of leaves.
+ */
+static inline size_t
+tth_rec_len(size_t leaves)
+{
+	return TTH_REC_HDRLEN + leaves * TTH_RAW_SIZE;
+}
+
+/**
+ * @return whether amount of leaves is valid for a stored entry.
+ */
+static inline bool
+tth_leaves_valid(size_t leaves)
+{
+	return leaves > 1 && leaves <= TTH_MAX_LEAVES;
+}
+
+/**
+ * @return name of shard file of the given kind, in the cache directory.
+ */
+static char *
+tth_shard_name(const struct tth_shard *s, const char *what)
+{
+	return str_cmsg("%s.%02x", what, tth_shard_number(s));
+}
+
+/**
+ * @return full pathname of shard file of the given kind, to be freed.
+ */
+static char *
+tth_shard_pathname(const struct tth_shard *s, const char *what)
+{
+	char *name = tth_shard_name(s, what);
+	char *path = make_pathname(tth_cache_directory(), name);
+
+	HFREE_NULL(name);
+	return path;
+}
+
+/**
+ * Fill segment header.
+ */
+static void
+tth_shard_header_fill(const struct tth_shard *s,
+	char buf[TTH_SEG_HDRLEN], uint64 generation)
+{
+	memcpy(buf, TTH_SEG_MAGIC, 8);
+	poke_be32(&buf[8], TTH_SEG_VERSION);
+	poke_be32(&buf[12], tth_shard_number(s));
+	poke_be64(&buf[16], generation);
+}
+
+/**
+ * Drop the mapping of the segment.
+ */
+static void
+tth_shard_unmap(struct tth_shard *s)
+{
+	if (s->map != NULL) {
+		vmm_munmap(s->map, s->mapped);
+		s->map = NULL;
+		s->mapped = 0;
+	}
+}
+
+/**
+ * Open the segment for appending, creating it when missing.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+tth_shard_open(struct tth_shard *s)
+{
+	char *path;
+
+	if (is_valid_fd(s->fd))
+		return TRUE;
+
+	if (
+		!is_directory(tth_cache_directory()) &&
+		-1 == create_directory(tth_cache_directory(), DEFAULT_DIRECTORY_MODE)
+	) {
+		g_warning("%s(): cannot create %s: %m",
+			G_STRFUNC, tth_cache_directory());
+		return FALSE;
+	}
+
+	path = tth_shard_pathname(s, "segment");
+	s->fd = file_open(path, O_CREAT | O_RDWR, TTH_FILE_MODE);
+
+	if (!is_valid_fd(s->fd))
+		goto failed;
+
+	if (0 == s->size) {
+		char hdr[TTH_SEG_HDRLEN];
+
+		tth_shard_header_fill(s, hdr, s->generation);
+		if (TTH_SEG_HDRLEN != compat_pwrite(s->fd, ARYLEN(hdr), 0))
+			goto failed;
+		s->size = TTH_SEG_HDRLEN;
+		s->dead = 0;
+	}
+
+	if (-1 == ftruncate(s->fd, s->size))
+		goto failed;
+
+	HFREE_NULL(path);
+	return TRUE;
+
+failed:
+	g_warning("%s(): cannot open %s: %m", G_STRFUNC, path);
+	fd_close(&s->fd);
+	HFREE_NULL(path);
+	return FALSE;
+}
+
+/**
+ * Get mapped segment data, remapping the segment when it grew.
+ *
+ * @return the address of the data, NULL on error.
+ */
+static const char *
+tth_shard_data(struct tth_shard *s, fileoffset_t offset, size_t len)
+{
+	g_assert(offset >= TTH_SEG_HDRLEN);
+
+	if G_UNLIKELY(offset + (fileoffset_t) len > s->size)
+		return NULL;
+
+	if (offset + len > s->mapped) {
+		void *p;
+
+		tth_shard_unmap(s);
+
+		if (!tth_shard_open(s))
+			return NULL;
+
+		p = vmm_mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+
+		if G_UNLIKELY(MAP_FAILED == p) {
+			g_warning("%s(): cannot map segment #%u: %m",
+				G_STRFUNC, tth_shard_number(s));
+			return NULL;
+		}
+
+		vmm_madvise_random(p, s->size);
+		s->map = p;
+		s->mapped = s->size;
+	}
+
+	return &s->map[offset];
+}
+
+/**
+ * Record entry in the shard index, updating any existing slot.
+ */
+static void
+tth_shard_index_add(struct tth_shard *s, const struct tth *tth,
+	fileoffset_t offset, size_t leaves, bool fresh)
+{
+	struct tth_slot *slot;
+
+	slot = hikset_lookup(s->index, tth);
 
-	g_return_val_if_fail(tth, -1);
+	if (NULL == slot) {
+		WALLOC0(slot);
+		slot->root = atom_tth_get(tth);
+		hikset_insert_key(s->index, &slot->root);
+	}
 
-	accmode = O_WRONLY | O_TRUNC;
-	pathname = tth_cache_pathname(tth);
+	slot->offset = offset;
+	slot->leaves = leaves;
+	slot->fresh = fresh;
+	s->dirty = TRUE;
+}
+
+/**
+ * Free index slot.
+ */
+static void
+tth_slot_free(struct tth_slot *slot)
+{
+	atom_tth_free_null(&slot->root);
+	WFREE(slot);
+}
 
+/**
+ * Kill the segment record of an index slot.
+ */
+static void
+tth_shard_kill(struct tth_shard *s, const struct tth_slot *slot)
+{
 	/*
-	 * Critical section required since we could have a concurrent thread
-	 * deciding to remove empty directories whilst we are attempting
-	 * to create a new directory to store the new cached entry!
+	 * Killing the record is done on a best-effort basis: should it resurrect
+	 * after a crash, its data would still be valid for its root hash.
 	 */
 
-	TTH_PATH_LOCK;
+	if (tth_shard_open(s)) {
+		char flags[4];
+		fileoffset_t offset = slot->offset + 28;
+
+		poke_be32(flags, 0);
+		if (4 != compat_pwrite(s->fd, ARYLEN(flags), offset))
+			g_warning("%s(): cannot kill record: %m", G_STRFUNC);
+	}
+
+	s->dead += tth_rec_len(slot->leaves);
+	s->dirty = TRUE;
+}
+
+/**
+ * Append new record to the segment, updating the index.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+tth_shard_append(struct tth_shard *s, const struct tth *tth,
+	const struct tth *leaves, size_t n, bool fresh)
+{
+	struct tth_slot *slot;
+	size_t len = tth_rec_len(n);
+	char *buf;
+	ssize_t w;
+
+	g_assert(tth_leaves_valid(n));
+
+	if (!tth_shard_open(s))
+		return FALSE;
+
+	STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
 
-	fd = file_create_missing(pathname, accmode, TTH_FILE_MODE);
-	if (fd < 0 && ENOENT == errno) {
-		char *dir = filepath_directory(pathname);
-		if (0 == create_directory(dir, DEFAULT_DIRECTORY_MODE)) {
-			fd = file_create(pathname, accmode, TTH_FILE_MODE);
+	buf = halloc(len);
+	memcpy(buf, tth, TTH_RAW_SIZE);
+	poke_be32(&buf[24], n);
+	poke_be32(&buf[28], TTH_REC_F_LIVE);
+	memcpy(&buf[TTH_REC_HDRLEN], leaves, n * TTH_RAW_SIZE);
+	w = compat_pwrite(s->fd, buf, len, s->size);
+	hfree(buf);
+
+	if G_UNLIKELY(UNSIGNED(w) != len) {
+		if (-1 == w) {
+			g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
+		} else {
+			g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
 		}
-		HFREE_NULL(dir);
+		if (-1 == ftruncate(s->fd, s->size))
+			g_warning("%s(): cannot truncate: %m", G_STRFUNC);
+		return FALSE;
 	}
 
-	TTH_PATH_UNLOCK;
+	slot = hikset_lookup(s->index, tth);
+	if (slot != NULL)
+		tth_shard_kill(s, slot);
+
+	tth_shard_index_add(s, tth, s->size, n, fresh);
+	s->size += len;
+
+	return TRUE;
+}
+
+/**
+ * Remove entry from the shard, if present.
+ */
+static void
+tth_shard_remove(struct tth_shard *s, const struct tth *tth)
+{
+	struct tth_slot *slot = hikset_lookup(s->index, tth);
 
-	HFREE_NULL(pathname);
-	return fd;
+	if (slot != NULL) {
+		tth_shard_kill(s, slot);
+		hikset_remove(s->index, tth);
+		tth_slot_free(slot);
+	}
 }
 
-static int
-tth_cache_file_open(const struct tth *tth)
+/**
+ * Import the legacy cache file for the given root hash, removing it.
+ *
+ * @return the new index slot, NULL if there was no valid legacy entry.
+ */
+static struct tth_slot *
+tth_cache_legacy_import(const struct tth *tth)
 {
-	char *pathname;
+	struct tth *leaves;
+	struct tth_shard *s = tth_cache_shard(tth);
+	char *path;
 	int fd;
+	ssize_t r;
+	size_t n;
+
+	path = tth_cache_legacy_pathname(tth);
+	fd = file_open_missing(path, O_RDONLY);
+
+	if (!is_valid_fd(fd)) {
+		HFREE_NULL(path);
+		return NULL;
+	}
 
-	g_return_val_if_fail(tth, -1);
+	HALLOC_ARRAY(leaves, TTH_MAX_LEAVES);
+	r = read(fd, leaves, TTH_MAX_LEAVES * sizeof leaves[0]);
+	fd_forget_and_close(&fd);
+
+	if (-1 == r || 0 != r % TTH_RAW_SIZE)
+		goto done;
+
+	n = r / TTH_RAW_SIZE;
+
+	if (tth_leaves_valid(n)) {
+		struct tth root = tt_root_hash(leaves, n);
+		if (tth_eq(tth, &root))
+			tth_shard_append(s, tth, leaves, n, FALSE);
+	}
+
+	/* FALL THROUGH */
 
-	pathname = tth_cache_pathname(tth);
-	fd = file_open_missing(pathname, O_RDONLY);
-	HFREE_NULL(pathname);
-	return fd;
+done:
+	if (-1 == unlink(path)) {
+		g_warning("%s(): cannot remove legacy TTH cache entry %s: %m",
+			G_STRFUNC, path);
+	}
+	HFREE_NULL(leaves);
+	HFREE_NULL(path);
+	return hikset_lookup(s->index, tth);
 }
 
-static bool
-tth_cache_file_exists(const struct tth *tth)
+/**
+ * Lookup index slot for the given root hash, importing any legacy entry.
+ *
+ * @attention
+ * Must be called with the lock held.
+ */
+static struct tth_slot *
+tth_cache_slot(const struct tth *tth)
 {
-	bool ret;
-	char *pathname;
+	struct tth_slot *slot;
+
+	if G_UNLIKELY(!tth_cache_inited)
+		return NULL;
 
-	g_return_val_if_fail(tth, FALSE);
+	slot = hikset_lookup(tth_cache_shard(tth)->index, tth);
 
-	pathname = tth_cache_pathname(tth);
-	ret = file_exists(pathname);
-	HFREE_NULL(pathname);
-	return ret;
+	if (NULL == slot && tth_cache_legacy)
+		slot = tth_cache_legacy_import(tth);
+
+	return slot;
 }
 
 void
 tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 {
-	int fd;
-
 	g_return_if_fail(tth);
 	g_return_if_fail(leaves);
 	g_return_if_fail(n_leaves >= 1);
+	g_return_if_fail(n_leaves <= TTH_MAX_LEAVES);
 
 	{
 		struct tth root;
@@ -198,45 +577,10 @@ tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 	if (1 == n_leaves)
 		return;
 
-	fd = tth_cache_file_create(tth);
-	if (fd >= 0) {
-		size_t size;
-		ssize_t ret;
-
-		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
-
-		size = TTH_RAW_SIZE * n_leaves;
-		ret = write(fd, leaves, size);
-		if ((ssize_t) -1 == ret) {
-			g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else if ((size_t) ret != size) {
-			g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
-		}
-		fd_forget_and_close(&fd);
-	}
-}
-
-static size_t
-tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
-{
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(sb, 0);
-
-	if (!S_ISREG(sb->st_mode)) {
-		g_warning("%s(%s): not a regular file", G_STRFUNC, tth_base32(tth));
-		return 0;
-	}
-	if (
-		sb->st_size % TTH_RAW_SIZE ||
-		sb->st_size < TTH_RAW_SIZE ||
-		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
-	) {
-		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
-			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
-		return 0;
-	}
-
-	return sb->st_size / TTH_RAW_SIZE;
+	TTH_CACHE_LOCK;
+	if (tth_cache_inited)
+		tth_shard_append(tth_cache_shard(tth), tth, leaves, n_leaves, TRUE);
+	TTH_CACHE_UNLOCK;
 }
 
 /**
@@ -251,20 +595,12 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 
 	expected = tt_good_node_count(filesize);
 	if (expected > 1) {
-		filestat_t sb;
-		char *pathname;
-
-		pathname = tth_cache_pathname(tth);
-		if (stat(pathname, &sb)) {
-			leave_count = 0;
-			if (ENOENT != errno) {
-				g_warning("%s(%s): stat(\"%s\") failed: %m",
-					G_STRFUNC, tth_base32(tth), pathname);
-			}
-		} else {
-			leave_count = tth_cache_leave_count(tth, &sb);
-		}
-		HFREE_NULL(pathname);
+		const struct tth_slot *slot;
+
+		TTH_CACHE_LOCK;
+		slot = tth_cache_slot(tth);
+		leave_count = NULL == slot ? 0 : slot->leaves;
+		TTH_CACHE_UNLOCK;
 	} else {
 		leave_count = 1;
 	}
@@ -274,50 +610,46 @@ tth_cache_lookup(const struct tth *tth, filesize_t filesize)
 void
 tth_cache_remove(const struct tth *tth)
 {
-	char *pathname;
-
 	g_return_if_fail(tth);
 
-	pathname = tth_cache_pathname(tth);
-	unlink(pathname);
-	HFREE_NULL(pathname);
+	TTH_CACHE_LOCK;
+	if (tth_cache_inited)
+		tth_shard_remove(tth_cache_shard(tth), tth);
+	TTH_CACHE_UNLOCK;
 }
 
 static size_t
 tth_cache_get_leaves(const struct tth *tth,
 	struct tth leaves[TTH_MAX_LEAVES], size_t n)
 {
-	int fd, num_leaves = 0;
+	const struct tth_slot *slot;
+	size_t num_leaves = 0;
 
 	g_return_val_if_fail(tth, 0);
 	g_return_val_if_fail(leaves, 0);
 
-	fd = tth_cache_file_open(tth);
-	if (fd >= 0) {
-		filestat_t sb;
+	TTH_CACHE_LOCK;
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			size_t n_leaves;
+	slot = tth_cache_slot(tth);
+
+	if (slot != NULL) {
+		struct tth_shard *s = tth_cache_shard(tth);
+		size_t n_leaves = MIN(n, slot->leaves);
+		const char *p;
 
-			n_leaves = tth_cache_leave_count(tth, &sb);
-			n_leaves = MIN(n, n_leaves);
-			if (n_leaves > 0) {
-				size_t size;
-				ssize_t ret;
+		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
 
-				STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+		p = tth_shard_data(s, slot->offset, tth_rec_len(n_leaves));
 
-				size = TTH_RAW_SIZE * n_leaves;
-				ret = read(fd, &leaves[0].data, size);
-				if ((size_t) ret == size) {
-					num_leaves = n_leaves;
-				}
-			}
+		if (p != NULL && tth_eq(p, tth)) {
+			memcpy(&leaves[0].data, &p[TTH_REC_HDRLEN],
+				n_leaves * TTH_RAW_SIZE);
+			num_leaves = n_leaves;
 		}
-		fd_forget_and_close(&fd);
 	}
+
+	TTH_CACHE_UNLOCK;
+
 	return num_leaves;
 }
 
@@ -364,7 +696,7 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 		}
 	}
 
-	if (tth_cache_file_exists(tth)) {
+	if (tth_cache_get_nleaves(tth) != 0) {
 		g_warning("%s(): removing corrupted tigertree for %s",
 			G_STRFUNC, tth_base32(tth));
 		tth_cache_remove(tth);
@@ -382,26 +714,369 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 size_t
 tth_cache_get_nleaves(const struct tth *tth)
 {
-	int fd;
-	filesize_t nleaves = 0;
+	const struct tth_slot *slot;
+	size_t nleaves;
 
 	g_return_val_if_fail(tth != NULL, 0);
 
-	fd = tth_cache_file_open(tth);
+	TTH_CACHE_LOCK;
+	slot = tth_cache_slot(tth);
+	nleaves = NULL == slot ? 0 : slot->leaves;
+	TTH_CACHE_UNLOCK;
+
+	return nleaves;
+}
+
+struct tth_index_context {
+	struct tth_shard *s;
+	FILE *f;
+	fileoffset_t offset;
+	bool error;
+};
+
+/**
+ * Save one index slot.
+ */
+static void
+tth_shard_index_write_slot(void *value, void *data)
+{
+	const struct tth_slot *slot = value;
+	struct tth_index_context *ctx = data;
+	char rec[TTH_IDX_RECLEN];
+
+	memcpy(rec, slot->root, TTH_RAW_SIZE);
+	poke_be64(&rec[24], slot->offset);
+	poke_be32(&rec[32], slot->leaves);
+
+	if (!ctx->error && 1 != fwrite(ARYLEN(rec), 1, ctx->f))
+		ctx->error = TRUE;
+}
+
+/**
+ * Save the shard index when it changed.
+ *
+ * The index records the segment generation and the length of the segment
+ * it covers: records appended afterwards are scanned at load time.
+ */
+static void
+tth_shard_index_write(struct tth_shard *s)
+{
+	struct tth_index_context ctx;
+	char hdr[TTH_IDX_HDRLEN];
+	file_path_t fp;
+	char *name;
+
+	if (!s->dirty || 0 == s->size)
+		return;
+
+	name = tth_shard_name(s, "index");
+	file_path_set(&fp, tth_cache_directory(), name);
+	ctx.f = file_config_open_write("TTH cache index", &fp);
+
+	if (ctx.f != NULL) {
+		memcpy(hdr, TTH_IDX_MAGIC, 8);
+		poke_be32(&hdr[8], TTH_SEG_VERSION);
+		poke_be32(&hdr[12], tth_shard_number(s));
+		poke_be64(&hdr[16], s->generation);
+		poke_be64(&hdr[24], s->size);
+
+		ctx.s = s;
+		ctx.error = 1 != fwrite(ARYLEN(hdr), 1, ctx.f);
+		hikset_foreach(s->index, tth_shard_index_write_slot, &ctx);
+
+		if (ctx.error) {
+			g_warning("%s(): cannot write %s: %m", G_STRFUNC, name);
+			fclose(ctx.f);
+		} else if (file_config_close(ctx.f, &fp)) {
+			s->dirty = FALSE;
+		}
+	}
+
+	HFREE_NULL(name);
+}
+
+/**
+ * Load the shard index.
+ *
+ * @return the length of the segment covered by the index, the segment
+ * header length if there is no usable index.
+ */
+static fileoffset_t G_COLD
+tth_shard_index_load(struct tth_shard *s, fileoffset_t size)
+{
+	char *path;
+	char *buf = NULL;
+	int fd;
+	filestat_t sb;
+	fileoffset_t covered = TTH_SEG_HDRLEN, live = 0;
+	size_t i, n;
+
+	path = tth_shard_pathname(s, "index");
+	fd = file_open_missing(path, O_RDONLY);
+
+	if (!is_valid_fd(fd))
+		goto done;
+
+	if (
+		-1 == fstat(fd, &sb) || sb.st_size < TTH_IDX_HDRLEN ||
+		0 != (sb.st_size - TTH_IDX_HDRLEN) % TTH_IDX_RECLEN ||
+		sb.st_size > MAX_INT_VAL(ssize_t)
+	)
+		goto done;
+
+	buf = halloc(sb.st_size);
+
+	if (sb.st_size != read(fd, buf, sb.st_size))
+		goto done;
+
+	if (
+		0 != memcmp(buf, TTH_IDX_MAGIC, 8) ||
+		TTH_SEG_VERSION != peek_be32(&buf[8]) ||
+		tth_shard_number(s) != peek_be32(&buf[12]) ||
+		s->generation != peek_be64(&buf[16]) ||
+		(fileoffset_t) peek_be64(&buf[24]) > size
+	)
+		goto done;
+
+	n = (sb.st_size - TTH_IDX_HDRLEN) / TTH_IDX_RECLEN;
+
+	for (i = 0; i < n; i++) {
+		const char *rec = &buf[TTH_IDX_HDRLEN + i * TTH_IDX_RECLEN];
+		fileoffset_t offset = peek_be64(&rec[24]);
+		size_t leaves = peek_be32(&rec[32]);
+
+		if (
+			!tth_leaves_valid(leaves) || offset < TTH_SEG_HDRLEN ||
+			offset + (fileoffset_t) tth_rec_len(leaves) > size
+		)
+			continue;
+
+		tth_shard_index_add(s, (const struct tth *) rec, offset, leaves, FALSE);
+		live += tth_rec_len(leaves);
+	}
+
+	covered = peek_be64(&buf[24]);
+	s->dead = covered > TTH_SEG_HDRLEN + live ?
+		covered - TTH_SEG_HDRLEN - live : 0;
+	s->dirty = FALSE;		/* Index matches the saved one */
+
+	/* FALL THROUGH */
+
+done:
+	fd_close(&fd);
+	HFREE_NULL(buf);
+	HFREE_NULL(path);
+	return covered;
+}
+
+/**
+ * Load a shard: its index, then any record appended to the segment since
+ * the index was saved.
+ */
+static void G_COLD
+tth_shard_load(struct tth_shard *s)
+{
+	char *path;
+	char hdr[TTH_SEG_HDRLEN];
+	filestat_t sb;
+	fileoffset_t offset;
+
+	s->index = hikset_create(
+		offsetof(struct tth_slot, root), HASH_KEY_FIXED, TTH_RAW_SIZE);
+	s->fd = -1;
+
+	path = tth_shard_pathname(s, "segment");
+	s->fd = file_open_missing(path, O_RDWR);
+
+	if (!is_valid_fd(s->fd))
+		goto done;
+
+	if (-1 == fstat(s->fd, &sb)) {
+		g_warning("%s(): cannot stat %s: %m", G_STRFUNC, path);
+		goto reset;
+	}
+
+	if (
+		sb.st_size < TTH_SEG_HDRLEN ||
+		TTH_SEG_HDRLEN != compat_pread(s->fd, ARYLEN(hdr), 0) ||
+		0 != memcmp(hdr, TTH_SEG_MAGIC, 8) ||
+		TTH_SEG_VERSION != peek_be32(&hdr[8]) ||
+		tth_shard_number(s) != peek_be32(&hdr[12])
+	) {
+		g_warning("%s(): discarding invalid %s", G_STRFUNC, path);
+		goto reset;
+	}
 
-	if (fd >= 0) {
-		filestat_t sb;
+	s->generation = peek_be64(&hdr[16]);
+	offset = tth_shard_index_load(s, sb.st_size);
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
+	while (offset + TTH_REC_HDRLEN <= sb.st_size) {
+		char rec[TTH_REC_HDRLEN];
+		size_t leaves, len;
+
+		if (TTH_REC_HDRLEN != compat_pread(s->fd, ARYLEN(rec), offset))
+			break;
+
+		leaves = peek_be32(&rec[24]);
+		len = tth_rec_len(leaves);
+
+		if (
+			!tth_leaves_valid(leaves) ||
+			offset + (fileoffset_t) len > sb.st_size
+		)
+			break;
+
+		if (TTH_REC_F_LIVE & peek_be32(&rec[28])) {
+			struct tth_slot *slot = hikset_lookup(s->index, rec);
+			if (slot != NULL)
+				s->dead += tth_rec_len(slot->leaves);
+			tth_shard_index_add(s, (const struct tth *) rec, offset, leaves,
+				FALSE);
 		} else {
-			nleaves = tth_cache_leave_count(tth, &sb);
+			s->dead += len;
 		}
 
-		fd_forget_and_close(&fd);
+		s->dirty = TRUE;
+		offset += len;
 	}
 
-	return nleaves;
+	if (offset != sb.st_size) {
+		g_warning("%s(): discarding last %s bytes of %s", G_STRFUNC,
+			fileoffset_t_to_string(sb.st_size - offset), path);
+		if (-1 == ftruncate(s->fd, offset))
+			g_warning("%s(): cannot truncate %s: %m", G_STRFUNC, path);
+	}
+
+	s->size = offset;
+	goto done;
+
+reset:
+	fd_close(&s->fd);
+	s->size = 0;		/* Segment will be recreated when needed */
+
+	/* FALL THROUGH */
+
+done:
+	HFREE_NULL(path);
+}
+
+struct tth_compact_context {
+	struct tth_shard *s;
+	int fd;
+	fileoffset_t offset;
+	bool error;
+};
+
+/**
+ * Copy one live record to the compacted segment.
+ */
+static void
+tth_shard_compact_copy(void *value, void *data)
+{
+	const struct tth_slot *slot = value;
+	struct tth_compact_context *ctx = data;
+	size_t len = tth_rec_len(slot->leaves);
+	const char *p;
+
+	if (ctx->error)
+		return;
+
+	p = tth_shard_data(ctx->s, slot->offset, len);
+
+	if (
+		NULL == p ||
+		UNSIGNED(compat_pwrite(ctx->fd, p, len, ctx->offset)) != len
+	) {
+		ctx->error = TRUE;
+		return;
+	}
+
+	ctx->offset += len;
+}
+
+/**
+ * Record the offset of the slot in the compacted segment.
+ *
+ * Slots are traversed in the same order as by tth_shard_compact_copy()
+ * since the index was not modified in-between.
+ */
+static void
+tth_shard_compact_rebase(void *value, void *data)
+{
+	struct tth_slot *slot = value;
+	struct tth_compact_context *ctx = data;
+
+	slot->offset = ctx->offset;
+	ctx->offset += tth_rec_len(slot->leaves);
+}
+
+/**
+ * Rewrite the segment without its dead records when they hold more room
+ * than the live ones.
+ *
+ * @attention
+ * Must be called with the lock held.
+ */
+static void
+tth_shard_compact(struct tth_shard *s)
+{
+	struct tth_compact_context ctx;
+	char hdr[TTH_SEG_HDRLEN];
+	char *path, *path_new;
+
+	if (s->dead < TTH_COMPACT_MIN || s->dead < s->size - s->dead)
+		return;
+
+	path = tth_shard_pathname(s, "segment");
+	path_new = h_strconcat(path, ".new", NULL_PTR);
+
+	ctx.s = s;
+	ctx.fd = file_create(path_new, O_RDWR | O_TRUNC, TTH_FILE_MODE);
+	ctx.offset = TTH_SEG_HDRLEN;
+	ctx.error = FALSE;
+
+	if (!is_valid_fd(ctx.fd))
+		goto done;
+
+	tth_shard_header_fill(s, hdr, s->generation + 1);
+
+	if (TTH_SEG_HDRLEN != compat_pwrite(ctx.fd, ARYLEN(hdr), 0))
+		ctx.error = TRUE;
+
+	hikset_foreach(s->index, tth_shard_compact_copy, &ctx);
+
+	if (ctx.error || -1 == fd_fsync(ctx.fd) || -1 == rename(path_new, path)) {
+		g_warning("%s(): cannot compact %s: %m", G_STRFUNC, path);
+		fd_close(&ctx.fd);
+		if (-1 == unlink(path_new) && ENOENT != errno)
+			g_warning("%s(): cannot remove %s: %m", G_STRFUNC, path_new);
+		goto done;
+	}
+
+	if (debugging(0)) {
+		g_debug("%s(): compacted %s, reclaimed %s bytes", G_STRFUNC,
+			path, fileoffset_t_to_string(s->size - ctx.offset));
+	}
+
+	tth_shard_unmap(s);
+	fd_close(&s->fd);
+	s->fd = ctx.fd;
+	s->size = ctx.offset;
+	s->dead = 0;
+	s->generation++;
+	s->dirty = TRUE;
+
+	ctx.offset = TTH_SEG_HDRLEN;
+	hikset_foreach(s->index, tth_shard_compact_rebase, &ctx);
+	g_assert(ctx.offset == s->size);
+
+	tth_shard_index_write(s);
+
+	/* FALL THROUGH */
+
+done:
+	HFREE_NULL(path);
+	HFREE_NULL(path_new);
 }
 
 /**
@@ -414,27 +1089,12 @@ tth_cache_dir_rmdir(const char *path)
 	if (debugging(0))
 		g_message("%s(): removing TTH cache directory %s", G_STRFUNC, path);
 
-	/*
-	 * To avoid any conflicts with another thread attempting to create a
-	 * file under that directory, take a lock.
-	 *
-	 * Note that there is a race condition between the traversal that detects
-	 * the directory is empty and the time we actually attempt to remove it.
-	 * Hence, we silence any error having to deal with the directory being
-	 * non-empty and therefore non-removable.
-	 */
-
-	TTH_PATH_LOCK;
-
 	if (-1 == rmdir(path) && ENOTEMPTY != errno) {
 		g_warning("%s(): cannot remove TTH cache directory %s: %m",
 			G_STRFUNC, path);
 	}
-
-	TTH_PATH_UNLOCK;
 }
 
-
 /**
  * ftw_foreach() callback to remove empty directories.
  */
@@ -451,7 +1111,7 @@ tth_cache_cleanup_rmdir(
 			tth_cache_dir_rmdir(info->fpath);	/* Try, we can't read it */
 		} else if (FTW_F_DONE & info->flags) {
 			void *cnt = (*dirsp)->data;
-			if (NULL == cnt && 0 != info->level)
+			if (NULL == cnt)
 				tth_cache_dir_rmdir(info->fpath);
 			*dirsp = pslist_delete_link(*dirsp, *dirsp);	/* Strip head */
 		} else {
@@ -493,14 +1153,17 @@ tth_cache_file_remove(const char *path, const char *reason)
 }
 
 /**
- * ftw_foreach() callback to remove obsolete / spurious files.
+ * ftw_foreach() callback to convert legacy entries, importing the shared
+ * ones and removing all the files.
  */
 static ftw_status_t
-tth_cache_cleanup_unlink(
-	const ftw_info_t *info, const filestat_t *sb, void *data)
+tth_cache_cleanup_import(
+	const ftw_info_t *info, const filestat_t *unused_sb, void *data)
 {
 	const hset_t *shared = data;
 
+	(void) unused_sb;
+
 	if (FTW_F_DIR & info->flags)
 		return FTW_STATUS_OK;
 
@@ -541,36 +1204,22 @@ tth_cache_cleanup_unlink(
 			TTH_RAW_SIZE != base32_decode(VARLEN(tth), b32, TTH_BASE32_SIZE)
 		) {
 			tth_cache_file_remove(info->fpath, "invalid");
-			goto done;
-		}
-
-		/*
-		 * At this point, we have a valid TTH cache filename.
-		 *
-		 * We want to only process files created before the session started.
-		 *
-		 * The rationale is that users could start unsharing directories,
-		 * moving files around, add new files, etc..  Each time a new library
-		 * rescan occurs, we're going to create new TTH cache files, or some
-		 * cached files could become unused for a while and then files will
-		 * reappear in the library.
-		 *
-		 * By only ever cleaning up files created before the current session,
-		 * we have a higher likelyhood of processing an obsolete cache entry.
-		 */
-
-		if (delta_time(sb->st_mtime, GNET_PROPERTY(session_start_stamp)) >= 0)
-			goto done;		/* Created after session started, skip */
-
-		if (!hset_contains(shared, &tth)) {
-			if (debugging(0))
-				g_debug("%s(): unshared TTH (%s)", G_STRFUNC, info->rpath);
+		} else if (hset_contains(shared, &tth)) {
+			struct tth_shard *s = tth_cache_shard(&tth);
+
+			TTH_CACHE_LOCK;
+			if (!tth_cache_inited) {
+				/* Shutting down, leave it alone */
+			} else if (NULL == hikset_lookup(s->index, &tth)) {
+				(void) tth_cache_legacy_import(&tth);	/* Removes file */
+			} else {
+				(void) tth_cache_file_unlink(info->fpath, "duplicate");
+			}
+			TTH_CACHE_UNLOCK;
+		} else {
 			(void) tth_cache_file_unlink(info->fpath, "unshared");
 		}
 
-		/* FALL THROUGH */
-
-	done:
 		g_strfreev(path);
 		return FTW_STATUS_OK;
 	}
@@ -579,54 +1228,127 @@ tth_cache_cleanup_unlink(
 	return FTW_STATUS_ERROR;
 }
 
-static int tth_cache_cleanups;
-
 /**
- * Main entry point for the thread that cleans up the TTH cache.
+ * Convert the legacy tree, then remove it.
  */
-static void *
-tth_cache_cleanup_thread(void *unused_arg)
+static void
+tth_cache_cleanup_legacy(const hset_t *shared)
 {
-	hset_t *shared;
-	const char *rootdir = tth_cache_directory();
+	const char *rootdir = tth_cache_legacy_directory();
 	pslist_t *dirstack;
 	uint32 flags;
 	ftw_status_t res;
 
-	(void) unused_arg;
-
 	if (!is_directory(rootdir))
-		goto done;			/* No TTH cache */
-
-	/*
-	 * First pass: spot all file entries that are older than our start
-	 * time (i.e. were created in another session) and which cannot be
-	 * associated with a shared file.
-	 */
+		goto done;
 
-	shared = share_tthset_get();
 	flags = FTW_O_PHYS | FTW_O_MOUNT | FTW_O_ALL;
-	res = ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_unlink, shared);
-	share_tthset_free(shared);
+	res = ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_import,
+			deconstify_pointer(shared));
 
 	if (res != FTW_STATUS_OK) {
-		g_warning("%s(): initial traversal failed with %d, aborting",
-			G_STRFUNC, res);
-		goto done;
+		g_warning("%s(): legacy traversal failed with %d", G_STRFUNC, res);
+		return;
 	}
 
-	/*
-	 * Second pass: spot empty directories and remove them.
-	 */
-
 	flags |= FTW_O_ENTRY | FTW_O_DEPTH;
 	dirstack = NULL;
 	(void) ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_rmdir, &dirstack);
 	pslist_free(dirstack);
 
+	if (is_directory(rootdir))
+		return;
+
+	g_info("converted legacy TTH cache");
+
 	/* FALL THROUGH */
 
 done:
+	TTH_CACHE_LOCK;
+	tth_cache_legacy = FALSE;
+	TTH_CACHE_UNLOCK;
+}
+
+struct tth_cleanup_context {
+	struct tth_shard *s;
+	const hset_t *shared;
+};
+
+/**
+ * hikset_foreach_remove() callback to drop entries that are no longer shared.
+ *
+ * We only process entries stored before the session started.
+ *
+ * The rationale is that users could start unsharing directories, moving
+ * files around, add new files, etc..  Each time a new library rescan
+ * occurs, we're going to store new TTH entries, or some cached entries
+ * could become unused for a while and then files will reappear in the
+ * library.
+ *
+ * By only ever cleaning up entries stored before the current session,
+ * we have a higher likelyhood of processing an obsolete cache entry.
+ *
+ * @return TRUE if the slot was freed and must be removed from the index.
+ */
+static bool
+tth_cache_cleanup_slot(void *value, void *data)
+{
+	struct tth_slot *slot = value;
+	struct tth_cleanup_context *ctx = data;
+
+	if (slot->fresh || hset_contains(ctx->shared, slot->root))
+		return FALSE;
+
+	if (debugging(0))
+		g_debug("%s(): unshared TTH %s", G_STRFUNC, tth_base32(slot->root));
+
+	tth_shard_kill(ctx->s, slot);
+	tth_slot_free(slot);
+	return TRUE;
+}
+
+static int tth_cache_cleanups;
+
+/**
+ * Main entry point for the thread that cleans up the TTH cache.
+ */
+static void *
+tth_cache_cleanup_thread(void *unused_arg)
+{
+	struct tth_cleanup_context ctx;
+	hset_t *shared;
+	size_t i, removed = 0;
+
+	(void) unused_arg;
+
+	shared = share_tthset_get();
+	ctx.shared = shared;
+
+	tth_cache_cleanup_legacy(shared);
+
+	/*
+	 * Each shard is processed in its own critical section, so as to not
+	 * hold the lock for too long.
+	 */
+
+	for (i = 0; i < N_ITEMS(tth_shard); i++) {
+		TTH_CACHE_LOCK;
+		if (tth_cache_inited) {
+			ctx.s = &tth_shard[i];
+			removed += hikset_foreach_remove(ctx.s->index,
+				tth_cache_cleanup_slot, &ctx);
+			tth_shard_compact(ctx.s);
+		}
+		TTH_CACHE_UNLOCK;
+	}
+
+	share_tthset_free(shared);
+
+	if (debugging(0)) {
+		g_debug("%s(): removed %zu unshared TTH entr%s",
+			G_STRFUNC, removed, plural_y(removed));
+	}
+
 	atomic_int_dec(&tth_cache_cleanups);
 	return NULL;
 }
@@ -648,16 +1370,55 @@ tth_cache_cleanup(void)
 	}
 }
 
-void
+void G_COLD
 tth_cache_init(void)
 {
-	/* NOTHING */
+	size_t i;
+
+	TTH_CACHE_LOCK;
+
+	for (i = 0; i < N_ITEMS(tth_shard); i++) {
+		tth_shard_load(&tth_shard[i]);
+	}
+
+	tth_cache_legacy = is_directory(tth_cache_legacy_directory());
+	tth_cache_inited = TRUE;
+
+	TTH_CACHE_UNLOCK;
 }
 
-void
+/**
+ * Free index slot, hikset_foreach() callback.
+ */
+static void
+tth_slot_free_cb(void *value, void *unused_data)
+{
+	(void) unused_data;
+
+	tth_slot_free(value);
+}
+
+void G_COLD
 tth_cache_close(void)
 {
-	/* NOTHING */
+	size_t i;
+
+	TTH_CACHE_LOCK;
+
+	if (tth_cache_inited) {
+		for (i = 0; i < N_ITEMS(tth_shard); i++) {
+			struct tth_shard *s = &tth_shard[i];
+
+			tth_shard_index_write(s);
+			tth_shard_unmap(s);
+			fd_close(&s->fd);
+			hikset_foreach(s->index, tth_slot_free_cb, NULL);
+			hikset_free_null(&s->index);
+		}
+		tth_cache_inited = FALSE;
+	}
+
+	TTH_CACHE_UNLOCK;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
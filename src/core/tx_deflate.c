@@ -41,6 +41,7 @@
 #include "tx_deflate.h"
 #include "hosts.h"
 #include "sockets.h"
+#include "zdict.h"
 
 #include "if/gnet_property_priv.h"
 
@@ -68,6 +69,7 @@
 #define BUFFER_COUNT	2
 #define BUFFER_NAGLE	500		/**< 500 ms */
 #define BUFFER_DELAY	2		/**< 2 secs -- max Nagle delay */
+#define LEVEL_DELAY		1		/**< 1 sec -- min level change period */
 
 struct buffer {
 	char *arena;				/**< Buffer arena */
@@ -100,6 +102,10 @@ struct attr {
 	tx_closed_t closed;			/**< Callback to invoke when layer closed */
 	void *closed_arg;			/**< Argument for closing routine */
 	time_t nagle_start;			/**< When we started the Nagle timer */
+	time_t level_change;		/**< When compression level was last changed */
+	int level;					/**< Current compression level */
+	int level_max;				/**< Configured compression level */
+	int strategy;				/**< Current compression strategy */
 	struct {
 		bool		enabled;	/**< Whether to use gzip encapsulation */
 		uint32		size;		/**< Payload size counter for gzip */
@@ -335,6 +341,98 @@ deflate_set_flowc(txdrv_t *tx, bool on)
 		attr->cb->flow_control(tx->owner, on ? deflate_buffered(tx) : 0);
 }
 
+/**
+ * Adapt compression level to the current conditions, once all the pending
+ * data were flushed.
+ *
+ * When the CPU is overloaded, we favour speed over compression.  Otherwise,
+ * we gradually go back to the configured level, immediately when the link
+ * cannot keep up with the data we produce, since bandwidth is then what
+ * we need to save.
+ */
+static void
+deflate_adapt(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz = attr->outz;
+	struct buffer *b;
+	int level, strategy, ret, old_avail;
+
+	if (tx->flags & TX_CLOSING)
+		return;
+
+	strategy = Z_DEFAULT_STRATEGY;
+
+	if (GNET_PROPERTY(overloaded_cpu)) {
+		level = Z_BEST_SPEED;
+#ifdef Z_RLE
+		/*
+		 * If the CPU remains overloaded once we compress at the fastest
+		 * level, only look for runs of repeated bytes: this is much cheaper
+		 * than searching the window for matches, and the output remains a
+		 * plain deflate stream that any peer can inflate.
+		 */
+
+		if (Z_BEST_SPEED == attr->level)
+			strategy = Z_RLE;
+#endif	/* Z_RLE */
+	} else if (attr->send_idx >= 0 || (attr->flags & DF_FLOWC))
+		level = attr->level_max;			/* Bandwidth-starved */
+	else
+		level = MIN(attr->level + 1, attr->level_max);
+
+	if (level == attr->level && strategy == attr->strategy)
+		return;
+
+	if (delta_time(tm_time(), attr->level_change) < LEVEL_DELAY)
+		return;
+
+	b = &attr->buf[attr->fill_idx];		/* Buffer we fill */
+
+	if (b->wptr == b->end)
+		return;			/* Wait for next flush, may need to emit a block */
+
+	/*
+	 * Changing the compression parameters can flush the current block.
+	 */
+
+	outz->next_out = cast_to_pointer(b->wptr);
+	outz->avail_out = old_avail = b->end - b->wptr;
+	outz->avail_in = 0;
+
+	ret = deflateParams(outz, level, strategy);
+
+	{
+		size_t written = old_avail - outz->avail_out;
+
+		b->wptr += written;
+		attr->total_output += written;
+
+		if (0 != written && NULL != attr->cb->add_tx_deflated)
+			attr->cb->add_tx_deflated(tx->owner, written);
+	}
+
+	if (Z_OK != ret) {
+		if (tx_deflate_debugging(0)) {
+			g_debug("TX %s: (%s) cannot change compression level to %d: %s",
+				G_STRFUNC, gnet_host_to_string(&tx->host), level,
+				zlib_strerror(ret));
+		}
+		return;
+	}
+
+	if (tx_deflate_debugging(1)) {
+		g_debug("TX %s: (%s) compression level %d -> %d%s%s",
+			G_STRFUNC, gnet_host_to_string(&tx->host), attr->level, level,
+			Z_DEFAULT_STRATEGY == strategy ? "" : " (RLE only)",
+			GNET_PROPERTY(overloaded_cpu) ? " (CPU overloaded)" : "");
+	}
+
+	attr->level = level;
+	attr->strategy = strategy;
+	attr->level_change = tm_time();
+}
+
 /**
  * Pending data were all flushed.
  */
@@ -375,6 +473,8 @@ deflate_flushed(txdrv_t *tx)
 done:
 	attr->unflushed = attr->flushed = 0;
 	attr->flags &= ~DF_FLUSH;
+
+	deflate_adapt(tx);
 }
 
 /**
@@ -541,6 +641,237 @@ deflate_nagle_timeout(cqueue_t *cq, void *arg)
 	deflate_flush_send(tx);
 }
 
+/*
+ * Messages broadcasted to many compressed connections can be deflated once,
+ * the resulting output being spliced as-is into each connection stream.
+ *
+ * Since a deflate stream is byte-aligned and can refer to no prior data
+ * after a full flush, a standalone raw deflate output ending with a sync
+ * flush can be inserted in any stream just after a full flush.  The remote
+ * inflater adds the spliced data to its window, but our compressor never
+ * saw it and will therefore never refer to it: this is why the full flush
+ * is required before splicing, at the expense of losing the compression
+ * history of the connection.
+ *
+ * The standalone compression of a single message is also less efficient,
+ * hence this trades bandwidth for CPU and should only be used when the
+ * CPU is the bottleneck.
+ *
+ * Shared messages are recorded in a small ring: entries are looked up by
+ * the address of the message data, which is shared by all the clones of
+ * the broadcasted message, and their content is compared to make sure the
+ * data was not changed since.
+ */
+
+#define DEFLATE_SHARED_MAX	32		/**< Amount of shared messages kept */
+
+static struct deflate_shared {
+	const void *key;			/**< Start of message data */
+	void *raw;					/**< Copy of the raw message */
+	void *zdata;				/**< Standalone raw deflate output */
+	size_t len;					/**< Length of raw message */
+	size_t zlen;				/**< Length of deflated data */
+	uLong adler;				/**< Adler-32 of the raw message */
+} deflate_shared[DEFLATE_SHARED_MAX];
+
+static uint deflate_shared_next;	/**< Next slot to use in the ring */
+static uint deflate_shared_count;	/**< Amount of used slots */
+static z_streamp deflate_shared_z;	/**< Compressor for shared messages */
+
+static void
+deflate_shared_clear(struct deflate_shared *ds)
+{
+	if (ds->raw != NULL) {
+		wfree(ds->raw, ds->len);
+		wfree(ds->zdata, ds->zlen);
+		ZERO(ds);
+		deflate_shared_count--;
+	}
+}
+
+/**
+ * Look for the shared deflated form of a message.
+ *
+ * @return the shared entry if found, NULL otherwise.
+ */
+static const struct deflate_shared *
+deflate_shared_lookup(const void *data, size_t len)
+{
+	uint i;
+
+	for (i = 0; i < DEFLATE_SHARED_MAX; i++) {
+		const struct deflate_shared *ds = &deflate_shared[i];
+
+		if (ds->key == data && ds->len == len)
+			return 0 == memcmp(ds->raw, data, len) ? ds : NULL;
+	}
+
+	return NULL;
+}
+
+/**
+ * Deflate message once, on behalf of all the compressed connections to which
+ * it is going to be broadcasted.
+ *
+ * The message data must be the same buffer that will be written to the
+ * connections, i.e. the one shared by all the message clones.
+ *
+ * @param data		start of the message data, as it will be written
+ * @param len		length of the message
+ */
+void
+tx_deflate_share(const void *data, size_t len)
+{
+	struct deflate_shared *ds;
+	char buf[2048];
+	int ret;
+
+	g_assert(data != NULL);
+
+	if G_UNLIKELY(NULL == deflate_shared_z) {
+		WALLOC0(deflate_shared_z);
+		deflate_shared_z->zalloc = zlib_alloc_func;
+		deflate_shared_z->zfree = zlib_free_func;
+
+		ret = deflateInit2(deflate_shared_z, Z_BEST_COMPRESSION, Z_DEFLATED,
+				-MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+
+		if (Z_OK != ret) {
+			g_warning("%s(): unable to initialize compressor: %s",
+				G_STRFUNC, zlib_strerror(ret));
+			WFREE_TYPE_NULL(deflate_shared_z);
+			return;
+		}
+	} else {
+		deflateReset(deflate_shared_z);
+	}
+
+	/*
+	 * Only messages whose deflated form fits in the stack buffer are shared,
+	 * since larger messages require several output buffers anyway.
+	 */
+
+	if (deflateBound(deflate_shared_z, len) + 16 > sizeof buf)
+		return;
+
+	deflate_shared_z->next_in = deconstify_pointer(data);
+	deflate_shared_z->avail_in = len;
+	deflate_shared_z->next_out = (void *) buf;
+	deflate_shared_z->avail_out = sizeof buf;
+
+	ret = deflate(deflate_shared_z, Z_SYNC_FLUSH);
+
+	if (Z_OK != ret || 0 != deflate_shared_z->avail_in) {
+		g_carp("%s(): deflate error: %s", G_STRFUNC, zlib_strerror(ret));
+		return;
+	}
+
+	ds = &deflate_shared[deflate_shared_next];
+	deflate_shared_next = (deflate_shared_next + 1) % DEFLATE_SHARED_MAX;
+	deflate_shared_clear(ds);
+
+	ds->key = data;
+	ds->len = len;
+	ds->raw = wcopy(data, len);
+	ds->zlen = sizeof buf - deflate_shared_z->avail_out;
+	ds->zdata = wcopy(buf, ds->zlen);
+	ds->adler = adler32(adler32(0, NULL, 0), data, len);
+	deflate_shared_count++;
+}
+
+/**
+ * Release all the shared deflated messages.
+ */
+void G_COLD
+tx_deflate_share_close(void)
+{
+	uint i;
+
+	for (i = 0; i < DEFLATE_SHARED_MAX; i++)
+		deflate_shared_clear(&deflate_shared[i]);
+
+	if (deflate_shared_z != NULL) {
+		deflateEnd(deflate_shared_z);
+		WFREE_TYPE_NULL(deflate_shared_z);
+	}
+}
+
+/**
+ * Splice pre-deflated message data into the stream, if the message was
+ * shared and there is enough room in the filling buffer.
+ *
+ * @return TRUE if data were spliced, FALSE if they must be compressed.
+ */
+static bool
+deflate_splice(txdrv_t *tx, const void *data, int len)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz = attr->outz;
+	const struct deflate_shared *ds;
+	struct buffer *b;
+	int ret, old_avail, written;
+
+	if (attr->gzip.enabled || (attr->flags & DF_FLUSH))
+		return FALSE;
+
+	ds = deflate_shared_lookup(data, len);
+
+	if (NULL == ds)
+		return FALSE;
+
+	b = &attr->buf[attr->fill_idx];		/* Buffer we fill */
+
+	if (UNSIGNED(b->end - b->wptr) <= ds->zlen)
+		return FALSE;
+
+	/*
+	 * Fully flush the stream, so that we restart on a byte boundary and
+	 * with no history.
+	 */
+
+	outz->next_out = cast_to_pointer(b->wptr);
+	outz->avail_out = old_avail = b->end - b->wptr;
+	outz->avail_in = 0;
+
+	ret = deflate(outz, Z_FULL_FLUSH);
+
+	if (Z_OK != ret && Z_BUF_ERROR != ret)
+		return FALSE;		/* Error will be reported on next deflate() */
+
+	written = old_avail - outz->avail_out;
+	b->wptr += written;
+	attr->flushed += written;
+
+	if (0 != written && NULL != attr->cb->add_tx_deflated)
+		attr->cb->add_tx_deflated(tx->owner, written);
+
+	if (0 == outz->avail_out || UNSIGNED(b->end - b->wptr) < ds->zlen)
+		return FALSE;		/* Lost history, but stream is still valid */
+
+	/*
+	 * Insert the pre-deflated data and account the raw data in the
+	 * checksum emitted in the zlib trailer when the stream is closed.
+	 */
+
+	b->wptr = mempcpy(b->wptr, ds->zdata, ds->zlen);
+	outz->adler = adler32_combine(outz->adler, ds->adler, ds->len);
+
+	attr->unflushed += len;
+	attr->flushed += ds->zlen;
+
+	if (NULL != attr->cb->add_tx_deflated)
+		attr->cb->add_tx_deflated(tx->owner, ds->zlen);
+
+	if (tx_deflate_debugging(9)) {
+		g_debug("TX %s: (%s) spliced %d bytes deflated into %zu "
+			"(buffer #%d, flushed %zu, unflushed %zu)",
+			G_STRFUNC, gnet_host_to_string(&tx->host),
+			len, ds->zlen, attr->fill_idx, attr->flushed, attr->unflushed);
+	}
+
+	return TRUE;
+}
+
 /**
  * Compress as much data as possible to the output buffer, sending data
  * as we go along.
@@ -572,6 +903,9 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 	if G_UNLIKELY(tx->flags & TX_ERROR)
 		return -1;
 
+	if G_UNLIKELY(0 != deflate_shared_count && deflate_splice(tx, data, len))
+		added = len;
+
 	while (added < len) {
 		struct buffer *b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
 		int ret;
@@ -826,7 +1160,7 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	struct attr *attr;
 	struct tx_deflate_args *targs = args;
 	z_streamp outz;
-	int ret;
+	int ret, initial_level;
 	int i;
 
 	g_assert(tx);
@@ -868,28 +1202,42 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	 * of compression).
 	 *
 	 *		--RAM, 2011-11-29
+	 *
+	 * When running in "low_memory" mode, we further shrink the windows:
+	 * window_bits = 12 and mem_level = 5 for reduced connections, which
+	 * makes 16 KiB + 16 KiB = 32 KiB, and window_bits = 13 and mem_level = 7
+	 * for full connections, i.e. 32 KiB + 64 KiB = 96 KiB.  Gnutella messages
+	 * are small and repetitions mostly occur between close messages, so the
+	 * compression ratio is only slightly degraded.
+	 *
+	 * The compression level is further adapted dynamically, see
+	 * deflate_adapt(), but the window size cannot be changed afterwards.
 	 */
 
 	{
-		int window_bits = MAX_WBITS;		/* Must be 8 .. MAX_WBITS */
+		int window_bits = MAX_WBITS;		/* Must be 9 .. MAX_WBITS */
 		int mem_level = MAX_MEM_LEVEL;		/* Must be 1 .. MAX_MEM_LEVEL */
 		int level = Z_BEST_COMPRESSION;
 
 		if (targs->reduced) {
 			/* Ultra -> Leaf connection */
-			window_bits = 14;
-			mem_level = 6;
-			level = Z_DEFAULT_COMPRESSION;
+			window_bits = targs->low_memory ? 12 : 14;
+			mem_level = targs->low_memory ? 5 : 6;
+			level = 6;						/* Z_DEFAULT_COMPRESSION */
+		} else if (targs->low_memory) {
+			window_bits = 13;
+			mem_level = 7;
 		}
 
-		g_assert(window_bits >= 8 && window_bits <= MAX_WBITS);
+		g_assert(window_bits >= 9 && window_bits <= MAX_WBITS);
 		g_assert(mem_level >= 1 && mem_level <= MAX_MEM_LEVEL);
-		g_assert(level == Z_DEFAULT_COMPRESSION ||
-			(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION));
+		g_assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
 
 		ret = deflateInit2(outz, level, Z_DEFLATED,
 				targs->gzip ? (-window_bits) : window_bits, mem_level,
 				Z_DEFAULT_STRATEGY);
+
+		initial_level = level;
 	}
 
 	if (Z_OK != ret) {
@@ -899,6 +1247,24 @@ tx_deflate_init(txdrv_t *tx, void *args)
 		return NULL;
 	}
 
+	/*
+	 * The preset dictionary is only meaningful for zlib streams, since it
+	 * is identified in the stream header, which gzip encapsulation lacks.
+	 */
+
+	if (targs->dictionary && !targs->gzip) {
+		const void *dict;
+		size_t len;
+
+		dict = zdict_get(&len);
+		ret = deflateSetDictionary(outz, dict, len);
+
+		if (Z_OK != ret) {
+			g_warning("unable to set compression dictionary for peer %s: %s",
+				gnet_host_to_string(&tx->host), zlib_strerror(ret));
+		}
+	}
+
 	WALLOC0(attr);
 	attr->cq = targs->cq;
 	attr->cb = targs->cb;
@@ -906,6 +1272,8 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	attr->buffer_flush = targs->buffer_flush;
 	attr->nagle = booleanize(targs->nagle);
 	attr->gzip.enabled = targs->gzip;
+	attr->level = attr->level_max = initial_level;
+	attr->strategy = Z_DEFAULT_STRATEGY;
 
 	attr->outz = outz;
 	attr->tm_ev = NULL;
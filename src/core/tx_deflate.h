@@ -41,6 +41,9 @@
 
 const struct txdrv_ops *tx_deflate_get_ops(void);
 
+void tx_deflate_share(const void *data, size_t len);
+void tx_deflate_share_close(void);
+
 /**
  * Callbacks used by the deflating layer.
  */
@@ -61,6 +64,8 @@ struct tx_deflate_args {
 	bool nagle;					/**< Whether to use Nagle or not */
 	bool gzip;					/**< Whether to use gzip encapsulation */
 	bool reduced;				/**< Whether to use reduced compression */
+	bool low_memory;			/**< Whether to use smaller windows */
+	bool dictionary;			/**< Whether to use the preset dictionary */
 };
 
 #endif	/* _core_tx_deflate_h_ */
@@ -156,6 +156,22 @@
  * in case each fragment is not immediately sent out), to leave about 20 seconds
  * to get the final acknowledgement back on the last re-transmission.
  *
+ * CONGESTION CONTROL
+ *
+ * For each remote host, we keep an estimate of the round-trip time, measured
+ * on fragments acknowledged after their first transmission only, and a
+ * congestion window.  When the round-trip time is known, the retransmission
+ * timeout is derived from it as in TCP (RFC 6298), the fixed delays above
+ * becoming upper bounds.
+ *
+ * The congestion window limits the amount of fragments of a reliable message
+ * that can be in flight without having been acknowledged.  It grows by one
+ * fragment per ACK received whilst below the slow-start threshold, then by
+ * one fragment per window's worth of ACKs.  Growth is suspended when the
+ * round-trip time rises above its minimum by more than a target delay, a
+ * sign that queues are building up along the path.  When an acknowledgment
+ * times out, the window is halved, at most once per round-trip time.
+ *
  * LINK WITH THE RX SIDE
  *
  * Due to the reliability nature of the layer, the RX side must know the TX
@@ -211,6 +227,12 @@
 #define TX_UT_GOOD_FREQ		900		/* Remember good hosts for 15 minutes */
 #define TX_UT_REQUEUE_DELAY	5000	/* Time to requeue message after drop */
 #define TX_UT_ALPHA			3		/* Initial parallelism */
+#define TX_UT_PEER_FREQ		900		/* Keep congestion state for 15 min */
+#define TX_UT_CWND_INIT		16		/* Initial congestion window */
+#define TX_UT_CWND_MIN		2		/* Minimum congestion window */
+#define TX_UT_CWND_MAX		TX_UT_FRAG_MAX
+#define TX_UT_RTO_MIN		1000	/* ms: minimum retransmission timeout */
+#define TX_UT_DELAY_TARGET	100		/* ms: max queuing delay for growth */
 
 #define TX_UT_EXPIRE_MS		(60*1000)	/* Expiration time for packets, in ms */
 #define TX_UT_LINGER_MS		(45*1000)	/* Lingering time for packets, in ms */
@@ -242,6 +264,7 @@ struct attr {
 	struct tx_ut_cb *cb;	/* Callbacks */
 	aging_table_t *ban;		/* Short ban of hosts to whom we cannot transmit */
 	aging_table_t *good;	/* Remeber good hosts for faster transmit */
+	aging_table_t *peers;	/* Congestion state of remote hosts */
 	udp_tag_t tag;			/* Protocol tag (e.g. "GTA" or "GND") */
 	unsigned seqno_freed;	/* Sequence IDs freed, for hysteresis */
 	unsigned improved_acks:1;	/* Advertise improved ACKs in TX fragments */
@@ -258,6 +281,30 @@ ut_attr_check(const struct attr * const attr)
 	g_assert(TX_UT_ATTR_MAGIC == attr->magic);
 }
 
+enum ut_peer_magic { UT_PEER_MAGIC = 0x5b1e84d3 };
+
+/**
+ * Congestion state for a remote host, all times being in ms.
+ */
+struct ut_peer {
+	enum ut_peer_magic magic;
+	tm_t last_reduced;		/* Last time window was reduced */
+	uint srtt;				/* Smoothed round-trip time, 0 if unknown */
+	uint rttvar;			/* Round-trip time variation */
+	uint min_rtt;			/* Smallest round-trip time seen */
+	uint cwnd;				/* Congestion window, in fragments */
+	uint ssthresh;			/* Slow-start threshold */
+	uint acked;				/* ACKs counted towards window growth */
+	unsigned queuing:1;		/* Last RTT sample showed queuing delay */
+};
+
+static inline void
+ut_peer_check(const struct ut_peer * const up)
+{
+	g_assert(up != NULL);
+	g_assert(UT_PEER_MAGIC == up->magic);
+}
+
 /**
  * An enqueued message to process in the service routine.
  */
@@ -279,10 +326,12 @@ struct ut_frag {
 	cevent_t *resend_ev;			/* Timer for fragment retransmission */
 	pmsg_t *fb;						/* Fragment message block */
 	link_t lk;						/* Link in "resend" queue */
+	tm_t sent;						/* Time of last transmission */
 	uint8 fragno;					/* Fragment number, zero-based */
 	uint8 txcnt;					/* Amount of times fragment was sent */
 	uint resend:1;					/* Enqueued for resending */
 	uint pending:1;					/* Pending ACK on resending */
+	uint timeout:1;					/* Resend timer is an ACK timeout */
 };
 
 static void
@@ -506,6 +555,145 @@ ut_to_flag_good(const struct attr *attr, const gnet_host_t *to)
 		aging_record(attr->good, atom_host_get(to));
 }
 
+/**
+ * Free congestion state of remote host, along with its key.
+ */
+static void
+ut_peer_free_kv(void *key, void *value)
+{
+	struct ut_peer *up = value;
+
+	ut_peer_check(up);
+
+	gnet_host_free_atom2(key, NULL);
+	up->magic = 0;
+	WFREE(up);
+}
+
+/**
+ * Get congestion state for host, creating it when missing.
+ */
+static struct ut_peer *
+ut_peer_get(const struct attr *attr, const gnet_host_t *to)
+{
+	struct ut_peer *up;
+
+	up = aging_lookup_revitalise(attr->peers, to);
+
+	if (NULL == up) {
+		WALLOC0(up);
+		up->magic = UT_PEER_MAGIC;
+		up->cwnd = TX_UT_CWND_INIT;
+		up->ssthresh = TX_UT_CWND_MAX;
+		aging_insert(attr->peers, atom_host_get(to), up);
+	}
+
+	return up;
+}
+
+/**
+ * @return the amount of fragments of the message we can have in flight.
+ */
+static uint8
+ut_msg_window(const struct ut_msg *um)
+{
+	const struct ut_peer *up = aging_lookup(um->attr->peers, um->to);
+	uint cwnd = NULL == up ? TX_UT_CWND_INIT : up->cwnd;
+
+	return MIN(cwnd, um->fragcnt);
+}
+
+/**
+ * Update congestion state of the message's destination upon reception of
+ * an acknowledgment for the fragment.
+ *
+ * @param um		the message being acknowledged
+ * @param uf		the fragment acknowledged, NULL if already acknowledged
+ */
+static void
+ut_peer_acked(struct ut_msg *um, const struct ut_frag *uf)
+{
+	struct ut_peer *up = ut_peer_get(um->attr, um->to);
+
+	ut_peer_check(up);
+
+	/*
+	 * Only sample the round-trip time on fragments sent once (Karn's rule)
+	 * since we cannot know which transmission is being acknowledged.
+	 */
+
+	if (uf != NULL && 1 == uf->txcnt) {
+		tm_t now;
+		uint rtt;
+
+		tm_now(&now);
+		rtt = MAX(0, tm_elapsed_ms(&now, &uf->sent));
+
+		if (0 == up->srtt) {
+			up->srtt = MAX(rtt, 1);
+			up->rttvar = rtt / 2;
+			up->min_rtt = rtt;
+		} else {
+			uint diff = up->srtt > rtt ? up->srtt - rtt : rtt - up->srtt;
+
+			up->rttvar = (3 * up->rttvar + diff) / 4;
+			up->srtt = MAX((7 * up->srtt + rtt) / 8, 1);
+			up->min_rtt = MIN(up->min_rtt, rtt);
+		}
+
+		up->queuing = booleanize(rtt > up->min_rtt + TX_UT_DELAY_TARGET);
+	}
+
+	if (up->queuing || up->cwnd >= TX_UT_CWND_MAX)
+		return;
+
+	if (up->cwnd < up->ssthresh) {
+		up->cwnd++;					/* Slow start */
+	} else if (++up->acked >= up->cwnd) {
+		up->acked = 0;
+		up->cwnd++;					/* Congestion avoidance */
+	}
+}
+
+/**
+ * Update congestion state of the message's destination when we did not
+ * get any acknowledgment for a fragment.
+ */
+static void
+ut_peer_lost(struct ut_msg *um)
+{
+	struct ut_peer *up = ut_peer_get(um->attr, um->to);
+	tm_t now;
+
+	ut_peer_check(up);
+
+	/*
+	 * All the fragments in flight when congestion occurred are likely to
+	 * time out together, hence only reduce once per round-trip time.
+	 */
+
+	tm_now(&now);
+
+	if (
+		!tm_is_zero(&up->last_reduced) &&
+		tm_elapsed_ms(&now, &up->last_reduced) <
+			(time_delta_t) MAX(up->srtt, TX_UT_RTO_MIN)
+	)
+		return;
+
+	up->ssthresh = MAX(up->cwnd / 2, TX_UT_CWND_MIN);
+	up->cwnd = up->ssthresh;
+	up->acked = 0;
+	up->last_reduced = now;		/* struct copy */
+
+	gnet_stats_inc_general(GNR_UDP_SR_TX_CWND_REDUCED);
+
+	if (tx_ut_debugging(TX_UT_DBG_TIMEOUT, um->to)) {
+		g_debug("TX UT: %s: congestion window to %s now %u (srtt=%u ms)",
+			G_STRFUNC, gnet_host_to_string(um->to), up->cwnd, up->srtt);
+	}
+}
+
 /**
  * Free message.
  */
@@ -801,6 +989,22 @@ ut_frag_delay(const struct ut_frag *uf)
 	if G_UNLIKELY(um->cautious && uf->txcnt <= 3)
 		return 1000 + 3000 * uf->txcnt;
 
+	/*
+	 * When we know the round-trip time to the host, derive the timeout from
+	 * it, doubling at each retransmission, within the fixed delays.
+	 */
+
+	{
+		const struct ut_peer *up = aging_lookup(um->attr->peers, um->to);
+
+		if (up != NULL && up->srtt != 0) {
+			uint rto = MAX(up->srtt + 4 * up->rttvar, TX_UT_RTO_MIN);
+
+			rto <<= MIN(uf->txcnt - 1, 4);
+			return MIN(rto, (uint) ut_sending_delay(uf->txcnt));
+		}
+	}
+
 	return ut_sending_delay(uf->txcnt);
 }
 
@@ -873,12 +1077,20 @@ ut_ear_send(struct ut_msg *um)
 static void
 ut_send_remaining(struct ut_msg *um)
 {
-	unsigned i;
+	unsigned i, window, sent = 0;
 
 	ut_msg_check(um);
 
 	um->cautious = FALSE;		/* No longer cautious, if we were ever! */
 
+	/*
+	 * For reliable messages, only send as many fragments as the congestion
+	 * window allows, the others being sent as acknowledgments come back.
+	 */
+
+	window = um->reliable ? ut_msg_window(um) : um->fragcnt;
+	um->alpha = MAX(window, 1);
+
 	for (i = 0; i < um->fragcnt; i++) {
 		struct ut_frag *uf = um->fragments[i];
 
@@ -893,7 +1105,23 @@ ut_send_remaining(struct ut_msg *um)
 				uf->resend = FALSE;
 			}
 			cq_cancel(&uf->resend_ev);
+
+			if (sent >= window) {
+				if (uf->pending) {
+					uf->pending = FALSE;
+					um->pending--;
+				}
+				uf->resend = TRUE;
+				elist_append(&um->resend, uf);
+				continue;
+			}
+
+			if (um->reliable && !uf->pending) {
+				uf->pending = TRUE;		/* Counts as being in flight */
+				um->pending++;
+			}
 			ut_frag_send(uf);
+			sent++;
 		}
 	}
 }
@@ -945,10 +1173,11 @@ ut_resend_iterate(cqueue_t *cq, void *obj)
 		return;
 
 	/*
-	 * We're getting ACKs for our fragments, send more.
+	 * We're getting ACKs for our fragments, send more, within the limits
+	 * of the congestion window for the host.
 	 */
 
-	if (um->alpha < um->fragcnt)
+	if (um->alpha < ut_msg_window(um))
 		um->alpha++;
 
 	while (um->pending < um->alpha) {
@@ -1131,6 +1360,13 @@ ut_frag_resend(cqueue_t *cq, void *obj)
 		}
 	}
 
+	/*
+	 * A missing acknowledgment signals congestion on the path to the host.
+	 */
+
+	if (uf->timeout && um->alive)
+		ut_peer_lost(um);
+
 	/*
 	 * If already lingering, do not resend this fragment.
 	 */
@@ -1310,6 +1546,8 @@ ut_frag_pmsg_free(pmsg_t *mb, void *arg)
 		 */
 
 		uf->txcnt++;
+		uf->timeout = TRUE;
+		tm_now(&uf->sent);
 		um->fragtx++;
 		gnet_stats_inc_general(GNR_UDP_SR_TX_FRAGMENTS_SENT);
 		if (um->lingering)
@@ -1387,6 +1625,7 @@ ut_frag_pmsg_free(pmsg_t *mb, void *arg)
 		 */
 
 		cq_cancel(&uf->resend_ev);		/* Same rationale as above */
+		uf->timeout = FALSE;
 		uf->resend_ev =
 			cq_main_insert(TX_UT_REQUEUE_DELAY, ut_frag_resend, uf);
 	}
@@ -2360,6 +2599,8 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 	if (um->expecting_ack)
 		gnet_stats_inc_general(GNR_UDP_SR_TX_EAR_FOLLOWED_BY_ACKS);
 
+	ut_peer_acked(um, um->fragments[ack->fragno]);
+
 	/*
 	 * If all the fragments were received, we're done with the whole message.
 	 */
@@ -2701,6 +2942,8 @@ tx_ut_init(txdrv_t *tx, void *args)
 		gnet_host_hash, gnet_host_equal, gnet_host_free_atom2);
 	attr->good = aging_make(TX_UT_GOOD_FREQ,
 		gnet_host_hash, gnet_host_equal, gnet_host_free_atom2);
+	attr->peers = aging_make(TX_UT_PEER_FREQ,
+		gnet_host_hash, gnet_host_equal, ut_peer_free_kv);
 	attr->cb = targs->cb;
 	attr->tag = targs->tag;				/* struct copy */
 	attr->improved_acks = booleanize(targs->advertise_improved_acks);
@@ -2765,6 +3008,7 @@ tx_ut_destroy(txdrv_t *tx)
 	idtable_destroy(attr->seq);
 	aging_destroy(&attr->ban);
 	aging_destroy(&attr->good);
+	aging_destroy(&attr->peers);
 	ut_pending_discard(attr);
 
 	attr->magic = 0;
@@ -958,7 +958,6 @@ udp_received(const gnutella_socket_t *s,
 {
 	gnutella_node_t *n;
 	bool bogus = FALSE, dht = FALSE, rudp = FALSE, g2 = FALSE;
-	hostiles_flags_t hflags;
 
 	/*
 	 * This must be regular Gnutella / DHT traffic.
@@ -1082,30 +1081,10 @@ rudp:
 	}
 
 	/*
-	 * Traffic from hosts sending gibberish data or information we previously
-	 * determined as being invalid / suspicious are simply discarded to avoid
-	 * further processing (which would probably lead to them being further
-	 * discarded as invalid, unparseable, etc...).
-	 *
-	 * We let statically-banned hosts through though so that we may parse
-	 * their message and log dropping in upper layers, for statistics per
-	 * message type.  We only drop known gibberish at this level.
+	 * Traffic from hosts sending gibberish data has already been dropped
+	 * by the socket layer, as soon as the datagram was read.
 	 */
 
-	hflags = hostiles_check(s->addr);
-
-	if (hflags & HSTL_GIBBERISH) {
-		if (GNET_PROPERTY(udp_debug)) {
-			g_warning("UDP %sdatagram (%zu byte%s) received from "
-				"shunned IP %s (%s) -- dropped",
-				truncated ? "truncated " : "",
-				len, plural(len),
-				host_addr_to_string(s->addr), hostiles_flags_to_string(hflags));
-		}
-		gnet_stats_inc_general(GNR_UDP_SHUNNED_SOURCE_IP);
-		return;
-	}
-
 	/*
 	 * Get proper pseudo-node.
 	 *
@@ -49,6 +49,10 @@
  * other less prioritary packets.  This is typically used for acknowledgments,
  * since delaying an ACK will likely cause retransmission on the other end.
  *
+ * Queued packets are not sent individually: they are gathered in small batches
+ * per network type and each batch is handed to the kernel with one single
+ * system call, when possible.
+ *
  * This layer is at the bottom of the TX stacks, but it can be used by several
  * TX stacks which happen to have the same shared bandwidth pool.  Therefore,
  * each packet to send also remembers its TX stack origin (for callback
@@ -89,6 +93,7 @@
 
 #define UDP_SCHED_EXPIRE	5	/**< Seconds before expiring unsent messages */
 #define UDP_SCHED_FACTOR	3	/**< Stop when that many times the b/w queued */
+#define UDP_SCHED_BATCH		16	/**< Max datagrams sent in one batch */
 
 #define udp_sched_log(lvl, fmt, ...)						\
 G_STMT_START {												\
@@ -132,6 +137,9 @@ struct udp_sched {
 	udp_sched_socket_cb_t get_socket;		/**< Get the UDP socket by net */
 	eslist_t lifo[PMSG_P_COUNT];	/**< LIFO stacks of TX descriptors */
 	eslist_t tx_released;			/**< Deferred TX descriptor freeing */
+	eslist_t unsent;				/**< Batched TX descriptors left unsent */
+	struct udp_tx_desc *batch[UDP_SCHED_NET_CNT][UDP_SCHED_BATCH];
+	uint batched[UDP_SCHED_NET_CNT];	/**< Amount of items in batches */
 	bsched_bws_t bws;				/**< Bandwidth scheduler to use */
 	hset_t *seen;					/**< Remembers destinations processed */
 	hash_list_t *stacks;			/**< TX stacks using us */
@@ -433,7 +441,8 @@ udp_tx_drop(const txdrv_t *tx, const struct tx_dgram_cb *cb)
 }
 
 /**
- * Send message block to IP:port.
+ * Check whether message block still needs to be sent and select the index
+ * of the I/O source to use.
  *
  * @param us		the UDP scheduler
  * @param mb		the message to send
@@ -441,20 +450,18 @@ udp_tx_drop(const txdrv_t *tx, const struct tx_dgram_cb *cb)
  * @param tx		the TX stack sending the message
  * @param cb		callback actions on the datagram
  *
- * @return TRUE if message was sent or dropped, FALSE if there is no more
- * bandwidth to send anything.
+ * @return the UDP_SCHED_* index of the I/O source to use, or UDP_SCHED_NET_CNT
+ * if the message was dropped.
  */
-static bool
-udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+static enum udp_sched_net
+udp_sched_mb_source(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 	const txdrv_t *tx, const struct tx_dgram_cb *cb)
 {
-	ssize_t r;
-	int len = pmsg_size(mb);
-	bio_source_t *bio = NULL;
+	enum udp_sched_net i = UDP_SCHED_NET_CNT;
 
 	if (0 == gnet_host_get_port(to)) {
 		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_ZERO_PORT);
-		return TRUE;
+		return UDP_SCHED_NET_CNT;
 	}
 
 	/*
@@ -463,7 +470,7 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 
 	if (!pmsg_can_transmit(mb)) {
 		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_NO_LONGER_NEEDED);
-		return TRUE;			/* Dropped */
+		return UDP_SCHED_NET_CNT;	/* Dropped */
 	}
 
 	/*
@@ -472,10 +479,10 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 
 	switch (gnet_host_get_net(to)) {
 	case NET_TYPE_IPV4:
-		bio = us->bio[UDP_SCHED_IPv4];
+		i = UDP_SCHED_IPv4;
 		break;
 	case NET_TYPE_IPV6:
-		bio = us->bio[UDP_SCHED_IPv6];
+		i = UDP_SCHED_IPv6;
 		break;
 	case NET_TYPE_NONE:
 	case NET_TYPE_LOCAL:
@@ -487,31 +494,117 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 	 * was cleared, hence we simply need to discard the message.
 	 */
 
-	if (NULL == bio) {
+	if (NULL == us->bio[i]) {
 		udp_sched_log(4, "%p: discarding mb=%p (%d bytes) to %s",
 			us, mb, pmsg_written_size(mb), gnet_host_to_string(to));
 		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_NO_SOCKET);
-		return udp_tx_drop(tx, cb);		/* TRUE, for "sent" */
+		udp_tx_drop(tx, cb);
+		return UDP_SCHED_NET_CNT;
+	}
+
+	return i;
+}
+
+/**
+ * Account for message block which was successfully sent.
+ *
+ * @param us		the UDP scheduler
+ * @param mb		the message sent
+ * @param to		the IP:port destination of the message
+ * @param tx		the TX stack sending the message
+ * @param cb		callback actions on the datagram
+ */
+static void
+udp_sched_mb_sent(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+	const txdrv_t *tx, const struct tx_dgram_cb *cb)
+{
+	static gnr_stats_t s[] = {
+		GNR_UDP_SCHED_FINALLY_SENT_PRIO_DATA,
+		GNR_UDP_SCHED_FINALLY_SENT_PRIO_CONTROL,
+		GNR_UDP_SCHED_FINALLY_SENT_PRIO_URGENT,
+		GNR_UDP_SCHED_FINALLY_SENT_PRIO_HIGHEST,
+	};
+	uint prio = pmsg_prio(mb);
+
+	STATIC_ASSERT(PMSG_P_COUNT == N_ITEMS(s));
+
+	g_assert_log(prio < PMSG_P_COUNT,
+		"%s(): prio=%u", G_STRFUNC, prio);
+
+	udp_sched_log(5, "%p: sent mb=%p (%d bytes) prio=%u",
+		us, mb, pmsg_size(mb), prio);
+
+	pmsg_mark_sent(mb);
+	gnet_stats_inc_general(s[prio]);
+
+	if (cb->msg_account != NULL)
+		(*cb->msg_account)(tx->owner, mb);
+
+	inet_udp_record_sent(gnet_host_get_addr(to));
+}
+
+/**
+ * Handle failure to send message block, with errno set.
+ *
+ * @param us		the UDP scheduler
+ * @param mb		the message we could not send
+ * @param to		the IP:port destination of the message
+ * @param tx		the TX stack sending the message
+ * @param cb		callback actions on the datagram
+ * @param func		calling routine name, for logging
+ *
+ * @return TRUE if message was dropped, FALSE if there is no more
+ * bandwidth to send anything.
+ */
+static bool
+udp_sched_mb_failed(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+	const txdrv_t *tx, const struct tx_dgram_cb *cb, const char *func)
+{
+	if (udp_sched_write_error(us, to, mb, func)) {
+		udp_sched_log(4, "%p: dropped mb=%p (%d bytes): %m",
+			us, mb, pmsg_written_size(mb));
+		gnet_stats_inc_general(GNR_UDP_SCHED_DROP_IO_ERROR);
+		return udp_tx_drop(tx, cb);	/* TRUE, for "sent" */
 	}
+	udp_sched_log(3, "%p: no bandwidth for mb=%p (%d bytes)",
+		us, mb, pmsg_written_size(mb));
+	us->used_all = TRUE;
+	return FALSE;
+}
+
+/**
+ * Send message block to IP:port.
+ *
+ * @param us		the UDP scheduler
+ * @param mb		the message to send
+ * @param to		the IP:port destination of the message
+ * @param tx		the TX stack sending the message
+ * @param cb		callback actions on the datagram
+ *
+ * @return TRUE if message was sent or dropped, FALSE if there is no more
+ * bandwidth to send anything.
+ */
+static bool
+udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
+	const txdrv_t *tx, const struct tx_dgram_cb *cb)
+{
+	ssize_t r;
+	int len = pmsg_size(mb);
+	enum udp_sched_net i;
+
+	i = udp_sched_mb_source(us, mb, to, tx, cb);
+
+	if (UDP_SCHED_NET_CNT == i)
+		return TRUE;			/* Dropped */
 
 	/*
 	 * OK, proceed if we have bandwidth.
 	 */
 
-	r = bio_sendto(bio, to, pmsg_phys_base(mb), len);
+	r = bio_sendto(us->bio[i], to, pmsg_phys_base(mb), len);
 
-	if (r < 0) {		/* Error, or no bandwidth */
-		if (udp_sched_write_error(us, to, mb, G_STRFUNC)) {
-			udp_sched_log(4, "%p: dropped mb=%p (%d bytes): %m",
-				us, mb, pmsg_written_size(mb));
-			gnet_stats_inc_general(GNR_UDP_SCHED_DROP_IO_ERROR);
-			return udp_tx_drop(tx, cb);	/* TRUE, for "sent" */
-		}
-		udp_sched_log(3, "%p: no bandwidth for mb=%p (%d bytes)",
-			us, mb, pmsg_written_size(mb));
-		us->used_all = TRUE;
-		return FALSE;
-	}
+	if (r < 0)		/* Error, or no bandwidth */
+		return udp_sched_mb_failed(us, mb, to, tx, cb, G_STRFUNC);
 
 	if (r != len) {
 		/* This should never happen with UDP/IP since datagrams are atomic */
@@ -519,44 +612,103 @@ udp_sched_mb_sendto(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 			"for %d-byte datagram",
 			G_STRFUNC, r, gnet_host_to_string(to), len);
 	} else {
-		static gnr_stats_t s[] = {
-			GNR_UDP_SCHED_FINALLY_SENT_PRIO_DATA,
-			GNR_UDP_SCHED_FINALLY_SENT_PRIO_CONTROL,
-			GNR_UDP_SCHED_FINALLY_SENT_PRIO_URGENT,
-			GNR_UDP_SCHED_FINALLY_SENT_PRIO_HIGHEST,
-		};
-		uint prio = pmsg_prio(mb);
+		udp_sched_mb_sent(us, mb, to, tx, cb);
+	}
 
-		STATIC_ASSERT(PMSG_P_COUNT == N_ITEMS(s));
+	return TRUE;		/* Message sent */
+}
 
-		g_assert_log(prio < PMSG_P_COUNT,
-			"%s(): prio=%u", G_STRFUNC, prio);
+/**
+ * Release TX descriptor whose message was sent or dropped.
+ */
+static void
+udp_tx_desc_done(struct udp_tx_desc *txd, udp_sched_t *us)
+{
+	us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
+	udp_tx_desc_flag_release(txd, us);
+}
 
-		udp_sched_log(5, "%p: sent mb=%p (%d bytes) prio=%u",
-			us, mb, pmsg_size(mb), prio);
+/**
+ * Send the batch of TX descriptors gathered for a network type.
+ *
+ * Descriptors that cannot be sent for lack of bandwidth are moved to the
+ * list of unsent items, for the caller to put them back in their queue.
+ */
+static void
+udp_sched_batch_flush(udp_sched_t *us, enum udp_sched_net net)
+{
+	struct udp_tx_desc **batch = us->batch[net];
+	wrap_dgram_t dg[UDP_SCHED_BATCH];
+	uint i, n = us->batched[net], done = 0;
 
-		pmsg_mark_sent(mb);
-		gnet_stats_inc_general(s[prio]);
+	if (0 == n)
+		return;
 
-		if (cb->msg_account != NULL)
-			(*cb->msg_account)(tx->owner, mb);
+	g_assert(us->bio[net] != NULL);
 
-		inet_udp_record_sent(gnet_host_get_addr(to));
+	for (i = 0; i < n; i++) {
+		dg[i].to = batch[i]->to;
+		dg[i].data = pmsg_phys_base(batch[i]->mb);
+		dg[i].len = pmsg_size(batch[i]->mb);
 	}
 
-	return TRUE;		/* Message sent */
+	while (done < n && !us->used_all) {
+		ssize_t r = bio_sendmmsg(us->bio[net], &dg[done], n - done);
+
+		if (r < 0) {
+			struct udp_tx_desc *txd = batch[done];
+
+			if (!udp_sched_mb_failed(us,
+				txd->mb, txd->to, txd->tx, txd->cb, G_STRFUNC)
+			)
+				break;			/* No more bandwidth */
+
+			udp_tx_desc_done(txd, us);
+			done++;
+			continue;
+		}
+
+		udp_sched_log(4, "%p: sent %zd/%u datagrams in batch",
+			us, r, n - done);
+
+		for (i = done; i < done + r; i++) {
+			struct udp_tx_desc *txd = batch[i];
+
+			udp_sched_mb_sent(us, txd->mb, txd->to, txd->tx, txd->cb);
+			udp_tx_desc_done(txd, us);
+		}
+		done += r;
+	}
+
+	for (i = done; i < n; i++)
+		eslist_append(&us->unsent, batch[i]);
+
+	us->batched[net] = 0;
+}
+
+/**
+ * Send all the pending batches.
+ */
+static void
+udp_sched_batch_flush_all(udp_sched_t *us)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(us->batched); i++)
+		udp_sched_batch_flush(us, i);
 }
 
 /**
  * Send message (eslist iterator callback).
  *
- * @return TRUE if message was sent and freed up.
+ * @return TRUE if message was dropped or batched for sending.
  */
 static bool
 udp_tx_desc_send(void *data, void *udata)
 {
 	struct udp_tx_desc *txd = data;
 	udp_sched_t *us = udata;
+	enum udp_sched_net net;
 	unsigned prio;
 
 	udp_sched_check(us);
@@ -586,15 +738,29 @@ udp_tx_desc_send(void *data, void *udata)
 		return FALSE;
 	}
 
-	if (udp_sched_mb_sendto(us, txd->mb, txd->to, txd->tx, txd->cb)) {
-		if (PMSG_P_DATA == prio && pmsg_was_sent(txd->mb))
-			hset_insert(us->seen, atom_host_get(txd->to));
-	} else {
-		return FALSE;		/* Unsent, leave it in the queue */
+	/*
+	 * Gather message in the batch for its network type, sending the batch
+	 * when it is full.  From now on, the descriptor is no longer part of
+	 * the list we are iterating over.
+	 */
+
+	net = udp_sched_mb_source(us, txd->mb, txd->to, txd->tx, txd->cb);
+
+	if (UDP_SCHED_NET_CNT == net) {
+		udp_tx_desc_done(txd, us);		/* Dropped */
+		return TRUE;
 	}
 
-	us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
-	udp_tx_desc_flag_release(txd, us);
+	if (PMSG_P_DATA == prio)
+		hset_insert(us->seen, atom_host_get(txd->to));
+
+	g_assert(us->batched[net] < N_ITEMS(us->batch[net]));
+
+	us->batch[net][us->batched[net]++] = txd;
+
+	if (N_ITEMS(us->batch[net]) == us->batched[net])
+		udp_sched_batch_flush(us, net);
+
 	return TRUE;
 }
 
@@ -753,6 +919,14 @@ udp_sched_process(udp_sched_t *us, eslist_t *list)
 	udp_sched_check(us);
 
 	eslist_foreach_remove(list, udp_tx_desc_send, us);
+	udp_sched_batch_flush_all(us);
+
+	/*
+	 * Messages we could not send go back to the head of the LIFO, in the
+	 * order they had in the list.
+	 */
+
+	eslist_prepend_list(list, &us->unsent);
 }
 
 /**
@@ -1023,6 +1197,7 @@ udp_sched_make(
 		eslist_init(&us->lifo[i], offsetof(struct udp_tx_desc, lnk));
 	}
 	eslist_init(&us->tx_released, offsetof(struct udp_tx_desc, lnk));
+	eslist_init(&us->unsent, offsetof(struct udp_tx_desc, lnk));
 	us->seen =
 		hset_create_any(gnet_host_hash, gnet_host_hash2, gnet_host_equal);
 	us->stacks = hash_list_new(udp_tx_stack_hash, udp_tx_stack_eq);
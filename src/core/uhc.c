@@ -53,6 +53,7 @@
 #include "lib/hashlist.h"
 #include "lib/hstrfn.h"
 #include "lib/mempcpy.h"
+#include "lib/misc.h"
 #include "lib/parse.h"
 #include "lib/shuffle.h"
 #include "lib/str.h"
@@ -68,21 +69,25 @@
 #define UHC_MAX_ATTEMPTS 3		/**< Maximum connection / resolution attempts */
 #define UHC_TIMEOUT		 20000	/**< Host cache timeout, milliseconds */
 #define UHC_RETRY_AFTER	 180	/**< Frequency of contacts for an UHC (secs) */
+#define UHC_PARALLEL	 3		/**< Amount of UHCs probed in parallel */
 
 /**
  * Request context, used when we decide to get hosts via the UDP host caches.
  *
- * It keeps track of the amount of messages we sent, and which GUID we used
- * in the pings.
+ * We probe UHC_PARALLEL host caches at the same time, each slot keeping
+ * track of the host cache it is talking to and which GUID was used in the
+ * ping.  The first host cache to reply with hosts ends the probing cycle.
  */
 static struct uhc_context {
-	const char *host;			/**< Last selected host (static buffer) */
+	char host[MAX_HOSTLEN + 1];	/**< Hostname of selected host cache */
+	const char *hp;				/**< Selected "host:port" (string atom) */
 	cevent_t *timeout_ev;		/**< Ping timeout */
-	int attempts;				/**< Connection / resolution attempts */
 	host_addr_t addr;			/**< Resolved IP address for host */
 	uint16 port;				/**< Port of selected host cache */
 	struct guid muid;			/**< MUID of the ping */
-} uhc_ctx;
+	unsigned active:1;			/**< Slot is part of the probing cycle */
+	unsigned resolving:1;		/**< Name resolution pending */
+} uhc_ctx[UHC_PARALLEL];
 
 static hash_list_t *uhc_list;	/**< List of ``struct uhc'' */
 
@@ -118,7 +123,8 @@ static const struct {
 static bool uhc_connecting = FALSE;
 
 static void uhc_host_resolved(const host_addr_t *addr, size_t n, void *udata);
-static void uhc_send_ping(void);
+static void uhc_try_next(struct uhc_context *ctx);
+static void uhc_ping_timeout(cqueue_t *cq, void *obj);
 
 /**
  * Parse hostname:port and return the hostname and port parts.
@@ -287,12 +293,15 @@ found:
 /**
  * Pick host at random among the host array.
  *
+ * @param ctx		the probing slot for which we pick a host cache
+ *
  * @return TRUE if OK.
  */
 static bool
-uhc_pick(void)
+uhc_pick(struct uhc_context *ctx)
 {
 	bool success = FALSE;
+	const char *host;
 	char *uhc;
 
 	uhc = uhc_get_next();
@@ -303,11 +312,15 @@ uhc_pick(void)
 		goto finish;
 	}
 
-	if (!uhc_get_host_port(uhc, &uhc_ctx.host, &uhc_ctx.port)) {
+	if (!uhc_get_host_port(uhc, &host, &ctx->port)) {
 		g_warning("cannot parse UDP host cache \"%s\"", uhc);
 		goto finish;
 	}
 
+	clamp_strcpy(ARYLEN(ctx->host), host);
+	atom_str_free_null(&ctx->hp);
+	ctx->hp = atom_str_get(uhc);
+
 	/*
 	 * Give GUI feedback.
 	 */
@@ -325,128 +338,171 @@ finish:
 }
 
 /**
- * Try with next host in the (already shuffled) list.
+ * Remove probing slot from the current cycle, ending the cycle when it
+ * was the last active slot.
  */
 static void
-uhc_try_next(void)
+uhc_slot_done(struct uhc_context *ctx)
 {
-	host_addr_t addr;
+	uint i;
+
+	cq_cancel(&ctx->timeout_ev);
+	ctx->active = FALSE;
+
+	for (i = 0; i < N_ITEMS(uhc_ctx); i++) {
+		if (uhc_ctx[i].active)
+			return;
+	}
 
+	uhc_connecting = FALSE;
+}
+
+/**
+ * Send an UDP ping to the host cache.
+ *
+ * @return TRUE if the ping was sent, FALSE on failure.
+ */
+static bool
+uhc_send_ping(struct uhc_context *ctx)
+{
 	g_assert(uhc_connecting);
-	g_assert(uhc_ctx.timeout_ev == NULL);
+	g_assert(ctx->active);
 
-	if (!uhc_pick()) {
-		uhc_connecting = FALSE;
-		return;
+	guid_random_muid(&ctx->muid);
+
+	if (!udp_send_ping(&ctx->muid, ctx->addr, ctx->port, TRUE)) {
+		g_warning("BOOT failed to send UDP SCP to %s",
+			host_addr_port_to_string(ctx->addr, ctx->port));
+		return FALSE;
+	}
+
+	if (GNET_PROPERTY(bootstrap_debug) || GNET_PROPERTY(log_uhc_pings_tx)) {
+		g_debug("BOOT sent UDP SCP ping #%s to %s:%u",
+			guid_hex_str(&ctx->muid), ctx->host, ctx->port);
 	}
 
 	/*
-	 * The following may recurse if resolution is synchronous, but
-	 * we're protected by the `attempts' counter.
+	 * Give GUI feedback.
 	 */
+	{
+		char msg[256];
 
-	if (string_to_host_addr(uhc_ctx.host, NULL, &addr)) {
-		uhc_ctx.addr = addr;
-
-		if (GNET_PROPERTY(bootstrap_debug))
-			g_debug("BOOT UDP host cache \"%s\"", uhc_ctx.host);
-
-		uhc_send_ping();
-	} else {
-		(void) adns_resolve(uhc_ctx.host, settings_dns_net(),
-					uhc_host_resolved, NULL);
+		str_bprintf(ARYLEN(msg),
+			_("Sent ping to UDP host cache %s:%u"), ctx->host, ctx->port);
+		gcu_statusbar_message(msg);
 	}
-}
 
-/**
- * Callout queue callback, invoked when the ping was sent and we did not
- * get a reply within the specified timeout.
- */
-static void
-uhc_ping_timeout(cqueue_t *cq, void *unused_obj)
-{
-	(void) unused_obj;
+	/*
+	 * Arm a timer to see whether we should not try to ping another
+	 * host cache if we don't get a timely reply.
+	 */
 
-	if (GNET_PROPERTY(bootstrap_debug))
-		g_warning("no reply from UDP host cache %s:%u",
-			uhc_ctx.host, uhc_ctx.port);
+	g_assert(ctx->timeout_ev == NULL);
 
-	cq_zero(cq, &uhc_ctx.timeout_ev);
-	uhc_try_next();
+	ctx->timeout_ev = cq_main_insert(UHC_TIMEOUT, uhc_ping_timeout, ctx);
+
+	return TRUE;
 }
 
 /**
- * Send an UDP ping to the host cache.
+ * Try with next host in the (already shuffled) list.
  */
 static void
-uhc_send_ping(void)
+uhc_try_next(struct uhc_context *ctx)
 {
-	g_assert(uhc_connecting);
+	host_addr_t addr;
 
-	guid_random_muid(&uhc_ctx.muid);
+	g_assert(uhc_connecting);
+	g_assert(ctx->active);
+	g_assert(ctx->timeout_ev == NULL);
 
-	if (udp_send_ping(&uhc_ctx.muid, uhc_ctx.addr, uhc_ctx.port, TRUE)) {
+	/*
+	 * The following may recurse if resolution is synchronous, but
+	 * uhc_get_next() will not hand out the same host cache twice within
+	 * UHC_RETRY_AFTER seconds, so we will eventually run out of hosts.
+	 */
 
-		if (GNET_PROPERTY(bootstrap_debug) || GNET_PROPERTY(log_uhc_pings_tx)) {
-			g_debug("BOOT sent UDP SCP ping #%s to %s:%u",
-				guid_hex_str(&uhc_ctx.muid), uhc_ctx.host, uhc_ctx.port);
+	while (uhc_pick(ctx)) {
+		if (!string_to_host_addr(ctx->host, NULL, &addr)) {
+			ctx->resolving = TRUE;
+			(void) adns_resolve(ctx->host, settings_dns_net(),
+						uhc_host_resolved, ctx);
+			return;
 		}
 
-		/*
-		 * Give GUI feedback.
-		 */
-		{
-			char msg[256];
+		ctx->addr = addr;
 
-			str_bprintf(ARYLEN(msg),
-				_("Sent ping to UDP host cache %s:%u"),
-				uhc_ctx.host, uhc_ctx.port);
-			gcu_statusbar_message(msg);
-		}
+		if (GNET_PROPERTY(bootstrap_debug))
+			g_debug("BOOT UDP host cache \"%s\"", ctx->host);
 
-		/*
-		 * Arm a timer to see whether we should not try to ping another
-		 * host cache if we don't get a timely reply.
-		 */
+		if (uhc_send_ping(ctx))
+			return;
+	}
 
-		g_assert(uhc_ctx.timeout_ev == NULL);
+	uhc_slot_done(ctx);
+}
 
-		uhc_ctx.timeout_ev = cq_main_insert(UHC_TIMEOUT,
-			uhc_ping_timeout, NULL);
-	} else {
-		g_warning("BOOT failed to send UDP SCP to %s",
-			host_addr_port_to_string(uhc_ctx.addr, uhc_ctx.port));
-		uhc_try_next();
-	}
+/**
+ * Callout queue callback, invoked when the ping was sent and we did not
+ * get a reply within the specified timeout.
+ */
+static void
+uhc_ping_timeout(cqueue_t *cq, void *obj)
+{
+	struct uhc_context *ctx = obj;
+
+	if (GNET_PROPERTY(bootstrap_debug))
+		g_warning("no reply from UDP host cache %s:%u", ctx->host, ctx->port);
+
+	cq_zero(cq, &ctx->timeout_ev);
+	uhc_try_next(ctx);
 }
 
 /**
  * Callback for adns_resolve(), invoked when the resolution is complete.
  */
 static void
-uhc_host_resolved(const host_addr_t *addrs, size_t n, void *uu_udata)
+uhc_host_resolved(const host_addr_t *addrs, size_t n, void *udata)
 {
-	(void) uu_udata;
+	struct uhc_context *ctx = udata;
+	host_addr_t other = zero_host_addr;
+
 	g_assert(addrs);
 
+	ctx->resolving = FALSE;
+
+	/*
+	 * The probing cycle may have ended whilst we were resolving, because
+	 * another host cache replied first: this slot lost the race.
+	 */
+
+	if (!ctx->active)
+		return;
+
 	/*
 	 * If resolution failed, try again if possible.
 	 */
 
 	if (0 == n) {
 		if (GNET_PROPERTY(bootstrap_debug))
-			g_warning("could not resolve UDP host cache \"%s\"",
-				uhc_ctx.host);
+			g_warning("could not resolve UDP host cache \"%s\"", ctx->host);
 
-		uhc_try_next();
+		uhc_try_next(ctx);
 		return;
 	}
 
 	if (n > 1) {
 		size_t i;
 		host_addr_t *hav;
-		/* Current UHC was moved to tail by uhc_get_next() */
-		struct uhc *uhc = hash_list_tail(uhc_list);
+		struct uhc key, *uhc;
+
+		/*
+		 * Other slots may have picked host caches since we started the
+		 * resolution, hence we need to look up the entry.
+		 */
+
+		key.host = ctx->hp;
+		uhc = hash_list_lookup(uhc_list, &key);
 
 		/*
 		 * UHC resolved to multiple endpoints. Could be roundrobbin or
@@ -462,15 +518,28 @@ uhc_host_resolved(const host_addr_t *addrs, size_t n, void *uu_udata)
 		SHUFFLE_ARRAY_N(hav, n);
 
 		for (i = 0; i < n; i++) {
-			const char *host = host_addr_port_to_string(hav[i], uhc_ctx.port);
+			const char *host = host_addr_port_to_string(hav[i], ctx->port);
 			g_debug("BOOT UDP host cache \"%s\" resolved to %s (#%zu)",
-				uhc_ctx.host, host, i + 1);
+				ctx->host, host, i + 1);
 
 			uhc_list_append(host);
+
+			/*
+			 * Remember the first address of a different family than the
+			 * one we are going to ping: we will race both families.
+			 */
+
+			if (
+				!is_host_addr(other) &&
+				host_addr_net(hav[i]) != host_addr_net(hav[0])
+			)
+				other = hav[i];		/* Struct copy */
 		}
 
-		hash_list_remove(uhc_list, uhc);	/* Replaced by IP address list */
-		uhc_free(&uhc);
+		if (uhc != NULL) {
+			hash_list_remove(uhc_list, uhc);	/* Replaced by address list */
+			uhc_free(&uhc);
+		}
 
 		/*
 		 * We're going to continue and process the first address (in our
@@ -479,10 +548,13 @@ uhc_host_resolved(const host_addr_t *addrs, size_t n, void *uu_udata)
 		 *		--RAM, 2015-10-01
 		 */
 
-		{
-			struct uhc key;
+		for (i = 0; i < 2; i++) {
+			host_addr_t ha = 0 == i ? hav[0] : other;
 
-			key.host = host_addr_port_to_string(hav[0], uhc_ctx.port);
+			if (!is_host_addr(ha))
+				break;
+
+			key.host = host_addr_port_to_string(ha, ctx->port);
 			uhc = hash_list_lookup(uhc_list, &key);
 			g_assert(uhc != NULL);	/* We added the entry above! */
 			uhc->stamp = tm_time();
@@ -490,22 +562,39 @@ uhc_host_resolved(const host_addr_t *addrs, size_t n, void *uu_udata)
 			hash_list_moveto_tail(uhc_list, uhc);
 		}
 
-		uhc_ctx.addr = hav[0];		/* Struct copy */
+		ctx->addr = hav[0];		/* Struct copy */
 		HFREE_NULL(hav);
 	} else {
-		uhc_ctx.addr = addrs[0];
+		ctx->addr = addrs[0];
 	}
 
 	if (GNET_PROPERTY(bootstrap_debug))
 		g_debug("BOOT UDP host cache \"%s\" resolved to %s",
-			uhc_ctx.host, host_addr_to_string(uhc_ctx.addr));
-
+			ctx->host, host_addr_to_string(ctx->addr));
 
 	/*
 	 * Now send the ping.
+	 *
+	 * When the host cache has both IPv4 and IPv6 addresses, ping both
+	 * with the same MUID: whichever family answers first wins, and we
+	 * do not have to wait for a timeout when one of them is unreachable.
 	 */
 
-	uhc_send_ping();
+	if (!uhc_send_ping(ctx)) {
+		uhc_try_next(ctx);
+		return;
+	}
+
+	if (is_host_addr(other)) {
+		bool sent = udp_send_ping(&ctx->muid, other, ctx->port, TRUE);
+
+		if (GNET_PROPERTY(bootstrap_debug) || GNET_PROPERTY(log_uhc_pings_tx)) {
+			g_debug("BOOT %s UDP SCP ping #%s to %s",
+				sent ? "sent" : "could not send",
+				guid_hex_str(&ctx->muid),
+				host_addr_port_to_string(other, ctx->port));
+		}
+	}
 }
 
 /**
@@ -523,6 +612,8 @@ uhc_is_waiting(void)
 void
 uhc_get_hosts(void)
 {
+	uint i, started = 0;
+
 	/*
 	 * Make sure we don't probe host caches more than once at a time.
 	 * Ancient versions are denied the right to contact host caches and
@@ -538,21 +629,42 @@ uhc_get_hosts(void)
 		return;
 	}
 
-	g_message("BOOT will be contacting an UHC");
+	g_message("BOOT will be contacting %u UHCs", (uint) N_ITEMS(uhc_ctx));
+
+	uhc_connecting = TRUE;
 
 	/*
-	 * Reset context.
+	 * When we are not connected at all, also query a GHC concurrently:
+	 * we are going to use whichever host source replies first.
 	 */
 
-	uhc_connecting = TRUE;
-
-	g_assert(uhc_ctx.timeout_ev == NULL);
+	if (0 == connected_nodes())
+		ghc_get_hosts();
 
 	/*
-	 * Pick next host.
+	 * Start all the probing slots, skipping the ones still waiting for a
+	 * name resolution from an earlier cycle.
 	 */
 
-	uhc_try_next();
+	for (i = 0; i < N_ITEMS(uhc_ctx); i++) {
+		struct uhc_context *ctx = &uhc_ctx[i];
+
+		if (ctx->resolving)
+			continue;
+
+		g_assert(!ctx->active);
+		g_assert(ctx->timeout_ev == NULL);
+
+		ctx->active = TRUE;
+		started++;
+		uhc_try_next(ctx);
+
+		if (!uhc_connecting)
+			break;			/* Ran out of host caches */
+	}
+
+	if (0 == started)
+		uhc_connecting = FALSE;
 }
 
 /**
@@ -565,6 +677,7 @@ uhc_ipp_extract(gnutella_node_t *n, const char *payload, int paylen,
 	int i, cnt;
 	int len = NET_TYPE_IPV6 == type ? 18 : 6;
 	const void *p;
+	struct uhc_context *ctx;
 
 	g_assert(0 == paylen % len);
 
@@ -598,33 +711,49 @@ uhc_ipp_extract(gnutella_node_t *n, const char *payload, int paylen,
 	 * check whether we're still in a probing cycle.
 	 */
 
-	if (!guid_eq(&uhc_ctx.muid, gnutella_header_get_muid(&n->header)))
+	for (i = 0, ctx = NULL; i < N_ITEMS(uhc_ctx); i++) {
+		if (
+			uhc_ctx[i].active &&
+			guid_eq(&uhc_ctx[i].muid, gnutella_header_get_muid(&n->header))
+		) {
+			ctx = &uhc_ctx[i];
+			break;
+		}
+	}
+
+	if (NULL == ctx)
 		return;
 
 	if (GNET_PROPERTY(bootstrap_debug)) {
 		g_debug("BOOT UDP cache \"%s\" replied: got %d host%s from %s",
-			uhc_ctx.host, cnt, plural(cnt), node_addr(n));
+			ctx->host, cnt, plural(cnt), node_addr(n));
 	}
 
 	/*
-	 * Terminate the probing cycle if we got hosts.
+	 * Terminate the probing cycle if we got hosts, cancelling the other
+	 * slots since they lost the race.  Pending name resolutions will be
+	 * ignored when they complete.
 	 */
 
 	if (cnt > 0) {
 		char msg[256];
 
-		cq_cancel(&uhc_ctx.timeout_ev);
-		uhc_connecting = FALSE;
-
 		str_bprintf(ARYLEN(msg),
 			NG_("Got %d host from UDP host cache %s",
 				"Got %d hosts from UDP host cache %s",
 				cnt),
-			cnt, uhc_ctx.host);
+			cnt, ctx->host);
 
 		gcu_statusbar_message(msg);
+
+		for (i = 0; i < N_ITEMS(uhc_ctx); i++) {
+			cq_cancel(&uhc_ctx[i].timeout_ev);
+			uhc_ctx[i].active = FALSE;
+		}
+		uhc_connecting = FALSE;
 	} else {
-		uhc_try_next();
+		cq_cancel(&ctx->timeout_ev);
+		uhc_try_next(ctx);
 	}
 }
 
@@ -666,7 +795,13 @@ uhc_init(void)
 void G_COLD
 uhc_close(void)
 {
-	cq_cancel(&uhc_ctx.timeout_ev);
+	uint i;
+
+	for (i = 0; i < N_ITEMS(uhc_ctx); i++) {
+		cq_cancel(&uhc_ctx[i].timeout_ev);
+		atom_str_free_null(&uhc_ctx[i].hp);
+		uhc_ctx[i].active = FALSE;
+	}
 	uhc_connecting = FALSE;
 
 	if (uhc_list) {
@@ -38,6 +38,12 @@
  *
  *	- "<url-escaped filename> <file size> <attempts> <completions>"
  *
+ * Changed entries are periodically appended, in the same format, to the
+ * 'upload_stats.log' journal, which is replayed on top of the main file
+ * at startup.  The main file is only rewritten (and the journal discarded)
+ * when the journal grows larger than the amount of entries, at shutdown,
+ * or when the statistics are cleared.
+ *
  * @todo
  * TODO: Add a check to make sure that all of the files still exist(?)
  *       grey them out if they dont, optionally remove them from the
@@ -66,6 +72,7 @@
 #include "lib/hashlist.h"
 #include "lib/hikset.h"
 #include "lib/parse.h"
+#include "lib/path.h"
 #include "lib/stringify.h"
 #include "lib/timestamp.h"
 #include "lib/tm.h"
@@ -76,11 +83,17 @@
 
 #include "lib/override.h"		/* Must be the last header included */
 
+#define UPLOAD_STATS_COMPACT_MIN	1024	/**< Min journal lines to compact */
+
 static const char ul_stats_file[] = "upload_stats";
+static const char ul_stats_log[] = "upload_stats.log";
 static const char ul_stats_what[] = "upload statistics";
 
 static bool dirty = FALSE;
+static bool rewrite = FALSE;		/**< Whether journal cannot be used */
+static size_t journal_lines;		/**< Lines in journal since compaction */
 static hash_list_t *upload_stats_list;
+static hash_list_t *upload_stats_changed;	/**< Entries to journal */
 static hikset_t *upload_stats_by_sha1;
 
 static bool
@@ -171,7 +184,7 @@ done:
 	return s;
 }
 
-static void
+static struct ul_stats *
 upload_stats_add(const char *pathname, filesize_t size, const char *name,
 	uint32 attempts, uint32 complete, uint64 ul_bytes,
 	time_t rtime, time_t dtime, const struct sha1 *sha1)
@@ -205,27 +218,66 @@ upload_stats_add(const char *pathname, filesize_t size, const char *name,
 	if (s->sha1)
 		hikset_insert_key(upload_stats_by_sha1, &s->sha1);
 	gcu_upload_stats_gui_add(s);
+
+	return s;
 }
 
-void G_COLD
-upload_stats_load_history(void)
+/**
+ * Record that statistics for an entry changed, so that it is appended to
+ * the journal at the next flush.
+ */
+static void
+upload_stats_changed_add(struct ul_stats *s)
 {
-	FILE *upload_stats_file;
-	file_path_t fp;
-	char line[FILENAME_MAX + 64];
-	uint lineno = 0;
+	if (NULL == upload_stats_changed)
+		upload_stats_changed = hash_list_new(pointer_hash, NULL);
 
-	gcu_upload_stats_gui_freeze();
+	if (!hash_list_contains(upload_stats_changed, s))
+		hash_list_append(upload_stats_changed, s);
 
-	file_path_set(&fp, settings_config_dir(), ul_stats_file);
+	dirty = TRUE;		/* Request asynchronous save of stats */
+}
 
-	/* open file for reading */
-	upload_stats_file = file_config_open_read(ul_stats_what, &fp, 1);
-	if (upload_stats_file == NULL)
-		goto done;
+/**
+ * Update an existing entry with the values read from the journal.
+ */
+static void
+upload_stats_replay(struct ul_stats *s, const struct ul_stats *item)
+{
+	if (0 != strcmp(s->pathname, item->pathname)) {
+		hash_list_remove(upload_stats_list, s);
+		atom_str_change(&s->pathname, item->pathname);
+		atom_str_change(&s->filename, item->filename);
+		hash_list_append(upload_stats_list, s);
+		gcu_upload_stats_gui_update_name(s);
+	}
+
+	s->attempts = item->attempts;
+	s->complete = item->complete;
+	s->bytes_sent = item->bytes_sent;
+	s->norm = s->size > 0 ? 1.0 * s->bytes_sent / s->size : 0.0;
+	s->rtime = item->rtime;
+	s->dtime = item->dtime;
+
+	gcu_upload_stats_gui_update(s);
+}
+
+/**
+ * Load upload statistics from opened file.
+ *
+ * @param f			the file to read from
+ * @param journal	whether we are replaying the journal
+ *
+ * @return amount of lines read.
+ */
+static uint G_COLD
+upload_stats_load(FILE *f, bool journal)
+{
+	char line[FILENAME_MAX + 64];
+	uint lineno = 0;
 
 	/* parse, insert names into ul_stats_clist */
-	while (fgets(ARYLEN(line), upload_stats_file)) {
+	while (fgets(ARYLEN(line), f)) {
 		static const struct ul_stats zero_item;
 		struct ul_stats item;
 		struct sha1 sha1_buf;
@@ -320,7 +372,18 @@ upload_stats_load_history(void)
 						filepath_basename(item.pathname), UNI_NORM_NFC, NULL);
 		}
 
-		if (upload_stats_find(NULL, item.pathname, item.size)) {
+		if (journal) {
+			struct ul_stats *s =
+				upload_stats_find(item.sha1, item.pathname, item.size);
+
+			if (s != NULL) {
+				upload_stats_replay(s, &item);
+			} else {
+				upload_stats_add(item.pathname, item.size, item.filename,
+					item.attempts, item.complete, item.bytes_sent,
+					item.rtime, item.dtime, item.sha1);
+			}
+		} else if (upload_stats_find(NULL, item.pathname, item.size)) {
 			g_warning("%s(): ignoring line %u due to duplicate file.",
 				G_STRFUNC, lineno);
 		} else if (upload_stats_find(item.sha1, item.pathname, item.size)) {
@@ -334,15 +397,44 @@ upload_stats_load_history(void)
 		continue;
 
 	corrupted:
-		g_warning("upload statistics file corrupted at line %u.", lineno);
+		g_warning("upload statistics %s corrupted at line %u.",
+			journal ? "journal" : "file", lineno);
 	}
 
-	/* close file */
-	fclose(upload_stats_file);
+	return lineno;
+}
+
+void G_COLD
+upload_stats_load_history(void)
+{
+	FILE *upload_stats_file;
+	file_path_t fp;
+	char *path;
+
+	gcu_upload_stats_gui_freeze();
+
+	file_path_set(&fp, settings_config_dir(), ul_stats_file);
+
+	/* open file for reading */
+	upload_stats_file = file_config_open_read(ul_stats_what, &fp, 1);
+	if (upload_stats_file != NULL) {
+		upload_stats_load(upload_stats_file, FALSE);
+		fclose(upload_stats_file);
+	}
+
+	/*
+	 * Replay the journal, holding changes since the file was last written.
+	 */
+
+	path = make_pathname(settings_config_dir(), ul_stats_log);
+	upload_stats_file = file_fopen_missing(path, "r");
+	if (upload_stats_file != NULL) {
+		journal_lines = upload_stats_load(upload_stats_file, TRUE);
+		fclose(upload_stats_file);
+	}
+	HFREE_NULL(path);
 
-done:
 	gcu_upload_stats_gui_thaw();
-	return;
 }
 
 static void
@@ -426,20 +518,94 @@ upload_stats_dump_history(void)
 		hash_list_foreach(upload_stats_list, upload_stats_dump_item, out);
 	}
 
-	file_config_close(out, &fp);
+	/*
+	 * Once the whole file is safely written, the journal is obsolete.
+	 */
+
+	if (file_config_close(out, &fp)) {
+		char *path = make_pathname(settings_config_dir(), ul_stats_log);
+
+		if (-1 == unlink(path) && ENOENT != errno)
+			g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, path);
+
+		HFREE_NULL(path);
+		journal_lines = 0;
+		rewrite = FALSE;
+		if (upload_stats_changed != NULL)
+			hash_list_clear(upload_stats_changed);
+	}
+
 	dirty = FALSE;
 }
 
+/**
+ * Append the entries that changed since the last flush to the journal.
+ *
+ * @return TRUE if OK, FALSE if the journal could not be written.
+ */
+static bool
+upload_stats_append_journal(void)
+{
+	FILE *out;
+	char *path;
+	size_t count;
+	bool ok = TRUE;
+
+	count = NULL == upload_stats_changed ?
+		0 : hash_list_count(upload_stats_changed);
+
+	if (0 == count)
+		return TRUE;
+
+	path = make_pathname(settings_config_dir(), ul_stats_log);
+	out = file_fopen(path, "a");
+	HFREE_NULL(path);
+
+	if (NULL == out)
+		return FALSE;
+
+	hash_list_foreach(upload_stats_changed, upload_stats_dump_item, out);
+
+	if (ferror(out))
+		ok = FALSE;
+	if (0 != fclose(out))
+		ok = FALSE;
+
+	if (ok) {
+		journal_lines += count;
+		hash_list_clear(upload_stats_changed);
+	}
+
+	return ok;
+}
+
 /**
  * Called on a periodic basis to flush the statistics to disk if changed
  * since last call.
+ *
+ * Changes are normally appended to the journal, to avoid rewriting all the
+ * statistics each time.  The journal is compacted into the main file when
+ * it holds more lines than there are entries.
  */
 void
 upload_stats_flush_if_dirty(void)
 {
+	size_t entries;
+
 	if (!dirty)
 		return;
 
+	entries = NULL == upload_stats_list ? 0 : hash_list_count(upload_stats_list);
+
+	if (
+		!rewrite &&
+		journal_lines < MAX(entries, UPLOAD_STATS_COMPACT_MIN) &&
+		upload_stats_append_journal()
+	) {
+		dirty = FALSE;
+		return;
+	}
+
 	upload_stats_dump_history();
 }
 
@@ -483,6 +649,7 @@ upload_stats_enforce_local_filename(const shared_file_t *sf)
 	hash_list_append(upload_stats_list, s);
 
 	gcu_upload_stats_gui_update_name(s);
+	upload_stats_changed_add(s);
 }
 
 /**
@@ -506,7 +673,7 @@ upload_stats_file_begin(const shared_file_t *sf)
 
 	/* increment the attempted counter */
 	if (NULL == s) {
-		upload_stats_add(pathname, size, shared_file_name_nfc(sf),
+		s = upload_stats_add(pathname, size, shared_file_name_nfc(sf),
 			1, 0, 0, tm_time(), 0, sha1);
 	} else {
 		s->attempts++;
@@ -514,7 +681,7 @@ upload_stats_file_begin(const shared_file_t *sf)
 		gcu_upload_stats_gui_update(s);
 	}
 
-	dirty = TRUE;		/* Request asynchronous save of stats */
+	upload_stats_changed_add(s);
 }
 
 /**
@@ -546,7 +713,7 @@ upload_stats_file_add(
 	/* increment the completed counter */
 	if (NULL == s) {
 		/* uh oh, row has since been deleted, add it: 1 attempt */
-		upload_stats_add(pathname, size, shared_file_name_nfc(sf),
+		s = upload_stats_add(pathname, size, shared_file_name_nfc(sf),
 			1, comp, sent, tm_time(), tm_time(), sha1);
 	} else {
 		s->bytes_sent += sent;
@@ -559,7 +726,7 @@ upload_stats_file_add(
 		gcu_upload_stats_gui_update(s);
 	}
 
-	dirty = TRUE;		/* Request asynchronous save of stats */
+	upload_stats_changed_add(s);
 }
 
 /**
@@ -610,6 +777,8 @@ upload_stats_prune_nonexistent(void)
 static void G_COLD
 upload_stats_free_all(void)
 {
+	hash_list_free(&upload_stats_changed);
+
 	if (upload_stats_list) {
 		struct ul_stats *s;
 
@@ -626,6 +795,7 @@ upload_stats_free_all(void)
 		hikset_free_null(&upload_stats_by_sha1);
 	}
 	dirty = TRUE;
+	rewrite = TRUE;		/* Journal would resurrect cleared entries */
 }
 
 /**
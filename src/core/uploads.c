@@ -61,6 +61,7 @@
 #include "sockets.h"
 #include "spam.h"
 #include "thex_upload.h"
+#include "tls_common.h"
 #include "tth_cache.h"
 #include "ipp_cache.h"
 #include "tx_deflate.h"
@@ -120,6 +121,7 @@
 #include "lib/override.h"	/* Must be the last header included */
 
 #define READ_BUF_SIZE	(64 * 1024)	/**< Read buffer size, if no sendfile(2) */
+#define READ_AHEAD_SIZE	(1024 * 1024)	/**< Read-ahead window for uploads */
 #define BW_OUT_MIN		1024		/**< Minimum bandwidth to enable uploads */
 #define IO_PRE_STALL	10			/**< Pre-stalling warning */
 #define IO_RTT_STALL	15			/**< Watch for RTT larger than that */
@@ -469,7 +471,8 @@ use_sendfile(struct upload *u)
 {
 	upload_check(u);
 #if defined(HAS_MMAP) || defined(HAS_SENDFILE)
-	return !sendfile_failed && !socket_uses_tls(u->socket);
+	return !sendfile_failed &&
+		(!socket_uses_tls(u->socket) || tls_kernel_offload(u->socket));
 #else
 	return FALSE;
 #endif /* USE_MMAP || HAS_SENDFILE */
@@ -748,6 +751,158 @@ upload_large_followup_rtt(const struct upload *u, time_delta_t d)
 /**
  * Upload heartbeat timer.
  */
+/*
+ * Upload slot scheduling.
+ *
+ * PARQ grants slots on a first-come first-served basis, so a slow downloader
+ * can keep a slot for hours whilst our uplink is mostly idle.  We measure
+ * the sustained rate of each upload, and periodically compare it with its
+ * fair share of the output bandwidth, as given by the bandwidth scheduler.
+ * Uploads which stayed well below their share for too long are demoted back
+ * into PARQ when others are waiting and the uplink is not saturated, letting
+ * their slot go to someone else.
+ *
+ * The amount of concurrent slots is then adjusted to the uplink usage by the
+ * bandwidth-dependent slot override in upload_request().
+ */
+#define UPLOAD_SCHED_PERIOD		10		/**< Scheduling period (secs) */
+#define UPLOAD_SLOW_DELAY		600		/**< Demote when slow for that long */
+#define UPLOAD_SLOW_FRACTION	4		/**< Slow when below 1/4 of fair share */
+#define UPLOAD_SATURATED_PCT	90		/**< Uplink deemed saturated above */
+#define UPLOAD_RATE_SHIFT		3		/**< Rate EMA smoothing factor: 1/8 */
+
+/**
+ * Sample the sending rate of an upload, updating its sustained rate.
+ */
+static void
+upload_rate_update(struct upload *u, time_t now)
+{
+	time_delta_t elapsed = delta_time(now, u->rate_stamp);
+	uint64 bps;
+
+	/*
+	 * The `sent' counter is reset for each new request: restart sampling
+	 * when it went backwards, but keep the sustained rate.
+	 */
+
+	if (0 == u->rate_stamp || u->sent < u->rate_sent) {
+		u->rate_stamp = now;
+		u->rate_sent = u->sent;
+		return;
+	}
+
+	if (elapsed <= 0)
+		return;
+
+	bps = (u->sent - u->rate_sent) / elapsed;
+
+	if (0 == u->avg_bps) {
+		u->avg_bps = bps;
+	} else {
+		u->avg_bps += (bps >> UPLOAD_RATE_SHIFT) -
+			(u->avg_bps >> UPLOAD_RATE_SHIFT);
+	}
+
+	u->rate_stamp = now;
+	u->rate_sent = u->sent;
+}
+
+/**
+ * Demote chronically slow uploads back into PARQ.
+ *
+ * At most one upload, the slowest, is demoted each time, to let the slot
+ * usage settle before reconsidering.
+ */
+static void
+upload_schedule(time_t now)
+{
+	static time_t last_run;
+	struct upload *slowest = NULL;
+	uint64 bw, fair;
+	uint running = 0;
+	pslist_t *sl;
+
+	if (delta_time(now, last_run) < UPLOAD_SCHED_PERIOD)
+		return;
+
+	last_run = now;
+
+	/*
+	 * Without a bandwidth limit, we cannot know whether the uplink is idle.
+	 */
+
+	if (!GNET_PROPERTY(bws_out_enabled))
+		return;
+
+	bw = bsched_bw_per_second(BSCHED_BWS_OUT);
+
+	PSLIST_FOREACH(list_uploads, sl) {
+		const struct upload *u = cast_to_upload(sl->data);
+
+		if (UPLOAD_IS_SENDING(u) && !upload_is_special(u))
+			running++;
+	}
+
+	if (running < 2 || 0 == bw)
+		return;
+
+	fair = bw / running;
+
+	PSLIST_FOREACH(list_uploads, sl) {
+		struct upload *u = cast_to_upload(sl->data);
+
+		if (!UPLOAD_IS_SENDING(u) || upload_is_special(u))
+			continue;
+
+		if (u->avg_bps * UPLOAD_SLOW_FRACTION >= fair) {
+			u->slow_since = 0;
+			continue;
+		}
+
+		if (0 == u->slow_since)
+			u->slow_since = now;
+
+		/*
+		 * Stalling uploads are handled separately, and quick slots are
+		 * short-lived by nature.
+		 */
+
+		if (
+			(u->flags & UPLOAD_F_STALLED) ||
+			parq_upload_lookup_quick(u) ||
+			delta_time(now, u->slow_since) < UPLOAD_SLOW_DELAY
+		)
+			continue;
+
+		if (NULL == slowest || u->avg_bps < slowest->avg_bps)
+			slowest = u;
+	}
+
+	/*
+	 * When uploads are stalling, b/w usage is abnormally low and demoting
+	 * would not help.
+	 */
+
+	if (
+		NULL == slowest ||
+		wd_is_awake(stall_wd) ||
+		0 == parq_upload_waiting() ||
+		bsched_avg_pct(BSCHED_BWS_OUT) >= UPLOAD_SATURATED_PCT
+	)
+		return;
+
+	if (GNET_PROPERTY(upload_debug)) {
+		g_debug("UL demoting \"%s\" to %s (%s): %s/s for %s, fair share %s/s",
+			slowest->name, host_addr_to_string(slowest->addr),
+			upload_vendor_str(slowest),
+			short_size(slowest->avg_bps, FALSE),
+			short_time_ascii(delta_time(now, slowest->slow_since)),
+			short_size2(fair, FALSE));
+	}
+
+	upload_remove(slowest, N_("Demoted, too slow"));
+}
+
 void
 upload_timer(time_t now)
 {
@@ -782,6 +937,8 @@ upload_timer(time_t now)
 		if (!UPLOAD_IS_SENDING(u))
 			goto not_sending;		/* Avoid deep nesting level */
 
+		upload_rate_update(u, now);
+
 		if (delta_time(now, u->last_update) > IO_STALLED) {
 			bool skip = FALSE;
 
@@ -900,6 +1057,8 @@ upload_timer(time_t now)
 			upload_remove(u, N_("Lifetime expired"));
 	}
 	pslist_free(to_remove);
+
+	upload_schedule(now);
 }
 
 struct upload *
@@ -4473,6 +4632,34 @@ upload_http_status_partially_sent(
 	socket_evt_set(u->socket, INPUT_EVENT_WX, upload_write_status, u);
 }
 
+/**
+ * Advise the kernel about the file range we are going to serve next, so that
+ * it can be read ahead whilst we're sending what precedes.
+ *
+ * Each request covers a known range, so we can be more precise than the
+ * kernel's own heuristics, especially for popular files requested by many
+ * sources at different offsets.  We keep the advised window at most
+ * READ_AHEAD_SIZE bytes ahead of the current position, refilling it when
+ * we have consumed half of it.
+ */
+static void
+upload_readahead(struct upload *u)
+{
+	filesize_t from, to;
+
+	if (NULL == u->file || u->pos > u->end)
+		return;
+
+	if (u->readahead > u->end || u->readahead > u->pos + READ_AHEAD_SIZE / 2)
+		return;
+
+	from = MAX(u->pos, u->readahead);
+	to = MIN(u->end + 1, from + READ_AHEAD_SIZE);
+
+	file_object_fadvise_willneed(u->file, from, to - from);
+	u->readahead = to;
+}
+
 /**
  * Handle request for a shared file.
  *
@@ -4836,6 +5023,10 @@ upload_request_for_shared_file(struct upload *u, const header_t *header)
 		return FALSE;
 	}
 
+	u->readahead = u->pos;
+	if (!u->head_only)
+		upload_readahead(u);
+
 	if (!u->head_only)
 		parq_upload_busy(u, u->parq_ul);
 
@@ -6186,6 +6377,8 @@ upload_writable(void *obj, int unused_source, inputevt_cond_t cond)
 		fi_increase_uploaded(u->file_info, written);
 	}
 
+	upload_readahead(u);
+
 	/* This upload is complete */
 	if (u->pos > u->end) {
 
@@ -6466,6 +6659,8 @@ upload_close(void)
 	wd_free_null(&stall_wd);
 	pattern_free_null(&pat_http);
 	pattern_free_null(&pat_applewebkit);
+	browse_host_close_cache();
+	thex_upload_close_cache();
 }
 
 gnet_upload_info_t *
@@ -105,6 +105,8 @@ struct upload {
 	time_t start_date;
 	time_t last_update;
 	time_t last_dmesh;			/**< Time when last download mesh was sent */
+	time_t rate_stamp;			/**< Time of last sending rate sample */
+	time_t slow_since;			/**< When upload became too slow, 0 if not */
 
 	host_addr_t addr;			/**< Remote IP address */
 	host_addr_t gnet_addr;		/**< Advertised remote IP address */
@@ -118,9 +120,12 @@ struct upload {
 	filesize_t skip;			/**< First byte to send, inclusive */
 	filesize_t end;				/**< Last byte to send, inclusive */
 	filesize_t pos;				/**< Read position in file we're sending */
+	filesize_t readahead;		/**< End of range advised for read-ahead */
 	filesize_t sent;			/**< Bytes sent in this request */
 	filesize_t total_requested;	/**< Total amount of bytes requested */
 	filesize_t downloaded;		/**< What they claim as downloaded so far */
+	filesize_t rate_sent;		/**< Value of `sent' at last rate sample */
+	uint64 avg_bps;				/**< Sustained sending rate (EMA), in B/s */
 
 	int http_major;				/**< HTTP major version */
 	int http_minor;				/**< HTTP minor version */
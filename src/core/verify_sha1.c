@@ -35,18 +35,39 @@
 
 #include "verify.h"
 
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/halloc.h"
 #include "lib/misc.h"
 #include "lib/once.h"
 #include "lib/sha1.h"
+#include "lib/tigertree.h"
 
 #include "core/verify_sha1.h"
 
 #include "lib/override.h"	/* Must be the last header included */
 
+/*
+ * When the file will also need its TTH computed, the caller can request
+ * during the VERIFY_START notification that the TTH be computed along,
+ * from the same data blocks, to avoid reading the whole file twice.
+ *
+ * When the leading part of the file was already hashed, the caller can
+ * enqueue the remaining tail only and supply the SHA1 state reached at
+ * that point, during the VERIFY_START notification.
+ */
 static struct {
 	struct verify	*verify;
 	SHA1_context	context;
 	struct sha1		digest;
+	SHA1_context	resume_context;	/**< SHA1 state to resume from */
+	bool			resuming;		/**< Resume from resume_context */
+	TTH_CONTEXT		*tth_context;	/**< Allocated on first need */
+	struct tth		tth_digest;
+	bool			tth_wanted;		/**< TTH requested for next file */
+	bool			tth_running;	/**< Computing TTH for current file */
+	bool			tth_done;		/**< TTH computed for last file */
 } verify_sha1;
 
 static const char *
@@ -60,9 +81,28 @@ verify_sha1_reset(filesize_t amount)
 {
 	int ret;
 
-	(void) amount;
-	ret = SHA1_reset(&verify_sha1.context);
-	g_assert(SHA_SUCCESS == ret);
+	if (verify_sha1.resuming) {
+		verify_sha1.context = verify_sha1.resume_context;
+	} else {
+		ret = SHA1_reset(&verify_sha1.context);
+		g_assert(SHA_SUCCESS == ret);
+	}
+
+	/*
+	 * The TTH needs the whole file, it cannot be computed when resuming.
+	 */
+
+	verify_sha1.tth_running = verify_sha1.tth_wanted && !verify_sha1.resuming;
+	verify_sha1.tth_wanted = FALSE;
+	verify_sha1.resuming = FALSE;
+	verify_sha1.tth_done = FALSE;
+
+	if (verify_sha1.tth_running) {
+		if (NULL == verify_sha1.tth_context)
+			verify_sha1.tth_context = halloc(tt_size());
+		tt_set_threads(GNET_PROPERTY(tth_hashing_threads));
+		tt_init(verify_sha1.tth_context, amount);
+	}
 }
 
 static int
@@ -71,6 +111,10 @@ verify_sha1_update(const void *data, size_t size)
 	int ret;
 
 	ret = SHA1_input(&verify_sha1.context, data, size);
+
+	if (verify_sha1.tth_running)
+		tt_update(verify_sha1.tth_context, data, size);
+
 	return SHA_SUCCESS == ret ? 0 : -1;
 }
 
@@ -80,6 +124,13 @@ verify_sha1_final(void)
 	int ret;
 
 	ret = SHA1_result(&verify_sha1.context, &verify_sha1.digest);
+
+	if (verify_sha1.tth_running) {
+		tt_digest(verify_sha1.tth_context, &verify_sha1.tth_digest);
+		verify_sha1.tth_running = FALSE;
+		verify_sha1.tth_done = TRUE;
+	}
+
 	return SHA_SUCCESS == ret ? 0 : -1;
 }
 
@@ -99,6 +150,23 @@ verify_sha1_enqueue(int high_priority,
 		pathname, 0, filesize, callback, user_data);
 }
 
+/**
+ * Enqueue the tail of a file, starting at ``offset'', for SHA1 computation.
+ *
+ * The callback must supply the SHA1 state reached after hashing the first
+ * ``offset'' bytes via verify_sha1_resume() upon VERIFY_START.
+ */
+int
+verify_sha1_enqueue_tail(int high_priority,
+	const char *pathname, filesize_t offset, filesize_t filesize,
+	verify_callback callback, void *user_data)
+{
+	g_assert(offset <= filesize);
+
+	return verify_enqueue(verify_sha1.verify, high_priority,
+		pathname, offset, filesize - offset, callback, user_data);
+}
+
 const struct sha1 *
 verify_sha1_digest(const struct verify *ctx)
 {
@@ -106,6 +174,57 @@ verify_sha1_digest(const struct verify *ctx)
 	return &verify_sha1.digest;
 }
 
+/**
+ * Supply the SHA1 state from which hashing must resume.
+ *
+ * This can only be called from the callback, upon VERIFY_START.
+ */
+void
+verify_sha1_resume(const struct verify *ctx, const SHA1_context *state)
+{
+	g_return_if_fail(verify_status(ctx) == VERIFY_START);
+	g_assert(state != NULL);
+
+	verify_sha1.resume_context = *state;
+	verify_sha1.resuming = TRUE;
+}
+
+/**
+ * Request that the TTH of the file be computed along with its SHA1.
+ *
+ * This can only be called from the callback, upon VERIFY_START.
+ */
+void
+verify_sha1_want_tth(const struct verify *ctx)
+{
+	g_return_if_fail(verify_status(ctx) == VERIFY_START);
+	verify_sha1.tth_wanted = TRUE;
+}
+
+/**
+ * @return the TTH computed along with the SHA1, NULL if none was requested.
+ */
+const struct tth *
+verify_sha1_tth_digest(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return verify_sha1.tth_done ? &verify_sha1.tth_digest : NULL;
+}
+
+const struct tth *
+verify_sha1_tth_leaves(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return verify_sha1.tth_done ? tt_leaves(verify_sha1.tth_context) : NULL;
+}
+
+size_t
+verify_sha1_tth_leave_count(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
+	return verify_sha1.tth_done ? tt_leave_count(verify_sha1.tth_context) : 0;
+}
+
 static void G_COLD
 verify_sha1_init_once(void)
 {
@@ -130,10 +249,22 @@ verify_sha1_init(void)
 	once_flag_runwait(&initialized, verify_sha1_init_once);
 }
 
+/**
+ * Stops the background task for SHA1 verification.
+ */
 void G_COLD
-verify_sha1_close(void)
+verify_sha1_shutdown(void)
 {
 	verify_free(&verify_sha1.verify);
 }
 
+/**
+ * Release memory resources used by SHA1 verification.
+ */
+void G_COLD
+verify_sha1_close(void)
+{
+	HFREE_NULL(verify_sha1.tth_context);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -41,10 +41,23 @@
 int verify_sha1_enqueue(int high_priority,
 	const char *pathname, filesize_t filesize,
 	verify_callback callback, void *user_data);
+int verify_sha1_enqueue_tail(int high_priority,
+	const char *pathname, filesize_t offset, filesize_t filesize,
+	verify_callback callback, void *user_data);
 
 const struct sha1 *verify_sha1_digest(const struct verify *);
 
+struct tth;
+struct SHA1_context;
+
+void verify_sha1_resume(const struct verify *, const struct SHA1_context *);
+void verify_sha1_want_tth(const struct verify *);
+const struct tth *verify_sha1_tth_digest(const struct verify *);
+const struct tth *verify_sha1_tth_leaves(const struct verify *);
+size_t verify_sha1_tth_leave_count(const struct verify *);
+
 void verify_sha1_init(void);
+void verify_sha1_shutdown(void);
 void verify_sha1_close(void);
 
 #endif	/* _core_verify_sha1_h_ */
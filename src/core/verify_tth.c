@@ -66,8 +66,10 @@ verify_tth_name(void)
 static void
 verify_tth_reset(filesize_t size)
 {
-	if G_LIKELY(verify_tth.context != NULL)
+	if G_LIKELY(verify_tth.context != NULL) {
+		tt_set_threads(GNET_PROPERTY(tth_hashing_threads));
 		tt_init(verify_tth.context, size);
+	}
 }
 
 static int
@@ -158,6 +160,7 @@ verify_tth_shutdown(void)
 void G_COLD
 verify_tth_close(void)
 {
+	tt_close();
 	HFREE_NULL(verify_tth.context);
 }
 
@@ -97,8 +97,6 @@ static gnutella_vendor_t *v_tmp_data = (void *) &v_tmp[GTA_HEADER_SIZE];
 #define VMSG_PAYLOAD_MAX \
 	((sizeof v_tmp) - GTA_HEADER_SIZE - sizeof(gnutella_vendor_t))
 
-static hset_t *hs_vmsg;
-
 /*
  * Vendor message handler.
  */
@@ -141,25 +139,22 @@ vmsg_pmsg_info_check(const struct vmsg_pmsg_info * const pmi)
 	g_assert(VMSG_PMI_MAGIC == pmi->magic);
 }
 
-static uint
-vmsg_hash_func(const void *key)
-{
-	const struct vmsg *vmsg = key;
-	return u32_hash(vmsg->vendor) ^ u16_hash(vmsg->id);
-}
-
-static uint
-vmsg_hash_func2(const void *key)
-{
-	const struct vmsg *vmsg = key;
-	return u32_hash2(vmsg->vendor) ^ u16_hash2(vmsg->id);
-}
+/*
+ * The sorted table of known messages, vmsg_map[], is defined after all
+ * the handlers, so find_message() reaches it through these variables,
+ * which are set by vmsg_init().
+ */
+static const struct vmsg *vmsg_table;
+static size_t vmsg_table_count;
 
-static bool
-vmsg_eq_func(const void *p, const void *q)
+/**
+ * Compare two vendor messages by vendor code and message ID.
+ */
+static int
+vmsg_cmp(const struct vmsg *a, const struct vmsg *b)
 {
-	const struct vmsg *a = p, *b = q;
-	return a->vendor == b->vendor && a->id == b->id;
+	int c = CMP(a->vendor, b->vendor);
+	return 0 != c ? c : CMP(a->id, b->id);
 }
 
 /**
@@ -176,19 +171,31 @@ static bool
 find_message(struct vmsg *vmsg_ptr,
 	vendor_code_t vc, uint16 id, uint16 version)
 {
-	struct vmsg key, *value;
+	struct vmsg key;
 
 	key.vendor = vc.u32;
 	key.id = id;
 
-	value = hset_lookup(hs_vmsg, &key);
-	if (value) {
-		*vmsg_ptr = *value;
-		vmsg_ptr->version = version;
-		return TRUE;
-	} else {
-		return FALSE;
-	}
+	/*
+	 * The vmsg_map[] table is sorted, so a binary search is enough
+	 * to locate the message.  All the versions of a message share the
+	 * same handler, hence we can stop at the first matching entry.
+	 */
+
+#define GET(i)		(&vmsg_table[(i)])
+#define FOUND(i) G_STMT_START {		\
+	*vmsg_ptr = vmsg_table[(i)];	\
+	vmsg_ptr->version = version;	\
+	return TRUE;					\
+} G_STMT_END
+
+	BINARY_SEARCH(const struct vmsg *, &key, vmsg_table_count,
+		vmsg_cmp, GET, FOUND);
+
+#undef FOUND
+#undef GET
+
+	return FALSE;
 }
 
 /**
@@ -3584,11 +3591,20 @@ vmsg_init(void)
 
 	vmsg_init_weight();
 
-	hs_vmsg = hset_create_any(vmsg_hash_func, vmsg_hash_func2, vmsg_eq_func);
+	vmsg_table = vmsg_map;
+	vmsg_table_count = N_ITEMS(vmsg_map);
 
 	for (i = 0; i < N_ITEMS(vmsg_map); i++) {
-		const void *key = &vmsg_map[i];
-		hset_insert(hs_vmsg, key);
+		if (i != 0) {
+			const struct vmsg *prev = &vmsg_map[i - 1];
+			const struct vmsg *e = &vmsg_map[i];
+			int c = vmsg_cmp(prev, e);
+
+			if (c > 0 || (0 == c && prev->version >= e->version)) {
+				g_error("vmsg_map[] unsorted (near %s/%uv%u)",
+					vendor_code_to_string(e->vendor), e->id, e->version);
+			}
+		}
 
 		gnutella_vendor_set_code(weight_key, vmsg_map[i].vendor);
 		gnutella_vendor_set_selector_id(weight_key, vmsg_map[i].id);
@@ -3611,7 +3627,6 @@ vmsg_close(void)
 	head_ping_expire(TRUE);
 	hash_list_free(&head_pings);
 	cq_cancel(&head_ping_ev);
-	hset_free_null(&hs_vmsg);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Preset dictionary for compressed Gnutella connections.
+ *
+ * A deflate stream starts with an empty window, so the first messages sent
+ * on a fresh connection compress poorly: there is nothing yet to refer back
+ * to.  Pre-seeding both ends of the stream with strings that commonly appear
+ * in Gnutella traffic (GGEP extension names, URN prefixes, vendor codes,
+ * XML metadata and popular file extensions) lets even the first query hits
+ * be compressed efficiently.
+ *
+ * Deflate encodes shorter distances with fewer bits, hence the most frequent
+ * strings are listed last, closest to the data being compressed.
+ *
+ * Both sides must use the very same dictionary, which is identified by its
+ * Adler-32 checksum in the zlib stream header.  Its use is negotiated
+ * through the "zdict" X-Features: the contents of the dictionary below must
+ * therefore NEVER be changed without bumping ZDICT_VERSION_MAJOR.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include <zlib.h>
+
+#include "zdict.h"
+
+#include "lib/misc.h"
+#include "lib/once.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+static const char zdict_data[] =
+	/* XML metadata */
+	"<?xml version=\"1.0\"?>"
+	"<audios xsi:noNamespaceSchemaLocation="
+	"\"http://www.limewire.com/schemas/audio.xsd\">"
+	"<audio title=\"\" artist=\"\" album=\"\" genre=\"\" year=\"\" "
+	"bitrate=\"\" seconds=\"\" track=\"\"/></audios>"
+	"<videos xsi:noNamespaceSchemaLocation="
+	"\"http://www.limewire.com/schemas/video.xsd\">"
+	"<video title=\"\" type=\"\" width=\"\" height=\"\" "
+	"length=\"\"/></videos>"
+	"<documents xsi:noNamespaceSchemaLocation="
+	"\"http://www.limewire.com/schemas/document.xsd\">"
+	"<document title=\"\" author=\"\"/></documents>"
+	/* Vendor codes */
+	"BEARLIMEGTKGRAZAMRPHSHRKGNUCACQLMNCTPHEX"
+	/* File extensions */
+	".txt.doc.pdf.zip.rar.iso.exe.jpg.png.gif"
+	".ogg.flac.wav.wma.avi.mkv.mpg.mp4.mp3"
+	/* GGEP extension names */
+	"DHTGTKGV1GTKGV2GTKGIPV6GTKGTLSPRIVDUDPHC"
+	"SCPIPPUDPNLEMFSXQIPHHNAMEPATHTLSA6I6"
+	"LFCTGUEPUSHALTH"
+	/* URN prefixes */
+	"urn:bitprint:urn:tree:tiger/:urn:sha1:";
+
+/**
+ * Get the preset dictionary.
+ *
+ * @param len		where the length of the dictionary is written
+ *
+ * @return the start of the dictionary data.
+ */
+const void *
+zdict_get(size_t *len)
+{
+	g_assert(len != NULL);
+
+	*len = CONST_STRLEN(zdict_data);
+	return zdict_data;
+}
+
+static uint32 zdict_adler;
+static once_flag_t zdict_adler_done;
+
+static void
+zdict_adler_compute(void)
+{
+	zdict_adler = adler32(adler32(0, NULL, 0),
+		(const void *) zdict_data, CONST_STRLEN(zdict_data));
+}
+
+/**
+ * @return the zlib identifier of the dictionary (its Adler-32 checksum).
+ */
+uint32
+zdict_id(void)
+{
+	once_flag_run(&zdict_adler_done, zdict_adler_compute);
+
+	return zdict_adler;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
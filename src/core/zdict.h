@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Preset dictionary for compressed Gnutella connections.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _core_zdict_h_
+#define _core_zdict_h_
+
+#include "common.h"
+
+/*
+ * Version of the dictionary, as advertised in the "zdict" X-Features.
+ * Any change to the dictionary contents requires a new major version.
+ */
+
+#define ZDICT_VERSION_MAJOR		1
+#define ZDICT_VERSION_MINOR		0
+
+/*
+ * Public interface.
+ */
+
+const void *zdict_get(size_t *len);
+uint32 zdict_id(void);
+
+#endif	/* _core_zdict_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -92,8 +92,9 @@
 #include "lib/crash.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/erbtree.h"
 #include "lib/glib-missing.h"
-#include "lib/hikset.h"
+#include "lib/hevset.h"
 #include "lib/hset.h"
 #include "lib/patricia.h"
 #include "lib/pmsg.h"
@@ -140,10 +141,15 @@ enum keyinfo_magic { KEYINFO_MAGIC = 0x79d4de97U };
 
 /**
  * Information about a key we're keeping in core.
+ *
+ * Since we can hold millions of keys, the KUID is stored inline and the
+ * structure is held in a set indexed by that embedded key: this spares us
+ * one KUID atom per key, along with the atom table overhead.
  */
 struct keyinfo {
 	enum keyinfo_magic magic;
-	kuid_t *kuid;				/**< The key (atom) */
+	kuid_t kuid;				/**< The key (embedded) */
+	rbnode_t expire_node;		/**< Embedding in the expiry index */
 	float get_req_load;			/**< EMA of # of (read) requests per period */
 	float store_req_load;		/**< EMA of # of (store) requests per period */
 	time_t next_expire;			/**< Earliest expiration of a value */
@@ -185,7 +191,16 @@ struct keydata {
 /**
  * Hashtable holding information about all the keys we're storing.
  */
-static hikset_t *keys;		/**< KUID => struct keyinfo */
+static hevset_t *keys;		/**< KUID => struct keyinfo */
+
+/**
+ * Expiry index: keyinfo sorted by increasing next_expire.
+ *
+ * Only keys holding values whose expiration time is known are present, that
+ * is keys with a next_expire set to something else than TIME_T_MAX.  This
+ * lets us expire values without traversing all the keys we hold.
+ */
+static erbtree_t keys_expiring;
 
 /**
  * DBM wrapper to store keydata.
@@ -214,13 +229,51 @@ static double decimation_factor[KUID_RAW_BITSIZE];
 
 static void keys_periodic_kball(cqueue_t *cq, void *obj);
 
+/**
+ * Comparison routine for keyinfo within the expiry index.
+ *
+ * Since we cannot have identical items in the red-black tree, compare
+ * keyinfo addresses if the expiration times are identical.
+ */
+static int
+keys_expire_cmp(const void *a, const void *b)
+{
+	const struct keyinfo *ka = a, *kb = b;
+
+	if G_UNLIKELY(ka->next_expire == kb->next_expire)
+		return ptr_cmp(ka, kb);
+
+	return CMP(ka->next_expire, kb->next_expire);
+}
+
+/**
+ * Set the next expiration time of a key, updating the expiry index.
+ *
+ * @param ki		the keyinfo
+ * @param next		the next expiration time, TIME_T_MAX if none
+ */
+static void
+keys_set_next_expire(struct keyinfo *ki, time_t next)
+{
+	if (ki->next_expire == next)
+		return;
+
+	if (ki->next_expire != TIME_T_MAX)
+		erbtree_remove(&keys_expiring, &ki->expire_node);
+
+	ki->next_expire = next;
+
+	if (next != TIME_T_MAX)
+		erbtree_insert(&keys_expiring, &ki->expire_node);
+}
+
 /**
  * @return TRUE if key is stored here.
  */
 bool
 keys_exists(const kuid_t *key)
 {
-	return hikset_contains(keys, key);
+	return hevset_contains(keys, key);
 }
 
 /**
@@ -234,7 +287,7 @@ keys_is_store_loaded(const kuid_t *id)
 
 	g_assert(id);
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 	if (ki == NULL)
 		return FALSE;
 
@@ -428,17 +481,17 @@ keys_reclaim(struct keyinfo *ki, bool can_remove)
 		G_STRFUNC, ki->values, can_remove ? "y" : "n");
 
 	if (GNET_PROPERTY(dht_storage_debug) > 2)
-		g_debug("DHT STORE key %s reclaimed", kuid_to_hex_string(ki->kuid));
+		g_debug("DHT STORE key %s reclaimed", kuid_to_hex_string(&ki->kuid));
 
-	dbmw_delete(db_keydata, ki->kuid);
+	dbmw_delete(db_keydata, &ki->kuid);
 	if (can_remove)
-		hikset_remove(keys, &ki->kuid);
+		hevset_remove(keys, &ki->kuid);
+	keys_set_next_expire(ki, TIME_T_MAX);
 
 	gnet_stats_dec_general(GNR_DHT_KEYS_HELD);
 	if (ki->flags & DHT_KEY_F_CACHED)
 		gnet_stats_dec_general(GNR_DHT_CACHED_KEYS_HELD);
 
-	kuid_atom_free_null(&ki->kuid);
 	ki->magic = 0;
 	WFREE(ki);
 }
@@ -458,7 +511,7 @@ keys_expire_values(struct keyinfo *ki, time_t now)
 	const char *reason = NULL;
 	char buf[80];
 
-	kd = get_keydata(ki->kuid);
+	kd = get_keydata(&ki->kuid);
 	if (NULL == kd) {
 		reason = "cannot retrieve associated keydata";
 		goto discard_key;
@@ -489,7 +542,7 @@ keys_expire_values(struct keyinfo *ki, time_t now)
 			if (kd->expire[i] != expire) {
 				g_warning("DHT KEYS mismatching expire time for value #%d in %s"
 					" (held %u, should have been %u)",
-					i, kuid_to_hex_string(ki->kuid),
+					i, kuid_to_hex_string(&ki->kuid),
 					(uint) kd->expire[i], (uint) expire);
 			}
 		} else {
@@ -499,11 +552,11 @@ keys_expire_values(struct keyinfo *ki, time_t now)
 
 	if (GNET_PROPERTY(dht_storage_debug) > 3)
 		g_debug("DHT STORE key %s has %d expired value%s out of %d",
-			kuid_to_hex_string(ki->kuid), expired, plural(expired),
+			kuid_to_hex_string(&ki->kuid), expired, plural(expired),
 			ki->values);
 
 	if (next_expire != TIME_T_MAX)
-		ki->next_expire = next_expire;	/* Next check, if values remain */
+		keys_set_next_expire(ki, next_expire);	/* Next check, if any */
 
 	/*
 	 * Reclaim expired values, which will call keys_remove_value() for each
@@ -520,7 +573,7 @@ discard_key:
 	 */
 
 	g_warning("DHT KEYS discarding corrupted key %s (%u value%s): %s",
-		kuid_to_hex_string(ki->kuid), ki->values, plural(ki->values),
+		kuid_to_hex_string(&ki->kuid), ki->values, plural(ki->values),
 		reason);
 
 	keys_reclaim(ki, TRUE);
@@ -547,7 +600,7 @@ keys_get_status(const kuid_t *id, bool *full, bool *loaded, bool can_expire)
 	*full = FALSE;
 	*loaded = FALSE;
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 	if (ki == NULL)
 		return;
 
@@ -618,7 +671,7 @@ keys_has(const kuid_t *id, const kuid_t *cid, bool store)
 	struct keydata *kd;
 	uint64 dbkey;
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 	if (ki == NULL)
 		return 0;
 
@@ -658,9 +711,10 @@ keys_remove_value(const kuid_t *id, const kuid_t *cid, uint64 dbkey)
 {
 	struct keyinfo *ki;
 	struct keydata *kd;
+	time_t next_expire;
 	int idx;
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 
 	g_assert(ki);
 
@@ -702,12 +756,14 @@ keys_remove_value(const kuid_t *id, const kuid_t *cid, uint64 dbkey)
 	 * Recompute next expiration time.
 	 */
 
-	ki->next_expire = TIME_T_MAX;
+	next_expire = TIME_T_MAX;
 
 	for (idx = 0; idx < ki->values; idx++) {
-		ki->next_expire = MIN(ki->next_expire, kd->expire[idx]);
+		next_expire = MIN(next_expire, kd->expire[idx]);
 	}
 
+	keys_set_next_expire(ki, next_expire);
+
 	dbmw_write(db_keydata, id, PTRLEN(kd));
 
 	if (GNET_PROPERTY(dht_storage_debug) > 2) {
@@ -730,10 +786,10 @@ keys_update_value(const kuid_t *id, const kuid_t *cid, time_t expire)
 	struct keyinfo *ki;
 	struct keydata *kd;
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 	g_assert(ki != NULL);
 
-	ki->next_expire = MIN(ki->next_expire, expire);
+	keys_set_next_expire(ki, MIN(ki->next_expire, expire));
 	kd = get_keydata(id);
 
 	if (kd != NULL) {
@@ -781,8 +837,9 @@ allocate_keyinfo(const kuid_t *kuid, size_t common)
 
 	WALLOC0(ki);
 	ki->magic = KEYINFO_MAGIC;
-	ki->kuid = kuid_get_atom(kuid);
+	ki->kuid = *kuid;					/* struct copy */
 	ki->common_bits = common & 0xff;
+	ki->next_expire = TIME_T_MAX;		/* Not in expiry index yet */
 
 	return ki;
 }
@@ -805,7 +862,7 @@ keys_add_value(const kuid_t *id, const kuid_t *cid,
 	struct keydata *kd;
 	struct keydata new_kd;
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 
 	/*
 	 * If we're storing the first value under a key, we do not have any
@@ -826,10 +883,10 @@ keys_add_value(const kuid_t *id, const kuid_t *cid,
 				kuid_to_hex_string2(cid));
 
 		ki = allocate_keyinfo(id, common);
-		ki->next_expire = expire;
+		keys_set_next_expire(ki, expire);
 		ki->flags = in_kball ? 0 : DHT_KEY_F_CACHED;
 
-		hikset_insert_key(keys, &ki->kuid);
+		hevset_insert(keys, ki);
 
 		kd = &new_kd;
 		kd->values = 0;						/* will be incremented below */
@@ -906,7 +963,7 @@ keys_add_value(const kuid_t *id, const kuid_t *cid,
 		kd->dbkeys[low] = dbkey;
 		kd->expire[low] = expire;
 
-		ki->next_expire = MIN(ki->next_expire, expire);
+		keys_set_next_expire(ki, MIN(ki->next_expire, expire));
 	}
 
 	kd->values++;
@@ -945,7 +1002,7 @@ keys_get_all(const kuid_t *id, dht_value_t **valvec, int valcnt)
 	g_assert(valvec);
 	g_assert(valcnt > 0);
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 	if (ki == NULL)
 		return 0;
 
@@ -1006,7 +1063,7 @@ keys_get(const kuid_t *id, dht_value_type_t type,
 	g_assert(valcnt > 0);
 	g_assert(loadptr);
 
-	ki = hikset_lookup(keys, id);
+	ki = hevset_lookup(keys, id);
 
 	g_assert(ki);	/* If called, we know the key exists */
 
@@ -1198,15 +1255,8 @@ keys_update_load(void *val, void *u)
 	keyinfo_check(ki);
 
 	/*
-	 * Check for expired values.
-	 */
-
-	if (ctx->now >= ki->next_expire) {
-		if (!keys_expire_values(ki, ctx->now))
-			return TRUE;		/* ki was freed, delete entry */
-	}
-
-	/*
+	 * Expired values were already handled by keys_expire_due().
+	 *
 	 * Collection of empty keys happens in a separate check because we also
 	 * call keys_expire_values() when we get a STORE request, so we can
 	 * have empty keys already when we reach this place.
@@ -1234,28 +1284,74 @@ keys_update_load(void *val, void *u)
 	return FALSE;				/* Node is kept */
 }
 
+/**
+ * Expire values from all the keys whose earliest expiration time is reached.
+ *
+ * The expiry index lets us only visit these keys, the due keys being
+ * collected first since expiring values updates the index.
+ *
+ * @return the amount of keys visited.
+ */
+static size_t
+keys_expire_due(time_t now)
+{
+	pslist_t *due = NULL, *sl;
+	rbnode_t *rn;
+	size_t n = 0;
+
+	for (rn = erbtree_first(&keys_expiring); rn != NULL; rn = erbtree_next(rn)) {
+		struct keyinfo *ki = erbtree_data(&keys_expiring, rn);
+
+		keyinfo_check(ki);
+
+		if (delta_time(now, ki->next_expire) < 0)
+			break;
+
+		due = pslist_prepend(due, ki);
+		n++;
+	}
+
+	/*
+	 * A keyinfo can only be reclaimed by keys_expire_values() when it is
+	 * the one being processed, so the remaining items in the list stay valid.
+	 */
+
+	PSLIST_FOREACH(due, sl) {
+		keys_expire_values(sl->data, now);
+	}
+
+	pslist_free(due);
+
+	return n;
+}
+
 /**
  * Callout queue periodic event for request load updates.
- * Also reclaims dead keys holding no values.
+ * Also expires values and reclaims dead keys holding no values.
  */
 static bool
 keys_periodic_load(void *unused_obj)
 {
 	struct load_ctx ctx;
+	size_t expired;
 
 	(void) unused_obj;
 
 	ctx.values = 0;
 	ctx.now = tm_time();
-	hikset_foreach_remove(keys, keys_update_load, &ctx);
+
+	expired = keys_expire_due(ctx.now);
+	hevset_foreach_remove(keys, keys_update_load, &ctx);
 
 	g_assert_log(values_count() == ctx.values,
 		"values_count()=%zu, ctx.values=%zu", values_count(), ctx.values);
 
 	if (GNET_PROPERTY(dht_storage_debug)) {
-		size_t keys_count = hikset_count(keys);
-		g_debug("DHT holding %zu value%s spread over %zu key%s",
-			ctx.values, plural(ctx.values), keys_count, plural(keys_count));
+		size_t keys_count = hevset_count(keys);
+		g_debug("DHT holding %zu value%s spread over %zu key%s "
+			"(%zu key%s had expiring values)",
+			ctx.values, plural(ctx.values), keys_count, plural(keys_count),
+			expired, plural(expired));
 	}
 
 	return TRUE;		/* Keep calling */
@@ -1437,7 +1533,7 @@ reload_ki(void *key, void *value, size_t u_len, void *data)
 
 	common = kuid_common_prefix(ctx->our_kuid, id);
 	ki = allocate_keyinfo(id, common);
-	hikset_insert_key(keys, &ki->kuid);
+	hevset_insert(keys, ki);
 
 	/*
 	 * Values will be inserted later, just prepare the DB keys we need to
@@ -1458,7 +1554,7 @@ reload_ki(void *key, void *value, size_t u_len, void *data)
 		}
 	}
 
-	ki->next_expire = next_expire;
+	keys_set_next_expire(ki, next_expire);
 
 	return FALSE;		/* Keep keydata */
 }
@@ -1486,7 +1582,7 @@ keys_discard_if_empty(void *key, void *u_data)
 	if (0 == ki->values) {
 		if (GNET_PROPERTY(dht_keys_debug) > 1) {
 			g_debug("DHT KEYS no values retrieved for key %s, discarding",
-				kuid_to_hex_string(ki->kuid));
+				kuid_to_hex_string(&ki->kuid));
 		}
 
 		keys_reclaim(ki, FALSE);
@@ -1524,7 +1620,7 @@ keys_reset_keydata(void *key, void *u_data)
 	(void) u_data;
 
 	ZERO(&kd);
-	dbmw_write(db_keydata, ki->kuid, VARLEN(kd));
+	dbmw_write(db_keydata, &ki->kuid, VARLEN(kd));
 }
 
 /**
@@ -1574,28 +1670,28 @@ keys_init_keyinfo(void)
 	 *		--RAM, 2012-11-17
 	 */
 
-	hikset_foreach(keys, keys_reset_keydata, NULL);
+	hevset_foreach(keys, keys_reset_keydata, NULL);
 	values_init_data(ctx.dbkeys);
 
 	hset_foreach(ctx.dbkeys, keys_free_dbkey, NULL);
 	hset_free_null(&ctx.dbkeys);
 
-	hikset_foreach_remove(keys, keys_discard_if_empty, NULL);
+	hevset_foreach_remove(keys, keys_discard_if_empty, NULL);
 	dbmw_foreach_remove(db_keydata, keys_delete_if_empty, NULL);
 
 	if (!crash_was_restarted())
 		dbstore_compact(db_keydata);
 
-	g_soft_assert_log(hikset_count(keys) == dbmw_count(db_keydata),
+	g_soft_assert_log(hevset_count(keys) == dbmw_count(db_keydata),
 		"keys reloaded: %zu, key data persisted: %zu",
-		hikset_count(keys), dbmw_count(db_keydata));
+		hevset_count(keys), dbmw_count(db_keydata));
 
 	if (GNET_PROPERTY(dht_keys_debug)) {
 		g_debug("DHT KEYS reloaded %zu key%s",
-			hikset_count(keys), plural(hikset_count(keys)));
+			hevset_count(keys), plural(hevset_count(keys)));
 	}
 
-	gnet_stats_set_general(GNR_DHT_KEYS_HELD, hikset_count(keys));
+	gnet_stats_set_general(GNR_DHT_KEYS_HELD, hevset_count(keys));
 }
 
 /**
@@ -1630,14 +1726,19 @@ keys_init(void)
 	keys_periodic_ev = cq_periodic_main_add(LOAD_PERIOD * 1000,
 		keys_periodic_load, NULL);
 
-	keys = hikset_create(
+	keys = hevset_create(
 		offsetof(struct keyinfo, kuid), HASH_KEY_FIXED, KUID_RAW_SIZE);
+	erbtree_init(&keys_expiring, keys_expire_cmp,
+		offsetof(struct keyinfo, expire_node));
 	install_periodic_kball(KBALL_FIRST);
 
 	db_keydata = dbstore_open(db_keywhat, settings_dht_db_dir(), db_keybase,
 		kv, packing, KEYS_DB_CACHE_SIZE, kuid_hash, kuid_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	dbmw_set_mmap(db_keydata, TRUE);	/* Large, randomly accessed */
+	dbstore_set_bloom(db_keydata, settings_dht_db_dir(), db_keybase);
+
 	for (i = 0; i < N_ITEMS(decimation_factor); i++)
 		decimation_factor[i] = pow(KEYS_DECIMATION_BASE, i);
 
@@ -1669,7 +1770,7 @@ keys_offload_prepare(void *val, void *data)
 	struct keyinfo *ki = val;
 	struct offload_context *ctx = data;
 
-	id = ki->kuid;
+	id = &ki->kuid;
 
 	if (!bits_within_kball(ki->common_bits))
 		return;		/* Key not in our k-ball, cached probably */
@@ -1720,7 +1821,7 @@ keys_offload(const knode_t *kn)
 	if (
 		!dht_bootstrapped() ||			/* Not bootstrapped */
 		!keys_within_kball(kn->id) ||	/* Node KUID outside our k-ball */
-		0 == hikset_count(keys)			/* No keys held */
+		0 == hevset_count(keys)			/* No keys held */
 	)
 		return;
 
@@ -1770,12 +1871,12 @@ keys_offload(const knode_t *kn)
 	 * Select offloading candidate keys.
 	 */
 
-	hikset_foreach(keys, keys_offload_prepare, &ctx);
+	hevset_foreach(keys, keys_offload_prepare, &ctx);
 	patricia_destroy(ctx.kclosest);
 
 	if (debug) {
 		g_debug("DHT found %u/%zu offloading candidate%s",
-			ctx.count, hikset_count(keys), plural(ctx.count));
+			ctx.count, hevset_count(keys), plural(ctx.count));
 	}
 
 	if (ctx.count)
@@ -1796,7 +1897,6 @@ keys_free_kv(void *val, void *u_x)
 
 	keyinfo_check(ki);
 
-	kuid_atom_free_null(&ki->kuid);
 	WFREE(ki);
 }
 
@@ -1812,8 +1912,9 @@ keys_close(void)
 	db_keydata = NULL;
 
 	if (keys) {
-		hikset_foreach(keys, keys_free_kv, NULL);
-		hikset_free_null(&keys);
+		erbtree_clear(&keys_expiring);
+		hevset_foreach(keys, keys_free_kv, NULL);
+		hevset_free_null(&keys);
 	}
 
 	kuid_atom_free_null(&kball.furthest);
@@ -61,6 +61,7 @@
 #include "lib/aging.h"
 #include "lib/bigint.h"
 #include "lib/bstr.h"
+#include "lib/halloc.h"
 #include "lib/host_addr.h"
 #include "lib/pmsg.h"
 #include "lib/pslist.h"
@@ -68,6 +69,9 @@
 #include "lib/sectoken.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/thread.h"
+#include "lib/tm.h"
+#include "lib/tpool.h"
 #include "lib/unsigned.h"
 #include "lib/vendors.h"
 #include "lib/vsort.h"
@@ -115,6 +119,36 @@ static aging_table_t *kmsg_aging_pings;
 
 static aging_table_t *kmsg_aging_finds;
 
+/**
+ * Off-thread validation of incoming datagrams.
+ *
+ * Datagrams larger than KMSG_ASYNC_MIN bytes are copied and their Kademlia
+ * header is validated by the thread pool.  Only the messages that passed
+ * these stateless checks come back to the main thread for processing.
+ * Smaller messages are cheaper to validate inline than to hand over.
+ */
+#define KMSG_ASYNC_MIN			256
+
+enum kmsg_job_magic { KMSG_JOB_MAGIC = 0x2d8e16a3 };
+
+struct kmsg_job {
+	enum kmsg_job_magic magic;
+	host_addr_t addr;			/**< Address from which datagram came */
+	uint16 port;				/**< Port from which datagram came */
+	const char *reason;			/**< Why message is invalid, NULL if OK */
+	size_t len;					/**< Length of datagram */
+	char data[1];				/**< Copy of the datagram (extends struct) */
+};
+
+static inline void
+kmsg_job_check(const struct kmsg_job * const kj)
+{
+	g_assert(kj != NULL);
+	g_assert(KMSG_JOB_MAGIC == kj->magic);
+}
+
+static bool kmsg_closed;		/**< Set when DHT messages are shutdown */
+
 /**
  * The aimed length for STORE messages.
  *
@@ -148,6 +182,8 @@ struct kmsg {
 };
 
 static const struct kmsg *kmsg_find(uint8 function);
+static void kmsg_stats_record(uint8 function, size_t len,
+	const tm_nano_t *start);
 
 /**
  * Test whether the Kademlia message can be safely dropped.
@@ -246,7 +282,11 @@ kmsg_handle(knode_t *kn,
 				g_warning("DHT unhandled %s from %s",
 					km->name, knode_to_string(kn));
 		} else {
+			tm_nano_t start;
+
+			tm_precise_time(&start);
 			km->handler(kn, n, header, extlen, payload, len);
+			kmsg_stats_record(function, len, &start);
 		}
 	}
 }
@@ -1785,16 +1825,17 @@ kmsg_send_ping(knode_t *kn, const guid_t *muid)
 }
 
 /**
- * Send find_node(id) message to node.
+ * Build find_node(id) message.
  *
- * @param kn		the node to whom the message should be sent
  * @param id		the ID we wish to look for
  * @param muid		the message ID to use
  * @param mfree		(optional) message free routine to use
  * @param marg		the argument to supply to the message free routine
+ *
+ * @return the message, ready to be sent.
  */
-void
-kmsg_send_find_node(knode_t *kn, const kuid_t *id, const guid_t *muid,
+pmsg_t *
+kmsg_build_find_node(const kuid_t *id, const guid_t *muid,
 	pmsg_free_t mfree, void *marg)
 {
 	pmsg_t *mb;
@@ -1808,7 +1849,24 @@ kmsg_send_find_node(knode_t *kn, const kuid_t *id, const guid_t *muid,
 	pmsg_seek(mb, KDA_HEADER_SIZE);		/* Start of payload */
 	pmsg_write(mb, id->v, KUID_RAW_SIZE);
 	g_assert(0 == pmsg_available(mb));
-	kmsg_send_mb(kn, mb);
+
+	return mb;
+}
+
+/**
+ * Send find_node(id) message to node.
+ *
+ * @param kn		the node to whom the message should be sent
+ * @param id		the ID we wish to look for
+ * @param muid		the message ID to use
+ * @param mfree		(optional) message free routine to use
+ * @param marg		the argument to supply to the message free routine
+ */
+void
+kmsg_send_find_node(knode_t *kn, const kuid_t *id, const guid_t *muid,
+	pmsg_free_t mfree, void *marg)
+{
+	kmsg_send_mb(kn, kmsg_build_find_node(id, muid, mfree, marg));
 }
 
 /**
@@ -2024,31 +2082,63 @@ kmsg_hostile_source(gnutella_node_t *n, const kuid_t *kuid, const guid_t *muid)
 }
 
 /**
- * Main entry point for DHT messages received from UDP.
+ * Stateless validation of the Kademlia header.
  *
- * The Gnutella layer that comes before has validated that the message looked
- * like a valid Gnutella one (i.e. the Gnutella header size is consistent)
- * but has NOT performed hostile address checks (because we want to timeout
- * RPCs early if we get any such messages on an RPC reply).
-
- * Traffic accounting was also done, based on the message being a Gnutella
- * one (in terms of header and payload).
+ * This does not access any global state and can therefore be run by any
+ * thread.
  *
- * Validation of the Kademlia message and its processing is now our problem.
+ * @param data		the head of the message (start of header)
+ * @param len		total length of the message (header + data)
+ *
+ * @return NULL if header is valid, the reason why it is not otherwise.
+ */
+static const char *
+kmsg_header_check(const void *data, size_t len)
+{
+	const kademlia_header_t *header = data;
+
+	if (len < KDA_HEADER_SIZE)
+		return "truncated header";
+
+	if (!kademlia_header_constants_ok(header))
+		return "bad header constants";
+
+	/*
+	 * We know the Gnutella layer has already validated the packet length.
+	 * Therefore this should not happen, but it's a protection against
+	 * something going wrong.
+	 */
+
+	if (kademlia_header_get_size(header) + KDA_HEADER_SIZE != len)
+		return "header size mismatch";
+
+	if (
+		kademlia_header_get_extended_length(header) + (uint) KDA_HEADER_SIZE
+			> len
+	)
+		return "invalid extended header length";
+
+	return NULL;
+}
+
+/**
+ * Process DHT message received from UDP.
  *
  * @param data		the head of the message (start of header)
  * @param len		total length of the message (header + data)
  * @param addr		address from which we received the datagram
  * @param port		port from which we received the datagram
  * @param n			the DHT Gnutella node, for some core function calls
+ * @param reason	if non-NULL, header was already checked and was invalid
+ * @param checked	whether kmsg_header_check() was already run
  */
-void kmsg_received(
+static void
+kmsg_process(
 	const void *data, size_t len,
 	host_addr_t addr, uint16 port,
-	gnutella_node_t *n)
+	gnutella_node_t *n, const char *reason, bool checked)
 {
 	const kademlia_header_t *header = deconstify_pointer(data);
-	char *reason;
 	uint8 major, minor;
 	knode_t *kn;
 	host_addr_t kaddr;
@@ -2074,37 +2164,17 @@ void kmsg_received(
 	}
 
 	/*
-	 * Basic checks on the Kademlia header.
+	 * Basic checks on the Kademlia header, unless already done.
 	 */
 
-	if (len < KDA_HEADER_SIZE) {
-		reason = "truncated header";
-		goto drop;
-	}
-
-	if (!kademlia_header_constants_ok(header)) {
-		reason = "bad header constants";
-		goto drop;
-	}
-
-	/*
-	 * We know the Gnutella layer has already validated the packet length.
-	 * Therefore this should not happen, but it's a protection against
-	 * something going wrong.
-	 */
+	if (!checked)
+		reason = kmsg_header_check(data, len);
 
-	if (kademlia_header_get_size(header) + KDA_HEADER_SIZE != len) {
-		reason = "header size mismatch";
+	if (reason != NULL)
 		goto drop;
-	}
 
 	extended_length = kademlia_header_get_extended_length(header);
 
-	if (extended_length + (uint) KDA_HEADER_SIZE > len) {
-		reason = "invalid extended header length";
-		goto drop;
-	}
-
 	/*
 	 * If evolutions are architected correctly, newer versions should
 	 * be backward compatible with older parsing code...
@@ -2573,6 +2643,120 @@ drop:
 	}
 }
 
+/**
+ * Main entry point for DHT messages received from UDP.
+ *
+ * The Gnutella layer that comes before has validated that the message looked
+ * like a valid Gnutella one (i.e. the Gnutella header size is consistent)
+ * but has NOT performed hostile address checks (because we want to timeout
+ * RPCs early if we get any such messages on an RPC reply).
+
+ * Traffic accounting was also done, based on the message being a Gnutella
+ * one (in terms of header and payload).
+ *
+ * Validation of the Kademlia message and its processing is now our problem.
+ *
+ * @param data		the head of the message (start of header)
+ * @param len		total length of the message (header + data)
+ * @param addr		address from which we received the datagram
+ * @param port		port from which we received the datagram
+ * @param n			the DHT Gnutella node, for some core function calls
+ */
+void
+kmsg_received(
+	const void *data, size_t len,
+	host_addr_t addr, uint16 port,
+	gnutella_node_t *n)
+{
+	kmsg_process(data, len, addr, port, n, NULL, FALSE);
+}
+
+/**
+ * Thread pool routine: validate the datagram held in the job.
+ */
+static void
+kmsg_job_validate(void *arg)
+{
+	struct kmsg_job *kj = arg;
+
+	kmsg_job_check(kj);
+
+	kj->reason = kmsg_header_check(kj->data, kj->len);
+}
+
+/**
+ * Callout queue acknowledgment: process the validated datagram.
+ */
+static void
+kmsg_job_done(void *arg)
+{
+	struct kmsg_job *kj = arg;
+	gnutella_node_t *n;
+
+	kmsg_job_check(kj);
+
+	/*
+	 * The DHT could have been shutdown whilst the datagram was being
+	 * validated, and the pseudo node must be setup again since the
+	 * reception buffer it was pointing to is long gone by now.
+	 */
+
+	if (kmsg_closed)
+		goto done;
+
+	n = node_dht_setup(kj->addr, kj->port, kj->data, kj->len);
+
+	if (n != NULL) {
+		kmsg_process(kj->data, kj->len, kj->addr, kj->port,
+			n, kj->reason, TRUE);
+	}
+
+done:
+	kj->magic = 0;
+	hfree(kj);
+}
+
+/**
+ * Asynchronous entry point for DHT messages received from UDP.
+ *
+ * Same as kmsg_received() but large enough messages are copied and their
+ * header validated by the thread pool, processing resuming later from the
+ * main thread.
+ *
+ * @param data		the head of the message (start of header)
+ * @param len		total length of the message (header + data)
+ * @param addr		address from which we received the datagram
+ * @param port		port from which we received the datagram
+ * @param n			the DHT Gnutella node, for some core function calls
+ */
+void
+kmsg_received_async(
+	const void *data, size_t len,
+	host_addr_t addr, uint16 port,
+	gnutella_node_t *n)
+{
+	struct kmsg_job *kj;
+
+	g_assert(len >= GTA_HEADER_SIZE);	/* Valid Gnutella packet at least */
+	g_assert(NODE_IS_DHT(n));
+
+	if (len < KMSG_ASYNC_MIN || !GNET_PROPERTY(enable_dht)) {
+		kmsg_received(data, len, addr, port, n);
+		return;
+	}
+
+	kj = halloc(offsetof(struct kmsg_job, data) + len);
+	kj->magic = KMSG_JOB_MAGIC;
+	kj->addr = addr;
+	kj->port = port;
+	kj->reason = NULL;
+	kj->len = len;
+	memcpy(kj->data, data, len);
+
+	tpool_post_ack(kmsg_job_validate, kj,
+		TEQ_AM_CALLOUT, kmsg_job_done, kj);
+}
+
 static const struct kmsg kmsg_map[] = {
 	{ 0x00,							FALSE, NULL, /* Invalid */	"invalid"	},
 	{ KDA_MSG_PING_REQUEST,			TRUE,  k_handle_ping,		"PING"		},
@@ -2587,6 +2771,95 @@ static const struct kmsg kmsg_map[] = {
 	{ KDA_MSG_STATS_RESPONSE,		FALSE, NULL, /* Obsolete */	"STATS_ACK"	},
 };
 
+/**
+ * Handling statistics, per message function.
+ */
+static struct kmsg_hstats {
+	uint64 count;				/**< Messages handled */
+	uint64 bytes;				/**< Payload bytes handled */
+	uint64 total_ns;			/**< Total handling time, in nanoseconds */
+	uint64 max_ns;				/**< Maximum handling time */
+} kmsg_hstats[N_ITEMS(kmsg_map)];
+
+static time_t kmsg_hstats_since;	/**< When statistics were last reset */
+
+/**
+ * Record handling of a message.
+ *
+ * @param function		the Kademlia message function
+ * @param len			the payload length
+ * @param start			when the handler was invoked
+ */
+static void
+kmsg_stats_record(uint8 function, size_t len, const tm_nano_t *start)
+{
+	struct kmsg_hstats *hs;
+	tm_nano_t end, elapsed;
+	uint64 ns;
+
+	g_assert(function < N_ITEMS(kmsg_hstats));
+
+	tm_precise_time(&end);
+	tm_precise_elapsed(&elapsed, &end, start);
+	ns = (uint64) elapsed.tv_sec * 1000000000UL + elapsed.tv_nsec;
+
+	hs = &kmsg_hstats[function];
+	hs->count++;
+	hs->bytes += len;
+	hs->total_ns += ns;
+	hs->max_ns = MAX(hs->max_ns, ns);
+}
+
+/**
+ * Reset message handling statistics.
+ */
+void
+kmsg_stats_reset(void)
+{
+	ZERO(&kmsg_hstats);
+	kmsg_hstats_since = tm_time();
+}
+
+/**
+ * Get message handling statistics.
+ *
+ * This must be called from the main thread, where messages are handled.
+ *
+ * @param vec		vector to fill, one entry per handled message function
+ * @param cnt		amount of entries in the vector
+ * @param since		if non-NULL, written with time of last statistics reset
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+kmsg_stats_get(kmsg_stats_t *vec, size_t cnt, time_t *since)
+{
+	size_t i, n = 0;
+
+	g_assert(vec != NULL || 0 == cnt);
+	g_assert(thread_is_main());
+
+	for (i = 0; i < N_ITEMS(kmsg_map) && n < cnt; i++) {
+		const struct kmsg_hstats *hs = &kmsg_hstats[i];
+		kmsg_stats_t *ks;
+
+		if (NULL == kmsg_map[i].handler)
+			continue;
+
+		ks = &vec[n++];
+		ks->name = kmsg_map[i].name;
+		ks->count = hs->count;
+		ks->bytes = hs->bytes;
+		ks->total_ns = hs->total_ns;
+		ks->max_ns = hs->max_ns;
+	}
+
+	if (since != NULL)
+		*since = kmsg_hstats_since;
+
+	return n;
+}
+
 /**
  * Find message description based on function.
  */
@@ -2690,6 +2963,9 @@ kmsg_init(void)
 
 	kmsg_aging_finds = aging_make(KMSG_FIND_FREQ,
 		host_addr_hash_func, host_addr_eq_func, wfree_host_addr);
+
+	kmsg_closed = FALSE;
+	kmsg_stats_reset();
 }
 
 /**
@@ -2698,6 +2974,7 @@ kmsg_init(void)
 void
 kmsg_close(void)
 {
+	kmsg_closed = TRUE;
 	aging_destroy(&kmsg_aging_pings);
 	aging_destroy(&kmsg_aging_finds);
 }
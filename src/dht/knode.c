@@ -46,10 +46,13 @@
 #include "core/hostiles.h"
 
 #include "lib/atoms.h"
+#include "lib/endian.h"
+#include "lib/halloc.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/vendors.h"
 #include "lib/walloc.h"
+#include "lib/xsort.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -501,4 +504,177 @@ knode_still_alive_probability(const knode_t *kn)
 	}
 }
 
+/**
+ * XOR distance of a node to a target, split into machine words.
+ *
+ * The 160-bit KUID is handled as two 64-bit lanes followed by a 32-bit one,
+ * all read big-endian so that comparing the lanes in order is the same as
+ * comparing the distances as 160-bit numbers.
+ */
+struct knode_dist {
+	uint64 hi, mid;
+	uint32 lo;
+	knode_t *kn;
+};
+
+/**
+ * Compute the XOR distance of node to the target KUID.
+ */
+static inline void
+knode_dist_compute(struct knode_dist *d, const kuid_t *id, knode_t *kn)
+{
+	const uchar *a = id->v, *b = kn->id->v;
+
+	d->hi  = peek_be64(&a[0])  ^ peek_be64(&b[0]);
+	d->mid = peek_be64(&a[8])  ^ peek_be64(&b[8]);
+	d->lo  = peek_be32(&a[16]) ^ peek_be32(&b[16]);
+	d->kn  = kn;
+}
+
+/**
+ * Compare two XOR distances.
+ */
+static inline int
+knode_dist_cmp3(const struct knode_dist *a, const struct knode_dist *b)
+{
+	if (a->hi != b->hi)
+		return a->hi < b->hi ? -1 : +1;
+	if (a->mid != b->mid)
+		return a->mid < b->mid ? -1 : +1;
+	return CMP(a->lo, b->lo);
+}
+
+/**
+ * xsort() callback for XOR distances.
+ */
+static int
+knode_dist_cmp(const void *a, const void *b)
+{
+	return knode_dist_cmp3(a, b);
+}
+
+/**
+ * Select the k nodes closest to a target KUID.
+ *
+ * Upon return, the first MIN(k, kcnt) entries of the vector are the closest
+ * nodes, sorted by increasing XOR distance to the target.  The remaining
+ * entries hold the other nodes, in no particular order.
+ *
+ * This is a partial sort: only the k closest entries are kept sorted as we
+ * scan the vector, which is cheaper than a full sort or a metric iteration
+ * over a PATRICIA tree when k is small compared to the amount of nodes.
+ *
+ * @param id		the target KUID
+ * @param kvec		the vector of nodes, re-ordered in place
+ * @param kcnt		amount of nodes in the vector
+ * @param k			amount of closest nodes we want
+ *
+ * @return the amount of sorted nodes at the head of the vector.
+ */
+size_t
+knode_closest_select(const kuid_t *id, knode_t **kvec, size_t kcnt, size_t k)
+{
+	struct knode_dist buf[KDA_K * 2], *dvec;
+	size_t i, n;
+
+	g_assert(id != NULL);
+	g_assert(kvec != NULL || 0 == kcnt);
+
+	n = MIN(k, kcnt);
+	if G_UNLIKELY(0 == n)
+		return 0;
+
+	if (kcnt <= N_ITEMS(buf))
+		dvec = buf;
+	else
+		HALLOC_ARRAY(dvec, kcnt);
+
+	for (i = 0; i < kcnt; i++) {
+		knode_check(kvec[i]);
+		knode_dist_compute(&dvec[i], id, kvec[i]);
+	}
+
+	xsort(dvec, n, sizeof dvec[0], knode_dist_cmp);
+
+	/*
+	 * Any entry closer than the farthest of the n selected ones is swapped
+	 * with it and moved into place, so the vector remains a permutation of
+	 * the original nodes.
+	 */
+
+	for (i = n; i < kcnt; i++) {
+		struct knode_dist tmp;
+		size_t j;
+
+		if (knode_dist_cmp3(&dvec[i], &dvec[n - 1]) >= 0)
+			continue;
+
+		tmp = dvec[i];
+		dvec[i] = dvec[n - 1];
+
+		for (j = n - 1; j > 0 && knode_dist_cmp3(&tmp, &dvec[j - 1]) < 0; j--)
+			dvec[j] = dvec[j - 1];
+
+		dvec[j] = tmp;
+	}
+
+	for (i = 0; i < kcnt; i++)
+		kvec[i] = dvec[i].kn;
+
+	if (dvec != buf)
+		HFREE_NULL(dvec);
+
+	return n;
+}
+
+/**
+ * PATRICIA iterator callback to collect knodes in a vector.
+ */
+static void
+knode_collect(void *key, size_t keybits, void *value, void *u)
+{
+	knode_t ***kp = u;
+
+	(void) key;
+	(void) keybits;
+
+	*(*kp)++ = value;
+}
+
+/**
+ * Get the k nodes closest to a target KUID from a PATRICIA tree whose
+ * values are knodes.
+ *
+ * @param pt		the PATRICIA tree
+ * @param id		the target KUID
+ * @param k			amount of closest nodes we want
+ * @param count		where the amount of returned nodes is written
+ *
+ * @return a vector of nodes sorted by increasing XOR distance to the
+ * target, which must be freed with hfree(), or NULL if the tree was empty.
+ */
+knode_t **
+knode_closest(const patricia_t *pt, const kuid_t *id, size_t k, size_t *count)
+{
+	knode_t **kvec, **kp;
+	size_t n;
+
+	g_assert(count != NULL);
+
+	n = patricia_count(pt);
+	if (0 == n) {
+		*count = 0;
+		return NULL;
+	}
+
+	HALLOC_ARRAY(kvec, n);
+	kp = kvec;
+	patricia_foreach(pt, knode_collect, &kp);
+
+	g_assert(ptr_diff(kp, kvec) == n * sizeof kvec[0]);
+
+	*count = knode_closest_select(id, kvec, n, k);
+	return kvec;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -38,6 +38,8 @@
 
 #include "if/dht/knode.h"
 
+#include "lib/patricia.h"
+
 #define KNODE_MAX_TIMEOUTS	5			/**< Max is 5 timeouts in a row */
 
 /*
@@ -56,6 +58,11 @@ bool knode_is_usable(const knode_t *kn);
 bool knode_addr_is_usable(const knode_t *kn);
 double knode_still_alive_probability(const knode_t *kn);
 
+size_t knode_closest_select(const kuid_t *id,
+	knode_t **kvec, size_t kcnt, size_t k);
+knode_t **knode_closest(const patricia_t *pt,
+	const kuid_t *id, size_t k, size_t *count);
+
 #endif /* _dht_knode_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -57,6 +57,7 @@
 #include "lib/bstr.h"
 #include "lib/cq.h"
 #include "lib/cstr.h"
+#include "lib/halloc.h"
 #include "lib/hashlist.h"
 #include "lib/host_addr.h"
 #include "lib/htable.h"
@@ -75,6 +76,7 @@
 #include "lib/vendors.h"
 #include "lib/vsort.h"
 #include "lib/walloc.h"
+#include "lib/xsort.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -85,6 +87,18 @@
 #define NL_FIND_DELAY		5000	/* 5 seconds, in ms */
 #define NL_VAL_DELAY		1000	/* 1 second, in ms */
 
+/**
+ * Adaptive parallelism.
+ *
+ * Each lookup starts with KDA_ALPHA concurrent RPCs.  Timeouts and replies
+ * much slower than the average of the lookup increase the parallelism, so
+ * that a few unresponsive nodes do not stall the whole lookup.  Fast replies
+ * bring it back down when the timeout rate is low.
+ */
+#define NL_MIN_ALPHA		KDA_ALPHA
+#define NL_MAX_ALPHA		(2 * KDA_ALPHA)
+#define NL_SLOW_RTT			2		/* Slow if RTT is twice the average */
+
 /**
  * Maximum number of nodes from a class C network that we can return in
  * the lookup path.  This is a way to fight against ID attacks (known as
@@ -228,6 +242,8 @@ struct nlookup {
 	int rpc_timeouts;			/**< Amount of RPC timeouts */
 	int rpc_bad;				/**< Amount of bad RPC replies */
 	int rpc_replies;			/**< Amount of valid RPC replies */
+	int alpha;					/**< Current parallelism degree */
+	uint32 rtt;					/**< Smoothed RPC round-trip time (ms) */
 	int bw_outgoing;			/**< Amount of outgoing bandwidth used */
 	int bw_incoming;			/**< Amount of incoming bandwidth used */
 	int udp_drops;				/**< Amount of UDP packet drops */
@@ -269,6 +285,7 @@ struct nlookup {
 #define NL_F_PASV_PROTECT	(1U << 5)	/**< Passive protection triggered */
 #define NL_F_ACTV_PROTECT	(1U << 6)	/**< Active protection triggered */
 #define NL_F_KBALL_CHECK	(1U << 7)	/**< Checked kball probability */
+#define NL_F_PIPELINE		(1U << 8)	/**< Iterating with RPCs pending */
 
 static inline void
 lookup_check(const nlookup_t *nl)
@@ -481,9 +498,9 @@ static lookup_rs_t *
 lookup_create_results(nlookup_t *nl)
 {
 	lookup_rs_t *rs;
-	patricia_iter_t *iter;
+	knode_t **kvec;
 	size_t len;
-	size_t i = 0;
+	size_t i;
 
 	lookup_check(nl);
 
@@ -494,17 +511,18 @@ lookup_create_results(nlookup_t *nl)
 	WALLOC_ARRAY(rs->path, len);
 	rs->path_len = len;
 
-	iter = patricia_metric_iterator_lazy(nl->path, nl->kuid, TRUE);
+	kvec = knode_closest(nl->path, nl->kuid, len, &len);
 
-	while (patricia_iter_has_next(iter)) {
-		knode_t *kn = patricia_iter_next_value(iter);
+	g_assert(len == rs->path_len);
+
+	for (i = 0; i < len; i++) {
+		knode_t *kn = kvec[i];
 		lookup_token_t *ltok = map_lookup(nl->tokens, kn->id);
 		lookup_rc_t *rc;
 
-		g_assert(i < len);
 		g_assert(ltok != NULL);		/* Tokens collected during lookup */
 
-		rc = &rs->path[i++];
+		rc = &rs->path[i];
 		rc->kn = knode_refcnt_inc(kn);
 		rc->token = ltok->token->v;		/* Becomes owner of token data */
 		rc->token_len = ltok->token->length;
@@ -513,7 +531,7 @@ lookup_create_results(nlookup_t *nl)
 		map_remove(nl->tokens, kn->id);
 	}
 
-	patricia_iterator_release(&iter);
+	HFREE_NULL(kvec);
 
 	lookup_result_check(rs);
 	return rs;
@@ -598,6 +616,79 @@ lookup_result_free(const lookup_rs_t *rs)
 	lookup_free_results(rsm);
 }
 
+/**
+ * Entry used to sort a lookup path by distance to a new target.
+ */
+struct lookup_rc_dist {
+	kuid_t distance;
+	size_t idx;
+};
+
+/**
+ * xsort() callback to sort lookup path entries by increasing distance.
+ */
+static int
+lookup_rc_dist_cmp(const void *a, const void *b)
+{
+	const struct lookup_rc_dist *da = a, *db = b;
+
+	return kuid_cmp(&da->distance, &db->distance);
+}
+
+/**
+ * Create a copy of lookup results, with the path re-ordered by increasing
+ * distance to another KUID.
+ *
+ * This is meant to reuse the results of a STORE roots lookup for a KUID
+ * lying in the same region of the keyspace as the original target, where
+ * the k-closest nodes are nearly the same.
+ *
+ * @param rs		the original lookup results
+ * @param kuid		the new target KUID
+ *
+ * @return new lookup results, to be freed with lookup_result_free().
+ */
+const lookup_rs_t *
+lookup_result_retarget(const lookup_rs_t *rs, const kuid_t *kuid)
+{
+	lookup_rs_t *nrs;
+	struct lookup_rc_dist *dvec;
+	size_t i;
+
+	lookup_result_check(rs);
+	g_assert(kuid != NULL);
+
+	HALLOC_ARRAY(dvec, rs->path_len);
+
+	for (i = 0; i < rs->path_len; i++) {
+		kuid_xor_distance(&dvec[i].distance, rs->path[i].kn->id, kuid);
+		dvec[i].idx = i;
+	}
+
+	xsort(dvec, rs->path_len, sizeof dvec[0], lookup_rc_dist_cmp);
+
+	WALLOC(nrs);
+	nrs->magic = LOOKUP_RESULT_MAGIC;
+	nrs->refcnt = 1;
+	nrs->path_len = rs->path_len;
+	WALLOC_ARRAY(nrs->path, nrs->path_len);
+
+	for (i = 0; i < rs->path_len; i++) {
+		const lookup_rc_t *orc = &rs->path[dvec[i].idx];
+		lookup_rc_t *rc = &nrs->path[i];
+
+		rc->kn = knode_refcnt_inc(orc->kn);
+		rc->token = NULL == orc->token ?
+			NULL : wcopy(orc->token, orc->token_len);
+		rc->token_len = orc->token_len;
+	}
+
+	HFREE_NULL(dvec);
+
+	lookup_result_check(nrs);
+	return nrs;
+}
+
 /**
  * Create value results.
  *
@@ -2072,20 +2163,19 @@ static size_t
 lookup_path_count_prefixes(const nlookup_t *nl,
 	int bmin, size_t prefix[KDA_C + 1])
 {
-	patricia_iter_t *iter;
+	knode_t **kvec;
 	size_t nodes;
-	size_t i;
+	size_t i, n;
 	int bmax = bmin + KDA_C;
 
 	lookup_check(nl);
 
-	iter = patricia_metric_iterator_lazy(nl->path, nl->kuid, TRUE);
+	kvec = knode_closest(nl->path, nl->kuid, KDA_K, &n);
 	nodes = 0;
 	memset(prefix, 0, sizeof prefix[0] * (KDA_C + 1));
-	i = 0;
 
-	while (i++ < KDA_K && patricia_iter_has_next(iter)) {
-		knode_t *kn = patricia_iter_next_value(iter);
+	for (i = 0; i < n; i++) {
+		knode_t *kn = kvec[i];
 		size_t common;
 
 		knode_check(kn);
@@ -2099,7 +2189,7 @@ lookup_path_count_prefixes(const nlookup_t *nl,
 		}
 	}
 
-	patricia_iterator_release(&iter);
+	HFREE_NULL(kvec);
 
 	return nodes;
 }
@@ -2190,7 +2280,7 @@ kullback_leibler_div(const nlookup_t *nl, size_t nodes, int bmin,
 static bool
 lookup_path_is_safe(nlookup_t *nl)
 {
-	patricia_iter_t *iter;
+	knode_t **kvec;
 	size_t prefix[KDA_C + 1];
 	struct kl_item items[KDA_C + 1];
 	plist_t *nodelist[KDA_C + 1];
@@ -2198,7 +2288,7 @@ lookup_path_is_safe(nlookup_t *nl)
 	double dkl, previous_dkl;
 	knode_t *removed_kn;
 	int min_common_bits, max_common_bits;
-	size_t i;
+	size_t i, n;
 	bool shifted = FALSE;
 	bool empty_min_prefix = FALSE;
 	size_t stripped;
@@ -2387,12 +2477,11 @@ compute:
 	 * one list of nodes per prefix size.
 	 */
 
-	iter = patricia_metric_iterator_lazy(nl->path, nl->kuid, TRUE);
+	kvec = knode_closest(nl->path, nl->kuid, KDA_K, &n);
 	ZERO(&nodelist);
-	i = 0;
 
-	while (i++ < KDA_K && patricia_iter_has_next(iter)) {
-		knode_t *kn = patricia_iter_next_value(iter);
+	for (i = 0; i < n; i++) {
+		knode_t *kn = kvec[i];
 		size_t common;
 
 		knode_check(kn);
@@ -2408,7 +2497,7 @@ compute:
 		}
 	}
 
-	patricia_iterator_release(&iter);
+	HFREE_NULL(kvec);
 
 	/*
 	 * Now determine which prefix size contributes the most to the
@@ -3559,6 +3648,79 @@ lk_rpc_cancelled(void *obj, uint32 hop)
 	}
 }
 
+/**
+ * Adjust the parallelism degree of the lookup after an RPC completed.
+ *
+ * @param nl		the node lookup
+ * @param kn		the node to which the RPC was sent
+ * @param type		whether the RPC timed out or got a reply
+ */
+static void
+lookup_adjust_alpha(nlookup_t *nl, const knode_t *kn, enum dht_rpc_ret type)
+{
+	int alpha = nl->alpha;
+
+	if (DHT_RPC_TIMEOUT == type) {
+		alpha++;
+	} else if (kn->rtt != 0) {
+		/*
+		 * The node RTT was just updated by the RPC layer with the duration
+		 * of this RPC, so it is a good indication of how fast it replied.
+		 */
+
+		if (0 == nl->rtt) {
+			nl->rtt = kn->rtt;
+		} else {
+			if (kn->rtt > NL_SLOW_RTT * nl->rtt)
+				alpha++;
+			else if (4 * nl->rpc_timeouts <= nl->rpc_replies)
+				alpha--;
+			nl->rtt += (kn->rtt >> 2) - (nl->rtt >> 2);
+		}
+	}
+
+	alpha = MAX(alpha, NL_MIN_ALPHA);
+	alpha = MIN(alpha, NL_MAX_ALPHA);
+
+	if (alpha != nl->alpha && GNET_PROPERTY(dht_lookup_debug) > 2) {
+		g_debug("DHT LOOKUP[%s] %s parallelism to %d after %s from %s "
+			"(average RTT is %u ms)",
+			nid_to_string(&nl->lid), alpha > nl->alpha ? "raising" : "lowering",
+			alpha, DHT_RPC_TIMEOUT == type ? "timeout" : "reply",
+			knode_to_string(kn), nl->rtt);
+	}
+
+	nl->alpha = alpha;
+}
+
+/**
+ * Iterate whilst RPCs are still pending, sending new requests to replace
+ * the RPCs that timed out or that lag behind, so that a handful of slow
+ * nodes do not hold the whole lookup.
+ *
+ * At most ``alpha'' RPCs are kept in flight.
+ *
+ * @return TRUE if we iterated.
+ */
+static bool
+lookup_pipeline(nlookup_t *nl)
+{
+	lookup_check(nl);
+
+	if (nl->rpc_pending >= nl->alpha)
+		return FALSE;
+
+	if (GNET_PROPERTY(dht_lookup_debug) > 2) {
+		g_debug("DHT LOOKUP[%s] pipelining (%d RPC%s pending, alpha=%d)",
+			nid_to_string(&nl->lid),
+			nl->rpc_pending, plural(nl->rpc_pending), nl->alpha);
+	}
+
+	nl->flags |= NL_F_PIPELINE;		/* Cleared by lookup_iterate() */
+	lookup_iterate(nl);
+	return TRUE;
+}
+
 static void
 lk_handling_rpc(void *obj, enum dht_rpc_ret type,
 	const knode_t *kn, uint32 hop)
@@ -3583,6 +3745,8 @@ lk_handling_rpc(void *obj, enum dht_rpc_ret type,
 	g_assert(removed);
 	knode_refcnt_dec(kn);		/* Was referenced in nl->pending */
 
+	lookup_adjust_alpha(nl, kn, type);
+
 	/*
 	 * If we have a timeout and an alternate address known, try it:
 	 * the node is removed from the queried set and put back in the
@@ -3836,7 +4000,8 @@ lk_iterate(void *obj, enum dht_rpc_ret type, uint32 hop)
 	 * outstanding requests.
 	 *
 	 * Otherwise, after a timeout or when we got a reply from a previous hop,
-	 * we never iterate unless there are no more pending RPCs.
+	 * we never iterate unless there are no more pending RPCs, or unless we
+	 * can pipeline new requests with loose parallelism.
 	 */
 
 	if (
@@ -3845,12 +4010,15 @@ lk_iterate(void *obj, enum dht_rpc_ret type, uint32 hop)
 	) {
 		if (0 == nl->rpc_pending) {
 			lookup_iterate(nl);
-		} else if (GNET_PROPERTY(dht_lookup_debug) > 2) {
-			g_debug("DHT LOOKUP[%s] not iterating on %s (%d pending RPC%s)",
-				nid_to_string(&nl->lid),
-				DHT_RPC_TIMEOUT == type ?
-					"timeout" : "reply from previous hop",
-				nl->rpc_pending, plural(nl->rpc_pending));
+		} else if (LOOKUP_LOOSE != nl->mode || !lookup_pipeline(nl)) {
+			if (GNET_PROPERTY(dht_lookup_debug) > 2) {
+				g_debug("DHT LOOKUP[%s] not iterating on %s "
+					"(%d pending RPC%s)",
+					nid_to_string(&nl->lid),
+					DHT_RPC_TIMEOUT == type ?
+						"timeout" : "reply from previous hop",
+					nl->rpc_pending, plural(nl->rpc_pending));
+			}
 		}
 	} else {
 		lookup_iterate_if_possible(nl);
@@ -3999,17 +4167,22 @@ lookup_async_iterate(nlookup_t *nl)
 static void
 lookup_iterate(nlookup_t *nl)
 {
-	patricia_iter_t *iter;
+	knode_t **kvec;
+	size_t j, n;
 	pslist_t *to_remove = NULL;
 	pslist_t *ignored = NULL;
 	pslist_t *sl;
 	int i = 0;
-	int alpha = KDA_ALPHA;
+	int alpha = nl->alpha;
 	char reason[80];
 	int reason_len;
+	bool pipelined;
 
 	lookup_check(nl);
 
+	pipelined = booleanize(nl->flags & NL_F_PIPELINE);
+	nl->flags &= ~NL_F_PIPELINE;
+
 	if (!dht_enabled()) {
 		lookup_cancel(nl, TRUE);
 		return;
@@ -4029,10 +4202,11 @@ lookup_iterate(nlookup_t *nl)
 	}
 
 	/*
-	 * Enforce bounded parallelism here.
+	 * Enforce bounded parallelism here.  When pipelining, we only replace
+	 * the RPCs that are no longer expected to come back quickly.
 	 */
 
-	if (LOOKUP_BOUNDED == nl->mode) {
+	if (LOOKUP_BOUNDED == nl->mode || pipelined) {
 		alpha -= nl->rpc_pending;
 
 		if (alpha <= 0) {
@@ -4070,13 +4244,14 @@ lookup_iterate(nlookup_t *nl)
 	 */
 
 	reason_len = GNET_PROPERTY(dht_lookup_debug) ? sizeof reason : 0;
-	iter = patricia_metric_iterator_lazy(nl->shortlist, nl->kuid, TRUE);
+	kvec = knode_closest(nl->shortlist, nl->kuid,
+		patricia_count(nl->shortlist), &n);
 
 	nl->flags |= NL_F_SENDING;		/* Protect against synchronous UDP drops */
 	nl->flags &= ~NL_F_UDP_DROP;	/* Clear condition */
 
-	while (i < alpha && patricia_iter_has_next(iter)) {
-		knode_t *kn = patricia_iter_next_value(iter);
+	for (j = 0; i < alpha && j < n; j++) {
+		knode_t *kn = kvec[j];
 
 		if (!knode_can_recontact(kn))
 			continue;
@@ -4102,7 +4277,7 @@ lookup_iterate(nlookup_t *nl)
 	}
 
 	nl->flags &= ~NL_F_SENDING;
-	patricia_iterator_release(&iter);
+	HFREE_NULL(kvec);
 
 	/*
 	 * Remove the nodes to whom we sent a message, or which we want to ignore.
@@ -4265,6 +4440,7 @@ lookup_create(const kuid_t *kuid, lookup_type_t type,
 	nl->arg = arg;
 	nl->expire_ev = cq_main_insert(NL_MAX_LIFETIME, lookup_expired, nl);
 	nl->max_common_bits = KDA_C + dht_get_kball_furthest();
+	nl->alpha = NL_MIN_ALPHA;
 	tm_now_exact(&nl->start);
 
 	htable_insert(nlookups, &nl->lid, nl);
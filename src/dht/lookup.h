@@ -142,6 +142,9 @@ nlookup_t *lookup_token(const knode_t *kn,
 void lookup_ctrl_stats(nlookup_t *nl, lookup_cb_stats_t stats);
 void lookup_cancel(nlookup_t *nl, bool callback);
 
+const lookup_rs_t *lookup_result_retarget(
+	const lookup_rs_t *rs, const kuid_t *kuid);
+
 #endif	/* _dht_lookup_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
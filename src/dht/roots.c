@@ -75,6 +75,7 @@
 #include "lib/crash.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/halloc.h"
 #include "lib/hset.h"
 #include "lib/map.h"
 #include "lib/patricia.h"
@@ -346,7 +347,8 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 		uint64 dbkey;
 	} previous[KDA_K];
 	map_t *existing;
-	patricia_iter_t *iter;
+	knode_t **kvec;
+	size_t j, n;
 	unsigned i;
 	unsigned new = 0, reused = 0;	/* For logging */
 	bool existed = FALSE;			/* For logging */
@@ -425,11 +427,11 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 	 * Now fetch the k-closest roots from the target KUID.
 	 */
 
-	iter = patricia_metric_iterator_lazy(nodes, kuid, TRUE);
+	kvec = knode_closest(nodes, kuid, patricia_count(nodes), &n);
 	i = 0;
 
-	while (patricia_iter_has_next(iter) && i < N_ITEMS(rd->dbkeys)) {
-		knode_t *kn = patricia_iter_next_value(iter);
+	for (j = 0; j < n && i < N_ITEMS(rd->dbkeys); j++) {
+		knode_t *kn = kvec[j];
 		uint64 *dbkey_ptr;
 
 		/*
@@ -484,7 +486,7 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 	}
 
 	rd->count = i;
-	patricia_iterator_release(&iter);
+	HFREE_NULL(kvec);
 
 	/*
 	 * Any remaining entry in ``existing'' was not reused and can be deleted.
@@ -90,6 +90,7 @@
 #include "lib/cq.h"
 #include "lib/file.h"
 #include "lib/getdate.h"
+#include "lib/halloc.h"
 #include "lib/hashlist.h"
 #include "lib/hikset.h"
 #include "lib/host_addr.h"
@@ -107,6 +108,7 @@
 #include "lib/tokenizer.h"
 #include "lib/vendors.h"
 #include "lib/walloc.h"
+#include "lib/xsort.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -170,6 +172,19 @@
 #define REFRESH_PERIOD			(60*60)		/* 1 hour */
 #define OUR_REFRESH_PERIOD		(15*60)		/* 15 minutes */
 
+/*
+ * Warm start.
+ *
+ * When the persisted routing table is too old for us to consider ourselves
+ * bootstrapped, yet recent enough for most of its contacts to be still alive,
+ * we ping a sample of the contacts in each leaf bucket in parallel and declare
+ * the table bootstrapped as soon as enough buckets were confirmed.
+ */
+#define WARM_START_PERIOD		(12*60*60)	/* 12 hours */
+#define WARM_START_PER_BUCKET	2			/* Contacts pinged per bucket */
+#define WARM_START_MIN_PROBA	0.2			/* Skip probably dead contacts */
+#define WARM_START_CONFIRM		2			/* Confirm 1/2 of the buckets */
+
 /*
  * K-bucket node information, accessed through the "kbucket" structure.
  */
@@ -260,15 +275,34 @@ struct other_size {
 
 static bool initialized;		/**< Whether dht_init() was called */
 static enum dht_bootsteps old_boot_status = DHT_BOOT_NONE;
+static bool warm_start_possible;	/**< Persisted table worth checking */
 
 static struct kbucket *root = NULL;	/**< The root of the routing table tree. */
 static kuid_t *our_kuid;			/**< Our own KUID (atom) */
 static struct kstats stats;			/**< Statistics on the routing table */
 
+/**
+ * The buckets on the path from the root to the leaf holding our KUID,
+ * indexed by their depth.  Since the tree is mostly split along our KUID,
+ * this flat array lets us jump right to the subtree covering any KUID,
+ * based on the amount of leading bits it shares with ours.
+ */
+static struct kbucket *our_path[K_BUCKET_MAX_DEPTH + 1];
+static size_t our_path_len;			/**< Valid entries, 0 if invalid */
+
 static const char dht_route_file[] = "dht_nodes";
 static const char dht_route_what[] = "the DHT routing table";
 static const kuid_t kuid_null;
 
+/**
+ * Invalidate the path to our KUID, after the shape of the tree changed.
+ */
+static inline void
+dht_our_path_invalidate(void)
+{
+	our_path_len = 0;
+}
+
 static void bucket_alive_check(cqueue_t *cq, void *obj);
 static void bucket_stale_check(cqueue_t *cq, void *obj);
 static void bucket_refresh(cqueue_t *cq, void *obj);
@@ -1488,6 +1522,266 @@ dht_is_bootstrapping(void)
 		DHT_BOOT_OWN == GNET_PROPERTY(dht_boot_status);
 }
 
+enum warm_start_magic { WARM_START_MAGIC = 0x4f1e2b8dU };
+
+/**
+ * Warm start context.
+ */
+struct warm_start {
+	enum warm_start_magic magic;
+	patricia_t *probed;			/**< KUID (atom) => bucket index + 1 */
+	uint8 *confirmed;			/**< Whether bucket was confirmed */
+	size_t buckets;				/**< Amount of buckets probed */
+	size_t nconfirmed;			/**< Amount of buckets confirmed */
+	size_t pending;				/**< Pending pings */
+	pslist_t *targets;			/**< Nodes to ping (while collecting) */
+	unsigned done:1;			/**< Whether outcome was decided */
+};
+
+static inline void
+warm_start_check(const struct warm_start * const ws)
+{
+	g_assert(ws != NULL);
+	g_assert(WARM_START_MAGIC == ws->magic);
+}
+
+static struct warm_start *warm;		/**< Running warm start, if any */
+
+/**
+ * Contacts selected in a bucket, by decreasing alive probability.
+ */
+struct warm_pick {
+	knode_t *kn[WARM_START_PER_BUCKET];
+	double proba[WARM_START_PER_BUCKET];
+};
+
+static void dht_initiate_bootstrap(void);
+
+/**
+ * Patricia iterator to free KUID atoms used as keys.
+ */
+static void
+warm_start_free_kuid(void *key, size_t u_kbits, void *u_value, void *u_data)
+{
+	(void) u_kbits;
+	(void) u_value;
+	(void) u_data;
+
+	kuid_atom_free(key);
+}
+
+/**
+ * Free warm start context.
+ */
+static void
+warm_start_free(struct warm_start *ws)
+{
+	warm_start_check(ws);
+
+	patricia_foreach(ws->probed, warm_start_free_kuid, NULL);
+	patricia_destroy(ws->probed);
+	HFREE_NULL(ws->confirmed);
+	ws->magic = 0;
+	WFREE(ws);
+
+	if (warm == ws)
+		warm = NULL;
+}
+
+/**
+ * Hash list iterator to select the contacts most likely to be alive.
+ */
+static void
+warm_start_consider(void *data, void *udata)
+{
+	knode_t *kn = data;
+	struct warm_pick *wp = udata;
+	double p;
+	size_t i;
+
+	knode_check(kn);
+
+	p = stable_still_alive_probability(kn->first_seen, kn->last_seen);
+
+	if (p < WARM_START_MIN_PROBA)
+		return;
+
+	for (i = 0; i < N_ITEMS(wp->kn); i++) {
+		if (NULL == wp->kn[i] || p > wp->proba[i]) {
+			size_t j;
+
+			for (j = N_ITEMS(wp->kn) - 1; j > i; j--) {
+				wp->kn[j] = wp->kn[j - 1];
+				wp->proba[j] = wp->proba[j - 1];
+			}
+			wp->kn[i] = kn;
+			wp->proba[i] = p;
+			break;
+		}
+	}
+}
+
+/**
+ * Select the contacts to ping in a leaf bucket.
+ */
+static void
+warm_start_bucket(struct kbucket *kb, void *u)
+{
+	struct warm_start *ws = u;
+	struct warm_pick wp;
+	size_t i;
+
+	if (!is_leaf(kb))
+		return;
+
+	ZERO(&wp);
+	hash_list_foreach(kb->nodes->good, warm_start_consider, &wp);
+	hash_list_foreach(kb->nodes->stale, warm_start_consider, &wp);
+
+	if (NULL == wp.kn[0])
+		return;
+
+	for (i = 0; i < N_ITEMS(wp.kn) && wp.kn[i] != NULL; i++) {
+		knode_t *kn = wp.kn[i];
+
+		patricia_insert(ws->probed, kuid_get_atom(kn->id),
+			size_to_pointer(ws->buckets + 1));
+		ws->targets = pslist_prepend(ws->targets, knode_refcnt_inc(kn));
+	}
+
+	ws->buckets++;
+}
+
+/**
+ * Conclude warm start, falling back to a regular bootstrap on failure.
+ */
+static void
+warm_start_conclude(struct warm_start *ws, bool success)
+{
+	warm_start_check(ws);
+	g_assert(!ws->done);
+
+	ws->done = TRUE;
+
+	if (GNET_PROPERTY(dht_debug)) {
+		g_debug("DHT warm start %s: %zu/%zu bucket%s confirmed",
+			success ? "succeeded" : "failed",
+			ws->nconfirmed, ws->buckets, plural(ws->buckets));
+	}
+
+	if (success) {
+		gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS, DHT_BOOT_COMPLETED);
+		keys_update_kball();
+
+		/*
+		 * Refine knowledge of our closest neighbours, as we would do when
+		 * finalizing a bootstrap.
+		 */
+
+		if (dht_is_active())
+			lookup_find_node(our_kuid, NULL, NULL, NULL);
+	} else {
+		gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS, DHT_BOOT_NONE);
+		dht_initiate_bootstrap();
+	}
+}
+
+/**
+ * RPC callback for warm start pings.
+ */
+static void
+warm_start_ping_cb(enum dht_rpc_ret type,
+	const knode_t *kn,
+	const gnutella_node_t *unused_n,
+	kda_msg_t unused_function,
+	const char *unused_payload, size_t unused_len, void *arg)
+{
+	struct warm_start *ws = arg;
+
+	(void) unused_n;
+	(void) unused_function;
+	(void) unused_payload;
+	(void) unused_len;
+
+	warm_start_check(ws);
+	g_assert(ws->pending != 0);
+
+	ws->pending--;
+
+	if (DHT_RPC_REPLY == type && !ws->done) {
+		size_t idx = pointer_to_size(patricia_lookup(ws->probed, kn->id));
+
+		g_assert(idx <= ws->buckets);
+
+		if (idx != 0 && !ws->confirmed[idx - 1]) {
+			ws->confirmed[idx - 1] = TRUE;
+			ws->nconfirmed++;
+		}
+
+		if (ws->nconfirmed * WARM_START_CONFIRM >= ws->buckets)
+			warm_start_conclude(ws, TRUE);
+	}
+
+	if (0 == ws->pending) {
+		if (!ws->done)
+			warm_start_conclude(ws, FALSE);
+		warm_start_free(ws);
+	}
+}
+
+/**
+ * Attempt a warm start from the persisted routing table.
+ *
+ * @return TRUE if warm start was launched.
+ */
+static bool
+dht_warm_start(void)
+{
+	struct warm_start *ws;
+	pslist_t *sl;
+
+	g_assert(NULL == warm);
+
+	WALLOC0(ws);
+	ws->magic = WARM_START_MAGIC;
+	ws->probed = patricia_create(KUID_RAW_BITSIZE);
+
+	recursively_apply(root, warm_start_bucket, ws);
+
+	if (0 == ws->buckets) {
+		warm_start_free(ws);
+		return FALSE;
+	}
+
+	HALLOC0_ARRAY(ws->confirmed, ws->buckets);
+	warm = ws;
+
+	if (GNET_PROPERTY(dht_debug)) {
+		size_t count = pslist_length(ws->targets);
+		g_debug("DHT warm start: pinging %zu contact%s in %zu bucket%s",
+			count, plural(count), ws->buckets, plural(ws->buckets));
+	}
+
+	gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS, DHT_BOOT_OWN);
+
+	/*
+	 * All the pings are issued before any reply can come back, hence the
+	 * context cannot be freed by the callback whilst we iterate.
+	 */
+
+	ws->pending = pslist_length(ws->targets);
+
+	PSLIST_FOREACH(ws->targets, sl) {
+		knode_t *kn = sl->data;
+
+		dht_rpc_ping(kn, warm_start_ping_cb, ws);
+		knode_free(kn);
+	}
+
+	pslist_free_null(&ws->targets);
+	return TRUE;
+}
+
 /**
  * Initiate DHT bootstrapping.
  */
@@ -1500,6 +1794,17 @@ dht_initiate_bootstrap(void)
 		return;
 	}
 
+	/*
+	 * If the persisted routing table is recent enough, check whether it is
+	 * still usable before launching a whole bootstrap.
+	 */
+
+	if (warm_start_possible) {
+		warm_start_possible = FALSE;
+		if (dht_warm_start())
+			return;
+	}
+
 	if (GNET_PROPERTY(dht_debug))
 		g_debug("DHT attempting bootstrap -- looking for our own KUID");
 
@@ -1592,6 +1897,7 @@ dht_initialize(bool post_init)
 
 	WALLOC0(root);
 	root->ours = TRUE;
+	dht_our_path_invalidate();
 	allocate_node_lists(root);
 	install_bucket_periodic_checks(root, 0);
 
@@ -1698,46 +2004,77 @@ kuid_position(uchar depth, int *byt, uchar *mask)
 }
 
 /**
- * Find bucket responsible for handling the given KUID.
+ * Compute the buckets on the path from the root to the leaf holding our KUID.
  */
-static struct kbucket *
-dht_find_bucket(const kuid_t *id)
+static void
+dht_our_path_compute(void)
 {
-	int i;
 	struct kbucket *kb = root;
-	struct kbucket *result;
 
-	for (i = 0; i < KUID_RAW_SIZE; i++) {
+	g_assert(root != NULL);
+
+	our_path_len = 0;
+
+	for (;;) {
+		int byt;
 		uchar mask;
-		uchar val = id->v[i];
-		int j;
+		struct kbucket *next;
 
-		for (j = 0, mask = 0x80; j < 8; j++, mask >>= 1) {
-			result = (val & mask) ? kb->one : kb->zero;
+		g_assert(our_path_len < N_ITEMS(our_path));
+		g_assert(kb->depth == our_path_len);
 
-			if (result == NULL)
-				goto found;		/* Found the leaf of the tree */
+		our_path[our_path_len++] = kb;
 
-			kb = result;		/* Will need to test one level beneath */
-		}
+		kuid_position(kb->depth, &byt, &mask);
+		next = (our_kuid->v[byt] & mask) ? kb->one : kb->zero;
+
+		if (NULL == next)
+			break;
+
+		kb = next;
 	}
+}
+
+/**
+ * Find bucket responsible for handling the given KUID.
+ */
+static struct kbucket *
+dht_find_bucket(const kuid_t *id)
+{
+	struct kbucket *kb;
+	size_t common;
+
+	if G_UNLIKELY(0 == our_path_len)
+		dht_our_path_compute();
 
 	/*
-	 * It's not possible to come here because at some point above we'll reach
-	 * a leaf node where there is no successor, whatever the bit is...  This
-	 * is guaranteeed at a depth of 160.  Hence the following assertion.
+	 * The bucket on our path at the depth of the leading bits shared by
+	 * the KUID and ours covers the KUID: walk down the tree from there,
+	 * which is immediate for the KUIDs in the subtrees we left when
+	 * splitting along our KUID.
 	 */
 
-	g_assert_not_reached();
+	common = kuid_common_prefix(id, our_kuid);
+	kb = our_path[MIN(common, our_path_len - 1)];
 
-	return NULL;
+	for (;;) {
+		int byt;
+		uchar mask;
+		struct kbucket *result;
+
+		kuid_position(kb->depth, &byt, &mask);
+		result = (id->v[byt] & mask) ? kb->one : kb->zero;
+
+		if (NULL == result)
+			break;		/* Found the leaf of the tree */
+
+		kb = result;	/* Will need to test one level beneath */
+	}
 
 	/*
 	 * Found the bucket, assert it is a leaf node.
 	 */
 
-found:
-
 	g_assert(is_leaf(kb));
 	g_assert(dht_bucket_manages(kb, id));
 
@@ -1967,6 +2304,7 @@ dht_split_bucket(struct kbucket *kb)
 
 	kb->one = one = allocate_child(kb);
 	kb->zero = zero = allocate_child(kb);
+	dht_our_path_invalidate();
 	kb->no_split = FALSE;			/* We're splitting it anyway */
 
 	/*
@@ -3037,6 +3375,7 @@ dht_merge_siblings(struct kbucket *kb, bool forced)
 	 */
 
 	parent->one = parent->zero = NULL;
+	dht_our_path_invalidate();
 	allocate_node_lists(parent);
 
 	parent->no_split = TRUE;	/* Hysteresis: no split until alive check */
@@ -4413,16 +4752,84 @@ dht_size(void)
 }
 
 /**
- * GList sort callback.
+ * A candidate for the closest nodes, along with its distance to the target.
+ */
+struct kclosest {
+	kuid_t distance;			/**< XOR distance to the target KUID */
+	knode_t *kn;				/**< The candidate node */
+};
+
+/**
+ * Context for fill_closest_add().
+ */
+struct kclosest_ctx {
+	struct kclosest *vec;		/**< Candidates */
+	size_t cnt;					/**< Amount of candidates in vector */
+	size_t size;				/**< Size of the vector */
+	const kuid_t *id;			/**< Target KUID */
+	const kuid_t *exclude;		/**< KUID to exclude (NULL if none) */
+	time_t now;					/**< Current time */
+	knode_status_t status;		/**< Status of the scanned list */
+	bool alive;					/**< Whether we want only alive nodes */
+};
+
+/**
+ * Sort callback for closest node candidates: by increasing distance.
  */
 static int
-distance_to(const void *a, const void *b, void *user_data)
+kclosest_cmp(const void *a, const void *b)
 {
-	const knode_t *ka = a;
-	const knode_t *kb = b;
-	const kuid_t *id = user_data;
+	const struct kclosest *ka = a, *kb = b;
 
-	return kuid_cmp3(id, ka->id, kb->id);
+	return kuid_cmp(&ka->distance, &kb->distance);
+}
+
+/**
+ * Hash list iterator callback to record node as a candidate for the
+ * closest nodes, provided it fulfills the criteria for its status.
+ */
+static void
+fill_closest_add(void *data, void *udata)
+{
+	knode_t *kn = data;
+	struct kclosest_ctx *ctx = udata;
+	struct kclosest *kc;
+
+	knode_check(kn);
+	g_assert(ctx->status == kn->status);
+
+	if (ctx->exclude != NULL && kuid_eq(kn->id, ctx->exclude))
+		return;
+
+	switch (kn->status) {
+	case KNODE_GOOD:
+		if (ctx->alive && !(kn->flags & KNODE_F_ALIVE))
+			return;
+		break;
+	case KNODE_STALE:
+		if (knode_still_alive_probability(kn) < ALIVE_PROBA_LOW_THRESH)
+			return;
+		break;
+	case KNODE_PENDING:
+		if (kn->flags & KNODE_F_SHUTDOWNING)
+			return;
+		if (
+			ctx->alive && (
+				!(kn->flags & KNODE_F_ALIVE) ||
+				delta_time(ctx->now, kn->last_seen) >= alive_period()
+			)
+		)
+			return;
+		break;
+	case KNODE_UNKNOWN:
+		g_assert_not_reached();
+	}
+
+	g_assert(ctx->cnt < ctx->size);
+
+	kc = &ctx->vec[ctx->cnt++];
+	kc->kn = kn;
+	kuid_xor_distance(&kc->distance, kn->id, ctx->id);
 }
 
 /**
@@ -4444,14 +4851,33 @@ fill_closest_in_bucket(
 	const kuid_t *id, struct kbucket *kb,
 	knode_t **kvec, int kcnt, const kuid_t *exclude, bool alive)
 {
-	plist_t *nodes = NULL, *good, *l;
+	struct kclosest buf[K_BUCKET_GOOD + K_BUCKET_STALE + K_BUCKET_PENDING];
+	struct kclosest_ctx ctx;
+	size_t i;
 	int added;
-	int available = 0;
 
 	g_assert(id);
 	g_assert(is_leaf(kb));
 	g_assert(kvec);
 
+	/*
+	 * Candidates are gathered in a flat vector along with their distance
+	 * to the target, computed once, so that sorting them does not need
+	 * to chase pointers to the nodes.
+	 */
+
+	ctx.size = hash_list_count(kb->nodes->good) +
+		hash_list_count(kb->nodes->stale) +
+		hash_list_count(kb->nodes->pending);
+	ctx.vec = buf;
+	if G_UNLIKELY(ctx.size > N_ITEMS(buf))
+		HALLOC_ARRAY(ctx.vec, ctx.size);
+	ctx.cnt = 0;
+	ctx.id = id;
+	ctx.exclude = exclude;
+	ctx.now = tm_time();
+	ctx.alive = alive;
+
 	/*
 	 * If we can determine that we do not have enough good nodes in the bucket
 	 * to fill the vector, consider "stale" nodes and then "pending" nodes
@@ -4459,24 +4885,8 @@ fill_closest_in_bucket(
 	 * recently (defined by the aliveness period).
 	 */
 
-	good = hash_list_list(kb->nodes->good);
-
-	while (good != NULL) {
-		knode_t *kn = good->data;
-
-		knode_check(kn);
-		g_assert(KNODE_GOOD == kn->status);
-
-		if (
-			(!exclude || !kuid_eq(kn->id, exclude)) &&
-			(!alive || (kn->flags & KNODE_F_ALIVE))
-		) {
-			nodes = plist_prepend(nodes, kn);
-			available++;
-		}
-
-		good = plist_remove(good, kn);
-	}
+	ctx.status = KNODE_GOOD;
+	hash_list_foreach(kb->nodes->good, fill_closest_add, &ctx);
 
 	/*
 	 * Only stale nodes that are still somewhat likely to be alive are
@@ -4490,56 +4900,17 @@ fill_closest_in_bucket(
 	 */
 
 	if (!alive) {
-		plist_t *stale = hash_list_list(kb->nodes->stale);
-
-		while (stale != NULL) {
-			knode_t *kn = stale->data;
-
-			knode_check(kn);
-			g_assert(KNODE_STALE == kn->status);
-
-			if (
-				(!exclude || !kuid_eq(kn->id, exclude)) &&
-				knode_still_alive_probability(kn) >= ALIVE_PROBA_LOW_THRESH
-			) {
-				nodes = plist_prepend(nodes, kn);
-				available++;
-			}
-
-			stale = plist_remove(stale, kn);
-		}
+		ctx.status = KNODE_STALE;
+		hash_list_foreach(kb->nodes->stale, fill_closest_add, &ctx);
 	}
 
 	/*
 	 * Pending nodes come last, if we miss nodes.
 	 */
 
-	if (available < kcnt) {
-		plist_t *pending = hash_list_list(kb->nodes->pending);
-		time_t now = tm_time();
-
-		while (pending != NULL) {
-			knode_t *kn = pending->data;
-
-			knode_check(kn);
-			g_assert(KNODE_PENDING == kn->status);
-
-			if (
-				!(kn->flags & KNODE_F_SHUTDOWNING) &&
-				(!exclude || !kuid_eq(kn->id, exclude)) &&
-				(!alive ||
-					(
-						(kn->flags & KNODE_F_ALIVE) &&
-						delta_time(now, kn->last_seen) < alive_period()
-					)
-				)
-			) {
-				nodes = plist_prepend(nodes, kn);
-				available++;
-			}
-
-			pending = plist_remove(pending, kn);
-		}
+	if (ctx.cnt < UNSIGNED(kcnt)) {
+		ctx.status = KNODE_PENDING;
+		hash_list_foreach(kb->nodes->pending, fill_closest_add, &ctx);
 	}
 
 	/*
@@ -4547,15 +4918,14 @@ fill_closest_in_bucket(
 	 * insert them in the vector.
 	 */
 
-	nodes = plist_sort_with_data(nodes, distance_to, deconstify_pointer(id));
+	xsort(ctx.vec, ctx.cnt, sizeof ctx.vec[0], kclosest_cmp);
 
-	for (added = 0, l = nodes; l && kcnt; l = plist_next(l)) {
-		*kvec++ = l->data;
-		kcnt--;
-		added++;
+	for (i = 0, added = 0; i < ctx.cnt && added < kcnt; i++) {
+		kvec[added++] = ctx.vec[i].kn;
 	}
 
-	plist_free(nodes);
+	if (ctx.vec != buf)
+		HFREE_NULL(ctx.vec);
 
 	return added;
 }
@@ -4913,6 +5283,18 @@ dht_close(bool exiting)
 	old_boot_status = GNET_PROPERTY(dht_boot_status);
 	gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS, DHT_BOOT_SHUTDOWN);
 
+	/*
+	 * Pending RPCs are discarded without invoking their callbacks, so any
+	 * running warm start will never complete.
+	 */
+
+	if (warm != NULL) {
+		if (DHT_BOOT_OWN == old_boot_status)
+			old_boot_status = DHT_BOOT_NONE;
+		warm_start_free(warm);
+	}
+	warm_start_possible = FALSE;
+
 	/*
 	 * Since we're shutting down the route table, we also need to shut down
 	 * the RPC and lookups, which rely on the routing table.
@@ -4931,6 +5313,7 @@ dht_close(bool exiting)
 
 	recursively_apply(root, dht_free_bucket, NULL);
 	root = NULL;
+	dht_our_path_invalidate();
 	kuid_atom_free_null(&our_kuid);
 
 	for (i = 0; i < K_REGIONS; i++) {
@@ -5581,6 +5964,8 @@ dht_route_parse(FILE *f)
 			boot_status = old_boot_status;
 		}
 		gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS, boot_status);
+		warm_start_possible = DHT_BOOT_SEEDED == boot_status &&
+			most_recent < WARM_START_PERIOD;
 	}
 
 	if (GNET_PROPERTY(dht_debug))
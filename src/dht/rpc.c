@@ -44,6 +44,7 @@
 
 #include "core/guid.h"
 #include "core/gnet_stats.h"
+#include "core/tracing.h"
 
 #include "lib/aging.h"
 #include "lib/atoms.h"
@@ -51,6 +52,7 @@
 #include "lib/gnet_host.h"
 #include "lib/hikset.h"
 #include "lib/host_addr.h"
+#include "lib/pslist.h"
 #include "lib/stacktrace.h"		/* For stacktrace_function_name() */
 #include "lib/stringify.h"
 #include "lib/tm.h"
@@ -79,9 +81,20 @@ struct rpc_cb {
 	dht_rpc_cb_t cb;			/**< Callback routine to invoke */
 	void *arg;					/**< Additional opaque argument */
 	cevent_t *timeout;			/**< Callout queue timeout event */
+	struct rpc_fkey *fkey;		/**< For FIND_NODE: node and target KUIDs */
+	pslist_t *followers;		/**< MUIDs of RPCs coalesced with this one */
 	unsigned lingering:1;		/**< RPC was cancelled / timed out */
 };
 
+/**
+ * Key identifying a FIND_NODE RPC, used to coalesce identical in-flight
+ * requests issued by concurrent lookups.
+ */
+struct rpc_fkey {
+	kuid_t node;				/**< KUID of the node we query */
+	kuid_t target;				/**< KUID we are looking for */
+};
+
 static inline void
 rpc_cb_check(const struct rpc_cb * const rcb)
 {
@@ -91,6 +104,7 @@ rpc_cb_check(const struct rpc_cb * const rcb)
 }
 
 static hikset_t *pending;		/**< Pending RPC (GUID -> rpc_cb) */
+static hikset_t *inflight;		/**< FIND_NODE in flight (rpc_fkey -> rpc_cb) */
 
 /**
  * Table recording the mappings between a KUID and an IP:port, as validated
@@ -264,17 +278,32 @@ dht_rpc_init(void)
 
 	pending = hikset_create(
 		offsetof(struct rpc_cb, muid), HASH_KEY_FIXED, GUID_RAW_SIZE);
+	inflight = hikset_create(
+		offsetof(struct rpc_cb, fkey), HASH_KEY_FIXED, sizeof(struct rpc_fkey));
 
 	rpc_recent = aging_make(DHT_RPC_RECENT_KEEP,
 		kuid_hash, kuid_eq, rpc_free_kuid_addr);
 }
 
+/**
+ * Stop using the RPC as the one to which identical FIND_NODE requests are
+ * coalesced.
+ */
+static void
+rpc_inflight_remove(struct rpc_cb *rcb)
+{
+	if (rcb->fkey != NULL && hikset_lookup(inflight, rcb->fkey) == rcb)
+		hikset_remove(inflight, rcb->fkey);
+}
+
 /**
  * Free the callback waiting indication.
  */
 static void
 rpc_cb_free(struct rpc_cb *rcb, bool in_shutdown)
 {
+	pslist_t *sl;
+
 	rpc_cb_check(rcb);
 
 	if (in_shutdown) {
@@ -288,7 +317,13 @@ rpc_cb_free(struct rpc_cb *rcb, bool in_shutdown)
 		}
 	} else {
 		hikset_remove(pending, rcb->muid);
+		rpc_inflight_remove(rcb);
+	}
+	PSLIST_FOREACH(rcb->followers, sl) {
+		atom_guid_free(sl->data);
 	}
+	pslist_free_null(&rcb->followers);
+	WFREE_NULL(rcb->fkey, sizeof *rcb->fkey);
 	atom_guid_free_null(&rcb->muid);
 	knode_free(rcb->kn);
 	cq_cancel(&rcb->timeout);
@@ -357,6 +392,7 @@ rpc_lingered(cqueue_t *cq, void *obj)
 static void
 rpc_timeout(struct rpc_cb *rcb)
 {
+	rpc_inflight_remove(rcb);		/* Late replies are not dispatched */
 	dht_node_timed_out(rcb->kn);
 
 	/*
@@ -366,6 +402,9 @@ rpc_timeout(struct rpc_cb *rcb)
 
 	knode_rpc_dec(rcb->kn);
 
+	BTRACE(TRACE_DHT_RPC_TIMEOUT, btrace_addr(rcb->addr, rcb->port),
+		rcb->op, tracing_guid(rcb->muid), 0);
+
 	if (rcb->cb != NULL) {
 		if (GNET_PROPERTY(dht_rpc_debug) > 4) {
 			g_debug("DHT RPC %s #%s invoking %s(TIMEOUT, %p)",
@@ -452,6 +491,9 @@ rpc_call_prepare(
 	hikset_insert_key(pending, &rcb->muid);
 	gnet_stats_inc_general(GNR_DHT_RPC_MSG_PREPARED);
 
+	BTRACE(TRACE_DHT_RPC_SEND, btrace_addr(rcb->addr, rcb->port),
+		op, tracing_guid(rcb->muid), delay);
+
 	if (GNET_PROPERTY(dht_rpc_debug) > 4) {
 		g_debug("DHT RPC created %s #%s to %s with callback %s(%p), "
 			"timeout %d ms",
@@ -637,6 +679,7 @@ dht_rpc_answer(const guid_t *muid,
 	struct rpc_cb *rcb;
 	tm_t now;
 	knode_t *rn;		/* Node to which we sent the RPC */
+	pslist_t *followers, *sl;
 
 	knode_check(kn);
 
@@ -772,6 +815,9 @@ dht_rpc_answer(const guid_t *muid,
 	rn->rpc_timeouts = 0;
 	rn->rtt += (tm_elapsed_ms(&now, &rcb->start) >> 1) - (rn->rtt >> 1);
 
+	BTRACE(TRACE_DHT_RPC_REPLY, btrace_addr(rcb->addr, rcb->port),
+		rcb->op, tracing_guid(rcb->muid), tm_elapsed_ms(&now, &rcb->start));
+
 	/*
 	 * If the node from which we got a reply is in the routing table and
 	 * not the same node as `rn', update the rtt there as well.
@@ -823,7 +869,28 @@ dht_rpc_answer(const guid_t *muid,
 		(*rcb->cb)(DHT_RPC_REPLY, rn, n, function, payload, len, rcb->arg);
 	}
 
+	followers = rcb->followers;
+	rcb->followers = NULL;
 	rpc_cb_free(rcb, FALSE);		/* Got a reply, no need to linger */
+
+	/*
+	 * Dispatch the reply to the RPCs that were coalesced with this one:
+	 * they never sent any message and were waiting on our reply.
+	 */
+
+	PSLIST_FOREACH(followers, sl) {
+		const guid_t *fmuid = sl->data;
+
+		if (GNET_PROPERTY(dht_rpc_debug) > 4) {
+			g_debug("DHT RPC dispatching reply to coalesced %s #%s",
+				op_to_string(DHT_RPC_FIND_NODE), guid_to_string(fmuid));
+		}
+
+		dht_rpc_answer(fmuid, kn, n, function, payload, len);
+		atom_guid_free(fmuid);
+	}
+	pslist_free(followers);
+
 	return TRUE;
 }
 
@@ -903,10 +970,59 @@ dht_rpc_find_node(knode_t *kn, const kuid_t *id,
 	pmsg_free_t mfree, void *marg)
 {
 	const guid_t *muid;
+	struct rpc_cb *rcb, *leader;
+	struct rpc_fkey *fkey;
 
 	knode_check(kn);
 
 	muid = rpc_call_prepare(DHT_RPC_FIND_NODE, kn, rpc_delay(kn), 0, cb, arg);
+	rcb = hikset_lookup(pending, muid);
+	rpc_cb_check(rcb);
+
+	WALLOC(fkey);
+	kuid_copy(&fkey->node, kn->id);
+	kuid_copy(&fkey->target, id);
+	rcb->fkey = fkey;
+
+	/*
+	 * If the same FIND_NODE request is already in flight to that node,
+	 * possibly on behalf of another lookup, do not send it again: the
+	 * reply will be dispatched to both RPCs.
+	 *
+	 * Our message is considered sent right away, so that the caller's
+	 * message accounting proceeds as usual.  Should the original RPC time
+	 * out or be cancelled, ours will simply time out as well.
+	 */
+
+	leader = hikset_lookup(inflight, fkey);
+
+	if (
+		leader != NULL &&
+		leader->port == kn->port && host_addr_equiv(leader->addr, kn->addr)
+	) {
+		pmsg_t *mb;
+
+		rpc_cb_check(leader);
+		g_assert(!leader->lingering);
+
+		leader->followers =
+			pslist_prepend(leader->followers, atom_guid_get(muid));
+
+		if (GNET_PROPERTY(dht_rpc_debug) > 3) {
+			g_debug("DHT RPC coalescing %s #%s to %s with #%s",
+				op_to_string(rcb->op), guid_to_string(muid),
+				knode_to_string(kn), guid_hex_str(leader->muid));
+		}
+
+		mb = kmsg_build_find_node(id, muid, mfree, marg);
+		pmsg_mark_sent(mb);
+		pmsg_free(mb);
+		return;
+	}
+
+	if (NULL == leader)
+		hikset_insert_key(inflight, &rcb->fkey);
+
 	kmsg_send_find_node(kn, id, muid, mfree, marg);
 }
 
@@ -1005,6 +1121,7 @@ dht_rpc_close(void)
 {
 	hikset_foreach(pending, rpc_free_kv, NULL);
 	hikset_free_null(&pending);
+	hikset_free_null(&inflight);
 	aging_destroy(&rpc_recent);
 }
 
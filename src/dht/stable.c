@@ -528,7 +528,7 @@ stable_init(void)
 	g_assert(NULL == stable_sync_ev);
 	g_assert(NULL == stable_prune_ev);
 
-	db_lifedata = dbstore_open(db_stable_what, settings_dht_db_dir(),
+	db_lifedata = dbstore_open_lsm(db_stable_what, settings_dht_db_dir(),
 		db_stable_base, kv, packing, STABLE_DB_CACHE_SIZE, kuid_hash, kuid_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
@@ -57,8 +57,11 @@
  * be issued to that node -- that really is up to the lookup logic to decide
  * depending on the replies for FIND_NODE it gets from other contacted nodes.
  *
- * The cache is made of one single DBMW database which maps a KUID target to
- * its latest known security token.
+ * The cache is an in-memory table mapping a KUID target to its latest known
+ * security token.  Tokens only live for a few hours, so there is no point
+ * in paying for database I/O on each STORE: unless the DHT storage is kept
+ * in memory, the table is periodically snapshot to a DBMW database, which
+ * is only used to reload the tokens still valid across restarts.
  *
  * @author Raphael Manfredi
  * @date 2009
@@ -79,6 +82,7 @@
 #include "lib/atoms.h"
 #include "lib/cq.h"
 #include "lib/debug.h"
+#include "lib/hevset.h"
 #include "lib/map.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
@@ -88,14 +92,16 @@
 #include "lib/walloc.h"
 #include "lib/override.h"		/* Must be the last header included */
 
-#define TOK_DB_CACHE_SIZE	4096	/**< Cached amount of tokens */
+#define TOK_DB_CACHE_SIZE	256		/**< Cached amount of snapshot tokens */
 #define TOK_MAP_CACHE_SIZE	64		/**< Amount of SDBM pages to cache */
 #define TOK_LIFE			(5*3600)	/**< Cached token lifetime in seconds */
 
-#define TCACHE_PRUNE_PERIOD	(3600 * 1000)	/**< 1 hour in ms */
+#define TCACHE_PRUNE_PERIOD		(3600 * 1000)	/**< 1 hour in ms */
+#define TCACHE_SNAPSHOT_PERIOD	(600 * 1000)	/**< 10 minutes in ms */
 
 static time_delta_t token_life;		/**< Lifetime of our cached tokens */
 static cperiodic_t *tcache_prune_ev;
+static cperiodic_t *tcache_snapshot_ev;
 
 /**
  * Debugging configuration for the DBM wrapper.
@@ -112,7 +118,8 @@ static dbg_config_t tcache_dbmw_dbg = {
 };
 
 /**
- * DBM wrapper to associate a target KUID its STORE security token.
+ * DBM wrapper to associate a target KUID its STORE security token, holding
+ * the last snapshot of the in-memory cache, NULL when not persisting.
  */
 static dbmw_t *db_tokdata;
 static char db_tcache_base[] = "dht_tokens";
@@ -128,6 +135,21 @@ struct tokdata {
 	void *token;			/**< Token binary data -- walloc()-ed */
 };
 
+/**
+ * A cached security token, as held in memory.
+ *
+ * The token data is allocated along with the structure.
+ */
+struct tcache_entry {
+	kuid_t id;				/**< The target KUID (embedded key) */
+	time_t last_update;		/**< When we last updated the security token */
+	uint8 length;			/**< Token length (0 if none) */
+	char token[1];			/**< Token binary data (extends struct) */
+};
+
+static hevset_t *tokens;	/**< KUID -> struct tcache_entry */
+static bool tcache_dirty;	/**< Whether cache changed since last snapshot */
+
 /**
  * Debugging variables changed.
  */
@@ -139,44 +161,85 @@ tcache_debugging_changed(void)
 }
 
 /**
- * Get tokdata from database, returning NULL if not found.
+ * @return size of the cached entry holding a token of given length.
  */
-static struct tokdata *
-get_tokdata(const kuid_t *id)
+static inline size_t
+tcache_entry_size(uint8 length)
 {
-	struct tokdata *td;
+	return offsetof(struct tcache_entry, token) + length;
+}
 
-	td = dbmw_read(db_tokdata, id, NULL);
+/**
+ * Allocate a new cached entry.
+ */
+static struct tcache_entry *
+tcache_entry_alloc(const kuid_t *id, time_t stamp,
+	const void *token, uint8 length)
+{
+	struct tcache_entry *te;
 
-	if (NULL == td) {
-		if (dbmw_has_ioerr(db_tokdata)) {
-			s_warning_once_per(LOG_PERIOD_MINUTE,
-				"DBMW \"%s\" I/O error, bad things could happen...",
-				dbmw_name(db_tokdata));
-		}
-	}
+	te = walloc(tcache_entry_size(length));
+	te->id = *id;
+	te->last_update = stamp;
+	te->length = length;
+	if (length != 0)
+		memcpy(te->token, token, length);
 
-	return td;
+	return te;
 }
 
 /**
- * Delete known-to-be existing token data for specified KUID from database.
+ * Free cached entry.
  */
 static void
-delete_tokdata(const kuid_t *id)
+tcache_entry_free(struct tcache_entry *te)
 {
-	dbmw_delete(db_tokdata, id);
-	gnet_stats_dec_general(GNR_DHT_CACHED_TOKENS_HELD);
+	wfree(te, tcache_entry_size(te->length));
+}
+
+/**
+ * Insert security token in the cache, superseding any older one.
+ */
+static void
+tcache_insert(const kuid_t *id, time_t stamp, const void *token, uint8 length)
+{
+	struct tcache_entry *te;
 
+	te = hevset_lookup(tokens, id);
+
+	if (te != NULL) {
+		hevset_remove(tokens, id);
+		tcache_entry_free(te);
+	}
+
+	te = tcache_entry_alloc(id, stamp, token, length);
+	hevset_insert(tokens, te);
+	tcache_dirty = TRUE;
+
+	gnet_stats_set_general(GNR_DHT_CACHED_TOKENS_HELD, hevset_count(tokens));
+}
+
+/**
+ * Delete known-to-be existing token data for specified KUID from cache.
+ */
+static void
+delete_tokdata(struct tcache_entry *te)
+{
 	if (GNET_PROPERTY(dht_tcache_debug) > 2)
 		g_debug("DHT TCACHE security token from %s reclaimed",
-			kuid_to_hex_string(id));
+			kuid_to_hex_string(&te->id));
+
+	hevset_remove(tokens, &te->id);
+	tcache_entry_free(te);
+	tcache_dirty = TRUE;
+
+	gnet_stats_dec_general(GNR_DHT_CACHED_TOKENS_HELD);
 
 	if (GNET_PROPERTY(dht_tcache_debug_flags) & DBG_DSF_USR1) {
-		g_debug("DHT TCACHE %s: stats=%s, count=%zu, id=%s",
+		g_debug("DHT TCACHE %s: stats=%s, count=%zu",
 			G_STRFUNC, uint64_to_string(
 				gnet_stats_get_general(GNR_DHT_CACHED_TOKENS_HELD)),
-			dbmw_count(db_tokdata), kuid_to_hex_string(id));
+			hevset_count(tokens));
 	}
 }
 
@@ -229,43 +292,31 @@ free_tokdata(void *valptr, size_t len)
 }
 
 /**
- * Map iterator to record security tokens in the database.
+ * Map iterator to record security tokens in the cache.
  */
 static void
 record_token(void *key, void *value, void *unused_u)
 {
 	kuid_t *id = key;
 	lookup_token_t *ltok = value;
-	struct tokdata td;
+	uint8 length = ltok->token->length;
 
 	(void) unused_u;
 
-	td.last_update = ltok->retrieved;
-	td.length = ltok->token->length;
-	td.token = td.length ? wcopy(ltok->token->v, td.length) : NULL;
-
-	if (GNET_PROPERTY(dht_tcache_debug) > 4 && td.token != NULL) {
+	if (GNET_PROPERTY(dht_tcache_debug) > 4 && length != 0) {
 		char buf[80];
-		bin_to_hex_buf(td.token, td.length, ARYLEN(buf));
+		bin_to_hex_buf(ltok->token->v, length, ARYLEN(buf));
 		g_debug("DHT TCACHE adding security token for %s: %u-byte \"%s\"",
-			kuid_to_hex_string(id), td.length, buf);
+			kuid_to_hex_string(id), length, buf);
 	}
 
-	/*
-	 * Data is put in the DBMW cache and the dynamically allocated token
-	 * will be freed via free_tokdata() when the cached entry is released.
-	 */
-
-	if (!dbmw_exists(db_tokdata, id->v))
-		gnet_stats_inc_general(GNR_DHT_CACHED_TOKENS_HELD);
-
-	dbmw_write(db_tokdata, id->v, VARLEN(td));
+	tcache_insert(id, ltok->retrieved, ltok->token->v, length);
 
 	if (GNET_PROPERTY(dht_tcache_debug_flags) & DBG_DSF_USR1) {
 		g_debug("DHT TCACHE %s: stats=%s, count=%zu, id=%s",
 			G_STRFUNC, uint64_to_string(
 				gnet_stats_get_general(GNR_DHT_CACHED_TOKENS_HELD)),
-			dbmw_count(db_tokdata), kuid_to_hex_string(id));
+			hevset_count(tokens), kuid_to_hex_string(id));
 	}
 }
 
@@ -290,36 +341,36 @@ tcache_record(map_t *tokens)
  *
  * @return TRUE if we found a token, with len_ptr and tok_ptr filled with
  * the information about the length and the token pointer.  Information is
- * returned from a static memory buffer so it must be perused immediately.
+ * returned from the cache so it must be perused immediately.
  */
 bool
 tcache_get(const kuid_t *id,
 	uint8 *len_ptr, const void **tok_ptr, time_t *time_ptr)
 {
-	struct tokdata *td;
+	struct tcache_entry *te;
 
 	g_assert(id != NULL);
 
-	td = get_tokdata(id);
+	te = hevset_lookup(tokens, id);
 
-	if (NULL == td)
+	if (NULL == te)
 		return FALSE;
 
-	if (delta_time(tm_time(), td->last_update) > token_life) {
-		delete_tokdata(id);
+	if (delta_time(tm_time(), te->last_update) > token_life) {
+		delete_tokdata(te);
 		return FALSE;
 	}
 
-	if (len_ptr != NULL)	*len_ptr = td->length;
-	if (tok_ptr != NULL)	*tok_ptr = td->token;
-	if (time_ptr != NULL)	*time_ptr = td->last_update;
+	if (len_ptr != NULL)	*len_ptr = te->length;
+	if (tok_ptr != NULL)	*tok_ptr = 0 == te->length ? NULL : te->token;
+	if (time_ptr != NULL)	*time_ptr = te->last_update;
 
 	if (GNET_PROPERTY(dht_tcache_debug) > 4) {
 		char buf[80];
-		bin_to_hex_buf(td->token, td->length, ARYLEN(buf));
+		bin_to_hex_buf(te->token, te->length, ARYLEN(buf));
 		g_debug("DHT TCACHE security token for %s is %u-byte \"%s\" (%s)",
-			kuid_to_hex_string(id), td->length, buf,
-			compact_time(delta_time(tm_time(), td->last_update)));
+			kuid_to_hex_string(id), te->length, buf,
+			compact_time(delta_time(tm_time(), te->last_update)));
 	}
 
 	gnet_stats_inc_general(GNR_DHT_CACHED_TOKENS_HITS);
@@ -335,45 +386,52 @@ tcache_get(const kuid_t *id,
 bool
 tcache_remove(const kuid_t *id)
 {
-	if (!dbmw_exists(db_tokdata, id))
+	struct tcache_entry *te;
+
+	te = hevset_lookup(tokens, id);
+
+	if (NULL == te)
 		return FALSE;
 
-	delete_tokdata(id);
+	delete_tokdata(te);
 	return TRUE;
 }
 
 /**
- * DBMW foreach iterator to remove old entries.
+ * Hash set iterator to remove old entries.
  * @return  TRUE if entry must be deleted.
  */
 static bool
-tk_prune_old(void *key, void *value, size_t u_len, void *u_data)
+tk_prune_old(void *value, void *u_data)
 {
-	const kuid_t *id = key;
-	const struct tokdata *td = value;
+	struct tcache_entry *te = value;
 	time_delta_t d;
 
-	(void) u_len;
 	(void) u_data;
 
-	d = delta_time(tm_time(), td->last_update);
+	d = delta_time(tm_time(), te->last_update);
 
 	if (GNET_PROPERTY(dht_tcache_debug) > 2 && d > token_life) {
 		g_debug("DHT TCACHE security token from %s expired",
-			kuid_to_hex_string(id));
+			kuid_to_hex_string(&te->id));
 	}
 
 	if (GNET_PROPERTY(dht_tcache_debug) > 5) {
 		g_debug("DHT TCACHE %s: %s id=%s",
 			G_STRFUNC, d > token_life ? "prune" : "keep ",
-			kuid_to_hex_string(id));
+			kuid_to_hex_string(&te->id));
 	}
 
-	return d > token_life;
+	if (d > token_life) {
+		tcache_entry_free(te);
+		return TRUE;
+	}
+
+	return FALSE;
 }
 
 /**
- * Prune the database, removing expired tokens.
+ * Prune the cache, removing expired tokens.
  */
 static void
 tcache_prune_old(void)
@@ -382,15 +440,18 @@ tcache_prune_old(void)
 
 	if (GNET_PROPERTY(dht_tcache_debug)) {
 		g_debug("DHT TCACHE pruning expired tokens (%zu)",
-			dbmw_count(db_tokdata));
+			hevset_count(tokens));
 	}
 
-	pruned = dbmw_foreach_remove(db_tokdata, tk_prune_old, NULL);
-	gnet_stats_set_general(GNR_DHT_CACHED_TOKENS_HELD, dbmw_count(db_tokdata));
+	pruned = hevset_foreach_remove(tokens, tk_prune_old, NULL);
+	gnet_stats_set_general(GNR_DHT_CACHED_TOKENS_HELD, hevset_count(tokens));
+
+	if (pruned != 0)
+		tcache_dirty = TRUE;
 
 	if (GNET_PROPERTY(dht_tcache_debug)) {
 		g_debug("DHT TCACHE pruned expired tokens (%zu pruned, %zu remaining)",
-			pruned, dbmw_count(db_tokdata));
+			pruned, hevset_count(tokens));
 	}
 }
 
@@ -406,6 +467,77 @@ tcache_periodic_prune(void *unused_obj)
 	return TRUE;		/* Keep calling */
 }
 
+/**
+ * Hash set iterator to write cached tokens to the snapshot database.
+ */
+static void
+tcache_snapshot_token(void *value, void *unused_data)
+{
+	const struct tcache_entry *te = value;
+	struct tokdata td;
+
+	(void) unused_data;
+
+	td.last_update = te->last_update;
+	td.length = te->length;
+	td.token = td.length ? wcopy(te->token, td.length) : NULL;
+
+	/*
+	 * Data is put in the DBMW cache and the dynamically allocated token
+	 * will be freed via free_tokdata() when the cached entry is released.
+	 */
+
+	dbmw_write(db_tokdata, te->id.v, VARLEN(td));
+}
+
+/**
+ * Save the in-memory cache to the database, if it changed.
+ */
+static void
+tcache_snapshot(void)
+{
+	if (NULL == db_tokdata || !tcache_dirty)
+		return;
+
+	dbmw_clear(db_tokdata);
+	hevset_foreach(tokens, tcache_snapshot_token, NULL);
+	dbstore_sync_flush(db_tokdata);
+	tcache_dirty = FALSE;
+
+	if (GNET_PROPERTY(dht_tcache_debug)) {
+		g_debug("DHT TCACHE saved snapshot of %zu token%s",
+			PLURAL(hevset_count(tokens)));
+	}
+}
+
+/**
+ * Callout queue periodic event to save the cache.
+ */
+static bool
+tcache_periodic_snapshot(void *unused_obj)
+{
+	(void) unused_obj;
+
+	tcache_snapshot();
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * DBMW iterator to reload the still valid tokens from the last snapshot.
+ */
+static void
+tcache_reload_token(void *key, void *value, size_t u_len, void *u_data)
+{
+	const kuid_t *id = key;
+	const struct tokdata *td = value;
+
+	(void) u_len;
+	(void) u_data;
+
+	if (delta_time(tm_time(), td->last_update) <= token_life)
+		tcache_insert(id, td->last_update, td->token, td->length);
+}
+
 /**
  * Initialize security token caching.
  */
@@ -417,15 +549,13 @@ tcache_init(void)
 	dbstore_packing_t packing =
 		{ serialize_tokdata, deserialize_tokdata, free_tokdata };
 
+	g_assert(NULL == tokens);
 	g_assert(NULL == db_tokdata);
 	g_assert(NULL == tcache_prune_ev);
+	g_assert(NULL == tcache_snapshot_ev);
 
-	db_tokdata = dbstore_create(db_tcache_what, settings_dht_db_dir(),
-		db_tcache_base, kv, packing, TOK_DB_CACHE_SIZE, kuid_hash, kuid_eq,
-		GNET_PROPERTY(dht_storage_in_memory));
-
-	dbmw_set_map_cache(db_tokdata, TOK_MAP_CACHE_SIZE);
-	dbmw_set_debugging(db_tokdata, &tcache_dbmw_dbg);
+	tokens = hevset_create(
+		offsetof(struct tcache_entry, id), HASH_KEY_FIXED, KUID_RAW_SIZE);
 
 	token_life = MIN(TOK_LIFE, token_lifetime());
 
@@ -433,19 +563,63 @@ tcache_init(void)
 		g_debug("DHT cached token lifetime set to %u secs",
 			(unsigned) token_life);
 
+	/*
+	 * When the DHT storage is to be kept in memory, there is no need
+	 * for a snapshot of the cache.
+	 */
+
+	if (!GNET_PROPERTY(dht_storage_in_memory)) {
+		db_tokdata = dbstore_open(db_tcache_what, settings_dht_db_dir(),
+			db_tcache_base, kv, packing, TOK_DB_CACHE_SIZE,
+			kuid_hash, kuid_eq, FALSE);
+
+		dbmw_set_map_cache(db_tokdata, TOK_MAP_CACHE_SIZE);
+		dbmw_set_debugging(db_tokdata, &tcache_dbmw_dbg);
+
+		dbmw_foreach(db_tokdata, tcache_reload_token, NULL);
+		tcache_dirty = FALSE;
+
+		if (GNET_PROPERTY(dht_tcache_debug)) {
+			g_debug("DHT TCACHE reloaded %zu token%s from snapshot",
+				PLURAL(hevset_count(tokens)));
+		}
+
+		tcache_snapshot_ev = cq_periodic_main_add(TCACHE_SNAPSHOT_PERIOD,
+			tcache_periodic_snapshot, NULL);
+	}
+
 	tcache_prune_ev = cq_periodic_main_add(TCACHE_PRUNE_PERIOD,
 		tcache_periodic_prune, NULL);
 }
 
+/**
+ * Hash set iterator to free cached entries.
+ */
+static void
+tcache_free_token(void *value, void *unused_data)
+{
+	(void) unused_data;
+
+	tcache_entry_free(value);
+}
+
 /**
  * Close security token caching.
  */
 void
 tcache_close(void)
 {
-	dbstore_delete(db_tokdata);
-	db_tokdata = NULL;
+	if (db_tokdata != NULL) {
+		tcache_prune_old();
+		tcache_snapshot();
+		dbstore_close(db_tokdata, settings_dht_db_dir(), db_tcache_base);
+		db_tokdata = NULL;
+	}
+
+	hevset_foreach(tokens, tcache_free_token, NULL);
+	hevset_free_null(&tokens);
 	cq_periodic_remove(&tcache_prune_ev);
+	cq_periodic_remove(&tcache_snapshot_ev);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -47,6 +47,12 @@
  * by the user: the larger the hints, the more concurrency will take place
  * and the faster the results will come back, at the expense on bandwidth.
  *
+ * Different parts of the code often want to perform the same lookup at the
+ * same time: identical lookups, still queued or already running, are merged
+ * and the results of the single lookup are given to all the callers.  When
+ * a prioritary lookup is merged with an older queued one, the latter moves
+ * to the prioritary queue, where lookups are ordered by age.
+ *
  * @author Raphael Manfredi
  * @date 2008
  */
@@ -65,9 +71,14 @@
 
 #include "lib/atoms.h"
 #include "lib/cq.h"
-#include "lib/fifo.h"
+#include "lib/elist.h"
+#include "lib/hashing.h"
+#include "lib/hevset.h"
+#include "lib/patricia.h"
+#include "lib/pslist.h"
 #include "lib/slist.h"
 #include "lib/str.h"
+#include "lib/tm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -75,6 +86,9 @@
 #define ULQ_MAX_RUNNING		3		/**< Initial amount of concurrent reqs */
 #define ULQ_UDP_DELAY		5000	/**< Delay in ms if UDP flow-controlled */
 #define ULQ_EMA_SHIFT		7		/**< Shifting during EMA computation */
+#define ULQ_ROOTS_LIFE		300		/**< Secs during which roots are reused */
+#define ULQ_ROOTS_MARGIN	2		/**< Extra common bits for roots reuse */
+#define ULQ_ROOTS_MAX		1024	/**< Max amount of cached STORE roots */
 
 #define vema(x)	((x) >> ULQ_EMA_SHIFT)
 
@@ -88,7 +102,7 @@ enum ulq_magic {
 struct ulq {
 	enum ulq_magic magic;
 	const char *name;				/**< Queue name */
-	fifo_t *q;						/**< Queue is a FIFO */
+	elist_t q;						/**< Queued lookups, oldest first */
 	slist_t *launched;				/**< Launched lookups */
 	int running;					/**< Amount of launched lookups */
 	int weight;						/**< Scheduling weight */
@@ -101,25 +115,39 @@ enum ulqitem_magic {
 };
 
 /**
- * The queued lookup item.
+ * What identifies a lookup: identical lookups are merged.
  */
-struct ulq_item {
-	enum ulqitem_magic magic;
-	lookup_type_t type;				/**< Type of lookup (STORE or VALUE) */
+struct ulq_key {
 	const kuid_t *kuid;				/**< KUID to look for (atom) */
-	struct ulq *uq;					/**< The queue where item lies */
+	lookup_type_t type;				/**< Type of lookup (STORE or VALUE) */
+	dht_value_type_t vtype;			/**< Type of value they want */
+};
+
+/**
+ * A caller waiting for the results of a lookup.
+ */
+struct ulq_caller {
 	union {
-		struct {
-			lookup_cb_ok_t ok;		/**< OK callback for node lookups */
-		} fn;
-		struct {
-			lookup_cbv_ok_t ok;		/**< OK callback for value lookups */
-			dht_value_type_t vtype;	/**< Type of value they want */
-		} fv;
-	} u;
+		lookup_cb_ok_t fn;			/**< OK callback for node lookups */
+		lookup_cbv_ok_t fv;			/**< OK callback for value lookups */
+	} ok;
 	lookup_cb_start_t start;		/**< Optional starting callback */
 	lookup_cb_err_t err;			/**< Error callback */
-	void *arg;						/**< Common callback opaque argument */
+	void *arg;						/**< Callback opaque argument */
+};
+
+/**
+ * The queued lookup item.
+ */
+struct ulq_item {
+	enum ulqitem_magic magic;
+	struct ulq_key key;				/**< Lookup key */
+	struct ulq *uq;					/**< The queue where item lies */
+	pslist_t *callers;				/**< Callers to notify, in arrival order */
+	uint64 seq;						/**< Enqueuing order, to sort by age */
+	bool prioritary;				/**< Whether lookup is urgent */
+	bool queued;					/**< Whether lookup is still queued */
+	link_t lk;						/**< Links item in queue */
 };
 
 /**
@@ -139,6 +167,25 @@ enum ulq_qtype {
 
 static struct ulq *ulq[ULQ_QUEUE_COUNT];	/**< The user lookup queues */
 static cevent_t *service_ev;				/**< Servicing event */
+static hevset_t *lookups;					/**< ulq_key -> struct ulq_item */
+
+/**
+ * Recently found STORE roots.
+ *
+ * When publishing many values, their keys often fall in the same region of
+ * the keyspace.  All the k roots of a STORE lookup share a common prefix with
+ * the target.  Any key sharing a longer prefix with that target has nearly
+ * the same k-closest nodes, so we can reuse the lookup results instead of
+ * launching a new lookup.
+ */
+struct ulq_roots {
+	const kuid_t *kuid;				/**< Target of the lookup (atom) */
+	const lookup_rs_t *rs;			/**< The STORE roots found */
+	time_t stamp;					/**< When lookup completed */
+	size_t bits;					/**< Prefix common to target and roots */
+};
+
+static patricia_t *store_roots;		/**< KUID -> struct ulq_roots */
 
 /**
  * Scheduling informations.
@@ -152,6 +199,7 @@ static struct ulq_sched {
 	int sz_in_ema;					/**< Slow EMA of incoming message size */
 	int sz_out_ema;					/**< Slow EMA of outgoing message size */
 	int msg_dropped;				/**< Exponentially decaying # of drops */
+	uint64 seq;						/**< Enqueuing sequence number */
 	bool udp_flow_controlled;		/**< Whether UDP was flow-controlled */
 } sched;
 
@@ -172,22 +220,75 @@ ulq_item_check(const struct ulq_item *ui)
 	g_assert(ULQ_ITEM_MAGIC == ui->magic);
 }
 
+/**
+ * Hash a lookup key.
+ */
+static uint
+ulq_key_hash(const void *key)
+{
+	const struct ulq_key *k = key;
+
+	return kuid_hash(k->kuid) ^ integer_hash_fast((k->type << 16) ^ k->vtype);
+}
+
+/**
+ * Compare two lookup keys for equality.
+ */
+static bool
+ulq_key_eq(const void *a, const void *b)
+{
+	const struct ulq_key *ka = a, *kb = b;
+
+	return ka->kuid == kb->kuid &&		/* Atoms */
+		ka->type == kb->type && ka->vtype == kb->vtype;
+}
+
+/**
+ * Allocate a new caller.
+ */
+static struct ulq_caller *
+allocate_ulq_caller(lookup_cb_start_t start, lookup_cb_err_t err, void *arg)
+{
+	struct ulq_caller *uc;
+
+	WALLOC0(uc);
+	uc->start = start;
+	uc->err = err;
+	uc->arg = arg;
+
+	return uc;
+}
+
+/**
+ * Free list of callers, nullifying its pointer.
+ */
+static void
+free_ulq_callers(pslist_t **callers_ptr)
+{
+	pslist_t *sl;
+
+	PSLIST_FOREACH(*callers_ptr, sl) {
+		struct ulq_caller *uc = sl->data;
+		WFREE(uc);
+	}
+
+	pslist_free_null(callers_ptr);
+}
+
 /**
  * Allocate new ulq item.
  */
 static struct ulq_item *
-allocate_ulq_item(lookup_type_t type, const kuid_t *kuid,
-	lookup_cb_start_t start, lookup_cb_err_t err, void *arg)
+allocate_ulq_item(const struct ulq_key *key, bool prioritary)
 {
 	struct ulq_item *ui;
 
-	WALLOC(ui);
+	WALLOC0(ui);
 	ui->magic = ULQ_ITEM_MAGIC;
-	ui->type = type;
-	ui->kuid = kuid_get_atom(kuid);
-	ui->start = start;
-	ui->err = err;
-	ui->arg = arg;
+	ui->key = *key;
+	ui->key.kuid = kuid_get_atom(key->kuid);
+	ui->seq = sched.seq++;
+	ui->prioritary = prioritary;
 
 	return ui;
 }
@@ -200,12 +301,230 @@ free_ulq_item(struct ulq_item *ui)
 {
 	ulq_item_check(ui);
 
-	kuid_atom_free(ui->kuid);
-	ui->kuid = NULL;
+	free_ulq_callers(&ui->callers);
+	kuid_atom_free(ui->key.kuid);
+	ui->key.kuid = NULL;
 	ui->magic = 0;
 	WFREE(ui);
 }
 
+/**
+ * Detach item from the known lookups, so that new identical lookups are no
+ * longer merged with it, and steal its list of callers.
+ *
+ * @return the list of callers, to be freed with free_ulq_callers().
+ */
+static pslist_t *
+ulq_item_detach(struct ulq_item *ui)
+{
+	pslist_t *callers;
+
+	ulq_item_check(ui);
+
+	hevset_remove(lookups, &ui->key);
+	callers = ui->callers;
+	ui->callers = NULL;
+
+	return callers;
+}
+
+/**
+ * Report error to all the callers of the lookup.
+ */
+static void
+ulq_item_error(struct ulq_item *ui, lookup_error_t error)
+{
+	pslist_t *sl, *callers = ulq_item_detach(ui);
+
+	PSLIST_FOREACH(callers, sl) {
+		struct ulq_caller *uc = sl->data;
+		(*uc->err)(ui->key.kuid, error, uc->arg);
+	}
+
+	free_ulq_callers(&callers);
+}
+
+/**
+ * Give the STORE roots found to all the callers of the lookup.
+ */
+static void
+ulq_item_nodes(struct ulq_item *ui, const lookup_rs_t *rs)
+{
+	pslist_t *sl, *callers = ulq_item_detach(ui);
+
+	g_assert(LOOKUP_STORE == ui->key.type);
+
+	PSLIST_FOREACH(callers, sl) {
+		struct ulq_caller *uc = sl->data;
+		(*uc->ok.fn)(ui->key.kuid, rs, uc->arg);
+	}
+
+	free_ulq_callers(&callers);
+}
+
+/**
+ * Give the values found to all the callers of the lookup.
+ */
+static void
+ulq_item_values(struct ulq_item *ui, const lookup_val_rs_t *rs)
+{
+	pslist_t *sl, *callers = ulq_item_detach(ui);
+
+	g_assert(LOOKUP_VALUE == ui->key.type);
+
+	PSLIST_FOREACH(callers, sl) {
+		struct ulq_caller *uc = sl->data;
+		(*uc->ok.fv)(ui->key.kuid, rs, uc->arg);
+	}
+
+	free_ulq_callers(&callers);
+}
+
+/**
+ * Invoke the "starting" callbacks of the lookup callers, if any, cancelling
+ * the callers for which it does not return TRUE.
+ *
+ * @return whether there are still callers interested by the lookup.
+ */
+static bool
+ulq_item_start(struct ulq_item *ui)
+{
+	pslist_t *sl, *kept = NULL, *callers = ui->callers;
+
+	/*
+	 * Callbacks could enqueue an identical lookup, which would be merged
+	 * with this one: work on a detached list.
+	 */
+
+	ui->callers = NULL;
+
+	PSLIST_FOREACH(callers, sl) {
+		struct ulq_caller *uc = sl->data;
+
+		if (uc->start != NULL && !(*uc->start)(ui->key.kuid, uc->arg)) {
+			(*uc->err)(ui->key.kuid, LOOKUP_E_CANCELLED, uc->arg);
+			WFREE(uc);
+		} else {
+			kept = pslist_prepend(kept, uc);
+		}
+	}
+
+	pslist_free(callers);
+	ui->callers = pslist_concat(pslist_reverse(kept), ui->callers);
+
+	return ui->callers != NULL;
+}
+
+/**
+ * Free cached STORE roots.
+ */
+static void
+ulq_roots_free(struct ulq_roots *ur)
+{
+	kuid_atom_free(ur->kuid);
+	lookup_result_free(ur->rs);
+	WFREE(ur);
+}
+
+/**
+ * PATRICIA iterator callback to remove expired STORE roots.
+ */
+static bool
+ulq_roots_expired(void *key, size_t keybits, void *value, void *u)
+{
+	struct ulq_roots *ur = value;
+	bool *all = u;
+
+	(void) key;
+	(void) keybits;
+
+	if (*all || delta_time(tm_time(), ur->stamp) > ULQ_ROOTS_LIFE) {
+		ulq_roots_free(ur);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Record results of a STORE roots lookup for later reuse.
+ */
+static void
+ulq_roots_record(const kuid_t *kuid, const lookup_rs_t *rs)
+{
+	struct ulq_roots *ur;
+	size_t i, bits = KUID_RAW_BITSIZE;
+
+	/*
+	 * We need the k roots to determine the region of the keyspace they
+	 * cover.  Anything less means the lookup was not able to find them all.
+	 */
+
+	if (lookup_result_path_length(rs) < KDA_K)
+		return;
+
+	if (patricia_count(store_roots) >= ULQ_ROOTS_MAX) {
+		bool all = FALSE;
+		patricia_foreach_remove(store_roots, ulq_roots_expired, &all);
+		if (patricia_count(store_roots) >= ULQ_ROOTS_MAX)
+			return;
+	}
+
+	for (i = 0; i < KDA_K; i++) {
+		const knode_t *kn = lookup_result_nth_node(rs, i);
+		bits = MIN(bits, kuid_common_prefix(kuid, kn->id));
+	}
+
+	ur = patricia_lookup(store_roots, kuid);
+	if (ur != NULL) {
+		patricia_remove(store_roots, kuid);
+		ulq_roots_free(ur);
+	}
+
+	WALLOC(ur);
+	ur->kuid = kuid_get_atom(kuid);
+	ur->rs = lookup_result_refcnt_inc(rs);
+	ur->stamp = tm_time();
+	ur->bits = bits;
+
+	patricia_insert(store_roots, ur->kuid, ur);
+}
+
+/**
+ * Look whether we can reuse the results of a recent STORE roots lookup
+ * for a key lying in the same region of the keyspace.
+ *
+ * @return results sorted by distance to the KUID, to be freed with
+ * lookup_result_free(), NULL if a lookup is required.
+ */
+static const lookup_rs_t *
+ulq_roots_reuse(const kuid_t *kuid)
+{
+	struct ulq_roots *ur;
+
+	ur = patricia_closest(store_roots, kuid);
+	if (NULL == ur)
+		return NULL;
+
+	if (delta_time(tm_time(), ur->stamp) > ULQ_ROOTS_LIFE) {
+		patricia_remove(store_roots, ur->kuid);
+		ulq_roots_free(ur);
+		return NULL;
+	}
+
+	if (kuid_common_prefix(kuid, ur->kuid) < ur->bits + ULQ_ROOTS_MARGIN)
+		return NULL;
+
+	if (GNET_PROPERTY(dht_ulq_debug) > 1) {
+		g_debug("DHT ULQ reusing STORE roots of %s for %s "
+			"(%zu common bits, roots have %zu)",
+			kuid_to_hex_string(ur->kuid), kuid_to_hex_string2(kuid),
+			kuid_common_prefix(kuid, ur->kuid), ur->bits);
+	}
+
+	return lookup_result_retarget(ur->rs, kuid);
+}
+
 /**
  * Add queue to the run queue.
  */
@@ -233,7 +552,7 @@ ulq_sched_reset(void)
 		g_assert(!uq->runnable);
 
 		uq->scheduled = 0;
-		if (fifo_count(uq->q) > 0)
+		if (elist_count(&uq->q) > 0)
 			ulq_sched_add(uq);
 	}
 }
@@ -270,10 +589,10 @@ ulq_error_cb(const kuid_t *kuid, lookup_error_t error, void *arg)
 	struct ulq_item *ui = arg;
 
 	ulq_item_check(ui);
-	g_assert(LOOKUP_VALUE == ui->type || LOOKUP_STORE == ui->type);
-	g_assert(ui->kuid == kuid);		/* Atoms */
+	g_assert(LOOKUP_VALUE == ui->key.type || LOOKUP_STORE == ui->key.type);
+	g_assert(ui->key.kuid == kuid);		/* Atoms */
 
-	(*ui->err)(ui->kuid, error, ui->arg);
+	ulq_item_error(ui, error);
 	ulq_completed(ui);
 }
 
@@ -286,10 +605,9 @@ ulq_value_found_cb(const kuid_t *kuid, const lookup_val_rs_t *rs, void *arg)
 	struct ulq_item *ui = arg;
 
 	ulq_item_check(ui);
-	g_assert(LOOKUP_VALUE == ui->type);
-	g_assert(ui->kuid == kuid);		/* Atoms */
+	g_assert(ui->key.kuid == kuid);		/* Atoms */
 
-	(*ui->u.fv.ok)(ui->kuid, rs, ui->arg);
+	ulq_item_values(ui, rs);
 	ulq_completed(ui);
 }
 
@@ -302,10 +620,10 @@ ulq_node_found_cb(const kuid_t *kuid, const lookup_rs_t *rs, void *arg)
 	struct ulq_item *ui = arg;
 
 	ulq_item_check(ui);
-	g_assert(LOOKUP_STORE == ui->type);
-	g_assert(ui->kuid == kuid);		/* Atoms */
+	g_assert(ui->key.kuid == kuid);		/* Atoms */
 
-	(*ui->u.fn.ok)(ui->kuid, rs, ui->arg);
+	ulq_roots_record(ui->key.kuid, rs);
+	ulq_item_nodes(ui, rs);
 	ulq_completed(ui);
 }
 
@@ -321,7 +639,7 @@ ulq_lookup_stats(const kuid_t *kuid,
 	int avg;
 
 	ulq_item_check(ui);
-	g_assert(ui->kuid == kuid);		/* Atoms */
+	g_assert(ui->key.kuid == kuid);		/* Atoms */
 
 	/*
 	 * Update the slow EMAs (n = 31 => sm = 2/(n+1) = 0.0625 = 1/2^4).
@@ -386,7 +704,7 @@ ulq_queue_status(void)
 
 		offset += str_bprintf(ARYPOSLEN(buf, offset),
 			"%s%s: %u/%u", offset > 0 ? ", " : "",
-			uq->name, uq->running, fifo_count(uq->q));
+			uq->name, uq->running, elist_count(&uq->q));
 	}
 
 	return buf;
@@ -404,21 +722,22 @@ ulq_launch(struct ulq *uq)
 	struct ulq_item *ui;
 
 	ulq_check(uq);
-	g_assert(fifo_count(uq->q));
+	g_assert(elist_count(&uq->q));
 	g_assert(sched.pending > 0);
 
-	ui = fifo_remove(uq->q);
+	ui = elist_shift(&uq->q);
 	sched.pending--;
 
 	ulq_item_check(ui);
+	ui->queued = FALSE;
 
 	/*
-	 * If there is a "starting" callback, make sure it returns TRUE
+	 * If there are "starting" callbacks, make sure one returns TRUE
 	 * before launching the request.
 	 */
 
-	if (ui->start != NULL && !(*ui->start)(ui->kuid, ui->arg)) {
-		(*ui->err)(ui->kuid, LOOKUP_E_CANCELLED, ui->arg);
+	if (!ulq_item_start(ui)) {
+		hevset_remove(lookups, &ui->key);
 		free_ulq_item(ui);
 		return FALSE;
 	}
@@ -428,13 +747,30 @@ ulq_launch(struct ulq *uq)
 	 * lookup has completed.
 	 */
 
-	switch (ui->type) {
+	switch (ui->key.type) {
 	case LOOKUP_VALUE:
-		nl = lookup_find_value(ui->kuid, ui->u.fv.vtype,
+		nl = lookup_find_value(ui->key.kuid, ui->key.vtype,
 			ulq_value_found_cb, ulq_error_cb, ui);
 		goto initialized;
 	case LOOKUP_STORE:
-		nl = lookup_store_nodes(ui->kuid, ulq_node_found_cb, ulq_error_cb, ui);
+		{
+			const lookup_rs_t *rs = ulq_roots_reuse(ui->key.kuid);
+
+			/*
+			 * Since we are called asynchronously with respect to the
+			 * enqueuing of the lookup, it is safe to invoke the callbacks.
+			 */
+
+			if (rs != NULL) {
+				uq->scheduled++;
+				ulq_item_nodes(ui, rs);
+				lookup_result_free(rs);
+				free_ulq_item(ui);
+				return FALSE;
+			}
+		}
+		nl = lookup_store_nodes(ui->key.kuid,
+			ulq_node_found_cb, ulq_error_cb, ui);
 		goto initialized;
 		break;
 	case LOOKUP_REFRESH:
@@ -455,8 +791,8 @@ initialized:
 		sched.running++;
 		lookup_ctrl_stats(nl, ulq_lookup_stats);
 
-		if (LOOKUP_VALUE == ui->type) {
-			switch (ui->u.fv.vtype) {
+		if (LOOKUP_VALUE == ui->key.type) {
+			switch (ui->key.vtype) {
 			case DHT_VT_ANY:
 				/*
 				 * We use generic lookups to locate PROX or NOPE values.
@@ -480,10 +816,10 @@ initialized:
 		 * We know the only cause for a lookup not starting is that the
 		 * initial shortlist is empty.  Since here we are called asynchronously
 		 * with respect to the initial lookup launch, it is safe to invoke
-		 * the error callback.
+		 * the error callbacks.
 		 */
 
-		(*ui->err)(ui->kuid, LOOKUP_E_EMPTY_ROUTE, ui->arg);
+		ulq_item_error(ui, LOOKUP_E_EMPTY_ROUTE);
 		free_ulq_item(ui);
 	}
 
@@ -583,7 +919,7 @@ ulq_service(void)
 
 		launched = ulq_launch(uq);
 
-		if (fifo_count(uq->q) > 0 && uq->scheduled < uq->weight)
+		if (elist_count(&uq->q) > 0 && uq->scheduled < uq->weight)
 			slist_append(sched.runq, uq);
 		else
 			uq->runnable = FALSE;
@@ -726,6 +1062,17 @@ ulq_get(lookup_type_t ltype, dht_value_type_t vtype, bool prioritary)
 	}
 }
 
+/**
+ * Order queued items by age, oldest first.
+ */
+static int
+ulq_item_age_cmp(const void *a, const void *b)
+{
+	const struct ulq_item *ua = a, *ub = b;
+
+	return CMP(ua->seq, ub->seq);
+}
+
 /**
  * Enqueue lookup item.
  */
@@ -735,8 +1082,9 @@ ulq_putq(struct ulq *uq, struct ulq_item *ui)
 	ulq_check(uq);
 	ulq_item_check(ui);
 
-	fifo_put(uq->q, ui);
+	elist_append(&uq->q, ui);		/* Newest item, hence the youngest */
 	ui->uq = uq;
+	ui->queued = TRUE;
 	sched.pending++;
 
 	if (!uq->runnable && uq->scheduled < uq->weight)
@@ -745,6 +1093,92 @@ ulq_putq(struct ulq *uq, struct ulq_item *ui)
 	ulq_needs_servicing();
 }
 
+/**
+ * Move queued item to a more urgent queue, where it is inserted according
+ * to its age.
+ */
+static void
+ulq_promote(struct ulq_item *ui, struct ulq *uq)
+{
+	struct ulq *old;
+
+	ulq_item_check(ui);
+	ulq_check(uq);
+	g_assert(ui->queued);
+
+	old = ui->uq;
+	ulq_check(old);
+
+	if (old == uq)
+		return;
+
+	elist_remove(&old->q, ui);
+
+	if (0 == elist_count(&old->q) && old->runnable) {
+		slist_remove(sched.runq, old);
+		old->runnable = FALSE;
+	}
+
+	elist_insert_sorted(&uq->q, ui, ulq_item_age_cmp);
+	ui->uq = uq;
+
+	if (!uq->runnable && uq->scheduled < uq->weight)
+		ulq_sched_add(uq);
+
+	if (GNET_PROPERTY(dht_ulq_debug) > 1) {
+		g_debug("DHT ULQ promoted lookup for %s from %s to %s queue",
+			kuid_to_hex_string(ui->key.kuid), old->name, uq->name);
+	}
+
+	ulq_needs_servicing();
+}
+
+/**
+ * Record new caller for a lookup, merging it with an identical lookup
+ * already queued or running, if any.
+ *
+ * @param key			the lookup key
+ * @param uq			the queue where lookup should be enqueued
+ * @param prioritary	whether lookup is urgent
+ * @param uc			the caller to notify
+ */
+static void
+ulq_enqueue(const struct ulq_key *key, struct ulq *uq, bool prioritary,
+	struct ulq_caller *uc)
+{
+	struct ulq_item *ui;
+
+	ui = hevset_lookup(lookups, key);
+
+	if (ui != NULL) {
+		ulq_item_check(ui);
+
+		ui->callers = pslist_append(ui->callers, uc);
+		gnet_stats_inc_general(GNR_DHT_ULQ_MERGED_LOOKUPS);
+
+		if (GNET_PROPERTY(dht_ulq_debug) > 1) {
+			g_debug("DHT ULQ merged lookup for %s with %s one in %s queue "
+				"(%zu callers)",
+				kuid_to_hex_string(key->kuid),
+				ui->queued ? "queued" : "running", ui->uq->name,
+				pslist_length(ui->callers));
+		}
+
+		if (prioritary && !ui->prioritary) {
+			ui->prioritary = TRUE;
+			if (ui->queued)
+				ulq_promote(ui, uq);
+		}
+		return;
+	}
+
+	ui = allocate_ulq_item(key, prioritary);
+	ui->callers = pslist_prepend(NULL, uc);
+	hevset_insert(lookups, ui);
+
+	ulq_putq(uq, ui);
+}
+
 /**
  * Enqueue store roots lookup.
  *
@@ -755,18 +1189,21 @@ void
 ulq_find_store_roots(const kuid_t *kuid, bool prioritary,
 	lookup_cb_ok_t ok, lookup_cb_err_t error, void *arg)
 {
-	struct ulq_item *ui;
-	struct ulq *uq;
+	struct ulq_caller *uc;
+	struct ulq_key key;
 
 	g_assert(ok);
 	g_assert(error);
 
-	uq = ulq_get(LOOKUP_STORE, DHT_VT_BINARY, prioritary);
+	key.kuid = kuid;
+	key.type = LOOKUP_STORE;
+	key.vtype = DHT_VT_BINARY;
 
-	ui = allocate_ulq_item(LOOKUP_STORE,  kuid, NULL, error, arg);
-	ui->u.fn.ok = ok;
+	uc = allocate_ulq_caller(NULL, error, arg);
+	uc->ok.fn = ok;
 
-	ulq_putq(uq, ui);
+	ulq_enqueue(&key, ulq_get(LOOKUP_STORE, DHT_VT_BINARY, prioritary),
+		prioritary, uc);
 }
 
 /**
@@ -777,19 +1214,20 @@ ulq_find_value(const kuid_t *kuid, dht_value_type_t type,
 	lookup_cbv_ok_t ok, lookup_cb_start_t start, lookup_cb_err_t error,
 	void *arg)
 {
-	struct ulq_item *ui;
-	struct ulq *uq;
+	struct ulq_caller *uc;
+	struct ulq_key key;
 
 	g_assert(ok);
 	g_assert(error);
 
-	uq = ulq_get(LOOKUP_VALUE, type, FALSE);
+	key.kuid = kuid;
+	key.type = LOOKUP_VALUE;
+	key.vtype = type;
 
-	ui = allocate_ulq_item(LOOKUP_VALUE,  kuid, start, error, arg);
-	ui->u.fv.ok = ok;
-	ui->u.fv.vtype = type;
+	uc = allocate_ulq_caller(start, error, arg);
+	uc->ok.fv = ok;
 
-	ulq_putq(uq, ui);
+	ulq_enqueue(&key, ulq_get(LOOKUP_VALUE, type, FALSE), FALSE, uc);
 }
 
 /**
@@ -802,19 +1240,20 @@ void
 ulq_find_any_value(const kuid_t *kuid, dht_value_type_t queue_type,
 	lookup_cbv_ok_t ok, lookup_cb_err_t error, void *arg)
 {
-	struct ulq_item *ui;
-	struct ulq *uq;
+	struct ulq_caller *uc;
+	struct ulq_key key;
 
 	g_assert(ok);
 	g_assert(error);
 
-	uq = ulq_get(LOOKUP_VALUE, queue_type, FALSE);
+	key.kuid = kuid;
+	key.type = LOOKUP_VALUE;
+	key.vtype = DHT_VT_ANY;		/* Generic type */
 
-	ui = allocate_ulq_item(LOOKUP_VALUE,  kuid, NULL, error, arg);
-	ui->u.fv.ok = ok;
-	ui->u.fv.vtype = DHT_VT_ANY;	/* Generic type */
+	uc = allocate_ulq_caller(NULL, error, arg);
+	uc->ok.fv = ok;
 
-	ulq_putq(uq, ui);
+	ulq_enqueue(&key, ulq_get(LOOKUP_VALUE, queue_type, FALSE), FALSE, uc);
 }
 
 /**
@@ -835,7 +1274,7 @@ ulq_init_queue(const char *name, int weight)
 	WALLOC0(uq);
 	uq->magic = ULQ_MAGIC;
 	uq->name = name;
-	uq->q = fifo_make();
+	elist_init(&uq->q, offsetof(struct ulq_item, lk));
 	uq->launched = slist_new();
 	uq->running = 0;
 	uq->weight = weight;
@@ -884,13 +1323,16 @@ ulq_init(void)
 
 	ZERO(&sched);
 	sched.runq = slist_new();
+	store_roots = patricia_create(KUID_RAW_BITSIZE);
+	lookups = hevset_create_any(offsetof(struct ulq_item, key),
+		ulq_key_hash, NULL, ulq_key_eq);
 }
 
 /**
- * FIFO free item freeing callback.
+ * Queued item freeing callback.
  */
 static void
-free_fifo_item(void *item, void *data)
+free_queued_item(void *item, void *data)
 {
 	struct ulq_item *ui = item;
 	bool *exiting = data;
@@ -904,7 +1346,7 @@ free_fifo_item(void *item, void *data)
 	 */
 
 	if (!*exiting)
-		(*ui->err)(ui->kuid, LOOKUP_E_CANCELLED, ui->arg);
+		ulq_item_error(ui, LOOKUP_E_CANCELLED);
 
 	free_ulq_item(ui);
 }
@@ -923,13 +1365,20 @@ ulq_close(bool exiting)
 	cq_cancel(&service_ev);
 	slist_free(&sched.runq);
 
+	if (store_roots != NULL) {
+		bool all = TRUE;
+		patricia_foreach_remove(store_roots, ulq_roots_expired, &all);
+		patricia_destroy(store_roots);
+		store_roots = NULL;
+	}
+
 	for (i = 0; i < N_ITEMS(ulq); i++) {
 		struct ulq *uq = ulq[i];
 
 		if (uq) {
 			/*
 			 * Do not invoke callback for launched lookups, they will be
-			 * duly cancelled by lookup_close(): tell free_fifo_item() that
+			 * duly cancelled by lookup_close(): tell free_queued_item() that
 			 * we are exiting.
 			 *
 			 * Enqueued lookups on the other hand (still in the FIFO) need
@@ -937,14 +1386,18 @@ ulq_close(bool exiting)
 			 * callback, since there is no lookup object yet.
 			 */
 
-			slist_foreach(uq->launched, free_fifo_item, &one);
+			slist_foreach(uq->launched, free_queued_item, &one);
 			slist_free(&uq->launched);
-			fifo_free_all(uq->q, free_fifo_item, &exiting);
+			while (elist_count(&uq->q) != 0) {
+				free_queued_item(elist_shift(&uq->q), &exiting);
+			}
 			WFREE(uq);
 
 			ulq[i] = NULL;
 		}
 	}
+
+	hevset_free_null(&lookups);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -85,6 +85,7 @@
 #include "lib/cstr.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/endian.h"
 #include "lib/hashing.h"
 #include "lib/host_addr.h"
 #include "lib/hset.h"
@@ -127,6 +128,7 @@
 
 #define VALUES_DB_CACHE_SIZE 1024	/**< Amount of values to keep cached */
 #define RAW_DB_CACHE_SIZE	 512	/**< Amount of raw data to keep cached */
+#define VALUES_EXPIRY_GRACE	(24 * 3600)	/**< LSM drops expired after 1 day */
 
 /**
  * Information about a value that is stored to disk and not kept in memory.
@@ -279,6 +281,7 @@ values_max_per_net(void)
 }
 
 #define VALUES_DATA_VERSION	1		/* Serialization version number */
+#define VALUES_EXPIRE_OFFSET	(1 + KUID_RAW_SIZE + 4 + 4)	/* Serialized */
 
 /**
  * Serialization routine for valuedata.
@@ -315,6 +318,26 @@ serialize_valuedata(pmsg_t *mb, const void *data)
 	pmsg_write_be32(mb, vd->n_requests);
 }
 
+/**
+ * Extract expiration time from serialized valuedata, for the LSM tree.
+ */
+static time_t
+valuedata_expiry(const void *unused_key, size_t unused_klen,
+	const void *data, size_t dlen)
+{
+	const char *p = data;
+
+	(void) unused_key;
+	(void) unused_klen;
+
+	/* Version, KUID, publish and replicated times precede the expire time */
+
+	if (dlen < VALUES_EXPIRE_OFFSET + 4)
+		return 0;
+
+	return peek_be32(&p[VALUES_EXPIRE_OFFSET]);
+}
+
 /**
  * Deserialization routine for valuedata.
  */
@@ -2107,15 +2130,39 @@ values_init(void)
 	g_assert(NULL == expired);
 	g_assert(NULL == values_expire_ev);
 
-	db_valuedata = dbstore_open(db_valwhat, settings_dht_db_dir(),
+	/*
+	 * Values are constantly published and expired, hence these databases
+	 * are backed by LSM trees, which turn all the writes into sequential
+	 * ones.  Value records left behind past their expiration time (e.g.
+	 * after a crash) are discarded during compactions.
+	 */
+
+	db_valuedata = dbstore_open_lsm(db_valwhat, settings_dht_db_dir(),
 		db_valbase, value_kv, value_packing, VALUES_DB_CACHE_SIZE,
 		uint64_mem_hash, uint64_mem_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
-	db_rawdata = dbstore_open(db_rawwhat, settings_dht_db_dir(), db_rawbase,
-		raw_kv, no_packing, RAW_DB_CACHE_SIZE, uint64_mem_hash, uint64_mem_eq,
+	db_rawdata = dbstore_open_lsm(db_rawwhat, settings_dht_db_dir(),
+		db_rawbase, raw_kv, no_packing, RAW_DB_CACHE_SIZE,
+		uint64_mem_hash, uint64_mem_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	dbmw_set_expiry(db_valuedata, valuedata_expiry, VALUES_EXPIRY_GRACE);
+
+	/*
+	 * Log changes sequentially instead of writing back scattered dirty
+	 * pages at each periodic synchronization.
+	 */
+
+	dbstore_set_wal(db_valuedata, settings_dht_db_dir(), db_valbase);
+	dbstore_set_wal(db_rawdata, settings_dht_db_dir(), db_rawbase);
+
+	/*
+	 * Most lookups of absent values are answered by a key filter.
+	 */
+
+	dbstore_set_bloom(db_valuedata, settings_dht_db_dir(), db_valbase);
+
 	db_expired = dbstore_create(db_expwhat, settings_dht_db_dir(), db_expbase,
 		expired_kv, no_packing, 0, kuid_pair_hash, kuid_pair_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
@@ -25,6 +25,7 @@
 #ifndef _if_core_downloads_h_
 #define _if_core_downloads_h_
 
+#include "lib/erbtree.h"
 #include "lib/event.h"			/* For frequency_t */
 #include "lib/hashlist.h"
 #include "lib/htable.h"
@@ -97,14 +98,17 @@ struct dl_server {
 	const char *hostname;		/**< Remote hostname, if known (atom) */
 	pproxy_set_t *proxies;		/**< Known push proxies */
 	htable_t *sha1_counts;
+	rbnode_t by_time;			/**< Embedded node in retry schedule */
 	time_t retry_after;		/**< Time at which we may retry from this host */
 	time_t dns_lookup;		/**< Last DNS lookup for hostname */
 	time_t last_connect;	/**< When we last connected to that server */
 	struct vernum parq_version; /**< Supported queueing version */
 	uint speed_avg;			/**< Average (EMA) upload speed, in bytes/sec */
 	unsigned latency;		/**< HTTP latency, in ms (EMA) */
+	uint quality;			/**< Quality score, see dlqual.c */
 	uint32 attrs;
 	uint16 country;			/**< Country of origin -- encoded ISO3166 */
+	unsigned scheduled:1;	/**< Whether server is in the retry schedule */
 };
 
 static inline bool
@@ -279,6 +283,7 @@ struct download {
 	unsigned got_giv:1;			/**< Whether initiated from GIV reception */
 	unsigned unavailable:1;		/**< Set on Timout, Push route lost */
 	unsigned tls_upgraded:1;	/**< Was successfully upgraded to TLS */
+	unsigned preempted:1;		/**< Slow source, yield after current chunk */
 
 	struct cproxy *cproxy;		/**< Push proxy being used currently */
 	struct parq_dl_queued *parq_dl;	/**< Queuing status */
@@ -26,6 +26,7 @@
 
 #include "common.h"
 
+#include "lib/erbtree.h"
 #include "lib/eslist.h"
 #include "lib/http_range.h"
 #include "lib/path.h"
@@ -172,9 +173,12 @@ typedef struct dl_file_info {
 	filesize_t buffered;	/**< Amount of buffered data (unflushed) */
 	filesize_t uploaded;	/**< Amount of bytes uploaded */
 	eslist_t chunklist;		/**< List of ranges within file */
+	erbtree_t chunktree;	/**< Chunks of chunklist, indexed by range */
 	eslist_t available;		/**< List of ranges available, with source count */
 	http_rangeset_t *seen_on_network;  /**< Ranges available on network */
 	uint32 generation;		/**< Generation number, incremented on disk update */
+	uint32 db_crc;			/**< CRC of record persisted in fileinfo database */
+	uint32 db_len;			/**< Length of persisted record, 0 if none */
 	struct shared_file *sf;	/**< When PFSP-server is enabled, share this file */
 	uint32 active_queued;	/**< Actively queued sources */
 	uint32 passive_queued;	/**< Passively queued sources */
@@ -195,6 +199,8 @@ typedef struct dl_file_info {
 	 */
 
 	filesize_t vrfy_hashed;	/**< Amount of bytes hashed so far during verify */
+	filesize_t sha1_hashed;	/**< Leading bytes already fed to sha1_ctx */
+	struct SHA1_context *sha1_ctx;	/**< SHA1 of prefix hashed when written */
 	filesize_t copied;		/**< Amount of bytes copied so far */
 	unsigned vrfy_elapsed;	/**< Time spent to compute the hash */
 	unsigned copy_elapsed;	/**< Time spent to copy the file */
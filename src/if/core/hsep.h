@@ -48,6 +48,7 @@ typedef struct {
 	hsep_triple table[HSEP_N_MAX + 1];      /**< Connection's HSEP table */
 	hsep_triple sent_table[HSEP_N_MAX];     /**< Previous table sent */
 	time_t last_sent;                       /**< When last msg was sent */
+	time_t last_changed;                    /**< When table was last sent */
 	time_t last_received;                   /**< When last msg was rcvd */
 	uint32 msgs_received;                   /**< # of msgs received */
 	uint32 triples_received;                /**< # of triples received */
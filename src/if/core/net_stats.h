@@ -76,6 +76,17 @@ typedef struct gnet_bw_stats {
 	uint64  limit;
 } gnet_bw_stats_t;
 
+/**
+ * Gnutella message handling statistics, for a given message type.
+ */
+typedef struct gnet_msg_stats {
+	msg_type_t type;			/**< Message type */
+	uint64 count;				/**< Messages handled */
+	uint64 bytes;				/**< Payload bytes handled */
+	uint64 total_ns;			/**< Total handling time, in nanoseconds */
+	uint64 max_ns;				/**< Maximum handling time */
+} gnet_msg_stats_t;
+
 /***
  *** General statistics
  ***/
@@ -86,6 +97,9 @@ void gnet_stats_get(gnet_stats_t *stats);
 void gnet_stats_tcp_get(gnet_stats_t *stats);
 void gnet_stats_udp_get(gnet_stats_t *stats);
 void gnet_get_bw_stats(gnet_bw_source type, gnet_bw_stats_t *stats);
+size_t gnet_stats_handled_get(gnet_msg_stats_t *vec, size_t cnt,
+	time_t *since);
+void gnet_stats_handled_reset(void);
 
 #endif /* CORE_SOURCES */
 
@@ -175,6 +175,7 @@ typedef struct gnet_record {
 	filesize_t available;		/**< Available bytes, if partial file */
 	time_t create_time;			/**< Create Time of file; zero if unknown */
 	time_t mod_time;			/**< Last modification time of partial file */
+	uint64 fingerprint;			/**< SHA1 or name/size hash, never 0 once set */
 	uint32 file_index;			/**< Index for GET command */
     uint32 flags;
 } gnet_record_t;
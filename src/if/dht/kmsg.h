@@ -27,6 +27,17 @@
 #include "kademlia.h"
 #include "lib/host_addr.h"
 
+/**
+ * Kademlia message handling statistics, for a given message function.
+ */
+typedef struct kmsg_stats {
+	const char *name;			/**< Message name */
+	uint64 count;				/**< Messages handled */
+	uint64 bytes;				/**< Payload bytes handled */
+	uint64 total_ns;			/**< Total handling time, in nanoseconds */
+	uint64 max_ns;				/**< Maximum handling time */
+} kmsg_stats_t;
+
 /*
  * Public interface.
  */
@@ -36,11 +47,16 @@ struct gnutella_node;
 void kmsg_received(const void *data, size_t len,
 	host_addr_t addr, uint16 port,
 	struct gnutella_node *n);
+void kmsg_received_async(const void *data, size_t len,
+	host_addr_t addr, uint16 port,
+	struct gnutella_node *n);
 bool kmsg_can_drop(const void *pdu, int size);
 
 const char *kmsg_infostr(const void *msg);
 const char *kmsg_name(uint function);
 size_t kmsg_infostr_to_buf(const void *msg, char *buf, size_t buf_size);
+size_t kmsg_stats_get(kmsg_stats_t *vec, size_t cnt, time_t *since);
+void kmsg_stats_reset(void);
 
 /*
  * Inlined routines.
@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Thu Oct 15 07:08:47 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -430,6 +430,18 @@ static const char *stats_symbols[] = {
 	"stats_digest",
 	"stats_tcp_digest",
 	"stats_udp_digest",
+	"mq_sojourn_median",
+	"mq_sojourn_p90",
+	"mq_sojourn_p99",
+	"mq_sojourn_max",
+	"mq_codel_drops",
+	"udp_sr_tx_cwnd_reduced",
+	"dl_preempted_sources",
+	"dht_ulq_merged_lookups",
+	"udp_sr_tx_coalesced",
+	"udp_sr_rx_coalesced",
+	"dht_guid_cache_hits",
+	"dht_guid_cache_negative_hits",
 };
 
 /**
@@ -866,6 +878,18 @@ static const char *stats_text[] = {
 	N_("Digests computed on general statistics"),
 	N_("Digests computed on TCP statistics"),
 	N_("Digests computed on UDP statistics"),
+	N_("Median queueing delay of sent messages (ms)"),
+	N_("90th percentile of queueing delay (ms)"),
+	N_("99th percentile of queueing delay (ms)"),
+	N_("Maximum queueing delay of sent messages (ms)"),
+	N_("Messages dropped after waiting too long in queue"),
+	N_("Semi-reliable UDP congestion window reductions"),
+	N_("Slow download sources preempted by faster ones"),
+	N_("DHT user lookups merged with an identical pending one"),
+	N_("Gnutella messages coalesced into semi-reliable UDP messages"),
+	N_("Gnutella messages received coalesced via semi-reliable UDP"),
+	N_("DHT push-proxy lookups answered from the GUID cache"),
+	N_("DHT push-proxy lookups skipped after a recent failure"),
 };
 
 /**
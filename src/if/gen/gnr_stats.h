@@ -1,5 +1,5 @@
 /*
- * Generated on Sun Mar 10 21:55:45 2019 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Thu Oct 15 07:08:47 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -8,7 +8,7 @@
 #define _if_gen_gnr_stats_h_
 
 /*
- * Enum count: 415
+ * Enum count: 427
  */
 typedef enum {
 	GNR_ROUTING_ERRORS = 0,
@@ -426,6 +426,18 @@ typedef enum {
 	GNR_STATS_DIGEST,
 	GNR_STATS_TCP_DIGEST,
 	GNR_STATS_UDP_DIGEST,
+	GNR_MQ_SOJOURN_MEDIAN,
+	GNR_MQ_SOJOURN_P90,
+	GNR_MQ_SOJOURN_P99,
+	GNR_MQ_SOJOURN_MAX,
+	GNR_MQ_CODEL_DROPS,
+	GNR_UDP_SR_TX_CWND_REDUCED,
+	GNR_DL_PREEMPTED_SOURCES,
+	GNR_DHT_ULQ_MERGED_LOOKUPS,
+	GNR_UDP_SR_TX_COALESCED,
+	GNR_UDP_SR_RX_COALESCED,
+	GNR_DHT_GUID_CACHE_HITS,
+	GNR_DHT_GUID_CACHE_NEGATIVE_HITS,
 
 	GNR_TYPE_COUNT
 } gnr_stats_t;
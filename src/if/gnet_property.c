@@ -1134,6 +1134,34 @@ gboolean gnet_property_variable_running_topless     = FALSE;
 static const gboolean gnet_property_variable_running_topless_default = FALSE;
 gboolean gnet_property_variable_send_oob_ind_reliably     = TRUE;
 static const gboolean gnet_property_variable_send_oob_ind_reliably_default = TRUE;
+guint32  gnet_property_variable_search_matching_threads     = 0;
+static const guint32  gnet_property_variable_search_matching_threads_default = 0;
+guint32  gnet_property_variable_tth_hashing_threads     = 0;
+static const guint32  gnet_property_variable_tth_hashing_threads_default = 0;
+gboolean gnet_property_variable_tls_kernel_offload     = TRUE;
+static const gboolean gnet_property_variable_tls_kernel_offload_default = TRUE;
+gboolean gnet_property_variable_deflate_low_memory     = FALSE;
+static const gboolean gnet_property_variable_deflate_low_memory_default = FALSE;
+gboolean gnet_property_variable_deflate_dictionary     = TRUE;
+static const gboolean gnet_property_variable_deflate_dictionary_default = TRUE;
+gboolean gnet_property_variable_deflate_shared_broadcast     = TRUE;
+static const gboolean gnet_property_variable_deflate_shared_broadcast_default = TRUE;
+gboolean gnet_property_variable_mq_codel     = TRUE;
+static const gboolean gnet_property_variable_mq_codel_default = TRUE;
+guint32  gnet_property_variable_mq_codel_target     = 500;
+static const guint32  gnet_property_variable_mq_codel_target_default = 500;
+guint32  gnet_property_variable_mq_codel_interval     = 5000;
+static const guint32  gnet_property_variable_mq_codel_interval_default = 5000;
+gboolean gnet_property_variable_bw_pacing     = TRUE;
+static const gboolean gnet_property_variable_bw_pacing_default = TRUE;
+gboolean gnet_property_variable_download_preallocate     = FALSE;
+static const gboolean gnet_property_variable_download_preallocate_default = FALSE;
+gboolean gnet_property_variable_search_word_index     = FALSE;
+static const gboolean gnet_property_variable_search_word_index_default = FALSE;
+gboolean gnet_property_variable_dump_capture     = FALSE;
+static const gboolean gnet_property_variable_dump_capture_default = FALSE;
+guint32  gnet_property_variable_dump_capture_sampling     = 1;
+static const guint32  gnet_property_variable_dump_capture_sampling_default = 1;
 
 static prop_set_t *gnet_property;
 
@@ -11418,6 +11446,287 @@ gnet_prop_init(void) {
     gnet_property->props[488].data.boolean.def   = (void *) &gnet_property_variable_send_oob_ind_reliably_default;
     gnet_property->props[488].data.boolean.value = (void *) &gnet_property_variable_send_oob_ind_reliably;
 
+
+    /*
+     * PROP_SEARCH_MATCHING_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[489].name = "search_matching_threads";
+    gnet_property->props[489].desc = _("Amount of worker threads helping the main thread to match incoming queries against the library.  Large search bins are split between the main thread and the workers.  When 0, all the matching is done by the main thread.");
+    gnet_property->props[489].ev_changed = event_new("search_matching_threads_changed");
+    gnet_property->props[489].save = TRUE;
+    gnet_property->props[489].internal = FALSE;
+    gnet_property->props[489].vector_size = 1;
+	mutex_init(&gnet_property->props[489].lock);
+
+    /* Type specific data: */
+    gnet_property->props[489].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[489].data.guint32.def   = (void *) &gnet_property_variable_search_matching_threads_default;
+    gnet_property->props[489].data.guint32.value = (void *) &gnet_property_variable_search_matching_threads;
+    gnet_property->props[489].data.guint32.choices = NULL;
+    gnet_property->props[489].data.guint32.max   = 16;
+    gnet_property->props[489].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_TTH_HASHING_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[490].name = "tth_hashing_threads";
+    gnet_property->props[490].desc = _("Amount of additional threads used to compute the TTH of files, hashing their data blocks in parallel.  Set to 0 to hash files with the verification thread only.");
+    gnet_property->props[490].ev_changed = event_new("tth_hashing_threads_changed");
+    gnet_property->props[490].save = TRUE;
+    gnet_property->props[490].internal = FALSE;
+    gnet_property->props[490].vector_size = 1;
+	mutex_init(&gnet_property->props[490].lock);
+
+    /* Type specific data: */
+    gnet_property->props[490].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[490].data.guint32.def   = (void *) &gnet_property_variable_tth_hashing_threads_default;
+    gnet_property->props[490].data.guint32.value = (void *) &gnet_property_variable_tth_hashing_threads;
+    gnet_property->props[490].data.guint32.choices = NULL;
+    gnet_property->props[490].data.guint32.max   = 16;
+    gnet_property->props[490].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_TLS_KERNEL_OFFLOAD:
+     *
+     * General data:
+     */
+    gnet_property->props[491].name = "tls_kernel_offload";
+    gnet_property->props[491].desc = _("Whether the TLS session keys of uploads can be handed to the kernel once the handshake is done, so that files can be sent with sendfile() on encrypted connections.  Only used when the kernel supports TLS offloading.");
+    gnet_property->props[491].ev_changed = event_new("tls_kernel_offload_changed");
+    gnet_property->props[491].save = TRUE;
+    gnet_property->props[491].internal = FALSE;
+    gnet_property->props[491].vector_size = 1;
+	mutex_init(&gnet_property->props[491].lock);
+
+    /* Type specific data: */
+    gnet_property->props[491].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[491].data.boolean.def   = (void *) &gnet_property_variable_tls_kernel_offload_default;
+    gnet_property->props[491].data.boolean.value = (void *) &gnet_property_variable_tls_kernel_offload;
+
+
+    /*
+     * PROP_DEFLATE_LOW_MEMORY:
+     *
+     * General data:
+     */
+    gnet_property->props[492].name = "deflate_low_memory";
+    gnet_property->props[492].desc = _("Whether compressed Gnutella connections should use smaller compression windows to reduce memory usage, at the expense of a slightly lower compression ratio.");
+    gnet_property->props[492].ev_changed = event_new("deflate_low_memory_changed");
+    gnet_property->props[492].save = TRUE;
+    gnet_property->props[492].internal = FALSE;
+    gnet_property->props[492].vector_size = 1;
+	mutex_init(&gnet_property->props[492].lock);
+
+    /* Type specific data: */
+    gnet_property->props[492].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[492].data.boolean.def   = (void *) &gnet_property_variable_deflate_low_memory_default;
+    gnet_property->props[492].data.boolean.value = (void *) &gnet_property_variable_deflate_low_memory;
+
+
+    /*
+     * PROP_DEFLATE_DICTIONARY:
+     *
+     * General data:
+     */
+    gnet_property->props[493].name = "deflate_dictionary";
+    gnet_property->props[493].desc = _("Whether to pre-seed compressed Gnutella connections with a dictionary of common Gnutella strings, when the remote peer supports it.");
+    gnet_property->props[493].ev_changed = event_new("deflate_dictionary_changed");
+    gnet_property->props[493].save = TRUE;
+    gnet_property->props[493].internal = FALSE;
+    gnet_property->props[493].vector_size = 1;
+	mutex_init(&gnet_property->props[493].lock);
+
+    /* Type specific data: */
+    gnet_property->props[493].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[493].data.boolean.def   = (void *) &gnet_property_variable_deflate_dictionary_default;
+    gnet_property->props[493].data.boolean.value = (void *) &gnet_property_variable_deflate_dictionary;
+
+
+    /*
+     * PROP_DEFLATE_SHARED_BROADCAST:
+     *
+     * General data:
+     */
+    gnet_property->props[494].name = "deflate_shared_broadcast";
+    gnet_property->props[494].desc = _("Whether messages broadcasted to many compressed connections should be compressed only once when the CPU is overloaded, at the expense of a lower compression ratio.");
+    gnet_property->props[494].ev_changed = event_new("deflate_shared_broadcast_changed");
+    gnet_property->props[494].save = TRUE;
+    gnet_property->props[494].internal = FALSE;
+    gnet_property->props[494].vector_size = 1;
+	mutex_init(&gnet_property->props[494].lock);
+
+    /* Type specific data: */
+    gnet_property->props[494].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[494].data.boolean.def   = (void *) &gnet_property_variable_deflate_shared_broadcast_default;
+    gnet_property->props[494].data.boolean.value = (void *) &gnet_property_variable_deflate_shared_broadcast;
+
+
+    /*
+     * PROP_MQ_CODEL:
+     *
+     * General data:
+     */
+    gnet_property->props[495].name = "mq_codel";
+    gnet_property->props[495].desc = _("Whether send queues should drop droppable messages that waited too long, based on their queueing delay rather than on the amount of bytes queued.");
+    gnet_property->props[495].ev_changed = event_new("mq_codel_changed");
+    gnet_property->props[495].save = TRUE;
+    gnet_property->props[495].internal = FALSE;
+    gnet_property->props[495].vector_size = 1;
+	mutex_init(&gnet_property->props[495].lock);
+
+    /* Type specific data: */
+    gnet_property->props[495].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[495].data.boolean.def   = (void *) &gnet_property_variable_mq_codel_default;
+    gnet_property->props[495].data.boolean.value = (void *) &gnet_property_variable_mq_codel;
+
+
+    /*
+     * PROP_MQ_CODEL_TARGET:
+     *
+     * General data:
+     */
+    gnet_property->props[496].name = "mq_codel_target";
+    gnet_property->props[496].desc = _("Target queueing delay in send queues, in milliseconds.  Droppable messages start to be dropped when the delay stays above that target for a whole interval.");
+    gnet_property->props[496].ev_changed = event_new("mq_codel_target_changed");
+    gnet_property->props[496].save = TRUE;
+    gnet_property->props[496].internal = FALSE;
+    gnet_property->props[496].vector_size = 1;
+	mutex_init(&gnet_property->props[496].lock);
+
+    /* Type specific data: */
+    gnet_property->props[496].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[496].data.guint32.def   = (void *) &gnet_property_variable_mq_codel_target_default;
+    gnet_property->props[496].data.guint32.value = (void *) &gnet_property_variable_mq_codel_target;
+    gnet_property->props[496].data.guint32.choices = NULL;
+    gnet_property->props[496].data.guint32.max   = 60000;
+    gnet_property->props[496].data.guint32.min   = 5;
+
+
+    /*
+     * PROP_MQ_CODEL_INTERVAL:
+     *
+     * General data:
+     */
+    gnet_property->props[497].name = "mq_codel_interval";
+    gnet_property->props[497].desc = _("Interval, in milliseconds, during which the queueing delay must stay above its target before send queues start to drop old droppable messages.");
+    gnet_property->props[497].ev_changed = event_new("mq_codel_interval_changed");
+    gnet_property->props[497].save = TRUE;
+    gnet_property->props[497].internal = FALSE;
+    gnet_property->props[497].vector_size = 1;
+	mutex_init(&gnet_property->props[497].lock);
+
+    /* Type specific data: */
+    gnet_property->props[497].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[497].data.guint32.def   = (void *) &gnet_property_variable_mq_codel_interval_default;
+    gnet_property->props[497].data.guint32.value = (void *) &gnet_property_variable_mq_codel_interval;
+    gnet_property->props[497].data.guint32.choices = NULL;
+    gnet_property->props[497].data.guint32.max   = 600000;
+    gnet_property->props[497].data.guint32.min   = 100;
+
+
+    /*
+     * PROP_BW_PACING:
+     *
+     * General data:
+     */
+    gnet_property->props[498].name = "bw_pacing";
+    gnet_property->props[498].desc = _("Whether bandwidth should be made available gradually within each scheduling period, to avoid traffic bursts at the beginning of each period followed by idle times.");
+    gnet_property->props[498].ev_changed = event_new("bw_pacing_changed");
+    gnet_property->props[498].save = TRUE;
+    gnet_property->props[498].internal = FALSE;
+    gnet_property->props[498].vector_size = 1;
+	mutex_init(&gnet_property->props[498].lock);
+
+    /* Type specific data: */
+    gnet_property->props[498].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[498].data.boolean.def   = (void *) &gnet_property_variable_bw_pacing_default;
+    gnet_property->props[498].data.boolean.value = (void *) &gnet_property_variable_bw_pacing;
+
+
+    /*
+     * PROP_DOWNLOAD_PREALLOCATE:
+     *
+     * General data:
+     */
+    gnet_property->props[499].name = "download_preallocate";
+    gnet_property->props[499].desc = _("Whether disk space for new downloads should be reserved when they start, so that the file gets contiguous extents even though chunks are written in random order.  Only done when the file size is known and when the system supports it.");
+    gnet_property->props[499].ev_changed = event_new("download_preallocate_changed");
+    gnet_property->props[499].save = TRUE;
+    gnet_property->props[499].internal = FALSE;
+    gnet_property->props[499].vector_size = 1;
+	mutex_init(&gnet_property->props[499].lock);
+
+    /* Type specific data: */
+    gnet_property->props[499].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[499].data.boolean.def   = (void *) &gnet_property_variable_download_preallocate_default;
+    gnet_property->props[499].data.boolean.value = (void *) &gnet_property_variable_download_preallocate;
+
+
+    /*
+     * PROP_SEARCH_WORD_INDEX:
+     *
+     * General data:
+     */
+    gnet_property->props[500].name = "search_word_index";
+    gnet_property->props[500].desc = _("Whether the library search table should also index the beginning of the words in file names, so that queries only need to look at the files having all the query words.  This uses more memory and applies the next time the library is rescanned.");
+    gnet_property->props[500].ev_changed = event_new("search_word_index_changed");
+    gnet_property->props[500].save = TRUE;
+    gnet_property->props[500].internal = FALSE;
+    gnet_property->props[500].vector_size = 1;
+	mutex_init(&gnet_property->props[500].lock);
+
+    /* Type specific data: */
+    gnet_property->props[500].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[500].data.boolean.def   = (void *) &gnet_property_variable_search_word_index_default;
+    gnet_property->props[500].data.boolean.value = (void *) &gnet_property_variable_search_word_index;
+
+
+    /*
+     * PROP_DUMP_CAPTURE:
+     *
+     * General data:
+     */
+    gnet_property->props[501].name = "dump_capture";
+    gnet_property->props[501].desc = _("If enabled, Gnutella packets are captured into $GTK_GNUTELLA_DIR/packets.pcapng, through an in-memory ring flushed by a background thread.  Packets are dropped rather than delaying traffic when the ring is full.  The dump_rx_addrs, dump_tx_from_addrs and dump_tx_to_addrs filters apply.");
+    gnet_property->props[501].ev_changed = event_new("dump_capture_changed");
+    gnet_property->props[501].save = FALSE;
+    gnet_property->props[501].internal = FALSE;
+    gnet_property->props[501].vector_size = 1;
+	mutex_init(&gnet_property->props[501].lock);
+
+    /* Type specific data: */
+    gnet_property->props[501].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[501].data.boolean.def   = (void *) &gnet_property_variable_dump_capture_default;
+    gnet_property->props[501].data.boolean.value = (void *) &gnet_property_variable_dump_capture;
+
+
+    /*
+     * PROP_DUMP_CAPTURE_SAMPLING:
+     *
+     * General data:
+     */
+    gnet_property->props[502].name = "dump_capture_sampling";
+    gnet_property->props[502].desc = _("When capturing packets, only capture one out of that many packets, in each direction.");
+    gnet_property->props[502].ev_changed = event_new("dump_capture_sampling_changed");
+    gnet_property->props[502].save = TRUE;
+    gnet_property->props[502].internal = FALSE;
+    gnet_property->props[502].vector_size = 1;
+	mutex_init(&gnet_property->props[502].lock);
+
+    /* Type specific data: */
+    gnet_property->props[502].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[502].data.guint32.def   = (void *) &gnet_property_variable_dump_capture_sampling_default;
+    gnet_property->props[502].data.guint32.value = (void *) &gnet_property_variable_dump_capture_sampling;
+    gnet_property->props[502].data.guint32.choices = NULL;
+    gnet_property->props[502].data.guint32.max   = 1000000;
+    gnet_property->props[502].data.guint32.min   = 1;
+
     gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
     for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
         htable_insert(gnet_property->by_name,
@@ -525,6 +525,20 @@ typedef enum {
     PROP_LOCK_SLEEP_TRACE,
     PROP_RUNNING_TOPLESS,
     PROP_SEND_OOB_IND_RELIABLY,
+    PROP_SEARCH_MATCHING_THREADS,
+    PROP_TTH_HASHING_THREADS,
+    PROP_TLS_KERNEL_OFFLOAD,
+    PROP_DEFLATE_LOW_MEMORY,
+    PROP_DEFLATE_DICTIONARY,
+    PROP_DEFLATE_SHARED_BROADCAST,
+    PROP_MQ_CODEL,
+    PROP_MQ_CODEL_TARGET,
+    PROP_MQ_CODEL_INTERVAL,
+    PROP_BW_PACING,
+    PROP_DOWNLOAD_PREALLOCATE,
+    PROP_SEARCH_WORD_INDEX,
+    PROP_DUMP_CAPTURE,
+    PROP_DUMP_CAPTURE_SAMPLING,
     GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -539,6 +539,20 @@ extern const gboolean gnet_property_variable_lock_contention_trace;
 extern const gboolean gnet_property_variable_lock_sleep_trace;
 extern const gboolean gnet_property_variable_running_topless;
 extern const gboolean gnet_property_variable_send_oob_ind_reliably;
+extern const guint32  gnet_property_variable_search_matching_threads;
+extern const guint32  gnet_property_variable_tth_hashing_threads;
+extern const gboolean gnet_property_variable_tls_kernel_offload;
+extern const gboolean gnet_property_variable_deflate_low_memory;
+extern const gboolean gnet_property_variable_deflate_dictionary;
+extern const gboolean gnet_property_variable_deflate_shared_broadcast;
+extern const gboolean gnet_property_variable_mq_codel;
+extern const guint32  gnet_property_variable_mq_codel_target;
+extern const guint32  gnet_property_variable_mq_codel_interval;
+extern const gboolean gnet_property_variable_bw_pacing;
+extern const gboolean gnet_property_variable_download_preallocate;
+extern const gboolean gnet_property_variable_search_word_index;
+extern const gboolean gnet_property_variable_dump_capture;
+extern const guint32  gnet_property_variable_dump_capture_sampling;
 
 
 prop_set_t *gnet_prop_init(void);
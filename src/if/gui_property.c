@@ -365,6 +365,10 @@ guint32  gui_property_variable_gnet_stats_notebook_tab     = 0;
 static const guint32  gui_property_variable_gnet_stats_notebook_tab_default = 0;
 guint32  gui_property_variable_downloads_info_notebook_tab     = 0;
 static const guint32  gui_property_variable_downloads_info_notebook_tab_default = 0;
+gboolean gui_property_variable_search_spill_results     = FALSE;
+static const gboolean gui_property_variable_search_spill_results_default = FALSE;
+guint32  gui_property_variable_search_spill_age     = 3600;
+static const guint32  gui_property_variable_search_spill_age_default = 3600;
 
 static prop_set_t *gui_property;
 
@@ -2916,6 +2920,47 @@ gui_prop_init(void) {
     gui_property->props[125].data.guint32.max   = 0xFFFFFFFF;
     gui_property->props[125].data.guint32.min   = 0x00000000;
 
+
+    /*
+     * PROP_SEARCH_SPILL_RESULTS:
+     *
+     * General data:
+     */
+    gui_property->props[126].name = "search_spill_results";
+    gui_property->props[126].desc = _("Whether the XML metadata and alternate locations of old search results should be moved to a disk file, to limit the memory used by searches left open for a long time.  They are loaded back when the result is viewed or downloaded.");
+    gui_property->props[126].ev_changed = event_new("search_spill_results_changed");
+    gui_property->props[126].save = TRUE;
+    gui_property->props[126].internal = FALSE;
+    gui_property->props[126].vector_size = 1;
+	mutex_init(&gui_property->props[126].lock);
+
+    /* Type specific data: */
+    gui_property->props[126].type               = PROP_TYPE_BOOLEAN;
+    gui_property->props[126].data.boolean.def   = (void *) &gui_property_variable_search_spill_results_default;
+    gui_property->props[126].data.boolean.value = (void *) &gui_property_variable_search_spill_results;
+
+
+    /*
+     * PROP_SEARCH_SPILL_AGE:
+     *
+     * General data:
+     */
+    gui_property->props[127].name = "search_spill_age";
+    gui_property->props[127].desc = _("Age, in seconds, past which the data of search results are moved to disk, when search_spill_results is enabled.");
+    gui_property->props[127].ev_changed = event_new("search_spill_age_changed");
+    gui_property->props[127].save = TRUE;
+    gui_property->props[127].internal = FALSE;
+    gui_property->props[127].vector_size = 1;
+	mutex_init(&gui_property->props[127].lock);
+
+    /* Type specific data: */
+    gui_property->props[127].type               = PROP_TYPE_GUINT32;
+    gui_property->props[127].data.guint32.def   = (void *) &gui_property_variable_search_spill_age_default;
+    gui_property->props[127].data.guint32.value = (void *) &gui_property_variable_search_spill_age;
+    gui_property->props[127].data.guint32.choices = NULL;
+    gui_property->props[127].data.guint32.max   = 2592000;
+    gui_property->props[127].data.guint32.min   = 60;
+
     gui_property->by_name = htable_create(HASH_KEY_STRING, 0);
     for (n = 0; n < GUI_PROPERTY_NUM; n ++) {
         htable_insert(gui_property->by_name,
@@ -162,6 +162,8 @@ typedef enum {
     PROP_MAIN_NOTEBOOK_TAB,
     PROP_GNET_STATS_NOTEBOOK_TAB,
     PROP_DOWNLOADS_INFO_NOTEBOOK_TAB,
+    PROP_SEARCH_SPILL_RESULTS,
+    PROP_SEARCH_SPILL_AGE,
     GUI_PROPERTY_END
 } gui_property_t;
 
@@ -172,6 +172,8 @@ extern const guint32  gui_property_variable_fileinfo_notebook_tab;
 extern const guint32  gui_property_variable_main_notebook_tab;
 extern const guint32  gui_property_variable_gnet_stats_notebook_tab;
 extern const guint32  gui_property_variable_downloads_info_notebook_tab;
+extern const gboolean gui_property_variable_search_spill_results;
+extern const guint32  gui_property_variable_search_spill_age;
 
 
 prop_set_t *gui_prop_init(void);
@@ -107,6 +107,7 @@ struct adns_response {
 typedef struct adns_cache_entry {
 	const char *hostname;		/**< atom */
 	time_t timestamp;
+	int ttl;				/**< Lifetime of entry, in seconds */
 	size_t n;				/**< Number of addr items */
 	unsigned id;
 	host_addr_t addrs[1 /* pseudo-size */];
@@ -135,9 +136,14 @@ count_addrs(const host_addr_t *addrs, size_t m)
 }
 
 /**
- * Cache entries will expire after ADNS_CACHE_TIMEOUT seconds.
+ * Cache entries will expire after ADNS_CACHE_TIMEOUT seconds, failed
+ * resolutions after ADNS_CACHE_NEG_TIMEOUT seconds.
+ *
+ * The system resolver does not give us the TTL of the DNS records, hence
+ * we use fixed lifetimes, similar to those of nscd.
  */
-#define ADNS_CACHE_TIMEOUT 60
+#define ADNS_CACHE_TIMEOUT		300
+#define ADNS_CACHE_NEG_TIMEOUT	60
 
 /**
  * Cache max. ADNS_CACHE_SIZE of adns_cache_entry_t entries.
@@ -148,17 +154,35 @@ typedef struct adns_cache_struct {
 	hikset_t *ht;
 	unsigned pos;
 	int timeout;
+	int neg_timeout;
 	adns_cache_entry_t *entries[ADNS_CACHE_MAX_SIZE];
 } adns_cache_t;
 
 static adns_cache_t *adns_cache = NULL;
 
+/**
+ * A forward resolution in progress, with the requests for the same hostname
+ * that came in meanwhile and which will get the same reply.
+ */
+struct adns_pending {
+	const char *hostname;		/**< atom */
+	pslist_t *waiters;			/**< Additional requests (adns_common) */
+};
+
+/**
+ * Amount of helper threads, so that a slow resolution does not delay the
+ * other ones.
+ */
+#define ADNS_HELPERS	4
+
 /* private variables */
 
 static unsigned adns_reply_event_id;
 static aqueue_t *adns_req;
 static aqueue_t *adns_ans;
-static int adns_id = -1;
+static hikset_t *adns_pending;
+static int adns_id[ADNS_HELPERS];
+static uint adns_helpers;		/**< Amount of helper threads started */
 
 /**
  * Private functions.
@@ -172,6 +196,7 @@ adns_cache_init(void)
 
 	XMALLOC(cache);
 	cache->timeout = ADNS_CACHE_TIMEOUT;
+	cache->neg_timeout = ADNS_CACHE_NEG_TIMEOUT;
 	cache->ht = hikset_create(
 		offsetof(adns_cache_entry_t, hostname), HASH_KEY_STRING, 0);
 	cache->pos = 0;
@@ -184,6 +209,7 @@ adns_cache_init(void)
 /* these are not needed anywhere else so undefine them */
 #undef ADNS_CACHE_MAX_SIZE
 #undef ADNS_CACHE_TIMEOUT
+#undef ADNS_CACHE_NEG_TIMEOUT
 
 static inline adns_cache_entry_t *
 adns_cache_get_entry(adns_cache_t *cache, unsigned i)
@@ -249,6 +275,9 @@ adns_cache_free(adns_cache_t **cache_ptr)
  * Adds ``hostname'' and ``addr'' to the cache. The cache is implemented
  * as a wrap-around FIFO. In case it's full, the oldest entry will be
  * overwritten.
+ *
+ * A single zero address records a failed resolution, which is kept for
+ * a shorter time than successful ones.
  */
 static void
 adns_cache_add(adns_cache_t *cache, time_t now,
@@ -279,6 +308,7 @@ adns_cache_add(adns_cache_t *cache, time_t now,
 	entry->n = n;
 	entry->hostname = atom_str_get(hostname);
 	entry->timestamp = now;
+	entry->ttl = is_host_addr(addrs[0]) ? cache->timeout : cache->neg_timeout;
 	entry->id = cache->pos;
 	for (i = 0; i < entry->n; i++) {
 		entry->addrs[i] = addrs[i];
@@ -289,7 +319,7 @@ adns_cache_add(adns_cache_t *cache, time_t now,
 }
 
 /**
- * Looks for ``hostname'' in ``cache'' wrt to cache->timeout. If
+ * Looks for ``hostname'' in ``cache'' wrt to the entry lifetime. If
  * ``hostname'' is not found or the entry is expired, FALSE will be
  * returned. Expired entries will be removed! ``addr'' is allowed to
  * be NULL, otherwise the cached IP will be stored into the variable
@@ -312,7 +342,7 @@ adns_cache_lookup(adns_cache_t *cache, time_t now,
 
 	entry = hikset_lookup(cache->ht, hostname);
 	if (entry) {
-		if (delta_time(now, entry->timestamp) < cache->timeout) {
+		if (delta_time(now, entry->timestamp) < entry->ttl) {
 			size_t i;
 
 			for (i = 0; i < n; i++) {
@@ -402,11 +432,14 @@ struct adns_helper_args {
 #define ADNS_HELPER_STACK	THREAD_STACK_MIN
 
 /**
- * The ``main'' function of the adns helper thread (server).
+ * The ``main'' function of the adns helper threads (server).
  *
  * Simply reads requests (queries) from the queue, performs a DNS lookup for it
  * and writes the result back to the output queue. All operations should be
  * blocking.
+ *
+ * Several helpers share the same queues, each one processing the next
+ * pending request as soon as it is done with the previous one.
  */
 static void *
 adns_helper(void *p)
@@ -481,6 +514,105 @@ adns_fallback(const struct adns_request *req)
 	adns_invoke_user_callback(&ans);
 }
 
+/**
+ * Record that a forward resolution for ``hostname'' was sent to the helpers.
+ */
+static void
+adns_pending_add(const char *hostname)
+{
+	struct adns_pending *ap;
+
+	g_assert(!hikset_contains(adns_pending, hostname));
+
+	WALLOC0(ap);
+	ap->hostname = atom_str_get(hostname);
+	hikset_insert_key(adns_pending, &ap->hostname);
+}
+
+/**
+ * If a forward resolution for the same hostname is already in progress,
+ * attach the request to it so that it gets the same reply.
+ *
+ * @return TRUE if the request will be answered when the pending
+ * resolution completes.
+ */
+static bool
+adns_pending_join(const struct adns_request *req)
+{
+	struct adns_pending *ap;
+
+	g_assert(!req->common.reverse);
+
+	ap = hikset_lookup(adns_pending, req->query.by_addr.hostname);
+	if (NULL == ap)
+		return FALSE;
+
+	if (common_dbg > 1) {
+		g_debug("%s: \"%s\" already being resolved",
+			G_STRFUNC, ap->hostname);
+	}
+
+	ap->waiters = pslist_prepend(ap->waiters, WCOPY(&req->common));
+	return TRUE;
+}
+
+/**
+ * Invoke the user callbacks of the requests which were waiting for the
+ * same resolution as the one we got an answer for.
+ */
+static void
+adns_pending_done(const struct adns_response *ans)
+{
+	const struct adns_reply *reply = &ans->reply.by_addr;
+	struct adns_pending *ap;
+	pslist_t *sl;
+
+	ap = hikset_lookup(adns_pending, reply->hostname);
+	if (NULL == ap)
+		return;
+
+	/*
+	 * Remove the entry first: callbacks may issue new resolutions for
+	 * the same hostname.
+	 */
+
+	hikset_remove(adns_pending, ap->hostname);
+
+	PSLIST_FOREACH(ap->waiters, sl) {
+		struct adns_common *common = sl->data;
+		struct adns_response copy = *ans;
+
+		copy.common = *common;
+		adns_invoke_user_callback(&copy);
+		WFREE(common);
+	}
+
+	pslist_free_null(&ap->waiters);
+	atom_str_free_null(&ap->hostname);
+	WFREE(ap);
+}
+
+/**
+ * Free pending resolution entry, without notifying the waiting requests.
+ */
+static void
+adns_pending_free(void *value, void *unused_data)
+{
+	struct adns_pending *ap = value;
+	pslist_t *sl;
+
+	(void) unused_data;
+
+	PSLIST_FOREACH(ap->waiters, sl) {
+		struct adns_common *common = sl->data;
+		WFREE(common);
+	}
+
+	pslist_free_null(&ap->waiters);
+	atom_str_free_null(&ap->hostname);
+	WFREE(ap);
+}
+
 static void
 adns_reply_ready(const struct adns_response *ans)
 {
@@ -519,6 +651,9 @@ adns_reply_ready(const struct adns_response *ans)
 
 	g_assert(ans->common.user_callback);
 	adns_invoke_user_callback(ans);
+
+	if (!ans->common.reverse)
+		adns_pending_done(ans);
 }
 
 /**
@@ -556,11 +691,10 @@ static void
 adns_helper_init(void)
 {
 	waiter_t *waiter;
-	struct adns_helper_args *args;
-	int r;
+	uint i;
 
 	/*
-	 * The ADNS thread talks to the main thread via a pair of asynchronous
+	 * The ADNS threads talk to the main thread via a pair of asynchronous
 	 * queues: requests are written to the adns_req queue and replies read
 	 * from the adns_ans queue.
 	 *
@@ -580,14 +714,17 @@ adns_helper_init(void)
 			adns_reply_callback, waiter);
 	waiter_destroy_null(&waiter);	/* Is now referenced by the queue */
 
-	WALLOC(args);
-	args->requests = adns_req;
-	args->answers = adns_ans;
+	for (i = 0; i < N_ITEMS(adns_id); i++) {
+		struct adns_helper_args *args;
 
-	r = thread_create(adns_helper, args,
-			THREAD_F_NO_POOL | THREAD_F_PANIC, ADNS_HELPER_STACK);
+		WALLOC(args);
+		args->requests = adns_req;
+		args->answers = adns_ans;
 
-	adns_id = r;
+		adns_id[i] = thread_create(adns_helper, args,
+				THREAD_F_NO_POOL | THREAD_F_PANIC, ADNS_HELPER_STACK);
+		adns_helpers++;
+	}
 }
 
 /**
@@ -597,13 +734,15 @@ static void
 adns_init_once(void)
 {
 	adns_cache = adns_cache_init();
+	adns_pending = hikset_create(
+		offsetof(struct adns_pending, hostname), HASH_KEY_STRING, 0);
 	adns_helper_init();
 }
 
 /* public functions */
 
 /**
- * Initializes the adns helper running in a dedicated therad to resolve
+ * Initializes the adns helpers running in dedicated threads to resolve
  * hostnames asynchronously.
  */
 void
@@ -699,8 +838,13 @@ adns_resolve(const char *hostname, enum net_type net,
 		return FALSE; /* synchronous */
 	}
 
-	if (adns_send_request(&req))
+	if (adns_pending_join(&req))
+		return TRUE; /* asynchronous */
+
+	if (adns_send_request(&req)) {
+		adns_pending_add(query->hostname);
 		return TRUE; /* asynchronous */
+	}
 
 	if (common_dbg) {
 		g_warning("%s(): using synchronous resolution for \"%s\"",
@@ -756,25 +900,33 @@ adns_reverse_lookup(const host_addr_t addr,
 void
 adns_close(void)
 {
-	aq_put(adns_req, NULL);		/* Signals: end of processing */
+	uint i;
+
+	for (i = 0; i < adns_helpers; i++)
+		aq_put(adns_req, NULL);		/* Signals: end of processing */
 	aq_destroy_null(&adns_req);
 	aq_destroy_null(&adns_ans);
 	inputevt_remove(&adns_reply_event_id);
 	adns_cache_free(&adns_cache);
+	if (adns_pending != NULL) {
+		hikset_foreach(adns_pending, adns_pending_free, NULL);
+		hikset_free_null(&adns_pending);
+	}
 
 	/*
-	 * Wait for the ADNS to exit before continuing since we're shutdowning
-	 * and all the important subsystems on which the thread layer relies upon
-	 * are also going to be shutdowned (e.g. the callout queue).
+	 * Wait for the ADNS threads to exit before continuing since we're
+	 * shutdowning and all the important subsystems on which the thread
+	 * layer relies upon are also going to be shutdowned (e.g. the callout
+	 * queue).
 	 *
 	 * Therefore, having a deterministic destruction is important.
 	 */
 
-	if (-1 != adns_id) {
-		if (-1 == thread_join(adns_id, NULL))
+	for (i = 0; i < adns_helpers; i++) {
+		if (-1 == thread_join(adns_id[i], NULL))
 			g_warning("%s(): cannot join with ADNS thread: %m", G_STRFUNC);
-		adns_id = -1;
 	}
+	adns_helpers = 0;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
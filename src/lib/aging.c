@@ -65,7 +65,7 @@ struct aging {
 	enum aging_magic magic;		/**< Magic number */
 	int delay;					/**< Initial aging delay, in seconds */
 	hikset_t *table;			/**< The table holding values */
-	cperiodic_t *gc_ev;			/**< Periodic garbage collecting event */
+	cperiodic_t *gc_ev;			/**< Garbage collecting event, when not empty */
 	mutex_t *lock;				/**< Optional thread-safe lock */
 	free_keyval_fn_t kvfree;	/**< Freeing callback for key/value pairs */
 	elist_t list;				/**< List of items in table, oldest first */
@@ -147,8 +147,28 @@ aging_free(void *value, void *data)
 	WFREE(aval);
 }
 
+static bool aging_gc(void *obj);
+
+/**
+ * Record new item in the table, installing the garbage collecting event if
+ * it was not running.
+ */
+static void
+aging_append(aging_table_t *ag, struct aging_value *aval)
+{
+	assert_aging_locked(ag);
+
+	elist_append(&ag->list, aval);
+
+	if G_UNLIKELY(NULL == ag->gc_ev)
+		ag->gc_ev = cq_periodic_main_add(AGING_CALLOUT, aging_gc, ag);
+}
+
 /**
  * Periodic garbage collecting routine.
+ *
+ * The event is only running whilst the table holds items, so that idle
+ * tables do not cost anything.
  */
 static bool
 aging_gc(void *obj)
@@ -170,6 +190,11 @@ aging_gc(void *obj)
 		aging_free(aval, ag);
 	}
 
+	if (0 == elist_count(&ag->list)) {
+		ag->gc_ev = NULL;			/* Freed by the callout queue */
+		aging_return(ag, FALSE);	/* Will be re-installed on insertion */
+	}
+
 	aging_return(ag, TRUE);			/* Keep calling */
 }
 
@@ -209,8 +234,6 @@ aging_make(int delay, hash_fn_t hash, eq_fn_t eq, free_keyval_fn_t kvfree)
 	if (cq_main_thread_id() != thread_small_id())
 		aging_thread_safe(ag);
 
-	ag->gc_ev = cq_periodic_main_add(AGING_CALLOUT, aging_gc, ag);
-
 	aging_check(ag);
 	return ag;
 }
@@ -448,7 +471,7 @@ aging_insert(aging_table_t *ag, const void *key, void *value)
 		aval->key = deconstify_pointer(key);
 		aval->last_insert = now;
 		hikset_insert(ag->table, aval);
-		elist_append(&ag->list, aval);
+		aging_append(ag, aval);
 	}
 
 	aging_return_void(ag);
@@ -590,7 +613,7 @@ aging_saw_another_internal(
 		aval->last_insert = tm_time();
 
 		hikset_insert(ag->table, aval);
-		elist_append(&ag->list, aval);
+		aging_append(ag, aval);
 	} else {
 		/* Key already existed in the table */
 		g_assert(count > 1);
@@ -0,0 +1,867 @@
+/*
+ * alloc-test -- memory allocator benchmarking.
+ *
+ * Copyright (c) 2026 Raphael Manfredi <Raphael_Manfredi@pobox.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "atoms.h"
+#include "constants.h"
+#include "crash.h"
+#include "hikset.h"
+#include "htable.h"
+#include "log.h"
+#include "misc.h"
+#include "parse.h"
+#include "pmsg.h"
+#include "pow2.h"
+#include "progname.h"
+#include "random.h"
+#include "str.h"
+#include "stringify.h"
+#include "teq.h"
+#include "thread.h"
+#include "tm.h"
+#include "tmalloc.h"
+#include "vmm.h"
+#include "walloc.h"
+#include "xmalloc.h"
+#include "zalloc.h"
+
+#define BENCH_OPS		1000000		/* Default amount of operations */
+#define BENCH_LIVE		10000		/* Default amount of live objects */
+#define BENCH_THREADS	4			/* Default amount of remote producers */
+
+#define BENCH_MIN_SHIFT	3			/* Smallest size class is 8 bytes */
+#define BENCH_MAX_SHIFT	WALLOC_MAX_SHIFT
+#define BENCH_CLASSES	(BENCH_MAX_SHIFT - BENCH_MIN_SHIFT + 1)
+#define BENCH_MAX		(1U << BENCH_MAX_SHIFT)
+
+#define BENCH_STR_LEN	24			/* Max length of atom strings */
+#define BENCH_HIST		64			/* Latency histogram buckets */
+
+/*
+ * The allocator layers we can benchmark.
+ */
+enum bench_layer {
+	BENCH_XMALLOC = 0,
+	BENCH_WALLOC,
+	BENCH_ZALLOC,
+	BENCH_TMALLOC,
+
+	BENCH_LAYERS
+};
+
+static const char bench_layer_chars[] = "xwzt";
+
+static const char *bench_layer_names[] = {
+	"xmalloc",
+	"walloc",
+	"zalloc",
+	"tmalloc",
+};
+
+/*
+ * Latency histogram: bucket i holds operations that took less than 2^i ns.
+ */
+struct bench_lat {
+	uint64 hist[BENCH_HIST];
+	uint64 count;
+	uint64 max_ns;
+};
+
+struct bench_result {
+	uint64 elapsed_ns;		/* Total elapsed time */
+	size_t rss_base;		/* RSS before running */
+	size_t rss_peak;		/* RSS with the largest live set */
+	size_t live_peak;		/* Largest amount of live bytes requested */
+	struct bench_lat alloc;	/* Allocation latency */
+	struct bench_lat free;	/* Freeing latency */
+};
+
+struct bench_obj {
+	void *p;
+	size_t size;
+};
+
+static zone_t *bench_zones[BENCH_CLASSES];
+static tmalloc_t *bench_tmas[BENCH_CLASSES];
+
+static size_t bench_ops = BENCH_OPS;
+static size_t bench_live = BENCH_LIVE;
+static uint bench_threads = BENCH_THREADS;
+static bool bench_latency = TRUE;
+static bool bench_machine = FALSE;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hmsL] [-a layers] [-l live] [-n ops] [-t threads]\n"
+		"       [-w workloads]\n"
+		"  -a : allocator layers to benchmark (default \"%s\")\n"
+		"  -h : prints this help message\n"
+		"  -l : amount of live objects (default %u)\n"
+		"  -m : machine-readable output, for comparisons between runs\n"
+		"  -n : amount of operations per workload (default %u)\n"
+		"  -s : dump allocator statistics at the end\n"
+		"  -t : amount of remote producing threads (default %u)\n"
+		"  -w : workloads to run (default \"cpahkr\")\n"
+		"  -L : do not measure latency, only throughput\n"
+		"Layers: x=xmalloc, w=walloc, z=zalloc, t=tmalloc\n"
+		"Workloads:\n"
+		"  c=churn of random-sized objects, per layer\n"
+		"  p=pmsg creation and freeing\n"
+		"  a=string atoms\n"
+		"  h=htable growth and shrinking\n"
+		"  k=hikset growth and shrinking\n"
+		"  r=cross-thread freeing via thread event queues, per layer\n"
+		, getprogname(), bench_layer_chars,
+		BENCH_LIVE, BENCH_OPS, BENCH_THREADS);
+	exit(EXIT_FAILURE);
+}
+
+static uint32
+get_number(const char *arg, int opt)
+{
+	int error;
+	uint32 val;
+
+	val = parse_v32(arg, NULL, &error);
+	if (0 == val && error != 0) {
+		fprintf(stderr, "%s: invalid -%c argument \"%s\": %s\n",
+			getprogname(), opt, arg, english_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+static inline uint64
+bench_now(void)
+{
+	tm_nano_t tn;
+
+	tm_precise_time(&tn);
+	return (uint64) tn.tv_sec * 1000000000UL + tn.tv_nsec;
+}
+
+static inline uint64
+bench_start(void)
+{
+	return bench_latency ? bench_now() : 0;
+}
+
+static inline void
+bench_record(struct bench_lat *bl, uint64 start)
+{
+	bl->count++;
+
+	if (bench_latency) {
+		uint64 ns = bench_now() - start;
+		int b = 0 == ns ? 0 : highest_bit_set64(ns) + 1;
+
+		bl->hist[MIN(b, BENCH_HIST - 1)]++;
+		bl->max_ns = MAX(bl->max_ns, ns);
+	}
+}
+
+static void
+bench_lat_merge(struct bench_lat *to, const struct bench_lat *from)
+{
+	size_t i;
+
+	for (i = 0; i < N_ITEMS(to->hist); i++)
+		to->hist[i] += from->hist[i];
+
+	to->count += from->count;
+	to->max_ns = MAX(to->max_ns, from->max_ns);
+}
+
+/**
+ * @return upper bound of the latency at the given per-mille, in ns.
+ */
+static uint64
+bench_lat_percentile(const struct bench_lat *bl, uint permille)
+{
+	uint64 target, seen = 0;
+	size_t i;
+
+	target = (bl->count * permille + 999) / 1000;
+
+	for (i = 0; i < N_ITEMS(bl->hist); i++) {
+		seen += bl->hist[i];
+		if (seen >= target && seen != 0)
+			return MIN((uint64) 1 << i, bl->max_ns);
+	}
+
+	return bl->max_ns;
+}
+
+/**
+ * @return the current resident set size of the process, 0 if unknown.
+ */
+static size_t
+bench_rss(void)
+{
+	FILE *f;
+	ulong size, resident = 0;
+
+	f = fopen("/proc/self/statm", "r");
+	if (NULL == f)
+		return 0;
+
+	if (2 != fscanf(f, "%lu %lu", &size, &resident))
+		resident = 0;
+
+	fclose(f);
+
+	return resident * compat_pagesize();
+}
+
+static inline size_t
+bench_class(size_t size)
+{
+	size_t s = MAX(size, 1U << BENCH_MIN_SHIFT);
+
+	return highest_bit_set(next_pow2(s)) - BENCH_MIN_SHIFT;
+}
+
+static void *
+bench_xmalloc(size_t size)
+{
+	return xmalloc(size);
+}
+
+static void
+bench_xfree(void *p, size_t size)
+{
+	(void) size;
+	xfree(p);
+}
+
+static void
+bench_layers_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < BENCH_CLASSES; i++) {
+		size_t size = 1U << (i + BENCH_MIN_SHIFT);
+		char name[32];
+
+		bench_zones[i] = zget(size, 0, TRUE);
+		str_bprintf(ARYLEN(name), "bench-%zu", size);
+		bench_tmas[i] = tmalloc_create(constant_str(name), size,
+			bench_xmalloc, bench_xfree);
+	}
+}
+
+static inline void *
+bench_alloc(enum bench_layer l, size_t size)
+{
+	switch (l) {
+	case BENCH_XMALLOC:	return xmalloc(size);
+	case BENCH_WALLOC:	return walloc(size);
+	case BENCH_ZALLOC:	return zalloc(bench_zones[bench_class(size)]);
+	case BENCH_TMALLOC:	return tmalloc(bench_tmas[bench_class(size)]);
+	case BENCH_LAYERS:	break;
+	}
+	g_assert_not_reached();
+}
+
+static inline void
+bench_free(enum bench_layer l, void *p, size_t size)
+{
+	switch (l) {
+	case BENCH_XMALLOC:	xfree(p);									return;
+	case BENCH_WALLOC:	wfree(p, size);								return;
+	case BENCH_ZALLOC:	zfree(bench_zones[bench_class(size)], p);	return;
+	case BENCH_TMALLOC:	tmfree(bench_tmas[bench_class(size)], p);	return;
+	case BENCH_LAYERS:	break;
+	}
+	g_assert_not_reached();
+}
+
+/**
+ * Pick a random object size, mimicking what we allocate at runtime: many
+ * small objects (message headers, atoms, list cells, table items), fewer
+ * message payloads and seldom large buffers.
+ */
+static size_t
+bench_size(size_t min)
+{
+	uint r = random_value(99);
+	size_t size;
+
+	if (r < 50)
+		size = 8 + random_value(56);
+	else if (r < 85)
+		size = 65 + random_value(447);
+	else if (r < 97)
+		size = 513 + random_value(3583);
+	else
+		size = 4097 + random_value(BENCH_MAX - 4097);
+
+	return MAX(size, min);
+}
+
+/**
+ * Churn: keep a live set of random-sized objects, replacing them randomly.
+ */
+static void
+bench_churn(enum bench_layer l, struct bench_result *br)
+{
+	struct bench_obj *live;
+	size_t i, bytes = 0;
+	uint64 start, t;
+
+	XMALLOC0_ARRAY(live, bench_live);
+
+	start = bench_now();
+
+	for (i = 0; i < bench_live; i++) {
+		struct bench_obj *o = &live[i];
+
+		o->size = bench_size(0);
+		t = bench_start();
+		o->p = bench_alloc(l, o->size);
+		bench_record(&br->alloc, t);
+		bytes += o->size;
+	}
+
+	br->rss_peak = bench_rss();
+	br->live_peak = bytes;
+
+	for (i = 0; i < bench_ops; i++) {
+		struct bench_obj *o = &live[random_value(bench_live - 1)];
+
+		t = bench_start();
+		bench_free(l, o->p, o->size);
+		bench_record(&br->free, t);
+
+		bytes -= o->size;
+		o->size = bench_size(0);
+		bytes += o->size;
+
+		t = bench_start();
+		o->p = bench_alloc(l, o->size);
+		bench_record(&br->alloc, t);
+
+		if G_UNLIKELY(bytes > br->live_peak) {
+			br->live_peak = bytes;
+			br->rss_peak = MAX(br->rss_peak, bench_rss());
+		}
+	}
+
+	br->rss_peak = MAX(br->rss_peak, bench_rss());
+
+	for (i = 0; i < bench_live; i++) {
+		struct bench_obj *o = &live[i];
+
+		t = bench_start();
+		bench_free(l, o->p, o->size);
+		bench_record(&br->free, t);
+	}
+
+	br->elapsed_ns = bench_now() - start;
+
+	XFREE_NULL(live);
+}
+
+/**
+ * Message churn: create and free messages with Gnutella-like sizes.
+ */
+static void
+bench_pmsg(struct bench_result *br)
+{
+	pmsg_t **live;
+	size_t i, bytes = 0;
+	uint64 start, t;
+
+	XMALLOC0_ARRAY(live, bench_live);
+
+	start = bench_now();
+
+	for (i = 0; i < bench_live; i++) {
+		int len = 23 + random_value(4096);
+
+		t = bench_start();
+		live[i] = pmsg_new(PMSG_P_DATA, NULL, len);
+		bench_record(&br->alloc, t);
+		bytes += len;
+	}
+
+	br->rss_peak = bench_rss();
+	br->live_peak = bytes;
+
+	for (i = 0; i < bench_ops; i++) {
+		pmsg_t **mb = &live[random_value(bench_live - 1)];
+		int len = 23 + random_value(4096);
+
+		bytes -= pmsg_phys_len(*mb);
+
+		t = bench_start();
+		pmsg_free(*mb);
+		bench_record(&br->free, t);
+
+		t = bench_start();
+		*mb = pmsg_new(PMSG_P_DATA, NULL, len);
+		bench_record(&br->alloc, t);
+		bytes += len;
+
+		if G_UNLIKELY(bytes > br->live_peak)
+			br->live_peak = bytes;
+	}
+
+	br->rss_peak = MAX(br->rss_peak, bench_rss());
+
+	for (i = 0; i < bench_live; i++) {
+		t = bench_start();
+		pmsg_free_null(&live[i]);
+		bench_record(&br->free, t);
+	}
+
+	br->elapsed_ns = bench_now() - start;
+
+	XFREE_NULL(live);
+}
+
+/**
+ * Atoms: hold references on strings out of a pool twice as large as the
+ * live set, so that we both create new atoms and ref existing ones.
+ */
+static void
+bench_atoms(struct bench_result *br)
+{
+	const char **live;
+	size_t i, pool = 2 * bench_live;
+	uint64 start, t;
+	char buf[BENCH_STR_LEN];
+
+	XMALLOC0_ARRAY(live, bench_live);
+
+	start = bench_now();
+
+	for (i = 0; i < bench_live; i++) {
+		str_bprintf(ARYLEN(buf), "atom-%u", random_value(pool - 1));
+		t = bench_start();
+		live[i] = atom_str_get(buf);
+		bench_record(&br->alloc, t);
+	}
+
+	br->rss_peak = bench_rss();
+	br->live_peak = bench_live * sizeof buf;
+
+	for (i = 0; i < bench_ops; i++) {
+		const char **a = &live[random_value(bench_live - 1)];
+
+		t = bench_start();
+		atom_str_free_null(a);
+		bench_record(&br->free, t);
+
+		str_bprintf(ARYLEN(buf), "atom-%u", random_value(pool - 1));
+		t = bench_start();
+		*a = atom_str_get(buf);
+		bench_record(&br->alloc, t);
+	}
+
+	br->rss_peak = MAX(br->rss_peak, bench_rss());
+
+	for (i = 0; i < bench_live; i++) {
+		t = bench_start();
+		atom_str_free_null(&live[i]);
+		bench_record(&br->free, t);
+	}
+
+	br->elapsed_ns = bench_now() - start;
+
+	XFREE_NULL(live);
+}
+
+/**
+ * Hash tables: grow a table to the live set size, then empty it, as many
+ * times as needed to perform the requested amount of operations.
+ */
+static void
+bench_htable(struct bench_result *br)
+{
+	size_t i, done = 0;
+	uint64 start, t;
+
+	start = bench_now();
+	br->live_peak = bench_live * 2 * sizeof(void *);
+
+	while (done < bench_ops) {
+		htable_t *ht = htable_create(HASH_KEY_SELF, 0);
+
+		for (i = 0; i < bench_live; i++) {
+			t = bench_start();
+			htable_insert(ht, size_to_pointer(i + 1), ht);
+			bench_record(&br->alloc, t);
+		}
+
+		br->rss_peak = MAX(br->rss_peak, bench_rss());
+
+		for (i = 0; i < bench_live; i++) {
+			t = bench_start();
+			htable_remove(ht, size_to_pointer(i + 1));
+			bench_record(&br->free, t);
+		}
+
+		htable_free_null(&ht);
+		done += bench_live;
+	}
+
+	br->elapsed_ns = bench_now() - start;
+}
+
+struct bench_item {
+	const void *key;
+	size_t value;
+};
+
+/**
+ * Sets of items with embedded keys, same pattern as bench_htable().
+ */
+static void
+bench_hikset(struct bench_result *br)
+{
+	struct bench_item *items;
+	size_t i, done = 0;
+	uint64 start, t;
+
+	XMALLOC_ARRAY(items, bench_live);
+
+	for (i = 0; i < bench_live; i++) {
+		items[i].key = &items[i];
+		items[i].value = i;
+	}
+
+	start = bench_now();
+	br->live_peak = bench_live * sizeof(void *);
+
+	while (done < bench_ops) {
+		hikset_t *hs =
+			hikset_create(offsetof(struct bench_item, key), HASH_KEY_SELF, 0);
+
+		for (i = 0; i < bench_live; i++) {
+			t = bench_start();
+			hikset_insert(hs, &items[i]);
+			bench_record(&br->alloc, t);
+		}
+
+		br->rss_peak = MAX(br->rss_peak, bench_rss());
+
+		for (i = 0; i < bench_live; i++) {
+			t = bench_start();
+			hikset_remove(hs, items[i].key);
+			bench_record(&br->free, t);
+		}
+
+		hikset_free_null(&hs);
+		done += bench_live;
+	}
+
+	br->elapsed_ns = bench_now() - start;
+
+	XFREE_NULL(items);
+}
+
+/*
+ * Cross-thread freeing: producers allocate blocks and post them to the
+ * main thread, which frees them.  The block size is recorded at the
+ * start of each block.
+ */
+
+struct bench_remote {
+	enum bench_layer layer;
+	size_t count;				/* Amount of blocks to produce */
+	struct bench_lat alloc;		/* Allocation latency in producer */
+};
+
+static struct bench_lat *bench_remote_lat;
+static enum bench_layer bench_remote_layer;
+static size_t bench_remote_freed;
+
+static void
+bench_remote_free(void *p)
+{
+	size_t size = *(size_t *) p;
+	uint64 t;
+
+	t = bench_start();
+	bench_free(bench_remote_layer, p, size);
+	bench_record(bench_remote_lat, t);
+	bench_remote_freed++;
+}
+
+static void *
+bench_remote_producer(void *arg)
+{
+	struct bench_remote *r = arg;
+	size_t i;
+
+	for (i = 0; i < r->count; i++) {
+		size_t size = bench_size(sizeof(size_t));
+		uint64 t;
+		void *p;
+
+		t = bench_start();
+		p = bench_alloc(r->layer, size);
+		bench_record(&r->alloc, t);
+
+		*(size_t *) p = size;
+		teq_post(THREAD_MAIN_ID, bench_remote_free, p);
+	}
+
+	return NULL;
+}
+
+static void
+bench_remote(enum bench_layer l, struct bench_result *br)
+{
+	struct bench_remote *r;
+	int *tid;
+	size_t total;
+	uint i;
+	uint64 start;
+
+	XMALLOC0_ARRAY(r, bench_threads);
+	XMALLOC_ARRAY(tid, bench_threads);
+
+	bench_remote_lat = &br->free;
+	bench_remote_layer = l;
+	bench_remote_freed = 0;
+	total = (bench_ops / bench_threads) * bench_threads;
+
+	start = bench_now();
+
+	for (i = 0; i < bench_threads; i++) {
+		r[i].layer = l;
+		r[i].count = bench_ops / bench_threads;
+		tid[i] = thread_create(bench_remote_producer, &r[i],
+			THREAD_F_PANIC, THREAD_STACK_MIN);
+	}
+
+	while (bench_remote_freed < total) {
+		if (0 == teq_dispatch())
+			thread_yield();
+		br->rss_peak = MAX(br->rss_peak, bench_rss());
+	}
+
+	for (i = 0; i < bench_threads; i++) {
+		thread_join(tid[i], NULL);
+		bench_lat_merge(&br->alloc, &r[i].alloc);
+	}
+
+	br->elapsed_ns = bench_now() - start;
+	br->live_peak = 0;		/* Unknown, depends on scheduling */
+
+	XFREE_NULL(tid);
+	XFREE_NULL(r);
+}
+
+static void
+bench_report_op(const char *workload, const char *layer, const char *op,
+	const struct bench_result *br, const struct bench_lat *bl)
+{
+	double secs = br->elapsed_ns / 1e9;
+	double frag = 0.0;
+	size_t used = br->rss_peak > br->rss_base ?
+		br->rss_peak - br->rss_base : 0;
+	char p50[UINT64_DEC_BUFLEN], p99[UINT64_DEC_BUFLEN];
+	char p999[UINT64_DEC_BUFLEN], max[UINT64_DEC_BUFLEN];
+
+	if (br->live_peak != 0)
+		frag = (double) used / br->live_peak;
+
+	uint64_to_string_buf(bench_lat_percentile(bl, 500), ARYLEN(p50));
+	uint64_to_string_buf(bench_lat_percentile(bl, 990), ARYLEN(p99));
+	uint64_to_string_buf(bench_lat_percentile(bl, 999), ARYLEN(p999));
+	uint64_to_string_buf(bl->max_ns, ARYLEN(max));
+
+	if (bench_machine) {
+		printf("workload=%s layer=%s op=%s ops=%s ops_per_sec=%.0f "
+			"p50_ns=%s p99_ns=%s p999_ns=%s max_ns=%s "
+			"rss_kib=%zu live_kib=%zu frag=%.3f\n",
+			workload, layer, op, uint64_to_string(bl->count),
+			0 == secs ? 0.0 : bl->count / secs,
+			p50, p99, p999, max, used / 1024, br->live_peak / 1024, frag);
+	} else {
+		printf("%-7s %-8s %-5s %9s ops %8.3f Mops/s",
+			workload, layer, op, uint64_to_string(bl->count),
+			0 == secs ? 0.0 : bl->count / secs / 1e6);
+		if (bench_latency) {
+			printf("  p50<%s p99<%s p99.9<%s max=%s ns",
+				p50, p99, p999, max);
+		}
+		printf("  rss+%s", short_size(used, FALSE));
+		if (br->live_peak != 0)
+			printf(" frag=%.2f", frag);
+		printf("\n");
+	}
+}
+
+static void
+bench_report(const char *workload, const char *layer,
+	const struct bench_result *br)
+{
+	bench_report_op(workload, layer, "alloc", br, &br->alloc);
+	bench_report_op(workload, layer, "free", br, &br->free);
+	fflush(stdout);
+}
+
+static bool
+bench_layer_selected(const char *layers, enum bench_layer l)
+{
+	return NULL != strchr(layers, bench_layer_chars[l]);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	const char *layers = bench_layer_chars, *workloads = "cpahkr";
+	bool stats = FALSE;
+	const char *w;
+	int c;
+	const char options[] = "a:hl:mn:st:w:L";
+
+	progstart(argc, argv);
+	thread_set_main(TRUE);		/* We're the main thread, we can block */
+	crash_init(argv[0], getprogname(), 0, NULL);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'a':			/* allocator layers to benchmark */
+			layers = optarg;
+			break;
+		case 'l':			/* amount of live objects */
+			bench_live = get_number(optarg, c);
+			break;
+		case 'm':			/* machine-readable output */
+			bench_machine = TRUE;
+			break;
+		case 'n':			/* amount of operations */
+			bench_ops = get_number(optarg, c);
+			break;
+		case 's':			/* dump allocator statistics */
+			stats = TRUE;
+			break;
+		case 't':			/* amount of remote producers */
+			bench_threads = get_number(optarg, c);
+			break;
+		case 'w':			/* workloads to run */
+			workloads = optarg;
+			break;
+		case 'L':			/* no latency measurement */
+			bench_latency = FALSE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (0 == bench_live || 0 == bench_ops || 0 == bench_threads)
+		usage();
+
+	bench_layers_init();
+	teq_create();			/* For cross-thread freeing */
+
+	for (w = workloads; *w != '\0'; w++) {
+		enum bench_layer l;
+		struct bench_result br;
+
+		switch (*w) {
+		case 'c':
+		case 'r':
+			for (l = 0; l < BENCH_LAYERS; l++) {
+				if (!bench_layer_selected(layers, l))
+					continue;
+				ZERO(&br);
+				br.rss_base = bench_rss();
+				if ('c' == *w) {
+					bench_churn(l, &br);
+					bench_report("churn", bench_layer_names[l], &br);
+				} else {
+					bench_remote(l, &br);
+					bench_report("remote", bench_layer_names[l], &br);
+				}
+			}
+			break;
+		case 'p':
+			ZERO(&br);
+			br.rss_base = bench_rss();
+			bench_pmsg(&br);
+			bench_report("pmsg", "native", &br);
+			break;
+		case 'a':
+			ZERO(&br);
+			br.rss_base = bench_rss();
+			bench_atoms(&br);
+			bench_report("atoms", "native", &br);
+			break;
+		case 'h':
+			ZERO(&br);
+			br.rss_base = bench_rss();
+			bench_htable(&br);
+			bench_report("htable", "native", &br);
+			break;
+		case 'k':
+			ZERO(&br);
+			br.rss_base = bench_rss();
+			bench_hikset(&br);
+			bench_report("hikset", "native", &br);
+			break;
+		default:
+			fprintf(stderr, "%s: unknown workload '%c'\n", getprogname(), *w);
+			usage();
+		}
+	}
+
+	if (stats) {
+		logagent_t *la = log_agent_stdout_get();
+
+		xmalloc_dump_stats_log(la, 0);
+		zalloc_dump_stats_log(la, 0);
+		tmalloc_dump_stats_log(la, 0);
+		vmm_dump_stats_log(la, 0);
+	}
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
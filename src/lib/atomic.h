@@ -254,6 +254,13 @@ atomic_uint_set(uint *p, uint v)
 	atomic_mb();
 }
 
+static inline ALWAYS_INLINE void *
+atomic_ptr_get(void * const *p)
+{
+	atomic_mb();
+	return *p;
+}
+
 /***
  *** Atomic 64-bit counters.
  ***
@@ -531,17 +531,35 @@ atom_dealloc(atom_t *a, size_t size)
 typedef size_t (*len_func_t)(const void *v);
 typedef const char *(*str_func_t)(const void *v);
 
+/*
+ * Atoms of a given type are spread over several tables, each with its own
+ * lock, so that threads creating or releasing different atoms of the same
+ * type do not all contend for a single lock.
+ *
+ * The shard is selected from the leading bits of the mixed atom hash, since
+ * the trailing bits are the ones used by the hash table itself.
+ */
+#define ATOM_SHARD_BITS	4
+#define ATOM_SHARDS		(1U << ATOM_SHARD_BITS)
+
+/**
+ * A shard of the atoms of a given type.
+ */
+struct atom_shard {
+	spinlock_t lock;			/**< Lock protecting the hash table */
+	htable_t *table;			/**< Table of atoms: "atom value" -> size */
+};
+
 /**
  * Description of atom types.
  */
 typedef struct atom_desc {
-	spinlock_t lock;			/**< Lock protecting the hash table */
 	const char *type;			/**< Type of atoms */
-	htable_t *table;			/**< Table of atoms: "atom value" -> size */
 	hash_fn_t hash_func;		/**< Hashing function for atoms */
 	eq_fn_t eq_func;			/**< Atom equality function */
 	len_func_t len_func;		/**< Atom length function */
 	str_func_t str_func;		/**< Atom to human-readable string */
+	struct atom_shard shard[ATOM_SHARDS];	/**< Lock-striped atom tables */
 } atom_desc_t;
 
 #define ATOM_TABLE_LOCK(t)		spinlock(&(t)->lock)
@@ -579,22 +597,20 @@ static const char *packed_host_addr_str(const void *v);
 #define pha_eq		packed_host_addr_equal
 #define pha_len		packed_host_addr_len
 #define pha_str		packed_host_addr_str
-#define S			SPINLOCK_INIT
-#define N			NULL
 
 /**
  * The set of all atom types we know about.
  */
 static atom_desc_t atoms[] = {
-	{ S, "String", N, str_hash,    str_eq,     str_xlen,   str_str  }, /* 0 */
-	{ S, "GUID",   N, guid_hash,   guid_eq,    guid_len,   guid_str }, /* 1 */
-	{ S, "SHA1",   N, sha1_hash,   sha1_eq,	   sha1_len,   sha1_str }, /* 2 */
-	{ S, "TTH",    N, tth_hash,    tth_eq,	   tth_len,    tth_str },  /* 3 */
-	{ S, "uint64", N, uint64_hash, uint64_eq,  uint64_len, uint64_str},/* 4 */
-	{ S, "filesize", N, fs_hash,   fs_eq,      fs_len,     fs_str },   /* 5 */
-	{ S, "uint32", N, uint32_hash, uint32_eq,  uint32_len, uint32_str},/* 6 */
-	{ S, "host",   N, gnh_hash,    gnh_eq,     gnh_len,    gnh_str },  /* 7 */
-	{ S, "addr",   N, pha_hash,    pha_eq,     pha_len,    pha_str },  /* 8 */
+	{ "String",   str_hash,    str_eq,     str_xlen,   str_str  },  /* 0 */
+	{ "GUID",     guid_hash,   guid_eq,    guid_len,   guid_str },  /* 1 */
+	{ "SHA1",     sha1_hash,   sha1_eq,	   sha1_len,   sha1_str },  /* 2 */
+	{ "TTH",      tth_hash,    tth_eq,	   tth_len,    tth_str },   /* 3 */
+	{ "uint64",   uint64_hash, uint64_eq,  uint64_len, uint64_str}, /* 4 */
+	{ "filesize", fs_hash,     fs_eq,      fs_len,     fs_str },    /* 5 */
+	{ "uint32",   uint32_hash, uint32_eq,  uint32_len, uint32_str}, /* 6 */
+	{ "host",     gnh_hash,    gnh_eq,     gnh_len,    gnh_str },   /* 7 */
+	{ "addr",     pha_hash,    pha_eq,     pha_len,    pha_str },   /* 8 */
 };
 
 #undef str_hash
@@ -611,8 +627,17 @@ static atom_desc_t atoms[] = {
 #undef pha_eq
 #undef pha_len
 #undef pha_str
-#undef S
-#undef N
+
+/**
+ * @return the shard of the `ad' atom table where `key' belongs.
+ */
+static inline struct atom_shard *
+atom_shard(atom_desc_t *ad, const void *key)
+{
+	uint32 hv = hashing_mix32((*ad->hash_func)(key));
+
+	return &ad->shard[hv >> (32 - ATOM_SHARD_BITS)];
+}
 
 /**
  * @return length of string + trailing NUL.
@@ -980,8 +1005,14 @@ atoms_init_once(void)
 
 	for (i = 0; i < N_ITEMS(atoms); i++) {
 		atom_desc_t *ad = &atoms[i];
+		uint j;
+
+		for (j = 0; j < N_ITEMS(ad->shard); j++) {
+			struct atom_shard *as = &ad->shard[j];
 
-		ad->table = htable_create_any(ad->hash_func, NULL, ad->eq_func);
+			spinlock_init(&as->lock);
+			as->table = htable_create_any(ad->hash_func, NULL, ad->eq_func);
+		}
 	}
 
 	/*
@@ -1033,7 +1064,7 @@ atom_exists(enum atom_type type, const void *key)
 	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
 		return FALSE;
 
-	return htable_contains(atoms[type].table, key);
+	return htable_contains(atom_shard(&atoms[type], key)->table, key);
 }
 
 /**
@@ -1051,19 +1082,19 @@ atom_is_atom(enum atom_type type, const void *key)
 	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
 		return FALSE;
 
-	return htable_lookup_extended(atoms[type].table, key, &atom, NULL)
-		&& key == atom;
+	return htable_lookup_extended(atom_shard(&atoms[type], key)->table,
+			key, &atom, NULL) && key == atom;
 }
 
 /**
  * Increment / decrement the atom reference count.
  *
- * Must be called with the table description locked.
+ * Must be called with the atom shard locked.
  *
  * @return new reference count.
  */
 static inline size_t
-atom_refcnt_add(const atom_desc_t *ad, const void *key, void *value, int delta)
+atom_refcnt_add(struct atom_shard *as, const void *key, void *value, int delta)
 {
 	if (4 == sizeof(void *)) {
 		/* 32-bit machine, we can directly update the atom_info structure */
@@ -1077,7 +1108,7 @@ atom_refcnt_add(const atom_desc_t *ad, const void *key, void *value, int delta)
 			v += delta;
 		else
 			v -= -delta;	/* Necessary since int may be smaller than long */
-		htable_insert(ad->table, key, ulong_to_pointer(v));
+		htable_insert(as->table, key, ulong_to_pointer(v));
 		return ATOM_REFCNT(v);
 	}
 }
@@ -1092,6 +1123,7 @@ const void *
 atom_get(enum atom_type type, const void *key)
 {
 	atom_desc_t *ad;
+	struct atom_shard *as;
 	const void *orig_key;
 	void *value;
 	size_t size;
@@ -1108,9 +1140,10 @@ atom_get(enum atom_type type, const void *key)
 		atoms_init();
 
 	ad = &atoms[type];		/* Where atoms of this type are held */
-	ATOM_TABLE_LOCK(ad);
+	as = atom_shard(ad, key);
+	ATOM_TABLE_LOCK(as);
 
-	if (htable_lookup_extended(ad->table, key, &orig_key, &value)) {
+	if (htable_lookup_extended(as->table, key, &orig_key, &value)) {
 		size_t refcnt;
 
 		size = atom_info_length(value);
@@ -1123,9 +1156,9 @@ atom_get(enum atom_type type, const void *key)
 
 		g_assert(atom_info_refcnt(value) > 0);
 
-		refcnt = atom_refcnt_add(ad, orig_key, value, +1);
+		refcnt = atom_refcnt_add(as, orig_key, value, +1);
 		ATOM_TRACK_REFCNT(orig_key, +1, refcnt);
-		ATOM_TABLE_UNLOCK(ad);
+		ATOM_TABLE_UNLOCK(as);
 
 		return orig_key;
 	} else {
@@ -1156,13 +1189,13 @@ atom_get(enum atom_type type, const void *key)
 			WALLOC(ai);
 			ai->len = size;
 			ai->refcnt = 1;
-			htable_insert(ad->table, atom_arena(a), ai);
+			htable_insert(as->table, atom_arena(a), ai);
 		} else {
 			ulong v = ATOM_INFO(size) + 1;	/* +1 means refcnt is 1 */
-			htable_insert(ad->table, atom_arena(a), ulong_to_pointer(v));
+			htable_insert(as->table, atom_arena(a), ulong_to_pointer(v));
 		}
 
-		ATOM_TABLE_UNLOCK(ad);
+		ATOM_TABLE_UNLOCK(as);
 
 		return atom_arena(a);
 	}
@@ -1176,6 +1209,7 @@ void
 atom_free(enum atom_type type, const void *key)
 {
 	atom_desc_t *ad;
+	struct atom_shard *as;
 	size_t size;
 	atom_t *a;
 	bool found;
@@ -1188,9 +1222,10 @@ atom_free(enum atom_type type, const void *key)
 	ATOM_TRACK_IS_LOCKED();
 
 	ad = &atoms[type];		/* Where atoms of this type are held */
-	ATOM_TABLE_LOCK(ad);
+	as = atom_shard(ad, key);
+	ATOM_TABLE_LOCK(as);
 
-	found = htable_lookup_extended(ad->table, key, &orig_key, &value);
+	found = htable_lookup_extended(as->table, key, &orig_key, &value);
 
 	g_assert_log(found,
 		"attempting to free unknown %s atom at %p", ad->type, key);
@@ -1211,7 +1246,7 @@ atom_free(enum atom_type type, const void *key)
 	 */
 
 	if (1 == refcnt) {
-		htable_remove(ad->table, key);
+		htable_remove(as->table, key);
 		if (4 == sizeof(void *)) {
 			/* 32-bit machine */
 			struct atom_info *ai = value;
@@ -1220,11 +1255,11 @@ atom_free(enum atom_type type, const void *key)
 		atom_unprotect(a, size);
 		atom_dealloc(a, size);
 	} else {
-		size_t rcnt = atom_refcnt_add(ad, key, value, -1);
+		size_t rcnt = atom_refcnt_add(as, key, value, -1);
 		ATOM_TRACK_REFCNT(key, -1, rcnt);
 	}
 
-	ATOM_TABLE_UNLOCK(ad);
+	ATOM_TABLE_UNLOCK(as);
 }
 
 #ifdef TRACK_ATOMS
@@ -1471,11 +1506,16 @@ atoms_close(void)
 
 	for (i = 0; i < N_ITEMS(atoms); i++) {
 		atom_desc_t *ad = &atoms[i];
+		uint j;
 
-		ATOM_TABLE_LOCK(ad);
-		htable_foreach(ad->table, atom_warn_free, ad);
-		htable_free_null(&ad->table);
-		ATOM_TABLE_UNLOCK(ad);
+		for (j = 0; j < N_ITEMS(ad->shard); j++) {
+			struct atom_shard *as = &ad->shard[j];
+
+			ATOM_TABLE_LOCK(as);
+			htable_foreach(as->table, atom_warn_free, ad);
+			htable_free_null(&as->table);
+			ATOM_TABLE_UNLOCK(as);
+		}
 	}
 }
 
@@ -97,6 +97,15 @@
  * makes it more complex and tedious to write, but it gives nice multiplexing
  * in an execution thread for "heavy" computations.
  *
+ * A task whose steps are thread-safe can be flagged "threaded" through
+ * bg_task_set_threaded().  When its scheduler picks it, the task is put to
+ * sleep and its steps are run to completion by a thread pool worker, so that
+ * they do not take time away from the scheduler's thread.  The task remains
+ * attached to its scheduler, so that its progress can still be monitored.
+ * Once the steps are done, the task is given back to its scheduler, which
+ * terminates it in its own thread: the "done" and context freeing callbacks
+ * are therefore invoked in the scheduler's thread as for any other task.
+ *
  * @author Raphael Manfredi
  * @date 2002-2003, 2013
  */
@@ -119,7 +128,9 @@
 #include "stacktrace.h"
 #include "str.h"
 #include "stringify.h"		/* For short_time_ascii() and plural() */
+#include "thread.h"
 #include "tm.h"
+#include "tpool.h"
 #include "walloc.h"
 
 #include "override.h"		/* Must be the last header included */
@@ -133,6 +144,19 @@
 #define BG_JUMP_END		1
 #define BG_JUMP_CANCEL	2
 
+#define BG_THREAD_TICKS	1000			/**< Ticks per step in worker threads */
+
+/**
+ * Outcome of the last run of a threaded task in a worker thread.
+ */
+enum bg_thread_status {
+	BG_THREAD_NONE = 0,					/**< Not run yet, or outcome handled */
+	BG_THREAD_MORE,						/**< Interrupted, more work to do */
+	BG_THREAD_DONE,						/**< All steps completed */
+	BG_THREAD_ERROR,					/**< Step returned BGR_ERROR */
+	BG_THREAD_EXIT						/**< Task called bg_task_exit() */
+};
+
 enum bgsched_magic {
 	BGSCHED_MAGIC = 0x57a5ea07,
 };
@@ -211,6 +235,7 @@ struct bgtask {
 	int step;				/**< Current processing step */
 	int seqno;				/**< Number of calls at same step */
 	bgstatus_t status;		/**< Final exit status */
+	enum bg_thread_status tstatus;	/**< Outcome of threaded run */
 	bgstep_cb_t *stepvec;	/**< Set of steps to run in sequence */
 	int stepcnt;			/**< Amount of steps in the `stepvec' array */
 	void *ucontext;			/**< User context */
@@ -271,6 +296,7 @@ bg_task_is_daemon(const bgtask_t * const bt)
  * Operating flags.
  */
 enum {
+	TASK_F_THREAD		= 1 << 9,	/**< Task running in a worker thread */
 	TASK_F_USERMODE		= 1 << 8,	/**< Task is in "user" mode, running code */
 	TASK_F_CANCELLING	= 1 << 7,	/**< Task handling cancel request */
 	TASK_F_DAEMON		= 1 << 6,	/**< Task is a daemon */
@@ -286,6 +312,7 @@ enum {
  * User flags, can only be modified with the task locked.
  */
 enum {
+	TASK_UF_THREADED	= 1 << 4,	/**< Task steps are thread-safe */
 	TASK_UF_SLEEPING	= 1 << 3,	/**< Task put to user-induced sleep */
 	TASK_UF_SLEEP_REQ	= 1 << 2,	/**< Task requesting to be put to sleep */
 	TASK_UF_NOTICK		= 1 << 1,	/**< Do no recompute tick info */
@@ -437,6 +464,7 @@ bg_task_operating_flags_str(const bgtask_t *bt)
 		{ TASK_F_SLEEPING,		's' },
 		{ TASK_F_ZOMBIE,		'Z' },
 		{ TASK_F_SIGNAL,		'S' },
+		{ TASK_F_THREAD,		'T' },
 		{ TASK_F_EXITED,		'X' },
 	};
 	str_t *s = str_private(G_STRFUNC, 1 + N_ITEMS(flags));
@@ -468,6 +496,7 @@ bg_task_user_flags_str(const bgtask_t *bt)
 		{ TASK_UF_NOTICK,		'N' },
 		{ TASK_UF_SLEEP_REQ,	'S' },
 		{ TASK_UF_SLEEPING,		's' },
+		{ TASK_UF_THREADED,		'T' },
 	};
 	str_t *s = str_private(G_STRFUNC, 1 + N_ITEMS(flags));
 	uint i;
@@ -1081,7 +1110,7 @@ bg_task_run(bgtask_t *bt)
 
 	BG_TASK_LOCK(bt);
 
-	if (bt->flags & TASK_F_SLEEPING) {
+	if ((bt->flags & (TASK_F_SLEEPING | TASK_F_THREAD)) == TASK_F_SLEEPING) {
 		awoken = TRUE;
 		bg_sched_wakeup(bt);
 	}
@@ -1747,6 +1776,20 @@ bg_task_cancel(bgtask_t *bt)
 
 	bt->uflags |= TASK_UF_CANCELLED;	/* Mark it cancelled */
 
+	/*
+	 * If the task is running in a worker thread, it will notice it was
+	 * cancelled and come back to its scheduler, which will process the
+	 * cancellation then.
+	 */
+
+	if (bt->flags & TASK_F_THREAD) {
+		BG_TASK_UNLOCK(bt);
+		if (bg_debug > 1)
+			s_debug("BGTASK recorded cancel for threaded \"%s\" %p, "
+				"currently in %s()", bt->name, bt, bg_task_step_name(bt));
+		return;
+	}
+
 	/*
 	 * If the task is sleeping, wake it up so that it can be cancelled
 	 * as soon as it is scheduled.
@@ -1930,6 +1973,14 @@ bg_task_wakeup(bgtask_t *bt)
 		bt->uflags &= ~TASK_UF_SLEEP_REQ;	/* "awoken" now */
 	}
 
+	/*
+	 * A task running in a worker thread is only held sleeping whilst it
+	 * runs, and will be awoken when it comes back to its scheduler.
+	 */
+
+	if G_UNLIKELY(bt->flags & TASK_F_THREAD)
+		only_requested = TRUE;
+
 	/*
 	 * If bg_task_cancel() has already been called for the task we are supposed
 	 * to wake up, there is nothing to do here, but we need to warn loudly
@@ -2115,6 +2166,196 @@ bg_task_cancel_test(bgtask_t *bt)
 	}
 }
 
+/**
+ * Give threaded task back to its scheduler, once its worker thread is done
+ * running its steps.
+ *
+ * @param bt		the task
+ * @param outcome	the outcome of the threaded run
+ */
+static void
+bg_task_thread_return(bgtask_t *bt, enum bg_thread_status outcome)
+{
+	bgsched_t *bs = bt->sched;
+
+	bg_sched_check(bs);
+
+	BG_TASK_LOCK(bt);		/* Strict lock order: task first, then scheduler */
+	BG_SCHED_LOCK(bs);
+
+	g_assert(bt->flags & TASK_F_THREAD);
+	g_assert(bt->flags & TASK_F_SLEEPING);
+
+	bt->flags &= ~(TASK_F_THREAD | TASK_F_RUNNING | TASK_F_USERMODE);
+	bt->tstatus = outcome;
+
+	/*
+	 * If the task requested to be put to sleep and was not cancelled, it
+	 * remains sleeping until bg_task_wakeup() is called.
+	 */
+
+	if (
+		BG_THREAD_MORE == outcome &&
+		(bt->uflags & TASK_UF_SLEEP_REQ) &&
+		!(bt->uflags & TASK_UF_CANCELLED)
+	) {
+		bt->uflags &= ~TASK_UF_SLEEP_REQ;
+		bt->uflags |= TASK_UF_SLEEPING;		/* Explicitly sleeping */
+	} else {
+		bt->uflags &= ~TASK_UF_SLEEP_REQ;
+		bg_sched_wakeup(bt);
+	}
+
+	BG_SCHED_UNLOCK(bs);
+	BG_TASK_UNLOCK(bt);
+}
+
+/**
+ * Run the steps of a threaded task, from a thread pool worker.
+ *
+ * We stop when all the steps have been run, when the task exits, when it
+ * is cancelled or when it requests to be put to sleep.
+ */
+static void
+bg_task_thread_run(void *arg)
+{
+	bgtask_t *bt = arg;
+	volatile enum bg_thread_status outcome = BG_THREAD_MORE;
+	int status;
+	tm_t start, end;
+
+	bg_task_check(bt);
+	g_assert(bt->flags & TASK_F_THREAD);
+	g_assert(!(bt->flags & TASK_F_DAEMON));
+
+	if (bg_debug > 2) {
+		s_debug("BGTASK \"%s\" %p running step #%d.%d (%s) in %s",
+			bt->name, bt, bt->step, bt->seqno, bg_task_step_name(bt),
+			thread_name());
+	}
+
+	tm_now_exact(&start);
+
+	BG_TASK_LOCK(bt);
+	bt->flags |= TASK_F_RUNNING;
+	BG_TASK_UNLOCK(bt);
+
+	/*
+	 * Steps can call bg_task_exit() or bg_task_cancel_test(), which will
+	 * bring us back here.
+	 */
+
+	if ((status = Setjmp(bt->env))) {
+		if (BG_JUMP_END == status)
+			outcome = BG_THREAD_EXIT;
+		goto done;
+	}
+
+	while (0 == (bt->uflags & (TASK_UF_CANCELLED | TASK_UF_SLEEP_REQ))) {
+		bgret_t ret;
+
+		g_assert(bt->step < bt->stepcnt);
+
+		bt->ticks = bt->ticks_used = BG_THREAD_TICKS;
+
+		BG_TASK_LOCK(bt);
+		bt->flags |= TASK_F_USERMODE;
+		BG_TASK_UNLOCK(bt);
+
+		ret = (*bt->stepvec[bt->step])(bt, bt->ucontext, BG_THREAD_TICKS);
+
+		BG_TASK_LOCK(bt);
+		bt->flags &= ~TASK_F_USERMODE;
+		BG_TASK_UNLOCK(bt);
+
+		if (
+			BGR_DONE == ret ||
+			(BGR_NEXT == ret && bt->step == bt->stepcnt - 1)
+		) {
+			outcome = BG_THREAD_DONE;
+			break;
+		} else if (BGR_ERROR == ret) {
+			outcome = BG_THREAD_ERROR;
+			break;
+		}
+
+		BG_TASK_LOCK(bt);
+		if (BGR_NEXT == ret) {
+			bt->seqno = 0;
+			bt->step++;
+		} else {
+			bt->seqno++;
+		}
+		BG_TASK_UNLOCK(bt);
+	}
+
+done:
+	tm_now_exact(&end);
+	bt->wtime += (tm_elapsed_us(&end, &start) + 500) / 1000;
+
+	bg_task_thread_return(bt, outcome);
+}
+
+/**
+ * Handle threaded task picked by its scheduler.
+ *
+ * If the task came back from a worker thread with all its steps done, we
+ * terminate it.  Otherwise, it is put to sleep and sent to the thread pool.
+ */
+static void
+bg_task_thread_schedule(bgtask_t *bt)
+{
+	enum bg_thread_status outcome = bt->tstatus;
+
+	bt->tstatus = BG_THREAD_NONE;
+
+	switch (outcome) {
+	case BG_THREAD_DONE:
+		bg_task_ended(bt);
+		return;
+	case BG_THREAD_ERROR:
+		bt->exitcode = -1;		/* Fake an exit(-1) */
+		/* FALL THROUGH */
+	case BG_THREAD_EXIT:
+		bg_task_terminate(bt);
+		return;
+	case BG_THREAD_NONE:
+	case BG_THREAD_MORE:
+		break;
+	}
+
+	BG_TASK_LOCK(bt);		/* Strict lock order: task first, then scheduler */
+	BG_SCHED_LOCK(bt->sched);
+	bg_sched_sleep(bt);
+	bt->flags |= TASK_F_THREAD;
+	BG_SCHED_UNLOCK(bt->sched);
+	BG_TASK_UNLOCK(bt);
+
+	tpool_post(bg_task_thread_run, bt);
+}
+
+/**
+ * Declare that the task's steps are thread-safe, so that they can be run
+ * to completion by a thread pool worker instead of being sliced by the
+ * scheduler in its own thread.
+ *
+ * The "done" and context freeing callbacks are still invoked from the
+ * scheduler's thread.  Daemon tasks cannot be threaded.
+ *
+ * This must be called before the task is scheduled, i.e. from the
+ * scheduler's thread or on a task created stopped.
+ */
+void
+bg_task_set_threaded(bgtask_t *bt)
+{
+	bg_task_check(bt);
+	g_assert(!(bt->flags & TASK_F_DAEMON));
+
+	BG_TASK_LOCK(bt);
+	bt->uflags |= TASK_UF_THREADED;
+	BG_TASK_UNLOCK(bt);
+}
+
 /**
  * Assert that scheduling count is consistent.
  *
@@ -2204,6 +2445,15 @@ bg_sched_timer(void *arg)
 			continue;
 		}
 
+		/*
+		 * Threaded tasks run their steps in a worker thread.
+		 */
+
+		if (bt->uflags & TASK_UF_THREADED) {
+			bg_task_thread_schedule(bt);
+			continue;
+		}
+
 		/*
 		 * Compute how many ticks we can ask for this processing step.
 		 *
@@ -2676,6 +2926,7 @@ bg_info_get(void *data, void *udata)
 		bi->signals = pslist_length(bt->signals);	/* Expecting low amount */
 	flags = bt->flags;								/* Read all bits once */
 	bi->running = booleanize(flags & TASK_F_RUNNING);
+	bi->threaded = booleanize(flags & TASK_F_THREAD);
 	bi->daemon = booleanize(flags & TASK_F_DAEMON);
 	bi->cancelling = booleanize(flags & TASK_F_CANCELLING);
 	bi->cancelled = booleanize(bt->uflags & TASK_UF_CANCELLED);
@@ -92,6 +92,7 @@ typedef struct {
 	size_t wq_count;		/**< Work queue count, for daemon tasks */
 	size_t wq_done;			/**< Processed items, for daemon tasks */
 	uint running:1;			/**< Is task running? */
+	uint threaded:1;		/**< Is task running in a worker thread? */
 	uint daemon:1;			/**< Is task a daemon? */
 	uint cancelled:1;		/**< Is task cancelled? */
 	uint cancelling:1;		/**< Is task cancel being processed? */
@@ -200,6 +201,7 @@ void bg_task_cancel(bgtask_t *h);
 void bg_task_cancel_test(bgtask_t *bt);
 void bg_task_sleep(bgtask_t *bt);
 void bg_task_wakeup(bgtask_t *bt);
+void bg_task_set_threaded(bgtask_t *bt);
 void bg_task_exit(bgtask_t *h, int code) G_NORETURN;
 void bg_task_ticks_used(bgtask_t *h, int used);
 bgsig_cb_t bg_task_signal(bgtask_t *h, bgsig_t sig, bgsig_cb_t handler);
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Bloom filters.
+ *
+ * A Bloom filter is a compact probabilistic set representation: it can tell
+ * that a key is definitely not part of the set, or that it may be, with a
+ * small rate of false positives.  It cannot enumerate nor remove keys.
+ *
+ * Filters are sized for a given capacity, with 10 bits per key and 7 hash
+ * functions, giving a false positive rate around 1% until the capacity is
+ * reached.  Beyond that the rate increases, and the filter should be rebuilt
+ * with a larger capacity.
+ *
+ * The filter is "blocked": it is split into blocks of the size of a cache
+ * line and all the bits of a key are set within the same block, chosen by
+ * the first hash.  Checking a key therefore costs a single cache miss at
+ * most, instead of one per hash function, for a slightly higher false
+ * positive rate than a plain filter of the same size.
+ *
+ * Filters can be persisted to a file, along with an opaque tag supplied by
+ * the caller, to check that the filter still matches the data it describes
+ * when it is loaded back.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "bloom.h"
+
+#include "compat_pio.h"
+#include "crc.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hashing.h"
+#include "log.h"
+#include "misc.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define BLOOM_BITS_PER_KEY	10			/**< Filter bits per key */
+#define BLOOM_HASHES		7			/**< Amount of hash functions */
+#define BLOOM_MIN_CAPACITY	1024		/**< Minimum capacity */
+#define BLOOM_BLOCK_BITS	512			/**< Bits per block (a cache line) */
+#define BLOOM_BLOCK_MASK	(BLOOM_BLOCK_BITS - 1)
+
+#define BLOOM_MAGIC_LEN		8
+#define BLOOM_HEADER		(BLOOM_MAGIC_LEN + 24)	/**< Persisted header */
+
+static const char bloom_file_magic[] = "BLOOMF02";
+
+enum bloom_magic { BLOOM_MAGIC = 0x2a85c9d1 };
+
+/**
+ * A Bloom filter.
+ */
+struct bloom {
+	enum bloom_magic magic;
+	uint8 *bits;			/**< The filter bits */
+	size_t nbits;			/**< Size of filter, in bits */
+	size_t capacity;		/**< Amount of keys the filter is sized for */
+	size_t count;			/**< Amount of keys added */
+};
+
+static inline void
+bloom_check(const struct bloom * const b)
+{
+	g_assert(b != NULL);
+	g_assert(BLOOM_MAGIC == b->magic);
+}
+
+static inline size_t
+bloom_bytes(size_t nbits)
+{
+	return (nbits + 7) / 8;
+}
+
+/**
+ * Allocate filter structure.
+ */
+static bloom_t *
+bloom_alloc(size_t capacity, size_t nbits)
+{
+	bloom_t *b;
+
+	WALLOC0(b);
+	b->magic = BLOOM_MAGIC;
+	b->capacity = capacity;
+	b->nbits = nbits;
+	b->bits = halloc0(bloom_bytes(nbits));
+
+	return b;
+}
+
+/**
+ * Create a new empty filter.
+ *
+ * @param capacity		expected amount of keys
+ *
+ * @return new filter, to be freed with bloom_free_null().
+ */
+bloom_t *
+bloom_make(size_t capacity)
+{
+	size_t nbits;
+
+	capacity = MAX(capacity, BLOOM_MIN_CAPACITY);
+	nbits = round_size(BLOOM_BLOCK_BITS, capacity * BLOOM_BITS_PER_KEY);
+
+	return bloom_alloc(capacity, nbits);
+}
+
+/**
+ * Free filter and nullify its pointer.
+ */
+void
+bloom_free_null(bloom_t **b_ptr)
+{
+	bloom_t *b = *b_ptr;
+
+	if (b != NULL) {
+		bloom_check(b);
+
+		HFREE_NULL(b->bits);
+		b->magic = 0;
+		WFREE(b);
+		*b_ptr = NULL;
+	}
+}
+
+/**
+ * Compute the first filter bit of the block holding the bits of a key.
+ */
+static inline size_t
+bloom_block(const bloom_t *b, unsigned h1)
+{
+	return (h1 % (b->nbits / BLOOM_BLOCK_BITS)) * BLOOM_BLOCK_BITS;
+}
+
+/**
+ * Compute the i-th filter bit for a key, within its block.
+ *
+ * The filter bits for a key are derived from two independent hashes, using
+ * the h2 + i * h3 construction, which is as good as using independent hash
+ * functions, h3 being made of the bits of h1 not used to select the block.
+ */
+static inline size_t
+bloom_bit(size_t block, unsigned h2, unsigned h3, uint i)
+{
+	return block + ((h2 + i * h3) & BLOOM_BLOCK_MASK);
+}
+
+/**
+ * Add key to the filter.
+ */
+void
+bloom_add(bloom_t *b, const void *key, size_t len)
+{
+	unsigned h1, h2, h3;
+	size_t block;
+	uint i;
+
+	bloom_check(b);
+
+	h1 = binary_hash(key, len);
+	h2 = binary_hash2(key, len);
+	block = bloom_block(b, h1);
+	h3 = (h1 >> 16) | 1;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		size_t bit = bloom_bit(block, h2, h3, i);
+		b->bits[bit >> 3] |= 1U << (bit & 0x7);
+	}
+
+	b->count++;
+}
+
+/**
+ * Check whether key may be part of the filter.
+ *
+ * @return FALSE if the key was definitely never added, TRUE if it may have.
+ */
+bool
+bloom_maybe(const bloom_t *b, const void *key, size_t len)
+{
+	unsigned h1, h2, h3;
+	size_t block;
+	uint i;
+
+	bloom_check(b);
+
+	h1 = binary_hash(key, len);
+	h2 = binary_hash2(key, len);
+	block = bloom_block(b, h1);
+	h3 = (h1 >> 16) | 1;
+
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		size_t bit = bloom_bit(block, h2, h3, i);
+		if (0 == (b->bits[bit >> 3] & (1U << (bit & 0x7))))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Clear the filter, keeping its capacity.
+ */
+void
+bloom_clear(bloom_t *b)
+{
+	bloom_check(b);
+
+	memset(b->bits, 0, bloom_bytes(b->nbits));
+	b->count = 0;
+}
+
+/**
+ * @return amount of keys added to the filter.
+ */
+size_t
+bloom_count(const bloom_t *b)
+{
+	bloom_check(b);
+
+	return b->count;
+}
+
+/**
+ * @return amount of keys the filter was sized for.
+ */
+size_t
+bloom_capacity(const bloom_t *b)
+{
+	bloom_check(b);
+
+	return b->capacity;
+}
+
+/**
+ * @return whether the filter holds more keys than it was sized for, meaning
+ * its false positive rate is getting higher than planned.
+ */
+bool
+bloom_is_full(const bloom_t *b)
+{
+	bloom_check(b);
+
+	return b->count > b->capacity;
+}
+
+/**
+ * Persist filter to file.
+ *
+ * @param b		the filter
+ * @param path	the file where filter is saved
+ * @param tag	opaque tag saved with the filter
+ *
+ * @return TRUE if OK.
+ */
+bool
+bloom_save(const bloom_t *b, const char *path, uint64 tag)
+{
+	size_t len;
+	char *data;
+	bool ok = FALSE;
+	int fd;
+
+	bloom_check(b);
+
+	len = BLOOM_HEADER + bloom_bytes(b->nbits) + 4;
+	data = halloc(len);
+
+	memcpy(data, bloom_file_magic, BLOOM_MAGIC_LEN);
+	poke_be64(&data[BLOOM_MAGIC_LEN], tag);
+	poke_be32(&data[BLOOM_MAGIC_LEN + 8], b->nbits);
+	poke_be32(&data[BLOOM_MAGIC_LEN + 12], b->capacity);
+	poke_be64(&data[BLOOM_MAGIC_LEN + 16], b->count);
+	memcpy(&data[BLOOM_HEADER], b->bits, bloom_bytes(b->nbits));
+	poke_be32(&data[len - 4], crc32_update(0, data, len - 4));
+
+	fd = file_create(path, O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (-1 == fd)
+		goto done;
+
+	if ((ssize_t) len != compat_pwrite(fd, data, len, 0)) {
+		s_warning("%s(): cannot write \"%s\": %m", G_STRFUNC, path);
+		fd_close(&fd);
+		unlink(path);
+		goto done;
+	}
+
+	fd_close(&fd);
+	ok = TRUE;
+
+done:
+	HFREE_NULL(data);
+	return ok;
+}
+
+/**
+ * Load filter from file.
+ *
+ * @param path	the file where filter was saved
+ * @param tag	where the opaque tag saved with the filter is written
+ *
+ * @return the filter, NULL if the file is missing or corrupted.
+ */
+bloom_t *
+bloom_load(const char *path, uint64 *tag)
+{
+	bloom_t *b = NULL;
+	filestat_t buf;
+	char *data = NULL;
+	size_t len, nbits;
+	int fd;
+
+	g_assert(tag != NULL);
+
+	fd = file_open_missing(path, O_RDONLY);
+	if (-1 == fd)
+		return NULL;
+
+	if (-1 == fstat(fd, &buf) || buf.st_size < BLOOM_HEADER + 4)
+		goto corrupted;
+
+	len = buf.st_size;
+	data = halloc(len);
+
+	if ((ssize_t) len != compat_pread(fd, data, len, 0))
+		goto corrupted;
+
+	if (0 != memcmp(data, bloom_file_magic, BLOOM_MAGIC_LEN))
+		goto corrupted;
+
+	if (crc32_update(0, data, len - 4) != peek_be32(&data[len - 4]))
+		goto corrupted;
+
+	nbits = peek_be32(&data[BLOOM_MAGIC_LEN + 8]);
+
+	if (0 == nbits || 0 != (nbits & BLOOM_BLOCK_MASK))
+		goto corrupted;
+
+	if (BLOOM_HEADER + bloom_bytes(nbits) + 4 != len)
+		goto corrupted;
+
+	b = bloom_alloc(peek_be32(&data[BLOOM_MAGIC_LEN + 12]), nbits);
+	b->count = peek_be64(&data[BLOOM_MAGIC_LEN + 16]);
+	memcpy(b->bits, &data[BLOOM_HEADER], bloom_bytes(nbits));
+	*tag = peek_be64(&data[BLOOM_MAGIC_LEN]);
+	goto done;
+
+corrupted:
+	s_warning("%s(): ignoring corrupted \"%s\"", G_STRFUNC, path);
+	/* FALL THROUGH */
+
+done:
+	fd_close(&fd);
+	HFREE_NULL(data);
+	return b;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
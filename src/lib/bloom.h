@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Bloom filters.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _bloom_h_
+#define _bloom_h_
+
+#define BLOOM_FEXT	".bloom"		/**< Extension of persisted filters */
+
+struct bloom;
+typedef struct bloom bloom_t;
+
+/*
+ * Public interface.
+ */
+
+bloom_t *bloom_make(size_t capacity);
+void bloom_free_null(bloom_t **b_ptr);
+
+void bloom_add(bloom_t *b, const void *key, size_t len);
+bool bloom_maybe(const bloom_t *b, const void *key, size_t len);
+void bloom_clear(bloom_t *b);
+
+size_t bloom_count(const bloom_t *b);
+size_t bloom_capacity(const bloom_t *b);
+bool bloom_is_full(const bloom_t *b);
+
+bool bloom_save(const bloom_t *b, const char *path, uint64 tag);
+bloom_t *bloom_load(const char *path, uint64 *tag);
+
+#endif /* _bloom_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
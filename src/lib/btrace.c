@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Binary event tracing.
+ *
+ * This is meant to trace high-rate events cheaply enough that tracing can
+ * be left on in production, where enabling textual debugging logs would
+ * have a prohibitive cost.
+ *
+ * Each event is a fixed-size record holding an event ID, a timestamp and a
+ * few integer arguments.  Records are accumulated in per-thread buffers
+ * which are appended to the trace file in one single write() when they
+ * fill up, or periodically from the main thread.
+ *
+ * Events are first defined through btrace_define(), which gives them a
+ * name and describes the kind of their arguments.  These definitions are
+ * written to the trace file as well, making it self-describing: the offline
+ * decoder does not need to know about the events being traced.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "btrace.h"
+#include "atio.h"
+#include "cq.h"
+#include "fd.h"
+#include "file.h"
+#include "signal.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "tm.h"
+#include "vmm.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define BTRACE_BUFLEN		256		/**< Records per thread buffer */
+#define BTRACE_PERIOD		1000	/**< ms, periodic flushing */
+#define BTRACE_DEFINED		256		/**< Max amount of event definitions */
+
+/**
+ * A per-thread trace buffer.
+ */
+struct btrace_buf {
+	spinlock_t lock;					/**< Thread-safe flushing */
+	uint32 seq;							/**< Sequence number */
+	uint count;							/**< Records held */
+	struct btrace_record rec[BTRACE_BUFLEN];
+};
+
+bool btrace_on;			/**< Whether tracing is enabled */
+
+static struct btrace_buf *btrace_bufs[THREAD_MAX];
+static struct btrace_record btrace_defs[BTRACE_DEFINED];
+static uint btrace_defcount;
+static int btrace_fd = -1;
+static cperiodic_t *btrace_ev;
+static spinlock_t btrace_slk = SPINLOCK_INIT;
+
+#define BTRACE_LOCK		spinlock(&btrace_slk)
+#define BTRACE_UNLOCK	spinunlock(&btrace_slk)
+
+/**
+ * Pack an address and a port into a single trace argument.
+ *
+ * IPv4 addresses are stored verbatim, along with the port.  IPv6 addresses
+ * cannot fit, so we store a hash of the address with the highest bit set,
+ * which is enough to correlate events involving the same host.
+ */
+uint64
+btrace_addr(host_addr_t addr, uint16 port)
+{
+	host_addr_t to;
+
+	if (host_addr_convert(addr, &to, NET_TYPE_IPV4))
+		addr = to;
+
+	switch (host_addr_net(addr)) {
+	case NET_TYPE_IPV4:
+		return ((uint64) host_addr_ipv4(addr) << 16) | port;
+	case NET_TYPE_IPV6:
+		return ((uint64) 1 << 63) |
+			((uint64) host_addr_hash(addr) << 16) | port;
+	case NET_TYPE_LOCAL:
+	case NET_TYPE_NONE:
+		break;
+	}
+
+	return port;
+}
+
+/**
+ * Write the pending records of a buffer to the trace file.
+ *
+ * The buffer must be locked.
+ */
+static void
+btrace_buf_flush(struct btrace_buf *tb)
+{
+	if (0 == tb->count)
+		return;
+
+	if (btrace_fd >= 0)
+		atio_write(btrace_fd, tb->rec, tb->count * sizeof tb->rec[0]);
+
+	tb->count = 0;
+}
+
+/**
+ * Get the trace buffer of the current thread.
+ *
+ * @return the trace buffer.
+ */
+static struct btrace_buf *
+btrace_buf_get(unsigned stid)
+{
+	struct btrace_buf *tb = btrace_bufs[stid];
+
+	if G_UNLIKELY(NULL == tb) {
+		/*
+		 * Buffers are never freed: they are attached to a thread small ID
+		 * and will be re-used by the next thread getting the same ID.
+		 */
+
+		tb = vmm_core_alloc_not_leaking(sizeof *tb);
+		spinlock_init(&tb->lock);
+		tb->seq = 0;
+		tb->count = 0;
+
+		atomic_mb();
+		btrace_bufs[stid] = tb;
+	}
+
+	return tb;
+}
+
+/**
+ * Record an event.
+ *
+ * This is normally called through the BTRACE() macro, which only calls us
+ * when tracing is enabled.
+ */
+void
+btrace_record(uint16 event, uint64 a, uint64 b, uint64 c, uint64 d)
+{
+	struct btrace_buf *tb;
+	struct btrace_record *r;
+	unsigned stid = thread_small_id();
+	tm_t now;
+
+	/*
+	 * Events traced from signal handlers are ignored, since the thread
+	 * could be interrupted whilst holding the lock on its buffer.
+	 */
+
+	if G_UNLIKELY(signal_in_handler())
+		return;
+
+	tb = btrace_buf_get(stid);
+
+	tm_now_exact(&now);
+
+	/*
+	 * The lock is never contended by other producers, only by the main
+	 * thread when it periodically flushes all the buffers.
+	 */
+
+	spinlock_hidden(&tb->lock);
+
+	r = &tb->rec[tb->count++];
+	r->stamp = (uint64) now.tv_sec * 1000000 + now.tv_usec;
+	r->event = event;
+	r->stid = stid;
+	r->seq = tb->seq++;
+	r->arg[0] = a;
+	r->arg[1] = b;
+	r->arg[2] = c;
+	r->arg[3] = d;
+
+	if G_UNLIKELY(BTRACE_BUFLEN == tb->count)
+		btrace_buf_flush(tb);
+
+	spinunlock_hidden(&tb->lock);
+}
+
+/**
+ * Write the event definition record to the trace file.
+ */
+static void
+btrace_define_write(const struct btrace_record *r)
+{
+	if (btrace_fd >= 0)
+		atio_write(btrace_fd, r, sizeof *r);
+}
+
+/**
+ * Define a traced event.
+ *
+ * Definitions can be made at any time, before or after the trace file is
+ * opened: they are written to every new trace file.
+ *
+ * @param event		the event ID
+ * @param name		the event name, for the decoder
+ * @param kinds		argument kinds, built with BTRACE_KINDS()
+ */
+void
+btrace_define(uint16 event, const char *name, uint kinds)
+{
+	struct btrace_record *r;
+
+	g_assert(event != BTRACE_EV_DEFINE);
+	g_assert(name != NULL);
+	g_assert(vstrlen(name) < BTRACE_NAMELEN);
+	g_assert(kinds <= MAX_INT_VAL(uint16));
+
+	BTRACE_LOCK;
+
+	g_assert(btrace_defcount < N_ITEMS(btrace_defs));
+
+	r = &btrace_defs[btrace_defcount++];
+	ZERO(r);
+	r->event = BTRACE_EV_DEFINE;
+	r->arg[0] = event | (kinds << 16);
+	memcpy(&r->arg[1], name, vstrlen(name));
+
+	btrace_define_write(r);
+
+	BTRACE_UNLOCK;
+}
+
+/**
+ * Flush all the trace buffers to the trace file.
+ */
+void
+btrace_flush(void)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(btrace_bufs); i++) {
+		struct btrace_buf *tb = atomic_ptr_get((void **) &btrace_bufs[i]);
+
+		if (NULL == tb)
+			continue;
+
+		spinlock_hidden(&tb->lock);
+		btrace_buf_flush(tb);
+		spinunlock_hidden(&tb->lock);
+	}
+}
+
+/**
+ * Periodic flushing of the trace buffers.
+ */
+static bool
+btrace_periodic(void *unused_data)
+{
+	(void) unused_data;
+
+	btrace_flush();
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Open trace file and start tracing.
+ *
+ * @param path		the trace file path, truncated if it exists
+ *
+ * @return TRUE if tracing was started.
+ */
+bool
+btrace_open(const char *path)
+{
+	struct btrace_header hd;
+	uint i;
+	int fd;
+
+	g_assert(path != NULL);
+
+	fd = file_create(path, O_WRONLY | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return FALSE;
+
+	btrace_close();
+
+	ZERO(&hd);
+	memcpy(hd.magic, BTRACE_MAGIC, sizeof hd.magic);
+	hd.endian = BTRACE_ENDIAN;
+	hd.recsize = sizeof(struct btrace_record);
+
+	if (sizeof hd != atio_write(fd, &hd, sizeof hd)) {
+		s_warning("%s(): cannot write to \"%s\": %m", G_STRFUNC, path);
+		fd_close(&fd);
+		return FALSE;
+	}
+
+	BTRACE_LOCK;
+	btrace_fd = fd;
+	for (i = 0; i < btrace_defcount; i++)
+		btrace_define_write(&btrace_defs[i]);
+	BTRACE_UNLOCK;
+
+	btrace_ev = cq_periodic_main_add(BTRACE_PERIOD, btrace_periodic, NULL);
+	atomic_bool_set(&btrace_on, TRUE);
+
+	return TRUE;
+}
+
+/**
+ * Stop tracing, flushing all the pending records.
+ */
+void
+btrace_close(void)
+{
+	int fd;
+
+	if (btrace_fd < 0)
+		return;
+
+	atomic_bool_set(&btrace_on, FALSE);
+	cq_periodic_remove(&btrace_ev);
+	btrace_flush();
+
+	BTRACE_LOCK;
+	fd = btrace_fd;
+	btrace_fd = -1;
+	BTRACE_UNLOCK;
+
+	fd_close(&fd);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
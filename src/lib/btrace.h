@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Binary event tracing.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _btrace_h_
+#define _btrace_h_
+
+#include "host_addr.h"
+
+#define BTRACE_MAGIC		"GTKGBTR1"	/**< File magic, 8 bytes */
+#define BTRACE_ENDIAN		0x01020304U	/**< Endianness check */
+#define BTRACE_ARGS			4			/**< Arguments per record */
+#define BTRACE_NAMELEN		24			/**< Max event name length */
+
+#define BTRACE_EV_DEFINE	0			/**< Event definition record */
+#define BTRACE_EV_MAX		0xffffU		/**< Maximum event ID */
+
+/**
+ * Argument kinds, as recorded in the event definitions so that the
+ * decoder can display the values.  Each argument kind takes 4 bits.
+ */
+enum btrace_kind {
+	BTRACE_A_NONE = 0,			/**< Unused argument */
+	BTRACE_A_UINT,				/**< Unsigned integer */
+	BTRACE_A_INT,				/**< Signed integer */
+	BTRACE_A_HEX,				/**< Hexadecimal value */
+	BTRACE_A_ADDR				/**< Address and port, see btrace_addr() */
+};
+
+#define BTRACE_KINDS(a,b,c,d) \
+	((a) | ((b) << 4) | ((c) << 8) | ((d) << 12))
+
+#define btrace_kind(kinds,i)	(((kinds) >> (4 * (i))) & 0xf)
+
+/**
+ * File header.
+ */
+struct btrace_header {
+	char magic[8];				/**< BTRACE_MAGIC */
+	uint32 endian;				/**< BTRACE_ENDIAN, in native order */
+	uint32 recsize;				/**< Size of each record */
+};
+
+/**
+ * A trace record, written in native order.
+ *
+ * Definition records have a zero timestamp, carry the defined event ID and
+ * the argument kinds in arg[0] and the event name in the remaining bytes.
+ */
+struct btrace_record {
+	uint64 stamp;				/**< Microseconds since the Epoch */
+	uint16 event;				/**< Event ID */
+	uint16 stid;				/**< Thread small ID */
+	uint32 seq;					/**< Per-thread sequence number */
+	uint64 arg[BTRACE_ARGS];	/**< Event arguments */
+};
+
+/*
+ * Public interface.
+ */
+
+extern bool btrace_on;
+
+/**
+ * Record an event, when tracing is enabled.
+ */
+#define BTRACE(ev,a,b,c,d) G_STMT_START {						\
+	if G_UNLIKELY(btrace_on)									\
+		btrace_record((ev), (a), (b), (c), (d));				\
+} G_STMT_END
+
+bool btrace_open(const char *path);
+void btrace_close(void);
+void btrace_define(uint16 event, const char *name, uint kinds);
+void btrace_record(uint16 event, uint64 a, uint64 b, uint64 c, uint64 d);
+void btrace_flush(void);
+
+uint64 btrace_addr(host_addr_t addr, uint16 port);
+
+#endif /* _btrace_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -230,6 +230,9 @@ compat_fadvise(int fd, fileoffset_t offset, fileoffset_t size, int hint)
 #ifndef POSIX_FADV_DONTNEED
 #define POSIX_FADV_DONTNEED 0
 #endif
+#ifndef POSIX_FADV_WILLNEED
+#define POSIX_FADV_WILLNEED 0
+#endif
 #endif	/* HAS_POSIX_FADVISE */
 
 void
@@ -256,4 +259,75 @@ compat_fadvise_dontneed(int fd, fileoffset_t offset, fileoffset_t size)
 	compat_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
 }
 
+void
+compat_fadvise_willneed(int fd, fileoffset_t offset, fileoffset_t size)
+{
+	compat_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Reserve disk space for the given range of the file, without changing
+ * its apparent size.
+ *
+ * Reserving the space beforehand lets the filesystem allocate contiguous
+ * extents even when the range is later written in random order.
+ *
+ * @param fd The file descriptor.
+ * @param offset Start of range.
+ * @param size Size of range.
+ *
+ * @return 0 if OK, -1 on failure with errno set (ENOTSUP if not supported).
+ */
+int
+compat_preallocate(int fd, fileoffset_t offset, fileoffset_t size)
+{
+	g_return_val_if_fail(fd >= 0, -1);
+	g_return_val_if_fail(offset >= 0, -1);
+	g_return_val_if_fail(size > 0, -1);
+
+#if defined(LINUX_SYSTEM) && defined(FALLOC_FL_KEEP_SIZE)
+	return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * Locate the next hole in a file, starting at the given offset.
+ *
+ * The end of the file is considered to be a hole.  When the system cannot
+ * report holes, the end of the file is returned.
+ *
+ * @param fd The file descriptor.
+ * @param offset Where to start looking.
+ *
+ * @return the offset of the next hole, -1 on error with errno set (ENXIO
+ * if the offset is beyond the end of the file).
+ */
+fileoffset_t
+compat_next_hole(int fd, fileoffset_t offset)
+{
+	g_return_val_if_fail(fd >= 0, -1);
+	g_return_val_if_fail(offset >= 0, -1);
+
+#ifdef SEEK_HOLE
+	return lseek(fd, offset, SEEK_HOLE);
+#else
+	{
+		filestat_t buf;
+
+		if (-1 == fstat(fd, &buf))
+			return -1;
+
+		if (offset >= buf.st_size) {
+			errno = ENXIO;
+			return -1;
+		}
+
+		return buf.st_size;
+	}
+#endif
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -46,6 +46,9 @@ void compat_fadvise_sequential(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_random(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_noreuse(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_dontneed(int fd, fileoffset_t offset, fileoffset_t size);
+void compat_fadvise_willneed(int fd, fileoffset_t offset, fileoffset_t size);
+int compat_preallocate(int fd, fileoffset_t offset, fileoffset_t size);
+fileoffset_t compat_next_hole(int fd, fileoffset_t offset);
 void *compat_memmem(const void *data, size_t data_size,
 		const void *pattern, size_t pattern_size);
 
@@ -49,6 +49,7 @@
 #include "pslist.h"
 #include "spinlock.h"
 #include "stacktrace.h"
+#include "stall.h"
 #include "stringify.h"
 #include "thread.h"
 #include "tm.h"
@@ -82,6 +83,7 @@ struct cevent {
 	cq_time_t ce_time;			/**< Absolute trigger time (virtual cq time) */
 	struct cevent *ce_bnext;	/**< Next item in hash bucket */
 	struct cevent *ce_bprev;	/**< Prev item in hash bucket */
+	struct chash *ce_bucket;	/**< Wheel bucket where event is linked */
 	cqueue_t *ce_cq;			/**< Callout queue where event is registered */
 	cq_service_t ce_fn;			/**< Callback routine */
 	void *ce_arg;				/**< Argument to pass to said callback */
@@ -136,18 +138,23 @@ cevent_is_extended(const cevent_t *ce)
  *
  * Callout queue descriptor.
  *
- * A callout queue is really a sorted linked list of events that are to
- * happen in the near future, most recent coming first.
+ * A callout queue is a set of events that are to happen in the future.
+ * We can hold hundreds of thousands of them, so insertion and deletion of
+ * items have to be done in constant time, and expired events must be found
+ * without looking at the ones that are still pending.
  *
- * Naturally, the insertion/deletion of items has to be relatively efficient.
- * We don't want to go through all the items in the list to find the proper
- * position for insertion.
+ * To do that, events are kept in a hierarchical timing wheel.  Time is cut
+ * into slots, and the first level of the wheel holds one bucket per slot for
+ * the HASH_SIZE slots to come, starting at the current slot.  Each upper
+ * level has WHEEL_SIZE buckets, each covering a whole revolution of the level
+ * below.  Events are appended to the bucket covering their trigger time at
+ * the lowest level possible.  Each time the first level starts a revolution,
+ * the next bucket of the level above is "cascaded", i.e. its events are
+ * spread into the lower level buckets, and so on for the levels above.
  *
- * To do that, we maintain a parallel hash list of all the events, each event
- * being inserted in the bucket i, where i is computed by abs_time % size,
- * abs_time being the absolute time where the event is to be triggered
- * and size being the size of the hash list. All the items under the bucket
- * list are further sorted by increasing trigger time.
+ * The buckets are not sorted: when a slot has fully elapsed, all the events
+ * in its bucket are due.  Only the bucket of the current slot, which has
+ * partially elapsed, needs to be scanned for events that are due.
  *
  * To be completely generic, the callout queue "absolute time" is a mere
  * unsigned long value. It can represent an amount of ms, or an amount of
@@ -181,7 +188,7 @@ struct cqueue {
 	unsigned cq_stid;			/**< Thread where callout queue runs */
 	int cq_ticks;				/**< Number of cq_clock() calls processed */
 	int cq_items;				/**< Amount of recorded events */
-	int cq_last_bucket;			/**< Last bucket slot we were at */
+	cq_time_t cq_slot;			/**< Current slot, where we are in the wheel */
 	int cq_period;				/**< Regular callout period, in ms */
 	uint8 cq_call_extended;		/**< Is cq_call an extended event? */
 	time_t cq_last_idle;		/**< Last time we ran the idle callbacks */
@@ -198,17 +205,32 @@ cqueue_check(const struct cqueue * const cq)
 	g_assert(CQUEUE_MAGIC == cq->cq_magic || CSUBQUEUE_MAGIC == cq->cq_magic);
 }
 
-#define HASH_SIZE	2048		/**< Hash list size, must be a power of 2 */
+#define HASH_BITS	11
+#define HASH_SIZE	(1 << HASH_BITS)	/**< Wheel first level size */
 #define HASH_MASK	(HASH_SIZE - 1)
 
+#define WHEEL_LEVELS	3		/**< Amount of upper levels */
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)	/**< Buckets per upper level */
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+
+#define CQ_BUCKETS	(HASH_SIZE + WHEEL_LEVELS * WHEEL_SIZE)
+
+/*
+ * A slot is 2^5 or 32 time units, to avoid cq_clock() scanning too many
+ * buckets each time.  If we increment cq_clock() with milliseconds, we
+ * won't go to a new slot unless at least 32 milliseconds have elapsed.
+ */
+#define EV_SLOT(x)	((x) >> 5)
+
 /*
- * The hashing function divides the time by 2^5 or 32, to avoid cq_clock()
- * scanning too many hash buckets each time.  This means our time resolution
- * is at least 32 units.  If we increment cq_clock() with milliseconds, we
- * won't trigger any queue run unless at least 32 milliseconds have elapsed.
+ * Upper level `l' (starting at 1) has buckets covering 2^WHEEL_SHIFT(l)
+ * slots, and its range spans 2^WHEEL_SHIFT(l + 1) slots.  Events further away
+ * than WHEEL_SPAN slots are parked in the farthest bucket, to be cascaded
+ * again later.
  */
-#define EV_HASH(x) (((x) >> 5) & HASH_MASK)
-#define EV_OVER(x) (((x) >> 5) & ~HASH_MASK)
+#define WHEEL_SHIFT(l)	(HASH_BITS + ((l) - 1) * WHEEL_BITS)
+#define WHEEL_SPAN		((cq_time_t) 1 << WHEEL_SHIFT(WHEEL_LEVELS + 1))
 
 /**
  * Locking of the callout queue for short period of time, in sections that
@@ -303,9 +325,9 @@ cq_initialize(cqueue_t *cq, const char *name, cq_time_t now, int period)
 
 	cq->cq_magic = CQUEUE_MAGIC;
 	cq->cq_name = atom_str_get(name);
-	XMALLOC0_ARRAY(cq->cq_hash, HASH_SIZE);
+	XMALLOC0_ARRAY(cq->cq_hash, CQ_BUCKETS);
 	cq->cq_time = now;
-	cq->cq_last_bucket = EV_HASH(now);
+	cq->cq_slot = EV_SLOT(now);
 	cq->cq_period = period;
 	cq->cq_stid = THREAD_INVALID_ID;
 	mutex_init(&cq->cq_lock);
@@ -452,100 +474,114 @@ ev_free(cevent_t *ev)
 }
 
 /**
- * Link event into the callout queue.
+ * Append event to bucket.
  */
-static void
-ev_link(cevent_t *ev)
+static inline void
+chash_append(struct chash *ch, cevent_t *ev)
 {
-	struct chash *ch;		/* Hashing bucket */
-	cq_time_t trigger;		/* Trigger time */
-	cevent_t *hev;			/* To loop through the hash bucket */
-	cqueue_t *cq;
+	ev->ce_bucket = ch;
+	ev->ce_bnext = NULL;
+	ev->ce_bprev = ch->ch_tail;
 
-	cevent_check(ev);
+	if (NULL == ch->ch_tail) {
+		g_assert(NULL == ch->ch_head);
+		ch->ch_head = ev;
+	} else {
+		ch->ch_tail->ce_bnext = ev;
+	}
+	ch->ch_tail = ev;
+}
 
-	cq = ev->ce_cq;
-	cqueue_check(cq);
-	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
-	assert_mutex_is_owned(&cq->cq_lock);
+/**
+ * Remove event from its bucket.
+ */
+static inline void
+chash_remove(cevent_t *ev)
+{
+	struct chash *ch = ev->ce_bucket;
 
-	trigger = ev->ce_time;
-	cq->cq_items++;
+	g_assert(ch != NULL);
 
-	/*
-	 * Important corner case: we may be rescheduling an event BEFORE
-	 * the current clock time, in which case we must insert the event
-	 * in the current bucket, so it gets fired during the current
-	 * cq_clock() run.
-	 */
+	if (ch->ch_head == ev)
+		ch->ch_head = ev->ce_bnext;
+	if (ch->ch_tail == ev)
+		ch->ch_tail = ev->ce_bprev;
 
-	if (trigger <= cq->cq_time)
-		ch = cq->cq_current;
-	else
-		ch = &cq->cq_hash[EV_HASH(trigger)];
+	if (ev->ce_bprev)
+		ev->ce_bprev->ce_bnext = ev->ce_bnext;
+	if (ev->ce_bnext)
+		ev->ce_bnext->ce_bprev = ev->ce_bprev;
 
-	g_assert(ch);
+	g_assert(ch->ch_head == NULL || ch->ch_head->ce_bprev == NULL);
+	g_assert(ch->ch_tail == NULL || ch->ch_tail->ce_bnext == NULL);
 
-	/*
-	 * If bucket is empty, the event is the new head.
-	 */
+	ev->ce_bucket = NULL;
+}
 
-	if (ch->ch_head == NULL) {
-		g_assert(ch->ch_tail == NULL);
-		ch->ch_tail = ch->ch_head = ev;
-		ev->ce_bnext = ev->ce_bprev = NULL;
-		return;
-	}
+/**
+ * @return bucket of upper wheel level `l' covering slot `idx'.
+ */
+static inline struct chash *
+cq_wheel_bucket(const cqueue_t *cq, uint l, cq_time_t idx)
+{
+	return &cq->cq_hash[HASH_SIZE + (l - 1) * WHEEL_SIZE +
+		((idx >> WHEEL_SHIFT(l)) & WHEEL_MASK)];
+}
 
-	g_assert(ch->ch_tail);
+/**
+ * Compute the wheel bucket where an event triggering at specified time
+ * must be linked, given the current slot.
+ *
+ * Events due at or before the current slot go to the current bucket.
+ */
+static struct chash *
+cq_bucket(const cqueue_t *cq, cq_time_t trigger)
+{
+	cq_time_t idx = EV_SLOT(trigger), d;
+	uint l;
 
-	/*
-	 * If item is larger than the tail, insert at the end right away.
-	 */
+	if (idx <= cq->cq_slot)
+		return &cq->cq_hash[cq->cq_slot & HASH_MASK];
 
-	hev = ch->ch_tail;
+	d = idx - cq->cq_slot;
 
-	g_assert(hev->ce_bnext == NULL);
+	if (d < HASH_SIZE)
+		return &cq->cq_hash[idx & HASH_MASK];
 
-	if (trigger >= hev->ce_time) {
-		hev->ce_bnext = ev;
-		ev->ce_bnext = NULL;
-		ev->ce_bprev = hev;
-		ch->ch_tail = ev;
-		return;
+	for (l = 1; l < WHEEL_LEVELS; l++) {
+		if (d < (cq_time_t) 1 << WHEEL_SHIFT(l + 1))
+			return cq_wheel_bucket(cq, l, idx);
 	}
 
-	/*
-	 * If item is smaller than the head...
-	 */
+	if G_UNLIKELY(d >= WHEEL_SPAN)
+		idx = cq->cq_slot + WHEEL_SPAN - 1;		/* Parked, will cascade */
+
+	return cq_wheel_bucket(cq, WHEEL_LEVELS, idx);
+}
 
-	hev = ch->ch_head;
+/**
+ * Link event into the callout queue.
+ */
+static void
+ev_link(cevent_t *ev)
+{
+	cqueue_t *cq;
 
-	g_assert(hev->ce_bprev == NULL);
+	cevent_check(ev);
 
-	if (trigger < hev->ce_time) {
-		hev->ce_bprev = ev;
-		ev->ce_bnext = hev;
-		ev->ce_bprev = NULL;
-		ch->ch_head = ev;
-		return;
-	}
+	cq = ev->ce_cq;
+	cqueue_check(cq);
+	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
+	assert_mutex_is_owned(&cq->cq_lock);
 
 	/*
-	 * Insert before the first item whose trigger will come after ours.
+	 * Important corner case: we may be rescheduling an event BEFORE
+	 * the current clock time, in which case it goes to the current
+	 * bucket, so it gets fired during the current cq_clock() run.
 	 */
 
-	for (hev = hev->ce_bnext; hev; hev = hev->ce_bnext) {
-		if (trigger < hev->ce_time) {
-			hev->ce_bprev->ce_bnext = ev;
-			ev->ce_bprev = hev->ce_bprev;
-			hev->ce_bprev = ev;
-			ev->ce_bnext = hev;
-			return;
-		}
-	}
-
-	g_assert_not_reached();	/* Must have found an event to insert before */
+	cq->cq_items++;
+	chash_append(cq_bucket(cq, ev->ce_time), ev);
 }
 
 /**
@@ -554,7 +590,6 @@ ev_link(cevent_t *ev)
 static void
 ev_unlink(cevent_t *ev)
 {
-	struct chash *ch;			/* Hashing bucket */
 	cqueue_t *cq;
 
 	cevent_check(ev);
@@ -562,25 +597,52 @@ ev_unlink(cevent_t *ev)
 	cqueue_check(cq);
 	assert_mutex_is_owned(&cq->cq_lock);
 
-	ch = &cq->cq_hash[EV_HASH(ev->ce_time)];
 	cq->cq_items--;
+	chash_remove(ev);
+}
+
+/**
+ * Cascade the events of an upper level bucket into the lower levels.
+ */
+static void
+cq_cascade(cqueue_t *cq, struct chash *ch)
+{
+	cevent_t *ev, *next;
+
+	ev = ch->ch_head;
+	ch->ch_head = ch->ch_tail = NULL;
+
+	for (/* empty */; ev != NULL; ev = next) {
+		next = ev->ce_bnext;
+		chash_append(cq_bucket(cq, ev->ce_time), ev);
+	}
+}
+
+/**
+ * Move to the next slot, cascading upper levels as needed.
+ */
+static void
+cq_advance(cqueue_t *cq)
+{
+	cq_time_t slot = ++cq->cq_slot;
+	uint l;
+
+	if G_LIKELY(0 != (slot & HASH_MASK))
+		return;
 
 	/*
-	 * Unlinking the item is straigthforward, unlike insertion!
+	 * We are starting a new revolution of the first level.  Find out how
+	 * many upper levels are also starting a new revolution, and cascade
+	 * from the highest one down.
 	 */
 
-	if (ch->ch_head == ev)
-		ch->ch_head = ev->ce_bnext;
-	if (ch->ch_tail == ev)
-		ch->ch_tail = ev->ce_bprev;
-
-	if (ev->ce_bprev)
-		ev->ce_bprev->ce_bnext = ev->ce_bnext;
-	if (ev->ce_bnext)
-		ev->ce_bnext->ce_bprev = ev->ce_bprev;
+	for (l = 1; l < WHEEL_LEVELS; l++) {
+		if (0 != ((slot >> WHEEL_SHIFT(l)) & WHEEL_MASK))
+			break;
+	}
 
-	g_assert(ch->ch_head == NULL || ch->ch_head->ce_bprev == NULL);
-	g_assert(ch->ch_tail == NULL || ch->ch_tail->ce_bnext == NULL);
+	for (/* empty */; l != 0; l--)
+		cq_cascade(cq, cq_wheel_bucket(cq, l, slot));
 }
 
 /**
@@ -1044,7 +1106,22 @@ cq_expire_internal(cqueue_t *cq, cevent_t *ev)
 	g_assert(fn != NULL);
 
 	CQ_UNLOCK(cq);
-	(*fn)(cq, arg);		/* Callback invoked with queue unlocked */
+
+	/*
+	 * Events from the main callout queue are run from the main loop,
+	 * hence we monitor their execution time to spot stalls.
+	 */
+
+	if (callout_queue == cq) {
+		tm_t start;
+
+		tm_now_exact(&start);
+		(*fn)(cq, arg);
+		stall_account(STALL_SRC_CALLOUT, func_to_pointer(fn), &start);
+	} else {
+		(*fn)(cq, arg);		/* Callback invoked with queue unlocked */
+	}
+
 	CQ_LOCK(cq);
 
 	/*
@@ -1144,13 +1221,10 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 static size_t
 cq_clock(cqueue_t *cq, int elapsed)
 {
-	int bucket;
-	int last_bucket, old_last_bucket;
 	struct chash *ch, *old_current;
 	cevent_t *ev;
 	const cevent_t *old_call;
 	bool old_call_extended, force_idle = FALSE;
-	cq_time_t now;
 	size_t processed = 0;
 
 	cqueue_check(cq);
@@ -1161,10 +1235,10 @@ cq_clock(cqueue_t *cq, int elapsed)
 	 * Recursive calls are possible: in the middle of an event, we could
 	 * trigger something that will call cq_dispatch() manually for instance.
 	 *
-	 * Therefore, we save the cq_current and cq_last_bucket fields upon
-	 * entry and restore them at the end as appropriate. If cq_current is
-	 * NULL initially, it means we were not in the middle of any recursion
-	 * so we won't have to restore cq_last_bucket.
+	 * Therefore, we save the cq_current field upon entry and restore it at
+	 * the end.  If cq_current is NULL initially, it means we were not in the
+	 * middle of any recursion.  Since a recursive call can move the current
+	 * slot, we always look at the queue state after events were fired.
 	 *
 	 * Note that we enforce recursive calls to cq_clock() to be on the
 	 * same thread due to the use of a mutex. However, each initial run of
@@ -1174,75 +1248,72 @@ cq_clock(cqueue_t *cq, int elapsed)
 	old_current = cq->cq_current;
 	old_call = cq->cq_call;
 	old_call_extended = cq->cq_call_extended;
-	old_last_bucket = cq->cq_last_bucket;
 
 	cq->cq_ticks++;
 	cq->cq_time += elapsed;
-	now = cq->cq_time;
 
-	bucket = cq->cq_last_bucket;		/* Bucket we traversed last time */
-	ch = &cq->cq_hash[bucket];
-	last_bucket = EV_HASH(now);			/* Last bucket to traverse now */
+	for (;;) {
+		cq_time_t slot = cq->cq_slot, now = cq->cq_time;
+		struct chash pending;
 
-	/*
-	 * If `elapsed' has overflowed the hash size, then we'll need to look at
-	 * all the buckets in the table (wrap around).
-	 */
-
-	if (EV_OVER(elapsed))
-		last_bucket = bucket;
+		ch = &cq->cq_hash[slot & HASH_MASK];
+		cq->cq_current = ch;
 
-	/*
-	 * Since the hashed time is a not a strictly monotonic function of time,
-	 * we have to rescan the last bucket, in case the earliest event have
-	 * expired now, before moving forward.
-	 */
+		if (slot < EV_SLOT(now)) {
+			/*
+			 * The slot has fully elapsed: all its events are due.
+			 */
 
-	cq->cq_current = ch;
+			while (slot == cq->cq_slot && NULL != (ev = ch->ch_head)) {
+				cq_expire_internal(cq, ev);
+				processed++;
+			}
 
-	while ((ev = ch->ch_head) && ev->ce_time <= now) {
-		cq_expire_internal(cq, ev);
-		processed++;
-	}
+			if G_LIKELY(slot == cq->cq_slot) {
+				if (0 == cq->cq_items)
+					cq->cq_slot = EV_SLOT(now);		/* Nothing to cascade */
+				else
+					cq_advance(cq);
+			}
+			continue;
+		}
 
-	/*
-	 * If we don't have to move forward (elapsed is too small), we're done.
-	 */
+		/*
+		 * We reached the current slot, which has only partially elapsed.
+		 *
+		 * The events which are not due yet are moved aside whilst we
+		 * scan the bucket, where callbacks can add new events.
+		 */
 
-	if (cq->cq_last_bucket == last_bucket && !EV_OVER(elapsed))
-		goto done;
+		pending.ch_head = pending.ch_tail = NULL;
 
-	cq->cq_last_bucket = last_bucket;
+		while (slot == cq->cq_slot && NULL != (ev = ch->ch_head)) {
+			if (ev->ce_time <= cq->cq_time) {
+				cq_expire_internal(cq, ev);
+				processed++;
+			} else {
+				chash_remove(ev);
+				chash_append(&pending, ev);
+			}
+		}
 
-	do {
-		ch++;
-		if (++bucket >= HASH_SIZE) {
-			bucket = 0;
-			ch = cq->cq_hash;
+		while (NULL != (ev = pending.ch_head)) {
+			chash_remove(ev);
+			chash_append(cq_bucket(cq, ev->ce_time), ev);
 		}
 
 		/*
-		 * Since each bucket is sorted, we can stop our walkthrough as
-		 * soon as we reach an event scheduled after `now'.
+		 * Unless a recursive call moved the clock, we are done.
 		 */
 
-		cq->cq_current = ch;
-
-		while ((ev = ch->ch_head) && ev->ce_time <= now) {
-			cq_expire_internal(cq, ev);
-			processed++;
-		}
-
-	} while (bucket != last_bucket);
+		if G_LIKELY(slot == cq->cq_slot && now == cq->cq_time)
+			break;
+	}
 
-done:
 	cq->cq_current = old_current;
 	cq->cq_call = old_call;
 	cq->cq_call_extended = old_call_extended;
 
-	if G_UNLIKELY(old_current != NULL)
-		cq->cq_last_bucket = old_last_bucket;	/* Was in recursive call */
-
 	if (cq_debugging(5)) {
 		s_debug("CQ: %squeue \"%s\" %striggered %zu event%s (%d item%s)",
 			cq->cq_magic == CSUBQUEUE_MAGIC ? "sub" : "",
@@ -1284,6 +1355,21 @@ done:
 	return processed;		/* Do not count idle events */
 }
 
+/**
+ * @return the earliest trigger time of the events in a non-empty bucket.
+ */
+static cq_time_t
+chash_earliest(const struct chash *ch)
+{
+	const cevent_t *ev = ch->ch_head;
+	cq_time_t t = ev->ce_time;
+
+	for (ev = ev->ce_bnext; ev != NULL; ev = ev->ce_bnext)
+		t = MIN(t, ev->ce_time);
+
+	return t;
+}
+
 /**
  * Compute delay until the next registered event, expressed in units of the
  * callout queue "virtual time".
@@ -1303,45 +1389,67 @@ int
 cq_delay(const cqueue_t *cq)
 {
 	int delay = MAX_INT_VAL(int);
-	int last_bucket;
-	int i;
-	cq_time_t now;
-	bool adjusted = FALSE;
+	int i, l;
+	cq_time_t slot, next = 0;
+	bool found = FALSE, adjusted = FALSE;
 
 	cqueue_check(cq);
 
 	mutex_lock_const(&cq->cq_lock);
 
-	last_bucket = cq->cq_last_bucket;	/* Last bucket scanned */
-	now = cq->cq_time;
+	slot = cq->cq_slot;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		int b = (last_bucket + i) & HASH_MASK;
-		struct chash *ch = &cq->cq_hash[b];
-		cevent_t *ev = ch->ch_head;
-		int edelay;
+	/*
+	 * Events in the first level are sorted by bucket: the first non-empty
+	 * bucket holds the earliest event of that level.
+	 */
 
-		/*
-		 * If the delay we have so far is not too large (does not overflow
-		 * the size of the hashing array) and we have moved away from the
-		 * last scanned bucket by an amount that is large-enough, we know
-		 * we cannot find a smaller delay ahead in the buckets.
-		 */
+	for (i = 0; i < HASH_SIZE; i++) {
+		const struct chash *ch = &cq->cq_hash[(slot + i) & HASH_MASK];
 
-		if (!EV_OVER(delay) && i > EV_HASH(delay))
+		if (ch->ch_head != NULL) {
+			next = chash_earliest(ch);
+			found = TRUE;
 			break;
+		}
+	}
 
-		if (NULL == ev)
-			continue;
+	/*
+	 * Events in an upper level are not necessarily due after the ones in
+	 * the levels below, since a level only gets cascaded at the start of
+	 * its next bucket.  The first non-empty bucket of each level holds the
+	 * earliest event of that level, the current bucket of each level coming
+	 * last since it is for the next revolution.  A bucket starting after the
+	 * earliest event we know of cannot hold anything earlier.
+	 */
 
-		edelay = ev->ce_time - now;
+	for (l = 1; l <= WHEEL_LEVELS; l++) {
+		int j;
 
-		if G_UNLIKELY(edelay <= 0) {
-			delay = 0;
-			break;
+		for (j = 1; j <= WHEEL_SIZE; j++, i++) {
+			cq_time_t start = ((slot >> WHEEL_SHIFT(l)) + j) << WHEEL_SHIFT(l);
+			const struct chash *ch;
+
+			if (found && (start << 5) >= next)
+				break;
+
+			ch = cq_wheel_bucket(cq, l, start);
+
+			if (ch->ch_head != NULL) {
+				cq_time_t t = chash_earliest(ch);
+				if (!found || t < next)
+					next = t;
+				found = TRUE;
+				break;
+			}
 		}
+	}
 
-		delay = MIN(delay, edelay);
+	if (found) {
+		if (next <= cq->cq_time)
+			delay = 0;
+		else
+			delay = MIN(next - cq->cq_time, (cq_time_t) MAX_INT_VAL(int));
 	}
 
 	/*
@@ -2274,7 +2382,7 @@ cq_free(cqueue_t *cq)
 
 	mutex_lock(&cq->cq_lock);
 
-	for (ch = cq->cq_hash, i = 0; i < HASH_SIZE; i++, ch++) {
+	for (ch = cq->cq_hash, i = 0; i < CQ_BUCKETS; i++, ch++) {
 		for (ev = ch->ch_head; ev; ev = ev_next) {
 			ev_next = ev->ce_bnext;
 			ev_free(ev);
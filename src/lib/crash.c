@@ -3884,13 +3884,16 @@ crash_init(const char *argv0, const char *progname,
 	}
 
 	/*
-	 * Since we install a crash handler, we can load program symbols
-	 * immediately!  Indeed, we could fail to do so later on when we
+	 * Since we install a crash handler, we must load program symbols
+	 * early!  Indeed, we could fail to do so later on when we
 	 * actully would desperately need symbols...
 	 *		--RAM, 2015-11-07
+	 *
+	 * Loading is deferred to stacktrace_post_init(), which loads them in
+	 * the background.  Should we crash before, they are loaded on the spot.
 	 */
 
-	stacktrace_init(executable, FALSE);
+	stacktrace_init(executable, TRUE);
 
 	if (executable != argv0)
 		HFREE_NULL(executable);
@@ -35,6 +35,10 @@
  * hash-to-disk database.  That way, we can add more DBM-like backends
  * without having the change the client code.
  *
+ * The log-structured merge tree back-end suits maps with a high turnover,
+ * where keys are constantly created and deleted, since it turns all the
+ * writes into sequential I/Os.
+ *
  * Another advantage is that we can provide easily a transparent fallback
  * to an in-core version of a DBM database should there be a problem with
  * initialization of the DBM.
@@ -49,6 +53,7 @@
 
 #include "bstr.h"
 #include "debug.h"
+#include "fd.h"
 #include "map.h"
 #include "misc.h"				/* For english_strerror() */
 #include "pmsg.h"
@@ -79,6 +84,9 @@ struct dbmap {
 			time_t last_check;		/**< When we last checked keys */
 			unsigned is_volatile:1;	/**< Whether DB can be discarded */
 		} s;
+		struct {
+			lsm_t *lsm;
+		} l;
 	} u;
 	size_t key_size;		/**< Constant width keys are a requirement */
 	dbmap_keylen_t key_len;	/**< Optional, computes serialized key length */
@@ -292,6 +300,35 @@ dbmap_sdbm_error_check(const dbmap_t *dm)
 	return FALSE;
 }
 
+/**
+ * Check whether last operation reported an I/O error in the LSM layer.
+ *
+ * @return TRUE on error
+ */
+static bool
+dbmap_lsm_error_check(const dbmap_t *dm)
+{
+	dbmap_t *dmw = deconstify_pointer(dm);
+
+	dbmap_check(dm);
+	g_assert(DBMAP_LSM == dm->type);
+
+	dmw->count = lsm_count(dm->u.l.lsm);
+
+	if (lsm_error(dm->u.l.lsm)) {
+		dmw->ioerr = TRUE;
+		dmw->had_ioerr = TRUE;
+		dmw->error = errno;
+		lsm_clearerr(dm->u.l.lsm);
+		return TRUE;
+	} else if (dm->ioerr) {
+		dmw->ioerr = FALSE;
+		dmw->error = 0;
+	}
+
+	return FALSE;
+}
+
 /**
  * Helper routine to count keys in an opened SDBM database.
  */
@@ -432,6 +469,22 @@ dbmap_type(const dbmap_t *dm)
 	return dm->type;
 }
 
+/**
+ * @return name of DB map type, for logging.
+ */
+const char *
+dbmap_type_to_string(enum dbmap_type type)
+{
+	switch (type) {
+	case DBMAP_MAP:		return "map";
+	case DBMAP_SDBM:	return "sdbm";
+	case DBMAP_LSM:		return "lsm";
+	case DBMAP_MAXTYPE:	break;
+	}
+
+	return "unknown";
+}
+
 /**
  * @return amount of items held in map
  */
@@ -530,6 +583,52 @@ dbmap_create_sdbm(size_t ksize, dbmap_keylen_t klen,
 	return dm;
 }
 
+/**
+ * Create a DB map implemented as a log-structured merge tree.
+ *
+ * When klen is NULL, ksize is the expected constant key length.
+ * When klen is not NULL, ksize is the expected maximum key length
+ * and the klen routine is used to compute the actual size of the key
+ * based on its serialized form.
+ *
+ * @param ksize		expected constant key length
+ * @param klen		optional, computes serialized key length
+ * @param name		name of the database, for logging (may be NULL)
+ * @param path		base path of the database files
+ * @param flags		opening flags
+ * @param mode		file permissions
+ *
+ * @return the opened database, or NULL if an error occurred during opening.
+ */
+dbmap_t *
+dbmap_create_lsm(size_t ksize, dbmap_keylen_t klen,
+	const char *name, const char *path, int flags, int mode)
+{
+	dbmap_t *dm;
+	lsm_t *lsm;
+
+	g_assert(ksize != 0);
+	g_assert(path != NULL);
+
+	lsm = lsm_open(path, flags, mode);
+	if (NULL == lsm)
+		return NULL;
+
+	if (name != NULL)
+		lsm_set_name(lsm, name);
+
+	WALLOC0(dm);
+	dm->magic = DBMAP_MAGIC;
+	dm->type = DBMAP_LSM;
+	dm->key_size = ksize;
+	dm->key_len = klen;
+	dm->u.l.lsm = lsm;
+	dm->count = lsm_count(lsm);
+	dm->validated = TRUE;
+
+	return dm;
+}
+
 /**
  * Create a map out of an existing map.
  * Use dbmap_release() to discard the dbmap encapsulation.
@@ -679,6 +778,20 @@ dbmap_insert(dbmap_t *dm, const void *key, dbmap_datum_t value)
 				dm->count++;
 		}
 		break;
+	case DBMAP_LSM:
+		{
+			int ret;
+
+			errno = dm->error = 0;
+			ret = lsm_store(dm->u.l.lsm, key, dbmap_keylen(dm, key),
+				value.data, value.len, NULL);
+			dbmap_lsm_error_check(dm);
+			if (0 != ret) {
+				dm->error = errno;
+				return FALSE;
+			}
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -757,6 +870,19 @@ dbmap_remove(dbmap_t *dm, const void *key)
 			}
 		}
 		break;
+	case DBMAP_LSM:
+		{
+			int ret;
+
+			errno = dm->error = 0;
+			ret = lsm_delete(dm->u.l.lsm, key, dbmap_keylen(dm, key));
+			dbmap_lsm_error_check(dm);
+			if (-1 == ret && errno != 0) {
+				dm->error = errno;
+				return FALSE;
+			}
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -792,6 +918,19 @@ dbmap_contains(dbmap_t *dm, const void *key)
 			}
 			return 0 != ret;
 		}
+	case DBMAP_LSM:
+		{
+			int ret;
+
+			dm->error = errno = 0;
+			ret = lsm_exists(dm->u.l.lsm, key, dbmap_keylen(dm, key));
+			dbmap_lsm_error_check(dm);
+			if (-1 == ret) {
+				dm->error = errno;
+				return FALSE;
+			}
+			return 0 != ret;
+		}
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -839,6 +978,19 @@ dbmap_lookup(dbmap_t *dm, const void *key)
 			result.len = value.dsize;
 		}
 		break;
+	case DBMAP_LSM:
+		{
+			size_t len = 0;
+
+			errno = dm->error = 0;
+			result.data = lsm_fetch(dm->u.l.lsm, key, dbmap_keylen(dm, key),
+				&len);
+			dbmap_lsm_error_check(dm);
+			if (errno)
+				dm->error = errno;
+			result.len = len;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -859,6 +1011,8 @@ dbmap_implementation(const dbmap_t *dm)
 		return dm->u.m.map;
 	case DBMAP_SDBM:
 		return dm->u.s.sdbm;
+	case DBMAP_LSM:
+		return dm->u.l.lsm;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -905,7 +1059,7 @@ free_kv(void *key, void *value, void *u)
  * Destroy a DB map.
  *
  * A memory-backed map is lost.
- * An SDBM-backed map is lost if marked volatile.
+ * An SDBM-backed or LSM-backed map is lost if marked volatile.
  */
 void
 dbmap_destroy(dbmap_t *dm)
@@ -920,6 +1074,9 @@ dbmap_destroy(dbmap_t *dm)
 	case DBMAP_SDBM:
 		sdbm_close(dm->u.s.sdbm);
 		break;
+	case DBMAP_LSM:
+		lsm_close(dm->u.l.lsm);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -949,6 +1106,24 @@ insert_key(void *key, void *unused_value, void *u)
 	ctx->sl = pslist_prepend(ctx->sl, kdup);
 }
 
+/**
+ * LSM iterator to insert a copy of the keys into a singly-linked list.
+ */
+static bool
+dbmap_lsm_insert_key(const void *key, size_t klen,
+	const void *unused_data, size_t unused_dlen, void *u)
+{
+	struct insert_ctx *ctx = u;
+
+	(void) unused_data;
+	(void) unused_dlen;
+
+	if (dbmap_keylen(ctx->dm, key) == klen)
+		ctx->sl = pslist_prepend(ctx->sl, wcopy(key, klen));
+
+	return FALSE;
+}
+
 /**
  * Snapshot all the constant-width keys, returning them in a singly linked list.
  * To free the returned keys, use the dbmap_free_all_keys() helper.
@@ -993,6 +1168,17 @@ dbmap_all_keys(const dbmap_t *dm)
 			dbmap_sdbm_error_check(dm);
 		}
 		break;
+	case DBMAP_LSM:
+		{
+			struct insert_ctx ctx;
+
+			ctx.sl = NULL;
+			ctx.dm = dm;
+			lsm_foreach(dm->u.l.lsm, dbmap_lsm_insert_key, &ctx);
+			dbmap_lsm_error_check(dm);
+			sl = ctx.sl;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1103,6 +1289,52 @@ dbmap_foreach_remove_sdbm(const datum key, const datum value, void *arg)
 	return to_remove;
 }
 
+/**
+ * Trampoline to invoke the LSM iterator and do the proper casts.
+ */
+static bool
+dbmap_foreach_lsm(const void *key, size_t klen,
+	const void *data, size_t dlen, void *arg)
+{
+	dbmap_datum_t d;
+	struct foreach_ctx *ctx = arg;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return FALSE;		/* Invalid key, corrupted file? */
+
+	d.data = deconstify_pointer(data);
+	d.len  = dlen;
+
+	(*ctx->u.cb)(deconstify_pointer(key), &d, ctx->arg);
+
+	return FALSE;
+}
+
+/**
+ * Trampoline to invoke the LSM removal iterator and do the proper casts.
+ */
+static bool
+dbmap_foreach_remove_lsm(const void *key, size_t klen,
+	const void *data, size_t dlen, void *arg)
+{
+	dbmap_datum_t d;
+	struct foreach_ctx *ctx = arg;
+	bool to_remove;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return FALSE;		/* Invalid key, corrupted file, keep it */
+
+	d.data = deconstify_pointer(data);
+	d.len  = dlen;
+
+	to_remove = (*ctx->u.cbr)(deconstify_pointer(key), &d, ctx->arg);
+
+	if (to_remove)
+		ctx->deleted++;
+
+	return to_remove;
+}
+
 /**
  * Reset count of items.
  *
@@ -1157,6 +1389,11 @@ dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg)
 				dbmap_reset_count(dm, count);
 		}
 		break;
+	case DBMAP_LSM:
+		ctx.dm = dm;
+		lsm_foreach(dm->u.l.lsm, dbmap_foreach_lsm, &ctx);
+		dbmap_lsm_error_check(dm);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1205,6 +1442,13 @@ dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg)
 			deleted = ctx.deleted;
 		}
 		break;
+	case DBMAP_LSM:
+		ctx.dm = dm;
+		ctx.deleted = 0;
+		lsm_foreach_remove(dm->u.l.lsm, dbmap_foreach_remove_lsm, &ctx);
+		dbmap_lsm_error_check(dm);
+		deleted = ctx.deleted;
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1224,7 +1468,7 @@ dbmap_store_entry(void *key, dbmap_datum_t *d, void *arg)
  *
  * If the map was already backed by an SDBM database and ``inplace'' is TRUE,
  * then the map is simply persisted as such.  It is marked non-volatile as
- * a side effect.
+ * a side effect.  The same applies to maps backed by an LSM tree.
  *
  * @param dm		the DB map to store
  * @param base		base path for the persistent database
@@ -1253,6 +1497,17 @@ dbmap_store(dbmap_t *dm, const char *base, bool inplace)
 		/* FALL THROUGH */
 	}
 
+	if (inplace && DBMAP_LSM == dm->type) {
+		dbmap_set_volatile(dm, FALSE);
+		if (-1 != dbmap_sync(dm))
+			return ok;
+
+		s_warning("LSM \"%s\": cannot flush: %s",
+			lsm_name(dm->u.l.lsm), dbmap_strerror(dm));
+
+		/* FALL THROUGH */
+	}
+
 	if (NULL == base)
 		return FALSE;
 
@@ -1341,6 +1596,12 @@ dbmap_sync(dbmap_t *dm)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_sync(dm->u.s.sdbm);
+	case DBMAP_LSM:
+		{
+			ssize_t n = lsm_sync(dm->u.l.lsm);
+			dbmap_lsm_error_check(dm);
+			return n;
+		}
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1348,6 +1609,38 @@ dbmap_sync(dbmap_t *dm)
 	return 0;
 }
 
+/**
+ * Synchronize map and make sure the flushed data reach the disk.
+ *
+ * This is stronger than dbmap_sync() which only hands the data over to
+ * the kernel, and it is meant to be used to checkpoint the database.
+ *
+ * @return amount of pages flushed to disk, or -1 in case of errors.
+ */
+ssize_t
+dbmap_sync_data(dbmap_t *dm)
+{
+	ssize_t n;
+
+	dbmap_check(dm);
+
+	n = dbmap_sync(dm);
+
+	if (n != -1 && DBMAP_SDBM == dm->type) {
+		DBM *sdbm = dm->u.s.sdbm;
+		int fd;
+
+		if (-1 == fd_fdatasync(sdbm_pagfno(sdbm)))
+			return -1;
+
+		fd = sdbm_datfno(sdbm);
+		if (fd != -1 && -1 == fd_fdatasync(fd))
+			return -1;
+	}
+
+	return n;
+}
+
 /**
  * Attempt to shrink the database.
  * @return TRUE if no error occurred.
@@ -1362,6 +1655,8 @@ dbmap_shrink(dbmap_t *dm)
 		return TRUE;
 	case DBMAP_SDBM:
 		return sdbm_shrink(dm->u.s.sdbm);
+	case DBMAP_LSM:
+		return TRUE;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1383,6 +1678,12 @@ dbmap_rebuild(dbmap_t *dm)
 		return TRUE;
 	case DBMAP_SDBM:
 		return 0 == sdbm_rebuild(dm->u.s.sdbm);
+	case DBMAP_LSM:
+		{
+			bool ok = lsm_compact(dm->u.l.lsm);
+			dbmap_lsm_error_check(dm);
+			return ok;
+		}
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1390,6 +1691,78 @@ dbmap_rebuild(dbmap_t *dm)
 	return FALSE;
 }
 
+/**
+ * Start an incremental rebuild of the database, which is then performed
+ * by calling dbmap_rebuild_step() until it reports completion.
+ *
+ * Only SDBM databases support incremental rebuilds.
+ *
+ * @return TRUE if the rebuild was started, FALSE if not supported or on error.
+ */
+bool
+dbmap_rebuild_start(dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	if (DBMAP_SDBM != dm->type)
+		return FALSE;
+
+	errno = dm->error = 0;
+	if (0 == sdbm_rebuild_start(dm->u.s.sdbm))
+		return TRUE;
+
+	dm->error = errno;
+	return FALSE;
+}
+
+/**
+ * Perform one step of the incremental rebuild.
+ *
+ * @param dm		the database being rebuilt
+ * @param pages		maximum amount of pages to copy
+ *
+ * @return 1 when the rebuild is completed, 0 if more steps are needed, -1
+ * on error, the rebuild being cancelled.
+ */
+int
+dbmap_rebuild_step(dbmap_t *dm, long pages)
+{
+	int r;
+
+	dbmap_check(dm);
+	g_assert(DBMAP_SDBM == dm->type);
+
+	errno = dm->error = 0;
+	r = sdbm_rebuild_step(dm->u.s.sdbm, pages);
+	if (-1 == r)
+		dm->error = errno;
+
+	return r;
+}
+
+/**
+ * Cancel incremental rebuild, if any is in progress.
+ */
+void
+dbmap_rebuild_cancel(dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	if (DBMAP_SDBM == dm->type)
+		sdbm_rebuild_cancel(dm->u.s.sdbm);
+}
+
+/**
+ * @return whether an incremental rebuild is in progress.
+ */
+bool
+dbmap_is_rebuilding(const dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	return DBMAP_SDBM == dm->type && sdbm_is_rebuilding(dm->u.s.sdbm);
+}
+
 /**
  * Discard all data from the database.
  * @return TRUE if no error occurred.
@@ -1411,6 +1784,14 @@ dbmap_clear(dbmap_t *dm)
 			return TRUE;
 		}
 		return FALSE;
+	case DBMAP_LSM:
+		if (0 == lsm_clear(dm->u.l.lsm)) {
+			dm->ioerr = FALSE;
+			dm->count = 0;
+			return TRUE;
+		}
+		dbmap_lsm_error_check(dm);
+		return FALSE;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1432,6 +1813,8 @@ dbmap_set_cachesize(dbmap_t *dm, long pages)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_set_cache(dm->u.s.sdbm, pages);
+	case DBMAP_LSM:
+		return 0;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1453,6 +1836,31 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_set_wdelay(dm->u.s.sdbm, on);
+	case DBMAP_LSM:
+		return 0;
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Turn SDBM memory-mapped page access on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_mmap(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_set_mmap(dm->u.s.sdbm, on);
+	case DBMAP_LSM:
+		return 0;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1475,6 +1883,9 @@ dbmap_set_volatile(dbmap_t *dm, bool is_volatile)
 	case DBMAP_SDBM:
 		dm->u.s.is_volatile = booleanize(is_volatile);
 		return sdbm_set_volatile(dm->u.s.sdbm, is_volatile);
+	case DBMAP_LSM:
+		lsm_set_volatile(dm->u.l.lsm, is_volatile);
+		return 0;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1482,6 +1893,25 @@ dbmap_set_volatile(dbmap_t *dm, bool is_volatile)
 	return 0;
 }
 
+/**
+ * Install callback computing the expiration time of values, so that
+ * expired values can be discarded during compactions.
+ *
+ * This is only supported by LSM-backed maps, and ignored otherwise.
+ *
+ * @param dm		the DB map
+ * @param cb		computes the expiration time of values (NULL to disable)
+ * @param grace		grace period after expiration before values are discarded
+ */
+void
+dbmap_set_expiry(dbmap_t *dm, lsm_expiry_t cb, time_delta_t grace)
+{
+	dbmap_check(dm);
+
+	if (DBMAP_LSM == dm->type)
+		lsm_set_expiry(dm->u.l.lsm, cb, grace);
+}
+
 /**
  * Record debugging configuration.
  */
@@ -1494,7 +1924,7 @@ dbmap_set_debugging(dbmap_t *dm, const dbg_config_t *dbg)
 
 	if (dbg_ds_debugging(dm->dbg, 1, DBG_DSF_DEBUGGING)) {
 		dbg_ds_log(dm->dbg, dm, "%s: attached with %s back-end (count=%zu)",
-			G_STRFUNC, DBMAP_SDBM == dm->type ? "sdbm" : "map", dm->count);
+			G_STRFUNC, dbmap_type_to_string(dm->type), dm->count);
 	}
 }
 
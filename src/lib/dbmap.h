@@ -36,6 +36,7 @@
 
 #include "common.h"
 
+#include "lsm.h"
 #include "map.h"
 #include "sdbm/sdbm.h"
 
@@ -45,6 +46,7 @@
 enum dbmap_type {
 	DBMAP_MAP = 0,			/* Map in memory */
 	DBMAP_SDBM,				/* SDBM database */
+	DBMAP_LSM,				/* Log-structured merge tree */
 
 	DBMAP_MAXTYPE
 };
@@ -79,6 +81,8 @@ dbmap_t *dbmap_create_hash(size_t ks, dbmap_keylen_t kl,
 	hash_fn_t hashf, eq_fn_t key_eqf);
 dbmap_t * dbmap_create_sdbm(size_t ks, dbmap_keylen_t kl, const char *name,
 	const char *path, int flags, int mode);
+dbmap_t *dbmap_create_lsm(size_t ks, dbmap_keylen_t kl, const char *name,
+	const char *path, int flags, int mode);
 dbmap_t *dbmap_create_from_map(size_t ks, dbmap_keylen_t kl, map_t *map);
 dbmap_t *dbmap_create_from_sdbm(const char *name,
 	size_t ks, dbmap_keylen_t kl, DBM *sdbm);
@@ -101,6 +105,7 @@ dbmap_keylen_t dbmap_key_length(const dbmap_t *dm);
 bool dbmap_has_ioerr(const dbmap_t *dm);
 const char *dbmap_strerror(const dbmap_t *dm);
 enum dbmap_type dbmap_type(const dbmap_t *dm);
+const char *dbmap_type_to_string(enum dbmap_type type);
 size_t dbmap_count(const dbmap_t *dm);
 
 void dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg);
@@ -119,11 +124,18 @@ bool dbmap_store(dbmap_t *dm, const char *base, bool inplace);
 bool dbmap_copy(dbmap_t *from, dbmap_t *to);
 bool dbmap_shrink(dbmap_t *dm);
 bool dbmap_rebuild(dbmap_t *dm);
+bool dbmap_rebuild_start(dbmap_t *dm);
+int dbmap_rebuild_step(dbmap_t *dm, long pages);
+void dbmap_rebuild_cancel(dbmap_t *dm);
+bool dbmap_is_rebuilding(const dbmap_t *dm);
 bool dbmap_clear(dbmap_t *dm);
 ssize_t dbmap_sync(dbmap_t *dm);
+ssize_t dbmap_sync_data(dbmap_t *dm);
 int dbmap_set_cachesize(dbmap_t *dm, long pages);
 int dbmap_set_deferred_writes(dbmap_t *dm, bool on);
+int dbmap_set_mmap(dbmap_t *dm, bool on);
 int dbmap_set_volatile(dbmap_t *dm, bool is_volatile);
+void dbmap_set_expiry(dbmap_t *dm, lsm_expiry_t cb, time_delta_t grace);
 void dbmap_set_debugging(dbmap_t *dm, const struct dbg_config *dbg);
 
 #endif	/* _dbmap_h_ */
@@ -36,22 +36,40 @@
 
 #include "dbmw.h"
 
+#include "atoms.h"
+#include "bloom.h"
 #include "bstr.h"
+#include "cq.h"
 #include "dbmap.h"
+#include "dbwal.h"
 #include "debug.h"
+#include "elist.h"
 #include "hashlist.h"
 #include "map.h"
+#include "mempress.h"
 #include "misc.h"				/* For english_strerror() */
+#include "once.h"
 #include "pmsg.h"
 #include "pslist.h"
+#include "spinlock.h"
 #include "stacktrace.h"
 #include "stringify.h"
 #include "walloc.h"
+#include "xmalloc.h"
 #include "zalloc.h"
 
 #include "override.h"			/* Must be the last header included */
 
 #define DBMW_CACHE	128			/**< Default amount of items to cache */
+#define DBMW_CACHE_MIN		16	/**< Cache never shrunk below that */
+#define DBMW_CACHE_BUDGET	(32 * 1024 * 1024)	/**< Global cache budget */
+#define DBMW_CACHE_FLOOR	(DBMW_CACHE_BUDGET / 8)	/**< Under memory pressure */
+
+#define DBMW_WAL_MAXSIZE	(16 * 1024 * 1024)	/**< Checkpoint beyond that */
+#define DBMW_WAL_DELAY		1000				/**< Checkpoint delay (ms) */
+
+#define DBMW_REBUILD_PERIOD	100		/**< Incremental rebuild period (ms) */
+#define DBMW_REBUILD_PAGES	256		/**< Pages copied per rebuild step */
 
 enum dbmw_magic { DBMW_MAGIC = 0x28e7e7d2U };
 
@@ -64,23 +82,34 @@ struct dbmw {
 	const char *name;			/**< DB name, for logging */
 	pmsg_t *mb;					/**< Message block used for serialization */
 	bstr_t *bs;					/**< Binary stream used for deserialization */
-	hash_list_t *keys;			/**< LRU list of keys cached */
+	hash_list_t *hot;			/**< 2Q "Am": keys accessed again, LRU */
+	hash_list_t *fresh;			/**< 2Q "A1in": keys accessed once, FIFO */
+	hash_list_t *ghosts;		/**< 2Q "A1out": keys evicted from A1in */
+	link_t lnk;					/**< Links all the DBM wrappers */
 	map_t *values;				/**< Map of values cached */
 	uint64 r_access;			/**< Number of read accesses */
 	uint64 w_access;			/**< Number of write accesses */
 	uint64 r_hits;				/**< Number of read cache hits */
 	uint64 w_hits;				/**< Number of write cache hits */
+	uint64 evictions;			/**< Number of cache evictions */
+	uint64 ghost_hits;			/**< Number of re-admitted evicted keys */
 	size_t key_size;			/**< Size of keys (constant or maximum) */
 	dbmap_keylen_t key_len;		/**< Optional, computes actual key length */
 	size_t value_size;			/**< Maximum size of values (structure) */
 	size_t value_data_size;		/**< Maximum size of values (serialized form) */
 	size_t max_cached;			/**< Max amount of items to cache */
+	size_t entry_cost;			/**< Budget charged per cached entry */
 	ssize_t cached;				/**< Cached entries not present in dbmap */
 	dbmw_serialize_t pack;		/**< Serialization routine for values */
 	dbmw_deserialize_t unpack;	/**< Deserialization routine for values */
 	dbmw_free_t valfree;		/**< Free routine for deserialized values */
 	const dbg_config_t *dbg;	/**< Optional debugging */
 	dbg_config_t *dbmap_dbg;	/**< Object created for DBMAP debugging */
+	dbwal_t *wal;				/**< Optional write-ahead log */
+	bloom_t *bloom;				/**< Optional filter of keys in the map */
+	uint64 b_skips;				/**< Map lookups avoided by the filter */
+	cevent_t *checkpoint_ev;	/**< Scheduled checkpoint */
+	cperiodic_t *rebuild_ev;	/**< Incremental rebuild steps */
 	int error;					/**< Last errno value */
 	unsigned ioerr:1;			/**< Had I/O error */
 	unsigned count_needs_sync:1;/**< Whether we need to sync to get count */
@@ -94,6 +123,21 @@ dbmw_check(const dbmw_t *dw)
 	g_assert(DBMW_MAGIC == dw->magic);
 }
 
+/*
+ * All the DBM wrappers share a global memory budget for their caches.
+ *
+ * The list of DBM wrappers is only used to report statistics, which can
+ * be requested from another thread, hence the lock.
+ */
+static elist_t dbmw_list = ELIST_INIT(offsetof(dbmw_t, lnk));
+static spinlock_t dbmw_list_slk = SPINLOCK_INIT;
+static size_t dbmw_cache_used;		/**< Budget used by all caches */
+static size_t dbmw_cache_limit = DBMW_CACHE_BUDGET;	/**< Current budget */
+static once_flag_t dbmw_mempress_inited;
+
+#define DBMW_LIST_LOCK		spinlock(&dbmw_list_slk)
+#define DBMW_LIST_UNLOCK	spinunlock(&dbmw_list_slk)
+
 /**
  * A cached entry (deserialized value).
  *
@@ -212,6 +256,8 @@ dbmw_create(dbmap_t *dm, const char *name,
 	g_assert(valfree == NULL || unpack != NULL);
 	g_assert(dm);
 
+	ONCE_FLAG_RUN(dbmw_mempress_inited, dbmw_mempress_init);
+
 	WALLOC0(dw);
 	dw->magic = DBMW_MAGIC;
 	dw->dm = dm;
@@ -246,7 +292,9 @@ dbmw_create(dbmap_t *dm, const char *name,
 		dw->values = map_create_hash(hash_func, eq_func);
 	}
 
-	dw->keys = hash_list_new(hash_func, eq_func);
+	dw->hot = hash_list_new(hash_func, eq_func);
+	dw->fresh = hash_list_new(hash_func, eq_func);
+	dw->ghosts = hash_list_new(hash_func, eq_func);
 	dw->pack = pack;
 	dw->unpack = unpack;
 	dw->valfree = valfree;
@@ -281,11 +329,17 @@ dbmw_create(dbmap_t *dm, const char *name,
 	else
 		dw->max_cached = cache_size;
 
+	dw->entry_cost = dw->key_size + dw->value_size + sizeof(struct cached);
+
+	DBMW_LIST_LOCK;
+	elist_append(&dbmw_list, dw);
+	DBMW_LIST_UNLOCK;
+
 	if (common_dbg)
 		s_debug("DBMW created \"%s\" with %s back-end "
 			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
 
 	return dw;
@@ -362,6 +416,15 @@ write_back(dbmw_t *dw, const void *key, struct cached *value)
 
 	if (ok) {
 		value->dirty = FALSE;
+		if (dw->bloom != NULL && !value->absent)
+			bloom_add(dw->bloom, key, dbmw_keylen(dw, key));
+		if (dw->wal != NULL) {
+			size_t klen = dbmw_keylen(dw, key);
+			if (value->absent)
+				dbwal_delete(dw->wal, key, klen);
+			else
+				dbwal_store(dw->wal, key, klen, dval.data, dval.len);
+		}
 	} else if (dbmap_has_ioerr(dw->dm)) {
 		dw->ioerr = TRUE;
 		dw->error = errno;
@@ -402,6 +465,133 @@ free_value(const dbmw_t *dw, struct cached *cv, bool reclaim)
 	}
 }
 
+/**
+ * @return amount of entries held in the cache.
+ */
+static inline size_t
+dbmw_cache_count(const dbmw_t *dw)
+{
+	return hash_list_count(dw->hot) + hash_list_count(dw->fresh);
+}
+
+/**
+ * Charge the global cache budget for the given amount of entries, which is
+ * negative when entries are released.
+ */
+static void
+dbmw_cache_charge(const dbmw_t *dw, ssize_t n)
+{
+	size_t amount = (n < 0 ? -n : n) * dw->entry_cost;
+
+	DBMW_LIST_LOCK;
+	if (n < 0) {
+		g_assert(dbmw_cache_used >= amount);
+		dbmw_cache_used -= amount;
+	} else {
+		dbmw_cache_used += amount;
+	}
+	DBMW_LIST_UNLOCK;
+}
+
+/**
+ * Check whether the cache must shrink to remain within the global budget.
+ *
+ * Only caches using more than their fair share of the budget have to give
+ * memory back, so that a busy cache can still grow up to its maximum size
+ * whilst others are seldom used.
+ */
+static bool
+dbmw_cache_over_budget(const dbmw_t *dw)
+{
+	size_t count = dbmw_cache_count(dw), used, limit, share;
+
+	if (count <= DBMW_CACHE_MIN)
+		return FALSE;
+
+	DBMW_LIST_LOCK;
+	used = dbmw_cache_used;
+	limit = dbmw_cache_limit;
+	share = limit / MAX(1, elist_count(&dbmw_list));
+	DBMW_LIST_UNLOCK;
+
+	return used + dw->entry_cost > limit && count * dw->entry_cost > share;
+}
+
+/**
+ * Record a cache hit on key.
+ *
+ * Keys in the "hot" list are moved to its tail, keys in the "fresh" list
+ * keep their FIFO position: a burst of accesses right after a key was
+ * loaded does not make it hot.
+ */
+static inline void
+dbmw_cache_hit(dbmw_t *dw, const void *key)
+{
+	if (hash_list_contains(dw->hot, key))
+		hash_list_moveto_tail(dw->hot, key);
+}
+
+/**
+ * Unlink key from the cache list holding it.
+ */
+static void
+dbmw_cache_unlink(dbmw_t *dw, const void *key)
+{
+	if (NULL == hash_list_remove(dw->hot, key)) {
+		void *k = hash_list_remove(dw->fresh, key);
+		g_assert(k != NULL);
+	}
+}
+
+/**
+ * Remember key evicted from the "fresh" list, trimming the ghost list
+ * to half the maximum cache size.
+ */
+static void
+dbmw_ghost_add(dbmw_t *dw, const void *key)
+{
+	size_t max = dw->max_cached / 2;
+
+	if (0 == max)
+		return;
+
+	hash_list_append(dw->ghosts, wcopy(key, dbmw_keylen(dw, key)));
+
+	while (hash_list_count(dw->ghosts) > max) {
+		void *old = hash_list_shift(dw->ghosts);
+		wfree(old, dbmw_keylen(dw, old));
+	}
+}
+
+/**
+ * Forget about an evicted key.
+ *
+ * @return TRUE if the key was remembered.
+ */
+static bool
+dbmw_ghost_remove(dbmw_t *dw, const void *key)
+{
+	void *old = hash_list_remove(dw->ghosts, key);
+
+	if (NULL == old)
+		return FALSE;
+
+	wfree(old, dbmw_keylen(dw, old));
+	return TRUE;
+}
+
+/**
+ * Forget about all the evicted keys.
+ */
+static void
+dbmw_ghost_clear(dbmw_t *dw)
+{
+	void *key;
+
+	while (NULL != (key = hash_list_shift(dw->ghosts)))
+		wfree(key, dbmw_keylen(dw, key));
+}
+
 /**
  * Remove cached entry for key, optionally disposing of the whole structure.
  * Cached entry is flushed if it was dirty and flush is set.
@@ -433,9 +623,10 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
 	if (old->dirty && flush)
 		write_back(dw, key, old);
 
-	hash_list_remove(dw->keys, key);
+	dbmw_cache_unlink(dw, key);
 	map_remove(dw->values, key);
 	wfree(old_key, dbmw_keylen(dw, old_key));
+	dbmw_cache_charge(dw, -1);
 
 	if (!dispose)
 		return old;
@@ -450,6 +641,122 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
 	return NULL;
 }
 
+/**
+ * Evict an entry from the cache, following the 2Q replacement policy.
+ *
+ * Keys accessed only once are evicted first, as long as they use more than
+ * a quarter of the cache, and are remembered in the ghost list.  Otherwise
+ * the least recently used "hot" key is evicted.
+ *
+ * @return the reusable cached entry if dispose was FALSE, NULL otherwise.
+ */
+static struct cached *
+evict_entry(dbmw_t *dw, bool dispose)
+{
+	size_t kin = MAX(1, dbmw_cache_count(dw) / 4);
+	bool fresh;
+	void *key;
+
+	fresh = hash_list_count(dw->fresh) > kin || 0 == hash_list_count(dw->hot);
+	key = hash_list_head(fresh ? dw->fresh : dw->hot);
+
+	g_assert(key != NULL);
+
+	if (fresh)
+		dbmw_ghost_add(dw, key);
+
+	dw->evictions++;
+
+	return remove_entry(dw, key, dispose, TRUE);
+}
+
+/**
+ * Memory pressure callback: amount of memory held by all the caches.
+ */
+static size_t
+dbmw_cache_usage(void *unused_data)
+{
+	size_t used;
+
+	(void) unused_data;
+
+	DBMW_LIST_LOCK;
+	used = dbmw_cache_used;
+	DBMW_LIST_UNLOCK;
+
+	return used;
+}
+
+/**
+ * Memory pressure callback: lower the global cache budget and evict the
+ * entries of the caches now above their share of it.
+ *
+ * When the pressure is gone, the nominal budget is restored.
+ *
+ * Since DBM wrappers are not thread-safe, this relies on them being used
+ * from the main thread only, where memory pressure callbacks are invoked.
+ */
+static size_t
+dbmw_cache_shrink(void *unused_data, size_t amount, mempress_level_t level)
+{
+	dbmw_t **dv, *dw;
+	size_t i, n, before, after;
+
+	(void) unused_data;
+
+	if (MEMPRESS_NONE == level) {
+		DBMW_LIST_LOCK;
+		dbmw_cache_limit = DBMW_CACHE_BUDGET;
+		DBMW_LIST_UNLOCK;
+		return 0;
+	}
+
+	DBMW_LIST_LOCK;
+	n = elist_count(&dbmw_list);
+	DBMW_LIST_UNLOCK;
+
+	XMALLOC_ARRAY(dv, MAX(1, n));
+
+	DBMW_LIST_LOCK;
+	before = dbmw_cache_used;
+	dbmw_cache_limit = before > amount ? before - amount : 0;
+	dbmw_cache_limit = MAX(dbmw_cache_limit, DBMW_CACHE_FLOOR);
+	i = 0;
+	ELIST_FOREACH_DATA(&dbmw_list, dw) {
+		if (i >= n)
+			break;
+		dv[i++] = dw;
+	}
+	n = i;
+	DBMW_LIST_UNLOCK;
+
+	for (i = 0; i < n; i++) {
+		dw = dv[i];
+		dbmw_check(dw);
+
+		while (dbmw_cache_over_budget(dw))
+			(void) evict_entry(dw, TRUE);
+	}
+
+	xfree(dv);
+
+	DBMW_LIST_LOCK;
+	after = dbmw_cache_used;
+	DBMW_LIST_UNLOCK;
+
+	return before > after ? before - after : 0;
+}
+
+/**
+ * Register the DBM wrapper caches with the memory pressure layer.
+ */
+static void
+dbmw_mempress_init(void)
+{
+	mempress_register("DBMW caches", MEMPRESS_COST_CHEAP,
+		dbmw_cache_usage, dbmw_cache_shrink, NULL);
+}
+
 /**
  * Allocate a new entry in the cache to hold the deserialized value.
  *
@@ -471,29 +778,34 @@ allocate_entry(dbmw_t *dw, const void *key, struct cached *filled)
 	struct cached *entry;
 	void *saved_key;
 
-	g_assert(!hash_list_contains(dw->keys, key));
+	g_assert(!hash_list_contains(dw->hot, key));
+	g_assert(!hash_list_contains(dw->fresh, key));
 	g_assert(!map_contains(dw->values, key));
 	g_assert(!filled || (!filled->len == !filled->data));
 
 	saved_key = wcopy(key, dbmw_keylen(dw, key));
 
+	/*
+	 * Give memory back whilst we exceed our share of the global budget.
+	 */
+
+	while (dbmw_cache_over_budget(dw))
+		(void) evict_entry(dw, TRUE);
+
 	/*
 	 * If we have less keys cached than our maximum, add it.
-	 * Otherwise evict the least recently used key, at the head.
+	 * Otherwise evict an older key.
 	 */
 
-	if (hash_list_length(dw->keys) < dw->max_cached) {
+	if (dbmw_cache_count(dw) < dw->max_cached) {
 		if (filled)
 			entry = filled;
 		else
 			WALLOC0(entry);
 	} else {
-		void *head;
+		g_assert(dbmw_cache_count(dw) == dw->max_cached);
 
-		g_assert(hash_list_length(dw->keys) == dw->max_cached);
-
-		head = hash_list_head(dw->keys);
-		entry = remove_entry(dw, head, filled != NULL, TRUE);
+		entry = evict_entry(dw, filled != NULL);
 
 		g_assert(filled != NULL || entry != NULL);
 
@@ -503,12 +815,23 @@ allocate_entry(dbmw_t *dw, const void *key, struct cached *filled)
 
 	/*
 	 * Add entry into cache.
+	 *
+	 * A key evicted after a single access and which is needed again is hot.
+	 * Other keys start in the "fresh" list, so that a one-off scan of the
+	 * database cannot flush the hot keys out of the cache.
 	 */
 
 	g_assert(entry);
 
-	hash_list_append(dw->keys, saved_key);
+	if (dbmw_ghost_remove(dw, key)) {
+		dw->ghost_hits++;
+		hash_list_append(dw->hot, saved_key);
+	} else {
+		hash_list_append(dw->fresh, saved_key);
+	}
+
 	map_insert(dw->values, saved_key, entry);
+	dbmw_cache_charge(dw, +1);
 
 	return entry;
 }
@@ -681,9 +1004,10 @@ cache_free_removable(void *key, void *value, void *data)
 		return FALSE;
 
 	free_value(dw, entry, TRUE);
-	hash_list_remove(dw->keys, key);
+	dbmw_cache_unlink(dw, key);
 	wfree(key, dbmw_keylen(dw, key));
 	WFREE(entry);
+	dbmw_cache_charge(dw, -1);
 
 	return TRUE;
 }
@@ -717,6 +1041,88 @@ flush_dirty(void *key, void *value, void *data)
 	}
 }
 
+/**
+ * Checkpoint the database.
+ *
+ * All the dirty pages of the underlying map are flushed and synchronized to
+ * disk, at which point the changes recorded in the write-ahead log are no
+ * longer needed and the log can be reset.
+ *
+ * @return amount of pages flushed, -1 on error.
+ */
+static ssize_t
+dbmw_checkpoint(dbmw_t *dw)
+{
+	ssize_t n;
+
+	g_assert(dw->wal != NULL);
+
+	cq_cancel(&dw->checkpoint_ev);
+
+	if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING)) {
+		dbg_ds_log(dw->dbg, dw, "%s: checkpointing (log is %s bytes)",
+			G_STRFUNC, fileoffset_t_to_string(dbwal_size(dw->wal)));
+	}
+
+	n = dbmap_sync_data(dw->dm);
+
+	if (-1 == n) {
+		s_warning("DBMW \"%s\" cannot checkpoint database: %m", dw->name);
+		return -1;
+	}
+
+	return dbwal_reset(dw->wal) ? n : -1;
+}
+
+/**
+ * Callout queue callback to checkpoint the database.
+ */
+static void
+dbmw_checkpoint_event(cqueue_t *cq, void *obj)
+{
+	dbmw_t *dw = obj;
+
+	dbmw_check(dw);
+
+	cq_zero(cq, &dw->checkpoint_ev);
+	dbmw_checkpoint(dw);
+}
+
+/**
+ * Synchronize the underlying map.
+ *
+ * When the database has a write-ahead log, only the log is committed and
+ * the map pages are left to the next checkpoint, which is scheduled when
+ * the log becomes too large.
+ *
+ * @return amount of pages or log records flushed, -1 on error.
+ */
+static ssize_t
+dbmw_sync_map(dbmw_t *dw)
+{
+	ssize_t n;
+
+	if (NULL == dw->wal)
+		return dbmap_sync(dw->dm);
+
+	n = dbwal_commit(dw->wal);
+
+	/*
+	 * If the log cannot be committed, it is unusable: synchronize the map
+	 * pages instead, which resets the log.
+	 */
+
+	if G_UNLIKELY(-1 == n)
+		return dbmw_checkpoint(dw);
+
+	if (NULL == dw->checkpoint_ev && dbwal_size(dw->wal) >= DBMW_WAL_MAXSIZE) {
+		dw->checkpoint_ev =
+			cq_main_insert(DBMW_WAL_DELAY, dbmw_checkpoint_event, dw);
+	}
+
+	return n;
+}
+
 /**
  * Synchronize dirty values.
  *
@@ -727,7 +1133,8 @@ flush_dirty(void *key, void *value, void *data)
  * be flushed to the DB map layer immediately.
  *
  * DBMW_SYNC_MAP requests that the DB map layer be flushed, if it is backed
- * by disk data.
+ * by disk data.  When the database has a write-ahead log, this only commits
+ * the log.
  *
  * If DBMW_DELETED_ONLY is specified along with DBMW_SYNC_CACHE, only the
  * dirty values that are marked as pending deletion are flushed.
@@ -781,7 +1188,7 @@ dbmw_sync(dbmw_t *dw, int which)
 		if (dbg_ds_debugging(dw->dbg, 6, DBG_DSF_CACHING))
 			dbg_ds_log(dw->dbg, dw, "%s: syncing map", G_STRFUNC);
 
-		ret = dbmap_sync(dw->dm);
+		ret = dbmw_sync_map(dw);
 		if (-1 == ret) {
 			error = TRUE;
 		} else {
@@ -810,6 +1217,65 @@ dbmw_shrink(dbmw_t *dw)
 	return dbmap_shrink(dw->dm);
 }
 
+/**
+ * DB map iterator to add keys to the filter.
+ */
+static void
+dbmw_bloom_add_key(void *key, dbmap_datum_t *unused_d, void *arg)
+{
+	dbmw_t *dw = arg;
+
+	(void) unused_d;
+
+	bloom_add(dw->bloom, key, dbmw_keylen(dw, key));
+}
+
+/**
+ * Rebuild the filter from the keys present in the map, sizing it so that
+ * the map can double before the filter becomes full.
+ *
+ * Values pending in the cache do not need to be flushed beforehand, since
+ * their keys are added to the filter when they are written back.
+ */
+static void
+dbmw_bloom_rebuild(dbmw_t *dw)
+{
+	bloom_free_null(&dw->bloom);
+	dw->bloom = bloom_make(2 * dbmap_count(dw->dm));
+
+	dw->ioerr = FALSE;
+	dbmap_foreach(dw->dm, dbmw_bloom_add_key, dw);
+
+	/*
+	 * A filter missing some keys would make us lose their values, so it
+	 * is better to have no filter at all.
+	 */
+
+	if (dbmap_has_ioerr(dw->dm)) {
+		s_warning("DBMW \"%s\" I/O error whilst building key filter: %s",
+			dw->name, dbmap_strerror(dw->dm));
+		bloom_free_null(&dw->bloom);
+	}
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_CACHING)) {
+		dbg_ds_log(dw->dbg, dw, "%s: %s key filter with %zu key%s",
+			G_STRFUNC, NULL == dw->bloom ? "discarded" : "built",
+			PLURAL(dbmap_count(dw->dm)));
+	}
+}
+
+/**
+ * Cancel incremental rebuild of the DB, if any is in progress.
+ */
+static void
+dbmw_rebuild_cancel(dbmw_t *dw)
+{
+	if (dw->rebuild_ev != NULL) {
+		cq_periodic_remove(&dw->rebuild_ev);
+		dbmap_rebuild_cancel(dw->dm);
+	}
+}
+
 /**
  * Attempt to rebuild the DB on disk.
  *
@@ -818,6 +1284,8 @@ dbmw_shrink(dbmw_t *dw)
 bool
 dbmw_rebuild(dbmw_t *dw)
 {
+	dbmw_rebuild_cancel(dw);
+
 	/*
 	 * We're going to work at the SDBM level, so we need to flush the cache
 	 * to make sure SDBM knows the latest database state: cached data pending
@@ -826,7 +1294,91 @@ dbmw_rebuild(dbmw_t *dw)
 
 	dbmw_sync(dw, DBMW_SYNC_CACHE);
 
-	return dbmap_rebuild(dw->dm);
+	if (!dbmap_rebuild(dw->dm))
+		return FALSE;
+
+	/*
+	 * Deleted keys remain in the filter, which can only grow: take this
+	 * opportunity to rebuild it from the keys that are still present.
+	 */
+
+	if (dw->bloom != NULL)
+		dbmw_bloom_rebuild(dw);
+
+	return TRUE;
+}
+
+/**
+ * Periodic callback performing a step of the incremental rebuild.
+ *
+ * @return whether to keep calling us.
+ */
+static bool
+dbmw_rebuild_step(void *obj)
+{
+	dbmw_t *dw = obj;
+	int r;
+
+	dbmw_check(dw);
+
+	r = dbmap_rebuild_step(dw->dm, DBMW_REBUILD_PAGES);
+
+	if (0 == r)
+		return TRUE;			/* More pages to copy */
+
+	dw->rebuild_ev = NULL;		/* Periodic event will be removed */
+
+	if (-1 == r) {
+		s_warning("DBMW \"%s\" incremental rebuild failed: %s",
+			dw->name, dbmap_strerror(dw->dm));
+		return FALSE;
+	}
+
+	if (dw->bloom != NULL)
+		dbmw_bloom_rebuild(dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_STATS)) {
+		dbg_ds_log(dw->dbg, dw, "%s: incremental rebuild completed",
+			G_STRFUNC);
+	}
+
+	return FALSE;
+}
+
+/**
+ * Attempt to rebuild the DB on disk without blocking.
+ *
+ * The underlying map is copied into a new one a few pages at a time from
+ * a periodic callback, whilst reads and writes continue against the live
+ * map, all the updates being replicated to the new map.  Once the copy is
+ * completed, the new map replaces the old one.
+ *
+ * When the map does not support incremental rebuilds, this is the same
+ * as dbmw_rebuild().
+ *
+ * @return TRUE if the rebuild was started (or is already in progress), or
+ * if the synchronous rebuild was successful.
+ */
+bool
+dbmw_rebuild_async(dbmw_t *dw)
+{
+	dbmw_check(dw);
+
+	if (dw->rebuild_ev != NULL)
+		return TRUE;			/* Already rebuilding */
+
+	if (!dbmap_rebuild_start(dw->dm))
+		return dbmw_rebuild(dw);
+
+	dw->rebuild_ev =
+		cq_periodic_main_add(DBMW_REBUILD_PERIOD, dbmw_rebuild_step, dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_STATS)) {
+		dbg_ds_log(dw->dbg, dw, "%s: started incremental rebuild of %zu key%s",
+			G_STRFUNC, PLURAL(dbmap_count(dw->dm)));
+	}
+
+	return TRUE;
 }
 
 /**
@@ -952,7 +1504,7 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 		if (entry->absent)
 			dw->cached++;			/* Key exists now, in unflushed status */
 		fill_entry(dw, entry, value, length);
-		hash_list_moveto_tail(dw->keys, key);
+		dbmw_cache_hit(dw, key);
 
 	} else if (dw->max_cached > 1) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_UPDATE)) {
@@ -1011,15 +1563,25 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 		}
 
 		dw->r_hits++;
+		dbmw_cache_hit(dw, key);
 		if (lenptr)
 			*lenptr = entry->len;
 		return entry->data;
 	}
 
 	/*
-	 * Not cached, must read from DB.
+	 * Not cached, must read from DB, unless the filter tells us the key
+	 * is not there.
 	 */
 
+	if (
+		dw->bloom != NULL &&
+		!bloom_maybe(dw->bloom, key, dbmw_keylen(dw, key))
+	) {
+		dw->b_skips++;
+		return NULL;
+	}
+
 	dw->ioerr = FALSE;
 	dval = dbmap_lookup(dw->dm, key);
 
@@ -1122,9 +1684,18 @@ dbmw_exists(dbmw_t *dw, const void *key)
 		}
 
 		dw->r_hits++;
+		dbmw_cache_hit(dw, key);
 		return !entry->absent;
 	}
 
+	if (
+		dw->bloom != NULL &&
+		!bloom_maybe(dw->bloom, key, dbmw_keylen(dw, key))
+	) {
+		dw->b_skips++;
+		return FALSE;
+	}
+
 	dw->ioerr = FALSE;
 	ret = dbmap_contains(dw->dm, key);
 
@@ -1209,7 +1780,7 @@ dbmw_delete(dbmw_t *dw, const void *key)
 			fill_entry(dw, entry, NULL, 0);
 			entry->absent = TRUE;
 		}
-		hash_list_moveto_tail(dw->keys, key);
+		dbmw_cache_hit(dw, key);
 
 	} else {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_DELETE)) {
@@ -1225,6 +1796,8 @@ dbmw_delete(dbmw_t *dw, const void *key)
 			dw->error = errno;
 			s_warning("DBMW \"%s\" I/O error whilst deleting key: %s",
 				dw->name, dbmap_strerror(dw->dm));
+		} else if (dw->wal != NULL) {
+			dbwal_delete(dw->wal, key, dbmw_keylen(dw, key));
 		}
 
 		/*
@@ -1276,14 +1849,18 @@ dbmw_clear_cache(dbmw_t *dw)
 {
 	dbmw_check(dw);
 
+	dbmw_cache_charge(dw, -(ssize_t) dbmw_cache_count(dw));
+
 	/*
-	 * In the cache, the hash list and the value cache share the same
+	 * In the cache, the hash lists and the value cache share the same
 	 * key pointers.  Therefore, we need to iterate on the map only
 	 * to free both at the same time.
 	 */
 
-	hash_list_clear(dw->keys);
+	hash_list_clear(dw->hot);
+	hash_list_clear(dw->fresh);
 	map_foreach_remove(dw->values, free_cached, dw);
+	dbmw_ghost_clear(dw);
 }
 
 /**
@@ -1297,6 +1874,12 @@ dbmw_clear(dbmw_t *dw)
 	if (!dbmap_clear(dw->dm))
 		return FALSE;
 
+	if (dw->wal != NULL)
+		dbwal_reset(dw->wal);
+
+	if (dw->bloom != NULL)
+		bloom_clear(dw->bloom);
+
 	dbmw_clear_cache(dw);
 	dw->ioerr = FALSE;
 	dw->count_needs_sync = FALSE;
@@ -1313,22 +1896,35 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 {
 	dbmw_check(dw);
 
+	dbmw_rebuild_cancel(dw);
+
 	if (common_stats) {
 		s_debug("DBMW destroying \"%s\" with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
 			"write cache hits = %.2f%% on %s request%s)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->r_hits * 100.0 / MAX(1, dw->r_access),
 			uint64_to_string(dw->r_access), plural(dw->r_access),
 			dw->w_hits * 100.0 / MAX(1, dw->w_access),
 			uint64_to_string2(dw->w_access), plural(dw->w_access));
 	}
 
+	if (common_stats) {
+		s_debug("DBMW \"%s\" cache evicted %s entr%s, re-admitted %s",
+			dw->name, uint64_to_string(dw->evictions), plural_y(dw->evictions),
+			uint64_to_string2(dw->ghost_hits));
+	}
+
+	if (common_stats && dw->bloom != NULL) {
+		s_debug("DBMW \"%s\" key filter avoided %s map lookup%s",
+			dw->name, uint64_to_string(dw->b_skips), plural(dw->b_skips));
+	}
+
 	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_DESTROY)) {
 		dbg_ds_log(dw->dbg, dw, "%s: with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
 			"write cache hits = %.2f%% on %s request%s)",
-			G_STRFUNC, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			G_STRFUNC, dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->r_hits * 100.0 / MAX(1, dw->r_access),
 			uint64_to_string(dw->r_access), plural(dw->r_access),
 			dw->w_hits * 100.0 / MAX(1, dw->w_access),
@@ -1344,10 +1940,33 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 		dbmw_sync(dw, DBMW_SYNC_CACHE);
 	}
 
+	/*
+	 * When closing a persistent map, checkpoint it so that the log is empty
+	 * and can be removed.  A volatile map is gone, and so is its log.
+	 */
+
+	if (dw->wal != NULL) {
+		cq_cancel(&dw->checkpoint_ev);
+		if (close_map) {
+			if (dw->is_volatile)
+				dbwal_reset(dw->wal);
+			else
+				dbmw_checkpoint(dw);
+		}
+		dbwal_close(&dw->wal);
+	}
+
+	bloom_free_null(&dw->bloom);
 	dbmw_clear_cache(dw);
-	hash_list_free(&dw->keys);
+	hash_list_free(&dw->hot);
+	hash_list_free(&dw->fresh);
+	hash_list_free(&dw->ghosts);
 	map_destroy(dw->values);
 
+	DBMW_LIST_LOCK;
+	elist_remove(&dbmw_list, dw);
+	DBMW_LIST_UNLOCK;
+
 	if (dw->mb)
 		pmsg_free(dw->mb);
 	bstr_free(&dw->bs);
@@ -1473,7 +2092,21 @@ dbmw_foreach_trampoline(void *key, dbmap_datum_t *d, void *arg)
 static bool
 dbmw_foreach_remove_trampoline(void *key, dbmap_datum_t *d, void *arg)
 {
-	return dbmw_foreach_common(TRUE, key, d, arg);
+	struct foreach_ctx *ctx = arg;
+	dbmw_t *dw = ctx->dw;
+	bool status;
+
+	status = dbmw_foreach_common(TRUE, key, d, arg);
+
+	/*
+	 * The key is going to be removed from the map by the lower layer,
+	 * so we need to log the deletion.
+	 */
+
+	if (status && dw->wal != NULL)
+		dbwal_delete(dw->wal, key, dbmw_keylen(dw, key));
+
+	return status;
 }
 
 /**
@@ -1686,9 +2319,18 @@ dbmw_copy(dbmw_t *from, dbmw_t *to)
 	/*
 	 * Since ``from'' was sync'ed and the cache from ``to'' was cleared,
 	 * we can ignore caches and handle the copy at the dbmap level.
+	 *
+	 * The copied data are not logged, so we need to checkpoint the
+	 * destination if it has a write-ahead log.
 	 */
 
-	return dbmap_copy(from->dm, to->dm);
+	if (!dbmap_copy(from->dm, to->dm))
+		return FALSE;
+
+	if (to->wal != NULL && -1 == dbmw_checkpoint(to))
+		return FALSE;
+
+	return TRUE;
 }
 
 /**
@@ -1703,6 +2345,90 @@ dbmw_set_map_cache(dbmw_t *dw, long pages)
 	return 0 == dbmap_set_cachesize(dw->dm, pages);
 }
 
+/**
+ * Turn memory-mapped access to the underlying map on or off.
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_mmap(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_mmap(dw->dm, on);
+}
+
+/**
+ * Attach a write-ahead log to the database, which becomes the owner of it.
+ *
+ * From then on, changes made to the underlying map are logged and
+ * synchronizing the map only commits the log.  The map pages are flushed
+ * to disk at checkpoints, when the log grows too large or when the map
+ * is closed.
+ *
+ * The log must have been replayed into the map beforehand.
+ */
+void
+dbmw_set_wal(dbmw_t *dw, dbwal_t *wal)
+{
+	dbmw_check(dw);
+	g_assert(NULL == dw->wal);
+	g_assert(wal != NULL);
+	g_assert(DBMAP_MAP != dbmw_map_type(dw));
+
+	dw->wal = wal;
+}
+
+/**
+ * Attach a filter of the keys present in the map, which becomes the owner
+ * of it.
+ *
+ * The filter lets us avoid map lookups for most of the keys that are absent.
+ * When no filter is given, or when the given one is full, it is rebuilt from
+ * the keys present in the map.
+ *
+ * @attention
+ * A supplied filter must hold all the keys present in the map.
+ */
+void
+dbmw_set_bloom(dbmw_t *dw, bloom_t *b)
+{
+	dbmw_check(dw);
+	g_assert(NULL == dw->bloom);
+
+	if (NULL == b || bloom_is_full(b)) {
+		bloom_free_null(&b);
+		dbmw_bloom_rebuild(dw);
+	} else {
+		dw->bloom = b;
+	}
+}
+
+/**
+ * @return the key filter attached to the map, NULL if none.
+ */
+const bloom_t *
+dbmw_bloom(const dbmw_t *dw)
+{
+	dbmw_check(dw);
+
+	return dw->bloom;
+}
+
+/**
+ * Install callback computing the expiration time of serialized values, so
+ * that values expired for longer than the grace period can be discarded by
+ * the underlying map during its compactions.
+ *
+ * This is only supported by LSM-backed maps, and ignored otherwise.
+ */
+void
+dbmw_set_expiry(dbmw_t *dw, lsm_expiry_t cb, time_delta_t grace)
+{
+	dbmw_check(dw);
+
+	dbmap_set_expiry(dw->dm, cb, grace);
+}
+
 /**
  * Flag whether database is volatile (never outlives a close).
  *
@@ -1731,7 +2457,7 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 		dbg_ds_log(dw->dbg, dw, "%s: attached with %s back-end "
 			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)", G_STRFUNC,
-			dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
 	}
 
@@ -1748,4 +2474,90 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 	dbmap_set_debugging(dw->dm, dw->dbmap_dbg);
 }
 
+/**
+ * Get the global cache budget usage.
+ *
+ * @param used		where the amount of bytes used by all the caches is written
+ * @param budget	where the global budget size is written
+ */
+void
+dbmw_cache_budget(size_t *used, size_t *budget)
+{
+	DBMW_LIST_LOCK;
+	*used = dbmw_cache_used;
+	*budget = dbmw_cache_limit;
+	DBMW_LIST_UNLOCK;
+}
+
+/**
+ * Retrieve DBM wrapper information.
+ *
+ * Counters are read without synchronizing with the thread using the DBM
+ * wrapper, hence they may be slightly inconsistent with each other.
+ *
+ * @return list of dbmw_info_t that must be freed by calling the
+ * dbmw_info_list_free_null() routine.
+ */
+pslist_t *
+dbmw_info_list(void)
+{
+	pslist_t *sl = NULL;
+	dbmw_t *dw;
+
+	DBMW_LIST_LOCK;
+
+	ELIST_FOREACH_DATA(&dbmw_list, dw) {
+		dbmw_info_t *dwi;
+
+		dbmw_check(dw);
+
+		WALLOC0(dwi);
+		dwi->magic = DBMW_INFO_MAGIC;
+		dwi->name = atom_str_get(dw->name);
+		dwi->type = dbmap_type_to_string(dbmw_map_type(dw));
+		dwi->hot = hash_list_count(dw->hot);
+		dwi->fresh = hash_list_count(dw->fresh);
+		dwi->ghosts = hash_list_count(dw->ghosts);
+		dwi->max_cached = dw->max_cached;
+		dwi->entry_cost = dw->entry_cost;
+		dwi->r_access = dw->r_access;
+		dwi->r_hits = dw->r_hits;
+		dwi->w_access = dw->w_access;
+		dwi->w_hits = dw->w_hits;
+		dwi->evictions = dw->evictions;
+		dwi->ghost_hits = dw->ghost_hits;
+		dwi->b_skips = dw->b_skips;
+
+		sl = pslist_prepend(sl, dwi);
+	}
+
+	DBMW_LIST_UNLOCK;
+
+	return pslist_reverse(sl);
+}
+
+static void
+dbmw_info_free(void *data, void *udata)
+{
+	dbmw_info_t *dwi = data;
+
+	dbmw_info_check(dwi);
+	(void) udata;
+
+	atom_str_free_null(&dwi->name);
+	WFREE(dwi);
+}
+
+/**
+ * Free list created by dbmw_info_list() and nullify pointer.
+ */
+void
+dbmw_info_list_free_null(pslist_t **sl_ptr)
+{
+	pslist_t *sl = *sl_ptr;
+
+	pslist_foreach(sl, dbmw_info_free, NULL);
+	pslist_free_null(sl_ptr);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -42,6 +42,36 @@
 struct dbmw;
 typedef struct dbmw dbmw_t;
 
+enum dbmw_info_magic { DBMW_INFO_MAGIC = 0x3d5c0b47 };
+
+/**
+ * DBM wrapper information that can be retrieved.
+ */
+typedef struct {
+	enum dbmw_info_magic magic;
+	const char *name;		/**< DB name (atom) */
+	const char *type;		/**< Back-end type (static string) */
+	size_t hot;				/**< Cached keys accessed more than once */
+	size_t fresh;			/**< Cached keys accessed once */
+	size_t ghosts;			/**< Remembered keys recently evicted */
+	size_t max_cached;		/**< Maximum amount of cached keys */
+	size_t entry_cost;		/**< Budget charged per cached key */
+	uint64 r_access;		/**< Number of read accesses */
+	uint64 r_hits;			/**< Number of read cache hits */
+	uint64 w_access;		/**< Number of write accesses */
+	uint64 w_hits;			/**< Number of write cache hits */
+	uint64 evictions;		/**< Number of cache evictions */
+	uint64 ghost_hits;		/**< Number of re-admitted evicted keys */
+	uint64 b_skips;			/**< Map lookups avoided by the key filter */
+} dbmw_info_t;
+
+static inline void
+dbmw_info_check(const dbmw_info_t * const dwi)
+{
+	g_assert(dwi != NULL);
+	g_assert(DBMW_INFO_MAGIC == dwi->magic);
+}
+
 /**
  * Serialization routine for values.
  *
@@ -92,6 +122,8 @@ typedef bool (*dbmw_cbr_t)(void *key, void *value, size_t len, void *u);
 #define DBMW_DELETED_ONLY	(1 << 2)	/**< Only sync deleted keys */
 
 struct dbg_config;
+struct dbwal;
+struct bloom;
 
 dbmw_t *dbmw_create(dbmap_t *dm, const char *name,
 	size_t value_size, size_t value_data_size,
@@ -110,10 +142,16 @@ size_t dbmw_count(dbmw_t *dw);
 bool dbmw_has_ioerr(const dbmw_t *dw);
 const char *dbmw_name(const dbmw_t *dw);
 bool dbmw_set_map_cache(dbmw_t *dw, long pages);
+bool dbmw_set_mmap(dbmw_t *dw, bool on);
+void dbmw_set_wal(dbmw_t *dw, struct dbwal *wal);
+void dbmw_set_bloom(dbmw_t *dw, struct bloom *b);
+const struct bloom *dbmw_bloom(const dbmw_t *dw);
+void dbmw_set_expiry(dbmw_t *dw, lsm_expiry_t cb, time_delta_t grace);
 bool dbmw_set_volatile(dbmw_t *dw, bool is_volatile);
 void dbmw_set_debugging(dbmw_t *dw, const struct dbg_config *dbg);
 bool dbmw_shrink(dbmw_t *dw);
 bool dbmw_rebuild(dbmw_t *dw);
+bool dbmw_rebuild_async(dbmw_t *dw);
 bool dbmw_clear(dbmw_t *dw);
 const char *dbmw_strerror(const dbmw_t *dw);
 
@@ -126,6 +164,10 @@ size_t dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg);
 bool dbmw_store(dbmw_t *dw, const char *base, bool inplace);
 bool dbmw_copy(dbmw_t *from, dbmw_t *to);
 
+void dbmw_cache_budget(size_t *used, size_t *budget);
+struct pslist *dbmw_info_list(void);
+void dbmw_info_list_free_null(struct pslist **sl_ptr);
+
 #endif /* _dbmw_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -42,12 +42,15 @@
 #include "if/gnet_property_priv.h"
 
 #include "atoms.h"
+#include "bloom.h"
 #include "dbmap.h"
 #include "dbmw.h"
+#include "dbwal.h"
 #include "file.h"
 #include "halloc.h"
 #include "hstrfn.h"
 #include "log.h"
+#include "lsm.h"
 #include "path.h"
 #include "stringify.h"
 
@@ -66,11 +69,147 @@ dbstore_set_debug(unsigned level)
 }
 
 /**
- * Creates a disk database with an SDBM or memory map back-end.
+ * Apply logged change to the map.
+ */
+static void
+dbstore_wal_apply(const void *key, size_t klen,
+	const void *data, size_t dlen, void *arg)
+{
+	dbmap_t *dm = arg;
+
+	g_assert(klen <= dbmap_key_size(dm));
+
+	if (NULL == data) {
+		dbmap_remove(dm, key);
+	} else {
+		dbmap_datum_t d;
+
+		d.data = deconstify_pointer(data);
+		d.len = dlen;
+		dbmap_insert(dm, key, d);
+	}
+}
+
+/**
+ * Recover changes from a write-ahead log left over by a previous session
+ * that did not close the database properly.
  *
- * If we can't create the SDBM files on disk, we'll transparently use
+ * The log is replayed into the map, which is then checkpointed so that the
+ * log can be removed.  When the map was truncated, the log is discarded.
+ *
+ * @param dm		the SDBM map
+ * @param name		the name of the storage, for logs
+ * @param path		the base path of SDBM files
+ * @param flags		the sdbm_open() flags used for the map
+ */
+static void
+dbstore_wal_recover(dbmap_t *dm, const char *name, const char *path, int flags)
+{
+	char *file = h_strconcat(path, DBWAL_FEXT, NULL_PTR);
+	dbwal_t *wal;
+
+	if (!file_exists(file))
+		goto done;
+
+	wal = dbwal_open(name, file);
+
+	if (NULL == wal) {
+		s_warning("DBSTORE cannot open log %s for %s: %m", file, name);
+		goto done;
+	}
+
+	if (flags & O_TRUNC) {
+		dbwal_reset(wal);
+	} else {
+		size_t n = dbwal_replay(wal, dbstore_wal_apply, dm);
+
+		if (n != 0) {
+			s_message("DBSTORE replayed %zu logged change%s for %s",
+				n, plural(n), name);
+		}
+
+		if (-1 == dbmap_sync_data(dm)) {
+			s_warning("DBSTORE cannot checkpoint %s, keeping %s: %m",
+				name, file);
+		} else {
+			dbwal_reset(wal);
+		}
+	}
+
+	dbwal_close(&wal);		/* Removes the file if empty */
+
+done:
+	HFREE_NULL(file);
+}
+
+static void dbstore_unlink_file(const char *path, const char *ext);
+
+/**
+ * Open an LSM map, migrating the data from an existing SDBM database at the
+ * same path when the LSM map does not exist yet.
+ *
+ * @param name		the name of the storage, for logs
+ * @param path		the base path of the files
+ * @param flags		the opening flags
+ * @param kv		key/value description
+ *
+ * @return the opened map, NULL on error.
+ */
+static dbmap_t *
+dbstore_open_lsm_map(const char *name, const char *path, int flags,
+	dbstore_kv_t kv)
+{
+	char *file;
+	dbmap_t *dm, *old;
+	bool migrate;
+
+	file = h_strconcat(path, DBM_PAGFEXT, NULL_PTR);
+	migrate = !(flags & O_TRUNC) &&
+		!lsm_exists_on_disk(path) && file_exists(file);
+	HFREE_NULL(file);
+
+	dm = dbmap_create_lsm(kv.key_size, kv.key_len,
+			name, path, flags, STORAGE_FILE_MODE);
+
+	if (NULL == dm || !migrate)
+		goto done;
+
+	old = dbmap_create_sdbm(kv.key_size, kv.key_len,
+			name, path, O_RDWR, STORAGE_FILE_MODE);
+
+	if (NULL == old) {
+		s_warning("DBSTORE cannot open SDBM at %s to migrate %s: %m",
+			path, name);
+		goto done;
+	}
+
+	if (!dbmap_copy(old, dm) || -1 == dbmap_sync(dm)) {
+		s_warning("DBSTORE cannot migrate %s from SDBM at %s, keeping it",
+			name, path);
+		dbmap_destroy(old);
+		dbmap_clear(dm);
+		goto done;
+	}
+
+	s_message("DBSTORE migrated %zu key%s of %s from SDBM to LSM",
+		PLURAL(dbmap_count(dm)), name);
+
+	dbmap_destroy(old);
+	dbstore_unlink_file(path, DBM_DIRFEXT);
+	dbstore_unlink_file(path, DBM_PAGFEXT);
+	dbstore_unlink_file(path, DBM_DATFEXT);
+
+done:
+	return dm;
+}
+
+/**
+ * Creates a disk database with an SDBM, LSM or memory map back-end.
+ *
+ * If we can't create the files on disk, we'll transparently use
  * an in-core version.
  *
+ * @param type				the on-disk back-end type
  * @param name				the name of the storage created, for logs
  * @param dir				the directory where SDBM files will be put
  * @param base				the base name of SDBM files
@@ -85,7 +224,8 @@ dbstore_set_debug(unsigned level)
  * @return the DBMW wrapping object.
  */
 static dbmw_t *
-dbstore_create_internal(const char *name, const char *dir, const char *base,
+dbstore_create_internal(enum dbmap_type type,
+	const char *name, const char *dir, const char *base,
 	int flags, dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
 	bool incore)
@@ -100,8 +240,14 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 		g_assert(base != NULL);
 
 		path = make_pathname(dir, base);
-		dm = dbmap_create_sdbm(kv.key_size, kv.key_len,
-				name, path, flags, STORAGE_FILE_MODE);
+
+		if (DBMAP_LSM == type) {
+			dm = dbstore_open_lsm_map(name, path, flags, kv);
+		} else {
+			g_assert(DBMAP_SDBM == type);
+			dm = dbmap_create_sdbm(kv.key_size, kv.key_len,
+					name, path, flags, STORAGE_FILE_MODE);
+		}
 
 		/*
 		 * For performance reasons, always use deferred writes.  Maps which
@@ -111,8 +257,10 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 
 		if (dm != NULL) {
 			dbmap_set_deferred_writes(dm, TRUE);
+			dbstore_wal_recover(dm, name, path, flags);
 		} else {
-			s_warning("DBSTORE cannot open SDBM at %s for %s: %m", path, name);
+			s_warning("DBSTORE cannot open %s at %s for %s: %m",
+				dbmap_type_to_string(type), path, name);
 		}
 		HFREE_NULL(path);
 	} else {
@@ -136,6 +284,27 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 	return dw;
 }
 
+/**
+ * Creates a volatile disk database with the specified back-end.
+ */
+static dbmw_t *
+dbstore_create_type(enum dbmap_type type,
+	const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore)
+{
+	dbmw_t *dw;
+
+	dw = dbstore_create_internal(type, name, dir, base,
+			O_CREAT | O_TRUNC | O_RDWR,
+			kv, packing, cache_size, hash_func, eq_func, incore);
+
+	dbmw_set_volatile(dw, TRUE);
+
+	return dw;
+}
+
 /**
  * Creates a disk database with an SDBM back-end.
  *
@@ -145,7 +314,6 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
  * @param name				the name of the storage created, for logs
  * @param dir				the directory where SDBM files will be put
  * @param base				the base name of SDBM files
- * @param flags				the sdbm_open() flags
  * @param kv				key/value description
  * @param packing			key/value serialization description
  * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
@@ -161,44 +329,42 @@ dbstore_create(const char *name, const char *dir, const char *base,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
 	bool incore)
 {
-	dbmw_t *dw;
-
-	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_TRUNC | O_RDWR,
-			kv, packing, cache_size, hash_func, eq_func, incore);
-
-	dbmw_set_volatile(dw, TRUE);
-
-	return dw;
+	return dbstore_create_type(DBMAP_SDBM, name, dir, base,
+		kv, packing, cache_size, hash_func, eq_func, incore);
 }
 
 /**
- * Opens or create a disk database with an SDBM back-end.
+ * Creates a disk database with an LSM tree back-end.
  *
- * If we can't access the SDBM files on disk, we'll transparently use
- * an in-core version.
- *
- * @param name				the name of the storage created, for logs
- * @param dir				the directory where SDBM files will be put
- * @param base				the base name of SDBM files
- * @param flags				the sdbm_open() flags
- * @param kv				key/value description
- * @param packing			key/value serialization description
- * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
- * @param hash_func			Key hash function
- * @param eq_func			Key equality test function
- * @param incore			If TRUE, allow fallback to a RAM-only database
+ * This suits databases where keys are constantly created and deleted, since
+ * all the writes become sequential.  The arguments are the same as for
+ * dbstore_create().
  *
  * @return the DBMW wrapping object.
  */
 dbmw_t *
-dbstore_open(const char *name, const char *dir, const char *base,
+dbstore_create_lsm(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore)
+{
+	return dbstore_create_type(DBMAP_LSM, name, dir, base,
+		kv, packing, cache_size, hash_func, eq_func, incore);
+}
+
+/**
+ * Opens or create a disk database with the specified back-end.
+ */
+static dbmw_t *
+dbstore_open_type(enum dbmap_type type,
+	const char *name, const char *dir, const char *base,
 	dbstore_kv_t kv, dbstore_packing_t packing,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
 	bool incore)
 {
 	dbmw_t *dw;
 
-	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_RDWR,
+	dw = dbstore_create_internal(type, name, dir, base, O_CREAT | O_RDWR,
 			kv, packing, cache_size, hash_func, eq_func, FALSE);
 
 	if (dw != NULL && dbstore_debug > 0) {
@@ -221,7 +387,7 @@ dbstore_open(const char *name, const char *dir, const char *base,
 				dbmw_name(dw), (unsigned) count, plural(count), base);
 		}
 
-		dram = dbstore_create_internal(name, NULL, NULL, 0,
+		dram = dbstore_create_internal(type, name, NULL, NULL, 0,
 				kv, packing, cache_size, hash_func, eq_func, TRUE);
 
 		if (!dbmw_copy(dw, dram)) {
@@ -236,6 +402,169 @@ dbstore_open(const char *name, const char *dir, const char *base,
 	return dw;
 }
 
+/**
+ * Opens or create a disk database with an SDBM back-end.
+ *
+ * If we can't access the SDBM files on disk, we'll transparently use
+ * an in-core version.
+ *
+ * @param name				the name of the storage created, for logs
+ * @param dir				the directory where SDBM files will be put
+ * @param base				the base name of SDBM files
+ * @param kv				key/value description
+ * @param packing			key/value serialization description
+ * @param cache_size		Amount of items to cache (0 = no cache, 1 = default)
+ * @param hash_func			Key hash function
+ * @param eq_func			Key equality test function
+ * @param incore			If TRUE, allow fallback to a RAM-only database
+ *
+ * @return the DBMW wrapping object.
+ */
+dbmw_t *
+dbstore_open(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore)
+{
+	return dbstore_open_type(DBMAP_SDBM, name, dir, base,
+		kv, packing, cache_size, hash_func, eq_func, incore);
+}
+
+/**
+ * Opens or create a disk database with an LSM tree back-end.
+ *
+ * An existing SDBM database with the same base name is migrated into the
+ * LSM tree and removed.  The arguments are the same as for dbstore_open().
+ *
+ * @return the DBMW wrapping object.
+ */
+dbmw_t *
+dbstore_open_lsm(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore)
+{
+	return dbstore_open_type(DBMAP_LSM, name, dir, base,
+		kv, packing, cache_size, hash_func, eq_func, incore);
+}
+
+/**
+ * Attach a write-ahead log to a persistent DBMW database.
+ *
+ * Synchronizing the database then becomes a sequential write to the log,
+ * the SDBM pages being written back to disk at checkpoints only.  This turns
+ * the random write I/Os of large databases into sequential ones.
+ *
+ * RAM-only databases are left untouched.
+ *
+ * @param dw				the DBMW database, opened with dbstore_open()
+ * @param dir				the directory where SDBM files are
+ * @param base				the base name of SDBM files
+ *
+ * @return TRUE if the log was attached.
+ */
+bool
+dbstore_set_wal(dbmw_t *dw, const char *dir, const char *base)
+{
+	char *path, *file;
+	dbwal_t *wal;
+
+	if (NULL == dw || DBMAP_MAP == dbmw_map_type(dw))
+		return FALSE;
+
+	path = make_pathname(dir, base);
+	file = h_strconcat(path, DBWAL_FEXT, NULL_PTR);
+	HFREE_NULL(path);
+
+	wal = dbwal_open(dbmw_name(dw), file);
+
+	if (NULL == wal) {
+		s_warning("DBSTORE cannot open log %s for DBMW \"%s\": %m",
+			file, dbmw_name(dw));
+		goto done;
+	}
+
+	/*
+	 * A leftover log was replayed when the database was opened, and the
+	 * log is only kept when it could not be checkpointed: leave it alone
+	 * so that it can be replayed next time.
+	 */
+
+	if (0 != dbwal_size(wal)) {
+		s_warning("DBSTORE not logging DBMW \"%s\": stale log %s",
+			dbmw_name(dw), file);
+		dbwal_close(&wal);
+		goto done;
+	}
+
+	dbmw_set_wal(dw, wal);
+
+	if (dbstore_debug > 0)
+		g_debug("DBSTORE logging DBMW \"%s\" to %s", dbmw_name(dw), file);
+
+done:
+	HFREE_NULL(file);
+	return wal != NULL;
+}
+
+/**
+ * Attach a filter of the present keys to a persistent DBMW database, so that
+ * most lookups of absent keys can be answered without reading the database.
+ *
+ * The filter persisted by dbstore_close() is reloaded when it still matches
+ * the database, otherwise it is rebuilt from the keys in the database.  The
+ * persisted file is removed once loaded, so that a filter that could become
+ * stale after a crash is never reused.
+ *
+ * RAM-only databases are left untouched.
+ *
+ * @param dw				the DBMW database, opened with dbstore_open()
+ * @param dir				the directory where SDBM files are
+ * @param base				the base name of SDBM files
+ *
+ * @return TRUE if the filter was attached.
+ */
+bool
+dbstore_set_bloom(dbmw_t *dw, const char *dir, const char *base)
+{
+	char *path, *file;
+	bloom_t *b;
+	uint64 tag = 0;
+
+	if (NULL == dw || DBMAP_MAP == dbmw_map_type(dw))
+		return FALSE;
+
+	path = make_pathname(dir, base);
+	file = h_strconcat(path, BLOOM_FEXT, NULL_PTR);
+	HFREE_NULL(path);
+
+	b = bloom_load(file, &tag);
+
+	if (b != NULL) {
+		if (-1 == unlink(file))
+			s_warning("DBSTORE cannot unlink %s: %m", file);
+
+		if (tag != dbmw_count(dw)) {
+			if (dbstore_debug > 0) {
+				g_debug("DBSTORE stale key filter for DBMW \"%s\"",
+					dbmw_name(dw));
+			}
+			bloom_free_null(&b);
+		}
+	}
+
+	dbmw_set_bloom(dw, b);		/* Rebuilt if NULL */
+
+	if (dbstore_debug > 0) {
+		g_debug("DBSTORE %s key filter for DBMW \"%s\"",
+			NULL == dbmw_bloom(dw) ? "no" :
+			NULL == b ? "rebuilt" : "loaded", dbmw_name(dw));
+	}
+
+	HFREE_NULL(file);
+	return dbmw_bloom(dw) != NULL;
+}
+
 /**
  * Synchronize a DBMW database, flushing its SDBM cache.
  */
@@ -302,6 +631,21 @@ dbstore_close(dbmw_t *dw, const char *dir, const char *base)
 		g_debug("DBSTORE persisting DBMW \"%s\" as %s", dbmw_name(dw), path);
 
 	ok = dbmw_store(dw, path, TRUE);
+
+	/*
+	 * Persist the key filter, tagged with the amount of keys so that we can
+	 * detect that the database was changed without it.
+	 */
+
+	if (ok && dbmw_bloom(dw) != NULL) {
+		char *file = h_strconcat(path, BLOOM_FEXT, NULL_PTR);
+
+		if (!bloom_save(dbmw_bloom(dw), file, dbmw_count(dw)))
+			s_warning("DBSTORE cannot save key filter to %s", file);
+
+		HFREE_NULL(file);
+	}
+
 	HFREE_NULL(path);
 
 	if (dbstore_debug > 0) {
@@ -330,6 +674,9 @@ dbstore_delete(dbmw_t *dw)
  * The aim is to reduce the disk size of the database since it can grow very
  * large after many insertions and deletions, with most pages being empty or
  * holding only a few keys.
+ *
+ * Rebuilding is done incrementally in the background when the underlying
+ * map supports it, the database remaining fully usable meanwhile.
  */
 void
 dbstore_compact(dbmw_t *dw)
@@ -357,13 +704,14 @@ dbstore_compact(dbmw_t *dw)
 		if (dbstore_debug > 1) {
 			g_debug("DBSTORE rebuilding database DBMW \"%s\"", dbmw_name(dw));
 		}
-		if (!dbmw_rebuild(dw)) {
+		if (!dbmw_rebuild_async(dw)) {
 			if (dbstore_debug) {
 				g_warning("DBSTORE unable to rebuild DBMW \"%s\"",
 					dbmw_name(dw));
 			}
 		} else if (dbstore_debug) {
-			g_debug("DBSTORE database DBMW \"%s\" rebuilt", dbmw_name(dw));
+			g_debug("DBSTORE database DBMW \"%s\" being rebuilt",
+				dbmw_name(dw));
 		}
 	}
 }
@@ -404,6 +752,9 @@ dbstore_move(const char *src, const char *dst, const char *base)
 	dbstore_move_file(old_path, new_path, DBM_DIRFEXT);
 	dbstore_move_file(old_path, new_path, DBM_PAGFEXT);
 	dbstore_move_file(old_path, new_path, DBM_DATFEXT);
+	dbstore_move_file(old_path, new_path, DBWAL_FEXT);
+	dbstore_move_file(old_path, new_path, BLOOM_FEXT);
+	lsm_move(old_path, new_path);
 
 	HFREE_NULL(old_path);
 	HFREE_NULL(new_path);
@@ -439,6 +790,9 @@ dbstore_unlink(const char *dir, const char *base)
 	dbstore_unlink_file(path, DBM_DIRFEXT);
 	dbstore_unlink_file(path, DBM_PAGFEXT);
 	dbstore_unlink_file(path, DBM_DATFEXT);
+	dbstore_unlink_file(path, DBWAL_FEXT);
+	dbstore_unlink_file(path, BLOOM_FEXT);
+	lsm_unlink(path);
 
 	HFREE_NULL(path);
 }
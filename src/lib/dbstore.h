@@ -79,6 +79,18 @@ dbmw_t *dbstore_open(const char *name, const char *dir, const char *base,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
 	bool incore);
 
+dbmw_t *dbstore_create_lsm(const char *name, const char *dir,
+	const char *base, dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore);
+
+dbmw_t *dbstore_open_lsm(const char *name, const char *dir, const char *base,
+	dbstore_kv_t kv, dbstore_packing_t packing,
+	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func,
+	bool incore);
+
+bool dbstore_set_wal(dbmw_t *dw, const char *dir, const char *base);
+bool dbstore_set_bloom(dbmw_t *dw, const char *dir, const char *base);
 void dbstore_sync(dbmw_t *dw);
 void dbstore_flush(dbmw_t *dw);
 void dbstore_sync_flush(dbmw_t *dw);
@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Write-ahead log for DB maps.
+ *
+ * Updates made to a persistent DB map are appended to a sequential log,
+ * which is what gets synchronized to disk periodically instead of the
+ * scattered database pages.  Records are buffered and written by large
+ * chunks, and all the records logged since the last commit reach the disk
+ * through a single fdatasync(): this is a group commit.
+ *
+ * Every so often, the database pages are flushed and synchronized to disk,
+ * at which point the log becomes useless and can be reset: this is a
+ * checkpoint, which is driven by the user of the log.
+ *
+ * Each record holds the full new state of a key (its value, or the fact
+ * that it was deleted), so replaying the log after a crash is idempotent:
+ * records are applied in order and the final state of each logged key is
+ * restored regardless of which database pages had made it to disk.
+ *
+ * Records are laid out as follows (all integers are big-endian):
+ *
+ *    length    4 bytes, length of the payload
+ *    CRC       4 bytes, CRC-32 of the payload
+ *    payload:
+ *      op      1 byte, the operation (store or delete)
+ *      klen    2 bytes, the key length
+ *      key     klen bytes
+ *      data    the remaining bytes, the value for stores
+ *
+ * The CRC lets us detect a torn record at the tail of the log, which can
+ * happen when we crash in the middle of a write: the log is truncated at
+ * the first invalid record during replay.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "dbwal.h"
+
+#include "compat_pio.h"
+#include "crc.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hstrfn.h"
+#include "log.h"
+#include "misc.h"				/* For english_strerror() */
+#include "stringify.h"
+#include "unsigned.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define DBWAL_HEADSIZE	8				/**< Record header: length + CRC */
+#define DBWAL_OPSIZE	3				/**< Operation + key length */
+#define DBWAL_BUFSIZE	(64 * 1024)		/**< Buffered data before writing */
+#define DBWAL_MAXREC	(1024 * 1024)	/**< Sanity limit on record payload */
+
+static const mode_t DBWAL_FILE_MODE = S_IRUSR | S_IWUSR; /* 0600 */
+
+enum dbwal_op {
+	DBWAL_OP_STORE = 1,
+	DBWAL_OP_DELETE = 2
+};
+
+enum dbwal_magic { DBWAL_MAGIC = 0x6f2d14a9 };
+
+/**
+ * A write-ahead log.
+ */
+struct dbwal {
+	enum dbwal_magic magic;
+	int fd;						/**< Opened log file */
+	char *name;					/**< Name, for logging */
+	char *path;					/**< Path of the log file */
+	char *buf;					/**< Records not written yet */
+	size_t bufsize;				/**< Allocated size of ``buf'' */
+	size_t buflen;				/**< Used space in ``buf'' */
+	fileoffset_t size;			/**< Amount of data written to the file */
+	size_t pending;				/**< Records not written yet */
+	size_t unsynced;			/**< Records written but not committed */
+	unsigned ioerr:1;			/**< Had I/O error, log disabled */
+};
+
+static inline void
+dbwal_check(const struct dbwal * const w)
+{
+	g_assert(w != NULL);
+	g_assert(DBWAL_MAGIC == w->magic);
+}
+
+/**
+ * Open or create the log file.
+ *
+ * Any existing data in the log are preserved, and should be replayed
+ * via dbwal_replay() before new records are appended.
+ *
+ * @param name		name of the log, for logging
+ * @param path		path of the log file
+ *
+ * @return the opened log, NULL on error with errno set.
+ */
+dbwal_t *
+dbwal_open(const char *name, const char *path)
+{
+	dbwal_t *w;
+	filestat_t buf;
+	int fd;
+
+	g_assert(name != NULL);
+	g_assert(path != NULL);
+
+	fd = file_open(path, O_CREAT | O_RDWR, DBWAL_FILE_MODE);
+	if (-1 == fd)
+		return NULL;
+
+	if (-1 == fstat(fd, &buf)) {
+		int saved_errno = errno;
+		fd_close(&fd);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	WALLOC0(w);
+	w->magic = DBWAL_MAGIC;
+	w->fd = fd;
+	w->name = h_strdup(name);
+	w->path = h_strdup(path);
+	w->size = buf.st_size;
+
+	return w;
+}
+
+/**
+ * @return the name of the log.
+ */
+const char *
+dbwal_name(const dbwal_t *w)
+{
+	dbwal_check(w);
+
+	return w->name;
+}
+
+/**
+ * @return the size of the log, including records not written yet.
+ */
+fileoffset_t
+dbwal_size(const dbwal_t *w)
+{
+	dbwal_check(w);
+
+	return w->size + w->buflen;
+}
+
+/**
+ * Flag I/O error on the log, which disables it.
+ *
+ * Records are no longer accepted: the log is only useful if it is complete,
+ * so we stop logging and let the database be synchronized the old way.
+ */
+static void
+dbwal_ioerr(dbwal_t *w, const char *what, int error)
+{
+	s_warning("DBWAL \"%s\" cannot %s log file \"%s\": %s",
+		w->name, what, w->path, english_strerror(error));
+
+	w->ioerr = TRUE;
+	w->buflen = 0;
+	w->pending = 0;
+}
+
+/**
+ * Write buffered records to the log file.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+dbwal_write(dbwal_t *w)
+{
+	const char *p = w->buf;
+	size_t n = w->buflen;
+
+	while (n != 0) {
+		ssize_t r = compat_pwrite(w->fd, p, n, w->size);
+
+		if G_UNLIKELY(-1 == r) {
+			if (is_temporary_error(errno))
+				continue;
+			dbwal_ioerr(w, "write to", errno);
+			return FALSE;
+		}
+
+		p += r;
+		n -= r;
+		w->size += r;
+	}
+
+	w->buflen = 0;
+	w->unsynced += w->pending;
+	w->pending = 0;
+
+	return TRUE;
+}
+
+/**
+ * Append a record to the log.
+ */
+static void
+dbwal_append(dbwal_t *w, enum dbwal_op op,
+	const void *key, size_t klen, const void *data, size_t dlen)
+{
+	size_t len = DBWAL_OPSIZE + klen + dlen;
+	char *rec, *payload;
+
+	dbwal_check(w);
+	g_assert(key != NULL);
+	g_assert(klen <= MAX_INT_VAL(uint16));
+	g_assert(len <= DBWAL_MAXREC);
+
+	if G_UNLIKELY(w->ioerr)
+		return;
+
+	if (w->buflen + DBWAL_HEADSIZE + len > w->bufsize) {
+		w->bufsize = MAX(DBWAL_BUFSIZE, w->buflen + DBWAL_HEADSIZE + len);
+		w->buf = hrealloc(w->buf, w->bufsize);
+	}
+
+	rec = &w->buf[w->buflen];
+	payload = rec + DBWAL_HEADSIZE;
+
+	payload[0] = op;
+	poke_be16(&payload[1], klen);
+	memcpy(&payload[DBWAL_OPSIZE], key, klen);
+	if (dlen != 0)
+		memcpy(&payload[DBWAL_OPSIZE + klen], data, dlen);
+
+	poke_be32(&rec[0], len);
+	poke_be32(&rec[4], crc32_update(0, payload, len));
+
+	w->buflen += DBWAL_HEADSIZE + len;
+	w->pending++;
+
+	/*
+	 * Buffered records are written in large chunks, to limit memory usage
+	 * between commits, but they will only be synchronized to disk at the
+	 * next commit.
+	 */
+
+	if (w->buflen >= DBWAL_BUFSIZE)
+		dbwal_write(w);
+}
+
+/**
+ * Log new value for a key.
+ *
+ * @param w		the log
+ * @param key	the key
+ * @param klen	length of the key
+ * @param data	the serialized value
+ * @param dlen	length of the value
+ */
+void
+dbwal_store(dbwal_t *w,
+	const void *key, size_t klen, const void *data, size_t dlen)
+{
+	dbwal_append(w, DBWAL_OP_STORE, key, klen, data, dlen);
+}
+
+/**
+ * Log deletion of a key.
+ *
+ * @param w		the log
+ * @param key	the key
+ * @param klen	length of the key
+ */
+void
+dbwal_delete(dbwal_t *w, const void *key, size_t klen)
+{
+	dbwal_append(w, DBWAL_OP_DELETE, key, klen, NULL, 0);
+}
+
+/**
+ * Commit all the records logged so far, making sure they reach the disk.
+ *
+ * @return the amount of records committed, -1 on error.
+ */
+ssize_t
+dbwal_commit(dbwal_t *w)
+{
+	size_t n;
+
+	dbwal_check(w);
+
+	if G_UNLIKELY(w->ioerr) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (0 != w->buflen && !dbwal_write(w))
+		return -1;
+
+	if (0 == w->unsynced)
+		return 0;
+
+	if G_UNLIKELY(-1 == fd_fdatasync(w->fd)) {
+		dbwal_ioerr(w, "synchronize", errno);
+		return -1;
+	}
+
+	n = w->unsynced;
+	w->unsynced = 0;
+
+	return n;
+}
+
+/**
+ * Reset the log, discarding all the records, including the ones not
+ * committed yet.
+ *
+ * This is done after a checkpoint, once all the logged changes have made
+ * it to the database pages on disk.  Resetting clears any previous I/O
+ * error condition, re-enabling the log.
+ *
+ * @return TRUE if OK.
+ */
+bool
+dbwal_reset(dbwal_t *w)
+{
+	dbwal_check(w);
+
+	w->buflen = 0;
+	w->pending = 0;
+	w->unsynced = 0;
+
+	if (0 == w->size && !w->ioerr)
+		return TRUE;
+
+	if G_UNLIKELY(-1 == ftruncate(w->fd, 0)) {
+		dbwal_ioerr(w, "truncate", errno);
+		return FALSE;
+	}
+
+	w->size = 0;
+	w->ioerr = FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Read a record from the log file.
+ *
+ * @param w			the log
+ * @param offset	offset of the record in the file
+ * @param len		where the length of the payload is returned
+ *
+ * @return the record payload (held in the log buffer), NULL if the record
+ * is invalid or truncated.
+ */
+static const char *
+dbwal_read(dbwal_t *w, fileoffset_t offset, size_t *len)
+{
+	char head[DBWAL_HEADSIZE];
+	size_t n;
+	ssize_t r;
+
+	if (w->size - offset < DBWAL_HEADSIZE)
+		return NULL;
+
+	r = compat_pread(w->fd, head, sizeof head, offset);
+	if (r != sizeof head)
+		return NULL;
+
+	n = peek_be32(&head[0]);
+
+	if (n < DBWAL_OPSIZE || n > DBWAL_MAXREC)
+		return NULL;
+
+	if (w->size - offset - DBWAL_HEADSIZE < (fileoffset_t) n)
+		return NULL;
+
+	if (n > w->bufsize) {
+		w->bufsize = MAX(DBWAL_BUFSIZE, n);
+		w->buf = hrealloc(w->buf, w->bufsize);
+	}
+
+	r = compat_pread(w->fd, w->buf, n, offset + DBWAL_HEADSIZE);
+	if (r < 0 || (size_t) r != n)
+		return NULL;
+
+	if (crc32_update(0, w->buf, n) != peek_be32(&head[4]))
+		return NULL;
+
+	*len = n;
+	return w->buf;
+}
+
+/**
+ * Replay the log, invoking the callback on each logged change, in order.
+ *
+ * Replaying stops at the first invalid record, which is normally the
+ * last one, partially written when we crashed: the log is truncated there.
+ *
+ * @param w		the log, with no pending records
+ * @param cb	the callback to invoke on each record
+ * @param arg	additional callback argument
+ *
+ * @return the amount of records replayed.
+ */
+size_t
+dbwal_replay(dbwal_t *w, dbwal_cb_t cb, void *arg)
+{
+	fileoffset_t offset = 0;
+	size_t count = 0;
+
+	dbwal_check(w);
+	g_assert(0 == w->buflen);
+	g_assert(cb != NULL);
+
+	while (offset < w->size) {
+		const char *payload;
+		const char *key, *data;
+		size_t len, klen, dlen;
+
+		payload = dbwal_read(w, offset, &len);
+		if (NULL == payload)
+			break;
+
+		klen = peek_be16(&payload[1]);
+		if (klen > len - DBWAL_OPSIZE)
+			break;
+
+		key = &payload[DBWAL_OPSIZE];
+		dlen = len - DBWAL_OPSIZE - klen;
+
+		switch (payload[0]) {
+		case DBWAL_OP_STORE:
+			data = key + klen;
+			break;
+		case DBWAL_OP_DELETE:
+			if (dlen != 0)
+				goto done;
+			data = NULL;
+			break;
+		default:
+			goto done;
+		}
+
+		(*cb)(key, klen, data, dlen, arg);
+
+		offset += DBWAL_HEADSIZE + len;
+		count++;
+	}
+
+done:
+	if (offset != w->size) {
+		s_warning("DBWAL \"%s\" discarding %s trailing byte%s in \"%s\" "
+			"after %zu valid record%s",
+			w->name, fileoffset_t_to_string(w->size - offset),
+			plural(w->size - offset), w->path, count, plural(count));
+
+		if (-1 == ftruncate(w->fd, offset)) {
+			dbwal_ioerr(w, "truncate", errno);
+		} else {
+			w->size = offset;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Close the log, committing pending records.
+ *
+ * An empty log file is removed.
+ */
+void
+dbwal_close(dbwal_t **w_ptr)
+{
+	dbwal_t *w = *w_ptr;
+
+	if (w != NULL) {
+		dbwal_check(w);
+
+		dbwal_commit(w);
+		fd_close(&w->fd);
+
+		if (0 == w->size && !w->ioerr) {
+			if (-1 == unlink(w->path)) {
+				s_warning("DBWAL \"%s\" cannot unlink \"%s\": %m",
+					w->name, w->path);
+			}
+		}
+
+		HFREE_NULL(w->buf);
+		HFREE_NULL(w->name);
+		HFREE_NULL(w->path);
+		w->magic = 0;
+		WFREE(w);
+		*w_ptr = NULL;
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Write-ahead log for DB maps.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _dbwal_h_
+#define _dbwal_h_
+
+#define DBWAL_FEXT	".wal"		/**< Extension of log files */
+
+struct dbwal;
+typedef struct dbwal dbwal_t;
+
+/**
+ * Log replaying callback.
+ *
+ * @param key		the key
+ * @param klen		length of the key
+ * @param data		the value data, NULL if the key was deleted
+ * @param dlen		length of the value data
+ * @param arg		user-supplied additional callback argument
+ */
+typedef void (*dbwal_cb_t)(const void *key, size_t klen,
+	const void *data, size_t dlen, void *arg);
+
+/*
+ * Public interface.
+ */
+
+dbwal_t *dbwal_open(const char *name, const char *path);
+void dbwal_close(dbwal_t **w_ptr);
+
+void dbwal_store(dbwal_t *w,
+	const void *key, size_t klen, const void *data, size_t dlen);
+void dbwal_delete(dbwal_t *w, const void *key, size_t klen);
+
+ssize_t dbwal_commit(dbwal_t *w);
+size_t dbwal_replay(dbwal_t *w, dbwal_cb_t cb, void *arg);
+bool dbwal_reset(dbwal_t *w);
+fileoffset_t dbwal_size(const dbwal_t *w);
+const char *dbwal_name(const dbwal_t *w);
+
+#endif /* _dbwal_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Directory change monitoring.
+ *
+ * A directory watcher records a set of directories and tells whether any
+ * of them was changed since it was added (or re-armed) in the set.  A change
+ * is anything that could alter the result of scanning the directory: entries
+ * created, removed or renamed, files written to or their attributes changed.
+ *
+ * The intended usage is to arm the watch on a directory BEFORE scanning it,
+ * so that changes made whilst the scan is in progress are not lost.  Later,
+ * a directory that is still reported as "clean" is known to contain the same
+ * entries, with the same attributes, as when it was last scanned.
+ *
+ * Events are collected lazily from the kernel when the set is queried, hence
+ * there is no need to plug the watcher in the main event loop.
+ *
+ * When the underlying OS does not provide a suitable notification mechanism,
+ * or when the kernel runs out of watches, directories are simply never
+ * reported as clean.
+ *
+ * This is not a thread-safe data structure, it must be used from one thread.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "dirwatch.h"
+
+#include "atoms.h"
+#include "fd.h"
+#include "htable.h"
+#include "log.h"
+#include "misc.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+enum dirwatch_magic { DIRWATCH_MAGIC = 0x28a4c3e1 };
+
+/**
+ * A directory watcher.
+ */
+struct dirwatch {
+	enum dirwatch_magic magic;
+	const char *name;			/**< Name, for logging (static string) */
+	htable_t *by_path;			/**< path (atom) -> struct dirwatch_entry */
+	htable_t *by_wd;			/**< watch descriptor -> dirwatch_entry */
+	int fd;						/**< Kernel notification descriptor */
+};
+
+static inline void
+dirwatch_check(const struct dirwatch * const dw)
+{
+	g_assert(dw != NULL);
+	g_assert(DIRWATCH_MAGIC == dw->magic);
+}
+
+/**
+ * A watched directory.
+ */
+struct dirwatch_entry {
+	const char *path;			/**< Directory path (atom) */
+	int wd;						/**< Watch descriptor, -1 if none */
+	bool dirty;					/**< Whether directory changed */
+};
+
+/**
+ * Create a new directory watcher.
+ *
+ * @param name		the name of the watcher, for logging (static string)
+ *
+ * @return a new directory watcher.
+ */
+dirwatch_t *
+dirwatch_make(const char *name)
+{
+	dirwatch_t *dw;
+
+	WALLOC0(dw);
+	dw->magic = DIRWATCH_MAGIC;
+	dw->name = name;
+	dw->by_path = htable_create(HASH_KEY_STRING, 0);
+	dw->by_wd = htable_create(HASH_KEY_SELF, 0);
+	dw->fd = -1;
+
+#ifdef HAS_INOTIFY
+	dw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (-1 == dw->fd)
+		s_warning("%s(): cannot monitor \"%s\" directories: %m",
+			G_STRFUNC, name);
+#endif
+
+	return dw;
+}
+
+static void
+dirwatch_entry_free_kv(const void *unused_key, void *value, void *unused_data)
+{
+	struct dirwatch_entry *de = value;
+
+	(void) unused_key;
+	(void) unused_data;
+
+	atom_str_free_null(&de->path);
+	WFREE(de);
+}
+
+/**
+ * Destroy directory watcher and nullify its pointer.
+ */
+void
+dirwatch_free_null(dirwatch_t **dw_ptr)
+{
+	dirwatch_t *dw = *dw_ptr;
+
+	if (dw != NULL) {
+		dirwatch_check(dw);
+
+		htable_foreach(dw->by_path, dirwatch_entry_free_kv, NULL);
+		htable_free_null(&dw->by_path);
+		htable_free_null(&dw->by_wd);
+		fd_close(&dw->fd);		/* Drops all the kernel watches */
+
+		dw->magic = 0;
+		WFREE(dw);
+		*dw_ptr = NULL;
+	}
+}
+
+/**
+ * @return whether directory changes can be monitored.
+ */
+bool
+dirwatch_is_supported(const dirwatch_t *dw)
+{
+	dirwatch_check(dw);
+
+	return dw->fd != -1;
+}
+
+/**
+ * @return the amount of directories in the watcher.
+ */
+size_t
+dirwatch_count(const dirwatch_t *dw)
+{
+	dirwatch_check(dw);
+
+	return htable_count(dw->by_path);
+}
+
+#ifdef HAS_INOTIFY
+static void
+dirwatch_entry_mark_dirty(const void *unused_key, void *value, void *unused)
+{
+	struct dirwatch_entry *de = value;
+
+	(void) unused_key;
+	(void) unused;
+
+	de->dirty = TRUE;
+}
+
+#endif	/* HAS_INOTIFY */
+
+/**
+ * Collect pending change notifications from the kernel.
+ *
+ * @return the amount of events processed.
+ */
+size_t
+dirwatch_poll(dirwatch_t *dw)
+{
+	size_t events = 0;
+
+	dirwatch_check(dw);
+
+	if (-1 == dw->fd)
+		return 0;
+
+#ifdef HAS_INOTIFY
+	for (;;) {
+		union {
+			struct inotify_event ev;
+			char buf[4096];
+		} u;
+		ssize_t r;
+		size_t i;
+
+		r = read(dw->fd, u.buf, sizeof u.buf);
+
+		if (-1 == r) {
+			if (EINTR == errno)
+				continue;
+			if (!is_temporary_error(errno)) {
+				s_warning("%s(): error reading \"%s\" events: %m",
+					G_STRFUNC, dw->name);
+			}
+			break;
+		}
+
+		if (0 == r)
+			break;
+
+		for (i = 0; i + sizeof u.ev <= UNSIGNED(r); /* empty */) {
+			const struct inotify_event *ev = (void *) &u.buf[i];
+			struct dirwatch_entry *de;
+
+			events++;
+			i += sizeof *ev + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* Events were lost, we cannot trust anything */
+				htable_foreach(dw->by_path, dirwatch_entry_mark_dirty, NULL);
+				continue;
+			}
+
+			de = htable_lookup(dw->by_wd, int_to_pointer(ev->wd));
+			if (NULL == de)
+				continue;
+
+			de->dirty = TRUE;
+
+			if (ev->mask & IN_IGNORED) {
+				/* Watch was removed by the kernel, directory deleted */
+				htable_remove(dw->by_wd, int_to_pointer(ev->wd));
+				de->wd = -1;
+			}
+		}
+	}
+#endif	/* HAS_INOTIFY */
+
+	return events;
+}
+
+/**
+ * Add directory to the watcher, or re-arm the watch if it was already known,
+ * meaning the directory is considered unchanged from now on.
+ *
+ * @param dw		the directory watcher
+ * @param path		the directory path
+ *
+ * @return TRUE if the directory is now watched.
+ */
+bool
+dirwatch_add(dirwatch_t *dw, const char *path)
+{
+	struct dirwatch_entry *de;
+
+	dirwatch_check(dw);
+	g_assert(path != NULL);
+
+	if (-1 == dw->fd)
+		return FALSE;
+
+	/*
+	 * Flush events collected so far: they pertain to the state of the
+	 * directory before we re-arm the watch.
+	 */
+
+	dirwatch_poll(dw);
+
+	de = htable_lookup(dw->by_path, path);
+
+	if (NULL == de) {
+		WALLOC0(de);
+		de->path = atom_str_get(path);
+		de->wd = -1;
+		htable_insert(dw->by_path, de->path, de);
+	}
+
+#ifdef HAS_INOTIFY
+	if (-1 == de->wd) {
+		int wd = inotify_add_watch(dw->fd, path,
+			IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+			IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+			IN_ONLYDIR);
+
+		if (-1 == wd) {
+			if (ENOSPC == errno) {
+				s_warning_once_per(LOG_PERIOD_MINUTE,
+					"%s(): out of kernel watches for \"%s\"",
+					G_STRFUNC, dw->name);
+			}
+		} else if (htable_contains(dw->by_wd, int_to_pointer(wd))) {
+			/*
+			 * Same directory reached through another path (symbolic link),
+			 * let the first path we saw own the watch: this one will never
+			 * be reported as clean.
+			 */
+		} else {
+			de->wd = wd;
+			htable_insert(dw->by_wd, int_to_pointer(wd), de);
+		}
+	}
+#endif	/* HAS_INOTIFY */
+
+	de->dirty = -1 == de->wd;
+
+	return !de->dirty;
+}
+
+/**
+ * Stop monitoring a directory.
+ */
+void
+dirwatch_remove(dirwatch_t *dw, const char *path)
+{
+	struct dirwatch_entry *de;
+
+	dirwatch_check(dw);
+	g_assert(path != NULL);
+
+	de = htable_lookup(dw->by_path, path);
+	if (NULL == de)
+		return;
+
+#ifdef HAS_INOTIFY
+	if (de->wd != -1) {
+		htable_remove(dw->by_wd, int_to_pointer(de->wd));
+		inotify_rm_watch(dw->fd, de->wd);
+	}
+#endif
+
+	htable_remove(dw->by_path, path);
+	dirwatch_entry_free_kv(NULL, de, NULL);
+}
+
+/**
+ * Check whether directory is clean, i.e. has not been changed since it was
+ * added to the watcher.
+ *
+ * @return TRUE if directory is known to be unchanged.
+ */
+bool
+dirwatch_is_clean(dirwatch_t *dw, const char *path)
+{
+	const struct dirwatch_entry *de;
+
+	dirwatch_check(dw);
+	g_assert(path != NULL);
+
+	if (-1 == dw->fd)
+		return FALSE;
+
+	dirwatch_poll(dw);
+
+	de = htable_lookup(dw->by_path, path);
+
+	return de != NULL && !de->dirty;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
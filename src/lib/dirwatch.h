@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Directory change monitoring.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _dirwatch_h_
+#define _dirwatch_h_
+
+typedef struct dirwatch dirwatch_t;
+
+/*
+ * Public interface.
+ */
+
+dirwatch_t *dirwatch_make(const char *name);
+void dirwatch_free_null(dirwatch_t **dw_ptr);
+
+bool dirwatch_is_supported(const dirwatch_t *dw);
+bool dirwatch_add(dirwatch_t *dw, const char *path);
+void dirwatch_remove(dirwatch_t *dw, const char *path);
+bool dirwatch_is_clean(dirwatch_t *dw, const char *path);
+size_t dirwatch_poll(dirwatch_t *dw);
+size_t dirwatch_count(const dirwatch_t *dw);
+
+#endif	/* _dirwatch_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Epoch-based memory reclamation.
+ *
+ * This lets readers access shared data without taking any lock nor
+ * manipulating reference counts, the price being paid by the writers which
+ * cannot free the data they replace immediately.
+ *
+ * Readers bracket their accesses with epoch_enter() and epoch_leave(), and
+ * must not keep any pointer to the shared data outside these read-side
+ * sections, which are meant to be short.  Sections can be nested, but a
+ * thread must not block nor exit whilst within one, since this prevents any
+ * further reclamation.
+ *
+ * Writers publish the new version of the data before calling epoch_defer()
+ * on the old one, which will be freed once all the threads that could still
+ * see it have left their read-side section.
+ *
+ * The global epoch can only advance when all the threads within a read-side
+ * section have observed its current value.  Data retired during epoch E
+ * can therefore be freed once the global epoch reaches E + 2: the threads
+ * that could have seen it entered their section at epoch E at the latest,
+ * and they must have left it for the epoch to move past E + 1.
+ *
+ * Reclamation is attempted each time data is retired and periodically from
+ * the main callout queue, so that retired data does not linger.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "epoch.h"
+
+#include "atomic.h"
+#include "compat_sleep_ms.h"
+#include "cq.h"
+#include "once.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define EPOCH_SLOT_SIZE		64		/* Assumed cache line size */
+#define EPOCH_PERIOD_MS		1000	/* Periodic reclamation, every second */
+#define EPOCH_STEP			2		/* Keeps epochs odd, 0 flagging idle threads */
+
+/**
+ * A per-thread epoch record, alone on its cache line (assuming the array is
+ * suitably aligned, otherwise adjacent slots can share a line).
+ *
+ * Only the owning thread updates its record.  The observed epoch is 0 when
+ * the thread is not within a read-side section.
+ */
+struct epoch_slot {
+	uint epoch;			/* Epoch observed when entering section, 0 if none */
+	uint depth;			/* Nesting depth of read-side sections */
+	char pad[EPOCH_SLOT_SIZE - 2 * sizeof(uint)];
+};
+
+/**
+ * A retired item, waiting for reclamation.
+ */
+struct epoch_item {
+	struct epoch_item *next;
+	epoch_free_t fn;				/* Freeing routine */
+	void *data;						/* Data to free */
+	uint epoch;						/* Epoch when retired */
+};
+
+static struct epoch_slot epoch_slots[THREAD_MAX];
+static uint epoch_global = 1;		/* Always odd, hence never 0 */
+
+/*
+ * The list of retired items, oldest first, hence in increasing epochs.
+ */
+static struct {
+	struct epoch_item *head, *tail;
+	size_t count;
+} epoch_retired;
+
+static spinlock_t epoch_slk = SPINLOCK_INIT;
+
+#define EPOCH_LOCK		spinlock(&epoch_slk)
+#define EPOCH_UNLOCK	spinunlock(&epoch_slk)
+
+/**
+ * Enter read-side section.
+ *
+ * Until epoch_leave() is called, the data retired by other threads through
+ * epoch_defer() will not be freed.
+ */
+void
+epoch_enter(void)
+{
+	struct epoch_slot *es = &epoch_slots[thread_small_id()];
+
+	if G_LIKELY(0 == es->depth++) {
+		atomic_uint_set(&es->epoch, atomic_uint_get(&epoch_global));
+		atomic_mb();	/* Make sure we are seen before reading any data */
+	}
+}
+
+/**
+ * Leave read-side section.
+ */
+void
+epoch_leave(void)
+{
+	struct epoch_slot *es = &epoch_slots[thread_small_id()];
+
+	g_assert_log(es->depth != 0,
+		"%s(): not within a read-side section", G_STRFUNC);
+
+	if G_LIKELY(0 == --es->depth) {
+		atomic_mb();	/* All our reads must be done before we clear */
+		atomic_uint_set(&es->epoch, 0);
+	}
+}
+
+/**
+ * @return whether current thread is within a read-side section.
+ */
+bool
+epoch_is_inside(void)
+{
+	return 0 != epoch_slots[thread_small_id()].depth;
+}
+
+/**
+ * Attempt to advance the global epoch.
+ *
+ * @return TRUE if the epoch was advanced.
+ */
+static bool
+epoch_advance(void)
+{
+	uint g = atomic_uint_get(&epoch_global);
+	uint i;
+
+	atomic_mb();
+
+	for (i = 0; i < N_ITEMS(epoch_slots); i++) {
+		uint e = atomic_uint_get(&epoch_slots[i].epoch);
+
+		if (e != 0 && e != g)
+			return FALSE;		/* Thread still in a previous epoch */
+	}
+
+	return atomic_uint_xchg_if_eq(&epoch_global, g, g + EPOCH_STEP);
+}
+
+/**
+ * Can item retired during epoch `e' be freed now that the global epoch is `g'?
+ */
+static inline bool
+epoch_expired(uint e, uint g)
+{
+	/* Using a signed difference to cope with wrapping epochs */
+	return (int) (g - e) >= 2 * EPOCH_STEP;
+}
+
+/**
+ * Free the retired items which can no longer be seen by any thread.
+ *
+ * @return TRUE if there are still items to reclaim.
+ */
+bool
+epoch_reclaim(void)
+{
+	struct epoch_item *ei, *list = NULL, **tail = &list;
+	uint g;
+	bool pending;
+
+	if (0 == epoch_retired.count)
+		return FALSE;
+
+	(void) epoch_advance();
+	g = atomic_uint_get(&epoch_global);
+
+	EPOCH_LOCK;
+
+	while (
+		NULL != (ei = epoch_retired.head) && epoch_expired(ei->epoch, g)
+	) {
+		epoch_retired.head = ei->next;
+		epoch_retired.count--;
+		*tail = ei;
+		tail = &ei->next;
+	}
+	*tail = NULL;
+
+	if (NULL == epoch_retired.head)
+		epoch_retired.tail = NULL;
+
+	pending = NULL != epoch_retired.head;
+
+	EPOCH_UNLOCK;
+
+	/*
+	 * Free the items outside the critical section.
+	 */
+
+	while (NULL != (ei = list)) {
+		list = ei->next;
+		(*ei->fn)(ei->data);
+		WFREE(ei);
+	}
+
+	return pending;
+}
+
+/**
+ * Periodic reclamation of retired items.
+ */
+static bool
+epoch_periodic(void *unused)
+{
+	(void) unused;
+
+	epoch_reclaim();
+	return TRUE;		/* Keep calling */
+}
+
+static void
+epoch_periodic_install(void)
+{
+	cq_periodic_main_add(EPOCH_PERIOD_MS, epoch_periodic, NULL);
+}
+
+/**
+ * Retire data, which will be freed once no thread can see it any more.
+ *
+ * The data must no longer be reachable from the shared structures through
+ * which readers can find it.
+ *
+ * @param fn		the routine to free the data
+ * @param data		the data to free
+ */
+void
+epoch_defer(epoch_free_t fn, void *data)
+{
+	static once_flag_t periodic_installed;
+	struct epoch_item *ei;
+
+	g_assert(fn != NULL);
+
+	ONCE_FLAG_RUN(periodic_installed, epoch_periodic_install);
+
+	WALLOC(ei);
+	ei->fn = fn;
+	ei->data = data;
+	ei->next = NULL;
+
+	atomic_mb();		/* Data was unlinked before we read the epoch */
+
+	EPOCH_LOCK;
+
+	ei->epoch = atomic_uint_get(&epoch_global);
+
+	if (NULL == epoch_retired.tail)
+		epoch_retired.head = ei;
+	else
+		epoch_retired.tail->next = ei;
+	epoch_retired.tail = ei;
+	epoch_retired.count++;
+
+	EPOCH_UNLOCK;
+
+	epoch_reclaim();
+}
+
+/**
+ * Wait until all the data retired so far has been freed.
+ *
+ * This must not be called from within a read-side section, since that would
+ * prevent the global epoch from advancing.
+ */
+void
+epoch_synchronize(void)
+{
+	g_assert_log(!epoch_is_inside(),
+		"%s(): called from within a read-side section", G_STRFUNC);
+
+	while (epoch_reclaim())
+		compat_sleep_ms(1);
+}
+
+/**
+ * @return amount of retired items waiting for reclamation.
+ */
+size_t
+epoch_pending(void)
+{
+	return epoch_retired.count;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Epoch-based memory reclamation.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _epoch_h_
+#define _epoch_h_
+
+typedef void (*epoch_free_t)(void *data);
+
+/*
+ * Public interface.
+ */
+
+void epoch_enter(void);
+void epoch_leave(void);
+bool epoch_is_inside(void);
+
+void epoch_defer(epoch_free_t fn, void *data);
+bool epoch_reclaim(void);
+void epoch_synchronize(void);
+size_t epoch_pending(void);
+
+#endif /* _epoch_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
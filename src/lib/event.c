@@ -119,6 +119,7 @@ event_add_subscriber(event_t *evt, callback_fn_t cb,
 
 	event_check(evt);
     g_assert(cb != NULL);
+	g_assert(t != FREQ_BATCHED);
 
     s = subscriber_new(cb, t, interval);
 
@@ -166,6 +167,35 @@ found:
 	subscriber_destroy(s);
 }
 
+/**
+ * @return whether callback is a subscriber of the event.
+ */
+bool
+event_has_subscriber(const event_t *evt, callback_fn_t cb)
+{
+	const pslist_t *sl;
+	bool found = FALSE;
+
+	event_check(evt);
+	g_assert(cb != NULL);
+
+	mutex_lock_const(&evt->lock);
+
+	PSLIST_FOREACH(evt->subscribers, sl) {
+		const struct subscriber *s = sl->data;
+
+		subscriber_check(s);
+		if (s->cb == cb) {
+			found = TRUE;
+			break;
+		}
+	}
+
+	mutex_unlock_const(&evt->lock);
+
+	return found;
+}
+
 size_t
 event_subscriber_count(const event_t *evt)
 {
@@ -45,7 +45,8 @@
 
 typedef enum frequency_type {
     FREQ_SECS,
-    FREQ_UPDATES
+    FREQ_UPDATES,
+    FREQ_BATCHED	/**< Property listeners only, see prop.c */
 } frequency_t;
 
 enum subscriber_magic { SUBSCRIBER_MAGIC = 0x2184e261 };
@@ -88,6 +89,7 @@ void event_destroy(event_t *evt);
 void event_add_subscriber(
     event_t *evt, callback_fn_t cb, frequency_t t, uint32 interval);
 void event_remove_subscriber(event_t *evt, callback_fn_t cb);
+bool event_has_subscriber(const event_t *evt, callback_fn_t cb);
 
 size_t event_subscriber_count(const event_t *evt);
 bool event_subscriber_active(const event_t *evt);
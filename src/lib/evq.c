@@ -39,6 +39,10 @@
  * the thread exits), but also the events that have triggered already and
  * need to be dispatched to the thread.
  *
+ * Triggered events are delivered in batches: the thread is only signalled
+ * when an event is added to an empty list of triggered events, since the
+ * signal handler dispatches all the events it finds in that list.
+ *
  * Direct access to the callout queue is also given because it is guaranteed
  * that the event queue will run in a dedicated thread.  As such, the library
  * code should use the event queue for its own processing and leave the main
@@ -64,6 +68,7 @@
 #include "stacktrace.h"
 #include "thread.h"
 #include "tm.h"
+#include "tpool.h"
 #include "tsig.h"
 #include "walloc.h"
 
@@ -699,6 +704,7 @@ evq_trampoline(cqueue_t *cq, void *obj)
 	struct evq_event *eve = obj;
 	struct evq *q;
 	uint id;
+	bool notify;
 
 	evq_event_check(eve);
 	g_assert(thread_small_id() == evq_thread_id);
@@ -807,8 +813,13 @@ evq_trampoline(cqueue_t *cq, void *obj)
 
 	/*
 	 * Event will be handled by the signal handler.
+	 *
+	 * If there were already triggered events, the thread was signalled
+	 * when the first one was added and it has not yet emptied the list,
+	 * so it will also dispatch this event: no need to signal it again.
 	 */
 
+	notify = 0 == elist_count(&q->triggered);
 	elist_append(&q->triggered, eve);
 
 	/*
@@ -827,7 +838,7 @@ evq_trampoline(cqueue_t *cq, void *obj)
 	 * Signal the target thread that it has triggered events to dispatch.
 	 */
 
-	if (-1 == thread_kill(id, TSIG_EVQ)) {
+	if (notify && -1 == thread_kill(id, TSIG_EVQ)) {
 		s_critical_once_per(LOG_PERIOD_SECOND,
 			"%s(): cannot send TSIG_EVQ to %s: %m",
 			G_STRFUNC, thread_id_name(id));
@@ -1193,4 +1204,53 @@ evq_raw_periodic_add(int period, cq_invoke_t event, void *arg)
 	return cp;
 }
 
+/***
+ *** Events dispatched to the thread pool.
+ ***
+ *** They are timed by the event queue thread, which posts them to the
+ *** thread pool when they fire, without running them itself.
+ ***/
+
+struct evq_pool_info {
+	notify_fn_t cb;				/**< Callback routine */
+	void *arg;					/**< Argument to pass to said callback */
+};
+
+/**
+ * Event queue trampoline posting the event to the thread pool.
+ */
+static void
+evq_pool_trampoline(cqueue_t *unused_cq, void *udata)
+{
+	struct evq_pool_info *pi = udata;
+
+	(void) unused_cq;
+
+	tpool_post(pi->cb, pi->arg);
+	WFREE(pi);
+}
+
+/**
+ * Schedule a new event that cannot be cancelled, to be processed by the
+ * thread pool once the delay has expired.
+ *
+ * @param delay		delay in ms
+ * @param fn		the routine to call, from a thread pool worker
+ * @param arg		routine argument
+ */
+void
+evq_pool_schedule(int delay, notify_fn_t fn, const void *arg)
+{
+	struct evq_pool_info *pi;
+
+	g_assert(fn != NULL);
+
+	WALLOC(pi);
+	pi->cb = fn;
+	pi->arg = deconstify_pointer(arg);
+
+	if G_UNLIKELY(NULL == evq_raw_insert(delay, evq_pool_trampoline, pi))
+		WFREE(pi);		/* Shutdowning */
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -59,6 +59,8 @@ cevent_t *evq_raw_insert(int delay, cq_service_t fn, void *arg);
 cidle_t *evq_raw_idle_add(cq_invoke_t event, void *arg);
 cperiodic_t *evq_raw_periodic_add(int period, cq_invoke_t event, void *arg);
 
+void evq_pool_schedule(int delay, notify_fn_t fn, const void *arg);
+
 #endif /* _evq_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
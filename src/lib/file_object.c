@@ -1203,6 +1203,146 @@ file_object_ftruncate(const file_object_t * const fo, filesize_t off)
 	return s;
 }
 
+/**
+ * Reserve disk space for the given range of the file, without changing
+ * its apparent size.
+ *
+ * @param fo		the file object
+ * @param offset	starting offset of the range
+ * @param size		length of the range
+ *
+ * @return 0 if OK, -1 on failure with errno set.
+ */
+int
+file_object_preallocate(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	const struct file_descriptor *fd;
+	int s;
+
+	file_object_check(fo);
+
+	fd = fo->fd;
+	FILE_DESCRIPTOR_LOCK(fd);
+
+	if G_UNLIKELY(fd->revoked) {
+		s_carp("%s(): descriptor for \"%s\" was revoked",
+			G_STRFUNC, fd->pathname);
+		s = -1;
+		errno = EBADF;
+	} else {
+		g_assert(is_valid_fd(fd->fd));
+		s = compat_preallocate(fd->fd, offset, size);
+	}
+
+	FILE_DESCRIPTOR_UNLOCK(fd);
+
+	return s;
+}
+
+/**
+ * Check whether the given range of the file contains a hole, i.e. a region
+ * that was never written to, or lies beyond the end of the file.
+ *
+ * When the system cannot report holes, only the latter case is detected.
+ *
+ * @param fo		the file object
+ * @param offset	starting offset of the range
+ * @param size		length of the range
+ *
+ * @return TRUE if the range has a hole.
+ */
+bool
+file_object_has_hole(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	const struct file_descriptor *fd;
+	fileoffset_t hole;
+	bool has_hole;
+
+	file_object_check(fo);
+
+	fd = fo->fd;
+	FILE_DESCRIPTOR_LOCK(fd);
+
+	if G_UNLIKELY(fd->revoked) {
+		s_carp("%s(): descriptor for \"%s\" was revoked",
+			G_STRFUNC, fd->pathname);
+		has_hole = FALSE;
+	} else {
+		g_assert(is_valid_fd(fd->fd));
+		hole = compat_next_hole(fd->fd, offset);
+		if (-1 == hole)
+			has_hole = ENXIO == errno;
+		else
+			has_hole = (filesize_t) hole < offset + size;
+	}
+
+	FILE_DESCRIPTOR_UNLOCK(fd);
+
+	return has_hole;
+}
+
+/**
+ * Declare that the given range of file data will not be accessed soon,
+ * letting the kernel drop the corresponding pages from its cache.
+ *
+ * @param fo		the file object
+ * @param offset	starting offset of the range
+ * @param size		length of the range
+ */
+void
+file_object_fadvise_dontneed(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	const struct file_descriptor *fd;
+
+	file_object_check(fo);
+
+	fd = fo->fd;
+	FILE_DESCRIPTOR_LOCK(fd);
+
+	if G_UNLIKELY(fd->revoked) {
+		s_carp("%s(): descriptor for \"%s\" was revoked",
+			G_STRFUNC, fd->pathname);
+	} else {
+		g_assert(is_valid_fd(fd->fd));
+		compat_fadvise_dontneed(fd->fd, offset, size);
+	}
+
+	FILE_DESCRIPTOR_UNLOCK(fd);
+}
+
+/**
+ * Declare that the given range of file data will be accessed soon, letting
+ * the kernel start reading it ahead asynchronously.
+ *
+ * @param fo		the file object
+ * @param offset	starting offset of the range
+ * @param size		length of the range
+ */
+void
+file_object_fadvise_willneed(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	const struct file_descriptor *fd;
+
+	file_object_check(fo);
+
+	fd = fo->fd;
+	FILE_DESCRIPTOR_LOCK(fd);
+
+	if G_UNLIKELY(fd->revoked) {
+		s_carp("%s(): descriptor for \"%s\" was revoked",
+			G_STRFUNC, fd->pathname);
+	} else {
+		g_assert(is_valid_fd(fd->fd));
+		compat_fadvise_willneed(fd->fd, offset, size);
+	}
+
+	FILE_DESCRIPTOR_UNLOCK(fd);
+}
+
 /**
  * Predeclare a sequential access pattern for file data.
  */
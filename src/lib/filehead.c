@@ -42,6 +42,49 @@
 
 #define FILEHEAD_LINE_MAXLEN	1024	/**< Maximum expected line length */
 
+/**
+ * Open and read the head of a given file into the supplied buffer, which
+ * is NUL-terminated.
+ *
+ * @param path			file path
+ * @param missing		whether file may be missing (to shut up warnings)
+ * @param buf			where data are read
+ * @param len			length of buffer, including space for the trailing NUL
+ *
+ * @return the amount of bytes read, -1 on error with errno set.
+ */
+ssize_t
+filehead_read(const char *path, bool missing, char *buf, size_t len)
+{
+	int fd;
+	ssize_t r;
+
+	g_assert(buf != NULL);
+	g_assert(size_is_positive(len));
+
+	fd = missing ?  file_open_missing(path, O_RDONLY) :
+		file_open(path, O_RDONLY, 0);
+
+	if (-1 == fd)
+		return -1;
+
+	r = read(fd, buf, len - 1);	/* reserve one byte for NUL */
+
+	if ((ssize_t) -1 == r) {
+		int saved_errno = errno;
+		fd_close(&fd);
+		errno = saved_errno;
+		return -1;
+	}
+
+	g_assert(r >= 0 && UNSIGNED(r) < len);
+
+	fd_close(&fd);
+	buf[r] = '\0';
+
+	return r;
+}
+
 /**
  * Open and parse the first line of a given file as the ASCII representation
  * of an unsigned 64-bit integer.
@@ -59,27 +102,13 @@
 uint64
 filehead_uint64(const char *path, bool missing, int *errptr)
 {
-	int fd;
 	uint64 value;
 	char data[FILEHEAD_LINE_MAXLEN + 1];
-	ssize_t r;
 	int error;
 
-	fd = missing ?  file_open_missing(path, O_RDONLY) :
-		file_open(path, O_RDONLY, 0);
-
-	if (-1 == fd)
+	if (-1 == filehead_read(path, missing, ARYLEN(data)))
 		goto error;
 
-	r = read(fd, ARYLEN(data) - 1); /* reserve one byte for NUL */
-
-	if ((ssize_t) -1 == r)
-		goto error_close;
-
-	g_assert(r >= 0 && UNSIGNED(r) < sizeof data);
-
-	fd_close(&fd);
-	data[r] = '\0';
 	value = parse_uint64(data, NULL, 10, &error);
 
 	if (error) {
@@ -92,8 +121,6 @@ filehead_uint64(const char *path, bool missing, int *errptr)
 
 	return value;
 
-error_close:
-	fd_close(&fd);
 error:
 	if (errptr != NULL)
 		*errptr = errno;
@@ -34,6 +34,7 @@
 #ifndef _filehead_h_
 #define _filehead_h_
 
+ssize_t filehead_read(const char *path, bool missing, char *buf, size_t len);
 uint64 filehead_uint64(const char *path, bool missing, int *errptr);
 
 #endif /* _filehead_h_ */
@@ -58,14 +58,16 @@
  * immune to clustering, the hash table size is a power of 2: the modulo
  * operator is much slower than a simple trailing bit masking.
  *
- * When a collision occurs and alternative slots are to be used, the distance
- * from the "home" slot is computed via the secondary hash routine, and then
- * linear probing of slots is done, using the computed distance.  To guarantee
- * that all the slots will be visited, the distance must be prime with the
- * hash table size.  Because the table size is a power of 2, any odd number
- * will be prime with it.  This is enough to guarantee that for any odd number
- * "d" and a hash table size "S", the first "n", n > 1, for which n*d = 0
- * modulo S is when n = S since d and S are prime with each-other.
+ * When a collision occurs, the other slots sharing the CPU cacheline of the
+ * "home" slot in the hashes array are probed first.  When they are all used,
+ * the distance to the next group of slots is computed via the secondary hash
+ * routine, and then probing of groups is done, using the computed distance.
+ * To guarantee that all the slots will be visited, the distance must be prime
+ * with the amount of groups in the table.  Because that amount is a power
+ * of 2, any odd number will be prime with it.  This is enough to guarantee
+ * that for any odd number "d" and an amount of groups "S", the first "n",
+ * n > 1, for which n*d = 0 modulo S is when n = S since d and S are prime
+ * with each-other.
  *
  * Because the final position of an item depends on the presence of other
  * items in the traversed path (in case the item is not at its "home" slot),
@@ -189,6 +191,9 @@ hash_random_offset_init(void)
 /**
  * How many extra hops past the home location do we allow in the table before
  * considering resizing it.
+ *
+ * A hop is a jump to another group of slots, i.e. to another cacheline in
+ * the hashes array: probing slots within the same group is not counted.
  */
 static inline size_t
 hash_hops_max(const struct hkeys *hk)
@@ -578,9 +583,9 @@ hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
 	size_t *kidx, size_t *tombidx)
 {
 	unsigned inc, ih;
-	size_t idx, nidx;
-	size_t first_tomb, mask, hops;
-	bool found;
+	size_t idx, nidx, i, home, base, step;
+	size_t first_tomb, mask, lmask, hops;
+	bool found, looped;
 
 	idx = hashing_keep(hv, hk->bits);
 	ih = hk->hashes[idx];
@@ -615,24 +620,40 @@ hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
 
 	/*
 	 * We're going to need the secondary hash now.
+	 *
+	 * Slots are probed by groups of HASH_LINE_ITEMS consecutive hashes,
+	 * which all lie in the same CPU cacheline: we first scan the remaining
+	 * slots of the home group, wrapping around within the group, and only
+	 * then jump to another group, using the secondary hash as the distance
+	 * between groups.  The rationale is that comparing the hashes within a
+	 * cacheline is nearly free whereas each jump is likely to cause a cache
+	 * miss, hence the amount of "hops" we count is the amount of extra
+	 * groups we have to visit.
 	 */
 
 	inc = hash_compute_increment(hk, key, hv);
 	found = FALSE;
 	mask = hk->size - 1;		/* Size is power of two */
+	lmask = MIN(HASH_LINE_ITEMS, hk->size) - 1;
+	home = idx & ~lmask;
+	base = home;
+	step = ((size_t) inc * (lmask + 1)) & mask;
+	looped = FALSE;
+	hops = 0;
+	i = 1;						/* Home slot already probed */
 
 	/*
 	 * By design, the hash table can never become full because we're constantly
 	 * monitoring its size and resizing it as it grows past a high watermark.
 	 * Therefore, we know we have to end up on a free slot or a tomb.
 	 *
-	 * We may very well loop back to the original home slot though, meaning
-	 * the key was nowhere to be found.  We can't go back to the home slot
-	 * before we have been through all the other slots in the table since
-	 * the increment and the table size are prime with each other.
+	 * We may very well loop back to the original home group though, meaning
+	 * the key was nowhere to be found.  We can't go back to the home group
+	 * before we have been through all the other groups in the table since
+	 * the increment and the amount of groups are prime with each other.
 	 *
-	 * Here's the mathematical proof: let S be the table size (a power of 2)
-	 * and i be the increment (odd number).
+	 * Here's the mathematical proof: let S be the amount of groups (a power
+	 * of 2) and i be the increment (odd number).
 	 *
 	 * Lemma: S and i are prime together.
 	 * Proof: let d be a common divisor of S and i.  Since S is a power of 2,
@@ -658,41 +679,55 @@ hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
 	 *
 	 * Therefore, we have established the only k such that x + i*k = x (mod S)
 	 * is k = 0 (mod S).  We won't come back to x before having looped through
-	 * all the other slots first. QED
+	 * all the other groups first. QED
 	 *
 	 * Our proof does not depend on the value of x, the initial position, hence
-	 * we have demonstrated that the while loop below will either look at all
-	 * the slots or stop when it reaches a free slot.
+	 * we have demonstrated that the loop below will either look at all the
+	 * slots or stop when it reaches a free slot.
 	 */
 
-	hops = 1;
-	nidx = (idx + inc) & mask;
-	ih = hk->hashes[nidx];
+	for (;;) {
+		size_t next = (base + step) & mask;
+
+		G_PREFETCH_R(&hk->hashes[next]);
+
+		for (; i <= lmask; i++) {
+			nidx = base + ((idx + i) & lmask);
+			ih = hk->hashes[nidx];
+
+			if (HASH_IS_FREE(ih))
+				goto done;
 
-	while (!HASH_IS_FREE(ih) && nidx != idx) {
-		size_t aidx = (nidx + inc) & mask;
-		G_PREFETCH_R(&hk->hashes[aidx]);
-		if (ih == hv && hash_keyset_equals(hk, hk->keys[nidx], key)) {
-			found = TRUE;
+			if (ih == hv && hash_keyset_equals(hk, hk->keys[nidx], key)) {
+				found = TRUE;
+				goto done;
+			} else if ((size_t) -1 == first_tomb && HASH_IS_TOMB(ih)) {
+				first_tomb = nidx;
+			}
+		}
+
+		if G_UNLIKELY(next == home) {
+			looped = TRUE;
+			nidx = idx;
 			break;
-		} else if ((size_t) -1 == first_tomb && HASH_IS_TOMB(ih)) {
-			first_tomb = nidx;
 		}
-		nidx = aidx;
-		ih = hk->hashes[nidx];
+
+		base = next;
 		hops++;
+		i = 0;
 	}
 
+done:
 	G_PREFETCH_W(kidx);
 
 	/*
 	 * When lookups go through too many hops before ending, flag for a resizing
 	 * at the next opportunity.
 	 *
-	 * If we looped back to the initial index, it means the table is full...
+	 * If we looped back to the initial group, it means the table is full...
 	 */
 
-	if G_UNLIKELY(hops > hash_hops_max(hk) || nidx == idx)
+	if G_UNLIKELY(hops > hash_hops_max(hk) || looped)
 		hk->resize = TRUE;
 
 	if (tombidx != NULL)
@@ -44,7 +44,6 @@
 #include "htable.h"
 #include "log.h"			/* For log_file_printable() */
 #include "misc.h"
-#include "slist.h"
 #include "str.h"
 #include "stringify.h"
 #include "unsigned.h"
@@ -60,15 +59,17 @@ enum header_magic { HEADER_MAGIC = 0x71b8484fU };
  * with all continuations removed (leading spaces collapsed into one), and
  * indentical fields concatenated using ", " separators, per RFC2616.
  *
- * The `fields' field holds a list of all the fields, in the order they
- * appeared.  The value is a header_field_t structure.  It allows one to
- * dump the header exactly as it was read.
+ * The `lines' field accumulates all the lines, in the order they appeared,
+ * each field name being followed by ": " and its value, continuations being
+ * indented.  It allows one to dump the header as it was read, and is held
+ * in a single buffer to avoid allocating memory for each line parsed.
  */
 
 struct header {
 	enum header_magic magic;
 	htable_t *headers;			/**< Indexed by name (case-insensitively) */
-	slist_t *fields;			/**< Ordered list of header_field_t */
+	str_t *lines;				/**< All lines, NL-terminated, for dumping */
+	str_t *last;				/**< Value of last field, for continuations */
 	int flags;					/**< Various operating flags */
 	int size;					/**< Total header size, in bytes */
 	int num_lines;				/**< Total header lines seen */
@@ -83,40 +84,6 @@ header_check(const header_t * const h)
 	g_assert(h->refcnt > 0);
 }
 
-enum header_field { HEADER_FIELD_MAGIC = 0x6e29aad7U };
-
-/**
- * A header field.
- *
- * It holds the field name, and all the lines that make up that field.
- * The first line has the field name and the ":" stripped, as well as
- * all the leading spaces.  Continuations also have their leading spaces
- * stripped out.
- *
- * For instance, assume the following header field:
- *
- *    - X-Comment: first line
- *         and continuation of first line
- *
- * Then the structure would contain, with () denoting a list:
- *
- *    - name = "X-Comment"
- *    - lines = ("first line", "and continuation of first line")
- */
-
-typedef struct {
-	enum header_field magic;
-	char *name;					/**< Field name */
-	slist_t *lines;				/**< List of lines making this header */
-} header_field_t;
-
-static inline void
-header_field_check(const header_field_t * const hf)
-{
-	g_assert(hf != NULL);
-	g_assert(HEADER_FIELD_MAGIC == hf->magic);
-}
-
 /***
  *** Operating flags
  ***/
@@ -160,106 +127,30 @@ header_num_lines(const header_t *h)
 	return h->num_lines;
 }
 
-/***
- *** header_field object
- ***/
-
-/**
- * Create a new empty header field, whose name is `name'.
- * A private copy of `name' is done.
- */
-static header_field_t *
-hfield_make(const char *name)
-{
-	header_field_t *h;
-
-	WALLOC0(h);
-	h->magic = HEADER_FIELD_MAGIC;
-	h->name = h_strdup(name);
-
-	return h;
-}
-
-static void
-hfield_free_item(void *p)
-{
-	HFREE_NULL(p);
-}
-
 /**
- * Dispose of the header field.
+ * Dump header line on specified file, flagging non-printable bytes.
  */
 static void
-hfield_free(header_field_t *h)
+header_dump_line(FILE *out, const char *s, size_t len)
 {
-	header_field_check(h);
-
-	slist_free_all(&h->lines, hfield_free_item);
-	HFREE_NULL(h->name);
-	h->magic = 0;
-	WFREE(h);
-}
-
-/**
- * Append line of text to given header field.
- * A private copy of the data is made.
- */
-static void
-hfield_append(header_field_t *h, const char *text)
-{
-	header_field_check(h);
-
-	if (!h->lines) {
-		h->lines = slist_new();
-	}
-	slist_append(h->lines, h_strdup(text));
-}
-
-/**
- * Dump field on specified file descriptor.
- */
-static void
-hfield_dump(const header_field_t *h, FILE *out)
-{
-	slist_iter_t *iter;
-	bool first;
-
-	header_field_check(h);
-	g_assert(h->lines);
-
-	fprintf(out, "%s: ", h->name);
-
-	first = TRUE;
-	iter = slist_iter_on_head(h->lines);
-	for (/* NOTHING */; slist_iter_has_item(iter); slist_iter_next(iter)) {
-		const char *s;
-
-		if (first)
-			first = FALSE;
-		else
-			fputs("    ", out);			/* Continuation line */
-
-		s = slist_iter_current(iter);
-		if (is_printable_iso8859_string(s)) {
-			fputs(s, out);
-		} else {
-			char buf[80];
-			const char *p = s;
-			int c;
-			size_t len = vstrlen(s);
-			str_bprintf(ARYLEN(buf), "<%u non-printable byte%s>",
-				(unsigned) len, plural(len));
-			fputs(buf, out);
-			while ((c = *p++)) {
-				if (is_ascii_print(c) || is_ascii_space(c))
-					fputc(c, out);
-				else
-					fputc('.', out);	/* Less visual clutter than '?' */
-			}
+	if (is_printable_iso8859_string(s)) {
+		fputs(s, out);
+	} else {
+		char buf[80];
+		const char *p = s;
+		int c;
+
+		str_bprintf(ARYLEN(buf), "<%u non-printable byte%s>",
+			(unsigned) len, plural(len));
+		fputs(buf, out);
+		while ((c = *p++)) {
+			if (is_ascii_print(c) || is_ascii_space(c))
+				fputc(c, out);
+			else
+				fputc('.', out);	/* Less visual clutter than '?' */
 		}
-		fputc('\n', out);
 	}
-	slist_iter_free(&iter);
+	fputc('\n', out);
 }
 
 /***
@@ -366,7 +257,8 @@ header_reset(header_t *o)
 		htable_foreach_remove(o->headers, free_header_data, NULL);
 		htable_free_null(&o->headers);
 	}
-	slist_free_all(&o->fields, cast_to_free_fn(hfield_free));
+	str_destroy_null(&o->lines);
+	o->last = NULL;
 	o->flags = o->size = o->num_lines = 0;
 }
 
@@ -416,6 +308,31 @@ header_get_extended(const header_t *o, const char *field, size_t *len_ptr)
 	return str_2c(v);
 }
 
+/**
+ * Record line in the `lines' buffer used for dumping.
+ *
+ * @param o			the header object
+ * @param prefix	the field name for a new field, NULL for a continuation
+ * @param text		the text of the line, leading spaces stripped
+ */
+static void
+add_line(header_t *o, const char *prefix, const char *text)
+{
+	header_check(o);
+
+	if (NULL == o->lines)
+		o->lines = str_new(HEAD_MAX_SIZE / 4);
+
+	if (prefix != NULL) {
+		str_cat(o->lines, prefix);
+		STR_CAT(o->lines, ": ");
+	} else {
+		STR_CAT(o->lines, "    ");
+	}
+	str_cat(o->lines, text);
+	str_putc(o->lines, '\n');
+}
+
 /**
  * Add header line to the `headers' hash for specified field name.
  * A private copy of the `field' name and of the `text' data is made.
@@ -450,24 +367,22 @@ add_header(header_t *o, const char *field, const char *text)
 		v = str_new_from(text);
 		htable_insert(ht, key, v);
 	}
+
+	o->last = v;
 }
 
 /**
- * Add continuation line to the `headers' hash for specified field name.
+ * Add continuation line to the value of the last field seen.
  * A private copy of the data is made.
  */
 static void
-add_continuation(header_t *o, const char *field, const char *text)
+add_continuation(header_t *o, const char *text)
 {
-	str_t *v;
-
 	header_check(o);
-	g_assert(o->headers);
+	g_assert(o->last != NULL);
 
-	v = htable_lookup(o->headers, field);
-	g_assert(v != NULL);
-	str_putc(v, ' ');
-	str_cat(v, text);
+	str_putc(o->last, ' ');
+	str_cat(o->last, text);
 }
 
 /**
@@ -482,7 +397,6 @@ header_append(header_t *o, const char *text, int len)
 	char buf[MAX_LINE_SIZE];
 	const char *p = text;
 	uchar c;
-	header_field_t *hf;
 
 	header_check(o);
 	g_assert(len >= 0);
@@ -523,7 +437,7 @@ header_append(header_t *o, const char *text, int len)
 		 * an unexpected continuation line.
 		 */
 
-		if (NULL == o->fields)
+		if (NULL == o->last)
 			return HEAD_CONTINUATION;		/* Unexpected continuation */
 
 		/*
@@ -561,15 +475,10 @@ header_append(header_t *o, const char *text, int len)
 		 * field we handled.
 		 */
 
-		hf = slist_tail(o->fields);
-		hfield_append(hf, p);
-		add_continuation(o, hf->name, p);
+		add_line(o, NULL, p);
+		add_continuation(o, p);
 		o->size += len - (p - text);	/* Count only effective text */
 
-		/*
-		 * Also append the data in the hash table.
-		 */
-
 	} else {
 		char *b;
 		bool seen_space = FALSE;
@@ -622,11 +531,6 @@ header_append(header_t *o, const char *text, int len)
 
 		/*
 		 * We have a valid header field in buf[].
-		 */
-
-		hf = hfield_make(buf);
-
-		/*
 		 * Strip leading spaces in the value.
 		 */
 
@@ -639,24 +543,14 @@ header_append(header_t *o, const char *text, int len)
 		 * Record field value.
 		 */
 
-		hfield_append(hf, p);
+		add_line(o, buf, p);
 		add_header(o, buf, p);
-		if (!o->fields) {
-			o->fields = slist_new();
-		}
-		slist_append(o->fields, hf);
 		o->size += len - (p - text);	/* Count only effective text */
 	}
 
 	return HEAD_OK;
 }
 
-static void
-header_dump_item(void *p, void *user_data)
-{
-	hfield_dump(p, user_data);
-}
-
 /**
  * Dump whole header on specified file, followed by trailer string
  * (if not NULL) and a final "\n".
@@ -669,8 +563,16 @@ header_dump(FILE *out, const header_t *o, const char *trailer)
 	if (!log_file_printable(out))
 		return;
 
-	if (o->fields) {
-		slist_foreach(o->fields, header_dump_item, out);
+	if (o->lines != NULL) {
+		char *s = str_2c(o->lines);
+		char *nl;
+
+		while (NULL != (nl = strchr(s, '\n'))) {
+			*nl = '\0';
+			header_dump_line(out, s, nl - s);
+			*nl = '\n';
+			s = nl + 1;
+		}
 	}
 	if (trailer)
 		fprintf(out, "%s\n", trailer);
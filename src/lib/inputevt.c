@@ -66,6 +66,7 @@
 #undef HAS_EPOLL
 #undef HAS_KQUEUE
 #undef HAS_DEV_POLL
+#undef HAS_IO_URING
 
 /* The following lines are for test-compiling without MINGW */
 #if 0 && !defined(MINGW32)
@@ -106,8 +107,14 @@ typedef struct {
 #include <sys/devpoll.h>
 #endif /* HAS_DEV_POLL */
 
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif /* HAS_IO_URING */
+
 #include "inputevt.h"
 
+#include "atomic.h"
 #include "bit_array.h"
 #include "compat_poll.h"
 #include "fd.h"
@@ -121,9 +128,11 @@ typedef struct {
 #include "plist.h"
 #include "pslist.h"
 #include "stacktrace.h"
+#include "stall.h"
 #include "stringify.h"
 #include "thread.h"			/* For thread_in_syscall_set() */
 #include "tm.h"
+#include "vmm.h"
 #include "walloc.h"
 #include "xmalloc.h"
 
@@ -239,6 +248,11 @@ struct poll_ctx {
 	struct epoll_event *ep_arr;
 #endif	/* HAS_EPOLL */
 
+#ifdef HAS_IO_URING
+	struct uring *ur;
+	struct event *ur_ev;
+#endif	/* HAS_IO_URING */
+
 	struct pollfd *pfd_arr;
 
 	/**
@@ -251,6 +265,7 @@ struct poll_ctx {
 	struct event (*event_get)(const struct poll_ctx *, unsigned);
 	int (*event_set_mask)(struct poll_ctx *, int,
 			inputevt_cond_t, inputevt_cond_t);
+	int (*event_flush)(struct poll_ctx *);	/* optional, after dispatching */
 };
 
 /*
@@ -546,6 +561,316 @@ event_check_all_with_epoll(struct poll_ctx *ctx)
 }
 #endif	/* HAS_EPOLL */
 
+#ifdef HAS_IO_URING
+/*
+ * Polling through io_uring.
+ *
+ * File descriptors are monitored with one-shot poll requests: a completion
+ * reports the readiness of one descriptor, whose poll request is re-armed
+ * once the events have been dispatched, which gives the level-triggered
+ * semantics the I/O callbacks expect.
+ *
+ * The poll requests queued whilst dispatching, to re-arm descriptors or
+ * because callbacks changed the conditions they monitor, are submitted all at
+ * once by a single system call at the end of the dispatching, whereas epoll
+ * requires one epoll_ctl() for each change.  Completions are read from the
+ * ring shared with the kernel, without any system call.
+ *
+ * The ring descriptor becomes readable when completions are pending, so it
+ * is given to the main loop the same way the epoll descriptor is.
+ */
+
+#define URING_ENTRIES	1024			/**< Submission queue size */
+#define URING_REMOVE	(1ULL << 63)	/**< Tags poll removal requests */
+
+/**
+ * State of a file descriptor.
+ */
+struct uring_fd {
+	uint32 gen;					/**< Generation of last poll request */
+	uint16 armed;				/**< Events of pending poll request */
+	uint8 cond;					/**< Conditions being monitored */
+};
+
+/**
+ * An io_uring instance.
+ */
+struct uring {
+	uint32 *sq_head;			/**< Consumed by the kernel */
+	uint32 *sq_tail;			/**< Produced by us */
+	uint32 *sq_array;			/**< Indices in sqes[] */
+	uint32 sq_mask;
+	uint32 sq_entries;
+	uint32 *cq_head;			/**< Consumed by us */
+	uint32 *cq_tail;			/**< Produced by the kernel */
+	uint32 cq_mask;
+	struct io_uring_sqe *sqes;	/**< Submission queue entries */
+	struct io_uring_cqe *cqes;	/**< Completion queue entries */
+	void *ring;					/**< Mapped submission and completion rings */
+	size_t ring_size;
+	size_t sqes_size;
+	struct uring_fd *fds;		/**< Indexed by file descriptor */
+	uint nfds;					/**< Length of fds[] */
+};
+
+static inline uint64
+uring_poll_data(int fd, uint32 gen)
+{
+	return ((uint64) gen << 32) | (uint32) fd;
+}
+
+/**
+ * Submit all the queued requests to the kernel.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+uring_submit(struct poll_ctx *ctx)
+{
+	struct uring *ur = ctx->ur;
+
+	for (;;) {
+		uint32 pending;
+		int r;
+
+		atomic_mb();
+		pending = *ur->sq_tail - *ur->sq_head;
+
+		if (0 == pending)
+			return 0;
+
+		r = syscall(__NR_io_uring_enter, ctx->master_fd, pending, 0, 0,
+				NULL, 0);
+
+		if (-1 == r) {
+			if (EINTR == errno)
+				continue;
+			return -1;		/* EAGAIN or EBUSY: will retry on next dispatch */
+		}
+
+		if G_UNLIKELY(0 == r) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+}
+
+/**
+ * Get a free submission queue entry, submitting queued requests if the
+ * queue is full.
+ *
+ * @return the entry, to be committed with uring_sqe_commit(), NULL on error.
+ */
+static struct io_uring_sqe *
+uring_sqe_get(struct poll_ctx *ctx)
+{
+	struct uring *ur = ctx->ur;
+	struct io_uring_sqe *sqe;
+	uint32 idx;
+
+	atomic_mb();
+
+	if G_UNLIKELY(*ur->sq_tail - *ur->sq_head >= ur->sq_entries) {
+		if (-1 == uring_submit(ctx))
+			return NULL;
+	}
+
+	idx = *ur->sq_tail & ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	ZERO(sqe);
+	ur->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+static inline void
+uring_sqe_commit(struct uring *ur)
+{
+	atomic_mb();		/* Entry must be visible before the new tail */
+	(*ur->sq_tail)++;
+}
+
+/**
+ * Queue a poll request for the file descriptor, on its monitored conditions.
+ */
+static int
+uring_poll_add(struct poll_ctx *ctx, int fd, struct uring_fd *uf)
+{
+	struct io_uring_sqe *sqe = uring_sqe_get(ctx);
+	uint16 events = 0;
+
+	if G_UNLIKELY(NULL == sqe)
+		return -1;
+
+	if (INPUT_EVENT_R & uf->cond)
+		events |= POLLIN | POLLPRI;
+	if (INPUT_EVENT_W & uf->cond)
+		events |= POLLOUT;
+
+	uf->gen++;
+	uf->armed = events;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = events;
+	sqe->user_data = uring_poll_data(fd, uf->gen);
+	uring_sqe_commit(ctx->ur);
+
+	return 0;
+}
+
+static struct event
+event_get_with_uring(const struct poll_ctx *ctx, unsigned idx)
+{
+	g_assert(CTX_IS_LOCKED(ctx));
+
+	return ctx->ur_ev[idx];
+}
+
+static int
+event_set_mask_with_uring(struct poll_ctx *ctx, int fd,
+	inputevt_cond_t old, inputevt_cond_t cur)
+{
+	struct uring *ur = ctx->ur;
+	struct uring_fd *uf;
+
+	g_assert(CTX_IS_LOCKED(ctx));
+	g_assert(fd >= 0);
+
+	old &= INPUT_EVENT_RW;
+	cur &= INPUT_EVENT_RW;
+	if (cur == old)
+		return 0;
+
+	if G_UNLIKELY(UNSIGNED(fd) >= ur->nfds) {
+		uint n = MAX(ur->nfds * 2, UNSIGNED(fd) + 1);
+
+		n = MAX(n, 64);
+		XREALLOC_ARRAY(ur->fds, n);
+		memset(&ur->fds[ur->nfds], 0, (n - ur->nfds) * sizeof ur->fds[0]);
+		ur->nfds = n;
+	}
+
+	uf = &ur->fds[fd];
+	uf->cond = cur;
+
+	if (uf->armed != 0) {
+		struct io_uring_sqe *sqe = uring_sqe_get(ctx);
+
+		if G_UNLIKELY(NULL == sqe)
+			return -1;
+
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = uring_poll_data(fd, uf->gen);
+		sqe->user_data = URING_REMOVE;
+		uring_sqe_commit(ur);
+		uf->armed = 0;
+	}
+
+	if (cur != 0 && -1 == uring_poll_add(ctx, fd, uf))
+		return -1;
+
+	/*
+	 * Changes made whilst dispatching are submitted at the end of the
+	 * dispatching, by event_flush_with_uring().
+	 */
+
+	return ctx->dispatching ? 0 : uring_submit(ctx);
+}
+
+static int
+event_check_all_with_uring(struct poll_ctx *ctx)
+{
+	struct uring *ur = ctx->ur;
+	uint32 head, tail;
+	int n = 0;
+
+	g_assert(ctx);
+	g_assert(ctx->initialized);
+	g_assert(CTX_IS_LOCKED(ctx));
+
+	(void) uring_submit(ctx);
+
+	head = *ur->cq_head;
+	tail = *ur->cq_tail;
+	atomic_mb();		/* Read entries only after reading the tail */
+
+	for (/**/; head != tail && UNSIGNED(n) < ctx->num_ev; head++) {
+		const struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+		int fd = (int) (uint32) cqe->user_data;
+		struct uring_fd *uf;
+		struct event *ev;
+
+		if (URING_REMOVE & cqe->user_data)
+			continue;
+
+		if G_UNLIKELY(UNSIGNED(fd) >= ur->nfds)
+			continue;
+
+		/*
+		 * Ignore completions of poll requests that were removed since,
+		 * which are reported as cancelled.
+		 */
+
+		uf = &ur->fds[fd];
+
+		if (0 == uf->armed || uf->gen != (uint32) (cqe->user_data >> 32))
+			continue;
+
+		uf->armed = 0;
+		ev = &ctx->ur_ev[n++];
+		ev->fd = fd;
+		ev->data_available = 0;
+
+		if G_UNLIKELY(cqe->res < 0) {
+			ev->condition = INPUT_EVENT_EXCEPTION;
+			continue;
+		}
+
+		ev->condition =
+			((POLLIN | POLLPRI | POLLHUP) & cqe->res ? INPUT_EVENT_R : 0)
+			| (POLLOUT & cqe->res ? INPUT_EVENT_W : 0)
+			| ((POLLERR | POLLNVAL) & cqe->res ? INPUT_EVENT_EXCEPTION : 0);
+
+		/* Re-armed now, submitted after the events have been processed */
+		(void) uring_poll_add(ctx, fd, uf);
+	}
+
+	atomic_mb();		/* Entries must be read before releasing them */
+	*ur->cq_head = head;
+
+	return n;
+}
+
+static int
+event_flush_with_uring(struct poll_ctx *ctx)
+{
+	g_assert(CTX_IS_LOCKED(ctx));
+
+	return uring_submit(ctx);
+}
+
+/**
+ * Release io_uring resources.
+ */
+static void
+uring_free_null(struct uring **ur_ptr)
+{
+	struct uring *ur = *ur_ptr;
+
+	if (ur != NULL) {
+		if (ur->ring != NULL)
+			vmm_munmap(ur->ring, ur->ring_size);
+		if (ur->sqes != NULL)
+			vmm_munmap(ur->sqes, ur->sqes_size);
+		XFREE_NULL(ur->fds);
+		WFREE(ur);
+		*ur_ptr = NULL;
+	}
+}
+#endif	/* HAS_IO_URING */
+
 #ifdef HAS_DEV_POLL
 static int
 event_set_mask_with_dev_poll(struct poll_ctx *ctx, int fd,
@@ -993,7 +1318,11 @@ inputevt_handle(const struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
 			continue;
 
 		if (condition & relay->condition) {
+			const void *fn = func_to_pointer(relay->handler);
+			tm_t start;
+
 			data_available = 0;		/* FIXME: not thread-safe */
+			tm_now_exact(&start);
 
 			if G_UNLIKELY(inputevt_trace) {
 				void *handler = relay->handler;
@@ -1008,6 +1337,8 @@ inputevt_handle(const struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
 			} else {
 				relay->handler(relay->data, fd, condition);
 			}
+
+			stall_account(STALL_SRC_IO, fn, &start);
 		}
 	}
 }
@@ -1116,6 +1447,14 @@ inputevt_timer(struct poll_ctx *ctx)
 
 	ctx->dispatching = FALSE;
 
+	if (ctx->event_flush != NULL) {
+		if (-1 == (*ctx->event_flush)(ctx) && !is_temporary_error(errno)) {
+			s_warning("%s(): event_flush(%d) failed with %s(): %m",
+				G_STRFUNC, ctx->master_fd,
+				stacktrace_function_name(ctx->event_flush));
+		}
+	}
+
 	if (ctx->removed) {
 		inputevt_purge_removed(ctx);
 	}
@@ -1321,6 +1660,10 @@ inputevt_add_source(struct poll_ctx *ctx, inputevt_relay_t *relay, uint id)
 		XREALLOC_ARRAY(ctx->ep_arr, ctx->num_ev);
 #endif
 
+#ifdef HAS_IO_URING
+		XREALLOC_ARRAY(ctx->ur_ev, ctx->num_ev);
+#endif
+
 		XREALLOC_ARRAY(ctx->pfd_arr, ctx->num_ev);
 
 		for (i = n; i < ctx->num_ev; i++) {
@@ -1502,6 +1845,90 @@ init_with_devpoll(struct poll_ctx *ctx)
 }
 #endif	/* HAS_DEV_POLL */
 
+static int
+init_with_uring(struct poll_ctx *ctx)
+#ifdef HAS_IO_URING
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	int fd;
+
+	g_assert(CTX_IS_LOCKED(ctx));
+
+	ZERO(&p);
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+
+	if (!is_valid_fd(fd)) {
+		/* Kernel may be too old or io_uring disabled by the administrator */
+		if (ENOSYS != errno && EPERM != errno)
+			s_warning("%s(): io_uring_setup() failed: %m", G_STRFUNC);
+		return -1;
+	}
+
+	/*
+	 * We need the rings to be mapped at once and the kernel to never drop
+	 * completions when the completion queue is full, lest we lose events.
+	 */
+
+	if (
+		0 == (p.features & IORING_FEAT_SINGLE_MMAP) ||
+		0 == (p.features & IORING_FEAT_NODROP)
+	) {
+		fd_close(&fd);
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	WALLOC0(ur);
+	ur->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(uint32),
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ur->ring = vmm_mmap(NULL, ur->ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ur->sqes = vmm_mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (MAP_FAILED == ur->ring || MAP_FAILED == ur->sqes) {
+		s_warning("%s(): cannot map io_uring queues: %m", G_STRFUNC);
+		if (MAP_FAILED == ur->ring)
+			ur->ring = NULL;
+		if (MAP_FAILED == ur->sqes)
+			ur->sqes = NULL;
+		uring_free_null(&ur);
+		fd_close(&fd);
+		return -1;
+	}
+
+	ur->sq_head    = ptr_add_offset(ur->ring, p.sq_off.head);
+	ur->sq_tail    = ptr_add_offset(ur->ring, p.sq_off.tail);
+	ur->sq_array   = ptr_add_offset(ur->ring, p.sq_off.array);
+	ur->sq_mask    = *(uint32 *) ptr_add_offset(ur->ring, p.sq_off.ring_mask);
+	ur->sq_entries = p.sq_entries;
+	ur->cq_head    = ptr_add_offset(ur->ring, p.cq_off.head);
+	ur->cq_tail    = ptr_add_offset(ur->ring, p.cq_off.tail);
+	ur->cq_mask    = *(uint32 *) ptr_add_offset(ur->ring, p.cq_off.ring_mask);
+	ur->cqes       = ptr_add_offset(ur->ring, p.cq_off.cqes);
+
+	g_main_context_set_poll_func(NULL, default_poll_func);
+	ctx->ur = ur;
+	ctx->master_fd = fd;
+	ctx->polling_method = "io_uring";
+	ctx->collect_events = NULL; /* master fd can be polled */
+	ctx->event_check_all = event_check_all_with_uring;
+	ctx->event_get = event_get_with_uring;
+	ctx->event_set_mask = event_set_mask_with_uring;
+	ctx->event_flush = event_flush_with_uring;
+	return 0;
+}
+#else
+{
+	(void) ctx;
+	errno = ENOTSUP;
+	return -1;
+}
+#endif	/* HAS_IO_URING */
+
 static int
 init_with_epoll(struct poll_ctx *ctx)
 #ifdef HAS_EPOLL
@@ -1546,6 +1973,7 @@ init_with_poll(struct poll_ctx *ctx)
 	ctx->event_check_all = event_check_all_with_poll;
 	ctx->event_get = event_get_with_poll;
 	ctx->event_set_mask = event_set_mask_with_poll;
+	ctx->event_flush = NULL;
 
 #ifdef MINGW32
 	if (!mingw_has_wsapoll()) {
@@ -1568,7 +1996,8 @@ inputevt_thread_id(void)
 
 /**
  * Performs module initialization.
- * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ * @param use_poll If TRUE, kqueue(), io_uring, epoll(), /dev/poll etc. won't
+ * be used.
  */
 void
 inputevt_init(int use_poll)
@@ -1597,8 +2026,10 @@ inputevt_init(int use_poll)
 
 	if (!use_poll) {
 		if (init_with_kqueue(ctx)) {
-			if (init_with_epoll(ctx)) {
-				init_with_devpoll(ctx);
+			if (init_with_uring(ctx)) {
+				if (init_with_epoll(ctx)) {
+					init_with_devpoll(ctx);
+				}
 			}
 		}
 	}
@@ -1760,6 +2191,10 @@ inputevt_close(void)
 	HFREE_NULL(ctx->used_event_id);
 	XFREE_NULL(ctx->relay);
 	XFREE_NULL(ctx->pfd_arr);
+#ifdef HAS_IO_URING
+	XFREE_NULL(ctx->ur_ev);
+	uring_free_null(&ctx->ur);
+#endif
 	fd_close(&ctx->master_fd);
 	ctx->initialized = FALSE;
 
@@ -39,12 +39,17 @@
 
 #include "common.h"
 
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
 #include "host_addr.h"
+#include "hstrfn.h"
 #include "iprange.h"
 #include "misc.h"			/* For bitcmp() */
 #include "parse.h"
 #include "sorted_array.h"
 #include "stringify.h"
+#include "vmm.h"
 #include "walloc.h"
 
 #include "override.h"		/* Must be the last header included */
@@ -53,6 +58,9 @@ enum iprange_db_magic {
    	IPRANGE_DB_MAGIC = 0x01b3a59e
 };
 
+#define IPRANGE_IDX4_BITS	12		/**< Leading bits indexed for IPv4 */
+#define IPRANGE_IDX4_SLOTS	(1U << IPRANGE_IDX4_BITS)
+
 /**
  * A CIDR network description for IPv4 addresses.
  */
@@ -78,10 +86,32 @@ struct iprange_db {
 	enum iprange_db_magic magic;	/**< Magic number */
 	struct sorted_array *tab4;		/**< IPv4 */
 	struct sorted_array *tab6;		/**< IPv6 */
+	uint32 *idx4;					/**< IPv4 index, by leading bits */
+	void *map;						/**< Mapped file, if loaded from file */
+	size_t mapsize;					/**< Size of mapped file */
 	unsigned tab4_unsorted:1;
 	unsigned tab6_unsorted:1;
 };
 
+#define IPRANGE_FILE_MAGIC	"GTKGIPR1"	/**< File magic, 8 bytes */
+#define IPRANGE_FILE_ENDIAN	0x01020304U	/**< Endianness check */
+
+/**
+ * Header of a compiled database file, written in native order.
+ *
+ * It is followed by the IPv4 index, if any, then by the IPv4 and IPv6
+ * network arrays, which are therefore suitably aligned.
+ */
+struct iprange_file_header {
+	char magic[8];					/**< IPRANGE_FILE_MAGIC */
+	uint32 endian;					/**< IPRANGE_FILE_ENDIAN */
+	uint16 size4;					/**< sizeof(struct iprange_net4) */
+	uint16 size6;					/**< sizeof(struct iprange_net6) */
+	uint64 stamp;					/**< Caller-defined validity stamp */
+	uint32 count4;					/**< Amount of IPv4 networks */
+	uint32 count6;					/**< Amount of IPv6 networks */
+};
+
 static inline void
 iprange_db_check(const struct iprange_db * const idb)
 {
@@ -116,8 +146,10 @@ void
 iprange_reset_ipv4(struct iprange_db *idb)
 {
 	iprange_db_check(idb);
+	g_assert(NULL == idb->map);		/* Read-only if loaded from file */
 
 	sorted_array_free(&idb->tab4);
+	HFREE_NULL(idb->idx4);
 	idb->tab4 = sorted_array_new(sizeof(struct iprange_net4), iprange_net4_cmp);
 	idb->tab4_unsorted = FALSE;
 }
@@ -129,6 +161,7 @@ void
 iprange_reset_ipv6(struct iprange_db *idb)
 {
 	iprange_db_check(idb);
+	g_assert(NULL == idb->map);		/* Read-only if loaded from file */
 
 	sorted_array_free(&idb->tab6);
 	idb->tab6 = sorted_array_new(sizeof(struct iprange_net6), iprange_net6_cmp);
@@ -150,6 +183,19 @@ iprange_new(void)
 	return idb;
 }
 
+/**
+ * Release a mapped database file.
+ */
+static void
+iprange_unmap(void *p, size_t size)
+{
+#ifdef HAS_MMAP
+	vmm_munmap(p, size);
+#else
+	vmm_free(p, size);
+#endif
+}
+
 /**
  * Destroy the database.
  *
@@ -165,6 +211,11 @@ iprange_free(struct iprange_db **idb_ptr)
 		iprange_db_check(idb);
 		sorted_array_free(&idb->tab4);
 		sorted_array_free(&idb->tab6);
+		if (idb->map != NULL) {
+			iprange_unmap(idb->map, idb->mapsize);
+		} else {
+			HFREE_NULL(idb->idx4);
+		}
 		WFREE(idb);
 		*idb_ptr = NULL;
 	}
@@ -186,6 +237,41 @@ iprange_get(const struct iprange_db *idb, uint32 ip)
 
 	iprange_db_check(idb);
 
+	/*
+	 * When the index is available, it gives us the slice of the array
+	 * where the network holding the address can be, and we can then
+	 * look for the last network starting at or before the address within
+	 * that slice, without going through the generic comparison routine.
+	 */
+
+	if (idb->idx4 != NULL) {
+		const struct iprange_net4 *base;
+		size_t bucket = ip >> (32 - IPRANGE_IDX4_BITS);
+		size_t lo = idb->idx4[bucket], hi = idb->idx4[bucket + 1] + 1;
+		size_t n = sorted_array_count(idb->tab4);
+
+		hi = MIN(hi, n);
+
+		if (lo >= hi)
+			return 0;
+
+		base = sorted_array_item(idb->tab4, 0);
+
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (base[mid].ip <= ip)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		base += lo;
+
+		return (ip & cidr_to_netmask(base->bits)) == base->ip ?
+			base->value : 0;
+	}
+
 	key.ip = ip;
 	key.bits = 32;
 	item = sorted_array_lookup(idb->tab4, &key);
@@ -351,6 +437,41 @@ iprange_net6_collision(const void *p, const void *q)
 	return CMP(b->bits, a->bits);		/* Reversed comparison */
 }
 
+/**
+ * Build the IPv4 index.
+ *
+ * Networks in the sorted array do not overlap, so both their first and
+ * their last addresses are increasing.  For each possible value of the
+ * IPRANGE_IDX4_BITS leading address bits, we record the index of the first
+ * network ending at or after the start of the corresponding address slice.
+ */
+static void
+iprange_index4(struct iprange_db *idb)
+{
+	size_t i, j, n;
+	const struct iprange_net4 *base;
+
+	HFREE_NULL(idb->idx4);
+
+	n = sorted_array_count(idb->tab4);
+	if (0 == n)
+		return;
+
+	HALLOC_ARRAY(idb->idx4, IPRANGE_IDX4_SLOTS + 1);
+	base = sorted_array_item(idb->tab4, 0);
+
+	for (i = 0, j = 0; i < IPRANGE_IDX4_SLOTS; i++) {
+		uint32 start = i << (32 - IPRANGE_IDX4_BITS);
+
+		while (j < n && (base[j].ip | ~cidr_to_netmask(base[j].bits)) < start)
+			j++;
+
+		idb->idx4[i] = j;
+	}
+
+	idb->idx4[IPRANGE_IDX4_SLOTS] = n;
+}
+
 /**
  * This function must be called after iprange_add_cidr() to make the
  * changes effective. As this function is costly, it should not be
@@ -367,6 +488,7 @@ iprange_sync(struct iprange_db *idb)
 	if (idb->tab4_unsorted) {
 		sorted_array_sync(idb->tab4, iprange_net4_collision);
 		idb->tab4_unsorted = FALSE;
+		iprange_index4(idb);
 	}
 	if (idb->tab6_unsorted) {
 		sorted_array_sync(idb->tab6, iprange_net6_collision);
@@ -438,4 +560,204 @@ iprange_get_host_count4(const struct iprange_db *idb)
 	return hosts;
 }
 
+/**
+ * Save the database to a file, which can later be loaded back with
+ * iprange_load() at almost no cost.
+ *
+ * The file is written in native order and is therefore not meant to be
+ * shared between machines.  It is written atomically.
+ *
+ * @param idb	the IP range database, which must be synchronized
+ * @param path	the file to create
+ * @param stamp	a stamp identifying the data, checked at load time
+ *
+ * @return TRUE if the file was successfully written.
+ */
+bool
+iprange_save(const struct iprange_db *idb, const char *path, uint64 stamp)
+{
+	struct iprange_file_header h;
+	char *tmp;
+	FILE *f;
+	bool ok = FALSE;
+
+	iprange_db_check(idb);
+	g_assert(path != NULL);
+	g_assert(!idb->tab4_unsorted && !idb->tab6_unsorted);
+
+	tmp = h_strconcat(path, ".tmp", NULL_PTR);
+	f = file_fopen(tmp, "wb");
+	if (NULL == f)
+		goto done;
+
+	ZERO(&h);
+	memcpy(h.magic, IPRANGE_FILE_MAGIC, sizeof h.magic);
+	h.endian = IPRANGE_FILE_ENDIAN;
+	h.size4 = sizeof(struct iprange_net4);
+	h.size6 = sizeof(struct iprange_net6);
+	h.stamp = stamp;
+	h.count4 = sorted_array_count(idb->tab4);
+	h.count6 = sorted_array_count(idb->tab6);
+
+	if (1 != fwrite(&h, sizeof h, 1, f))
+		goto failed;
+
+	if (h.count4 != 0) {
+		g_assert(idb->idx4 != NULL);
+
+		if (
+			1 != fwrite(idb->idx4,
+					(IPRANGE_IDX4_SLOTS + 1) * sizeof idb->idx4[0], 1, f) ||
+			1 != fwrite(sorted_array_item(idb->tab4, 0),
+					h.count4 * h.size4, 1, f)
+		)
+			goto failed;
+	}
+
+	if (h.count6 != 0) {
+		if (1 != fwrite(sorted_array_item(idb->tab6, 0),
+				h.count6 * h.size6, 1, f))
+			goto failed;
+	}
+
+	if (0 != fclose(f)) {
+		f = NULL;
+		goto failed;
+	}
+
+	if (-1 == rename(tmp, path)) {
+		s_warning("%s(): cannot rename \"%s\": %m", G_STRFUNC, tmp);
+		unlink(tmp);
+	} else {
+		ok = TRUE;
+	}
+
+	goto done;
+
+failed:
+	s_warning("%s(): cannot write \"%s\": %m", G_STRFUNC, tmp);
+	if (f != NULL)
+		fclose(f);
+	unlink(tmp);
+
+done:
+	HFREE_NULL(tmp);
+	return ok;
+}
+
+/**
+ * Map a database file in memory.
+ *
+ * @return the start of the mapped file, NULL on error.
+ */
+static void *
+iprange_map(const char *path, size_t *size)
+{
+	filestat_t sb;
+	void *p = NULL;
+	int fd;
+
+	fd = file_open_missing(path, O_RDONLY);
+	if (-1 == fd)
+		return NULL;
+
+	if (-1 == fstat(fd, &sb) || !S_ISREG(sb.st_mode))
+		goto done;
+
+	if (UNSIGNED(sb.st_size) < sizeof(struct iprange_file_header))
+		goto done;
+
+	*size = sb.st_size;
+
+#ifdef HAS_MMAP
+	p = vmm_mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == p)
+		p = NULL;
+#else
+	p = vmm_alloc_not_leaking(*size);
+	if (UNSIGNED(read(fd, p, *size)) != *size) {
+		vmm_free(p, *size);
+		p = NULL;
+	}
+#endif	/* HAS_MMAP */
+
+done:
+	fd_forget_and_close(&fd);
+	return p;
+}
+
+/**
+ * Load a database saved by iprange_save().
+ *
+ * The file is memory-mapped and shared, so the database costs almost
+ * nothing to load and its pages are shared with all the processes mapping
+ * the same file.  The database is read-only: it cannot be reset nor can
+ * new networks be added to it.
+ *
+ * @param path	the file to load
+ * @param stamp	the expected stamp of the data
+ *
+ * @return the loaded database, NULL if the file is missing, corrupted
+ * or was not created with the same stamp.
+ */
+struct iprange_db *
+iprange_load(const char *path, uint64 stamp)
+{
+	const struct iprange_file_header *h;
+	struct iprange_db *idb;
+	const void *q;
+	size_t size = 0, len;
+	void *p;
+
+	g_assert(path != NULL);
+
+	p = iprange_map(path, &size);
+	if (NULL == p)
+		return NULL;
+
+	h = p;
+
+	if (
+		0 != memcmp(h->magic, IPRANGE_FILE_MAGIC, sizeof h->magic) ||
+		h->endian != IPRANGE_FILE_ENDIAN ||
+		h->size4 != sizeof(struct iprange_net4) ||
+		h->size6 != sizeof(struct iprange_net6) ||
+		h->stamp != stamp
+	)
+		goto failed;
+
+	len = sizeof *h + (size_t) h->count6 * h->size6;
+	if (h->count4 != 0) {
+		len += (IPRANGE_IDX4_SLOTS + 1) * sizeof(uint32) +
+			(size_t) h->count4 * h->size4;
+	}
+
+	if (len != size)
+		goto failed;
+
+	WALLOC0(idb);
+	idb->magic = IPRANGE_DB_MAGIC;
+	idb->map = p;
+	idb->mapsize = size;
+
+	q = const_ptr_add_offset(p, sizeof *h);
+
+	if (h->count4 != 0) {
+		idb->idx4 = deconstify_pointer(q);
+		q = const_ptr_add_offset(q, (IPRANGE_IDX4_SLOTS + 1) * sizeof(uint32));
+	}
+
+	idb->tab4 = sorted_array_new_readonly(h->size4,
+		iprange_net4_cmp, q, h->count4);
+	q = const_ptr_add_offset(q, (size_t) h->count4 * h->size4);
+	idb->tab6 = sorted_array_new_readonly(h->size6,
+		iprange_net6_cmp, q, h->count6);
+
+	return idb;
+
+failed:
+	iprange_unmap(p, size);
+	return NULL;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
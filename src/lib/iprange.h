@@ -60,6 +60,19 @@ void iprange_free(struct iprange_db **idb_ptr);
 void iprange_reset_ipv4(struct iprange_db *idb);
 void iprange_reset_ipv6(struct iprange_db *idb);
 
+/**
+ * Compute the validity stamp of a saved database from the status of the
+ * file out of which it was built.
+ */
+static inline uint64
+iprange_file_stamp(const filestat_t *sb)
+{
+	return ((uint64) sb->st_mtime << 32) ^ (uint64) sb->st_size;
+}
+
+bool iprange_save(const struct iprange_db *idb, const char *path, uint64 stamp);
+struct iprange_db *iprange_load(const char *path, uint64 stamp);
+
 unsigned iprange_get_item_count(const struct iprange_db *idb);
 unsigned iprange_get_item_count4(const struct iprange_db *idb);
 unsigned iprange_get_item_count6(const struct iprange_db *idb);
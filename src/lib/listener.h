@@ -140,6 +140,14 @@
  * the GUESS layer has to provide, plus the definition of the parameters that
  * will be passed to the callback.  And of course, the semantics of the
  * events triggered must be clearly known.
+ *
+ * When nobody listens, as is the case for all the GUI-oriented signals when
+ * running without a GUI, LISTENER_EMIT() costs a single test.  Emitters that
+ * need to compute the parameters of the callback can also check for
+ * LISTENER_NONE() first to skip that work entirely:
+ *
+ * if (LISTENER_NONE(guess_event))
+ *     return;
  */
 
 typedef pslist_t *listeners_t;
@@ -166,18 +174,29 @@ G_STMT_START {																\
 	spinunlock(lock);														\
 } G_STMT_END
 
+/*
+ * Checking for listeners is done without taking the lock: listeners are
+ * registered at initialization time, and missing an event whilst a listener
+ * is being concurrently added is harmless.
+ */
+#define LISTENER_NONE(signal)	(NULL == CAT2(signal,_listeners))
+
 #define LISTENER_EMIT(signal, params)										\
 G_STMT_START {																\
-	pslist_t *sl;												 			\
-	spinlock_t *lock = listener_get_lock(STRINGIFY(signal));				\
-	spinlock(lock);															\
-	for (sl = CAT2(signal,_listeners); sl != NULL; sl = pslist_next(sl)) {	\
-		CAT2(signal,_listener_t) fn;										\
-		g_assert(NULL != sl->data);	  										\
-		fn = (CAT2(signal,_listener_t)) cast_pointer_to_func(sl->data);		\
-		fn params;															\
+	if (!LISTENER_NONE(signal)) {											\
+		pslist_t *sl;														\
+		spinlock_t *lock = listener_get_lock(STRINGIFY(signal));			\
+		spinlock(lock);														\
+		for (																\
+			sl = CAT2(signal,_listeners); sl != NULL; sl = pslist_next(sl)	\
+		) {																	\
+			CAT2(signal,_listener_t) fn;									\
+			g_assert(NULL != sl->data);										\
+			fn = (CAT2(signal,_listener_t)) cast_pointer_to_func(sl->data);	\
+			fn params;														\
+		}																	\
+		spinunlock(lock);													\
 	}																		\
-	spinunlock(lock);														\
 } G_STMT_END
 
 #endif /* _listener_h_ */
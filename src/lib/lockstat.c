@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Lock contention statistics.
+ *
+ * Contention is tracked per locking site, i.e. the place in the code where
+ * a lock was requested and found busy, which is what we need to identify
+ * the code paths hurting us under load.
+ *
+ * Each site learns how long it is worth spinning before going to sleep,
+ * which is used by spinlock_loop(): a lock usually released quickly gets
+ * more spinning, whereas a lock held for long makes us sleep sooner.
+ * This is always active since it only involves the contended path.
+ *
+ * When enabled, we also record the amount of contentions, the waiting time
+ * with its distribution and, when SPINLOCK_DEBUG is defined, the last site
+ * that was holding the lock.
+ *
+ * Since this is used by the locking code itself, we cannot take any lock
+ * nor allocate any memory here: sites are kept in a fixed-size table where
+ * slots are claimed atomically, and statistics are updated atomically.
+ * When the table is full, new sites are simply not tracked.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "lockstat.h"
+
+#include "atomic.h"
+#include "hashing.h"
+#include "log.h"
+#include "pow2.h"
+#include "str.h"
+#include "stringify.h"
+#include "tm.h"
+#include "xmalloc.h"
+#include "xsort.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define LOCKSTAT_SITES		1024	/**< Must be a power of 2 */
+#define LOCKSTAT_PROBES		16		/**< Max probes in table */
+#define LOCKSTAT_BUCKETS	20		/**< Waiting time histogram buckets */
+#define LOCKSTAT_SPIN_MIN	10		/**< Minimum amount of spinning */
+#define LOCKSTAT_SPIN_MAX	2000	/**< Maximum amount of spinning */
+
+/**
+ * A locking site.
+ *
+ * Bucket i of the histogram counts waits lasting less than 2^i us (bucket 0
+ * is for waits under 1 us), the last bucket counting all the longer waits.
+ */
+struct lockstat_site {
+	const char *file;			/**< Locking site (static string) */
+	unsigned line;				/**< Line number in file */
+	enum lockstat_kind kind;	/**< Kind of lock */
+	unsigned spin;				/**< Learnt amount of spinning, 0 if none */
+	unsigned contentions;		/**< Amount of contentions recorded */
+	unsigned slept;				/**< Contentions that had to sleep */
+	unsigned max_us;			/**< Maximum waiting time */
+	AU64(wait_us);				/**< Total waiting time */
+	const char *holder_file;	/**< Last known holding site */
+	unsigned holder_line;
+	unsigned hist[LOCKSTAT_BUCKETS];
+};
+
+static struct lockstat_site lockstat_sites[LOCKSTAT_SITES];
+static bool lockstat_enabled;
+
+static const char *lockstat_kind_names[] = {
+	"spinlock",
+	"mutex",
+	"qlock",
+};
+
+static inline bool
+lockstat_site_is(const struct lockstat_site *ls,
+	enum lockstat_kind kind, const char *file, unsigned line)
+{
+	return ls->file == file && ls->line == line && ls->kind == kind;
+}
+
+/**
+ * Get the statistics record for a locking site, creating it if needed.
+ *
+ * Two threads racing to create the same site can end-up with two distinct
+ * records, which is harmless.
+ *
+ * @param kind		the kind of lock
+ * @param file		the file where the lock is requested (static string)
+ * @param line		the line where the lock is requested
+ *
+ * @return the record for the site, NULL if the table is full.
+ */
+lockstat_site_t *
+lockstat_site(enum lockstat_kind kind, const char *file, unsigned line)
+{
+	unsigned h, i;
+
+	if G_UNLIKELY(NULL == file)
+		return NULL;
+
+	h = pointer_hash_fast(file) + u32_hash(line) + kind;
+
+	for (i = 0; i < LOCKSTAT_PROBES; i++) {
+		struct lockstat_site *ls;
+		const char *f;
+
+		ls = &lockstat_sites[(h + i) & (LOCKSTAT_SITES - 1)];
+		f = atomic_ptr_get((void * const *) &ls->file);
+
+		if (NULL == f) {
+			if (!atomic_ptr_xchg_if_eq((void **) &ls->file, NULL,
+				deconstify_char(file))
+			)
+				continue;		/* Lost race to claim slot, probe further */
+
+			ls->line = line;
+			ls->kind = kind;
+			atomic_mb();
+			return ls;
+		}
+
+		if (lockstat_site_is(ls, kind, file, line))
+			return ls;
+	}
+
+	return NULL;
+}
+
+/**
+ * @return amount of spinning to do before sleeping at the locking site.
+ */
+unsigned
+lockstat_spin(const lockstat_site_t *ls, unsigned dflt)
+{
+	unsigned spin;
+
+	if G_UNLIKELY(NULL == ls)
+		return dflt;
+
+	spin = ls->spin;
+
+	return 0 == spin ? dflt : spin;
+}
+
+/**
+ * Adapt the amount of spinning for the locking site, after the lock was
+ * finally acquired.
+ *
+ * Like the glibc adaptive mutexes, we move the spinning amount towards
+ * twice the amount of spinning that was needed, by 1/8 of the difference.
+ * When we had to sleep, the lock is held for long periods so spinning
+ * is wasting CPU: the amount of spinning is then reduced by 1/8.
+ *
+ * Updates are not atomic, but losing some of them is harmless.
+ *
+ * @param ls		the locking site (may be NULL)
+ * @param dflt		default spinning amount
+ * @param used		amount of spinning that was done before acquiring
+ * @param slept		whether we had to sleep before acquiring
+ */
+void
+lockstat_adapt(lockstat_site_t *ls, unsigned dflt, unsigned used, bool slept)
+{
+	int spin;
+
+	if G_UNLIKELY(NULL == ls)
+		return;
+
+	spin = lockstat_spin(ls, dflt);
+
+	if (slept)
+		spin -= spin / 8;
+	else
+		spin += (2 * (int) used - spin) / 8;
+
+	spin = MAX(spin, LOCKSTAT_SPIN_MIN);
+	ls->spin = MIN(spin, LOCKSTAT_SPIN_MAX);
+}
+
+/**
+ * Start timing a contention.
+ *
+ * @return starting time in nanoseconds, 0 if statistics are not collected.
+ */
+uint64
+lockstat_start(void)
+{
+	tm_nano_t now;
+
+	if G_LIKELY(!lockstat_enabled)
+		return 0;
+
+	tm_precise_time(&now);
+	return (uint64) now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/**
+ * Record contention at locking site, once the lock was acquired.
+ *
+ * @param ls			the locking site (may be NULL)
+ * @param start			value returned by lockstat_start() before waiting
+ * @param slept			whether we had to sleep
+ * @param holder_file	the site holding the lock, NULL if unknown
+ * @param holder_line	the line holding the lock
+ */
+void
+lockstat_record(lockstat_site_t *ls, uint64 start, bool slept,
+	const char *holder_file, unsigned holder_line)
+{
+	tm_nano_t now;
+	uint64 end, us;
+	unsigned b, max;
+
+	if G_UNLIKELY(NULL == ls || 0 == start)
+		return;
+
+	tm_precise_time(&now);
+	end = (uint64) now.tv_sec * 1000000000UL + now.tv_nsec;
+	us = end > start ? (end - start) / 1000 : 0;
+
+	b = 0 == us ? 0 : highest_bit_set64(us) + 1;
+
+	atomic_uint_inc(&ls->contentions);
+	atomic_uint_inc(&ls->hist[MIN(b, LOCKSTAT_BUCKETS - 1)]);
+	AU64_ADD(&ls->wait_us, us);
+
+	if (slept)
+		atomic_uint_inc(&ls->slept);
+
+	us = MIN(us, MAX_INT_VAL(unsigned));
+
+	while ((max = atomic_uint_get(&ls->max_us)) < us) {
+		if (atomic_uint_xchg_if_eq(&ls->max_us, max, us))
+			break;
+	}
+
+	if (holder_file != NULL) {
+		ls->holder_file = holder_file;
+		ls->holder_line = holder_line;
+	}
+}
+
+/**
+ * @return whether contention statistics are collected.
+ */
+bool
+lockstat_is_enabled(void)
+{
+	return lockstat_enabled;
+}
+
+/**
+ * Turn collection of contention statistics on or off.
+ */
+void
+lockstat_enable(bool on)
+{
+	atomic_bool_set(&lockstat_enabled, on);
+}
+
+/**
+ * Clear all the collected statistics, keeping the learnt spinning amounts.
+ */
+void
+lockstat_reset(void)
+{
+	size_t i;
+
+	for (i = 0; i < N_ITEMS(lockstat_sites); i++) {
+		struct lockstat_site *ls = &lockstat_sites[i];
+
+		if (NULL == ls->file)
+			continue;
+
+		ls->contentions = ls->slept = ls->max_us = 0;
+		AU64_ZERO(&ls->wait_us);
+		ls->holder_file = NULL;
+		ls->holder_line = 0;
+		ZERO(&ls->hist);
+	}
+
+	atomic_mb();
+}
+
+/**
+ * qsort() callback to sort sites by decreasing total waiting time.
+ */
+static int
+lockstat_site_cmp(const void *a, const void *b)
+{
+	const struct lockstat_site * const *la = a, * const *lb = b;
+	uint64 wa = AU64_VALUE(&(*la)->wait_us), wb = AU64_VALUE(&(*lb)->wait_us);
+
+	return CMP(wb, wa);
+}
+
+/**
+ * Dump contention statistics to specified logging agent, the sites with
+ * the largest total waiting time coming first.
+ */
+void
+lockstat_dump_log(struct logagent *la, unsigned options)
+{
+	const struct lockstat_site **sites;
+	size_t i, n = 0;
+
+	(void) options;
+
+	XMALLOC_ARRAY(sites, N_ITEMS(lockstat_sites));
+
+	for (i = 0; i < N_ITEMS(lockstat_sites); i++) {
+		const struct lockstat_site *ls = &lockstat_sites[i];
+
+		if (ls->file != NULL && 0 != ls->contentions)
+			sites[n++] = ls;
+	}
+
+	xqsort(sites, n, sizeof sites[0], lockstat_site_cmp);
+
+	log_info(la, "LOCK contention statistics are %s, %zu site%s",
+		lockstat_enabled ? "on" : "off", n, plural(n));
+
+	for (i = 0; i < n; i++) {
+		const struct lockstat_site *ls = sites[i];
+		uint64 wait = AU64_VALUE(&ls->wait_us);
+		char hist[LOCKSTAT_BUCKETS * 16];
+		size_t b, off = 0;
+
+		log_info(la, "LOCK %s at %s:%u: count=%'u slept=%'u wait=%s us "
+			"avg=%'u us max=%'u us spin=%u",
+			lockstat_kind_names[ls->kind], ls->file, ls->line,
+			ls->contentions, ls->slept, uint64_to_string_grp(wait, TRUE),
+			(unsigned) (wait / ls->contentions), ls->max_us, ls->spin);
+
+		if (ls->holder_file != NULL) {
+			log_info(la, "LOCK     last held from %s:%u",
+				ls->holder_file, ls->holder_line);
+		}
+
+		hist[0] = '\0';
+
+		for (b = 0; b < N_ITEMS(ls->hist); b++) {
+			if (0 == ls->hist[b])
+				continue;
+			off += str_bprintf(&hist[off], sizeof hist - off, " %s%u:%u",
+				b + 1 == N_ITEMS(ls->hist) ? ">=" : "<",
+				b + 1 == N_ITEMS(ls->hist) ? 1U << (b - 1) : 1U << b,
+				ls->hist[b]);
+		}
+
+		log_info(la, "LOCK     wait us%s", hist);
+	}
+
+	XFREE_NULL(sites);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Lock contention statistics.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _lockstat_h_
+#define _lockstat_h_
+
+/**
+ * Kind of lock being contended.
+ */
+enum lockstat_kind {
+	LOCKSTAT_SPINLOCK = 0,
+	LOCKSTAT_MUTEX,
+	LOCKSTAT_QLOCK,
+
+	LOCKSTAT_KINDS
+};
+
+typedef struct lockstat_site lockstat_site_t;
+
+struct logagent;
+
+/*
+ * Public interface.
+ */
+
+lockstat_site_t *lockstat_site(enum lockstat_kind kind,
+	const char *file, unsigned line);
+unsigned lockstat_spin(const lockstat_site_t *ls, unsigned dflt);
+void lockstat_adapt(lockstat_site_t *ls, unsigned dflt,
+	unsigned used, bool slept);
+uint64 lockstat_start(void);
+void lockstat_record(lockstat_site_t *ls, uint64 start, bool slept,
+	const char *holder_file, unsigned holder_line);
+
+bool lockstat_is_enabled(void);
+void lockstat_enable(bool on);
+void lockstat_reset(void);
+void lockstat_dump_log(struct logagent *la, unsigned options);
+
+#endif /* _lockstat_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
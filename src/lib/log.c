@@ -73,6 +73,7 @@
 #include "misc.h"			/* For CONST_STRLEN() and english_strerror() */
 #include "offtime.h"
 #include "once.h"
+#include "semaphore.h"
 #include "signal.h"
 #include "spinlock.h"
 #include "stacktrace.h"
@@ -80,6 +81,7 @@
 #include "stringify.h"
 #include "thread.h"
 #include "tm.h"
+#include "vmm.h"
 #include "walloc.h"
 
 #include "override.h"		/* Must be the last header included */
@@ -88,6 +90,11 @@
 #define LOG_MSG_REGULAR_LEN	3500	/**< Regular message length otherwise */
 #define LOG_MSG_DEFAULT		4080	/**< Default string length for logger */
 #define LOG_IOERR_GRACE		5		/**< Seconds between I/O errors */
+#define LOG_RING_SIZE		65536	/**< Per-thread asynchronous ring size */
+#define LOG_RING_WAKEUP		(LOG_RING_SIZE / 2)	/**< Wake writer above */
+#define LOG_RING_SPIN		100		/**< Yields when ring is full */
+#define LOG_ASYNC_PERIOD	100		/**< ms, writer thread polling period */
+#define LOG_ASYNC_IOV		32		/**< Max I/O vectors per writev() */
 
 /*
  * An internal log flag given to s_logv() to request explicit copy of the
@@ -242,6 +249,120 @@ static struct logfile logfile[LOG_MAX_FILES] = {
 static bool log_crashing;
 static const char DEV_NULL[] = "/dev/null";
 
+/**
+ * Per-thread ring buffer of formatted log lines, for asynchronous logging.
+ *
+ * There is a single producer (the thread whose small ID indexes the ring)
+ * and a single consumer (the log writer thread), hence no lock is needed:
+ * the producer only moves the head and the consumer only moves the tail.
+ * Both offsets increase monotonically and wrap naturally, being reduced
+ * modulo the (power of 2) ring size when indexing the buffer.
+ *
+ * The ring only ever holds complete lines, so that draining it as a whole
+ * never interleaves partial output from different threads.
+ */
+struct logring {
+	uint head;					/**< Producer offset */
+	uint tail;					/**< Consumer offset */
+	char buf[LOG_RING_SIZE];	/**< Formatted log lines */
+};
+
+static struct logring *log_rings[THREAD_MAX];
+static bool log_async;				/**< Is asynchronous logging active? */
+static bool log_async_stopping;		/**< Writer thread must exit */
+static semaphore_t *log_async_sem;	/**< To wake up the writer thread */
+static atomic_lock_t log_async_draining;
+static int log_async_tid = -1;		/**< Thread ID of the writer */
+
+/**
+ * Flush a batch of I/O vectors to stderr and release the ring space.
+ */
+static void
+log_async_writev(iovec_t *iov, int cnt,
+	struct logring **rings, uint *heads, int rcnt)
+{
+	int i;
+
+	if (0 == cnt)
+		return;
+
+	atio_writev(logfile[LOG_STDERR].fd, iov, cnt);
+
+	for (i = 0; i < rcnt; i++)
+		atomic_uint_set(&rings[i]->tail, heads[i]);
+}
+
+/**
+ * Write all the pending data from the per-thread rings to stderr.
+ *
+ * Data from all the rings are batched into as few writev() calls as
+ * possible.  The caller must hold the ``log_async_draining'' lock.
+ */
+static void
+log_async_drain(void)
+{
+	iovec_t iov[LOG_ASYNC_IOV];
+	struct logring *rings[LOG_ASYNC_IOV / 2];
+	uint heads[LOG_ASYNC_IOV / 2];
+	int cnt = 0, rcnt = 0;
+	uint i;
+
+	STATIC_ASSERT(IS_POWER_OF_2(LOG_RING_SIZE));
+
+	for (i = 0; i < N_ITEMS(log_rings); i++) {
+		struct logring *r = atomic_ptr_get((void **) &log_rings[i]);
+		uint head, tail, len, off;
+
+		if (NULL == r)
+			continue;
+
+		head = atomic_uint_get(&r->head);
+		tail = r->tail;
+
+		if (head == tail)
+			continue;
+
+		len = head - tail;
+		off = tail & (LOG_RING_SIZE - 1);
+
+		/*
+		 * Pending data may wrap around the end of the buffer, requiring
+		 * two I/O vectors to flush.
+		 */
+
+		if (off + len > LOG_RING_SIZE) {
+			iovec_set(&iov[cnt++], &r->buf[off], LOG_RING_SIZE - off);
+			iovec_set(&iov[cnt++], &r->buf[0], off + len - LOG_RING_SIZE);
+		} else {
+			iovec_set(&iov[cnt++], &r->buf[off], len);
+		}
+
+		rings[rcnt] = r;
+		heads[rcnt++] = head;
+
+		if (cnt > LOG_ASYNC_IOV - 2) {
+			log_async_writev(iov, cnt, rings, heads, rcnt);
+			cnt = rcnt = 0;
+		}
+	}
+
+	log_async_writev(iov, cnt, rings, heads, rcnt);
+}
+
+/**
+ * Synchronously flush all the pending asynchronous log lines.
+ *
+ * This is a no-op if the writer thread is currently draining the rings.
+ */
+static void
+log_async_flush(void)
+{
+	if (atomic_acquire(&log_async_draining)) {
+		log_async_drain();
+		atomic_release(&log_async_draining);
+	}
+}
+
 /**
  * Make sure all logging routines are always using a raw log.
  *
@@ -254,6 +375,16 @@ void G_COLD
 log_crash_mode(void)
 {
 	log_crashing = TRUE;
+
+	/*
+	 * Flush what is still buffered, everything will be logged synchronously
+	 * from now on.
+	 */
+
+	if (log_async) {
+		log_async = FALSE;
+		log_async_flush();
+	}
 }
 
 /**
@@ -996,6 +1127,140 @@ log_no_memory(const char *fmt, size_t msglen, int stid,
 	log_flush_err_atomic();
 }
 
+/**
+ * Copy data into the ring, at the given producer offset.
+ *
+ * @return the updated producer offset.
+ */
+static uint
+log_ring_copy(struct logring *r, uint pos, const char *data, size_t len)
+{
+	while (len != 0) {
+		uint off = pos & (LOG_RING_SIZE - 1);
+		size_t n = MIN(len, LOG_RING_SIZE - off);
+
+		memcpy(&r->buf[off], data, n);
+		data += n;
+		pos += n;
+		len -= n;
+	}
+
+	return pos;
+}
+
+/**
+ * Get the asynchronous logging ring of a thread, allocating it if needed.
+ *
+ * @return the ring, NULL if it cannot be allocated.
+ */
+static struct logring *
+log_ring_get(unsigned stid)
+{
+	struct logring *r;
+
+	g_assert(stid < N_ITEMS(log_rings));
+
+	r = log_rings[stid];
+
+	if G_UNLIKELY(NULL == r) {
+		if (signal_in_unsafe_handler())
+			return NULL;
+
+		/*
+		 * Rings are never freed: a ring is attached to a thread small ID
+		 * and will be re-used by the next thread getting the same ID.
+		 */
+
+		r = vmm_core_alloc_not_leaking(sizeof *r);
+		r->head = r->tail = 0;
+		atomic_ptr_xchg_if_eq((void **) &log_rings[stid], NULL, r);
+		r = log_rings[stid];
+	}
+
+	return r;
+}
+
+/**
+ * Attempt to emit log message asynchronously, through the per-thread ring.
+ *
+ * The formatted line is queued and will be written by the log writer thread.
+ * If the ring is full, we wake up the writer and wait a little for it to
+ * make room.
+ *
+ * @return TRUE if the message was queued, FALSE if the caller must log it
+ * synchronously.
+ */
+static bool
+log_async_emit(
+	GLogLevelFlags level, str_t *msg, const char *prefix, unsigned stid)
+{
+	struct logring *r;
+	char time_buf[LOG_TIME_BUFLEN];
+	char stid_buf[ULONG_DEC_BUFLEN];
+	const char *stid_str = NULL;
+	const char *recursive = "";
+	size_t len;
+	uint head, pos, used;
+	int i;
+
+	if G_UNLIKELY(UNSIGNED(log_async_tid) == stid)
+		return FALSE;		/* The writer thread logs synchronously */
+
+	r = log_ring_get(stid);
+	if G_UNLIKELY(NULL == r)
+		return FALSE;
+
+	log_time(ARYLEN(time_buf));
+
+	if (stid != 0)
+		stid_str = PRINT_NUMBER(stid_buf, stid);
+
+	if G_UNLIKELY(level & G_LOG_FLAG_RECURSION)
+		recursive = " [RECURSIVE]";
+
+	len = vstrlen(time_buf) + CONST_STRLEN(" (") + vstrlen(prefix) +
+		(NULL == stid_str ? 0 : 1 + vstrlen(stid_str)) +
+		CONST_STRLEN(")") + vstrlen(recursive) + CONST_STRLEN(": ") +
+		str_len(msg) + CONST_STRLEN("\n");
+
+	if G_UNLIKELY(len > LOG_RING_SIZE / 4)
+		return FALSE;
+
+	head = r->head;
+
+	for (i = 0; /* empty */; i++) {
+		used = head - atomic_uint_get(&r->tail);
+		if G_LIKELY(used + len <= LOG_RING_SIZE)
+			break;
+		if (i >= LOG_RING_SPIN)
+			return FALSE;	/* Writer is lagging, log synchronously */
+		semaphore_release(log_async_sem, 1);
+		thread_yield();
+	}
+
+	pos = log_ring_copy(r, head, time_buf, vstrlen(time_buf));
+	pos = log_ring_copy(r, pos, " (", CONST_STRLEN(" ("));
+	pos = log_ring_copy(r, pos, prefix, vstrlen(prefix));
+	if (stid_str != NULL) {
+		pos = log_ring_copy(r, pos, "-", 1);
+		pos = log_ring_copy(r, pos, stid_str, vstrlen(stid_str));
+	}
+	pos = log_ring_copy(r, pos, ")", 1);
+	pos = log_ring_copy(r, pos, recursive, vstrlen(recursive));
+	pos = log_ring_copy(r, pos, ": ", CONST_STRLEN(": "));
+	pos = log_ring_copy(r, pos, str_2c(msg), str_len(msg));
+	pos = log_ring_copy(r, pos, "\n", 1);
+
+	g_assert(pos - head == len);
+
+	atomic_uint_set(&r->head, pos);
+
+	if (used < LOG_RING_WAKEUP && used + len >= LOG_RING_WAKEUP)
+		semaphore_release(log_async_sem, 1);
+
+	return TRUE;
+}
+
 /**
  * Emit log message.
  *
@@ -1022,6 +1287,20 @@ log_emit(
 	char time_buf[LOG_TIME_BUFLEN];
 	char stid_buf[ULONG_DEC_BUFLEN];
 
+	/*
+	 * When asynchronous logging is enabled, regular messages are handed
+	 * to the writer thread.  Anything that could precede a crash, or that
+	 * needs to be copied or duplicated elsewhere, is still logged right away.
+	 */
+
+	if (
+		log_async && !in_sigh && !raw && !copy &&
+		0 == (level & G_LOG_FLAG_FATAL) &&
+		!logfile[LOG_STDERR].duplicate &&
+		log_async_emit(level, msg, prefix, stid)
+	)
+		return;
+
 	log_time_careful(ARYLEN(time_buf), in_sigh || raw);
 	print_str(time_buf);	/* 0 */
 	print_str(" (");		/* 1 */
@@ -2931,6 +3210,92 @@ log_get_fd(enum log_file which)
 	return logfile[which].fd;
 }
 
+/**
+ * Main entry point for the log writer thread.
+ */
+static void *
+log_async_main(void *unused_arg)
+{
+	(void) unused_arg;
+
+	thread_set_name("log writer");
+
+	while (!atomic_bool_get(&log_async_stopping)) {
+		tm_t timeout;
+
+		tm_fill_ms(&timeout, LOG_ASYNC_PERIOD);
+		semaphore_acquire(log_async_sem, 1, &timeout);
+
+		/*
+		 * Collapse pending wakeups, we are going to flush everything.
+		 */
+
+		while (semaphore_acquire_try(log_async_sem, 1))
+			/* empty */;
+
+		log_async_flush();
+	}
+
+	return NULL;
+}
+
+/**
+ * Enable asynchronous logging.
+ *
+ * Regular log messages are then formatted into a per-thread ring buffer
+ * and written to stderr by a dedicated thread, batching the output of all
+ * the threads into writev() calls.  Critical and fatal messages, as well as
+ * messages logged from signal handlers or when crashing, remain synchronous.
+ */
+void G_COLD
+log_async_start(void)
+{
+	int r;
+
+	if (log_async || log_crashing)
+		return;
+
+	/*
+	 * The semaphore is never destroyed since producers could still be
+	 * releasing it whilst we are stopping.
+	 */
+
+	if (NULL == log_async_sem)
+		log_async_sem = semaphore_create(0);
+
+	log_async_stopping = FALSE;
+
+	r = thread_create(log_async_main, NULL,
+			THREAD_F_NO_CANCEL | THREAD_F_NO_POOL | THREAD_F_WARN,
+			THREAD_STACK_MIN);
+
+	if (-1 == r)
+		return;
+
+	log_async_tid = r;
+	atomic_bool_set(&log_async, TRUE);
+}
+
+/**
+ * Disable asynchronous logging, flushing all the pending messages.
+ */
+static void G_COLD
+log_async_stop(void)
+{
+	if (-1 == log_async_tid)
+		return;
+
+	atomic_bool_set(&log_async, FALSE);
+	atomic_bool_set(&log_async_stopping, TRUE);
+	semaphore_release(log_async_sem, 1);
+
+	if (-1 == thread_join(log_async_tid, NULL))
+		s_warning("%s(): cannot join log writer: %m", G_STRFUNC);
+
+	log_async_tid = -1;
+	log_async_flush();
+}
+
 /**
  * Shutdown the logging layer.
  */
@@ -2939,6 +3304,8 @@ log_close(void)
 {
 	size_t i;
 
+	log_async_stop();
+
 	for (i = 0; i < N_ITEMS(logfile); i++) {
 		struct logfile *lf = &logfile[i];
 
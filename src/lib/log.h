@@ -69,6 +69,7 @@ void log_crash_mode(void);
 void log_crashing_str(struct str *str);
 void log_atoms_inited(void);
 void log_close(void);
+void log_async_start(void);
 void log_show_pid(bool enabled);
 void log_set_disabled(enum log_file which, bool disabled);
 void log_set(enum log_file which, const char *path);
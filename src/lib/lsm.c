@@ -0,0 +1,2167 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Log-structured merge tree.
+ *
+ * This is a key/value store optimized for write-heavy workloads, where keys
+ * are constantly created and deleted.  Unlike a hashed database, it never
+ * updates data in place: changes are accumulated in memory, in a sorted
+ * "memtable", which is written sequentially to disk as an immutable sorted
+ * "run" file when it becomes too large, or when the store is synchronized.
+ *
+ * Deleted keys are recorded as tombstones, which hide older versions of the
+ * key present in older runs.  Lookups probe the memtable, then each run from
+ * the newest to the oldest, the first version found being the current one.
+ *
+ * To keep the amount of runs low, runs are merged together: after each flush,
+ * the newest run is merged with the next one as long as it is not much
+ * smaller, which leads to run sizes growing geometrically.  When the oldest
+ * run is part of a merge, tombstones can be discarded since there is nothing
+ * left for them to hide.  A full compaction merges all the runs into one.
+ *
+ * Records can be stamped with an expiration time when they are stored, as
+ * computed by a user-supplied callback.  Merges discard records expired for
+ * longer than a configured grace period, so that stale data get reclaimed
+ * without requiring an explicit deletion.
+ *
+ * Each run file is laid out as follows (all integers are big-endian):
+ *
+ *    header    8 bytes, magic string
+ *    records   sorted by key
+ *    index     one entry per block of records (at least LSM_BLOCK bytes)
+ *    bloom     bloom filter on all the keys of the run
+ *    trailer   LSM_TRAILER bytes, with the offsets and magic string
+ *
+ * Each record is made of:
+ *
+ *    klen      2 bytes, key length
+ *    flags     1 byte
+ *    dlen      4 bytes, data length
+ *    expire    4 bytes, expiration time (0 if none)
+ *    key       klen bytes
+ *    data      dlen bytes
+ *
+ * The index and the bloom filter are loaded in memory when the run is opened,
+ * so that looking up a key requires at most one block read per run, and
+ * usually none for runs not holding the key.
+ *
+ * The list of runs is kept in a manifest file, which is atomically replaced
+ * each time the list changes.  Runs not listed in the manifest are ignored.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "lsm.h"
+
+#include "compat_pio.h"
+#include "crc.h"
+#include "debug.h"
+#include "endian.h"
+#include "erbtree.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hashing.h"
+#include "hstrfn.h"
+#include "log.h"
+#include "misc.h"				/* For english_strerror() */
+#include "stringify.h"
+#include "tm.h"
+#include "unsigned.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define LSM_RUN_FEXT		".run"			/**< Extension of run files */
+#define LSM_TMP_FEXT		".tmp"			/**< Temporary manifest */
+
+#define LSM_MEMTABLE_MAX	(1024 * 1024)	/**< Flush memtable beyond that */
+#define LSM_BLOCK			4096			/**< Index granularity in runs */
+#define LSM_BUFSIZE			(64 * 1024)		/**< I/O buffer size */
+#define LSM_BLOOM_BITS		10				/**< Bloom filter bits per key */
+#define LSM_BLOOM_HASHES	4				/**< Bloom filter hash functions */
+#define LSM_FANOUT			4				/**< Size ratio between runs */
+#define LSM_MAX_RUNS		8				/**< Forced merging beyond that */
+
+#define LSM_MAGIC_LEN		8				/**< Length of magic strings */
+#define LSM_RECHEAD			11				/**< Record header size */
+#define LSM_IDXHEAD			10				/**< Index entry header size */
+#define LSM_TRAILER			32				/**< Run trailer size */
+
+#define LSM_F_TOMBSTONE		(1 << 0)		/**< Record is a deletion */
+
+static const char lsm_run_magic[]		= "LSMRUN01";
+static const char lsm_manifest_magic[]	= "LSMMAN01";
+
+/**
+ * An entry of the sparse run index.
+ */
+struct lsm_index {
+	char *key;				/**< First key of the block */
+	size_t klen;			/**< Key length */
+	fileoffset_t offset;	/**< Offset of the block in the run file */
+};
+
+/**
+ * A sorted run, on disk.
+ */
+struct lsm_run {
+	char *path;				/**< Path of the run file */
+	uint32 seq;				/**< Sequence number of the run */
+	int fd;					/**< Opened run file */
+	fileoffset_t end;		/**< End of record data (start of the index) */
+	fileoffset_t size;		/**< Total file size */
+	struct lsm_index *index;/**< Sparse index, one entry per block */
+	size_t icount;			/**< Amount of index entries */
+	uint8 *bloom;			/**< Bloom filter on keys */
+	size_t bloom_bits;		/**< Size of the bloom filter, in bits */
+	size_t records;			/**< Amount of records held */
+};
+
+/**
+ * A memtable entry.
+ */
+struct lsm_entry {
+	char *key;				/**< The key */
+	size_t klen;			/**< Key length */
+	char *data;				/**< The data, NULL if empty or tombstone */
+	size_t dlen;			/**< Data length */
+	time_t expire;			/**< Expiration time, 0 if none */
+	uint8 flags;			/**< Record flags */
+	rbnode_t node;			/**< Embedded tree node */
+};
+
+/**
+ * A record, as read from a run or the memtable.
+ */
+struct lsm_rec {
+	const char *key;		/**< The key */
+	size_t klen;			/**< Key length */
+	const char *data;		/**< The data */
+	size_t dlen;			/**< Data length */
+	time_t expire;			/**< Expiration time, 0 if none */
+	uint8 flags;			/**< Record flags */
+};
+
+enum lsm_magic { LSM_MAGIC = 0x1ba6f3e2 };
+
+/**
+ * A log-structured merge tree.
+ */
+struct lsm {
+	enum lsm_magic magic;
+	char *path;				/**< Base path of the files */
+	char *name;				/**< Name, for logging */
+	erbtree_t memtable;		/**< Recent changes, sorted by key */
+	size_t memsize;			/**< Memory used by the memtable */
+	struct lsm_run **runs;	/**< Runs, from the newest to the oldest */
+	size_t nruns;			/**< Amount of runs */
+	uint32 next_seq;		/**< Sequence number of the next run file */
+	size_t count;			/**< Amount of keys held */
+	lsm_expiry_t expiry;	/**< Optional, computes expiration time */
+	time_delta_t grace;		/**< Grace period after expiration */
+	char *buf;				/**< Block buffer for lookups */
+	size_t bufsize;			/**< Size of ``buf'' */
+	int mode;				/**< Permissions for created files */
+	int error;				/**< Last errno value */
+	unsigned long flushes;	/**< Stats: memtable flushes */
+	unsigned long merges;	/**< Stats: run merges */
+	unsigned long dropped;	/**< Stats: expired records dropped */
+	unsigned rdonly:1;		/**< Opened read-only */
+	unsigned is_volatile:1;	/**< Whether files can be discarded on close */
+	unsigned ioerr:1;		/**< Had I/O error */
+	unsigned iterating:1;	/**< Being iterated over */
+};
+
+static inline void
+lsm_check(const struct lsm * const lsm)
+{
+	g_assert(lsm != NULL);
+	g_assert(LSM_MAGIC == lsm->magic);
+}
+
+static char lsm_empty[1];	/* Returned for empty values */
+
+/**
+ * Compare two keys.
+ */
+static inline int
+lsm_keycmp(const void *k1, size_t l1, const void *k2, size_t l2)
+{
+	int c = memcmp(k1, k2, MIN(l1, l2));
+
+	return 0 != c ? c : CMP(l1, l2);
+}
+
+/**
+ * Compare two memtable entries.
+ */
+static int
+lsm_entry_cmp(const void *a, const void *b)
+{
+	const struct lsm_entry *ea = a, *eb = b;
+
+	return lsm_keycmp(ea->key, ea->klen, eb->key, eb->klen);
+}
+
+/**
+ * @return the name of the store, for logging.
+ */
+const char *
+lsm_name(const lsm_t *lsm)
+{
+	lsm_check(lsm);
+
+	return NULL == lsm->name ? lsm->path : lsm->name;
+}
+
+/**
+ * Set the name of the store, for logging.
+ */
+void
+lsm_set_name(lsm_t *lsm, const char *name)
+{
+	lsm_check(lsm);
+
+	HFREE_NULL(lsm->name);
+	lsm->name = h_strdup(name);
+}
+
+/**
+ * Record I/O error.
+ */
+static void
+lsm_ioerr(lsm_t *lsm, const char *what, const char *path, int error)
+{
+	s_warning("LSM \"%s\": cannot %s \"%s\": %s",
+		lsm_name(lsm), what, path, english_strerror(error));
+
+	lsm->ioerr = TRUE;
+	lsm->error = error;
+	errno = error;
+}
+
+/**
+ * @return whether an I/O error occurred.
+ */
+bool
+lsm_error(const lsm_t *lsm)
+{
+	lsm_check(lsm);
+
+	return lsm->ioerr;
+}
+
+/**
+ * Clear the I/O error indication.
+ */
+void
+lsm_clearerr(lsm_t *lsm)
+{
+	lsm_check(lsm);
+
+	lsm->ioerr = FALSE;
+	lsm->error = 0;
+}
+
+/**
+ * @return the amount of keys held.
+ */
+size_t
+lsm_count(const lsm_t *lsm)
+{
+	lsm_check(lsm);
+
+	return lsm->count;
+}
+
+/**
+ * Flag whether the store is volatile, in which case its files are removed
+ * when it is closed.
+ */
+void
+lsm_set_volatile(lsm_t *lsm, bool yes)
+{
+	lsm_check(lsm);
+
+	lsm->is_volatile = booleanize(yes);
+}
+
+/**
+ * Set the expiration callback, used to stamp records as they are stored.
+ *
+ * Records expired for longer than the grace period are discarded when runs
+ * are merged.  The grace period lets the application process expired records
+ * itself, since they remain visible until they are discarded.
+ *
+ * @param lsm		the store
+ * @param cb		computes the expiration time of records (NULL to disable)
+ * @param grace		grace period after expiration
+ */
+void
+lsm_set_expiry(lsm_t *lsm, lsm_expiry_t cb, time_delta_t grace)
+{
+	lsm_check(lsm);
+	g_assert(grace >= 0);
+
+	lsm->expiry = cb;
+	lsm->grace = grace;
+}
+
+/**
+ * Is record expired beyond the grace period?
+ */
+static inline bool
+lsm_expired(const lsm_t *lsm, const struct lsm_rec *rec, time_t now)
+{
+	return 0 != rec->expire && delta_time(now, rec->expire) > lsm->grace;
+}
+
+/***
+ *** File names.
+ ***/
+
+static char *
+lsm_manifest_path(const char *path)
+{
+	return h_strconcat(path, LSM_MANIFEST_FEXT, NULL_PTR);
+}
+
+static char *
+lsm_run_path(const char *path, uint32 seq)
+{
+	return h_strdup_printf("%s.%u%s", path, (unsigned) seq, LSM_RUN_FEXT);
+}
+
+/***
+ *** Bloom filters.
+ ***/
+
+/**
+ * Compute the bloom filter bits for a key, invoking the callback on each.
+ *
+ * @return TRUE if the callback returned TRUE for all the bits.
+ */
+static bool
+lsm_bloom_bits(const void *key, size_t klen, size_t nbits,
+	bool (*cb)(uint8 *bloom, size_t bit), uint8 *bloom)
+{
+	unsigned h1 = binary_hash(key, klen);
+	unsigned h2 = binary_hash2(key, klen) | 1;
+	uint i;
+	bool all = TRUE;
+
+	for (i = 0; i < LSM_BLOOM_HASHES; i++) {
+		if (!(*cb)(bloom, (h1 + i * h2) % nbits))
+			all = FALSE;
+	}
+
+	return all;
+}
+
+static bool
+lsm_bloom_set(uint8 *bloom, size_t bit)
+{
+	bloom[bit >> 3] |= 1U << (bit & 0x7);
+	return TRUE;
+}
+
+static bool
+lsm_bloom_get(uint8 *bloom, size_t bit)
+{
+	return 0 != (bloom[bit >> 3] & (1U << (bit & 0x7)));
+}
+
+/**
+ * Can run hold the key?
+ */
+static inline bool
+lsm_bloom_maybe(const struct lsm_run *run, const void *key, size_t klen)
+{
+	return lsm_bloom_bits(key, klen, run->bloom_bits,
+		lsm_bloom_get, run->bloom);
+}
+
+/***
+ *** Records.
+ ***/
+
+/**
+ * Serialize record header into supplied buffer.
+ */
+static void
+lsm_rec_head(char *p, const struct lsm_rec *rec)
+{
+	poke_be16(&p[0], rec->klen);
+	p[2] = rec->flags;
+	poke_be32(&p[3], rec->dlen);
+	poke_be32(&p[7], (uint32) rec->expire);
+}
+
+/**
+ * Parse record from buffer.
+ *
+ * @param p		start of the record
+ * @param len	available bytes
+ * @param rec	filled with the record, pointing into the buffer
+ *
+ * @return the total record length, 0 if the record is incomplete.
+ */
+static size_t
+lsm_rec_parse(const char *p, size_t len, struct lsm_rec *rec)
+{
+	size_t total;
+
+	if (len < LSM_RECHEAD)
+		return 0;
+
+	rec->klen = peek_be16(&p[0]);
+	rec->flags = p[2];
+	rec->dlen = peek_be32(&p[3]);
+	rec->expire = peek_be32(&p[7]);
+
+	total = LSM_RECHEAD + rec->klen + rec->dlen;
+
+	if (len < total)
+		return 0;
+
+	rec->key = &p[LSM_RECHEAD];
+	rec->data = 0 == rec->dlen ? lsm_empty : &p[LSM_RECHEAD + rec->klen];
+
+	return total;
+}
+
+/**
+ * Fill record from memtable entry.
+ */
+static void
+lsm_rec_from_entry(struct lsm_rec *rec, const struct lsm_entry *e)
+{
+	rec->key = e->key;
+	rec->klen = e->klen;
+	rec->data = NULL == e->data ? lsm_empty : e->data;
+	rec->dlen = e->dlen;
+	rec->expire = e->expire;
+	rec->flags = e->flags;
+}
+
+/***
+ *** Runs.
+ ***/
+
+/**
+ * Free run, optionally removing its file.
+ */
+static void
+lsm_run_free(struct lsm_run *run, bool remove)
+{
+	size_t i;
+
+	fd_close(&run->fd);
+
+	if (remove && -1 == unlink(run->path))
+		s_warning("LSM cannot unlink \"%s\": %m", run->path);
+
+	for (i = 0; i < run->icount; i++) {
+		struct lsm_index *idx = &run->index[i];
+		wfree(idx->key, MAX(1, idx->klen));
+	}
+
+	HFREE_NULL(run->index);
+	HFREE_NULL(run->bloom);
+	HFREE_NULL(run->path);
+	WFREE(run);
+}
+
+/**
+ * Open existing run file, loading its index and bloom filter.
+ *
+ * @return the run, NULL on error.
+ */
+static struct lsm_run *
+lsm_run_open(lsm_t *lsm, uint32 seq)
+{
+	struct lsm_run *run;
+	char trailer[LSM_TRAILER];
+	filestat_t buf;
+	char *meta = NULL, *p;
+	size_t metalen, bloom_bytes, icount, i;
+
+	WALLOC0(run);
+	run->seq = seq;
+	run->path = lsm_run_path(lsm->path, seq);
+	run->fd = file_open(run->path, lsm->rdonly ? O_RDONLY : O_RDWR, 0);
+
+	if (-1 == run->fd)
+		goto failed;
+
+	if (-1 == fstat(run->fd, &buf))
+		goto failed;
+
+	run->size = buf.st_size;
+
+	if (run->size < LSM_MAGIC_LEN + LSM_TRAILER)
+		goto corrupted;
+
+	if ((ssize_t) sizeof trailer != compat_pread(run->fd,
+			trailer, sizeof trailer, run->size - LSM_TRAILER))
+		goto failed;
+
+	if (0 != memcmp(&trailer[24], lsm_run_magic, LSM_MAGIC_LEN))
+		goto corrupted;
+
+	run->end = peek_be64(&trailer[0]);
+	icount = peek_be32(&trailer[8]);
+	run->bloom_bits = peek_be32(&trailer[12]);
+	run->records = peek_be32(&trailer[16]);
+
+	if (
+		run->end < LSM_MAGIC_LEN ||
+		run->end > run->size - LSM_TRAILER ||
+		0 == run->bloom_bits
+	)
+		goto corrupted;
+
+	metalen = run->size - LSM_TRAILER - run->end;
+	bloom_bytes = (run->bloom_bits + 7) / 8;
+
+	if (metalen < bloom_bytes || icount > (metalen - bloom_bytes) / LSM_IDXHEAD)
+		goto corrupted;
+
+	meta = halloc(MAX(1, metalen));
+
+	if (metalen != (size_t) compat_pread(run->fd, meta, metalen, run->end))
+		goto failed;
+
+	/*
+	 * Load the sparse index.
+	 */
+
+	HALLOC0_ARRAY(run->index, MAX(1, icount));
+	p = meta;
+
+	for (i = 0; i < icount; i++) {
+		struct lsm_index *idx = &run->index[i];
+
+		if (ptr_diff(p, meta) + LSM_IDXHEAD > metalen - bloom_bytes)
+			goto corrupted;
+
+		idx->klen = peek_be16(&p[0]);
+		idx->offset = peek_be64(&p[2]);
+		p += LSM_IDXHEAD;
+
+		if (ptr_diff(p, meta) + idx->klen > metalen - bloom_bytes)
+			goto corrupted;
+
+		idx->key = wcopy(p, MAX(1, idx->klen));
+		run->icount++;
+		p += idx->klen;
+
+		if (idx->offset < LSM_MAGIC_LEN || idx->offset >= run->end)
+			goto corrupted;
+	}
+
+	if (ptr_diff(p, meta) + bloom_bytes != metalen)
+		goto corrupted;
+
+	run->bloom = hcopy(p, bloom_bytes);
+	HFREE_NULL(meta);
+
+	return run;
+
+corrupted:
+	errno = EINVAL;
+	/* FALL THROUGH */
+failed:
+	lsm_ioerr(lsm, "load run", run->path, errno);
+	HFREE_NULL(meta);
+	lsm_run_free(run, FALSE);
+	return NULL;
+}
+
+/**
+ * Lookup key in run.
+ *
+ * @param lsm		the store
+ * @param run		the run
+ * @param key		the key
+ * @param klen		key length
+ * @param rec		filled with the record, pointing to the lookup buffer
+ *
+ * @return 1 if found, 0 if not found, -1 on error.
+ */
+static int
+lsm_run_lookup(lsm_t *lsm, const struct lsm_run *run,
+	const void *key, size_t klen, struct lsm_rec *rec)
+{
+	size_t lo, hi, i, len, pos;
+	fileoffset_t start, end;
+	ssize_t r;
+
+	if (0 == run->icount || !lsm_bloom_maybe(run, key, klen))
+		return 0;
+
+	/*
+	 * Find the last index entry whose key is not greater than ours.
+	 */
+
+	if (lsm_keycmp(key, klen, run->index[0].key, run->index[0].klen) < 0)
+		return 0;
+
+	lo = 0;
+	hi = run->icount;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct lsm_index *idx = &run->index[mid];
+
+		if (lsm_keycmp(key, klen, idx->key, idx->klen) < 0)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	i = lo;
+	start = run->index[i].offset;
+	end = i + 1 < run->icount ? run->index[i + 1].offset : run->end;
+	len = end - start;
+
+	if (len > lsm->bufsize) {
+		lsm->bufsize = MAX(len, LSM_BLOCK * 2);
+		lsm->buf = hrealloc(lsm->buf, lsm->bufsize);
+	}
+
+	r = compat_pread(run->fd, lsm->buf, len, start);
+
+	if G_UNLIKELY((ssize_t) len != r) {
+		lsm_ioerr(lsm, "read block from", run->path, -1 == r ? errno : EIO);
+		return -1;
+	}
+
+	/*
+	 * Records within the block are sorted, scan them.
+	 */
+
+	for (pos = 0; pos < len; /* empty */) {
+		size_t n = lsm_rec_parse(&lsm->buf[pos], len - pos, rec);
+		int c;
+
+		if G_UNLIKELY(0 == n) {
+			lsm_ioerr(lsm, "parse block from", run->path, EINVAL);
+			return -1;
+		}
+
+		c = lsm_keycmp(key, klen, rec->key, rec->klen);
+
+		if (0 == c)
+			return 1;
+		if (c < 0)
+			break;			/* Went past the key */
+
+		pos += n;
+	}
+
+	return 0;
+}
+
+/**
+ * Sequential reader on a run.
+ */
+struct lsm_reader {
+	const struct lsm_run *run;
+	fileoffset_t offset;	/**< File offset of buf[0] */
+	char *buf;				/**< Read buffer */
+	size_t size;			/**< Size of buffer */
+	size_t len;				/**< Amount of data held in buffer */
+	size_t pos;				/**< Reading position in buffer */
+	bool error;				/**< Whether an I/O error occurred */
+};
+
+static void
+lsm_reader_init(struct lsm_reader *r, const struct lsm_run *run)
+{
+	ZERO(r);
+	r->run = run;
+	r->offset = LSM_MAGIC_LEN;
+	r->size = LSM_BUFSIZE;
+	r->buf = halloc(r->size);
+}
+
+static void
+lsm_reader_free(struct lsm_reader *r)
+{
+	HFREE_NULL(r->buf);
+}
+
+/**
+ * Make sure at least ``need'' bytes are available in the buffer.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+lsm_reader_fill(struct lsm_reader *r, size_t need)
+{
+	if (r->len - r->pos >= need)
+		return TRUE;
+
+	memmove(r->buf, &r->buf[r->pos], r->len - r->pos);
+	r->offset += r->pos;
+	r->len -= r->pos;
+	r->pos = 0;
+
+	if (need > r->size) {
+		r->size = need;
+		r->buf = hrealloc(r->buf, r->size);
+	}
+
+	while (r->len < need) {
+		fileoffset_t from = r->offset + r->len;
+		size_t n = MIN(r->size - r->len, (size_t) (r->run->end - from));
+		ssize_t got;
+
+		if (0 == n)
+			return FALSE;		/* Truncated record */
+
+		got = compat_pread(r->run->fd, &r->buf[r->len], n, from);
+
+		if G_UNLIKELY(got <= 0) {
+			r->error = TRUE;
+			return FALSE;
+		}
+
+		r->len += got;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Read next record.
+ *
+ * The record data point into the reader buffer and remain valid until the
+ * next call.
+ *
+ * @return TRUE if a record was read, FALSE at the end of the run or on error.
+ */
+static bool
+lsm_reader_next(struct lsm_reader *r, struct lsm_rec *rec)
+{
+	size_t n;
+
+	if (r->offset + r->pos >= r->run->end)
+		return FALSE;
+
+	if (!lsm_reader_fill(r, LSM_RECHEAD))
+		goto error;
+
+	n = LSM_RECHEAD + peek_be16(&r->buf[r->pos]) +
+		peek_be32(&r->buf[r->pos + 3]);
+
+	if (!lsm_reader_fill(r, n))
+		goto error;
+
+	n = lsm_rec_parse(&r->buf[r->pos], r->len - r->pos, rec);
+	g_assert(n != 0);
+	r->pos += n;
+
+	return TRUE;
+
+error:
+	r->error = TRUE;
+	return FALSE;
+}
+
+/**
+ * Run writer.
+ */
+struct lsm_writer {
+	struct lsm_run *run;	/**< The run being created */
+	fileoffset_t offset;	/**< Amount of data written, including buffer */
+	fileoffset_t block;		/**< Start of current block, -1 initially */
+	char *buf;				/**< Write buffer */
+	size_t len;				/**< Amount of buffered data */
+	size_t isize;			/**< Allocated index entries */
+	bool error;				/**< Whether an I/O error occurred */
+};
+
+/**
+ * Flush buffered data.
+ */
+static void
+lsm_writer_flush(struct lsm_writer *w)
+{
+	fileoffset_t from = w->offset - w->len;
+	const char *p = w->buf;
+	size_t n = w->len;
+
+	while (n != 0 && !w->error) {
+		ssize_t r = compat_pwrite(w->run->fd, p, n, from);
+
+		if G_UNLIKELY(-1 == r) {
+			if (!is_temporary_error(errno))
+				w->error = TRUE;
+			continue;
+		}
+
+		p += r;
+		n -= r;
+		from += r;
+	}
+
+	w->len = 0;
+}
+
+/**
+ * Append data to the run file.
+ */
+static void
+lsm_writer_write(struct lsm_writer *w, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len != 0) {
+		size_t n = MIN(len, LSM_BUFSIZE - w->len);
+
+		memcpy(&w->buf[w->len], p, n);
+		w->len += n;
+		w->offset += n;
+		p += n;
+		len -= n;
+
+		if (LSM_BUFSIZE == w->len)
+			lsm_writer_flush(w);
+	}
+}
+
+/**
+ * Create a new run file.
+ *
+ * @param lsm		the store
+ * @param expected	upper bound of the amount of records, to size the bloom
+ *
+ * @return the writer, NULL on error.
+ */
+static struct lsm_writer *
+lsm_writer_open(lsm_t *lsm, size_t expected)
+{
+	struct lsm_writer *w;
+	struct lsm_run *run;
+
+	g_assert(!lsm->rdonly);
+
+	WALLOC0(run);
+	run->seq = lsm->next_seq++;
+	run->path = lsm_run_path(lsm->path, run->seq);
+	run->fd = file_create(run->path, O_RDWR | O_TRUNC, lsm->mode);
+
+	if (-1 == run->fd) {
+		lsm_ioerr(lsm, "create run", run->path, errno);
+		lsm_run_free(run, FALSE);
+		return NULL;
+	}
+
+	run->bloom_bits = MAX(64, expected * LSM_BLOOM_BITS);
+	run->bloom = halloc0((run->bloom_bits + 7) / 8);
+
+	WALLOC0(w);
+	w->run = run;
+	w->block = -1;
+	w->buf = halloc(LSM_BUFSIZE);
+
+	lsm_writer_write(w, lsm_run_magic, LSM_MAGIC_LEN);
+
+	return w;
+}
+
+/**
+ * Append record to the run.
+ */
+static void
+lsm_writer_add(struct lsm_writer *w, const struct lsm_rec *rec)
+{
+	struct lsm_run *run = w->run;
+	char head[LSM_RECHEAD];
+
+	/*
+	 * Start a new block when the current one is large enough, recording
+	 * its first key in the sparse index.
+	 */
+
+	if (-1 == w->block || w->offset - w->block >= LSM_BLOCK) {
+		struct lsm_index *idx;
+
+		if (run->icount >= w->isize) {
+			w->isize = MAX(16, w->isize * 2);
+			HREALLOC_ARRAY(run->index, w->isize);
+		}
+
+		idx = &run->index[run->icount++];
+		idx->key = wcopy(rec->key, MAX(1, rec->klen));
+		idx->klen = rec->klen;
+		idx->offset = w->block = w->offset;
+	}
+
+	lsm_bloom_bits(rec->key, rec->klen, run->bloom_bits,
+		lsm_bloom_set, run->bloom);
+
+	lsm_rec_head(head, rec);
+	lsm_writer_write(w, head, sizeof head);
+	lsm_writer_write(w, rec->key, rec->klen);
+	if (0 != rec->dlen)
+		lsm_writer_write(w, rec->data, rec->dlen);
+
+	run->records++;
+}
+
+/**
+ * Complete the run file, writing its index, bloom filter and trailer, and
+ * make sure it reaches the disk.
+ *
+ * @return the new run, NULL on error (the file being removed).
+ */
+static struct lsm_run *
+lsm_writer_finish(lsm_t *lsm, struct lsm_writer *w)
+{
+	struct lsm_run *run = w->run;
+	char trailer[LSM_TRAILER];
+	size_t i;
+
+	run->end = w->offset;
+
+	for (i = 0; i < run->icount; i++) {
+		const struct lsm_index *idx = &run->index[i];
+		char head[LSM_IDXHEAD];
+
+		poke_be16(&head[0], idx->klen);
+		poke_be64(&head[2], idx->offset);
+		lsm_writer_write(w, head, sizeof head);
+		lsm_writer_write(w, idx->key, idx->klen);
+	}
+
+	lsm_writer_write(w, run->bloom, (run->bloom_bits + 7) / 8);
+
+	poke_be64(&trailer[0], run->end);
+	poke_be32(&trailer[8], run->icount);
+	poke_be32(&trailer[12], run->bloom_bits);
+	poke_be32(&trailer[16], run->records);
+	poke_be32(&trailer[20], 0);
+	memcpy(&trailer[24], lsm_run_magic, LSM_MAGIC_LEN);
+	lsm_writer_write(w, trailer, sizeof trailer);
+
+	lsm_writer_flush(w);
+	run->size = w->offset;
+
+	if (!w->error && -1 == fd_fdatasync(run->fd))
+		w->error = TRUE;
+
+	if G_UNLIKELY(w->error) {
+		lsm_ioerr(lsm, "write run", run->path, errno);
+		lsm_run_free(run, TRUE);
+		run = NULL;
+	}
+
+	HFREE_NULL(w->buf);
+	WFREE(w);
+
+	return run;
+}
+
+/***
+ *** Manifest.
+ ***/
+
+/**
+ * Read the manifest.
+ *
+ * @param path		base path of the store
+ * @param count		where the amount of keys is written
+ * @param next_seq	where the next run sequence number is written
+ * @param nruns		where the amount of runs is written
+ *
+ * @return the halloc()'ed array of run sequence numbers (newest first),
+ * NULL on error with errno set.
+ */
+static uint32 *
+lsm_manifest_read(const char *path, size_t *count, uint32 *next_seq,
+	size_t *nruns)
+{
+	char *file = lsm_manifest_path(path);
+	char head[LSM_MAGIC_LEN + 16];
+	uint32 *seqs = NULL;
+	char *data = NULL;
+	size_t n, i, len;
+	int fd;
+
+	fd = file_open_missing(file, O_RDONLY);
+	if (-1 == fd)
+		goto done;
+
+	if ((ssize_t) sizeof head != compat_pread(fd, head, sizeof head, 0))
+		goto corrupted;
+
+	if (0 != memcmp(head, lsm_manifest_magic, LSM_MAGIC_LEN))
+		goto corrupted;
+
+	n = peek_be32(&head[LSM_MAGIC_LEN + 12]);
+	if (n > MAX_INT_VAL(uint16))
+		goto corrupted;
+
+	len = sizeof head + n * 4 + 4;
+	data = halloc(len);
+
+	if (len != (size_t) compat_pread(fd, data, len, 0))
+		goto corrupted;
+
+	if (crc32_update(0, data, len - 4) != peek_be32(&data[len - 4]))
+		goto corrupted;
+
+	*count = peek_be64(&data[LSM_MAGIC_LEN]);
+	*next_seq = peek_be32(&data[LSM_MAGIC_LEN + 8]);
+	*nruns = n;
+
+	HALLOC0_ARRAY(seqs, MAX(1, n));
+	for (i = 0; i < n; i++)
+		seqs[i] = peek_be32(&data[sizeof head + i * 4]);
+
+	goto done;
+
+corrupted:
+	errno = EINVAL;
+	/* FALL THROUGH */
+done:
+	fd_close(&fd);
+	HFREE_NULL(data);
+	HFREE_NULL(file);
+	return seqs;
+}
+
+/**
+ * Write the manifest, atomically replacing the previous one.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+lsm_manifest_write(lsm_t *lsm)
+{
+	char *file = lsm_manifest_path(lsm->path);
+	char *tmp = h_strconcat(file, LSM_TMP_FEXT, NULL_PTR);
+	size_t len = LSM_MAGIC_LEN + 16 + lsm->nruns * 4 + 4;
+	char *data = halloc(len);
+	bool ok = FALSE;
+	size_t i;
+	int fd;
+
+	memcpy(data, lsm_manifest_magic, LSM_MAGIC_LEN);
+	poke_be64(&data[LSM_MAGIC_LEN], lsm->count);
+	poke_be32(&data[LSM_MAGIC_LEN + 8], lsm->next_seq);
+	poke_be32(&data[LSM_MAGIC_LEN + 12], lsm->nruns);
+
+	for (i = 0; i < lsm->nruns; i++)
+		poke_be32(&data[LSM_MAGIC_LEN + 16 + i * 4], lsm->runs[i]->seq);
+
+	poke_be32(&data[len - 4], crc32_update(0, data, len - 4));
+
+	fd = file_create(tmp, O_WRONLY | O_TRUNC, lsm->mode);
+	if (-1 == fd) {
+		lsm_ioerr(lsm, "create manifest", tmp, errno);
+		goto done;
+	}
+
+	if (
+		len != (size_t) compat_pwrite(fd, data, len, 0) ||
+		-1 == fd_fdatasync(fd)
+	) {
+		lsm_ioerr(lsm, "write manifest", tmp, errno);
+		fd_close(&fd);
+		goto done;
+	}
+
+	fd_close(&fd);
+
+	if (-1 == rename(tmp, file)) {
+		lsm_ioerr(lsm, "rename manifest", tmp, errno);
+		goto done;
+	}
+
+	ok = TRUE;
+
+done:
+	HFREE_NULL(data);
+	HFREE_NULL(tmp);
+	HFREE_NULL(file);
+	return ok;
+}
+
+/***
+ *** Memtable.
+ ***/
+
+/**
+ * Free memtable entry.
+ */
+static void
+lsm_entry_free(void *data)
+{
+	struct lsm_entry *e = data;
+
+	wfree(e->key, e->klen);
+	if (e->data != NULL)
+		wfree(e->data, e->dlen);
+	WFREE(e);
+}
+
+/**
+ * @return memory accounted for an entry.
+ */
+static inline size_t
+lsm_entry_size(const struct lsm_entry *e)
+{
+	return sizeof *e + e->klen + e->dlen;
+}
+
+/**
+ * Lookup key in the memtable.
+ */
+static struct lsm_entry *
+lsm_mem_lookup(const lsm_t *lsm, const void *key, size_t klen)
+{
+	struct lsm_entry probe;
+
+	probe.key = deconstify_pointer(key);
+	probe.klen = klen;
+
+	return erbtree_lookup(&lsm->memtable, &probe);
+}
+
+/**
+ * Record new value (or tombstone) for key in the memtable.
+ */
+static void
+lsm_mem_put(lsm_t *lsm, const void *key, size_t klen,
+	const void *data, size_t dlen, time_t expire, uint8 flags)
+{
+	struct lsm_entry *e = lsm_mem_lookup(lsm, key, klen);
+
+	if (NULL == e) {
+		WALLOC0(e);
+		e->key = wcopy(key, klen);
+		e->klen = klen;
+		erbtree_insert(&lsm->memtable, &e->node);
+	} else {
+		lsm->memsize -= lsm_entry_size(e);
+		if (e->data != NULL)
+			wfree(e->data, e->dlen);
+	}
+
+	e->data = 0 == dlen ? NULL : wcopy(data, dlen);
+	e->dlen = dlen;
+	e->expire = expire;
+	e->flags = flags;
+
+	lsm->memsize += lsm_entry_size(e);
+}
+
+/**
+ * Remove entry from the memtable.
+ */
+static void
+lsm_mem_remove(lsm_t *lsm, struct lsm_entry *e)
+{
+	lsm->memsize -= lsm_entry_size(e);
+	erbtree_remove(&lsm->memtable, &e->node);
+	lsm_entry_free(e);
+}
+
+/**
+ * Empty the memtable.
+ */
+static void
+lsm_mem_clear(lsm_t *lsm)
+{
+	erbtree_discard(&lsm->memtable, lsm_entry_free);
+	lsm->memsize = 0;
+}
+
+/***
+ *** Lookups.
+ ***/
+
+/**
+ * Lookup key in the runs only.
+ *
+ * @return 1 if found (possibly as a tombstone), 0 if not found, -1 on error.
+ */
+static int
+lsm_runs_lookup(lsm_t *lsm, const void *key, size_t klen, struct lsm_rec *rec)
+{
+	size_t i;
+
+	for (i = 0; i < lsm->nruns; i++) {
+		int r = lsm_run_lookup(lsm, lsm->runs[i], key, klen, rec);
+
+		if (0 != r)
+			return r;
+	}
+
+	return 0;
+}
+
+/**
+ * Lookup current value of key.
+ *
+ * @param lsm		the store
+ * @param key		the key
+ * @param klen		key length
+ * @param rec		filled with the record if found
+ *
+ * @return 1 if found, 0 if not found or deleted, -1 on error.
+ */
+static int
+lsm_lookup(lsm_t *lsm, const void *key, size_t klen, struct lsm_rec *rec)
+{
+	const struct lsm_entry *e = lsm_mem_lookup(lsm, key, klen);
+	int r;
+
+	if (e != NULL) {
+		if (e->flags & LSM_F_TOMBSTONE)
+			return 0;
+		lsm_rec_from_entry(rec, e);
+		return 1;
+	}
+
+	r = lsm_runs_lookup(lsm, key, klen, rec);
+
+	if (1 == r && (rec->flags & LSM_F_TOMBSTONE))
+		return 0;
+
+	return r;
+}
+
+/***
+ *** Merging.
+ ***/
+
+/**
+ * A merge source: either the memtable or a run.
+ */
+struct lsm_source {
+	struct lsm_rec rec;			/**< Current record */
+	struct lsm_entry *entry;	/**< Memtable cursor, NULL for runs */
+	struct lsm_reader reader;	/**< Run reader */
+	bool is_run;				/**< Whether this is a run source */
+	bool valid;					/**< Whether ``rec'' is valid */
+};
+
+/**
+ * A k-way merge of sorted sources, ordered from the newest to the oldest.
+ */
+struct lsm_merge {
+	const lsm_t *lsm;
+	struct lsm_source *src;		/**< Sources, newest first */
+	size_t count;				/**< Amount of sources */
+	ssize_t pending;			/**< Source to advance on next call */
+};
+
+/**
+ * Advance source to its next record.
+ */
+static void
+lsm_source_next(const lsm_t *lsm, struct lsm_source *s)
+{
+	if (s->is_run) {
+		s->valid = lsm_reader_next(&s->reader, &s->rec);
+	} else {
+		if (NULL == s->entry)
+			s->entry = erbtree_head(&lsm->memtable);
+		else {
+			s->entry = erbtree_data(&lsm->memtable,
+				erbtree_next(&s->entry->node));
+		}
+		s->valid = s->entry != NULL;
+		if (s->valid)
+			lsm_rec_from_entry(&s->rec, s->entry);
+	}
+}
+
+/**
+ * Initialize merge.
+ *
+ * @param m			the merge to initialize
+ * @param lsm		the store
+ * @param memtable	whether to include the memtable
+ * @param first		index of the first run to merge
+ * @param n			amount of runs to merge
+ */
+static void
+lsm_merge_init(struct lsm_merge *m, const lsm_t *lsm,
+	bool memtable, size_t first, size_t n)
+{
+	size_t i, j = 0;
+
+	g_assert(first + n <= lsm->nruns);
+
+	m->lsm = lsm;
+	m->count = n + (memtable ? 1 : 0);
+	m->pending = -1;
+	HALLOC0_ARRAY(m->src, MAX(1, m->count));
+
+	if (memtable)
+		lsm_source_next(lsm, &m->src[j++]);
+
+	for (i = 0; i < n; i++) {
+		struct lsm_source *s = &m->src[j++];
+
+		s->is_run = TRUE;
+		lsm_reader_init(&s->reader, lsm->runs[first + i]);
+		lsm_source_next(lsm, s);
+	}
+}
+
+/**
+ * Get next merged record, the newest version of each key.
+ *
+ * The record remains valid until the next call.
+ *
+ * @return TRUE if a record was returned, FALSE when done.
+ */
+static bool
+lsm_merge_next(struct lsm_merge *m, struct lsm_rec *rec)
+{
+	ssize_t w = -1;
+	size_t i;
+
+	if (m->pending >= 0)
+		lsm_source_next(m->lsm, &m->src[m->pending]);
+
+	for (i = 0; i < m->count; i++) {
+		const struct lsm_source *s = &m->src[i];
+
+		if (!s->valid)
+			continue;
+
+		if (
+			-1 == w ||
+			lsm_keycmp(s->rec.key, s->rec.klen,
+				m->src[w].rec.key, m->src[w].rec.klen) < 0
+		)
+			w = i;
+	}
+
+	if (-1 == w) {
+		m->pending = -1;
+		return FALSE;
+	}
+
+	/*
+	 * Older sources holding the same key are obsolete: skip their record.
+	 */
+
+	for (i = w + 1; i < m->count; i++) {
+		struct lsm_source *s = &m->src[i];
+
+		if (
+			s->valid &&
+			0 == lsm_keycmp(s->rec.key, s->rec.klen,
+				m->src[w].rec.key, m->src[w].rec.klen)
+		)
+			lsm_source_next(m->lsm, s);
+	}
+
+	*rec = m->src[w].rec;
+	m->pending = w;
+
+	return TRUE;
+}
+
+/**
+ * Terminate merge.
+ *
+ * @return TRUE if no I/O error occurred whilst reading the runs.
+ */
+static bool
+lsm_merge_close(struct lsm_merge *m)
+{
+	bool ok = TRUE;
+	size_t i;
+
+	for (i = 0; i < m->count; i++) {
+		struct lsm_source *s = &m->src[i];
+
+		if (s->is_run) {
+			if (s->reader.error)
+				ok = FALSE;
+			lsm_reader_free(&s->reader);
+		}
+	}
+
+	HFREE_NULL(m->src);
+	return ok;
+}
+
+/**
+ * Replace runs by the merged run, updating the manifest.
+ *
+ * @param lsm		the store
+ * @param first		index of the first replaced run
+ * @param n			amount of runs to replace
+ * @param run		the new run (NULL if empty)
+ */
+static void
+lsm_runs_replace(lsm_t *lsm, size_t first, size_t n, struct lsm_run *run)
+{
+	struct lsm_run **old;
+	size_t i, add = NULL == run ? 0 : 1;
+
+	g_assert(first + n <= lsm->nruns);
+
+	HALLOC_ARRAY(old, MAX(1, n));
+	for (i = 0; i < n; i++)
+		old[i] = lsm->runs[first + i];
+
+	if (add > n)
+		HREALLOC_ARRAY(lsm->runs, lsm->nruns + 1);
+
+	memmove(&lsm->runs[first + add], &lsm->runs[first + n],
+		(lsm->nruns - first - n) * sizeof lsm->runs[0]);
+
+	if (run != NULL)
+		lsm->runs[first] = run;
+
+	lsm->nruns = lsm->nruns - n + add;
+
+	/*
+	 * Only remove the old runs once the manifest no longer references them,
+	 * so that a crash leaves us with a consistent set of runs.
+	 */
+
+	if (lsm_manifest_write(lsm)) {
+		for (i = 0; i < n; i++)
+			lsm_run_free(old[i], TRUE);
+	} else {
+		for (i = 0; i < n; i++)
+			lsm_run_free(old[i], FALSE);
+	}
+
+	HFREE_NULL(old);
+}
+
+/**
+ * Merge consecutive runs into a single one.
+ *
+ * When the oldest run is part of the merge, tombstones and expired records
+ * are dropped.  Otherwise, expired records are turned into tombstones to
+ * hide their older versions.
+ *
+ * @param lsm		the store
+ * @param first		index of the first run to merge
+ * @param n			amount of runs to merge
+ *
+ * @return TRUE if OK.
+ */
+static bool
+lsm_merge(lsm_t *lsm, size_t first, size_t n)
+{
+	struct lsm_merge m;
+	struct lsm_writer *w;
+	struct lsm_run *run;
+	struct lsm_rec rec;
+	bool last = first + n == lsm->nruns;
+	size_t expected = 0, i;
+	time_t now = tm_time();
+
+	for (i = 0; i < n; i++)
+		expected += lsm->runs[first + i]->records;
+
+	w = lsm_writer_open(lsm, expected);
+	if (NULL == w)
+		return FALSE;
+
+	lsm_merge_init(&m, lsm, FALSE, first, n);
+
+	while (lsm_merge_next(&m, &rec)) {
+		if (rec.flags & LSM_F_TOMBSTONE) {
+			if (last)
+				continue;
+		} else if (lsm_expired(lsm, &rec, now)) {
+			/*
+			 * A newer version in the memtable, if any, is the visible one
+			 * and was already accounted for.
+			 */
+
+			if (0 == first && NULL == lsm_mem_lookup(lsm, rec.key, rec.klen)) {
+				g_assert(size_is_positive(lsm->count));
+				lsm->count--;
+			}
+			lsm->dropped++;
+
+			if (last)
+				continue;
+
+			rec.flags = LSM_F_TOMBSTONE;
+			rec.dlen = 0;
+			rec.expire = 0;
+		}
+
+		lsm_writer_add(w, &rec);
+	}
+
+	if (!lsm_merge_close(&m)) {
+		lsm_ioerr(lsm, "merge runs of", lsm->path, EIO);
+		run = lsm_writer_finish(lsm, w);
+		if (run != NULL)
+			lsm_run_free(run, TRUE);
+		return FALSE;
+	}
+
+	run = lsm_writer_finish(lsm, w);
+	if (NULL == run)
+		return FALSE;
+
+	if (0 == run->records) {
+		lsm_run_free(run, TRUE);
+		run = NULL;
+	}
+
+	lsm_runs_replace(lsm, first, n, run);
+	lsm->merges++;
+
+	return TRUE;
+}
+
+/**
+ * Merge the newest runs as long as they are not much smaller than the
+ * next ones, or when there are too many runs.
+ */
+static void
+lsm_maybe_merge(lsm_t *lsm)
+{
+	while (lsm->nruns >= 2) {
+		const struct lsm_run *newer = lsm->runs[0], *older = lsm->runs[1];
+
+		if (
+			lsm->nruns <= LSM_MAX_RUNS &&
+			newer->size * LSM_FANOUT < older->size
+		)
+			break;
+
+		if (!lsm_merge(lsm, 0, 2))
+			break;
+	}
+}
+
+/**
+ * Write the memtable as a new run.
+ *
+ * @return the amount of records flushed, -1 on error.
+ */
+static ssize_t
+lsm_flush(lsm_t *lsm)
+{
+	struct lsm_writer *w;
+	struct lsm_run *run;
+	rbnode_t *rn;
+	size_t n = erbtree_count(&lsm->memtable);
+
+	if (0 == n || lsm->rdonly)
+		return 0;
+
+	w = lsm_writer_open(lsm, n);
+	if (NULL == w)
+		return -1;
+
+	ERBTREE_FOREACH(&lsm->memtable, rn) {
+		const struct lsm_entry *e = erbtree_data(&lsm->memtable, rn);
+		struct lsm_rec rec;
+
+		/* Without runs, tombstones have nothing to hide */
+
+		if (0 == lsm->nruns && (e->flags & LSM_F_TOMBSTONE))
+			continue;
+
+		lsm_rec_from_entry(&rec, e);
+		lsm_writer_add(w, &rec);
+	}
+
+	run = lsm_writer_finish(lsm, w);
+	if (NULL == run)
+		return -1;
+
+	lsm_mem_clear(lsm);
+
+	if (0 == run->records)
+		lsm_run_free(run, TRUE);
+	else
+		lsm_runs_replace(lsm, 0, 0, run);
+
+	lsm->flushes++;
+	lsm_maybe_merge(lsm);
+
+	return n;
+}
+
+/***
+ *** Public interface.
+ ***/
+
+/**
+ * Store value for key, replacing any previous value.
+ *
+ * @param lsm		the store
+ * @param key		the key
+ * @param klen		key length
+ * @param data		the value
+ * @param dlen		value length
+ * @param existed	if non-NULL, written with whether the key existed
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+lsm_store(lsm_t *lsm, const void *key, size_t klen,
+	const void *data, size_t dlen, bool *existed)
+{
+	struct lsm_rec rec;
+	time_t expire;
+	int r;
+
+	lsm_check(lsm);
+	g_assert(size_is_positive(klen) && klen <= MAX_INT_VAL(uint16));
+	g_assert(dlen <= MAX_INT_VAL(uint32));
+	g_assert(!lsm->iterating);
+
+	if (lsm->rdonly) {
+		errno = EPERM;
+		return -1;
+	}
+
+	r = lsm_lookup(lsm, key, klen, &rec);
+	if (-1 == r)
+		return -1;
+
+	expire = NULL == lsm->expiry ? 0 : (*lsm->expiry)(key, klen, data, dlen);
+	lsm_mem_put(lsm, key, klen, data, dlen, expire, 0);
+
+	if (0 == r)
+		lsm->count++;
+
+	if (existed != NULL)
+		*existed = booleanize(r);
+
+	if (lsm->memsize >= LSM_MEMTABLE_MAX)
+		lsm_flush(lsm);		/* Errors are flagged, data remain in memory */
+
+	return 0;
+}
+
+/**
+ * Delete key.
+ *
+ * @return 0 if the key was deleted, -1 if it was not found (errno being
+ * set to 0) or on error (errno being set).
+ */
+int
+lsm_delete(lsm_t *lsm, const void *key, size_t klen)
+{
+	struct lsm_entry *e;
+	struct lsm_rec rec;
+	int r;
+
+	lsm_check(lsm);
+	g_assert(size_is_positive(klen) && klen <= MAX_INT_VAL(uint16));
+	g_assert(!lsm->iterating);
+
+	if (lsm->rdonly) {
+		errno = EPERM;
+		return -1;
+	}
+
+	r = lsm_lookup(lsm, key, klen, &rec);
+	if (r <= 0) {
+		if (0 == r)
+			errno = 0;
+		return -1;
+	}
+
+	/*
+	 * If the key is only known to the memtable, we can simply forget about
+	 * it.  Otherwise, we need a tombstone to hide the older versions.
+	 */
+
+	e = lsm_mem_lookup(lsm, key, klen);
+
+	if (e != NULL) {
+		r = lsm_runs_lookup(lsm, key, klen, &rec);
+		if (-1 == r)
+			return -1;
+		if (0 == r || (rec.flags & LSM_F_TOMBSTONE)) {
+			lsm_mem_remove(lsm, e);
+			goto deleted;
+		}
+	}
+
+	lsm_mem_put(lsm, key, klen, NULL, 0, 0, LSM_F_TOMBSTONE);
+
+deleted:
+	g_assert(size_is_positive(lsm->count));
+	lsm->count--;
+
+	if (lsm->memsize >= LSM_MEMTABLE_MAX)
+		lsm_flush(lsm);
+
+	return 0;
+}
+
+/**
+ * Check whether key exists.
+ *
+ * @return 1 if the key exists, 0 if not, -1 on error.
+ */
+int
+lsm_exists(lsm_t *lsm, const void *key, size_t klen)
+{
+	struct lsm_rec rec;
+
+	lsm_check(lsm);
+	g_assert(size_is_positive(klen) && klen <= MAX_INT_VAL(uint16));
+
+	return lsm_lookup(lsm, key, klen, &rec);
+}
+
+/**
+ * Fetch value for key.
+ *
+ * The returned data remain valid until the next operation on the store.
+ *
+ * @param lsm		the store
+ * @param key		the key
+ * @param klen		key length
+ * @param dlen		where the value length is written
+ *
+ * @return pointer to the value, NULL if not found or on error (errno being
+ * set to 0 when not found).
+ */
+void *
+lsm_fetch(lsm_t *lsm, const void *key, size_t klen, size_t *dlen)
+{
+	struct lsm_rec rec;
+	int r;
+
+	lsm_check(lsm);
+	g_assert(size_is_positive(klen) && klen <= MAX_INT_VAL(uint16));
+	g_assert(dlen != NULL);
+
+	r = lsm_lookup(lsm, key, klen, &rec);
+	if (r <= 0) {
+		if (0 == r)
+			errno = 0;
+		return NULL;
+	}
+
+	*dlen = rec.dlen;
+	return deconstify_pointer(rec.data);
+}
+
+/**
+ * Iterate over all the keys, invoking the callback on each.
+ *
+ * The callback must not modify the store.
+ *
+ * @return the amount of keys traversed.
+ */
+size_t
+lsm_foreach(lsm_t *lsm, lsm_cb_t cb, void *arg)
+{
+	struct lsm_merge m;
+	struct lsm_rec rec;
+	size_t n = 0;
+
+	lsm_check(lsm);
+	g_assert(cb != NULL);
+	g_assert(!lsm->iterating);
+
+	lsm->iterating = TRUE;
+	lsm_merge_init(&m, lsm, TRUE, 0, lsm->nruns);
+
+	while (lsm_merge_next(&m, &rec)) {
+		if (rec.flags & LSM_F_TOMBSTONE)
+			continue;
+		n++;
+		(*cb)(rec.key, rec.klen, rec.data, rec.dlen, arg);
+	}
+
+	if (lsm_merge_close(&m))
+		lsm->count = n;		/* Resynchronize, in case we were off */
+	else
+		lsm_ioerr(lsm, "iterate over", lsm->path, EIO);
+
+	lsm->iterating = FALSE;
+
+	return n;
+}
+
+/**
+ * A key collected for deletion.
+ */
+struct lsm_key {
+	char *key;
+	size_t klen;
+};
+
+struct lsm_remove_ctx {
+	lsm_cb_t cb;
+	void *arg;
+	struct lsm_key *keys;
+	size_t count;
+	size_t size;
+};
+
+static bool
+lsm_foreach_remove_collect(const void *key, size_t klen,
+	const void *data, size_t dlen, void *arg)
+{
+	struct lsm_remove_ctx *ctx = arg;
+
+	if ((*ctx->cb)(key, klen, data, dlen, ctx->arg)) {
+		struct lsm_key *k;
+
+		if (ctx->count >= ctx->size) {
+			ctx->size = MAX(16, ctx->size * 2);
+			HREALLOC_ARRAY(ctx->keys, ctx->size);
+		}
+
+		k = &ctx->keys[ctx->count++];
+		k->key = wcopy(key, klen);
+		k->klen = klen;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Iterate over all the keys, removing the ones for which the callback
+ * returns TRUE.
+ *
+ * @return the amount of keys kept.
+ */
+size_t
+lsm_foreach_remove(lsm_t *lsm, lsm_cb_t cb, void *arg)
+{
+	struct lsm_remove_ctx ctx;
+	size_t n, i;
+
+	lsm_check(lsm);
+	g_assert(cb != NULL);
+
+	ZERO(&ctx);
+	ctx.cb = cb;
+	ctx.arg = arg;
+
+	n = lsm_foreach(lsm, lsm_foreach_remove_collect, &ctx);
+
+	for (i = 0; i < ctx.count; i++) {
+		struct lsm_key *k = &ctx.keys[i];
+
+		if (0 == lsm_delete(lsm, k->key, k->klen))
+			n--;
+		wfree(k->key, k->klen);
+	}
+
+	HFREE_NULL(ctx.keys);
+
+	return n;
+}
+
+/**
+ * Flush pending changes to disk.
+ *
+ * @return the amount of records flushed, -1 on error.
+ */
+ssize_t
+lsm_sync(lsm_t *lsm)
+{
+	lsm_check(lsm);
+
+	return lsm_flush(lsm);
+}
+
+/**
+ * Flush pending changes and merge all the runs into one, discarding
+ * deleted and expired records.
+ *
+ * @return TRUE if OK.
+ */
+bool
+lsm_compact(lsm_t *lsm)
+{
+	lsm_check(lsm);
+
+	if (lsm->rdonly)
+		return FALSE;
+
+	if (-1 == lsm_flush(lsm))
+		return FALSE;
+
+	if (0 == lsm->nruns)
+		return TRUE;
+
+	return lsm_merge(lsm, 0, lsm->nruns);
+}
+
+/**
+ * Remove all the keys.
+ *
+ * @return 0 if OK, -1 on error.
+ */
+int
+lsm_clear(lsm_t *lsm)
+{
+	size_t i;
+
+	lsm_check(lsm);
+	g_assert(!lsm->iterating);
+
+	if (lsm->rdonly) {
+		errno = EPERM;
+		return -1;
+	}
+
+	lsm_mem_clear(lsm);
+
+	for (i = 0; i < lsm->nruns; i++)
+		lsm_run_free(lsm->runs[i], TRUE);
+
+	lsm->nruns = 0;
+	lsm->count = 0;
+
+	return lsm_manifest_write(lsm) ? 0 : -1;
+}
+
+/**
+ * Open store.
+ *
+ * @param path		base path of the files
+ * @param flags		open() flags, O_CREAT and O_TRUNC being honoured
+ * @param mode		permissions of created files
+ *
+ * @return the store, NULL on error with errno set.
+ */
+lsm_t *
+lsm_open(const char *path, int flags, int mode)
+{
+	lsm_t *lsm;
+	uint32 *seqs;
+	size_t nruns = 0, i;
+
+	g_assert(path != NULL);
+
+	if (flags & O_TRUNC)
+		lsm_unlink(path);
+
+	WALLOC0(lsm);
+	lsm->magic = LSM_MAGIC;
+	lsm->path = h_strdup(path);
+	lsm->mode = mode;
+	lsm->rdonly = O_RDONLY == (flags & O_ACCMODE);
+	erbtree_init(&lsm->memtable, lsm_entry_cmp,
+		offsetof(struct lsm_entry, node));
+
+	seqs = lsm_manifest_read(path, &lsm->count, &lsm->next_seq, &nruns);
+
+	if (NULL == seqs) {
+		if (ENOENT != errno || !(flags & O_CREAT) || lsm->rdonly)
+			goto failed;
+		if (!lsm_manifest_write(lsm))
+			goto failed;
+		return lsm;
+	}
+
+	HALLOC0_ARRAY(lsm->runs, MAX(1, nruns));
+
+	for (i = 0; i < nruns; i++) {
+		struct lsm_run *run = lsm_run_open(lsm, seqs[i]);
+
+		if (NULL == run) {
+			size_t j;
+
+			for (j = 0; j < lsm->nruns; j++)
+				lsm_run_free(lsm->runs[j], FALSE);
+			lsm->nruns = 0;
+			HFREE_NULL(seqs);
+			goto failed;
+		}
+
+		lsm->runs[lsm->nruns++] = run;
+	}
+
+	HFREE_NULL(seqs);
+	return lsm;
+
+failed:
+	{
+		int saved = errno;
+
+		HFREE_NULL(lsm->runs);
+		HFREE_NULL(lsm->path);
+		lsm->magic = 0;
+		WFREE(lsm);
+		errno = saved;
+	}
+	return NULL;
+}
+
+/**
+ * Close store, flushing pending changes unless it is volatile, in which
+ * case all its files are removed.
+ */
+void
+lsm_close(lsm_t *lsm)
+{
+	size_t i;
+
+	if (NULL == lsm)
+		return;
+
+	lsm_check(lsm);
+	g_assert(!lsm->iterating);
+
+	if (!lsm->is_volatile)
+		lsm_flush(lsm);
+
+	if (common_stats) {
+		s_debug("LSM \"%s\": %zu key%s in %zu run%s, "
+			"%lu flush%s, %lu merge%s, %lu expired record%s dropped",
+			lsm_name(lsm), PLURAL(lsm->count), PLURAL(lsm->nruns),
+			PLURAL_ES(lsm->flushes), PLURAL(lsm->merges),
+			PLURAL(lsm->dropped));
+	}
+
+	lsm_mem_clear(lsm);
+
+	for (i = 0; i < lsm->nruns; i++)
+		lsm_run_free(lsm->runs[i], lsm->is_volatile);
+
+	if (lsm->is_volatile) {
+		char *file = lsm_manifest_path(lsm->path);
+
+		if (-1 == unlink(file) && ENOENT != errno)
+			s_warning("LSM cannot unlink \"%s\": %m", file);
+		HFREE_NULL(file);
+	}
+
+	HFREE_NULL(lsm->runs);
+	HFREE_NULL(lsm->buf);
+	HFREE_NULL(lsm->name);
+	HFREE_NULL(lsm->path);
+	lsm->magic = 0;
+	WFREE(lsm);
+}
+
+/**
+ * @return whether a store exists at the given path.
+ */
+bool
+lsm_exists_on_disk(const char *path)
+{
+	char *file = lsm_manifest_path(path);
+	bool exists = file_exists(file);
+
+	HFREE_NULL(file);
+	return exists;
+}
+
+/**
+ * Rename store files.
+ *
+ * @param old_path		current base path
+ * @param new_path		new base path
+ */
+void
+lsm_move(const char *old_path, const char *new_path)
+{
+	size_t count, nruns = 0, i;
+	uint32 next_seq, *seqs;
+	char *old_file, *new_file;
+
+	seqs = lsm_manifest_read(old_path, &count, &next_seq, &nruns);
+	if (NULL == seqs)
+		return;
+
+	for (i = 0; i < nruns; i++) {
+		old_file = lsm_run_path(old_path, seqs[i]);
+		new_file = lsm_run_path(new_path, seqs[i]);
+
+		if (-1 == rename(old_file, new_file))
+			s_warning("LSM cannot rename \"%s\" as \"%s\": %m",
+				old_file, new_file);
+
+		HFREE_NULL(old_file);
+		HFREE_NULL(new_file);
+	}
+
+	/* Manifest last, so that a failure leaves the old store usable */
+
+	old_file = lsm_manifest_path(old_path);
+	new_file = lsm_manifest_path(new_path);
+
+	if (-1 == rename(old_file, new_file))
+		s_warning("LSM cannot rename \"%s\" as \"%s\": %m", old_file, new_file);
+
+	HFREE_NULL(old_file);
+	HFREE_NULL(new_file);
+	HFREE_NULL(seqs);
+}
+
+/**
+ * Remove store files.
+ */
+void
+lsm_unlink(const char *path)
+{
+	size_t count, nruns = 0, i;
+	uint32 next_seq, *seqs;
+	char *file;
+
+	seqs = lsm_manifest_read(path, &count, &next_seq, &nruns);
+
+	for (i = 0; i < nruns; i++) {
+		file = lsm_run_path(path, seqs[i]);
+		if (-1 == unlink(file) && ENOENT != errno)
+			s_warning("LSM cannot unlink \"%s\": %m", file);
+		HFREE_NULL(file);
+	}
+
+	file = lsm_manifest_path(path);
+	if (-1 == unlink(file) && ENOENT != errno)
+		s_warning("LSM cannot unlink \"%s\": %m", file);
+
+	HFREE_NULL(file);
+	HFREE_NULL(seqs);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
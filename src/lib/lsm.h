@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Log-structured merge tree.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _lsm_h_
+#define _lsm_h_
+
+#define LSM_MANIFEST_FEXT	".lsm"		/**< Extension of the manifest file */
+
+struct lsm;
+typedef struct lsm lsm_t;
+
+/**
+ * Computes the expiration time of a record, given its key and value.
+ *
+ * @return the absolute expiration time, 0 if the record never expires.
+ */
+typedef time_t (*lsm_expiry_t)(const void *key, size_t klen,
+	const void *data, size_t dlen);
+
+/**
+ * Iteration callback.
+ *
+ * @return TRUE if the record must be removed, for lsm_foreach_remove().
+ */
+typedef bool (*lsm_cb_t)(const void *key, size_t klen,
+	const void *data, size_t dlen, void *arg);
+
+/*
+ * Public interface.
+ */
+
+lsm_t *lsm_open(const char *path, int flags, int mode);
+void lsm_close(lsm_t *lsm);
+void lsm_set_name(lsm_t *lsm, const char *name);
+const char *lsm_name(const lsm_t *lsm);
+void lsm_set_volatile(lsm_t *lsm, bool yes);
+void lsm_set_expiry(lsm_t *lsm, lsm_expiry_t cb, time_delta_t grace);
+bool lsm_error(const lsm_t *lsm);
+void lsm_clearerr(lsm_t *lsm);
+size_t lsm_count(const lsm_t *lsm);
+
+int lsm_store(lsm_t *lsm, const void *key, size_t klen,
+	const void *data, size_t dlen, bool *existed);
+int lsm_delete(lsm_t *lsm, const void *key, size_t klen);
+int lsm_exists(lsm_t *lsm, const void *key, size_t klen);
+void *lsm_fetch(lsm_t *lsm, const void *key, size_t klen, size_t *dlen);
+
+size_t lsm_foreach(lsm_t *lsm, lsm_cb_t cb, void *arg);
+size_t lsm_foreach_remove(lsm_t *lsm, lsm_cb_t cb, void *arg);
+
+ssize_t lsm_sync(lsm_t *lsm);
+bool lsm_compact(lsm_t *lsm);
+int lsm_clear(lsm_t *lsm);
+
+bool lsm_exists_on_disk(const char *path);
+void lsm_move(const char *old_path, const char *new_path);
+void lsm_unlink(const char *path);
+
+#endif /* _lsm_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Global memory pressure monitoring.
+ *
+ * The memory budget of the process is the amount of physical memory, or
+ * the memory limit of the control group we are running in, if lower.
+ * Periodically, we compare the resident set size of the process with that
+ * budget and look at the pressure stall information (PSI) reported by the
+ * kernel, which tells how much time tasks spend waiting on memory, to
+ * derive a global memory pressure level.
+ *
+ * Caches holding memory that could be released register a shrinker, made
+ * of a callback reporting how much memory is held and another to release
+ * some of it, along with the cost of rebuilding what is released.  Under
+ * pressure, shrinkers are ranked by the amount of memory they hold per unit
+ * of cost and asked in turn to release memory until we are back below our
+ * target.  The higher the pressure level, the more expensive shrinkers we
+ * are willing to call.  When the pressure is gone, shrinkers are told so
+ * that caches can grow back to their nominal sizes.
+ *
+ * Shrinkers may be registered from any thread but they are invoked from
+ * the main thread.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "mempress.h"
+
+#include "ascii.h"
+#include "atomic.h"
+#include "cq.h"
+#include "filehead.h"
+#include "getphysmemsize.h"
+#include "misc.h"
+#include "parse.h"
+#include "pslist.h"
+#include "spinlock.h"
+#include "walloc.h"
+#include "xmalloc.h"
+#include "xsort.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define MEMPRESS_PERIOD		5000	/**< Check every 5 secs, in ms */
+#define MEMPRESS_BUFLEN		512		/**< Size of buffer to read /proc files */
+
+/*
+ * Memory pressure thresholds, as a percentage of the budget used by the
+ * resident set.  When shrinking, we aim at MEMPRESS_TARGET_PCT.
+ */
+#define MEMPRESS_TARGET_PCT	70
+#define MEMPRESS_LOW_PCT	75
+#define MEMPRESS_HIGH_PCT	85
+#define MEMPRESS_CRIT_PCT	95
+
+/*
+ * Pressure stall thresholds, in 1/100 of percents of the "avg10" values,
+ * i.e. the share of the last 10 seconds during which some (or all) tasks
+ * were stalled waiting for memory.
+ */
+#define MEMPRESS_PSI_SOME_LOW	500		/**< 5% */
+#define MEMPRESS_PSI_SOME_HIGH	2000	/**< 20% */
+#define MEMPRESS_PSI_FULL_CRIT	1000	/**< 10% */
+
+enum mempress_shrinker_magic { MEMPRESS_SHRINKER_MAGIC = 0x2f6c08a1 };
+
+/**
+ * A registered shrinker.
+ */
+struct mempress_shrinker {
+	enum mempress_shrinker_magic magic;
+	const char *name;			/**< Name, for logging (static string) */
+	mempress_usage_t usage;		/**< Reports amount of memory held */
+	mempress_shrink_t shrink;	/**< Releases memory */
+	void *data;					/**< User data for callbacks */
+	mempress_cost_t cost;		/**< Cost of rebuilding released memory */
+	size_t released;			/**< Total amount of memory released */
+};
+
+static inline void
+mempress_shrinker_check(const struct mempress_shrinker * const ms)
+{
+	g_assert(ms != NULL);
+	g_assert(MEMPRESS_SHRINKER_MAGIC == ms->magic);
+}
+
+/**
+ * A shrinker candidate, during shrinking.
+ */
+struct mempress_candidate {
+	mempress_shrinker_t *ms;
+	size_t usage;
+};
+
+static pslist_t *mempress_shrinkers;		/**< Registered shrinkers */
+static spinlock_t mempress_slk = SPINLOCK_INIT;
+static int mempress_current;				/**< Current mempress_level_t */
+static size_t mempress_limit;				/**< Memory budget */
+static cperiodic_t *mempress_ev;
+
+#define MEMPRESS_LOCK		spinlock(&mempress_slk)
+#define MEMPRESS_UNLOCK		spinunlock(&mempress_slk)
+
+/**
+ * @return English description of the pressure level.
+ */
+const char *
+mempress_level_to_string(mempress_level_t level)
+{
+	switch (level) {
+	case MEMPRESS_NONE:		return "none";
+	case MEMPRESS_LOW:		return "low";
+	case MEMPRESS_HIGH:		return "high";
+	case MEMPRESS_CRITICAL:	return "critical";
+	}
+
+	return "unknown";
+}
+
+/**
+ * Register a new shrinker.
+ *
+ * @param name		name of the shrinker, for logging (static string)
+ * @param cost		cost of rebuilding the memory released
+ * @param usage		callback reporting the amount of memory held
+ * @param shrink	callback releasing memory
+ * @param data		user data passed to callbacks
+ *
+ * @return the shrinker handle.
+ */
+mempress_shrinker_t *
+mempress_register(const char *name, mempress_cost_t cost,
+	mempress_usage_t usage, mempress_shrink_t shrink, void *data)
+{
+	mempress_shrinker_t *ms;
+
+	g_assert(name != NULL);
+	g_assert(usage != NULL);
+	g_assert(shrink != NULL);
+
+	WALLOC0(ms);
+	ms->magic = MEMPRESS_SHRINKER_MAGIC;
+	ms->name = name;
+	ms->cost = cost;
+	ms->usage = usage;
+	ms->shrink = shrink;
+	ms->data = data;
+
+	MEMPRESS_LOCK;
+	mempress_shrinkers = pslist_prepend(mempress_shrinkers, ms);
+	MEMPRESS_UNLOCK;
+
+	return ms;
+}
+
+/**
+ * Unregister shrinker and nullify its handle.
+ */
+void
+mempress_unregister(mempress_shrinker_t **ms_ptr)
+{
+	mempress_shrinker_t *ms = *ms_ptr;
+
+	if (ms != NULL) {
+		mempress_shrinker_check(ms);
+
+		MEMPRESS_LOCK;
+		mempress_shrinkers = pslist_remove(mempress_shrinkers, ms);
+		MEMPRESS_UNLOCK;
+
+		ms->magic = 0;
+		WFREE(ms);
+		*ms_ptr = NULL;
+	}
+}
+
+/**
+ * @return the resident set size of the process, 0 if unknown.
+ */
+size_t
+mempress_rss(void)
+{
+	char buf[MEMPRESS_BUFLEN];
+	const char *p;
+	uint64 resident;
+	int error;
+
+	/*
+	 * The first value is the total program size, then comes the size of
+	 * the resident set, both in pages.
+	 */
+
+	if (-1 == filehead_read("/proc/self/statm", TRUE, ARYLEN(buf)))
+		return 0;
+
+	p = strchr(buf, ' ');
+	if (NULL == p)
+		return 0;
+
+	resident = parse_uint64(p + 1, NULL, 10, &error);
+	if (error)
+		return 0;
+
+	return resident * compat_pagesize();
+}
+
+/**
+ * @return the memory limit of our control group, 0 if none.
+ */
+static uint64
+mempress_cgroup_limit(void)
+{
+	static const char *files[] = {
+		"/sys/fs/cgroup/memory.high",					/* cgroup v2 */
+		"/sys/fs/cgroup/memory.max",					/* cgroup v2 */
+		"/sys/fs/cgroup/memory/memory.limit_in_bytes",	/* cgroup v1 */
+	};
+	uint64 limit = 0;
+	uint i;
+
+	/*
+	 * With cgroup v2, "max" is reported when there is no limit, which will
+	 * fail to parse.  With cgroup v1, a very large value is reported, which
+	 * will be above the physical memory size anyway.
+	 */
+
+	for (i = 0; i < N_ITEMS(files); i++) {
+		int error;
+		uint64 value = filehead_uint64(files[i], TRUE, &error);
+
+		if (0 == error && value != 0 && (0 == limit || value < limit))
+			limit = value;
+	}
+
+	return limit;
+}
+
+/**
+ * @return the memory budget of the process.
+ */
+static size_t
+mempress_compute_budget(void)
+{
+	uint64 limit = getphysmemsize();
+	uint64 cgroup = mempress_cgroup_limit();
+
+	if (cgroup != 0 && cgroup < limit)
+		limit = cgroup;
+
+	return MIN(limit, MAX_INT_VAL(size_t));
+}
+
+/**
+ * Parse the "avg10" value of given line kind in PSI data.
+ *
+ * @return value in 1/100 of percents, 0 if not found.
+ */
+static uint
+mempress_psi_field(const char *buf, const char *kind)
+{
+	const char *p, *end;
+	uint value;
+	int error;
+
+	p = strstr(buf, kind);
+	if (NULL == p)
+		return 0;
+
+	p = strstr(p, "avg10=");
+	if (NULL == p)
+		return 0;
+
+	value = parse_uint32(p + CONST_STRLEN("avg10="), &end, 10, &error);
+	if (error)
+		return 0;
+
+	value *= 100;
+
+	if ('.' == end[0] && is_ascii_digit(end[1])) {
+		value += 10 * (end[1] - '0');
+		if (is_ascii_digit(end[2]))
+			value += end[2] - '0';
+	}
+
+	return value;
+}
+
+/**
+ * Read memory pressure stall information, for our control group if
+ * available, otherwise for the whole system.
+ *
+ * @param some		where the "some" avg10 value is written
+ * @param full		where the "full" avg10 value is written
+ */
+static void
+mempress_psi(uint *some, uint *full)
+{
+	char buf[MEMPRESS_BUFLEN];
+
+	*some = *full = 0;
+
+	if (
+		-1 == filehead_read("/sys/fs/cgroup/memory.pressure",
+			TRUE, ARYLEN(buf)) &&
+		-1 == filehead_read("/proc/pressure/memory", TRUE, ARYLEN(buf))
+	)
+		return;
+
+	*some = mempress_psi_field(buf, "some");
+	*full = mempress_psi_field(buf, "full");
+}
+
+/**
+ * Compute memory pressure level.
+ */
+static mempress_level_t
+mempress_compute_level(size_t rss, size_t limit, uint some, uint full)
+{
+	uint pct = 0 == limit ? 0 : 100 * (uint64) rss / limit;
+
+	if (pct >= MEMPRESS_CRIT_PCT || full >= MEMPRESS_PSI_FULL_CRIT)
+		return MEMPRESS_CRITICAL;
+
+	if (pct >= MEMPRESS_HIGH_PCT || some >= MEMPRESS_PSI_SOME_HIGH)
+		return MEMPRESS_HIGH;
+
+	if (pct >= MEMPRESS_LOW_PCT || some >= MEMPRESS_PSI_SOME_LOW)
+		return MEMPRESS_LOW;
+
+	return MEMPRESS_NONE;
+}
+
+/**
+ * @return current memory pressure level.
+ */
+mempress_level_t
+mempress_level(void)
+{
+	return atomic_int_get(&mempress_current);
+}
+
+/**
+ * @return the memory budget of the process, 0 if not computed yet.
+ */
+size_t
+mempress_budget(void)
+{
+	return mempress_limit;
+}
+
+/**
+ * Take a snapshot of the registered shrinkers.
+ *
+ * @param count		where the amount of shrinkers is written
+ *
+ * @return array of candidates, to be freed with xfree().
+ */
+static struct mempress_candidate *
+mempress_snapshot(size_t *count)
+{
+	struct mempress_candidate *cv;
+	pslist_t *sl;
+	size_t i = 0;
+
+	MEMPRESS_LOCK;
+
+	*count = pslist_length(mempress_shrinkers);
+	XMALLOC_ARRAY(cv, MAX(1, *count));
+
+	PSLIST_FOREACH(mempress_shrinkers, sl) {
+		cv[i].ms = sl->data;
+		cv[i++].usage = 0;
+	}
+
+	MEMPRESS_UNLOCK;
+
+	return cv;
+}
+
+/**
+ * Sort shrinkers by decreasing amount of memory held per unit of cost.
+ */
+static int
+mempress_candidate_cmp(const void *a, const void *b)
+{
+	const struct mempress_candidate *ca = a, *cb = b;
+	uint64 wa = (uint64) ca->usage * cb->ms->cost;
+	uint64 wb = (uint64) cb->usage * ca->ms->cost;
+
+	return CMP(wb, wa);
+}
+
+/**
+ * Let caches grow back now that the pressure is gone.
+ */
+static void
+mempress_relax(void)
+{
+	struct mempress_candidate *cv;
+	size_t i, n;
+
+	cv = mempress_snapshot(&n);
+
+	for (i = 0; i < n; i++) {
+		mempress_shrinker_t *ms = cv[i].ms;
+
+		mempress_shrinker_check(ms);
+		(void) (*ms->shrink)(ms->data, 0, MEMPRESS_NONE);
+	}
+
+	xfree(cv);
+}
+
+/**
+ * Ask shrinkers to release memory.
+ *
+ * @param level		the current memory pressure level
+ * @param rss		the current resident set size
+ */
+static void
+mempress_shrink(mempress_level_t level, size_t rss)
+{
+	struct mempress_candidate *cv;
+	size_t i, n, m, total = 0, need = 0, freed = 0;
+	size_t target = (uint64) mempress_limit * MEMPRESS_TARGET_PCT / 100;
+	mempress_cost_t max_cost;
+
+	switch (level) {
+	case MEMPRESS_LOW:		max_cost = MEMPRESS_COST_FREE;  break;
+	case MEMPRESS_HIGH:		max_cost = MEMPRESS_COST_CHEAP; break;
+	case MEMPRESS_CRITICAL:	max_cost = MEMPRESS_COST_DEAR;  break;
+	case MEMPRESS_NONE:
+	default:
+		g_assert_not_reached();
+		return;
+	}
+
+	cv = mempress_snapshot(&n);
+
+	/*
+	 * Only keep the shrinkers we are willing to call at this level, and
+	 * which hold memory.
+	 */
+
+	for (i = m = 0; i < n; i++) {
+		mempress_shrinker_t *ms = cv[i].ms;
+		size_t usage;
+
+		mempress_shrinker_check(ms);
+
+		if (ms->cost > max_cost)
+			continue;
+
+		usage = (*ms->usage)(ms->data);
+		if (0 == usage)
+			continue;
+
+		cv[m].ms = ms;
+		cv[m++].usage = usage;
+		total += usage;
+	}
+
+	/*
+	 * Release what brings us back to our target, and at least a fraction
+	 * of the memory held, since pressure can be signaled by the kernel
+	 * whilst our own footprint is below target.
+	 */
+
+	if (rss > target)
+		need = rss - target;
+
+	need = MAX(need, total >> (MEMPRESS_CRITICAL - level + 1));
+
+	xsort(cv, m, sizeof cv[0], mempress_candidate_cmp);
+
+	for (i = 0; i < m && need != 0; i++) {
+		mempress_shrinker_t *ms = cv[i].ms;
+		size_t released;
+
+		released = (*ms->shrink)(ms->data, MIN(need, cv[i].usage), level);
+		ms->released += released;
+		freed += released;
+		need -= MIN(need, released);
+	}
+
+	xfree(cv);
+
+	if (level >= MEMPRESS_HIGH) {
+		s_info("%s(): %s pressure, released %s out of %s held by caches "
+			"(RSS is %s, budget is %s)",
+			G_STRFUNC, mempress_level_to_string(level),
+			compact_size(freed, FALSE), compact_size2(total, FALSE),
+			short_size(rss, FALSE), short_size2(mempress_limit, FALSE));
+	}
+}
+
+/**
+ * Callout queue periodic event to monitor memory pressure.
+ */
+static bool
+mempress_periodic(void *unused_obj)
+{
+	mempress_level_t level, old;
+	size_t rss;
+	uint some, full;
+
+	(void) unused_obj;
+
+	mempress_limit = mempress_compute_budget();
+	rss = mempress_rss();
+	mempress_psi(&some, &full);
+
+	level = mempress_compute_level(rss, mempress_limit, some, full);
+	old = atomic_int_get(&mempress_current);
+	atomic_int_set(&mempress_current, level);
+
+	if (level != old) {
+		s_info("memory pressure now %s (RSS %s, budget %s, "
+			"PSI some %u.%02u%%, full %u.%02u%%)",
+			mempress_level_to_string(level),
+			short_size(rss, FALSE), short_size2(mempress_limit, FALSE),
+			some / 100, some % 100, full / 100, full % 100);
+	}
+
+	if (MEMPRESS_NONE == level) {
+		if (old != MEMPRESS_NONE)
+			mempress_relax();
+	} else {
+		mempress_shrink(level, rss);
+	}
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Initialize memory pressure monitoring.
+ */
+void G_COLD
+mempress_init(void)
+{
+	g_assert(NULL == mempress_ev);
+
+	mempress_limit = mempress_compute_budget();
+	mempress_ev = cq_periodic_main_add(MEMPRESS_PERIOD,
+		mempress_periodic, NULL);
+}
+
+/**
+ * Stop memory pressure monitoring.
+ *
+ * Shrinkers are not freed since their owners may still hold the handles.
+ */
+void G_COLD
+mempress_close(void)
+{
+	cq_periodic_remove(&mempress_ev);
+	atomic_int_set(&mempress_current, MEMPRESS_NONE);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Global memory pressure monitoring.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _mempress_h_
+#define _mempress_h_
+
+/**
+ * Memory pressure levels.
+ */
+typedef enum mempress_level {
+	MEMPRESS_NONE = 0,		/**< No pressure, caches may grow back */
+	MEMPRESS_LOW,			/**< Getting close to the memory budget */
+	MEMPRESS_HIGH,			/**< Over the budget, or stalling on memory */
+	MEMPRESS_CRITICAL		/**< About to run out of memory */
+} mempress_level_t;
+
+/**
+ * Cost of rebuilding the memory released by a shrinker, used as a weight
+ * when ranking shrinkers: cheaper ones are asked first.
+ */
+typedef enum mempress_cost {
+	MEMPRESS_COST_FREE = 1,		/**< Unused memory kept for reuse */
+	MEMPRESS_COST_CHEAP = 4,	/**< Data reloaded from disk on demand */
+	MEMPRESS_COST_DEAR = 16		/**< Data costly to rebuild (network, CPU) */
+} mempress_cost_t;
+
+/**
+ * Shrinker callback to compute the amount of memory held.
+ *
+ * @param data		user-supplied data
+ *
+ * @return amount of bytes that could be released.
+ */
+typedef size_t (*mempress_usage_t)(void *data);
+
+/**
+ * Shrinker callback to release memory.
+ *
+ * When the pressure is gone, the callback is invoked with a zero amount and
+ * MEMPRESS_NONE to let the cache go back to its nominal limits.
+ *
+ * @param data		user-supplied data
+ * @param amount	amount of bytes we would like to see released
+ * @param level		current memory pressure level
+ *
+ * @return amount of bytes released.
+ */
+typedef size_t (*mempress_shrink_t)(void *data,
+	size_t amount, mempress_level_t level);
+
+typedef struct mempress_shrinker mempress_shrinker_t;
+
+/*
+ * Public interface.
+ */
+
+mempress_shrinker_t *mempress_register(const char *name, mempress_cost_t cost,
+	mempress_usage_t usage, mempress_shrink_t shrink, void *data);
+void mempress_unregister(mempress_shrinker_t **ms_ptr);
+
+mempress_level_t mempress_level(void);
+const char *mempress_level_to_string(mempress_level_t level);
+size_t mempress_budget(void);
+size_t mempress_rss(void);
+
+void mempress_init(void);
+void mempress_close(void);
+
+#endif /* _mempress_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
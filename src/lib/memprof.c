@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Sampling allocation profiler.
+ *
+ * Full allocation tracking, as done by memusage for a given zone, captures
+ * the stack of every allocation and is therefore too costly to be enabled
+ * on a running servent.
+ *
+ * Here we only capture the stack of one allocation out of ``period'', on a
+ * per-thread basis, and aggregate the sampled blocks by allocation site.
+ * Sampled blocks are remembered so that freeing them updates the amount of
+ * live memory attributed to their site.  Multiplying the sampled figures
+ * by the period gives an estimate of the real ones.
+ *
+ * When profiling is off, the cost is a mere test of a global variable at
+ * allocation and freeing time.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "memprof.h"
+#include "hashtable.h"
+#include "log.h"
+#include "mutex.h"
+#include "signal.h"
+#include "stacktrace.h"
+#include "stringify.h"
+#include "thread.h"
+#include "timestamp.h"
+#include "tm.h"
+#include "vsort.h"
+#include "xmalloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+/**
+ * Statistics about an allocation site.
+ */
+struct memprof_site {
+	const struct stackatom *where;	/**< Allocation stack (atom) */
+	uint64 allocs;					/**< Sampled allocations */
+	uint64 bytes;					/**< Sampled bytes allocated */
+	size_t live;					/**< Sampled blocks still allocated */
+	size_t live_bytes;				/**< Size of these live blocks */
+};
+
+/**
+ * A sampled block, still allocated.
+ */
+struct memprof_block {
+	struct memprof_site *site;		/**< Where block was allocated */
+	size_t size;					/**< Block size */
+};
+
+uint memprof_period;				/**< Sampling period, 0 if disabled */
+size_t memprof_live;				/**< Amount of live sampled blocks */
+
+static hash_table_t *memprof_sites;		/**< stackatom -> memprof_site */
+static hash_table_t *memprof_blocks;	/**< address -> memprof_block */
+static uint memprof_countdown[THREAD_MAX];
+static bool memprof_inside[THREAD_MAX];
+static time_t memprof_started;
+static mutex_t memprof_mtx = MUTEX_INIT;
+
+#define MEMPROF_LOCK	mutex_lock(&memprof_mtx)
+#define MEMPROF_UNLOCK	mutex_unlock(&memprof_mtx)
+
+/**
+ * Forget about a sampled block.
+ *
+ * Must be called with the lock held.
+ */
+static void
+memprof_forget(const void *p)
+{
+	struct memprof_block *mb;
+
+	mb = hash_table_lookup(memprof_blocks, p);
+	if (NULL == mb)
+		return;
+
+	mb->site->live--;
+	mb->site->live_bytes -= mb->size;
+	hash_table_remove(memprof_blocks, p);
+	xfree(mb);
+	memprof_live--;
+}
+
+/**
+ * Record allocation of a new block, sampling one in ``memprof_period''.
+ *
+ * This is normally called through the MEMPROF_ALLOC() macro, by the
+ * allocator itself, whose caller is the allocation site.
+ */
+void
+memprof_allocated(void *p, size_t size)
+{
+	uint stid = thread_small_id();
+	struct stacktrace t;
+	const struct stackatom *where;
+	struct memprof_site *ms;
+	struct memprof_block *mb;
+
+	/*
+	 * The countdown is per-thread, hence needs no locking.
+	 */
+
+	if G_LIKELY(memprof_countdown[stid] > 1) {
+		memprof_countdown[stid]--;
+		return;
+	}
+
+	memprof_countdown[stid] = memprof_period;
+
+	if G_UNLIKELY(memprof_inside[stid] || signal_in_handler())
+		return;
+
+	memprof_inside[stid] = TRUE;
+
+	stacktrace_get_offset(&t, 2);		/* Remove ourselves and allocator */
+	where = stacktrace_get_atom(&t);	/* Never freed, always same address */
+
+	MEMPROF_LOCK;
+
+	if G_UNLIKELY(NULL == memprof_sites)
+		goto done;						/* Profiling stopped meanwhile */
+
+	ms = hash_table_lookup(memprof_sites, where);
+	if (NULL == ms) {
+		XMALLOC0(ms);
+		ms->where = where;
+		hash_table_insert(memprof_sites, where, ms);
+	}
+
+	ms->allocs++;
+	ms->bytes += size;
+
+	/*
+	 * If the address is already known, we missed its freeing, so the
+	 * previous block is forgotten.
+	 */
+
+	memprof_forget(p);
+
+	XMALLOC(mb);
+	mb->site = ms;
+	mb->size = size;
+	hash_table_insert(memprof_blocks, p, mb);
+
+	ms->live++;
+	ms->live_bytes += size;
+	memprof_live++;
+
+done:
+	MEMPROF_UNLOCK;
+	memprof_inside[stid] = FALSE;
+}
+
+/**
+ * Record freeing of a block, which may have been sampled.
+ *
+ * This is normally called through the MEMPROF_FREE() macro.
+ */
+void
+memprof_freed(const void *p, size_t size)
+{
+	uint stid = thread_small_id();
+
+	(void) size;
+
+	if G_UNLIKELY(memprof_inside[stid] || signal_in_handler())
+		return;
+
+	memprof_inside[stid] = TRUE;
+	MEMPROF_LOCK;
+
+	if G_LIKELY(memprof_blocks != NULL)
+		memprof_forget(p);
+
+	MEMPROF_UNLOCK;
+	memprof_inside[stid] = FALSE;
+}
+
+/**
+ * Record that a block was moved to a new address.
+ *
+ * This is normally called through the MEMPROF_MOVE() macro.
+ */
+void
+memprof_moved(const void *old, void *p, size_t size)
+{
+	uint stid = thread_small_id();
+	struct memprof_block *mb;
+
+	if G_UNLIKELY(memprof_inside[stid] || signal_in_handler())
+		return;
+
+	memprof_inside[stid] = TRUE;
+	MEMPROF_LOCK;
+
+	if G_UNLIKELY(NULL == memprof_blocks)
+		goto done;
+
+	mb = hash_table_lookup(memprof_blocks, old);
+	if (mb != NULL) {
+		hash_table_remove(memprof_blocks, old);
+		mb->site->live_bytes -= mb->size;
+		mb->site->live_bytes += size;
+		mb->size = size;
+		hash_table_insert(memprof_blocks, p, mb);
+	}
+
+done:
+	MEMPROF_UNLOCK;
+	memprof_inside[stid] = FALSE;
+}
+
+/**
+ * Hash table iterator -- free value.
+ */
+static void
+memprof_free_value(const void *key, void *value, void *data)
+{
+	(void) key;
+	(void) data;
+
+	xfree(value);
+}
+
+/**
+ * Stop profiling, discarding all the collected data.
+ */
+void
+memprof_stop(void)
+{
+	hash_table_t *sites, *blocks;
+	uint stid = thread_small_id();
+
+	memprof_inside[stid] = TRUE;
+	MEMPROF_LOCK;
+
+	memprof_period = 0;
+	memprof_live = 0;
+	sites = memprof_sites;
+	blocks = memprof_blocks;
+	memprof_sites = memprof_blocks = NULL;
+
+	MEMPROF_UNLOCK;
+
+	if (blocks != NULL) {
+		hash_table_foreach(blocks, memprof_free_value, NULL);
+		hash_table_destroy(blocks);
+	}
+
+	if (sites != NULL) {
+		hash_table_foreach(sites, memprof_free_value, NULL);
+		hash_table_destroy(sites);
+	}
+
+	memprof_inside[stid] = FALSE;
+}
+
+/**
+ * Start profiling, sampling one allocation every ``period''.
+ *
+ * Any previously collected data are discarded.
+ */
+void
+memprof_start(uint period)
+{
+	uint stid = thread_small_id();
+
+	g_assert(period != 0);
+
+	memprof_stop();
+
+	memprof_inside[stid] = TRUE;
+	MEMPROF_LOCK;
+
+	memprof_sites = hash_table_new();
+	memprof_blocks = hash_table_new();
+	memprof_started = tm_time();
+	memprof_period = period;
+
+	MEMPROF_UNLOCK;
+	memprof_inside[stid] = FALSE;
+}
+
+/**
+ * vsort() callback for sorting sites by decreasing live size.
+ */
+static int
+memprof_live_cmp(const void *a, const void *b)
+{
+	const struct memprof_site * const *sa = a, * const *sb = b;
+
+	return CMP((*sb)->live_bytes, (*sa)->live_bytes);
+}
+
+/**
+ * vsort() callback for sorting sites by decreasing allocation count.
+ */
+static int
+memprof_rate_cmp(const void *a, const void *b)
+{
+	const struct memprof_site * const *sa = a, * const *sb = b;
+
+	return CMP((*sb)->allocs, (*sa)->allocs);
+}
+
+/**
+ * Log the top allocation sites.
+ *
+ * Figures are estimated by scaling the sampled ones by the sampling period.
+ *
+ * @param la		logging agent where logging is done
+ * @param count		maximum amount of sites to log
+ * @param by_rate	if TRUE, sort by allocation rate instead of live size
+ */
+void
+memprof_dump_log(logagent_t *la, size_t count, bool by_rate)
+{
+	struct memprof_site **vec;
+	size_t i, n;
+	uint stid = thread_small_id();
+	time_delta_t elapsed;
+	uint period;
+
+	memprof_inside[stid] = TRUE;
+	MEMPROF_LOCK;
+
+	if (NULL == memprof_sites) {
+		MEMPROF_UNLOCK;
+		memprof_inside[stid] = FALSE;
+		log_info(la, "Allocation profiling is off");
+		return;
+	}
+
+	/*
+	 * Copy the sites so that we can sort and log them without holding
+	 * the lock, since logging will allocate memory.
+	 */
+
+	period = memprof_period;
+	elapsed = MAX(1, delta_time(tm_time(), memprof_started));
+	vec = (struct memprof_site **) hash_table_values(memprof_sites, &n);
+
+	for (i = 0; i < n; i++) {
+		struct memprof_site *ms;
+
+		XMALLOC(ms);
+		*ms = *vec[i];
+		vec[i] = ms;
+	}
+
+	log_info(la, "Sampling 1 allocation in %u, %zu site%s, "
+		"%zu live sampled block%s, running for %s",
+		period, n, plural(n), memprof_live, plural(memprof_live),
+		compact_time(elapsed));
+
+	MEMPROF_UNLOCK;
+
+	vsort(vec, n, sizeof vec[0], by_rate ? memprof_rate_cmp : memprof_live_cmp);
+
+	for (i = 0; i < n && i < count; i++) {
+		const struct memprof_site *ms = vec[i];
+
+		log_info(la, "#%zu: ~%s live bytes in ~%zu blocks, "
+			"~%s allocs/s (~%s bytes/s)",
+			i + 1, uint64_to_string((uint64) ms->live_bytes * period),
+			ms->live * period,
+			uint64_to_string2(ms->allocs * period / elapsed),
+			uint64_to_string3(ms->bytes * period / elapsed));
+		stacktrace_atom_log(la, ms->where);
+	}
+
+	for (i = 0; i < n; i++)
+		xfree(vec[i]);
+	xfree(vec);
+
+	memprof_inside[stid] = FALSE;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Sampling allocation profiler.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _memprof_h_
+#define _memprof_h_
+
+/*
+ * Public interface.
+ */
+
+extern uint memprof_period;
+extern size_t memprof_live;
+
+void memprof_allocated(void *p, size_t size);
+void memprof_freed(const void *p, size_t size);
+void memprof_moved(const void *old, void *p, size_t size);
+
+/**
+ * Account for a newly allocated block, when profiling is enabled.
+ */
+#define MEMPROF_ALLOC(p,size) G_STMT_START {				\
+	if G_UNLIKELY(memprof_period != 0)						\
+		memprof_allocated((p), (size));						\
+} G_STMT_END
+
+/**
+ * Account for a freed block, when sampled blocks are still live.
+ */
+#define MEMPROF_FREE(p,size) G_STMT_START {					\
+	if G_UNLIKELY(memprof_live != 0)						\
+		memprof_freed((p), (size));							\
+} G_STMT_END
+
+/**
+ * Account for a block moved to a new address.
+ */
+#define MEMPROF_MOVE(o,p,size) G_STMT_START {				\
+	if G_UNLIKELY(memprof_live != 0 && (o) != (p))			\
+		memprof_moved((o), (p), (size));					\
+} G_STMT_END
+
+struct logagent;
+
+void memprof_start(uint period);
+void memprof_stop(void);
+void memprof_dump_log(struct logagent *la, size_t count, bool by_rate);
+
+#endif /* _memprof_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
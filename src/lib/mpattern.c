@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Multiple pattern matching automaton.
+ *
+ * This is an Aho-Corasick automaton looking for a set of words within a text
+ * in a single pass, a text matching when each of the words occurs at least
+ * the amount of times requested in the word vector.  Occurrences of the same
+ * word cannot overlap, and they must obey the word constraints given at
+ * compilation time.  This yields the same result as looking for each word
+ * successively with pattern_search(), case-sensitively, each new search for
+ * a word starting where its previous occurrence ended.
+ *
+ * The automaton is compiled into a deterministic state machine, so that each
+ * character of the text is processed with a single table lookup.  To keep
+ * the transition table small, characters are first mapped to a class: all
+ * the characters not present in any word share the same class.
+ *
+ * Once compiled, the automaton is read-only and can be used concurrently
+ * by several threads.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "mpattern.h"
+
+#include "ascii.h"
+#include "halloc.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define MPATTERN_STATES_MAX	MAX_INT_VAL(uint16)
+#define MPATTERN_WORDS_MAX	64	/**< Matching state kept on stack below that */
+
+enum mpattern_magic { MPATTERN_MAGIC = 0x1e0c43a5 };
+
+/**
+ * A compiled automaton.
+ *
+ * State 0 is the initial state.  The transition from state `s' on a character
+ * of class `c' is delta[s * nclass + c].
+ */
+struct mpattern {
+	enum mpattern_magic magic;
+	qsearch_mode_t word;		/**< Word constraints on matches */
+	uint nclass;				/**< Amount of character classes */
+	uint nstates;				/**< Amount of states */
+	uint nwords;				/**< Amount of words */
+	uint16 *delta;				/**< Transition table */
+	uint16 *term;				/**< Word index + 1 at state, 0 if none */
+	uint16 *dict;				/**< Next state on suffix chain with a word */
+	uint *len;					/**< Length of each word */
+	uint *amount;				/**< Required occurrences of each word */
+	uint8 cls[256];				/**< Character classes */
+};
+
+static inline void
+mpattern_check(const struct mpattern * const mp)
+{
+	g_assert(mp != NULL);
+	g_assert(MPATTERN_MAGIC == mp->magic);
+}
+
+/**
+ * Compile automaton looking for all the words in the vector.
+ *
+ * @param wovec		the word vector
+ * @param wn		amount of words in the vector
+ * @param word		constraints on word boundaries for each match
+ *
+ * @return the compiled automaton, NULL if the words are too long for it.
+ */
+mpattern_t *
+mpattern_compile(const word_vec_t *wovec, size_t wn, qsearch_mode_t word)
+{
+	mpattern_t *mp;
+	size_t i, total = 0;
+	uint s, head, tail, *queue;
+	uint16 *fail;
+
+	g_assert(wovec != NULL || 0 == wn);
+
+	for (i = 0; i < wn; i++)
+		total += wovec[i].len;
+
+	if (total >= MPATTERN_STATES_MAX || wn >= MPATTERN_STATES_MAX)
+		return NULL;
+
+	WALLOC0(mp);
+	mp->magic = MPATTERN_MAGIC;
+	mp->word = word;
+	mp->nwords = wn;
+
+	/*
+	 * Compute character classes.
+	 */
+
+	mp->nclass = 1;		/* Class 0: characters not present in any word */
+
+	for (i = 0; i < wn; i++) {
+		const uchar *w = (const uchar *) wovec[i].word;
+		int j;
+
+		g_assert(wovec[i].len > 0);
+
+		for (j = 0; j < wovec[i].len; j++) {
+			if (0 == mp->cls[w[j]])
+				mp->cls[w[j]] = mp->nclass++;
+		}
+	}
+
+	g_assert(mp->nclass <= N_ITEMS(mp->cls));
+
+	HALLOC0_ARRAY(mp->delta, (total + 1) * mp->nclass);
+	HALLOC0_ARRAY(mp->term, total + 1);
+	HALLOC0_ARRAY(mp->dict, total + 1);
+	HALLOC_ARRAY(mp->len, MAX(wn, 1));
+	HALLOC_ARRAY(mp->amount, MAX(wn, 1));
+
+	/*
+	 * Build the trie of the words.  Since the initial state cannot be the
+	 * target of a trie edge, a 0 transition means there is no edge yet.
+	 */
+
+	mp->nstates = 1;
+
+	for (i = 0; i < wn; i++) {
+		const uchar *w = (const uchar *) wovec[i].word;
+		int j;
+
+		for (s = 0, j = 0; j < wovec[i].len; j++) {
+			uint16 *next = &mp->delta[s * mp->nclass + mp->cls[w[j]]];
+
+			if (0 == *next)
+				*next = mp->nstates++;
+			s = *next;
+		}
+
+		mp->len[i] = wovec[i].len;
+
+		if G_UNLIKELY(mp->term[s] != 0) {
+			uint d = mp->term[s] - 1;	/* Duplicate word */
+
+			mp->amount[d] = MAX(mp->amount[d], wovec[i].amount);
+			mp->amount[i] = 0;
+		} else {
+			mp->term[s] = i + 1;
+			mp->amount[i] = wovec[i].amount;
+		}
+	}
+
+	/*
+	 * Compute failure links breadth-first, turning the trie into a
+	 * deterministic automaton: missing edges are replaced by the transition
+	 * of the failure state, which has already been fully computed since it
+	 * is closer to the initial state.
+	 */
+
+	HALLOC0_ARRAY(fail, mp->nstates);
+	HALLOC_ARRAY(queue, mp->nstates);
+	head = tail = 0;
+
+	for (s = 0; s < mp->nclass; s++) {
+		uint t = mp->delta[s];
+
+		if (t != 0)
+			queue[tail++] = t;		/* Failure state of depth-1 states is 0 */
+	}
+
+	while (head < tail) {
+		uint c;
+
+		s = queue[head++];
+
+		/* Next state on the suffix chain holding a word */
+		mp->dict[s] = 0 != mp->term[fail[s]] ? fail[s] : mp->dict[fail[s]];
+
+		for (c = 0; c < mp->nclass; c++) {
+			uint16 *next = &mp->delta[s * mp->nclass + c];
+			uint f = mp->delta[fail[s] * mp->nclass + c];
+
+			if (0 == *next) {
+				*next = f;
+			} else {
+				fail[*next] = f;
+				queue[tail++] = *next;
+			}
+		}
+	}
+
+	HFREE_NULL(queue);
+	HFREE_NULL(fail);
+
+	return mp;
+}
+
+/**
+ * Free automaton and nullify its pointer.
+ */
+void
+mpattern_free_null(mpattern_t **mp_ptr)
+{
+	mpattern_t *mp = *mp_ptr;
+
+	if (mp != NULL) {
+		mpattern_check(mp);
+
+		HFREE_NULL(mp->delta);
+		HFREE_NULL(mp->term);
+		HFREE_NULL(mp->dict);
+		HFREE_NULL(mp->len);
+		HFREE_NULL(mp->amount);
+		mp->magic = 0;
+		WFREE(mp);
+		*mp_ptr = NULL;
+	}
+}
+
+/**
+ * @return the amount of states in the automaton.
+ */
+size_t
+mpattern_states(const mpattern_t *mp)
+{
+	mpattern_check(mp);
+
+	return mp->nstates;
+}
+
+/**
+ * Check whether match at [start, end[ within text obeys word constraints.
+ */
+static inline bool
+mpattern_word_ok(const mpattern_t *mp,
+	const uchar *text, size_t tlen, size_t start, size_t end)
+{
+	bool at_start, at_end;
+
+	if (qs_any == mp->word)
+		return TRUE;
+
+	at_start = 0 == start ||
+		is_ascii_ident(text[start - 1]) != is_ascii_ident(text[start]);
+
+	if (qs_begin == mp->word)
+		return at_start;
+
+	at_end = tlen == end ||
+		is_ascii_ident(text[end]) != is_ascii_ident(text[end - 1]);
+
+	if (qs_end == mp->word)
+		return at_end;
+
+	return at_start && at_end;		/* qs_whole */
+}
+
+/**
+ * Check whether text contains all the words of the automaton, each the
+ * amount of times requested.
+ *
+ * @param mp		the automaton
+ * @param text		the text to scan
+ * @param tlen		the length of the text
+ *
+ * @return TRUE if the text matches.
+ */
+bool G_HOT
+mpattern_match(const mpattern_t *mp, const char *text, size_t tlen)
+{
+	const uchar *t = (const uchar *) text;
+	uint need_buf[MPATTERN_WORDS_MAX], *need = need_buf;
+	size_t next_buf[MPATTERN_WORDS_MAX], *next = next_buf;
+	size_t i;
+	uint s = 0, left;
+	bool matched = FALSE;
+
+	mpattern_check(mp);
+
+	if G_UNLIKELY(mp->nwords > MPATTERN_WORDS_MAX) {
+		WALLOC_ARRAY(need, mp->nwords);
+		WALLOC_ARRAY(next, mp->nwords);
+	}
+
+	/*
+	 * For each word, need[] is the amount of occurrences we still need and
+	 * next[] the offset where its next occurrence may start, since they
+	 * cannot overlap each other.
+	 */
+
+	for (left = 0, i = 0; i < mp->nwords; i++) {
+		need[i] = mp->amount[i];
+		next[i] = 0;
+		if (need[i] != 0)
+			left++;
+	}
+
+	if G_UNLIKELY(0 == left) {
+		matched = TRUE;
+		goto done;
+	}
+
+	for (i = 0; i < tlen; i++) {
+		uint m;
+
+		s = mp->delta[s * mp->nclass + mp->cls[t[i]]];
+
+		for (m = 0 != mp->term[s] ? s : mp->dict[s]; m != 0; m = mp->dict[m]) {
+			uint w = mp->term[m] - 1;
+			size_t start = i + 1 - mp->len[w];
+
+			if (0 == need[w] || start < next[w])
+				continue;
+
+			if (!mpattern_word_ok(mp, t, tlen, start, i + 1))
+				continue;
+
+			next[w] = i + 1;
+
+			if (0 == --need[w] && 0 == --left) {
+				matched = TRUE;
+				goto done;
+			}
+		}
+	}
+
+done:
+	if G_UNLIKELY(need != need_buf) {
+		WFREE_ARRAY(need, mp->nwords);
+		WFREE_ARRAY(next, mp->nwords);
+	}
+
+	return matched;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
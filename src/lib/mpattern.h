@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Multiple pattern matching automaton.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _mpattern_h_
+#define _mpattern_h_
+
+#include "pattern.h"			/* For qsearch_mode_t */
+#include "wordvec.h"
+
+typedef struct mpattern mpattern_t;
+
+/*
+ * Public interface.
+ */
+
+mpattern_t *mpattern_compile(const word_vec_t *wovec, size_t wn,
+	qsearch_mode_t word);
+void mpattern_free_null(mpattern_t **mp_ptr);
+bool mpattern_match(const mpattern_t *mp, const char *text, size_t tlen);
+size_t mpattern_states(const mpattern_t *mp);
+
+#endif	/* _mpattern_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
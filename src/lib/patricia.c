@@ -293,6 +293,23 @@ patricia_parent_check(const struct patricia_parent *pp)
 #define embedded_item_value(n_)		((n_)->p.ext->value)
 #define embedded_item_keybits(n_)	((size_t) ((n_)->bit))
 
+#define PATRICIA_CHUNK_MIN	4		/**< Nodes in first allocation chunk */
+#define PATRICIA_CHUNK_MAX	128		/**< Max nodes per allocation chunk */
+
+/**
+ * Nodes are allocated by chunks owned by the tree, so that nodes of a given
+ * tree are packed together in memory instead of being scattered among all
+ * the other objects of the same size: this makes the traversal of large
+ * trees more cache-friendly.
+ *
+ * Chunks are all released when the tree becomes empty or is destroyed.
+ */
+struct patricia_chunk {
+	struct patricia_chunk *next;	/**< Next allocated chunk */
+	size_t count;					/**< Amount of nodes in chunk */
+	struct patricia_node node[1];	/**< Node array (extended as needed) */
+};
+
 enum patricia_magic { PATRICIA_MAGIC = 0x42123004U };
 
 /**
@@ -305,6 +322,9 @@ struct patricia {
 	size_t count;					/**< Amount of keys stored */
 	size_t nodes;					/**< Total amount of nodes used */
 	size_t embedded;				/**< Nodes holding embedded data */
+	struct patricia_chunk *chunks;	/**< Node allocation chunks */
+	struct patricia_node *free;		/**< Free nodes, linked through "z" */
+	size_t chunk_nodes;				/**< Nodes in last allocated chunk */
 	uint stamp;						/**< Stamp to protect iterators */
 	int refcnt;						/**< Reference count */
 };
@@ -335,6 +355,9 @@ patricia_create(size_t maxbits)
 	pt->magic = PATRICIA_MAGIC;
 	pt->root = NULL;
 	pt->count = pt->nodes = pt->embedded = 0;
+	pt->chunks = NULL;
+	pt->free = NULL;
+	pt->chunk_nodes = 0;
 	pt->maxbits = maxbits;
 	pt->stamp = 0;
 	pt->refcnt = 1;
@@ -364,6 +387,60 @@ patricia_max_keybits(const patricia_t *pt)
 	return pt->maxbits;
 }
 
+/**
+ * Allocate a new chunk of nodes, putting them in the free list.
+ *
+ * Chunks get larger as the tree grows, so that small trees do not waste
+ * memory whilst large trees are allocated with few, large, chunks.
+ */
+static void
+allocate_chunk(patricia_t *pt)
+{
+	struct patricia_chunk *pc;
+	size_t i, n;
+
+	g_assert(NULL == pt->free);
+
+	n = 0 == pt->chunk_nodes ? PATRICIA_CHUNK_MIN :
+		MIN(2 * pt->chunk_nodes, PATRICIA_CHUNK_MAX);
+
+	pc = xmalloc(offsetof(struct patricia_chunk, node) + n * sizeof pc->node[0]);
+	pc->count = n;
+	pc->next = pt->chunks;
+	pt->chunks = pc;
+	pt->chunk_nodes = n;
+
+	/*
+	 * Link nodes in increasing address order so that successive allocations
+	 * return adjacent nodes.
+	 */
+
+	for (i = n; i != 0; i--) {
+		struct patricia_node *pn = &pc->node[i - 1];
+
+		child_zero(pn) = pt->free;
+		pt->free = pn;
+	}
+}
+
+/**
+ * Release all the node chunks.
+ */
+static void
+free_chunks(patricia_t *pt)
+{
+	struct patricia_chunk *pc, *next;
+
+	for (pc = pt->chunks; pc != NULL; pc = next) {
+		next = pc->next;
+		xfree(pc);
+	}
+
+	pt->chunks = NULL;
+	pt->free = NULL;
+	pt->chunk_nodes = 0;
+}
+
 /**
  * Allocate a new PATRICIA node.
  */
@@ -374,8 +451,12 @@ allocate_node(patricia_t *pt)
 
 	patricia_check(pt);
 
+	if G_UNLIKELY(NULL == pt->free)
+		allocate_chunk(pt);
+
+	pn = pt->free;
+	pt->free = child_zero(pn);
 	pt->nodes++;
-	WALLOC(pn);
 	patricia_node_set_magic(pn);
 
 	return pn;
@@ -393,7 +474,13 @@ free_node(patricia_t *pt, struct patricia_node *pn)
 
 	pt->nodes--;
 	patricia_node_clear_magic(pn);
-	WFREE(pn);
+
+	if (0 == pt->nodes) {
+		free_chunks(pt);
+	} else {
+		child_zero(pn) = pt->free;
+		pt->free = pn;
+	}
 }
 
 /**
@@ -2088,17 +2175,6 @@ patricia_traverse(patricia_t *pt,
 	}
 }
 
-/**
- * Node callback for patricia_traverse().
- */
-static void
-patricia_traverse_remove_node(struct patricia_node *pn, void *u)
-{
-	patricia_t *pt = u;
-
-	free_node(pt, pn);
-}
-
 /**
  * Destroy the PATRICIA tree.
  */
@@ -2110,8 +2186,13 @@ patricia_destroy(patricia_t *pt)
 	if (--pt->refcnt > 0)
 		return;			/* Still referenced by something internally */
 
-	patricia_traverse(pt, patricia_traverse_remove_node, pt, NULL, NULL);
-	g_assert(pt->nodes == 0);
+	/*
+	 * All the nodes are held in the chunks, there is no need to traverse
+	 * the tree to free them individually.
+	 */
+
+	free_chunks(pt);
+	pt->nodes = 0;
 
 	pt->magic = 0;
 	WFREE(pt);
@@ -39,9 +39,12 @@
 #include "log.h"				/* For s_carp_once() */
 #include "mempcpy.h"
 #include "stacktrace.h"
+#include "str.h"
 #include "stringify.h"			/* For plural() */
+#include "tmalloc.h"
 #include "unsigned.h"			/* For size_is_non_negative() */
 #include "walloc.h"
+#include "xmalloc.h"
 
 #include "override.h"			/* Must be the last header included */
 
@@ -49,6 +52,85 @@
 
 #define EMBEDDED_OFFSET	offsetof(pdata_t, d_embedded)
 
+/**
+ * Message slabs.
+ *
+ * Plain messages created by pmsg_new() are allocated as a single block
+ * holding the message block header, followed by the data buffer header and
+ * its embedded arena.  These blocks come from a few size classes, each
+ * distributed by a thread-magazine allocator: allocation and freeing are
+ * lock-free most of the time, and the magazines of idle threads are given
+ * back to the memory layer by the tmalloc() garbage collector.
+ *
+ * The message block header is only a tenant of the slab: when it is freed,
+ * the slab remains in use until the last reference on the data buffer goes,
+ * since clones of the message can still be referencing the data.
+ */
+#define PMSG_SLAB_OFFSET \
+	((sizeof(pmsg_t) + MEM_ALIGNBYTES - 1) & ~(MEM_ALIGNBYTES - 1))
+
+#define PMSG_SLAB_HEADER	(PMSG_SLAB_OFFSET + EMBEDDED_OFFSET)
+
+static const size_t pmsg_slab_sizes[] = {	/* Arena capacity of classes */
+	128,			/* Gnutella headers, pings, pongs, small queries */
+	512,			/* Most queries and small hits */
+	2048,
+	8192,
+	32768,
+	65536,			/* Large query hit batches */
+};
+
+static tmalloc_t *pmsg_slab[N_ITEMS(pmsg_slab_sizes)];
+
+/**
+ * Memory layer for the message slab magazines.
+ */
+static void *
+pmsg_slab_alloc(size_t size)
+{
+	return xmalloc(size);
+}
+
+static void
+pmsg_slab_free(void *p, size_t size)
+{
+	(void) size;
+	xfree(p);
+}
+
+/**
+ * Free routine for data buffers embedded in a message slab.
+ *
+ * @param p		the data buffer, as embedded in the slab
+ * @param arg	the magazine depot from which the slab was allocated
+ */
+static void
+pmsg_slab_release(void *p, void *arg)
+{
+	pdata_t *db = p;
+
+	db->magic = 0;
+	tmfree(arg, ptr_add_offset(p, -PMSG_SLAB_OFFSET));
+}
+
+/**
+ * Get the slab class able to hold ``len'' bytes of data.
+ *
+ * @return the magazine depot for the class, NULL if none applies.
+ */
+static inline tmalloc_t *
+pmsg_slab_class(int len)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(pmsg_slab_sizes); i++) {
+		if ((size_t) len <= pmsg_slab_sizes[i])
+			return pmsg_slab[i];		/* NULL before pmsg_init() */
+	}
+
+	return NULL;
+}
+
 /**
  * An extended message block.
  *
@@ -93,7 +175,16 @@ cast_to_pmsg(pmsg_ext_t *emb)
 void
 pmsg_init(void)
 {
-	/* Nothing to do */
+	uint i;
+
+	for (i = 0; i < N_ITEMS(pmsg_slab_sizes); i++) {
+		char name[STR_CONST_LEN("pmsg-") + SIZE_T_DEC_BUFLEN + 1];
+
+		str_bprintf(ARYLEN(name), "pmsg-%zu", pmsg_slab_sizes[i]);
+		pmsg_slab[i] = tmalloc_create(name,
+			pmsg_slab_sizes[i] + PMSG_SLAB_HEADER,
+			pmsg_slab_alloc, pmsg_slab_free);
+	}
 }
 
 /**
@@ -116,7 +207,9 @@ pmsg_reset(pmsg_t *mb)
 	pmsg_check(mb);
 
 	mb->m_rptr = mb->m_wptr = mb->m_data->d_arena;	/* Empty buffer */
-	mb->m_flags = PMSG_EXT_MAGIC == mb->magic ? PMSG_PF_EXT : 0;
+	pmsg_free_null(&mb->m_cont);
+	mb->m_flags = (PMSG_EXT_MAGIC == mb->magic ? PMSG_PF_EXT : 0) |
+		(mb->m_flags & PMSG_PF_SLAB);
 	mb->m_u.m_check = NULL;						/* Clear "pre-send" checks */
 }
 
@@ -130,10 +223,12 @@ pmsg_fill(pmsg_t *mb, pdata_t *db, int prio, bool ext, const void *buf, int len)
 {
 	mb->magic = ext ? PMSG_EXT_MAGIC : PMSG_MAGIC;
 	mb->m_data = db;
+	mb->m_cont = NULL;
 	mb->m_prio = prio;
 	mb->m_flags = ext ? PMSG_PF_EXT : 0;
 	mb->m_u.m_check = NULL;
 	mb->m_refcnt = 1;
+	mb->m_stamp = 0;
 	db->d_refcnt++;
 
 	if (buf) {
@@ -162,9 +257,31 @@ pmsg_new(int prio, const void *buf, int len)
 	pmsg_t *mb;
 	pdata_t *db;
 
+	tmalloc_t *depot;
+
 	g_assert(len > 0);
 	g_assert(implies(buf, valid_ptr(buf)));
 
+	depot = pmsg_slab_class(len);
+
+	if G_LIKELY(depot != NULL) {
+		void *slab = tmalloc(depot);
+
+		mb = slab;
+		db = ptr_add_offset(slab, PMSG_SLAB_OFFSET);
+		db->magic = PDATA_MAGIC;
+		db->d_arena = db->d_embedded;
+		db->d_end = db->d_arena + len;
+		db->d_refcnt = 0;
+		db->d_free = pmsg_slab_release;
+		db->d_arg = depot;
+
+		(void) pmsg_fill(mb, db, prio, FALSE, buf, len);
+		mb->m_flags |= PMSG_PF_SLAB;
+
+		return mb;
+	}
+
 	WALLOC(mb);
 	db = pdata_new(len);
 
@@ -222,6 +339,17 @@ pmsg_alloc(int prio, pdata_t *db, int roff, int woff)
 	return mb;
 }
 
+/**
+ * Shallow cloning of the continuation blocks of a message.
+ *
+ * @return the cloned chain, NULL if there was no continuation.
+ */
+static pmsg_t *
+pmsg_cont_clone(const pmsg_t *mb)
+{
+	return NULL == mb->m_cont ? NULL : pmsg_clone_plain(mb->m_cont);
+}
+
 /**
  * Extended cloning of message, adds a free routine callback.
  */
@@ -237,8 +365,10 @@ pmsg_clone_extend(const pmsg_t *mb, pmsg_free_t free_cb, void *arg)
 	nmb->pmsg.magic = PMSG_EXT_MAGIC;
 
 	pdata_addref(nmb->pmsg.m_data);
+	nmb->pmsg.m_cont = pmsg_cont_clone(mb);
 
 	nmb->pmsg.m_flags |= PMSG_PF_EXT;
+	nmb->pmsg.m_flags &= ~PMSG_PF_SLAB;
 	nmb->pmsg.m_refcnt = 1;
 	nmb->m_free = free_cb;
 	nmb->m_arg = arg;
@@ -381,6 +511,7 @@ pmsg_clone_ext(pmsg_ext_t *mb)
 	*nmb = *mb;					/* Struct copy */
 	nmb->pmsg.m_refcnt = 1;
 	pdata_addref(nmb->pmsg.m_data);
+	nmb->pmsg.m_cont = pmsg_cont_clone(&mb->pmsg);
 
 	return cast_to_pmsg(nmb);
 }
@@ -402,8 +533,10 @@ pmsg_clone(const pmsg_t *mb)
 		pmsg_check(mb);
 		WALLOC(nmb);
 		*nmb = *mb;					/* Struct copy */
+		nmb->m_flags &= ~PMSG_PF_SLAB;
 		nmb->m_refcnt = 1;
 		pdata_addref(nmb->m_data);
+		nmb->m_cont = pmsg_cont_clone(mb);
 
 		return nmb;
 	}
@@ -423,9 +556,10 @@ pmsg_clone_plain(const pmsg_t *mb)
 	WALLOC(nmb);
 	memcpy(nmb, mb, sizeof *nmb);
 	nmb->magic = PMSG_MAGIC;		/* Force plain message */
-	nmb->m_flags &= ~PMSG_PF_EXT;	/* In case original was extended */
+	nmb->m_flags &= ~(PMSG_PF_EXT | PMSG_PF_SLAB);	/* Extended original? */
 	nmb->m_refcnt = 1;
 	pdata_addref(nmb->m_data);
+	nmb->m_cont = pmsg_cont_clone(mb);
 
 	return nmb;
 }
@@ -467,6 +601,7 @@ void
 pmsg_free(pmsg_t *mb)
 {
 	pdata_t *db = mb->m_data;
+	pmsg_t *cont = mb->m_cont;
 
 	pmsg_check(mb);
 	g_assert(mb->m_refcnt != 0);
@@ -489,6 +624,8 @@ pmsg_free(pmsg_t *mb)
 		if (emb->m_free)
 			(*emb->m_free)(mb, emb->m_arg);
 		WFREE0(emb);
+	} else if (mb->m_flags & PMSG_PF_SLAB) {
+		mb->magic = 0;		/* Slab freed with the data buffer */
 	} else {
 		WFREE0(mb);
 	}
@@ -500,6 +637,9 @@ pmsg_free(pmsg_t *mb)
 	 */
 
 	pdata_unref(db);
+
+	if G_UNLIKELY(cont != NULL)
+		pmsg_free(cont);
 }
 
 /**
@@ -552,6 +692,7 @@ pmsg_write(pmsg_t *mb, const void *data, int len)
 	pmsg_check(mb);
 	g_assert_log(len >= 0, "%s(): len=%d", G_STRFUNC, len);
 	g_assert(pmsg_is_writable(mb));	/* Not shared, or would corrupt data */
+	g_assert(!pmsg_is_chained(mb));	/* Would insert data before chain */
 
 	arena = mb->m_data;
 	available = arena->d_end - mb->m_wptr;
@@ -583,6 +724,11 @@ pmsg_read(pmsg_t *mb, void *data, int len)
 		memcpy(data, mb->m_rptr, readable);
 		mb->m_rptr += readable;
 	}
+
+	if G_UNLIKELY(readable < len && mb->m_cont != NULL)
+		readable += pmsg_read(mb->m_cont, ptr_add_offset(data, readable),
+			len - readable);
+
 	return readable;
 }
 
@@ -606,6 +752,10 @@ pmsg_discard(pmsg_t *mb, int len)
 
 	n = len >= available ? available : len;
 	mb->m_rptr += n;
+
+	if G_UNLIKELY(n < len && mb->m_cont != NULL)
+		n += pmsg_discard(mb->m_cont, len - n);
+
 	return n;
 }
 
@@ -620,6 +770,7 @@ pmsg_discard_trailing(pmsg_t *mb, int len)
 
 	pmsg_check(mb);
 	g_assert_log(len >= 0, "%s(): len=%d", G_STRFUNC, len);
+	g_assert(!pmsg_is_chained(mb));
 
 	available = mb->m_wptr - mb->m_rptr;
 	g_assert(available >= 0);		/* Data cannot go beyond end of arena */
@@ -650,6 +801,8 @@ pmsg_copy(pmsg_t *dest, pmsg_t *src, int len)
 	pmsg_check(src);
 	g_assert_log(len >= 0, "%s(): len=%d", G_STRFUNC, len);
 	g_assert(pmsg_is_writable(dest));	/* Not shared, or would corrupt data */
+	g_assert(!pmsg_is_chained(dest));
+	g_assert(!pmsg_is_chained(src));
 
 	copied = src->m_wptr - src->m_rptr;	/* Available data in source */
 	copied = MIN(copied, len);
@@ -674,6 +827,7 @@ pmsg_compact(pmsg_t *mb)
 
 	pmsg_check(mb);
 	g_assert(pmsg_is_writable(mb));		/* Not shared, or would corrupt data */
+	g_assert(!pmsg_is_chained(mb));
 	g_assert(mb->m_rptr <= mb->m_wptr);
 
 	shifting = mb->m_rptr - mb->m_data->d_arena;
@@ -698,6 +852,7 @@ pmsg_fractional_compact(pmsg_t *mb, int n)
 	g_assert(n > 0);
 	pmsg_check(mb);
 	g_assert(pmsg_is_writable(mb));		/* Not shared, or would corrupt data */
+	g_assert(!pmsg_is_chained(mb));
 	g_assert(mb->m_rptr <= mb->m_wptr);
 
 	shifting = mb->m_rptr - mb->m_data->d_arena;
@@ -730,6 +885,7 @@ pmsg_split(pmsg_t *mb, int offset)
 	g_assert(offset >= 0);
 	g_assert(offset < pmsg_size(mb));
 	pmsg_check(mb);
+	g_assert(!pmsg_is_chained(mb));
 
 	start = mb->m_rptr + offset;
 	slen = mb->m_wptr - start;
@@ -740,6 +896,119 @@ pmsg_split(pmsg_t *mb, int offset)
 	return pmsg_new(mb->m_prio, start, slen);	/* Copies data */
 }
 
+/**
+ * @return the amount of unread data held in the message block and all its
+ * continuation blocks.
+ */
+size_t
+pmsg_cont_size(const pmsg_t *mb)
+{
+	size_t size = 0;
+
+	for (/* empty */; mb != NULL; mb = mb->m_cont) {
+		pmsg_check(mb);
+		size += mb->m_wptr - mb->m_rptr;
+	}
+
+	return size;
+}
+
+/**
+ * Append continuation block at the end of the message chain.
+ *
+ * This allows a message to reference data held in other data buffers,
+ * for instance to share a payload between messages having a different
+ * header, without copying it.  The continuation block must be a plain
+ * message block, which is now owned by the message.
+ *
+ * @param mb		the message to which data is appended
+ * @param cont		the continuation block (possibly chained itself)
+ */
+void
+pmsg_chain_append(pmsg_t *mb, pmsg_t *cont)
+{
+	pmsg_check(mb);
+	pmsg_check(cont);
+	g_assert(!pmsg_is_extended(cont));
+	g_assert(1 == cont->m_refcnt);
+
+	while (mb->m_cont != NULL)
+		mb = mb->m_cont;
+
+	mb->m_cont = cont;
+}
+
+/**
+ * @return the amount of message blocks in the chain holding unread data.
+ */
+int
+pmsg_chain_blocks(const pmsg_t *mb)
+{
+	int n = 0;
+
+	for (/* empty */; mb != NULL; mb = mb->m_cont) {
+		pmsg_check(mb);
+		if (mb->m_wptr != mb->m_rptr)
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * Fill I/O vector with the unread data of the message chain, one entry per
+ * message block holding data.
+ *
+ * @param mb		the message
+ * @param iov		the I/O vector to fill
+ * @param iovcnt	amount of entries available in the I/O vector
+ *
+ * @return the amount of entries filled, which can be less than needed to
+ * cover the whole message if the vector is too small.
+ */
+int
+pmsg_chain_to_iovec(const pmsg_t *mb, iovec_t *iov, int iovcnt)
+{
+	int n = 0;
+
+	g_assert(iov != NULL);
+	g_assert(iovcnt >= 0);
+
+	for (/* empty */; mb != NULL && n < iovcnt; mb = mb->m_cont) {
+		pmsg_check(mb);
+		if (mb->m_wptr != mb->m_rptr) {
+			iovec_set(&iov[n], deconstify_pointer(mb->m_rptr),
+				mb->m_wptr - mb->m_rptr);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * Copy unread data of the message chain to the supplied buffer, without
+ * consuming it.
+ *
+ * @return the amount of bytes copied.
+ */
+size_t
+pmsg_chain_copy(const pmsg_t *mb, void *buf, size_t len)
+{
+	size_t copied = 0;
+
+	for (/* empty */; mb != NULL && copied < len; mb = mb->m_cont) {
+		size_t n;
+
+		pmsg_check(mb);
+		n = MIN(UNSIGNED(mb->m_wptr - mb->m_rptr), len - copied);
+		memcpy(ptr_add_offset(buf, copied), mb->m_rptr, n);
+		copied += n;
+	}
+
+	return copied;
+}
+
 /**
  * Allocate a new data block of given size.
  * The block header is at the start of the allocated block.
@@ -121,9 +121,11 @@ struct pmsg {
 	const char *m_rptr;			/**< First unread byte in buffer */
 	char *m_wptr;				/**< First unwritten byte in buffer */
 	pdata_t *m_data;			/**< Data buffer */
+	pmsg_t *m_cont;				/**< Continuation block, NULL if none */
 	uint8 m_flags;				/**< Message flags */
 	uint8 m_prio;				/**< Message priority (0 = normal) */
 	uint16 m_refcnt;			/**< Refs to this message block */
+	uint32 m_stamp;				/**< Enqueuing time, in ms (wraps around) */
 	union {
 		pmsg_check_t m_check;	/**< Optional check before sending */
 		pmsg_hook_t m_hook;		/**< Optional check before transmitting */
@@ -152,6 +154,7 @@ typedef void (*pmsg_free_t)(pmsg_t *mb, void *arg);
 #define PMSG_PF_ACKME	(1U << 5)	/**< Request remote acknowledgment */
 #define PMSG_PF_COMP	(1U << 4)	/**< Compression already attempted / done */
 #define PMSG_PF_HOOK	(1U << 3)	/**< Use ``m_check'' as standalone hook */
+#define PMSG_PF_SLAB	(1U << 2)	/**< Block lives in its data buffer slab */
 
 static inline void
 pmsg_check(const pmsg_t * const mb)
@@ -192,6 +195,26 @@ pmsg_prio(const pmsg_t *mb)
 	return mb->m_prio;
 }
 
+/**
+ * @return the time at which message was enqueued, in ms (wraps around).
+ */
+static inline uint32
+pmsg_stamp(const pmsg_t *mb)
+{
+	pmsg_check(mb);
+	return mb->m_stamp;
+}
+
+/**
+ * Record the time at which message is enqueued, in ms.
+ */
+static inline void
+pmsg_set_stamp(pmsg_t *mb, uint32 stamp)
+{
+	pmsg_check(mb);
+	mb->m_stamp = stamp;
+}
+
 static inline unsigned
 pmsg_refcnt(const pmsg_t *mb)
 {
@@ -384,32 +407,72 @@ pmsg_slist_free(slist_t **slist_ptr)
 	slist_free_all(slist_ptr, (free_fn_t) pmsg_free);
 }
 
+size_t pmsg_cont_size(const pmsg_t *mb);
+void pmsg_chain_append(pmsg_t *mb, pmsg_t *cont);
+int pmsg_chain_blocks(const pmsg_t *mb);
+int pmsg_chain_to_iovec(const pmsg_t *mb, iovec_t *iov, int iovcnt);
+size_t pmsg_chain_copy(const pmsg_t *mb, void *buf, size_t len);
+
+/**
+ * @return whether message is made of several chained message blocks.
+ */
+static inline bool
+pmsg_is_chained(const pmsg_t *mb)
+{
+	return NULL != mb->m_cont;
+}
+
+/**
+ * @return the continuation block of the message, NULL if none.
+ */
+static inline const pmsg_t *
+pmsg_cont(const pmsg_t *mb)
+{
+	return mb->m_cont;
+}
+
+/**
+ * Compute the size of the data held in this message block only, not
+ * including any chained continuation block.
+ */
+static inline int
+pmsg_block_size(const pmsg_t *mb)
+{
+	return mb->m_wptr - mb->m_rptr;
+}
+
 /**
  * Compute message's size (what remains to be read).
+ *
+ * For chained messages, this includes the size of all the continuation
+ * blocks, whereas pmsg_start() only points to the data of the first block.
  */
 static inline int
 pmsg_size(const pmsg_t *mb)
 {
-	/*
-	 * Not a macro because of foreseen addition of an m_cont field to link
- 	 * additional message blocks (auto-extension of messages on pmsg_write).
-	 */
+	int size = mb->m_wptr - mb->m_rptr;
 
-	return mb->m_wptr - mb->m_rptr;
+	if G_UNLIKELY(mb->m_cont != NULL)
+		size += pmsg_cont_size(mb->m_cont);
+
+	return size;
 }
 
 /**
  * Compute message's written size, regardless of where the read pointer is.
+ *
+ * For chained messages, continuation blocks only account for the data that
+ * remain to be read.
  */
 static inline int
 pmsg_written_size(const pmsg_t *mb)
 {
-	/*
-	 * Not a macro because of foreseen addition of an m_cont field to link
- 	 * additional message blocks (auto-extension of messages on pmsg_write).
-	 */
+	int size = mb->m_wptr - mb->m_data->d_arena;
 
-	return mb->m_wptr - mb->m_data->d_arena;
+	if G_UNLIKELY(mb->m_cont != NULL)
+		size += pmsg_cont_size(mb->m_cont);
+
+	return size;
 }
 
 /***
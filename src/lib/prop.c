@@ -28,11 +28,13 @@
 
 #include "ascii.h"
 #include "concat.h"
+#include "cq.h"
 #include "debug.h"
 #include "file.h"
 #include "getdate.h"
 #include "halloc.h"
 #include "hstrfn.h"
+#include "htable.h"
 #include "misc.h"
 #include "mutex.h"
 #include "parse.h"
@@ -50,6 +52,7 @@
 #include "override.h"		/* Must be the last header included */
 
 #define PROP_FILE_ID	"_id"
+#define PROP_BATCH_PERIOD	1000	/**< ms, batched listener notification */
 
 #define debug track_props
 static uint32 track_props = 0;	/**< XXX need to init lib's props--RAM */
@@ -60,6 +63,28 @@ static uint32 track_props = 0;	/**< XXX need to init lib's props--RAM */
 #define PROP_DEF_LOCK(d)	mutex_lock(&d->lock)
 #define PROP_DEF_UNLOCK(d)	mutex_unlock(&d->lock)
 
+/**
+ * Additional property state, kept aside from the property definitions
+ * since these are initialized by generated code.
+ *
+ * These are created on demand and never freed, like the properties.
+ */
+struct prop_extra {
+	prop_set_t *ps;				/**< Property set */
+	property_t prop;			/**< Property number */
+	struct event *ev_batched;	/**< Batched change listeners */
+	char *entry;				/**< Cached config file entry, NULL if stale */
+	uint pending:1;				/**< Batched notification pending */
+};
+
+static htable_t *prop_extras;	/**< prop_def_t -> struct prop_extra */
+static pslist_t *prop_batched;	/**< prop_extra with pending notification */
+static cperiodic_t *prop_batch_ev;
+static mutex_t prop_extra_mtx = MUTEX_INIT;
+
+#define PROP_EXTRA_LOCK		mutex_lock(&prop_extra_mtx)
+#define PROP_EXTRA_UNLOCK	mutex_unlock(&prop_extra_mtx)
+
 const struct {
 	const char *name;
 } prop_type_str[] = {
@@ -542,6 +567,73 @@ prop_free_def(prop_def_t *d)
 	WFREE_NULL(d, sizeof *d);
 }
 
+/**
+ * Get the additional state of a property, creating it if needed.
+ *
+ * @return the additional property state.
+ */
+static struct prop_extra *
+prop_extra_get(prop_set_t *ps, property_t prop, const prop_def_t *d)
+{
+	struct prop_extra *pe;
+
+	PROP_EXTRA_LOCK;
+
+	if G_UNLIKELY(NULL == prop_extras)
+		prop_extras = htable_create(HASH_KEY_SELF, 0);
+
+	pe = htable_lookup(prop_extras, d);
+
+	if (NULL == pe) {
+		WALLOC0(pe);
+		pe->ps = ps;
+		pe->prop = prop;
+		htable_insert(prop_extras, d, pe);
+	}
+
+	PROP_EXTRA_UNLOCK;
+
+	return pe;
+}
+
+/**
+ * Periodic notification of the batched property change listeners.
+ *
+ * Each listener is called once per period at most, for the properties
+ * which changed since the last period, and therefore sees the final value.
+ */
+static bool
+prop_batch_flush(void *unused_data)
+{
+	pslist_t *sl, *pending;
+
+	(void) unused_data;
+
+	PROP_EXTRA_LOCK;
+	pending = prop_batched;
+	prop_batched = NULL;
+	PSLIST_FOREACH(pending, sl) {
+		struct prop_extra *pe = sl->data;
+		pe->pending = FALSE;
+	}
+	PROP_EXTRA_UNLOCK;
+
+	pending = pslist_reverse(pending);	/* Notify in order of changes */
+
+	PSLIST_FOREACH(pending, sl) {
+		struct prop_extra *pe = sl->data;
+		prop_def_t *d = &PROP(pe->ps, pe->prop);
+
+		PROP_DEF_LOCK(d);
+		event_trigger(pe->ev_batched,
+			T_VETO(prop_changed_listener_t, (pe->prop)));
+		PROP_DEF_UNLOCK(d);
+	}
+
+	pslist_free(pending);
+	return TRUE;		/* Keep calling */
+}
+
 /**
  * Add a change listener to a given property. If init is TRUE then
  * the listener is immediately called.
@@ -556,6 +648,11 @@ prop_add_prop_changed_listener(
 /**
  * Add a change listener to a given property. If init is TRUE then
  * the listener is immediately called.
+ *
+ * With FREQ_BATCHED, the listener is called at most once per second with
+ * the final value of the property, regardless of how many times it changed.
+ * This is meant for listeners of frequently updated properties, which do
+ * not care about intermediate values.  The interval is then ignored.
  */
 void
 prop_add_prop_changed_listener_full(
@@ -567,7 +664,23 @@ prop_add_prop_changed_listener_full(
 	d = &PROP(ps, prop);
 
 	PROP_DEF_LOCK(d);
-	event_add_subscriber(d->ev_changed, (callback_fn_t) l, freq, interval);
+	if (FREQ_BATCHED == freq) {
+		struct prop_extra *pe = prop_extra_get(ps, prop, d);
+
+		PROP_EXTRA_LOCK;
+		if (NULL == pe->ev_batched)
+			pe->ev_batched = event_new(d->name);
+		if (NULL == prop_batch_ev) {
+			prop_batch_ev = cq_periodic_main_add(PROP_BATCH_PERIOD,
+				prop_batch_flush, NULL);
+		}
+		PROP_EXTRA_UNLOCK;
+
+		event_add_subscriber(pe->ev_batched, (callback_fn_t) l,
+			FREQ_UPDATES, 0);
+	} else {
+		event_add_subscriber(d->ev_changed, (callback_fn_t) l, freq, interval);
+	}
 	if (init)
 		(*l)(prop);		/* Listener always called with the property locked */
 
@@ -583,7 +696,16 @@ prop_remove_prop_changed_listener(
 	d = &PROP(ps, prop);
 
 	PROP_DEF_LOCK(d);
+	if (!event_has_subscriber(d->ev_changed, (callback_fn_t) l)) {
+		struct prop_extra *pe = prop_extra_get(ps, prop, d);
+
+		if (pe->ev_batched != NULL) {
+			event_remove_subscriber(pe->ev_batched, (callback_fn_t) l);
+			goto done;
+		}
+	}
 	event_remove_subscriber(d->ev_changed, (callback_fn_t) l);
+done:
 	PROP_DEF_UNLOCK(d);
 }
 
@@ -602,6 +724,35 @@ prop_emit_prop_changed(const prop_def_t *d, prop_set_t *ps, property_t prop)
 
 	event_trigger(d->ev_changed, T_VETO(prop_changed_listener_t, (prop)));
 
+	/*
+	 * Invalidate the cached config file entry and record the change for
+	 * the batched listeners, if any.
+	 *
+	 * The table is read without locking: it is created at most once.
+	 */
+
+	if (prop_extras != NULL) {
+		struct prop_extra *pe;
+		char *entry = NULL;
+
+		PROP_EXTRA_LOCK;
+		pe = htable_lookup(prop_extras, d);
+		if (pe != NULL) {
+			entry = pe->entry;
+			pe->entry = NULL;
+			if (
+				!pe->pending && pe->ev_batched != NULL &&
+				event_subscriber_active(pe->ev_batched)
+			) {
+				pe->pending = TRUE;
+				prop_batched = pslist_prepend(prop_batched, pe);
+			}
+		}
+		PROP_EXTRA_UNLOCK;
+
+		hfree(entry);
+	}
+
 	if (d->save) {
 		PROP_SET_LOCK(ps);
 		ps->dirty = TRUE;
@@ -1739,6 +1890,175 @@ unique_file_token(const filestat_t *st)
 	return str_2c(s);
 }
 
+/**
+ * Format the configuration file entry of a persisted property.
+ *
+ * The property must be locked.
+ *
+ * @return the entry, to be freed with hfree().
+ */
+static char *
+prop_save_entry(const prop_def_t *p)
+{
+	char **vbuf;
+	uint i;
+	char sbuf[1024];
+	char *val = NULL, *comment, *entry;
+	bool quotes = FALSE;
+	bool defaultvalue = TRUE;
+
+	assert_mutex_is_owned(&p->lock);
+
+	HALLOC_ARRAY(vbuf, p->vector_size + 1);
+	vbuf[0] = NULL;
+
+	switch (p->type) {
+	case PROP_TYPE_BOOLEAN:
+		for (i = 0; i < p->vector_size; i++) {
+			bool v;
+
+			v = p->data.boolean.value[i];
+			if (v != p->data.boolean.def[i])
+				defaultvalue = FALSE;
+			vbuf[i] = h_strdup(config_boolean(v));
+		}
+		vbuf[p->vector_size] = NULL;
+
+		val = h_strjoinv(",", vbuf);
+		break;
+	case PROP_TYPE_MULTICHOICE:
+	case PROP_TYPE_GUINT32:
+		for (i = 0; i < p->vector_size; i++) {
+			uint32 v;
+
+			v = p->data.guint32.value[i];
+			if (v != p->data.guint32.def[i])
+				defaultvalue = FALSE;
+			str_bprintf(ARYLEN(sbuf), "%u", v);
+			vbuf[i] = h_strdup(sbuf);
+		}
+		vbuf[p->vector_size] = NULL;
+
+		val = h_strjoinv(",", vbuf);
+		break;
+	case PROP_TYPE_GUINT64:
+		for (i = 0; i < p->vector_size; i++) {
+			uint64 v;
+
+			v = p->data.guint64.value[i];
+			if (v != p->data.guint64.def[i])
+				defaultvalue = FALSE;
+
+			uint64_to_string_buf(v, ARYLEN(sbuf));
+			vbuf[i] = h_strdup(sbuf);
+		}
+		vbuf[p->vector_size] = NULL;
+
+		val = h_strjoinv(",", vbuf);
+		break;
+	case PROP_TYPE_TIMESTAMP:
+		for (i = 0; i < p->vector_size; i++) {
+			time_t t;
+
+			t = p->data.timestamp.value[i];
+			if (t != p->data.timestamp.def[i])
+				defaultvalue = FALSE;
+
+			timestamp_utc_to_string_buf(t, ARYLEN(sbuf));
+			vbuf[i] = h_strdup(sbuf);
+		}
+		vbuf[p->vector_size] = NULL;
+		val = h_strjoinv(",", vbuf);
+		quotes = TRUE;
+		break;
+	case PROP_TYPE_STRING:
+		val = h_strdup(*p->data.string.value);
+		if (
+			val != *p->data.string.def &&
+			NULL != val &&
+			NULL != *p->data.string.def &&
+			0 != strcmp(val, *p->data.string.def)
+		) {
+			defaultvalue = FALSE;
+		}
+		if (NULL == val) {
+			val = h_strdup("");
+			defaultvalue = FALSE;
+		}
+		quotes = TRUE;
+		break;
+	case PROP_TYPE_IP:
+		for (i = 0; i < p->vector_size; i++) {
+			host_addr_t addr;
+
+			addr = p->data.ip.value[i];
+			vbuf[i] = h_strdup(host_addr_to_string(addr));
+		}
+		vbuf[p->vector_size] = NULL;
+
+		val = h_strjoinv(",", vbuf);
+		quotes = TRUE;
+		defaultvalue = FALSE;
+		break;
+	case PROP_TYPE_STORAGE:
+		{
+			size_t hex_size = (p->vector_size * 2) + 1;
+
+			val = halloc(hex_size);
+			bin_to_hex_buf(p->data.storage.value, p->vector_size,
+				val, hex_size);
+			quotes = TRUE;
+
+			/* No default values for storage type properties. */
+			defaultvalue = FALSE;
+		}
+		break;
+	case NUM_PROP_TYPES:
+		g_assert_not_reached();
+	}
+
+	g_assert(val != NULL);
+
+	comment = config_comment(p->desc);
+	entry = h_strdup_printf("%s\n%s%s = %s%s%s\n\n", comment,
+		defaultvalue ? "#" : "",
+		p->name, quotes ? "\"" : "", val, quotes ? "\"" : "");
+
+	HFREE_NULL(comment);
+	HFREE_NULL(val);
+	h_strfreev(vbuf);
+
+	return entry;
+}
+
+/**
+ * Get the configuration file entry of a persisted property.
+ *
+ * Entries are cached until the property changes, so that saving the
+ * properties only needs to format the entries of the changed properties.
+ *
+ * The property must be locked.
+ *
+ * @return the entry, which must not be freed.
+ */
+static const char *
+prop_saved_entry(prop_set_t *ps, property_t prop, const prop_def_t *d)
+{
+	struct prop_extra *pe = prop_extra_get(ps, prop, d);
+
+	assert_mutex_is_owned(&d->lock);
+
+	/*
+	 * Since the property is locked, the entry cannot be invalidated by
+	 * prop_emit_prop_changed() until we return.
+	 */
+
+	if (NULL == pe->entry)
+		pe->entry = prop_save_entry(d);
+
+	return pe->entry;
+}
+
 /**
  * Like prop_save_to_file(), but only perform when dirty, i.e. when at least
  * one persisted property changed since the last time we saved.
@@ -1846,142 +2166,13 @@ prop_save_to_file(prop_set_t *ps, const char *dir, const char *filename)
 
 	for (n = 0; n < ps->size; n++) {
 		prop_def_t *p = &ps->props[n];
-		char **vbuf;
-		uint i;
-		char sbuf[1024];
-		char *val = NULL;
-		bool quotes = FALSE;
-		bool defaultvalue = TRUE;
 
 		if (p->save == FALSE)
 			continue;
 
 		PROP_DEF_LOCK(p);
-
-		HALLOC_ARRAY(vbuf, p->vector_size + 1);
-		vbuf[0] = NULL;
-
-		{
-			char *comment = config_comment(p->desc);
-
-			fprintf(config, "%s\n", comment);
-			HFREE_NULL(comment);
-		}
-
-		switch (p->type) {
-		case PROP_TYPE_BOOLEAN:
-			for (i = 0; i < p->vector_size; i++) {
-				bool v;
-
-				v = p->data.boolean.value[i];
-				if (v != p->data.boolean.def[i])
-					defaultvalue = FALSE;
-				vbuf[i] = h_strdup(config_boolean(v));
-			}
-			vbuf[p->vector_size] = NULL;
-
-			val = h_strjoinv(",", vbuf);
-			break;
-		case PROP_TYPE_MULTICHOICE:
-		case PROP_TYPE_GUINT32:
-			for (i = 0; i < p->vector_size; i++) {
-				uint32 v;
-
-				v = p->data.guint32.value[i];
-				if (v != p->data.guint32.def[i])
-					defaultvalue = FALSE;
-				str_bprintf(ARYLEN(sbuf), "%u", v);
-				vbuf[i] = h_strdup(sbuf);
-			}
-			vbuf[p->vector_size] = NULL;
-
-			val = h_strjoinv(",", vbuf);
-			break;
-		case PROP_TYPE_GUINT64:
-			for (i = 0; i < p->vector_size; i++) {
-				uint64 v;
-
-				v = p->data.guint64.value[i];
-				if (v != p->data.guint64.def[i])
-					defaultvalue = FALSE;
-
-				uint64_to_string_buf(v, ARYLEN(sbuf));
-				vbuf[i] = h_strdup(sbuf);
-			}
-			vbuf[p->vector_size] = NULL;
-
-			val = h_strjoinv(",", vbuf);
-			break;
-		case PROP_TYPE_TIMESTAMP:
-			for (i = 0; i < p->vector_size; i++) {
-				time_t t;
-
-				t = p->data.timestamp.value[i];
-				if (t != p->data.timestamp.def[i])
-					defaultvalue = FALSE;
-
-				timestamp_utc_to_string_buf(t, ARYLEN(sbuf));
-				vbuf[i] = h_strdup(sbuf);
-			}
-			vbuf[p->vector_size] = NULL;
-			val = h_strjoinv(",", vbuf);
-			quotes = TRUE;
-			break;
-		case PROP_TYPE_STRING:
-			val = h_strdup(*p->data.string.value);
-			if (
-				val != *p->data.string.def &&
-				NULL != val &&
-				NULL != *p->data.string.def &&
-				0 != strcmp(val, *p->data.string.def)
-			) {
-				defaultvalue = FALSE;
-			}
-			if (NULL == val) {
-				val = h_strdup("");
-				defaultvalue = FALSE;
-			}
-			quotes = TRUE;
-			break;
-		case PROP_TYPE_IP:
-			for (i = 0; i < p->vector_size; i++) {
-				host_addr_t addr;
-
-				addr = p->data.ip.value[i];
-				vbuf[i] = h_strdup(host_addr_to_string(addr));
-			}
-			vbuf[p->vector_size] = NULL;
-
-			val = h_strjoinv(",", vbuf);
-			quotes = TRUE;
-			defaultvalue = FALSE;
-			break;
-		case PROP_TYPE_STORAGE:
-			{
-				size_t hex_size = (p->vector_size * 2) + 1;
-
-				val = halloc(hex_size);
-				bin_to_hex_buf(p->data.storage.value, p->vector_size,
-					val, hex_size);
-				quotes = TRUE;
-
-				/* No default values for storage type properties. */
-				defaultvalue = FALSE;
-			}
-			break;
-		case NUM_PROP_TYPES:
-			g_assert_not_reached();
-		}
-
+		fputs(prop_saved_entry(ps, n + ps->offset, p), config);
 		PROP_DEF_UNLOCK(p);
-
-		g_assert(val != NULL);
-
-		fprintf(config, "%s%s = %s%s%s\n\n", defaultvalue ? "#" : "",
-			p->name, quotes ? "\"" : "", val, quotes ? "\"" : "");
-
-		HFREE_NULL(val);
-		h_strfreev(vbuf);
 	}
 
 	/*
@@ -39,6 +39,7 @@
 #include "crash.h"
 #include "gentime.h"
 #include "hashing.h"		/* For pointer_hash_fast() */
+#include "lockstat.h"
 #include "log.h"
 #include "pow2.h"
 #include "spinlock.h"
@@ -360,6 +361,9 @@ qlock_loop(qlock_t *q,
 	unsigned stid = thread_small_id();
 	struct qlock_waiting wc;
 	enum thread_cancel_state state;
+	uint64 wait_start;
+	const char *holder_file = NULL;
+	unsigned holder_line = 0;
 
 	/*
 	 * This assertion guarantees that we can call thread_timed_block_self()
@@ -534,7 +538,13 @@ qlock_loop(qlock_t *q,
 	 */
 
 	element = thread_lock_waiting_element(q, THREAD_LOCK_QLOCK, file, line);
+	wait_start = lockstat_start();
 	start = gentime_now_exact();
+
+#ifdef SPINLOCK_DEBUG
+	holder_file = q->file;
+	holder_line = q->line;
+#endif
 	tmout.tv_sec = QLOCK_TIMEOUT_WARN;
 	tmout.tv_usec = 0;
 	warned = FALSE;
@@ -586,6 +596,11 @@ qlock_loop(qlock_t *q,
 done:
 	thread_lock_waiting_done(element, q);
 
+	if G_UNLIKELY(wait_start != 0) {
+		lockstat_record(lockstat_site(LOCKSTAT_QLOCK, file, line),
+			wait_start, TRUE, holder_file, holder_line);
+	}
+
 	/*
 	 * Restore old cancel state now that we got the lock.
 	 */
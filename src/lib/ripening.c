@@ -36,6 +36,11 @@
  * being done, to post-process the key/value pair differently than when the
  * entry simply matures and falls off the table.
  *
+ * Since maturation times have a granularity of one second and tables are
+ * usually filled with a few distinct ripening delays, entries maturing at
+ * the same time are grouped into a cohort: only cohorts need to be sorted
+ * by maturation time, and a whole cohort is collected at once.
+ *
  * @author Raphael Manfredi
  * @date 2014
  */
@@ -44,6 +49,7 @@
 
 #include "ripening.h"
 #include "cq.h"
+#include "elist.h"
 #include "erbtree.h"
 #include "hashing.h"
 #include "hikset.h"
@@ -81,7 +87,7 @@ struct ripening_hook {
  *
  * The hash set is the central piece, but we also have a freeing callback,
  * since the entries expire automatically after some time has elapsed and
- * a red-black tree to sort out entries by expiration time.
+ * a red-black tree to sort out entry cohorts by expiration time.
  */
 struct ripening {
 	enum ripening_magic magic;	/**< Magic number */
@@ -89,7 +95,7 @@ struct ripening {
 	cevent_t *expire_ev;		/**< The installed expiration event */
 	mutex_t *lock;				/**< Optional thread-safe lock */
 	struct ripening_hook *hook;	/**< Global freeing hooks defined */
-	erbtree_t tree;				/**< Items in table, by increasing time */
+	erbtree_t tree;				/**< Cohorts, by increasing time */
 };
 
 static void
@@ -99,21 +105,30 @@ ripening_check(const ripening_table_t * const rt)
 	g_assert(RIPENING_MAGIC == rt->magic);
 }
 
+/**
+ * A cohort of items maturing at the same time.
+ *
+ * All the cohorts are tracked in a red-back tree, sorted by increasing
+ * expiration time (the time by which the items "fall off" the structure).
+ */
+struct ripening_cohort {
+	time_t expire;			/**< Maturation time */
+	elist_t items;			/**< Items in the cohort */
+	rbnode_t node;			/**< Embedded node to sort cohorts */
+};
+
 /**
  * We wrap the values we insert in the table, since each value must keep
- * track of its expiration time.
+ * track of its expiration time, given by the cohort to which it belongs.
  *
  * Because the structure (inserted in the table) refers to the key, we can use
  * a hikset instead of a hash table, which saves a pointer for each entry.
- *
- * All the items are also tracked in a red-back tree, sorted by increasing
- * expiration time (the time by which the items "fall off" the structure).
  */
 struct ripening_value {
 	void *value;			/**< The value they inserted in the table */
 	void *key;				/**< The associated key object */
-	time_t expire;			/**< Maturation time */
-	rbnode_t node;			/**< Embedded node to sort items */
+	struct ripening_cohort *cohort;	/**< Cohort, giving maturation time */
+	link_t lk;				/**< Embedded link to chain cohort items */
 };
 
 /*
@@ -151,6 +166,52 @@ struct ripening_value {
 		assert_mutex_is_owned((a)->lock);			\
 } G_STMT_END
 
+/**
+ * Attach item to the cohort maturing at the specified time, creating that
+ * cohort if needed.
+ */
+static void
+ripening_link(ripening_table_t *rt, struct ripening_value *rval, time_t expire)
+{
+	struct ripening_cohort key, *rc;
+
+	assert_ripening_locked(rt);
+	g_assert(NULL == rval->cohort);
+
+	key.expire = expire;
+	rc = erbtree_lookup(&rt->tree, &key);
+
+	if (NULL == rc) {
+		WALLOC(rc);
+		rc->expire = expire;
+		elist_init(&rc->items, offsetof(struct ripening_value, lk));
+		erbtree_insert(&rt->tree, &rc->node);
+	}
+
+	elist_append(&rc->items, rval);
+	rval->cohort = rc;
+}
+
+/**
+ * Detach item from its cohort, disposing of the cohort when it becomes empty.
+ */
+static void
+ripening_unlink(ripening_table_t *rt, struct ripening_value *rval)
+{
+	struct ripening_cohort *rc = rval->cohort;
+
+	assert_ripening_locked(rt);
+	g_assert(rc != NULL);
+
+	elist_remove(&rc->items, rval);
+	rval->cohort = NULL;
+
+	if (0 == elist_count(&rc->items)) {
+		erbtree_remove(&rt->tree, &rc->node);
+		WFREE(rc);
+	}
+}
+
 /**
  * Free keys and values from the ripening table, using specified freeing hooks.
  */
@@ -164,13 +225,12 @@ ripening_free_hook(void *value, void *data, const struct ripening_hook *hook)
 	assert_ripening_locked(rt);
 
 	/*
-	 * Remove the entry from the red-black tree before invoking the
-	 * freeing hooks: the post-processing done in that routine could
-	 * lead to re-entry into ripening_insert() hence we need to be in
-	 * a clean state.
+	 * Remove the entry from its cohort before invoking the freeing
+	 * hooks: the post-processing done in that routine could lead to
+	 * re-entry into ripening_insert() hence we need to be in a clean state.
 	 */
 
-	erbtree_remove(&rt->tree, &rval->node);
+	ripening_unlink(rt, rval);
 
 	if (NULL == hook)
 		hook = rt->hook;
@@ -202,30 +262,40 @@ ripening_gc(cqueue_t *cq, void *obj)
 {
 	ripening_table_t *rt = obj;
 	time_t now = tm_time();
-	struct ripening_value *rval;
+	struct ripening_cohort *rc;
 
 	ripening_check(rt);
 
 	ripening_synchronize(rt);
 
-	g_assert(erbtree_count(&rt->tree) == hikset_count(rt->table));
+	g_assert(erbtree_count(&rt->tree) <= hikset_count(rt->table));
 
 	cq_zero(cq, &rt->expire_ev);
 
-	while (NULL != (rval = erbtree_head(&rt->tree))) {
-		if (delta_time(now, rval->expire) < 0)
-			break;			/* Tree is sorted, oldest items first */
+	/*
+	 * Items are collected one at a time, re-fetching the oldest cohort
+	 * each time: the cohort is freed when its last item is removed, and
+	 * the freeing hooks may insert new items.
+	 */
+
+	while (NULL != (rc = erbtree_head(&rt->tree))) {
+		struct ripening_value *rval;
+
+		if (delta_time(now, rc->expire) < 0)
+			break;			/* Tree is sorted, oldest cohorts first */
+
+		rval = elist_head(&rc->items);
 		hikset_remove(rt->table, rval->key);
 		ripening_free(rval, rt);
 	}
 
 	/*
-	 * If at leat one item remains in the tree, compute the remaining time
-	 * until that item expires and create a corresponding callout event.
+	 * If at leat one cohort remains in the tree, compute the remaining time
+	 * until that cohort expires and create a corresponding callout event.
 	 */
 
-	if (rval != NULL) {
-		time_delta_t delta = delta_time(rval->expire, now);
+	if (rc != NULL) {
+		time_delta_t delta = delta_time(rc->expire, now);
 		g_assert(delta > 0);		/* Checked in the above loop */
 
 		/*
@@ -240,29 +310,22 @@ ripening_gc(cqueue_t *cq, void *obj)
 			cq_resched(rt->expire_ev, delta * 1000);
 	}
 
-	g_assert(erbtree_count(&rt->tree) == hikset_count(rt->table));
+	g_assert(erbtree_count(&rt->tree) <= hikset_count(rt->table));
 
 	ripening_return_void(rt);
 }
 
 /**
- * Comparison routine for items in the red-black tree.
+ * Comparison routine for cohorts in the red-black tree.
  *
- * This sorts items by increasing expiration time, and since we cannot have
- * identical items in the red-black tree, compare key pointers if the expiration
- * time matches.
+ * This sorts cohorts by increasing expiration time, which is unique.
  */
 static int
 ripening_cmp(const void *a, const void *b)
 {
-	const struct ripening_value *ra = a, *rb = b;
+	const struct ripening_cohort *ra = a, *rb = b;
 
-	if G_UNLIKELY(ra->expire == rb->expire) {
-		/* Artificial ordering of items: keys CANNOT be equal */
-		return ptr_cmp(ra->key, rb->key);
-	} else {
-		return CMP(ra->expire, rb->expire);
-	}
+	return CMP(ra->expire, rb->expire);
 }
 
 /**
@@ -287,7 +350,7 @@ ripening_make_hook(hash_fn_t hash, eq_fn_t eq, struct ripening_hook *hook)
 		offsetof(struct ripening_value, key),
 		NULL == hash ? pointer_hash : hash, eq);
 	erbtree_init(&rt->tree, ripening_cmp,
-		offsetof(struct ripening_value, node));
+		offsetof(struct ripening_cohort, node));
 
 	ripening_check(rt);
 	return rt;
@@ -472,7 +535,7 @@ ripening_time(const ripening_table_t *rt, const void *key)
 	ripening_synchronize(rt);
 
 	rval = hikset_lookup(rt->table, key);
-	when = NULL == rval ? 0 : rval->expire;
+	when = NULL == rval ? 0 : rval->cohort->expire;
 
 	ripening_return(rt, when);
 }
@@ -633,7 +696,7 @@ ripening_insert(ripening_table_t *rt, uint delay, const void *key, void *value)
 {
 	bool found;
 	void *ovalue;
-	time_t now = tm_time(), old;
+	time_t now = tm_time(), old, expire;
 	time_delta_t delta;
 	struct ripening_value *rval;
 
@@ -642,13 +705,13 @@ ripening_insert(ripening_table_t *rt, uint delay, const void *key, void *value)
 	ripening_synchronize(rt);
 
 	/*
-	 * Compute the previous expiration time of the first value in the table.
+	 * Compute the previous expiration time of the first cohort in the table.
 	 */
 
 	if (rt->expire_ev != NULL) {
-		rval = erbtree_head(&rt->tree);
-		g_assert(rval != NULL);
-		old = rval->expire;
+		struct ripening_cohort *rc = erbtree_head(&rt->tree);
+		g_assert(rc != NULL);
+		old = rc->expire;
 	} else {
 		old = 0;
 	}
@@ -677,11 +740,11 @@ ripening_insert(ripening_table_t *rt, uint delay, const void *key, void *value)
 		 * Value existed for this key, reset its maturation time.
 		 *
 		 * We assume the maturation time will change, hence we blindly
-		 * remove the node from the red-black tree to re-insert it later
-		 * with the new time, hence at a different position.
+		 * remove the item from its cohort to re-insert it later in the
+		 * cohort for the new time.
 		 */
 
-		erbtree_remove(&rt->tree, &rval->node);
+		ripening_unlink(rt, rval);
 		rval->value = value;
 	} else {
 		WALLOC0(rval);
@@ -690,15 +753,21 @@ ripening_insert(ripening_table_t *rt, uint delay, const void *key, void *value)
 		hikset_insert(rt->table, rval);
 	}
 
-	rval->expire = time_advance(now, delay);
-	erbtree_insert(&rt->tree, &rval->node);
+	expire = time_advance(now, delay);
+	ripening_link(rt, rval, expire);
 
 	/*
 	 * Set or update the timeout event.
+	 *
+	 * There is nothing to do when the event is already set to fire no later
+	 * than the new maturation time, which is the common case.
 	 */
 
-	if (0 == old || delta_time(rval->expire, old) < 0)
-		old = rval->expire;		/* Earliest expiration time */
+	if (rt->expire_ev != NULL && delta_time(expire, old) >= 0)
+		goto done;
+
+	if (0 == old || delta_time(expire, old) < 0)
+		old = expire;			/* Earliest expiration time */
 
 	delta = delta_time(old, now);
 	delta = delta <= 0 ? 1 : delta * 1000;
@@ -51,6 +51,17 @@
  * is usually kept by the application and the delay under which an application
  * expects to be able to get a lock.
  *
+ * Distributed locks keep their readers in per-thread counters, which only
+ * the thread itself updates, so that readers never write to a shared cache
+ * line when the lock is not write-locked.  A reader bumps its counter and
+ * then checks whether there is a writer, whereas a writer first claims the
+ * lock and then waits for all the counters to drop to zero: with a memory
+ * barrier between the two steps on each side, at least one of them sees the
+ * other and backs off.  Since writers wait for the readers to drain after
+ * they obtain the lock, the waiting queue can only exist whilst the lock is
+ * write-locked, and queued writers are granted the lock in FIFO order right
+ * after the queued readers preceding them.
+ *
  * @author Raphael Manfredi
  * @date 2013
  */
@@ -67,6 +78,7 @@
 #include "spinlock.h"
 #include "stringify.h"
 #include "thread.h"
+#include "vmm.h"
 
 #include "override.h"			/* Must be the last header included */
 
@@ -95,6 +107,29 @@ struct rwlock_waiting {
 	uint8 stid;						/* Thread small ID */
 };
 
+#define RWLOCK_SLOT_SIZE	64	/* Assumed cache line size */
+
+/**
+ * A per-thread reader count, alone on its cache line.
+ *
+ * Only the thread owning the slot updates it, except when it is granted the
+ * read lock whilst sleeping in the waiting queue: updates are atomic since
+ * it could be running a signal handler grabbing the lock at that time.
+ * Being alone on its cache line, this is cheap.
+ */
+struct rwlock_slot {
+	uint readers;
+	char pad[RWLOCK_SLOT_SIZE - sizeof(uint)];
+};
+
+/**
+ * The distributed reader counts, allocated for locks created with the
+ * RWLOCK_F_DISTRIBUTED flag.
+ */
+struct rwlock_slots {
+	struct rwlock_slot slot[THREAD_MAX];
+};
+
 static long rwlock_cpus;			/* Amount of CPUs in the system */
 static bool rwlock_pass_through;	/* Whether locks are disabled */
 
@@ -108,6 +143,67 @@ rwlock_check(const struct rwlock * const rw)
 	g_assert(RWLOCK_MAGIC == rw->magic);
 }
 
+/**
+ * Count one more reader for thread.
+ *
+ * The rwlock MUST be locked when calling this routine, unless the thread is
+ * counting itself on a distributed lock.
+ */
+static inline void
+rwlock_reader_add(rwlock_t *rw, uint stid)
+{
+	if (NULL == rw->slots)
+		rw->readers++;
+	else
+		atomic_uint_inc(&rw->slots->slot[stid].readers);
+}
+
+/**
+ * Count one less reader for thread.
+ *
+ * The rwlock MUST be locked when calling this routine, unless the thread is
+ * counting itself on a distributed lock.
+ */
+static inline void
+rwlock_reader_remove(rwlock_t *rw, uint stid)
+{
+	if (NULL == rw->slots)
+		rw->readers--;
+	else
+		atomic_uint_dec(&rw->slots->slot[stid].readers);
+}
+
+/**
+ * @return whether thread is counted as a reader, for assertions.
+ *
+ * On a regular lock, this only checks that there are readers.
+ */
+static inline bool
+rwlock_reader_counted(const rwlock_t *rw, uint stid)
+{
+	if (NULL == rw->slots)
+		return 0 != rw->readers;
+
+	return 0 != atomic_uint_get(&rw->slots->slot[stid].readers);
+}
+
+/**
+ * @return the total amount of readers.
+ */
+static uint
+rwlock_readers_count(const rwlock_t *rw)
+{
+	uint i, n = rw->readers;
+
+	if G_LIKELY(NULL == rw->slots)
+		return n;
+
+	for (i = 0; i < N_ITEMS(rw->slots->slot); i++)
+		n += atomic_uint_get(&rw->slots->slot[i].readers);
+
+	return n;
+}
+
 static bool rwlock_sleep_trace;
 static bool rwlock_contention_trace;
 
@@ -420,7 +516,7 @@ rwlock_grant_waiter(struct rwlock *rw)
 	rw->waiters--;
 
 	if G_LIKELY(wc->reading) {
-		rw->readers++;
+		rwlock_reader_add(rw, wc->stid);
 		wc = wc->next;
 		g_assert(NULL == wc || RWLOCK_WAITING_MAGIC == wc->magic);
 		*ok = TRUE;				/* Wakes up thread */
@@ -429,7 +525,7 @@ rwlock_grant_waiter(struct rwlock *rw)
 			wc = wc->next;
 			g_assert(NULL == wc || RWLOCK_WAITING_MAGIC == wc->magic);
 			G_PREFETCH_R(&wc->next);
-			rw->readers++;
+			rwlock_reader_add(rw, wc->stid);
 			rw->waiters--;
 			*ok = TRUE;			/* Wakes up thread */
 		}
@@ -461,6 +557,29 @@ rwlock_waiters_for_read(const rwlock_t *rw)
 	return NULL == wc || wc->reading;
 }
 
+/**
+ * Grant the lock to waiters after the write lock was released.
+ *
+ * On regular locks, writers can only be granted the lock when there are
+ * no more readers.  On distributed locks, writers wait for the readers
+ * to drain once they got the lock, so we serve the queue up to the first
+ * writer included.
+ *
+ * The rwlock MUST be locked when calling this routine.
+ */
+static void
+rwlock_grant_waiters(struct rwlock *rw)
+{
+	if (NULL == rw->slots) {
+		if (0 == rw->readers || rwlock_waiters_for_read(rw))
+			rwlock_grant_waiter(rw);
+		return;
+	}
+
+	while (0 != rw->waiters && RWLOCK_WFREE == rw->owner)
+		rwlock_grant_waiter(rw);
+}
+
 /**
  * Called on possible deadlock condition.
  *
@@ -616,7 +735,7 @@ rwlock_wait(const rwlock_t *rw, bool reading,
 	if G_UNLIKELY(rwlock_contention_trace) {
 		s_rawinfo("LOCK contention for %s-lock %p (r:%u w:%u q:%u+%u) at %s:%u",
 			reading ? "read" : "write", rw,
-			rw->readers, rw->writers,
+			rwlock_readers_count(rw), rw->writers,
 			rw->waiters - rw->write_waiters, rw->write_waiters,
 			file, line);
 	}
@@ -830,10 +949,14 @@ rwlock_readers_downto(void *p)
 	 * Because rw->readers is updated within a spinlock critical
 	 * section, there is no need to issue a memory (read) barrier
 	 * here, the data was already synchronized by the release of
-	 * the lock.
+	 * the lock.  Distributed counts are updated without the lock
+	 * by their readers however.
 	 */
 
-	if (arg->count == arg->rw->readers)
+	if (arg->rw->slots != NULL)
+		atomic_mb();
+
+	if (arg->count == rwlock_readers_count(arg->rw))
 		return TRUE;
 
 	if G_UNLIKELY(rwlock_pass_through) {
@@ -860,10 +983,16 @@ rwlock_wait_readers(const rwlock_t *rw, uint16 count,
 }
 
 /**
- * Initialize a non-static read-write lock.
+ * Initialize a non-static read-write lock, with flags.
+ *
+ * With RWLOCK_F_DISTRIBUTED, readers are counted on a per-thread basis,
+ * which costs a page of memory but lets readers run without contention.
+ *
+ * @param rw		the read-write lock
+ * @param flags		RWLOCK_F_* flags
  */
 void
-rwlock_init(rwlock_t *rw)
+rwlock_init_flags(rwlock_t *rw, uint flags)
 {
 	g_assert(rw != NULL);
 
@@ -875,6 +1004,20 @@ rwlock_init(rwlock_t *rw)
 	rw->magic = RWLOCK_MAGIC;
 	rw->owner = RWLOCK_WFREE;
 	spinlock_init(&rw->lock);
+
+	if (flags & RWLOCK_F_DISTRIBUTED) {
+		/* Page-aligned, so that each slot lies on its own cache line */
+		rw->slots = vmm_alloc0(sizeof *rw->slots);
+	}
+}
+
+/**
+ * Initialize a non-static read-write lock.
+ */
+void
+rwlock_init(rwlock_t *rw)
+{
+	rwlock_init_flags(rw, 0);
 }
 
 /**
@@ -890,20 +1033,24 @@ rwlock_init(rwlock_t *rw)
 void
 rwlock_destroy(rwlock_t *rw)
 {
+	uint readers;
+
 	rwlock_check(rw);
 
-	if (rw->waiters != 0 || rw->readers != 0 || rw->writers != 0) {
+	readers = rwlock_readers_count(rw);
+
+	if (rw->waiters != 0 || readers != 0 || rw->writers != 0) {
 		uint rwait = rw->writers - rw->write_waiters;
 		bool owned = rwlock_is_owned(rw);
 		bool need_carp = TRUE;
 
 		if (owned)
-			need_carp = rw->waiters != 0 || rw->readers != 0 || rw->writers > 1;
+			need_carp = rw->waiters != 0 || readers != 0 || rw->writers > 1;
 
 		if (need_carp) {
 			s_carp("destroying %srwlock %p with %u reader%s, "
 				"%u writer%s, %u read-waiter%s and %u write-waiter%s",
-				owned ? "owned " : "", rw, rw->readers, plural(rw->readers),
+				owned ? "owned " : "", rw, readers, plural(readers),
 				rw->writers, plural(rw->writers),
 				rwait, plural(rwait),
 				rw->write_waiters, plural(rw->write_waiters));
@@ -916,6 +1063,11 @@ rwlock_destroy(rwlock_t *rw)
 	rw->magic = RWLOCK_DESTROYED;		/* Now invalid */
 	atomic_mb();
 	spinlock_destroy(&rw->lock);
+
+	if (rw->slots != NULL) {
+		vmm_free(rw->slots, sizeof *rw->slots);
+		rw->slots = NULL;
+	}
 }
 
 /**
@@ -926,11 +1078,19 @@ rwlock_destroy(rwlock_t *rw)
 void
 rwlock_reset(rwlock_t *rw)
 {
+	struct rwlock_slots *slots;
+
 	rwlock_check(rw);
 
+	slots = rw->slots;
 	ZERO(rw);
 	rw->magic = RWLOCK_MAGIC;
 	rw->owner = RWLOCK_WFREE;
+
+	if (slots != NULL) {
+		ZERO(slots);
+		rw->slots = slots;
+	}
 }
 
 /**
@@ -971,7 +1131,7 @@ rwlock_is_used(const rwlock_t *rw)
 {
 	rwlock_check(rw);
 
-	if (0 != rw->readers || 0 != rw->writers)
+	if (0 != rw->writers || 0 != rwlock_readers_count(rw))
 		return TRUE;
 
 	if G_UNLIKELY(rwlock_pass_through) {
@@ -990,7 +1150,47 @@ rwlock_is_free(const rwlock_t *rw)
 {
 	rwlock_check(rw);
 
-	return 0 == rw->readers && 0 == rw->writers;
+	return 0 == rw->writers && 0 == rwlock_readers_count(rw);
+}
+
+/**
+ * Attempt to grab a read lock on a distributed lock, without locking.
+ *
+ * @param rw		the read-write lock
+ * @param stid		the current thread small ID
+ *
+ * @return TRUE if we got the read lock, FALSE if there is a writer.
+ */
+static inline bool
+rwlock_rgrab_distributed(rwlock_t *rw, uint stid)
+{
+	uint *readers = &rw->slots->slot[stid].readers;
+
+	/*
+	 * A recursive read lock must always be granted, since a writer
+	 * will be waiting for us to release the read lock we already have.
+	 */
+
+	if G_UNLIKELY(0 != atomic_uint_get(readers)) {
+		atomic_uint_inc(readers);
+		return TRUE;
+	}
+
+	/*
+	 * Announce ourselves before checking for a writer: a writer claims
+	 * the lock before checking for readers, so one of us will see the
+	 * other.
+	 */
+
+	atomic_uint_inc(readers);
+	atomic_mb();
+
+	if G_LIKELY(RWLOCK_WFREE == rw->owner && 0 == rw->waiters)
+		return TRUE;
+
+	atomic_uint_dec(readers);	/* Back off, will go through regular path */
+
+	return FALSE;
 }
 
 /**
@@ -1010,6 +1210,15 @@ rwlock_rgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 
 	rwlock_check(rw);
 
+	/*
+	 * On distributed locks, readers can go without taking the lock.
+	 */
+
+	if (rw->slots != NULL && rwlock_rgrab_distributed(rw, stid)) {
+		got = TRUE;
+		goto granted;
+	}
+
 	/*
 	 * When nobody is waiting and the write lock is not used, we get our
 	 * read lock immediately.
@@ -1019,20 +1228,20 @@ rwlock_rgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 
 	RWLOCK_LOCK(rw);
 	if G_LIKELY(0 == rw->waiters && RWLOCK_WFREE == rw->owner) {
-		rw->readers++;
+		rwlock_reader_add(rw, stid);
 		got = TRUE;
 		g_assert(0 == rw->writers || rwlock_pass_through);
   	} else if G_UNLIKELY(stid == rw->owner) {
-		rw->readers++;
+		rwlock_reader_add(rw, stid);
 		got = TRUE;			/* But we also got the write lock... */
 		g_assert(rw->writers != 0);
 	} else if (thread_lock_holds(rw)) {
-		rw->readers++;		/* This is a recursive read-lock */
+		rwlock_reader_add(rw, stid);	/* This is a recursive read-lock */
 		got = TRUE;
 	} else {
 		if G_UNLIKELY(rwlock_pass_through) {
 			thread_check_suspended();
-			rw->readers++;
+			rwlock_reader_add(rw, stid);
 			got = TRUE;
 		} else {
 			rwlock_add_read_waiter(rw, &wc, stid);
@@ -1041,6 +1250,7 @@ rwlock_rgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 	}
 	RWLOCK_UNLOCK(rw);
 
+granted:
 	if G_UNLIKELY(!got) {
 		rwlock_wait_grant(rw, &wc, file, line);
 		rwlock_readers_record(rw, file, line);
@@ -1053,7 +1263,7 @@ rwlock_rgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 
 	/* Ensure there are no overflows */
 
-	g_assert(rw->readers != 0 || rwlock_pass_through);
+	g_assert(rwlock_reader_counted(rw, stid) || rwlock_pass_through);
 }
 
 /**
@@ -1066,6 +1276,16 @@ rwlock_rungrab(rwlock_t *rw)
 {
 	rwlock_check(rw);
 
+	/*
+	 * On distributed locks, writers wait for the readers to drain after
+	 * they got the lock, so there is nobody to wake up.
+	 */
+
+	if (rw->slots != NULL) {
+		atomic_uint_dec(&rw->slots->slot[thread_small_id()].readers);
+		return;
+	}
+
 	/*
 	 * When the last read lock is gone and there are no more writers,
 	 * grant the lock to the next waiter.
@@ -1089,7 +1309,7 @@ void
 rwlock_wgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 {
 	struct rwlock_waiting wc;
-	bool got;
+	bool got, drain = FALSE;
 	unsigned stid = thread_small_id();
 
 	rwlock_check(rw);
@@ -1099,6 +1319,9 @@ rwlock_wgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 	 * and then proceed.
 	 *
 	 * If writers and readers are already waiting, we have to wait in the line.
+	 *
+	 * Readers of distributed locks are not counted in rw->readers: we get
+	 * the lock and then wait for them to go away.
 	 */
 
 	RWLOCK_LOCK(rw);
@@ -1108,6 +1331,7 @@ rwlock_wgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 		rw->writers++;
 		rw->owner = stid;
 		got = TRUE;
+		drain = rw->slots != NULL;
 		g_assert(1 == rw->writers);
 	} else if G_UNLIKELY(stid == rw->owner) {
 		rw->writers++;
@@ -1147,15 +1371,23 @@ rwlock_wgrab(rwlock_t *rw, const char *file, unsigned line, bool account)
 		 */
 
 		rwlock_wait_grant(rw, &wc, file, line);
+		drain = rw->slots != NULL;
+	}
 
-		if (account)
-			rwlock_write_account(rw, file, line);
+	if G_UNLIKELY(drain) {
+		g_assert_log(!thread_lock_holds(rw),
+			"attempting to get write-lock whilst still holding "
+			"read-lock %p (depth=%zu) at %s:%u",
+			rw, thread_lock_held_count(rw), file, line);
 
-		g_assert(1 == rw->writers || rwlock_pass_through);
+		atomic_mb();		/* Make our ownership visible to readers */
+		rwlock_wait_readers(rw, 0, file, line);
 	}
-	else if (account) {
+
+	if (account)
 		rwlock_write_account(rw, file, line);
-	}
+
+	g_assert(got || 1 == rw->writers || rwlock_pass_through);
 }
 
 /**
@@ -1180,10 +1412,8 @@ rwlock_wungrab(rwlock_t *rw)
 		 * lock whilst there are readers.
 		 */
 
-		if G_UNLIKELY(0 != rw->waiters) {
-			if (0 == rw->readers || rwlock_waiters_for_read(rw))
-				rwlock_grant_waiter(rw);
-		}
+		if G_UNLIKELY(0 != rw->waiters)
+			rwlock_grant_waiters(rw);
 	}
 	RWLOCK_UNLOCK(rw);
 }
@@ -1214,9 +1444,15 @@ bool
 rwlock_rgrab_try_from(rwlock_t *rw, const char *file, unsigned line)
 {
 	bool got;
+	unsigned stid = thread_small_id();
 
 	rwlock_check(rw);
 
+	if (rw->slots != NULL && rwlock_rgrab_distributed(rw, stid)) {
+		got = TRUE;
+		goto granted;
+	}
+
 	/*
 	 * When nobody is waiting and owns the write lock, we get our read lock
 	 * immediately.
@@ -1224,21 +1460,21 @@ rwlock_rgrab_try_from(rwlock_t *rw, const char *file, unsigned line)
 
 	RWLOCK_LOCK(rw);
 	if G_LIKELY(0 == rw->waiters && RWLOCK_WFREE == rw->owner) {
-		rw->readers++;
+		rwlock_reader_add(rw, stid);
 		got = TRUE;
 		g_assert(0 == rw->writers || rwlock_pass_through);
 		g_assert(RWLOCK_WFREE == rw->owner);
-	} else if G_UNLIKELY(thread_small_id() == rw->owner) {
-		rw->readers++;
+	} else if G_UNLIKELY(stid == rw->owner) {
+		rwlock_reader_add(rw, stid);
 		got = TRUE;			/* We already got the write lock... */
 		g_assert(rw->writers != 0);
 	} else if (thread_lock_holds(rw)) {
-		rw->readers++;		/* This is a recursive read lock */
+		rwlock_reader_add(rw, stid);	/* This is a recursive read lock */
 		got = TRUE;
 	} else {
 		if G_UNLIKELY(rwlock_pass_through) {
 			thread_check_suspended();
-			rw->readers++;
+			rwlock_reader_add(rw, stid);
 			got = TRUE;
 		} else {
 			got = FALSE;
@@ -1246,9 +1482,10 @@ rwlock_rgrab_try_from(rwlock_t *rw, const char *file, unsigned line)
 	}
 	RWLOCK_UNLOCK(rw);
 
+granted:
 	if G_LIKELY(got) {
 		/* Ensure there are no overflows */
-		g_assert(rw->readers != 0 || rwlock_pass_through);
+		g_assert(rwlock_reader_counted(rw, stid) || rwlock_pass_through);
 		rwlock_readers_record(rw, file, line);
 		rwlock_read_account(rw, file, line);
 	} else if G_UNLIKELY(rwlock_contention_trace) {
@@ -1273,7 +1510,8 @@ rwlock_rungrab_from(rwlock_t *rw, const char *file, unsigned line)
 	g_assert_log(thread_lock_holds_as(rw, THREAD_LOCK_RLOCK),
 		"attempting to release non-held read-lock %p at %s:%u",
 		rw, file, line);
-	g_assert_log(rw->readers != 0 || rwlock_pass_through,
+	g_assert_log(
+		rwlock_reader_counted(rw, thread_small_id()) || rwlock_pass_through,
 		"attempting to release read-lock %p with no readers at %s:%u",
 		rw, file, line);
 
@@ -1329,6 +1567,20 @@ rwlock_wgrab_try_from(rwlock_t *rw, const char *file, unsigned line)
 		rw->owner = stid;
 		got = TRUE;
 		g_assert(1 == rw->writers);
+
+		/*
+		 * On distributed locks, we must check for readers after claiming
+		 * the lock, and release it if there are any.
+		 */
+
+		if (rw->slots != NULL) {
+			atomic_mb();
+			if (0 != rwlock_readers_count(rw)) {
+				rw->writers--;
+				rw->owner = RWLOCK_WFREE;
+				got = FALSE;
+			}
+		}
 	} else {
 		if G_UNLIKELY(rwlock_pass_through) {
 			thread_check_suspended();
@@ -1409,7 +1661,7 @@ rwlock_upgrade_from(rwlock_t *rw, const char *file, unsigned line)
 	bool need_wait;
 
 	rwlock_check(rw);
-	g_assert_log(rw->readers != 0,
+	g_assert_log(rwlock_reader_counted(rw, stid),
 		"attempting to release read-lock %p with no readers at %s:%u",
 		rw, file, line);
 
@@ -1419,7 +1671,7 @@ rwlock_upgrade_from(rwlock_t *rw, const char *file, unsigned line)
 		"attempting to upgrade non-held read-lock %p at %s:%u",
 		rw, file, line);
 
-	g_assert(count <= rw->readers || rwlock_pass_through);
+	g_assert(count <= rwlock_readers_count(rw) || rwlock_pass_through);
 
 	/*
 	 * When nobody is owning the write lock we can wait for all the readers
@@ -1437,26 +1689,28 @@ rwlock_upgrade_from(rwlock_t *rw, const char *file, unsigned line)
 	RWLOCK_LOCK(rw);
 	if G_LIKELY(RWLOCK_WFREE == rw->owner) {
 		rw->writers++;
-		rw->readers--;					/* Upgrading last read lock */
+		rwlock_reader_remove(rw, stid);	/* Upgrading last read lock */
 		rw->owner = stid;
 		got = TRUE;
 		g_assert(1 == rw->writers);
 	} else if G_UNLIKELY(stid == rw->owner) {
 		rw->writers++;
-		rw->readers--;					/* Upgrading last read lock */
+		rwlock_reader_remove(rw, stid);	/* Upgrading last read lock */
 		got = TRUE;
 	} else {
 		if G_UNLIKELY(rwlock_pass_through) {
 			thread_check_suspended();
 			rw->writers++;
-			rw->readers--;				/* Upgrading last read lock */
+			rwlock_reader_remove(rw, stid);	/* Upgrading last read lock */
 			rw->owner = stid;
 			got = TRUE;
 		} else {
 			got = FALSE;
 		}
 	}
-	need_wait = got && count != rw->readers;
+	if (got && rw->slots != NULL)
+		atomic_mb();		/* Distributed readers may not see our ownership */
+	need_wait = got && count != rwlock_readers_count(rw);
 	RWLOCK_UNLOCK(rw);
 
 	if G_UNLIKELY(!got) {
@@ -1508,7 +1762,7 @@ rwlock_downgrade_from(rwlock_t *rw, const char *file, unsigned line)
 		rw, file, line);
 
 	RWLOCK_LOCK(rw);
-	rw->readers++;						/* We're now a reader */
+	rwlock_reader_add(rw, thread_small_id());	/* We're now a reader */
 	if G_LIKELY(1 == rw->writers--) {
 		rw->owner = RWLOCK_WFREE;
 
@@ -1517,10 +1771,8 @@ rwlock_downgrade_from(rwlock_t *rw, const char *file, unsigned line)
 		 * if they are readers since we're about to become a reader.
 		 */
 
-		if G_UNLIKELY(0 != rw->waiters) {
-			if (rwlock_waiters_for_read(rw))
-				rwlock_grant_waiter(rw);
-		}
+		if G_UNLIKELY(0 != rw->waiters)
+			rwlock_grant_waiters(rw);
 	}
 	RWLOCK_UNLOCK(rw);
 
@@ -1575,6 +1827,19 @@ rwlock_force_upgrade_from(rwlock_t *rw, const char *file, unsigned line)
 	return FALSE;	/* Upgrade was non-atomic, i.e. "forced" */
 }
 
+/**
+ * How many readers are registered currently?
+ *
+ * @return amount of readers for lock.
+ */
+unsigned
+rwlock_readers(const rwlock_t *rw)
+{
+	rwlock_check(rw);
+
+	return rwlock_readers_count(rw);
+}
+
 /**
  * How many writers are registered currently?
  *
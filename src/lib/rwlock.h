@@ -51,6 +51,12 @@
  *		rwlock_upgrade()	-- try to upgrade a read lock into a write one
  *		rwlock_downgrade()	-- downgrade our write lock into a read one
  *
+ * Locks initialized with rwlock_init_flags() and RWLOCK_F_DISTRIBUTED keep
+ * their readers in per-thread counters, each on its own cache line, instead
+ * of a single shared count.  Readers then do not contend with each other as
+ * long as there is no writer, at the expense of a costlier write locking,
+ * which has to scan all the counters.  This is meant for read-mostly data.
+ *
  * @author Raphael Manfredi
  * @date 2013
  */
@@ -89,6 +95,11 @@ enum rwlock_magic {
 
 #define RWLOCK_WFREE	255		/* Write lock available */
 
+/**
+ * Flags for rwlock_init_flags().
+ */
+#define RWLOCK_F_DISTRIBUTED	(1U << 0)	/* Per-thread reader counts */
+
 /**
  * A read-write lock.
  *
@@ -106,6 +117,7 @@ typedef struct rwlock {
 	spinlock_t lock;		/* The thread-safe lock for updating fields */
 	void *wait_head;		/* Head of the waiting list */
 	void *wait_tail;		/* Tail of the waiting list */
+	struct rwlock_slots *slots;	/* Distributed reader counts, NULL if none */
 #ifdef RWLOCK_READER_DEBUG
 	bit_array_t reading[BIT_ARRAY_SIZE(THREAD_MAX)];
 #endif
@@ -131,7 +143,7 @@ typedef struct rwlock {
  * Static initialization value for a rwlock structure.
  */
 #define RWLOCK_INIT	\
-	{ RWLOCK_MAGIC, RWLOCK_WFREE, 0, 0, 0, 0, SPINLOCK_INIT, NULL, NULL	\
+	{ RWLOCK_MAGIC, RWLOCK_WFREE, 0, 0, 0, 0, SPINLOCK_INIT, NULL, NULL, NULL	\
 		RWLOCK_READING_INIT		\
 		RWLOCK_READSPOT_INIT	\
 	}
@@ -174,6 +186,7 @@ void rwlock_set_sleep_trace(bool on);
 void rwlock_set_contention_trace(bool on);
 
 void rwlock_init(rwlock_t *rw);
+void rwlock_init_flags(rwlock_t *rw, uint flags);
 void rwlock_destroy(rwlock_t *rw);
 
 void rwlock_crash_mode(void);
@@ -199,6 +212,7 @@ bool rwlock_is_used(const rwlock_t *rw) NON_NULL_PARAM((1));
 bool rwlock_is_free(const rwlock_t *rw) NON_NULL_PARAM((1));
 bool rwlock_is_taken(const rwlock_t *rw) NON_NULL_PARAM((1));
 
+unsigned rwlock_readers(const rwlock_t *rw);
 unsigned rwlock_writers(const rwlock_t *rw);
 
 NON_NULL_PARAM((1, 2))
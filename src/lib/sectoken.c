@@ -79,35 +79,18 @@ sectoken_lifetime(const sectoken_gen_t *stg)
 }
 
 /**
- * Create a security token from host address and port using specified key.
- *
- * Optionally, extra contextual data may be given (i.e. the token is not
- * only based on the address and port) to make the token more unique to
- * a specific context.
+ * Fill the block holding the host address and port, which is the base
+ * of the security token.
  *
- * @param stg		the security token generator
- * @param n			key index to use
- * @param tok		where security token is written
+ * @param block		where the block is written (TEA_BLOCK_SIZE bytes)
  * @param addr		address of the host for which we're generating a token
  * @param port		port of the host for which we're generating a token
- * @param data		optional contextual data
- * @param len		length of contextual data
  */
 static void
-sectoken_generate_n(sectoken_gen_t *stg, size_t n,
-	sectoken_t *tok, host_addr_t addr, uint16 port,
-	const void *data, size_t len)
+sectoken_block(char block[8], host_addr_t addr, uint16 port)
 {
-	char block[8];
-	char enc[8];
 	char *p = block;
 
-	sectoken_gen_check(stg);
-	g_assert(tok != NULL);
-	g_assert(size_is_non_negative(n));
-	g_assert(n < stg->keycnt);
-	g_assert((NULL != data) == (len != 0));
-
 	switch (host_addr_net(addr)) {
 	case NET_TYPE_IPV4:
 		p = poke_be32(p, host_addr_ipv4(addr));
@@ -130,11 +113,33 @@ sectoken_generate_n(sectoken_gen_t *stg, size_t n,
 	p = poke_be16(p, 0);		/* Filler */
 
 	g_assert(p == &block[8]);
+}
 
-	STATIC_ASSERT(sizeof(tok->v) == sizeof(uint32));
-	STATIC_ASSERT(sizeof(block) == sizeof(enc));
+/**
+ * Create a security token from the host block using specified key.
+ *
+ * Optionally, extra contextual data may be given (i.e. the token is not
+ * only based on the address and port) to make the token more unique to
+ * a specific context.
+ *
+ * @param stg		the security token generator
+ * @param n			key index to use
+ * @param hblock	the host block, filled by sectoken_block()
+ * @param data		optional contextual data
+ * @param len		length of contextual data
+ *
+ * @return the security token value.
+ */
+static uint32
+sectoken_compute(const sectoken_gen_t *stg, size_t n,
+	const char hblock[8], const void *data, size_t len)
+{
+	char enc[8];
+
+	g_assert(size_is_non_negative(n));
+	g_assert(n < stg->keycnt);
 
-	tea_encrypt(&stg->keys[n], enc, ARYLEN(block));
+	tea_encrypt(&stg->keys[n], enc, hblock, TEA_BLOCK_SIZE);
 
 	/*
 	 * If they gave contextual data, encrypt them by block of TEA_BLOCK_SIZE
@@ -144,9 +149,11 @@ sectoken_generate_n(sectoken_gen_t *stg, size_t n,
 	if (data != NULL) {
 		const void *q = data;
 		size_t remain = len;
+		char block[8];
 		char denc[8];
 
 		STATIC_ASSERT(sizeof(denc) == sizeof(enc));
+		STATIC_ASSERT(sizeof(block) == sizeof(enc));
 
 		while (remain != 0) {
 			size_t fill = MIN(remain, TEA_BLOCK_SIZE);
@@ -172,7 +179,36 @@ sectoken_generate_n(sectoken_gen_t *stg, size_t n,
 		}
 	}
 
-	poke_be32(tok->v, tea_squeeze(ARYLEN(enc)));
+	return tea_squeeze(ARYLEN(enc));
+}
+
+/**
+ * Create a security token from host address and port using specified key.
+ *
+ * @param stg		the security token generator
+ * @param n			key index to use
+ * @param tok		where security token is written
+ * @param addr		address of the host for which we're generating a token
+ * @param port		port of the host for which we're generating a token
+ * @param data		optional contextual data
+ * @param len		length of contextual data
+ */
+static void
+sectoken_generate_n(sectoken_gen_t *stg, size_t n,
+	sectoken_t *tok, host_addr_t addr, uint16 port,
+	const void *data, size_t len)
+{
+	char block[8];
+
+	sectoken_gen_check(stg);
+	g_assert(tok != NULL);
+	g_assert((NULL != data) == (len != 0));
+
+	STATIC_ASSERT(sizeof(tok->v) == sizeof(uint32));
+	STATIC_ASSERT(sizeof(block) == TEA_BLOCK_SIZE);
+
+	sectoken_block(block, addr, port);
+	poke_be32(tok->v, sectoken_compute(stg, n, block, data, len));
 }
 
 /**
@@ -219,6 +255,8 @@ sectoken_is_valid_internal(sectoken_gen_t *stg,
 	const sectoken_t *tok, host_addr_t addr, uint16 port,
 	const void *data, size_t len)
 {
+	char block[8];
+	uint32 v;
 	size_t i;
 
 	sectoken_gen_check(stg);
@@ -230,14 +268,17 @@ sectoken_is_valid_internal(sectoken_gen_t *stg,
 	 * keys and say the token is valid if it matches with the one we're
 	 * generating.
 	 *
+	 * The host block does not depend on the key, so it is only built once,
+	 * and tokens are compared as integers.
+	 *
 	 * We try the most recent key first as it is the most likely to succeed.
 	 */
 
-	for (i = 0; i < stg->keycnt; i++) {
-		sectoken_t gen;
+	sectoken_block(block, addr, port);
+	v = peek_be32(tok->v);
 
-		sectoken_generate_n(stg, i, &gen, addr, port, data, len);
-		if (0 == memcmp(&gen, PTRLEN(tok)))
+	for (i = 0; i < stg->keycnt; i++) {
+		if (v == sectoken_compute(stg, i, block, data, len))
 			return TRUE;
 	}
 
@@ -65,16 +65,45 @@
  */
 
 #include "common.h"
+
+#ifdef HAS_X86_SHA
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#ifdef HAS_ARM_SHA1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
 #include "endian.h"
 #include "sha1.h"
 #include "misc.h"			/* For RCSID */
+#include "once.h"
 #include "override.h"		/* Must be the last header included */
 
 #define SHA1_BLEN	64		/**< Message block length */
 
 /* Local Function Prototyptes */
 static void SHA1_pad_message(SHA1_context *);
-static void SHA1_process_message_block(SHA1_context *, const void *mblock);
+static void SHA1_process_blocks(SHA1_context *, const void *data, size_t n);
+static void SHA1_hw_init(void);
+
+/**
+ * Processing of consecutive message blocks using the SHA-1 instructions of
+ * the CPU, when available, updating the intermediate hash.
+ */
+typedef void (*SHA1_blocks_fn_t)(uint32 *ihash, const uint8 *p, size_t n);
+
+static SHA1_blocks_fn_t SHA1_process_blocks_hw;
+static once_flag_t SHA1_hw_inited;
+
+/*
+ * The portable code casts message blocks to uint32 *, hence can only work
+ * on aligned data, whereas the hardware routines do not care.
+ */
+#define SHA1_CAN_PROCESS(p) \
+	(0 == pointer_to_long(p) % 4 || SHA1_process_blocks_hw != NULL)
 
 /**
  *  SHA1_reset
@@ -103,6 +132,8 @@ SHA1_reset(SHA1_context *context)
 	 */
 	STATIC_ASSERT(0 == offsetof(struct SHA1_context, mblock) % 4);
 
+	ONCE_FLAG_RUN(SHA1_hw_inited, SHA1_hw_init);
+
 	ZERO(context);
 
 	context->magic     = SHA1_CONTEXT_MAGIC;
@@ -242,26 +273,34 @@ SHA1_input(SHA1_context *context, const void *data, size_t length)
 	/*
 	 * Optimization: if the data block is aligned on a 32-bit boundary and
 	 * is at least 64-byte long, we can avoid moving data around and feed
-	 * them directly to SHA1_process_message_block(), as long as there are
+	 * them directly to SHA1_process_blocks(), as long as there are
 	 * no pending bytes in the context.  This will likely be happening when
 	 * large chunks of data are fed to the routine, e.g. when processing a file.
 	 *		--RAM, 2015-03-14
+	 *
+	 * All the complete blocks are now handed over at once, so that the
+	 * hardware routines can keep the hash state in registers between blocks
+	 * and the alignment constraint is lifted when they are used.
 	 */
 
-	if G_UNLIKELY(0 != context->midx || 0 != pointer_to_long(mp) % 4)
+	if G_UNLIKELY(0 != context->midx || !SHA1_CAN_PROCESS(mp))
 		goto slowpath;
 
 fastpath:
-	for (/**/; length >= SHA1_BLEN; mp += SHA1_BLEN, length -= SHA1_BLEN) {
-		context->length += 8 * SHA1_BLEN;		/* Counts bits, not bytes */
+	if (length >= SHA1_BLEN) {
+		size_t n = length / SHA1_BLEN;
+		uint64 bits = context->length + (uint64) n * 8 * SHA1_BLEN;
 
-		if G_UNLIKELY(context->length < 8 * SHA1_BLEN) {
+		if G_UNLIKELY(bits < context->length) {
 			/* Message is too long */
 			context->corrupted = SHA_INPUT_TOO_LONG;
 			return SHA_INPUT_TOO_LONG;
 		}
 
-		SHA1_process_message_block(context, mp);
+		context->length = bits;		/* Counts bits, not bytes */
+		SHA1_process_blocks(context, mp, n);
+		mp += n * SHA1_BLEN;
+		length -= n * SHA1_BLEN;
 	}
 
 	/* FALL THROUGH */
@@ -282,8 +321,8 @@ slowpath:
 		}
 
 		if G_UNLIKELY(SHA1_BLEN == context->midx) {
-			SHA1_process_message_block(context, context->mblock);
-			if (length >= SHA1_BLEN && 0 == pointer_to_long(mp) % 4)
+			SHA1_process_blocks(context, context->mblock, 1);
+			if (length >= SHA1_BLEN && SHA1_CAN_PROCESS(mp))
 				goto fastpath;		/* Can use faster processing now */
 		}
 	}
@@ -498,6 +537,425 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 	context->midx = 0;
 }
 
+#ifdef HAS_X86_SHA
+/**
+ * Process consecutive message blocks with the x86 SHA extensions.
+ *
+ * @param ihash		the intermediate hash to update
+ * @param p			start of the message blocks
+ * @param n			amount of 64-byte blocks to process
+ */
+static void G_HOT __attribute__((target("sha,sse4.1")))
+SHA1_process_blocks_x86(uint32 *ihash, const uint8 *p, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(
+		0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, E0, E1, M0, M1, M2, M3;
+
+	/*
+	 * The instructions want A in the highest 32-bit lane, and E in the
+	 * highest lane of its own register.
+	 */
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) ihash), 0x1b);
+	E0 = _mm_set_epi32(ihash[4], 0, 0, 0);
+
+	for (/**/; n != 0; n--, p += SHA1_BLEN) {
+		__m128i abcd_saved = abcd, E0_saved = E0;
+
+		/* Rounds 0-3 */
+		M0 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) &p[0]), mask);
+		E0 = _mm_add_epi32(E0, M0);
+		E1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 0);
+
+		/* Rounds 4-7 */
+		M1 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) &p[16]), mask);
+		E1 = _mm_sha1nexte_epu32(E1, M1);
+		E0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 0);
+		M0 = _mm_sha1msg1_epu32(M0, M1);
+
+		/* Rounds 8-11 */
+		M2 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) &p[32]), mask);
+		E0 = _mm_sha1nexte_epu32(E0, M2);
+		E1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 0);
+		M1 = _mm_sha1msg1_epu32(M1, M2);
+		M0 = _mm_xor_si128(M0, M2);
+
+		/* Rounds 12-15 */
+		M3 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) &p[48]), mask);
+		E1 = _mm_sha1nexte_epu32(E1, M3);
+		E0 = abcd;
+		M0 = _mm_sha1msg2_epu32(M0, M3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 0);
+		M2 = _mm_sha1msg1_epu32(M2, M3);
+		M1 = _mm_xor_si128(M1, M3);
+
+		/* Rounds 16-19 */
+		E0 = _mm_sha1nexte_epu32(E0, M0);
+		E1 = abcd;
+		M1 = _mm_sha1msg2_epu32(M1, M0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 0);
+		M3 = _mm_sha1msg1_epu32(M3, M0);
+		M2 = _mm_xor_si128(M2, M0);
+
+		/* Rounds 20-23 */
+		E1 = _mm_sha1nexte_epu32(E1, M1);
+		E0 = abcd;
+		M2 = _mm_sha1msg2_epu32(M2, M1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 1);
+		M0 = _mm_sha1msg1_epu32(M0, M1);
+		M3 = _mm_xor_si128(M3, M1);
+
+		/* Rounds 24-27 */
+		E0 = _mm_sha1nexte_epu32(E0, M2);
+		E1 = abcd;
+		M3 = _mm_sha1msg2_epu32(M3, M2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 1);
+		M1 = _mm_sha1msg1_epu32(M1, M2);
+		M0 = _mm_xor_si128(M0, M2);
+
+		/* Rounds 28-31 */
+		E1 = _mm_sha1nexte_epu32(E1, M3);
+		E0 = abcd;
+		M0 = _mm_sha1msg2_epu32(M0, M3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 1);
+		M2 = _mm_sha1msg1_epu32(M2, M3);
+		M1 = _mm_xor_si128(M1, M3);
+
+		/* Rounds 32-35 */
+		E0 = _mm_sha1nexte_epu32(E0, M0);
+		E1 = abcd;
+		M1 = _mm_sha1msg2_epu32(M1, M0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 1);
+		M3 = _mm_sha1msg1_epu32(M3, M0);
+		M2 = _mm_xor_si128(M2, M0);
+
+		/* Rounds 36-39 */
+		E1 = _mm_sha1nexte_epu32(E1, M1);
+		E0 = abcd;
+		M2 = _mm_sha1msg2_epu32(M2, M1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 1);
+		M0 = _mm_sha1msg1_epu32(M0, M1);
+		M3 = _mm_xor_si128(M3, M1);
+
+		/* Rounds 40-43 */
+		E0 = _mm_sha1nexte_epu32(E0, M2);
+		E1 = abcd;
+		M3 = _mm_sha1msg2_epu32(M3, M2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 2);
+		M1 = _mm_sha1msg1_epu32(M1, M2);
+		M0 = _mm_xor_si128(M0, M2);
+
+		/* Rounds 44-47 */
+		E1 = _mm_sha1nexte_epu32(E1, M3);
+		E0 = abcd;
+		M0 = _mm_sha1msg2_epu32(M0, M3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 2);
+		M2 = _mm_sha1msg1_epu32(M2, M3);
+		M1 = _mm_xor_si128(M1, M3);
+
+		/* Rounds 48-51 */
+		E0 = _mm_sha1nexte_epu32(E0, M0);
+		E1 = abcd;
+		M1 = _mm_sha1msg2_epu32(M1, M0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 2);
+		M3 = _mm_sha1msg1_epu32(M3, M0);
+		M2 = _mm_xor_si128(M2, M0);
+
+		/* Rounds 52-55 */
+		E1 = _mm_sha1nexte_epu32(E1, M1);
+		E0 = abcd;
+		M2 = _mm_sha1msg2_epu32(M2, M1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 2);
+		M0 = _mm_sha1msg1_epu32(M0, M1);
+		M3 = _mm_xor_si128(M3, M1);
+
+		/* Rounds 56-59 */
+		E0 = _mm_sha1nexte_epu32(E0, M2);
+		E1 = abcd;
+		M3 = _mm_sha1msg2_epu32(M3, M2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 2);
+		M1 = _mm_sha1msg1_epu32(M1, M2);
+		M0 = _mm_xor_si128(M0, M2);
+
+		/* Rounds 60-63 */
+		E1 = _mm_sha1nexte_epu32(E1, M3);
+		E0 = abcd;
+		M0 = _mm_sha1msg2_epu32(M0, M3);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 3);
+		M2 = _mm_sha1msg1_epu32(M2, M3);
+		M1 = _mm_xor_si128(M1, M3);
+
+		/* Rounds 64-67 */
+		E0 = _mm_sha1nexte_epu32(E0, M0);
+		E1 = abcd;
+		M1 = _mm_sha1msg2_epu32(M1, M0);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 3);
+		M3 = _mm_sha1msg1_epu32(M3, M0);
+		M2 = _mm_xor_si128(M2, M0);
+
+		/* Rounds 68-71 */
+		E1 = _mm_sha1nexte_epu32(E1, M1);
+		E0 = abcd;
+		M2 = _mm_sha1msg2_epu32(M2, M1);
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 3);
+		M3 = _mm_xor_si128(M3, M1);
+
+		/* Rounds 72-75 */
+		E0 = _mm_sha1nexte_epu32(E0, M2);
+		E1 = abcd;
+		M3 = _mm_sha1msg2_epu32(M3, M2);
+		abcd = _mm_sha1rnds4_epu32(abcd, E0, 3);
+
+		/* Rounds 76-79 */
+		E1 = _mm_sha1nexte_epu32(E1, M3);
+		E0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, E1, 3);
+		E0 = _mm_sha1nexte_epu32(E0, E0_saved);
+		abcd = _mm_add_epi32(abcd, abcd_saved);
+	}
+
+	_mm_storeu_si128((__m128i *) ihash, _mm_shuffle_epi32(abcd, 0x1b));
+	ihash[4] = _mm_extract_epi32(E0, 3);
+}
+
+/**
+ * @return whether the CPU supports the x86 SHA extensions, along with the
+ * SSSE3 and SSE4.1 instructions we use to load and store the state.
+ */
+static bool
+SHA1_x86_supported(void)
+{
+	uint eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return FALSE;
+
+	if (0 == (ecx & (1U << 9)) || 0 == (ecx & (1U << 19)))
+		return FALSE;		/* No SSSE3 or no SSE4.1 */
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return FALSE;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	return 0 != (ebx & (1U << 29));		/* SHA extensions */
+}
+#endif	/* HAS_X86_SHA */
+
+#ifdef HAS_ARM_SHA1
+/**
+ * Process consecutive message blocks with the ARMv8 cryptographic extensions.
+ *
+ * @param ihash		the intermediate hash to update
+ * @param p			start of the message blocks
+ * @param n			amount of 64-byte blocks to process
+ */
+static void G_HOT __attribute__((target("+crypto")))
+SHA1_process_blocks_arm(uint32 *ihash, const uint8 *p, size_t n)
+{
+	uint32x4_t abcd, T0, T1, M0, M1, M2, M3;
+	uint32 E0, E1;
+
+	abcd = vld1q_u32(ihash);
+	E0 = ihash[4];
+
+	for (/**/; n != 0; n--, p += SHA1_BLEN) {
+		uint32x4_t abcd_saved = abcd;
+		uint32 E0_saved = E0;
+
+		M0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&p[0])));
+		M1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&p[16])));
+		M2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&p[32])));
+		M3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&p[48])));
+
+		T0 = vaddq_u32(M0, vdupq_n_u32(0x5A827999));
+		T1 = vaddq_u32(M1, vdupq_n_u32(0x5A827999));
+
+		/* Rounds 0-3 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M2, vdupq_n_u32(0x5A827999));
+		M0 = vsha1su0q_u32(M0, M1, M2);
+
+		/* Rounds 4-7 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M3, vdupq_n_u32(0x5A827999));
+		M0 = vsha1su1q_u32(M0, M3);
+		M1 = vsha1su0q_u32(M1, M2, M3);
+
+		/* Rounds 8-11 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M0, vdupq_n_u32(0x5A827999));
+		M1 = vsha1su1q_u32(M1, M0);
+		M2 = vsha1su0q_u32(M2, M3, M0);
+
+		/* Rounds 12-15 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M1, vdupq_n_u32(0x6ED9EBA1));
+		M2 = vsha1su1q_u32(M2, M1);
+		M3 = vsha1su0q_u32(M3, M0, M1);
+
+		/* Rounds 16-19 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M2, vdupq_n_u32(0x6ED9EBA1));
+		M3 = vsha1su1q_u32(M3, M2);
+		M0 = vsha1su0q_u32(M0, M1, M2);
+
+		/* Rounds 20-23 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M3, vdupq_n_u32(0x6ED9EBA1));
+		M0 = vsha1su1q_u32(M0, M3);
+		M1 = vsha1su0q_u32(M1, M2, M3);
+
+		/* Rounds 24-27 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M0, vdupq_n_u32(0x6ED9EBA1));
+		M1 = vsha1su1q_u32(M1, M0);
+		M2 = vsha1su0q_u32(M2, M3, M0);
+
+		/* Rounds 28-31 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M1, vdupq_n_u32(0x6ED9EBA1));
+		M2 = vsha1su1q_u32(M2, M1);
+		M3 = vsha1su0q_u32(M3, M0, M1);
+
+		/* Rounds 32-35 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M2, vdupq_n_u32(0x8F1BBCDC));
+		M3 = vsha1su1q_u32(M3, M2);
+		M0 = vsha1su0q_u32(M0, M1, M2);
+
+		/* Rounds 36-39 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M3, vdupq_n_u32(0x8F1BBCDC));
+		M0 = vsha1su1q_u32(M0, M3);
+		M1 = vsha1su0q_u32(M1, M2, M3);
+
+		/* Rounds 40-43 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M0, vdupq_n_u32(0x8F1BBCDC));
+		M1 = vsha1su1q_u32(M1, M0);
+		M2 = vsha1su0q_u32(M2, M3, M0);
+
+		/* Rounds 44-47 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M1, vdupq_n_u32(0x8F1BBCDC));
+		M2 = vsha1su1q_u32(M2, M1);
+		M3 = vsha1su0q_u32(M3, M0, M1);
+
+		/* Rounds 48-51 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M2, vdupq_n_u32(0x8F1BBCDC));
+		M3 = vsha1su1q_u32(M3, M2);
+		M0 = vsha1su0q_u32(M0, M1, M2);
+
+		/* Rounds 52-55 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M3, vdupq_n_u32(0xCA62C1D6));
+		M0 = vsha1su1q_u32(M0, M3);
+		M1 = vsha1su0q_u32(M1, M2, M3);
+
+		/* Rounds 56-59 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M0, vdupq_n_u32(0xCA62C1D6));
+		M1 = vsha1su1q_u32(M1, M0);
+		M2 = vsha1su0q_u32(M2, M3, M0);
+
+		/* Rounds 60-63 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M1, vdupq_n_u32(0xCA62C1D6));
+		M2 = vsha1su1q_u32(M2, M1);
+		M3 = vsha1su0q_u32(M3, M0, M1);
+
+		/* Rounds 64-67 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E0, T0);
+		T0 = vaddq_u32(M2, vdupq_n_u32(0xCA62C1D6));
+		M3 = vsha1su1q_u32(M3, M2);
+
+		/* Rounds 68-71 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E1, T1);
+		T1 = vaddq_u32(M3, vdupq_n_u32(0xCA62C1D6));
+
+		/* Rounds 72-75 */
+		E1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E0, T0);
+
+		/* Rounds 76-79 */
+		E0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, E1, T1);
+		E0 += E0_saved;
+		abcd = vaddq_u32(abcd, abcd_saved);
+	}
+
+	vst1q_u32(ihash, abcd);
+	ihash[4] = E0;
+}
+#endif	/* HAS_ARM_SHA1 */
+
+/**
+ * Select the hardware routine to use for processing message blocks, if any.
+ */
+static void
+SHA1_hw_init(void)
+{
+#ifdef HAS_X86_SHA
+	if (SHA1_x86_supported())
+		SHA1_process_blocks_hw = SHA1_process_blocks_x86;
+#endif
+
+#ifdef HAS_ARM_SHA1
+	if (getauxval(AT_HWCAP) & HWCAP_SHA1)
+		SHA1_process_blocks_hw = SHA1_process_blocks_arm;
+#endif
+}
+
+/**
+ * Process consecutive message blocks, using the SHA-1 instructions of the
+ * CPU when available.
+ *
+ * @param context	the SHA1 context
+ * @param data		start of the message blocks
+ * @param n			amount of 64-byte blocks to process
+ */
+static void
+SHA1_process_blocks(SHA1_context *context, const void *data, size_t n)
+{
+	if (SHA1_process_blocks_hw != NULL) {
+		(*SHA1_process_blocks_hw)(context->ihash, data, n);
+		context->midx = 0;
+	} else {
+		const uint8 *p = data;
+
+		for (/**/; n != 0; n--, p += SHA1_BLEN)
+			SHA1_process_message_block(context, p);
+	}
+}
+
 /**
  *  SHA1_pad_message
  *
@@ -534,7 +992,7 @@ SHA1_pad_message(SHA1_context *context)
 			context->mblock[context->midx++] = 0;
 		}
 
-		SHA1_process_message_block(context, context->mblock);
+		SHA1_process_blocks(context, context->mblock, 1);
 
 		while (context->midx < SHA1_BUP) {
 			context->mblock[context->midx++] = 0;
@@ -551,7 +1009,7 @@ SHA1_pad_message(SHA1_context *context)
 	 */
 
 	poke_be64(&context->mblock[SHA1_BUP], context->length);
-	SHA1_process_message_block(context, context->mblock);
+	SHA1_process_blocks(context, context->mblock, 1);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Static SHA-1 sets.
+ *
+ * A static set is built once from a sorted list of SHA-1 and can then only
+ * be queried.  It is meant for large lists of SHA-1 loaded at startup and
+ * queried on every search hit, like the spam lists, where most lookups
+ * are for SHA-1 which are not part of the set.
+ *
+ * A blocked Bloom filter sits in front of the set, so that negative lookups
+ * usually cost a single cache line.  Behind it, the keys are bucketed by
+ * their leading byte(s), and only their remaining bytes are stored, sorted,
+ * in a single memory-mapped arena along with the bucket index.  Positive
+ * lookups (and false positives of the filter) end up in a binary search
+ * within the bucket.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "sha1set.h"
+
+#include "bloom.h"
+#include "misc.h"
+#include "sha1.h"
+#include "vmm.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+/*
+ * Sets with at least that many keys are bucketed by their two leading bytes
+ * instead of their first byte only.
+ */
+#define SHA1SET_WIDE	65536
+
+enum sha1set_magic { SHA1SET_MAGIC = 0x0e5b17a3 };
+
+/**
+ * A static SHA-1 set.
+ */
+struct sha1set {
+	enum sha1set_magic magic;
+	size_t count;			/**< Amount of keys in set */
+	size_t size;			/**< Size of arena */
+	size_t plen;			/**< Length of the bucketing prefix */
+	size_t slen;			/**< Length of the stored suffixes */
+	bloom_t *bloom;			/**< Filter in front of the set */
+	void *arena;			/**< Memory-mapped arena */
+	const uint32 *index;	/**< Bucket index, in arena */
+	const char *suffix;		/**< Sorted key suffixes, in arena */
+};
+
+static inline void
+sha1set_check(const struct sha1set * const s)
+{
+	g_assert(s != NULL);
+	g_assert(SHA1SET_MAGIC == s->magic);
+}
+
+/**
+ * @return the bucket of a key.
+ */
+static inline uint
+sha1set_bucket(const sha1set_t *s, const struct sha1 *sha1)
+{
+	const uchar *p = (const uchar *) sha1->data;
+
+	return 1 == s->plen ? p[0] : (p[0] << 8) | p[1];
+}
+
+/**
+ * Create a static set from a list of SHA-1.
+ *
+ * @param keys		the keys, sorted in ascending order and without duplicates
+ * @param count		amount of keys
+ *
+ * @return new set, which can be freed with sha1set_free_null().
+ */
+sha1set_t *
+sha1set_make(const struct sha1 *keys, size_t count)
+{
+	sha1set_t *s;
+	uint32 *index;
+	char *suffix;
+	size_t buckets, i;
+	uint b;
+
+	g_assert(keys != NULL || 0 == count);
+	g_assert(count <= MAX_INT_VAL(uint32));
+
+	WALLOC0(s);
+	s->magic = SHA1SET_MAGIC;
+	s->count = count;
+
+	if (0 == count)
+		return s;
+
+	s->plen = count >= SHA1SET_WIDE ? 2 : 1;
+	s->slen = SHA1_RAW_SIZE - s->plen;
+	s->bloom = bloom_make(count);
+
+	buckets = (size_t) 1 << (8 * s->plen);
+	s->size = (buckets + 1) * sizeof index[0] + count * s->slen;
+	s->arena = vmm_alloc(s->size);
+
+	index = s->arena;
+	suffix = ptr_add_offset(s->arena, (buckets + 1) * sizeof index[0]);
+
+	for (i = 0, b = 0; i < count; i++) {
+		const struct sha1 *k = &keys[i];
+		uint bucket = sha1set_bucket(s, k);
+
+		g_assert(0 == i || sha1_cmp(&keys[i - 1], k) < 0);
+
+		while (b <= bucket)
+			index[b++] = i;
+
+		memcpy(&suffix[i * s->slen], &k->data[s->plen], s->slen);
+		bloom_add(s->bloom, k, SHA1_RAW_SIZE);
+	}
+
+	while (b <= buckets)
+		index[b++] = count;
+
+	s->index = index;
+	s->suffix = suffix;
+
+	return s;
+}
+
+/**
+ * Free set and nullify its pointer.
+ */
+void
+sha1set_free_null(sha1set_t **s_ptr)
+{
+	sha1set_t *s = *s_ptr;
+
+	if (s != NULL) {
+		sha1set_check(s);
+
+		bloom_free_null(&s->bloom);
+		if (s->arena != NULL)
+			vmm_free(s->arena, s->size);
+		s->magic = 0;
+		WFREE(s);
+		*s_ptr = NULL;
+	}
+}
+
+/**
+ * Check whether a SHA-1 is part of the set.
+ */
+bool
+sha1set_contains(const sha1set_t *s, const struct sha1 *sha1)
+{
+	const char *key;
+	size_t lo, hi;
+	uint bucket;
+
+	sha1set_check(s);
+	g_assert(sha1 != NULL);
+
+	if G_UNLIKELY(0 == s->count)
+		return FALSE;
+
+	if G_LIKELY(!bloom_maybe(s->bloom, sha1, SHA1_RAW_SIZE))
+		return FALSE;
+
+	bucket = sha1set_bucket(s, sha1);
+	lo = s->index[bucket];
+	hi = s->index[bucket + 1];
+	key = &sha1->data[s->plen];
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = memcmp(&s->suffix[mid * s->slen], key, s->slen);
+
+		if (0 == c)
+			return TRUE;
+		else if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return FALSE;
+}
+
+/**
+ * @return amount of keys in the set.
+ */
+size_t
+sha1set_count(const sha1set_t *s)
+{
+	sha1set_check(s);
+
+	return s->count;
+}
+
+/**
+ * @return the memory used by the set, excluding its Bloom filter.
+ */
+size_t
+sha1set_memory(const sha1set_t *s)
+{
+	sha1set_check(s);
+
+	return sizeof *s + s->size;
+}
+
+/**
+ * Iterate over the set, in ascending order, invoking the callback on each key.
+ */
+void
+sha1set_foreach(const sha1set_t *s, sha1set_cb_t cb, void *data)
+{
+	size_t buckets, i;
+	uint b;
+
+	sha1set_check(s);
+	g_assert(cb != NULL);
+
+	if (0 == s->count)
+		return;
+
+	buckets = (size_t) 1 << (8 * s->plen);
+
+	for (b = 0; b < buckets; b++) {
+		struct sha1 sha1;
+
+		if (1 == s->plen) {
+			sha1.data[0] = b;
+		} else {
+			sha1.data[0] = b >> 8;
+			sha1.data[1] = b & 0xff;
+		}
+
+		for (i = s->index[b]; i < s->index[b + 1]; i++) {
+			memcpy(&sha1.data[s->plen], &s->suffix[i * s->slen], s->slen);
+			(*cb)(&sha1, data);
+		}
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Static SHA-1 sets.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _sha1set_h_
+#define _sha1set_h_
+
+struct sha1set;
+typedef struct sha1set sha1set_t;
+
+typedef void (*sha1set_cb_t)(const struct sha1 *sha1, void *data);
+
+/*
+ * Public interface.
+ */
+
+sha1set_t *sha1set_make(const struct sha1 *keys, size_t count);
+void sha1set_free_null(sha1set_t **s_ptr);
+
+bool sha1set_contains(const sha1set_t *s, const struct sha1 *sha1);
+size_t sha1set_count(const sha1set_t *s);
+size_t sha1set_memory(const sha1set_t *s);
+void sha1set_foreach(const sha1set_t *s, sha1set_cb_t cb, void *data);
+
+#endif /* _sha1set_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
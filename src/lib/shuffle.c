@@ -156,7 +156,8 @@ shuffle(void *b, size_t n, size_t s)
 		 * otherwise we're bound by the initial context of our PRNGs and do
 		 * not improve on anything.  Also, we need to draw randomness from
 		 * another pool to benefit from extra bits of entropy, hence we use
-		 * arc4random() to provide us the additional randomness.
+		 * arc4_thread_rand() to provide us the additional randomness, from
+		 * the thread-private ARC4 stream to avoid taking any lock.
 		 *
 		 * How many re-shuffling do we need to do?  We know we will never be
 		 * able to explore all the possible permutations when "n" (the amount
@@ -187,7 +188,7 @@ shuffle(void *b, size_t n, size_t s)
 		if (n > 12450) {
 			double bits = (n * log(n) - n) / log(2) - 151406.0;
 
-			while (bits > 0.0 && random_upto(arc4random, 99) < 70) {
+			while (bits > 0.0 && random_upto(arc4_thread_rand, 99) < 70) {
 				bits -= 152047.0 / 2.0;		/* Pure conjecture */
 				shuffle_internal(shuffle_thread_rand, b, n, s);
 			}
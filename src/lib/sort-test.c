@@ -44,6 +44,7 @@
 #include "lib/tm.h"
 #include "lib/tqsort.h"
 #include "lib/xmalloc.h"
+#include "lib/xpsort.h"
 #include "lib/xsort.h"
 
 #define TEST_BITS	16
@@ -385,6 +386,12 @@ tqsort_test(void *array, void *copy, size_t cnt, size_t isize, size_t loops)
 	xtest(tqsort, array, copy, cnt, isize, loops);
 }
 
+static void
+xpsort_test(void *array, void *copy, size_t cnt, size_t isize, size_t loops)
+{
+	xtest(xpsort, array, copy, cnt, isize, loops);
+}
+
 static void
 smsort_test(void *array, void *copy, size_t cnt, size_t isize, size_t loops)
 {
@@ -709,6 +716,7 @@ run(void *array, size_t cnt, size_t isize, bool chrono, size_t loops,
 	timeit(qsort_test, loops, array, cnt, isize, chrono, what, "qsort");
 	timeit(tqsort_test, loops, array, cnt, isize, chrono, what, "tqsort");
 	if (!qsort_only) {
+		timeit(xpsort_test, loops, array, cnt, isize, chrono, what, "xpsort");
 		timeit(smsort_test, loops, array, cnt, isize, chrono, what, "smooth");
 		timeit(smsorte_test, loops, array, cnt, isize, chrono, what, "smoothe");
 	}
@@ -53,6 +53,7 @@ struct sorted_array {
 	size_t added;		/**< Number of items added */
 	size_t isize;		/**< The size of an array item (in bytes) */
 	int (*cmp)(const void *a, const void *b); /**< Defines the order */
+	unsigned readonly:1;	/**< Items are not owned, cannot be changed */
 };
 
 static inline void
@@ -89,6 +90,38 @@ sorted_array_new(size_t isize,
 /**
  * Free and dispose of the sorted array, nullifying the given pointer.
  */
+/**
+ * Create a read-only sorted array over already sorted items.
+ *
+ * The items are not copied, they must therefore remain valid and unchanged
+ * until the array is freed.  This is typically used to access an array
+ * stored in a memory-mapped file.
+ *
+ * @param isize		the size of each item
+ * @param cmp		the comparison routine defining the order of items
+ * @param items		the sorted items
+ * @param count		the amount of items
+ *
+ * @return a new read-only sorted array.
+ */
+struct sorted_array *
+sorted_array_new_readonly(size_t isize,
+	int (*cmp)(const void *a, const void *b), const void *items, size_t count)
+{
+	struct sorted_array *tab;
+
+	g_assert(items != NULL || 0 == count);
+
+	tab = sorted_array_new(isize, cmp);
+	g_return_val_if_fail(tab != NULL, NULL);
+
+	tab->items = deconstify_pointer(items);
+	tab->count = tab->added = tab->capacity = count;
+	tab->readonly = TRUE;
+
+	return tab;
+}
+
 void
 sorted_array_free(struct sorted_array **tab_ptr)
 {
@@ -97,7 +130,8 @@ sorted_array_free(struct sorted_array **tab_ptr)
 	tab = *tab_ptr;
 	if (tab) {
 		sorted_array_check(tab);
-		HFREE_NULL(tab->items);
+		if (!tab->readonly)
+			HFREE_NULL(tab->items);
 		tab->magic = 0;
 		WFREE(tab);
 		*tab_ptr = NULL;
@@ -151,6 +185,7 @@ sorted_array_add(struct sorted_array *tab, const void *item)
 	void *dst;
 
 	sorted_array_check(tab);
+	g_assert(!tab->readonly);
 
 	if (tab->added >= tab->capacity) {
 		tab->capacity = tab->capacity ? (tab->capacity * 2) : 8;
@@ -179,6 +214,9 @@ sorted_array_sync(struct sorted_array *tab,
 
 	sorted_array_check(tab);
 
+	if (tab->readonly)
+		return;		/* Already sorted */
+
 	vsort(tab->items, tab->added, tab->isize, tab->cmp);
 
 	/*
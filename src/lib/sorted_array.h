@@ -37,6 +37,9 @@ struct sorted_array;
 
 struct sorted_array *sorted_array_new(size_t item_size,
 						int (*cmp_func)(const void *a, const void *b));
+struct sorted_array *sorted_array_new_readonly(size_t item_size,
+						int (*cmp_func)(const void *a, const void *b),
+						const void *items, size_t count);
 void sorted_array_free(struct sorted_array **tab_ptr);
 void *sorted_array_item(const struct sorted_array *tab, size_t i);
 void *sorted_array_lookup(struct sorted_array *tab, const void *key);
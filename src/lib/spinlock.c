@@ -42,6 +42,7 @@
 #include "crash.h"
 #include "gentime.h"
 #include "getcpucount.h"
+#include "lockstat.h"
 #include "log.h"
 #include "thread.h"
 
@@ -255,8 +256,13 @@ spinlock_loop(volatile spinlock_t *s,
 {
 	unsigned i;
 	gentime_t start = GENTIME_ZERO;
-	int loops = SPINLOCK_LOOP;
+	int loops;
 	const void *element = NULL;
+	lockstat_site_t *ls;
+	uint64 wait_start;
+	int spun = 0;
+	const char *holder_file = NULL;
+	unsigned holder_line = 0;
 
 	spinlock_check(s);
 
@@ -305,9 +311,24 @@ spinlock_loop(volatile spinlock_t *s,
 	if (SPINLOCK_SRC_SPINLOCK == src && thread_lock_holds(src_object))
 		(*deadlocked)(src_object, 0, file, line);
 
+	/*
+	 * The amount of spinning before sleeping is learnt for each locking site
+	 * by lockstat_adapt(), depending on how long we had to wait previously.
+	 */
+
+	ls = lockstat_site(SPINLOCK_SRC_MUTEX == src ?
+		LOCKSTAT_MUTEX : LOCKSTAT_SPINLOCK, file, line);
+	loops = lockstat_spin(ls, SPINLOCK_LOOP);
+	wait_start = lockstat_start();
+
+#ifdef SPINLOCK_DEBUG
+	holder_file = s->file;
+	holder_line = s->line;
+#endif
+
 #ifdef HAS_SCHED_YIELD
 	if (1 == spinlock_cpus)
-		loops /= 10;
+		loops = MAX(loops / 10, 1);
 #endif
 
 	for (i = 1; /* empty */; i++) {
@@ -331,6 +352,7 @@ spinlock_loop(volatile spinlock_t *s,
 						spinlock_source_string(src), src_object, i, file, line);
 				}
 #endif	/* SPINLOCK_DEBUG */
+				spun = j;
 				goto locked;
 			}
 			if (1 == spinlock_cpus)
@@ -389,6 +411,10 @@ spinlock_loop(volatile spinlock_t *s,
 locked:
 	if G_UNLIKELY(element != NULL)
 		thread_lock_waiting_done(element, src_object);
+
+	if (spinlock_cpus > 1)
+		lockstat_adapt(ls, SPINLOCK_LOOP, spun, i > 1);
+	lockstat_record(ls, wait_start, i > 1, holder_file, holder_line);
 }
 
 /**
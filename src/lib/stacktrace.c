@@ -76,6 +76,7 @@
 #define STACKTRACE_DLFT_SYMBOLS	8192	/* Pre-sizing of symbol table */
 #define STACKTRACE_BUFFER_SIZE	8192	/* Amount reserved for stack tracing */
 #define STACKTRACE_BUFFER_COUNT	3		/* Amount of pre-allocated buffers */
+#define STACKTRACE_SYM_CACHE	"symbols.cache"	/* Symbol cache file name */
 
 /**
  * Default stacktrace decoration flags we're using here.
@@ -90,6 +91,7 @@
 static const char *local_path;		/**< Path before a chdir() (ro string) */
 static const char *program_path;	/**< Absolute program path (ro string) */
 static time_t program_mtime;		/**< Last modification time of executable */
+static const char *symbols_cache;	/**< Symbol cache file (ro string) */
 static bool stacktrace_crashing;	/**< Use simple stack traces if set */
 static bool symbols_loaded;
 static symbols_t *stacktrace_symbols;
@@ -534,7 +536,8 @@ stacktrace_auto_tune(void)
  * Get symbols from the executable.
  */
 static void G_COLD
-stacktrace_get_symbols(const char *path, const char *lpath, bool stale)
+stacktrace_get_symbols(const char *path, const char *lpath, bool stale,
+	bool cached)
 {
 	static int done;
 
@@ -559,7 +562,13 @@ stacktrace_get_symbols(const char *path, const char *lpath, bool stale)
 	if (NULL == stacktrace_symbols)
 		stacktrace_symbols = symbols_make(STACKTRACE_DLFT_SYMBOLS, TRUE);
 
-	symbols_load_from(stacktrace_symbols, path, lpath != NULL ? lpath : path);
+	if (NULL == lpath)
+		lpath = path;
+
+	if (cached && !stale && symbols_cache != NULL)
+		symbols_load_cached(stacktrace_symbols, path, lpath, symbols_cache);
+	else
+		symbols_load_from(stacktrace_symbols, path, lpath);
 
 	if (stale)
 		symbols_mark_stale(stacktrace_symbols);
@@ -607,14 +616,6 @@ stacktrace_init(const char *argv0, bool deferred)
 	program_path = ostrdup_readonly(apath);
 	HFREE_NULL(apath);
 
-	if (deferred) {
-		program_mtime = buf.st_mtime;
-		local_path = ostrdup_readonly(path);
-		goto tune;
-	}
-
-	stacktrace_get_symbols(path, path, FALSE);
-
 	/*
 	 * If running on Windows, call dl_util_get_base() to indirectly call
 	 * dladdr(), which will trigger the mingw_dladdr() code and cause
@@ -626,6 +627,14 @@ stacktrace_init(const char *argv0, bool deferred)
 	if (is_running_on_mingw())
 		(void) dl_util_get_base(stacktrace_init);
 
+	if (deferred) {
+		program_mtime = buf.st_mtime;
+		local_path = ostrdup_readonly(path);
+		goto tune;
+	}
+
+	stacktrace_get_symbols(path, path, FALSE, FALSE);
+
 	/* FALL THROUGH */
 
 done:
@@ -669,10 +678,30 @@ stacktrace_close(void)
 }
 
 /**
- * Load symbols if not done already.
+ * Record the directory where the symbol cache file can be kept.
+ *
+ * When symbols are loaded in the background, the cache file is used to
+ * avoid parsing and sorting all the symbols of the executable each time.
  */
 void G_COLD
-stacktrace_load_symbols(void)
+stacktrace_symbols_cache(const char *dir)
+{
+	char *path;
+
+	g_assert(dir != NULL);
+
+	path = make_pathname(dir, STACKTRACE_SYM_CACHE);
+	symbols_cache = ostrdup_readonly(path);
+	HFREE_NULL(path);
+}
+
+/**
+ * Load symbols if not done already.
+ *
+ * @param cached	whether we can use the symbol cache file
+ */
+static void G_COLD
+stacktrace_load(bool cached)
 {
 	static spinlock_t sym_load_slk = SPINLOCK_INIT;
 	bool stale = FALSE;
@@ -735,7 +764,7 @@ stacktrace_load_symbols(void)
 			/* FALL THROUGH */
 		}
 
-		stacktrace_get_symbols(program_path, local_path, stale);
+		stacktrace_get_symbols(program_path, local_path, stale, cached);
 	}
 
 	return;
@@ -746,6 +775,29 @@ error:
 	}
 }
 
+/**
+ * Load symbols if not done already.
+ */
+void G_COLD
+stacktrace_load_symbols(void)
+{
+	stacktrace_load(FALSE);
+}
+
+/**
+ * Thread loading the symbols in the background.
+ */
+static void *
+stacktrace_symbols_thread(void *unused_arg)
+{
+	(void) unused_arg;
+
+	thread_set_name("symbols");
+	stacktrace_load(TRUE);
+
+	return NULL;
+}
+
 /**
  * Post-init operations.
  */
@@ -761,7 +813,19 @@ stacktrace_post_init(void)
 	 * report and cannot map the PC addresses to functions.
 	 */
 
-	stacktrace_load_symbols();
+	stacktrace_load(TRUE);
+#else
+	/*
+	 * Load symbols in the background, so that startup does not pay for it
+	 * but we still get them early, whilst the executable is still there.
+	 * Should we need symbols before the thread is done, we will wait for
+	 * the symbol lock unless we hold other locks.
+	 */
+
+	if (!symbols_loaded) {
+		thread_create(stacktrace_symbols_thread, NULL,
+			THREAD_F_DETACH | THREAD_F_NO_CANCEL | THREAD_F_NO_POOL, 0);
+	}
 #endif
 }
 
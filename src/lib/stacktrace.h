@@ -126,6 +126,7 @@ void stacktrace_atom_circular_flush(void);
 
 void stacktrace_init(const char *argv0, bool deferred);
 void stacktrace_load_symbols(void);
+void stacktrace_symbols_cache(const char *dir);
 void stacktrace_post_init(void);
 void stacktrace_close(void);
 size_t stacktrace_memory_used(void);
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Main loop stall monitoring.
+ *
+ * Callbacks dispatched from the main loop, be it callout queue events or
+ * I/O event handlers, must not run for too long or the whole application
+ * becomes unresponsive.  We time each of these callbacks, building a
+ * latency histogram, and remember the last callbacks which ran for longer
+ * than the configured threshold, so that the culprits can be identified.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "stall.h"
+#include "log.h"
+#include "spinlock.h"
+#include "stacktrace.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define STALL_THRESHOLD		100		/**< ms, default stall threshold */
+#define STALL_KEPT			32		/**< Amount of stalls remembered */
+#define STALL_LOUD			10		/**< Warn past that many thresholds */
+
+/**
+ * Upper bounds of the latency histogram buckets, in usecs.  The last
+ * bucket is unbounded.
+ */
+static const uint64 stall_bucket[STALL_BUCKETS - 1] = {
+	1000, 10000, 100000, 1000000,
+};
+
+static struct stall_stats stall_stats;
+static struct stall_event stall_events[STALL_KEPT];
+static uint stall_events_idx;			/**< Next slot to fill */
+static uint stall_events_cnt;			/**< Amount of filled slots */
+static uint stall_threshold_us = STALL_THRESHOLD * 1000;
+static spinlock_t stall_slk = SPINLOCK_INIT;
+
+#define STALL_LOCK		spinlock_hidden(&stall_slk)
+#define STALL_UNLOCK	spinunlock_hidden(&stall_slk)
+
+/**
+ * Account for the execution of a main loop callback.
+ *
+ * @param src		the callback source
+ * @param fn		the callback that was run
+ * @param start		when the callback was started
+ */
+void
+stall_account(enum stall_source src, const void *fn, const tm_t *start)
+{
+	tm_t end;
+	time_delta_t elapsed;
+	uint64 us;
+	uint i;
+	bool stalled;
+
+	g_assert(UNSIGNED(src) < STALL_SRC_COUNT);
+
+	tm_now_exact(&end);
+	elapsed = tm_elapsed_us(&end, start);
+
+	if G_UNLIKELY(elapsed < 0)
+		return;		/* Clock adjusted whilst the callback ran */
+
+	us = elapsed;
+
+	for (i = 0; i < N_ITEMS(stall_bucket); i++) {
+		if (us < stall_bucket[i])
+			break;
+	}
+
+	STALL_LOCK;
+
+	stall_stats.count[src]++;
+	stall_stats.total_us[src] += us;
+	stall_stats.hist[i]++;
+	if (us > stall_stats.max_us[src])
+		stall_stats.max_us[src] = us;
+
+	stalled = us >= stall_threshold_us;
+
+	if G_UNLIKELY(stalled) {
+		struct stall_event *se = &stall_events[stall_events_idx];
+
+		stall_stats.stalls[src]++;
+		se->when = end.tv_sec;
+		se->duration_ms = us / 1000;
+		se->src = src;
+		se->fn = fn;
+
+		stall_events_idx = (stall_events_idx + 1) % N_ITEMS(stall_events);
+		if (stall_events_cnt < N_ITEMS(stall_events))
+			stall_events_cnt++;
+	}
+
+	STALL_UNLOCK;
+
+	if G_UNLIKELY(stalled && us >= STALL_LOUD * (uint64) stall_threshold_us) {
+		s_warning("main loop stalled for %u ms in %s() from %s",
+			(uint) (us / 1000), stacktrace_function_name(fn),
+			stall_source_name(src));
+	}
+}
+
+/**
+ * Set the stall threshold.
+ *
+ * @param ms		callbacks running for that long or more are recorded
+ */
+void
+stall_threshold_set(uint ms)
+{
+	g_assert(ms != 0);
+
+	STALL_LOCK;
+	stall_threshold_us = MIN(ms, MAX_INT_VAL(uint) / 1000) * 1000;
+	STALL_UNLOCK;
+}
+
+/**
+ * @return the stall threshold, in milliseconds.
+ */
+uint
+stall_threshold(void)
+{
+	return stall_threshold_us / 1000;
+}
+
+/**
+ * Get a snapshot of the callback dispatching statistics.
+ */
+void
+stall_stats_get(struct stall_stats *s)
+{
+	g_assert(s != NULL);
+
+	STALL_LOCK;
+	*s = stall_stats;
+	STALL_UNLOCK;
+}
+
+/**
+ * Fetch the most recent stalls.
+ *
+ * @param vec		where stalls are written, most recent first
+ * @param n			amount of entries in vector
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+stall_recent(struct stall_event *vec, size_t n)
+{
+	size_t i, cnt;
+
+	g_assert(vec != NULL);
+
+	STALL_LOCK;
+
+	cnt = MIN(n, stall_events_cnt);
+
+	for (i = 0; i < cnt; i++) {
+		uint idx = (stall_events_idx + N_ITEMS(stall_events) - 1 - i) %
+			N_ITEMS(stall_events);
+		vec[i] = stall_events[idx];
+	}
+
+	STALL_UNLOCK;
+
+	return cnt;
+}
+
+/**
+ * @return the name of the callback source.
+ */
+const char *
+stall_source_name(enum stall_source src)
+{
+	switch (src) {
+	case STALL_SRC_CALLOUT:	return "callout";
+	case STALL_SRC_IO:		return "I/O";
+	case STALL_SRC_COUNT:	break;
+	}
+
+	return "unknown";
+}
+
+/**
+ * @return upper bound of the histogram bucket, in usecs, 0 if unbounded.
+ */
+uint64
+stall_bucket_limit(uint i)
+{
+	g_assert(i < STALL_BUCKETS);
+
+	return i < N_ITEMS(stall_bucket) ? stall_bucket[i] : 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Main loop stall monitoring.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _stall_h_
+#define _stall_h_
+
+#include "tm.h"
+
+/**
+ * Sources of main loop callbacks being monitored.
+ */
+enum stall_source {
+	STALL_SRC_CALLOUT = 0,		/**< Callout queue event */
+	STALL_SRC_IO,				/**< I/O event handler */
+
+	STALL_SRC_COUNT
+};
+
+#define STALL_BUCKETS	5		/**< Amount of latency histogram buckets */
+
+/**
+ * Callback dispatching statistics.
+ */
+struct stall_stats {
+	uint64 count[STALL_SRC_COUNT];		/**< Callbacks dispatched */
+	uint64 total_us[STALL_SRC_COUNT];	/**< Total time spent, in usecs */
+	uint64 max_us[STALL_SRC_COUNT];		/**< Longest callback, in usecs */
+	uint64 stalls[STALL_SRC_COUNT];		/**< Callbacks above threshold */
+	uint64 hist[STALL_BUCKETS];			/**< Latency histogram */
+};
+
+/**
+ * A recorded stall.
+ */
+struct stall_event {
+	time_t when;				/**< When stall ended */
+	uint32 duration_ms;			/**< Stall duration */
+	enum stall_source src;		/**< Callback source */
+	const void *fn;				/**< Callback which stalled */
+};
+
+/*
+ * Public interface.
+ */
+
+void stall_account(enum stall_source src, const void *fn, const tm_t *start);
+void stall_threshold_set(uint ms);
+uint stall_threshold(void);
+void stall_stats_get(struct stall_stats *s);
+size_t stall_recent(struct stall_event *vec, size_t n);
+const char *stall_source_name(enum stall_source src);
+uint64 stall_bucket_limit(uint i);
+
+#endif /* _stall_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
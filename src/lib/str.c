@@ -2746,6 +2746,46 @@ G_STMT_START {									\
 		if (q++ >= fmtend)
 			break;
 
+		/*
+		 * Fast path for the most common conversions, without any flag,
+		 * width or precision: this bypasses the generic formatting logic,
+		 * which matters when building headers or logging.
+		 */
+
+		switch (*q) {
+		case 's':
+			eptr = va_arg(args, char*);
+			processed++;
+			q++;
+			if (NULL == eptr)
+				eptr = nullstr;
+			elen = vstrlen(eptr);
+			STR_APPEND(eptr, elen);
+			continue;
+
+		case 'd':
+		case 'u':
+			if ('d' == *q) {
+				int i = va_arg(args, int);
+				uv = (i < 0) ? -UNSIGNED(i) : UNSIGNED(i);
+				if (i < 0)
+					esignbuf[esignlen++] = '-';
+			} else {
+				uv = va_arg(args, unsigned);
+			}
+			processed++;
+			q++;
+			mptr = ebuf + sizeof ebuf;
+			do {
+				*--mptr = '0' + uv % 10;
+			} while (uv /= 10);
+			if (esignlen != 0)
+				*--mptr = '-';
+			elen = (ebuf + sizeof ebuf) - mptr;
+			STR_APPEND(mptr, elen);
+			continue;
+		}
+
 		/* FLAGS */
 
 		while (*q) {
@@ -46,8 +46,10 @@
 #include "constants.h"
 #include "cstr.h"
 #include "eslist.h"
+#include "fd.h"
 #include "file.h"
 #include "halloc.h"
+#include "hstrfn.h"
 #include "htable.h"
 #include "log.h"
 #include "misc.h"
@@ -1479,6 +1481,314 @@ unlock:
 	SYMBOLS_WRITE_UNLOCK(st);
 }
 
+/**
+ * Header of the symbol cache file.
+ *
+ * The cache file holds the sorted symbols of an executable, identified by
+ * its SHA1.  It is laid out so that it can be mapped in memory and used
+ * as-is: the header is followed by the symbol entries, sorted by address,
+ * and then by the NUL-terminated symbol names.  All values are stored in
+ * native order, the file being only meaningful on the machine where it was
+ * generated anyway.
+ */
+struct symbols_cache_header {
+	char magic[8];				/**< SYMBOLS_CACHE_MAGIC */
+	struct sha1 build;			/**< SHA1 of the executable */
+	uint32 flags;				/**< Loading flags (SYMBOLS_CACHE_F_*) */
+	uint32 count;				/**< Amount of symbols */
+	uint32 strsize;				/**< Size of the symbol name area */
+};
+
+/**
+ * A symbol entry in the cache file.
+ */
+struct symbols_cache_entry {
+	uint64 addr;				/**< Symbol address, as loaded */
+	uint32 name;				/**< Offset of name in the name area */
+	uint32 reserved;			/**< Padding, set to 0 */
+};
+
+static const char SYMBOLS_CACHE_MAGIC[8] = "GTKGSYM1";
+
+#define SYMBOLS_CACHE_F_FRESH		(1U << 0)	/**< Loaded via nm parsing */
+#define SYMBOLS_CACHE_F_INDIRECT	(1U << 1)	/**< Loaded via nm file */
+
+/**
+ * Map the symbol cache file in memory.
+ *
+ * @param path		the cache file
+ * @param size		where size of the mapped file is written
+ *
+ * @return the base of the mapped file, NULL on error.
+ */
+static void *
+symbols_cache_map(const char *path, size_t *size)
+{
+	filestat_t sb;
+	void *p = NULL;
+	int fd;
+
+	fd = file_open_missing(path, O_RDONLY);
+	if (-1 == fd)
+		return NULL;
+
+	if (-1 == fstat(fd, &sb) || !S_ISREG(sb.st_mode))
+		goto done;
+
+	if (UNSIGNED(sb.st_size) < sizeof(struct symbols_cache_header))
+		goto done;
+
+	*size = sb.st_size;
+
+#ifdef HAS_MMAP
+	p = vmm_mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == p)
+		p = NULL;
+#else
+	p = vmm_alloc_not_leaking(*size);
+	if (UNSIGNED(read(fd, p, *size)) != *size) {
+		vmm_free(p, *size);
+		p = NULL;
+	}
+#endif	/* HAS_MMAP */
+
+done:
+	fd_forget_and_close(&fd);
+	return p;
+}
+
+/**
+ * Release the mapped symbol cache file.
+ */
+static void
+symbols_cache_unmap(void *p, size_t size)
+{
+#ifdef HAS_MMAP
+	vmm_munmap(p, size);
+#else
+	vmm_free(p, size);
+#endif
+}
+
+/**
+ * Load symbols from the cache file, if it holds symbols for the executable.
+ *
+ * When the symbol names are "once" atoms, they point directly into the
+ * mapped cache file, which is then never unmapped.
+ *
+ * @return TRUE if symbols were loaded from the cache.
+ */
+static bool
+symbols_cache_load(symbols_t *st, const struct sha1 *build, const char *path)
+{
+	const struct symbols_cache_header *h;
+	const struct symbols_cache_entry *e;
+	const char *names;
+	size_t size = 0, len, i;
+	void *p;
+
+	p = symbols_cache_map(path, &size);
+	if (NULL == p)
+		return FALSE;
+
+	h = p;
+
+	if (
+		0 != memcmp(h->magic, SYMBOLS_CACHE_MAGIC, sizeof h->magic) ||
+		0 != sha1_cmp(&h->build, build) ||
+		0 == h->count
+	)
+		goto failed;
+
+	len = sizeof *h + h->count * sizeof *e + h->strsize;
+
+	if (len != size || 0 == h->strsize)
+		goto failed;
+
+	e = const_ptr_add_offset(p, sizeof *h);
+	names = const_ptr_add_offset(e, h->count * sizeof *e);
+
+	if (names[h->strsize - 1] != '\0')
+		goto failed;
+
+	for (i = 0; i < h->count; i++) {
+		if (e[i].name >= h->strsize)
+			goto failed;
+	}
+
+	g_assert(0 == st->count);
+
+	if (st->size != 0)
+		vmm_free(st->base, st->size * sizeof st->base[0]);
+
+	st->size = h->count;
+	len = st->size * sizeof st->base[0];
+	st->base = st->once ? vmm_alloc_not_leaking(len) : vmm_alloc(len);
+
+	for (i = 0; i < h->count; i++) {
+		struct symbol *s = &st->base[i];
+		const char *name = &names[e[i].name];
+
+		s->addr = ulong_to_pointer(e[i].addr);
+		s->name = st->once ? name : xstrdup(name);
+	}
+
+	st->count = h->count;
+	st->sorted = TRUE;
+	st->fresh = booleanize(h->flags & SYMBOLS_CACHE_F_FRESH);
+	st->indirect = booleanize(h->flags & SYMBOLS_CACHE_F_INDIRECT);
+
+	if (!st->once)
+		symbols_cache_unmap(p, size);
+
+	return TRUE;
+
+failed:
+	symbols_cache_unmap(p, size);
+	return FALSE;
+}
+
+/**
+ * Save the loaded symbols to the cache file.
+ */
+static void
+symbols_cache_save(const symbols_t *st, const struct sha1 *build,
+	const char *path)
+{
+	struct symbols_cache_header h;
+	char *tmp;
+	FILE *f;
+	size_t i;
+	uint32 off = 0;
+
+	tmp = h_strconcat(path, ".tmp", NULL_PTR);
+	f = file_fopen(tmp, "wb");
+	if (NULL == f)
+		goto done;
+
+	ZERO(&h);
+	memcpy(h.magic, SYMBOLS_CACHE_MAGIC, sizeof h.magic);
+	h.build = *build;
+	h.flags = (st->fresh ? SYMBOLS_CACHE_F_FRESH : 0) |
+		(st->indirect ? SYMBOLS_CACHE_F_INDIRECT : 0);
+	h.count = st->count;
+
+	for (i = 0; i < st->count; i++)
+		h.strsize += vstrlen(st->base[i].name) + 1;
+
+	if (1 != fwrite(&h, sizeof h, 1, f))
+		goto failed;
+
+	for (i = 0; i < st->count; i++) {
+		struct symbols_cache_entry e;
+
+		ZERO(&e);
+		e.addr = pointer_to_ulong(st->base[i].addr);
+		e.name = off;
+		off += vstrlen(st->base[i].name) + 1;
+
+		if (1 != fwrite(&e, sizeof e, 1, f))
+			goto failed;
+	}
+
+	for (i = 0; i < st->count; i++) {
+		const char *name = st->base[i].name;
+
+		if (1 != fwrite(name, vstrlen(name) + 1, 1, f))
+			goto failed;
+	}
+
+	if (0 != fclose(f)) {
+		f = NULL;
+		goto failed;
+	}
+
+	if (-1 == rename(tmp, path))
+		s_warning("%s(): cannot rename \"%s\": %m", G_STRFUNC, tmp);
+
+	goto done;
+
+failed:
+	s_warning("%s(): cannot write \"%s\": %m", G_STRFUNC, tmp);
+	if (f != NULL)
+		fclose(f);
+	unlink(tmp);
+
+done:
+	HFREE_NULL(tmp);
+}
+
+/**
+ * Load symbols from the executable we're running, using a cache file.
+ *
+ * The cache is keyed by the SHA1 of the executable, which is much cheaper
+ * to compute than loading and sorting the symbols.  When the cache does
+ * not match the executable, symbols are loaded via symbols_load_from()
+ * and the cache is regenerated, unless the symbols are not trustworthy.
+ *
+ * @param st			the symbol table into which symbols should be loaded
+ * @param exe			the executable file
+ * @param lpath			the executable name for logging purposes only
+ * @param cache			the symbol cache file path
+ */
+void G_COLD
+symbols_load_cached(symbols_t *st, const char *exe, const char *lpath,
+	const char *cache)
+{
+	struct sha1 build;
+	tm_t start, end;
+
+	symbols_check(st);
+	g_assert(cache != NULL);
+
+	if (!symbols_sha1(exe, &build)) {
+		symbols_load_from(st, exe, lpath);
+		return;
+	}
+
+	tm_now_exact(&start);
+
+	SYMBOLS_WRITE_LOCK(st);
+
+	if (symbols_cache_load(st, &build, cache)) {
+		symbols_check_consistency(st);
+		tm_now_exact(&end);
+
+		symbols_notify_loaded(lpath, "the symbol cache", st->count, 0,
+			st->offset, st->garbage, st->mismatch,
+			tm_elapsed_f(&end, &start));
+
+		if (!st->garbage) {
+			SYMBOLS_WRITE_UNLOCK(st);
+			return;
+		}
+
+		/*
+		 * Garbage symbols in the cache: forget them and reload from the
+		 * executable, which will regenerate the cache.
+		 */
+
+		if (!st->once) {
+			size_t i;
+
+			for (i = 0; i < st->count; i++)
+				xfree(deconstify_pointer(st->base[i].name));
+		}
+
+		st->count = 0;
+		st->sorted = FALSE;
+	}
+
+	SYMBOLS_WRITE_UNLOCK(st);
+
+	symbols_load_from(st, exe, lpath);
+
+	SYMBOLS_READ_LOCK(st);
+	if (0 != st->count && !st->garbage && !st->stale)
+		symbols_cache_save(st, &build, cache);
+	SYMBOLS_READ_UNLOCK(st);
+}
+
 /**
  * Return self-assessed symbol quality.
  */
@@ -56,6 +56,8 @@ const char *symbols_name(const symbols_t *st, const void *pc, bool offset);
 const char *symbols_name_only(const symbols_t *st, const void *pc, bool offset);
 const void *symbols_addr(const symbols_t *st, const void *pc);
 void symbols_load_from(symbols_t *st, const char *path, const  char *lpath);
+void symbols_load_cached(symbols_t *st, const char *exe, const char *lpath,
+	const char *cache);
 enum stacktrace_sym_quality symbols_quality(const symbols_t *st);
 size_t symbols_count(const symbols_t *st);
 void symbols_mark_stale(symbols_t *st);
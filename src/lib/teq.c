@@ -50,6 +50,16 @@
  * Events are processed by the receiving thread in the order they were sent,
  * as soon as the targeted thread is able to process the TSIG_TEQ signal.
  *
+ * Events are not directly appended to the queue: senders push them to a
+ * per-thread mailbox without taking any lock, and the whole mailbox is later
+ * moved to the queue in one batch, under the queue lock.  Only the sender
+ * finding the mailbox empty signals the targeted thread, so that a burst of
+ * events costs a single TSIG_TEQ delivery.
+ *
+ * Events can also be posted to the TEQ_POOL pseudo thread, in which case
+ * they are handed to the thread pool and processed by whichever worker
+ * thread gets them first, in no particular order.
+ *
  * TEQs allows work dispatching to "slave threads" and the possibility
  * for the "master thread" to be informed that a processing is finished.
  * The advantage compared to asynchronous queues (AQ) is that with AQs the
@@ -86,6 +96,7 @@
 #include "stringify.h"			/* For plural() */
 #include "thread.h"
 #include "tm.h"
+#include "tpool.h"
 #include "tsig.h"
 #include "waiter.h"
 #include "walloc.h"
@@ -196,6 +207,7 @@ struct teq {
 	int refcnt;					/**< Reference count */
 	time_t last_handling;		/**< When we last handled the TSIG_TEQ signal */
 	eslist_t queue;				/**< Queue receiving events */
+	void *mailbox;				/**< Lock-free LIFO of posted events */
 	spinlock_t lock;			/**< Thread-safe lock protecting the queue */
 	cevent_t *throttle_ev;		/**< Throttle event (no throttling if NULL) */
 };
@@ -233,6 +245,41 @@ teq_is_io(const struct teq * const teq)
 
 #define TEQ_IO(t)	(teq_is_io(t) ? (struct teq_io *) (t) : NULL)
 
+/**
+ * Move all the events pushed to the mailbox to the tail of the queue.
+ *
+ * The mailbox is a lock-free LIFO, threaded through the event links, which
+ * is detached atomically as a whole: there is no ABA problem since we only
+ * ever swap its head to NULL.  Events are then reversed to restore their
+ * posting order.
+ *
+ * Must be called with the queue locked, unless the queue is being destroyed.
+ */
+static void
+teq_mailbox_flush(struct teq *teq)
+{
+	slink_t *lk;
+	eslist_t batch;
+
+	while (NULL != (lk = atomic_ptr_get(&teq->mailbox))) {
+		if (atomic_ptr_xchg_if_eq(&teq->mailbox, lk, NULL))
+			break;
+	}
+
+	if G_LIKELY(NULL == lk)
+		return;
+
+	eslist_init(&batch, offsetof(struct tevent, lk));
+
+	while (lk != NULL) {
+		slink_t *next = lk->next;
+		eslist_link_prepend(&batch, lk);
+		lk = next;
+	}
+
+	eslist_append_list(&teq->queue, &batch);
+}
+
 /**
  * Array of event queues, one per thread.
  *
@@ -352,6 +399,8 @@ teq_destroy(struct teq *teq)
 	 * events in its queue, but it is not necessarily critical.
 	 */
 
+	teq_mailbox_flush(teq);
+
 	while (NULL != (ev = eslist_shift(&teq->queue))) {
 		teq_destroy_event(teq, ev);
 	}
@@ -388,6 +437,9 @@ teq_is_supported(unsigned id)
 {
 	bool supported;
 
+	if (TEQ_POOL == id)
+		return TRUE;
+
 	g_assert(id < THREAD_MAX);
 
 	EVENT_QUEUE_LOCK;
@@ -555,8 +607,37 @@ teq_put(struct teq *teq, void *ev, bool unique)
 	/* We only support "unique" for plain events */
 	g_assert(implies(unique, tevent_is_plain(ev)));
 
+	/*
+	 * Regular events are pushed to the mailbox without locking.  The thread
+	 * only needs to be signalled when the mailbox was empty: otherwise, the
+	 * sender that filled it has already done so and the pending signal will
+	 * cause the whole mailbox to be processed.
+	 */
+
+	if G_LIKELY(!unique && atomic_ops_available()) {
+		slink_t *lk = &((struct tevent *) ev)->lk;
+		void *head;
+
+		do {
+			head = atomic_ptr_get(&teq->mailbox);
+			lk->next = head;
+		} while (!atomic_ptr_xchg_if_eq(&teq->mailbox, head, lk));
+
+		if (NULL == head)
+			thread_kill(teq->stid, TSIG_TEQ);
+
+		return TRUE;
+	}
+
+	/*
+	 * Looking for an identical event requires that we see all the pending
+	 * events, hence the mailbox must be flushed to the queue first.
+	 */
+
 	TEQ_LOCK(teq);
 
+	teq_mailbox_flush(teq);
+
 	if G_UNLIKELY(unique && NULL != eslist_find(&teq->queue, ev, teq_ev_cmp))
 		posted = FALSE;
 
@@ -608,6 +689,10 @@ teq_remove(struct teq *teq)
 
 	TEQ_LOCK(teq);
 	ev = eslist_shift(&teq->queue);
+	if (NULL == ev) {
+		teq_mailbox_flush(teq);		/* Grab all the new events at once */
+		ev = eslist_shift(&teq->queue);
+	}
 	TEQ_UNLOCK(teq);
 
 	return ev;
@@ -884,7 +969,8 @@ teq_post_event(struct teq *teq, notify_fn_t routine, void *data, bool unique,
  * in order to know how to process the data argument, whether to free it
  * after processing, how it is structured, etc...
  *
- * The targeted thread must have a valid event queue.
+ * The targeted thread must have a valid event queue.  When it is TEQ_POOL,
+ * the event is processed by the thread pool.
  *
  * @param id		ID of the thread to which we want to post the event
  * @param routine	the routine to invoke
@@ -893,7 +979,14 @@ teq_post_event(struct teq *teq, notify_fn_t routine, void *data, bool unique,
 void
 teq_post(unsigned id, notify_fn_t routine, void *data)
 {
-	struct teq *teq = teq_get_mandatory(id, G_STRFUNC);
+	struct teq *teq;
+
+	if (TEQ_POOL == id) {
+		tpool_post(routine, data);
+		return;
+	}
+
+	teq = teq_get_mandatory(id, G_STRFUNC);
 
 	teq_post_event(teq, routine, data, FALSE, THREAD_EVENT_MAGIC);
 }
@@ -976,7 +1069,8 @@ teq_safe_post(unsigned id, notify_fn_t routine, void *data)
  * TEQ_AM_CALLOUT requests that the targeted thread inserts a callout event
  * in the main callout queue.
  *
- * The targeted thread must have a valid event queue.
+ * The targeted thread must have a valid event queue.  When it is TEQ_POOL,
+ * the event is processed by the thread pool.
  *
  * @param id		ID of the thread to which we want to post the event
  * @param routine	the routine to invoke
@@ -995,6 +1089,11 @@ teq_post_ack(unsigned id, notify_fn_t routine, void *data,
 	g_assert(routine != NULL);
 	g_assert(ack != NULL);
 
+	if (TEQ_POOL == id) {
+		tpool_post_ack(routine, data, mode, ack, ack_data);
+		return;
+	}
+
 	teq = teq_get_mandatory(id, G_STRFUNC);
 
 	WALLOC0(eva);
@@ -1349,11 +1448,15 @@ teq_count(unsigned id)
 	struct teq *teq;
 	size_t count;
 
+	if (TEQ_POOL == id)
+		return tpool_pending();
+
 	teq = teq_get(id);
 	if (NULL == teq)
 		return 0;
 
 	TEQ_LOCK(teq);
+	teq_mailbox_flush(teq);
 	count = eslist_count(&teq->queue);
 	if (teq_is_io(teq)) {
 		struct teq_io *teq_io = TEQ_IO(teq);
@@ -1558,6 +1661,8 @@ teq_monitor_trace(struct teq *teq, str_t *logs)
 
 	TEQ_LOCK(teq);
 
+	teq_mailbox_flush(teq);
+
 	ESLIST_FOREACH_DATA(&teq->queue, ev) {
 		teq_monitor_event(ev, logs);
 	}
@@ -1612,6 +1717,7 @@ teq_monitor(void *unused_obj)
 			teq_check(teq);
 
 			TEQ_LOCK(teq);
+			teq_mailbox_flush(teq);
 			count = eslist_count(&teq->queue);
 			last = teq->last_handling;
 			throttled = teq->throttle_ev != NULL;
@@ -43,6 +43,11 @@ typedef enum {
 	TEQ_AM_CALLOUT		/**< Register event into the main callout queue */
 } teq_ackmode_t;
 
+/**
+ * Pseudo thread ID targeting the thread pool, see tpool_post().
+ */
+#define TEQ_POOL	(-2U)
+
 /**
  * An RPC routine for teq_rpc().
  */
@@ -68,6 +68,7 @@
 #include "teq.h"
 #include "thread.h"
 #include "tm.h"
+#include "tpool.h"
 #include "tsig.h"
 #include "vmea.h"
 #include "waiter.h"
@@ -92,7 +93,7 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-hejsvwxABCDEFHIKMNOPQRSUVWX]\n"
+		"Usage: %s [-hejsvwxABCDEFGHIKLMNOPQRSUVWXY]\n"
 		"       [-a type] [-b size] [-c CPU]\n"
 		"       [-f count] [-n count] [-r percent] [-t ms] [-T msecs]\n"
 		"       [-z fn1,fn2...]\n"
@@ -117,9 +118,11 @@ usage(void)
 		"  -D : test synchronization dams\n"
 		"  -E : test thread signals\n"
 		"  -F : test thread fork\n"
+		"  -G : test thread pool\n"
 		"  -H : test thread interrupts\n"
 		"  -I : test inter-thread waiter signaling\n"
 		"  -K : test thread cancellation\n"
+		"  -L : benchmark current thread lookups\n"
 		"  -M : monitors tennis match via waiters\n"
 		"  -N : add broadcast noise during tennis session\n"
 		"  -O : test thread stack overflow\n"
@@ -132,6 +135,7 @@ usage(void)
 		"  -V : test thread event queue (TEQ)\n"
 		"  -W : test local event queue (EVQ)\n"
 		"  -X : exercise concurrent memory allocation\n"
+		"  -Y : benchmark thread event queue (TEQ) post and dispatch latency\n"
 		"Values given as decimal, hexadecimal (0x), octal (0) or binary (0b)\n"
 		"Allocators: r=random mix, h=halloc, v=vmm_alloc, w=walloc, x=xmalloc\n"
 		, getprogname());
@@ -1175,43 +1179,40 @@ test_qthreads(void *arg)
 	return NULL;
 }
 
-static rwlock_t rwsync = RWLOCK_INIT;
-
 static void *
-test_rwthreads(void *unused_arg)
+test_rwthreads(void *arg)
 {
 	const char *tname = thread_name();
-
-	(void) unused_arg;
+	rwlock_t *rwsync = arg;
 
 	s_info("%s - starting concurrent read tests", tname);
-	rwlock_rlock(&rwsync);
+	rwlock_rlock(rwsync);
 
 	s_info("%s - has read lock", tname);
 	compat_sleep_ms(100);
 	s_info("%s - and now trying to upgrade it", tname);
 
-	if (rwlock_upgrade(&rwsync)) {
+	if (rwlock_upgrade(rwsync)) {
 		s_info("%s - could upgrade to write lock, pausing 1 second", tname);
 		sleep(1);
 		s_info("%s - downgrading back to read lock, pausing 1 second", tname);
-		rwlock_downgrade(&rwsync);
+		rwlock_downgrade(rwsync);
 		sleep(1);
 		s_info("%s - releasing read lock, re-getting write lock", tname);
-		rwlock_runlock(&rwsync);
-		rwlock_wlock(&rwsync);
+		rwlock_runlock(rwsync);
+		rwlock_wlock(rwsync);
 		s_info("%s - ok, got write lock back", tname);
 	} else {
 		s_info("%s - could not upgrade, releasing read lock", tname);
-		rwlock_runlock(&rwsync);
+		rwlock_runlock(rwsync);
 		s_info("%s - waiting for write lock", tname);
-		rwlock_wlock(&rwsync);
+		rwlock_wlock(rwsync);
 		s_info("%s - ok, got write lock, sleeping 1 second", tname);
 		sleep(1);
 	}
 
 	s_info("%s - releasing write lock", tname);
-	rwlock_wunlock(&rwsync);
+	rwlock_wunlock(rwsync);
 	s_info("%s - exiting", tname);
 
 	return NULL;
@@ -1278,20 +1279,22 @@ test_qlock(void)
 }
 
 static void
-test_rwlock(void)
+test_rwlock_run(uint flags)
 {
 	int t[9];
-	rwlock_t rw = RWLOCK_INIT;
+	rwlock_t rw, rwsync;
 	unsigned i;
+	const char *what = (flags & RWLOCK_F_DISTRIBUTED) ? "distributed" : "plain";
 
-	TESTING(G_STRFUNC);
+	rwlock_init_flags(&rw, flags);
+	rwlock_init_flags(&rwsync, flags);
 
 	s_info("%s starting, will be launching %s()", thread_name(),
 		stacktrace_function_name(test_rwthreads));
 
 	/* The mono-threaded "cannot fail" sequence */
 
-	emit("%s(): mono-threaded tests...", G_STRFUNC);
+	emit("%s(): mono-threaded tests on %s lock...", G_STRFUNC, what);
 
 	if (!rwlock_rlock_try(&rw))
 		s_error("cannot read-lock");
@@ -1317,10 +1320,10 @@ test_rwlock(void)
 
 	/* Now for multi-threaded tests.... */
 
-	emit("%s(): multi-threaded tests...", G_STRFUNC);
+	emit("%s(): multi-threaded tests on %s lock...", G_STRFUNC, what);
 
 	for (i = 0; i < N_ITEMS(t); i++) {
-		t[i] = thread_create(test_rwthreads, NULL, 0, 0);
+		t[i] = thread_create(test_rwthreads, &rwsync, 0, 0);
 		if (-1 == t[i])
 			s_error("%s() cannot create thread %u: %m", G_STRFUNC, i);
 	}
@@ -1330,6 +1333,18 @@ test_rwlock(void)
 	}
 
 	emit("%s(): multi-threaded tests done.", G_STRFUNC);
+
+	rwlock_destroy(&rw);
+	rwlock_destroy(&rwsync);
+}
+
+static void
+test_rwlock(void)
+{
+	TESTING(G_STRFUNC);
+
+	test_rwlock_run(0);
+	test_rwlock_run(RWLOCK_F_DISTRIBUTED);
 }
 
 static bool test_signals_done;
@@ -2308,6 +2323,265 @@ test_evq(unsigned repeat)
 	}
 }
 
+#define LOOKUP_CALLS	10000000	/* Amount of calls per lookup benchmark */
+
+static void
+lookup_run(const char *what, unsigned (*lookup)(void))
+{
+	tm_nano_t start, end;
+	unsigned i, sum = 0;
+	double elapsed;
+
+	tm_precise_time(&start);
+	for (i = 0; i < LOOKUP_CALLS; i++)
+		sum += (*lookup)();
+	tm_precise_time(&end);
+
+	elapsed = tm_precise_elapsed_f(&end, &start);
+
+	emit("%s: %s: %u calls in %.3f secs, %.2f ns/call (sum=%u)",
+		thread_name(), what, LOOKUP_CALLS, elapsed,
+		elapsed * 1e9 / LOOKUP_CALLS, sum);
+}
+
+static void *
+lookup_thread(void *unused_arg)
+{
+	(void) unused_arg;
+
+	/*
+	 * thread_small_id() uses the native thread-local storage when it is
+	 * supported, whereas thread_safe_small_id() always goes through the
+	 * stack-based QID cache: comparing both measures the gain.
+	 */
+
+	lookup_run("thread_small_id()", thread_small_id);
+	lookup_run("thread_safe_small_id()", thread_safe_small_id);
+
+	return NULL;
+}
+
+static void
+test_lookup(unsigned repeat)
+{
+	TESTING(G_STRFUNC);
+
+	while (repeat--) {
+		int r;
+
+		lookup_thread(NULL);
+
+		r = thread_create(lookup_thread, NULL, THREAD_F_PANIC, THREAD_STACK_MIN);
+		thread_join(r, NULL);
+	}
+}
+
+#define TEQ_BENCH_EVENTS	100000	/* Events posted in one burst */
+#define TEQ_BENCH_PINGS		10000	/* Round-trips between two threads */
+
+static uint teq_bench_received;		/* Events dispatched by the receiver */
+static uint teq_bench_replies;		/* Replies dispatched by the sender */
+static tm_nano_t teq_bench_last;	/* When receiver got last burst event */
+
+struct teq_bench_arg {
+	int receiver;
+	barrier_t *b;
+};
+
+static void
+teq_bench_reply(void *unused_arg)
+{
+	(void) unused_arg;
+
+	teq_bench_replies++;
+}
+
+static void
+teq_bench_event(void *arg)
+{
+	if (TEQ_BENCH_EVENTS == ++teq_bench_received) {
+		tm_precise_time(&teq_bench_last);
+		teq_post(pointer_to_uint(arg), teq_bench_reply, NULL);
+	}
+}
+
+static void
+teq_bench_ping(void *arg)
+{
+	teq_bench_received++;
+	teq_post(pointer_to_uint(arg), teq_bench_reply, NULL);
+}
+
+static bool
+teq_bench_received_all(void *unused_arg)
+{
+	(void) unused_arg;
+
+	return TEQ_BENCH_EVENTS + TEQ_BENCH_PINGS == teq_bench_received;
+}
+
+static bool
+teq_bench_replied(void *arg)
+{
+	return pointer_to_uint(arg) == teq_bench_replies;
+}
+
+static void *
+teq_bench_receiver(void *arg)
+{
+	barrier_t *b = arg;
+
+	teq_create();
+	barrier_wait(b);			/* Receiver installed event queue */
+	barrier_free_null(&b);
+
+	teq_wait(teq_bench_received_all, NULL);
+
+	return NULL;
+}
+
+static void *
+teq_bench_sender(void *arg)
+{
+	struct teq_bench_arg *ba = arg;
+	uint i, me = thread_small_id();
+	tm_nano_t start, posted, end;
+	double elapsed;
+
+	teq_create();
+	barrier_wait(ba->b);		/* Wait for receiver to install event queue */
+	barrier_free_null(&ba->b);
+
+	/*
+	 * A burst of events measures the cost of posting and the rate at
+	 * which the receiver can dispatch a backlog of events.
+	 */
+
+	tm_precise_time(&start);
+	for (i = 0; i < TEQ_BENCH_EVENTS; i++)
+		teq_post(ba->receiver, teq_bench_event, uint_to_pointer(me));
+	tm_precise_time(&posted);
+
+	teq_wait(teq_bench_replied, uint_to_pointer(1));
+
+	elapsed = tm_precise_elapsed_f(&posted, &start);
+	emit("%s(): posted %u events in %.3f secs, %.2f ns/post",
+		G_STRFUNC, TEQ_BENCH_EVENTS, elapsed,
+		elapsed * 1e9 / TEQ_BENCH_EVENTS);
+
+	elapsed = tm_precise_elapsed_f(&teq_bench_last, &start);
+	emit("%s(): dispatched %u events in %.3f secs, %.2f ns/event",
+		G_STRFUNC, TEQ_BENCH_EVENTS, elapsed,
+		elapsed * 1e9 / TEQ_BENCH_EVENTS);
+
+	/*
+	 * Ping-pong between the two threads measures the latency between the
+	 * posting of an event and its dispatching in the other thread.
+	 */
+
+	tm_precise_time(&start);
+	for (i = 0; i < TEQ_BENCH_PINGS; i++) {
+		teq_post(ba->receiver, teq_bench_ping, uint_to_pointer(me));
+		teq_wait(teq_bench_replied, uint_to_pointer(i + 2));
+	}
+	tm_precise_time(&end);
+
+	elapsed = tm_precise_elapsed_f(&end, &start);
+	emit("%s(): %u round-trips in %.3f secs, %.2f us/round-trip",
+		G_STRFUNC, TEQ_BENCH_PINGS, elapsed,
+		elapsed * 1e6 / TEQ_BENCH_PINGS);
+
+	return NULL;
+}
+
+static void
+test_teq_bench(unsigned repeat)
+{
+	TESTING(G_STRFUNC);
+
+	while (repeat--) {
+		int s, r;
+		struct teq_bench_arg arg;
+
+		teq_bench_received = teq_bench_replies = 0;
+
+		arg.b = barrier_new(2);
+		r = thread_create(teq_bench_receiver, barrier_refcnt_inc(arg.b),
+				THREAD_F_PANIC, THREAD_STACK_MIN);
+		arg.receiver = r;
+		s = thread_create(teq_bench_sender, &arg,
+				THREAD_F_PANIC, THREAD_STACK_MIN);
+
+		thread_join(r, NULL);
+		thread_join(s, NULL);
+	}
+}
+
+#define TPOOL_JOBS	1000	/* Amount of jobs posted to the thread pool */
+
+static uint tpool_done, tpool_acked;
+
+static void
+tpool_job(void *arg)
+{
+	int n = pointer_to_int(arg);
+
+	/*
+	 * Jobs posted from a worker go to its own queue, and can be stolen.
+	 */
+
+	if (n > 0 && 0 == n % 2)
+		tpool_post(tpool_job, int_to_pointer(-n));
+
+	atomic_uint_inc(&tpool_done);
+}
+
+static void
+tpool_ack(void *arg)
+{
+	(void) arg;
+
+	atomic_uint_inc(&tpool_acked);
+}
+
+static void
+test_tpool(unsigned repeat)
+{
+	TESTING(G_STRFUNC);
+
+	while (repeat--) {
+		int i;
+		uint expected = TPOOL_JOBS + TPOOL_JOBS / 2;
+
+		atomic_uint_set(&tpool_done, 0);
+		atomic_uint_set(&tpool_acked, 0);
+
+		for (i = 1; i <= TPOOL_JOBS; i++) {
+			tpool_post_ack(tpool_job, int_to_pointer(i),
+				TEQ_AM_CALL, tpool_ack, NULL);
+		}
+
+		for (i = 0; i < 500; i++) {
+			if (
+				expected == atomic_uint_get(&tpool_done) &&
+				TPOOL_JOBS == atomic_uint_get(&tpool_acked)
+			)
+				break;
+			thread_sleep_ms(10);
+		}
+
+		emit("%s(): %u workers ran %u jobs", G_STRFUNC,
+			tpool_workers(), atomic_uint_get(&tpool_done));
+
+		g_assert_log(expected == atomic_uint_get(&tpool_done),
+			"tpool_done=%u (expected %u)", tpool_done, expected);
+		g_assert_log(TPOOL_JOBS == atomic_uint_get(&tpool_acked),
+			"tpool_acked=%u (expected %u)", tpool_acked, TPOOL_JOBS);
+	}
+
+	tpool_close();
+}
+
 #define INTERRUPTS	5	/* Amount of interrupts we're sending */
 
 static int interrupt_count;
@@ -2484,9 +2758,10 @@ main(int argc, char **argv)
 	bool inter = FALSE, forking = FALSE, aqueue = FALSE, rwlock = FALSE;
 	bool signals = FALSE, barrier = FALSE, overflow = FALSE, memory = FALSE;
 	bool stats = FALSE, teq = FALSE, cancel = FALSE, dam = FALSE, evq = FALSE;
-	bool interrupts = FALSE, qlock = FALSE;
+	bool interrupts = FALSE, qlock = FALSE, pool = FALSE, lookup = FALSE;
+	bool teq_bench = FALSE;
 	unsigned repeat = 1, play_time = 0;
-	const char options[] = "a:b:c:ef:hjn:r:st:vwxz:ABCDEFHIKMNOPQRST:UVWX";
+	const char options[] = "a:b:c:ef:hjn:r:st:vwxz:ABCDEFGHIKLMNOPQRST:UVWXY";
 
 	progstart(argc, argv);
 	thread_set_main(TRUE);		/* We're the main thread, we can block */
@@ -2512,6 +2787,9 @@ main(int argc, char **argv)
 		case 'F':			/* test thread_fork() */
 			forking = TRUE;
 			break;
+		case 'G':			/* test thread pool */
+			pool = TRUE;
+			break;
 		case 'H':			/* test thread interrupts */
 			interrupts = TRUE;
 			break;
@@ -2521,6 +2799,9 @@ main(int argc, char **argv)
 		case 'K':			/* test thread cancellation */
 			cancel = TRUE;
 			break;
+		case 'L':			/* benchmark thread lookups */
+			lookup = TRUE;
+			break;
 		case 'M':			/* monitor tennis match */
 			monitor = TRUE;
 			break;
@@ -2558,6 +2839,9 @@ main(int argc, char **argv)
 		case 'X':			/* exercise memory allocation */
 			memory = TRUE;
 			break;
+		case 'Y':			/* benchmark thread event queue */
+			teq_bench = TRUE;
+			break;
 		case 'a':			/* choose allocator for -X tests */
 			allocator = *optarg;
 			break;
@@ -2707,9 +2991,18 @@ main(int argc, char **argv)
 	if (teq)
 		test_teq(repeat);
 
+	if (pool)
+		test_tpool(repeat);
+
 	if (evq)
 		test_evq(repeat);
 
+	if (lookup)
+		test_lookup(repeat);
+
+	if (teq_bench)
+		test_teq_bench(repeat);
+
 	/*
 	 * Print final statistics.
 	 */
@@ -3671,6 +3671,67 @@ thread_find_via_qid(thread_qid_t qid)
 	return te;
 }
 
+/*
+ * When the compiler supports native thread-local storage, we remember the
+ * thread element of the current thread there, which is cheaper than
+ * computing the QID and probing the QID cache.  The stack-based lookup
+ * remains the fallback, and is still needed to map a stack pointer to
+ * its thread.
+ */
+#if HAS_GCC(3, 3) && !defined(MINGW32)
+#define THREAD_HAS_TLS
+static __thread struct thread_element *thread_tls_element;
+#endif
+
+/**
+ * Get the thread element of the current thread from the thread-local
+ * storage, if available.
+ *
+ * @return the thread element, NULL if not known or not supported.
+ */
+static inline struct thread_element *
+thread_tls_get(void)
+{
+#ifdef THREAD_HAS_TLS
+	struct thread_element *te = thread_tls_element;
+
+	/*
+	 * The element could have been reset or reused since we recorded it,
+	 * so make sure it is still attached to the current thread.
+	 */
+
+	if G_LIKELY(te != NULL) {
+		thread_t t = thread_self();
+
+		if G_LIKELY(thread_eq(te->tid, t))
+			return te;
+	}
+#endif	/* THREAD_HAS_TLS */
+
+	return NULL;
+}
+
+/**
+ * Record the thread element in the thread-local storage, if it belongs
+ * to the current thread.
+ *
+ * @return the thread element, for convenience.
+ */
+static inline struct thread_element *
+thread_tls_set(struct thread_element *te)
+{
+#ifdef THREAD_HAS_TLS
+	if G_LIKELY(te != NULL) {
+		thread_t t = thread_self();
+
+		if G_LIKELY(thread_eq(te->tid, t))
+			thread_tls_element = te;
+	}
+#endif	/* THREAD_HAS_TLS */
+
+	return te;
+}
+
 /**
  * Find existing thread based on the supplied stack pointer.
  *
@@ -3746,7 +3807,15 @@ thread_get_element(void)
 	int retries;
 
 	/*
-	 * First look for thread via the QID cache
+	 * Fast path through the thread-local storage, when supported.
+	 */
+
+	te = thread_tls_get();
+	if G_LIKELY(te != NULL)
+		return te;
+
+	/*
+	 * Look for thread via the QID cache
 	 */
 
 	qid = thread_quasi_id_fast(&qid);
@@ -3754,7 +3823,7 @@ thread_get_element(void)
 
 	te = thread_qid_cache_get(idx);
 	if G_LIKELY(thread_element_matches(te, qid))
-		return te;
+		return thread_tls_set(te);
 
 	/*
 	 * Not in cache, look for a match by comparing known QID ranges.
@@ -3763,7 +3832,7 @@ thread_get_element(void)
 	te = thread_find_via_qid(qid);
 	if G_LIKELY(te != NULL) {
 		thread_element_stack_check(te);		/* For Windows only */
-		return te;
+		return thread_tls_set(te);
 	}
 
 	/*
@@ -3935,7 +4004,7 @@ found:
 
 	thread_qid_cache_set(idx, te, qid);
 
-	return te;
+	return thread_tls_set(te);
 }
 
 /**
@@ -4320,6 +4389,14 @@ thread_small_id(void)
 	struct thread_element *te;
 	int stid;
 
+	/*
+	 * Fast path through the thread-local storage, when supported.
+	 */
+
+	te = thread_tls_get();
+	if G_LIKELY(NULL != te)
+		return te->stid;
+
 	/*
 	 * Look in the QID cache for a match.
 	 */
@@ -6765,7 +6842,7 @@ thread_lock_dump_fd(int fd, const struct thread_element *te)
 					else
 						print_str(" write");		/* 7 */
 
-					r = PRINT_NUMBER(rdbuf, rw->readers);
+					r = PRINT_NUMBER(rdbuf, rwlock_readers(rw));
 					w = PRINT_NUMBER(wrbuf, rw->writers);
 					qr = PRINT_NUMBER(qrbuf, rw->waiters - rw->write_waiters);
 					qw = PRINT_NUMBER(qwbuf, rw->write_waiters);
@@ -8251,7 +8328,10 @@ thread_element_clear_locks(struct thread_element *te)
 				if (
 					mem_is_valid_range(PTRLEN(rw)) &&
 					RWLOCK_MAGIC == rw->magic &&
-					(0 != rw->readers || 0 != rw->writers || 0 != rw->waiters)
+					(
+						0 != rwlock_readers(rw) || 0 != rw->writers ||
+						0 != rw->waiters
+					)
 				) {
 					unlocked = TRUE;
 					rwlock_reset(rw);
@@ -62,9 +62,18 @@
 #define TM_MILLION			1000000L
 #define TM_BILLION			1000000000L
 
+#define TM_SEQ_RETRIES		64	/* Lock-free read attempts before locking */
+
 tm_t tm_cached_now;			/* Currently cached time */
 static spinlock_t tm_slk = SPINLOCK_INIT;
 
+/*
+ * Sequence counter protecting tm_cached_now, so that readers do not need
+ * to take the lock: it is odd whilst the cached time is being updated.
+ * Updaters are serialized by the tm_slk lock.
+ */
+static volatile uint tm_seq;
+
 static struct {
 	time_delta_t offset;	/* Current GMT offset, as computed */
 	time_t computed;		/* Last computed time for the GMT offset */
@@ -80,6 +89,47 @@ static uint32 tm_debug;
 
 #define tm_debugging(lvl)	G_UNLIKELY(tm_debug > (lvl))
 
+/**
+ * Update the cached time.
+ *
+ * @attention
+ * Must be called with the tm_slk lock held.
+ */
+static inline void
+tm_cached_set(const tm_t *now)
+{
+	tm_seq++;
+	atomic_mb();
+	tm_cached_now = *now;	/* Struct copy */
+	atomic_mb();
+	tm_seq++;
+}
+
+/**
+ * Read the cached time, without taking the lock unless the cached value
+ * keeps changing under our feet.
+ */
+static inline void
+tm_cached_get(tm_t *tm)
+{
+	uint i;
+
+	for (i = 0; i < TM_SEQ_RETRIES; i++) {
+		uint seq = tm_seq;
+
+		atomic_mb();
+		*tm = tm_cached_now;	/* Struct copy */
+		atomic_mb();
+
+		if G_LIKELY(0 == (seq & 1) && seq == tm_seq)
+			return;
+	}
+
+	TM_LOCK;
+	*tm = tm_cached_now;		/* Struct copy */
+	TM_UNLOCK;
+}
+
 /**
  * Set time debug level.
  */
@@ -430,9 +480,15 @@ tm_thread_main(void *unused_arg)
 
 		G_PREFETCH_HI_R(&tm_gmt.computed);
 
+		/*
+		 * We always update the cached time, even when it goes backwards,
+		 * so that clock adjustments are seen by tm_now_exact_raw().
+		 */
+
+		tm_current_time(&now);
+
 		TM_LOCK;
-		tm_current_time(&tm_cached_now);
-		now = tm_cached_now;
+		tm_cached_set(&now);
 		TM_UNLOCK;
 
 		if G_UNLIKELY(tm_updated(&prev, &now)) {
@@ -630,9 +686,7 @@ tm_now(tm_t *tm)
 	if G_UNLIKELY(thread_check_suspended()) {
 		tm_now_exact(tm);
 	} else {
-		TM_LOCK;
-		*tm = tm_cached_now;	/* Struct copy */
-		TM_UNLOCK;
+		tm_cached_get(tm);
 	}
 }
 
@@ -647,11 +701,24 @@ tm_now(tm_t *tm)
 void
 tm_now_exact_raw(tm_t *tm)
 {
+	tm_t now;
+
+	/*
+	 * Read the clock outside of the critical section, and only update
+	 * the cached time if it moves it forward: concurrent callers can
+	 * then not make the cached time go backwards.  Real clock adjustments
+	 * are propagated by the time thread.
+	 */
+
+	tm_current_time(&now);
+
 	TM_LOCK;
-	tm_current_time(&tm_cached_now);
-	if G_LIKELY(tm != NULL)
-		*tm = tm_cached_now;
+	if G_LIKELY(tm_cmp(&now, &tm_cached_now) > 0)
+		tm_cached_set(&now);
 	TM_UNLOCK;
+
+	if G_LIKELY(tm != NULL)
+		*tm = now;			/* Struct copy */
 }
 
 /**
@@ -662,6 +729,7 @@ tm_now_exact(tm_t *tm)
 {
 	G_PREFETCH_HI_W(&tm_slk);
 	G_PREFETCH_HI_W(&tm_cached_now);
+	G_PREFETCH_HI_W(&tm_seq);
 
 	thread_check_suspended();
 	tm_now_exact_raw(tm);
@@ -688,8 +756,10 @@ tm_now_raw(tm_t *tm)
 time_t
 tm_time_exact(void)
 {
-	tm_now_exact(NULL);
-	return (time_t) tm_cached_now.tv_sec;
+	tm_t now;
+
+	tm_now_exact(&now);
+	return (time_t) now.tv_sec;
 }
 
 /**
@@ -142,6 +142,11 @@
 
 #include "common.h"
 
+#ifdef HAS_SCHED_GETCPU
+#define _GNU_SOURCE			/* Needed on linux to get sched_getcpu() */
+#include <sched.h>
+#endif
+
 #include "tmalloc.h"
 
 #include "array_util.h"
@@ -151,10 +156,12 @@
 #include "entropy.h"
 #include "eslist.h"
 #include "evq.h"
+#include "getcpucount.h"
 #include "glib-missing.h"	/* For pslist_free_null() */
 #include "log.h"
 #include "omalloc.h"
 #include "once.h"
+#include "pow2.h"
 #include "pslist.h"
 #include "sha1.h"
 #include "spinlock.h"
@@ -227,6 +234,7 @@ struct tmalloc_stats {
 	AU64(tmas_threads);				/* Total amount of threads attached */
 	AU64(tmas_contentions);			/* Total amount of lock contentions */
 	AU64(tmas_preemptions);			/* Counts "concurrent" signal processing */
+	AU64(tmas_cpu_exchanges);		/* Magazines exchanged in CPU caches */
 	AU64(tmas_capacity_increased);	/* Increased magazine capacity */
 	AU64(tmas_object_trash_reused);	/* Amount of trahsed object reused */
 	AU64(tmas_empty_trash_reused);	/* Empty trahsed magazines reused */
@@ -255,6 +263,23 @@ struct tma_list {
 	size_t tml_max;				/* Maximum list count */
 };
 
+/**
+ * A per-CPU magazine cache.
+ *
+ * It sits between the thread layer and the depot, holding at most one full
+ * and one empty magazine.  Threads running on the same CPU exchange their
+ * magazines there first, which keeps recently freed objects close to
+ * the CPU (and memory node) that will reuse them and spares a trip to the
+ * shared depot lock.
+ */
+struct tmalloc_cpu {
+	spinlock_t tmc_lock;			/* Thread-safe lock */
+	struct tmalloc_magazine *tmc_full;	/* Cached full magazine, or NULL */
+	struct tmalloc_magazine *tmc_empty;	/* Cached empty magazine */
+};
+
+#define TMALLOC_CPU_MAX		64		/* Max CPU caches (power of 2) */
+
 enum tmalloc_magic { TMALLOC_MAGIC = 0x4aeecb45 };
 
 /**
@@ -284,6 +309,10 @@ struct tmalloc_depot {
 	cperiodic_t *tma_gc_ev;		/* Periodic garbage collector event */
 	spinlock_t tma_lock;		/* Thread-safe lock */
 
+	/* CPU layer */
+	struct tmalloc_cpu *tma_cpu;	/* Per-CPU caches, NULL if only 1 CPU */
+	uint tma_cpu_mask;				/* Mask to get cache index from CPU */
+
 	/* memory layer */
 	alloc_fn_t tma_alloc;		/* Memory allocation routine */
 	free_size_fn_t tma_free;	/* Memory free routine */
@@ -731,6 +760,106 @@ tmalloc_depot_unlock_hidden(tmalloc_t *d)
 	spinunlock_hidden(&d->tma_lock);
 }
 
+/**
+ * @return the CPU cache to use for the running thread, NULL if none.
+ */
+static inline struct tmalloc_cpu *
+tmalloc_cpu_cache(const tmalloc_t *d)
+{
+	uint cpu;
+
+	if (NULL == d->tma_cpu)
+		return NULL;
+
+	/*
+	 * Without knowing the CPU we run on, spread threads over the caches,
+	 * which at least relieves contention on the depot lock.
+	 */
+
+#ifdef HAS_SCHED_GETCPU
+	{
+		int c = sched_getcpu();
+		cpu = c >= 0 ? UNSIGNED(c) : thread_small_id();
+	}
+#else
+	cpu = thread_small_id();
+#endif
+
+	return &d->tma_cpu[cpu & d->tma_cpu_mask];
+}
+
+/**
+ * Give empty magazine to the CPU cache and get a full magazine from it.
+ *
+ * Magazines held in CPU caches are accounted as being used by threads.
+ *
+ * @param d		the depot owning the CPU caches
+ * @param mp	the empty magazine, reset to NULL if it was kept by the cache
+ *
+ * @return full magazine, or NULL if none were cached.
+ */
+static tmalloc_magazine_t *
+tmalloc_cpu_return_empty(tmalloc_t *d, tmalloc_magazine_t **mp)
+{
+	struct tmalloc_cpu *c = tmalloc_cpu_cache(d);
+	tmalloc_magazine_t *fm = NULL, *m = *mp;
+
+	if (NULL == c || NULL == m || m->tmag_capacity != d->tma_mag_capacity)
+		return NULL;
+
+	if G_UNLIKELY(!spinlock_hidden_try(&c->tmc_lock))
+		return NULL;		/* Someone else on that CPU, use the depot */
+
+	if (NULL == c->tmc_empty) {
+		c->tmc_empty = m;
+		*mp = NULL;
+		fm = c->tmc_full;
+		c->tmc_full = NULL;
+	}
+
+	spinunlock_hidden(&c->tmc_lock);
+
+	if (fm != NULL)
+		TMALLOC_STATS_INCX(d, cpu_exchanges);
+
+	return fm;
+}
+
+/**
+ * Give full magazine to the CPU cache and get an empty magazine from it.
+ *
+ * @param d		the depot owning the CPU caches
+ * @param mp	the full magazine, reset to NULL if it was kept by the cache
+ *
+ * @return empty magazine, or NULL if none were cached.
+ */
+static tmalloc_magazine_t *
+tmalloc_cpu_return_full(tmalloc_t *d, tmalloc_magazine_t **mp)
+{
+	struct tmalloc_cpu *c = tmalloc_cpu_cache(d);
+	tmalloc_magazine_t *em = NULL, *m = *mp;
+
+	if (NULL == c || NULL == m || m->tmag_capacity != d->tma_mag_capacity)
+		return NULL;
+
+	if G_UNLIKELY(!spinlock_hidden_try(&c->tmc_lock))
+		return NULL;		/* Someone else on that CPU, use the depot */
+
+	if (NULL == c->tmc_full) {
+		c->tmc_full = m;
+		*mp = NULL;
+		em = c->tmc_empty;
+		c->tmc_empty = NULL;
+	}
+
+	spinunlock_hidden(&c->tmc_lock);
+
+	if (em != NULL)
+		TMALLOC_STATS_INCX(d, cpu_exchanges);
+
+	return em;
+}
+
 /**
  * Give empty magazine back to the depot and get a new full magazine.
  *
@@ -747,6 +876,17 @@ tmalloc_depot_return_empty(tmalloc_t *d, tmalloc_magazine_t *m)
 
 	tmalloc_check(d);
 
+	/*
+	 * Try the CPU cache first.  If it kept our magazine but had nothing
+	 * to give back, we go to the depot as if we had no magazine.
+	 */
+
+	fm = tmalloc_cpu_return_empty(d, &m);
+	if (fm != NULL) {
+		TMALLOC_STATS_INCX(d, mag_full_loaded);
+		return fm;
+	}
+
 	tmalloc_depot_lock_hidden(d);
 
 	fm = eslist_shift(&d->tma_full.tml_list);	/* Full magazine (or NULL) */
@@ -835,6 +975,17 @@ tmalloc_depot_return_full(tmalloc_t *d, tmalloc_magazine_t *m)
 
 	tmalloc_check(d);
 
+	/*
+	 * Try the CPU cache first.  If it kept our magazine but had nothing
+	 * to give back, we go to the depot as if we had no magazine.
+	 */
+
+	em = tmalloc_cpu_return_full(d, &m);
+	if (em != NULL) {
+		TMALLOC_STATS_INCX(d, mag_empty_loaded);
+		return em;
+	}
+
 	tmalloc_depot_lock_hidden(d);
 
 	em = eslist_shift(&d->tma_empty.tml_list);	/* Empty magazine (or NULL) */
@@ -1902,6 +2053,23 @@ tmalloc_create(const char *name, size_t size,
 	tmalloc_list_init(&tma->tma_full);
 	tmalloc_list_init(&tma->tma_empty);
 
+	/*
+	 * With several CPUs, add a cache of magazines per CPU.
+	 */
+
+	{
+		long cpus = getcpucount();
+
+		if (cpus > 1) {
+			uint i, n = MIN(next_pow2(cpus), TMALLOC_CPU_MAX);
+
+			OMALLOC0_ARRAY(tma->tma_cpu, n);
+			for (i = 0; i < n; i++)
+				spinlock_init(&tma->tma_cpu[i].tmc_lock);
+			tma->tma_cpu_mask = n - 1;
+		}
+	}
+
 	tmalloc_vars_add(tma);
 
 	/*
@@ -2047,6 +2215,33 @@ tmalloc_reset(tmalloc_t *tma)
 	tmalloc_list_free(&full, tma);
 	tmalloc_list_free(&empty, tma);
 
+	/*
+	 * Clear the CPU caches.
+	 */
+
+	if (tma->tma_cpu != NULL) {
+		uint i;
+
+		for (i = 0; i <= tma->tma_cpu_mask; i++) {
+			struct tmalloc_cpu *c = &tma->tma_cpu[i];
+			tmalloc_magazine_t *m[2];
+			uint j;
+
+			spinlock_hidden(&c->tmc_lock);
+			m[0] = c->tmc_full;
+			m[1] = c->tmc_empty;
+			c->tmc_full = c->tmc_empty = NULL;
+			spinunlock_hidden(&c->tmc_lock);
+
+			for (j = 0; j < N_ITEMS(m); j++) {
+				if (m[j] != NULL) {
+					atomic_int_dec(&tma->tma_magazines);
+					tmalloc_magazine_free(tma, m[j]);
+				}
+			}
+		}
+	}
+
 	/*
 	 * We cannot safely access the two magazines from other threads, but we
 	 * can at least clear the two ones in the current thread.
@@ -2984,6 +3179,7 @@ tmalloc_all_stats(tmalloc_info_t *stats)
 		STATS_COPY(smart_drop_full_mag);
 		STATS_COPY(contentions);
 		STATS_COPY(preemptions);
+		STATS_COPY(cpu_exchanges);
 		STATS_COPY(object_trash_reused);
 		STATS_COPY(empty_trash_reused);
 		STATS_COPY(capacity_increased);
@@ -3060,6 +3256,7 @@ tmalloc_dump_stats_log(logagent_t *la, unsigned options)
 	DUMP(smart_drop_full_mag);
 	DUMP(contentions);
 	DUMP(preemptions);
+	DUMP(cpu_exchanges);
 	DUMPV(depot_count);
 	DUMP(magazines);
 	DUMP(object_trash_reused);
@@ -3112,6 +3309,7 @@ tmalloc_info_dump(void *data, void *udata)
 	DUMPS(magazines);
 	DUMPL(contentions);
 	DUMPL(preemptions);
+	DUMPL(cpu_exchanges);
 	DUMPL(allocations);
 	DUMPL(allocations_zeroed);
 	DUMPL(depot_allocations);
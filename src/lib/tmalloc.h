@@ -80,6 +80,7 @@ typedef struct {
 	uint64 threads;					/**< Total amount of threads attached */
 	uint64 contentions;				/**< Total amount of lock contentions */
 	uint64 preemptions;				/**< Signal handler preemptions seen */
+	uint64 cpu_exchanges;			/**< Magazines exchanged in CPU caches */
 	uint64 object_trash_reused;		/**< Amount of trashed objects reused */
 	uint64 empty_trash_reused;		/**< Empty trashed magazines reused */
 	uint64 capacity_increased;		/**< Magazine capacity increases */
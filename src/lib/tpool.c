@@ -0,0 +1,556 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Work-stealing thread pool.
+ *
+ * This is a general executor for background jobs, which can be posted from
+ * any thread, directly or through the TEQ and EVQ layers.  It saves each
+ * subsystem from creating its own dedicated thread, and lets all the jobs
+ * share the available CPUs.
+ *
+ * The pool is created on first use, with as many worker threads as there
+ * are CPUs.  Each worker has its own job queue: a job posted by a worker
+ * is appended to its own queue, jobs posted by other threads are spread
+ * over the workers in a round-robin fashion.
+ *
+ * A worker takes the most recent job from its own queue, since that one is
+ * the most likely to find its data still in the CPU caches.  When its queue
+ * is empty, it steals the oldest job from the queue of the other workers,
+ * hence the ones which are the less likely to be processed soon.  Each queue
+ * has its own lock, so workers only contend when stealing.  When there is
+ * nothing left to steal, the worker goes to sleep until a new job is posted.
+ *
+ * Jobs can request an acknowledgment once they are processed, which is
+ * delivered according to the TEQ acknowledgment modes.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "tpool.h"
+
+#include "atomic.h"
+#include "cond.h"
+#include "cq.h"
+#include "elist.h"
+#include "getcpucount.h"
+#include "log.h"
+#include "mutex.h"
+#include "once.h"
+#include "random.h"
+#include "spinlock.h"
+#include "str.h"
+#include "thread.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define TPOOL_WORKERS_MAX	(THREAD_MAX / 4)	/* Leave room for other threads */
+#define TPOOL_STACK_SIZE	THREAD_STACK_DFLT
+
+enum tpool_job_magic { TPOOL_JOB_MAGIC = 0x3cb1e4d7 };
+
+/**
+ * A job posted to the thread pool.
+ */
+struct tpool_job {
+	enum tpool_job_magic magic;	/**< Magic number */
+	notify_fn_t routine;		/**< The routine to invoke */
+	void *data;					/**< Routine argument */
+	notify_fn_t ack;			/**< Optional acknowledgment routine */
+	void *ack_data;				/**< Acknowledgment argument */
+	teq_ackmode_t mode;			/**< Acknowledgment mode */
+	uint id;					/**< Posting thread, only for TEQ_AM_EVENT */
+	link_t lk;					/**< Links jobs in worker queue */
+};
+
+static inline void
+tpool_job_check(const struct tpool_job * const j)
+{
+	g_assert(j != NULL);
+	g_assert(TPOOL_JOB_MAGIC == j->magic);
+}
+
+/**
+ * A worker thread.
+ */
+struct tpool_worker {
+	elist_t jobs;				/**< Pending jobs, most recent last */
+	spinlock_t lock;			/**< Thread-safe access to job queue */
+	uint idx;					/**< Index in the worker array */
+	int stid;					/**< Thread small ID */
+};
+
+/**
+ * The thread pool.
+ */
+static struct tpool {
+	struct tpool_worker workers[TPOOL_WORKERS_MAX];
+	uint count;					/**< Amount of workers launched */
+	uint next;					/**< Next worker for foreign posts */
+	uint pending;				/**< Jobs in the worker queues */
+	uint idle;					/**< Amount of sleeping workers */
+	bool closing;				/**< Set when shutdowning */
+	mutex_t lock;				/**< To sleep and wake up workers */
+	cond_t wakeup;				/**< Signaled when jobs are posted */
+} tpool;
+
+static once_flag_t tpool_inited;
+
+/*
+ * Maps thread small IDs to workers, NULL for threads outside the pool.
+ */
+static struct tpool_worker *tpool_worker_by_id[THREAD_MAX];
+
+/**
+ * @return the worker structure of the current thread, NULL if not a worker.
+ */
+static inline struct tpool_worker *
+tpool_self(void)
+{
+	return tpool_worker_by_id[thread_small_id()];
+}
+
+/**
+ * @return whether current thread is a thread pool worker.
+ */
+bool
+tpool_is_worker(void)
+{
+	return NULL != tpool_self();
+}
+
+/**
+ * @return amount of worker threads in the pool.
+ */
+uint
+tpool_workers(void)
+{
+	return atomic_uint_get(&tpool.count);
+}
+
+/**
+ * @return amount of jobs waiting for a worker.
+ */
+size_t
+tpool_pending(void)
+{
+	return atomic_uint_get(&tpool.pending);
+}
+
+struct tpool_cq_info {
+	notify_fn_t event;
+	void *data;
+};
+
+/**
+ * Callout queue trampoline to deliver acknowledgments.
+ */
+static void
+tpool_cq_trampoline(cqueue_t *unused_cq, void *udata)
+{
+	struct tpool_cq_info *ci = udata;
+
+	(void) unused_cq;
+
+	(*ci->event)(ci->data);
+	WFREE(ci);
+}
+
+/**
+ * Run job and free it.
+ */
+static void
+tpool_job_run(struct tpool_job *j)
+{
+	tpool_job_check(j);
+
+	(*j->routine)(j->data);
+
+	if (j->ack != NULL) {
+		switch (j->mode) {
+		case TEQ_AM_CALL:		/* Direct call from worker */
+			(*j->ack)(j->ack_data);
+			break;
+		case TEQ_AM_EVENT:		/* Post event to posting thread */
+			teq_post(j->id, j->ack, j->ack_data);
+			break;
+		case TEQ_AM_CALLOUT:	/* Invoke via main callout queue */
+			{
+				struct tpool_cq_info *ci;
+
+				WALLOC(ci);
+				ci->event = j->ack;
+				ci->data = j->ack_data;
+				cq_main_insert(1, tpool_cq_trampoline, ci);
+			}
+			break;
+		}
+	}
+
+	j->magic = 0;
+	WFREE(j);
+}
+
+/**
+ * Take the most recent job from our own queue.
+ */
+static struct tpool_job *
+tpool_take_own(struct tpool_worker *w)
+{
+	struct tpool_job *j;
+
+	if (0 == elist_count(&w->jobs))
+		return NULL;
+
+	spinlock(&w->lock);
+	j = elist_pop(&w->jobs);
+	spinunlock(&w->lock);
+
+	return j;
+}
+
+/**
+ * Steal the oldest job from the queue of another worker.
+ */
+static struct tpool_job *
+tpool_steal(const struct tpool_worker *w)
+{
+	uint i, n = atomic_uint_get(&tpool.count);
+	uint start = random_value(n - 1);
+
+	for (i = 0; i < n; i++) {
+		struct tpool_worker *v = &tpool.workers[(start + i) % n];
+		struct tpool_job *j;
+
+		if (v == w || 0 == elist_count(&v->jobs))
+			continue;
+
+		/*
+		 * Do not wait for a busy queue, another will do.
+		 */
+
+		if (!spinlock_try(&v->lock))
+			continue;
+
+		j = elist_shift(&v->jobs);
+		spinunlock(&v->lock);
+
+		if (j != NULL)
+			return j;
+	}
+
+	return NULL;
+}
+
+/**
+ * Wait until there are pending jobs.
+ *
+ * @return FALSE if the worker should exit.
+ */
+static bool
+tpool_wait(void)
+{
+	bool closing;
+
+	mutex_lock(&tpool.lock);
+
+	/*
+	 * Since posting threads first increase the pending count and then check
+	 * for idle workers, whilst we do the reverse here, a job cannot be
+	 * posted without either us seeing it or the poster waking us up.
+	 */
+
+	atomic_uint_inc(&tpool.idle);
+
+	if (
+		0 == atomic_uint_get(&tpool.pending) &&
+		!atomic_bool_get(&tpool.closing)
+	)
+		cond_wait(&tpool.wakeup, &tpool.lock);
+
+	atomic_uint_dec(&tpool.idle);
+	closing = atomic_bool_get(&tpool.closing);
+
+	mutex_unlock(&tpool.lock);
+
+	return !closing || 0 != atomic_uint_get(&tpool.pending);
+}
+
+/**
+ * Worker thread.
+ */
+static void *
+tpool_worker_main(void *arg)
+{
+	struct tpool_worker *w = arg;
+
+	thread_set_name_atom(str_smsg("thread pool #%u", w->idx));
+	tpool_worker_by_id[thread_small_id()] = w;
+
+	for (;;) {
+		struct tpool_job *j = tpool_take_own(w);
+
+		if (NULL == j)
+			j = tpool_steal(w);
+
+		if (j != NULL) {
+			atomic_uint_dec(&tpool.pending);
+			tpool_job_run(j);
+			continue;
+		}
+
+		/*
+		 * If there are pending jobs we could not get, they are being taken
+		 * by other workers or their queue was busy: try again.
+		 */
+
+		if (0 != atomic_uint_get(&tpool.pending)) {
+			thread_yield();
+			continue;
+		}
+
+		if (!tpool_wait())
+			break;
+	}
+
+	tpool_worker_by_id[thread_small_id()] = NULL;
+	return NULL;
+}
+
+/**
+ * Launch the worker threads.
+ */
+static void
+tpool_init_once(void)
+{
+	long cpus = getcpucount();
+	uint i, n;
+
+	n = MAX(1, MIN(cpus, TPOOL_WORKERS_MAX));
+
+	mutex_init(&tpool.lock);
+	cond_init(&tpool.wakeup, &tpool.lock);
+
+	for (i = 0; i < n; i++) {
+		struct tpool_worker *w = &tpool.workers[i];
+
+		elist_init(&w->jobs, offsetof(struct tpool_job, lk));
+		spinlock_init(&w->lock);
+		w->idx = i;
+	}
+
+	/*
+	 * The worker count is published before the threads are launched, since
+	 * they will start stealing from each other immediately.  If we cannot
+	 * create as many threads as planned, we shrink the pool accordingly:
+	 * no jobs were posted yet.
+	 */
+
+	tpool.count = n;
+
+	for (i = 0; i < n; i++) {
+		struct tpool_worker *w = &tpool.workers[i];
+
+		w->stid = thread_create(tpool_worker_main, w,
+			THREAD_F_NO_CANCEL | THREAD_F_WARN, TPOOL_STACK_SIZE);
+
+		if (-1 == w->stid)
+			break;
+	}
+
+	atomic_uint_set(&tpool.count, i);
+
+	if (0 == i)
+		s_warning("%s(): no worker thread, jobs will run synchronously",
+			G_STRFUNC);
+}
+
+/**
+ * Enqueue new job.
+ */
+static void
+tpool_put(struct tpool_job *j)
+{
+	struct tpool_worker *w;
+
+	ONCE_FLAG_RUN(tpool_inited, tpool_init_once);
+
+	/*
+	 * Without any worker, or if we are shutdowning, run the job now.
+	 */
+
+	if G_UNLIKELY(
+		0 == atomic_uint_get(&tpool.count) || atomic_bool_get(&tpool.closing)
+	) {
+		tpool_job_run(j);
+		return;
+	}
+
+	w = tpool_self();
+
+	if (NULL == w) {
+		uint n = atomic_uint_inc(&tpool.next);
+		w = &tpool.workers[n % atomic_uint_get(&tpool.count)];
+	}
+
+	spinlock(&w->lock);
+	elist_append(&w->jobs, j);
+	spinunlock(&w->lock);
+
+	atomic_uint_inc(&tpool.pending);	/* Full memory barrier */
+
+	if (0 != atomic_uint_get(&tpool.idle)) {
+		mutex_lock(&tpool.lock);
+		cond_signal(&tpool.wakeup, &tpool.lock);
+		mutex_unlock(&tpool.lock);
+	}
+}
+
+/**
+ * Allocate a new job.
+ */
+static struct tpool_job *
+tpool_job_alloc(notify_fn_t routine, void *data)
+{
+	struct tpool_job *j;
+
+	g_assert(routine != NULL);
+
+	WALLOC0(j);
+	j->magic = TPOOL_JOB_MAGIC;
+	j->routine = routine;
+	j->data = data;
+
+	return j;
+}
+
+/**
+ * Post a job to the thread pool.
+ *
+ * The routine will be invoked from one of the worker threads, hence it
+ * must be thread-safe.  Jobs are not necessarily processed in the order
+ * they were posted.
+ *
+ * @param routine	the routine to invoke
+ * @param data		the context to pass to the routine
+ */
+void
+tpool_post(notify_fn_t routine, void *data)
+{
+	tpool_put(tpool_job_alloc(routine, data));
+}
+
+/**
+ * Post a job to the thread pool, requesting an acknowledgment once the job
+ * has been processed.
+ *
+ * The acknowledgment modes are the ones used by teq_post_ack(): TEQ_AM_CALL
+ * invokes the callback directly from the worker thread, TEQ_AM_EVENT posts
+ * it to the TEQ of the calling thread, which must have one, and
+ * TEQ_AM_CALLOUT invokes it through the main callout queue.
+ *
+ * @param routine	the routine to invoke
+ * @param data		the context to pass to the routine
+ * @param mode		the acknowledgment mode
+ * @param ack		the acknowledgment routine to invoke
+ * @param ack_data	the context to pass to the acknowledgment routine
+ */
+void
+tpool_post_ack(notify_fn_t routine, void *data,
+	teq_ackmode_t mode, notify_fn_t ack, void *ack_data)
+{
+	struct tpool_job *j;
+
+	g_assert(ack != NULL);
+
+	j = tpool_job_alloc(routine, data);
+	j->ack = ack;
+	j->ack_data = ack_data;
+	j->mode = mode;
+
+	if (TEQ_AM_EVENT == mode) {
+		uint id = thread_small_id();
+
+		if (!teq_is_supported(id)) {
+			s_error("%s(): no thread event queue for calling thread %s",
+				G_STRFUNC, thread_id_name(id));
+		}
+
+		j->id = id;
+	}
+
+	tpool_put(j);
+}
+
+/**
+ * Shutdown the thread pool, waiting for all the pending jobs to be processed.
+ *
+ * Jobs posted afterwards are run synchronously by the posting thread.
+ */
+void
+tpool_close(void)
+{
+	uint i, n;
+
+	if (!ONCE_DONE(tpool_inited))
+		return;
+
+	mutex_lock(&tpool.lock);
+	atomic_bool_set(&tpool.closing, TRUE);
+	cond_broadcast(&tpool.wakeup, &tpool.lock);
+	mutex_unlock(&tpool.lock);
+
+	n = atomic_uint_get(&tpool.count);
+
+	for (i = 0; i < n; i++) {
+		struct tpool_worker *w = &tpool.workers[i];
+
+		if (-1 != w->stid && 0 != thread_join(w->stid, NULL)) {
+			s_warning("%s(): cannot join with %s: %m",
+				G_STRFUNC, thread_id_name(w->stid));
+		}
+	}
+
+	/*
+	 * Jobs posted whilst the workers were exiting are run synchronously.
+	 */
+
+	for (i = 0; i < n; i++) {
+		struct tpool_worker *w = &tpool.workers[i];
+		struct tpool_job *j;
+
+		while (NULL != (j = tpool_take_own(w))) {
+			atomic_uint_dec(&tpool.pending);
+			tpool_job_run(j);
+		}
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
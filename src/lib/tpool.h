@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Work-stealing thread pool.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _tpool_h_
+#define _tpool_h_
+
+#include "teq.h"		/* For teq_ackmode_t */
+
+/*
+ * Public interface.
+ */
+
+void tpool_post(notify_fn_t routine, void *data);
+void tpool_post_ack(notify_fn_t routine, void *data,
+	teq_ackmode_t mode, notify_fn_t ack, void *ack_data);
+
+bool tpool_is_worker(void);
+uint tpool_workers(void);
+size_t tpool_pending(void);
+void tpool_close(void);
+
+#endif /* _tpool_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -5673,6 +5673,43 @@ utf32_canonize(const uint32 *src0)
 	return dst;
 }
 
+/**
+ * Canonize a pure ASCII string of `len' bytes into `dst'.
+ *
+ * For ASCII, composition, decomposition and block splitting are identities
+ * and case folding is plain lowercasing, so this yields exactly what
+ * utf32_canonize() would, without any UTF-32 round-trip: it mirrors what
+ * utf32_filter_char() does on the Basic Latin block.
+ *
+ * @param src	the NUL-terminated ASCII string
+ * @param len	the length of `src'
+ * @param dst	where the result is written, must hold at least len + 1 bytes
+ */
+static void
+utf8_canonize_ascii(const char *src, size_t len, char *dst)
+{
+	const char *s = src, *end = &src[len];
+	char *p = dst;
+	bool space = TRUE;		/* prevent adding leading space */
+
+	while (s != end) {
+		int c = ascii_tolower(*s++);
+
+		if (is_ascii_alnum(c)) {
+			*p++ = c;
+			space = FALSE;
+		} else if (is_ascii_cntrl(c)) {
+			if ('\n' == c)
+				*p++ = c;
+		} else {
+			if (!space && s != end)
+				*p++ = ' ';
+			space = TRUE;
+		}
+	}
+	*p = '\0';
+}
+
 /**
  * Apply the NFKD/NFC algo to have nomalized keywords (string is halloc()-ed)
  */
@@ -5681,6 +5718,19 @@ utf8_canonize(const char *src)
 {
 	uint32 *dst32;
 
+	/*
+	 * Most queries and filenames are plain ASCII, for which canonization
+	 * boils down to lowercasing and collapsing separators.
+	 */
+
+	if (is_ascii_string(src)) {
+		size_t len = vstrlen(src);
+		char *dst = halloc(len + 1);
+
+		utf8_canonize_ascii(src, len, dst);
+		return dst;
+	}
+
 	g_assert(utf8_is_valid_string(src));
 
 	{
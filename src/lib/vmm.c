@@ -118,6 +118,7 @@
 #include "evq.h"
 #include "fd.h"
 #include "log.h"
+#include "mempress.h"
 #include "memusage.h"
 #include "mutex.h"
 #include "omalloc.h"
@@ -313,6 +314,7 @@ static struct vmm_stats {
 	uint64 magazine_freeings_frag;	/**< Magazine regions that were fragments */
 	uint64 hints_followed;			/**< Allocations following hints */
 	uint64 hints_ignored;			/**< Allocations ignoring non-NULL hints */
+	AU64(hugepage_advised);			/**< Long-term mappings advised for THP */
 	uint64 alloc_from_cache;		/**< Allocation from cache */
 	uint64 alloc_from_cache_pages;	/**< Pages allocated from cache */
 	uint64 alloc_direct_core;		/**< Allocation done through core */
@@ -1601,6 +1603,21 @@ vmm_mmap_anonymous(size_t size, const void *hole)
 		VMM_STATS_UNLOCK;
 	}
 done:
+	/*
+	 * Under the long-term strategy, memory is not going to be released
+	 * quickly so have the kernel back it with transparent huge pages.
+	 *
+	 * Since we attempt to allocate contiguously through hinting, all the
+	 * advised mappings end-up carrying identical flags and get merged by
+	 * the kernel into larger areas, which khugepaged can then collapse
+	 * into huge pages, reducing TLB pressure for a large heap.
+	 */
+
+	if (p != NULL && VMM_STRATEGY_LONG_TERM == vmm_strategy) {
+		if (vmm_madvise_hugepage(p, size))
+			VMM_STATS_INCX(hugepage_advised);
+	}
+
 	return p;
 }
 #else	/* !HAS_MMAP */
@@ -4476,6 +4493,16 @@ vmm_madvise_sequential(void *p, size_t size)
 #endif	/* MADV_SEQUENTIAL */
 }
 
+void
+vmm_madvise_random(void *p, size_t size)
+{
+	g_assert(p);
+	g_assert(size_is_positive(size));
+#if defined(HAS_MADVISE) && defined(MADV_RANDOM)
+	madvise(p, size, MADV_RANDOM);
+#endif	/* MADV_RANDOM */
+}
+
 void
 vmm_madvise_free(void *p, size_t size)
 {
@@ -4498,6 +4525,39 @@ vmm_madvise_willneed(void *p, size_t size)
 #endif	/* MADV_WILLNEED */
 }
 
+/**
+ * Advise kernel that region should be backed by transparent huge pages.
+ *
+ * @return TRUE if the advice was given successfully.
+ */
+bool
+vmm_madvise_hugepage(void *p, size_t size)
+{
+	g_assert(p);
+	g_assert(size_is_positive(size));
+#if defined(HAS_MADVISE) && defined(MADV_HUGEPAGE)
+	{
+		static bool unsupported;
+
+		if G_UNLIKELY(unsupported)
+			return FALSE;
+
+		if (0 == madvise(p, size, MADV_HUGEPAGE))
+			return TRUE;
+
+		/*
+		 * EINVAL means the kernel was built without THP support, so there
+		 * is no need to try again.
+		 */
+
+		if (EINVAL == errno)
+			unsupported = TRUE;
+	}
+#endif	/* MADV_HUGEPAGE */
+
+	return FALSE;
+}
+
 /**
  * Perform memory allocation during crashes.
  *
@@ -4812,8 +4872,14 @@ vmm_should_cache(const void *p, size_t n)
 	 *
 	 * Cache everything, breaking up larger regions.  When the largest
 	 * line is full, we'll start evicting memory of course.
+	 *
+	 * Under memory pressure, we give memory back to the kernel instead,
+	 * unless we are already facing an OOM condition.
 	 */
 
+	if G_UNLIKELY(mempress_level() >= MEMPRESS_HIGH && !vmm_oom_detected)
+		return FALSE;
+
 	if (VMM_STRATEGY_SHORT_TERM == vmm_strategy) {
 		return TRUE;
 	} else {
@@ -5639,6 +5705,46 @@ page_cache_free_all(bool locked)
 	}
 }
 
+/**
+ * Memory pressure callback: amount of memory held in the page cache.
+ */
+static size_t
+page_cache_usage(void *unused_data)
+{
+	size_t i, total = 0;
+
+	(void) unused_data;
+
+	for (i = 0; i < N_ITEMS(page_cache); i++) {
+		const struct page_cache *pc = &page_cache[i];
+
+		total += pc->current * pc->chunksize;	/* Unlocked, approximate */
+	}
+
+	return total;
+}
+
+/**
+ * Memory pressure callback: release the whole page cache.
+ */
+static size_t
+page_cache_shrink(void *unused_data, size_t unused_amount,
+	mempress_level_t level)
+{
+	size_t held;
+
+	(void) unused_data;
+	(void) unused_amount;
+
+	if (MEMPRESS_NONE == level)
+		return 0;
+
+	held = page_cache_usage(NULL);
+	page_cache_free_all(FALSE);
+
+	return held;
+}
+
 /**
  * Get a protected region bearing a non-NULL address.
  *
@@ -5889,6 +5995,7 @@ vmm_dump_stats_log(logagent_t *la, unsigned options)
 	DUMP(magazine_freeings_frag);
 	DUMP(hints_followed);
 	DUMP(hints_ignored);
+	DUMP64(hugepage_advised);
 	DUMP(alloc_from_cache);
 	DUMP(alloc_from_cache_pages);
 	DUMP(alloc_direct_core);
@@ -6189,6 +6296,8 @@ vmm_post_init(void)
 	} settings = { FALSE, FALSE, FALSE };
 
 	crash_hook_add(_WHERE_, vmm_crash_hook);
+	mempress_register("VMM page cache", MEMPRESS_COST_FREE,
+		page_cache_usage, page_cache_shrink, NULL);
 
 	/*
 	 * Log VMM configuration.
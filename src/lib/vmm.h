@@ -165,7 +165,9 @@ struct sha1;
 void vmm_stats_digest(struct sha1 *digest);
 
 void vmm_madvise_free(void *p, size_t size);
+bool vmm_madvise_hugepage(void *p, size_t size);
 void vmm_madvise_normal(void *p, size_t size);
+void vmm_madvise_random(void *p, size_t size);
 void vmm_madvise_sequential(void *p, size_t size);
 void vmm_madvise_willneed(void *p, size_t size);
 
@@ -44,6 +44,15 @@
  * default sorting routine is set to our xqsort(), which is a reasonably fast
  * quicksort implementation with no memory allocation.
  *
+ * Beyond random data, the general case is also benchmarked on reversed arrays
+ * and arrays with many duplicates, and the almost-sorted case on already
+ * sorted arrays, since these inputs are frequent in practice and are the
+ * ones where the various algorithms differ the most.
+ *
+ * When vsort_cache() is called before vsort_init(), the selection made is
+ * saved to the given directory and reused at the next startups, as long
+ * as it is not too old and the machine did not change.
+ *
  * @author Raphael Manfredi
  * @date 2012
  */
@@ -56,14 +65,22 @@
 
 #include "vsort.h"
 
+#include "file.h"
+#include "getcpucount.h"
+#include "halloc.h"
 #include "log.h"
 #include "op.h"
+#include "parse.h"
+#include "path.h"
 #include "random.h"
 #include "smsort.h"
+#include "strtok.h"
+#include "timestamp.h"
 #include "tm.h"
 #include "tqsort.h"
 #include "unsigned.h"
 #include "vmm.h"
+#include "xpsort.h"
 #include "xsort.h"
 
 #include "override.h"			/* Must be the last header included */
@@ -74,6 +91,10 @@
 #define VSORT_SMALL_ITEMS	128		/* Upper limit for small arrays */
 #define VSORT_HUGE_ITEMS	TQSORT_ITEMS	/* Huge item amount */
 #define VSORT_MIN_SECS		0.01	/* Lowest CPU time we want to spend */
+#define VSORT_DUP_VALUES	16		/* Distinct values in duplicate tests */
+
+#define VSORT_CACHE_FILE	"vsort.cache"
+#define VSORT_CACHE_MAXAGE	(30 * 86400)	/* Re-benchmark monthly */
 
 struct vsort_timing {
 	void *data;				/* The data to sort */
@@ -99,6 +120,22 @@ static struct {
 	{ tqsort, xqsort },		/* Default if they do not call vsort_init() */
 };
 
+static const char *vsort_class[] = { "small", "large", "huge" };
+
+static const struct {
+	const char *name;
+	vsort_t routine;
+} vsort_routines[] = {
+	{ "qsort",	qsort },
+	{ "xqsort",	xqsort },
+	{ "xsort",	xsort },
+	{ "xpsort",	xpsort },
+	{ "tqsort",	tqsort },
+	{ "smsort",	smsort },
+};
+
+static char *vsort_cache_path;		/* Cached benchmark results */
+
 static int
 vsort_long_cmp(const void *a, const void *b)
 {
@@ -140,6 +177,17 @@ vsort_xqsort(struct vsort_timing *vt, size_t loops)
 	}
 }
 
+static void
+vsort_xpsort(struct vsort_timing *vt, size_t loops)
+{
+	size_t n = loops;
+
+	while (n-- > 0) {
+		memcpy(vt->copy, vt->data, vt->len);
+		xpsort(vt->copy, vt->items, vt->isize, vsort_long_cmp);
+	}
+}
+
 static void
 vsort_tqsort(struct vsort_timing *vt, size_t loops)
 {
@@ -223,8 +271,8 @@ retry:
 	 * middle of the test, that would completely taint the results.
 	 *
 	 * However, in multi-threaded processes, the accounted CPU time is for
-	 * the whole process, and this is not fair for tqsort() which uses multiple
-	 * threads in order to minimize the overall elapsed time.
+	 * the whole process, and this is not fair for tqsort() or xpsort() which
+	 * use multiple threads in order to minimize the overall elapsed time.
 	 *
 	 * Hence we measure both the CPU time and the wall-clock time and pick
 	 * the lowest figure.
@@ -292,6 +340,36 @@ vsort_almost(void *b, size_t n, size_t s, cmp_fn_t cmp)
 	(*f)(b, n, s, cmp);
 }
 
+/**
+ * Fill array with items in descending order.
+ */
+static void
+vsort_fill_reversed(struct vsort_timing *vt)
+{
+	long *p = vt->data;
+	size_t i;
+
+	g_assert(sizeof(long) == vt->isize);
+
+	for (i = 0; i < vt->items; i++)
+		p[i] = vt->items - i;
+}
+
+/**
+ * Fill array with random items taken among few distinct values.
+ */
+static void
+vsort_fill_duplicates(struct vsort_timing *vt)
+{
+	long *p = vt->data;
+	size_t i;
+
+	g_assert(sizeof(long) == vt->isize);
+
+	for (i = 0; i < vt->items; i++)
+		p[i] = random_value(VSORT_DUP_VALUES - 1);
+}
+
 /**
  * Randomly swap 1/128 of the array items.
  */
@@ -339,7 +417,7 @@ vsort_testing_cmp(const void *a, const void *b)
 /*
  * Always substitute xqsort() for tqsort() if handling less than
  * TQSORT_ITEMS at a time since tqsort() will always remap to xqsort()
- * in that case.
+ * in that case.  Likewise, xpsort() remaps to xsort() below XPSORT_ITEMS.
  */
 static vsort_t
 vsort_routine(const vsort_t routine, size_t items)
@@ -347,6 +425,9 @@ vsort_routine(const vsort_t routine, size_t items)
 	if (items < TQSORT_ITEMS && routine == tqsort)
 		return xqsort;
 
+	if (items < XPSORT_ITEMS && routine == xpsort)
+		return xsort;
+
 	return routine;
 }
 
@@ -356,14 +437,206 @@ vsort_routine_name(const char *name, size_t items)
 	if (items < TQSORT_ITEMS && 0 == strcmp(name, "tqsort"))
 		return "xqsort";
 
+	if (items < XPSORT_ITEMS && 0 == strcmp(name, "xpsort"))
+		return "xsort";
+
 	return name;
 }
 
 /**
- * Check which of qsort(), xqsort(), xsort() or smsort() is best for sorting
- * aligned arrays with a native item size of OPSIZ.  At identical performance
- * level, we prefer our own sorting algorithms instead of libc's qsort() for
- * memory allocation purposes.
+ * Time all the tests on the current data, adding to their elapsed time.
+ *
+ * Since timings are per iteration, a change in the amount of loops does
+ * not require restarting the tests.
+ *
+ * @param tests		the tests to run
+ * @param count		amount of tests to run
+ * @param vt		the data to sort
+ * @param loops		amount of loops to perform, possibly updated (increased)
+ * @param what		the kind of data, for logging
+ * @param which		the array size class, for logging
+ * @param verbose	whether to be verbose
+ */
+static void
+vsort_time_all(struct vsort_testing *tests, size_t count,
+	struct vsort_timing *vt, size_t *loops,
+	const char *what, const char *which, int verbose)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		double elapsed = vsort_timeit(tests[i].v_timer, vt, loops);
+
+		tests[i].v_elapsed += elapsed;
+
+		if (verbose > 1) {
+			s_debug("%s() on %s took %.4f secs for %s array (%zu loops)",
+				tests[i].v_name, what, elapsed * *loops, which, *loops);
+		}
+	}
+}
+
+/**
+ * Get the sorting routine bearing the given name.
+ *
+ * @return the routine, NULL if not found.
+ */
+static vsort_t
+vsort_routine_by_name(const char *name)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(vsort_routines); i++) {
+		if (0 == strcmp(name, vsort_routines[i].name))
+			return vsort_routines[i].routine;
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the name of a sorting routine.
+ */
+static const char *
+vsort_routine_to_name(const vsort_t routine)
+{
+	uint i;
+
+	for (i = 0; i < N_ITEMS(vsort_routines); i++) {
+		if (routine == vsort_routines[i].routine)
+			return vsort_routines[i].name;
+	}
+
+	g_assert_not_reached();
+	return NULL;
+}
+
+/**
+ * Load the cached benchmark results, if still valid.
+ *
+ * @return TRUE if the sorting routines were all loaded from the cache.
+ */
+static bool
+vsort_cache_load(int verbose)
+{
+	FILE *f;
+	char line[128];
+	uint loaded = 0;
+	bool valid = TRUE;
+
+	if (NULL == vsort_cache_path)
+		return FALSE;
+
+	f = fopen(vsort_cache_path, "r");
+	if (NULL == f)
+		return FALSE;
+
+	while (valid && fgets(ARYLEN(line), f)) {
+		strtok_t *st;
+		const char *key, *v;
+		vsort_t general = NULL, almost = NULL;
+		uint i;
+		int error;
+
+		if ('#' == line[0] || '\n' == line[0])
+			continue;
+
+		st = strtok_make_strip(line);
+		key = strtok_next(st, " \t\n");
+		v = strtok_next(st, " \t\n");
+
+		if (NULL == key || NULL == v) {
+			valid = FALSE;
+		} else if (0 == strcmp(key, "cpus")) {
+			valid = getcpucount() == (long) parse_ulong(v, NULL, 10, &error)
+				&& 0 == error;
+		} else if (0 == strcmp(key, "opsiz")) {
+			valid = OPSIZ == parse_size(v, NULL, 10, &error) && 0 == error;
+		} else if (0 == strcmp(key, "stamp")) {
+			time_t stamp = parse_uint64(v, NULL, 10, &error);
+			valid = 0 == error &&
+				delta_time(tm_time(), stamp) < VSORT_CACHE_MAXAGE;
+		} else {
+			general = vsort_routine_by_name(v);
+			v = strtok_next(st, " \t\n");
+			almost = NULL == v ? NULL : vsort_routine_by_name(v);
+			valid = FALSE;
+
+			for (i = 0; i < N_ITEMS(vsort_class); i++) {
+				if (0 == strcmp(key, vsort_class[i])) {
+					valid = general != NULL && almost != NULL;
+					break;
+				}
+			}
+
+			if (valid) {
+				vsort_table[i].v_sort = general;
+				vsort_table[i].v_sort_almost = almost;
+				loaded |= 1U << i;
+			}
+		}
+
+		strtok_free_null(&st);
+	}
+
+	fclose(f);
+
+	valid = valid && loaded == (1U << N_ITEMS(vsort_class)) - 1;
+
+	if (valid && verbose) {
+		s_info("vsort() using cached benchmark results from %s",
+			vsort_cache_path);
+	}
+
+	return valid;
+}
+
+/**
+ * Save the benchmark results to the cache.
+ */
+static void
+vsort_cache_save(void)
+{
+	FILE *f;
+	char *tmp;
+	uint i;
+
+	if (NULL == vsort_cache_path)
+		return;
+
+	tmp = h_strconcat(vsort_cache_path, ".tmp", NULL_PTR);
+	f = file_fopen(tmp, "w");
+	if (NULL == f)
+		goto done;
+
+	fprintf(f, "# vsort() benchmark results, automatically generated\n");
+	fprintf(f, "# %s\n", timestamp_to_string(tm_time()));
+	fprintf(f, "cpus %ld\n", getcpucount());
+	fprintf(f, "opsiz %zu\n", OPSIZ);
+	fprintf(f, "stamp %lu\n", (ulong) tm_time());
+
+	for (i = 0; i < N_ITEMS(vsort_class); i++) {
+		fprintf(f, "%s %s %s\n", vsort_class[i],
+			vsort_routine_to_name(vsort_table[i].v_sort),
+			vsort_routine_to_name(vsort_table[i].v_sort_almost));
+	}
+
+	if (0 != fclose(f)) {
+		s_warning("%s(): cannot write \"%s\": %m", G_STRFUNC, tmp);
+		unlink(tmp);
+	} else if (-1 == rename(tmp, vsort_cache_path)) {
+		s_warning("%s(): cannot rename \"%s\": %m", G_STRFUNC, tmp);
+	}
+
+done:
+	HFREE_NULL(tmp);
+}
+
+/**
+ * Check which of qsort(), xqsort(), xsort(), xpsort(), tqsort() or smsort()
+ * is best for sorting aligned arrays with a native item size of OPSIZ.
+ * At identical performance level, we prefer our own sorting algorithms
+ * instead of libc's qsort() for memory allocation purposes.
  *
  * @param items		amount of items to use in the sorted array
  * @param idx		index of the virtual routine to update
@@ -377,6 +650,7 @@ vsort_init_items(size_t items, unsigned idx, int verbose, const char *which)
 		{ vsort_qsort,	qsort,	0.0, 0, "qsort" },
 		{ vsort_xqsort,	xqsort,	0.0, 2, "xqsort" },
 		{ vsort_xsort,	xsort,	0.0, 1, "xsort" },
+		{ vsort_xpsort,	xpsort,	0.0, 1, "xpsort" },
 		{ vsort_tqsort,	tqsort,	0.0, 1, "tqsort" },
 		{ vsort_smsort,	smsort,	0.0, 1, "smsort" },	/* Only for almost sorted */
 	};
@@ -448,6 +722,19 @@ retry_random:
 		}
 	}
 
+	/*
+	 * Arrays in reverse order or with many duplicates are not rare, and
+	 * some algorithms behave badly with them: account for these too.
+	 */
+
+	vsort_fill_reversed(&vt);
+	vsort_time_all(tests, N_ITEMS(tests) - 1, &vt, &loops,
+		"reversed", which, verbose);
+
+	vsort_fill_duplicates(&vt);
+	vsort_time_all(tests, N_ITEMS(tests) - 1, &vt, &loops,
+		"duplicates", which, verbose);
+
 	xqsort(tests, N_ITEMS(tests) - 1, sizeof tests[0], vsort_testing_cmp);
 
 	vsort_table[idx].v_sort = vsort_routine(tests[0].v_routine, items);
@@ -462,6 +749,7 @@ retry_random:
 	 * so that the array is almost sorted.
 	 */
 
+	random_bytes(vt.data, len);
 	xqsort(vt.data, vt.items, vt.isize, vsort_long_cmp);
 	vsort_perturb_sorted_array(vt.data, vt.items, vt.isize);
 
@@ -483,6 +771,14 @@ retry_sorted:
 		}
 	}
 
+	/*
+	 * Almost-sorted arrays are frequently fully sorted already.
+	 */
+
+	xqsort(vt.data, vt.items, vt.isize, vsort_long_cmp);
+	vsort_time_all(tests, N_ITEMS(tests), &vt, &loops,
+		"sorted", which, verbose);
+
 	xqsort(tests, N_ITEMS(tests), sizeof tests[0], vsort_testing_cmp);
 
 	vsort_table[idx].v_sort_almost = vsort_routine(tests[0].v_routine, items);
@@ -496,6 +792,22 @@ retry_sorted:
 	vmm_free(vt.copy, len);
 }
 
+/**
+ * Record the directory where benchmark results can be cached across runs.
+ *
+ * This must be called before vsort_init() to be effective.
+ *
+ * @param dir		the directory where the cache file is kept
+ */
+void
+vsort_cache(const char *dir)
+{
+	g_assert(dir != NULL);
+
+	HFREE_NULL(vsort_cache_path);
+	vsort_cache_path = make_pathname(dir, VSORT_CACHE_FILE);
+}
+
 /**
  * Check which of qsort() or xqsort() is best for sorting aligned arrays with
  * a native item size of OPSIZ.
@@ -508,13 +820,17 @@ vsort_init(int verbose)
 
 	STATIC_ASSERT(VSORT_HUGE_ITEMS > VSORT_ITEMS);
 	STATIC_ASSERT(VSORT_ITEMS > VSORT_SMALL_ITEMS);
+	STATIC_ASSERT(N_ITEMS(vsort_class) == N_ITEMS(vsort_table));
+
+	if (vsort_cache_load(verbose))
+		return;
 
 	if (verbose)
 		s_info("benchmarking sort routines to select the best one...");
 
 	/*
 	 * Allow main thread to block during the duration of our tests.
-	 * This is needed since tqsort() can create threads and block.
+	 * This is needed since tqsort() and xpsort() can block on other threads.
 	 */
 
 	if (thread_is_main() && !thread_main_is_blockable()) {
@@ -531,6 +847,8 @@ vsort_init(int verbose)
 	if (verbose)
 		s_info("vsort() benchmarking took %F secs", tm_elapsed_f(&end, &start));
 
+	vsort_cache_save();
+
 	/*
 	 * Restore non-blockable main thread if needed.
 	 */
@@ -38,6 +38,7 @@
  * Public interface.
  */
 
+void vsort_cache(const char *dir);
 void vsort_init(int verbose);
 
 void vsort(void *b, size_t n, size_t s, cmp_fn_t cmp);
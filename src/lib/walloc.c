@@ -47,6 +47,7 @@
 #include "eslist.h"
 #include "evq.h"			/* For evq_is_inited() */
 #include "log.h"
+#include "memprof.h"
 #include "mutex.h"
 #include "once.h"
 #include "pow2.h"
@@ -434,26 +435,28 @@ void * G_HOT
 walloc(size_t size)
 {
 	size_t rounded = zalloc_round(size);
+	void *p;
 
 	g_assert(size_is_positive(size));
 
 	if G_UNLIKELY(rounded > walloc_max) {
 		/* Too big for efficient zalloc() */
-		return xmalloc(size);
-	}
-
+		p = xmalloc(size);
+	} else {
 #ifdef TRACK_ZALLOC
-	return walloc_raw(size);
+		p = walloc_raw(size);
 #else
-	{
 		tmalloc_t *depot = walloc_get_magazine(rounded);
 
 		if G_UNLIKELY(NULL == depot)
-			return walloc_raw(size);
-
-		return tmalloc(depot);
-	}
+			p = walloc_raw(size);
+		else
+			p = tmalloc(depot);
 #endif	/* TRACK_ZALLOC */
+	}
+
+	MEMPROF_ALLOC(p, size);
+	return p;
 }
 
 /**
@@ -484,6 +487,8 @@ wfree(void *ptr, size_t size)
 	g_assert(ptr != NULL);
 	g_assert(size_is_positive(size));
 
+	MEMPROF_FREE(ptr, size);
+
 	if G_UNLIKELY(rounded > walloc_max) {
 		xfree(ptr);
 		return;
@@ -545,6 +550,13 @@ wfree_pslist(pslist_t *pl, size_t size)
 	 * free objects to possibly different zones or magazines.
 	 */
 
+	if G_UNLIKELY(memprof_live != 0) {
+		const pslist_t *l;
+
+		for (l = pl; l != NULL; l = l->next)
+			memprof_freed(l, size);
+	}
+
 	if G_UNLIKELY(rounded > walloc_max) {
 		pslist_t *next, *l;
 
@@ -591,6 +603,13 @@ wfree_eslist(eslist_t *el, size_t size)
 	 * quickly.
 	 */
 
+	if G_UNLIKELY(memprof_live != 0) {
+		const void *p;
+
+		for (p = eslist_head(el); p != NULL; p = eslist_next_data(el, p))
+			memprof_freed(p, size);
+	}
+
 	if G_UNLIKELY(rounded > walloc_max) {
 		void *next, *p;
 
@@ -649,8 +668,8 @@ walloc_ptr_is_better(const void *o, const void *n)
  * Move block around if that can serve memory compaction.
  * @return new location for block.
  */
-void *
-wmove(void *ptr, size_t size)
+static void *
+wmove_internal(void *ptr, size_t size)
 {
 	size_t rounded = zalloc_round(size);
 	zone_t *zone = walloc_get_zone(rounded, FALSE);
@@ -697,6 +716,19 @@ wmove(void *ptr, size_t size)
 #endif	/* TRACK_ZALLOC */
 }
 
+/**
+ * Move block around if that can serve memory compaction.
+ * @return new location for block.
+ */
+void *
+wmove(void *ptr, size_t size)
+{
+	void *p = wmove_internal(ptr, size);
+
+	MEMPROF_MOVE(ptr, p, size);
+	return p;
+}
+
 /**
  * Reallocate a block allocated via walloc().
  *
@@ -738,8 +770,11 @@ wrealloc(void *old, size_t old_size, size_t new_size)
 	if G_UNLIKELY(NULL == new_zone)
 		return old;						/* walloc_stopped has been set */
 
-	if (old_zone == new_zone)
-		return zmove(old_zone, old);	/* Move around if interesting */
+	if (old_zone == new_zone) {
+		new = zmove(old_zone, old);		/* Move around if interesting */
+		MEMPROF_MOVE(old, new, new_size);
+		return new;
+	}
 
 resize_block:
 
@@ -42,6 +42,7 @@
 #include "cq.h"
 #include "halloc.h"
 #include "hikset.h"
+#include "mutex.h"
 #include "once.h"
 #include "path.h"
 #include "walloc.h"
@@ -61,6 +62,10 @@ struct monitored {
 };
 
 static hikset_t *monitored;	/**< filename -> struct monitored */
+static mutex_t watcher_mtx = MUTEX_INIT;
+
+#define WATCHER_LOCK	mutex_lock(&watcher_mtx)
+#define WATCHER_UNLOCK	mutex_unlock(&watcher_mtx)
 
 /**
  * Compute the modified time of the file on disk.
@@ -107,7 +112,14 @@ watcher_timer(void *unused_udata)
 	if G_UNLIKELY(NULL == monitored)
 		return FALSE;	/* Stop calling, layer disabled */
 
+	/*
+	 * The lock is recursive, so callbacks can safely register or
+	 * unregister files.
+	 */
+
+	WATCHER_LOCK;
 	hikset_foreach(monitored, watcher_check_mtime, NULL);
+	WATCHER_UNLOCK;
 
 	return TRUE;		/* Keep calling */
 }
@@ -138,10 +150,14 @@ watcher_register(const char *filename, watcher_cb_t cb, void *udata)
 	m->udata = udata;
 	m->mtime = watcher_mtime(filename);
 
+	WATCHER_LOCK;
+
 	if (hikset_contains(monitored, filename))
 		watcher_unregister(filename);
 
 	hikset_insert_key(monitored, &m->filename);
+
+	WATCHER_UNLOCK;
 }
 
 /**
@@ -182,12 +198,16 @@ watcher_unregister(const char *filename)
 	g_return_unless(monitored != NULL);
 	g_assert(filename != NULL);
 
+	WATCHER_LOCK;
+
 	m = hikset_lookup(monitored, filename);
 
 	g_assert(m != NULL);
 
 	hikset_remove(monitored, m->filename);
 	watcher_free(m);
+
+	WATCHER_UNLOCK;
 }
 
 /**
@@ -246,8 +266,10 @@ free_monitored_kv(void *value, void *unused_udata)
 void
 watcher_close(void)
 {
+	WATCHER_LOCK;
 	hikset_foreach(monitored, free_monitored_kv, NULL);
 	hikset_free_null(&monitored);
+	WATCHER_UNLOCK;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -407,11 +407,17 @@ xchunk_check(const struct xchunk * const xck)
 /**
  * Per-bucket temporary list of blocks whose insertion to the bucket was
  * deferred due to the bucket being already locked by another thread.
+ *
+ * This is a lock-free stack: blocks are pushed atomically by any thread,
+ * but only the thread owning the bucket lock can remove blocks, and it
+ * always grabs the whole list at once, which prevents any ABA problem.
+ *
+ * The count is incremented before the block is pushed and decremented
+ * after it was removed, so it can only over-estimate the list length.
  */
 struct xdefer {
-	spinlock_t lock;		/**< Thread-safe lock */
-	size_t count;			/**< Amount of blocks chained */
 	void *head;				/**< Head of block list to return to bucket */
+	uint count;				/**< Amount of blocks chained */
 };
 
 /**
@@ -2462,6 +2468,7 @@ xfl_process_deferred(struct xfreelist *fl)
 {
 	struct xdefer *xdf = &fl->deferred;
 	size_t n = 0;
+	void *p;
 
 	assert_mutex_is_owned(&fl->lock);
 
@@ -2476,29 +2483,30 @@ xfl_process_deferred(struct xfreelist *fl)
 
 	fl->retrofiting = TRUE;
 
-	for (;;) {
-		spinlock(&xdf->lock);
-		if (0 != xdf->count) {
-			void *p;
+	/*
+	 * Detach the whole list atomically, then insert its blocks.  We loop
+	 * since other threads can push new blocks whilst we are processing.
+	 */
 
-			p = xdf->head;
-			xdf->head = *(void **) p;	/* Next block in list, or NULL */
-			xdf->count--;
-			spinunlock(&xdf->lock);
+	while (NULL != (p = atomic_ptr_get(&xdf->head))) {
+		if (!atomic_ptr_xchg_if_eq(&xdf->head, p, NULL))
+			continue;
+
+		while (p != NULL) {
+			void *next = *(void **) p;	/* Next block in list, or NULL */
+
+			atomic_uint_dec(&xdf->count);
 
 			if (xmalloc_debugging(5)) {
 				s_minidbg("XM %s() handling deferred block %p "
-					"in free list #%zu (%zu bytes), with %zu more",
-					G_STRFUNC, p, xfl_index(fl), fl->blocksize, xdf->count);
+					"in free list #%zu (%zu bytes), with %u more",
+					G_STRFUNC, p, xfl_index(fl), fl->blocksize,
+					atomic_uint_get(&xdf->count));
 			}
 
-			g_assert(p != NULL);
-
 			xfl_insert(fl, p, TRUE);
 			n++;
-		} else {
-			spinunlock(&xdf->lock);
-			break;
+			p = next;
 		}
 	}
 
@@ -2529,28 +2537,29 @@ static void
 xfl_defer(struct xfreelist *fl, void *p)
 {
 	struct xdefer *xdf = &fl->deferred;
+	void *head;
 
 	if (xmalloc_debugging(5)) {
 		s_minidbg("XM %s() enqueuing deferred block %p "
-			"in free list #%zu (%zu bytes), with %zu already present",
-			G_STRFUNC, p, xfl_index(fl), fl->blocksize, xdf->count);
+			"in free list #%zu (%zu bytes), with %u already present",
+			G_STRFUNC, p, xfl_index(fl), fl->blocksize,
+			atomic_uint_get(&xdf->count));
 	}
 
 	/*
-	 * We cannot deadlock because we're only grabbing the lock on the
-	 * deferred list, which is kept for a short period of time, without
-	 * calling any other routine.
+	 * The block is pushed without taking any lock, so that concurrent
+	 * freeings in a contended bucket do not serialize here.
 	 *
 	 * The list structure is kept using the first pointer of the block,
 	 * since we cannot allocate any memory here.
 	 */
 
-	spinlock(&xdf->lock);
-	g_assert(xdf->count != 0 || NULL == xdf->head);
-	*(void **) p = xdf->head;
-	xdf->head = p;
-	xdf->count++;
-	spinunlock(&xdf->lock);
+	atomic_uint_inc(&xdf->count);
+
+	do {
+		head = atomic_ptr_get(&xdf->head);
+		*(void **) p = head;
+	} while (!atomic_ptr_xchg_if_eq(&xdf->head, head, p));
 
 	XSTATS_LOCK;
 	xstats.freelist_insertions_deferred++;
@@ -2630,7 +2639,6 @@ xmalloc_freelist_init_once(void)
 
 		fl->blocksize = xfl_block_size_idx(i);
 		mutex_init(&fl->lock);
-		spinlock_init(&fl->deferred.lock);
 
 		g_assert_log(xfl_find_freelist_index(fl->blocksize) == i,
 			"i=%zu, blocksize=%zu, inverted_index=%zu",
@@ -7088,12 +7096,12 @@ xmalloc_dump_freelist_log(logagent_t *la)
 			log_info(la, "XM freelist #%zu (%zu bytes): cap=%zu, "
 				"cnt=%zu, def=%zu, lck=%zu",
 				i, fl->blocksize, fl->capacity, fl->count,
-				fl->deferred.count, mutex_held_depth(&fl->lock));
+				(size_t) fl->deferred.count, mutex_held_depth(&fl->lock));
 		} else {
 			log_info(la, "XM freelist #%zu (%zu bytes): cap=%zu, "
 				"sort=%zu/%zu, def=%zu, lck=%zu",
 				i, fl->blocksize, fl->capacity, fl->sorted, fl->count,
-				fl->deferred.count, mutex_held_depth(&fl->lock));
+				(size_t) fl->deferred.count, mutex_held_depth(&fl->lock));
 		}
 	}
 
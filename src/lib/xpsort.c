@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Parallel mergesort using the thread pool.
+ *
+ * The array is split into as many runs as there are CPUs, each run being
+ * sorted by xsort() in a separate job.  The sorted runs are then merged
+ * pairwise, all the merges of a given round being again handled by
+ * separate jobs, until only one run remains.
+ *
+ * The calling thread does not simply wait for the jobs to complete: it
+ * processes the jobs that no worker has picked up yet, so that sorting
+ * always progresses, even when all the workers are busy or when we are
+ * called from a worker thread.
+ *
+ * Unlike xsort(), this routine allocates memory and relies on threads,
+ * hence it must not be used by the memory allocators nor on crashing paths.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "xpsort.h"
+
+#include "atomic.h"
+#include "cond.h"
+#include "getcpucount.h"
+#include "getphysmemsize.h"
+#include "mempcpy.h"
+#include "mutex.h"
+#include "op.h"
+#include "tpool.h"
+#include "unsigned.h"
+#include "vmm.h"
+#include "walloc.h"
+#include "xsort.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define XPSORT_RUNS_MAX	16					/* Max amount of parallel runs */
+#define XPSORT_RUN_MIN	(XPSORT_ITEMS / 4)	/* Min amount of items per run */
+
+/**
+ * A sorting job: sort a run, or merge two consecutive runs.
+ */
+struct xpsort_job {
+	char *src;				/**< First run, in the source arena */
+	char *dst;				/**< Merging target, NULL to sort the run */
+	size_t n1;				/**< Items in first run */
+	size_t n2;				/**< Items in the next run, when merging */
+};
+
+/**
+ * Jobs to process concurrently.
+ *
+ * This is reference-counted because jobs we post to the thread pool can
+ * start after the calling thread has processed all the work.
+ */
+struct xpsort_ctx {
+	struct xpsort_job jobs[XPSORT_RUNS_MAX];
+	cmp_fn_t cmp;			/**< Item comparison routine */
+	size_t s;				/**< Item size */
+	uint count;				/**< Amount of jobs */
+	uint next;				/**< Next job to process */
+	uint finished;			/**< Amount of processed jobs */
+	uint refcnt;			/**< Reference count */
+	mutex_t lock;			/**< Protects ``finished'' */
+	cond_t over;			/**< Signaled when all jobs are processed */
+};
+
+/**
+ * Merge two sorted runs into ``dst''.
+ */
+static void
+xpsort_merge(const char *b1, size_t n1, const char *b2, size_t n2,
+	char *dst, size_t s, cmp_fn_t cmp)
+{
+	if (s == OPSIZ && op_aligned(b1) && op_aligned(b2) && op_aligned(dst)) {
+		const op_t *ob1 = (const op_t *) b1;
+		const op_t *ob2 = (const op_t *) b2;
+		op_t *odst = (op_t *) dst;
+
+		/* We are operating on aligned words.  Use direct word stores. */
+
+		while (n1 > 0 && n2 > 0) {
+			if ((*cmp)(ob1, ob2) <= 0) {
+				--n1;
+				*odst++ = *ob1++;
+			} else {
+				--n2;
+				*odst++ = *ob2++;
+			}
+		}
+
+		dst = (char *) odst;
+		b1 = (const char *) ob1;
+		b2 = (const char *) ob2;
+	} else {
+		while (n1 > 0 && n2 > 0) {
+			if ((*cmp)(b1, b2) <= 0) {
+				dst = mempcpy(dst, b1, s);
+				b1 += s;
+				--n1;
+			} else {
+				dst = mempcpy(dst, b2, s);
+				b2 += s;
+				--n2;
+			}
+		}
+	}
+
+	if (n1 > 0)
+		dst = mempcpy(dst, b1, n1 * s);
+	if (n2 > 0)
+		memcpy(dst, b2, n2 * s);
+}
+
+/**
+ * Allocate a new job context.
+ */
+static struct xpsort_ctx *
+xpsort_ctx_alloc(size_t s, cmp_fn_t cmp)
+{
+	struct xpsort_ctx *ctx;
+
+	WALLOC0(ctx);
+	ctx->s = s;
+	ctx->cmp = cmp;
+	mutex_init(&ctx->lock);
+	cond_init(&ctx->over, &ctx->lock);
+
+	return ctx;
+}
+
+/**
+ * Release a reference on the job context, freeing it with the last one.
+ */
+static void
+xpsort_ctx_release(struct xpsort_ctx *ctx)
+{
+	if (atomic_uint_dec_is_zero(&ctx->refcnt)) {
+		cond_destroy(&ctx->over);
+		mutex_destroy(&ctx->lock);
+		WFREE(ctx);
+	}
+}
+
+/**
+ * Process all the jobs nobody has claimed yet.
+ */
+static void
+xpsort_process(struct xpsort_ctx *ctx)
+{
+	for (;;) {
+		uint i = atomic_uint_inc(&ctx->next);
+		struct xpsort_job *j;
+
+		if (i >= ctx->count)
+			break;
+
+		j = &ctx->jobs[i];
+
+		if (NULL == j->dst) {
+			xsort(j->src, j->n1, ctx->s, ctx->cmp);
+		} else {
+			xpsort_merge(j->src, j->n1, j->src + j->n1 * ctx->s, j->n2,
+				j->dst, ctx->s, ctx->cmp);
+		}
+
+		mutex_lock(&ctx->lock);
+		if (++ctx->finished == ctx->count)
+			cond_signal(&ctx->over, &ctx->lock);
+		mutex_unlock(&ctx->lock);
+	}
+}
+
+/**
+ * Thread pool job, helping the calling thread.
+ */
+static void
+xpsort_worker(void *data)
+{
+	struct xpsort_ctx *ctx = data;
+
+	xpsort_process(ctx);
+	xpsort_ctx_release(ctx);
+}
+
+/**
+ * Process all the jobs of the context concurrently, then free it.
+ *
+ * @param ctx		the job context
+ * @param cpus		amount of CPUs we can use
+ */
+static void
+xpsort_run(struct xpsort_ctx *ctx, uint cpus)
+{
+	uint i, helpers = MIN(ctx->count, cpus) - 1;
+
+	g_assert(ctx->count != 0);
+	g_assert(ctx->count <= N_ITEMS(ctx->jobs));
+
+	ctx->refcnt = 1 + helpers;
+
+	for (i = 0; i < helpers; i++) {
+		tpool_post(xpsort_worker, ctx);
+	}
+
+	xpsort_process(ctx);
+
+	/*
+	 * The jobs still running were claimed by workers, which will signal
+	 * us when they are done.
+	 */
+
+	mutex_lock(&ctx->lock);
+	while (ctx->finished != ctx->count) {
+		cond_wait(&ctx->over, &ctx->lock);
+	}
+	mutex_unlock(&ctx->lock);
+
+	xpsort_ctx_release(ctx);
+}
+
+/**
+ * Compute amount of runs to sort in parallel.
+ *
+ * @return amount of runs, 0 if it is not worth sorting in parallel.
+ */
+static uint
+xpsort_runs(size_t n, size_t size, uint cpus)
+{
+	static uint64 memsize;
+	size_t runs;
+
+	if (n < XPSORT_ITEMS || cpus < 2)
+		return 0;
+
+	/*
+	 * Like xsort(), avoid allocating too much memory since this might
+	 * have to be backed up by swap space.
+	 */
+
+	if G_UNLIKELY(0 == memsize) {
+		memsize = getphysmemsize();
+		if (0 == memsize)
+			memsize = (uint64) -1;		/* Assume plenty! */
+	}
+
+	if ((uint64) size > memsize / 4)
+		return 0;
+
+	runs = MIN(cpus, XPSORT_RUNS_MAX);
+	runs = MIN(runs, n / XPSORT_RUN_MIN);
+
+	return runs;
+}
+
+/**
+ * Sort array with ``n'' elements of size ``s''.  The base ``b'' points to
+ * the start of the array.
+ *
+ * When there are more than XPSORT_ITEMS items to sort and more than one CPU,
+ * this routine uses the thread pool to sort several parts of the array
+ * concurrently, then merges them.  Otherwise it is equivalent to xsort().
+ *
+ * The contents are sorted in ascending order, as defined by the comparison
+ * function ``cmp''.
+ */
+void
+xpsort(void *b, size_t n, size_t s, cmp_fn_t cmp)
+{
+	const size_t size = size_saturate_mult(n, s);
+	size_t start[XPSORT_RUNS_MAX + 1];
+	struct xpsort_ctx *ctx;
+	char *src, *dst, *tmp;
+	uint cpus, runs, i;
+
+	g_assert(b != NULL);
+	g_assert(cmp != NULL);
+	g_assert(size_is_non_negative(n));
+	g_assert(size_is_positive(s));
+
+	cpus = MIN(getcpucount(), XPSORT_RUNS_MAX);
+	runs = xpsort_runs(n, size, cpus);
+
+	if (runs < 2) {
+		xsort(b, n, s, cmp);
+		return;
+	}
+
+	for (i = 0; i <= runs; i++) {
+		start[i] = (n / runs) * i + MIN(i, n % runs);
+	}
+
+	/*
+	 * Sort each run separately.
+	 */
+
+	ctx = xpsort_ctx_alloc(s, cmp);
+
+	for (i = 0; i < runs; i++) {
+		struct xpsort_job *j = &ctx->jobs[i];
+
+		j->src = ptr_add_offset(b, start[i] * s);
+		j->n1 = start[i + 1] - start[i];
+	}
+
+	ctx->count = runs;
+	xpsort_run(ctx, cpus);
+
+	/*
+	 * Merge runs pairwise, alternating between the array and the temporary
+	 * arena, until we have only one sorted run.
+	 */
+
+	tmp = vmm_alloc(size);
+	src = b;
+	dst = tmp;
+
+	while (runs > 1) {
+		uint k;
+
+		ctx = xpsort_ctx_alloc(s, cmp);
+
+		for (i = 0, k = 0; i < runs; i += 2, k++) {
+			struct xpsort_job *j = &ctx->jobs[k];
+			size_t offset = start[i] * s;
+
+			j->src = src + offset;
+			j->dst = dst + offset;
+			j->n1 = start[i + 1] - start[i];
+			j->n2 = i + 1 < runs ? start[i + 2] - start[i + 1] : 0;
+			start[k] = start[i];
+		}
+
+		start[k] = n;
+		ctx->count = runs = k;
+		xpsort_run(ctx, cpus);
+
+		{
+			char *t = src;
+			src = dst;
+			dst = t;
+		}
+	}
+
+	if (src != b)
+		memcpy(b, src, size);
+
+	vmm_free(tmp, size);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
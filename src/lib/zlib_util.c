@@ -642,6 +642,38 @@ zlib_deflater_reset(zlib_deflater_t *zd, const void *data, int len)
 	zlib_stream_reset_into(&zd->zs, data, len, NULL, 0);
 }
 
+/**
+ * Install a preset dictionary in the zlib deflater.
+ *
+ * This must be done before any data is compressed, and again after each
+ * reset since resetting the deflater discards the dictionary.
+ *
+ * @param zd		the zlib deflater
+ * @param dict		the dictionary data
+ * @param len		length of the dictionary
+ *
+ * @return TRUE if OK, FALSE on error.
+ */
+bool
+zlib_deflater_set_dictionary(zlib_deflater_t *zd, const void *dict, size_t len)
+{
+	int ret;
+
+	zlib_deflater_check(zd);
+	g_assert(dict != NULL);
+	g_assert(len <= MAX_INT_VAL(uInt));
+
+	ret = deflateSetDictionary(zd->zs.z, dict, len);
+
+	if (Z_OK != ret) {
+		g_carp("%s(): cannot set dictionary: %s",
+			G_STRFUNC, zlib_strerror(ret));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /**
  * Creates an incremental zlib deflater for `len' bytes starting at `data',
  * with specified compression `level'.  Data will be compressed into a
@@ -836,6 +868,27 @@ zlib_uncompress(const void *data, int len, ulong uncompressed_len)
  */
 int
 zlib_inflate_into(const void *data, int len, void *out, int *outlen)
+{
+	return zlib_inflate_into_dict(data, len, out, outlen, NULL, 0);
+}
+
+/**
+ * Inflate data into supplied buffer, using a preset dictionary if the
+ * deflated stream requires one.
+ *
+ * @param data		the data to inflate
+ * @param len		length of data
+ * @param out		buffer where inflated data is written
+ * @param outlen	written with the length of inflated data
+ * @param dict		the preset dictionary, NULL if none
+ * @param dictlen	length of the dictionary
+ *
+ * @return zlib status: Z_OK on success.  If the stream requires another
+ * dictionary than the one supplied, Z_DATA_ERROR is returned.
+ */
+int
+zlib_inflate_into_dict(const void *data, int len, void *out, int *outlen,
+	const void *dict, size_t dictlen)
 {
 	z_streamp inz;
 	int ret;
@@ -880,6 +933,25 @@ zlib_inflate_into(const void *data, int len, void *out, int *outlen)
 
 	ret = inflate(inz, Z_SYNC_FLUSH);
 
+	/*
+	 * A stream made with a preset dictionary requests it right after
+	 * its header.  The dictionary is checked against the Adler-32 sum
+	 * recorded in the stream header.
+	 */
+
+	if (Z_NEED_DICT == ret) {
+		if (NULL == dict) {
+			ret = Z_DATA_ERROR;
+			goto done;
+		}
+
+		ret = inflateSetDictionary(inz, dict, dictlen);
+		if (ret != Z_OK)
+			goto done;
+
+		ret = inflate(inz, Z_SYNC_FLUSH);
+	}
+
 	inflated = *outlen - inz->avail_out;
 
 	if (ret == Z_STREAM_END) {
@@ -1103,4 +1175,19 @@ zlib_is_valid_header(const void *data, int len)
 	return booleanize(0 == check % 31);
 }
 
+/**
+ * Check whether first bytes of data make up a valid zlib marker for a
+ * stream compressed with a preset dictionary (FDICT bit set).
+ */
+bool
+zlib_header_has_dictionary(const void *data, int len)
+{
+	const uchar *p = data;
+
+	if (!zlib_is_valid_header(data, len))
+		return FALSE;
+
+	return booleanize(p[1] & 0x20);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -59,6 +59,8 @@ bool zlib_deflate_data(zlib_deflater_t *zd,
 bool zlib_deflate_close(zlib_deflater_t *zd);
 void zlib_deflater_free(zlib_deflater_t *zd, bool output);
 void zlib_deflater_reset(zlib_deflater_t *zd, const void *data, int len);
+bool zlib_deflater_set_dictionary(zlib_deflater_t *zd,
+	const void *dict, size_t len);
 void zlib_deflater_reset_into(zlib_deflater_t *zd,
 	const void *data, int len, void *dest, int destlen);
 
@@ -88,7 +90,10 @@ void zlib_inflater_set_maxoutlen(struct zlib_inflater *zi, size_t len);
 
 void *zlib_uncompress(const void *data, int len, ulong uncompressed_len);
 int zlib_inflate_into(const void *data, int len, void *out, int *outlen);
+int zlib_inflate_into_dict(const void *data, int len, void *out, int *outlen,
+	const void *dict, size_t dictlen);
 bool zlib_is_valid_header(const void *data, int len);
+bool zlib_header_has_dictionary(const void *data, int len);
 
 void zlib_free_func(void *unused_opaque, void *p);
 void *zlib_alloc_func(void *unused_opaque, uint n, uint m);
@@ -46,6 +46,7 @@
 #include "core/clock.h"
 #include "core/ctl.h"
 #include "core/dh.h"
+#include "core/dlqual.h"
 #include "core/dmesh.h"
 #include "core/downloads.h"
 #include "core/dq.h"
@@ -76,6 +77,7 @@
 #include "core/ipp_cache.h"
 #include "core/local_shell.h"
 #include "core/move.h"
+#include "core/mq_udp.h"
 #include "core/nodes.h"
 #include "core/ntp.h"
 #include "core/oob.h"
@@ -92,9 +94,12 @@
 #include "core/sockets.h"
 #include "core/spam.h"
 #include "core/sq.h"
+#include "core/startup.h"
 #include "core/tls_common.h"
 #include "core/topless.h"
+#include "core/tracing.h"
 #include "core/tsync.h"
+#include "core/tth_cache.h"
 #include "core/tx.h"
 #include "core/udp.h"
 #include "core/uhc.h"
@@ -138,6 +143,7 @@
 #include "lib/log.h"
 #include "lib/map.h"
 #include "lib/mem.h"
+#include "lib/mempress.h"
 #include "lib/mime_type.h"
 #include "lib/misc.h"
 #include "lib/mtwist.h"
@@ -167,6 +173,7 @@
 #include "lib/tigertree.h"
 #include "lib/tm.h"
 #include "lib/tmalloc.h"
+#include "lib/tpool.h"
 #include "lib/utf8.h"
 #include "lib/vendors.h"
 #include "lib/vmea.h"
@@ -251,6 +258,7 @@ enum main_arg {
 	main_arg_gdb_on_crash,
 	main_arg_geometry,
 	main_arg_help,
+	main_arg_log_async,
 	main_arg_log_stderr,
 	main_arg_log_stdout,
 	main_arg_log_supervise,
@@ -267,6 +275,7 @@ enum main_arg {
 	main_arg_resume_session,
 	main_arg_shell,
 	main_arg_topless,
+	main_arg_trace,
 	main_arg_use_poll,
 	main_arg_version,
 
@@ -313,6 +322,7 @@ static struct option {
 #endif	/* HAS_FORK */
 	OPTION(geometry,		TEXT, "Placement of the main GUI window."),
 	OPTION(help, 			NONE, "Print this message."),
+	OPTION(log_async,		NONE, "Write logs from a dedicated thread."),
 	OPTION(log_stderr,		PATH, "Log standard output to a file."),
 	OPTION(log_stdout,		PATH, "Log standard error output to a file."),
 	OPTION(log_supervise,	PATH, "Log for the supervisor process."),
@@ -341,6 +351,7 @@ static struct option {
 #else
 	OPTION(topless,			NONE, "Disable the graphical user-interface."),
 #endif	/* USE_TOPLESS */
+	OPTION(trace,			PATH, "Record binary trace of events to file."),
 	OPTION(use_poll,		NONE, "Use poll() instead of epoll(), kqueue() etc."),
 	OPTION(version,			NONE, "Show version information."),
 
@@ -718,9 +729,12 @@ gtk_gnutella_exit(int exit_code)
 	DO(upload_close);	/* Done before upload_stats_close() for stats update */
 	DO(upload_stats_close);
 	DO(parq_close_pre);
-	DO(verify_sha1_close);
+	DO(verify_sha1_shutdown);
 	DO(verify_tth_shutdown);
+	DO(tpool_close);		/* Let background jobs complete */
+	DO(mempress_close);
 	DO(download_close);
+	DO(dlqual_close);		/* After download_close() */
 	DO(file_info_store_if_dirty);	/* In case downloads had buffered data */
 	DO(parq_close);
 	DO(pproxy_close);
@@ -969,6 +983,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(word_vec_close);
 	DO(pmsg_close);
 	DO(gmsg_close);
+	DO(mq_udp_close);
 	DO(g2_build_close);
 	DO(version_close);
 	DO(ignore_close);
@@ -981,10 +996,13 @@ gtk_gnutella_exit(int exit_code)
 	DO(tls_global_close);
 	DO(misc_close);
 	DO(mingw_close);
+	DO(verify_sha1_close);
 	DO(verify_tth_close);
+	DO(tth_cache_close);	/* After verify_tth_close() */
 	DO(inputevt_close);
 	DO(locale_close);
 	DO(wq_close);
+	DO(tracing_close);
 	DO(log_close);		/* Does not disable logging */
 	DO(gentime_close);
 
@@ -2389,6 +2407,8 @@ main(int argc, char **argv)
 	settings_early_init();
 	crash_setdir(settings_crash_dir());
 	handle_arguments();		/* Returning from here means we're good to go */
+	stacktrace_symbols_cache(settings_config_dir());
+	vsort_cache(settings_config_dir());
 	stacktrace_post_init();	/* And for possibly (hopefully) a long time */
 
 	/*
@@ -2430,6 +2450,9 @@ main(int argc, char **argv)
 	crash_setcctime(__TIME__);
 	crash_post_init();		/* Done with crash initialization */
 
+	if (OPT(log_async))
+		log_async_start();
+
 	/* Our regular inits */
 
 #ifndef OFFICIAL_BUILD
@@ -2514,6 +2537,7 @@ main(int argc, char **argv)
 
 	xmalloc_post_init();	/* after settings_init() */
 	vmm_post_init();		/* after settings_init() */
+	mempress_init();		/* after vmm_post_init() */
 
 	if (debugging(0) || is_running_on_mingw())
 		stacktrace_load_symbols();
@@ -2548,23 +2572,28 @@ main(int argc, char **argv)
 	ghc_init();
 	gwc_init();
 	verify_sha1_init();
+	tth_cache_init();
 	verify_tth_init();
 	move_init();
 	ignore_init();
 	word_vec_init();
+	startup_wait();			/* Wait for hostiles, spam and geo-ip data */
 
 	file_info_init();
 	host_init();
 	gmsg_init();
+	mq_udp_init();
 	bsched_init();
 	dump_init();
 	node_init();
 	g2_node_init();
     hcache_retrieve_all();	/* after settings_init() and node_init() */
+	tracing_init(OPT(trace) ? OPTARG(trace) : NULL);
 	routing_init();
 	search_init();
 	share_init();
 	dmesh_init();			/* MUST be done BEFORE download_init() */
+	dlqual_init();			/* MUST be done BEFORE download_init() */
 	download_init();		/* MUST be done AFTER file_info_init() */
 	upload_init();
 	shell_init();
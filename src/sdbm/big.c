@@ -16,6 +16,8 @@
 #include "sdbm.h"
 #include "tune.h"
 #include "big.h"
+#include "fmap.h"
+#include "lru.h"				/* For getmmap() */
 #include "private.h"
 #include "pair.h"				/* For sdbm_page_dump() */
 
@@ -34,6 +36,7 @@
 #include "lib/stringify.h"
 #include "lib/unsigned.h"
 #include "lib/walloc.h"
+#include "lib/xsort.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -96,6 +99,11 @@ struct DBMBIG {
 	ulong bigwrite;			/* stats: amount of big data write syscalls */
 	ulong bigread_blk;		/* stats: amount of big data blocks read */
 	ulong bigwrite_blk;		/* stats: amount of big data blocks written */
+	ulong bigreadahead;		/* stats: amount of fragmented reads advised */
+#ifdef MMAP
+	struct fmap *map;		/* memory-mapped .dat file, NULL if none */
+	ulong bigmread;			/* stats: amount of big data mapped reads */
+#endif
 	uint8 bitbuf_dirty;		/* whether bitbuf needs flushing to disk */
 };
 
@@ -163,12 +171,21 @@ log_bigstats(DBM *db)
 		sdbm_name(db),
 		dbg->key_full_match * 100.0 / MAX(dbg->key_short_match, 1),
 		dbg->key_short_match, plural(dbg->key_short_match));
-	g_info("sdbm: \"%s\" big blocks read = %lu (%lu system call%s)",
+	g_info("sdbm: \"%s\" big blocks read = %lu (%lu system call%s, "
+		"%lu fragmented)",
 		sdbm_name(db),
-		dbg->bigread_blk, dbg->bigread, plural(dbg->bigread));
+		dbg->bigread_blk, dbg->bigread, plural(dbg->bigread),
+		dbg->bigreadahead);
 	g_info("sdbm: \"%s\" big blocks written = %lu (%lu system call%s)",
 		sdbm_name(db),
 		dbg->bigwrite_blk, dbg->bigwrite, plural(dbg->bigwrite));
+#ifdef MMAP
+	if (dbg->map != NULL) {
+		g_info("sdbm: \"%s\" big data mapped reads = %lu",
+			sdbm_name(db), dbg->bigmread);
+		fmap_log_stats(dbg->map, sdbm_name(db), ".dat");
+	}
+#endif
 }
 
 /**
@@ -207,6 +224,9 @@ big_close(DBM *db)
 	if (-1 == dbg->fd)
 		return FALSE;
 
+#ifdef MMAP
+	fmap_close_null(&dbg->map);
+#endif
 	fd_forget_and_close(&dbg->fd);
 	return TRUE;
 }
@@ -294,6 +314,9 @@ big_free(DBM *db)
 	HFREE_NULL(dbg->bitcheck);
 	buf_free_null(&dbg->keybuf);
 	buf_free_null(&dbg->valbuf);
+#ifdef MMAP
+	fmap_close_null(&dbg->map);
+#endif
 	fd_forget_and_close(&dbg->fd);
 	dbg->magic = 0;
 	WFREE(dbg);
@@ -505,65 +528,6 @@ incomplete:
 	return adjustments;
 }
 
-/**
- * Allocate a single block in the file, without extending it.
- *
- * @param db		the sdbm database
- * @param first		first block to consider
- *
- * @return the block number if found, 0 otherwise.
- */
-static size_t
-big_falloc(DBM *db, size_t first)
-{
-	DBMBIG *dbg = db->big;
-	long max_bitmap = dbg->bitmaps;
-	long i;
-	long bmap;
-	size_t first_bit;
-
-	bmap = first / BIG_BITCOUNT;			/* Bitmap handling this block */
-	first_bit = first & (BIG_BITCOUNT - 1);	/* Index within bitmap */
-
-	g_assert(first_bit != 0);				/* Bit 0 is the bitmap itself */
-
-	/*
-	 * Loop through all the currently existing bitmaps.
-	 */
-
-	for (i = bmap; i < max_bitmap; i++) {
-		size_t bno;
-
-		if (!fetch_bitbuf(db, i))
-			return 0;
-
-		bno = bit_field_first_clear(dbg->bitbuf, first_bit, BIG_BITCOUNT - 1);
-		if ((size_t) -1 == bno)
-			continue;
-
-		/*
-		 * Found a free block.
-		 */
-
-		bit_field_set(dbg->bitbuf, bno);
-		dbg->bitbuf_dirty = TRUE;
-
-		/*
-		 * Correct the block number corresponding to "bno", if we did
-		 * not find it in bitmap #0.
-		 */
-
-		bno = size_saturate_add(bno, size_saturate_mult(BIG_BITCOUNT, i));
-
-		/* Make sure we can represent the block number in 32 bits */
-		g_assert(bno <= MAX_INT_VAL(uint32));
-
-		return bno;		/* Allocated block number */
-	}
-
-	return 0;		/* No free block found */
-}
-
 /**
  * Check whether data block is allocated.
  *
@@ -752,6 +716,255 @@ big_falloc_seq(DBM *db, int bmap, int n)
 	return 0;		/* No free block found */
 }
 
+/**
+ * A free extent in the .dat file: a run of consecutive free blocks.
+ *
+ * Extents never span two bitmaps since the bitmap block separating them
+ * is always allocated.
+ */
+struct big_extent {
+	size_t start;		/* First free block number */
+	size_t len;			/* Amount of consecutive free blocks */
+};
+
+static int
+big_extent_cmp(const void *a, const void *b)
+{
+	const struct big_extent *ea = a, *eb = b;
+
+	return CMP(ea->start, eb->start);
+}
+
+/**
+ * Record free extent in the array of the largest extents seen so far,
+ * which is kept sorted by decreasing length.
+ *
+ * @param ext		the array of extents
+ * @param cnt		amount of extents held in the array (updated)
+ * @param max		maximum amount of extents the array can hold
+ * @param start		first block of the new extent
+ * @param len		length of the new extent
+ */
+static void
+big_extent_record(struct big_extent *ext, int *cnt, int max,
+	size_t start, size_t len)
+{
+	int i;
+
+	if (*cnt == max) {
+		if (len <= ext[max - 1].len)
+			return;			/* Smaller than all the extents we have */
+		i = max - 1;		/* Supersede the smallest extent */
+	} else {
+		i = (*cnt)++;
+	}
+
+	for (; i > 0 && ext[i - 1].len < len; i--)
+		ext[i] = ext[i - 1];	/* struct copy */
+
+	ext[i].start = start;
+	ext[i].len = len;
+}
+
+/**
+ * Free the first "cnt" extents in the array.
+ */
+static void
+big_file_free_extents(DBM *db, const struct big_extent *ext, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		size_t j;
+
+		for (j = 0; j < ext[i].len; j++)
+			big_ffree(db, ext[i].start + j);
+	}
+}
+
+/**
+ * Allocate "n" blocks in the file, without attempting to extend it, using
+ * as few extents of consecutive free blocks as possible.
+ *
+ * This limits fragmentation of the data compared to filling the first holes
+ * we find, and keeps the amount of read requests low when fetching the data
+ * back since big_fetch() reads each extent with a single system call.
+ *
+ * Allocated block numbers are written back in the specified vector, sorted.
+ *
+ * @param db		the sdbm database
+ * @param bvec		vector where allocated block numbers will be stored
+ * @param n			amount of blocks to allocate
+ *
+ * @return TRUE if we were able to allocate all the requested blocks, FALSE
+ * otherwise, in which case no block was allocated.
+ */
+static bool
+big_falloc_extents(DBM *db, void *bvec, int n)
+{
+	DBMBIG *dbg = db->big;
+	struct big_extent *ext;
+	int cnt = 0, used, i;
+	size_t total;
+	long b;
+	bool ok = FALSE;
+
+	g_assert(n > 0);
+
+	WALLOC_ARRAY(ext, n);
+
+	/*
+	 * Gather the "n" largest free extents from all the bitmaps: we will
+	 * never need more than that to allocate "n" blocks.
+	 */
+
+	for (b = 0; b < dbg->bitmaps; b++) {
+		size_t from = 1;	/* Bit #0 is the bitmap itself */
+
+		if (!fetch_bitbuf(db, b))
+			goto done;
+
+		while (from < BIG_BITCOUNT) {
+			size_t start, end;
+
+			start = bit_field_first_clear(dbg->bitbuf, from, BIG_BITCOUNT - 1);
+			if ((size_t) -1 == start)
+				break;
+
+			end = bit_field_first_set(dbg->bitbuf, start, BIG_BITCOUNT - 1);
+			if ((size_t) -1 == end)
+				end = BIG_BITCOUNT;
+
+			big_extent_record(ext, &cnt, n,
+				size_saturate_add(start, size_saturate_mult(BIG_BITCOUNT, b)),
+				end - start);
+
+			from = end;
+		}
+	}
+
+	/*
+	 * Use the largest extents first, trimming the last one we need.
+	 */
+
+	for (used = 0, total = 0; used < cnt && total < UNSIGNED(n); used++)
+		total += ext[used].len;
+
+	if (total < UNSIGNED(n))
+		goto done;			/* Not enough free blocks */
+
+	ext[used - 1].len -= total - n;
+
+	/*
+	 * Allocate blocks with increasing block numbers, so that the resulting
+	 * vector is sorted.
+	 */
+
+	xqsort(ext, used, sizeof ext[0], big_extent_cmp);
+
+	for (i = 0; i < used; i++) {
+		const struct big_extent *e = &ext[i];
+		size_t bit = e->start & (BIG_BITCOUNT - 1);
+		size_t j;
+
+		/* Make sure we can represent all block numbers in 32 bits */
+		g_assert(size_saturate_add(e->start, e->len - 1) <=
+			MAX_INT_VAL(uint32));
+
+		if (!fetch_bitbuf(db, e->start / BIG_BITCOUNT)) {
+			/* Undo allocations made so far in previous extents */
+			big_file_free_extents(db, ext, i);
+			goto done;
+		}
+
+		for (j = 0; j < e->len; j++) {
+			bit_field_set(dbg->bitbuf, bit + j);
+			bvec = poke_be32(bvec, e->start + j);
+		}
+		dbg->bitbuf_dirty = TRUE;
+	}
+
+	ok = TRUE;
+
+done:
+	WFREE_ARRAY(ext, n);
+	return ok;
+}
+
+#ifdef MMAP
+/**
+ * Check whether big data can be read through the memory-mapped .dat file,
+ * mapping the file if not already done.
+ *
+ * @return TRUE if the .dat file is memory-mapped.
+ */
+static bool
+big_mapped(DBM *db)
+{
+	DBMBIG *dbg = db->big;
+
+	if (!getmmap(db)) {
+		fmap_close_null(&dbg->map);		/* Memory-mapping was turned off */
+		return FALSE;
+	}
+
+	if G_UNLIKELY(NULL == dbg->map)
+		dbg->map = fmap_open(dbg->fd, 0 == (db->flags & DBM_RDONLY));
+
+	return dbg->map != NULL;
+}
+#endif	/* MMAP */
+
+/**
+ * Advise the kernel that we are about to read the data held in the supplied
+ * block numbers, when they are not consecutive.
+ *
+ * Each run of consecutive blocks is read by big_fetch() with a single system
+ * call, but runs are read sequentially: letting the kernel know about all of
+ * them upfront allows it to schedule the I/Os together.
+ *
+ * @param db		the sdbm database
+ * @param bvec		start of block vector, containing block numbers
+ * @param bcnt		amount of blocks in the vector
+ */
+static void
+big_readahead(DBM *db, const void *bvec, int bcnt)
+{
+	DBMBIG *dbg = db->big;
+	const void *p = bvec;
+	uint32 start, prev;
+	int n, runs = 0;
+
+	start = prev = peek_be32(p);
+
+	for (n = 1; n <= bcnt; n++) {
+		uint32 bno = 0;
+
+		if (n < bcnt) {
+			p = const_ptr_add_offset(p, sizeof(uint32));
+			bno = peek_be32(p);
+			if (bno == prev + 1) {
+				prev = bno;
+				continue;
+			}
+		}
+
+		/*
+		 * The first run is going to be read immediately, no need to advise.
+		 */
+
+		if (0 != runs++) {
+			compat_fadvise_willneed(dbg->fd, OFF_DAT(start),
+				(fileoffset_t) (prev - start + 1) * BIG_BLKSIZE);
+		}
+
+		start = prev = bno;
+	}
+
+	if (runs > 1)
+		dbg->bigreadahead++;
+}
+
 /**
  * Fetch data block from the .dat file, reading from the supplied block numbers.
  *
@@ -773,6 +986,7 @@ big_fetch(DBM *db, const void *bvec, size_t len, buf_t *buf)
 	char *q;
 	size_t remain;
 	uint32 prev_bno;
+	bool mapped = FALSE;
 
 	if (-1 == dbg->fd && -1 == big_open(db))
 		return -1;
@@ -782,9 +996,17 @@ big_fetch(DBM *db, const void *bvec, size_t len, buf_t *buf)
 	buf_grow(buf, len);
 
 	/*
-	 * Read consecutive blocks in one single system call.
+	 * Read consecutive blocks in one single system call, after letting
+	 * the kernel know about all the runs we are going to read.
 	 */
 
+#ifdef MMAP
+	mapped = big_mapped(db);
+#endif
+
+	if (bcnt > 1 && !mapped)
+		big_readahead(db, bvec, bcnt);
+
 	n = bcnt;
 	p = bvec;
 	q = buf_data(buf);
@@ -821,6 +1043,13 @@ big_fetch(DBM *db, const void *bvec, size_t len, buf_t *buf)
 			remain = size_saturate_sub(remain, amount);
 		}
 
+#ifdef MMAP
+		if (mapped && fmap_read(dbg->map, q, toread, OFF_DAT(bno))) {
+			dbg->bigmread++;
+			goto next;
+		}
+#endif
+
 		dbg->bigread++;
 		if (-1 == compat_pread(dbg->fd, q, toread, OFF_DAT(bno))) {
 			s_critical("sdbm: \"%s\": "
@@ -831,6 +1060,9 @@ big_fetch(DBM *db, const void *bvec, size_t len, buf_t *buf)
 			return -1;
 		}
 
+#ifdef MMAP
+	next:
+#endif
 		q += toread;
 		dbg->bigread_blk += bigblocks(toread);
 		g_assert(ptr_diff(q, buf_data(buf)) <= buf_size(buf));
@@ -1248,31 +1480,14 @@ retry:
 	/*
 	 * There are no "bcnt" consecutive free blocks in the file.
 	 *
-	 * Before extending the file, we're going to fill the holes as much
-	 * as possible.
+	 * Before extending the file, we're going to fill the holes, using the
+	 * largest free extents to limit fragmentation.  When there are not
+	 * enough free blocks, nothing is allocated and we will use consecutive
+	 * blocks from the new chunk governed by the added empty bitmap.
 	 */
 
-	for (first = 0, q = bvec, n = bcnt; n > 0; n--) {
-		first = big_falloc(db, first + 1);
-		if (0 == first)
-			break;
-		q = poke_be32(q, first);
-	}
-
-	if (0 == n)
-		goto success;		/* Found the requested "bcnt" free blocks */
-
-	/*
-	 * Free the incompletely allocated blocks: since we're about to extend
-	 * the file, we'll use consecutive blocks from the new chunk governed
-	 * by the added empty bitmap.
-	 */
-
-	for (q = bvec, n = bcnt - n; n > 0; n--) {
-		first = peek_be32(q);
-		big_ffree(db, first);
-		q = ptr_add_offset(q, sizeof(uint32));
-	}
+	if (big_falloc_extents(db, bvec, bcnt))
+		goto success;
 
 	/*
 	 * Extend the file by allocating another bitmap.
@@ -1849,6 +2064,11 @@ big_shrink(DBM *db)
 	if (-1 == ftruncate(dbg->fd, offset))
 		return FALSE;
 
+#ifdef MMAP
+	if (dbg->map != NULL)
+		fmap_refresh(dbg->map);
+#endif
+
 	dbg->bitmaps = i + 1;	/* Possibly reduced the amount of bitmaps */
 
 	return TRUE;
@@ -1884,6 +2104,10 @@ big_clear(DBM *db)
 
 	g_assert(dbg->fd != -1);
 
+#ifdef MMAP
+	fmap_close_null(&dbg->map);
+#endif
+
 	if (-1 == fd_forget_and_close(&dbg->fd))
 		return FALSE;
 
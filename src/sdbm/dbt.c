@@ -56,6 +56,7 @@ static bool unlink_db;
 static bool all_keys;
 static bool large_keys, large_values, common_head_tail;
 static bool loose_delete;
+static bool mmapped;
 static bool async_rebuild, async_rebuild_launched;
 static int async_thread = -1;
 
@@ -68,7 +69,7 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-abdeiklprstvwyABCDEKSTUVX] [-R seed] [-c pages]\n"
+		"Usage: %s [-abdeiklprstvwyABCDEKMSTUVX] [-R seed] [-c pages]\n"
 		"       dbname [count]\n"
 		"  -a : rebuild the database asynchronously whilst testing\n"
 		"  -b : rebuild the database\n"
@@ -92,6 +93,7 @@ usage(void)
 		"  -D : enable LRU cache write delay\n"
 		"  -E : empty existing database on write test\n"
 		"  -K : use large keys with common head/tail parts\n"
+		"  -M : access pages through memory-mapping\n"
 		"  -R : seed for repeatable random key sequence\n"
 		"  -S : shrink database before testing\n"
 		"  -T : make database handle thread-safe\n"
@@ -147,6 +149,11 @@ open_db(const char *name, bool writeable, long cache, int wflags)
 		oops("error %sabling write delay for \"%s\"",
 			(wflags & WR_DELAY) ? "en" : "dis", name);
 	}
+	if (mmapped) {
+		if (-1 == sdbm_set_mmap(db, TRUE)) {
+			oops("error enabling memory-mapping for \"%s\"", name);
+		}
+	}
 	if (shrink)
 		sdbm_shrink(db);
 
@@ -659,7 +666,7 @@ main(int argc, char **argv)
 	const char *name;
 	long count;
 	long cache = 0;
-	const char options[] = "aAbBc:CdDeEiklKprR:sStTUvVwxXy";
+	const char options[] = "aAbBc:CdDeEiklKMprR:sStTUvVwxXy";
 
 	progstart(argc, argv);
 
@@ -710,6 +717,9 @@ main(int argc, char **argv)
 			lflag++;
 			thread_safe++;
 			break;
+		case 'M':			/* memory-mapped page access */
+			mmapped++;
+			break;
 		case 'p':			/* show test progress */
 			progress++;
 			break;
@@ -824,6 +834,9 @@ main(int argc, char **argv)
 	if (large_values)
 		printf("Will be using large values.\n");
 
+	if (mmapped)
+		printf("Pages will be accessed through memory-mapping.\n");
+
 	if (cache < 0)
 		oops("cache must be positive (is %ld)", cache);
 
@@ -0,0 +1,306 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Memory-mapped file access.
+ * author: Raphael Manfredi <Raphael_Manfredi@pobox.com>
+ * status: public domain.
+ *
+ * @ingroup sdbm
+ * @file
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "fmap.h"
+
+#include "lib/fd.h"
+#include "lib/halloc.h"
+#include "lib/log.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/unsigned.h"
+#include "lib/vmm.h"
+#include "lib/walloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#ifdef MMAP
+
+#define FMAP_SEGSHIFT	23		/* 8 MiB segments */
+#define FMAP_SEGSIZE	(1 << FMAP_SEGSHIFT)
+#define FMAP_SEGMASK	(FMAP_SEGSIZE - 1)
+
+enum sdbm_fmap_magic { SDBM_FMAP_MAGIC = 0x3b0e6c15 };
+
+/**
+ * A memory-mapped file.
+ *
+ * The file is mapped lazily by fixed-size segments, each segment being mapped
+ * the first time data within it is accessed.  Segments are never moved nor
+ * unmapped until the whole mapping is closed, so that the addresses we hand
+ * out remain stable even when the file grows.
+ *
+ * A segment can extend past the end of the file, which is legitimate, but
+ * accessing data there would raise a SIGBUS.  Hence we track the file size
+ * and refuse to hand out addresses beyond it.
+ *
+ * Read-only files are mapped privately, so that a corrupted page can still be
+ * cleared in memory without affecting the file.
+ */
+struct fmap {
+	enum sdbm_fmap_magic magic;	/* Magic number */
+	int fd;						/* Mapped file descriptor (not owned) */
+	int flags;					/* Mapping flags (shared or private) */
+	fileoffset_t size;			/* Known size of the file */
+	char **seg;					/* Mapped segments, NULL if not mapped yet */
+	size_t segcnt;				/* Size of the `seg' array */
+	unsigned long mapped;		/* Stats: segments mapped */
+	unsigned long failed;		/* Stats: failed segment mappings */
+	unsigned long refreshed;	/* Stats: file size refreshes */
+};
+
+static inline void
+sdbm_fmap_check(const struct fmap * const fm)
+{
+	g_assert(fm != NULL);
+	g_assert(SDBM_FMAP_MAGIC == fm->magic);
+}
+
+/**
+ * Create a new memory mapping for the file.
+ *
+ * Nothing is mapped yet, segments being mapped on demand.
+ *
+ * @param fd		the opened file descriptor (must remain valid)
+ * @param writable	whether changes made to the mapped data reach the file
+ *
+ * @return the new mapping, NULL on error with errno set.
+ */
+struct fmap *
+fmap_open(int fd, bool writable)
+{
+	struct fmap *fm;
+	filestat_t buf;
+
+	g_assert(is_valid_fd(fd));
+
+	if (-1 == fstat(fd, &buf))
+		return NULL;
+
+	WALLOC0(fm);
+	fm->magic = SDBM_FMAP_MAGIC;
+	fm->fd = fd;
+	fm->flags = writable ? MAP_SHARED : MAP_PRIVATE;
+	fm->size = buf.st_size;
+
+	return fm;
+}
+
+/**
+ * Unmap all the segments and free the mapping, nullifying its pointer.
+ *
+ * @attention
+ * All the addresses handed out previously become invalid.
+ */
+void
+fmap_close_null(struct fmap **fm_ptr)
+{
+	struct fmap *fm = *fm_ptr;
+
+	if (fm != NULL) {
+		size_t i;
+
+		sdbm_fmap_check(fm);
+
+		for (i = 0; i < fm->segcnt; i++) {
+			if (fm->seg[i] != NULL)
+				vmm_munmap(fm->seg[i], FMAP_SEGSIZE);
+		}
+
+		HFREE_NULL(fm->seg);
+		fm->magic = 0;
+		WFREE(fm);
+		*fm_ptr = NULL;
+	}
+}
+
+/**
+ * Refresh the known size of the mapped file.
+ *
+ * This must be called after the file was truncated, since addresses beyond
+ * the new end of the file can no longer be accessed.  When the file grows,
+ * this is done automatically when accessing data past the known size.
+ */
+void
+fmap_refresh(struct fmap *fm)
+{
+	filestat_t buf;
+
+	sdbm_fmap_check(fm);
+
+	fm->refreshed++;
+	fm->size = -1 == fstat(fm->fd, &buf) ? 0 : buf.st_size;
+}
+
+/**
+ * Get the address of a mapped segment, mapping it if needed.
+ *
+ * @return the segment start, NULL if we cannot map it.
+ */
+static char *
+fmap_segment(struct fmap *fm, size_t idx)
+{
+	void *p;
+
+	if G_UNLIKELY(idx >= fm->segcnt) {
+		size_t n = MAX(idx + 1, 2 * fm->segcnt);
+
+		HREALLOC_ARRAY(fm->seg, n);
+		memset(&fm->seg[fm->segcnt], 0, (n - fm->segcnt) * sizeof fm->seg[0]);
+		fm->segcnt = n;
+	}
+
+	if G_LIKELY(fm->seg[idx] != NULL)
+		return fm->seg[idx];
+
+	p = vmm_mmap(NULL, FMAP_SEGSIZE, PROT_READ | PROT_WRITE, fm->flags,
+			fm->fd, (fileoffset_t) idx << FMAP_SEGSHIFT);
+
+	if G_UNLIKELY(MAP_FAILED == p) {
+		fm->failed++;
+		return NULL;
+	}
+
+	vmm_madvise_random(p, FMAP_SEGSIZE);	/* Hashed accesses */
+
+	fm->mapped++;
+	return fm->seg[idx] = p;
+}
+
+/**
+ * Get the address of mapped data.
+ *
+ * The data must lie within a single segment, which is guaranteed when the
+ * length is a power of 2 no larger than the segment size and the offset is
+ * a multiple of that length.
+ *
+ * @param fm		the file mapping
+ * @param offset	starting offset of the data in the file
+ * @param len		length of the data
+ *
+ * @return the address of the data, NULL if the data lie beyond the end
+ * of the file or if the segment could not be mapped.
+ */
+char *
+fmap_page(struct fmap *fm, fileoffset_t offset, size_t len)
+{
+	char *seg;
+
+	sdbm_fmap_check(fm);
+	g_assert(offset >= 0);
+	g_assert(size_is_positive(len));
+	g_assert((offset & FMAP_SEGMASK) + len <= FMAP_SEGSIZE);
+
+	if G_UNLIKELY(offset + (fileoffset_t) len > fm->size) {
+		fmap_refresh(fm);
+		if (offset + (fileoffset_t) len > fm->size)
+			return NULL;
+	}
+
+	seg = fmap_segment(fm, offset >> FMAP_SEGSHIFT);
+
+	return NULL == seg ? NULL : seg + (offset & FMAP_SEGMASK);
+}
+
+/**
+ * Copy mapped data, which can span several segments.
+ *
+ * @param fm		the file mapping
+ * @param dst		where data are copied
+ * @param len		length of the data
+ * @param offset	starting offset of the data in the file
+ *
+ * @return TRUE if OK, FALSE if the data lie beyond the end of the file
+ * or if a segment could not be mapped.
+ */
+bool
+fmap_read(struct fmap *fm, void *dst, size_t len, fileoffset_t offset)
+{
+	char *q = dst;
+
+	sdbm_fmap_check(fm);
+	g_assert(offset >= 0);
+
+	if G_UNLIKELY(offset + (fileoffset_t) len > fm->size) {
+		fmap_refresh(fm);
+		if (offset + (fileoffset_t) len > fm->size)
+			return FALSE;
+	}
+
+	while (len != 0) {
+		size_t start = offset & FMAP_SEGMASK;
+		size_t n = MIN(len, FMAP_SEGSIZE - start);
+		char *seg = fmap_segment(fm, offset >> FMAP_SEGSHIFT);
+
+		if G_UNLIKELY(NULL == seg)
+			return FALSE;
+
+		memcpy(q, seg + start, n);
+		q += n;
+		len -= n;
+		offset += n;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Synchronously write back modified mapped data to the file.
+ *
+ * @param fm		the file mapping
+ * @param p			start of the mapped data
+ * @param len		length of the data
+ *
+ * @return TRUE if OK, FALSE on error with errno set.
+ */
+bool
+fmap_sync(struct fmap *fm, const void *p, size_t len)
+{
+	const void *start;
+
+	sdbm_fmap_check(fm);
+
+	if (MAP_PRIVATE == fm->flags)
+		return TRUE;		/* Changes are never written back */
+
+	start = vmm_page_start(p);
+	len = round_pagesize(ptr_diff(p, start) + len);
+
+	return 0 == msync(deconstify_pointer(start), len, MS_SYNC);
+}
+
+/**
+ * Log mapping statistics.
+ *
+ * @param fm		the file mapping
+ * @param name		the database name
+ * @param what		the kind of file mapped
+ */
+void
+fmap_log_stats(const struct fmap *fm, const char *name, const char *what)
+{
+	sdbm_fmap_check(fm);
+
+	s_info("sdbm: \"%s\" %s mapping: %lu segment%s of %u KiB, "
+		"%lu failure%s, %lu size refresh%s",
+		name, what, fm->mapped, plural(fm->mapped), FMAP_SEGSIZE / 1024,
+		fm->failed, plural(fm->failed),
+		fm->refreshed, plural_es(fm->refreshed));
+}
+
+#endif	/* MMAP */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,20 @@
+/* Mini EMBED (fmap.c) */
+#define fmap_open sdbm__fmap_open
+#define fmap_close_null sdbm__fmap_close_null
+#define fmap_page sdbm__fmap_page
+#define fmap_read sdbm__fmap_read
+#define fmap_refresh sdbm__fmap_refresh
+#define fmap_sync sdbm__fmap_sync
+#define fmap_log_stats sdbm__fmap_log_stats
+
+struct fmap;
+
+struct fmap *fmap_open(int, bool);
+void fmap_close_null(struct fmap **);
+char *fmap_page(struct fmap *, fileoffset_t, size_t);
+bool fmap_read(struct fmap *, void *, size_t, fileoffset_t);
+void fmap_refresh(struct fmap *);
+bool fmap_sync(struct fmap *, const void *, size_t);
+void fmap_log_stats(const struct fmap *, const char *, const char *);
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -16,6 +16,7 @@
 #include "sdbm.h"
 #include "tune.h"
 #include "lru.h"
+#include "fmap.h"
 #include "pair.h"				/* For sdbm_page_dump() */
 #include "private.h"
 
@@ -29,11 +30,17 @@
 #include "lib/qlock.h"
 #include "lib/stacktrace.h"
 #include "lib/stringify.h"		/* For plural() */
+#include "lib/thread.h"
 #include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
+#define LRU_READERS_SPIN	100	/* Spins before yielding, waiting readers */
+
+static bool lru_chkpage(DBM *, char *, long);
+static void lru_chkflush(DBM *, char *, long);
+
 #ifdef LRU
 enum sdbm_lru_magic { SDBM_LRU_MAGIC = 0x6a6daa37 };
 
@@ -47,6 +54,11 @@ enum sdbm_lru_magic { SDBM_LRU_MAGIC = 0x6a6daa37 };
  * When the SDBM layer wires pages, they are put in the `wired' list and
  * can no longer be reclaimed, regardless of the configured amount of
  * cached pages, until they are un-wired.
+ *
+ * When memory-mapped access is enabled, pages are accessed directly in the
+ * mapped .pag file instead of being read in the cache, relying on the kernel
+ * page cache.  Only wired pages, and pages lying beyond the end of the file,
+ * are still held in the cache.
  */
 struct lru_cache {
 	enum sdbm_lru_magic magic;	/* Magic number */
@@ -65,8 +77,15 @@ struct lru_cache {
 	unsigned long cp_discarded;	/* Stats: cached pages discarded */
 	unsigned long cp_wired;		/* Stats: cached pages wired */
 	unsigned long cp_mod_wired;	/* Stats: cached pages modified whilst wired */
+	unsigned long cp_pinned;	/* Stats: cached pages pinned for reading */
 	unsigned long cp_dirtied;	/* Stats: cached pages marked dirty */
 	unsigned long cp_flushed;	/* Stats: cached pages flushed */
+#ifdef MMAP
+	struct fmap *map;			/* Memory-mapped .pag file, NULL if none */
+	const char *mapped;			/* Last page address handed out from `map' */
+	uint8 mmap;					/* Whether pages are accessed via `map' */
+	unsigned long mhits;		/* Stats: pages accessed through the map */
+#endif
 };
 
 static inline void
@@ -89,6 +108,10 @@ enum sdbm_lru_cpage_magic { SDBM_LRU_CPAGE_MAGIC = 0x22015b77 };
  * Wiring a page lets the application make sure that page is held in the cache
  * and monitored for changes through its `mstamp' field, which is atomically
  * incremented each time a wired page is changed.
+ *
+ * A wired page can also be "pinned" for reading: its `readers' field counts
+ * the threads reading the page without holding the database lock, and any
+ * modification of the page has to wait until all these readers are gone.
  */
 struct lru_cpage {
 	enum sdbm_lru_cpage_magic magic;	/* Magic number */
@@ -97,6 +120,7 @@ struct lru_cpage {
 	uint was_cached:1;					/* Was in LRU list before being wired */
 	uint invalid:1;						/* Wired page was invalidated */
 	int wirecnt;						/* Amount of wiring done for page */
+	int readers;						/* Readers not holding the DB lock */
 	ulong mstamp;						/* Modification stamp (counter) */
 	long numpag;						/* Cache key: page number within DB */
 	DBM *db;							/* Associated DB */
@@ -203,6 +227,25 @@ sdbm_lru_cpage_get(const DBM *db, const char *pag, bool safe)
 	return deconstify_pointer(cp);
 }
 
+/**
+ * Check whether page address lies in the memory-mapped .pag file.
+ *
+ * The only mapped address that the SDBM layer can use is db->pagbuf, as set
+ * by readbuf(), so it is enough to compare with the last mapped address we
+ * handed out.
+ */
+static inline bool
+lru_is_mapped(const struct lru_cache *cache, const char *pag)
+{
+#ifdef MMAP
+	return cache != NULL && cache->mapped != NULL && pag == cache->mapped;
+#else
+	(void) cache;
+	(void) pag;
+	return FALSE;
+#endif
+}
+
 /**
  * Setup allocated LRU page cache.
  */
@@ -242,6 +285,10 @@ free_cache(struct lru_cache *cache)
 {
 	hevset_foreach(cache->pagnum, free_cached_page, NULL);
 	hevset_free_null(&cache->pagnum);
+#ifdef MMAP
+	fmap_close_null(&cache->map);
+	cache->mapped = NULL;
+#endif
 	elist_discard(&cache->lru);
 	elist_discard(&cache->wired);
 	cache->pages = 0;
@@ -302,10 +349,18 @@ log_lrustats(DBM *db)
 		"created = %lu, freed = %lu, reused = %lu, discarded = %lu",
 		sdbm_name(db), cache->cp_created, cache->cp_freed, cache->cp_reused,
 		cache->cp_discarded);
-	s_info("sdbm: \"%s\" LRU pages wired = %lu, modified-whilst-wired = %lu",
-		sdbm_name(db), cache->cp_wired, cache->cp_mod_wired);
+	s_info("sdbm: \"%s\" LRU pages wired = %lu, modified-whilst-wired = %lu, "
+		"pinned = %lu",
+		sdbm_name(db), cache->cp_wired, cache->cp_mod_wired, cache->cp_pinned);
 	s_info("sdbm: \"%s\" LRU pages dirtied = %lu, flushed = %lu",
 		sdbm_name(db), cache->cp_dirtied, cache->cp_flushed);
+#ifdef MMAP
+	if (cache->map != NULL) {
+		s_info("sdbm: \"%s\" LRU pages accessed through mapping = %lu",
+			sdbm_name(db), cache->mhits);
+		fmap_log_stats(cache->map, sdbm_name(db), ".pag");
+	}
+#endif
 }
 
 /**
@@ -327,6 +382,12 @@ lru_page_log(const DBM *db, const char *pag)
 	sdbm_lru_check(cache);
 	assert_sdbm_locked(db);
 
+	if (lru_is_mapped(cache, pag)) {
+		s_info("sdbm: \"%s\": %p is memory-mapped: page #%ld",
+			sdbm_name(db), pag, db->pagbno);
+		return;
+	}
+
 	cp = sdbm_lru_cpage_get(db, pag, TRUE);
 
 	if (NULL == cp) {
@@ -566,7 +627,7 @@ setcache(DBM *db, uint pages)
 	 * provided that db->pagbno is valid.
 	 */
 
-	if (db->pagbno != -1) {
+	if (db->pagbno != -1 && !lru_is_mapped(cache, db->pagbuf)) {
 		struct lru_cpage *cp = sdbm_lru_cpage_get(db, db->pagbuf, TRUE);
 
 		g_assert_log(cp != NULL,
@@ -645,6 +706,66 @@ getwdelay(const DBM *db)
 	return cache != NULL && cache->write_deferred;
 }
 
+/**
+ * Turn memory-mapped page access on or off.
+ * @return -1 on error with errno set, 0 if OK.
+ */
+int
+setmmap(DBM *db, bool on)
+{
+#ifdef MMAP
+	struct lru_cache *cache = db->cache;
+
+	if (NULL == cache)
+		init_cache(db, LRU_PAGES, FALSE);
+
+	cache = db->cache;
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+	if (on == cache->mmap)
+		return 0;
+
+	/*
+	 * When turning mapping off, db->pagbuf must no longer point within
+	 * the mapped file since we are going to unmap it.
+	 */
+
+	if (!on) {
+		if (lru_is_mapped(cache, db->pagbuf)) {
+			db->pagbno = -1;
+			db->pagbuf = NULL;
+		}
+		fmap_close_null(&cache->map);
+		cache->mapped = NULL;
+	}
+
+	cache->mmap = on;
+	return 0;
+#else
+	(void) db;
+	(void) on;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * @return whether memory-mapped page access is enabled.
+ */
+bool
+getmmap(const DBM *db)
+{
+#ifdef MMAP
+	const struct lru_cache *cache = db->cache;
+
+	return cache != NULL && cache->mmap;
+#else
+	(void) db;
+	return FALSE;
+#endif
+}
+
 /**
  * Close (i.e. free) the LRU page cache.
  *
@@ -667,13 +788,45 @@ lru_close(DBM *db)
 	}
 }
 
+/**
+ * Wait until all the readers that pinned the page are gone.
+ *
+ * Readers do not need the database lock to unpin the page, and no new reader
+ * can come since we own the lock, so this cannot deadlock.  Readers only
+ * look up one key on the page, hence we should not have to wait for long.
+ */
+static void
+lru_wait_readers(const DBM *db, struct lru_cpage *cp)
+{
+	uint i;
+
+	assert_sdbm_locked(db);
+
+	for (i = 0; 0 != atomic_int_get(&cp->readers); i++) {
+		if (i < LRU_READERS_SPIN)
+			atomic_mb();
+		else
+			thread_yield();
+	}
+}
+
 /**
  * Signal that we are about to modify the specified page.
  */
 void
 modifypag(const DBM *db, const char *pag)
 {
-	struct lru_cpage *cp = sdbm_lru_cpage_get(db, pag, FALSE);
+	struct lru_cpage *cp;
+
+	/*
+	 * A memory-mapped page cannot be wired since wired pages are always
+	 * held in the cache, hence there is nothing to track.
+	 */
+
+	if (lru_is_mapped(db->cache, pag))
+		return;
+
+	cp = sdbm_lru_cpage_get(db, pag, FALSE);
 
 	g_assert_log(cp != NULL,		/* Page must be cached */
 		"%s(): sdbm \"%s\": %p not in LRU cache (pagbuf=%p, pabgno=%ld)",
@@ -687,6 +840,7 @@ modifypag(const DBM *db, const char *pag)
 	 */
 
 	if G_UNLIKELY(cp->wired) {
+		lru_wait_readers(db, cp);
 		ATOMIC_INC(&cp->mstamp);
 
 		sdbm_lru_check(db->cache);
@@ -751,6 +905,14 @@ lru_wire(DBM *db, long num, ulong *mstamp)
 		}
 		cp->numpag = num;
 		hevset_insert(cache->pagnum, cp);
+
+		/*
+		 * From now on, the page is accessed through its wired copy: if the
+		 * current page is the memory-mapped version, force a reload.
+		 */
+
+		if (db->pagbno == num && lru_is_mapped(cache, db->pagbuf))
+			db->pagbno = -1;
 	}
 
 	g_assert(cp->wired);
@@ -781,6 +943,76 @@ lru_wired_mstamp(DBM *db, const char *pag)
 	return cp->mstamp;
 }
 
+/**
+ * Pin a cached page for reading without holding the database lock.
+ *
+ * The page is wired, so that it cannot be evicted, and flagged as being read:
+ * any thread willing to modify the page will have to wait until the page is
+ * unpinned.  Pages that are not already cached are not pinned, since that
+ * would mean reading them from disk and then dropping them on unwiring.
+ *
+ * Once the page has been read, it must be unpinned by lru_unpin() without
+ * holding the lock, then unwired with the lock held again.
+ *
+ * @param db		the database (locked)
+ * @param num		the page number to pin
+ *
+ * @return the base address of the pinned page, NULL if the page is not cached.
+ */
+const char *
+lru_pin(DBM *db, long num)
+{
+	struct lru_cache *cache = db->cache;
+	struct lru_cpage *cp;
+	const char *pag;
+
+	sdbm_check(db);
+	assert_sdbm_locked(db);
+	g_assert(num >= 0);
+
+	if G_UNLIKELY(NULL == cache)
+		return NULL;
+
+	sdbm_lru_check(cache);
+
+	cp = hevset_lookup(cache->pagnum, &num);
+
+	if (NULL == cp || cp->invalid)
+		return NULL;
+
+	pag = lru_wire(db, num, NULL);
+
+	g_assert(pag == cp->page);
+
+	cache->rhits++;
+	cache->cp_pinned++;
+	atomic_int_inc(&cp->readers);
+
+	return pag;
+}
+
+/**
+ * Unpin page previously pinned for reading by lru_pin().
+ *
+ * This routine must be called WITHOUT holding the database lock, since the
+ * thread willing to modify the page waits for its readers with the lock held.
+ * The page remains wired and must be unwired by lru_unwire() afterwards.
+ */
+void
+lru_unpin(DBM *db, const char *pag)
+{
+	struct lru_cpage *cp;
+
+	sdbm_check(db);
+
+	cp = sdbm_lru_cpage_get(db, pag, FALSE);
+
+	g_assert_log(cp != NULL, "%s(): page %p is not cached", G_STRFUNC, pag);
+	g_assert_log(cp->wired,  "%s(): page %p is not wired",  G_STRFUNC, pag);
+
+	atomic_int_dec(&cp->readers);
+}
+
 /**
  * Unwire a wired cache page.
  *
@@ -807,6 +1039,8 @@ lru_unwire(DBM *db, const char *pag)
 	if (0 != --cp->wirecnt)
 		return;
 
+	g_assert(0 == atomic_int_get(&cp->readers));
+
 	elist_remove(&cache->wired, cp);
 	cp->wired = FALSE;
 
@@ -826,7 +1060,7 @@ lru_unwire(DBM *db, const char *pag)
 
 			sdbm_lru_cpage_valid(old, db);
 
-			if (old->dirty && writebuf(old)) {
+			if (!old->dirty || writebuf(old)) {
 				if (db->pagbno == old->numpag)
 					db->pagbno = -1;
 				elist_remove(&cache->lru, old);
@@ -877,6 +1111,45 @@ freepage:
 	}
 }
 
+/**
+ * Mark current memory-mapped page as dirty.
+ *
+ * The page is already held in the kernel page cache and will be written back
+ * by the kernel, hence there is nothing to do unless ``force'' is TRUE, in
+ * which case we synchronously write it back.
+ *
+ * @return TRUE on success.
+ */
+static bool
+dirtymap(DBM *db, bool force)
+{
+#ifdef MMAP
+	struct lru_cache *cache = db->cache;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+	lru_chkflush(db, db->pagbuf, db->pagbno);
+
+	cache->cp_dirtied++;
+	db->pagwrite++;
+
+	if G_UNLIKELY(force && !fmap_sync(cache->map, db->pagbuf, DBM_PBLKSIZ)) {
+		s_warning("sdbm: \"%s\": cannot sync mapped page #%ld: %m",
+			sdbm_name(db), db->pagbno);
+		ioerr(db, TRUE);
+		db->flush_errors++;
+		return FALSE;
+	}
+
+	return TRUE;
+#else
+	(void) db;
+	(void) force;
+	g_assert_not_reached();
+#endif
+}
+
 /**
  * Mark current page as dirty.
  * If there are no deferred writes, the page is immediately flushed to disk.
@@ -887,7 +1160,12 @@ bool
 dirtypag(DBM *db, bool force)
 {
 	struct lru_cache *cache = db->cache;
-	struct lru_cpage *cp = sdbm_lru_cpage_get(db, db->pagbuf, FALSE);
+	struct lru_cpage *cp;
+
+	if (lru_is_mapped(cache, db->pagbuf))
+		return dirtymap(db, force);
+
+	cp = sdbm_lru_cpage_get(db, db->pagbuf, FALSE);
 
 	g_assert_log(cp != NULL,		/* Page must be cached */
 		"%s(): sdbm \"%s\": %p not in LRU cache (pabgno=%ld)",
@@ -1095,6 +1373,7 @@ lru_discard_wired_page(struct lru_cpage *cp, long bno)
 	g_assert(cp->wired);
 
 	if (cp->numpag >= bno) {
+		lru_wait_readers(cp->db, cp);
 		ATOMIC_INC(&cp->mstamp);
 		cp->dirty = FALSE;
 		cp->invalid = TRUE;
@@ -1127,6 +1406,26 @@ lru_discard(DBM *db, long bno)
 
 	if (db->pagbno >= bno)
 		db->pagbno = -1;		/* We discarded that old page */
+
+#ifdef MMAP
+	/*
+	 * When discarding all the pages, the .pag file is being cleared or
+	 * replaced, so we unmap it: it will be mapped again when needed.
+	 * Otherwise the file was truncated and we must not access the pages
+	 * that were beyond the new end of the file.
+	 */
+
+	if (cache->map != NULL) {
+		if (0 == bno) {
+			if (lru_is_mapped(cache, db->pagbuf))
+				db->pagbuf = NULL;
+			fmap_close_null(&cache->map);
+			cache->mapped = NULL;
+		} else {
+			fmap_refresh(cache->map);
+		}
+	}
+#endif
 }
 
 /**
@@ -1207,6 +1506,39 @@ lru_tail_offset(const DBM *db)
 	return OFF_PAG(bno + 1);
 }
 
+#ifdef MMAP
+/**
+ * Get the address of a page within the memory-mapped .pag file, mapping the
+ * file if not already done.
+ *
+ * Pages lying beyond the end of the file cannot be accessed through the
+ * mapping (that would raise a SIGBUS), so they need to be held in the cache
+ * until they are flushed to disk.
+ *
+ * @return the page address, NULL if the page cannot be accessed through the
+ * mapping.
+ */
+static char *
+lru_mapped_page(DBM *db, long num)
+{
+	struct lru_cache *cache = db->cache;
+
+	g_assert(cache->mmap);
+
+	if G_UNLIKELY(NULL == cache->map) {
+		cache->map = fmap_open(db->pagf, 0 == (db->flags & DBM_RDONLY));
+		if (NULL == cache->map) {
+			s_warning("sdbm: \"%s\": cannot map .pag file, "
+				"disabling memory-mapped access: %m", sdbm_name(db));
+			cache->mmap = FALSE;
+			return NULL;
+		}
+	}
+
+	return fmap_page(cache->map, OFF_PAG(num), DBM_PBLKSIZ);
+}
+#endif	/* MMAP */
+
 /**
  * Get a suitable buffer in the cache to read a page and set db->pagbuf
  * accordingly.
@@ -1238,6 +1570,24 @@ readbuf(DBM *db, long num, bool *loaded)
 		cached = TRUE;
 		cache->rhits++;
 	} else {
+#ifdef MMAP
+		if (cache->mmap) {
+			char *pag = lru_mapped_page(db, num);
+
+			if (pag != NULL) {
+				(void) lru_chkpage(db, pag, num);
+				cache->mapped = pag;
+				cache->mhits++;
+				db->pagbuf = pag;
+				if (loaded != NULL)
+					*loaded = TRUE;		/* Page is readily accessible */
+				return TRUE;
+			}
+
+			/* FALL THROUGH -- page beyond the end of the file, cache it */
+		}
+#endif	/* MMAP */
+
 		cp = getcpage(db, num);
 		if (NULL == cp)
 			return FALSE;	/* Do not update db->pagbuf */
@@ -1324,6 +1674,9 @@ cachepag(DBM *db, char *pag, long num)
 		 * Supersede cached page with new page created by makroom().
 		 */
 
+		if G_UNLIKELY(cp->wired)
+			lru_wait_readers(db, cp);
+
 		memmove(cpag, pag, DBM_PBLKSIZ);
 
 		if (cache->write_deferred) {
@@ -1332,7 +1685,25 @@ cachepag(DBM *db, char *pag, long num)
 			cp->dirty = !flushpag(db, pag, num);
 		}
 		return TRUE;
-	} else if (cache->write_deferred) {
+	}
+
+#ifdef MMAP
+	/*
+	 * If the new page lies within the mapped .pag file, write it there.
+	 */
+
+	if (cache->mmap) {
+		char *mpag = lru_mapped_page(db, num);
+
+		if (mpag != NULL) {
+			memmove(mpag, pag, DBM_PBLKSIZ);
+			db->pagwrite++;
+			return TRUE;
+		}
+	}
+#endif	/* MMAP */
+
+	if (cache->write_deferred) {
 		cp = getcpage(db, num);
 		if (NULL == cp)
 			return FALSE;
@@ -1366,6 +1737,25 @@ lru_chkpage(DBM *db, char *pag, long num)
 	return TRUE;
 }
 
+/**
+ * Make sure page we are about to write back is valid.
+ */
+static void
+lru_chkflush(DBM *db, char *pag, long num)
+{
+	/*
+	 * We cannot write back a corrupted page: if we do, it means something
+	 * went wrong in the SDBM internal processing and it needs to be fixed!
+	 */
+
+	if G_UNLIKELY(!lru_chkpage(db, pag, num)) {
+		sdbm_page_dump(db, pag, num);
+		s_error("SDBM internal page corruption for %s\"%s\" (refcnt=%d)",
+			sdbm_is_thread_safe(db) ? "thread-safe " :"", sdbm_name(db),
+			sdbm_refcnt(db));
+	}
+}
+
 /**
  * Read page `num' from disk into `pag'.
  * @return TRUE on success.
@@ -1440,17 +1830,7 @@ flushpag(DBM *db, char *pag, long num)
 	assert_sdbm_locked(db);
 	g_assert(num >= 0);
 
-	/*
-	 * We cannot write back a corrupted page: if we do, it means something
-	 * went wrong in the SDBM internal processing and it needs to be fixed!
-	 */
-
-	if G_UNLIKELY(!lru_chkpage(db, pag, num)) {
-		sdbm_page_dump(db, pag, num);
-		s_error("SDBM internal page corruption for %s\"%s\" (refcnt=%d)",
-			sdbm_is_thread_safe(db) ? "thread-safe " :"", sdbm_name(db),
-			sdbm_refcnt(db));
-	}
+	lru_chkflush(db, pag, num);
 
 	db->pagwrite++;
 	w = compat_pwrite(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
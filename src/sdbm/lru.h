@@ -7,6 +7,8 @@
 #define lru_tail_offset sdbm__lru_tail_offset
 #define lru_wire sdbm__lru_wire
 #define lru_unwire sdbm__lru_unwire
+#define lru_pin sdbm__lru_pin
+#define lru_unpin sdbm__lru_unpin
 #define lru_page_log sdbm__lru_page_log
 #define readbuf sdbm__readbuf
 #define flushpag sdbm__flushpag
@@ -17,6 +19,8 @@
 #define getcache sdbm__getcache
 #define setwdelay sdbm__setwdelay
 #define getwdelay sdbm__getwdelay
+#define setmmap sdbm__setmmap
+#define getmmap sdbm__getmmap
 #define cachepag sdbm__cachepag
 #define readpag sdbm__readpag
 
@@ -32,6 +36,8 @@ int setcache(DBM *, uint);
 uint getcache(const DBM *);
 int setwdelay(DBM *, bool);
 bool getwdelay(const DBM *);
+int setmmap(DBM *, bool);
+bool getmmap(const DBM *);
 bool cachepag(DBM *, char *, long);
 char *lru_cached_page(DBM *, long);
 void lru_discard(DBM *, long);
@@ -40,6 +46,8 @@ fileoffset_t lru_tail_offset(const DBM *);
 const char *lru_wire(DBM *, long, ulong *);
 ulong lru_wired_mstamp(DBM *, const char *);
 void lru_unwire(DBM *, const char *);
+const char *lru_pin(DBM *, long);
+void lru_unpin(DBM *, const char *);
 void lru_page_log(const DBM *, const char *);
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -671,6 +671,68 @@ exipair(DBM *db, const char *pag, datum key)
 	return seepair(db, pag, ino[0], key.dptr, key.dsize) != 0;
 }
 
+/**
+ * Look for key in a page pinned in the LRU cache, without the database lock.
+ *
+ * Since we do not hold the lock, we cannot access the .dat file and we must
+ * not log anything about the page: whenever we see a big key or value, or
+ * anything that looks inconsistent, we let the caller redo the lookup the
+ * regular way, with the database locked.
+ *
+ * @param db	the database (unlocked)
+ * @param pag	the pinned page
+ * @param key	the key we are looking for
+ * @param val	if non-NULL, filled with the value, pointing within the page
+ *
+ * @return 1 if key was found, 0 if missing, -1 if the lookup cannot be
+ * performed without the database locked.
+ */
+int
+getpair_pinned(const DBM *db, const char *pag, datum key, datum *val)
+{
+	const unsigned short *ino = INO(pag);
+	unsigned short n = ino[0];
+	size_t off = DBM_PBLKSIZ;
+	unsigned i;
+
+	sdbm_check(db);
+
+	if G_UNLIKELY(n > INO_MAX || (n & 0x1))
+		return -1;
+
+	for (i = 1; i < n; i += 2) {
+		unsigned short koff = poffset(ino[i]);
+		unsigned short voff = poffset(ino[i + 1]);
+
+		if G_UNLIKELY(
+			!pair_offset_is_valid(koff, n) ||
+			!pair_offset_is_valid(voff, n) ||
+			voff > koff || koff > off
+		)
+			return -1;
+
+		if G_UNLIKELY(is_big(ino[i]))
+			return -1;
+
+		if (
+			key.dsize == off - koff &&
+			0 == memcmp(key.dptr, pag + koff, key.dsize)
+		) {
+			if G_UNLIKELY(is_big(ino[i + 1]))
+				return -1;
+			if (val != NULL) {
+				val->dptr = deconstify_pointer(pag + voff);
+				val->dsize = koff - voff;
+			}
+			return 1;
+		}
+
+		off = voff;
+	}
+
+	return 0;
+}
+
 #ifdef SEEDUPS
 bool
 duppair(DBM *db, const char *pag, datum key)
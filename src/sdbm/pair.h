@@ -6,6 +6,7 @@
 #define getnkey sdbm__getnkey
 #define getnval sdbm__getnval
 #define getpair sdbm__getpair
+#define getpair_pinned sdbm__getpair_pinned
 #define putpair sdbm__putpair
 #define splpage sdbm__splpage
 #define delnpair sdbm__delnpair
@@ -67,6 +68,7 @@ extern bool fitpair(const DBM *, const char *, size_t);
 extern bool putpair(DBM *, char *, datum, datum);
 extern datum getpair(DBM *, char *, datum);
 extern bool exipair(DBM *, const char *, datum);
+extern int getpair_pinned(const DBM *, const char *, datum, datum *);
 extern bool delpair(DBM *, char *, datum);
 extern bool delnpair(DBM *, char *, int);
 extern bool delipair(DBM *, char *, int, bool);
@@ -5,6 +5,7 @@
  */
 
 struct DBMBIG;
+struct DBMREB;
 struct qlock;			/* Avoid including "qlock.h" here */
 struct lru_cache;
 
@@ -34,6 +35,7 @@ struct DBM {
 	int refcnt;			/* reference count */
 #endif
 	struct DBM *rdb;	/* if non-NULL, concurrent DB rebuild in progress */
+	struct DBMREB *reb;	/* if non-NULL, incremental DB rebuild in progress */
 	fileoffset_t pagtail;	/* end of page file descriptor, for iterating */
 	long maxbno;		/* size of dirfile in bits */
 	long curbit;		/* current bit number */
@@ -178,5 +180,6 @@ ioerr(DBM *db, bool on_write)
 
 void sdbm_return_free(struct dbm_returns *r);
 datum *sdbm_datum_copy(datum *v, struct dbm_returns *r);
+void sdbm_rebuild_discard(DBM *db);
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -18,6 +18,7 @@
 #include "private.h"
 #include "big.h"
 #include "lru.h"
+#include "pair.h"
 #include "tmp.h"
 
 #include "lib/halloc.h"
@@ -26,6 +27,8 @@
 #include "lib/qlock.h"
 #include "lib/random.h"
 #include "lib/str.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -54,7 +57,7 @@ sdbm_can_rebuild(const DBM *db, bool async)
 		errno = EBUSY;		/* Already iterating */
 		return FALSE;
 	}
-	if (async && db->rdb != NULL) {
+	if (db->rdb != NULL) {
 		errno = EBUSY;		/* Already rebuilding concurrently */
 		return FALSE;
 	}
@@ -95,6 +98,60 @@ sdbm_attr_propagate(DBM *ndb, const DBM *db)
 	if (cache != 0)				sdbm_set_cache(ndb, cache);
 }
 
+/**
+ * Create the new database to which data are copied during a rebuild.
+ *
+ * The temporary extension is recorded so that, if the process dies during
+ * the rebuild, the dead files can be reclaimed by sdbm_cleanup().  It is
+ * up to the caller to remove that extension once the rebuild is over.
+ *
+ * @param db		the database we're rebuilding
+ * @param ext		the temporary extension to use for the new files
+ *
+ * @return the new database, NULL on error with errno set.
+ */
+static DBM *
+sdbm_rebuild_create(DBM *db, const char *ext)
+{
+	DBM *ndb;
+	char *dirname, *pagname, *datname;
+
+	assert_sdbm_locked(db);
+
+	dirname = h_strconcat(db->dirname, ext, NULL_PTR);
+	pagname = h_strconcat(db->pagname, ext, NULL_PTR);
+	datname =
+		NULL == db->datname ? NULL : h_strconcat(db->datname, ext, NULL_PTR);
+
+	tmp_add(db, ext);
+
+	/*
+	 * Regardless of whether the database being rebuilt was opened read-only,
+	 * we open the new database for writing (O_WRONLY will become O_RDWR
+	 * internally, but the intent is that we write to it for now).
+	 *
+	 * Flags will be properly restored to match the original once the copy
+	 * has been done and we are ready to replace the old descriptor.
+	 */
+
+	ndb = sdbm_prep(dirname, pagname, datname,
+		O_WRONLY | O_CREAT | O_EXCL, db->openmode);
+
+	/*
+	 * Propagates attributes to the new database: cache size, write delay,
+	 * volatility status, etc...
+	 */
+
+	if (ndb != NULL)
+		sdbm_attr_propagate(ndb, db);
+
+	HFREE_NULL(dirname);
+	HFREE_NULL(pagname);
+	HFREE_NULL(datname);
+
+	return ndb;
+}
+
 /**
  * After the rebuild operation is complete and we have a new database
  * descriptor, replace the original descriptor with the new one and
@@ -230,7 +287,6 @@ sdbm_rebuild_internal(DBM *db, bool async)
 {
 	DBM *ndb;
 	char ext[11];
-	char *dirname, *pagname, *datname;
 	int error = 0, result;
 	datum key;
 	unsigned items = 0, skipped = 0, duplicate = 0;
@@ -243,43 +299,14 @@ sdbm_rebuild_internal(DBM *db, bool async)
 		goto failed;		/* errno was already set */
 
 	str_bprintf(ARYLEN(ext), ".%08x%c", random_u32(), async ? '~' : '\0');
-	dirname = h_strconcat(db->dirname, ext, NULL_PTR);
-	pagname = h_strconcat(db->pagname, ext, NULL_PTR);
-	datname =
-		NULL == db->datname ? NULL : h_strconcat(db->datname, ext, NULL_PTR);
-
-	/*
-	 * Record the temporary extension associated with the rebuilt db.
-	 * That way, if the process dies during rebuild, the dead files will
-	 * be able to be reclaimed when they run sdbm_cleanup().
-	 */
-
-	tmp_add(db, ext);
-
-	/*
-	 * Regardless of whether the database being rebuilt was opened read-only,
-	 * we open the new database for writing (O_WRONLY will become O_RDWR
-	 * internally, but the intent is that we write to it for now).
-	 *
-	 * Flags will be properly restored to match the original once the copy
-	 * has been done and we are ready to replace the old descriptor.
-	 */
 
-	ndb = sdbm_prep(dirname, pagname, datname,
-		O_WRONLY | O_CREAT | O_EXCL, db->openmode);
+	ndb = sdbm_rebuild_create(db, ext);
 
 	if (NULL == ndb) {
 		error = errno;
 		goto error;
 	}
 
-	/*
-	 * Propagates attributes to the new database: cache size, write delay,
-	 * volatility status, etc...
-	 */
-
-	sdbm_attr_propagate(ndb, db);
-
 	/*
 	 * If rebuild is done asynchronously, the database is not kept locked.
 	 * We are going to loosely iterate over the database, copying each page
@@ -366,10 +393,6 @@ rebuilt:
 	/* FALL THROUGH */
 
 error:
-	HFREE_NULL(dirname);
-	HFREE_NULL(pagname);
-	HFREE_NULL(datname);
-
 	tmp_remove(db, ext);
 
 	if (ndb != NULL) {
@@ -442,4 +465,311 @@ sdbm_rebuild_async(DBM *db)
 	return sdbm_rebuild_internal(db, TRUE);
 }
 
+#ifdef LRU
+
+/**
+ * Incremental rebuild state.
+ */
+struct DBMREB {
+	char ext[11];				/* temporary extension of new database */
+	long bno;					/* next page to copy */
+	ulong pages;				/* stats: amount of pages copied */
+	ulong items;				/* stats: amount of items copied */
+	struct dbm_returns key;		/* copied key */
+	struct dbm_returns value;	/* copied value */
+};
+
+/**
+ * Start an incremental rebuild of the database.
+ *
+ * The new database is created and all the subsequent writes and deletions
+ * made to the database are replicated there.  The original pages are then
+ * copied to the new database by calling sdbm_rebuild_step() repeatedly,
+ * which only keeps the database locked whilst it copies a few pages.
+ *
+ * @return 0 if OK, -1 on failure with errno set.
+ */
+int
+sdbm_rebuild_start(DBM *db)
+{
+	struct DBMREB *reb;
+	DBM *ndb;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if (!sdbm_can_rebuild(db, TRUE))
+		goto failed;		/* errno was already set */
+
+	g_assert(NULL == db->reb);
+
+	WALLOC0(reb);
+	str_bprintf(ARYLEN(reb->ext), ".%08x~", random_u32());
+
+	ndb = sdbm_rebuild_create(db, reb->ext);
+
+	if (NULL == ndb) {
+		int error = errno;
+		tmp_remove(db, reb->ext);
+		WFREE(reb);
+		errno = error;
+		goto failed;
+	}
+
+	db->rdb = ndb;		/* Where all write / delete are now duplicated */
+	db->reb = reb;
+
+	sdbm_return(db, 0);
+
+failed:
+	sdbm_return(db, -1);
+}
+
+/**
+ * Discard the incremental rebuild state, unlinking the new database.
+ *
+ * This is also called when closing a database that is being rebuilt.
+ */
+void
+sdbm_rebuild_discard(DBM *db)
+{
+	struct DBMREB *reb = db->reb;
+
+	g_assert(reb != NULL);
+
+	if (db->rdb != NULL) {
+		sdbm_unlink(db->rdb);
+		db->rdb = NULL;
+	}
+
+	tmp_remove(db, reb->ext);
+	sdbm_return_free(&reb->key);
+	sdbm_return_free(&reb->value);
+	WFREE(reb);
+	db->reb = NULL;
+}
+
+/**
+ * Copy all the pairs held on a wired page to the new database.
+ *
+ * @return TRUE if OK, FALSE on I/O error.
+ */
+static bool
+sdbm_rebuild_page(DBM *db, const char *pag)
+{
+	struct DBMREB *reb = db->reb;
+	int i, cnt = paircount(pag);
+
+	for (i = 1; i <= cnt; i++) {
+		datum d, *key, *value;
+
+		/*
+		 * Take private copies, since big keys and values are returned in
+		 * a scratch buffer that is reused on the next access.
+		 */
+
+		d = getnkey(db, pag, i);
+		key = sdbm_datum_copy(&d, &reb->key);
+		d = getnval(db, pag, i);
+		value = sdbm_datum_copy(&d, &reb->value);
+
+		if G_UNLIKELY(NULL == key->dptr || NULL == value->dptr)
+			continue;		/* Unreadable big key or value, skip */
+
+		/*
+		 * Keys written to since the rebuild started are already present
+		 * in the new database with their latest value, hence DBM_INSERT.
+		 * Keys deleted before we reach their page are not seen here, and
+		 * deletions made afterwards are replicated.  Page splits only move
+		 * keys forward, so we will not miss any key.
+		 */
+
+		if (-1 == sdbm_store(db->rdb, *key, *value, DBM_INSERT))
+			return FALSE;
+
+		reb->items++;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Perform one step of an incremental rebuild, copying at most ``pages''
+ * pages to the new database.
+ *
+ * When all the pages have been copied, the new database replaces the old
+ * one atomically.
+ *
+ * @param db		the database being rebuilt
+ * @param pages		maximum amount of pages to copy
+ *
+ * @return 1 when the rebuild is completed, 0 if more steps are needed, -1
+ * on error with errno set, the rebuild being cancelled.
+ */
+int
+sdbm_rebuild_step(DBM *db, long pages)
+{
+	struct DBMREB *reb;
+	fileoffset_t pagtail, lrutail;
+	long n;
+	int error;
+
+	sdbm_check(db);
+	g_assert(pages > 0);
+
+	sdbm_synchronize(db);
+
+	reb = db->reb;
+
+	if G_UNLIKELY(NULL == reb) {
+		errno = EINVAL;		/* No incremental rebuild in progress */
+		goto failed;
+	}
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		error = ESTALE;
+		goto cancel;
+	}
+
+	if G_UNLIKELY(NULL == db->cache)
+		lru_init(db);
+
+	/*
+	 * Find out the true database end, accounting for possibly cached pages
+	 * that have not yet been flushed to disk.
+	 */
+
+	pagtail = lseek(db->pagf, 0L, SEEK_END);
+	lrutail = lru_tail_offset(db);
+
+	if (lrutail > pagtail)
+		pagtail = lrutail - 1;
+
+	for (n = 0; n < pages && OFF_PAG(reb->bno) <= pagtail; n++, reb->bno++) {
+		const char *pag = lru_wire(db, reb->bno, NULL);
+		bool ok;
+
+		if G_UNLIKELY(NULL == pag)
+			continue;		/* Skip unreadable page */
+
+		ok = sdbm_rebuild_page(db, pag);
+		lru_unwire(db, pag);
+
+		if G_UNLIKELY(!ok || sdbm_error(db->rdb)) {
+			error = EIO;
+			goto cancel;
+		}
+
+		reb->pages++;
+	}
+
+	if (OFF_PAG(reb->bno) <= pagtail)
+		sdbm_return(db, 0);		/* More pages to copy */
+
+	/*
+	 * All the pages were copied, the new database can replace the old one.
+	 */
+
+	if G_UNLIKELY(sdbm_error(db->rdb)) {
+		error = EIO;
+		goto cancel;
+	}
+
+	{
+		DBM *ndb = db->rdb;
+
+		db->rdb = NULL;		/* Done copying, no more replication */
+		db->reb = NULL;		/* Descriptor replacement will copy db over */
+
+		error = sdbm_replace_descriptor(db, ndb);
+
+		db->reb = reb;
+		sdbm_rebuild_discard(db);
+	}
+
+	if (0 != error) {
+		errno = error;
+		goto failed;
+	}
+
+	sdbm_return(db, 1);
+
+cancel:
+	errno = error;
+	s_warning("sdbm: \"%s\": cancelling incremental rebuild after %lu page%s: "
+		"%m", sdbm_name(db), reb->pages, plural(reb->pages));
+	sdbm_rebuild_discard(db);
+	errno = error;
+
+	/* FALL THROUGH */
+
+failed:
+	sdbm_return(db, -1);
+}
+
+/**
+ * Cancel an incremental rebuild, if any is in progress.
+ */
+void
+sdbm_rebuild_cancel(DBM *db)
+{
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if (db->reb != NULL)
+		sdbm_rebuild_discard(db);
+
+	sdbm_unsynchronize(db);
+}
+
+#else	/* !LRU */
+
+/*
+ * Incremental rebuild needs to wire pages in the LRU cache.
+ */
+
+int
+sdbm_rebuild_start(DBM *db)
+{
+	(void) db;
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+sdbm_rebuild_step(DBM *db, long pages)
+{
+	(void) db;
+	(void) pages;
+	errno = EINVAL;
+	return -1;
+}
+
+void
+sdbm_rebuild_cancel(DBM *db)
+{
+	(void) db;
+}
+
+void
+sdbm_rebuild_discard(DBM *db)
+{
+	(void) db;
+}
+
+#endif	/* LRU */
+
+/**
+ * @return whether an incremental rebuild is in progress.
+ */
+bool
+sdbm_is_rebuilding(const DBM *db)
+{
+	sdbm_check(db);
+
+	return db->reb != NULL;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
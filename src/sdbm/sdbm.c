@@ -47,6 +47,7 @@ const datum nullitem = {0, 0};
 static bool getdbit(DBM *, long);
 static bool setdbit(DBM *, long);
 static bool getpage(DBM *, long);
+static long getpageb(DBM *, long, bool);
 static datum getnext(DBM *);
 static bool makroom(DBM *, long, size_t);
 static void validpage(DBM *, long);
@@ -941,6 +942,9 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 		big_close(db);
 #endif
 
+	if (db->reb != NULL)
+		sdbm_rebuild_discard(db);	/* Also unlinks db->rdb */
+
 	if (db->rdb != NULL) {
 		sdbm_unlink(db->rdb);
 		db->rdb = NULL;
@@ -1098,6 +1102,57 @@ sdbm_close(DBM *db)
 	}													\
 } G_STMT_END
 
+#if defined(THREADS) && defined(LRU)
+/**
+ * Look up key on its page, searching the page without holding the lock.
+ *
+ * When the page is already held in the LRU cache, it is pinned there and
+ * the database lock is released whilst we look for the key and copy the
+ * value: other threads can access the database concurrently, with writers
+ * only waiting for us if they need to modify the page we are reading.
+ *
+ * The database must be locked on entry and it is still locked on exit.
+ *
+ * @param db		the database (locked)
+ * @param key		the key to look for
+ * @param value		if non-NULL, set to a thread-private copy of the value
+ *
+ * @return 1 if the key was found, 0 if it is missing, -1 if the lookup must
+ * be performed the regular way, with the database locked.
+ */
+static int
+sdbm_pinned_lookup(DBM *db, datum key, datum *value)
+{
+	const char *pag;
+	datum v;
+	int r;
+
+	assert_sdbm_locked(db);
+
+	if (NULL == db->lock || NULL == db->cache)
+		return -1;
+
+	pag = lru_pin(db, getpageb(db, exhash(key), FALSE));
+
+	if (NULL == pag)
+		return -1;		/* Page not cached, needs to be read with lock held */
+
+	sdbm_unsynchronize(db);
+
+	r = getpair_pinned(db, pag, key, &v);
+
+	if (1 == r && value != NULL)
+		*value = *sdbm_thread_datum(db, &v);
+
+	lru_unpin(db, pag);
+
+	sdbm_synchronize(db);
+	lru_unwire(db, pag);
+
+	return r;
+}
+#endif	/* THREADS && LRU */
+
 datum
 sdbm_fetch(DBM *db, datum key)
 {
@@ -1116,6 +1171,16 @@ sdbm_fetch(DBM *db, datum key)
 
 	SDBM_WARN_ITERATING(db);
 
+#if defined(THREADS) && defined(LRU)
+	{
+		datum value;
+		int r = sdbm_pinned_lookup(db, key, &value);
+
+		if (r >= 0)
+			sdbm_return(db, 1 == r ? value : nullitem);
+	}
+#endif
+
 	if (getpage(db, exhash(key))) {
 		datum value = getpair(db, db->pagbuf, key);
 		sdbm_return_datum(db, value);
@@ -1147,6 +1212,16 @@ sdbm_exists(DBM *db, datum key)
 		goto error;
 	}
 	SDBM_WARN_ITERATING(db);
+
+#if defined(THREADS) && defined(LRU)
+	{
+		int r = sdbm_pinned_lookup(db, key, NULL);
+
+		if (r >= 0)
+			sdbm_return(db, r);
+	}
+#endif
+
 	if (getpage(db, exhash(key))) {
 		int exists = exipair(db, db->pagbuf, key);
 		sdbm_return(db, exists);
@@ -3293,6 +3368,59 @@ sdbm_set_wdelay(DBM *db, bool on)
 	sdbm_return(db, result);
 }
 
+/**
+ * @return whether memory-mapped page access is enabled.
+ */
+bool
+sdbm_get_mmap(const DBM *db)
+{
+	bool mapped;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	mapped = getmmap(db);
+#else
+	mapped = FALSE;
+#endif
+
+	sdbm_return(db, mapped);
+}
+
+/**
+ * Turn memory-mapped page access on or off.
+ *
+ * When on, pages are accessed directly within the memory-mapped .pag file
+ * instead of being read into the LRU cache, and big data are read from the
+ * memory-mapped .dat file, relying on the kernel page cache.  This avoids
+ * caching data twice and copying pages around, which pays off on large
+ * databases accessed randomly.
+ *
+ * @return 0 if OK, -1 on error with errno set (ENOTSUP when the system
+ * lacks memory-mapping support).
+ */
+int
+sdbm_set_mmap(DBM *db, bool on)
+{
+	int result;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	result = setmmap(db, on);
+#else
+	(void) on;
+	errno = ENOTSUP;
+	result = -1;
+#endif
+
+	sdbm_return(db, result);
+}
+
 /**
  * @return whether database was flagged as "volatile".
  */
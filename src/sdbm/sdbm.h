@@ -89,6 +89,8 @@ int sdbm_set_cache(DBM *db, long pages);
 long sdbm_get_cache(const DBM *) G_PURE;
 int sdbm_set_wdelay(DBM *db, bool on);
 bool sdbm_get_wdelay(const DBM *) G_PURE;
+int sdbm_set_mmap(DBM *db, bool on);
+bool sdbm_get_mmap(const DBM *) G_PURE;
 int sdbm_set_volatile(DBM *db, bool yes);
 bool sdbm_is_volatile(const DBM *) G_PURE;
 bool sdbm_shrink(DBM *db);
@@ -101,6 +103,10 @@ int sdbm_rename(DBM *, const char *);
 int sdbm_rename_files(DBM *, const char *, const char *, const char *);
 int sdbm_rebuild(DBM *);
 int sdbm_rebuild_async(DBM *);
+int sdbm_rebuild_start(DBM *);
+int sdbm_rebuild_step(DBM *, long);
+void sdbm_rebuild_cancel(DBM *);
+bool sdbm_is_rebuilding(const DBM *);
 size_t sdbm_foreach(DBM *db, int flags, sdbm_cb_t cb, void *arg);
 size_t sdbm_foreach_remove(DBM *db, int flags, sdbm_cbr_t cb, void *arg);
 
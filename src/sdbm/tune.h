@@ -16,6 +16,10 @@
 #define BIGDATA			/* can store large keys/values */
 #define THREADS			/* thread-safe */
 
+#if defined(LRU) && defined(HAS_MMAP)
+#define MMAP			/* can access pages through memory-mapping */
+#endif
+
 /*
  * misc
  */
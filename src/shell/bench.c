@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "bench" command.
+ *
+ * Runs microbenchmarks inside the live process, on the real data structures
+ * (library search tables, query routing table) when they are relevant.
+ *
+ * Each benchmark is run by batches of operations until the requested time
+ * has elapsed.  The per-operation latency of each batch is recorded, which
+ * gives the latency percentiles reported alongside the throughput.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "core/matching.h"
+#include "core/qrp.h"
+#include "core/search.h"
+#include "core/share.h"
+
+#include "lib/atoms.h"
+#include "lib/halloc.h"
+#include "lib/htable.h"
+#include "lib/parse.h"
+#include "lib/pmsg.h"
+#include "lib/random.h"
+#include "lib/sha1.h"
+#include "lib/str.h"
+#include "lib/tiger.h"
+#include "lib/tm.h"
+#include "lib/walloc.h"
+#include "lib/xsort.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define BENCH_MS_DFLT		100		/**< Default running time per benchmark */
+#define BENCH_MS_MAX		2000	/**< Maximum running time per benchmark */
+#define BENCH_SAMPLES		4096	/**< Max amount of latency samples */
+#define BENCH_BATCH_NS		20000	/**< Targeted duration of a batch (ns) */
+#define BENCH_BATCH_MAX		65536	/**< Max amount of operations per batch */
+
+#define BENCH_BUFLEN		65536	/**< Data hashed by each SHA1/Tiger op */
+#define BENCH_KEYS			1024	/**< Amount of keys / atoms used */
+
+/**
+ * A registered benchmark.
+ */
+struct bench {
+	const char *name;			/**< Name, for the command line */
+	const char *what;			/**< Description */
+	void *(*setup)(void);		/**< Returns context, NULL if unavailable */
+	void (*run)(void *ctx, uint n);		/**< Perform n operations */
+	void (*teardown)(void *ctx);		/**< Dispose of context */
+	size_t bytes;				/**< Bytes processed per operation */
+};
+
+/**
+ * Benchmark results.
+ */
+struct bench_result {
+	uint64 ops;					/**< Total amount of operations */
+	uint64 ns;					/**< Total time spent in batches */
+	double p50, p90, p99;		/**< Latency percentiles (ns per op) */
+};
+
+/*
+ * Hash table: insertion, lookup and removal of a key in a populated table.
+ */
+
+struct bench_htable {
+	htable_t *ht;
+	ulong next;
+};
+
+static void *
+bench_htable_setup(void)
+{
+	struct bench_htable *ctx;
+	ulong i;
+
+	WALLOC(ctx);
+	ctx->ht = htable_create(HASH_KEY_SELF, 0);
+	ctx->next = BENCH_KEYS + 1;
+
+	for (i = 1; i <= BENCH_KEYS; i++)
+		htable_insert(ctx->ht, ulong_to_pointer(i), ulong_to_pointer(i));
+
+	return ctx;
+}
+
+static void
+bench_htable_run(void *p, uint n)
+{
+	struct bench_htable *ctx = p;
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		void *key = ulong_to_pointer(ctx->next++);
+
+		htable_insert(ctx->ht, key, key);
+		(void) htable_lookup(ctx->ht, key);
+		htable_remove(ctx->ht, key);
+	}
+}
+
+static void
+bench_htable_teardown(void *p)
+{
+	struct bench_htable *ctx = p;
+
+	htable_free_null(&ctx->ht);
+	WFREE(ctx);
+}
+
+/*
+ * Atoms: interning and releasing of strings.
+ */
+
+static void *
+bench_atom_setup(void)
+{
+	char **strings;
+	uint i;
+
+	HALLOC_ARRAY(strings, BENCH_KEYS);
+
+	for (i = 0; i < BENCH_KEYS; i++)
+		strings[i] = str_cmsg("bench-atom-%u-%u", i, random_u32());
+
+	return strings;
+}
+
+static void
+bench_atom_run(void *p, uint n)
+{
+	char **strings = p;
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		const char *atom = atom_str_get(strings[i % BENCH_KEYS]);
+		atom_str_free(atom);
+	}
+}
+
+static void
+bench_atom_teardown(void *p)
+{
+	char **strings = p;
+	uint i;
+
+	for (i = 0; i < BENCH_KEYS; i++)
+		HFREE_NULL(strings[i]);
+
+	hfree(strings);
+}
+
+/*
+ * Hashing: SHA1 and Tiger throughput over a random buffer.
+ */
+
+static void *
+bench_buffer_setup(void)
+{
+	void *buf = halloc(BENCH_BUFLEN);
+
+	random_bytes(buf, BENCH_BUFLEN);
+	return buf;
+}
+
+static void
+bench_buffer_teardown(void *p)
+{
+	hfree(p);
+}
+
+static void
+bench_sha1_run(void *p, uint n)
+{
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		SHA1_context ctx;
+		struct sha1 digest;
+
+		SHA1_reset(&ctx);
+		SHA1_input(&ctx, p, BENCH_BUFLEN);
+		SHA1_result(&ctx, &digest);
+	}
+}
+
+static void
+bench_tiger_run(void *p, uint n)
+{
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		char hash[24];
+
+		tiger(p, BENCH_BUFLEN, hash);
+	}
+}
+
+/*
+ * Library search: queries run against the shared files.
+ */
+
+static const char *bench_queries[] = {
+	"music", "the", "live", "mp3", "love", "video",
+	"linux iso", "best of", "remix 2026", "audio book",
+};
+
+struct bench_search {
+	search_request_info_t *sri;
+	uint hits;
+};
+
+static bool
+bench_search_hit(void *udata, const void *data, bool limits)
+{
+	struct bench_search *ctx = udata;
+
+	(void) data;
+	(void) limits;
+
+	ctx->hits++;
+	return TRUE;
+}
+
+static void *
+bench_search_setup(void)
+{
+	struct bench_search *ctx;
+
+	WALLOC0(ctx);
+	ctx->sri = search_request_info_alloc();
+
+	return ctx;
+}
+
+static void
+bench_search_run(void *p, uint n)
+{
+	struct bench_search *ctx = p;
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		shared_files_match(bench_queries[i % N_ITEMS(bench_queries)],
+			ctx->sri, bench_search_hit, ctx, 100, 0, NULL);
+	}
+}
+
+static void
+bench_search_teardown(void *p)
+{
+	struct bench_search *ctx = p;
+
+	search_request_info_free_null(&ctx->sri);
+	WFREE(ctx);
+}
+
+/*
+ * QRP: lookups of query hash vectors in our own query routing table.
+ */
+
+struct bench_qrp {
+	struct routing_table *rt;
+	query_hashvec_t *qhv[N_ITEMS(bench_queries)];
+};
+
+static void *
+bench_qrp_setup(void)
+{
+	struct bench_qrp *ctx;
+	struct routing_table *rt = qrt_get_table();
+	uint i;
+
+	if (NULL == rt)
+		return NULL;
+
+	WALLOC(ctx);
+	ctx->rt = qrt_ref(rt);
+
+	for (i = 0; i < N_ITEMS(ctx->qhv); i++) {
+		ctx->qhv[i] = qhvec_alloc(QRP_HVEC_MAX);
+		st_fill_qhv(bench_queries[i], ctx->qhv[i]);
+	}
+
+	return ctx;
+}
+
+static void
+bench_qrp_run(void *p, uint n)
+{
+	struct bench_qrp *ctx = p;
+	uint i;
+
+	for (i = 0; i < n; i++)
+		(void) qrt_can_route(ctx->rt, ctx->qhv[i % N_ITEMS(ctx->qhv)]);
+}
+
+static void
+bench_qrp_teardown(void *p)
+{
+	struct bench_qrp *ctx = p;
+	uint i;
+
+	for (i = 0; i < N_ITEMS(ctx->qhv); i++)
+		qhvec_free(ctx->qhv[i]);
+
+	qrt_unref(ctx->rt);
+	WFREE(ctx);
+}
+
+/*
+ * Message blocks: allocation and release of typical Gnutella messages.
+ */
+
+static const int bench_pmsg_sizes[] = {
+	23, 49, 83, 128, 256, 512, 1024, 4096,
+};
+
+static void
+bench_pmsg_run(void *p, uint n)
+{
+	uint i;
+
+	for (i = 0; i < n; i++) {
+		int len = bench_pmsg_sizes[i % N_ITEMS(bench_pmsg_sizes)];
+		pmsg_free(pmsg_new(PMSG_P_DATA, p, len));
+	}
+}
+
+static const struct bench benchmarks[] = {
+	{ "htable", "hash table insert + lookup + remove",
+		bench_htable_setup, bench_htable_run, bench_htable_teardown, 0 },
+	{ "atom", "string atom interning + release",
+		bench_atom_setup, bench_atom_run, bench_atom_teardown, 0 },
+	{ "sha1", "SHA1 of 64 KiB",
+		bench_buffer_setup, bench_sha1_run, bench_buffer_teardown,
+		BENCH_BUFLEN },
+	{ "tiger", "Tiger of 64 KiB",
+		bench_buffer_setup, bench_tiger_run, bench_buffer_teardown,
+		BENCH_BUFLEN },
+	{ "search", "library search (st_search)",
+		bench_search_setup, bench_search_run, bench_search_teardown, 0 },
+	{ "qrp", "QRP table lookup",
+		bench_qrp_setup, bench_qrp_run, bench_qrp_teardown, 0 },
+	{ "pmsg", "message block alloc + free",
+		bench_buffer_setup, bench_pmsg_run, bench_buffer_teardown, 0 },
+};
+
+static int
+bench_double_cmp(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return CMP(*x, *y);
+}
+
+/**
+ * @return the ns elapsed since ``start''.
+ */
+static uint64
+bench_elapsed_ns(const tm_nano_t *start)
+{
+	tm_nano_t end, elapsed;
+
+	tm_precise_time(&end);
+	tm_precise_elapsed(&elapsed, &end, start);
+	return tmn2ns(&elapsed);
+}
+
+/**
+ * Run benchmark for the specified amount of time.
+ *
+ * @param b		the benchmark to run
+ * @param ms	running time, in milliseconds
+ * @param r		where results are written
+ *
+ * @return FALSE if the benchmark could not run.
+ */
+static bool
+bench_run(const struct bench *b, uint ms, struct bench_result *r)
+{
+	void *ctx;
+	double *lat;
+	uint batch = 1, samples = 0;
+	uint64 limit = (uint64) ms * 1000000;
+
+	ctx = (*b->setup)();
+	if (NULL == ctx)
+		return FALSE;
+
+	ZERO(r);
+	XMALLOC_ARRAY(lat, BENCH_SAMPLES);
+
+	/*
+	 * Calibrate the batch size, so that timing overhead remains negligible
+	 * compared to the operations being timed.
+	 */
+
+	for (;;) {
+		tm_nano_t start;
+		uint64 ns;
+
+		tm_precise_time(&start);
+		(*b->run)(ctx, batch);
+		ns = bench_elapsed_ns(&start);
+
+		if (ns >= BENCH_BATCH_NS || batch >= BENCH_BATCH_MAX)
+			break;
+
+		batch *= 2;
+	}
+
+	while (r->ns < limit && samples < BENCH_SAMPLES) {
+		tm_nano_t start;
+		uint64 ns;
+
+		tm_precise_time(&start);
+		(*b->run)(ctx, batch);
+		ns = bench_elapsed_ns(&start);
+
+		r->ops += batch;
+		r->ns += ns;
+		lat[samples++] = (double) ns / batch;
+	}
+
+	(*b->teardown)(ctx);
+
+	xqsort(lat, samples, sizeof lat[0], bench_double_cmp);
+
+	r->p50 = lat[samples * 50 / 100];
+	r->p90 = lat[samples * 90 / 100];
+	r->p99 = lat[samples * 99 / 100];
+
+	XFREE_NULL(lat);
+	return TRUE;
+}
+
+/**
+ * Run benchmark and display its results.
+ */
+static void
+bench_show(struct gnutella_shell *sh, const struct bench *b, uint ms, str_t *s)
+{
+	struct bench_result r;
+
+	if (!bench_run(b, ms, &r)) {
+		str_printf(s, "%-8s (unavailable)\n", b->name);
+	} else {
+		double secs = r.ns / 1e9;
+		double ops = 0 == r.ns ? 0.0 : r.ops / secs;
+
+		str_printf(s, "%-8s %12.0f %10.1f %10.1f %10.1f",
+			b->name, ops, r.p50, r.p90, r.p99);
+
+		if (b->bytes != 0)
+			str_catf(s, " %9.1f", ops * b->bytes / (1024.0 * 1024.0));
+
+		STR_CAT(s, "\n");
+	}
+
+	shell_write(sh, str_2c(s));
+}
+
+/**
+ * Run in-process microbenchmarks.
+ */
+enum shell_reply
+shell_exec_bench(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	const struct bench *b = NULL;
+	uint i, ms = BENCH_MS_DFLT;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc > 3) {
+		shell_set_formatted(sh, "Invalid parameter count (%d)", argc);
+		return REPLY_ERROR;
+	}
+
+	s = str_new(80);
+
+	if (1 == argc) {
+		shell_write(sh, "100~\n");
+		for (i = 0; i < N_ITEMS(benchmarks); i++) {
+			str_printf(s, "%-8s %s\n",
+				benchmarks[i].name, benchmarks[i].what);
+			shell_write(sh, str_2c(s));
+		}
+		goto done;
+	}
+
+	if (0 != strcmp(argv[1], "all")) {
+		for (i = 0; i < N_ITEMS(benchmarks); i++) {
+			if (0 == strcmp(argv[1], benchmarks[i].name)) {
+				b = &benchmarks[i];
+				break;
+			}
+		}
+		if (NULL == b) {
+			shell_set_formatted(sh, "Unknown benchmark \"%s\"", argv[1]);
+			goto error;
+		}
+	}
+
+	if (3 == argc) {
+		int error;
+
+		ms = parse_uint(argv[2], NULL, 10, &error);
+
+		if (error || 0 == ms || ms > BENCH_MS_MAX) {
+			shell_set_formatted(sh, "Invalid duration \"%s\"", argv[2]);
+			goto error;
+		}
+	}
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"Name            ops/s   p50 (ns)   p90 (ns)   p99 (ns)      MB/s\n");
+
+	if (b != NULL) {
+		bench_show(sh, b, ms, s);
+	} else {
+		for (i = 0; i < N_ITEMS(benchmarks); i++)
+			bench_show(sh, &benchmarks[i], ms, s);
+	}
+
+done:
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+	return REPLY_READY;
+
+error:
+	str_destroy_null(&s);
+	return REPLY_ERROR;
+}
+
+const char *
+shell_summary_bench(void)
+{
+	return "Run in-process microbenchmarks";
+}
+
+const char *
+shell_help_bench(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	return "bench [all | <name> [ms]]\n"
+		"runs microbenchmarks inside the process, for the given time\n"
+		"(100 ms by default, 2000 ms at most) per benchmark.\n"
+		"Without arguments, lists the available benchmarks.\n"
+		"Reports the throughput and the per-operation latency percentiles.\n"
+		"The main loop is blocked whilst benchmarks run, and the \"search\"\n"
+		"benchmark is accounted in the local hits statistics.\n";
+}
+
+/* vi: set ts=4 sw=4 cindent: */
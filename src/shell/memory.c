@@ -45,6 +45,7 @@
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
 #include "lib/log.h"
+#include "lib/memprof.h"
 #include "lib/misc.h"
 #include "lib/omalloc.h"
 #include "lib/palloc.h"
@@ -699,6 +700,82 @@ shell_exec_memory_usage(struct gnutella_shell *sh,
 	return REPLY_ERROR;
 }
 
+#define MEMPROF_DEFAULT_PERIOD	1000	/**< Sample 1 allocation in 1000 */
+#define MEMPROF_DEFAULT_SITES	20		/**< Amount of sites to show */
+
+/**
+ * Parse the optional numeric argument of the "profile" operations.
+ *
+ * @return TRUE if OK, with the value filled, FALSE on errors.
+ */
+static bool
+shell_exec_memory_profile_arg(struct gnutella_shell *sh,
+	int argc, const char *argv[], uint *value)
+{
+	const char *endptr;
+	int error;
+	uint v;
+
+	if (argc < 3)
+		return TRUE;		/* Keep default value */
+
+	v = parse_uint(argv[2], &endptr, 10, &error);
+	if (error || '\0' != *endptr || 0 == v) {
+		shell_set_formatted(sh, "Invalid number \"%s\"", argv[2]);
+		return FALSE;
+	}
+
+	*value = v;
+	return TRUE;
+}
+
+static enum shell_reply
+shell_exec_memory_profile(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc < 2)
+		return REPLY_ERROR;
+
+	if (0 == ascii_strcasecmp(argv[1], "on")) {
+		uint period = MEMPROF_DEFAULT_PERIOD;
+
+		if (!shell_exec_memory_profile_arg(sh, argc, argv, &period))
+			return REPLY_ERROR;
+
+		memprof_start(period);
+		shell_write_linef(sh, REPLY_READY,
+			"Sampling 1 allocation in %u", period);
+	} else if (0 == ascii_strcasecmp(argv[1], "off")) {
+		memprof_stop();
+		shell_write_line(sh, REPLY_READY, "Allocation profiling stopped");
+	} else if (
+		0 == ascii_strcasecmp(argv[1], "live") ||
+		0 == ascii_strcasecmp(argv[1], "rate")
+	) {
+		uint count = MEMPROF_DEFAULT_SITES;
+		logagent_t *la;
+
+		if (!shell_exec_memory_profile_arg(sh, argc, argv, &count))
+			return REPLY_ERROR;
+
+		la = log_agent_string_make(0, NULL);
+		memprof_dump_log(la, count, 0 == ascii_strcasecmp(argv[1], "rate"));
+		shell_write(sh, "100~\n");
+		shell_write(sh, log_agent_string_get(la));
+		shell_write(sh, ".\n");
+		log_agent_free_null(&la);
+	} else {
+		shell_set_formatted(sh, "Unknown action \"%s\"", argv[1]);
+		return REPLY_ERROR;
+	}
+
+	return REPLY_READY;
+}
+
 /**
  * Handles the memory command.
  */
@@ -721,6 +798,7 @@ shell_exec_memory(struct gnutella_shell *sh, int argc, const char *argv[])
 	CMD(dump);
 #endif
 	CMD(check);
+	CMD(profile);
 	CMD(show);
 	CMD(stats);
 	CMD(usage);
@@ -756,6 +834,14 @@ shell_help_memory(int argc, const char *argv[])
 				"-s : silent mode, only display summary at the end\n"
 				"-v : verbosely report for each freelist\n";
 		}
+		else if (0 == ascii_strcasecmp(argv[1], "profile")) {
+			return
+				"memory profile on [N]     # sample 1 allocation in N\n"
+				"memory profile off        # stop profiling\n"
+				"memory profile live [N]   # top N sites by live size\n"
+				"memory profile rate [N]   # top N sites by allocation rate\n"
+				"Figures are estimated from the sampled allocations.\n";
+		}
 		else if (0 == ascii_strcasecmp(argv[1], "show")) {
 			return
 				"memory show hole      # display VMM first known hole\n"
@@ -782,6 +868,7 @@ shell_help_memory(int argc, const char *argv[])
 		"memory dump ADDRESS LENGTH\n"
 #endif
 		"memory check xmalloc\n"
+		"memory profile on [N]|off|live [N]|rate [N]\n"
 		"memory show hole|magazines|options|pmap|pools|xmalloc|zones\n"
 		"memory stats [-pu] omalloc|palloc|tmalloc|vmm|xmalloc|zalloc\n"
 		"memory usage zone <size> on|off|show\n"
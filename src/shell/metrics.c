@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "metrics" command.
+ *
+ * Exports the statistics counters in the Prometheus text exposition format,
+ * so that they can be collected by a monitoring system without having to
+ * parse the output of the human-oriented commands.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+#include "core/gnet_stats.h"
+
+#include "lib/stall.h"
+#include "lib/str.h"
+#include "lib/stringify.h"
+#include "lib/thread.h"
+#include "lib/xmalloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define METRICS_PREFIX	"gtkg_"
+
+/**
+ * Write the "# TYPE" line of a metric.
+ */
+static void
+metrics_type(struct gnutella_shell *sh, str_t *s,
+	const char *name, const char *type)
+{
+	str_printf(s, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+	shell_write(sh, str_2c(s));
+}
+
+/**
+ * Write a metric value, with an optional label.
+ */
+static void
+metrics_value(struct gnutella_shell *sh, str_t *s,
+	const char *name, const char *labels, uint64 value)
+{
+	str_printf(s, METRICS_PREFIX "%s", name);
+	if (labels != NULL)
+		str_catf(s, "{%s}", labels);
+	str_catf(s, " %s\n", uint64_to_string(value));
+	shell_write(sh, str_2c(s));
+}
+
+/**
+ * Export the per-message type traffic counters of one transport.
+ */
+static void
+metrics_traffic(struct gnutella_shell *sh, str_t *s,
+	const char *name, const char *transport,
+	const uint64 *pkg, const uint64 *byte)
+{
+	str_t *label = str_new(64);
+	char tmp[64];
+	int i;
+
+	for (i = 0; i < MSG_TOTAL; i++) {
+		if (0 == pkg[i])
+			continue;
+
+		str_printf(label, "transport=\"%s\",type=\"%s\"",
+			transport, gnet_msg_type_description(i));
+		str_bprintf(ARYLEN(tmp), "messages_%s_total", name);
+		metrics_value(sh, s, tmp, str_2c(label), pkg[i]);
+		str_bprintf(ARYLEN(tmp), "bytes_%s_total", name);
+		metrics_value(sh, s, tmp, str_2c(label), byte[i]);
+	}
+
+	str_destroy_null(&label);
+}
+
+/**
+ * Export the Gnutella traffic and general counters.
+ */
+static void
+metrics_gnet(struct gnutella_shell *sh, str_t *s)
+{
+	static const struct {
+		const char *name;
+		void (*get)(gnet_stats_t *);
+	} transports[] = {
+		{ "tcp", gnet_stats_tcp_get },
+		{ "udp", gnet_stats_udp_get },
+	};
+	gnet_stats_t *stats;
+	uint i;
+
+	XMALLOC(stats);
+
+	for (i = 0; i < N_ITEMS(transports); i++) {
+		const char *t = transports[i].name;
+
+		(*transports[i].get)(stats);
+
+		metrics_traffic(sh, s, "received", t,
+			stats->pkg.received, stats->byte.received);
+		metrics_traffic(sh, s, "relayed", t,
+			stats->pkg.relayed, stats->byte.relayed);
+		metrics_traffic(sh, s, "generated", t,
+			stats->pkg.generated, stats->byte.generated);
+		metrics_traffic(sh, s, "dropped", t,
+			stats->pkg.dropped, stats->byte.dropped);
+		metrics_traffic(sh, s, "expired", t,
+			stats->pkg.expired, stats->byte.expired);
+	}
+
+	gnet_stats_get(stats);
+
+	for (i = 0; i < GNR_TYPE_COUNT; i++) {
+		metrics_value(sh, s,
+			gnet_stats_general_to_string(i), NULL, stats->general[i]);
+	}
+
+	XFREE_NULL(stats);
+}
+
+/**
+ * Export the bandwidth scheduler rates.
+ */
+static void
+metrics_bandwidth(struct gnutella_shell *sh, str_t *s)
+{
+	static const struct {
+		const char *name;
+		gnet_bw_source source;
+	} bws[] = {
+		{ "gnet_in",		BW_GNET_IN },
+		{ "gnet_out",		BW_GNET_OUT },
+		{ "gnet_udp_in",	BW_GNET_UDP_IN },
+		{ "gnet_udp_out",	BW_GNET_UDP_OUT },
+		{ "http_in",		BW_HTTP_IN },
+		{ "http_out",		BW_HTTP_OUT },
+		{ "leaf_in",		BW_LEAF_IN },
+		{ "leaf_out",		BW_LEAF_OUT },
+		{ "dht_in",			BW_DHT_IN },
+		{ "dht_out",		BW_DHT_OUT },
+	};
+	char label[32];
+	uint i;
+
+	metrics_type(sh, s, "bandwidth_bytes_per_second", "gauge");
+	metrics_type(sh, s, "bandwidth_average_bytes_per_second", "gauge");
+	metrics_type(sh, s, "bandwidth_limit_bytes_per_second", "gauge");
+
+	for (i = 0; i < N_ITEMS(bws); i++) {
+		gnet_bw_stats_t bw;
+
+		gnet_get_bw_stats(bws[i].source, &bw);
+		str_bprintf(ARYLEN(label), "scheduler=\"%s\"", bws[i].name);
+
+		metrics_value(sh, s, "bandwidth_bytes_per_second",
+			label, bw.current);
+		metrics_value(sh, s, "bandwidth_average_bytes_per_second",
+			label, bw.average);
+		if (bw.enabled) {
+			metrics_value(sh, s, "bandwidth_limit_bytes_per_second",
+				label, bw.limit);
+		}
+	}
+}
+
+/**
+ * Export the message handling costs.
+ */
+static void
+metrics_handling(struct gnutella_shell *sh, str_t *s)
+{
+	gnet_msg_stats_t *vec;
+	size_t i, cnt;
+	char label[64];
+
+	XMALLOC_ARRAY(vec, MSG_TYPE_COUNT);
+	cnt = gnet_stats_handled_get(vec, MSG_TYPE_COUNT, NULL);
+
+	metrics_type(sh, s, "messages_handled_total", "counter");
+	metrics_type(sh, s, "messages_handling_nanoseconds_total", "counter");
+	metrics_type(sh, s, "messages_handling_max_nanoseconds", "gauge");
+
+	for (i = 0; i < cnt; i++) {
+		const gnet_msg_stats_t *ms = &vec[i];
+
+		if (MSG_TOTAL == ms->type)
+			continue;
+
+		str_bprintf(ARYLEN(label), "type=\"%s\"",
+			gnet_msg_type_description(ms->type));
+
+		metrics_value(sh, s, "messages_handled_total", label, ms->count);
+		metrics_value(sh, s, "messages_handling_nanoseconds_total",
+			label, ms->total_ns);
+		metrics_value(sh, s, "messages_handling_max_nanoseconds",
+			label, ms->max_ns);
+	}
+
+	XFREE_NULL(vec);
+}
+
+/**
+ * Export the main loop callback latencies.
+ */
+static void
+metrics_stalls(struct gnutella_shell *sh, str_t *s)
+{
+	struct stall_stats stats;
+	char label[64];
+	uint64 cumul = 0, count = 0, total = 0;
+	uint i;
+
+	stall_stats_get(&stats);
+
+	metrics_type(sh, s, "loop_callbacks_total", "counter");
+	metrics_type(sh, s, "loop_stalls_total", "counter");
+	metrics_type(sh, s, "loop_callback_max_microseconds", "gauge");
+
+	for (i = 0; i < STALL_SRC_COUNT; i++) {
+		str_bprintf(ARYLEN(label), "source=\"%s\"", stall_source_name(i));
+
+		metrics_value(sh, s, "loop_callbacks_total", label,
+			stats.count[i]);
+		metrics_value(sh, s, "loop_stalls_total", label, stats.stalls[i]);
+		metrics_value(sh, s, "loop_callback_max_microseconds",
+			label, stats.max_us[i]);
+
+		count += stats.count[i];
+		total += stats.total_us[i];
+	}
+
+	metrics_type(sh, s, "loop_callback_microseconds", "histogram");
+
+	for (i = 0; i < STALL_BUCKETS; i++) {
+		uint64 limit = stall_bucket_limit(i);
+
+		cumul += stats.hist[i];
+		if (0 == limit)
+			str_bprintf(ARYLEN(label), "le=\"+Inf\"");
+		else
+			str_bprintf(ARYLEN(label), "le=\"%s\"", uint64_to_string(limit));
+		metrics_value(sh, s, "loop_callback_microseconds_bucket",
+			label, cumul);
+	}
+
+	metrics_value(sh, s, "loop_callback_microseconds_sum", NULL, total);
+	metrics_value(sh, s, "loop_callback_microseconds_count", NULL, count);
+}
+
+/**
+ * Export statistics in a machine-readable format.
+ */
+enum shell_reply
+shell_exec_metrics(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	s = str_new(128);
+
+	shell_write(sh, "100~\n");
+
+	metrics_gnet(sh, s);
+	metrics_bandwidth(sh, s);
+	metrics_handling(sh, s);
+	metrics_stalls(sh, s);
+
+	metrics_type(sh, s, "threads", "gauge");
+	metrics_value(sh, s, "threads", NULL, thread_count());
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+const char *
+shell_summary_metrics(void)
+{
+	return "Export statistics for monitoring";
+}
+
+const char *
+shell_help_metrics(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	return "metrics\n"
+		"prints the statistics counters in the Prometheus text format.\n";
+}
+
+/* vi: set ts=4 sw=4 cindent: */
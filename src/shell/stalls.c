@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "stalls" command.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "lib/parse.h"
+#include "lib/stacktrace.h"		/* For stacktrace_function_name() */
+#include "lib/stall.h"
+#include "lib/str.h"
+#include "lib/stringify.h"
+#include "lib/timestamp.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define STALLS_SHOWN	32		/**< Max amount of stalls listed */
+
+/**
+ * Display main loop callback latency and the most recent stalls.
+ */
+enum shell_reply
+shell_exec_stalls(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	struct stall_stats stats;
+	struct stall_event ev[STALLS_SHOWN];
+	size_t i, cnt;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc > 2) {
+		shell_set_formatted(sh, "Invalid parameter count (%d)", argc);
+		return REPLY_ERROR;
+	}
+
+	if (2 == argc) {
+		int error;
+		uint ms = parse_uint(argv[1], NULL, 10, &error);
+
+		if (error || 0 == ms) {
+			shell_set_formatted(sh, "Invalid threshold \"%s\"", argv[1]);
+			return REPLY_ERROR;
+		}
+		stall_threshold_set(ms);
+	}
+
+	stall_stats_get(&stats);
+	cnt = stall_recent(ev, N_ITEMS(ev));
+
+	s = str_new(80);
+
+	shell_write(sh, "100~\n");
+
+	str_printf(s, "Stall threshold: %u ms\n\n", stall_threshold());
+	shell_write(sh, str_2c(s));
+
+	shell_write(sh, "Source          Calls   Avg (us)   Max (ms)  Stalls\n");
+
+	for (i = 0; i < STALL_SRC_COUNT; i++) {
+		uint64 avg = 0 == stats.count[i] ? 0 :
+			stats.total_us[i] / stats.count[i];
+		char buf[UINT64_DEC_BUFLEN];
+
+		uint64_to_string_buf(stats.stalls[i], ARYLEN(buf));
+
+		str_printf(s, "%-8s %12s %10s %10s %7s\n",
+			stall_source_name(i), uint64_to_string(stats.count[i]),
+			uint64_to_string2(avg),
+			uint64_to_string3(stats.max_us[i] / 1000),
+			buf);
+		shell_write(sh, str_2c(s));
+	}
+
+	if (cnt != 0) {
+		shell_write(sh, "\nMost recent stalls:\n");
+
+		for (i = 0; i < cnt; i++) {
+			str_printf(s, "%s %6u ms %-8s %s()\n",
+				timestamp_to_string(ev[i].when), ev[i].duration_ms,
+				stall_source_name(ev[i].src),
+				stacktrace_function_name(ev[i].fn));
+			shell_write(sh, str_2c(s));
+		}
+	}
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+const char *
+shell_summary_stalls(void)
+{
+	return "Show main loop stalls";
+}
+
+const char *
+shell_help_stalls(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	return "stalls [threshold]\n"
+		"shows the execution time of main loop callbacks and lists the\n"
+		"most recent ones which ran for longer than the stall threshold.\n"
+		"When given, the threshold (in ms) is changed first.\n";
+}
+
+/* vi: set ts=4 sw=4 cindent: */
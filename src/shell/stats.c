@@ -36,10 +36,17 @@
 #include "cmd.h"
 #include "core/gnet_stats.h"
 
+#include "if/dht/kmsg.h"
+
 #include "lib/ascii.h"
+#include "lib/dbmw.h"
+#include "lib/misc.h"			/* For short_size() */
 #include "lib/options.h"
+#include "lib/pslist.h"
+#include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/teq.h"
+#include "lib/tm.h"
 #include "lib/xmalloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -191,6 +198,219 @@ shell_exec_stats_drop(struct gnutella_shell *sh,
 	return REPLY_READY;
 }
 
+static enum shell_reply
+shell_exec_stats_dbmw(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	pslist_t *info, *sl;
+	size_t used, budget;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	dbmw_cache_budget(&used, &budget);
+	info = dbmw_info_list();
+	s = str_new(80);
+
+	shell_write(sh, "100~\n");
+	str_printf(s, "Cache budget: %s used out of %s\n",
+		short_size(used, FALSE), short_size2(budget, FALSE));
+	shell_write(sh, str_2c(s));
+	shell_write(sh, "Type Cached/Max   Hot Fresh Ghost R-Hit%  W-Hit% "
+		"  Evicted Readmit  Filtered Name\n");
+
+	PSLIST_FOREACH(info, sl) {
+		dbmw_info_t *dwi = sl->data;
+
+		dbmw_info_check(dwi);
+
+		str_printf(s, "%-4.4s ", dwi->type);
+		str_catf(s, "%6zu/%-5zu ", dwi->hot + dwi->fresh, dwi->max_cached);
+		str_catf(s, "%5zu %5zu %5zu ", dwi->hot, dwi->fresh, dwi->ghosts);
+		str_catf(s, "%6.2f ", dwi->r_hits * 100.0 / MAX(1, dwi->r_access));
+		str_catf(s, "%6.2f ", dwi->w_hits * 100.0 / MAX(1, dwi->w_access));
+		str_catf(s, "%9s ", uint64_to_string(dwi->evictions));
+		str_catf(s, "%7s ", uint64_to_string(dwi->ghost_hits));
+		str_catf(s, "%9s ", uint64_to_string(dwi->b_skips));
+		str_catf(s, "\"%s\"\n", dwi->name);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	dbmw_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+struct stats_dht_args {
+	kmsg_stats_t *vec;
+	size_t cnt;
+	time_t since;
+	bool reset;
+};
+
+static void *
+stats_dht_trampoline(void *a)
+{
+	struct stats_dht_args *arg = a;
+
+	arg->cnt = kmsg_stats_get(arg->vec, arg->cnt, &arg->since);
+	if (arg->reset)
+		kmsg_stats_reset();
+
+	return NULL;
+}
+
+static enum shell_reply
+shell_exec_stats_dht(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	const char *reset;
+	const option_t options[] = {
+		{ "r", &reset },		/* reset counters after printing */
+	};
+	struct stats_dht_args arg;
+	kmsg_stats_t vec[16];
+	time_delta_t elapsed;
+	int parsed;
+	size_t i;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
+	/*
+	 * Kademlia messages are handled by the main thread, which owns the
+	 * statistics: fetch them from there.
+	 */
+
+	arg.vec = vec;
+	arg.cnt = N_ITEMS(vec);
+	arg.reset = reset != NULL;
+
+	(void) teq_rpc(THREAD_MAIN_ID, stats_dht_trampoline, &arg);
+
+	elapsed = MAX(1, delta_time(tm_time(), arg.since));
+	s = str_new(80);
+
+	shell_write(sh, "100~\n");
+	str_printf(s, "Handled over the last %s\n",
+		compact_time(elapsed));
+	shell_write(sh, str_2c(s));
+	shell_write(sh, "Message         Count   Msg/s    Bytes  Avg-us  Max-us\n");
+
+	for (i = 0; i < arg.cnt; i++) {
+		const kmsg_stats_t *ks = &vec[i];
+
+		str_printf(s, "%-10s ", ks->name);
+		str_catf(s, "%10s ", uint64_to_string(ks->count));
+		str_catf(s, "%7.2f ", ks->count / (double) elapsed);
+		str_catf(s, "%8s ", short_size(ks->bytes, FALSE));
+		str_catf(s, "%7.1f ",
+			ks->total_ns / 1000.0 / MAX(1, ks->count));
+		str_catf(s, "%7.1f\n", ks->max_ns / 1000.0);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+struct stats_msg_args {
+	gnet_msg_stats_t *vec;
+	size_t cnt;
+	time_t since;
+	bool reset;
+};
+
+static void *
+stats_msg_trampoline(void *a)
+{
+	struct stats_msg_args *arg = a;
+
+	arg->cnt = gnet_stats_handled_get(arg->vec, arg->cnt, &arg->since);
+	if (arg->reset)
+		gnet_stats_handled_reset();
+
+	return NULL;
+}
+
+static enum shell_reply
+shell_exec_stats_msg(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	const char *reset;
+	const option_t options[] = {
+		{ "r", &reset },		/* reset counters after printing */
+	};
+	struct stats_msg_args arg;
+	gnet_msg_stats_t *vec;
+	time_delta_t elapsed;
+	int parsed;
+	size_t i;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
+	/*
+	 * Gnutella messages are handled by the main thread, which owns the
+	 * statistics: fetch them from there.
+	 */
+
+	XMALLOC_ARRAY(vec, MSG_TYPE_COUNT);
+	arg.vec = vec;
+	arg.cnt = MSG_TYPE_COUNT;
+	arg.reset = reset != NULL;
+
+	(void) teq_rpc(THREAD_MAIN_ID, stats_msg_trampoline, &arg);
+
+	elapsed = MAX(1, delta_time(tm_time(), arg.since));
+	s = str_new(80);
+
+	shell_write(sh, "100~\n");
+	str_printf(s, "Handled over the last %s\n",
+		compact_time(elapsed));
+	shell_write(sh, str_2c(s));
+	shell_write(sh, "Message              Count   Msg/s    Bytes  Avg-us  "
+		"Max-us  CPU%\n");
+
+	for (i = 0; i < arg.cnt; i++) {
+		const gnet_msg_stats_t *ms = &vec[i];
+
+		str_printf(s, "%-15.15s ", gnet_msg_type_description(ms->type));
+		str_catf(s, "%10s ", uint64_to_string(ms->count));
+		str_catf(s, "%7.2f ", ms->count / (double) elapsed);
+		str_catf(s, "%8s ", short_size(ms->bytes, FALSE));
+		str_catf(s, "%7.1f ",
+			ms->total_ns / 1000.0 / MAX(1, ms->count));
+		str_catf(s, "%7.1f ", ms->max_ns / 1000.0);
+		str_catf(s, "%5.2f\n", ms->total_ns / 1e7 / elapsed);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	XFREE_NULL(vec);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
 /**
  * Handle the stats command.
  */
@@ -213,6 +433,9 @@ shell_exec_stats(struct gnutella_shell *sh, int argc, const char *argv[])
 
 	CMD(general);
 	CMD(drop);
+	CMD(dbmw);
+	CMD(dht);
+	CMD(msg);
 
 #undef CMD
 
@@ -245,10 +468,27 @@ shell_help_stats(int argc, const char *argv[])
 				"-t : only show TCP messages.\n"
 				"-u : only show UDP messages.\n";
 		}
+		else if (0 == ascii_strcasecmp(argv[1], "dbmw")) {
+			return "stats dbmw\n"
+				"prints the cache statistics of all the databases.\n";
+		}
+		else if (0 == ascii_strcasecmp(argv[1], "dht")) {
+			return "stats dht [-r]\n"
+				"prints the Kademlia message handling statistics.\n"
+				"-r : reset the counters after printing.\n";
+		}
+		else if (0 == ascii_strcasecmp(argv[1], "msg")) {
+			return "stats msg [-r]\n"
+				"prints the Gnutella message handling statistics.\n"
+				"-r : reset the counters after printing.\n";
+		}
 	} else {
 		return
 			"stats [general] [-p]\n"
 			"stats drop [-ptu]\n"
+			"stats dbmw\n"
+			"stats dht [-r]\n"
+			"stats msg [-r]\n"
 			;
 	}
 	return NULL;
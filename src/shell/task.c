@@ -128,7 +128,7 @@ shell_exec_task_list(struct gnutella_shell *sh,
 			else
 				str_putc(s, '-');
 			str_putc(s, bi->daemon ? 'd' : '-');
-			str_putc(s, bi->running ? 'R' : 'S');
+			str_putc(s, bi->threaded ? 'T' : bi->running ? 'R' : 'S');
 			str_putc(s, ' ');
 			str_catf(s, "%-1zu ", bi->signals);
 			if (bi->daemon) {
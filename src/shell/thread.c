@@ -37,6 +37,7 @@
 
 #include "lib/ascii.h"
 #include "lib/dump_options.h"
+#include "lib/lockstat.h"
 #include "lib/log.h"
 #include "lib/options.h"
 #include "lib/pow2.h"			/* For popcount() */
@@ -223,6 +224,60 @@ shell_exec_thread_elements(struct gnutella_shell *sh,
 	return REPLY_READY;
 }
 
+static enum shell_reply
+shell_exec_thread_locks(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	const char *reset;
+	const option_t options[] = {
+		{ "r", &reset },			/* reset statistics after dumping */
+	};
+	int parsed;
+	logagent_t *la;
+
+	shell_check(sh);
+
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
+	argv += parsed;		/* args[0] is first command argument */
+	argc -= parsed;		/* counts only command arguments now */
+
+	if (argc > 1)
+		return REPLY_ERROR;
+
+	if (1 == argc) {
+		if (0 == ascii_strcasecmp(argv[0], "on")) {
+			lockstat_enable(TRUE);
+			shell_set_msg(sh, "Lock contention statistics enabled");
+		} else if (0 == ascii_strcasecmp(argv[0], "off")) {
+			lockstat_enable(FALSE);
+			shell_set_msg(sh, "Lock contention statistics disabled");
+		} else {
+			shell_set_formatted(sh, "Unknown argument \"%s\"", argv[0]);
+			return REPLY_ERROR;
+		}
+		if (reset != NULL)
+			lockstat_reset();
+		return REPLY_READY;
+	}
+
+	la = log_agent_string_make(0, NULL);
+	lockstat_dump_log(la, 0);
+
+	if (reset != NULL)
+		lockstat_reset();
+
+	shell_write(sh, "100~\n");
+	shell_write(sh, log_agent_string_get(la));
+	shell_write(sh, ".\n");
+
+	log_agent_free_null(&la);
+
+	return REPLY_READY;
+}
+
 /**
  * Handles the thread command.
  */
@@ -244,6 +299,7 @@ shell_exec_thread(struct gnutella_shell *sh, int argc, const char *argv[])
 	CMD(list);
 	CMD(stats);
 	CMD(elements);
+	CMD(locks);
 
 #undef CMD
 
@@ -273,6 +329,13 @@ shell_help_thread(int argc, const char *argv[])
 				"list all initialized thread elements\n"
 				"-a : include all elements, even the reusable ones\n";
 		}
+		else if (0 == ascii_strcasecmp(argv[1], "locks")) {
+			return "thread locks [-r] [on|off]\n"
+				"show lock contention statistics, by locking site\n"
+				"on  : start collecting statistics\n"
+				"off : stop collecting statistics\n"
+				"-r : reset statistics\n";
+		}
 		else if (0 == ascii_strcasecmp(argv[1], "stats")) {
 			return "thread stats [-p]\n"
 				"show thread global statistics\n"
@@ -282,6 +345,7 @@ shell_help_thread(int argc, const char *argv[])
 		return
 			"thread list\n"
 			"thread elements [-a]\n"
+			"thread locks [-r] [on|off]\n"
 			"thread stats [-p]\n"
 			;
 	}
@@ -46,8 +46,12 @@
 #include "if/core/search.h"
 
 #include "lib/atoms.h"
+#include "lib/ascii.h"
 #include "lib/cstr.h"
+#include "lib/glib-missing.h"
 #include "lib/halloc.h"
+#include "lib/hashing.h"
+#include "lib/hset.h"
 #include "lib/hstrfn.h"
 #include "lib/parse.h"
 #include "lib/str.h"
@@ -95,6 +99,7 @@ struct filter_context {
 	size_t l_len;				/**< Length of lower-cased representation */
 	const gchar *utf8_name;		/**< Normalized UTF-8 version of name; atom */
 	size_t utf8_len;			/**< Length of UTF-8 name representation */
+	guint32 serial;				/**< Record serial, for condition caching */
 };
 
 /*
@@ -102,6 +107,8 @@ struct filter_context {
  */
 void filter_remove_rule(filter_t *f, rule_t *r);
 static void filter_free(filter_t *f);
+static void filter_invalidate(void);
+static void filter_prog_free_null(struct filter_prog **prog_ptr);
 
 /**
  * Public variables.
@@ -368,6 +375,7 @@ shadow_commit(shadow_t *shadow)
     shadow->filter->refcount = shadow->refcount;
 
     shadow->filter->flags = shadow->flags;
+	filter_invalidate();
 
     /*
      * Now that we have actually commited the changes for this
@@ -1375,6 +1383,7 @@ filter_free(filter_t *f)
 	G_LIST_FOREACH_SWAPPED(copy, filter_remove_rule, f);
 	g_list_free(copy);
 
+	filter_prog_free_null(&f->prog);
 	atom_str_free_null(&f->name);
 	WFREE(f);
 }
@@ -1390,6 +1399,8 @@ filter_free_rule(rule_t *r)
     if (GUI_PROPERTY(gui_debug) >= 6)
         g_debug("freeing rule: %s", filter_rule_to_string(r));
 
+	filter_invalidate();		/* Shared conditions may refer to it */
+
     switch (r->type) {
     case RULE_TEXT:
         HFREE_NULL(r->u.text.match);
@@ -1470,6 +1481,7 @@ filter_add_rule(filter_t *f, rule_t * const r, filter_add_rule_func_t func)
 #else
     f->ruleset = (*func)(f->ruleset, r);
 #endif
+	filter_invalidate();
     r->target->refcount ++;
     if (GUI_PROPERTY(gui_debug) >= 6)
         g_debug("increased refcount on \"%s\" to %d",
@@ -1656,8 +1668,10 @@ filter_remove_rule(filter_t *f, rule_t *r)
     if (in_shadow_removed && (shadow != NULL))
        shadow->removed = g_list_remove(shadow->removed, r);
 
-    if (in_filter)
+    if (in_filter) {
         f->ruleset = g_list_remove(f->ruleset, r);
+		filter_invalidate();
+	}
 
     /*
      * Now we need to clean up the refcounts that may have been
@@ -2045,6 +2059,638 @@ filter_adapt_order(void)
 #endif /* USE_GTK2 */
 
 
+/***
+ *** Filter compilation.
+ ***/
+
+/*
+ * Each filter is compiled into a program: an array of instructions, one per
+ * rule, which filter_apply() runs through.  Programs are compiled lazily,
+ * and recompiled only after rules changed, as tracked by filter_generation.
+ *
+ * Rule conditions are interned in a pool shared by all the programs, so
+ * that a condition appearing in several rules or filters is evaluated at
+ * most once per record.  On top of that, each program combines the regular
+ * expressions of its rules into a single one, and collects the SHA1 of its
+ * rules in a set, to rule them all out at once for the vast majority of the
+ * records, which match none of them.
+ */
+
+enum filter_op {
+	FILTER_OP_FAIL = 0,			/**< Inactive rule, never matches */
+	FILTER_OP_JUMP,				/**< Always matches */
+	FILTER_OP_COND,				/**< Matches when shared condition holds */
+	FILTER_OP_STATE				/**< Matches on current result state */
+};
+
+struct filter_cond {
+	const rule_t *rule;			/**< First rule with that condition */
+	guint32 serial;				/**< Record for which value is valid */
+	gboolean value;				/**< Cached condition value */
+	gboolean combinable;		/**< Regexp can be part of an alternation */
+};
+
+struct filter_insn {
+	rule_t *rule;				/**< Rule being evaluated */
+	struct filter_cond *cond;	/**< Condition, for FILTER_OP_COND */
+	enum filter_op op;
+	gint prop;					/**< Property set by target, -1 if none */
+};
+
+enum {
+	FILTER_RE_ICASE = 0,		/**< Case-insensitive regexps */
+	FILTER_RE_CASE,				/**< Case-sensitive regexps */
+
+	FILTER_RE_COUNT
+};
+
+struct filter_prog {
+	guint32 generation;			/**< Rules generation compiled */
+	size_t count;				/**< Amount of instructions */
+	struct filter_insn *insn;	/**< Instructions, one per rule */
+	regex_t *re[FILTER_RE_COUNT];		/**< Combined regexps, if any */
+	GSList *re_conds[FILTER_RE_COUNT];	/**< Conditions behind re[] */
+	guint32 re_serial[FILTER_RE_COUNT];	/**< Record for which re[] ran */
+	hset_t *sha1s;				/**< SHA1 of the SHA1 conditions, if any */
+	GSList *sha1_conds;			/**< Conditions behind sha1s */
+	guint32 sha1_serial;		/**< Record for which sha1s was probed */
+};
+
+static hset_t *filter_conds;			/**< Pool of shared conditions */
+static guint32 filter_generation = 1;	/**< Bumped when rules change */
+static guint32 filter_conds_generation;	/**< Generation of filter_conds */
+static guint32 filter_serial;			/**< Serial of filtered records */
+
+/**
+ * Record that rules changed, invalidating all the compiled programs.
+ */
+static void
+filter_invalidate(void)
+{
+	filter_generation++;
+}
+
+static uint
+filter_cond_hash(const void *key)
+{
+	const struct filter_cond *c = key;
+	const rule_t *r = c->rule;
+	uint h = integer_hash(r->type);
+
+	switch (r->type) {
+	case RULE_TEXT:
+		h ^= integer_hash2((r->u.text.type << 1) | r->u.text.case_sensitive);
+		return h ^ string_mix_hash(r->u.text.match);
+	case RULE_IP:
+		return h ^ host_addr_hash(r->u.ip.addr) ^ integer_hash2(r->u.ip.cidr);
+	case RULE_SIZE:
+		return h ^ integer_hash2(r->u.size.lower ^ r->u.size.upper);
+	case RULE_SHA1:
+		return NULL == r->u.sha1.hash ? h : h ^ sha1_hash(r->u.sha1.hash);
+	case RULE_FLAG:
+		return h ^ integer_hash2(
+			(r->u.flag.busy << 8) ^ (r->u.flag.stable << 4) ^ r->u.flag.push);
+	default:
+		g_assert_not_reached();
+	}
+
+	return h;
+}
+
+static bool
+filter_cond_eq(const void *p, const void *q)
+{
+	const rule_t *a = ((const struct filter_cond *) p)->rule;
+	const rule_t *b = ((const struct filter_cond *) q)->rule;
+
+	if (a->type != b->type)
+		return FALSE;
+
+	switch (a->type) {
+	case RULE_TEXT:
+		return a->u.text.type == b->u.text.type &&
+			a->u.text.case_sensitive == b->u.text.case_sensitive &&
+			0 == strcmp(a->u.text.match, b->u.text.match);
+	case RULE_IP:
+		return a->u.ip.cidr == b->u.ip.cidr &&
+			host_addr_equal(a->u.ip.addr, b->u.ip.addr);
+	case RULE_SIZE:
+		return a->u.size.lower == b->u.size.lower &&
+			a->u.size.upper == b->u.size.upper;
+	case RULE_SHA1:
+		if (NULL == a->u.sha1.hash || NULL == b->u.sha1.hash)
+			return a->u.sha1.hash == b->u.sha1.hash;
+		return sha1_eq(a->u.sha1.hash, b->u.sha1.hash);
+	case RULE_FLAG:
+		return a->u.flag.busy == b->u.flag.busy &&
+			a->u.flag.stable == b->u.flag.stable &&
+			a->u.flag.push == b->u.flag.push;
+	default:
+		g_assert_not_reached();
+	}
+
+	return FALSE;
+}
+
+/**
+ * Can regular expression be made part of an alternation?
+ *
+ * Back-references would refer to the wrong sub-expression once the regexp
+ * is enclosed in a group within a larger one.
+ */
+static gboolean
+filter_regexp_combinable(const char *re)
+{
+	const char *p;
+
+	for (p = re; *p != '\0'; p++) {
+		if ('\\' == *p) {
+			if ('\0' == p[1] || is_ascii_digit(p[1]))
+				return FALSE;
+			p++;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Hash set iterator callback, freeing conditions from the pool.
+ */
+static void
+filter_cond_free(const void *key, void *unused_data)
+{
+	struct filter_cond *cond = deconstify_pointer(key);
+
+	(void) unused_data;
+
+	WFREE(cond);
+}
+
+/**
+ * Free the pool of conditions.
+ */
+static void
+filter_conds_free(void)
+{
+	if (filter_conds != NULL) {
+		hset_foreach(filter_conds, filter_cond_free, NULL);
+		hset_free_null(&filter_conds);
+	}
+}
+
+/**
+ * Get the shared condition for a rule, creating it as needed.
+ */
+static struct filter_cond *
+filter_cond_intern(const rule_t *r)
+{
+	struct filter_cond key, *cond;
+
+	/*
+	 * Conditions can refer to rules which are gone since the pool was
+	 * populated: start afresh when rules changed.
+	 */
+
+	if (filter_conds_generation != filter_generation) {
+		filter_conds_free();
+		filter_conds_generation = filter_generation;
+	}
+
+	if G_UNLIKELY(NULL == filter_conds)
+		filter_conds = hset_create_any(filter_cond_hash, NULL, filter_cond_eq);
+
+	key.rule = r;
+	cond = hset_lookup(filter_conds, &key);
+
+	if (NULL == cond) {
+		WALLOC0(cond);
+		cond->rule = r;
+		cond->combinable = RULE_TEXT == r->type &&
+			RULE_TEXT_REGEXP == r->u.text.type &&
+			filter_regexp_combinable(r->u.text.match);
+		hset_insert(filter_conds, cond);
+	}
+
+	return cond;
+}
+
+/**
+ * @return the property set by rules targeting the filter, -1 if none.
+ */
+static gint
+filter_target_prop(const filter_t *target)
+{
+	if (target == filter_show || target == filter_drop)
+		return FILTER_PROP_DISPLAY;
+	if (target == filter_download || target == filter_nodownload)
+		return FILTER_PROP_DOWNLOAD;
+
+	return -1;
+}
+
+/**
+ * Free compiled program and nullify its pointer.
+ */
+static void
+filter_prog_free_null(struct filter_prog **prog_ptr)
+{
+	struct filter_prog *prog = *prog_ptr;
+
+	if (prog != NULL) {
+		gint g;
+
+		for (g = 0; g < FILTER_RE_COUNT; g++) {
+			if (prog->re[g] != NULL) {
+				regfree(prog->re[g]);
+				WFREE(prog->re[g]);
+			}
+			gm_slist_free_null(&prog->re_conds[g]);
+		}
+		hset_free_null(&prog->sha1s);
+		gm_slist_free_null(&prog->sha1_conds);
+		HFREE_NULL(prog->insn);
+		WFREE(prog);
+		*prog_ptr = NULL;
+	}
+}
+
+/**
+ * Register condition in the prefilters of the program being compiled.
+ *
+ * @param prog		the program being compiled
+ * @param cond		the condition to register
+ * @param re		the alternations being built, for each regexp class
+ */
+static void
+filter_prog_prefilter_add(struct filter_prog *prog,
+	struct filter_cond *cond, str_t *re[FILTER_RE_COUNT])
+{
+	const rule_t *r = cond->rule;
+
+	if (cond->combinable) {
+		gint g = r->u.text.case_sensitive ? FILTER_RE_CASE : FILTER_RE_ICASE;
+
+		if (g_slist_find(prog->re_conds[g], cond) != NULL)
+			return;
+
+		prog->re_conds[g] = g_slist_prepend(prog->re_conds[g], cond);
+
+		if (NULL == re[g])
+			re[g] = str_new(0);
+		else
+			str_putc(re[g], '|');
+
+		str_putc(re[g], '(');
+		str_cat(re[g], r->u.text.match);
+		str_putc(re[g], ')');
+	} else if (RULE_SHA1 == r->type && r->u.sha1.hash != NULL) {
+		if (g_slist_find(prog->sha1_conds, cond) != NULL)
+			return;
+
+		if (NULL == prog->sha1s)
+			prog->sha1s = hset_create(HASH_KEY_FIXED, SHA1_RAW_SIZE);
+
+		prog->sha1_conds = g_slist_prepend(prog->sha1_conds, cond);
+		hset_insert(prog->sha1s, r->u.sha1.hash);
+	}
+}
+
+/**
+ * Compile the combined regexp of the program for a given class.
+ *
+ * Prefilters are only kept when they cover at least two conditions, since
+ * otherwise they would not save anything.
+ */
+static void
+filter_prog_prefilter_compile(struct filter_prog *prog, gint g, str_t *re)
+{
+	if (g_slist_length(prog->re_conds[g]) >= 2) {
+		regex_t *cre;
+		int err;
+
+		WALLOC0(cre);
+		err = regcomp(cre, str_2c(re),
+			REG_EXTENDED | REG_NOSUB | (FILTER_RE_CASE == g ? 0 : REG_ICASE));
+
+		if (0 == err) {
+			prog->re[g] = cre;
+			return;
+		}
+
+		if (GUI_PROPERTY(gui_debug))
+			g_debug("%s(): cannot combine %u regexps",
+				G_STRFUNC, g_slist_length(prog->re_conds[g]));
+
+		regfree(cre);
+		WFREE(cre);
+	}
+
+	gm_slist_free_null(&prog->re_conds[g]);
+}
+
+/**
+ * Compile filter into a program.
+ */
+static struct filter_prog *
+filter_prog_compile(const filter_t *filter)
+{
+	struct filter_prog *prog;
+	str_t *re[FILTER_RE_COUNT];
+	GList *l;
+	size_t i;
+	gint g;
+
+	ZERO(&re);
+
+	WALLOC0(prog);
+	prog->generation = filter_generation;
+	prog->count = g_list_length(filter->ruleset);
+
+	if (prog->count != 0)
+		HALLOC0_ARRAY(prog->insn, prog->count);
+
+	for (i = 0, l = filter->ruleset; l != NULL; i++, l = g_list_next(l)) {
+		struct filter_insn *in = &prog->insn[i];
+		rule_t *r = l->data;
+
+		in->rule = r;
+		in->prop = filter_target_prop(r->target);
+
+		if (!RULE_IS_ACTIVE(r)) {
+			in->op = FILTER_OP_FAIL;
+			continue;
+		}
+
+		switch (r->type) {
+		case RULE_JUMP:
+			in->op = FILTER_OP_JUMP;
+			break;
+		case RULE_STATE:
+			in->op = FILTER_OP_STATE;
+			break;
+		case RULE_TEXT:
+		case RULE_IP:
+		case RULE_SIZE:
+		case RULE_SHA1:
+		case RULE_FLAG:
+			in->op = FILTER_OP_COND;
+			in->cond = filter_cond_intern(r);
+			filter_prog_prefilter_add(prog, in->cond, re);
+			break;
+		default:
+			g_error("Unknown rule type: %d", r->type);
+		}
+	}
+
+	for (g = 0; g < FILTER_RE_COUNT; g++) {
+		if (re[g] != NULL) {
+			filter_prog_prefilter_compile(prog, g, re[g]);
+			str_destroy_null(&re[g]);
+		}
+	}
+
+	if (g_slist_length(prog->sha1_conds) < 2) {
+		hset_free_null(&prog->sha1s);
+		gm_slist_free_null(&prog->sha1_conds);
+	}
+
+	return prog;
+}
+
+/**
+ * Compute the cached names of the filtered record, if not already done.
+ */
+static void
+filter_context_names(struct filter_context *ctx)
+{
+	if (NULL == ctx->utf8_name) {
+		ctx->utf8_name = atom_str_get(ctx->rec->utf8_name);
+		ctx->utf8_len = vstrlen(ctx->utf8_name);
+	}
+
+	if (NULL == ctx->l_name) {
+		gchar *s = utf8_strlower_copy(ctx->utf8_name);
+
+		/*
+		 * Cache for further rules, to avoid costly utf8
+		 * lowercasing transformation for each text-matching
+		 * rule they have configured.
+		 */
+
+		ctx->l_name = atom_str_get(s);
+		ctx->l_len = vstrlen(ctx->l_name);
+
+		hfree(s);
+	}
+}
+
+/**
+ * Mark all the conditions of the list as failing for the current record.
+ */
+static void
+filter_conds_fail(GSList *conds, const struct filter_context *ctx)
+{
+	GSList *sl;
+
+	for (sl = conds; sl != NULL; sl = g_slist_next(sl)) {
+		struct filter_cond *cond = sl->data;
+
+		cond->serial = ctx->serial;
+		cond->value = FALSE;
+	}
+}
+
+/**
+ * Run the program prefilter covering the condition, if any and not
+ * already done for the current record.
+ */
+static void
+filter_prog_prefilter(struct filter_prog *prog,
+	const struct filter_cond *cond, struct filter_context *ctx)
+{
+	const rule_t *r = cond->rule;
+
+	if (cond->combinable) {
+		gint g = r->u.text.case_sensitive ? FILTER_RE_CASE : FILTER_RE_ICASE;
+
+		if (prog->re[g] != NULL && prog->re_serial[g] != ctx->serial) {
+			prog->re_serial[g] = ctx->serial;
+			filter_context_names(ctx);
+
+			if (
+				REG_NOMATCH == regexec(prog->re[g],
+					FILTER_RE_CASE == g ? ctx->utf8_name : ctx->l_name,
+					0, NULL, 0)
+			)
+				filter_conds_fail(prog->re_conds[g], ctx);
+		}
+	} else if (
+		RULE_SHA1 == r->type && prog->sha1s != NULL &&
+		prog->sha1_serial != ctx->serial
+	) {
+		const struct sha1 *sha1 = ctx->rec->sha1;
+
+		prog->sha1_serial = ctx->serial;
+
+		if (NULL == sha1 || !hset_contains(prog->sha1s, sha1))
+			filter_conds_fail(prog->sha1_conds, ctx);
+	}
+}
+
+/**
+ * Evaluate rule condition against the filtered record.
+ */
+static gboolean
+filter_cond_eval(const rule_t *r, struct filter_context *ctx)
+{
+	const struct record *rec = ctx->rec;
+	gboolean match = FALSE;
+
+	switch (r->type) {
+	case RULE_TEXT: {
+		const gchar *name;
+		size_t namelen;
+		int i;
+
+		filter_context_names(ctx);
+
+		if (r->u.text.case_sensitive) {
+			name = ctx->utf8_name;
+			namelen = ctx->utf8_len;
+		} else {
+			name = ctx->l_name;
+			namelen = ctx->l_len;
+		}
+
+		switch (r->u.text.type) {
+		case RULE_TEXT_EXACT:
+			match = 0 == strcmp(name, r->u.text.match);
+			break;
+		case RULE_TEXT_PREFIX:
+			match = 0 == strncmp(name, r->u.text.match, r->u.text.match_len);
+			break;
+		case RULE_TEXT_WORDS:	/* Contains ALL the words */
+			{
+				GList *iter;
+
+				match = TRUE;
+
+				for (
+					iter = g_list_first(r->u.text.u.words);
+					iter && match;
+					iter = g_list_next(iter)
+				) {
+					if (NULL == pattern_search(iter->data, name, 0, 0, qs_any))
+						match = FALSE;
+				}
+			}
+			break;
+		case RULE_TEXT_SUFFIX:
+			{
+				size_t n = r->u.text.match_len;
+
+				match = namelen >= n &&
+					0 == strcmp(name + namelen - n, r->u.text.match);
+			}
+			break;
+		case RULE_TEXT_SUBSTR:
+			match = NULL !=
+				pattern_search(r->u.text.u.pattern, name, 0, 0, qs_any);
+			break;
+		case RULE_TEXT_REGEXP:
+			i = regexec(r->u.text.u.re, name, 0, NULL, 0);
+			match = 0 == i;
+			if (i == REG_ESPACE)
+				g_warning("%s(): regexp memory overflow", G_STRFUNC);
+			break;
+		default:
+			g_error("%s(): unknown text rule type: %d",
+				G_STRFUNC, r->u.text.type);
+		}
+		break;
+	}
+	case RULE_IP:
+		match = host_addr_matches(rec->results_set->addr,
+					r->u.ip.addr, r->u.ip.cidr);
+		break;
+	case RULE_SIZE:
+		match = rec->size >= r->u.size.lower && rec->size <= r->u.size.upper;
+		break;
+	case RULE_SHA1:
+		if (rec->sha1 == r->u.sha1.hash)
+			match = TRUE;
+		else if (rec->sha1 != NULL && r->u.sha1.hash != NULL)
+			match = sha1_eq(rec->sha1, r->u.sha1.hash);
+		break;
+	case RULE_FLAG:
+		{
+			gboolean stable_match;
+			gboolean busy_match;
+			gboolean push_match;
+
+			stable_match =
+				(
+					r->u.flag.busy == RULE_FLAG_SET &&
+					(rec->results_set->status & ST_BUSY)
+				) ||
+				(
+					r->u.flag.busy == RULE_FLAG_UNSET &&
+					!(rec->results_set->status & ST_BUSY)
+				) ||
+				r->u.flag.busy == RULE_FLAG_IGNORE;
+
+			busy_match =
+				(
+					r->u.flag.push == RULE_FLAG_SET &&
+					(rec->results_set->status & ST_FIREWALL)
+				) ||
+				(
+					(r->u.flag.push == RULE_FLAG_UNSET) &&
+					!(rec->results_set->status & ST_FIREWALL)
+				) ||
+				r->u.flag.push == RULE_FLAG_IGNORE;
+
+			push_match =
+				(
+					r->u.flag.stable == RULE_FLAG_SET &&
+					(rec->results_set->status & ST_UPLOADED)
+				) ||
+				(
+					r->u.flag.stable == RULE_FLAG_UNSET &&
+					!(rec->results_set->status & ST_UPLOADED)
+				) ||
+				r->u.flag.stable == RULE_FLAG_IGNORE;
+
+			match = stable_match && busy_match && push_match;
+		}
+		break;
+	default:
+		g_error("Unknown rule type: %d", r->type);
+		break;
+	}
+
+	return match;
+}
+
+/**
+ * @return value of the shared condition for the filtered record.
+ */
+static gboolean
+filter_cond_value(struct filter_prog *prog, struct filter_cond *cond,
+	struct filter_context *ctx)
+{
+	if (cond->serial != ctx->serial)
+		filter_prog_prefilter(prog, cond, ctx);
+
+	if (cond->serial != ctx->serial) {
+		cond->value = filter_cond_eval(cond->rule, ctx);
+		cond->serial = ctx->serial;
+	}
+
+	return cond->value;
+}
+
 #define MATCH_RULE(filter, r, res)									\
 do {																\
     (res)->props_set++;												\
@@ -2063,15 +2709,14 @@ do {																\
 static int
 filter_apply(filter_t *filter, struct filter_context *ctx, filter_result_t *res)
 {
-    GList *list;
+	struct filter_prog *prog;
     gint prop_count = 0;
     gboolean do_abort = FALSE;
-	const struct record *rec;
+	size_t i;
 
     g_assert(filter != NULL);
     g_assert(ctx != NULL);
-	rec = ctx->rec;
-	record_check(rec);
+	record_check(ctx->rec);
     g_assert(res != NULL);
 
     /*
@@ -2083,210 +2728,68 @@ filter_apply(filter_t *filter, struct filter_context *ctx, filter_result_t *res)
 
     filter->visited = TRUE;
 
-    list = filter->ruleset;
-
-	list = g_list_first(list);
-	while (list != NULL && res->props_set < MAX_FILTER_PROP && !do_abort) {
-        gboolean match = FALSE;
-		rule_t *r;
-		gint i;
-
-        r = list->data;
-        if (GUI_PROPERTY(gui_debug) >= 10)
-            g_debug("trying to match against: %s", filter_rule_to_string(r));
-
-        if (RULE_IS_ACTIVE(r)) {
-            switch (r->type){
-            case RULE_JUMP:
-                match = TRUE;
-                break;
-            case RULE_TEXT: {
-				const gchar *l_name = ctx->l_name;
-				const gchar *utf8_name = ctx->utf8_name;
+	if (NULL == filter->prog || filter->prog->generation != filter_generation) {
+		filter_prog_free_null(&filter->prog);
+		filter->prog = filter_prog_compile(filter);
+	}
 
-				if (utf8_name == NULL) {
-					ctx->utf8_name = utf8_name = atom_str_get(rec->utf8_name);
-					ctx->utf8_len = vstrlen(utf8_name);
-				}
+	prog = filter->prog;
 
-				if (l_name == NULL) {
-					gchar *s = utf8_strlower_copy(utf8_name);
+	for (
+		i = 0;
+		i < prog->count && res->props_set < MAX_FILTER_PROP && !do_abort;
+		i++
+	) {
+		const struct filter_insn *in = &prog->insn[i];
+        gboolean match = FALSE;
+		rule_t *r = in->rule;
 
-					/*
-					 * Cache for further rules, to avoid costly utf8
-					 * lowercasing transformation for each text-matching
-					 * rule they have configured.
-					 */
+		/*
+		 * A rule whose target sets a property already decided cannot
+		 * change the outcome: skip its evaluation altogether.
+		 */
 
-					ctx->l_name = atom_str_get(s);
-					ctx->l_len = vstrlen(ctx->l_name);
-					l_name = ctx->l_name;
+		if (in->prop >= 0 && res->props[in->prop].state)
+			continue;
 
-					hfree(s);
-				}
+        if (GUI_PROPERTY(gui_debug) >= 10)
+            g_debug("trying to match against: %s", filter_rule_to_string(r));
 
-                switch (r->u.text.type) {
-                case RULE_TEXT_EXACT:
-                    if (
-						0 == strcmp(r->u.text.case_sensitive ?
-							ctx->utf8_name : ctx->l_name, r->u.text.match)
-					)
-                        match = TRUE;
-                    break;
-                case RULE_TEXT_PREFIX:
-                    if (
-						0 == strncmp(r->u.text.case_sensitive ?
-							ctx->utf8_name : ctx->l_name,
-							r->u.text.match, r->u.text.match_len)
-					)
-                        match = TRUE;
-                    break;
-                case RULE_TEXT_WORDS:	/* Contains ALL the words */
-                    {
-                        GList *iter;
-						gboolean failed = FALSE;
-
-                        for (
-                            iter = g_list_first(r->u.text.u.words);
-                            iter && !failed;
-                            iter = g_list_next(iter)
-                        ) {
-                            if (
-								NULL == pattern_search(iter->data,
-									r->u.text.case_sensitive ?
-										ctx->utf8_name : ctx->l_name,
-									0, 0, qs_any)
-							)
-                                failed = TRUE;
-                        }
-
-						match = !failed;
-                    }
-                    break;
-                case RULE_TEXT_SUFFIX: {
-					size_t namelen = r->u.text.case_sensitive ?
-						ctx->utf8_len : ctx->l_len;
-					size_t n;
-                    n = r->u.text.match_len;
-                    if (namelen >= n
-                        && strcmp((r->u.text.case_sensitive
-                               ? utf8_name : l_name) + namelen
-                              - n, r->u.text.match) == 0)
-                        match = TRUE;
-				   }
-                    break;
-                case RULE_TEXT_SUBSTR:
-                    if (
-						NULL != pattern_search(
-							r->u.text.u.pattern,
-							r->u.text.case_sensitive ?
-								ctx->utf8_name : ctx->l_name,
-							0, 0, qs_any)
-					)
-                        match = TRUE;
-                    break;
-                case RULE_TEXT_REGEXP:
-                    if (
-						0 == (i = regexec(r->u.text.u.re,
-							r->u.text.case_sensitive ?
-								ctx->utf8_name : ctx->l_name, 0, NULL, 0))
-					)
-                        match = TRUE;
-                    if (i == REG_ESPACE)
-                        g_warning("%s(): regexp memory overflow", G_STRFUNC);
-                    break;
-                default:
-                    g_error("%s(): unknown text rule type: %d",
-						G_STRFUNC, r->u.text.type);
-                }
-                break;
+		switch (in->op) {
+		case FILTER_OP_FAIL:
+			r->fail_count++;
+			continue;
+		case FILTER_OP_JUMP:
+			match = TRUE;
+			break;
+		case FILTER_OP_COND:
+			match = filter_cond_value(prog, in->cond, ctx);
+			break;
+		case FILTER_OP_STATE:
+			{
+				gboolean display_match;
+				gboolean download_match;
+
+				display_match =
+					(r->u.state.display == FILTER_PROP_STATE_IGNORE) ||
+					(res->props[FILTER_PROP_DISPLAY].state
+						== r->u.state.display);
+
+				download_match =
+					(r->u.state.download == FILTER_PROP_STATE_IGNORE) ||
+					(res->props[FILTER_PROP_DOWNLOAD].state
+						== r->u.state.download);
+
+				match = display_match && download_match;
 			}
-            case RULE_IP:
-				match = host_addr_matches(rec->results_set->addr,
-							r->u.ip.addr, r->u.ip.cidr);
-                break;
-            case RULE_SIZE:
-                if (rec->size >= r->u.size.lower &&
-                    rec->size <= r->u.size.upper)
-                    match = TRUE;
-                break;
-            case RULE_SHA1:
-                if (rec->sha1 == r->u.sha1.hash)
-                    match = TRUE;
-                else if (rec->sha1 != NULL && r->u.sha1.hash != NULL)
-                    if (sha1_eq(rec->sha1, r->u.sha1.hash))
-                        match = TRUE;
-                break;
-            case RULE_FLAG:
-                {
-                    gboolean stable_match;
-                    gboolean busy_match;
-                    gboolean push_match;
-
-                    stable_match =
-                        (
-							r->u.flag.busy == RULE_FLAG_SET &&
-							(rec->results_set->status & ST_BUSY)
-						) ||
-                        (
-							r->u.flag.busy == RULE_FLAG_UNSET &&
-							!(rec->results_set->status & ST_BUSY)
-						) ||
-                        r->u.flag.busy == RULE_FLAG_IGNORE;
-
-                    busy_match =
-                        (
-							r->u.flag.push == RULE_FLAG_SET &&
-							(rec->results_set->status & ST_FIREWALL)
-						) ||
-                        (
-							(r->u.flag.push == RULE_FLAG_UNSET) &&
-							!(rec->results_set->status & ST_FIREWALL)
-						) ||
-                        r->u.flag.push == RULE_FLAG_IGNORE;
-
-                    push_match =
-                        (
-							r->u.flag.stable == RULE_FLAG_SET &&
-							(rec->results_set->status & ST_UPLOADED)
-						) ||
-                        (
-							r->u.flag.stable == RULE_FLAG_UNSET &&
-							!(rec->results_set->status & ST_UPLOADED)
-						) ||
-						r->u.flag.stable == RULE_FLAG_IGNORE;
-
-                    match = stable_match && busy_match && push_match;
-                }
-                break;
-            case RULE_STATE:
-                {
-                    gboolean display_match;
-                    gboolean download_match;
-
-                    display_match =
-                        (r->u.state.display == FILTER_PROP_STATE_IGNORE) ||
-                        (res->props[FILTER_PROP_DISPLAY].state
-                            == r->u.state.display);
-
-                    download_match =
-                        (r->u.state.download == FILTER_PROP_STATE_IGNORE) ||
-                        (res->props[FILTER_PROP_DOWNLOAD].state
-                            == r->u.state.download);
-
-                    match = display_match && download_match;
-                }
-                break;
-            default:
-                g_error("Unknown rule type: %d", r->type);
-                break;
-            }
-        }
+			break;
+		}
+
         /*
          * If negate is set, we invert the meaning of match.
          */
 
-		if (RULE_IS_NEGATED(r) && RULE_IS_ACTIVE(r))
+		if (RULE_IS_NEGATED(r))
 			match = !match;
 
         /*
@@ -2300,39 +2803,20 @@ filter_apply(filter_t *filter, struct filter_context *ctx, filter_result_t *res)
                 r->match_count ++;
                 r->target->match_count ++;
             } else if (r->target == filter_show) {
-                if (!res->props[FILTER_PROP_DISPLAY].state) {
-
-                    res->props[FILTER_PROP_DISPLAY].state =
-                        FILTER_PROP_STATE_DO;
-
-                    MATCH_RULE(filter, r, res);
-                }
+				res->props[FILTER_PROP_DISPLAY].state = FILTER_PROP_STATE_DO;
+				MATCH_RULE(filter, r, res);
             } else if (r->target == filter_drop) {
-                if (!res->props[FILTER_PROP_DISPLAY].state) {
-
-                    res->props[FILTER_PROP_DISPLAY].state =
-                        FILTER_PROP_STATE_DONT;
-                    res->props[FILTER_PROP_DISPLAY].user_data =
-                        GINT_TO_POINTER(RULE_IS_SOFT(r) ? 1 : 0);
-
-                    MATCH_RULE(filter, r, res);
-                }
+				res->props[FILTER_PROP_DISPLAY].state = FILTER_PROP_STATE_DONT;
+				res->props[FILTER_PROP_DISPLAY].user_data =
+					GINT_TO_POINTER(RULE_IS_SOFT(r) ? 1 : 0);
+				MATCH_RULE(filter, r, res);
             } else if (r->target == filter_download) {
-                if (!res->props[FILTER_PROP_DOWNLOAD].state) {
-
-                    res->props[FILTER_PROP_DOWNLOAD].state =
-                        FILTER_PROP_STATE_DO;
-
-                    MATCH_RULE(filter, r, res);
-                }
+				res->props[FILTER_PROP_DOWNLOAD].state = FILTER_PROP_STATE_DO;
+				MATCH_RULE(filter, r, res);
             } else if (r->target == filter_nodownload) {
-                if (!res->props[FILTER_PROP_DOWNLOAD].state) {
-
-                    res->props[FILTER_PROP_DOWNLOAD].state =
-                        FILTER_PROP_STATE_DONT;
-
-                    MATCH_RULE(filter, r, res);
-                }
+				res->props[FILTER_PROP_DOWNLOAD].state =
+					FILTER_PROP_STATE_DONT;
+				MATCH_RULE(filter, r, res);
             } else {
                 /*
                  * We have a matched rule the target is not a builtin
@@ -2344,8 +2828,6 @@ filter_apply(filter_t *filter, struct filter_context *ctx, filter_result_t *res)
         } else {
             r->fail_count ++;
         }
-
-		list = g_list_next(list);
 	}
 
     filter->visited = FALSE;
@@ -2373,6 +2855,10 @@ filter_record(struct search *search, const struct record *rec)
 	ctx.l_name = ctx.utf8_name = NULL;
 	ctx.l_len = ctx.utf8_len = 0;
 
+	if G_UNLIKELY(0 == ++filter_serial)
+		filter_serial = 1;		/* 0 is never a valid serial */
+	ctx.serial = filter_serial;
+
     /*
      * Initialize all properties with FILTER_PROP_STATE_UNKNOWN and
      * the props_set count with 0;
@@ -2476,6 +2962,8 @@ filter_shutdown(void)
      */
     for (f = filters; f != NULL; f = filters)
         filter_free(f->data);
+
+	filter_conds_free();
 }
 
 static void G_COLD
@@ -35,10 +35,12 @@
  */
 
 struct record;
+struct filter_prog;
 
 typedef struct filter {
     const gchar *name;
     GList *ruleset;
+    struct filter_prog *prog;	/**< Compiled ruleset, NULL if none yet */
     struct search *search;
     gboolean visited;
     gint32 refcount;
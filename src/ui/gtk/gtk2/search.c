@@ -530,6 +530,36 @@ search_gui_enable_sort(struct search *search)
 	}
 }
 
+#define SEARCH_GUI_LAZY_SORT		10000	/**< Results sorted per second */
+#define SEARCH_GUI_MAX_SORT_DELAY	30		/**< Max re-sorting delay (s) */
+
+/**
+ * Re-enable sorting after a massive update.
+ *
+ * Re-sorting all the results is costly when there are many of them, and
+ * doing it each time new results are flushed to the tree makes the GUI
+ * unusable on wide searches.  The delay between two re-sortings is thus
+ * made proportional to the amount of results, new results being appended
+ * at the end of the list in the meantime.
+ */
+static void
+search_gui_lazy_sort(struct search *search)
+{
+	time_t now = tm_time();
+	time_delta_t delay;
+
+	delay = search->items / SEARCH_GUI_LAZY_SORT;
+	delay = MIN(delay, SEARCH_GUI_MAX_SORT_DELAY);
+
+	if (0 == delay || delta_time(now, search->last_sort) >= delay) {
+		search->last_sort = now;
+		search->sort_pending = FALSE;
+		search_gui_enable_sort(search);
+	} else {
+		search->sort_pending = TRUE;
+	}
+}
+
 /**
  * Enforce a tri-state sorting.
  */
@@ -1409,7 +1439,7 @@ search_gui_end_massive_update(struct search *search)
 	model = gtk_tree_view_get_model(GTK_TREE_VIEW(search->tree));
 	g_object_thaw_notify(G_OBJECT(model));
 	g_object_thaw_notify(G_OBJECT(search->tree));
-	search_gui_enable_sort(search);
+	search_gui_lazy_sort(search);
 }
 
 /**
@@ -1614,6 +1644,8 @@ search_gui_flush_queue(search_t *search)
 
 		if (stopped)
 			search_gui_end_massive_update(search);
+	} else if (search->sort_pending && !search->frozen) {
+		search_gui_lazy_sort(search);
 	}
 }
 
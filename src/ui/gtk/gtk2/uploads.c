@@ -47,6 +47,7 @@
 #include "lib/atoms.h"
 #include "lib/cstr.h"
 #include "lib/host_addr.h"
+#include "lib/hset.h"
 #include "lib/htable.h"
 #include "lib/iso3166.h"
 #include "lib/misc.h"
@@ -67,6 +68,8 @@ static GtkWidget *button_uploads_clear_completed;
 static htable_t *upload_handles;
 /** list of all *removed* uploads; contains the handles */
 static GSList *sl_removed_uploads;
+/** set of upload handles whose information changed since last update */
+static hset_t *upload_info_updates;
 
 #if GTK_CHECK_VERSION(2,6,0)
 static struct sorting_context uploads_sort;
@@ -155,6 +158,7 @@ upload_removed(gnet_upload_t uh, const gchar *reason)
     /* Invalidate row and remove it from the GUI if autoclear is on */
 	rd = find_upload(uh);
 	g_assert(NULL != rd);
+	hset_remove(upload_info_updates, uint_to_pointer(uh));
 	rd->valid = FALSE;
 	gtk_widget_set_sensitive(button_uploads_clear_completed, TRUE);
 	if (reason != NULL)
@@ -192,16 +196,75 @@ uploads_gui_get_row_data(gnet_upload_t uhandle)
 
 /**
  * Callback: called when upload information was changed by the backend.
- * This updates the upload information in the gui.
+ *
+ * This schedules an update of the upload information in the gui at the
+ * next display update, so that changes are applied in batches.
  */
 static void
 upload_info_changed(gnet_upload_t u)
+{
+	hset_insert(upload_info_updates, uint_to_pointer(u));
+}
+
+/**
+ * Apply queued upload information change -- hash set iterator callback.
+ *
+ * @return TRUE to remove the handle from the set.
+ */
+static bool
+upload_info_update_queued(const void *key, void *unused_udata)
 {
     gnet_upload_info_t *info;
 
-    info = guc_upload_get_info(u);
+	(void) unused_udata;
+
+    info = guc_upload_get_info(pointer_to_uint(key));
     uploads_gui_update_upload_info(info);
     guc_upload_free_info(info);
+
+	return TRUE;
+}
+
+/**
+ * Disable sorting of the uploads, saving the current sort order.
+ *
+ * @return whether sorting was disabled.
+ */
+static bool
+uploads_gui_sort_disable(int *column, GtkSortType *order)
+{
+#if GTK_CHECK_VERSION(2,6,0)
+	GtkTreeSortable *sortable = GTK_TREE_SORTABLE(store_uploads);
+
+	if (
+		gtk_tree_sortable_get_sort_column_id(sortable, column, order) &&
+		GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID != *column
+	) {
+		gtk_tree_sortable_set_sort_column_id(sortable,
+			GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID, *order);
+		return TRUE;
+	}
+#else
+	(void) column;
+	(void) order;
+#endif /* Gtk+ >= 2.6.0 */
+
+	return FALSE;
+}
+
+/**
+ * Restore sorting of the uploads, as saved by uploads_gui_sort_disable().
+ */
+static void
+uploads_gui_sort_restore(int column, GtkSortType order)
+{
+#if GTK_CHECK_VERSION(2,6,0)
+	gtk_tree_sortable_set_sort_column_id(
+		GTK_TREE_SORTABLE(store_uploads), column, order);
+#else
+	(void) column;
+	(void) order;
+#endif /* Gtk+ >= 2.6.0 */
 }
 
 #define COMPARE_FUNC(field) \
@@ -565,6 +628,9 @@ uploads_gui_update_display(time_t now)
 {
    	static gboolean locked = FALSE;
 	remove_row_ctx_t ctx;
+	GtkSortType order;
+	int column;
+	bool sorted;
 
 	ctx.force = FALSE;
 	ctx.now = now;
@@ -574,6 +640,17 @@ uploads_gui_update_display(time_t now)
 	locked = TRUE;
 
 	g_object_freeze_notify(G_OBJECT(treeview_uploads));
+
+	/*
+	 * Changes are applied to the unsorted model, which is then sorted
+	 * once at the end, instead of being re-sorted after each change.
+	 */
+
+	sorted = uploads_gui_sort_disable(&column, &order);
+
+	/* Apply all the information changes since last update. */
+	hset_foreach_remove(upload_info_updates, upload_info_update_queued, NULL);
+
 	/* Remove all rows with `removed' uploads. */
 	G_SLIST_FOREACH_WITH_DATA(sl_removed_uploads, remove_row, &ctx);
 	g_slist_free(sl_removed_uploads);
@@ -581,6 +658,10 @@ uploads_gui_update_display(time_t now)
 
 	/* Update the status column for all active uploads. */
 	htable_foreach(upload_handles, update_row, NULL);
+
+	if (sorted)
+		uploads_gui_sort_restore(column, order);
+
 	g_object_thaw_notify(G_OBJECT(treeview_uploads));
 
 	gtk_widget_set_sensitive(button_uploads_clear_completed,
@@ -709,6 +790,7 @@ uploads_gui_init(void)
 	tree_view_restore_visibility(treeview_uploads, PROP_UPLOADS_COL_VISIBLE);
 
 	upload_handles = htable_create(HASH_KEY_SELF, 0);
+	upload_info_updates = hset_create(HASH_KEY_SELF, 0);
 
     guc_upload_add_upload_added_listener(upload_added);
     guc_upload_add_upload_removed_listener(upload_removed);
@@ -738,6 +820,7 @@ uploads_gui_shutdown(void)
 
 	htable_foreach(upload_handles, free_handle, NULL);
 	htable_free_null(&upload_handles);
+	hset_free_null(&upload_info_updates);
 	G_SLIST_FOREACH(sl_removed_uploads, free_row_data);
 	gm_slist_free_null(&sl_removed_uploads);
 }
@@ -43,6 +43,7 @@
 #include "gtk/gtkcolumnchooser.h"
 #include "gtk/misc.h"
 #include "gtk/search.h"
+#include "gtk/search_spill.h"
 #include "gtk/settings.h"
 #include "gtk/statusbar.h"
 
@@ -972,6 +973,7 @@ search_gui_free_record(record_t *rc)
 
 	g_assert(NULL == rc->results_set);
 
+	search_spill_forget(rc);
 	WFREE_TYPE_NULL(rc->partial);
 	atom_str_free_null(&rc->name);
 	atom_str_free_null(&rc->utf8_name);
@@ -1095,6 +1097,32 @@ search_gui_unref_record(record_t *rc)
 	}
 }
 
+/**
+ * Compute the duplicate detection key of a record.
+ *
+ * The key mixes the content fingerprint computed by the core (from the SHA1,
+ * or from the name and size) with the identity of the servent, so that the
+ * hashing done by the dups table on each probe is a mere field access.
+ *
+ * @param fingerprint	the content fingerprint of the record
+ * @param host			the pre-hashed servent identity of the result set
+ */
+static inline guint64
+search_gui_dup_key(guint64 fingerprint, guint64 host)
+{
+	return fingerprint ^ host;
+}
+
+/**
+ * @return the pre-hashed servent identity of a result set.
+ */
+static guint64
+search_gui_results_set_host(const results_set_t *rs)
+{
+	return (guint64) pointer_hash(rs->guid) << 32 |		/* atom! */
+		host_addr_port_hash(rs->addr, rs->port);
+}
+
 static guint
 search_gui_hash_func(gconstpointer p)
 {
@@ -1102,13 +1130,8 @@ search_gui_hash_func(gconstpointer p)
 
 	record_check(rc);
 
-	/* Must use same fields as search_hash_key_compare() --RAM */
-	return
-		pointer_hash_fast(rc->sha1) ^	/* atom! (may be NULL) */
-		pointer_hash_fast(rc->results_set->guid) ^	/* atom! */
-		(NULL != rc->sha1 ? 0 : string_mix_hash(rc->name)) ^
-		integer_hash_fast(rc->size) ^
-		host_addr_port_hash(rc->results_set->addr, rc->results_set->port);
+	/* Must use same fields as search_gui_hash_key_compare() --RAM */
+	return (guint) rc->dup_key;
 }
 
 static guint
@@ -1119,12 +1142,7 @@ search_gui_hash_func2(gconstpointer p)
 	record_check(rc);
 
 	/* Must use same fields as search_gui_hash_key_compare() --RAM */
-	return
-		pointer_hash2(rc->sha1) ^	/* atom! (may be NULL) */
-		pointer_hash2(rc->results_set->guid) ^	/* atom! */
-		(NULL != rc->sha1 ? 0 : string_hash(rc->name)) ^
-		integer_hash2(rc->size) ^
-		host_addr_port_hash2(rc->results_set->addr, rc->results_set->port);
+	return (guint) (rc->dup_key >> 32);
 }
 
 static gint
@@ -1133,7 +1151,8 @@ search_gui_hash_key_compare(gconstpointer a, gconstpointer b)
 	const record_t *rc1 = a, *rc2 = b;
 
 	/* Must compare same fields as search_gui_hash_func() --RAM */
-	return rc1->size == rc2->size
+	return rc1->dup_key == rc2->dup_key
+		&& rc1->size == rc2->size
 		&& host_addr_equiv(rc1->results_set->addr, rc2->results_set->addr)
 		&& rc1->results_set->port == rc2->results_set->port
 		&& rc1->results_set->guid == rc2->results_set->guid	/* atom! */
@@ -1372,6 +1391,7 @@ search_gui_create_results_set(pslist_t *schl, const gnet_results_set_t *r_set)
 {
     results_set_t *rs;
 	guint ignored;
+	guint64 host;
     pslist_t *sl;
 
     WALLOC(rs);
@@ -1398,6 +1418,8 @@ search_gui_create_results_set(pslist_t *schl, const gnet_results_set_t *r_set)
     rs->records = NULL;
 	rs->proxies = search_gui_proxies_clone(r_set->proxies);
 
+	host = search_gui_results_set_host(rs);
+
 	ignored = 0;
 	PSLIST_FOREACH(r_set->records, sl) {
 		gnet_record_t *grc = sl->data;
@@ -1409,6 +1431,7 @@ search_gui_create_results_set(pslist_t *schl, const gnet_results_set_t *r_set)
 
 			rc = search_gui_create_record(r_set, grc);
     		rc->results_set = rs;
+			rc->dup_key = search_gui_dup_key(grc->fingerprint, host);
 			rs->records = g_slist_prepend(rs->records, rc);
 			rs->num_recs++;
 		}
@@ -1786,6 +1809,8 @@ search_gui_check_alt_locs(record_t *rc)
 	rs = rc->results_set;
 	results_set_check(rs);
 
+	search_spill_restore(rc);
+
 	if (rc->alt_locs) {
 		gint i, n;
 
@@ -3994,6 +4019,7 @@ search_gui_set_details(const record_t *rc)
 
 	search_details_record = deconstify_gpointer(rc);
 	search_gui_ref_record(search_details_record);
+	search_spill_restore(search_details_record);
 
 	search_gui_append_detail(_("Filename"),
 		lazy_utf8_to_ui_string(rc->utf8_name));
@@ -4349,6 +4375,7 @@ search_gui_magnet_add_source(struct magnet_resource *magnet, record_t *record)
 	record_check(record);
 
 	rs = record->results_set;
+	search_spill_restore(record);
 
 	if (!(ST_FIREWALL & rs->status)) {
 		magnet_add_sha1_source(magnet, record->sha1, rs->addr, rs->port,
@@ -4419,12 +4446,55 @@ search_gui_store_searches(void)
 	store_searches_requested = TRUE;
 }
 
+/**
+ * Hash set iterator to spill the cold data of old records.
+ */
+static void
+search_gui_spill_record(const void *key, void *data)
+{
+	record_t *rc = deconstify_pointer(key);
+	const time_t *now = data;
+
+	record_check(rc);
+
+	if (
+		rc->results_set != NULL &&
+		delta_time(*now, rc->results_set->stamp) >
+			(time_delta_t) GUI_PROPERTY(search_spill_age)
+	)
+		search_spill_record(rc);
+}
+
+/**
+ * Move the cold data of old records to disk, when configured to.
+ */
+static void
+search_gui_spill(time_t now)
+{
+	static time_t last_spill;
+	GList *iter;
+
+	if (!GUI_PROPERTY(search_spill_results))
+		return;
+
+	if (delta_time(now, last_spill) < SEARCH_SPILL_PERIOD)
+		return;
+
+	last_spill = now;
+
+	for (iter = list_searches; NULL != iter; iter = g_list_next(iter)) {
+		struct search *search = iter->data;
+		hset_foreach(search->dups, search_gui_spill_record, &now);
+	}
+}
+
 static void
 search_gui_timer(time_t now)
 {
     static time_t last_update;
 
     search_gui_flush(now, FALSE);
+	search_gui_spill(now);
 
 	if (search_gui_visible && delta_time(last_update, now)) {
 		GList *iter;
@@ -4752,6 +4822,7 @@ search_gui_common_shutdown(void)
 
     gm_list_free_null(&list_search_history);
 	htable_free_null(&ht_searches);
+	search_spill_close();
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -57,8 +57,10 @@ typedef struct search {
 	uint	clicked:1;
 	uint	sort:1;
 	uint	frozen:1;
+	uint	sort_pending:1;		/**< Re-sorting deferred */
 
 	struct sorting_context sorting;
+	time_t last_sort;			/**< When results were last re-sorted */
 
 	/*
 	 * Cached attributes.
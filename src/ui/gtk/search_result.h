@@ -109,8 +109,10 @@ typedef struct record {
 	const char *path;			/**< Optional path (atom) */
 	struct precord *partial;	/**< Optional: partial record information */
 	struct gnet_host_vec *alt_locs;	/**< Optional alternate locations */
+	filesize_t spilled;			/**< Spill store offset + 1, 0 if in core */
 	filesize_t size;			/**< Size of file, in bytes */
 	time_t  create_time;		/**< Create Time of file; zero if unknown */
+	guint64 dup_key;			/**< Duplicate detection key, pre-hashed */
 	guint32 file_index;			/**< Index for GET command */
     guint32 flags;              /**< same flags as in gnet_record_t */
 } record_t;
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup gtk
+ * @file
+ *
+ * Disk spilling of cold search result data.
+ *
+ * Searches left open for days accumulate many records, and the bulkiest
+ * parts of these records, the XML metadata and the alternate locations,
+ * are only needed when the details of a record are displayed or when a
+ * download is started from it.
+ *
+ * For old records, these parts are appended to a store file and released
+ * from memory, the record only keeping the offset of its data in the file.
+ * The store is memory-mapped for reading and data are brought back in
+ * memory on demand, at which time they leave the store for good.
+ *
+ * The store is append-only: it is truncated when it no longer holds data
+ * for any record, and removed on shutdown.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#include "gui.h"
+
+#include "gtk/search_spill.h"
+#include "gtk/settings.h"
+
+#include "lib/atoms.h"
+#include "lib/bstr.h"
+#include "lib/compat_pio.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
+#include "lib/file.h"
+#include "lib/gnet_host.h"
+#include "lib/halloc.h"
+#include "lib/path.h"
+#include "lib/pmsg.h"
+#include "lib/stringify.h"
+#include "lib/vmm.h"
+
+#include "lib/override.h"	/* Must be the last header included */
+
+#define SEARCH_SPILL_VERSION	1		/**< Serialization version number */
+#define SEARCH_SPILL_HOST_SIZE	19		/**< Max serialized host size */
+
+static const char search_spill_file[] = "search_spill";
+
+static char *spill_path;		/**< Path of the store, NULL if not created */
+static int spill_fd = -1;		/**< Opened store, -1 if not opened */
+static filesize_t spill_size;	/**< Size of the store, where we append */
+static size_t spill_records;	/**< Amount of records with data in store */
+static gboolean spill_failed;	/**< Set when we cannot use the store */
+
+#ifdef HAS_MMAP
+static void *spill_base;		/**< Read-only mapping of the store */
+static size_t spill_mapped;		/**< Size of the mapping */
+#endif	/* HAS_MMAP */
+
+/**
+ * Open the store, creating it the first time it is needed.
+ *
+ * @return TRUE if the store can be used.
+ */
+static gboolean
+search_spill_open(void)
+{
+	if (spill_failed)
+		return FALSE;
+
+	if G_LIKELY(spill_fd >= 0)
+		return TRUE;
+
+	if (NULL == spill_path) {
+		spill_path =
+			make_pathname(settings_gui_config_dir(), search_spill_file);
+	}
+
+	spill_fd = file_create(spill_path, O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+
+	if (spill_fd < 0) {
+		spill_failed = TRUE;
+		return FALSE;
+	}
+
+	spill_size = 0;
+	return TRUE;
+}
+
+/**
+ * Discard the read-only mapping of the store.
+ */
+static void
+search_spill_unmap(void)
+{
+#ifdef HAS_MMAP
+	if (spill_base != NULL) {
+		vmm_munmap(spill_base, spill_mapped);
+		spill_base = NULL;
+		spill_mapped = 0;
+	}
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * Record that the record no longer has data in the store.
+ *
+ * When the store is no longer used by any record, truncate it so that
+ * it does not grow forever.
+ */
+static void
+search_spill_release(record_t *rc)
+{
+	g_assert(spill_records != 0);
+
+	rc->spilled = 0;
+
+	if (0 != --spill_records || spill_fd < 0)
+		return;
+
+	search_spill_unmap();
+
+	if (-1 == ftruncate(spill_fd, 0)) {
+		g_warning("%s(): cannot truncate \"%s\": %m", G_STRFUNC, spill_path);
+	} else {
+		spill_size = 0;
+	}
+}
+
+/**
+ * Read data from the store.
+ *
+ * @return TRUE if all the requested data could be read.
+ */
+static gboolean
+search_spill_fetch(filesize_t offset, void *buf, size_t len)
+{
+	if (offset + len > spill_size)
+		return FALSE;
+
+#ifdef HAS_MMAP
+	/*
+	 * The mapping covers the whole store: remap it when the store grew
+	 * since we last mapped it.
+	 */
+
+	if (offset + len > spill_mapped) {
+		void *p;
+
+		search_spill_unmap();
+
+		p = vmm_mmap(NULL, spill_size, PROT_READ, MAP_SHARED, spill_fd, 0);
+		if (MAP_FAILED == p) {
+			g_warning("%s(): cannot map \"%s\": %m", G_STRFUNC, spill_path);
+			return FALSE;
+		}
+
+		spill_base = p;
+		spill_mapped = spill_size;
+	}
+
+	memcpy(buf, ptr_add_offset(spill_base, offset), len);
+	return TRUE;
+#else
+	return (ssize_t) len == compat_pread(spill_fd, buf, len, offset);
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * Move the XML metadata and alternate locations of a record to the store.
+ *
+ * @return TRUE if the record was spilled.
+ */
+gboolean
+search_spill_record(record_t *rc)
+{
+	pmsg_t *mb;
+	size_t len, xml_len, i, n;
+	ssize_t r;
+
+	record_check(rc);
+
+	if (0 != rc->spilled || (NULL == rc->xml && NULL == rc->alt_locs))
+		return FALSE;
+
+	if (!search_spill_open())
+		return FALSE;
+
+	xml_len = NULL == rc->xml ? 0 : vstrlen(rc->xml);
+	n = NULL == rc->alt_locs ? 0 : gnet_host_vec_count(rc->alt_locs);
+	n = MIN(n, MAX_INT_VAL(uint16));
+	len = 4 + 1 + 10 + xml_len + 2 + n * SEARCH_SPILL_HOST_SIZE;
+
+	if (len > MAX_INT_VAL(int))
+		return FALSE;
+
+	/*
+	 * Entries are made of their length, followed by the serialized data.
+	 */
+
+	mb = pmsg_new(PMSG_P_DATA, NULL, len);
+	pmsg_write_be32(mb, 0);		/* Length, patched below */
+	pmsg_write_u8(mb, SEARCH_SPILL_VERSION);
+	pmsg_write_string(mb, EMPTY_STRING(rc->xml), xml_len);
+	pmsg_write_be16(mb, n);
+
+	for (i = 0; i < n; i++) {
+		gnet_host_t host = gnet_host_vec_get(rc->alt_locs, i);
+
+		pmsg_write_ipv4_or_ipv6_addr(mb, gnet_host_get_addr(&host));
+		pmsg_write_be16(mb, gnet_host_get_port(&host));
+	}
+
+	len = pmsg_size(mb);
+	poke_be32(pmsg_start(mb), len - 4);
+
+	r = compat_pwrite(spill_fd, pmsg_start(mb), len, spill_size);
+	pmsg_free(mb);
+
+	if ((ssize_t) len != r) {
+		if (-1 == r) {
+			g_warning("%s(): cannot write to \"%s\": %m",
+				G_STRFUNC, spill_path);
+		} else {
+			g_warning("%s(): partial write to \"%s\"", G_STRFUNC, spill_path);
+		}
+		spill_failed = TRUE;	/* Stop spilling, keep data we have */
+		return FALSE;
+	}
+
+	rc->spilled = spill_size + 1;
+	spill_size += len;
+	spill_records++;
+
+	atom_str_free_null(&rc->xml);
+	gnet_host_vec_free(&rc->alt_locs);
+
+	return TRUE;
+}
+
+/**
+ * Bring back in memory the data of a record that were spilled to disk.
+ */
+void
+search_spill_restore(record_t *rc)
+{
+	filesize_t offset;
+	char lenbuf[4];
+	uint32 len;
+	char *buf;
+	bstr_t *bs;
+	uint8 version;
+	char *xml;
+	size_t xml_len;
+	uint16 i, n;
+
+	record_check(rc);
+
+	if (0 == rc->spilled)
+		return;
+
+	offset = rc->spilled - 1;
+
+	if (!search_spill_fetch(offset, lenbuf, sizeof lenbuf)) {
+		g_warning("%s(): cannot read entry length at offset %s in \"%s\"",
+			G_STRFUNC, filesize_to_string(offset), spill_path);
+		search_spill_release(rc);
+		return;
+	}
+
+	len = peek_be32(lenbuf);
+	buf = halloc(len);
+
+	if (!search_spill_fetch(offset + sizeof lenbuf, buf, len)) {
+		g_warning("%s(): cannot read %u-byte entry at offset %s in \"%s\"",
+			G_STRFUNC, len, filesize_to_string(offset), spill_path);
+		goto done;
+	}
+
+	bs = bstr_open(buf, len, BSTR_F_ERROR);
+
+	if (!bstr_read_u8(bs, &version) || version > SEARCH_SPILL_VERSION)
+		goto error;
+
+	if (!bstr_read_string(bs, &xml_len, &xml))
+		goto error;
+
+	if (0 != xml_len)
+		rc->xml = atom_str_get(xml);
+	HFREE_NULL(xml);
+
+	if (!bstr_read_be16(bs, &n))
+		goto error;
+
+	if (n != 0)
+		rc->alt_locs = gnet_host_vec_alloc();
+
+	for (i = 0; i < n; i++) {
+		host_addr_t addr;
+		uint16 port;
+
+		if (
+			!bstr_read_packed_ipv4_or_ipv6_addr(bs, &addr) ||
+			!bstr_read_be16(bs, &port)
+		)
+			goto error;
+
+		gnet_host_vec_add(rc->alt_locs, addr, port);
+	}
+
+	bstr_free(&bs);
+	goto done;
+
+error:
+	g_warning("%s(): corrupted entry at offset %s in \"%s\": %s",
+		G_STRFUNC, filesize_to_string(offset), spill_path,
+		bstr_has_error(bs) ? bstr_error(bs) : "unknown version");
+	bstr_free(&bs);
+
+	/* FALL THROUGH */
+
+done:
+	HFREE_NULL(buf);
+	search_spill_release(rc);
+}
+
+/**
+ * Forget about the spilled data of a record being freed.
+ */
+void
+search_spill_forget(record_t *rc)
+{
+	record_check(rc);
+
+	if (0 != rc->spilled)
+		search_spill_release(rc);
+}
+
+/**
+ * Close and remove the store, at shutdown time.
+ */
+void
+search_spill_close(void)
+{
+	search_spill_unmap();
+
+	if (spill_fd >= 0) {
+		fd_forget_and_close(&spill_fd);
+		if (-1 == unlink(spill_path))
+			g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, spill_path);
+	}
+
+	HFREE_NULL(spill_path);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
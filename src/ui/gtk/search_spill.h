@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2026 Raphael Manfredi
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup gtk
+ * @file
+ *
+ * Disk spilling of cold search result data.
+ *
+ * @author Raphael Manfredi
+ * @date 2026
+ */
+
+#ifndef _gtk_search_spill_h_
+#define _gtk_search_spill_h_
+
+#include "gtk/search_result.h"
+
+#define SEARCH_SPILL_PERIOD	300		/**< secs, between two spilling passes */
+
+/*
+ * Public interface.
+ */
+
+gboolean search_spill_record(record_t *rc);
+void search_spill_restore(record_t *rc);
+void search_spill_forget(record_t *rc);
+
+void search_spill_close(void);
+
+#endif	/* _gtk_search_spill_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -5217,7 +5217,7 @@ static prop_map_t property_map[] = {
         update_byte_size_entry,
         TRUE,
         "entry_ul_byte_count",
-        FREQ_SECS, 1
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5225,7 +5225,7 @@ static prop_map_t property_map[] = {
         update_byte_size_entry,
         TRUE,
         "entry_dl_byte_count",
-        FREQ_SECS, 1
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5233,7 +5233,7 @@ static prop_map_t property_map[] = {
         update_label,
         TRUE,
         "label_dl_queue_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5241,7 +5241,7 @@ static prop_map_t property_map[] = {
         update_label,
         TRUE,
         "label_dl_qalive_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5249,7 +5249,7 @@ static prop_map_t property_map[] = {
         update_label,
         TRUE,
         "label_dl_pqueued_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5257,7 +5257,7 @@ static prop_map_t property_map[] = {
         dl_running_count_changed,
         TRUE,
         "label_dl_running_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5265,7 +5265,7 @@ static prop_map_t property_map[] = {
         dl_active_count_changed,
         TRUE,
         "label_dl_active_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5273,7 +5273,7 @@ static prop_map_t property_map[] = {
         dl_aqueued_count_changed,
         TRUE,
         "label_dl_aqueued_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5281,7 +5281,7 @@ static prop_map_t property_map[] = {
         update_label,
         TRUE,
         "label_fi_all_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_main_window,
@@ -5289,7 +5289,7 @@ static prop_map_t property_map[] = {
         update_label,
         TRUE,
         "label_fi_with_source_count",
-        FREQ_UPDATES, 0
+        FREQ_BATCHED, 0
     ),
     PROP_ENTRY(
         gui_dlg_prefs,
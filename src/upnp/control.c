@@ -627,13 +627,18 @@ upnp_ctrl_launch(const upnp_service_t *usd, const char *action,
 	 * although it mentions that headers are case-insensitive names.  Hence,
 	 * force all-caps header names.
 	 *
+	 * Persistent connections are allowed so that the series of control
+	 * requests we issue when (re)publishing mappings can be sent over the
+	 * same connection to the device.
+	 *
 	 * If the SOAP RPC cannot be launched (payload too large), the XML tree
 	 * built above was freed anyway.
 	 */
 
 	{
 		char action_uri[256];
-		uint32 options = SOAP_RPC_O_MAN_RETRY | SOAP_RPC_O_ALL_CAPS;
+		uint32 options = SOAP_RPC_O_MAN_RETRY | SOAP_RPC_O_ALL_CAPS |
+			SOAP_RPC_O_KEEP_ALIVE;
 
 		/*
 		 * Grab our local IP address if it is unknown so far.
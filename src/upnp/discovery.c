@@ -113,6 +113,8 @@ struct upnp_dscv {
 	const char *desc_url;		/**< Description URL (atom) */
 	struct http_async *ha;		/**< Asynchronous HTTP request in progress */
 	pslist_t *services;			/**< List of upnp_service_t discovered */
+	char *desc;					/**< XML description (halloc) */
+	size_t desc_len;			/**< Length of XML description */
 	unsigned major;				/**< UPnP architecture major */
 	unsigned minor;				/**< UPnP architecture minor */
 };
@@ -198,6 +200,7 @@ upnp_dscv_free(struct upnp_dscv *ud)
 
 	atom_str_free_null(&ud->desc_url);
 	upnp_service_pslist_free_null(&ud->services);
+	HFREE_NULL(ud->desc);
 	if (ud->ha != NULL)
 		http_async_cancel(ud->ha);
 
@@ -269,6 +272,15 @@ upnp_dscv_updated(struct upnp_mcb *mcb)
 
 			devlist = pslist_prepend(devlist, udev);
 
+			/*
+			 * The XML description is handed over to the device, so that
+			 * it can be cached if the device is selected.
+			 */
+
+			udev->desc = ud->desc;
+			udev->desc_len = ud->desc_len;
+			ud->desc = NULL;
+
 			/*
 			 * The service list is shallow-cloned by the IGD device we
 			 * created above, so we must only free the list container,
@@ -758,7 +770,9 @@ upnp_dscv_probed(char *data, size_t len, int code, header_t *header, void *arg)
 	 */
 
 	ud->services = upnp_service_extract(data, len, ud->desc_url);
-	HFREE_NULL(data);
+	ud->desc = data;			/* Kept for caching the device description */
+	ud->desc_len = len;
+	data = NULL;
 
 	/*
 	 * If the services do not contain UPNP_SVC_WAN_CIF and at least one
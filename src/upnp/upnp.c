@@ -59,9 +59,13 @@
 
 #include "lib/atoms.h"
 #include "lib/cq.h"
+#include "lib/file.h"
+#include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/host_addr.h"
 #include "lib/htable.h"
+#include "lib/misc.h"			/* For is_strprefix() */
+#include "lib/parse.h"
 #include "lib/product.h"		/* For product_get_build() */
 #include "lib/stacktrace.h"
 #include "lib/str.h"
@@ -76,6 +80,7 @@
 #define UPNP_MAPPING_CAUTION	120		/**< 2 minutes */
 #define UPNP_PUBLISH_RETRY		2		/**< 2 seconds */
 #define UPNP_REDISCOVER			3600	/**< 1 hour (seconds) */
+#define UPNP_IGD_CACHE_MAX		65536	/**< Max cached description size */
 
 #define UPNP_MONITOR_DELAY_MS	(UPNP_MONITOR_DELAY * 1000)
 #define UPNP_PUBLISH_RETRY_MS	(UPNP_PUBLISH_RETRY * 1000)
@@ -89,11 +94,15 @@
 static const char UPNP_GET_TOTAL_RX_PACKETS[]	= "GetTotalPacketsReceived";
 static const char UPNP_GET_STATUS_INFO[]		= "GetStatusInfo";
 
+static const char UPNP_IGD_CACHE[]	= "upnp_igd";
+static const char UPNP_IGD_WHAT[]	= "UPnP gateway description";
+
 /**
  * The local Internet Gateway Device, for UPnP.
  */
 static struct {
 	upnp_device_t *dev;			/**< Our Internet Gateway Device */
+	upnp_device_t *cached;		/**< Cached device being revalidated */
 	upnp_ctrl_t *monitor;		/**< Regular monitoring event */
 	uint32 rcvd_pkts;			/**< Amount of received packets */
 	unsigned delete_pending;	/**< Amount of pending mapping deletes */
@@ -153,6 +162,7 @@ static host_addr_t upnp_local_addr;	/**< Computed local IP address */
 static const char UPNP_CONN_IP_ROUTED[]	= "IP_Routed";
 
 static void upnp_map_publish_all(void);
+static void upnp_launch_discovery(void);
 
 /**
  * Increase reference count of an UPnP mapping object.
@@ -362,6 +372,7 @@ upnp_dev_free(upnp_device_t *ud)
 
 	atom_str_free_null(&ud->desc_url);
 	upnp_service_pslist_free_null(&ud->services);
+	HFREE_NULL(ud->desc);
 	WFREE0(ud);
 }
 
@@ -379,6 +390,133 @@ upnp_dev_free_null(upnp_device_t **ud_ptr)
 	}
 }
 
+/**
+ * Save the description of the gateway device we use, so that we can
+ * quickly start using it again after a restart.
+ */
+static void
+upnp_igd_cache_save(const upnp_device_t *ud)
+{
+	file_path_t fp;
+	FILE *f;
+
+	upnp_device_check(ud);
+
+	if (NULL == ud->desc || ud->desc_len > UPNP_IGD_CACHE_MAX)
+		return;
+
+	file_path_set(&fp, settings_config_dir(), UPNP_IGD_CACHE);
+	f = file_config_open_write(UPNP_IGD_WHAT, &fp);
+	if (NULL == f)
+		return;
+
+	fprintf(f, "url %s\n", ud->desc_url);
+	fprintf(f, "upnp %u.%u\n", ud->major, ud->minor);
+	fprintf(f, "length %zu\n\n", ud->desc_len);
+
+	if (1 != fwrite(ud->desc, ud->desc_len, 1, f)) {
+		g_warning("UPNP cannot write %s: %m", UPNP_IGD_WHAT);
+		fclose(f);
+		return;
+	}
+
+	file_config_close(f, &fp);
+}
+
+/**
+ * Load the description of the gateway device we used last time.
+ *
+ * @return the cached device, with its WAN IP unknown, NULL if none.
+ */
+static upnp_device_t *
+upnp_igd_cache_load(void)
+{
+	file_path_t fp[1];
+	FILE *f;
+	char line[1024];
+	const char *url = NULL;
+	char *desc = NULL;
+	unsigned major = 1, minor = 0;
+	size_t len = 0;
+	pslist_t *services = NULL;
+	upnp_device_t *ud = NULL;
+
+	file_path_set(fp, settings_config_dir(), UPNP_IGD_CACHE);
+	f = file_config_open_read_norename(UPNP_IGD_WHAT, fp, N_ITEMS(fp));
+	if (NULL == f)
+		return NULL;
+
+	/*
+	 * The header lines are followed by an empty line, then by the XML
+	 * description of the device.
+	 */
+
+	while (fgets(ARYLEN(line), f)) {
+		const char *v;
+		int error;
+
+		if ('\n' == line[0])
+			break;
+
+		strchomp(line, 0);
+
+		if (NULL != (v = is_strprefix(line, "url "))) {
+			atom_str_free_null(&url);
+			url = atom_str_get(v);
+		} else if (NULL != (v = is_strprefix(line, "upnp "))) {
+			if (0 != parse_major_minor(v, NULL, &major, &minor))
+				goto done;
+		} else if (NULL != (v = is_strprefix(line, "length "))) {
+			len = parse_size(v, NULL, 10, &error);
+			if (error || 0 == len || len > UPNP_IGD_CACHE_MAX)
+				goto done;
+		}
+	}
+
+	if (NULL == url || 0 == len)
+		goto done;
+
+	desc = halloc(len);
+	if (1 != fread(desc, len, 1, f))
+		goto done;
+
+	/*
+	 * Make sure the device still offers the services we need, as we would
+	 * have checked during discovery.
+	 */
+
+	services = upnp_service_extract(desc, len, url);
+
+	if (
+		NULL == upnp_service_pslist_find(services, UPNP_SVC_WAN_CIF) ||
+		NULL == upnp_service_get_wan_connection(services)
+	) {
+		upnp_service_pslist_free_null(&services);
+		goto done;
+	}
+
+	ud = upnp_dev_igd_make(url, services, zero_host_addr, major, minor);
+	pslist_free_null(&services);		/* Services now owned by device */
+	ud->desc = desc;
+	ud->desc_len = len;
+	desc = NULL;
+
+done:
+	fclose(f);
+	atom_str_free_null(&url);
+	HFREE_NULL(desc);
+
+	if (GNET_PROPERTY(upnp_debug) > 1) {
+		if (ud != NULL) {
+			g_debug("UPNP loaded cached device \"%s\"", ud->desc_url);
+		} else {
+			g_debug("UPNP ignoring invalid %s", UPNP_IGD_WHAT);
+		}
+	}
+
+	return ud;
+}
+
 /**
  * Record the gateway device to whom we need to speak.
  */
@@ -387,6 +525,8 @@ upnp_record_igd(upnp_device_t *ud)
 {
 	upnp_device_check(ud);
 
+	upnp_igd_cache_save(ud);
+
 	upnp_dev_free_null(&igd.dev);
 	igd.rcvd_pkts = 0;
 	igd.dev = ud;
@@ -608,6 +748,79 @@ upnp_discover:
 	upnp_discover(UPNP_DISCOVERY_TIMEOUT, upnp_discovered, NULL);
 }
 
+/**
+ * Completion callback for the revalidation of the cached IGD.
+ *
+ * @param code		UPnP error code, 0 for OK
+ * @param value		returned value structure
+ * @param size		size of structure, for assertions
+ * @param arg		user-supplied callback argument
+ */
+static void
+upnp_cached_igd_callback(int code, void *value, size_t size, void *unused_arg)
+{
+	struct upnp_GetExternalIPAddress *ret = value;
+	upnp_device_t *ud = igd.cached;
+
+	(void) unused_arg;
+
+	g_assert(NULL == value || size == sizeof *ret);
+
+	igd.monitor = NULL;		/* Mark request completed */
+	igd.cached = NULL;
+
+	if (NULL == ud)
+		return;
+
+	if (ret != NULL && host_addr_is_routable(ret->external_ip)) {
+		igd.discovery_done = TRUE;
+		ud->u.igd.wan_ip = ret->external_ip;
+		upnp_check_new_wan_addr(ret->external_ip);
+		upnp_record_igd(ud);
+		return;
+	}
+
+	if (GNET_PROPERTY(upnp_debug)) {
+		g_message("UPNP cached device \"%s\" is gone (error %d => \"%s\")",
+			ud->desc_url, code, upnp_strerror(code));
+	}
+
+	upnp_dev_free(ud);
+	upnp_launch_discovery();
+}
+
+/**
+ * Revalidate the IGD we were using before we were restarted, by simply
+ * asking for its external IP address.
+ *
+ * This is much quicker than running a full discovery, and lets us publish
+ * our port mappings, hence become reachable again, sooner.
+ *
+ * @return TRUE if revalidation was launched.
+ */
+static bool
+upnp_igd_revalidate(void)
+{
+	upnp_device_t *ud;
+	upnp_service_t *usd;
+
+	ud = upnp_igd_cache_load();
+	if (NULL == ud)
+		return FALSE;
+
+	usd = upnp_service_get_wan_connection(ud->services);
+	igd.cached = ud;
+	igd.monitor = upnp_ctrl_GetExternalIPAddress(usd,
+		upnp_cached_igd_callback, NULL);
+
+	if (NULL == igd.monitor) {
+		upnp_dev_free_null(&igd.cached);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /**
  * Launch a NAT-PMP and UPnP discovery.
  */
@@ -1766,6 +1979,14 @@ upnp_init(void)
 void
 upnp_post_init(void)
 {
+	/*
+	 * When we were using an IGD before the restart, first check whether
+	 * it is still there before launching a full discovery.
+	 */
+
+	if (GNET_PROPERTY(enable_upnp) && upnp_igd_revalidate())
+		return;
+
 	upnp_launch_discovery();		/* NAT-PMP and UPnP discovery */
 }
 
@@ -1801,6 +2022,7 @@ upnp_close(void)
 	upnp_dev_free_null(&igd.dev);
 	natpmp_free_null(&gw.gateway);
 	upnp_ctrl_cancel_null(&igd.monitor, FALSE);
+	upnp_dev_free_null(&igd.cached);
 	htable_foreach_remove(upnp_mappings, upnp_free_mapping_kv, NULL);
 	htable_free_null(&upnp_mappings);
 }
@@ -94,6 +94,8 @@ typedef struct upnp_device {
 	} u;
 	unsigned major;					/**< UPnP architecture major */
 	unsigned minor;					/**< UPnP architecture minor */
+	char *desc;						/**< XML description (halloc), or NULL */
+	size_t desc_len;				/**< Length of XML description */
 } upnp_device_t;
 
 static inline void